@@ -8,6 +8,7 @@
 
 #include "aes128.h"
 
+#include "../lib/cpu.h"
 #include "../lib/rijndael-alg-fst.h"
 #include "../lib/logger.h"
 
@@ -24,18 +25,9 @@
 
 #if defined(__x86_64__)
 #define AES_HW_NAME "AES-NI"
+#define AES_HW_FEATURE CPU_AESNI
 
 #include <wmmintrin.h>
-#include <cpuid.h>
-
-static bool
-aes128_hw_supported(void)
-{
-	static const uint32_t flag_cpuid_ecx_aesni = 0x02000000;
-	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
-	__cpuid(1, eax, ebx, ecx, edx);
-	return (ecx & flag_cpuid_ecx_aesni) != 0;
-}
 
 #if defined(__clang__)
 #pragma clang attribute push(__attribute__((target("sse2,aes"))), apply_to = function)
@@ -94,6 +86,30 @@ aes128_hw_enc_block(struct aes128_hw_ctx const *ctx, uint8_t const *pt, uint8_t
 	_mm_storeu_si128((__m128i *)ct, block);
 }
 
+// Encrypt AES128_HW_LANES independent blocks with their rounds interleaved,
+// so the aesenc latency of one block is hidden behind the others.
+#define AES128_HW_LANES 8
+
+static void
+aes128_hw_enc_lanes(struct aes128_hw_ctx const *ctx, uint8_t const *pt, uint8_t *ct)
+{
+	__m128i const *rk = ctx->rk;
+	__m128i block[AES128_HW_LANES];
+	for (int j = 0; j < AES128_HW_LANES; j++) {
+		block[j] = _mm_loadu_si128((__m128i const *)(pt + j * AES128_BLOCK_BYTES));
+		block[j] = _mm_xor_si128(block[j], rk[0]);
+	}
+	for (int r = 1; r < AES128_ROUNDS; r++) {
+		for (int j = 0; j < AES128_HW_LANES; j++) {
+			block[j] = _mm_aesenc_si128(block[j], rk[r]);
+		}
+	}
+	for (int j = 0; j < AES128_HW_LANES; j++) {
+		block[j] = _mm_aesenclast_si128(block[j], rk[AES128_ROUNDS]);
+		_mm_storeu_si128((__m128i *)(ct + j * AES128_BLOCK_BYTES), block[j]);
+	}
+}
+
 #if defined(__clang__)
 #pragma clang attribute pop
 #elif defined(__GNUC__)
@@ -102,6 +118,7 @@ aes128_hw_enc_block(struct aes128_hw_ctx const *ctx, uint8_t const *pt, uint8_t
 
 #elif defined(__aarch64__)
 #define AES_HW_NAME "ARMv8 CE"
+#define AES_HW_FEATURE CPU_ARM_AES
 
 #ifdef __ARM_ACLE
 #include <arm_acle.h>
@@ -110,53 +127,6 @@ aes128_hw_enc_block(struct aes128_hw_ctx const *ctx, uint8_t const *pt, uint8_t
 #include <arm_neon.h>
 #endif
 
-#if defined(__APPLE__)
-#include <sys/types.h>
-#include <sys/sysctl.h>
-#elif defined(__FreeBSD__)
-#include <sys/auxv.h>
-#ifndef HWCAP_NEON
-#define HWCAP_NEON 0x00001000
-#endif
-#ifndef HWCAP2_AES
-#define HWCAP2_AES 0x00000001
-#endif
-#elif defined(__linux__)
-#include <sys/auxv.h>
-#ifndef HWCAP_NEON
-#define HWCAP_NEON 0x00000010
-#endif
-#ifndef HWCAP_AES
-#define HWCAP_AES 0x00001000
-#endif
-#else
-#warning "Runtime detection of AES hardware acceleration not implemented for platform"
-#endif
-
-static bool
-aes128_hw_supported(void)
-{
-#if defined(__APPLE__)
-	int value = 0;
-	size_t value_len = sizeof(value);
-	if (sysctlbyname("hw.optional.arm.FEAT_AES", &value, &value_len, NULL, 0) == -1) {
-		return false;
-	}
-	assert(value_len == sizeof(value));
-	return (value != 0);
-#elif defined(__FreeBSD__)
-	unsigned long hwcap = 0, hwcap2 = 0;
-	elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap));
-	elf_aux_info(AT_HWCAP2, &hwcap2, sizeof(hwcap2));
-	return ((hwcap & HWCAP_NEON) && (hwcap2 & HWCAP2_AES));
-#elif defined(__linux__)
-	unsigned long hwcap = getauxval(AT_HWCAP);
-	return ((hwcap & HWCAP_NEON) && (hwcap & HWCAP_AES));
-#else
-	return true;
-#endif
-}
-
 #if defined(__clang__)
 #pragma clang attribute push(__attribute__((target("aes"))), apply_to = function)
 #elif defined(__GNUC__)
@@ -233,6 +203,31 @@ aes128_hw_enc_block(struct aes128_hw_ctx const *ctx, uint8_t const *pt, uint8_t
 	vst1q_u8(ct, block);
 }
 
+// Encrypt AES128_HW_LANES independent blocks with their rounds interleaved,
+// so the aese/aesmc latency of one block is hidden behind the others.
+#define AES128_HW_LANES 4
+
+static void
+aes128_hw_enc_lanes(struct aes128_hw_ctx const *ctx, uint8_t const *pt, uint8_t *ct)
+{
+	uint8x16_t block[AES128_HW_LANES];
+	for (int j = 0; j < AES128_HW_LANES; j++) {
+		block[j] = vld1q_u8(pt + j * AES128_BLOCK_BYTES);
+	}
+	for (int r = 0; r < AES128_ROUNDS - 1; r++) {
+		uint8x16_t rk = vld1q_u8(ctx->rk[r]);
+		for (int j = 0; j < AES128_HW_LANES; j++) {
+			block[j] = vaesmcq_u8(vaeseq_u8(block[j], rk));
+		}
+	}
+	uint8x16_t rk9 = vld1q_u8(ctx->rk[AES128_ROUNDS - 1]);
+	uint8x16_t rk10 = vld1q_u8(ctx->rk[AES128_ROUNDS]);
+	for (int j = 0; j < AES128_HW_LANES; j++) {
+		block[j] = veorq_u8(vaeseq_u8(block[j], rk9), rk10);
+		vst1q_u8(ct + j * AES128_BLOCK_BYTES, block[j]);
+	}
+}
+
 #if defined(__clang__)
 #pragma clang attribute pop
 #elif defined(__GNUC__)
@@ -265,7 +260,7 @@ static void
 aes128_init_once(void)
 {
 #ifdef AES_HW
-	use_hw = aes128_hw_supported();
+	use_hw = (cpu_features() & AES_HW_FEATURE) != 0;
 	if (use_hw) {
 		log_debug("aes128", "AES hardware acceleration available, using " AES_HW_NAME);
 	} else {
@@ -276,6 +271,25 @@ aes128_init_once(void)
 #endif
 }
 
+int aes128_hw_available(void)
+{
+	pthread_once(&aes128_inited, aes128_init_once);
+#ifdef AES_HW
+	return use_hw;
+#else
+	return 0;
+#endif
+}
+
+const char *aes128_impl(void)
+{
+#ifdef AES_HW
+	return aes128_hw_available() ? AES_HW_NAME : "software";
+#else
+	return "software";
+#endif
+}
+
 aes128_ctx_t *
 aes128_init(uint8_t const *key)
 {
@@ -309,6 +323,26 @@ void aes128_encrypt_block(aes128_ctx_t *ctx, uint8_t const *pt, uint8_t *ct)
 	rijndaelEncrypt(ctx->u.sw.rk, AES128_ROUNDS, pt, ct);
 }
 
+void aes128_encrypt_blocks(aes128_ctx_t *ctx, uint8_t const *pt, uint8_t *ct,
+			   size_t n)
+{
+#ifdef AES_HW
+	if (use_hw) {
+		for (; n >= AES128_HW_LANES; n -= AES128_HW_LANES) {
+			aes128_hw_enc_lanes(&ctx->u.hw, pt, ct);
+			pt += AES128_HW_LANES * AES128_BLOCK_BYTES;
+			ct += AES128_HW_LANES * AES128_BLOCK_BYTES;
+		}
+	}
+#endif
+
+	for (; n > 0; n--) {
+		aes128_encrypt_block(ctx, pt, ct);
+		pt += AES128_BLOCK_BYTES;
+		ct += AES128_BLOCK_BYTES;
+	}
+}
+
 void aes128_fini(aes128_ctx_t *ctx)
 {
 	free(ctx);
@@ -326,9 +360,27 @@ void aes128_selftest(void)
 
 	aes128_ctx_t *ctx = aes128_init(key);
 	aes128_encrypt_block(ctx, pt, actual_ct);
-	aes128_fini(ctx);
 
 	if (memcmp(actual_ct, expected_ct, AES128_BLOCK_BYTES) != 0) {
 		log_fatal("aes128", "AES self-test with NIST test vector failed");
 	}
+
+	// The multi-block path must agree with the single-block one, including
+	// for the tail that does not fill a full set of interleaved lanes.
+	uint8_t blocks[11][AES128_BLOCK_BYTES];
+	for (size_t i = 0; i < 11; i++) {
+		memcpy(blocks[i], pt, AES128_BLOCK_BYTES);
+		blocks[i][0] ^= (uint8_t)i;
+	}
+	aes128_encrypt_blocks(ctx, (uint8_t *)blocks, (uint8_t *)blocks, 11);
+	for (size_t i = 0; i < 11; i++) {
+		uint8_t block[AES128_BLOCK_BYTES];
+		memcpy(block, pt, AES128_BLOCK_BYTES);
+		block[0] ^= (uint8_t)i;
+		aes128_encrypt_block(ctx, block, block);
+		if (memcmp(block, blocks[i], AES128_BLOCK_BYTES) != 0) {
+			log_fatal("aes128", "AES multi-block self-test failed");
+		}
+	}
+	aes128_fini(ctx);
 }
@@ -9,6 +9,7 @@
 #ifndef ZMAP_AES_H
 #define ZMAP_AES_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define AES128_KEY_BYTES 16
@@ -17,7 +18,14 @@
 typedef struct aes128_ctx aes128_ctx_t;
 
 aes128_ctx_t *aes128_init(uint8_t const *key);
+// whether aes128_init() contexts encrypt with AES instructions
+int aes128_hw_available(void);
+// the implementation aes128_init() contexts use, for the metadata
+const char *aes128_impl(void);
 void aes128_encrypt_block(aes128_ctx_t *ctx, uint8_t const *pt, uint8_t *ct);
+// Encrypt n consecutive blocks; pt and ct may be the same buffer.
+void aes128_encrypt_blocks(aes128_ctx_t *ctx, uint8_t const *pt, uint8_t *ct,
+			   size_t n);
 void aes128_fini(aes128_ctx_t *ctx);
 
 void aes128_selftest(void);
@@ -20,6 +20,7 @@
 
 #include "blocklist.h"
 #include "constraint.h"
+#include "constraint6.h"
 #include "logger.h"
 #include "xalloc.h"
 
@@ -34,6 +35,26 @@ typedef struct bl_linked_list {
 
 static constraint_t *constraint = NULL;
 
+// prefixes read by blocklist_init(), set in bulk once all are read
+static constraint_prefix_t *pending = NULL;
+static size_t pending_len = 0;
+static size_t pending_cap = 0;
+static int collecting = 0;
+
+// compiled constraint to map instead of parsing the lists, if set
+static const char *cache_filename = NULL;
+
+// The IPv6 entries of the lists, kept if blocklist_set_ipv6() asked for
+// them and built into constraint6 once all are read. ipv6_only is set while
+// the lists are read again for them alone, after mapping the cache.
+static int want_ipv6 = 0;
+static int ipv6_only = 0;
+static constraint6_prefix_t *pending6 = NULL;
+static size_t pending6_len = 0;
+static size_t pending6_cap = 0;
+static int allowlist6 = 0;
+static constraint6_t *constraint6 = NULL;
+
 // keep track of the prefixes we've tried to BL/WL
 // for logging purposes
 static bl_ll_t *blocklisted_cidrs = NULL;
@@ -42,7 +63,7 @@ static bl_ll_t *allowlisted_cidrs = NULL;
 void bl_ll_add(bl_ll_t *l, struct in_addr addr, uint16_t p)
 {
 	assert(l);
-	bl_cidr_node_t *new = xmalloc(sizeof(bl_cidr_node_t));
+	bl_cidr_node_t *new = xmalloc_tag(MEM_CONSTRAINT, sizeof(bl_cidr_node_t));
 	new->next = NULL;
 	new->ip_address = addr.s_addr;
 	new->prefix_len = p;
@@ -64,6 +85,11 @@ uint32_t blocklist_lookup_index(uint64_t index)
 	return ntohl(constraint_lookup_index(constraint, index, ADDR_ALLOWED));
 }
 
+void blocklist_prefetch_index(uint64_t index)
+{
+	constraint_prefetch_index(constraint, index);
+}
+
 // check whether a single IP address is allowed to be scanned.
 //		1 => is allowed
 //		0 => is not allowed
@@ -74,7 +100,21 @@ int blocklist_is_allowed(uint32_t s_addr)
 
 static void _add_constraint(struct in_addr addr, int prefix_len, int value)
 {
-	constraint_set(constraint, ntohl(addr.s_addr), prefix_len, value);
+	if (collecting) {
+		if (pending_len == pending_cap) {
+			pending_cap = pending_cap ? 2 * pending_cap : 1024;
+			pending = xrealloc_tag(
+			    MEM_CONSTRAINT, pending,
+			    pending_cap * sizeof(constraint_prefix_t));
+		}
+		pending[pending_len].prefix = ntohl(addr.s_addr);
+		pending[pending_len].len = prefix_len;
+		pending[pending_len].value = value;
+		pending_len++;
+	} else {
+		constraint_set(constraint, ntohl(addr.s_addr), prefix_len,
+			       value);
+	}
 	if (value == ADDR_ALLOWED) {
 		bl_ll_add(allowlisted_cidrs, addr, prefix_len);
 	} else if (value == ADDR_DISALLOWED) {
@@ -122,12 +162,49 @@ static int is_ip_ipv6(char *ip)
 	return false;
 }
 
+static int init_from_string_ipv6(char *ip, int value)
+{
+	int prefix_len = 128;
+	char *slash = strchr(ip, '/');
+	if (slash) {
+		*slash = '\0';
+		char *end;
+		char *len = slash + 1;
+		errno = 0;
+		prefix_len = strtol(len, &end, 10);
+		if (end == len || *end || errno != 0 || prefix_len < 0 ||
+		    prefix_len > 128) {
+			log_fatal("constraint",
+				  "'%s' is not a valid IPv6 prefix length", len);
+			return -1;
+		}
+	}
+	if (pending6_len == pending6_cap) {
+		pending6_cap = pending6_cap ? 2 * pending6_cap : 1024;
+		pending6 = xrealloc_tag(MEM_CONSTRAINT, pending6,
+					pending6_cap * sizeof(constraint6_prefix_t));
+	}
+	constraint6_prefix_t *p = &pending6[pending6_len++];
+	// is_ip_ipv6() has parsed it already
+	inet_pton(AF_INET6, ip, &p->prefix);
+	p->len = (uint8_t)prefix_len;
+	p->allowed = value == ADDR_ALLOWED;
+	allowlist6 |= p->allowed;
+	return 0;
+}
+
 static int init_from_string(char *ip, int value)
 {
 	if (is_ip_ipv6(ip)) {
+		if (want_ipv6) {
+			return init_from_string_ipv6(ip, value);
+		}
 		log_debug("constraint", "ignoring IPv6 IP/subnet: %s", ip);
 		return 0;
 	}
+	if (ipv6_only) {
+		return 0;
+	}
 	int prefix_len = 32;
 	char *slash = strchr(ip, '/');
 	if (slash) { // split apart network and prefix length
@@ -244,6 +321,92 @@ uint32_t blocklist_ip_to_index(uint32_t ip)
 	return constraint_lookup_ip(constraint, ip_hostorder);
 }
 
+void blocklist_set_cache(const char *filename) { cache_filename = filename; }
+
+void blocklist_set_ipv6(int keep) { want_ipv6 = keep; }
+
+int blocklist_is_allowed_ipv6(const struct in6_addr *addr)
+{
+	return constraint6_is_allowed(constraint6, addr);
+}
+
+static void build_ipv6(void)
+{
+	// the unspecified address is never scanned, as 0.0.0.0 isn't
+	init_from_string_ipv6(strdup("::"), ADDR_DISALLOWED);
+	// without IPv6 allowlist entries, an IPv4 allowlist only limits IPv4
+	constraint6 = constraint6_build(!allowlist6, pending6, pending6_len);
+	log_debug("blocklist",
+		  "%zu IPv6 allowlist and blocklist prefixes in %u trie nodes",
+		  pending6_len - 1, constraint6_nodes(constraint6));
+	xfree_tag(MEM_CONSTRAINT, pending6);
+	pending6 = NULL;
+	pending6_len = pending6_cap = 0;
+}
+
+// FNV-1a
+#define CACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+static uint64_t cache_hash(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t cache_hash_file(uint64_t h, const char *filename)
+{
+	FILE *fp = fopen(filename, "r");
+	if (!fp) {
+		log_fatal("blocklist", "unable to open %s: %s", filename,
+			  strerror(errno));
+	}
+	char buf[65536];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		h = cache_hash(h, buf, n);
+	}
+	fclose(fp);
+	return h;
+}
+
+// Key of the compiled constraint: everything it is built from. Names
+// in the lists are keyed as written, not as they resolve.
+static uint64_t cache_key(char *allowlist_filename, char *blocklist_filename,
+			  char **allowlist_entries, size_t allowlist_entries_len,
+			  char **blocklist_entries, size_t blocklist_entries_len,
+			  int ignore_invalid_hosts)
+{
+	uint64_t h = CACHE_HASH_INIT;
+	char sep[32];
+	snprintf(sep, sizeof(sep), "%d|%d|%zu|%zu|", !!allowlist_filename,
+		 !!blocklist_filename, allowlist_entries_len,
+		 blocklist_entries_len);
+	h = cache_hash(h, sep, strlen(sep));
+	h = cache_hash(h, &ignore_invalid_hosts, sizeof(ignore_invalid_hosts));
+	if (allowlist_filename) {
+		h = cache_hash_file(h, allowlist_filename);
+		h = cache_hash(h, "|", 1);
+	}
+	if (blocklist_filename) {
+		h = cache_hash_file(h, blocklist_filename);
+		h = cache_hash(h, "|", 1);
+	}
+	for (size_t i = 0; allowlist_entries && i < allowlist_entries_len;
+	     i++) {
+		h = cache_hash(h, allowlist_entries[i],
+			       strlen(allowlist_entries[i]) + 1);
+	}
+	for (size_t i = 0; blocklist_entries && i < blocklist_entries_len;
+	     i++) {
+		h = cache_hash(h, blocklist_entries[i],
+			       strlen(blocklist_entries[i]) + 1);
+	}
+	return h;
+}
+
 // Initialize address constraints from allowlist and blocklist files.
 // Either can be set to NULL to omit.
 int blocklist_init(char *allowlist_filename, char *blocklist_filename,
@@ -253,15 +416,56 @@ int blocklist_init(char *allowlist_filename, char *blocklist_filename,
 {
 	assert(!constraint);
 
-	blocklisted_cidrs = xcalloc(1, sizeof(bl_ll_t));
-	allowlisted_cidrs = xcalloc(1, sizeof(bl_ll_t));
+	blocklisted_cidrs = xcalloc_tag(MEM_CONSTRAINT, 1, sizeof(bl_ll_t));
+	allowlisted_cidrs = xcalloc_tag(MEM_CONSTRAINT, 1, sizeof(bl_ll_t));
 
+	uint64_t key = 0;
+	if (cache_filename) {
+		key = cache_key(allowlist_filename, blocklist_filename,
+				allowlist_entries, allowlist_entries_len,
+				blocklist_entries, blocklist_entries_len,
+				ignore_invalid_hosts);
+		constraint = constraint_load(cache_filename, key);
+		if (constraint) {
+			// the lists of prefixes are not kept in the file
+			log_info("blocklist",
+				 "using the allowlist and blocklist compiled "
+				 "in %s",
+				 cache_filename);
+			if (want_ipv6) {
+				// which holds IPv4 alone
+				ipv6_only = 1;
+				if (allowlist_filename) {
+					init_from_file(allowlist_filename,
+						       "allowlist", ADDR_ALLOWED,
+						       ignore_invalid_hosts);
+				}
+				init_from_array(allowlist_entries,
+						allowlist_entries_len,
+						ADDR_ALLOWED,
+						ignore_invalid_hosts);
+				if (blocklist_filename) {
+					init_from_file(blocklist_filename,
+						       "blocklist",
+						       ADDR_DISALLOWED,
+						       ignore_invalid_hosts);
+				}
+				init_from_array(blocklist_entries,
+						blocklist_entries_len,
+						ADDR_DISALLOWED,
+						ignore_invalid_hosts);
+				ipv6_only = 0;
+			}
+			goto painted;
+		}
+	}
 	if (allowlist_filename && allowlist_entries) {
 		log_warn("allowlist",
 			 "both a allowlist file and destination addresses "
 			 "were specified. The union of these two sources "
 			 "will be utilized.");
 	}
+	collecting = 1;
 	if (allowlist_filename || allowlist_entries_len > 0) {
 		// using a allowlist, so default to allowing nothing
 		constraint = constraint_init(ADDR_DISALLOWED);
@@ -290,13 +494,35 @@ int blocklist_init(char *allowlist_filename, char *blocklist_filename,
 				ADDR_DISALLOWED, ignore_invalid_hosts);
 	}
 	init_from_string(strdup("0.0.0.0"), ADDR_DISALLOWED);
+	collecting = 0;
+	constraint_set_bulk(constraint, pending, pending_len);
+	xfree_tag(MEM_CONSTRAINT, pending);
+	pending = NULL;
+	pending_len = pending_cap = 0;
 	constraint_paint_value(constraint, ADDR_ALLOWED);
+	if (cache_filename) {
+		if (constraint_save(constraint, cache_filename, key)) {
+			log_warn("blocklist",
+				 "unable to compile the allowlist and "
+				 "blocklist into %s",
+				 cache_filename);
+		} else {
+			log_info("blocklist",
+				 "compiled the allowlist and blocklist into %s",
+				 cache_filename);
+		}
+	}
+painted:;
+	if (want_ipv6) {
+		build_ipv6();
+	}
 	uint64_t allowed = blocklist_count_allowed();
 	log_debug("constraint",
 		  "%lu addresses (%0.0f%% of address "
 		  "space) can be scanned",
 		  allowed, allowed * 100. / ((long long int)1 << 32));
-	if (!allowed) {
+	// an IPv6 scan doesn't need any IPv4 address
+	if (!allowed && !want_ipv6) {
 		log_error("blocklist",
 			  "no addresses are eligible to be scanned in the "
 			  "current configuration. This may be because the "
@@ -16,6 +16,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <netinet/in.h>
 
 #ifndef BLACKLIST_H
 #define BLACKLIST_H
@@ -28,6 +29,8 @@ typedef struct bl_cidr_node {
 
 uint32_t blocklist_lookup_index(uint64_t index);
 
+void blocklist_prefetch_index(uint64_t index);
+
 int blocklist_is_allowed(uint32_t s_addr);
 
 void blocklist_prefix(char *ip, int prefix_len);
@@ -38,6 +41,18 @@ int blocklist_init(char *allowlist, char *blocklist, char **allowlist_entries,
 		   size_t allowlist_entries_len, char **blocklist_entries,
 		   size_t blocklist_entries_len, int ignore_invalid_hosts);
 
+// Map the allowlist and blocklist compiled in filename by an earlier
+// blocklist_init() with the same inputs, or compile them into it. Call
+// before blocklist_init().
+void blocklist_set_cache(const char *filename);
+
+// Keep the IPv6 entries of the lists as well, for
+// blocklist_is_allowed_ipv6(). Call before blocklist_init(). An IPv6
+// address is allowed unless a blocklist entry covers it, or the allowlist
+// has IPv6 entries and none of them does.
+void blocklist_set_ipv6(int keep);
+int blocklist_is_allowed_ipv6(const struct in6_addr *addr);
+
 uint64_t blocklist_count_allowed(void);
 
 uint64_t blocklist_count_not_allowed(void);
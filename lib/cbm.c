@@ -0,0 +1,282 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "cbm.h"
+
+#include <string.h>
+
+#include "xalloc.h"
+
+#define CBM_ARRAY 0
+#define CBM_RUN 1
+#define CBM_BITMAP 2
+
+struct cbm_container {
+	uint8_t type;
+	uint32_t len; // values of an array, runs of a run container
+	uint32_t cap; // uint16_t allocated in data
+	// sorted values, (start, length - 1) pairs sorted by start, or the
+	// bitmap's bytes
+	uint16_t *data;
+};
+
+cbm_t *cbm_init(uint64_t num_pages, mem_tag_t tag)
+{
+	cbm_t *b = xcalloc_tag(tag, 1, sizeof(cbm_t));
+	b->pages = xcalloc_tag(tag, num_pages, sizeof(cbm_container_t *));
+	b->num_pages = num_pages;
+	b->tag = tag;
+	return b;
+}
+
+void cbm_free(cbm_t *b)
+{
+	if (!b) {
+		return;
+	}
+	for (uint64_t i = 0; i < b->num_pages; i++) {
+		if (b->pages[i]) {
+			xfree_tag(b->tag, b->pages[i]->data);
+			xfree_tag(b->tag, b->pages[i]);
+		}
+	}
+	xfree_tag(b->tag, b->pages);
+	xfree_tag(b->tag, b);
+}
+
+// the first index of a whose value is >= v, len if there is none
+static uint32_t lower_bound(const uint16_t *a, uint32_t len, uint16_t v)
+{
+	uint32_t lo = 0;
+	uint32_t hi = len;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (a[mid] < v) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+// the last run starting at or before v, -1 if v is before them all
+static int64_t run_before(const cbm_container_t *c, uint16_t v)
+{
+	uint32_t lo = 0;
+	uint32_t hi = c->len;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (c->data[2 * mid] <= v) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (int64_t)lo - 1;
+}
+
+static int container_check(const cbm_container_t *c, uint16_t v)
+{
+	switch (c->type) {
+	case CBM_ARRAY: {
+		uint32_t i = lower_bound(c->data, c->len, v);
+		return i < c->len && c->data[i] == v;
+	}
+	case CBM_RUN: {
+		int64_t i = run_before(c, v);
+		return i >= 0 &&
+		       v - c->data[2 * i] <= c->data[2 * i + 1];
+	}
+	default: {
+		const uint8_t *bits = (const uint8_t *)c->data;
+		return bits[v >> 3] & (1 << (v & 0x07));
+	}
+	}
+}
+
+static void reserve(mem_tag_t tag, cbm_container_t *c, uint32_t n)
+{
+	if (n <= c->cap) {
+		return;
+	}
+	uint32_t cap = c->cap ? c->cap : 4;
+	while (cap < n) {
+		cap *= 2;
+	}
+	c->data = xrealloc_tag(tag, c->data, cap * sizeof(uint16_t));
+	c->cap = cap;
+}
+
+static void to_bitmap(mem_tag_t tag, cbm_container_t *c)
+{
+	uint8_t *bits = xcalloc_tag(tag, 1, CBM_PAGE_BYTES);
+	if (c->type == CBM_ARRAY) {
+		for (uint32_t i = 0; i < c->len; i++) {
+			uint16_t v = c->data[i];
+			bits[v >> 3] |= 1 << (v & 0x07);
+		}
+	} else {
+		for (uint32_t i = 0; i < c->len; i++) {
+			uint32_t start = c->data[2 * i];
+			uint32_t end = start + c->data[2 * i + 1];
+			for (uint32_t v = start; v <= end; v++) {
+				bits[v >> 3] |= 1 << (v & 0x07);
+			}
+		}
+	}
+	xfree_tag(tag, c->data);
+	c->data = (uint16_t *)bits;
+	c->cap = CBM_PAGE_BYTES / sizeof(uint16_t);
+	c->len = 0;
+	c->type = CBM_BITMAP;
+}
+
+// a full array goes to runs if there are few enough of them
+static void array_full(mem_tag_t tag, cbm_container_t *c)
+{
+	uint32_t runs = 1;
+	for (uint32_t i = 1; i < c->len; i++) {
+		runs += c->data[i] != c->data[i - 1] + 1;
+	}
+	if (runs > CBM_RUN_MAX) {
+		to_bitmap(tag, c);
+		return;
+	}
+	uint16_t *pairs = xmalloc_tag(tag, 2 * runs * sizeof(uint16_t));
+	uint32_t r = 0;
+	for (uint32_t i = 0; i < c->len; i++) {
+		if (i && c->data[i] == c->data[i - 1] + 1) {
+			pairs[2 * (r - 1) + 1]++;
+		} else {
+			pairs[2 * r] = c->data[i];
+			pairs[2 * r + 1] = 0;
+			r++;
+		}
+	}
+	xfree_tag(tag, c->data);
+	c->data = pairs;
+	c->cap = 2 * runs;
+	c->len = runs;
+	c->type = CBM_RUN;
+}
+
+static void run_set(mem_tag_t tag, cbm_container_t *c, uint16_t v)
+{
+	int64_t i = run_before(c, v);
+	uint16_t *d = c->data;
+	if (i >= 0 && v - d[2 * i] <= d[2 * i + 1]) {
+		return;
+	}
+	int joins_prev = i >= 0 && v == d[2 * i] + d[2 * i + 1] + 1;
+	int joins_next = (uint32_t)(i + 1) < c->len && d[2 * (i + 1)] == v + 1;
+	if (joins_prev && joins_next) {
+		// v closes the gap between two runs
+		d[2 * i + 1] += d[2 * (i + 1) + 1] + 2;
+		memmove(&d[2 * (i + 1)], &d[2 * (i + 2)],
+			(c->len - i - 2) * 2 * sizeof(uint16_t));
+		c->len--;
+	} else if (joins_prev) {
+		d[2 * i + 1]++;
+	} else if (joins_next) {
+		d[2 * (i + 1)]--;
+		d[2 * (i + 1) + 1]++;
+	} else if (c->len == CBM_RUN_MAX) {
+		to_bitmap(tag, c);
+		uint8_t *bits = (uint8_t *)c->data;
+		bits[v >> 3] |= 1 << (v & 0x07);
+	} else {
+		reserve(tag, c, 2 * (c->len + 1));
+		d = c->data;
+		memmove(&d[2 * (i + 2)], &d[2 * (i + 1)],
+			(c->len - i - 1) * 2 * sizeof(uint16_t));
+		d[2 * (i + 1)] = v;
+		d[2 * (i + 1) + 1] = 0;
+		c->len++;
+	}
+}
+
+int cbm_check(const cbm_t *b, uint64_t v)
+{
+	const cbm_container_t *c = b->pages[v >> 16];
+	return c && container_check(c, (uint16_t)v);
+}
+
+void cbm_set(cbm_t *b, uint64_t v)
+{
+	cbm_container_t *c = b->pages[v >> 16];
+	if (!c) {
+		c = xcalloc_tag(b->tag, 1, sizeof(cbm_container_t));
+		b->pages[v >> 16] = c;
+	}
+	uint16_t low = (uint16_t)v;
+	switch (c->type) {
+	case CBM_ARRAY: {
+		uint32_t i = lower_bound(c->data, c->len, low);
+		if (i < c->len && c->data[i] == low) {
+			return;
+		}
+		if (c->len == CBM_ARRAY_MAX) {
+			array_full(b->tag, c);
+			cbm_set(b, v);
+			return;
+		}
+		reserve(b->tag, c, c->len + 1);
+		memmove(&c->data[i + 1], &c->data[i],
+			(c->len - i) * sizeof(uint16_t));
+		c->data[i] = low;
+		c->len++;
+		return;
+	}
+	case CBM_RUN:
+		run_set(b->tag, c, low);
+		return;
+	default: {
+		uint8_t *bits = (uint8_t *)c->data;
+		bits[low >> 3] |= 1 << (low & 0x07);
+	}
+	}
+}
+
+int cbm_get_page(const cbm_t *b, uint64_t page, uint8_t *out)
+{
+	const cbm_container_t *c = b->pages[page];
+	memset(out, 0, CBM_PAGE_BYTES);
+	if (!c) {
+		return 0;
+	}
+	if (c->type == CBM_BITMAP) {
+		memcpy(out, c->data, CBM_PAGE_BYTES);
+		for (size_t i = 0; i < CBM_PAGE_BYTES; i++) {
+			if (out[i]) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+	// a copy converted in place, leaving c as it is
+	cbm_container_t copy = *c;
+	copy.data = xmalloc_tag(b->tag, c->cap * sizeof(uint16_t));
+	memcpy(copy.data, c->data, c->cap * sizeof(uint16_t));
+	to_bitmap(b->tag, &copy);
+	memcpy(out, copy.data, CBM_PAGE_BYTES);
+	xfree_tag(b->tag, copy.data);
+	return c->len != 0;
+}
+
+size_t cbm_memory(const cbm_t *b)
+{
+	size_t bytes = sizeof(cbm_t) + b->num_pages * sizeof(cbm_container_t *);
+	for (uint64_t i = 0; i < b->num_pages; i++) {
+		if (b->pages[i]) {
+			bytes += sizeof(cbm_container_t) +
+				 b->pages[i]->cap * sizeof(uint16_t);
+		}
+	}
+	return bytes;
+}
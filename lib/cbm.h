@@ -0,0 +1,50 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_CBM_H
+#define ZMAP_CBM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xalloc.h"
+
+// Compressed bitmap, a drop-in for a paged bitmap (pbm) when few of the
+// values in each page of 2^16 are set. Like roaring bitmaps, each page is a
+// container of one of three kinds, picked by what is smallest for what is in
+// it: a sorted array of values while there are up to CBM_ARRAY_MAX, then
+// runs of consecutive values while there are up to CBM_RUN_MAX of those, and
+// an 8 KiB bitmap past that. A page with a handful of values takes a few
+// dozen bytes rather than 8 KiB; checks are a binary search at worst.
+#define CBM_ARRAY_MAX 4096
+#define CBM_RUN_MAX 1024
+#define CBM_PAGE_BYTES 0x2000
+
+typedef struct cbm_container cbm_container_t;
+
+typedef struct cbm {
+	cbm_container_t **pages;
+	uint64_t num_pages;
+	mem_tag_t tag;
+} cbm_t;
+
+// a bitmap of num_pages * 2^16 values, 0x10000 pages for IPv4 addresses,
+// its memory accounted to tag
+cbm_t *cbm_init(uint64_t num_pages, mem_tag_t tag);
+void cbm_free(cbm_t *b);
+
+int cbm_check(const cbm_t *b, uint64_t v);
+void cbm_set(cbm_t *b, uint64_t v);
+
+// page as CBM_PAGE_BYTES of bits, returning 0 when none of them is set
+int cbm_get_page(const cbm_t *b, uint64_t page, uint8_t *out);
+
+// bytes allocated, directory included
+size_t cbm_memory(const cbm_t *b);
+
+#endif /* ZMAP_CBM_H */
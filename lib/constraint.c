@@ -20,6 +20,10 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -53,6 +57,15 @@
 // As an optimization, after all values are set, we look up the
 // value or subtree for every /16 prefix and cache them as an array.
 // This lets subsequent lookups bypass the bottom half of the tree.
+// The painted addresses the array does not cover are compiled into a
+// sorted list of intervals, stored in Eytzinger (breadth-first) order,
+// so that index lookups are a short branch-free search of one array
+// instead of a descent of the tree.
+//
+// A painted constraint can be saved to a file and memory-mapped by a
+// later run instead of being rebuilt. A mapped constraint has no tree;
+// it looks up addresses in a sorted list of the painted ranges and
+// can't be changed or painted again.
 //
 
 /*
@@ -67,18 +80,52 @@ typedef struct node {
 	struct node *l;
 	struct node *r;
 	value_t value;
+	uint8_t pooled; // part of a node_pool, freed with it
 	uint64_t count;
 } node_t;
 
+// Nodes built by constraint_set_bulk(), allocated in chunks
+#define NODE_POOL_CHUNK 4096
+
+typedef struct node_pool {
+	struct node_pool *next;
+	size_t used;
+	node_t nodes[NODE_POOL_CHUNK];
+} node_pool_t;
+
 // As an optimization, we precompute lookups for every prefix of this
 // length:
 #define RADIX_LENGTH 18
 
+// A run of painted addresses outside the radix array: the addresses at
+// indices start, start + 1, ... (counted after the radix array) are
+// base, base + 1, ... up to the start of the next interval.
+typedef struct interval {
+	uint64_t start;
+	uint32_t base;
+} interval_t;
+
+// Inclusive range of painted addresses
+typedef struct range {
+	uint32_t first;
+	uint32_t last;
+} range_t;
+
 struct _constraint {
 	node_t *root;	     // root node of the tree
+	node_pool_t *pool;   // chunks of nodes built in bulk
 	uint32_t *radix;     // array of prefixes (/RADIX_LENGTH) that are painted
 			     // paint_value
 	size_t radix_len;    // number of prefixes in radix array
+	interval_t *intervals; // Eytzinger order, 1-based
+	size_t intervals_len;  // number of intervals
+	uint64_t tree_count;   // painted addresses outside the radix array
+	// set when loaded by constraint_load(), which leaves root NULL
+	void *map;
+	size_t map_len;
+	const range_t *ranges; // painted ranges, sorted
+	size_t ranges_len;
+	value_t other_value; // the value of every address not painted
 	int painted;	     // have we precomputed counts for each node?
 	value_t paint_value; // value for which we precomputed counts
 };
@@ -90,10 +137,11 @@ struct _constraint {
 // Allocate a new leaf with the given value
 static node_t *_create_leaf(value_t value)
 {
-	node_t *node = xmalloc(sizeof(node_t));
+	node_t *node = xmalloc_tag(MEM_CONSTRAINT, sizeof(node_t));
 	node->l = NULL;
 	node->r = NULL;
 	node->value = value;
+	node->pooled = 0;
 	return node;
 }
 
@@ -104,7 +152,9 @@ static void _destroy_subtree(node_t *node)
 		return;
 	_destroy_subtree(node->l);
 	_destroy_subtree(node->r);
-	free(node);
+	if (!node->pooled) {
+		xfree_tag(MEM_CONSTRAINT, node);
+	}
 }
 
 // Convert from an internal node to a leaf.
@@ -172,10 +222,124 @@ static void _set_recurse(node_t *node, uint32_t prefix, int len, value_t value)
 void constraint_set(constraint_t *con, uint32_t prefix, int len, value_t value)
 {
 	assert(con);
+	assert(con->root);
 	_set_recurse(con->root, prefix, len, value);
 	con->painted = 0;
 }
 
+static node_t *_pool_leaf(constraint_t *con, value_t value)
+{
+	if (!con->pool || con->pool->used == NODE_POOL_CHUNK) {
+		node_pool_t *chunk = xmalloc_tag(MEM_CONSTRAINT, sizeof(node_pool_t));
+		chunk->next = con->pool;
+		chunk->used = 0;
+		con->pool = chunk;
+	}
+	node_t *node = &con->pool->nodes[con->pool->used++];
+	node->l = NULL;
+	node->r = NULL;
+	node->value = value;
+	node->pooled = 1;
+	return node;
+}
+
+// a constraint_set() call, numbered in call order
+typedef struct bulk_prefix {
+	uint32_t prefix;
+	int len;
+	value_t value;
+	size_t seq;
+} bulk_prefix_t;
+
+static int _bulk_prefix_cmp(const void *a, const void *b)
+{
+	const bulk_prefix_t *x = a, *y = b;
+	if (x->prefix != y->prefix) {
+		return x->prefix < y->prefix ? -1 : 1;
+	}
+	if (x->len != y->len) {
+		return x->len < y->len ? -1 : 1;
+	}
+	return x->seq < y->seq ? -1 : (x->seq > y->seq);
+}
+
+// Build the subtree for the prefix of node, at depth, out of the
+// prefixes in p[0..n) that lie within it, sorted by address and then
+// length. The latest prefix covering all of node so far is seq (0 for
+// none; prefixes count from 1) and gives it value.
+static void _build_bulk(constraint_t *con, node_t *node, int depth,
+			const bulk_prefix_t *p, size_t n, value_t value,
+			size_t seq)
+{
+	// the prefixes that are node itself sort first
+	while (n && p->len == depth) {
+		if (p->seq > seq) {
+			seq = p->seq;
+			value = p->value;
+		}
+		p++;
+		n--;
+	}
+	// smaller prefixes set before the one covering node don't show
+	size_t i;
+	for (i = 0; i < n && p[i].seq < seq; i++)
+		;
+	if (i == n) {
+		node->value = value;
+		return;
+	}
+	uint32_t bit = 0x80000000u >> depth;
+	size_t mid = 0;
+	while (mid < n && !(p[mid].prefix & bit)) {
+		mid++;
+	}
+	node->l = _pool_leaf(con, value);
+	node->r = _pool_leaf(con, value);
+	_build_bulk(con, node->l, depth + 1, p, mid, value, seq);
+	_build_bulk(con, node->r, depth + 1, p + mid, n - mid, value, seq);
+	// keep the invariant of _set_recurse(); the pooled children just go
+	// unused
+	if (IS_LEAF(node->l) && IS_LEAF(node->r) &&
+	    node->l->value == node->r->value) {
+		node->value = node->l->value;
+		node->l = NULL;
+		node->r = NULL;
+	}
+}
+
+// The same as calling constraint_set() for each prefix in order, but
+// sorts them and builds the tree once, from a pool of nodes, instead of
+// walking it from the root for each of them. Only a constraint that
+// nothing has been set in yet is built in bulk.
+void constraint_set_bulk(constraint_t *con, const constraint_prefix_t *prefixes,
+			 size_t len)
+{
+	assert(con);
+	assert(con->root);
+	if (!IS_LEAF(con->root)) {
+		for (size_t i = 0; i < len; i++) {
+			constraint_set(con, prefixes[i].prefix,
+				       prefixes[i].len, prefixes[i].value);
+		}
+		return;
+	}
+	bulk_prefix_t *p =
+	    xmalloc_tag(MEM_CONSTRAINT, (len + 1) * sizeof(bulk_prefix_t));
+	for (size_t i = 0; i < len; i++) {
+		int l = prefixes[i].len;
+		assert(0 <= l && l <= 32);
+		p[i].prefix = l ? prefixes[i].prefix & (0xFFFFFFFFu << (32 - l))
+				: 0;
+		p[i].len = l;
+		p[i].value = prefixes[i].value;
+		p[i].seq = i + 1;
+	}
+	qsort(p, len, sizeof(bulk_prefix_t), _bulk_prefix_cmp);
+	_build_bulk(con, con->root, 0, p, len, con->root->value, 0);
+	xfree_tag(MEM_CONSTRAINT, p);
+	con->painted = 0;
+}
+
 // Return the value pertaining to an address, according to the tree
 // starting at given root.  (Note: address must be in host byte order.)
 static int _lookup_ip(node_t *root, uint32_t address)
@@ -201,29 +365,38 @@ static int _lookup_ip(node_t *root, uint32_t address)
 value_t constraint_lookup_ip(constraint_t *con, uint32_t address)
 {
 	assert(con);
+	if (!con->root) {
+		// last range starting at or before address
+		size_t lo = 0, hi = con->ranges_len;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (con->ranges[mid].first <= address) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		return lo && address <= con->ranges[lo - 1].last
+			   ? con->paint_value
+			   : con->other_value;
+	}
 	return _lookup_ip(con->root, address);
 }
 
-// Return the nth painted IP address.
-static int _lookup_index(node_t *root, uint64_t n)
+// Return the nth painted IP address outside the radix array. Each step
+// moves to the left or right child depending on whether the interval
+// starts after n, and the last step to the right lands on the interval
+// holding n. Grandchildren are prefetched a level ahead.
+static uint32_t _lookup_interval(const constraint_t *con, uint64_t n)
 {
-	assert(root);
-	node_t *node = root;
-	uint32_t ip = 0;
-	uint32_t mask = 0x80000000;
-	for (;;) {
-		if (IS_LEAF(node)) {
-			return ip | n;
-		}
-		if (n < node->l->count) {
-			node = node->l;
-		} else {
-			n -= node->l->count;
-			node = node->r;
-			ip |= mask;
-		}
-		mask >>= 1;
+	const interval_t *b = con->intervals;
+	size_t k = 1;
+	while (k <= con->intervals_len) {
+		__builtin_prefetch(b + 4 * k);
+		k = 2 * k + (b[k].start <= n);
 	}
+	k >>= __builtin_ffsll((long long)k);
+	return b[k].base + (uint32_t)(n - b[k].start);
 }
 
 // For a given value, return the IP address with zero-based index n.
@@ -246,12 +419,25 @@ uint32_t constraint_lookup_index(constraint_t *con, uint64_t index,
 		return con->radix[radix_idx] | radix_offset;
 	}
 
-	// Otherwise, do the "slow" lookup in tree.
+	// Otherwise, search the intervals.
 	// Note that tree counts do NOT include things in the radix,
 	// so we subtract these off here.
 	index -= con->radix_len * (1 << (32 - RADIX_LENGTH));
-	assert(index < con->root->count);
-	return _lookup_index(con->root, index);
+	assert(index < con->tree_count);
+	return _lookup_interval(con, index);
+}
+
+// Hint that constraint_lookup_index() will soon be called for index. Only
+// the radix table is worth prefetching; the top of the interval search is
+// shared by every lookup and stays cached, and its search prefetches the
+// rest as it goes.
+// The tree must already be painted for the value that will be looked up.
+void constraint_prefetch_index(const constraint_t *con, uint64_t index)
+{
+	uint64_t radix_idx = index / (1 << (32 - RADIX_LENGTH));
+	if (radix_idx < con->radix_len) {
+		__builtin_prefetch(&con->radix[radix_idx]);
+	}
 }
 
 // Implement count_ips by recursing on halves of the tree.  Size represents
@@ -315,15 +501,82 @@ static node_t *_lookup_node(node_t *root, uint32_t prefix, int len)
 	return node;
 }
 
+typedef struct collect {
+	interval_t *out; // NULL to only count the intervals
+	size_t len;
+	uint64_t total;	 // painted addresses seen so far
+	uint32_t next;	 // address right after the last one seen
+} collect_t;
+
+// Walk the painted leaves that are not in the radix array in address
+// order, merging adjacent ones into intervals.
+static void _collect_intervals(node_t *node, value_t value, uint32_t prefix,
+			       uint64_t size, collect_t *c)
+{
+	if (!IS_LEAF(node)) {
+		_collect_intervals(node->l, value, prefix, size >> 1, c);
+		_collect_intervals(node->r, value,
+				   prefix | (uint32_t)(size >> 1), size >> 1, c);
+		return;
+	}
+	if (node->value != value || size >= (1 << (32 - RADIX_LENGTH))) {
+		return;
+	}
+	if (!c->len || prefix != c->next) {
+		if (c->out) {
+			c->out[c->len].start = c->total;
+			c->out[c->len].base = prefix;
+		}
+		c->len++;
+	}
+	c->total += size;
+	c->next = prefix + (uint32_t)size;
+}
+
+// Lay out sorted[] in Eytzinger order into out[1..len]
+static size_t _eytzinger_fill(const interval_t *sorted, interval_t *out,
+			      size_t len, size_t i, size_t k)
+{
+	if (k <= len) {
+		i = _eytzinger_fill(sorted, out, len, i, 2 * k);
+		out[k] = sorted[i++];
+		i = _eytzinger_fill(sorted, out, len, i, 2 * k + 1);
+	}
+	return i;
+}
+
+static void _build_intervals(constraint_t *con, value_t value)
+{
+	collect_t c = {0};
+	_collect_intervals(con->root, value, 0, (uint64_t)1 << 32, &c);
+	assert(c.total == con->tree_count);
+	interval_t *sorted =
+	    xmalloc_tag(MEM_CONSTRAINT, (c.len + 1) * sizeof(interval_t));
+	size_t len = c.len;
+	c = (collect_t){.out = sorted};
+	_collect_intervals(con->root, value, 0, (uint64_t)1 << 32, &c);
+	xfree_tag(MEM_CONSTRAINT, con->intervals);
+	con->intervals =
+	    xcalloc_tag(MEM_CONSTRAINT, len + 1, sizeof(interval_t));
+	_eytzinger_fill(sorted, con->intervals, len, 0, 1);
+	con->intervals_len = len;
+	xfree_tag(MEM_CONSTRAINT, sorted);
+}
+
 // For each node, precompute the count of leaves beneath it set to value.
 // Note that the tree can be painted for only one value at a time.
 void constraint_paint_value(constraint_t *con, value_t value)
 {
 	assert(con);
+	if (!con->root) {
+		log_fatal("constraint",
+			  "a loaded constraint can't be painted again");
+	}
 	log_debug("constraint", "Painting value %lu", value);
 
 	// Paint everything except what we will put in radix
-	_count_ips_recurse(con->root, value, (uint64_t)1 << 32, 1, 1);
+	con->tree_count =
+	    _count_ips_recurse(con->root, value, (uint64_t)1 << 32, 1, 1);
 
 	// Fill in the radix array with a list of addresses
 	uint32_t i;
@@ -336,9 +589,11 @@ void constraint_paint_value(constraint_t *con, value_t value)
 			con->radix[con->radix_len++] = prefix;
 		}
 	}
-	log_debug("constraint", "%lu IPs in radix array, %lu IPs in tree",
+	_build_intervals(con, value);
+	log_debug("constraint",
+		  "%lu IPs in radix array, %lu IPs in %zu intervals",
 		  con->radix_len * (1 << (32 - RADIX_LENGTH)),
-		  con->root->count);
+		  con->tree_count, con->intervals_len);
 	con->painted = 1;
 	con->paint_value = value;
 }
@@ -348,7 +603,13 @@ uint64_t constraint_count_ips(constraint_t *con, value_t value)
 {
 	assert(con);
 	if (con->painted && con->paint_value == value) {
-		return con->root->count +
+		return con->tree_count +
+		       con->radix_len * (1 << (32 - RADIX_LENGTH));
+	} else if (!con->root) {
+		if (value != con->other_value) {
+			return 0;
+		}
+		return ((uint64_t)1 << 32) - con->tree_count -
 		       con->radix_len * (1 << (32 - RADIX_LENGTH));
 	} else {
 		return _count_ips_recurse(con->root, value, (uint64_t)1 << 32,
@@ -360,9 +621,10 @@ uint64_t constraint_count_ips(constraint_t *con, value_t value)
 // All addresses will initially have the given value.
 constraint_t *constraint_init(value_t value)
 {
-	constraint_t *con = xmalloc(sizeof(constraint_t));
+	constraint_t *con = xcalloc_tag(MEM_CONSTRAINT, 1, sizeof(constraint_t));
 	con->root = _create_leaf(value);
-	con->radix = xcalloc(sizeof(uint32_t), 1 << RADIX_LENGTH);
+	con->radix =
+	    xcalloc_tag(MEM_CONSTRAINT, sizeof(uint32_t), 1 << RADIX_LENGTH);
 	con->painted = 0;
 	return con;
 }
@@ -372,9 +634,262 @@ void constraint_free(constraint_t *con)
 {
 	assert(con);
 	log_debug("constraint", "Cleaning up");
+	if (con->map) {
+		munmap(con->map, con->map_len);
+		xalloc_account(MEM_CONSTRAINT, -(int64_t)con->map_len);
+		xfree_tag(MEM_CONSTRAINT, con);
+		return;
+	}
 	_destroy_subtree(con->root);
-	free(con->radix);
-	free(con);
+	while (con->pool) {
+		node_pool_t *next = con->pool->next;
+		xfree_tag(MEM_CONSTRAINT, con->pool);
+		con->pool = next;
+	}
+	xfree_tag(MEM_CONSTRAINT, con->radix);
+	xfree_tag(MEM_CONSTRAINT, con->intervals);
+	xfree_tag(MEM_CONSTRAINT, con);
+}
+
+// Compiled constraint files, in host byte order: the header, then the
+// intervals (including the unused first slot), the radix array and the
+// ranges, each starting on an 8 byte boundary.
+#define CONSTRAINT_FILE_MAGIC "ZMAPCON"
+#define CONSTRAINT_FILE_VERSION 1
+
+typedef struct constraint_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t radix_length;
+	uint64_t key;
+	value_t paint_value;
+	value_t other_value;
+	uint64_t tree_count;
+	uint64_t radix_len;
+	uint64_t intervals_len;
+	uint64_t ranges_len;
+} constraint_file_header_t;
+
+#define ALIGN8(n) (((n) + 7) & ~(size_t)7)
+
+static size_t _file_sections(const constraint_file_header_t *h,
+			     size_t *radix_off, size_t *ranges_off)
+{
+	size_t off = ALIGN8(sizeof(*h));
+	off += (h->intervals_len + 1) * sizeof(interval_t);
+	*radix_off = off;
+	off = ALIGN8(off + h->radix_len * sizeof(uint32_t));
+	*ranges_off = off;
+	return off + h->ranges_len * sizeof(range_t);
+}
+
+typedef struct ranges {
+	range_t *out; // NULL to only count the ranges
+	size_t len;
+	uint32_t next; // address right after the last painted one seen
+	int has_other;
+	value_t other;
+	int mixed; // more than two values
+} ranges_t;
+
+// Collect the painted ranges in address order, merging adjacent leaves,
+// and check that every other leaf has one and the same value.
+static void _collect_ranges(node_t *node, value_t value, uint32_t prefix,
+			    uint64_t size, ranges_t *r)
+{
+	if (!IS_LEAF(node)) {
+		_collect_ranges(node->l, value, prefix, size >> 1, r);
+		_collect_ranges(node->r, value, prefix | (uint32_t)(size >> 1),
+				size >> 1, r);
+		return;
+	}
+	if (node->value != value) {
+		if (r->has_other && r->other != node->value) {
+			r->mixed = 1;
+		}
+		r->has_other = 1;
+		r->other = node->value;
+		return;
+	}
+	uint32_t last = prefix + (uint32_t)(size - 1);
+	if (!r->len || prefix != r->next) {
+		if (r->out) {
+			r->out[r->len].first = prefix;
+		}
+		r->len++;
+	}
+	if (r->out) {
+		r->out[r->len - 1].last = last;
+	}
+	r->next = last + 1;
+}
+
+static int _write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Save the painted constraint to path, tagged with key, replacing the
+// file at once. Only constraints with no more than two values can be
+// saved, as a loaded one only tells painted addresses from the rest.
+int constraint_save(constraint_t *con, const char *path, uint64_t key)
+{
+	assert(con);
+	if (!con->root || !con->painted) {
+		log_error("constraint", "only a painted constraint can be saved");
+		return EXIT_FAILURE;
+	}
+	ranges_t r = {0};
+	_collect_ranges(con->root, con->paint_value, 0, (uint64_t)1 << 32, &r);
+	if (r.mixed) {
+		log_error("constraint", "constraints with more than two values "
+					"can't be saved");
+		return EXIT_FAILURE;
+	}
+	size_t ranges_len = r.len;
+	range_t *ranges = xmalloc((ranges_len + 1) * sizeof(range_t));
+	r = (ranges_t){.out = ranges};
+	_collect_ranges(con->root, con->paint_value, 0, (uint64_t)1 << 32, &r);
+
+	constraint_file_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CONSTRAINT_FILE_MAGIC, sizeof(CONSTRAINT_FILE_MAGIC));
+	h.version = CONSTRAINT_FILE_VERSION;
+	h.radix_length = RADIX_LENGTH;
+	h.key = key;
+	h.paint_value = con->paint_value;
+	// with every address painted, any other value will do
+	h.other_value = r.has_other ? r.other : !con->paint_value;
+	h.tree_count = con->tree_count;
+	h.radix_len = con->radix_len;
+	h.intervals_len = con->intervals_len;
+	h.ranges_len = ranges_len;
+	size_t radix_off, ranges_off;
+	size_t len = _file_sections(&h, &radix_off, &ranges_off);
+	char *buf = xcalloc(1, len);
+	memcpy(buf, &h, sizeof(h));
+	memcpy(buf + ALIGN8(sizeof(h)), con->intervals,
+	       (con->intervals_len + 1) * sizeof(interval_t));
+	memcpy(buf + radix_off, con->radix, con->radix_len * sizeof(uint32_t));
+	memcpy(buf + ranges_off, ranges, ranges_len * sizeof(range_t));
+	xfree(ranges);
+
+	// written next to path and renamed over it, so that a concurrent
+	// run never maps a partial file
+	size_t tmp_len = strlen(path) + 32;
+	char *tmp = xmalloc(tmp_len);
+	snprintf(tmp, tmp_len, "%s.%ld.tmp", path, (long)getpid());
+	int ret = EXIT_FAILURE;
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_error("constraint", "unable to create %s: %s", tmp,
+			  strerror(errno));
+	} else if (_write_all(fd, buf, len) || fsync(fd)) {
+		log_error("constraint", "unable to write %s: %s", tmp,
+			  strerror(errno));
+		close(fd);
+		unlink(tmp);
+	} else if (close(fd) || rename(tmp, path)) {
+		log_error("constraint", "unable to replace %s: %s", path,
+			  strerror(errno));
+		unlink(tmp);
+	} else {
+		log_debug("constraint",
+			  "saved %zu intervals and %zu ranges to %s",
+			  con->intervals_len, ranges_len, path);
+		ret = EXIT_SUCCESS;
+	}
+	xfree(tmp);
+	xfree(buf);
+	return ret;
+}
+
+// Map a constraint saved by constraint_save(), painted as it was then.
+// Returns NULL if path is missing, unreadable, of another version or
+// saved with another key.
+constraint_t *constraint_load(const char *path, uint64_t key)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			log_warn("constraint", "unable to open %s: %s", path,
+				 strerror(errno));
+		}
+		return NULL;
+	}
+	struct stat st;
+	constraint_file_header_t h;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(h) ||
+	    pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h)) {
+		log_warn("constraint", "unable to read %s", path);
+		close(fd);
+		return NULL;
+	}
+	if (memcmp(h.magic, CONSTRAINT_FILE_MAGIC,
+		   sizeof(CONSTRAINT_FILE_MAGIC)) ||
+	    h.version != CONSTRAINT_FILE_VERSION ||
+	    h.radix_length != RADIX_LENGTH) {
+		log_debug("constraint", "%s is not a compiled constraint of "
+					"this version",
+			  path);
+		close(fd);
+		return NULL;
+	}
+	if (h.key != key) {
+		log_debug("constraint", "%s was compiled from other inputs",
+			  path);
+		close(fd);
+		return NULL;
+	}
+	size_t radix_off, ranges_off;
+	if (h.radix_len > (1 << RADIX_LENGTH) || h.intervals_len > UINT32_MAX ||
+	    h.ranges_len > UINT32_MAX ||
+	    _file_sections(&h, &radix_off, &ranges_off) !=
+		(size_t)st.st_size) {
+		log_warn("constraint", "%s is truncated or corrupt", path);
+		close(fd);
+		return NULL;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		log_warn("constraint", "unable to map %s: %s", path,
+			 strerror(errno));
+		return NULL;
+	}
+	// counted although the pages are the file's: they are what the
+	// constraint occupies for the scan
+	xalloc_account(MEM_CONSTRAINT, (int64_t)st.st_size);
+	char *base = map;
+	constraint_t *con = xcalloc_tag(MEM_CONSTRAINT, 1, sizeof(constraint_t));
+	con->root = NULL;
+	con->map = map;
+	con->map_len = st.st_size;
+	con->intervals = (interval_t *)(base + ALIGN8(sizeof(h)));
+	con->intervals_len = h.intervals_len;
+	con->radix = (uint32_t *)(base + radix_off);
+	con->radix_len = h.radix_len;
+	con->ranges = (const range_t *)(base + ranges_off);
+	con->ranges_len = h.ranges_len;
+	con->tree_count = h.tree_count;
+	con->paint_value = h.paint_value;
+	con->other_value = h.other_value;
+	con->painted = 1;
+	log_debug("constraint", "mapped %zu intervals and %zu ranges from %s",
+		  con->intervals_len, con->ranges_len, path);
+	return con;
 }
 
 /*
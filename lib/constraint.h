@@ -17,18 +17,31 @@
 #ifndef CONSTRAINT_H
 #define CONSTRAINT_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct _constraint constraint_t;
 typedef uint32_t value_t;
 
+typedef struct constraint_prefix {
+	uint32_t prefix;
+	int len;
+	value_t value;
+} constraint_prefix_t;
+
 constraint_t *constraint_init(value_t value);
 void constraint_free(constraint_t *con);
 void constraint_set(constraint_t *con, uint32_t prefix, int len, value_t value);
+void constraint_set_bulk(constraint_t *con, const constraint_prefix_t *prefixes,
+			 size_t len);
 value_t constraint_lookup_ip(constraint_t *con, uint32_t address);
 uint64_t constraint_count_ips(constraint_t *con, value_t value);
 uint32_t constraint_lookup_index(constraint_t *con, uint64_t index,
 				 value_t value);
+void constraint_prefetch_index(const constraint_t *con, uint64_t index);
 void constraint_paint_value(constraint_t *con, value_t value);
+// save a painted constraint, or map it back if it was saved with key
+int constraint_save(constraint_t *con, const char *path, uint64_t key);
+constraint_t *constraint_load(const char *path, uint64_t key);
 
 #endif //_CONSTRAINT_H
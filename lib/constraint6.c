@@ -0,0 +1,330 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "constraint6.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xalloc.h"
+
+#define STRIDE 6
+// the top bits index a table straight to the node or leaf below them
+#define DIRECT_BITS 16
+#define DIRECT_LEAF 0x80000000U
+
+typedef unsigned __int128 u128;
+
+typedef struct constraint6_node {
+	// slots with a child node
+	uint64_t vector;
+	// leaf slots whose value differs from that of the leaf slot before
+	uint64_t leafvec;
+	// the first leaf and child of this node
+	uint32_t base0;
+	uint32_t base1;
+} constraint6_node_t;
+
+struct constraint6 {
+	// a node index, or DIRECT_LEAF and the value
+	uint32_t direct[1 << DIRECT_BITS];
+	constraint6_node_t *nodes;
+	uint32_t nodes_len;
+	uint32_t nodes_cap;
+	uint8_t *leaves;
+	uint32_t leaves_len;
+	uint32_t leaves_cap;
+};
+
+// a prefix as the addresses from start to end
+struct range {
+	u128 start;
+	u128 end;
+	int len;
+};
+
+// the prefixes of one value while building, sorted and none inside another
+struct ranges {
+	struct range *r;
+	size_t len;
+};
+
+static inline u128 load_addr(const struct in6_addr *a)
+{
+	u128 v = 0;
+	for (int i = 0; i < 16; i++) {
+		v = v << 8 | a->s6_addr[i];
+	}
+	return v;
+}
+
+// the low n bits set
+static inline u128 ones(int n)
+{
+	if (n <= 0) {
+		return 0;
+	}
+	return n >= 128 ? ~(u128)0 : ((u128)1 << n) - 1;
+}
+
+static inline int stride_at(int depth)
+{
+	return depth + STRIDE <= 128 ? STRIDE : 128 - depth;
+}
+
+static int range_cmp(const void *x, const void *y)
+{
+	const struct range *a = x, *b = y;
+	if (a->start != b->start) {
+		return a->start < b->start ? -1 : 1;
+	}
+	return a->len - b->len;
+}
+
+// sorts the prefixes of one value and drops those inside an earlier one
+static struct ranges collect(const constraint6_prefix_t *prefixes, size_t len,
+			     int allowed)
+{
+	struct ranges out = {
+	    .r = xmalloc_tag(MEM_CONSTRAINT, (len + 1) * sizeof(struct range)),
+	    .len = 0};
+	for (size_t i = 0; i < len; i++) {
+		if (!!prefixes[i].allowed != allowed) {
+			continue;
+		}
+		int l = prefixes[i].len > 128 ? 128 : prefixes[i].len;
+		u128 host = ones(128 - l);
+		struct range *r = &out.r[out.len++];
+		r->start = load_addr(&prefixes[i].prefix) & ~host;
+		r->end = r->start | host;
+		r->len = l;
+	}
+	qsort(out.r, out.len, sizeof(struct range), range_cmp);
+	size_t kept = 0;
+	for (size_t i = 0; i < out.len; i++) {
+		if (kept && out.r[i].end <= out.r[kept - 1].end) {
+			continue;
+		}
+		out.r[kept++] = out.r[i];
+	}
+	out.len = kept;
+	return out;
+}
+
+typedef struct builder {
+	constraint6_t *con;
+	struct ranges allow;
+	struct ranges block;
+	// whether anything is allowed without an allowed prefix over it
+	int default_allowed;
+} builder_t;
+
+// how one slot of a node is resolved
+struct slot {
+	int child;
+	uint8_t value;
+	int allow_cov;
+	size_t a0, a1, b0, b1;
+};
+
+static uint32_t reserve_nodes(constraint6_t *con, uint32_t n)
+{
+	uint32_t first = con->nodes_len;
+	if (con->nodes_len + n > con->nodes_cap) {
+		while (con->nodes_len + n > con->nodes_cap) {
+			con->nodes_cap *= 2;
+		}
+		con->nodes = xrealloc_tag(MEM_CONSTRAINT, con->nodes,
+					  con->nodes_cap *
+					      sizeof(constraint6_node_t));
+	}
+	memset(&con->nodes[first], 0, n * sizeof(constraint6_node_t));
+	con->nodes_len += n;
+	return first;
+}
+
+static void add_leaf(constraint6_t *con, uint8_t value)
+{
+	if (con->leaves_len == con->leaves_cap) {
+		con->leaves_cap *= 2;
+		con->leaves =
+		    xrealloc_tag(MEM_CONSTRAINT, con->leaves, con->leaves_cap);
+	}
+	con->leaves[con->leaves_len++] = value;
+}
+
+// Resolves the slot of the addresses from lo to hi, which ends end bits
+// in, from the allowed prefixes from *ai to a1 and disallowed ones from *bi
+// to b1, all longer than the slot's parent and sorted; allow_cov is set if
+// an allowed prefix covers the parent. Slots must come in order, so that
+// *ai and *bi move on past the prefixes before them.
+static void resolve_slot(const builder_t *b, u128 lo, u128 hi, int end,
+			 int allow_cov, size_t *ai, size_t a1, size_t *bi,
+			 size_t b1, struct slot *s)
+{
+	const struct range *allow = b->allow.r;
+	const struct range *block = b->block.r;
+	// a prefix spanning several slots stays at the front until the slots
+	// are past its end
+	while (*bi < b1 && block[*bi].end < lo) {
+		(*bi)++;
+	}
+	size_t bj = *bi;
+	int block_cov = 0;
+	while (bj < b1 && block[bj].start <= hi) {
+		block_cov |= block[bj].len <= end;
+		bj++;
+	}
+	while (*ai < a1 && allow[*ai].end < lo) {
+		(*ai)++;
+	}
+	size_t aj = *ai;
+	int acov = allow_cov;
+	while (aj < a1 && allow[aj].start <= hi) {
+		acov |= allow[aj].len <= end;
+		aj++;
+	}
+	memset(s, 0, sizeof(*s));
+	if (block_cov) {
+		s->value = 0;
+	} else if (bj == *bi && (acov || b->default_allowed || aj == *ai)) {
+		s->value = (uint8_t)(acov || b->default_allowed);
+	} else {
+		// what is allowed in the slot depends on longer prefixes
+		s->child = 1;
+		s->allow_cov = acov;
+		s->a0 = acov ? 0 : *ai;
+		s->a1 = acov ? 0 : aj;
+		s->b0 = *bi;
+		s->b1 = bj;
+	}
+}
+
+// Fills node n, covering the addresses from base at depth bits in, from
+// the allowed prefixes a0 to a1 and disallowed ones b0 to b1 below it, all
+// longer than depth; allow_cov is set if an allowed prefix covers it all
+static void build_node(builder_t *b, uint32_t n, u128 base, int depth,
+		       int allow_cov, size_t a0, size_t a1, size_t b0,
+		       size_t b1)
+{
+	const int stride = stride_at(depth);
+	const int shift = 128 - depth - stride;
+	const int num_slots = 1 << stride;
+	struct slot slots[1 << STRIDE];
+	size_t ai = a0, bi = b0;
+	uint32_t children = 0;
+	for (int i = 0; i < num_slots; i++) {
+		u128 lo = base | ((u128)i << shift);
+		resolve_slot(b, lo, lo | ones(shift), depth + stride, allow_cov,
+			     &ai, a1, &bi, b1, &slots[i]);
+		children += (uint32_t)slots[i].child;
+	}
+
+	constraint6_t *con = b->con;
+	uint64_t vector = 0, leafvec = 0;
+	uint32_t base0 = con->leaves_len;
+	int have_leaf = 0;
+	uint8_t last = 0;
+	for (int i = 0; i < num_slots; i++) {
+		if (slots[i].child) {
+			vector |= 1ULL << i;
+		} else if (!have_leaf || slots[i].value != last) {
+			leafvec |= 1ULL << i;
+			add_leaf(con, slots[i].value);
+			last = slots[i].value;
+			have_leaf = 1;
+		}
+	}
+	uint32_t base1 = reserve_nodes(con, children);
+	con->nodes[n] = (constraint6_node_t){
+	    .vector = vector, .leafvec = leafvec, .base0 = base0, .base1 = base1};
+	uint32_t c = 0;
+	for (int i = 0; i < num_slots; i++) {
+		const struct slot *s = &slots[i];
+		if (s->child) {
+			build_node(b, base1 + c++, base | ((u128)i << shift),
+				   depth + stride, s->allow_cov, s->a0, s->a1,
+				   s->b0, s->b1);
+		}
+	}
+}
+
+constraint6_t *constraint6_build(int default_allowed,
+				 const constraint6_prefix_t *prefixes,
+				 size_t len)
+{
+	constraint6_t *con = xcalloc_tag(MEM_CONSTRAINT, 1, sizeof(*con));
+	con->nodes_cap = 64;
+	con->nodes = xmalloc_tag(MEM_CONSTRAINT,
+				 con->nodes_cap * sizeof(constraint6_node_t));
+	con->leaves_cap = 256;
+	con->leaves = xmalloc_tag(MEM_CONSTRAINT, con->leaves_cap);
+	builder_t b = {.con = con,
+		       .allow = collect(prefixes, len, 1),
+		       .block = collect(prefixes, len, 0),
+		       .default_allowed = default_allowed};
+	// the direct table is the root, with a slot per DIRECT_BITS prefix
+	size_t ai = 0, bi = 0;
+	const int shift = 128 - DIRECT_BITS;
+	for (uint32_t i = 0; i < (1U << DIRECT_BITS); i++) {
+		struct slot s;
+		u128 lo = (u128)i << shift;
+		resolve_slot(&b, lo, lo | ones(shift), DIRECT_BITS, 0, &ai,
+			     b.allow.len, &bi, b.block.len, &s);
+		if (!s.child) {
+			con->direct[i] = DIRECT_LEAF | s.value;
+			continue;
+		}
+		uint32_t n = reserve_nodes(con, 1);
+		con->direct[i] = n;
+		build_node(&b, n, lo, DIRECT_BITS, s.allow_cov, s.a0, s.a1,
+			   s.b0, s.b1);
+	}
+	xfree_tag(MEM_CONSTRAINT, b.allow.r);
+	xfree_tag(MEM_CONSTRAINT, b.block.r);
+	return con;
+}
+
+int constraint6_is_allowed(const constraint6_t *con,
+			   const struct in6_addr *addr)
+{
+	u128 a = load_addr(addr);
+	uint32_t d = con->direct[(uint32_t)(a >> (128 - DIRECT_BITS))];
+	if (d & DIRECT_LEAF) {
+		return (int)(d & 1);
+	}
+	const constraint6_node_t *node = &con->nodes[d];
+	int depth = DIRECT_BITS;
+	while (1) {
+		int stride = stride_at(depth);
+		uint32_t i = (uint32_t)(a >> (128 - depth - stride)) &
+			     ((1U << stride) - 1);
+		// the slots up to and including i; 2 << 63 wraps to all ones
+		uint64_t upto = (2ULL << i) - 1;
+		if (node->vector >> i & 1) {
+			node = &con->nodes[node->base1 +
+					   __builtin_popcountll(node->vector &
+								upto) -
+					   1];
+			depth += stride;
+			continue;
+		}
+		return con->leaves[node->base0 +
+				   __builtin_popcountll(node->leafvec & upto) -
+				   1];
+	}
+}
+
+uint32_t constraint6_nodes(const constraint6_t *con) { return con->nodes_len; }
+
+void constraint6_free(constraint6_t *con)
+{
+	xfree_tag(MEM_CONSTRAINT, con->nodes);
+	xfree_tag(MEM_CONSTRAINT, con->leaves);
+	xfree_tag(MEM_CONSTRAINT, con);
+}
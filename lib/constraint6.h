@@ -0,0 +1,46 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef CONSTRAINT6_H
+#define CONSTRAINT6_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+// The IPv6 counterpart of constraint.h for the allowlist and blocklist: a
+// poptrie over the 128-bit address space, built once from the prefixes in
+// bulk and read-only after. A table indexed by the top 16 bits of an
+// address leads to its leaf or first node. Each node looks up the next 6
+// bits in two 64-bit vectors, one of the slots that have a child node and
+// one of where runs of equal leaves start, and finds the child or leaf with
+// a popcount into arrays kept contiguous per node, so a lookup touches the
+// table and one 24-byte node per 6 bits down to the longest prefix under
+// the address, 6 of them for a /48.
+
+typedef struct constraint6 constraint6_t;
+
+typedef struct constraint6_prefix {
+	struct in6_addr prefix;
+	uint8_t len;
+	uint8_t allowed;
+} constraint6_prefix_t;
+
+// Addresses no prefix covers are allowed if default_allowed is set; a
+// disallowed prefix takes precedence over any allowed one it overlaps, as
+// blocklist entries do over allowlist entries. Prefixes may come in any
+// order and nest.
+constraint6_t *constraint6_build(int default_allowed,
+				 const constraint6_prefix_t *prefixes,
+				 size_t len);
+int constraint6_is_allowed(const constraint6_t *con,
+			   const struct in6_addr *addr);
+uint32_t constraint6_nodes(const constraint6_t *con);
+void constraint6_free(constraint6_t *con);
+
+#endif // CONSTRAINT6_H
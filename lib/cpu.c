@@ -0,0 +1,169 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "cpu.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logger.h"
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#if defined(__APPLE__)
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#elif defined(__FreeBSD__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON 0x00001000
+#endif
+#ifndef HWCAP2_AES
+#define HWCAP2_AES 0x00000001
+#endif
+#elif defined(__linux__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON 0x00000010
+#endif
+#ifndef HWCAP_AES
+#define HWCAP_AES 0x00001000
+#endif
+#else
+#warning "Runtime detection of AES hardware acceleration not implemented for platform"
+#endif
+#endif
+
+static const struct {
+	const char *name;
+	uint32_t flag;
+} cpu_feature_names[] = {
+    {"aesni", CPU_AESNI}, {"avx2", CPU_AVX2},	   {"avx512", CPU_AVX512},
+    {"neon", CPU_NEON},	  {"arm-aes", CPU_ARM_AES},
+};
+#define NUM_CPU_FEATURES \
+	(sizeof(cpu_feature_names) / sizeof(cpu_feature_names[0]))
+
+static uint32_t detected;
+static uint32_t allowed = UINT32_MAX;
+static pthread_once_t cpu_inited = PTHREAD_ONCE_INIT;
+
+#if defined(__aarch64__)
+static int cpu_arm_aes(void)
+{
+#if defined(__APPLE__)
+	int value = 0;
+	size_t value_len = sizeof(value);
+	if (sysctlbyname("hw.optional.arm.FEAT_AES", &value, &value_len, NULL,
+			 0) == -1) {
+		return 0;
+	}
+	assert(value_len == sizeof(value));
+	return value != 0;
+#elif defined(__FreeBSD__)
+	unsigned long hwcap = 0, hwcap2 = 0;
+	elf_aux_info(AT_HWCAP, &hwcap, sizeof(hwcap));
+	elf_aux_info(AT_HWCAP2, &hwcap2, sizeof(hwcap2));
+	return (hwcap & HWCAP_NEON) && (hwcap2 & HWCAP2_AES);
+#elif defined(__linux__)
+	unsigned long hwcap = getauxval(AT_HWCAP);
+	return (hwcap & HWCAP_NEON) && (hwcap & HWCAP_AES);
+#else
+	return 1;
+#endif
+}
+#endif
+
+static void cpu_init_once(void)
+{
+#if defined(__x86_64__)
+	static const uint32_t flag_cpuid_ecx_aesni = 0x02000000;
+	uint32_t eax = 0, ebx = 0, ecx = 0, edx = 0;
+	__cpuid(1, eax, ebx, ecx, edx);
+	if (ecx & flag_cpuid_ecx_aesni) {
+		detected |= CPU_AESNI;
+	}
+	// these also check that the OS saves the wider registers
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		detected |= CPU_AVX2;
+	}
+	if (__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw")) {
+		detected |= CPU_AVX512;
+	}
+#elif defined(__aarch64__)
+	// Advanced SIMD is part of the AArch64 baseline
+	detected |= CPU_NEON;
+	if (cpu_arm_aes()) {
+		detected |= CPU_ARM_AES;
+	}
+#endif
+	char buf[128];
+	cpu_features_str(detected, buf, sizeof(buf));
+	log_debug("cpu", "CPU features: %s", buf);
+}
+
+uint32_t cpu_detected(void)
+{
+	pthread_once(&cpu_inited, cpu_init_once);
+	return detected;
+}
+
+uint32_t cpu_features(void)
+{
+	return cpu_detected() & allowed;
+}
+
+int cpu_restrict(const char *list)
+{
+	uint32_t mask = 0;
+	if (strcmp(list, "none")) {
+		char *dup = strdup(list);
+		char *save = NULL;
+		for (char *tok = strtok_r(dup, ",", &save); tok;
+		     tok = strtok_r(NULL, ",", &save)) {
+			size_t i = 0;
+			while (i < NUM_CPU_FEATURES &&
+			       strcmp(tok, cpu_feature_names[i].name)) {
+				i++;
+			}
+			if (i == NUM_CPU_FEATURES) {
+				log_error("cpu", "unknown CPU feature '%s'", tok);
+				free(dup);
+				return -1;
+			}
+			mask |= cpu_feature_names[i].flag;
+		}
+		free(dup);
+	}
+	allowed = mask;
+	char buf[128];
+	cpu_features_str(cpu_features(), buf, sizeof(buf));
+	log_debug("cpu", "kernels limited to CPU features: %s", buf);
+	return 0;
+}
+
+void cpu_features_str(uint32_t mask, char *buf, size_t len)
+{
+	size_t n = 0;
+	buf[0] = '\0';
+	for (size_t i = 0; i < NUM_CPU_FEATURES && n < len; i++) {
+		if (mask & cpu_feature_names[i].flag) {
+			n += snprintf(buf + n, len - n, "%s%s", n ? "," : "",
+				      cpu_feature_names[i].name);
+		}
+	}
+	if (!n) {
+		snprintf(buf, len, "none");
+	}
+}
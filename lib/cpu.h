@@ -0,0 +1,41 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_CPU_H
+#define ZMAP_CPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The ISA extensions the hot kernels (AES, checksums, hex encoding) have
+// variants for. The CPU is probed once, and each kernel picks its variant
+// from cpu_features() the first time it runs, so a single binary takes
+// whatever the machine it runs on has.
+#define CPU_AESNI (1u << 0)
+#define CPU_AVX2 (1u << 1)
+// AVX-512 F and BW
+#define CPU_AVX512 (1u << 2)
+#define CPU_NEON (1u << 3)
+#define CPU_ARM_AES (1u << 4)
+
+// what the CPU has
+uint32_t cpu_detected(void);
+// what the kernels may use: what the CPU has, less what cpu_restrict()
+// took away
+uint32_t cpu_features(void);
+
+// --cpu-features: limit the kernels to the comma-separated features of
+// list, or to their generic code with "none", for instance to benchmark
+// one variant against another. Has to come before the first kernel runs.
+// -1 for a name that isn't a feature.
+int cpu_restrict(const char *list);
+
+// the names of the features of mask, comma-separated, or "none"
+void cpu_features_str(uint32_t mask, char *buf, size_t len);
+
+#endif /* ZMAP_CPU_H */
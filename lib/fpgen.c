@@ -0,0 +1,97 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "fpgen.h"
+
+#include <assert.h>
+
+#include "xalloc.h"
+
+// the keys a generation starts with room for before the first one has
+// been dropped, after which each starts the size of the one it replaces
+#define FPGEN_INITIAL_KEYS 4096
+
+fpgen_t *fpgen_init(uint64_t window_ns)
+{
+	fpgen_t *g = xcalloc_tag(MEM_DEDUP_WINDOW, 1, sizeof(fpgen_t));
+	g->span_ns = window_ns / (FPGEN_GENERATIONS - 1);
+	if (!g->span_ns) {
+		g->span_ns = 1;
+	}
+	for (unsigned i = 0; i < FPGEN_GENERATIONS; i++) {
+		g->gens[i] = fpset_init(FPGEN_INITIAL_KEYS, MEM_DEDUP_WINDOW);
+	}
+	return g;
+}
+
+size_t fpgen_bytes(uint64_t window_ns, uint64_t keys_per_sec)
+{
+	uint64_t keys = (uint64_t)((double)keys_per_sec * (double)window_ns /
+				   1e9 / (FPGEN_GENERATIONS - 1));
+	if (keys < FPGEN_INITIAL_KEYS) {
+		keys = FPGEN_INITIAL_KEYS;
+	}
+	return sizeof(fpgen_t) + FPGEN_GENERATIONS * fpset_bytes(keys);
+}
+
+static void fpgen_rotate(fpgen_t *g)
+{
+	unsigned oldest = (g->newest + 1) % FPGEN_GENERATIONS;
+	uint64_t count = g->gens[oldest]->count;
+	g->expired += count;
+	fpset_free(g->gens[oldest]);
+	g->gens[oldest] = fpset_init(count, MEM_DEDUP_WINDOW);
+	g->newest = oldest;
+}
+
+int fpgen_check_and_set(fpgen_t *g, uint64_t fp, uint64_t now_ns)
+{
+	if (!g->start_ns) {
+		g->start_ns = now_ns;
+	}
+	// after a long quiet stretch every generation may be out of date,
+	// but there are only so many to drop
+	for (unsigned i = 0;
+	     now_ns >= g->start_ns + g->span_ns && i < FPGEN_GENERATIONS; i++) {
+		fpgen_rotate(g);
+		g->start_ns += g->span_ns;
+	}
+	if (now_ns >= g->start_ns + g->span_ns) {
+		g->start_ns = now_ns;
+	}
+	fpset_t *newest = g->gens[g->newest];
+	if (fpset_check(newest, fp)) {
+		return 1;
+	}
+	int seen = 0;
+	for (unsigned i = 1; i < FPGEN_GENERATIONS && !seen; i++) {
+		unsigned gen = (g->newest + FPGEN_GENERATIONS - i) %
+			       FPGEN_GENERATIONS;
+		seen = fpset_check(g->gens[gen], fp);
+	}
+	fpset_set(newest, fp);
+	return seen;
+}
+
+uint64_t fpgen_count(const fpgen_t *g)
+{
+	uint64_t n = 0;
+	for (unsigned i = 0; i < FPGEN_GENERATIONS; i++) {
+		n += g->gens[i]->count;
+	}
+	return n;
+}
+
+void fpgen_free(fpgen_t *g)
+{
+	assert(g);
+	for (unsigned i = 0; i < FPGEN_GENERATIONS; i++) {
+		fpset_free(g->gens[i]);
+	}
+	xfree_tag(MEM_DEDUP_WINDOW, g);
+}
@@ -0,0 +1,47 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_FPGEN_H
+#define ZMAP_FPGEN_H
+
+#include <stdint.h>
+
+#include "fpset.h"
+
+// Window of the 64-bit fingerprints seen over the last stretch of time,
+// used for --dedup-window-time. The fingerprints are kept in
+// FPGEN_GENERATIONS fpsets, each taking the new keys of one span of
+// window / (FPGEN_GENERATIONS - 1). Once the newest has been current for a
+// span, the oldest is dropped whole and a new one takes its place, so a
+// key is remembered for at least the window and at most a span longer,
+// whatever the response rate, and memory follows the keys of the window.
+// Seeing a key again carries it into the newest generation. Times are
+// whatever clock the caller's are, in nanoseconds. Not thread safe.
+#define FPGEN_GENERATIONS 4
+
+typedef struct fpgen {
+	fpset_t *gens[FPGEN_GENERATIONS];
+	unsigned newest;
+	uint64_t span_ns;
+	// when the newest generation became current, 0 before the first key
+	uint64_t start_ns;
+	// keys dropped with their generation
+	uint64_t expired;
+} fpgen_t;
+
+fpgen_t *fpgen_init(uint64_t window_ns);
+// bytes of a window taking in keys_per_sec new keys
+size_t fpgen_bytes(uint64_t window_ns, uint64_t keys_per_sec);
+// Return 1 if fp was seen within the window as of now_ns, otherwise add it
+// and return 0
+int fpgen_check_and_set(fpgen_t *g, uint64_t fp, uint64_t now_ns);
+// keys currently held, repeats in several generations counted in each
+uint64_t fpgen_count(const fpgen_t *g);
+void fpgen_free(fpgen_t *g);
+
+#endif /* ZMAP_FPGEN_H */
@@ -0,0 +1,97 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "fpset.h"
+
+#include <assert.h>
+
+#include "xalloc.h"
+
+#define FPSET_MIN_SLOTS 1024
+
+static uint64_t fpset_slots(uint64_t expected)
+{
+	uint64_t slots = FPSET_MIN_SLOTS;
+	while (slots / 2 < expected) {
+		slots <<= 1;
+	}
+	return slots;
+}
+
+size_t fpset_bytes(uint64_t expected)
+{
+	return sizeof(fpset_t) + fpset_slots(expected) * sizeof(uint64_t);
+}
+
+fpset_t *fpset_init(uint64_t expected, mem_tag_t tag)
+{
+	uint64_t slots = fpset_slots(expected);
+	fpset_t *set = xmalloc_tag(tag, sizeof(fpset_t));
+	set->slots = xcalloc_tag(tag, slots, sizeof(uint64_t));
+	set->mask = slots - 1;
+	set->count = 0;
+	set->tag = tag;
+	return set;
+}
+
+int fpset_check(const fpset_t *set, uint64_t fp)
+{
+	uint64_t key = fpset_key(fp);
+	for (uint64_t i = key & set->mask;; i = (i + 1) & set->mask) {
+		if (set->slots[i] == key) {
+			return 1;
+		}
+		if (!set->slots[i]) {
+			return 0;
+		}
+	}
+}
+
+static void fpset_insert(uint64_t *slots, uint64_t mask, uint64_t key)
+{
+	uint64_t i = key & mask;
+	while (slots[i] && slots[i] != key) {
+		i = (i + 1) & mask;
+	}
+	slots[i] = key;
+}
+
+static void fpset_grow(fpset_t *set)
+{
+	uint64_t old_slots = set->mask + 1;
+	uint64_t mask = old_slots * 2 - 1;
+	uint64_t *slots = xcalloc_tag(set->tag, old_slots * 2, sizeof(uint64_t));
+	for (uint64_t i = 0; i < old_slots; i++) {
+		if (set->slots[i]) {
+			fpset_insert(slots, mask, set->slots[i]);
+		}
+	}
+	xfree_tag(set->tag, set->slots);
+	set->slots = slots;
+	set->mask = mask;
+}
+
+void fpset_set(fpset_t *set, uint64_t fp)
+{
+	if (fpset_check(set, fp)) {
+		return;
+	}
+	// keep the load factor at or below one half
+	if ((set->count + 1) * 2 > set->mask + 1) {
+		fpset_grow(set);
+	}
+	fpset_insert(set->slots, set->mask, fpset_key(fp));
+	set->count++;
+}
+
+void fpset_free(fpset_t *set)
+{
+	assert(set);
+	xfree_tag(set->tag, set->slots);
+	xfree_tag(set->tag, set);
+}
@@ -0,0 +1,48 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_FPSET_H
+#define ZMAP_FPSET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xalloc.h"
+
+// Set of 64-bit fingerprints in a linear-probing open-addressing table.
+// Used where a bitmap over the key space isn't possible, e.g. to
+// deduplicate IPv6 responses. Each entry costs 8 bytes at no more than half
+// load, so memory follows the number of keys actually inserted rather than
+// the size of the key space. Two keys with the same fingerprint are
+// indistinguishable, which for 64-bit fingerprints is negligible.
+// Not thread safe.
+typedef struct fpset {
+	uint64_t *slots; // 0 marks an empty slot
+	uint64_t mask;   // number of slots - 1, always a power of two
+	uint64_t count;
+	mem_tag_t tag;
+} fpset_t;
+
+// The fingerprint stored for fp. The empty marker can't be stored, so it
+// is remapped to an arbitrary other value. Fingerprints are assumed to be
+// well mixed already. Shared with fpwindow, which marks empty ways the same.
+static inline uint64_t fpset_key(uint64_t fp)
+{
+	return fp ? fp : 0x9e3779b97f4a7c15ULL;
+}
+
+// Create a set with room for about *expected* keys before it first grows,
+// its memory accounted to tag
+fpset_t *fpset_init(uint64_t expected, mem_tag_t tag);
+// bytes of a set holding expected keys
+size_t fpset_bytes(uint64_t expected);
+int fpset_check(const fpset_t *set, uint64_t fp);
+void fpset_set(fpset_t *set, uint64_t fp);
+void fpset_free(fpset_t *set);
+
+#endif /* ZMAP_FPSET_H */
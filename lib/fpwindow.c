@@ -0,0 +1,79 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "fpwindow.h"
+
+#include <assert.h>
+
+#include "fpset.h"
+#include "xalloc.h"
+
+_Static_assert(sizeof(fpwindow_bucket_t) == 64,
+	       "fpwindow buckets must be one cache line");
+
+static uint64_t fpwindow_buckets(size_t size)
+{
+	uint64_t buckets = 1;
+	while (buckets * FPWINDOW_WAYS < size) {
+		buckets <<= 1;
+	}
+	return buckets;
+}
+
+size_t fpwindow_bytes(size_t size)
+{
+	return sizeof(fpwindow_t) +
+	       fpwindow_buckets(size) * sizeof(fpwindow_bucket_t);
+}
+
+fpwindow_t *fpwindow_init(size_t size)
+{
+	uint64_t buckets = fpwindow_buckets(size);
+	fpwindow_t *w = xmalloc_tag(MEM_DEDUP_WINDOW, sizeof(fpwindow_t));
+	w->buckets = xmalloc_aligned_tag(MEM_DEDUP_WINDOW,
+					 sizeof(fpwindow_bucket_t),
+					 buckets * sizeof(fpwindow_bucket_t));
+	w->mask = buckets - 1;
+	return w;
+}
+
+int fpwindow_check_and_set(fpwindow_t *w, uint64_t fp)
+{
+	uint64_t key = fpset_key(fp);
+	fpwindow_bucket_t *b = &w->buckets[key & w->mask];
+	int empty = -1;
+	for (int i = 0; i < FPWINDOW_WAYS; i++) {
+		if (b->fp[i] == key) {
+			b->ref |= (uint8_t)(1 << i);
+			return 1;
+		}
+		if (!b->fp[i] && empty < 0) {
+			empty = i;
+		}
+	}
+	if (empty < 0) {
+		// every way is taken: give each referenced entry a second
+		// chance until one that wasn't is found
+		while (b->ref & (1 << b->hand)) {
+			b->ref &= (uint8_t)~(1 << b->hand);
+			b->hand = (uint8_t)((b->hand + 1) % FPWINDOW_WAYS);
+		}
+		empty = b->hand;
+		b->hand = (uint8_t)((b->hand + 1) % FPWINDOW_WAYS);
+	}
+	b->fp[empty] = key;
+	b->ref &= (uint8_t)~(1 << empty);
+	return 0;
+}
+
+void fpwindow_free(fpwindow_t *w)
+{
+	assert(w);
+	xfree_tag(MEM_DEDUP_WINDOW, w->buckets);
+	xfree_tag(MEM_DEDUP_WINDOW, w);
+}
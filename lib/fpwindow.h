@@ -0,0 +1,45 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_FPWINDOW_H
+#define ZMAP_FPWINDOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed-size window of recently seen 64-bit fingerprints, used for
+// --dedup-method window. The table is an array of cache-line buckets, each
+// holding FPWINDOW_WAYS fingerprints and their CLOCK reference bits. A key
+// only ever lives in the bucket its fingerprint selects, so a lookup touches
+// one cache line, and when that bucket is full the CLOCK hand evicts the
+// first entry that hasn't been seen since the hand last passed it. Nothing
+// is allocated after initialization. Not thread safe.
+#define FPWINDOW_WAYS 7
+
+typedef struct fpwindow_bucket {
+	uint64_t fp[FPWINDOW_WAYS]; // 0 marks an empty way
+	uint8_t ref;		    // CLOCK reference bit per way
+	uint8_t hand;		    // next way to consider for eviction
+	uint8_t pad[6];
+} __attribute__((aligned(64))) fpwindow_bucket_t;
+
+typedef struct fpwindow {
+	fpwindow_bucket_t *buckets;
+	uint64_t mask; // number of buckets - 1, always a power of two
+} fpwindow_t;
+
+// Create a window that holds at least *size* fingerprints
+fpwindow_t *fpwindow_init(size_t size);
+// bytes fpwindow_init(size) allocates
+size_t fpwindow_bytes(size_t size);
+// Return 1 if fp is in the window, marking it recently used. Otherwise add
+// it, evicting an older entry if needed, and return 0.
+int fpwindow_check_and_set(fpwindow_t *w, uint64_t fp);
+void fpwindow_free(fpwindow_t *w);
+
+#endif /* ZMAP_FPWINDOW_H */
@@ -0,0 +1,133 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "hugemem.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "logger.h"
+
+#define HUGE_2M ((size_t)1 << 21)
+#define HUGE_1G ((size_t)1 << 30)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+static int enabled = 1;
+static uint64_t usage_bytes[HUGEMEM_KINDS];
+
+static const char *kind_names[HUGEMEM_KINDS] = {
+    "normal pages", "transparent huge pages", "2 MiB huge pages",
+    "1 GiB huge pages"};
+
+void hugemem_set_enabled(int e) { enabled = e; }
+
+static size_t round_up(size_t size, size_t page)
+{
+	return (size + page - 1) & ~(page - 1);
+}
+
+#ifdef MAP_HUGETLB
+// at most half of the last page goes to waste
+static int try_huge(hugemem_t *m, size_t size, size_t page, int log2, int kind)
+{
+	if (size < page / 2) {
+		return 0;
+	}
+	size_t len = round_up(size, page);
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+			   (log2 << MAP_HUGE_SHIFT),
+		       -1, 0);
+	if (p == MAP_FAILED) {
+		log_debug("hugemem", "no %s for %zu bytes: %s",
+			  kind_names[kind], size, strerror(errno));
+		return 0;
+	}
+	m->addr = p;
+	m->len = len;
+	m->kind = kind;
+	return 1;
+}
+#endif
+
+void *hugemem_alloc(hugemem_t *m, mem_tag_t tag, size_t size)
+{
+	memset(m, 0, sizeof(*m));
+	m->tag = tag;
+#ifdef MAP_HUGETLB
+	if (enabled && !try_huge(m, size, HUGE_1G, 30, HUGEMEM_1G)) {
+		try_huge(m, size, HUGE_2M, 21, HUGEMEM_2M);
+	}
+#endif
+	if (!m->addr) {
+		size_t len = round_up(size, (size_t)sysconf(_SC_PAGESIZE));
+		void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			log_fatal("hugemem", "unable to map %zu bytes: %s", len,
+				  strerror(errno));
+		}
+		m->addr = p;
+		m->len = len;
+		m->kind = HUGEMEM_NORMAL;
+#ifdef MADV_HUGEPAGE
+		if (enabled && len >= HUGE_2M &&
+		    !madvise(p, len, MADV_HUGEPAGE)) {
+			m->kind = HUGEMEM_THP;
+		}
+#endif
+	}
+	// fault it all in now rather than on the first packets
+	memset(m->addr, 0, m->len);
+	__atomic_add_fetch(&usage_bytes[m->kind], m->len, __ATOMIC_RELAXED);
+	xalloc_account(tag, (int64_t)m->len);
+	return m->addr;
+}
+
+void hugemem_free(hugemem_t *m)
+{
+	if (!m->addr) {
+		return;
+	}
+	munmap(m->addr, m->len);
+	__atomic_sub_fetch(&usage_bytes[m->kind], m->len, __ATOMIC_RELAXED);
+	xalloc_account(m->tag, -(int64_t)m->len);
+	m->addr = NULL;
+	m->len = 0;
+}
+
+void hugemem_usage(uint64_t usage[HUGEMEM_KINDS])
+{
+	for (int i = 0; i < HUGEMEM_KINDS; i++) {
+		usage[i] = __atomic_load_n(&usage_bytes[i], __ATOMIC_RELAXED);
+	}
+}
+
+void hugemem_report(const char *module)
+{
+	uint64_t usage[HUGEMEM_KINDS];
+	hugemem_usage(usage);
+	char buf[256];
+	size_t len = 0;
+	for (int i = HUGEMEM_KINDS - 1; i >= 0; i--) {
+		if (usage[i] && len < sizeof(buf)) {
+			len += snprintf(buf + len, sizeof(buf) - len, "%s%.1f MiB on %s",
+					len ? ", " : "",
+					usage[i] / (double)(1 << 20), kind_names[i]);
+		}
+	}
+	if (len) {
+		log_info(module, "packet buffers: %s", buf);
+	}
+}
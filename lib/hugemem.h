@@ -0,0 +1,47 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_HUGEMEM_H
+#define ZMAP_HUGEMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "xalloc.h"
+
+// Anonymous memory for buffers touched on every packet (send batches, XDP
+// UMEM, the receive side's rings), on explicit 1 GiB or 2 MiB huge pages
+// when vm.nr_hugepages (or hugepages-1048576kB) has some reserved and the
+// area is big enough to fill most of one, otherwise on normal pages with
+// transparent huge pages asked for. Always page aligned and zeroed.
+#define HUGEMEM_NORMAL 0
+#define HUGEMEM_THP 1
+#define HUGEMEM_2M 2
+#define HUGEMEM_1G 3
+#define HUGEMEM_KINDS 4
+
+typedef struct hugemem {
+	void *addr;
+	size_t len; // as mapped, rounded up to the page size
+	int kind;
+	mem_tag_t tag;
+} hugemem_t;
+
+// huge pages are tried unless disabled (--no-hugepages) before allocating
+void hugemem_set_enabled(int enabled);
+
+// size bytes into m, accounted to tag, exits on failure
+void *hugemem_alloc(hugemem_t *m, mem_tag_t tag, size_t size);
+void hugemem_free(hugemem_t *m);
+
+// bytes currently mapped of each kind
+void hugemem_usage(uint64_t usage[HUGEMEM_KINDS]);
+// logs hugemem_usage at info level
+void hugemem_report(const char *module);
+
+#endif /* ZMAP_HUGEMEM_H */
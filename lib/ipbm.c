@@ -0,0 +1,160 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "ipbm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "xalloc.h"
+
+int ipbm_is_file(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	char magic[IPBM_MAGIC_LEN];
+	int is = read(fd, magic, sizeof(magic)) == sizeof(magic) &&
+		 !memcmp(magic, IPBM_MAGIC, IPBM_MAGIC_LEN);
+	close(fd);
+	return is;
+}
+
+uint32_t ipbm_page_number(const ipbm_t *b, uint32_t i)
+{
+	uint32_t n;
+	memcpy(&n, b->index + (size_t)i * sizeof(n), sizeof(n));
+	return ntohl(n);
+}
+
+static int check(ipbm_t *b)
+{
+	struct ipbm_header h;
+	if (b->map_len < sizeof(h)) {
+		return -1;
+	}
+	memcpy(&h, b->map, sizeof(h));
+	if (memcmp(h.magic, IPBM_MAGIC, IPBM_MAGIC_LEN) ||
+	    ntohl(h.version) != IPBM_VERSION) {
+		return -1;
+	}
+	b->pages = ntohl(h.pages);
+	b->count = (uint64_t)ntohl(h.count_hi) << 32 | ntohl(h.count_lo);
+	if (b->pages > IPBM_PAGES ||
+	    b->map_len != sizeof(h) + (size_t)b->pages * (4 + IPBM_PAGE_BYTES)) {
+		return -1;
+	}
+	b->index = (const uint8_t *)b->map + sizeof(h);
+	b->bits = b->index + (size_t)b->pages * 4;
+	for (uint32_t i = 0; i < b->pages; i++) {
+		uint32_t n = ipbm_page_number(b, i);
+		if (n >= IPBM_PAGES || (i && n <= ipbm_page_number(b, i - 1))) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int ipbm_open(ipbm_t *b, const char *path)
+{
+	memset(b, 0, sizeof(*b));
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	b->map_len = (size_t)st.st_size;
+	b->map = b->map_len ? mmap(NULL, b->map_len, PROT_READ, MAP_PRIVATE,
+				   fd, 0)
+			    : MAP_FAILED;
+	int err = errno;
+	close(fd);
+	if (b->map == MAP_FAILED) {
+		b->map = NULL;
+		errno = b->map_len ? err : EINVAL;
+		return -1;
+	}
+	if (check(b)) {
+		ipbm_close(b);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+void ipbm_close(ipbm_t *b)
+{
+	if (b->map) {
+		munmap(b->map, b->map_len);
+	}
+	memset(b, 0, sizeof(*b));
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= (size_t)n;
+	}
+	return 0;
+}
+
+int ipbm_write(int fd, uint8_t **pbm)
+{
+	// pages allocated but left empty are dropped
+	uint32_t *index = xmalloc(IPBM_PAGES * sizeof(uint32_t));
+	uint32_t pages = 0;
+	uint64_t count = 0;
+	for (uint32_t i = 0; i < IPBM_PAGES; i++) {
+		if (!pbm[i]) {
+			continue;
+		}
+		uint64_t n = 0;
+		for (size_t j = 0; j < IPBM_PAGE_BYTES; j++) {
+			n += __builtin_popcount(pbm[i][j]);
+		}
+		if (n) {
+			index[pages++] = htonl(i);
+			count += n;
+		}
+	}
+	struct ipbm_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IPBM_MAGIC, IPBM_MAGIC_LEN);
+	h.version = htonl(IPBM_VERSION);
+	h.pages = htonl(pages);
+	h.count_hi = htonl((uint32_t)(count >> 32));
+	h.count_lo = htonl((uint32_t)count);
+	int rc = write_all(fd, &h, sizeof(h));
+	if (!rc) {
+		rc = write_all(fd, index, pages * sizeof(uint32_t));
+	}
+	for (uint32_t i = 0; !rc && i < pages; i++) {
+		rc = write_all(fd, pbm[ntohl(index[i])], IPBM_PAGE_BYTES);
+	}
+	xfree(index);
+	return rc;
+}
@@ -0,0 +1,66 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_IPBM_H
+#define ZMAP_IPBM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary IPv4 address set files, written by the bitmap output module and
+ * zbitmap and read by --list-of-ips-file, which memory-maps them instead of
+ * parsing text. A file is struct ipbm_header, then the page numbers (the
+ * top 16 bits of their addresses) of the pages that have any address in
+ * them, in ascending order as 4-byte integers, then those pages as
+ * IPBM_PAGE_BYTES of bits each: the bit (1 << (v & 7)) of byte (v >> 3) for
+ * the low 16 bits v, as in a paged bitmap. All integers are in network byte
+ * order.
+ */
+#define IPBM_MAGIC "ZMAP4SET"
+#define IPBM_MAGIC_LEN 8
+#define IPBM_VERSION 1
+#define IPBM_PAGES 0x10000
+#define IPBM_PAGE_BYTES 0x2000
+
+struct ipbm_header {
+	char magic[IPBM_MAGIC_LEN];
+	uint32_t version;
+	uint32_t pages;
+	uint32_t count_hi;
+	uint32_t count_lo;
+};
+
+typedef struct ipbm {
+	void *map;
+	size_t map_len;
+	uint32_t pages;
+	uint64_t count; // addresses in the set
+	const uint8_t *index;
+	const uint8_t *bits;
+} ipbm_t;
+
+// whether path starts with IPBM_MAGIC
+int ipbm_is_file(const char *path);
+// maps path into b, returning 0 on success or -1 with errno set (EINVAL for
+// anything that isn't a valid set file)
+int ipbm_open(ipbm_t *b, const char *path);
+void ipbm_close(ipbm_t *b);
+
+// the page number and bits of the i-th page present
+uint32_t ipbm_page_number(const ipbm_t *b, uint32_t i);
+static inline const uint8_t *ipbm_page_bits(const ipbm_t *b, uint32_t i)
+{
+	return b->bits + (size_t)i * IPBM_PAGE_BYTES;
+}
+
+// writes the IPBM_PAGES pages of a paged bitmap (see pbm.h) to fd as a set
+// file, returning 0 on success or -1 with errno set
+int ipbm_write(int fd, uint8_t **pbm);
+
+#endif /* ZMAP_IPBM_H */
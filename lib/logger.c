@@ -16,7 +16,9 @@
 #include <syslog.h>
 #include <math.h>
 #include <pthread.h>
+#include <stdint.h>
 
+#include "includes.h"
 #include "logger.h"
 #include "xalloc.h"
 #include "lockfd.h"
@@ -32,6 +34,12 @@ static int log_to_syslog = 0;
 static const char *log_level_name[] = {"FATAL", "ERROR", "WARN",
 				       "INFO", "DEBUG", "TRACE"};
 
+static const int log_syslog_priority[] = {LOG_CRIT, LOG_ERR,   LOG_WARNING,
+					  LOG_INFO, LOG_DEBUG, LOG_DEBUG};
+
+// whether the message goes to syslog with the logger name in front
+static const int log_syslog_prefixed[] = {0, 0, 0, 1, 1, 1};
+
 #define RED "\x1b[31m"
 #define GREEN "\x1b[32m"
 #define YELLOW "\x1b[33m"
@@ -46,6 +54,63 @@ static const char *log_level_name[] = {"FATAL", "ERROR", "WARN",
 			fprintf(log_output_stream, "%s", x); \
 	} while (0)
 
+// Every message is formatted into a fixed-size record by the thread logging
+// it. Once log_async_start has been called, that thread queues the record
+// in a ring of its own and a background thread writes the rings out, so a
+// log call never takes a lock or makes a system call. Otherwise the record
+// is written out straight away.
+#define LOG_RECORD_LEN 1000
+#define LOG_RING_LEN 128 // records, a power of two
+#define LOG_DRAIN_WAIT_NS 1000000
+
+typedef struct log_record {
+	struct timeval time;
+	enum LogLevel level;
+	uint16_t msg_off; // of the message, after the logger name
+	uint16_t len;	  // 0 with neither a logger name nor a message
+	char text[LOG_RECORD_LEN];
+} log_record_t;
+
+typedef struct log_ring {
+	struct log_ring *next;
+	uint64_t dropped; // debug and trace records that found the ring full
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	log_record_t records[LOG_RING_LEN];
+} log_ring_t;
+
+static __thread log_ring_t *thread_ring = NULL;
+static log_ring_t *rings = NULL;
+static pthread_t drain_thread;
+static int async_running = 0;
+static int async_stopping = 0;
+
+static void lock_output(void)
+{
+	if (!log_output_stream) {
+		log_output_stream = stderr;
+	}
+	// if logging to a shared output channel, then use a global
+	// lock across ZMap. Otherwise, if we're logging to a file,
+	// only lockin with the module, in order to avoid having
+	// corrupt log entries.
+	if (log_output_stream == stdout || log_output_stream == stderr) {
+		lock_file(log_output_stream);
+	} else {
+		pthread_mutex_lock(&mutex);
+	}
+}
+
+static void unlock_output(void)
+{
+	fflush(log_output_stream);
+	if (log_output_stream == stdout || log_output_stream == stderr) {
+		unlock_file(log_output_stream);
+	} else {
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
 static const char *color_for_level(enum LogLevel level)
 {
 	switch (level) {
@@ -66,72 +131,215 @@ static const char *color_for_level(enum LogLevel level)
 	}
 }
 
-static int LogLogVA(enum LogLevel level, const char *loggerName,
-		    const char *logMessage, va_list args)
+static void format_record(log_record_t *rec, enum LogLevel level,
+			  const char *loggerName, const char *logMessage,
+			  va_list args)
 {
-	if (level <= log_output_level) {
-		if (!log_output_stream) {
-			log_output_stream = stderr;
+	gettimeofday(&rec->time, NULL);
+	rec->level = level;
+	size_t len = 0;
+	if (loggerName) {
+		int n = snprintf(rec->text, LOG_RECORD_LEN, "%s: ", loggerName);
+		len = n < 0 ? 0 : (size_t)n;
+		if (len >= LOG_RECORD_LEN) {
+			len = LOG_RECORD_LEN - 1;
 		}
-		// if logging to a shared output channel, then use a global
-		// lock across ZMap. Otherwise, if we're logging to a file,
-		// only lockin with the module, in order to avoid having
-		// corrupt log entries.
-		if (log_output_stream == stdout ||
-		    log_output_stream == stderr) {
-			lock_file(log_output_stream);
-		} else {
-			pthread_mutex_lock(&mutex);
+	}
+	rec->msg_off = (uint16_t)len;
+	rec->text[len] = '\0';
+	if (logMessage) {
+		int n = vsnprintf(rec->text + len, LOG_RECORD_LEN - len,
+				  logMessage, args);
+		len += n < 0 ? 0 : (size_t)n;
+		if (len >= LOG_RECORD_LEN) {
+			len = LOG_RECORD_LEN - 1;
 		}
-		if (color) {
-			COLOR(color_for_level(level));
+	}
+	rec->len = (uint16_t)len;
+	if (!loggerName && !logMessage) {
+		rec->len = 0;
+	}
+}
+
+// writes rec to the log stream, which must be locked
+static void put_record(const log_record_t *rec)
+{
+	if (rec->level > log_output_level) {
+		return;
+	}
+	if (color) {
+		COLOR(color_for_level(rec->level));
+	}
+	char timestamp[256];
+	time_t sec = rec->time.tv_sec;
+	struct tm *ptm = localtime(&sec);
+	strftime(timestamp, 20, "%b %d %H:%M:%S", ptm);
+	fprintf(log_output_stream, "%s.%03ld [%s] ", timestamp,
+		(long)rec->time.tv_usec / 1000, log_level_name[rec->level]);
+	if (rec->len) {
+		fwrite(rec->text, 1, rec->len, log_output_stream);
+		fputs("\n", log_output_stream);
+	}
+	if (color) {
+		COLOR(RESET);
+	}
+}
+
+static void syslog_record(const log_record_t *rec)
+{
+	if (log_to_syslog) {
+		const char *text = rec->text;
+		if (!log_syslog_prefixed[rec->level]) {
+			text += rec->msg_off;
 		}
+		syslog(LOG_MAKEPRI(LOG_USER, log_syslog_priority[rec->level]),
+		       "%s", text);
+	}
+}
+
+static void write_record(const log_record_t *rec)
+{
+	if (rec->level <= log_output_level) {
+		lock_output();
+		put_record(rec);
+		unlock_output();
+	}
+	syslog_record(rec);
+}
 
-		const char *levelName = log_level_name[level];
-		struct timeval now;
-		char timestamp[256];
-		gettimeofday(&now, NULL);
-		time_t sec = now.tv_sec;
-		struct tm *ptm = localtime(&sec);
-		strftime(timestamp, 20, "%b %d %H:%M:%S", ptm);
-		fprintf(log_output_stream, "%s.%03ld [%s] ", timestamp,
-			(long)now.tv_usec / 1000, levelName);
-		if (loggerName) {
-			fprintf(log_output_stream, "%s: ", loggerName);
+// writes out everything queued in the rings, from the drain thread or once
+// it is gone
+static size_t drain_rings(void)
+{
+	size_t drained = 0;
+	int locked = 0;
+	for (log_ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r;
+	     r = r->next) {
+		uint64_t tail = r->tail;
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (; tail != head; tail++) {
+			const log_record_t *rec =
+			    &r->records[tail & (LOG_RING_LEN - 1)];
+			if (rec->level <= log_output_level && !locked) {
+				lock_output();
+				locked = 1;
+			}
+			put_record(rec);
+			syslog_record(rec);
+			drained++;
 		}
-		if (logMessage) {
-			vfprintf(log_output_stream, logMessage, args);
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		uint64_t dropped =
+		    __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			if (!locked) {
+				lock_output();
+				locked = 1;
+			}
+			log_record_t rec;
+			gettimeofday(&rec.time, NULL);
+			rec.level = ZLOG_WARN;
+			rec.msg_off = 0;
+			rec.len = (uint16_t)snprintf(
+			    rec.text, LOG_RECORD_LEN,
+			    "logger: dropped %llu debug messages while the "
+			    "log was backed up",
+			    (unsigned long long)dropped);
+			put_record(&rec);
 		}
-		if (loggerName || logMessage) {
-			fputs("\n", log_output_stream);
+	}
+	if (locked) {
+		unlock_output();
+	}
+	return drained;
+}
+
+static void *drain_logs(UNUSED void *arg)
+{
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = LOG_DRAIN_WAIT_NS};
+	for (;;) {
+		// everything queued before stopping is seen by the pass after
+		int stopping = __atomic_load_n(&async_stopping, __ATOMIC_ACQUIRE);
+		if (!drain_rings()) {
+			if (stopping) {
+				break;
+			}
+			nanosleep(&ts, NULL);
+		}
+	}
+	return NULL;
+}
+
+static log_ring_t *get_thread_ring(void)
+{
+	if (!thread_ring) {
+		log_ring_t *r = xcalloc(1, sizeof(log_ring_t));
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+						    __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) {
+		}
+		thread_ring = r;
+	}
+	return thread_ring;
+}
+
+// queues rec for the drain thread, returning 0 once logging is synchronous
+// again
+static int queue_record(enum LogLevel level, const char *loggerName,
+			const char *logMessage, va_list args)
+{
+	log_ring_t *r = get_thread_ring();
+	uint64_t head = r->head;
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = LOG_DRAIN_WAIT_NS};
+	while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) ==
+	       LOG_RING_LEN) {
+		// debug output from hot paths is not worth waiting for
+		if (level >= ZLOG_DEBUG) {
+			__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+			return 1;
 		}
-		if (color) {
-			COLOR(RESET);
+		if (!__atomic_load_n(&async_running, __ATOMIC_ACQUIRE)) {
+			return 0;
 		}
-		fflush(log_output_stream);
-		if (log_output_stream == stdout ||
-		    log_output_stream == stderr) {
-			unlock_file(log_output_stream);
-		} else {
-			pthread_mutex_unlock(&mutex);
+		nanosleep(&ts, NULL);
+	}
+	format_record(&r->records[head & (LOG_RING_LEN - 1)], level,
+		      loggerName, logMessage, args);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+static int LogLogVA(enum LogLevel level, const char *loggerName,
+		    const char *logMessage, va_list args)
+{
+	if (level > log_output_level && !log_to_syslog) {
+		return EXIT_SUCCESS;
+	}
+	if (__atomic_load_n(&async_running, __ATOMIC_ACQUIRE)) {
+		va_list copy;
+		va_copy(copy, args);
+		int queued = queue_record(level, loggerName, logMessage, copy);
+		va_end(copy);
+		if (queued) {
+			return EXIT_SUCCESS;
 		}
 	}
+	log_record_t rec;
+	format_record(&rec, level, loggerName, logMessage, args);
+	write_record(&rec);
 	return EXIT_SUCCESS;
 }
 
 int log_fatal(const char *name, const char *message, ...)
 {
+	// whatever was queued before comes out first
+	log_async_stop();
 	va_list va;
 	va_start(va, message);
 	LogLogVA(ZLOG_FATAL, name, message, va);
 	va_end(va);
 
-	if (log_to_syslog) {
-		va_start(va, message);
-		vsyslog(LOG_MAKEPRI(LOG_USER, LOG_CRIT), message, va);
-		va_end(va);
-	}
-
 	exit(EXIT_FAILURE);
 }
 
@@ -141,13 +349,6 @@ int log_error(const char *name, const char *message, ...)
 	va_start(va, message);
 	int ret = LogLogVA(ZLOG_ERROR, name, message, va);
 	va_end(va);
-
-	if (log_to_syslog) {
-		va_start(va, message);
-		vsyslog(LOG_MAKEPRI(LOG_USER, LOG_ERR), message, va);
-		va_end(va);
-	}
-
 	return ret;
 }
 
@@ -157,13 +358,6 @@ int log_warn(const char *name, const char *message, ...)
 	va_start(va, message);
 	int ret = LogLogVA(ZLOG_WARN, name, message, va);
 	va_end(va);
-
-	if (log_to_syslog) {
-		va_start(va, message);
-		vsyslog(LOG_MAKEPRI(LOG_USER, LOG_WARNING), message, va);
-		va_end(va);
-	}
-
 	return ret;
 }
 
@@ -173,20 +367,6 @@ int log_info(const char *name, const char *message, ...)
 	va_start(va, message);
 	int ret = LogLogVA(ZLOG_INFO, name, message, va);
 	va_end(va);
-
-	char *prefixed = xmalloc(strlen(name) + strlen(message) + 3);
-	strcpy(prefixed, name);
-	strcat(prefixed, ": ");
-	strcat(prefixed, message);
-
-	if (log_to_syslog) {
-		va_start(va, message);
-		vsyslog(LOG_MAKEPRI(LOG_USER, LOG_INFO), prefixed, va);
-		va_end(va);
-	}
-
-	free(prefixed);
-
 	return ret;
 }
 
@@ -196,20 +376,6 @@ int log_debug(const char *name, const char *message, ...)
 	va_start(va, message);
 	int ret = LogLogVA(ZLOG_DEBUG, name, message, va);
 	va_end(va);
-
-	char *prefixed = xmalloc(strlen(name) + strlen(message) + 3);
-	strcpy(prefixed, name);
-	strcat(prefixed, ": ");
-	strcat(prefixed, message);
-
-	if (log_to_syslog) {
-		va_start(va, message);
-		vsyslog(LOG_MAKEPRI(LOG_USER, LOG_DEBUG), prefixed, va);
-		va_end(va);
-	}
-
-	free(prefixed);
-
 	return ret;
 }
 
@@ -220,23 +386,39 @@ extern int log_trace(const char *name, const char *message, ...)
 	va_start(va, message);
 	int ret = LogLogVA(ZLOG_TRACE, name, message, va);
 	va_end(va);
+	return ret;
+}
+#endif
 
-	char *prefixed = xmalloc(strlen(name) + strlen(message) + 3);
-	strcpy(prefixed, name);
-	strcat(prefixed, ": ");
-	strcat(prefixed, message);
-
-	if (log_to_syslog) {
-		va_start(va, message);
-		vsyslog(LOG_MAKEPRI(LOG_USER, LOG_DEBUG), prefixed, va);
-		va_end(va);
+int log_async_start(void)
+{
+	static int registered = 0;
+	if (__atomic_load_n(&async_running, __ATOMIC_ACQUIRE)) {
+		return 0;
 	}
+	async_stopping = 0;
+	if (pthread_create(&drain_thread, NULL, drain_logs, NULL)) {
+		return -1;
+	}
+	__atomic_store_n(&async_running, 1, __ATOMIC_RELEASE);
+	if (!registered) {
+		registered = 1;
+		atexit(log_async_stop);
+	}
+	return 0;
+}
 
-	free(prefixed);
-
-	return ret;
+void log_async_stop(void)
+{
+	// only one caller joins the drain thread
+	if (!__atomic_exchange_n(&async_running, 0, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	__atomic_store_n(&async_stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(drain_thread, NULL);
+	// anything queued while the drain thread finished up
+	drain_rings();
 }
-#endif
 
 int log_init(FILE *stream, enum LogLevel level, int syslog_enabled,
 	     const char *appname)
@@ -53,9 +53,32 @@ int log_trace(const char *loggerName, const char *logMessage, ...);
 #define log_trace(...) ;
 #endif
 
+// For per-packet and per-result instrumentation: only built into debug
+// builds, so neither the call nor the evaluation of its arguments costs
+// anything otherwise. LOG_TRACE_ENABLED gates code that only prepares such
+// output.
+#ifdef DEBUG
+#define LOG_TRACE_ENABLED 1
+#define LOG_TRACE_HOT(...) log_trace(__VA_ARGS__)
+#else
+#define LOG_TRACE_ENABLED 0
+#define LOG_TRACE_HOT(...) \
+	do {               \
+	} while (0)
+#endif
+
 int log_init(FILE *stream, enum LogLevel level, int syslog_enabled,
 	     const char *syslog_app);
 
+// Hands writing out the log to a background thread: log calls then queue
+// their message in a ring kept by each thread and return without taking a
+// lock. Debug and trace messages are dropped, and counted, when a ring is
+// full; others wait for room. log_async_stop writes out what is queued and
+// goes back to writing synchronously. It is called by log_fatal and at
+// exit, and must be called before closing the log stream.
+int log_async_start(void);
+void log_async_stop(void);
+
 void check_and_log_file_error(FILE *file, const char *name);
 
 size_t dstrftime(char *, size_t, const char *, double);
@@ -16,17 +16,23 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
 #include "logger.h"
+#include "util.h"
 #include "xalloc.h"
+#include "pbm.h"
 
 #define NUM_VALUES 0xFFFFFFFF
 #define PAGE_SIZE_IN_BITS 0x10000
@@ -34,12 +40,21 @@
 #define NUM_PAGES 0x10000
 #define PAGE_MASK 0xFFFF
 
+// pbm_load_from_file gives each thread at least LOAD_CHUNK_MIN bytes of the file
+#define LOAD_CHUNK_MIN (1 << 20)
+#define LOAD_THREADS_MAX 64
+
 uint8_t **pbm_init(void)
 {
 	uint8_t **retv = xcalloc(NUM_PAGES, sizeof(void *));
 	return retv;
 }
 
+uint8_t **pbm_init_pages(uint64_t num_pages)
+{
+	return xcalloc(num_pages, sizeof(void *));
+}
+
 uint8_t *bm_init(void)
 {
 	uint8_t *bm = xmalloc(PAGE_SIZE_IN_BYTES);
@@ -78,7 +93,146 @@ void pbm_set(uint8_t **b, uint32_t v)
 	bm_set(b[top], bottom);
 }
 
-uint32_t pbm_load_from_file(uint8_t **b, char *file)
+int pbm_check64(uint8_t **b, uint64_t v)
+{
+	uint64_t top = v >> 16;
+	return b[top] && bm_check(b[top], (uint16_t)(v & PAGE_MASK));
+}
+
+void pbm_set64(uint8_t **b, uint64_t v)
+{
+	uint64_t top = v >> 16;
+	if (!b[top]) {
+		b[top] = bm_init();
+	}
+	bm_set(b[top], (uint16_t)(v & PAGE_MASK));
+}
+
+// pbm_set for several threads setting bits in the same bitmap at once: a
+// missing page is raced for and the loser frees its copy
+static void pbm_set_shared(uint8_t **b, uint32_t v)
+{
+	uint8_t **slot = &b[v >> 16];
+	uint8_t *page = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (!page) {
+		uint8_t *fresh = bm_init();
+		if (__atomic_compare_exchange_n(slot, &page, fresh, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			page = fresh;
+		} else {
+			xfree(fresh);
+		}
+	}
+	uint8_t *byte = &page[(v & PAGE_MASK) >> 3];
+	uint8_t bit = (uint8_t)(1 << (v & 0x07));
+	if (!(__atomic_load_n(byte, __ATOMIC_RELAXED) & bit)) {
+		__atomic_fetch_or(byte, bit, __ATOMIC_RELAXED);
+	}
+}
+
+// The dotted quad in [p, e) in host order. Returns 1 for an address, 0 for a
+// blank or comment line, and -1 for anything else that inet_aton should
+// decide on, e.g. the octal and shortened forms it also takes.
+static int parse_dotted_quad(const char *p, const char *e, uint32_t *out)
+{
+	while (p < e && (*p == ' ' || *p == '\t')) {
+		p++;
+	}
+	if (p == e || *p == '#' || *p == '\r') {
+		return 0;
+	}
+	uint32_t v = 0;
+	for (int i = 0; i < 4; i++) {
+		if (i) {
+			if (p == e || *p != '.') {
+				return -1;
+			}
+			p++;
+		}
+		const char *digits = p;
+		uint32_t octet = 0;
+		while (p < e && *p >= '0' && *p <= '9' && p - digits < 3) {
+			octet = octet * 10 + (uint32_t)(*p - '0');
+			p++;
+		}
+		if (p == digits || octet > 255 ||
+		    (*digits == '0' && p - digits > 1)) {
+			return -1;
+		}
+		v = v << 8 | octet;
+	}
+	while (p < e && (*p == ' ' || *p == '\t' || *p == '\r')) {
+		p++;
+	}
+	if (p < e && *p != '#') {
+		return -1;
+	}
+	*out = v;
+	return 1;
+}
+
+static void load_line(uint8_t **b, const char *p, const char *e,
+		      uint64_t *count)
+{
+	uint32_t v;
+	int rc = parse_dotted_quad(p, e, &v);
+	if (rc < 0) {
+		char line[1000];
+		size_t len = (size_t)(e - p);
+		if (len >= sizeof(line)) {
+			len = sizeof(line) - 1;
+		}
+		memcpy(line, p, len);
+		line[len] = '\0';
+		line[strcspn(line, "#\r")] = '\0';
+		struct in_addr addr;
+		if (inet_aton(line, &addr) != 1) {
+			log_fatal("pbm", "unable to parse IP address: %s", line);
+		}
+		v = ntohl(addr.s_addr);
+		rc = 1;
+	}
+	if (rc) {
+		pbm_set_shared(b, v);
+		(*count)++;
+	}
+}
+
+struct load_chunk {
+	uint8_t **b;
+	const char *start;
+	const char *end;
+	uint64_t count;
+};
+
+static void *load_chunk(void *arg)
+{
+	struct load_chunk *c = arg;
+	const char *p = c->start;
+	while (p < c->end) {
+		const char *e = memchr(p, '\n', (size_t)(c->end - p));
+		if (!e) {
+			e = c->end;
+		}
+		load_line(c->b, p, e, &c->count);
+		p = e + 1;
+	}
+	return NULL;
+}
+
+// pipes and the like that can't be mapped are read a line at a time
+static uint64_t load_stream(uint8_t **b, FILE *fp)
+{
+	char line[1000];
+	uint64_t count = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		load_line(b, line, line + strcspn(line, "\n"), &count);
+	}
+	return count;
+}
+
+uint64_t pbm_load_from_file(uint8_t **b, char *file, uint32_t threads)
 {
 	if (!b) {
 		log_fatal("pbm", "load_from_file called with NULL PBM");
@@ -91,21 +245,116 @@ uint32_t pbm_load_from_file(uint8_t **b, char *file)
 		log_fatal("pbm", "unable to open file: %s: %s", file,
 			  strerror(errno));
 	}
-	char line[1000];
-	uint32_t count = 0;
-	while (fgets(line, sizeof(line), fp)) {
-		char *comment = strchr(line, '#');
-		if (comment) {
-			*comment = '\0';
+	double start = steady_now();
+	struct stat st;
+	if (fstat(fileno(fp), &st) || !S_ISREG(st.st_mode)) {
+		uint64_t count = load_stream(b, fp);
+		fclose(fp);
+		return count;
+	}
+	size_t len = (size_t)st.st_size;
+	if (!len) {
+		fclose(fp);
+		return 0;
+	}
+	const char *map =
+	    mmap(NULL, len, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (map == MAP_FAILED) {
+		log_fatal("pbm", "unable to map %s: %s", file, strerror(errno));
+	}
+	fclose(fp);
+	madvise((void *)map, len, MADV_SEQUENTIAL);
+
+	// a chunk per thread of at least LOAD_CHUNK_MIN bytes, each starting
+	// after the newline that ends the previous one's last line
+	uint64_t max_threads = len / LOAD_CHUNK_MIN + 1;
+	if (threads > max_threads) {
+		threads = (uint32_t)max_threads;
+	}
+	if (threads > LOAD_THREADS_MAX) {
+		threads = LOAD_THREADS_MAX;
+	}
+	if (!threads) {
+		threads = 1;
+	}
+	struct load_chunk *chunks = xcalloc(threads, sizeof(struct load_chunk));
+	pthread_t *tids = xcalloc(threads, sizeof(pthread_t));
+	const char *map_end = map + len;
+	const char *p = map;
+	for (uint32_t i = 0; i < threads; i++) {
+		chunks[i].b = b;
+		chunks[i].start = p;
+		const char *nominal = map + len / threads * (i + 1);
+		if (i + 1 == threads) {
+			p = map_end;
+		} else if (nominal > p) {
+			const char *nl =
+			    memchr(nominal, '\n', (size_t)(map_end - nominal));
+			p = nl ? nl + 1 : map_end;
 		}
-		struct in_addr addr;
-		if (inet_aton(line, &addr) != 1) {
-			log_fatal("pbm", "unable to parse IP address: %s",
-				  line);
+		chunks[i].end = p;
+	}
+	for (uint32_t i = 1; i < threads; i++) {
+		int r = pthread_create(&tids[i], NULL, load_chunk, &chunks[i]);
+		if (r) {
+			log_fatal("pbm", "unable to create load thread: %s",
+				  strerror(r));
 		}
-		pbm_set(b, addr.s_addr);
-		++count;
 	}
-	fclose(fp);
+	load_chunk(&chunks[0]);
+	uint64_t count = chunks[0].count;
+	for (uint32_t i = 1; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+		count += chunks[i].count;
+	}
+	munmap((void *)map, len);
+	xfree(chunks);
+	xfree(tids);
+
+	double secs = steady_now() - start;
+	log_info("pbm",
+		 "parsed %" PRIu64 " addresses from %s in %.2fs "
+		 "(%.1f M/s, %.1f MB/s) with %u threads",
+		 count, file, secs, secs > 0 ? count / secs / 1e6 : 0.0,
+		 secs > 0 ? len / secs / 1e6 : 0.0, threads);
 	return count;
 }
+
+uint8_t *flat_bm_init(void)
+{
+	void *b = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	// explicit huge pages first, they need to have been reserved through
+	// vm.nr_hugepages, otherwise fall back to asking for transparent ones
+	b = mmap(NULL, FLAT_BM_SIZE_IN_BYTES, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (b == MAP_FAILED) {
+		log_debug("pbm",
+			  "unable to map flat bitmap on huge pages (%s), "
+			  "falling back to transparent huge pages",
+			  strerror(errno));
+	}
+#endif
+	if (b == MAP_FAILED) {
+		b = mmap(NULL, FLAT_BM_SIZE_IN_BYTES, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (b == MAP_FAILED) {
+			log_fatal("pbm", "unable to map %" PRIu64 " byte "
+					 "flat bitmap: %s",
+				  FLAT_BM_SIZE_IN_BYTES, strerror(errno));
+		}
+#ifdef MADV_HUGEPAGE
+		madvise(b, FLAT_BM_SIZE_IN_BYTES, MADV_HUGEPAGE);
+#endif
+	}
+	// fault the whole bitmap in now rather than during the scan
+	memset(b, 0, FLAT_BM_SIZE_IN_BYTES);
+	return b;
+}
+
+void flat_bm_free(uint8_t *b)
+{
+	if (b) {
+		munmap(b, FLAT_BM_SIZE_IN_BYTES);
+	}
+}
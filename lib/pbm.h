@@ -26,6 +26,35 @@ void bm_set(uint8_t *bm, uint16_t v);
 uint8_t **pbm_init(void);
 int pbm_check(uint8_t **b, uint32_t v);
 void pbm_set(uint8_t **b, uint32_t v);
-uint32_t pbm_load_from_file(uint8_t **b, char *file);
+// Sets the addresses listed in file, one per line with # comments, as host
+// order values. Regular files are mapped and parsed by up to threads threads
+// at once, each taking a run of whole lines and setting bits in b
+// concurrently. Returns the number of addresses read, repeats included.
+uint64_t pbm_load_from_file(uint8_t **b, char *file, uint32_t threads);
+
+// A paged bitmap over num_pages pages of 2^16 values rather than the whole
+// 32-bit space, for keys wider than an address, e.g. address * ports + port.
+// Pages are allocated as values in them are set, as with pbm_init.
+uint8_t **pbm_init_pages(uint64_t num_pages);
+int pbm_check64(uint8_t **b, uint64_t v);
+void pbm_set64(uint8_t **b, uint64_t v);
+
+// Flat bitmap over the whole 32-bit space (512 MiB), allocated up front on
+// huge pages where the kernel allows it. A lookup is one shift and mask with
+// no page table and nothing is allocated after init.
+#define FLAT_BM_SIZE_IN_BYTES (((uint64_t)1 << 32) / 8)
+
+uint8_t *flat_bm_init(void);
+void flat_bm_free(uint8_t *b);
+
+static inline int flat_bm_check(const uint8_t *b, uint32_t v)
+{
+	return b[v >> 3] & (1 << (v & 0x07));
+}
+
+static inline void flat_bm_set(uint8_t *b, uint32_t v)
+{
+	b[v >> 3] |= (uint8_t)(1 << (v & 0x07));
+}
 
 #endif /* ZMAP_PBM_H */
@@ -0,0 +1,110 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "ratelimit.h"
+
+#include <assert.h>
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define PSEC_PER_SEC 1000000000000ULL
+// waits longer than this are (mostly) slept instead of spun
+#define SLEEP_THRESHOLD_NS 2000000ULL
+// how much of a long wait is left to spinning, to absorb wakeup latency
+#define SPIN_MARGIN_NS 1000000ULL
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (uint64_t)tp.tv_sec * NSEC_PER_SEC + (uint64_t)tp.tv_nsec;
+}
+
+static uint64_t rate_to_cost(uint64_t rate)
+{
+	assert(rate > 0);
+	uint64_t cost = PSEC_PER_SEC / rate;
+	// rates beyond 1 Tpps are indistinguishable from unlimited
+	return cost ? cost : 1;
+}
+
+void ratelimit_init(ratelimit_t *rl, uint64_t rate, uint32_t burst)
+{
+	rl->epoch_ns = monotonic_ns();
+	rl->tat_ps = 0;
+	rl->cost_ps = rate_to_cost(rate);
+	rl->burst = burst ? burst : 1;
+	rl->wait = NULL;
+}
+
+void ratelimit_set_wait(ratelimit_t *rl, void (*wait)(uint64_t until_ns))
+{
+	rl->wait = wait;
+}
+
+void ratelimit_set_rate(ratelimit_t *rl, uint64_t rate)
+{
+	__atomic_store_n(&rl->cost_ps, rate_to_cost(rate), __ATOMIC_RELAXED);
+}
+
+uint64_t ratelimit_cost(const ratelimit_t *rl)
+{
+	return __atomic_load_n(&rl->cost_ps, __ATOMIC_RELAXED);
+}
+
+uint64_t ratelimit_now(const ratelimit_t *rl)
+{
+	return monotonic_ns() - rl->epoch_ns;
+}
+
+uint64_t ratelimit_next(const ratelimit_t *rl)
+{
+	uint64_t tat_ns = __atomic_load_n(&rl->tat_ps, __ATOMIC_RELAXED) / 1000;
+	uint64_t now_ns = ratelimit_now(rl);
+	return tat_ns > now_ns ? tat_ns : now_ns;
+}
+
+uint64_t ratelimit_acquire(ratelimit_t *rl, uint32_t n, uint64_t lead_ns)
+{
+	uint64_t cost = __atomic_load_n(&rl->cost_ps, __ATOMIC_RELAXED);
+	uint64_t now_ps = ratelimit_now(rl) * 1000;
+	// a bucket that has been idle holds at most burst tokens
+	uint64_t credit = (uint64_t)rl->burst * cost;
+	uint64_t floor_ps = now_ps > credit ? now_ps - credit : 0;
+	uint64_t tat = __atomic_load_n(&rl->tat_ps, __ATOMIC_RELAXED);
+	uint64_t start;
+	do {
+		start = tat > floor_ps ? tat : floor_ps;
+	} while (!__atomic_compare_exchange_n(&rl->tat_ps, &tat, start + n * cost,
+					      1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	uint64_t start_ns = start / 1000;
+	uint64_t wake_ns = start_ns > lead_ns ? start_ns - lead_ns : 0;
+	uint64_t t = now_ps / 1000;
+	if (rl->wait) {
+		// late wakeups are made up for by the tokens that follow,
+		// as tat doesn't move for them
+		while (ratelimit_now(rl) < wake_ns) {
+			rl->wait(rl->epoch_ns + wake_ns);
+		}
+		return start_ns;
+	}
+	if (wake_ns > t + SLEEP_THRESHOLD_NS) {
+		uint64_t sleep_ns = wake_ns - t - SPIN_MARGIN_NS;
+		struct timespec ts = {
+		    .tv_sec = sleep_ns / NSEC_PER_SEC,
+		    .tv_nsec = sleep_ns % NSEC_PER_SEC,
+		};
+		struct timespec rem;
+		while (nanosleep(&ts, &rem) == -1) {
+			ts = rem;
+		}
+	}
+	while (ratelimit_now(rl) < wake_ns)
+		;
+	return start_ns;
+}
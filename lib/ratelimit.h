@@ -0,0 +1,60 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_RATELIMIT_H
+#define ZMAP_RATELIMIT_H
+
+#include <stdint.h>
+
+// Token bucket that can be shared by any number of threads without
+// locking. Internally this is the virtual scheduling form of a token
+// bucket: tat is the time at which the next token becomes available,
+// and claiming tokens atomically pushes it forward by their cost.
+// Since there is a single bucket, the aggregate rate stays correct no
+// matter how many threads are drawing from it.
+typedef struct ratelimit {
+	uint64_t epoch_ns;   // CLOCK_MONOTONIC at init, all times are relative
+	uint64_t tat_ps;     // theoretical arrival time of the next token
+	uint64_t cost_ps;    // time per token, in picoseconds
+	uint32_t burst;      // tokens that may be claimed back-to-back after idling
+	// how the claiming thread waits, if it has better things to do
+	void (*wait)(uint64_t until_ns);
+} ratelimit_t;
+
+// Initialize a bucket that hands out *rate* tokens per second and
+// allows bursts of up to *burst* tokens.
+void ratelimit_init(ratelimit_t *rl, uint64_t rate, uint32_t burst);
+
+// Have ratelimit_acquire() wait by calling wait with the CLOCK_MONOTONIC
+// time its tokens become available, for as often as it returns sooner,
+// instead of sleeping and spinning.
+void ratelimit_set_wait(ratelimit_t *rl, void (*wait)(uint64_t until_ns));
+
+// Change the rate of an initialized bucket. Async-signal safe.
+void ratelimit_set_rate(ratelimit_t *rl, uint64_t rate);
+
+// Claim *n* tokens and wait until *lead_ns* before they become
+// available. Long waits sleep, short ones spin on the monotonic clock,
+// unless the bucket has a wait function.
+// Returns the time (in ns relative to the bucket's epoch) at which the
+// first token becomes available, which may lie in the past when
+// catching up on a burst. The following tokens become available
+// ratelimit_cost() apart.
+uint64_t ratelimit_acquire(ratelimit_t *rl, uint32_t n, uint64_t lead_ns);
+
+// Current time per token, in picoseconds.
+uint64_t ratelimit_cost(const ratelimit_t *rl);
+
+// Current time in ns relative to the bucket's epoch.
+uint64_t ratelimit_now(const ratelimit_t *rl);
+
+// When (in ns relative to the bucket's epoch) the next token would be
+// handed out if no other thread claimed it first: now, after idling.
+uint64_t ratelimit_next(const ratelimit_t *rl);
+
+#endif /* ZMAP_RATELIMIT_H */
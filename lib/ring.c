@@ -0,0 +1,125 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "ring.h"
+
+#include <time.h>
+
+#include "xalloc.h"
+
+#define ZRING_WAIT_NS 50000
+
+static void ring_wait(void)
+{
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = ZRING_WAIT_NS};
+	nanosleep(&ts, NULL);
+}
+
+zring_t *zring_init(size_t capacity, int flags)
+{
+	size_t cap = 2;
+	while (cap < capacity) {
+		cap *= 2;
+	}
+	zring_t *r = xcalloc(1, sizeof(zring_t));
+	r->slots = hugemem_alloc(&r->slots_mem, MEM_PACKETS, cap * sizeof(zring_slot_t));
+	r->mask = cap - 1;
+	r->multi_producer = flags & ZRING_MPSC;
+	return r;
+}
+
+void zring_free(zring_t *r)
+{
+	hugemem_free(&r->slots_mem);
+	xfree(r);
+}
+
+size_t zring_push_batch(zring_t *r, void *const *items, size_t n)
+{
+	uint64_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	size_t k;
+	for (;;) {
+		uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		uint64_t room = r->mask + 1 - (pos - tail);
+		k = n < room ? n : (size_t)room;
+		if (!k) {
+			return 0;
+		}
+		if (!r->multi_producer) {
+			__atomic_store_n(&r->head, pos + k, __ATOMIC_RELAXED);
+			break;
+		}
+		// on failure pos is reloaded with the head another producer
+		// moved it to
+		if (__atomic_compare_exchange_n(&r->head, &pos, pos + k, 1,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+	for (size_t i = 0; i < k; i++) {
+		zring_slot_t *s = &r->slots[(pos + i) & r->mask];
+		s->data = items[i];
+		__atomic_store_n(&s->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+	return k;
+}
+
+void zring_push_wait(zring_t *r, void *const *items, size_t n)
+{
+	while (n) {
+		size_t k = zring_push_batch(r, items, n);
+		items += k;
+		n -= k;
+		if (n) {
+			ring_wait();
+		}
+	}
+}
+
+size_t zring_pop_batch(zring_t *r, void **items, size_t max)
+{
+	uint64_t tail = r->tail;
+	size_t k = 0;
+	while (k < max) {
+		zring_slot_t *s = &r->slots[(tail + k) & r->mask];
+		if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != tail + k + 1) {
+			break;
+		}
+		items[k++] = s->data;
+	}
+	if (k) {
+		__atomic_store_n(&r->tail, tail + k, __ATOMIC_RELEASE);
+	}
+	return k;
+}
+
+size_t zring_pop_wait(zring_t *r, void **items, size_t max)
+{
+	for (;;) {
+		// anything pushed before the close is visible once it is seen
+		int closed = __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+		size_t k = zring_pop_batch(r, items, max);
+		if (k || closed) {
+			return k;
+		}
+		ring_wait();
+	}
+}
+
+void zring_close(zring_t *r)
+{
+	__atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+}
+
+size_t zring_size(zring_t *r)
+{
+	uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	return head > tail ? (size_t)(head - tail) : 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_RING_H
+#define ZMAP_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hugemem.h"
+
+// Bounded ring of pointers for handing work from one thread to another
+// without locks or allocation. Producers reserve slots by advancing head,
+// with a compare-and-swap when there may be several of them (ZRING_MPSC),
+// and mark each slot filled by storing its position in it, so the single
+// consumer never reads a slot its producer is still writing. The consumer
+// gives slots back by advancing tail. head and tail sit on cache lines of
+// their own. The _wait variants poll with short sleeps instead of taking a
+// lock.
+#define ZRING_SPSC 0
+#define ZRING_MPSC 1
+
+typedef struct zring_slot {
+	uint64_t seq; // position + 1 once filled
+	void *data;
+} zring_slot_t;
+
+typedef struct zring {
+	zring_slot_t *slots;
+	hugemem_t slots_mem;
+	uint64_t mask; // capacity - 1, a power of two
+	int multi_producer;
+	int closed;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+} zring_t;
+
+// a ring of at least capacity slots
+zring_t *zring_init(size_t capacity, int flags);
+void zring_free(zring_t *r);
+
+// as many of items as fit, returning how many
+size_t zring_push_batch(zring_t *r, void *const *items, size_t n);
+// all of items, waiting for room
+void zring_push_wait(zring_t *r, void *const *items, size_t n);
+// up to max items, 0 if the ring is empty
+size_t zring_pop_batch(zring_t *r, void **items, size_t max);
+// waits for at least one item, returning 0 only once the ring is closed and
+// empty
+size_t zring_pop_wait(zring_t *r, void **items, size_t max);
+// no more pushes will follow
+void zring_close(zring_t *r);
+// items waiting, exact only from the consumer with producers quiet
+size_t zring_size(zring_t *r);
+
+static inline int zring_push(zring_t *r, void *item)
+{
+	return zring_push_batch(r, &item, 1) == 1;
+}
+
+static inline void *zring_pop(zring_t *r)
+{
+	void *item;
+	return zring_pop_batch(r, &item, 1) ? item : NULL;
+}
+
+#endif /* ZMAP_RING_H */
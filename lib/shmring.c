@@ -0,0 +1,378 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "shmring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+// longest a futex wait lasts before the other side's state is checked again,
+// in case it went away without a wakeup
+#define SHMRING_WAIT_MS 100
+
+static void ring_wait(uint32_t *word, uint32_t val, int timeout_ms)
+{
+	struct timespec ts = {.tv_sec = timeout_ms / 1000,
+			      .tv_nsec = (long)(timeout_ms % 1000) * 1000000L};
+#ifdef __linux__
+	// not FUTEX_PRIVATE_FLAG, the word is shared between processes
+	syscall(SYS_futex, word, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+	(void)word;
+	(void)val;
+	// no futex: poll, a little more often than the timeout asks
+	ts.tv_sec = 0;
+	ts.tv_nsec = 200000L;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static void ring_wake(uint32_t *word)
+{
+	__atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+	syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+static size_t schema_len(const char **names, uint32_t num_fields)
+{
+	size_t len = 0;
+	for (uint32_t i = 0; i < num_fields; i++) {
+		len += 1 + strlen(names[i]) + 1;
+	}
+	return len;
+}
+
+shmring_t *shmring_create(const char *name, size_t data_len,
+			  const char **names, const uint8_t *types,
+			  uint32_t num_fields)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t header_len = SHMRING_SCHEMA_OFFSET + schema_len(names, num_fields);
+	header_len = (header_len + page - 1) / page * page;
+	size_t len = 4096;
+	while (len < data_len) {
+		len *= 2;
+	}
+	data_len = len;
+
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		return NULL;
+	}
+	size_t map_len = header_len + data_len;
+	if (ftruncate(fd, (off_t)map_len)) {
+		int err = errno;
+		close(fd);
+		shm_unlink(name);
+		errno = err;
+		return NULL;
+	}
+	void *p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		int err = errno;
+		shm_unlink(name);
+		errno = err;
+		return NULL;
+	}
+	shmring_t *r = calloc(1, sizeof(shmring_t));
+	if (!r) {
+		munmap(p, map_len);
+		shm_unlink(name);
+		errno = ENOMEM;
+		return NULL;
+	}
+	r->hdr = p;
+	r->data = (uint8_t *)p + header_len;
+	r->map_len = map_len;
+
+	uint8_t *s = (uint8_t *)p + SHMRING_SCHEMA_OFFSET;
+	for (uint32_t i = 0; i < num_fields; i++) {
+		*s++ = types[i];
+		size_t n = strlen(names[i]) + 1;
+		memcpy(s, names[i], n);
+		s += n;
+	}
+	shmring_header_t *h = r->hdr;
+	h->version = SHMRING_VERSION;
+	h->header_len = (uint32_t)header_len;
+	h->data_len = data_len;
+	h->num_fields = num_fields;
+	// a consumer only looks further once the magic is there
+	__atomic_store_n(&h->magic, SHMRING_MAGIC, __ATOMIC_RELEASE);
+	return r;
+}
+
+// waits for the consumer to free up to pos, returning 0 if it hasn't and
+// block is not set
+static int wait_for_room(shmring_t *r, uint64_t pos, int block)
+{
+	shmring_header_t *h = r->hdr;
+	while (pos - __atomic_load_n(&h->tail, __ATOMIC_ACQUIRE) > h->data_len) {
+		if (!block) {
+			return 0;
+		}
+		uint32_t v = __atomic_load_n(&h->tail_futex, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&h->producer_waiting, 1, __ATOMIC_SEQ_CST);
+		if (pos - __atomic_load_n(&h->tail, __ATOMIC_SEQ_CST) >
+		    h->data_len) {
+			ring_wait(&h->tail_futex, v, SHMRING_WAIT_MS);
+		}
+		__atomic_store_n(&h->producer_waiting, 0, __ATOMIC_RELAXED);
+	}
+	return 1;
+}
+
+void *shmring_reserve(shmring_t *r, uint32_t len, int block)
+{
+	shmring_header_t *h = r->hdr;
+	if (len > h->data_len / 4) {
+		return NULL;
+	}
+	uint64_t off = r->pos & (h->data_len - 1);
+	uint64_t room = h->data_len - off;
+	if (room < len) {
+		// pad out to the end of the data area and start over at 0
+		if (!wait_for_room(r, r->pos + room + len, block)) {
+			return NULL;
+		}
+		shmring_record_t *pad = (shmring_record_t *)(r->data + off);
+		pad->len = (uint32_t)room;
+		pad->num_fields = SHMRING_WRAP;
+		r->pos += room;
+		__atomic_store_n(&h->head, r->pos, __ATOMIC_RELEASE);
+		off = 0;
+	} else if (!wait_for_room(r, r->pos + len, block)) {
+		return NULL;
+	}
+	shmring_record_t *rec = (shmring_record_t *)(r->data + off);
+	rec->len = len;
+	return rec;
+}
+
+void shmring_publish(shmring_t *r)
+{
+	shmring_header_t *h = r->hdr;
+	shmring_record_t *rec =
+	    (shmring_record_t *)(r->data + (r->pos & (h->data_len - 1)));
+	r->pos += rec->len;
+	__atomic_store_n(&h->head, r->pos, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->consumer_waiting, __ATOMIC_SEQ_CST)) {
+		ring_wake(&h->head_futex);
+	}
+}
+
+void shmring_close(shmring_t *r)
+{
+	__atomic_store_n(&r->hdr->closed, 1, __ATOMIC_SEQ_CST);
+	ring_wake(&r->hdr->head_futex);
+	munmap(r->hdr, r->map_len);
+	free(r);
+}
+
+shmring_t *shmring_open(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(shmring_header_t)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	size_t map_len = (size_t)st.st_size;
+	void *p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	shmring_header_t *h = p;
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHMRING_MAGIC ||
+	    h->version != SHMRING_VERSION ||
+	    (uint64_t)h->header_len + h->data_len != map_len) {
+		munmap(p, map_len);
+		errno = EINVAL;
+		return NULL;
+	}
+	shmring_t *r = calloc(1, sizeof(shmring_t));
+	if (r) {
+		r->names = calloc(h->num_fields + 1, sizeof(char *));
+		r->types = calloc(h->num_fields + 1, 1);
+	}
+	if (!r || !r->names || !r->types) {
+		if (r) {
+			free(r->names);
+			free((void *)r->types);
+		}
+		free(r);
+		munmap(p, map_len);
+		errno = ENOMEM;
+		return NULL;
+	}
+	r->hdr = h;
+	r->data = (uint8_t *)p + h->header_len;
+	r->map_len = map_len;
+	const uint8_t *s = (const uint8_t *)p + SHMRING_SCHEMA_OFFSET;
+	uint8_t *types = (uint8_t *)r->types;
+	for (uint32_t i = 0; i < h->num_fields; i++) {
+		types[i] = *s++;
+		r->names[i] = (const char *)s;
+		s += strlen((const char *)s) + 1;
+	}
+	return r;
+}
+
+uint32_t shmring_num_fields(const shmring_t *r)
+{
+	return r->hdr->num_fields;
+}
+
+const char *shmring_field_name(const shmring_t *r, uint32_t i)
+{
+	return i < r->hdr->num_fields ? r->names[i] : NULL;
+}
+
+uint8_t shmring_field_type(const shmring_t *r, uint32_t i)
+{
+	return i < r->hdr->num_fields ? r->types[i] : SHMRING_NULL;
+}
+
+int shmring_closed(const shmring_t *r)
+{
+	return (int)__atomic_load_n(&r->hdr->closed, __ATOMIC_ACQUIRE);
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// consumes len bytes, waking the producer if it is waiting for room
+static void advance(shmring_t *r, uint32_t len)
+{
+	shmring_header_t *h = r->hdr;
+	__atomic_store_n(&h->tail, h->tail + len, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&h->producer_waiting, __ATOMIC_SEQ_CST)) {
+		ring_wake(&h->tail_futex);
+	}
+}
+
+const shmring_record_t *shmring_read(shmring_t *r, int timeout_ms)
+{
+	shmring_header_t *h = r->hdr;
+	uint64_t deadline = timeout_ms < 0 ? UINT64_MAX
+					   : now_ms() + (uint64_t)timeout_ms;
+	if (r->read_len) {
+		// the last record was not released, hand it out again
+		return (const shmring_record_t *)(r->data +
+						  (h->tail & (h->data_len - 1)));
+	}
+	for (;;) {
+		uint64_t tail = h->tail;
+		if (__atomic_load_n(&h->head, __ATOMIC_ACQUIRE) != tail) {
+			const shmring_record_t *rec =
+			    (const shmring_record_t *)(r->data +
+						       (tail & (h->data_len - 1)));
+			if (rec->num_fields == SHMRING_WRAP) {
+				advance(r, rec->len);
+				continue;
+			}
+			r->read_len = rec->len;
+			return rec;
+		}
+		if (shmring_closed(r)) {
+			// anything published before closing is already visible
+			if (__atomic_load_n(&h->head, __ATOMIC_ACQUIRE) == tail) {
+				return NULL;
+			}
+			continue;
+		}
+		uint64_t now = now_ms();
+		if (now >= deadline) {
+			return NULL;
+		}
+		uint64_t wait = deadline - now;
+		uint32_t v = __atomic_load_n(&h->head_futex, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&h->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&h->head, __ATOMIC_SEQ_CST) == tail &&
+		    !shmring_closed(r)) {
+			ring_wait(&h->head_futex, v,
+				  wait < SHMRING_WAIT_MS ? (int)wait
+							 : SHMRING_WAIT_MS);
+		}
+		__atomic_store_n(&h->consumer_waiting, 0, __ATOMIC_RELAXED);
+	}
+}
+
+void shmring_release(shmring_t *r)
+{
+	if (r->read_len) {
+		advance(r, r->read_len);
+		r->read_len = 0;
+	}
+}
+
+void shmring_detach(shmring_t *r, const char *name, int unlink)
+{
+	munmap(r->hdr, r->map_len);
+	free(r->names);
+	free((void *)r->types);
+	free(r);
+	if (unlink) {
+		shm_unlink(name);
+	}
+}
+
+const shmring_field_t *shmring_first_field(const shmring_record_t *rec)
+{
+	return (const shmring_field_t *)(rec + 1);
+}
+
+const shmring_field_t *shmring_next_field(const shmring_field_t *f)
+{
+	uint32_t len = f->len + (f->type == SHMRING_STRING);
+	return (const shmring_field_t *)((const uint8_t *)f +
+					 shmring_field_size(f->name_len, len));
+}
+
+const shmring_field_t *shmring_first_member(const shmring_field_t *f,
+					    uint32_t *count)
+{
+	const uint8_t *v = shmring_value(f);
+	memcpy(count, v, sizeof(*count));
+	return (const shmring_field_t *)(v + 8);
+}
+
+const char *shmring_member_name(const shmring_field_t *f, size_t *len)
+{
+	*len = f->name_len;
+	return (const char *)(f + 1);
+}
+
+const void *shmring_value(const shmring_field_t *f)
+{
+	return (const uint8_t *)(f + 1) + shmring_align(f->name_len);
+}
@@ -0,0 +1,157 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_SHMRING_H
+#define ZMAP_SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A ring of typed records in a named POSIX shared memory object, written by
+// one process and read in place by another. The shm output module is the
+// writer; other tools read results with the consumer half of this file,
+// which depends on nothing but libc and may be copied out of the tree.
+//
+// Layout, in the byte order of the host and with every offset a multiple of
+// 8:
+//
+//   0                        shmring_header_t
+//   SHMRING_SCHEMA_OFFSET    schema: for each top-level field, its type in
+//                            one byte followed by its NUL-terminated name
+//   header_len               data area of data_len bytes, a power of two
+//
+// head and tail count bytes written and consumed since the ring was created
+// and only ever grow; a record starts at data + (pos & (data_len - 1)) and
+// never runs past the end of the data area. A record is a
+// shmring_record_t header followed by its fields. One whose num_fields is
+// SHMRING_WRAP only pads the data area out to its end and is skipped.
+//
+// A field is a shmring_field_t followed by name_len bytes of name (nested
+// fields only, the names of top-level ones are in the schema) and then len
+// bytes of value, each padded out to 8 bytes:
+//
+//   SHMRING_NULL     no value
+//   SHMRING_UINT64   8 bytes
+//   SHMRING_BOOL     8 bytes, 0 or 1
+//   SHMRING_STRING   len bytes, followed by a NUL not counted in len
+//   SHMRING_BINARY   len bytes
+//   SHMRING_IPV4     4 bytes, network order
+//   SHMRING_IPV6     16 bytes, network order
+//   SHMRING_LIST     a uint32_t count, 4 bytes of padding and count fields
+//   SHMRING_RECORD   the same, with named fields
+//
+// There is a single consumer. Either side sleeps on a futex when the ring
+// is empty or full, and the other side only wakes it when it says it is
+// waiting, so neither makes a system call while the other keeps up.
+#define SHMRING_MAGIC 0x474e495250414d5aULL // "ZMAPRING"
+#define SHMRING_VERSION 1
+#define SHMRING_SCHEMA_OFFSET 256
+#define SHMRING_WRAP 0xffffffffU
+
+#define SHMRING_NULL 0
+#define SHMRING_UINT64 1
+#define SHMRING_BOOL 2
+#define SHMRING_STRING 3
+#define SHMRING_BINARY 4
+#define SHMRING_IPV4 5
+#define SHMRING_IPV6 6
+#define SHMRING_LIST 7
+#define SHMRING_RECORD 8
+
+typedef struct shmring_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_len;
+	uint64_t data_len;
+	uint32_t num_fields;
+	uint32_t closed; // set once the writer is done
+	uint8_t pad0[32];
+	// written by the producer
+	uint64_t head __attribute__((aligned(64)));
+	uint32_t head_futex;
+	uint32_t consumer_waiting;
+	// written by the consumer
+	uint64_t tail __attribute__((aligned(64)));
+	uint32_t tail_futex;
+	uint32_t producer_waiting;
+} __attribute__((aligned(64))) shmring_header_t;
+
+typedef struct shmring_record {
+	uint32_t len; // of the whole record, a multiple of 8
+	uint32_t num_fields;
+} shmring_record_t;
+
+typedef struct shmring_field {
+	uint8_t type;
+	uint8_t name_len;
+	uint16_t reserved;
+	uint32_t len;
+} shmring_field_t;
+
+typedef struct shmring {
+	shmring_header_t *hdr;
+	uint8_t *data;
+	size_t map_len;
+	uint64_t pos;	      // producer: reserved up to here
+	uint32_t read_len;    // consumer: record being read
+	const char **names;   // consumer: top-level field names
+	const uint8_t *types; // consumer: top-level field types
+} shmring_t;
+
+// Producer. Creates the shm object name (replacing one left behind) with a
+// data area of at least data_len bytes and the given top-level fields.
+shmring_t *shmring_create(const char *name, size_t data_len,
+			  const char **names, const uint8_t *types,
+			  uint32_t num_fields);
+// Room for a record of len bytes, a multiple of 8, or NULL if the ring is
+// full and block is not set. Records may be at most data_len / 4 bytes.
+void *shmring_reserve(shmring_t *r, uint32_t len, int block);
+// makes the record last reserved visible to the consumer
+void shmring_publish(shmring_t *r);
+// marks the ring closed, waking the consumer, and unmaps it. The object
+// stays until the consumer unlinks it, or a later shmring_create replaces
+// it.
+void shmring_close(shmring_t *r);
+
+// Consumer. Returns NULL, with errno set, if name is not a ring.
+shmring_t *shmring_open(const char *name);
+uint32_t shmring_num_fields(const shmring_t *r);
+const char *shmring_field_name(const shmring_t *r, uint32_t i);
+uint8_t shmring_field_type(const shmring_t *r, uint32_t i);
+// the next record, in place, waiting up to timeout_ms (-1 for ever). NULL
+// on timeout, and once the ring is closed and empty.
+const shmring_record_t *shmring_read(shmring_t *r, int timeout_ms);
+// hands the record last read back to the producer
+void shmring_release(shmring_t *r);
+int shmring_closed(const shmring_t *r);
+// unmaps the ring and, if unlink is set, removes name
+void shmring_detach(shmring_t *r, const char *name, int unlink);
+
+// walking the fields of a record, a list or a nested record
+const shmring_field_t *shmring_first_field(const shmring_record_t *rec);
+const shmring_field_t *shmring_next_field(const shmring_field_t *f);
+// the first member of a SHMRING_LIST or SHMRING_RECORD, and their number
+const shmring_field_t *shmring_first_member(const shmring_field_t *f,
+					    uint32_t *count);
+const char *shmring_member_name(const shmring_field_t *f, size_t *len);
+const void *shmring_value(const shmring_field_t *f);
+
+static inline uint32_t shmring_align(uint32_t len)
+{
+	return (len + 7) & ~7U;
+}
+
+// space taken by a field with a name of name_len bytes and len bytes of
+// value, where len counts the NUL after a string
+static inline uint32_t shmring_field_size(uint32_t name_len, uint32_t len)
+{
+	return (uint32_t)sizeof(shmring_field_t) + shmring_align(name_len) +
+	       shmring_align(len);
+}
+
+#endif /* ZMAP_SHMRING_H */
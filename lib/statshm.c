@@ -0,0 +1,190 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "statshm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static size_t align64(size_t n) { return (n + 63) & ~(size_t)63; }
+
+statshm_t *statshm_create(const char *name, uint32_t max_senders,
+			  uint32_t max_receivers)
+{
+	size_t status_offset = align64(sizeof(statshm_header_t));
+	size_t sender_offset = status_offset + align64(sizeof(statshm_status_t));
+	size_t receiver_offset =
+	    sender_offset + (size_t)max_senders * sizeof(statshm_sender_t);
+	size_t len =
+	    receiver_offset + (size_t)max_receivers * sizeof(statshm_receiver_t);
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t map_len = (len + page - 1) / page * page;
+
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (ftruncate(fd, (off_t)map_len)) {
+		int err = errno;
+		close(fd);
+		shm_unlink(name);
+		errno = err;
+		return NULL;
+	}
+	void *p = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		int err = errno;
+		shm_unlink(name);
+		errno = err;
+		return NULL;
+	}
+	statshm_t *s = calloc(1, sizeof(statshm_t));
+	if (!s) {
+		munmap(p, map_len);
+		shm_unlink(name);
+		errno = ENOMEM;
+		return NULL;
+	}
+	s->hdr = p;
+	s->map_len = map_len;
+
+	statshm_header_t *h = s->hdr;
+	h->version = STATSHM_VERSION;
+	h->header_len = sizeof(statshm_header_t);
+	h->status_len = sizeof(statshm_status_t);
+	h->sender_len = sizeof(statshm_sender_t);
+	h->receiver_len = sizeof(statshm_receiver_t);
+	h->max_senders = max_senders;
+	h->max_receivers = max_receivers;
+	h->status_offset = status_offset;
+	h->sender_offset = sender_offset;
+	h->receiver_offset = receiver_offset;
+	h->pid = (int64_t)getpid();
+	// last, so that a reader that sees it sees the rest of the header
+	__atomic_store_n(&h->magic, STATSHM_MAGIC, __ATOMIC_RELEASE);
+	return s;
+}
+
+statshm_status_t *statshm_status(statshm_t *s)
+{
+	return (statshm_status_t *)((uint8_t *)s->hdr + s->hdr->status_offset);
+}
+
+statshm_sender_t *statshm_sender(statshm_t *s, uint32_t i)
+{
+	return (statshm_sender_t *)((uint8_t *)s->hdr + s->hdr->sender_offset) +
+	       i;
+}
+
+statshm_receiver_t *statshm_receiver(statshm_t *s, uint32_t i)
+{
+	return (statshm_receiver_t *)((uint8_t *)s->hdr +
+				      s->hdr->receiver_offset) +
+	       i;
+}
+
+void statshm_begin(statshm_t *s)
+{
+	uint64_t seq = __atomic_load_n(&s->hdr->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->hdr->seq, seq + 1, __ATOMIC_RELAXED);
+	// the odd seq is visible before any of the writes that follow
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void statshm_commit(statshm_t *s, double time)
+{
+	statshm_header_t *h = s->hdr;
+	h->writes++;
+	h->time = time;
+	uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void statshm_close(statshm_t *s)
+{
+	statshm_begin(s);
+	s->hdr->closed = 1;
+	statshm_commit(s, s->hdr->time);
+	munmap(s->hdr, s->map_len);
+	free(s);
+}
+
+statshm_t *statshm_open(const char *name)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(statshm_header_t)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	size_t map_len = (size_t)st.st_size;
+	void *p = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+	statshm_header_t *h = p;
+	if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != STATSHM_MAGIC ||
+	    h->receiver_offset +
+		    (uint64_t)h->max_receivers * h->receiver_len >
+		map_len) {
+		munmap(p, map_len);
+		errno = EINVAL;
+		return NULL;
+	}
+	statshm_t *s = calloc(1, sizeof(statshm_t));
+	if (!s) {
+		munmap(p, map_len);
+		errno = ENOMEM;
+		return NULL;
+	}
+	s->hdr = h;
+	s->map_len = map_len;
+	return s;
+}
+
+size_t statshm_len(const statshm_t *s) { return s->map_len; }
+
+int statshm_snapshot(const statshm_t *s, void *out, unsigned max_tries)
+{
+	const statshm_header_t *h = s->hdr;
+	for (unsigned i = 0; i < max_tries; i++) {
+		uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		memcpy(out, h, s->map_len);
+		// the copy is done before seq is read again
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq) {
+			return 0;
+		}
+	}
+	errno = EBUSY;
+	return -1;
+}
+
+void statshm_detach(statshm_t *s, const char *name, int unlink)
+{
+	munmap(s->hdr, s->map_len);
+	if (unlink) {
+		shm_unlink(name);
+	}
+	free(s);
+}
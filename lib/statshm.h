@@ -0,0 +1,164 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_STATSHM_H
+#define ZMAP_STATSHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// --stats-shm: the monitor's statistics in a named POSIX shared memory
+// object, which other processes map and read at whatever frequency they
+// like without a system call on either side. The monitor is the only
+// writer; readers use the consumer half of this file, which depends on
+// nothing but libc and may be copied out of the tree.
+//
+// Layout, in the byte order of the host and with every offset a multiple of
+// 64:
+//
+//   0                  statshm_header_t
+//   status_offset      statshm_status_t
+//   sender_offset      max_senders statshm_sender_t, num_senders in use
+//   receiver_offset    max_receivers statshm_receiver_t, num_receivers in use
+//
+// Everything after magic, version and the lengths and offsets is covered by
+// a sequence lock: seq is odd while the writer updates the segment, so a
+// reader copies it between two loads of seq that are equal and even.
+// Versions only ever append fields to the structures, so a reader takes
+// the first min(its own, status_len) bytes of the status and so on, and
+// the rest are left zero.
+#define STATSHM_MAGIC 0x54415453504d415aULL // "ZMAPSTAT"
+#define STATSHM_VERSION 1
+
+// what the monitor works out once a second, as on screen and in
+// --status-updates-file; rates are over the last update
+typedef struct statshm_status {
+	double time; // seconds since the epoch
+	uint64_t updates;
+	uint64_t time_elapsed;
+	uint64_t time_remaining;
+	double percent_complete;
+	uint64_t send_complete;
+	uint64_t send_threads;
+	uint64_t sent_total;
+	uint64_t tried_total;
+	double sent_rate;
+	double sent_avg;
+	uint64_t fail_total;
+	double fail_rate;
+	double fail_avg;
+	double hitrate;
+	double app_hitrate;
+	uint64_t success_unique;
+	double success_rate;
+	double success_avg;
+	uint64_t app_success_unique;
+	double app_success_rate;
+	double app_success_avg;
+	uint64_t recv_total;
+	double recv_rate;
+	double recv_avg;
+	uint64_t pcap_drop;
+	uint64_t pcap_ifdrop;
+	double pcap_drop_rate;
+	double pcap_drop_avg;
+	uint64_t capture_queue_depth;
+	uint64_t output_queue_depth;
+	uint64_t pipeline_drop_total;
+	double pipeline_drop_rate;
+	uint64_t output_ring_depth;
+	uint64_t output_spill_depth;
+	uint64_t output_drop_total;
+	double output_drop_rate;
+	uint64_t output_spill_total;
+	uint64_t outstanding;
+	double seconds_under_min_hitrate;
+} __attribute__((aligned(64))) statshm_status_t;
+
+// the counters of one send thread
+typedef struct statshm_sender {
+	uint64_t packets_sent;
+	uint64_t targets_scanned;
+	uint64_t packets_failed;
+	uint64_t iterations;
+	uint64_t retransmits_skipped;
+	// --target-threads: batches of targets waiting, and the time spent
+	// waiting for one
+	uint64_t target_ring_depth;
+	uint64_t starved_ns;
+} __attribute__((aligned(64))) statshm_sender_t;
+
+// the counters of one receiving thread, in the order they started counting
+typedef struct statshm_receiver {
+	uint64_t success_total;
+	uint64_t success_unique;
+	uint64_t app_success_total;
+	uint64_t app_success_unique;
+	uint64_t failure_total;
+	uint64_t validation_passed;
+	uint64_t validation_failed;
+	uint64_t rtt_samples;
+	uint64_t rtt_sum_us;
+} __attribute__((aligned(64))) statshm_receiver_t;
+
+typedef struct statshm_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t header_len;
+	uint32_t status_len;
+	uint32_t sender_len;
+	uint32_t receiver_len;
+	uint32_t max_senders;
+	uint32_t max_receivers;
+	uint32_t pad0;
+	uint64_t status_offset;
+	uint64_t sender_offset;
+	uint64_t receiver_offset;
+	int64_t pid;
+	// covered by seq from here on
+	uint64_t seq __attribute__((aligned(64)));
+	// writes of the segment, and the time of the last one in seconds
+	// since the epoch: the thread counters are refreshed more often than
+	// the status
+	uint64_t writes;
+	double time;
+	uint32_t num_senders;
+	uint32_t num_receivers;
+	uint32_t closed; // set once the scan is over
+	uint32_t pad1;
+} __attribute__((aligned(64))) statshm_header_t;
+
+typedef struct statshm {
+	statshm_header_t *hdr;
+	size_t map_len;
+} statshm_t;
+
+// Producer. Creates the shm object name (replacing one left behind) with
+// room for the given numbers of threads.
+statshm_t *statshm_create(const char *name, uint32_t max_senders,
+			  uint32_t max_receivers);
+statshm_status_t *statshm_status(statshm_t *s);
+statshm_sender_t *statshm_sender(statshm_t *s, uint32_t i);
+statshm_receiver_t *statshm_receiver(statshm_t *s, uint32_t i);
+// Writes go between the two; readers retry until they see none under way.
+void statshm_begin(statshm_t *s);
+void statshm_commit(statshm_t *s, double time);
+// marks the segment closed and unmaps it. The object stays, with the last
+// numbers, until a reader unlinks it or a later statshm_create replaces it.
+void statshm_close(statshm_t *s);
+
+// Consumer. Returns NULL, with errno set, if name is not a stats segment.
+statshm_t *statshm_open(const char *name);
+// A consistent copy of the whole segment, of statshm_len() bytes, into
+// out. Returns 0, or -1 if the writer kept it busy for max_tries tries.
+int statshm_snapshot(const statshm_t *s, void *out, unsigned max_tries);
+size_t statshm_len(const statshm_t *s);
+// unmaps the segment and, if unlink is set, removes name
+void statshm_detach(statshm_t *s, const char *name, int unlink);
+
+#endif /* ZMAP_STATSHM_H */
@@ -18,8 +18,7 @@
 #define ZMAP_TYPES_H
 
 #include <stdint.h>
-
-#include <stdint.h>
+#include <netinet/in.h>
 
 typedef uint32_t ipaddr_n_t; // IPv4 address network order
 typedef uint32_t ipaddr_h_t; // IPv4 address host order
@@ -27,4 +26,10 @@ typedef uint16_t port_n_t;   // port network order
 typedef uint16_t port_h_t;   // port host order
 typedef unsigned char macaddr_t;
 
+// IPv4 or IPv6 address, network order. IPv4 scans use v4 and IPv6 scans v6.
+typedef union ipaddr {
+	ipaddr_n_t v4;
+	struct in6_addr v6;
+} ipaddr_t;
+
 #endif /* ZMAP_TYPES_H */
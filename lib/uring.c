@@ -0,0 +1,154 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "uring.h"
+
+#ifdef IO_URING
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int uring_enter(uring_t *u, uint32_t to_submit, uint32_t min_complete,
+		       uint32_t flags)
+{
+	return (int)syscall(__NR_io_uring_enter, u->fd, to_submit,
+			    min_complete, flags, NULL, 0);
+}
+
+int uring_init(uring_t *u, uint32_t entries, int sqpoll, uint32_t idle_ms)
+{
+	memset(u, 0, sizeof(*u));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	if (sqpoll) {
+		p.flags = IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = idle_ms;
+	}
+	u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0) {
+		return -1;
+	}
+	u->sqpoll = sqpoll;
+	u->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+	u->cq_map_len =
+	    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	int single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single && u->cq_map_len > u->sq_map_len) {
+		u->sq_map_len = u->cq_map_len;
+	}
+	u->sq_map = mmap(NULL, u->sq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED) {
+		u->sq_map = NULL;
+		goto fail;
+	}
+	if (single) {
+		u->cq_map = u->sq_map;
+	} else {
+		u->cq_map =
+		    mmap(NULL, u->cq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cq_map == MAP_FAILED) {
+			u->cq_map = NULL;
+			goto fail;
+		}
+	}
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto fail;
+	}
+	uint8_t *sq = u->sq_map;
+	uint8_t *cq = u->cq_map;
+	u->sq_head = (uint32_t *)(sq + p.sq_off.head);
+	u->sq_tail = (uint32_t *)(sq + p.sq_off.tail);
+	u->sq_mask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+	u->sq_flags = (uint32_t *)(sq + p.sq_off.flags);
+	u->sq_array = (uint32_t *)(sq + p.sq_off.array);
+	u->cq_head = (uint32_t *)(cq + p.cq_off.head);
+	u->cq_tail = (uint32_t *)(cq + p.cq_off.tail);
+	u->cq_mask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	u->tail = *u->sq_tail;
+	return 0;
+fail:;
+	int err = errno;
+	uring_free(u);
+	errno = err;
+	return -1;
+}
+
+void uring_free(uring_t *u)
+{
+	if (u->sqes) {
+		munmap(u->sqes, u->sqes_len);
+	}
+	if (u->cq_map && u->cq_map != u->sq_map) {
+		munmap(u->cq_map, u->cq_map_len);
+	}
+	if (u->sq_map) {
+		munmap(u->sq_map, u->sq_map_len);
+	}
+	if (u->fd >= 0) {
+		close(u->fd);
+	}
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+int uring_register_files(uring_t *u, const int *fds, uint32_t n)
+{
+	return (int)syscall(__NR_io_uring_register, u->fd,
+			    IORING_REGISTER_FILES, fds, n);
+}
+
+int uring_submit(uring_t *u)
+{
+	int queued = (int)(u->tail - *u->sq_tail);
+	// the entries must be visible before the kernel sees the tail
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+	if (u->sqpoll) {
+		// the tail has to be stored before the flag is read
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) &
+		    IORING_SQ_NEED_WAKEUP) {
+			uring_enter(u, 0, 0, IORING_ENTER_SQ_WAKEUP);
+		}
+		return queued;
+	}
+	uint32_t pending =
+	    u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	if (!pending) {
+		return 0;
+	}
+	return uring_enter(u, pending, 0, 0);
+}
+
+void uring_drop_unsubmitted(uring_t *u)
+{
+	u->tail = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	__atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+}
+
+int uring_wait(uring_t *u, uint32_t n)
+{
+	while (uring_enter(u, 0, n, IORING_ENTER_GETEVENTS) < 0) {
+		if (errno != EINTR) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#endif /* IO_URING */
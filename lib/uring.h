@@ -0,0 +1,88 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_URING_H
+#define ZMAP_URING_H
+
+#ifdef IO_URING
+
+#include <stdint.h>
+#include <string.h>
+#include <linux/io_uring.h>
+
+// An io_uring driven through its syscalls (Linux, built with IO_URING),
+// which is all the kernel header is needed for. One thread queues entries,
+// submits them and reaps their completions.
+typedef struct uring {
+	int fd;
+	int sqpoll;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t sq_mask;
+	uint32_t *sq_flags;
+	uint32_t *sq_array;
+	struct io_uring_sqe *sqes;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe *cqes;
+	// past the last entry queued, which uring_submit() publishes
+	uint32_t tail;
+	void *sq_map;
+	void *cq_map;
+	size_t sq_map_len;
+	size_t cq_map_len;
+	size_t sqes_len;
+} uring_t;
+
+// A ring of at least entries submission entries and twice as many
+// completions, with a kernel thread polling it that sleeps after idle_ms
+// without work if sqpoll is set. 0 on success, else -1 with errno set.
+int uring_init(uring_t *u, uint32_t entries, int sqpoll, uint32_t idle_ms);
+void uring_free(uring_t *u);
+// registers fds as the ring's fixed files 0 to n - 1
+int uring_register_files(uring_t *u, const int *fds, uint32_t n);
+
+// a zeroed entry, queued at the tail but not yet visible to the kernel
+static inline struct io_uring_sqe *uring_get_sqe(uring_t *u)
+{
+	uint32_t idx = u->tail++ & u->sq_mask;
+	u->sq_array[idx] = idx;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+// Publishes the queued entries and has the kernel take them, only waking
+// the polling thread if it sleeps. Returns how many it took, everything
+// when polled, or -1 with errno set.
+int uring_submit(uring_t *u);
+// takes back what was queued and not taken by the kernel, without SQPOLL
+void uring_drop_unsubmitted(uring_t *u);
+// waits until at least n completions are there to reap
+int uring_wait(uring_t *u, uint32_t n);
+
+// the oldest completion not yet seen, or NULL
+static inline struct io_uring_cqe *uring_peek_cqe(uring_t *u)
+{
+	uint32_t head = *u->cq_head;
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &u->cqes[head & u->cq_mask];
+}
+
+// gives the completion uring_peek_cqe() returned back to the kernel
+static inline void uring_cqe_seen(uring_t *u)
+{
+	__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif /* IO_URING */
+
+#endif /* ZMAP_URING_H */
@@ -33,6 +33,13 @@
 #include <pwd.h>
 
 #include "../lib/logger.h"
+#include "../lib/cpu.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define MAX_SPLITS 128
 
@@ -381,3 +388,143 @@ double steady_now(void)
 	return (double)now.tv_sec + (double)now.tv_usec / 1000000.;
 #endif
 }
+
+// every byte's two hex digits, so that each byte is one load and store
+#define HEX_ROW(h)                                                     \
+	h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" h "8" h "9" h "a" \
+	h "b" h "c" h "d" h "e" h "f"
+static const char hex_pairs[] =
+    HEX_ROW("0") HEX_ROW("1") HEX_ROW("2") HEX_ROW("3")
+    HEX_ROW("4") HEX_ROW("5") HEX_ROW("6") HEX_ROW("7")
+    HEX_ROW("8") HEX_ROW("9") HEX_ROW("a") HEX_ROW("b")
+    HEX_ROW("c") HEX_ROW("d") HEX_ROW("e") HEX_ROW("f");
+
+static size_t hex_encode_generic(char *out, const uint8_t *in, size_t len)
+{
+	size_t i = 0;
+	// eight bytes at a time, which the compiler keeps in registers
+	for (; i + 8 <= len; i += 8) {
+		char *o = out + 2 * i;
+		memcpy(o, &hex_pairs[2 * in[i]], 2);
+		memcpy(o + 2, &hex_pairs[2 * in[i + 1]], 2);
+		memcpy(o + 4, &hex_pairs[2 * in[i + 2]], 2);
+		memcpy(o + 6, &hex_pairs[2 * in[i + 3]], 2);
+		memcpy(o + 8, &hex_pairs[2 * in[i + 4]], 2);
+		memcpy(o + 10, &hex_pairs[2 * in[i + 5]], 2);
+		memcpy(o + 12, &hex_pairs[2 * in[i + 6]], 2);
+		memcpy(o + 14, &hex_pairs[2 * in[i + 7]], 2);
+	}
+	for (; i < len; i++) {
+		memcpy(out + 2 * i, &hex_pairs[2 * in[i]], 2);
+	}
+	return HEX_ENCODED_LEN(len);
+}
+
+// Sixteen bytes at a time: the nibbles index a table of the digits, and
+// interleaving the high and low digits gives the pairs in order.
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static size_t
+hex_encode_avx2(char *out, const uint8_t *in, size_t len)
+{
+	const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6',
+					     '7', '8', '9', 'a', 'b', 'c', 'd',
+					     'e', 'f');
+	const __m128i low = _mm_set1_epi8(0x0f);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+		__m128i hi = _mm_shuffle_epi8(
+		    digits, _mm_and_si128(_mm_srli_epi16(v, 4), low));
+		__m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, low));
+		_mm_storeu_si128((__m128i *)(out + 2 * i),
+				 _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(out + 2 * i + 16),
+				 _mm_unpackhi_epi8(hi, lo));
+	}
+	hex_encode_generic(out + 2 * i, in + i, len - i);
+	return HEX_ENCODED_LEN(len);
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static size_t hex_encode_neon(char *out, const uint8_t *in, size_t len)
+{
+	static const uint8_t table[16] = "0123456789abcdef";
+	const uint8x16_t digits = vld1q_u8(table);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		uint8x16_t v = vld1q_u8(in + i);
+		uint8x16x2_t pairs;
+		pairs.val[0] = vqtbl1q_u8(digits, vshrq_n_u8(v, 4));
+		pairs.val[1] = vqtbl1q_u8(digits, vandq_u8(v, vdupq_n_u8(0x0f)));
+		// the interleaving store
+		vst2q_u8((uint8_t *)out + 2 * i, pairs);
+	}
+	hex_encode_generic(out + 2 * i, in + i, len - i);
+	return HEX_ENCODED_LEN(len);
+}
+#endif
+
+typedef size_t (*hex_encode_fn)(char *, const uint8_t *, size_t);
+
+static hex_encode_fn hex_encode_fn_impl = hex_encode_generic;
+static const char *hex_encode_impl_name = "generic";
+static pthread_once_t hex_encode_inited = PTHREAD_ONCE_INIT;
+
+static void hex_encode_init_once(void)
+{
+	uint32_t features = cpu_features();
+#if defined(__x86_64__)
+	if (features & CPU_AVX2) {
+		hex_encode_fn_impl = hex_encode_avx2;
+		hex_encode_impl_name = "avx2";
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	if (features & CPU_NEON) {
+		hex_encode_fn_impl = hex_encode_neon;
+		hex_encode_impl_name = "neon";
+	}
+#else
+	(void)features;
+#endif
+}
+
+size_t hex_encode(char *out, const uint8_t *in, size_t len)
+{
+	pthread_once(&hex_encode_inited, hex_encode_init_once);
+	return hex_encode_fn_impl(out, in, len);
+}
+
+const char *hex_encode_impl(void)
+{
+	pthread_once(&hex_encode_inited, hex_encode_init_once);
+	return hex_encode_impl_name;
+}
+
+static const char base64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+size_t base64_encode(char *out, const uint8_t *in, size_t len)
+{
+	char *o = out;
+	size_t i = 0;
+	for (; i + 3 <= len; i += 3) {
+		uint32_t v = (uint32_t)in[i] << 16 | (uint32_t)in[i + 1] << 8 |
+			     in[i + 2];
+		o[0] = base64_chars[v >> 18];
+		o[1] = base64_chars[(v >> 12) & 0x3f];
+		o[2] = base64_chars[(v >> 6) & 0x3f];
+		o[3] = base64_chars[v & 0x3f];
+		o += 4;
+	}
+	if (i < len) {
+		uint32_t v = (uint32_t)in[i] << 16;
+		if (i + 1 < len) {
+			v |= (uint32_t)in[i + 1] << 8;
+		}
+		o[0] = base64_chars[v >> 18];
+		o[1] = base64_chars[(v >> 12) & 0x3f];
+		o[2] = i + 1 < len ? base64_chars[(v >> 6) & 0x3f] : '=';
+		o[3] = '=';
+		o += 4;
+	}
+	return (size_t)(o - out);
+}
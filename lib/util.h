@@ -72,4 +72,15 @@ double now(void);
 // to `gettimeofday` which was ZMap's original implementation.
 double steady_now(void);
 
+// Text encodings of binary data. Both write to out without a terminator
+// and return the number of characters written, which for len bytes is
+// HEX_ENCODED_LEN(len) and BASE64_ENCODED_LEN(len) respectively.
+#define HEX_ENCODED_LEN(len) (2 * (len))
+#define BASE64_ENCODED_LEN(len) (4 * (((len) + 2) / 3))
+size_t hex_encode(char *out, const uint8_t *in, size_t len);
+// the variant hex_encode() picked for this CPU, for the metadata
+const char *hex_encode_impl(void);
+// standard alphabet (RFC 4648) with padding
+size_t base64_encode(char *out, const uint8_t *in, size_t len);
+
 #endif /* ZMAP_UTIL_H */
@@ -19,9 +19,29 @@
 
 #include <stdlib.h>
 #include <string.h>
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#define alloc_size(p) malloc_size(p)
+#elif defined(__FreeBSD__)
+#include <malloc_np.h>
+#define alloc_size(p) malloc_usable_size(p)
+#else
+#include <malloc.h>
+#define alloc_size(p) malloc_usable_size(p)
+#endif
 
 static void die(void) __attribute__((noreturn));
 
+const char *const MEM_TAG_NAMES[MEM_TAGS] = {
+    [MEM_DEDUP] = "dedup",	       [MEM_DEDUP_WINDOW] = "dedup_window",
+    [MEM_CONSTRAINT] = "constraint", [MEM_TARGETS] = "targets",
+    [MEM_PACKETS] = "packets",       [MEM_RESULTS] = "results",
+    [MEM_OUTPUT] = "output",
+};
+
+static uint64_t mem_current[MEM_TAGS];
+static uint64_t mem_peak[MEM_TAGS];
+
 void *xcalloc(size_t count, size_t size)
 {
 	void *res = calloc(count, size);
@@ -52,4 +72,75 @@ void *xrealloc(void *ptr, size_t size)
 	return res;
 }
 
+void *xmalloc_aligned(size_t alignment, size_t size)
+{
+	void *res = NULL;
+	if (posix_memalign(&res, alignment, size) != 0) {
+		die();
+	}
+	memset(res, 0, size);
+	return res;
+}
+
+void xalloc_account(mem_tag_t tag, int64_t bytes)
+{
+	uint64_t cur = __atomic_add_fetch(&mem_current[tag], (uint64_t)bytes,
+					  __ATOMIC_RELAXED);
+	if (bytes <= 0) {
+		return;
+	}
+	uint64_t peak = __atomic_load_n(&mem_peak[tag], __ATOMIC_RELAXED);
+	while (cur > peak &&
+	       !__atomic_compare_exchange_n(&mem_peak[tag], &peak, cur, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void xalloc_usage(mem_tag_t tag, uint64_t *current, uint64_t *peak)
+{
+	if (current) {
+		*current = __atomic_load_n(&mem_current[tag], __ATOMIC_RELAXED);
+	}
+	if (peak) {
+		*peak = __atomic_load_n(&mem_peak[tag], __ATOMIC_RELAXED);
+	}
+}
+
+void *xmalloc_tag(mem_tag_t tag, size_t size)
+{
+	void *res = xmalloc(size);
+	xalloc_account(tag, (int64_t)alloc_size(res));
+	return res;
+}
+
+void *xcalloc_tag(mem_tag_t tag, size_t count, size_t size)
+{
+	void *res = xcalloc(count, size);
+	xalloc_account(tag, (int64_t)alloc_size(res));
+	return res;
+}
+
+void *xrealloc_tag(mem_tag_t tag, void *ptr, size_t size)
+{
+	int64_t old = ptr ? (int64_t)alloc_size(ptr) : 0;
+	void *res = xrealloc(ptr, size);
+	xalloc_account(tag, (int64_t)alloc_size(res) - old);
+	return res;
+}
+
+void *xmalloc_aligned_tag(mem_tag_t tag, size_t alignment, size_t size)
+{
+	void *res = xmalloc_aligned(alignment, size);
+	xalloc_account(tag, (int64_t)alloc_size(res));
+	return res;
+}
+
+void xfree_tag(mem_tag_t tag, void *ptr)
+{
+	if (ptr) {
+		xalloc_account(tag, -(int64_t)alloc_size(ptr));
+		free(ptr);
+	}
+}
+
 void die(void) { log_fatal("zmap", "Out of memory"); }
@@ -18,6 +18,7 @@
 #define ZMAP_ALLOC_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 void *xcalloc(size_t count, size_t size);
 
@@ -27,4 +28,35 @@ void *xmalloc(size_t size);
 
 void *xrealloc(void *ptr, size_t size);
 
+// Zeroed allocation aligned to alignment (a power of two), freed with xfree
+void *xmalloc_aligned(size_t alignment, size_t size);
+
+// The subsystems whose memory is accounted, for the monitor, the scan
+// metadata and --dry-estimate-memory. Their allocations go through the
+// _tag variants below, which count the bytes malloc actually handed out,
+// and are freed with xfree_tag under the same tag. Memory they map
+// themselves is counted with xalloc_account.
+typedef enum mem_tag {
+	MEM_DEDUP,	  // --dedup-method=full bitmaps and sets
+	MEM_DEDUP_WINDOW, // --dedup-method=window
+	MEM_CONSTRAINT,	  // allowlist and blocklist
+	MEM_TARGETS,	  // --list-of-ips-file and --delta-from
+	MEM_PACKETS,	  // send batches, XDP UMEM and receive rings
+	MEM_RESULTS,	  // arenas that responses are parsed into
+	MEM_OUTPUT,	  // output buffers and --output-queue-size
+	MEM_TAGS
+} mem_tag_t;
+
+extern const char *const MEM_TAG_NAMES[MEM_TAGS];
+
+void *xmalloc_tag(mem_tag_t tag, size_t size);
+void *xcalloc_tag(mem_tag_t tag, size_t count, size_t size);
+void *xrealloc_tag(mem_tag_t tag, void *ptr, size_t size);
+void *xmalloc_aligned_tag(mem_tag_t tag, size_t alignment, size_t size);
+void xfree_tag(mem_tag_t tag, void *ptr);
+// bytes mapped (> 0) or unmapped (< 0) by tag itself
+void xalloc_account(mem_tag_t tag, int64_t bytes);
+// bytes tag holds now, and the most it has held at once
+void xalloc_usage(mem_tag_t tag, uint64_t *current, uint64_t *peak);
+
 #endif /* ZMAP_ALLOC_H */
@@ -13,7 +13,9 @@ checks = [
     ("zopt.ggo.in", "zmap.1.ronn"),
     ("zbopt.ggo.in", "zblocklist.1.ronn"),
     ("zitopt.ggo.in", "ziterate.1.ronn"),
-    ("ztopt.ggo.in", "ztee.1.ronn")
+    ("topt.ggo.in", "ztee.1.ronn"),
+    ("ztopt.ggo.in", "ztests.1.ronn"),
+    ("zropt.ggo.in", "zreflect.1.ronn")
 ]
 
 failures = False
@@ -0,0 +1,176 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "capture_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "../lib/logger.h"
+
+#include "state.h"
+
+// pcap with nanosecond timestamps, in host byte order
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+#define PCAP_SNAPLEN 65535
+// the link types of the link layer header lengths zmap knows
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record_header {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+static int fd = -1;
+static const char *filename;
+static uint8_t *map;
+static uint64_t map_len;
+// bytes reserved so far, and the offset of the first frame that didn't
+// fit: the frames before it are all written by the time the file is closed
+static uint64_t used;
+static uint64_t full_at;
+static uint64_t frames;
+static uint64_t dropped;
+
+void capture_file_open(const char *path, uint64_t max_bytes)
+{
+	filename = path;
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_fatal("capture", "unable to open %s: %s", path,
+			  strerror(errno));
+	}
+	// sparse until written
+	if (ftruncate(fd, (off_t)max_bytes)) {
+		log_fatal("capture", "unable to size %s: %s", path,
+			  strerror(errno));
+	}
+	map = mmap(NULL, max_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		log_fatal("capture", "unable to map %s: %s", path,
+			  strerror(errno));
+	}
+	madvise(map, max_bytes, MADV_SEQUENTIAL);
+	map_len = max_bytes;
+	used = sizeof(struct pcap_file_header);
+	full_at = max_bytes;
+}
+
+static void mark_full(uint64_t off)
+{
+	uint64_t cur = __atomic_load_n(&full_at, __ATOMIC_RELAXED);
+	while (off < cur && !__atomic_compare_exchange_n(&full_at, &cur, off, 0,
+							  __ATOMIC_RELAXED,
+							  __ATOMIC_RELAXED)) {
+	}
+	if (__atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED) == 0) {
+		log_warn("capture", "%s is full, further responses are "
+				    "dropped (see --capture-only-max)",
+			 filename);
+	}
+}
+
+void capture_file_write(const struct timespec ts, const uint8_t *bytes,
+			uint32_t len)
+{
+	if (len > PCAP_SNAPLEN) {
+		len = PCAP_SNAPLEN;
+	}
+	uint64_t need = sizeof(struct pcap_record_header) + len;
+	uint64_t off = __atomic_fetch_add(&used, need, __ATOMIC_RELAXED);
+	if (off + need > map_len) {
+		mark_full(off);
+		return;
+	}
+	struct pcap_record_header h = {
+	    .ts_sec = (uint32_t)ts.tv_sec,
+	    .ts_nsec = (uint32_t)ts.tv_nsec,
+	    .caplen = len,
+	    .len = len,
+	};
+	memcpy(map + off, &h, sizeof(h));
+	memcpy(map + off + sizeof(h), bytes, len);
+	__atomic_fetch_add(&frames, 1, __ATOMIC_RELAXED);
+}
+
+static uint32_t linktype(void)
+{
+	switch (zconf.data_link_size) {
+	case 0:
+		return LINKTYPE_RAW;
+	case 4:
+		return LINKTYPE_NULL;
+	case 16:
+		return LINKTYPE_LINUX_SLL;
+	default:
+		return LINKTYPE_ETHERNET;
+	}
+}
+
+void capture_file_close(void)
+{
+	if (fd < 0) {
+		return;
+	}
+	struct pcap_file_header h = {
+	    .magic = PCAP_MAGIC_NSEC,
+	    .version_major = 2,
+	    .version_minor = 4,
+	    .snaplen = PCAP_SNAPLEN,
+	    .linktype = linktype(),
+	};
+	memcpy(map, &h, sizeof(h));
+	uint64_t len = capture_file_bytes();
+	munmap(map, map_len);
+	map = NULL;
+	if (ftruncate(fd, (off_t)len) || close(fd)) {
+		log_error("capture", "unable to finish %s: %s", filename,
+			  strerror(errno));
+	}
+	fd = -1;
+	log_info("capture",
+		 "wrote %" PRIu64 " responses (%" PRIu64 " bytes) to %s%s",
+		 capture_file_frames(), len, filename,
+		 capture_file_dropped() ? ", which filled up" : "");
+}
+
+uint64_t capture_file_frames(void)
+{
+	return __atomic_load_n(&frames, __ATOMIC_RELAXED);
+}
+
+uint64_t capture_file_bytes(void)
+{
+	uint64_t u = __atomic_load_n(&used, __ATOMIC_RELAXED);
+	uint64_t f = __atomic_load_n(&full_at, __ATOMIC_RELAXED);
+	return u < f ? u : f;
+}
+
+uint64_t capture_file_dropped(void)
+{
+	return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,38 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_CAPTURE_FILE_H
+#define ZMAP_CAPTURE_FILE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * --capture-only: validated responses are appended as they are, with their
+ * capture times, to a pcap file (nanosecond timestamps) that --replay-pcap
+ * later classifies. The file is memory-mapped up to its maximum size at the
+ * start and cut to what was written at the end, so any receive thread
+ * appends a frame by reserving its bytes with one atomic add and copying
+ * it, with no lock and no system call.
+ */
+
+// opens path for at most max_bytes of frames, including the pcap headers
+void capture_file_open(const char *path, uint64_t max_bytes);
+// Append a frame of len bytes. Frames that don't fit are counted and
+// dropped.
+void capture_file_write(const struct timespec ts, const uint8_t *bytes,
+			uint32_t len);
+// Writes the file header, of the link layer of the frames captured, and
+// truncates the file to the frames written
+void capture_file_close(void);
+
+uint64_t capture_file_frames(void);
+uint64_t capture_file_bytes(void);
+uint64_t capture_file_dropped(void);
+
+#endif /* ZMAP_CAPTURE_FILE_H */
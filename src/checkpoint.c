@@ -0,0 +1,304 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+#include "recv.h"
+#include "shard.h"
+#include "state.h"
+#include "probe_modules/probe_modules.h"
+
+#define CHECKPOINT_FILE_MAGIC "ZMAPCKP"
+#define CHECKPOINT_FILE_VERSION 2
+
+// Followed by a shard_checkpoint_t for each send thread, then dedup_pages
+// checkpoint_page_t, all in host byte order.
+typedef struct checkpoint_file_header {
+	char magic[8];
+	uint32_t version;
+	uint16_t senders;
+	uint16_t reserved;
+	uint64_t config_hash;
+	uint64_t seed;
+	// unix time the checkpoint was written
+	uint64_t written;
+	uint32_t dedup_pages;
+	uint32_t reserved2;
+} checkpoint_file_header_t;
+
+typedef struct checkpoint_page {
+	uint32_t index;
+	uint32_t reserved;
+	uint8_t bits[RECV_DEDUP_PAGE_BYTES];
+} checkpoint_page_t;
+
+static iterator_t *iter = NULL;
+static uint64_t config_hash = 0;
+
+// --resume: what was read, until the shards and the bitmap have it
+static checkpoint_file_header_t loaded;
+static shard_checkpoint_t *loaded_shards = NULL;
+static checkpoint_page_t *loaded_pages = NULL;
+
+static pthread_t writer;
+static int writer_started = 0;
+static int writer_stop = 0;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+// FNV-1a
+#define CONFIG_HASH_INIT 0xcbf29ce484222325ULL
+
+static uint64_t hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t hash_str(uint64_t h, const char *s)
+{
+	// with the terminator, so that "" and NULL differ
+	return s ? hash_bytes(h, s, strlen(s) + 1) : hash_bytes(h, "", 0);
+}
+
+// what moves the targets of a shard, or their order
+static uint64_t compute_config_hash(void)
+{
+	uint64_t h = CONFIG_HASH_INIT;
+	h = hash_bytes(h, &zconf.seed, sizeof(zconf.seed));
+	h = hash_bytes(h, &zconf.shard_num, sizeof(zconf.shard_num));
+	h = hash_bytes(h, &zconf.total_shards, sizeof(zconf.total_shards));
+	h = hash_bytes(h, &zconf.senders, sizeof(zconf.senders));
+	h = hash_bytes(h, &zconf.max_targets, sizeof(zconf.max_targets));
+	h = hash_bytes(h, &zsend.max_index, sizeof(zsend.max_index));
+	h = hash_bytes(h, &zconf.list_of_ips_count,
+		       sizeof(zconf.list_of_ips_count));
+	h = hash_bytes(h, &zconf.ports->port_count,
+		       sizeof(zconf.ports->port_count));
+	h = hash_bytes(h, zconf.ports->ports,
+		       zconf.ports->port_count * sizeof(zconf.ports->ports[0]));
+	h = hash_str(h, zconf.probe_module ? zconf.probe_module->name : NULL);
+	h = hash_str(h, zconf.probe_args);
+	for (int i = 0; i < zconf.ipv6_target_patterns_len; i++) {
+		h = hash_str(h, zconf.ipv6_target_patterns[i]);
+	}
+	return h;
+}
+
+static int write_checkpoint(void)
+{
+	const char *path = zconf.checkpoint_filename;
+	checkpoint_file_header_t h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHECKPOINT_FILE_MAGIC, sizeof(CHECKPOINT_FILE_MAGIC));
+	h.version = CHECKPOINT_FILE_VERSION;
+	h.senders = zconf.senders;
+	h.config_hash = config_hash;
+	h.seed = zconf.seed;
+	h.written = (uint64_t)time(NULL);
+
+	// written next to path and renamed over it, so that a crash never
+	// leaves a partial checkpoint
+	size_t tmp_len = strlen(path) + 32;
+	char *tmp = xmalloc(tmp_len);
+	snprintf(tmp, tmp_len, "%s.%ld.tmp", path, (long)getpid());
+	FILE *fp = fopen(tmp, "wb");
+	if (!fp) {
+		log_warn("checkpoint", "unable to create %s: %s", tmp,
+			 strerror(errno));
+		xfree(tmp);
+		return EXIT_FAILURE;
+	}
+	int ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+	for (uint16_t i = 0; ok && i < zconf.senders; i++) {
+		shard_checkpoint_t c;
+		shard_checkpoint_read(get_shard(iter, i), &c);
+		ok = fwrite(&c, sizeof(c), 1, fp) == 1;
+	}
+	checkpoint_page_t *page = xcalloc(1, sizeof(checkpoint_page_t));
+	for (uint32_t i = 0; ok && i < RECV_DEDUP_PAGES; i++) {
+		if (!recv_dedup_get_page(i, page->bits)) {
+			continue;
+		}
+		page->index = i;
+		ok = fwrite(page, sizeof(*page), 1, fp) == 1;
+		h.dedup_pages++;
+	}
+	xfree(page);
+	// the page count goes in once it is known
+	ok = ok && !fseek(fp, 0, SEEK_SET) && fwrite(&h, sizeof(h), 1, fp) == 1;
+	ok = ok && !fflush(fp) && !fsync(fileno(fp));
+	if (fclose(fp)) {
+		ok = 0;
+	}
+	if (!ok || rename(tmp, path)) {
+		log_warn("checkpoint", "unable to write %s: %s", path,
+			 strerror(errno));
+		unlink(tmp);
+		xfree(tmp);
+		return EXIT_FAILURE;
+	}
+	xfree(tmp);
+	log_debug("checkpoint", "wrote %s with %" PRIu32 " dedup pages", path,
+		  h.dedup_pages);
+	return EXIT_SUCCESS;
+}
+
+void checkpoint_load(void)
+{
+	if (!zconf.resume) {
+		return;
+	}
+	const char *path = zconf.checkpoint_filename;
+	FILE *fp = fopen(path, "rb");
+	if (!fp) {
+		log_fatal("checkpoint", "unable to open %s: %s", path,
+			  strerror(errno));
+	}
+	if (fread(&loaded, sizeof(loaded), 1, fp) != 1 ||
+	    memcmp(loaded.magic, CHECKPOINT_FILE_MAGIC,
+		   sizeof(CHECKPOINT_FILE_MAGIC)) ||
+	    loaded.version != CHECKPOINT_FILE_VERSION || !loaded.senders ||
+	    loaded.dedup_pages > RECV_DEDUP_PAGES) {
+		log_fatal("checkpoint", "%s is not a checkpoint of this version",
+			  path);
+	}
+	loaded_shards = xcalloc(loaded.senders, sizeof(shard_checkpoint_t));
+	if (loaded.dedup_pages) {
+		loaded_pages =
+		    xmalloc(loaded.dedup_pages * sizeof(checkpoint_page_t));
+	}
+	if (fread(loaded_shards, sizeof(shard_checkpoint_t), loaded.senders,
+		  fp) != loaded.senders ||
+	    fread(loaded_pages, sizeof(checkpoint_page_t), loaded.dedup_pages,
+		  fp) != loaded.dedup_pages) {
+		log_fatal("checkpoint", "%s is truncated", path);
+	}
+	fclose(fp);
+	zconf.seed = loaded.seed;
+}
+
+void checkpoint_init(iterator_t *it)
+{
+	if (!zconf.checkpoint_filename) {
+		return;
+	}
+	if (zconf.ipv6 && !zsend.index_targets) {
+		log_fatal("checkpoint", "streamed IPv6 targets can't be "
+					"checkpointed");
+	}
+	iter = it;
+	config_hash = compute_config_hash();
+	if (!zconf.resume) {
+		return;
+	}
+	if (loaded.senders != zconf.senders) {
+		log_fatal("checkpoint",
+			  "%s was written with %hu send threads, not %hu",
+			  zconf.checkpoint_filename, loaded.senders,
+			  zconf.senders);
+	}
+	if (loaded.config_hash != config_hash) {
+		log_fatal("checkpoint",
+			  "%s was written by a scan of other targets, ports, "
+			  "shards or probe module",
+			  zconf.checkpoint_filename);
+	}
+	uint64_t targets = 0;
+	for (uint16_t i = 0; i < zconf.senders; i++) {
+		shard_checkpoint_restore(get_shard(it, i), &loaded_shards[i]);
+		targets += loaded_shards[i].targets_scanned;
+	}
+	xfree(loaded_shards);
+	loaded_shards = NULL;
+	time_t written = (time_t)loaded.written;
+	char when[64];
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S",
+		 localtime(&written));
+	log_info("checkpoint",
+		 "resuming from %s (written %s): %" PRIu64 " targets already "
+		 "scanned, %" PRIu32 " dedup pages",
+		 zconf.checkpoint_filename, when, targets, loaded.dedup_pages);
+}
+
+void checkpoint_restore_dedup(void)
+{
+	for (uint32_t i = 0; i < loaded.dedup_pages; i++) {
+		recv_dedup_merge_page(loaded_pages[i].index,
+				      loaded_pages[i].bits);
+	}
+	xfree(loaded_pages);
+	loaded_pages = NULL;
+	loaded.dedup_pages = 0;
+}
+
+static void *start_writer(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&writer_mutex);
+	while (!writer_stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += zconf.checkpoint_interval;
+		while (!writer_stop &&
+		       pthread_cond_timedwait(&writer_cond, &writer_mutex,
+					      &deadline) != ETIMEDOUT) {
+		}
+		if (writer_stop) {
+			break;
+		}
+		pthread_mutex_unlock(&writer_mutex);
+		write_checkpoint();
+		pthread_mutex_lock(&writer_mutex);
+	}
+	pthread_mutex_unlock(&writer_mutex);
+	return NULL;
+}
+
+void checkpoint_start(void)
+{
+	if (!zconf.checkpoint_filename) {
+		return;
+	}
+	if (pthread_create(&writer, NULL, start_writer, NULL)) {
+		log_fatal("checkpoint", "unable to create checkpoint thread");
+	}
+	writer_started = 1;
+	log_debug("checkpoint", "writing %s every %d s",
+		  zconf.checkpoint_filename, zconf.checkpoint_interval);
+}
+
+void checkpoint_finish(void)
+{
+	if (!zconf.checkpoint_filename) {
+		return;
+	}
+	if (writer_started) {
+		pthread_mutex_lock(&writer_mutex);
+		writer_stop = 1;
+		pthread_cond_signal(&writer_cond);
+		pthread_mutex_unlock(&writer_mutex);
+		pthread_join(writer, NULL);
+		writer_started = 0;
+	}
+	write_checkpoint();
+}
@@ -0,0 +1,40 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_CHECKPOINT_H
+#define ZMAP_CHECKPOINT_H
+
+#include "iterator.h"
+
+/*
+ * --checkpoint-file: every --checkpoint-interval seconds, and once the scan
+ * is over, the position of each send thread in its shard, with what it has
+ * counted, is written to the file along with the full IPv4 dedup bitmap.
+ * --resume reads it back and the senders pick up where they were. A sender
+ * publishes a position only once every target before it has been sent, so
+ * up to one batch of targets per send thread is sent again on resume.
+ *
+ * The seed, sharding, send threads, targets, ports and probe module make a
+ * hash that a resumed scan must match, since any of them moves the targets
+ * of a shard.
+ */
+
+// from option parsing, before the seed is set: with --resume, reads the
+// checkpoint and takes the seed from it
+void checkpoint_load(void);
+// once send_init() has set up the shards: checks that a checkpoint being
+// resumed is of this scan and moves the shards to it
+void checkpoint_init(iterator_t *it);
+// from the receive thread once the dedup bitmap is allocated
+void checkpoint_restore_dedup(void);
+// the thread writing the checkpoint every interval
+void checkpoint_start(void);
+// once sending and receiving are over: the last checkpoint
+void checkpoint_finish(void);
+
+#endif /* ZMAP_CHECKPOINT_H */
@@ -44,14 +44,14 @@
 #include <string.h>
 #include <math.h>
 
-#include <gmp.h>
-
 #include "../lib/includes.h"
 #include "../lib/logger.h"
 
 // We will pick the first cyclic group from this list that is
-// larger than the number of IPs in our allowlist. E.g. for an
-// entire Internet scan, this would be cyclic32
+// larger than the number of targets (IPs in our allowlist times ports).
+// E.g. for an entire Internet scan of one port, this would be cyclic32.
+// Above 2^24 there is a group every half power of two, so that no more
+// than a third of the elements of a cycle are not targets.
 // Note: this list should remain ordered by size (primes) ascending.
 
 static cyclic_group_t groups[] = {
@@ -70,41 +70,241 @@ static cyclic_group_t groups[] = {
      .known_primroot = 2,
      .prime_factors = {2, 23, 103, 3541},
      .num_prime_factors = 4},
+    {// 3 * 2^23 + 19
+     .prime = 25165843,
+     .known_primroot = 2,
+     .prime_factors = {2, 3, 13, 19, 16981},
+     .num_prime_factors = 5},
+    {// 2^25 + 35
+     .prime = 33554467,
+     .known_primroot = 2,
+     .prime_factors = {2, 3, 11, 56489},
+     .num_prime_factors = 4},
+    {// 3 * 2^24 + 5
+     .prime = 50331653,
+     .known_primroot = 2,
+     .prime_factors = {2, 7, 313, 5743},
+     .num_prime_factors = 4},
+    {// 2^26 + 15
+     .prime = 67108879,
+     .known_primroot = 3,
+     .prime_factors = {2, 3, 1242757},
+     .num_prime_factors = 3},
+    {// 3 * 2^25 + 23
+     .prime = 100663319,
+     .known_primroot = 7,
+     .prime_factors = {2, 7, 23, 312619},
+     .num_prime_factors = 4},
+    {// 2^27 + 29
+     .prime = 134217757,
+     .known_primroot = 5,
+     .prime_factors = {2, 3, 1242757},
+     .num_prime_factors = 3},
+    {// 3 * 2^26 + 19
+     .prime = 201326611,
+     .known_primroot = 2,
+     .prime_factors = {2, 3, 5, 6710887},
+     .num_prime_factors = 4},
     {// 2^28 + 3
      .prime = 268435459,
      .known_primroot = 2,
      .prime_factors = {2, 3, 19, 87211},
      .num_prime_factors = 4},
+    {// 3 * 2^27 + 5
+     .prime = 402653189,
+     .known_primroot = 2,
+     .prime_factors = {2, 7, 269, 1091},
+     .num_prime_factors = 4},
+    {// 2^29 + 11
+     .prime = 536870923,
+     .known_primroot = 3,
+     .prime_factors = {2, 3, 7, 23, 555767},
+     .num_prime_factors = 5},
+    {// 3 * 2^28 + 89
+     .prime = 805306457,
+     .known_primroot = 3,
+     .prime_factors = {2, 17, 5921371},
+     .num_prime_factors = 3},
+    {// 2^30 + 3
+     .prime = 1073741827,
+     .known_primroot = 2,
+     .prime_factors = {2, 3, 59, 3033169},
+     .num_prime_factors = 4},
+    {// 3 * 2^29 + 5
+     .prime = 1610612741,
+     .known_primroot = 2,
+     .prime_factors = {2, 5, 11, 1399, 5233},
+     .num_prime_factors = 5},
+    {// 2^31 + 11
+     .prime = 2147483659,
+     .known_primroot = 2,
+     .prime_factors = {2, 3, 149, 2402107},
+     .num_prime_factors = 4},
+    {// 3 * 2^30 + 1
+     .prime = 3221225473,
+     .known_primroot = 5,
+     .prime_factors = {2, 3},
+     .num_prime_factors = 2},
     {// 2^32 + 15
      .prime = 4294967311,
      .known_primroot = 3,
      .prime_factors = {2, 3, 5, 131, 364289},
      .num_prime_factors = 5},
+    {// 3 * 2^31 + 23
+     .prime = 6442450967,
+     .known_primroot = 7,
+     .prime_factors = {2, 7, 71, 6481339},
+     .num_prime_factors = 4},
     {// 2^33 + 17
      .prime = 8589934609,
      .known_primroot = 19,
      .prime_factors = {2, 3, 59, 3033169},
      .num_prime_factors = 4},
+    {// 3 * 2^32 + 5
+     .prime = 12884901893,
+     .known_primroot = 2,
+     .prime_factors = {2, 3221225473},
+     .num_prime_factors = 2},
     {// 2^34 + 25
      .prime = 17179869209,
      .known_primroot = 3,
      .prime_factors = {2, 83, 1277, 20261},
      .num_prime_factors = 4},
+    {// 3 * 2^33 + 23
+     .prime = 25769803799,
+     .known_primroot = 11,
+     .prime_factors = {2, 12884901899},
+     .num_prime_factors = 2},
+    {// 2^35 + 53
+     .prime = 34359738421,
+     .known_primroot = 2,
+     .prime_factors = {2, 3, 5, 7, 81808901},
+     .num_prime_factors = 5},
+    {// 3 * 2^34 + 47
+     .prime = 51539607599,
+     .known_primroot = 7,
+     .prime_factors = {2, 25769803799},
+     .num_prime_factors = 2},
     {// 2^36 + 31
      .prime = 68719476767,
      .known_primroot = 5,
      .prime_factors = {2, 163, 883, 238727},
      .num_prime_factors = 4},
+    {// 3 * 2^35 + 7
+     .prime = 103079215111,
+     .known_primroot = 3,
+     .prime_factors = {2, 3, 5, 137, 953, 26317},
+     .num_prime_factors = 6},
+    {// 2^37 + 9
+     .prime = 137438953481,
+     .known_primroot = 3,
+     .prime_factors = {2, 5, 137, 953, 26317},
+     .num_prime_factors = 5},
+    {// 3 * 2^36 + 1
+     .prime = 206158430209,
+     .known_primroot = 22,
+     .prime_factors = {2, 3},
+     .num_prime_factors = 2},
+    {// 2^38 + 7
+     .prime = 274877906951,
+     .known_primroot = 7,
+     .prime_factors = {2, 5, 35573, 154543},
+     .num_prime_factors = 4},
+    {// 3 * 2^37 + 25
+     .prime = 412316860441,
+     .known_primroot = 14,
+     .prime_factors = {2, 3, 5, 137, 953, 26317},
+     .num_prime_factors = 6},
+    {// 2^39 + 23
+     .prime = 549755813911,
+     .known_primroot = 3,
+     .prime_factors = {2, 3, 5, 383, 47846459},
+     .num_prime_factors = 5},
+    {// 3 * 2^38 + 5
+     .prime = 824633720837,
+     .known_primroot = 2,
+     .prime_factors = {2, 206158430209},
+     .num_prime_factors = 2},
     {// 2^40 + 15
      .prime = 1099511627791,
      .known_primroot = 3,
      .prime_factors = {2, 3, 5, 36650387593},
      .num_prime_factors = 4},
+    {// 3 * 2^39 + 17
+     .prime = 1649267441681,
+     .known_primroot = 6,
+     .prime_factors = {2, 5, 823, 25049627},
+     .num_prime_factors = 4},
+    {// 2^41 + 27
+     .prime = 2199023255579,
+     .known_primroot = 2,
+     .prime_factors = {2, 277, 3969356057},
+     .num_prime_factors = 3},
+    {// 3 * 2^40 + 89
+     .prime = 3298534883417,
+     .known_primroot = 3,
+     .prime_factors = {2, 369991, 1114397},
+     .num_prime_factors = 3},
+    {// 2^42 + 15
+     .prime = 4398046511119,
+     .known_primroot = 7,
+     .prime_factors = {2, 3, 13, 71, 227, 3498493},
+     .num_prime_factors = 6},
+    {// 3 * 2^41 + 1
+     .prime = 6597069766657,
+     .known_primroot = 5,
+     .prime_factors = {2, 3},
+     .num_prime_factors = 2},
+    {// 2^43 + 29
+     .prime = 8796093022237,
+     .known_primroot = 5,
+     .prime_factors = {2, 3, 13, 71, 227, 3498493},
+     .num_prime_factors = 6},
+    {// 3 * 2^42 + 37
+     .prime = 13194139533349,
+     .known_primroot = 2,
+     .prime_factors = {2, 3, 19, 57869033041},
+     .num_prime_factors = 4},
     {// 2^44 + 7
      .prime = 17592186044423,
      .known_primroot = 5,
      .prime_factors = {2, 11, 53, 97, 155542661},
      .num_prime_factors = 5},
+    {// 3 * 2^43 + 47
+     .prime = 26388279066671,
+     .known_primroot = 11,
+     .prime_factors = {2, 5, 428693, 6155519},
+     .num_prime_factors = 4},
+    {// 2^45 + 59
+     .prime = 35184372088891,
+     .known_primroot = 3,
+     .prime_factors = {2, 3, 5, 19, 120739, 511243},
+     .num_prime_factors = 6},
+    {// 3 * 2^44 + 55
+     .prime = 52776558133303,
+     .known_primroot = 3,
+     .prime_factors = {2, 3, 17, 659, 785155139},
+     .num_prime_factors = 5},
+    {// 2^46 + 15
+     .prime = 70368744177679,
+     .known_primroot = 3,
+     .prime_factors = {2, 3, 1947973, 6020681},
+     .num_prime_factors = 4},
+    {// 3 * 2^45 + 13
+     .prime = 105553116266509,
+     .known_primroot = 6,
+     .prime_factors = {2, 3, 2932031007403},
+     .num_prime_factors = 3},
+    {// 2^47 + 5
+     .prime = 140737488355333,
+     .known_primroot = 6,
+     .prime_factors = {2, 3, 11, 19, 331, 18837001},
+     .num_prime_factors = 6},
+    {// 3 * 2^46 + 55
+     .prime = 211106232533047,
+     .known_primroot = 3,
+     .prime_factors = {2, 3, 41, 67, 16763, 764081},
+     .num_prime_factors = 6},
     {// 2^48 + 23
      .prime = 281474976710677,
      .known_primroot = 6,
@@ -112,6 +312,39 @@ static cyclic_group_t groups[] = {
      .num_prime_factors = 5},
 };
 
+static inline uint64_t mulmod(uint64_t a, uint64_t b, uint64_t p)
+{
+#ifdef __SIZEOF_INT128__
+	return (uint64_t)((unsigned __int128)a * b % p);
+#else
+	// doubling and adding, each step staying below p < 2^63
+	uint64_t r = 0;
+	a %= p;
+	while (b) {
+		if (b & 1) {
+			r = r >= p - a ? r - (p - a) : r + a;
+		}
+		a = a >= p - a ? a - (p - a) : a + a;
+		b >>= 1;
+	}
+	return r;
+#endif
+}
+
+uint64_t cyclic_powmod(uint64_t base, uint64_t exponent, uint64_t prime)
+{
+	uint64_t result = 1 % prime;
+	base %= prime;
+	while (exponent) {
+		if (exponent & 1) {
+			result = mulmod(result, base, prime);
+		}
+		base = mulmod(base, base, prime);
+		exponent >>= 1;
+	}
+	return result;
+}
+
 // Return a (random) number coprime with (p - 1) of the group,
 // which is a generator of the additive group mod (p - 1)
 static uint32_t find_primroot(const cyclic_group_t *group, aesrand_t *aes)
@@ -139,24 +372,13 @@ static uint32_t find_primroot(const cyclic_group_t *group, aesrand_t *aes)
 			continue;
 		}
 
-		mpz_t prime;
-		mpz_init_set_ui(prime, group->prime);
 		int ok = 1;
 		for (size_t i = 0; i < group->num_prime_factors && ok; ++i) {
 			const uint64_t q = group->prime_factors[i];
 			const uint64_t k = (group->prime - 1) / q;
-			mpz_t base, power, res;
-			mpz_init_set_ui(base, candidate);
-			mpz_init_set_ui(power, k);
-			mpz_init(res);
-			mpz_powm(res, base, power, prime);
-			uint64_t res_ui = mpz_get_ui(res);
-			if (res_ui == 1) {
+			if (cyclic_powmod(candidate, k, group->prime) == 1) {
 				ok = 0;
 			}
-			mpz_clear(base);
-			mpz_clear(power);
-			mpz_clear(res);
 		}
 		if (ok) {
 			retv = candidate;
@@ -37,6 +37,37 @@ const cyclic_group_t *get_group(uint64_t min_size);
 // Generate cycle (find generator and inverse)
 cycle_t make_cycle(const cyclic_group_t *group, aesrand_t *aes);
 
+// base^exponent mod p for any p < 2^63, in native arithmetic
+uint64_t cyclic_powmod(uint64_t base, uint64_t exponent, uint64_t prime);
+
+// Multiply by a fixed factor modulo p without a hardware divide, using
+// Shoup's precomputed quotient (a Barrett variant for a constant
+// multiplicand). Requires factor < p < 2^63 and x < p.
+static inline uint64_t cyclic_mulmod_precompute(uint64_t factor, uint64_t prime)
+{
+#ifdef __SIZEOF_INT128__
+	return (uint64_t)(((unsigned __int128)factor << 64) / prime);
+#else
+	(void)factor;
+	(void)prime;
+	return 0;
+#endif
+}
+
+static inline uint64_t cyclic_mulmod(uint64_t x, uint64_t factor,
+				     uint64_t factor_pre, uint64_t prime)
+{
+#ifdef __SIZEOF_INT128__
+	uint64_t q = (uint64_t)(((unsigned __int128)x * factor_pre) >> 64);
+	// exact result is in [0, 2p), so wrapping arithmetic is fine
+	uint64_t r = x * factor - q * prime;
+	return r >= prime ? r - prime : r;
+#else
+	(void)factor_pre;
+	return x * factor % prime;
+#endif
+}
+
 // Perform the isomorphism from (Z/pZ)+ to (Z/pZ)*
 // Given known primitive root of (Z/pZ)* n, with x in (Z/pZ)+, do:
 //	f(x) = n^x mod p
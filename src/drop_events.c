@@ -0,0 +1,141 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "drop_events.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../lib/logger.h"
+
+#include "state.h"
+
+// a queue at least this full is falling behind
+#define DROP_QUEUE_FULL 0.5
+
+const char *const DROP_STAGE_NAMES[NUM_DROP_STAGES] = {
+    [DROP_STAGE_INTERFACE] = "interface",
+    [DROP_STAGE_CAPTURE] = "capture",
+    [DROP_STAGE_PROCESSING] = "processing",
+    [DROP_STAGE_OUTPUT] = "output",
+};
+
+static const char *const DROP_STAGE_HINTS[NUM_DROP_STAGES] = {
+    [DROP_STAGE_INTERFACE] = "a larger NIC ring (ethtool -G) or more RX "
+			     "queues and --recv-threads",
+    [DROP_STAGE_CAPTURE] = "more --recv-threads or a larger "
+			   "--capture-buffer",
+    [DROP_STAGE_PROCESSING] = "more --recv-processing-threads",
+    [DROP_STAGE_OUTPUT] = "a faster output module or a larger "
+			  "--output-queue-size",
+};
+
+static FILE *drop_log = NULL;
+static drop_sample_t last;
+static int have_last = 0;
+static uint64_t counts[NUM_DROP_STAGES];
+
+void drop_events_init(void)
+{
+	if (!zconf.drop_log_filename) {
+		return;
+	}
+	drop_log = fopen(zconf.drop_log_filename, "w");
+	if (!drop_log) {
+		log_fatal("monitor", "unable to open drop log %s: %s",
+			  zconf.drop_log_filename, strerror(errno));
+	}
+}
+
+static int filling(uint64_t depth, uint64_t capacity)
+{
+	return capacity && depth >= DROP_QUEUE_FULL * capacity;
+}
+
+static enum drop_stage attribute(const drop_sample_t *s, uint64_t capture,
+				 uint64_t interface, uint64_t pipeline,
+				 uint64_t output)
+{
+	if (output || filling(s->output_queue, s->output_capacity) ||
+	    (pipeline && s->emit_queue >= s->capture_queue) ||
+	    filling(s->emit_queue, s->pipeline_capacity)) {
+		return DROP_STAGE_OUTPUT;
+	}
+	if (pipeline || filling(s->capture_queue, s->pipeline_capacity)) {
+		return DROP_STAGE_PROCESSING;
+	}
+	if (capture || !interface) {
+		return DROP_STAGE_CAPTURE;
+	}
+	return DROP_STAGE_INTERFACE;
+}
+
+void drop_events_update(const drop_sample_t *s)
+{
+	if (!have_last) {
+		last = *s;
+		have_last = 1;
+		return;
+	}
+	double delta = s->time - last.time;
+	uint64_t capture = s->capture_drops - last.capture_drops;
+	uint64_t interface = s->interface_drops - last.interface_drops;
+	uint64_t pipeline = s->pipeline_drops - last.pipeline_drops;
+	uint64_t output = s->output_drops - last.output_drops;
+	uint64_t captured = s->captured - last.captured;
+	uint64_t written = s->output_written - last.output_written;
+	last = *s;
+	if (!(capture + interface + pipeline + output) || delta <= 0) {
+		return;
+	}
+	enum drop_stage stage =
+	    attribute(s, capture, interface, pipeline, output);
+	counts[stage]++;
+	// by Little's law, from how fast the output module drained the
+	// queue; -1 if it took nothing
+	double latency = 0;
+	if (s->output_queue) {
+		latency = written ? s->output_queue / (written / delta) : -1;
+	}
+	log_warn("monitor",
+		 "responses were dropped at the %s stage "
+		 "(queued: %" PRIu64 " to process, %" PRIu64
+		 " to emit, %" PRIu64 " to output), consider %s",
+		 DROP_STAGE_NAMES[stage], s->capture_queue, s->emit_queue,
+		 s->output_queue, DROP_STAGE_HINTS[stage]);
+	if (!drop_log) {
+		return;
+	}
+	fprintf(drop_log,
+		"{\"time\":%.3f,\"stage\":\"%s\",\"capture_drops\":%" PRIu64
+		",\"interface_drops\":%" PRIu64 ",\"pipeline_drops\":%" PRIu64
+		",\"output_drops\":%" PRIu64 ",\"captured_per_sec\":%.0f"
+		",\"capture_queue\":%" PRIu64 ",\"emit_queue\":%" PRIu64
+		",\"pipeline_capacity\":%" PRIu64 ",\"output_queue\":%" PRIu64
+		",\"output_capacity\":%" PRIu64 ",\"output_latency\":%.3f}\n",
+		s->time - zsend.start, DROP_STAGE_NAMES[stage], capture,
+		interface, pipeline, output, captured / delta, s->capture_queue,
+		s->emit_queue, s->pipeline_capacity, s->output_queue,
+		s->output_capacity, latency);
+	fflush(drop_log);
+}
+
+void drop_events_close(void)
+{
+	if (drop_log) {
+		fclose(drop_log);
+		drop_log = NULL;
+	}
+}
+
+uint64_t drop_events_count(enum drop_stage stage)
+{
+	return counts[stage];
+}
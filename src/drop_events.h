@@ -0,0 +1,59 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_DROP_EVENTS_H
+#define ZMAP_DROP_EVENTS_H
+
+#include <stdint.h>
+
+/*
+ * Where responses are lost. After each update the monitor hands over its
+ * running totals, and an update in which anything was dropped becomes an
+ * event, put down to the stage that fell behind: the furthest along the
+ * receive path whose queue was filling, or the capture itself if nothing
+ * after it was. The interface only when it alone dropped frames. With
+ * --drop-log every event is written as a line of JSON.
+ */
+enum drop_stage {
+	DROP_STAGE_INTERFACE,  // the NIC, before the kernel
+	DROP_STAGE_CAPTURE,    // the capture buffer or ring, or its thread
+	DROP_STAGE_PROCESSING, // --recv-processing-threads
+	DROP_STAGE_OUTPUT,     // the sequencer, output queue and module
+	NUM_DROP_STAGES
+};
+
+extern const char *const DROP_STAGE_NAMES[NUM_DROP_STAGES];
+
+// running totals and queue depths, as the monitor exports them
+typedef struct drop_sample {
+	double time;
+	uint64_t capture_drops;	  // pcap ps_drop, or the ring's
+	uint64_t interface_drops; // pcap ps_ifdrop
+	uint64_t pipeline_drops;
+	uint64_t output_drops;
+	uint64_t captured;
+	// frames waiting for the processing threads, then for the sequencer,
+	// out of the pipeline rings' capacity
+	uint64_t capture_queue;
+	uint64_t emit_queue;
+	uint64_t pipeline_capacity;
+	// --output-queue-size: results waiting, results the output module
+	// has taken so far, and the ring's capacity
+	uint64_t output_queue;
+	uint64_t output_written;
+	uint64_t output_capacity;
+} drop_sample_t;
+
+// opens --drop-log
+void drop_events_init(void);
+void drop_events_update(const drop_sample_t *s);
+void drop_events_close(void);
+// the events put down to each stage
+uint64_t drop_events_count(enum drop_stage stage);
+
+#endif /* ZMAP_DROP_EVENTS_H */
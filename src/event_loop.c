@@ -0,0 +1,136 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "event_loop.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/logger.h"
+#include "../lib/util.h"
+
+#include "monitor.h"
+#include "recv.h"
+#include "send.h"
+#include "state.h"
+
+// once sending is done, how long a wait lasts at most before the cooldown
+// is looked at again
+#define EVENT_LOOP_COOLDOWN_NS 10000000ull
+
+static struct {
+	iterator_t *it;
+	pthread_mutex_t *lock;
+	int capture_fd;
+	// until receiving is over, when the capture is closed
+	int receiving;
+	uint64_t interval_ns;
+	uint64_t next_update_ns;
+} loop;
+
+static inline uint64_t clock_ns(void)
+{
+	return (uint64_t)(steady_now() * 1e9);
+}
+
+static int poll_ns(struct pollfd *fds, nfds_t n, uint64_t timeout_ns)
+{
+#if defined __linux__ && __linux__
+	struct timespec ts = {.tv_sec = timeout_ns / 1000000000,
+			      .tv_nsec = timeout_ns % 1000000000};
+	return ppoll(fds, n, &ts, NULL);
+#else
+	// rounded up, the rate's burst making up for a late wakeup
+	return poll(fds, n, (int)((timeout_ns + 999999) / 1000000));
+#endif
+}
+
+static void receive(void)
+{
+	if (recv_step()) {
+		// --max-results, or the cooldown is over
+		recv_finish(loop.lock);
+		loop.receiving = 0;
+	}
+}
+
+void event_loop_wait(uint64_t until_ns)
+{
+	for (;;) {
+		uint64_t t = clock_ns();
+		if (t >= loop.next_update_ns) {
+			monitor_update(loop.it, loop.lock);
+			loop.next_update_ns = t + loop.interval_ns;
+		}
+		uint64_t end = until_ns < loop.next_update_ns
+				   ? until_ns
+				   : loop.next_update_ns;
+		struct pollfd fds[2];
+		nfds_t n = 0;
+		if (loop.receiving) {
+			fds[n++] = (struct pollfd){.fd = loop.capture_fd,
+						   .events = POLLIN};
+		}
+		int metrics = monitor_fd();
+		if (metrics >= 0) {
+			fds[n++] = (struct pollfd){.fd = metrics,
+						   .events = POLLIN};
+		}
+		int rc = poll_ns(fds, n, end > t ? end - t : 0);
+		if (rc < 0 && errno != EINTR) {
+			log_fatal("event-loop", "poll failed: %s",
+				  strerror(errno));
+		}
+		for (nfds_t i = 0; rc > 0 && i < n; i++) {
+			if (!fds[i].revents) {
+				continue;
+			}
+			if (fds[i].fd == metrics) {
+				monitor_serve();
+			} else if (loop.receiving) {
+				receive();
+			}
+		}
+		if (clock_ns() >= until_ns) {
+			return;
+		}
+	}
+}
+
+void event_loop_run(sock_t sock, shard_t *shard, iterator_t *it,
+		    pthread_mutex_t *lock)
+{
+	loop.it = it;
+	loop.lock = lock;
+	loop.capture_fd = recv_fd();
+	if (loop.capture_fd < 0) {
+		log_fatal("event-loop", "--event-loop needs a receive backend "
+					"with a descriptor to poll (pcap)");
+	}
+	loop.receiving = 1;
+	loop.interval_ns = (uint64_t)(monitor_interval() * 1e9);
+	loop.next_update_ns = clock_ns();
+	log_debug("event-loop", "sending, receiving and monitoring on one "
+				"thread");
+	if (send_run(sock, shard) != EXIT_SUCCESS) {
+		log_fatal("send", "send_run failed, terminating");
+	}
+	// the cooldown
+	while (loop.receiving) {
+		event_loop_wait(clock_ns() + EVENT_LOOP_COOLDOWN_NS);
+		if (loop.receiving) {
+			receive();
+		}
+	}
+	monitor_finish(it, lock);
+}
@@ -0,0 +1,38 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_EVENT_LOOP_H
+#define ZMAP_EVENT_LOOP_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "iterator.h"
+#include "shard.h"
+#include "socket.h"
+
+/*
+ * --event-loop: on a single core the send, receive and monitor threads
+ * mostly preempt one another, and a sender spinning for the rate's next
+ * tokens holds the core the receiver needs. Here the one send thread does
+ * it all: after each batch it takes the responses the capture has waiting,
+ * and it waits for the rate's tokens in poll() on the capture and the
+ * metrics socket, doing the monitor's update whenever one is due.
+ */
+
+// Runs the scan of shard through sock on this thread, and its cooldown,
+// once the capture is open and the monitor initialized. lock is the one
+// recv_start() was given.
+void event_loop_run(sock_t sock, shard_t *shard, iterator_t *it,
+		    pthread_mutex_t *lock);
+
+// From the send path: handles whatever is ready, waiting for it until
+// until_ns (CLOCK_MONOTONIC) at most, 0 not to wait
+void event_loop_wait(uint64_t until_ns);
+
+#endif /* ZMAP_EVENT_LOOP_H */
@@ -8,6 +8,10 @@
 
 #include "expression.h"
 #include "fieldset.h"
+#include "filter_set.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
 
 #include "../lib/xalloc.h"
 
@@ -17,8 +21,67 @@ static node_t *alloc_node(void);
 static int eval_gt_node(node_t *node, fieldset_t *fields);
 static int eval_lt_node(node_t *node, fieldset_t *fields);
 static int eval_eq_node(node_t *node, fieldset_t *fields);
+static int ip_in_prefix(const uint8_t *addr, const struct ip_literal *lit)
+{
+	int full = lit->prefix_len / 8;
+	int rem = lit->prefix_len % 8;
+	if (memcmp(addr, lit->addr, full)) {
+		return 0;
+	}
+	if (rem) {
+		uint8_t mask = (uint8_t)(0xFF << (8 - rem));
+		return (addr[full] & mask) == (lit->addr[full] & mask);
+	}
+	return 1;
+}
+
+int eval_ip_field(enum operation op, const struct ip_literal *lit,
+		  const field_t *f)
+{
+	uint8_t addr[16];
+	size_t len;
+	if (f->type == FS_IPV4 && lit->family == AF_INET) {
+		uint32_t v = (uint32_t)f->value.num;
+		len = sizeof(v);
+		memcpy(addr, &v, len);
+	} else if (f->type == FS_IPV6 && lit->family == AF_INET6) {
+		len = sizeof(addr);
+		memcpy(addr, f->value.ptr, len);
+	} else {
+		// other family, or no address at all
+		return op == NEQ;
+	}
+	// network order, so bytewise comparison is numeric
+	int cmp = memcmp(addr, lit->addr, len);
+	switch (op) {
+	case EQ:
+		return ip_in_prefix(addr, lit);
+	case NEQ:
+		return !ip_in_prefix(addr, lit);
+	case GT:
+		return cmp > 0;
+	case LT:
+		return cmp < 0;
+	case GT_EQ:
+		return cmp >= 0;
+	case LT_EQ:
+		return cmp <= 0;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static int eval_ip_node(node_t *node, fieldset_t *fields)
+{
+	return eval_ip_field(
+	    node->value.op, &node->right_child->value.ip,
+	    &(fields->fields[node->left_child->value.field.index]));
+}
+
 static int eval_lt_eq_node(node_t *node, fieldset_t *fields);
 static int eval_gt_eq_node(node_t *node, fieldset_t *fields);
+static int eval_ip_node(node_t *node, fieldset_t *fields);
 
 static node_t *alloc_node(void)
 {
@@ -108,6 +171,50 @@ node_t *make_int_node(int literal)
 	return node;
 }
 
+node_t *make_ip_node(char *literal)
+{
+	node_t *node = alloc_node();
+	node->type = IP;
+	struct ip_literal *ip = &node->value.ip;
+	memset(ip, 0, sizeof(*ip));
+	char *slash = strchr(literal, '/');
+	if (slash) {
+		*slash = '\0';
+	}
+	int max_len;
+	if (inet_pton(AF_INET, literal, ip->addr) == 1) {
+		ip->family = AF_INET;
+		max_len = 32;
+	} else if (inet_pton(AF_INET6, literal, ip->addr) == 1) {
+		ip->family = AF_INET6;
+		max_len = 128;
+	} else {
+		// reported by validate_filter
+		return node;
+	}
+	ip->prefix_len = max_len;
+	if (slash) {
+		char *end;
+		long l = strtol(slash + 1, &end, 10);
+		if (*end || l < 0 || l > max_len) {
+			ip->family = 0;
+		} else {
+			ip->prefix_len = (int)l;
+		}
+		*slash = '/';
+	}
+	return node;
+}
+
+node_t *make_set_node(char *path)
+{
+	node_t *node = alloc_node();
+	node->type = SET;
+	node->value.set.path = path;
+	node->value.set.set = NULL;
+	return node;
+}
+
 int evaluate_expression(node_t *root, fieldset_t *fields)
 {
 	if (!root)
@@ -116,10 +223,22 @@ int evaluate_expression(node_t *root, fieldset_t *fields)
 	case FIELD:
 	case STRING:
 	case INT:
+	case IP:
+	case SET:
 		return 1;
 	case OP:
 		break;
 	}
+	if (root->value.op == IN || root->value.op == NOT_IN) {
+		const field_t *f =
+		    &(fields->fields[root->left_child->value.field.index]);
+		return filter_set_contains(root->right_child->value.set.set, f) ==
+		       (root->value.op == IN);
+	}
+	if (root->value.op != AND && root->value.op != OR &&
+	    root->right_child->type == IP) {
+		return eval_ip_node(root, fields);
+	}
 	switch (root->value.op) {
 	case GT:
 		return eval_gt_node(root, fields);
@@ -133,6 +252,9 @@ int evaluate_expression(node_t *root, fieldset_t *fields)
 		return eval_lt_eq_node(root, fields);
 	case GT_EQ:
 		return eval_gt_eq_node(root, fields);
+	case IN:
+	case NOT_IN:
+		break;
 	case AND:
 		return (evaluate_expression(root->left_child, fields) &&
 			evaluate_expression(root->right_child, fields));
@@ -162,6 +284,20 @@ void print_expression(node_t *root)
 	case INT:
 		printf(" %llu) ", (long long unsigned)root->value.int_literal);
 		break;
+	case IP: {
+		char buf[INET6_ADDRSTRLEN];
+		if (root->value.ip.family) {
+			inet_ntop(root->value.ip.family, root->value.ip.addr, buf,
+				  sizeof(buf));
+		} else {
+			strcpy(buf, "invalid");
+		}
+		printf("%s/%d) ", buf, root->value.ip.prefix_len);
+		break;
+	}
+	case SET:
+		printf("@%s) ", root->value.set.path);
+		break;
 	default:
 		break;
 	}
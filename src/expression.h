@@ -23,23 +23,46 @@ enum operation { GT,
 		 AND,
 		 OR,
 		 LT_EQ,
-		 GT_EQ };
+		 GT_EQ,
+		 IN,
+		 NOT_IN };
 
 enum node_type { OP,
 		 FIELD,
 		 STRING,
-		 INT };
+		 INT,
+		 IP,
+		 SET };
 
 struct field_id {
 	int index;
 	char *fieldname;
 };
 
+// an address or CIDR prefix; = and != test membership, the other
+// operations compare the address numerically
+struct ip_literal {
+	int family; // AF_INET, AF_INET6, or 0 if it did not parse
+	uint8_t addr[16];
+	int prefix_len;
+};
+
+struct filter_set;
+
+// @file of `in` and `!in`, loaded by validate_filter once the field's type
+// is known
+struct set_literal {
+	char *path;
+	struct filter_set *set;
+};
+
 union node_value {
 	struct field_id field;
 	char *string_literal;
 	uint64_t int_literal;
 	enum operation op;
+	struct ip_literal ip;
+	struct set_literal set;
 };
 
 typedef struct node_st {
@@ -57,8 +80,16 @@ node_t *make_string_node(char *literal);
 
 node_t *make_int_node(int literal);
 
+node_t *make_ip_node(char *literal);
+
+node_t *make_set_node(char *path);
+
 int evaluate_expression(node_t *root, fieldset_t *fields);
 
+// compare an FS_IPV4/FS_IPV6 field against an address or prefix literal
+int eval_ip_field(enum operation op, const struct ip_literal *lit,
+		  const field_t *f);
+
 void print_expression(node_t *root);
 
 #endif /* ZMAP_TREE_H */
@@ -0,0 +1,320 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "extra_probes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <unistd.h>
+
+#include <json.h>
+
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+#include "fieldset.h"
+#include "output_modules/module_csv.h"
+#include "probe_modules/probe_modules.h"
+
+static char *stream_name(const char *module)
+{
+	const char *base = zconf.output_filename;
+	size_t len;
+	char *name;
+	if (!base || !strcmp(base, "-")) {
+		len = strlen(module) + sizeof(".csv");
+		name = xmalloc(len);
+		snprintf(name, len, "%s.csv", module);
+	} else {
+		len = strlen(base) + 1 + strlen(module) + 1;
+		name = xmalloc(len);
+		snprintf(name, len, "%s.%s", base, module);
+	}
+	return name;
+}
+
+static void init_fields(extra_probe_t *p)
+{
+	fielddefset_t *fds = &p->fsconf.defs;
+	gen_fielddef_set(fds, (fielddef_t *)&(ip_fields), ip_fields_len);
+	gen_fielddef_set(fds, p->module->fields, p->module->numfields);
+	gen_fielddef_set(fds, (fielddef_t *)&(sys_fields), sys_fields_len);
+	p->fsconf.success_index = fds_get_index_by_name(fds, "success");
+	if (p->fsconf.success_index < 0) {
+		log_fatal("extra_probes",
+			  "probe module %s does not supply required success "
+			  "field.",
+			  p->module->name);
+	}
+	p->fsconf.app_success_index = fds_get_index_by_name(fds, "app_success");
+	p->fsconf.classification_index =
+	    fds_get_index_by_name(fds, "classification");
+	fds_set_needed(fds, p->fsconf.success_index);
+	if (p->fsconf.classification_index >= 0) {
+		fds_set_needed(fds, p->fsconf.classification_index);
+	}
+
+	// the output fields the module has, in the order asked for
+	translation_t *t = &p->fsconf.translation;
+	memset(t, 0, sizeof(*t));
+	int all = !strcmp(zconf.raw_output_fields, "*");
+	int n = all ? fds->len : zconf.output_fields_len;
+	p->output_fields = xcalloc(n ? n : 1, sizeof(const char *));
+	for (int i = 0; i < n; i++) {
+		const char *name = all ? fds->fielddefs[i].name
+				       : zconf.output_fields[i];
+		int index = fds_get_index_by_name(fds, name);
+		if (index < 0) {
+			log_warn("extra_probes",
+				  "probe module %s has no field %s, leaving "
+				  "it out of its output",
+				  p->module->name, name);
+			continue;
+		}
+		fds_set_needed(fds, index);
+		t->translation[t->len++] = index;
+		p->output_fields[p->output_fields_len++] = name;
+	}
+	if (!t->len) {
+		log_fatal("extra_probes",
+			  "probe module %s has none of the output fields",
+			  p->module->name);
+	}
+}
+
+void extra_probes_init(char **specs, int num_specs)
+{
+	if (!num_specs) {
+		return;
+	}
+	// both hand the frames of the one batch a send thread has to the
+	// kernel, and each probe module needs a batch of its own
+#ifdef XDP
+	log_fatal("extra_probes",
+		  "--extra-probe-module is not supported by the AF_XDP sender");
+#endif
+	if (zconf.send_method != SEND_METHOD_SENDMMSG) {
+		log_fatal("extra_probes", "--extra-probe-module requires "
+					  "--send-method=sendmmsg");
+	}
+	zconf.extra_probes = xcalloc(num_specs, sizeof(extra_probe_t));
+	zconf.num_extra_probes = num_specs;
+	for (int i = 0; i < num_specs; i++) {
+		extra_probe_t *p = &zconf.extra_probes[i];
+		char *name = strdup(specs[i]);
+		char *args = strchr(name, ':');
+		if (args) {
+			*args++ = '\0';
+			p->probe_args = args;
+		}
+		p->fraction = 1;
+		char *fraction = strchr(name, '@');
+		if (fraction) {
+			*fraction++ = '\0';
+			char *end;
+			p->fraction = strtod(fraction, &end);
+			if (end == fraction || *end || !(p->fraction > 0) ||
+			    p->fraction > 1) {
+				log_fatal("extra_probes",
+					  "fraction of %s must be in (0, 1]: %s",
+					  name, fraction);
+			}
+		}
+		if (p->fraction < 1) {
+			p->sampled = 1;
+			p->threshold = (uint64_t)(p->fraction * 0x1p64);
+			// a subset of its own for each module, the same for
+			// the same seed
+			p->key = (zconf.seed + (uint64_t)i + 1) *
+				 0x9e3779b97f4a7c15ULL;
+		}
+		p->module = get_probe_module_by_name(name);
+		if (!p->module) {
+			log_fatal("extra_probes", "specified probe module (%s) "
+						  "does not exist",
+				  name);
+		}
+		if (p->module == zconf.probe_module) {
+			log_fatal("extra_probes",
+				  "probe module %s is already the main one",
+				  name);
+		}
+		for (int j = 0; j < i; j++) {
+			if (zconf.extra_probes[j].module == p->module) {
+				log_fatal("extra_probes",
+					  "probe module %s given twice, "
+					  "probe modules keep global state",
+					  name);
+			}
+		}
+		if (p->module->output_type == OUTPUT_TYPE_DYNAMIC) {
+			log_fatal("extra_probes",
+				  "probe module %s has dynamic output and cannot "
+				  "be an extra probe module",
+				  name);
+		}
+		init_fields(p);
+		p->output_filename = stream_name(name);
+		p->fd = open(p->output_filename, O_WRONLY | O_CREAT | O_TRUNC,
+			     0666);
+		if (p->fd < 0) {
+			log_fatal("extra_probes",
+				  "could not open output file (%s): %s",
+				  p->output_filename, strerror(errno));
+		}
+		obuf_init(&p->out, p->fd, p->module->name, NULL);
+		if (!zconf.no_header_row) {
+			csv_write_header(&p->out, p->output_fields,
+					 p->output_fields_len);
+		}
+		if (p->sampled) {
+			log_info("extra_probes",
+				 "also probing %.4g of the targets with %s, "
+				 "results in %s",
+				 p->fraction, name, p->output_filename);
+		} else {
+			log_info("extra_probes",
+				 "also probing with %s, results in %s", name,
+				 p->output_filename);
+		}
+	}
+}
+
+void extra_probes_global_initialize(void)
+{
+	// each module sees its own --probe-args and fields in the conf
+	static struct state_conf conf;
+	for (int i = 0; i < zconf.num_extra_probes; i++) {
+		extra_probe_t *p = &zconf.extra_probes[i];
+		if (!p->module->global_initialize) {
+			continue;
+		}
+		conf = zconf;
+		conf.probe_module = p->module;
+		conf.probe_args = p->probe_args;
+		conf.fsconf = p->fsconf;
+		if (p->module->global_initialize(&conf)) {
+			log_fatal("send", "global initialization for probe "
+					  "module %s failed.",
+				  p->module->name);
+		}
+	}
+}
+
+size_t probes_max_packet_length(void)
+{
+	size_t len = zconf.probe_module->max_packet_length;
+	for (int i = 0; i < zconf.num_extra_probes; i++) {
+		size_t l = zconf.extra_probes[i].module->max_packet_length;
+		if (l > len) {
+			len = l;
+		}
+	}
+	return len;
+}
+
+int probes_pcap_snaplen(void)
+{
+	int len = zconf.probe_module->pcap_snaplen;
+	for (int i = 0; i < zconf.num_extra_probes; i++) {
+		int l = zconf.extra_probes[i].module->pcap_snaplen;
+		if (l > len) {
+			len = l;
+		}
+	}
+	return len;
+}
+
+void probes_pcap_filter(char *buf, size_t len)
+{
+	buf[0] = '\0';
+	size_t used = 0;
+	for (int i = -1; i < zconf.num_extra_probes; i++) {
+		const probe_module_t *pm =
+		    i < 0 ? zconf.probe_module : zconf.extra_probes[i].module;
+		if (!pm->pcap_filter || !pm->pcap_filter[0]) {
+			// one module seeing everything is all of them
+			buf[0] = '\0';
+			return;
+		}
+		int n = zconf.num_extra_probes
+			    ? snprintf(buf + used, len - used, "%s(%s)",
+				       used ? " or " : "", pm->pcap_filter)
+			    : snprintf(buf, len, "%s", pm->pcap_filter);
+		if (n < 0 || (size_t)n >= len - used) {
+			log_fatal("extra_probes",
+				  "capture filters of the probe modules are "
+				  "too long together");
+		}
+		used += n;
+	}
+}
+
+void extra_probe_emit(extra_probe_t *p, fieldset_t *fs)
+{
+	p->validation_passed++;
+	int is_success = fs_get_uint64_by_index(fs, p->fsconf.success_index);
+	if (is_success) {
+		p->success_total++;
+	}
+	if (is_success || !zconf.default_mode) {
+		fs_view_t view = {.fs = fs, .t = &p->fsconf.translation};
+		csv_write_view(&p->out, &view);
+	}
+	fs_free(fs);
+}
+
+void extra_probes_close(void)
+{
+	for (int i = 0; i < zconf.num_extra_probes; i++) {
+		extra_probe_t *p = &zconf.extra_probes[i];
+		if (p->module->close) {
+			p->module->close(&zconf, &zsend, &zrecv);
+		}
+		obuf_close(&p->out);
+		log_info("extra_probes",
+			 "%s: %" PRIu64 " packets sent, %" PRIu64
+			 " responses, %" PRIu64 " successful",
+			 p->module->name, p->packets_sent, p->validation_passed,
+			 p->success_total);
+	}
+}
+
+struct json_object *extra_probes_json(void)
+{
+	json_object *arr = json_object_new_array();
+	for (int i = 0; i < zconf.num_extra_probes; i++) {
+		const extra_probe_t *p = &zconf.extra_probes[i];
+		json_object *obj = json_object_new_object();
+		json_object_object_add(obj, "probe_module",
+				       json_object_new_string(p->module->name));
+		if (p->probe_args) {
+			json_object_object_add(
+			    obj, "probe_args",
+			    json_object_new_string(p->probe_args));
+		}
+		json_object_object_add(obj, "fraction",
+				       json_object_new_double(p->fraction));
+		json_object_object_add(
+		    obj, "output_file",
+		    json_object_new_string(p->output_filename));
+		json_object_object_add(obj, "packets_sent",
+				       json_object_new_int64(p->packets_sent));
+		json_object_object_add(
+		    obj, "validation_passed",
+		    json_object_new_int64(p->validation_passed));
+		json_object_object_add(obj, "success_total",
+				       json_object_new_int64(p->success_total));
+		json_object_array_add(arr, obj);
+	}
+	return arr;
+}
@@ -0,0 +1,105 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_EXTRA_PROBES_H
+#define ZMAP_EXTRA_PROBES_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "state.h"
+#include "output_modules/output_buffer.h"
+
+/*
+ * --extra-probe-module runs further probe modules over the same targets in
+ * the same pass: every target the send threads take from the shard is
+ * probed by the main module and then by each extra one, and a response
+ * goes to the first module, main one first, whose validate_packet accepts
+ * it. The modules should therefore tell their responses apart by protocol
+ * or port, as tcp_synscan, udp and icmp_echoscan do.
+ *
+ * A module given as name@fraction probes only that fraction of the
+ * targets, picked by a keyed hash of the address and port so that every
+ * --probes copy goes to the same ones, and so takes that share of the send
+ * rate that the full modules each take.
+ *
+ * Responses to an extra module do not go through the output module. They
+ * are written as CSV to a stream of their own, <output file>.<module> or
+ * <module>.csv when writing to stdout, with the --output-fields that the
+ * module has (all of its fields for "*"). They are not deduplicated and
+ * --output-filter does not apply to them; in default mode only successful
+ * ones are written.
+ */
+typedef struct extra_probe {
+	struct probe_module *module;
+	char *probe_args;
+	struct fieldset_conf fsconf;
+	const char **output_fields;
+	int output_fields_len;
+	char *output_filename;
+	int fd;
+	output_buffer_t out;
+	// of the targets, those probed; if sampled, those whose hash under
+	// key is below threshold
+	double fraction;
+	int sampled;
+	uint64_t key;
+	uint64_t threshold;
+	// added up by the send threads as they finish
+	uint64_t packets_sent;
+	uint64_t validation_passed;
+	uint64_t success_total;
+} extra_probe_t;
+
+// whether p probes the target, of the address dst_ip
+static inline int extra_probe_takes(const extra_probe_t *p,
+				    const ipaddr_t *dst_ip, port_h_t port,
+				    int v6)
+{
+	if (!p->sampled) {
+		return 1;
+	}
+	uint64_t h = p->key ^ port;
+	if (v6) {
+		uint64_t w[2];
+		memcpy(w, &dst_ip->v6, sizeof(w));
+		h ^= w[0] * 0x9e3779b97f4a7c15ULL ^ w[1];
+	} else {
+		h ^= (uint64_t)dst_ip->v4 << 16;
+	}
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h < p->threshold;
+}
+
+// from zmap.c once the main module's fields and the output fields are
+// known; each spec is a module name, optionally followed by @<fraction>
+// and then by :<probe args>
+void extra_probes_init(char **specs, int num_specs);
+// global_initialize of each module, given a copy of zconf with its own
+// --probe-args and fields
+void extra_probes_global_initialize(void);
+// the largest max_packet_length and pcap_snaplen of all the probe modules
+size_t probes_max_packet_length(void);
+int probes_pcap_snaplen(void);
+// the union of the probe modules' capture filters into buf, "" if any
+// of them has none
+void probes_pcap_filter(char *buf, size_t len);
+// writes a response to an extra module out, taking fs
+void extra_probe_emit(extra_probe_t *p, fieldset_t *fs);
+// closes the modules and their streams, logging what each received
+void extra_probes_close(void);
+// for the metadata, an array of what each extra module sent and received
+struct json_object;
+struct json_object *extra_probes_json(void);
+
+#endif /* ZMAP_EXTRA_PROBES_H */
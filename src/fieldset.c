@@ -12,6 +12,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wundef"
@@ -31,19 +33,147 @@ void gen_fielddef_set(fielddefset_t *fds, fielddef_t fs[], int len)
 	fds->len += len;
 }
 
-fieldset_t *fs_new_fieldset(fielddefset_t *fds)
+#define FS_ARENA_ALIGN 16
+
+static __thread fs_arena_t *current_arena = NULL;
+
+void fs_arena_init(fs_arena_t *a, size_t size)
+{
+	a->base = xmalloc_aligned_tag(MEM_RESULTS, FS_ARENA_ALIGN, size);
+	a->size = size;
+	a->head = 0;
+	a->tail = 0;
+}
+
+void fs_arena_reset(fs_arena_t *a)
+{
+	a->head = 0;
+	a->tail = 0;
+}
+
+void fs_arena_use(fs_arena_t *a)
+{
+	current_arena = a;
+}
+
+uint64_t fs_arena_mark(const fs_arena_t *a)
+{
+	return a->head;
+}
+
+void fs_arena_release(fs_arena_t *a, uint64_t mark)
+{
+	__atomic_store_n(&a->tail, mark, __ATOMIC_RELEASE);
+}
+
+// head and tail only ever grow, their offset into base is modulo size
+static void *arena_alloc(fs_arena_t *a, size_t len)
+{
+	len = (len + FS_ARENA_ALIGN - 1) & ~(size_t)(FS_ARENA_ALIGN - 1);
+	if (!a || len > a->size) {
+		return NULL;
+	}
+	uint64_t tail = __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE);
+	uint64_t head = a->head;
+	uint64_t off = head % a->size;
+	if (off + len > a->size) {
+		// never split an allocation across the end, skip to the start
+		head += a->size - off;
+		off = 0;
+	}
+	if (head + len - tail > a->size) {
+		return NULL;
+	}
+	a->head = head + len;
+	return a->base + off;
+}
+
+static inline int arena_owns(const fs_arena_t *a, const void *ptr)
+{
+	return a && (const uint8_t *)ptr >= a->base &&
+	       (const uint8_t *)ptr < a->base + a->size;
+}
+
+void *fs_arena_alloc(size_t len)
+{
+	void *p = arena_alloc(current_arena, len);
+	return p ? p : xmalloc(len);
+}
+
+// free a field value unless it lives in the fieldset's arena
+static inline void fs_release(fieldset_t *fs, void *ptr)
+{
+	if (!arena_owns(fs->arena, ptr)) {
+		free(ptr);
+	}
+}
+
+// room a fieldset without a definition starts with, and grows by each
+// time it runs out, which covers most repeated fields and nested records
+#define FS_CHUNK 8
+
+// fields past len are left uninitialized, nothing reads them
+static fieldset_t *fs_alloc_fieldset(int cap)
 {
-	fieldset_t *f = xcalloc(1, sizeof(fieldset_t));
+	size_t size = sizeof(fieldset_t) + (size_t)cap * sizeof(field_t);
+	fieldset_t *f = arena_alloc(current_arena, size);
+	if (!f) {
+		f = xmalloc(size);
+	}
 	f->len = 0;
+	f->cap = cap;
+	f->fields = f->inline_fields;
+	f->fds = NULL;
+	f->inner_type = 0;
+	f->type = 0;
+	f->free_ = 0;
+	f->arena = current_arena;
+	return f;
+}
+
+static void fs_grow(fieldset_t *fs)
+{
+	int cap = fs->cap + FS_CHUNK;
+	if (cap > MAX_FIELDS) {
+		cap = MAX_FIELDS;
+	}
+	size_t size = (size_t)cap * sizeof(field_t);
+	// the arena is only for the thread that created the fieldset
+	field_t *fields = current_arena == fs->arena
+			      ? arena_alloc(current_arena, size)
+			      : NULL;
+	if (!fields) {
+		fields = xmalloc(size);
+	}
+	memcpy(fields, fs->fields, (size_t)fs->len * sizeof(field_t));
+	if (fs->fields != fs->inline_fields) {
+		fs_release(fs, fs->fields);
+	}
+	fs->fields = fields;
+	fs->cap = cap;
+}
+
+fieldset_t *fs_new_fieldset(fielddefset_t *fds)
+{
+	fieldset_t *f = fs_alloc_fieldset(fds ? fds->len : FS_CHUNK);
 	f->type = FS_FIELDSET;
 	f->fds = fds;
 	return f;
 }
 
+fieldset_t *fs_new_heap_fieldset(int cap)
+{
+	fs_arena_t *arena = current_arena;
+	current_arena = NULL;
+	fieldset_t *f = fs_alloc_fieldset(cap);
+	current_arena = arena;
+	f->type = FS_FIELDSET;
+	return f;
+}
+
 fieldset_t *fs_new_repeated_field(int type, int free_)
 {
-	fieldset_t *f = xcalloc(1, sizeof(fieldset_t));
-	f->len = 0;
+	fieldset_t *f = fs_alloc_fieldset(FS_CHUNK);
 	f->type = FS_REPEATED;
 	f->inner_type = type;
 	f->free_ = free_;
@@ -81,6 +211,9 @@ static inline void fs_add_word(fieldset_t *fs, const char *name, int type,
 	if (fs->len + 1 >= MAX_FIELDS) {
 		log_fatal("fieldset", "out of room in fieldset");
 	}
+	if (fs->len == fs->cap) {
+		fs_grow(fs);
+	}
 	if (fs->type == FS_REPEATED && fs->inner_type != type) {
 		log_fatal(
 		    "fieldset",
@@ -109,7 +242,7 @@ static void fs_modify_word(fieldset_t *fs, const char *name, int type,
 	for (int i = 0; i < fs->len; i++) {
 		if (!strcmp(fs->fields[i].name, name)) {
 			if (fs->fields[i].free_) {
-				free(fs->fields[i].value.ptr);
+				fs_release(fs, fs->fields[i].value.ptr);
 				fs->fields[i].value.ptr = NULL;
 			}
 			fs->fields[i].type = type;
@@ -216,7 +349,7 @@ void fs_add_unsafe_string(fieldset_t *fs, const char *name, char *value,
 		char *safe_value = sanitize_utf8(value);
 
 		if (free_) {
-			free(value);
+			fs_release(fs, value);
 		}
 
 		field_val_t val = {.ptr = safe_value};
@@ -268,6 +401,26 @@ void fs_add_binary(fieldset_t *fs, const char *name, size_t len, void *value,
 	fs_add_word(fs, name, FS_BINARY, free_, len, val);
 }
 
+void fs_add_ipv4(fieldset_t *fs, const char *name, uint32_t addr)
+{
+	field_val_t val = {.num = addr};
+	fs_add_word(fs, name, FS_IPV4, 0, sizeof(uint32_t), val);
+}
+
+static field_val_t copy_ipv6(const struct in6_addr *addr)
+{
+	field_val_t val = {.ptr = fs_arena_alloc(sizeof(struct in6_addr))};
+	memcpy(val.ptr, addr, sizeof(struct in6_addr));
+	return val;
+}
+
+void fs_add_ipv6(fieldset_t *fs, const char *name,
+		 const struct in6_addr *addr)
+{
+	fs_add_word(fs, name, FS_IPV6, 1, sizeof(struct in6_addr),
+		    copy_ipv6(addr));
+}
+
 void fs_add_fieldset(fieldset_t *fs, const char *name, fieldset_t *child)
 {
 	field_val_t val = {.ptr = child};
@@ -318,6 +471,63 @@ void fs_modify_binary(fieldset_t *fs, const char *name, size_t len, void *value,
 	fs_modify_word(fs, name, FS_BINARY, free_, len, val);
 }
 
+void fs_modify_ipv4(fieldset_t *fs, const char *name, uint32_t addr)
+{
+	field_val_t val = {.num = addr};
+	fs_modify_word(fs, name, FS_IPV4, 0, sizeof(uint32_t), val);
+}
+
+void fs_modify_ipv6(fieldset_t *fs, const char *name,
+		    const struct in6_addr *addr)
+{
+	fs_modify_word(fs, name, FS_IPV6, 1, sizeof(struct in6_addr),
+		       copy_ipv6(addr));
+}
+
+// "00" through "99", so dotted quads are built two digits at a time
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+static char *put_octet(char *p, uint8_t v)
+{
+	if (v >= 100) {
+		*p++ = (char)('0' + v / 100);
+		v %= 100;
+		memcpy(p, &digit_pairs[v * 2], 2);
+		return p + 2;
+	}
+	if (v >= 10) {
+		memcpy(p, &digit_pairs[v * 2], 2);
+		return p + 2;
+	}
+	*p++ = (char)('0' + v);
+	return p;
+}
+
+const char *fs_format_ip(const field_t *f, char *buf)
+{
+	if (f->type == FS_IPV6) {
+		inet_ntop(AF_INET6, f->value.ptr, buf, FS_IP_STR_LEN);
+		return buf;
+	}
+	assert(f->type == FS_IPV4);
+	uint8_t octets[4];
+	uint32_t addr = (uint32_t)f->value.num;
+	memcpy(octets, &addr, sizeof(octets));
+	char *p = buf;
+	for (int i = 0; i < 4; i++) {
+		if (i) {
+			*p++ = '.';
+		}
+		p = put_octet(p, octets[i]);
+	}
+	*p = '\0';
+	return buf;
+}
+
 uint64_t fs_get_uint64_by_index(fieldset_t *fs, int index)
 {
 	return (uint64_t)fs->fields[index].value.num;
@@ -328,6 +538,13 @@ char *fs_get_string_by_index(fieldset_t *fs, int index)
 	return (char *)fs->fields[index].value.ptr;
 }
 
+void fds_set_needed(fielddefset_t *fds, int index)
+{
+	assert(index >= 0 && index < MAX_FIELDS);
+	fds->pruned = 1;
+	fds->needed[index / 64] |= 1ULL << (index % 64);
+}
+
 int fds_get_index_by_name(fielddefset_t *fds, const char *name)
 {
 	for (int i = 0; i < fds->len; i++) {
@@ -338,12 +555,12 @@ int fds_get_index_by_name(fielddefset_t *fds, const char *name)
 	return -1;
 }
 
-void field_free(field_t *f)
+static void field_free(fieldset_t *fs, field_t *f)
 {
 	if (f->type == FS_FIELDSET || f->type == FS_REPEATED) {
 		fs_free((fieldset_t *)f->value.ptr);
 	} else if (f->free_) {
-		free(f->value.ptr);
+		fs_release(fs, f->value.ptr);
 	}
 }
 
@@ -354,9 +571,12 @@ void fs_free(fieldset_t *fs)
 	}
 	for (int i = 0; i < fs->len; i++) {
 		field_t *f = &(fs->fields[i]);
-		field_free(f);
+		field_free(fs, f);
 	}
-	free(fs);
+	if (fs->fields != fs->inline_fields) {
+		fs_release(fs, fs->fields);
+	}
+	fs_release(fs, fs);
 }
 
 void fs_generate_fieldset_translation(translation_t *t, fielddefset_t *avail,
@@ -394,17 +614,24 @@ void fs_generate_full_fieldset_translation(translation_t *t,
 	}
 }
 
-fieldset_t *translate_fieldset(fieldset_t *fs, translation_t *t)
+void fs_translate_into(fieldset_t *dst, fieldset_t *fs, translation_t *t)
 {
-	fieldset_t *retv = fs_new_fieldset(NULL);
-	if (!retv) {
-		log_fatal("fieldset",
-			  "unable to allocate space for translated field set");
-	}
+	assert(t->len <= dst->cap);
 	for (int i = 0; i < t->len; i++) {
 		int o = t->translation[i];
-		memcpy(&(retv->fields[i]), &(fs->fields[o]), sizeof(field_t));
+		memcpy(&(dst->fields[i]), &(fs->fields[o]), sizeof(field_t));
 	}
-	retv->len = t->len;
+	dst->len = t->len;
+	dst->fds = NULL;
+	dst->type = FS_FIELDSET;
+	dst->inner_type = 0;
+	dst->free_ = 0;
+	dst->arena = NULL;
+}
+
+fieldset_t *translate_fieldset(fieldset_t *fs, translation_t *t)
+{
+	fieldset_t *retv = fs_new_heap_fieldset(t->len);
+	fs_translate_into(retv, fs, t);
 	return retv;
 }
@@ -24,6 +24,12 @@
 #define FS_BINARY 3
 #define FS_NULL 4
 #define FS_BOOL 7
+// addresses kept in binary and only formatted by output modules
+#define FS_IPV4 8 // network order, in value.num
+#define FS_IPV6 9 // 16 bytes at value.ptr
+
+// buffer needed by fs_format_ip()
+#define FS_IP_STR_LEN 46
 // recursive support
 #define FS_FIELDSET 5
 #define FS_REPEATED 6
@@ -40,6 +46,10 @@ typedef struct field_def {
 typedef struct fielddef_set {
 	fielddef_t fielddefs[MAX_FIELDS];
 	int len;
+	// once any field is marked with fds_set_needed(), the unmarked ones
+	// are consumed by nobody and probe modules may add nulls instead
+	int pruned;
+	uint64_t needed[(MAX_FIELDS + 63) / 64];
 } fielddefset_t;
 
 typedef union field_val {
@@ -61,14 +71,47 @@ typedef struct field {
 // to the output module
 typedef struct fieldset {
 	int len;
-	field_t fields[MAX_FIELDS];
+	// fields has room for cap, which for a fieldset of a definition is
+	// its length and otherwise grows as fields are added
+	int cap;
+	field_t *fields;
 	fielddefset_t *fds;
 	// only used for repeated.
 	int inner_type; // type of repeated element. e.g., FS_STRING
 	int type;	// REPEATED or FIELDSET
 	int free_;	// should elements be freed
+	// arena that was current when the fieldset was created; fs_free()
+	// leaves anything inside it to the arena's owner
+	struct fs_arena *arena;
+	// allocated along with the fieldset, fields points here until it
+	// outgrows them
+	field_t inline_fields[];
 } fieldset_t;
 
+// Allocator the receive path carves fieldsets and their strings from, so
+// that a packet costs no malloc/free. Allocations are bumped off head and
+// reclaimed in bulk by the arena's owner, either all at once
+// (fs_arena_reset) or, when packets are emitted in the order they were
+// built, up to a mark taken after each one (fs_arena_release). head is
+// only advanced by the thread using the arena and tail by the one
+// releasing it. Anything that does not fit falls back to the heap.
+typedef struct fs_arena {
+	uint8_t *base;
+	uint64_t size;
+	uint64_t head;
+	uint64_t tail;
+} fs_arena_t;
+
+void fs_arena_init(fs_arena_t *a, size_t size);
+void fs_arena_reset(fs_arena_t *a);
+// make a the arena this thread allocates fieldsets from, NULL for the heap
+void fs_arena_use(fs_arena_t *a);
+// len bytes from the current arena, or xmalloc if there is none or it is
+// full. Callers that outlive fs_free() must not use this.
+void *fs_arena_alloc(size_t len);
+uint64_t fs_arena_mark(const fs_arena_t *a);
+void fs_arena_release(fs_arena_t *a, uint64_t mark);
+
 // we pass a different fieldset to an output module than
 // the probe module generates for us because a user may
 // only want certain fields and will expect them in a certain
@@ -81,7 +124,28 @@ typedef struct translation {
 	int translation[MAX_FIELDS];
 } translation_t;
 
+// a translated fieldset that is never materialized: field i of the view is
+// field t->translation[i] of fs
+typedef struct fieldset_view {
+	fieldset_t *fs;
+	const translation_t *t;
+} fs_view_t;
+
+static inline int fs_view_len(const fs_view_t *v)
+{
+	return v->t->len;
+}
+
+static inline field_t *fs_view_field(const fs_view_t *v, int i)
+{
+	return &(v->fs->fields[v->t->translation[i]]);
+}
+
+// sized for fds, or growable without one
 fieldset_t *fs_new_fieldset(fielddefset_t *);
+// room for cap fields off the heap regardless of the arena, for the
+// fieldsets fs_translate_into() fills over and over
+fieldset_t *fs_new_heap_fieldset(int cap);
 
 fieldset_t *fs_new_repeated_field(int type, int free_);
 fieldset_t *fs_new_repeated_uint64(void);
@@ -94,6 +158,21 @@ char *fs_get_string_by_index(fieldset_t *fs, int index);
 
 int fds_get_index_by_name(fielddefset_t *fds, const char *name);
 
+void fds_set_needed(fielddefset_t *fds, int index);
+
+// whether the output module or filter consumes the field at index
+static inline int fds_is_needed(const fielddefset_t *fds, int index)
+{
+	return !fds->pruned || (fds->needed[index / 64] >> (index % 64)) & 1;
+}
+
+// whether the next field added to fs is consumed; fields of nested
+// fieldsets always are
+static inline int fs_next_needed(const fieldset_t *fs)
+{
+	return !fs->fds || fds_is_needed(fs->fds, fs->len);
+}
+
 void gen_fielddef_set(fielddefset_t *fds, fielddef_t fs[], int len);
 
 void fs_add_null(fieldset_t *fs, const char *name);
@@ -117,6 +196,13 @@ void fs_add_constchar(fieldset_t *fs, const char *name, const char *value);
 void fs_add_binary(fieldset_t *fs, const char *name, size_t len, void *value,
 		   int free_);
 
+// addr is in network order
+void fs_add_ipv4(fieldset_t *fs, const char *name, uint32_t addr);
+
+struct in6_addr;
+void fs_add_ipv6(fieldset_t *fs, const char *name,
+		 const struct in6_addr *addr);
+
 void fs_add_fieldset(fieldset_t *fs, const char *name, fieldset_t *child);
 void fs_add_repeated(fieldset_t *fs, const char *name, fieldset_t *child);
 
@@ -132,6 +218,15 @@ void fs_modify_string(fieldset_t *fs, const char *name, char *value, int free_);
 void fs_modify_binary(fieldset_t *fs, const char *name, size_t len, void *value,
 		      int free_);
 
+void fs_modify_ipv4(fieldset_t *fs, const char *name, uint32_t addr);
+
+void fs_modify_ipv6(fieldset_t *fs, const char *name,
+		    const struct in6_addr *addr);
+
+// text form of an FS_IPV4 or FS_IPV6 field, written to buf
+// (FS_IP_STR_LEN bytes)
+const char *fs_format_ip(const field_t *f, char *buf);
+
 uint64_t fs_get_uint64_by_index(fieldset_t *fs, int index);
 
 void fs_free(fieldset_t *fs);
@@ -140,6 +235,8 @@ void fs_generate_fieldset_translation(translation_t *t, fielddefset_t *avail,
 				      const char **req, int reqlen);
 
 fieldset_t *translate_fieldset(fieldset_t *fs, translation_t *t);
+// translate into caller-provided storage, which owns none of the fields
+void fs_translate_into(fieldset_t *dst, fieldset_t *fs, translation_t *t);
 
 void fs_generate_full_fieldset_translation(translation_t *t,
 					   fielddefset_t *avail);
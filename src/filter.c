@@ -11,9 +11,14 @@
 #include "lexer.h"
 #include "parser.h"
 #include "expression.h"
+#include "filter_set.h"
 #include "../lib/logger.h"
 
+#include <assert.h>
 #include <string.h>
+#include <arpa/inet.h>
+
+#include "../lib/xalloc.h"
 
 extern int yyparse(void);
 
@@ -69,6 +74,40 @@ static int validate_node(node_t *node, fielddefset_t *fields)
 					fields->fielddefs[index].name);
 				return 0;
 			}
+		case IP:
+			if (strcmp(fields->fielddefs[index].type, "ip")) {
+				fprintf(stderr,
+					"Field '%s' is not of type 'ip'\n",
+					fields->fielddefs[index].name);
+				return 0;
+			}
+			if (!node->right_child->value.ip.family) {
+				fprintf(stderr,
+					"Invalid address or prefix for field '%s'\n",
+					fields->fielddefs[index].name);
+				return 0;
+			}
+			return 1;
+		case SET: {
+			const char *type = fields->fielddefs[index].type;
+			enum filter_set_kind kind;
+			if (!strcmp(type, "ip")) {
+				kind = FILTER_SET_IP;
+			} else if (!strcmp(type, "int") || !strcmp(type, "bool")) {
+				kind = FILTER_SET_INT;
+			} else if (!strcmp(type, "string")) {
+				kind = FILTER_SET_STRING;
+			} else {
+				fprintf(stderr,
+					"Field '%s' of type '%s' can't be looked "
+					"up in a set\n",
+					fields->fielddefs[index].name, type);
+				return 0;
+			}
+			struct set_literal *lit = &node->right_child->value.set;
+			lit->set = filter_set_load(lit->path, kind);
+			return lit->set != NULL;
+		}
 		default:
 			return 0;
 		}
@@ -113,3 +152,265 @@ int validate_filter(node_t *root, fielddefset_t *fields)
 	return (validate_filter(root->left_child, fields) &&
 		validate_filter(root->right_child, fields));
 }
+
+void filter_mark_needed(node_t *root, fielddefset_t *fields)
+{
+	if (!root) {
+		return;
+	}
+	if (root->type == OP && root->value.op != AND && root->value.op != OR) {
+		fds_set_needed(fields, root->left_child->value.field.index);
+		return;
+	}
+	filter_mark_needed(root->left_child, fields);
+	filter_mark_needed(root->right_child, fields);
+}
+
+static int reads_only(node_t *node, const uint8_t *early)
+{
+	if (node->type == OP && node->value.op != AND && node->value.op != OR) {
+		return early[node->left_child->value.field.index];
+	}
+	return reads_only(node->left_child, early) &&
+	       reads_only(node->right_child, early);
+}
+
+static node_t *join_and(node_t *left, node_t *right)
+{
+	if (!left || !right) {
+		return left ? left : right;
+	}
+	node_t *and = make_op_node(AND);
+	and->left_child = left;
+	and->right_child = right;
+	return and;
+}
+
+node_t *filter_prefix(node_t *root, const uint8_t *early)
+{
+	if (!root) {
+		return NULL;
+	}
+	if (root->value.op == AND) {
+		return join_and(filter_prefix(root->left_child, early),
+				filter_prefix(root->right_child, early));
+	}
+	return reads_only(root, early) ? root : NULL;
+}
+
+enum filter_opcode {
+	FOP_UINT_EQ,
+	FOP_UINT_NEQ,
+	FOP_UINT_GT,
+	FOP_UINT_LT,
+	FOP_UINT_GT_EQ,
+	FOP_UINT_LT_EQ,
+	FOP_STR_EQ,
+	FOP_STR_NEQ,
+	FOP_IP,
+	// IPv4 prefix membership, k.num holds the mask and network
+	FOP_IPV4_IN,
+	FOP_IPV4_NOT_IN,
+	// membership of an @file set, k.set
+	FOP_SET_IN,
+	FOP_SET_NOT_IN,
+	// jump to target if the accumulator is false (&&) or true (||)
+	FOP_JUMP_FALSE,
+	FOP_JUMP_TRUE,
+};
+
+struct filter_insn {
+	uint8_t opcode;
+	uint8_t ip_op; // enum operation, for FOP_IP
+	uint16_t field;
+	uint16_t target;
+	union {
+		uint64_t num;
+		const char *str;
+		const struct ip_literal *ip;
+		const struct filter_set *set;
+	} k;
+};
+
+struct filter_program {
+	int len;
+	// only integer equalities joined by &&, e.g. success = 1 && repeat = 0
+	int uint_eq_conjunction;
+	struct filter_insn insns[];
+};
+
+static int count_insns(node_t *node)
+{
+	if (node->type != OP) {
+		return 0;
+	}
+	if (node->value.op == AND || node->value.op == OR) {
+		return 1 + count_insns(node->left_child) +
+		       count_insns(node->right_child);
+	}
+	return 1;
+}
+
+static void compile_node(struct filter_program *prog, node_t *node)
+{
+	if (node->value.op == AND || node->value.op == OR) {
+		compile_node(prog, node->left_child);
+		struct filter_insn *jump = &prog->insns[prog->len++];
+		jump->opcode =
+		    node->value.op == AND ? FOP_JUMP_FALSE : FOP_JUMP_TRUE;
+		compile_node(prog, node->right_child);
+		jump->target = (uint16_t)prog->len;
+		return;
+	}
+	struct filter_insn *in = &prog->insns[prog->len++];
+	in->field = (uint16_t)node->left_child->value.field.index;
+	node_t *literal = node->right_child;
+	switch (literal->type) {
+	case INT: {
+		static const uint8_t uint_ops[] = {
+		    [GT] = FOP_UINT_GT,	      [LT] = FOP_UINT_LT,
+		    [EQ] = FOP_UINT_EQ,	      [NEQ] = FOP_UINT_NEQ,
+		    [LT_EQ] = FOP_UINT_LT_EQ, [GT_EQ] = FOP_UINT_GT_EQ};
+		in->opcode = uint_ops[node->value.op];
+		in->k.num = literal->value.int_literal;
+		break;
+	}
+	case STRING:
+		in->opcode = node->value.op == EQ ? FOP_STR_EQ : FOP_STR_NEQ;
+		in->k.str = literal->value.string_literal;
+		break;
+	case IP:
+		if (literal->value.ip.family == AF_INET &&
+		    (node->value.op == EQ || node->value.op == NEQ)) {
+			int len = literal->value.ip.prefix_len;
+			uint32_t mask = len ? htonl(~0u << (32 - len)) : 0;
+			uint32_t net;
+			memcpy(&net, literal->value.ip.addr, sizeof(net));
+			in->opcode = node->value.op == EQ ? FOP_IPV4_IN
+							  : FOP_IPV4_NOT_IN;
+			in->k.num = ((uint64_t)mask << 32) | (net & mask);
+			break;
+		}
+		in->opcode = FOP_IP;
+		in->ip_op = (uint8_t)node->value.op;
+		in->k.ip = &literal->value.ip;
+		break;
+	case SET:
+		in->opcode = node->value.op == IN ? FOP_SET_IN : FOP_SET_NOT_IN;
+		in->k.set = literal->value.set.set;
+		break;
+	default:
+		log_fatal("filter", "unexpected literal in filter expression");
+	}
+}
+
+struct filter_program *filter_compile(node_t *root)
+{
+	if (!root) {
+		return NULL;
+	}
+	int n = count_insns(root);
+	if (n > UINT16_MAX) {
+		log_fatal("filter", "filter expression is too long");
+	}
+	struct filter_program *prog = xcalloc(
+	    1, sizeof(struct filter_program) + n * sizeof(struct filter_insn));
+	compile_node(prog, root);
+	assert(prog->len == n);
+	prog->uint_eq_conjunction = 1;
+	for (int pc = 0; pc < prog->len; pc++) {
+		uint8_t op = prog->insns[pc].opcode;
+		if (op != FOP_UINT_EQ && op != FOP_JUMP_FALSE) {
+			prog->uint_eq_conjunction = 0;
+		}
+	}
+	return prog;
+}
+
+static inline int str_field_eq(const field_t *f, const char *k)
+{
+	return f->type == FS_STRING && f->value.ptr &&
+	       !strcmp((const char *)f->value.ptr, k);
+}
+
+static inline int ipv4_field_in(const field_t *f, uint64_t k)
+{
+	return f->type == FS_IPV4 &&
+	       ((uint32_t)f->value.num & (uint32_t)(k >> 32)) == (uint32_t)k;
+}
+
+int filter_eval(const struct filter_program *prog, fieldset_t *fs)
+{
+	if (!prog) {
+		return 1;
+	}
+	const struct filter_insn *insns = prog->insns;
+	if (prog->uint_eq_conjunction) {
+		for (int pc = 0; pc < prog->len; pc++) {
+			if (insns[pc].opcode == FOP_UINT_EQ &&
+			    fs->fields[insns[pc].field].value.num !=
+				insns[pc].k.num) {
+				return 0;
+			}
+		}
+		return 1;
+	}
+	int acc = 1;
+	for (int pc = 0; pc < prog->len; pc++) {
+		const struct filter_insn *in = &insns[pc];
+		const field_t *f = &(fs->fields[in->field]);
+		switch (in->opcode) {
+		case FOP_UINT_EQ:
+			acc = f->value.num == in->k.num;
+			break;
+		case FOP_UINT_NEQ:
+			acc = f->value.num != in->k.num;
+			break;
+		case FOP_UINT_GT:
+			acc = f->value.num > in->k.num;
+			break;
+		case FOP_UINT_LT:
+			acc = f->value.num < in->k.num;
+			break;
+		case FOP_UINT_GT_EQ:
+			acc = f->value.num >= in->k.num;
+			break;
+		case FOP_UINT_LT_EQ:
+			acc = f->value.num <= in->k.num;
+			break;
+		case FOP_STR_EQ:
+			acc = str_field_eq(f, in->k.str);
+			break;
+		case FOP_STR_NEQ:
+			acc = !str_field_eq(f, in->k.str);
+			break;
+		case FOP_IP:
+			acc = eval_ip_field((enum operation)in->ip_op, in->k.ip,
+					    f);
+			break;
+		case FOP_IPV4_IN:
+			acc = ipv4_field_in(f, in->k.num);
+			break;
+		case FOP_IPV4_NOT_IN:
+			acc = !ipv4_field_in(f, in->k.num);
+			break;
+		case FOP_SET_IN:
+			acc = filter_set_contains(in->k.set, f);
+			break;
+		case FOP_SET_NOT_IN:
+			acc = !filter_set_contains(in->k.set, f);
+			break;
+		case FOP_JUMP_FALSE:
+			if (!acc) {
+				pc = in->target - 1;
+			}
+			break;
+		case FOP_JUMP_TRUE:
+			if (acc) {
+				pc = in->target - 1;
+			}
+			break;
+		}
+	}
+	return acc;
+}
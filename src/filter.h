@@ -12,12 +12,37 @@
 #include "expression.h"
 #include "fieldset.h"
 
+struct filter_program;
+
 struct output_filter {
 	node_t *expression;
+	// expression after filter_compile(), what is evaluated per response
+	struct filter_program *program;
+	// the conditions of the filter that read only IP header and success
+	// fields, checked before the probe module builds the rest (NULL if
+	// there are none)
+	struct filter_program *early;
 };
 
 int parse_filter_string(char *filter);
 
 int validate_filter(node_t *root, fielddefset_t *fields);
 
+// Flatten a validated expression into a linear program. Comparisons become
+// instructions with the field index and a typed constant resolved, && and
+// || become short-circuit jumps over an accumulator.
+struct filter_program *filter_compile(node_t *root);
+
+// same result as evaluate_expression() on the compiled tree; a NULL
+// program accepts everything
+int filter_eval(const struct filter_program *prog, fieldset_t *fs);
+
+// The conjuncts of a validated expression's top-level && that read only the
+// fields early[] marks, joined by && again, or NULL if there are none. The
+// result shares its subtrees with root; whatever root accepts it does too.
+node_t *filter_prefix(node_t *root, const uint8_t *early);
+
+// mark the fields a validated filter reads with fds_set_needed()
+void filter_mark_needed(node_t *root, fielddefset_t *fields);
+
 #endif /* ZMAP_FILTER_H */
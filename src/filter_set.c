@@ -0,0 +1,348 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "filter_set.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/constraint.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+#define FILTER_SET_MIN_SLOTS 64
+
+// open addressing over keys of one or two words; used[] tells an empty
+// slot from the all-zero key
+typedef struct key_table {
+	uint64_t *keys;
+	uint8_t *used;
+	uint64_t slots;
+	uint64_t len;
+	int words;
+} key_table_t;
+
+struct filter_set {
+	enum filter_set_kind kind;
+	uint64_t size;
+	// FILTER_SET_IP
+	constraint_t *v4;
+	// the IPv6 prefixes by length, and the lengths there are, longest
+	// first
+	key_table_t v6[129];
+	int v6_lens[129];
+	int num_v6_lens;
+	// FILTER_SET_INT
+	key_table_t ints;
+	// FILTER_SET_STRING, slots of strings or NULL
+	char **strs;
+	uint64_t str_slots;
+};
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static inline uint64_t key_hash(const uint64_t *key, int words)
+{
+	uint64_t h = fmix64(key[0]);
+	return words == 2 ? fmix64(h ^ key[1]) : h;
+}
+
+static uint64_t str_hash(const char *s)
+{
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (; *s; s++) {
+		h = (h ^ (uint8_t)*s) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static int key_find(const key_table_t *t, const uint64_t *key, uint64_t *slot)
+{
+	uint64_t s = key_hash(key, t->words) & (t->slots - 1);
+	while (t->used[s]) {
+		if (!memcmp(&t->keys[s * t->words], key,
+			    t->words * sizeof(uint64_t))) {
+			*slot = s;
+			return 1;
+		}
+		s = (s + 1) & (t->slots - 1);
+	}
+	*slot = s;
+	return 0;
+}
+
+static inline int key_contains(const key_table_t *t, const uint64_t *key)
+{
+	uint64_t s;
+	return t->slots && key_find(t, key, &s);
+}
+
+static void key_grow(key_table_t *t)
+{
+	key_table_t n = {.slots = t->slots ? 2 * t->slots : FILTER_SET_MIN_SLOTS,
+			 .words = t->words};
+	n.keys = xcalloc(n.slots * n.words, sizeof(uint64_t));
+	n.used = xcalloc(n.slots, 1);
+	for (uint64_t i = 0; i < t->slots; i++) {
+		uint64_t s;
+		if (t->used[i]) {
+			key_find(&n, &t->keys[i * t->words], &s);
+			memcpy(&n.keys[s * n.words], &t->keys[i * t->words],
+			       n.words * sizeof(uint64_t));
+			n.used[s] = 1;
+			n.len++;
+		}
+	}
+	xfree(t->keys);
+	xfree(t->used);
+	*t = n;
+}
+
+// whether the key was new
+static int key_add(key_table_t *t, const uint64_t *key)
+{
+	if (2 * (t->len + 1) > t->slots) {
+		key_grow(t);
+	}
+	uint64_t s;
+	if (key_find(t, key, &s)) {
+		return 0;
+	}
+	memcpy(&t->keys[s * t->words], key, t->words * sizeof(uint64_t));
+	t->used[s] = 1;
+	t->len++;
+	return 1;
+}
+
+static int str_find(const filter_set_t *set, const char *str, uint64_t *slot)
+{
+	uint64_t s = str_hash(str) & (set->str_slots - 1);
+	while (set->strs[s]) {
+		if (!strcmp(set->strs[s], str)) {
+			*slot = s;
+			return 1;
+		}
+		s = (s + 1) & (set->str_slots - 1);
+	}
+	*slot = s;
+	return 0;
+}
+
+static int str_add(filter_set_t *set, const char *str)
+{
+	if (2 * (set->size + 1) > set->str_slots) {
+		uint64_t old_slots = set->str_slots;
+		char **old = set->strs;
+		set->str_slots = old_slots ? 2 * old_slots : FILTER_SET_MIN_SLOTS;
+		set->strs = xcalloc(set->str_slots, sizeof(char *));
+		for (uint64_t i = 0; i < old_slots; i++) {
+			uint64_t s;
+			if (old[i]) {
+				str_find(set, old[i], &s);
+				set->strs[s] = old[i];
+			}
+		}
+		xfree(old);
+	}
+	uint64_t s;
+	if (str_find(set, str, &s)) {
+		return 0;
+	}
+	set->strs[s] = strdup(str);
+	return 1;
+}
+
+static void mask_v6(uint8_t *addr, int len)
+{
+	for (int b = len; b < 128; b++) {
+		addr[b / 8] &= (uint8_t)~(0x80 >> (b % 8));
+	}
+}
+
+static int cmp_len_desc(const void *a, const void *b)
+{
+	return *(const int *)b - *(const int *)a;
+}
+
+// adds an element, or returns 0 if it doesn't parse
+static int add_line(filter_set_t *set, char *s, constraint_prefix_t **v4,
+		    size_t *v4_len, size_t *v4_cap)
+{
+	if (set->kind == FILTER_SET_STRING) {
+		set->size += str_add(set, s);
+		return 1;
+	}
+	if (set->kind == FILTER_SET_INT) {
+		char *end = NULL;
+		errno = 0;
+		uint64_t v = strtoull(s, &end, 0);
+		if (*end || errno) {
+			return 0;
+		}
+		set->size += key_add(&set->ints, &v);
+		return 1;
+	}
+	char *slash = strchr(s, '/');
+	if (slash) {
+		*slash = '\0';
+	}
+	uint8_t addr[16];
+	int family, max;
+	if (inet_pton(AF_INET, s, addr) == 1) {
+		family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, s, addr) == 1) {
+		family = AF_INET6;
+		max = 128;
+	} else {
+		return 0;
+	}
+	long len = max;
+	if (slash) {
+		char *end = NULL;
+		len = strtol(slash + 1, &end, 10);
+		if (*end || end == slash + 1 || len < 0 || len > max) {
+			return 0;
+		}
+	}
+	if (family == AF_INET) {
+		if (*v4_len == *v4_cap) {
+			*v4_cap = *v4_cap ? 2 * *v4_cap : 1024;
+			*v4 = xrealloc(*v4, *v4_cap * sizeof(**v4));
+		}
+		uint32_t a;
+		memcpy(&a, addr, sizeof(a));
+		(*v4)[*v4_len].prefix = ntohl(a);
+		(*v4)[*v4_len].len = (int)len;
+		(*v4)[*v4_len].value = 1;
+		(*v4_len)++;
+		set->size++;
+		return 1;
+	}
+	mask_v6(addr, (int)len);
+	key_table_t *t = &set->v6[len];
+	if (!t->words) {
+		t->words = 2;
+		set->v6_lens[set->num_v6_lens++] = (int)len;
+	}
+	uint64_t key[2];
+	memcpy(key, addr, sizeof(key));
+	set->size += key_add(t, key);
+	return 1;
+}
+
+filter_set_t *filter_set_load(const char *path, enum filter_set_kind kind)
+{
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		log_error("filter", "unable to open %s: %s", path,
+			  strerror(errno));
+		return NULL;
+	}
+	filter_set_t *set = xcalloc(1, sizeof(filter_set_t));
+	set->kind = kind;
+	set->ints.words = 1;
+	constraint_prefix_t *v4 = NULL;
+	size_t v4_len = 0, v4_cap = 0;
+	char *line = NULL;
+	size_t cap = 0;
+	uint64_t lineno = 0;
+	while (getline(&line, &cap, fp) > 0) {
+		lineno++;
+		char *hash = strchr(line, '#');
+		if (hash) {
+			*hash = '\0';
+		}
+		char *s = line + strspn(line, " \t");
+		size_t n = strcspn(s, "\r\n");
+		while (n && (s[n - 1] == ' ' || s[n - 1] == '\t')) {
+			n--;
+		}
+		s[n] = '\0';
+		if (!n) {
+			continue;
+		}
+		if (!add_line(set, s, &v4, &v4_len, &v4_cap)) {
+			log_error("filter", "%s:%" PRIu64 ": '%s' is not %s",
+				  path, lineno, s,
+				  kind == FILTER_SET_IP ? "an address or prefix"
+							: "a number");
+			free(line);
+			fclose(fp);
+			return NULL;
+		}
+	}
+	free(line);
+	fclose(fp);
+	if (kind == FILTER_SET_IP) {
+		set->v4 = constraint_init(0);
+		constraint_set_bulk(set->v4, v4, v4_len);
+		xfree(v4);
+		qsort(set->v6_lens, set->num_v6_lens, sizeof(int),
+		      cmp_len_desc);
+	}
+	log_debug("filter", "%" PRIu64 " elements in %s", set->size, path);
+	return set;
+}
+
+int filter_set_contains(const filter_set_t *set, const field_t *f)
+{
+	switch (f->type) {
+	case FS_IPV4:
+		return set->kind == FILTER_SET_IP &&
+		       constraint_lookup_ip(set->v4,
+					    ntohl((uint32_t)f->value.num));
+	case FS_IPV6: {
+		if (set->kind != FILTER_SET_IP) {
+			return 0;
+		}
+		for (int i = 0; i < set->num_v6_lens; i++) {
+			int len = set->v6_lens[i];
+			uint8_t addr[16];
+			memcpy(addr, f->value.ptr, sizeof(addr));
+			mask_v6(addr, len);
+			uint64_t key[2];
+			memcpy(key, addr, sizeof(key));
+			if (key_contains(&set->v6[len], key)) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+	case FS_UINT64:
+	case FS_BOOL:
+		return set->kind == FILTER_SET_INT &&
+		       key_contains(&set->ints, &f->value.num);
+	case FS_STRING: {
+		uint64_t s;
+		return set->kind == FILTER_SET_STRING && set->str_slots &&
+		       f->value.ptr &&
+		       str_find(set, (const char *)f->value.ptr, &s);
+	}
+	default:
+		return 0;
+	}
+}
+
+uint64_t filter_set_size(const filter_set_t *set)
+{
+	return set->size;
+}
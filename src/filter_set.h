@@ -0,0 +1,32 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_FILTER_SET_H
+#define ZMAP_FILTER_SET_H
+
+#include <stdint.h>
+
+#include "fieldset.h"
+
+// The sets of `field in @file` in an output filter, loaded once. A file has
+// an element per line, with # starting a comment: addresses and CIDR
+// prefixes for an ip field, numbers for int and bool fields, and strings
+// otherwise. IPv4 prefixes go into a constraint tree, IPv6 ones into a
+// hash set per prefix length, and numbers and strings into hash sets.
+typedef struct filter_set filter_set_t;
+
+enum filter_set_kind { FILTER_SET_IP, FILTER_SET_INT, FILTER_SET_STRING };
+
+// NULL, once what is wrong with the file is reported
+filter_set_t *filter_set_load(const char *path, enum filter_set_kind kind);
+
+int filter_set_contains(const filter_set_t *set, const field_t *f);
+
+uint64_t filter_set_size(const filter_set_t *set);
+
+#endif /* ZMAP_FILTER_SET_H */
@@ -0,0 +1,173 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "ifaces.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+#include "utility.h"
+
+void ifaces_parse(char **args, int n)
+{
+	if (n > MAX_IFACES) {
+		log_fatal("zmap", "at most %d interfaces can be given with -i",
+			  MAX_IFACES);
+	}
+	for (int i = 0; i < n; i++) {
+		struct iface_conf *ifc = &zconf.ifaces[i];
+		memset(ifc, 0, sizeof(*ifc));
+		ifc->name = xmalloc(strlen(args[i]) + 1);
+		strcpy(ifc->name, args[i]);
+		char *ips = strchr(ifc->name, '=');
+		if (ips) {
+			*ips++ = '\0';
+			parse_source_ips(ips, &ifc->source_ip_addresses,
+					 &ifc->number_source_ips);
+		}
+		if (!*ifc->name) {
+			log_fatal("zmap", "no interface name in -i %s", args[i]);
+		}
+		for (int j = 0; j < i; j++) {
+			if (!strcmp(zconf.ifaces[j].name, ifc->name)) {
+				log_fatal("zmap", "interface %s is given more than once",
+					  ifc->name);
+			}
+		}
+	}
+	zconf.num_ifaces = (uint8_t)n;
+	zconf.iface = zconf.ifaces[0].name;
+}
+
+#ifdef __linux__
+uint32_t iface_link_speed(const char *name)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "/sys/class/net/%s/speed", name);
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return 0;
+	}
+	// -1, or unreadable altogether, while the link is down
+	int speed = -1;
+	if (fscanf(fp, "%d", &speed) != 1) {
+		speed = -1;
+	}
+	fclose(fp);
+	return speed > 0 ? (uint32_t)speed : 0;
+}
+
+uint64_t ifaces_rx_packets(void)
+{
+	uint64_t total = 0;
+	for (uint8_t i = 0; i < zconf.num_ifaces; i++) {
+		char path[256];
+		snprintf(path, sizeof(path),
+			 "/sys/class/net/%s/statistics/rx_packets",
+			 zconf.ifaces[i].name);
+		FILE *fp = fopen(path, "r");
+		if (!fp) {
+			return 0;
+		}
+		unsigned long long n = 0;
+		int ok = fscanf(fp, "%llu", &n) == 1;
+		fclose(fp);
+		if (!ok) {
+			return 0;
+		}
+		total += n;
+	}
+	return total;
+}
+#else
+uint32_t iface_link_speed(const char *name)
+{
+	(void)name;
+	return 0;
+}
+
+uint64_t ifaces_rx_packets(void)
+{
+	return 0;
+}
+#endif
+
+void ifaces_assign_senders(void)
+{
+	uint8_t n = zconf.num_ifaces;
+	assert(n && zconf.senders >= n);
+	// interfaces of unknown speed count as the average of the others
+	uint64_t known = 0;
+	uint32_t num_known = 0;
+	for (uint8_t i = 0; i < n; i++) {
+		zconf.ifaces[i].speed = iface_link_speed(zconf.ifaces[i].name);
+		if (zconf.ifaces[i].speed) {
+			known += zconf.ifaces[i].speed;
+			num_known++;
+		}
+	}
+	uint64_t fallback = num_known ? known / num_known : 1;
+	uint64_t weights[MAX_IFACES];
+	uint64_t total = 0;
+	for (uint8_t i = 0; i < n; i++) {
+		weights[i] = zconf.ifaces[i].speed ? zconf.ifaces[i].speed : fallback;
+		total += weights[i];
+	}
+	// Every interface gets a thread, the rest go by the largest remainder
+	// of each interface's share of them.
+	uint16_t spare = zconf.senders - n;
+	uint16_t given = 0;
+	uint64_t remainders[MAX_IFACES];
+	for (uint8_t i = 0; i < n; i++) {
+		uint64_t share = spare * weights[i];
+		zconf.ifaces[i].senders = 1 + (uint16_t)(share / total);
+		remainders[i] = share % total;
+		given += zconf.ifaces[i].senders - 1;
+	}
+	for (; given < spare; given++) {
+		uint8_t best = 0;
+		for (uint8_t i = 1; i < n; i++) {
+			if (remainders[i] > remainders[best]) {
+				best = i;
+			}
+		}
+		zconf.ifaces[best].senders++;
+		remainders[best] = 0;
+	}
+	uint16_t first = 0;
+	for (uint8_t i = 0; i < n; i++) {
+		struct iface_conf *ifc = &zconf.ifaces[i];
+		ifc->first_sender = first;
+		first += ifc->senders;
+		if (n > 1) {
+			log_info("zmap", "sending through %s (%u Mbit/s%s) on %u of %u "
+					 "send threads",
+				 ifc->name, ifc->speed ? ifc->speed : (uint32_t)fallback,
+				 ifc->speed ? "" : ", assumed", ifc->senders,
+				 zconf.senders);
+		}
+	}
+}
+
+struct iface_conf *iface_of_sender(uint16_t id)
+{
+	for (uint8_t i = 1; i < zconf.num_ifaces; i++) {
+		if (id < zconf.ifaces[i].first_sender) {
+			return &zconf.ifaces[i - 1];
+		}
+	}
+	return &zconf.ifaces[zconf.num_ifaces - 1];
+}
+
+struct iface_conf *iface_of_receiver(uint32_t slot)
+{
+	return &zconf.ifaces[slot % zconf.num_ifaces];
+}
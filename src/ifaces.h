@@ -0,0 +1,48 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_IFACES_H
+#define ZMAP_IFACES_H
+
+#include <stdint.h>
+
+#include "state.h"
+
+/*
+ * Scanning through several interfaces at once (-i given more than once, the
+ * Linux raw socket sender and pcap receiver only). Each interface has its
+ * own source addresses, gateway and source MAC address, and send threads,
+ * of which it gets a share by its link speed. As every send thread takes
+ * an equal part of the scan, so does each interface by its speed. Receive
+ * threads are spread over the interfaces in turn, and all their responses
+ * go to the one output.
+ *
+ * zconf.ifaces[0] is also what zconf.iface, gw_mac, hw_mac and
+ * source_ip_addresses hold, which is all there is with a single interface.
+ */
+
+// -i name[=source addresses], n times; each goes into zconf.ifaces
+void ifaces_parse(char **args, int n);
+
+// the link speed of iface in Mbit/s, 0 if not known
+uint32_t iface_link_speed(const char *name);
+
+// frames received by all of the interfaces since they came up, 0 if not
+// known
+uint64_t ifaces_rx_packets(void);
+
+// share zconf.senders out between the interfaces, by link speed
+void ifaces_assign_senders(void);
+
+// the interface of send thread id
+struct iface_conf *iface_of_sender(uint16_t id);
+
+// the interface of receive thread slot
+struct iface_conf *iface_of_receiver(uint32_t slot);
+
+#endif /* ZMAP_IFACES_H */
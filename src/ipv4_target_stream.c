@@ -0,0 +1,190 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "ipv4_target_stream.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/blocklist.h"
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+#define LOGGER_NAME "ipv4_target_stream"
+
+// longest line we accept, as with --list-of-ips-file
+#define MAX_LINE_LEN 1000
+// stdin is read in blocks this large rather than a pipe buffer at a time
+#define READ_BUFFER_LEN (1 << 20)
+
+// per-sender ring fed by the reader thread, must be a power of two
+#define RING_SIZE 8192
+#define RING_WAIT_NS 100000
+
+struct target_ring {
+	uint32_t addrs[RING_SIZE];
+	// head is only written by the reader thread, tail only by its sender
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	// set by a sender that stops early, its share is dropped from then on
+	int closed;
+};
+
+static uint16_t num_senders;
+static uint16_t shard_idx;
+static uint16_t num_shards;
+
+static struct target_ring *rings;
+static char *read_buffer;
+static pthread_t reader;
+static int reader_done;
+static uint64_t lines_read;
+static uint64_t lines_blocked;
+
+int ipv4_target_stream_is_stream(const char *file)
+{
+	return file && !strcmp(file, "-");
+}
+
+static void ring_wait(void)
+{
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = RING_WAIT_NS};
+	nanosleep(&ts, NULL);
+}
+
+// The address on line, cut at a comment and stripped of surrounding
+// whitespace (including a Windows \r). Returns 0 for a blank line.
+static int parse_line(char *line, uint32_t *dst)
+{
+	line[strcspn(line, "#\r\n")] = '\0';
+	char *s = line + strspn(line, " \t");
+	char *e = s + strlen(s);
+	while (e > s && (e[-1] == ' ' || e[-1] == '\t')) {
+		e--;
+	}
+	if (e == s) {
+		return 0;
+	}
+	*e = '\0';
+	struct in_addr addr;
+	if (inet_aton(s, &addr) != 1) {
+		log_fatal(LOGGER_NAME, "unable to parse IP address: %s", s);
+	}
+	*dst = addr.s_addr;
+	return 1;
+}
+
+static void *reader_thread(UNUSED void *arg)
+{
+	char line[MAX_LINE_LEN];
+	// subshards are numbered shard * senders + sender, as in shard_init()
+	const uint32_t num_subshards = (uint32_t)num_shards * num_senders;
+	const uint32_t first_subshard = (uint32_t)shard_idx * num_senders;
+	uint64_t lineno = 0;
+	while (fgets(line, sizeof(line), stdin) != NULL) {
+		size_t len = strcspn(line, "\n");
+		if (len == sizeof(line) - 1 && line[len] != '\n' &&
+		    !feof(stdin)) {
+			log_fatal(LOGGER_NAME, "line too long in stdin: %s",
+				  line);
+		}
+		uint32_t addr;
+		if (!parse_line(line, &addr)) {
+			continue;
+		}
+		uint32_t sub = (uint32_t)(lineno++ % num_subshards);
+		if (sub < first_subshard || sub >= first_subshard + num_senders) {
+			continue;
+		}
+		__atomic_fetch_add(&lines_read, 1, __ATOMIC_RELAXED);
+		if (!blocklist_is_allowed(addr)) {
+			__atomic_fetch_add(&lines_blocked, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		struct target_ring *r = &rings[sub - first_subshard];
+		while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >=
+			   RING_SIZE &&
+		       !__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+			ring_wait();
+		}
+		if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		r->addrs[r->head & (RING_SIZE - 1)] = addr;
+		__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	}
+	log_debug(LOGGER_NAME, "read %" PRIu64 " targets from stdin", lineno);
+	__atomic_store_n(&reader_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+void ipv4_target_stream_init(uint16_t senders, uint16_t shard,
+			     uint16_t shards)
+{
+	assert(senders > 0);
+	assert(shard < shards);
+	num_senders = senders;
+	shard_idx = shard;
+	num_shards = shards;
+	read_buffer = xmalloc(READ_BUFFER_LEN);
+	setvbuf(stdin, read_buffer, _IOFBF, READ_BUFFER_LEN);
+	rings = xcalloc(num_senders, sizeof(struct target_ring));
+	if (pthread_create(&reader, NULL, reader_thread, NULL) != 0) {
+		log_fatal(LOGGER_NAME, "unable to start reader thread");
+	}
+	pthread_detach(reader);
+	// The reader may still be blocked on input or on a full ring when
+	// senders stop early, so its rings and buffer are left to process
+	// exit.
+}
+
+int ipv4_target_stream_get(uint16_t sender, uint32_t *dst)
+{
+	assert(rings && sender < num_senders);
+	struct target_ring *r = &rings[sender];
+	for (;;) {
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (head != r->tail) {
+			*dst = r->addrs[r->tail & (RING_SIZE - 1)];
+			__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+		if (__atomic_load_n(&reader_done, __ATOMIC_ACQUIRE)) {
+			// the reader may have pushed more right before finishing
+			if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail) {
+				continue;
+			}
+			return 1;
+		}
+		ring_wait();
+	}
+}
+
+void ipv4_target_stream_close(uint16_t sender)
+{
+	if (rings) {
+		assert(sender < num_senders);
+		__atomic_store_n(&rings[sender].closed, 1, __ATOMIC_RELEASE);
+	}
+}
+
+uint64_t ipv4_target_stream_read(void)
+{
+	return __atomic_load_n(&lines_read, __ATOMIC_RELAXED);
+}
+
+uint64_t ipv4_target_stream_blocked(void)
+{
+	return __atomic_load_n(&lines_blocked, __ATOMIC_RELAXED);
+}
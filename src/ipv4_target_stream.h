@@ -0,0 +1,38 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_IPV4_TARGET_STREAM_H
+#define ZMAP_IPV4_TARGET_STREAM_H
+
+#include <stdint.h>
+
+/*
+ * --list-of-ips-file=-: IPv4 targets read from stdin as they come, rather
+ * than loaded and permuted before the scan. A single thread reads and
+ * parses the lines, checks each address against the blocklist and deals
+ * them out to per-sender rings, so sending starts with the first line and
+ * memory stays the same however long the input is. As with streamed IPv6
+ * targets, lines are split between subshards round robin, so every machine
+ * and thread of a sharded scan gets a disjoint slice of the stream.
+ */
+
+// whether --list-of-ips-file names the stream rather than a list to load
+int ipv4_target_stream_is_stream(const char *file);
+void ipv4_target_stream_init(uint16_t senders, uint16_t shard,
+			     uint16_t shards);
+// next target for sender, in network order and in input order. Returns
+// non-zero once the input is exhausted
+int ipv4_target_stream_get(uint16_t sender, uint32_t *dst);
+// Called by a sender that stops before its share of the stream is
+// exhausted, so the reader doesn't stall the other senders waiting for it
+void ipv4_target_stream_close(uint16_t sender);
+// this shard's lines read so far, and those of them the blocklist dropped
+uint64_t ipv4_target_stream_read(void);
+uint64_t ipv4_target_stream_blocked(void);
+
+#endif /* ZMAP_IPV4_TARGET_STREAM_H */
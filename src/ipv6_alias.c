@@ -0,0 +1,274 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "ipv6_alias.h"
+
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/random.h"
+#include "../lib/xalloc.h"
+#include "state.h"
+
+#define LOGGER_NAME "ipv6_alias"
+
+// A prefix is keyed on the top 64 bits of its addresses with the rest
+// cleared, which is never 0 for a scannable one: key 0 (::/64 and shorter)
+// is left alone, and marks an empty slot below.
+
+#define COUNTING 0
+#define TESTING 1
+#define DONE 2
+
+// the receiver's count of one prefix
+struct counter {
+	uint64_t key;
+	uint32_t count;
+	// TESTING: the tests that have answered
+	uint32_t answered;
+	uint8_t state;
+};
+
+static uint64_t key_mask;
+static uint64_t secret[2];
+
+// only touched by ipv6_alias_success(), which emit_packet() serializes
+static struct counter *counters = NULL;
+static uint64_t counters_cap = 0;
+static uint64_t counters_len = 0;
+
+// Prefixes to be tested, from the receiver to the send threads
+#define QUEUE_LEN 4096
+static uint64_t queue[QUEUE_LEN];
+static uint64_t queue_head = 0;
+static uint64_t queue_tail = 0;
+// tests of the prefix at queue_head already taken
+static uint32_t queue_next_test = 0;
+static uint64_t queue_pending = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Aliased prefixes: an open-addressed set the send threads read as the
+// receiver, its only writer, adds to it, and the same in the order found
+#define SET_SLOTS (2 * IPV6_ALIAS_MAX)
+static uint64_t *aliased_set = NULL;
+static uint64_t *aliased = NULL;
+static uint32_t num_aliased = 0;
+
+static inline uint64_t mix(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+// big-endian 64-bit halves of an address
+static inline uint64_t load_half(const uint8_t *p)
+{
+	uint64_t v = 0;
+	for (int i = 0; i < 8; i++) {
+		v = v << 8 | p[i];
+	}
+	return v;
+}
+
+static inline void store_half(uint8_t *p, uint64_t v)
+{
+	for (int i = 7; i >= 0; i--) {
+		p[i] = (uint8_t)v;
+		v >>= 8;
+	}
+}
+
+static inline uint64_t prefix_key(const struct in6_addr *addr)
+{
+	return load_half(addr->s6_addr) & key_mask;
+}
+
+// the jth test address of a prefix, the same on both sides
+static void test_addr(uint64_t key, uint32_t j, struct in6_addr *out)
+{
+	store_half(out->s6_addr, key | (mix(key ^ secret[0] ^ j) & ~key_mask));
+	store_half(out->s6_addr + 8, mix(key ^ secret[1] ^ j));
+}
+
+void ipv6_alias_init(void)
+{
+	uint8_t len = zconf.ipv6_alias_prefix_len;
+	key_mask = len >= 64 ? ~0ULL : ~(~0ULL >> len);
+	if (!random_bytes(secret, sizeof(secret))) {
+		log_fatal(LOGGER_NAME, "couldn't get random bytes");
+	}
+	counters_cap = 1024;
+	counters = xcalloc_tag(MEM_DEDUP, counters_cap, sizeof(struct counter));
+	aliased_set = xcalloc_tag(MEM_DEDUP, SET_SLOTS, sizeof(uint64_t));
+	aliased = xcalloc_tag(MEM_DEDUP, IPV6_ALIAS_MAX, sizeof(uint64_t));
+}
+
+static struct counter *counter_slot(struct counter *t, uint64_t cap,
+				    uint64_t key)
+{
+	uint64_t i = mix(key) & (cap - 1);
+	while (t[i].key && t[i].key != key) {
+		i = (i + 1) & (cap - 1);
+	}
+	return &t[i];
+}
+
+static struct counter *counter_get(uint64_t key)
+{
+	struct counter *c = counter_slot(counters, counters_cap, key);
+	if (c->key) {
+		return c;
+	}
+	if (2 * (counters_len + 1) > counters_cap) {
+		uint64_t cap = 2 * counters_cap;
+		struct counter *t =
+		    xcalloc_tag(MEM_DEDUP, cap, sizeof(struct counter));
+		for (uint64_t i = 0; i < counters_cap; i++) {
+			if (counters[i].key) {
+				*counter_slot(t, cap, counters[i].key) =
+				    counters[i];
+			}
+		}
+		xfree_tag(MEM_DEDUP, counters);
+		counters = t;
+		counters_cap = cap;
+		c = counter_slot(counters, counters_cap, key);
+	}
+	c->key = key;
+	counters_len++;
+	return c;
+}
+
+static int enqueue(uint64_t key)
+{
+	pthread_mutex_lock(&queue_lock);
+	int ok = queue_tail - queue_head < QUEUE_LEN;
+	if (ok) {
+		queue[queue_tail++ % QUEUE_LEN] = key;
+		__atomic_store_n(&queue_pending, queue_tail - queue_head,
+				 __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return ok;
+}
+
+static void add_aliased(uint64_t key)
+{
+	struct in6_addr prefix = {0};
+	store_half(prefix.s6_addr, key);
+	char buf[INET6_ADDRSTRLEN];
+	inet_ntop(AF_INET6, &prefix, buf, sizeof(buf));
+	if (num_aliased == IPV6_ALIAS_MAX) {
+		log_info(LOGGER_NAME, "%s/%u is aliased, but %d prefixes "
+				      "already are and it is still scanned",
+			 buf, zconf.ipv6_alias_prefix_len, IPV6_ALIAS_MAX);
+		return;
+	}
+	log_info(LOGGER_NAME, "%s/%u is aliased, leaving out the rest of it",
+		 buf, zconf.ipv6_alias_prefix_len);
+	uint64_t i = mix(key) & (SET_SLOTS - 1);
+	while (aliased_set[i]) {
+		i = (i + 1) & (SET_SLOTS - 1);
+	}
+	__atomic_store_n(&aliased_set[i], key, __ATOMIC_RELEASE);
+	aliased[num_aliased] = key;
+	__atomic_store_n(&num_aliased, num_aliased + 1, __ATOMIC_RELEASE);
+}
+
+void ipv6_alias_success(const struct in6_addr *addr)
+{
+	uint64_t key = prefix_key(addr);
+	if (!key) {
+		return;
+	}
+	struct counter *c = counter_get(key);
+	if (c->state == DONE) {
+		return;
+	}
+	if (c->state == TESTING) {
+		for (uint32_t j = 0; j < zconf.ipv6_alias_tests; j++) {
+			struct in6_addr t;
+			test_addr(key, j, &t);
+			if (!memcmp(&t, addr, sizeof(t))) {
+				c->answered |= 1U << j;
+				break;
+			}
+		}
+		if ((uint32_t)__builtin_popcount(c->answered) ==
+		    zconf.ipv6_alias_tests) {
+			c->state = DONE;
+			add_aliased(key);
+		}
+		return;
+	}
+	// a prefix the queue had no room for is tried on its next success
+	if (++c->count >= zconf.ipv6_alias_threshold && enqueue(key)) {
+		c->state = TESTING;
+	}
+}
+
+int ipv6_alias_skip(const struct in6_addr *addr)
+{
+	if (!__atomic_load_n(&num_aliased, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	uint64_t key = prefix_key(addr);
+	if (!key) {
+		return 0;
+	}
+	uint64_t i = mix(key) & (SET_SLOTS - 1);
+	while (1) {
+		uint64_t v = __atomic_load_n(&aliased_set[i], __ATOMIC_ACQUIRE);
+		if (v == key) {
+			return 1;
+		}
+		if (!v) {
+			return 0;
+		}
+		i = (i + 1) & (SET_SLOTS - 1);
+	}
+}
+
+size_t ipv6_alias_take_tests(struct in6_addr *out, size_t max)
+{
+	if (!__atomic_load_n(&queue_pending, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	size_t n = 0;
+	pthread_mutex_lock(&queue_lock);
+	while (n < max && queue_head != queue_tail) {
+		test_addr(queue[queue_head % QUEUE_LEN], queue_next_test++,
+			  &out[n++]);
+		if (queue_next_test == zconf.ipv6_alias_tests) {
+			queue_next_test = 0;
+			queue_head++;
+		}
+	}
+	__atomic_store_n(&queue_pending, queue_tail - queue_head,
+			 __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&queue_lock);
+	return n;
+}
+
+uint32_t ipv6_alias_count(void)
+{
+	return __atomic_load_n(&num_aliased, __ATOMIC_ACQUIRE);
+}
+
+void ipv6_alias_get(uint32_t i, struct in6_addr *prefix)
+{
+	memset(prefix, 0, sizeof(*prefix));
+	store_half(prefix->s6_addr, aliased[i]);
+}
@@ -0,0 +1,46 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_IPV6_ALIAS_H
+#define ZMAP_IPV6_ALIAS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * --ipv6-alias-detect: finds aliased IPv6 prefixes, in which every address
+ * answers, while the scan runs, and stops probing them. The receiver counts
+ * the unique successes of every prefix of --ipv6-alias-prefix-len bits.
+ * Once one has --ipv6-alias-threshold of them it is tested: the send
+ * threads put --ipv6-alias-tests probes to addresses of the prefix with
+ * pseudo-random interface identifiers in front of their next batches. If
+ * every one of those answers, the prefix is aliased, the send threads leave
+ * out its remaining targets and it is listed in the metadata.
+ */
+
+// aliased prefixes remembered; those found after are only logged
+#define IPV6_ALIAS_MAX 65536
+#define IPV6_ALIAS_MAX_TESTS 32
+
+// from zconf, before the send and receive threads start
+void ipv6_alias_init(void);
+
+// Receive side, from emit_packet(), for each unique success
+void ipv6_alias_success(const struct in6_addr *addr);
+
+// Send side, from any send thread. Whether addr is in an aliased prefix.
+int ipv6_alias_skip(const struct in6_addr *addr);
+// Takes up to max test addresses to probe into out, returning how many.
+size_t ipv6_alias_take_tests(struct in6_addr *out, size_t max);
+
+// the aliased prefixes found so far, in the order they were
+uint32_t ipv6_alias_count(void);
+void ipv6_alias_get(uint32_t i, struct in6_addr *prefix);
+
+#endif /* ZMAP_IPV6_ALIAS_H */
@@ -0,0 +1,365 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "ipv6_pattern.h"
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+#define LOGGER_NAME "ipv6_pattern"
+
+#define GROUPS 8
+#define FIELD_RANGE 0  // lo + digit
+#define FIELD_DIGITS 1 // the digit's nybbles scattered over the ? places
+
+// one variable group of a pattern, a digit of the mixed radix number
+struct field {
+	uint8_t group;
+	uint8_t kind;
+	// FIELD_DIGITS: how many nybbles vary and their shifts, lowest first
+	uint8_t num_digits;
+	uint8_t shifts[4];
+	uint16_t lo;
+	uint32_t count;
+};
+
+struct pattern {
+	const char *text;
+	uint16_t base[GROUPS]; // the fixed bits, zero where they vary
+	struct field fields[GROUPS];
+	int num_fields;
+	// the most significant bit that varies, 128 if none does
+	int first_variable_bit;
+	uint64_t count;
+};
+
+struct prefix {
+	struct in6_addr addr; // zero below len
+	uint8_t len;
+};
+
+static struct pattern *patterns = NULL;
+static int num_patterns = 0;
+// without --ipv6-target-prefixes, a single ::/0
+static struct prefix *prefixes = NULL;
+static uint64_t num_prefixes = 1;
+// targets of all patterns under one prefix
+static uint64_t per_prefix = 0;
+
+static int parse_hex(const char *s, size_t n, uint16_t *out)
+{
+	if (!n || n > 4) {
+		return -1;
+	}
+	uint16_t v = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (!isxdigit((unsigned char)s[i])) {
+			return -1;
+		}
+		int c = tolower((unsigned char)s[i]);
+		v = (uint16_t)(v << 4 | (c <= '9' ? c - '0' : c - 'a' + 10));
+	}
+	*out = v;
+	return 0;
+}
+
+static int parse_group(struct pattern *p, int group, const char *s, size_t n)
+{
+	struct field f = {.group = (uint8_t)group};
+	const char *dash = memchr(s, '-', n);
+	if (n == 1 && *s == '*') {
+		f.kind = FIELD_RANGE;
+		f.lo = 0;
+		f.count = 0x10000;
+	} else if (dash) {
+		uint16_t lo, hi;
+		if (parse_hex(s, (size_t)(dash - s), &lo) ||
+		    parse_hex(dash + 1, n - (size_t)(dash - s) - 1, &hi) ||
+		    lo > hi) {
+			return -1;
+		}
+		f.kind = FIELD_RANGE;
+		f.lo = lo;
+		f.count = (uint32_t)hi - lo + 1;
+	} else if (memchr(s, '?', n)) {
+		if (n > 4) {
+			return -1;
+		}
+		f.kind = FIELD_DIGITS;
+		f.count = 1;
+		for (size_t i = n; i-- > 0;) {
+			uint8_t shift = (uint8_t)(4 * (n - 1 - i));
+			uint16_t v;
+			if (s[i] == '?') {
+				f.shifts[f.num_digits++] = shift;
+				f.count *= 16;
+			} else if (!parse_hex(&s[i], 1, &v)) {
+				p->base[group] |= (uint16_t)(v << shift);
+			} else {
+				return -1;
+			}
+		}
+	} else {
+		return parse_hex(s, n, &p->base[group]);
+	}
+	if (f.count == 1) {
+		p->base[group] = f.lo;
+		return 0;
+	}
+	int first = group * 16;
+	if (f.kind == FIELD_DIGITS) {
+		first += 12 - f.shifts[f.num_digits - 1];
+	}
+	if (first < p->first_variable_bit) {
+		p->first_variable_bit = first;
+	}
+	p->fields[p->num_fields++] = f;
+	return 0;
+}
+
+// the groups of s[0, n) separated by colons, at most max of them, into
+// tokens; returns how many or -1
+static int split_groups(const char *s, size_t n, const char **tokens,
+			size_t *lens, int max)
+{
+	if (!n) {
+		return 0;
+	}
+	int count = 0;
+	const char *end = s + n;
+	while (1) {
+		const char *colon = memchr(s, ':', (size_t)(end - s));
+		const char *stop = colon ? colon : end;
+		if (count == max || stop == s) {
+			return -1;
+		}
+		tokens[count] = s;
+		lens[count++] = (size_t)(stop - s);
+		if (!colon) {
+			return count;
+		}
+		s = colon + 1;
+	}
+}
+
+static void parse_pattern(struct pattern *p, const char *text)
+{
+	memset(p, 0, sizeof(*p));
+	p->text = text;
+	p->first_variable_bit = 128;
+	const char *tokens[GROUPS];
+	size_t lens[GROUPS];
+	int groups[GROUPS];
+	int n = 0;
+	const char *gap = strstr(text, "::");
+	if (gap && strstr(gap + 1, "::")) {
+		log_fatal(LOGGER_NAME, "more than one :: in %s", text);
+	}
+	if (!gap) {
+		n = split_groups(text, strlen(text), tokens, lens, GROUPS);
+		if (n != GROUPS) {
+			log_fatal(LOGGER_NAME, "%s is not 8 groups, or groups "
+					       "with :: between",
+				  text);
+		}
+		for (int i = 0; i < GROUPS; i++) {
+			groups[i] = i;
+		}
+	} else {
+		// :: is at least one group of zeros
+		int left = split_groups(text, (size_t)(gap - text), tokens,
+					lens, GROUPS - 1);
+		int right = left < 0 ? -1
+				     : split_groups(gap + 2, strlen(gap + 2),
+						    tokens + left, lens + left,
+						    GROUPS - 1 - left);
+		if (right < 0) {
+			log_fatal(LOGGER_NAME, "invalid groups around :: in %s",
+				  text);
+		}
+		n = left + right;
+		for (int i = 0; i < left; i++) {
+			groups[i] = i;
+		}
+		for (int i = 0; i < right; i++) {
+			groups[left + i] = GROUPS - right + i;
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		if (parse_group(p, groups[i], tokens[i], lens[i])) {
+			log_fatal(LOGGER_NAME, "invalid group %.*s in %s",
+				  (int)lens[i], tokens[i], text);
+		}
+	}
+	p->count = 1;
+	for (int i = 0; i < p->num_fields; i++) {
+		p->count *= p->fields[i].count;
+		if (p->count > IPV6_PATTERN_MAX_TARGETS) {
+			log_fatal(LOGGER_NAME,
+				  "%s gives more than 2^48 targets", text);
+		}
+	}
+}
+
+static void load_prefixes(const char *file)
+{
+	FILE *fp = fopen(file, "r");
+	if (!fp) {
+		log_fatal(LOGGER_NAME, "unable to open %s: %s", file,
+			  strerror(errno));
+	}
+	size_t cap = 1024;
+	prefixes = xmalloc_tag(MEM_TARGETS, cap * sizeof(struct prefix));
+	num_prefixes = 0;
+	char *line = NULL;
+	size_t line_cap = 0;
+	uint64_t lineno = 0;
+	while (getline(&line, &line_cap, fp) > 0) {
+		lineno++;
+		char *hash = strchr(line, '#');
+		if (hash) {
+			*hash = '\0';
+		}
+		char *s = line;
+		while (isspace((unsigned char)*s)) {
+			s++;
+		}
+		char *e = s + strlen(s);
+		while (e > s && isspace((unsigned char)e[-1])) {
+			*--e = '\0';
+		}
+		if (!*s) {
+			continue;
+		}
+		char *slash = strchr(s, '/');
+		char *end = NULL;
+		struct prefix pfx;
+		long len = slash ? strtol(slash + 1, &end, 10) : -1;
+		if (slash) {
+			*slash = '\0';
+		}
+		if (!slash || *end || end == slash + 1 || len < 0 || len > 128 ||
+		    inet_pton(AF_INET6, s, &pfx.addr) != 1) {
+			log_fatal(LOGGER_NAME,
+				  "%s:%" PRIu64 ": expected a prefix, e.g. "
+				  "2001:db8::/48",
+				  file, lineno);
+		}
+		pfx.len = (uint8_t)len;
+		for (int b = 0; b < 16; b++) {
+			int keep = pfx.len - 8 * b;
+			if (keep <= 0) {
+				pfx.addr.s6_addr[b] = 0;
+			} else if (keep < 8) {
+				pfx.addr.s6_addr[b] &= (uint8_t)(0xff << (8 - keep));
+			}
+		}
+		for (int i = 0; i < num_patterns; i++) {
+			if (patterns[i].first_variable_bit < pfx.len) {
+				log_fatal(LOGGER_NAME,
+					  "%s:%" PRIu64 ": %s varies bits of "
+					  "the /%ld prefix",
+					  file, lineno, patterns[i].text, len);
+			}
+		}
+		if (num_prefixes == cap) {
+			cap *= 2;
+			prefixes = xrealloc_tag(MEM_TARGETS, prefixes,
+						cap * sizeof(struct prefix));
+		}
+		prefixes[num_prefixes++] = pfx;
+	}
+	free(line);
+	fclose(fp);
+	if (!num_prefixes) {
+		log_fatal(LOGGER_NAME, "no prefixes in %s", file);
+	}
+	log_debug(LOGGER_NAME, "%" PRIu64 " prefixes in %s", num_prefixes,
+		  file);
+}
+
+void ipv6_pattern_init(char **texts, int len, const char *prefix_file)
+{
+	assert(len > 0);
+	num_patterns = len;
+	patterns = xcalloc_tag(MEM_TARGETS, len, sizeof(struct pattern));
+	per_prefix = 0;
+	for (int i = 0; i < len; i++) {
+		parse_pattern(&patterns[i], texts[i]);
+		per_prefix += patterns[i].count;
+		if (per_prefix > IPV6_PATTERN_MAX_TARGETS) {
+			log_fatal(LOGGER_NAME,
+				  "the patterns give more than 2^48 targets");
+		}
+	}
+	if (prefix_file) {
+		load_prefixes(prefix_file);
+	}
+	uint64_t total;
+	if (__builtin_mul_overflow(per_prefix, num_prefixes, &total) ||
+	    total > IPV6_PATTERN_MAX_TARGETS) {
+		log_fatal(LOGGER_NAME, "%" PRIu64 " prefixes of %" PRIu64
+				       " targets each are more than 2^48",
+			  num_prefixes, per_prefix);
+	}
+	log_info(LOGGER_NAME,
+		 "%" PRIu64 " IPv6 targets from %d patterns under %" PRIu64
+		 " prefixes",
+		 total, num_patterns, num_prefixes);
+}
+
+uint64_t ipv6_pattern_count(void) { return num_prefixes * per_prefix; }
+
+void ipv6_pattern_get_index(uint64_t index, struct in6_addr *dst)
+{
+	uint64_t rest = index % per_prefix;
+	const struct pattern *p = patterns;
+	while (rest >= p->count) {
+		rest -= p->count;
+		p++;
+	}
+	uint16_t g[GROUPS];
+	memcpy(g, p->base, sizeof(g));
+	for (int i = p->num_fields - 1; i >= 0; i--) {
+		const struct field *f = &p->fields[i];
+		uint32_t d = (uint32_t)(rest % f->count);
+		rest /= f->count;
+		if (f->kind == FIELD_RANGE) {
+			g[f->group] = (uint16_t)(f->lo + d);
+			continue;
+		}
+		for (int j = 0; j < f->num_digits; j++) {
+			g[f->group] |= (uint16_t)((d & 0xf) << f->shifts[j]);
+			d >>= 4;
+		}
+	}
+	for (int i = 0; i < GROUPS; i++) {
+		dst->s6_addr[2 * i] = (uint8_t)(g[i] >> 8);
+		dst->s6_addr[2 * i + 1] = (uint8_t)g[i];
+	}
+	if (!prefixes) {
+		return;
+	}
+	const struct prefix *pfx = &prefixes[index / per_prefix];
+	for (int b = 0; b < 16 && 8 * b < pfx->len; b++) {
+		int keep = pfx->len - 8 * b;
+		uint8_t mask = keep >= 8 ? 0xff : (uint8_t)(0xff << (8 - keep));
+		dst->s6_addr[b] = (uint8_t)((dst->s6_addr[b] & ~mask) |
+					    pfx->addr.s6_addr[b]);
+	}
+}
@@ -0,0 +1,46 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_IPV6_PATTERN_H
+#define ZMAP_IPV6_PATTERN_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * --ipv6-target-pattern: IPv6 targets generated from address patterns
+ * instead of read from a file. A pattern is an IPv6 address in which any
+ * 16-bit group may instead be
+ *
+ *   *        every value, 0-ffff
+ *   lo-hi    the hex values from lo to hi
+ *   1?3?     hex digits with ? for every digit in that place
+ *
+ * with :: standing for fixed zero groups as usual, e.g. 2001:db8:*::1-ff,
+ * or ::211:22ff:fe??:???? for the EUI-64 identifiers of an OUI. With
+ * --ipv6-target-prefixes every pattern is scanned under every prefix of
+ * the file, the prefix giving the bits above its length and the pattern
+ * those below, which must hold all of its variable groups and digits.
+ *
+ * The targets are numbered prefix by prefix, then pattern by pattern, then
+ * in mixed radix with the last variable group counting fastest, so a
+ * target is worked out from its index with a few divisions. The send
+ * threads take indices from the cyclic group like those of an indexed
+ * target file, sharded over threads and machines the same way, and
+ * nothing is materialized.
+ */
+
+// the cyclic groups go up to 2^48 (addresses times ports)
+#define IPV6_PATTERN_MAX_TARGETS ((uint64_t)1 << 48)
+
+// Parses patterns and loads prefix_file (NULL for none), exiting on errors
+void ipv6_pattern_init(char **patterns, int len, const char *prefix_file);
+uint64_t ipv6_pattern_count(void);
+void ipv6_pattern_get_index(uint64_t index, struct in6_addr *dst);
+
+#endif /* ZMAP_IPV6_PATTERN_H */
@@ -0,0 +1,112 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "ipv6_source.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+
+#include "../lib/includes.h"
+
+// an address as its high and low 64 bits, in host order
+struct u128 {
+	uint64_t hi;
+	uint64_t lo;
+};
+
+static struct u128 load(const uint8_t *b)
+{
+	struct u128 v = {0, 0};
+	for (int i = 0; i < 8; i++) {
+		v.hi = (v.hi << 8) | b[i];
+		v.lo = (v.lo << 8) | b[i + 8];
+	}
+	return v;
+}
+
+static void store(struct u128 v, uint8_t *b)
+{
+	for (int i = 7; i >= 0; i--) {
+		b[i] = (uint8_t)v.hi;
+		b[i + 8] = (uint8_t)v.lo;
+		v.hi >>= 8;
+		v.lo >>= 8;
+	}
+}
+
+// the host bits of the prefix
+static struct u128 host_mask(void)
+{
+	int bits = 128 - zconf.ipv6_src_prefix_len;
+	struct u128 m;
+	m.lo = bits >= 64 ? ~0ULL : (bits ? (1ULL << bits) - 1 : 0);
+	m.hi = bits <= 64 ? 0 : (bits == 128 ? ~0ULL : (1ULL << (bits - 64)) - 1);
+	return m;
+}
+
+int ipv6_source_parse(const char *spec)
+{
+	char addr[INET6_ADDRSTRLEN + 1];
+	const char *slash = strchr(spec, '/');
+	size_t len = slash ? (size_t)(slash - spec) : strlen(spec);
+	if (len >= sizeof(addr)) {
+		return -1;
+	}
+	memcpy(addr, spec, len);
+	addr[len] = '\0';
+	if (inet_pton(AF_INET6, addr, &zconf.ipv6_src_base) != 1) {
+		return -1;
+	}
+	zconf.ipv6_src_prefix_len = 128;
+	if (slash) {
+		char *end;
+		long bits = strtol(slash + 1, &end, 10);
+		if (*end || end == slash + 1 || bits < 1 || bits > 128) {
+			return -1;
+		}
+		zconf.ipv6_src_prefix_len = (uint8_t)bits;
+	}
+	// from the prefix alone, the host bits come from the validation
+	struct u128 m = host_mask();
+	struct u128 b = load(zconf.ipv6_src_base.s6_addr);
+	b.hi &= ~m.hi;
+	b.lo &= ~m.lo;
+	store(b, zconf.ipv6_src_base.s6_addr);
+	return 0;
+}
+
+void ipv6_source_derive(struct in6_addr *src,
+			const uint8_t validation[VALIDATE_BYTES], int stream)
+{
+	struct u128 m = host_mask();
+	struct u128 h = load(validation);
+	struct u128 s = load(zconf.ipv6_src_base.s6_addr);
+	s.hi |= h.hi & m.hi;
+	s.lo |= (h.lo + (uint64_t)stream) & m.lo;
+	store(s, src->s6_addr);
+}
+
+int ipv6_source_check(const struct in6_addr *dst,
+		      const struct in6_addr *target)
+{
+	if (!ipv6_source_is_pool()) {
+		return 1;
+	}
+	uint8_t validation[VALIDATE_BYTES];
+	validate_gen_ipv6(&zconf.ipv6_src_base, target, 0, validation);
+	struct u128 m = host_mask();
+	struct u128 h = load(validation);
+	struct u128 d = load(dst->s6_addr);
+	struct u128 b = load(zconf.ipv6_src_base.s6_addr);
+	if ((d.hi & ~m.hi) != b.hi || (d.lo & ~m.lo) != b.lo ||
+	    (d.hi & m.hi) != (h.hi & m.hi)) {
+		return 0;
+	}
+	// streams count up from the derived address in the low bits
+	return ((d.lo - h.lo) & m.lo) < (uint64_t)zconf.packet_streams;
+}
@@ -0,0 +1,54 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_IPV6_SOURCE_H
+#define ZMAP_IPV6_SOURCE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include "state.h"
+#include "validate.h"
+
+/*
+ * --ipv6-source-ip=prefix/len: probes are sent from all over a routed
+ * prefix, rather than from one address. The host bits of the source of a
+ * probe are the validation of (prefix, target), plus its stream in the low
+ * bits, so the source is fixed for every target and can't be guessed
+ * without the key. The validation of the probe itself is then of that
+ * source, as always, and a response is also checked for being to the
+ * source its target was sent from.
+ */
+
+// Parse --ipv6-source-ip, an address or prefix/len, into
+// zconf.ipv6_src_base and zconf.ipv6_src_prefix_len. Returns 0 on success.
+int ipv6_source_parse(const char *spec);
+
+// the pcap filter qualifier matching responses to spec, as given
+static inline const char *ipv6_source_filter_kind(const char *spec)
+{
+	return strchr(spec, '/') ? "net" : "host";
+}
+
+static inline int ipv6_source_is_pool(void)
+{
+	return zconf.ipv6_src_prefix_len < 128;
+}
+
+// The source of the probe to a target of stream, given the validation of
+// (zconf.ipv6_src_base, target).
+void ipv6_source_derive(struct in6_addr *src,
+			const uint8_t validation[VALIDATE_BYTES], int stream);
+
+// Whether dst is the source a probe to target was sent from, for some
+// stream. Always true of a single source address.
+int ipv6_source_check(const struct in6_addr *dst,
+		      const struct in6_addr *target);
+
+#endif /* ZMAP_IPV6_SOURCE_H */
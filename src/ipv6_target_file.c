@@ -9,62 +9,375 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "../lib/includes.h"
 #include "../lib/logger.h"
+#include "../lib/xalloc.h"
+#include "ipv6_target_file.h"
 
 #define LOGGER_NAME "ipv6_target_file"
 
+// longest line we accept, matching the old fgets() buffer
+#define MAX_LINE_LEN 100
+
+// per-sender ring fed by the stdin reader thread, must be a power of two
+#define RING_SIZE 4096
+#define RING_WAIT_NS 100000
+
+/*
+ * Regular files are memory-mapped and addressed by target index, so the
+ * sender threads can walk them in the same randomized, sharded order as the
+ * IPv4 address space. Binary files are indexed by record; text files get a
+ * table of line offsets built once at startup. stdin and other unmappable
+ * inputs are read in file order by a single thread that parses addresses and
+ * deals them out to per-sender single-producer/single-consumer rings. Stream
+ * targets are split between subshards round robin by line number, so every
+ * machine and thread of a sharded scan gets a disjoint, reproducible slice.
+ */
+
+struct target_ring {
+	struct in6_addr addrs[RING_SIZE];
+	// head is only written by the reader thread, tail only by its sender
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	// set by a sender that stops early, its share is dropped from then on
+	int closed;
+};
+
+static uint16_t num_senders;
+static uint16_t shard_idx;
+static uint16_t num_shards;
+static char *filename;
+
+static int indexed;
+static uint64_t num_targets;
+static char *map;
+static size_t map_len;
+
+// text files: offset of every non-blank line
+static uint64_t *line_offsets;
+// binary files: records are rec_len bytes
+static size_t rec_len;
+static const uint8_t *records;
+static const uint8_t *dict;
+static uint64_t dict_count;
+
 static FILE *fp;
+static struct target_ring *rings;
+static pthread_t reader;
+static int reader_done;
 
-int ipv6_target_file_init(char *file)
+static void ring_wait(void)
 {
-	if (strcmp(file, "-") == 0) {
-		fp = stdin;
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = RING_WAIT_NS};
+	nanosleep(&ts, NULL);
+}
+
+static void parse_line(const char *line, size_t len, struct in6_addr *dst)
+{
+	char buf[MAX_LINE_LEN];
+	if (len >= sizeof(buf)) {
+		log_fatal(LOGGER_NAME, "line too long in %s: %.*s", filename,
+			  (int)len, line);
+	}
+	memcpy(buf, line, len);
+	buf[len] = '\0';
+	if (inet_pton(AF_INET6, buf, dst) != 1) {
+		log_fatal(LOGGER_NAME,
+			  "could not parse IPv6 address from line: %s", buf);
+	}
+}
+
+// Strip surrounding whitespace (including a Windows \r) and report whether
+// anything is left.
+static int trim_line(const char **line, size_t *len)
+{
+	const char *s = *line;
+	const char *e = s + *len;
+	while (s < e && (*s == ' ' || *s == '\t' || *s == '\r')) {
+		s++;
+	}
+	while (e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r')) {
+		e--;
+	}
+	*line = s;
+	*len = (size_t)(e - s);
+	return *len > 0;
+}
+
+static void *reader_thread(UNUSED void *arg)
+{
+	char line[MAX_LINE_LEN];
+	// subshards are numbered shard * senders + sender, as in shard_init()
+	const uint32_t num_subshards = (uint32_t)num_shards * num_senders;
+	const uint32_t first_subshard = (uint32_t)shard_idx * num_senders;
+	uint64_t lineno = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		const char *s = line;
+		size_t len = strcspn(line, "\n");
+		if (len == sizeof(line) - 1 && line[len] != '\n' && !feof(fp)) {
+			log_fatal(LOGGER_NAME, "line too long in %s: %s",
+				  filename, line);
+		}
+		if (!trim_line(&s, &len)) {
+			continue;
+		}
+		uint32_t sub = (uint32_t)(lineno++ % num_subshards);
+		if (sub < first_subshard || sub >= first_subshard + num_senders) {
+			continue;
+		}
+		struct in6_addr addr;
+		parse_line(s, len, &addr);
+		struct target_ring *r = &rings[sub - first_subshard];
+		while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >=
+			   RING_SIZE &&
+		       !__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+			ring_wait();
+		}
+		if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		r->addrs[r->head & (RING_SIZE - 1)] = addr;
+		__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&reader_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static uint64_t hilo(uint32_t hi, uint32_t lo)
+{
+	return ((uint64_t)ntohl(hi) << 32) | ntohl(lo);
+}
+
+static void init_binary(void)
+{
+	if (map_len < sizeof(struct ipv6_bin_header)) {
+		log_fatal(LOGGER_NAME, "truncated binary header in %s",
+			  filename);
+	}
+	const struct ipv6_bin_header *h = (const struct ipv6_bin_header *)map;
+	if (ntohl(h->version) != IPV6_BIN_VERSION) {
+		log_fatal(LOGGER_NAME, "unsupported binary version %u in %s",
+			  ntohl(h->version), filename);
+	}
+	uint32_t flags = ntohl(h->flags);
+	uint64_t count = hilo(h->count_hi, h->count_lo);
+	dict_count = hilo(h->dict_count_hi, h->dict_count_lo);
+	rec_len = sizeof(struct in6_addr);
+	if (flags & IPV6_BIN_PREFIX_DICT) {
+		rec_len = IPV6_BIN_DICT_RECORD_LEN;
+	} else if (dict_count) {
+		log_fatal(LOGGER_NAME, "prefix dictionary without flag in %s",
+			  filename);
+	}
+	size_t avail = map_len - sizeof(struct ipv6_bin_header);
+	if (dict_count > avail / IPV6_BIN_PREFIX_LEN ||
+	    count > (avail - dict_count * IPV6_BIN_PREFIX_LEN) / rec_len ||
+	    avail != dict_count * IPV6_BIN_PREFIX_LEN + count * rec_len) {
+		log_fatal(LOGGER_NAME,
+			  "size of %s does not match its header (%" PRIu64
+			  " records)",
+			  filename, count);
+	}
+	dict = (const uint8_t *)map + sizeof(struct ipv6_bin_header);
+	records = dict + dict_count * IPV6_BIN_PREFIX_LEN;
+	num_targets = count;
+	log_debug(LOGGER_NAME,
+		  "mapped %" PRIu64 " binary records (%" PRIu64
+		  " prefixes) of %s",
+		  count, dict_count, filename);
+}
+
+static void init_text(void)
+{
+	size_t cap = 1024;
+	line_offsets = xmalloc(cap * sizeof(uint64_t));
+	const char *end = map + map_len;
+	const char *line = map;
+	while (line < end) {
+		const char *nl = memchr(line, '\n', (size_t)(end - line));
+		const char *s = line;
+		size_t len = (size_t)((nl ? nl : end) - line);
+		if (trim_line(&s, &len)) {
+			if (num_targets == cap) {
+				cap *= 2;
+				line_offsets = xrealloc(line_offsets,
+							cap * sizeof(uint64_t));
+			}
+			line_offsets[num_targets++] = (uint64_t)(s - map);
+		}
+		line = nl ? nl + 1 : end;
+	}
+	log_debug(LOGGER_NAME, "indexed %" PRIu64 " lines of %s", num_targets,
+		  filename);
+}
+
+static void get_binary(uint64_t index, struct in6_addr *dst)
+{
+	const uint8_t *rec = records + index * rec_len;
+	if (rec_len == sizeof(struct in6_addr)) {
+		memcpy(dst, rec, sizeof(struct in6_addr));
+		return;
+	}
+	uint32_t idx;
+	memcpy(&idx, rec, sizeof(idx));
+	idx = ntohl(idx);
+	if (idx >= dict_count) {
+		log_fatal(LOGGER_NAME, "prefix index %u out of range in %s",
+			  idx, filename);
+	}
+	memcpy(dst->s6_addr, dict + (size_t)idx * IPV6_BIN_PREFIX_LEN,
+	       IPV6_BIN_PREFIX_LEN);
+	memcpy(dst->s6_addr + IPV6_BIN_PREFIX_LEN, rec + sizeof(idx),
+	       sizeof(struct in6_addr) - IPV6_BIN_PREFIX_LEN);
+}
+
+static int init_mapped(int fd, size_t len)
+{
+	if (len > 0) {
+		map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+			return 1;
+		}
+		map_len = len;
+		// targets are visited in permuted order
+		madvise(map, len, MADV_RANDOM);
+	}
+	indexed = 1;
+	if (len >= IPV6_BIN_MAGIC_LEN &&
+	    memcmp(map, IPV6_BIN_MAGIC, IPV6_BIN_MAGIC_LEN) == 0) {
+		init_binary();
+	} else if (len > 0) {
+		init_text();
+	}
+	return 0;
+}
+
+int ipv6_target_file_init(char *file, uint16_t senders, uint16_t shard,
+			  uint16_t shards)
+{
+	assert(senders > 0);
+	assert(shard < shards);
+	num_senders = senders;
+	shard_idx = shard;
+	num_shards = shards;
+	filename = file;
+
+	if (strcmp(file, "-") != 0) {
+		int fd = open(file, O_RDONLY);
+		if (fd < 0) {
+			log_fatal(LOGGER_NAME, "unable to open %s file: %s: %s",
+				  LOGGER_NAME, file, strerror(errno));
+			return 1;
+		}
+		struct stat st;
+		if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+		    init_mapped(fd, (size_t)st.st_size) == 0) {
+			close(fd);
+			return 0;
+		}
+		// not a regular file (e.g. a named pipe), stream it instead
+		fp = fdopen(fd, "r");
 	} else {
-		fp = fopen(file, "r");
+		fp = stdin;
 	}
 	if (fp == NULL) {
 		log_fatal(LOGGER_NAME, "unable to open %s file: %s: %s",
-				LOGGER_NAME, file, strerror(errno));
+			  LOGGER_NAME, file, strerror(errno));
 		return 1;
 	}
-
+	rings = xcalloc(num_senders, sizeof(struct target_ring));
+	if (pthread_create(&reader, NULL, reader_thread, NULL) != 0) {
+		log_fatal(LOGGER_NAME, "unable to start reader thread");
+	}
+	pthread_detach(reader);
 	return 0;
 }
 
-int ipv6_target_file_get_ipv6(struct in6_addr *dst)
+int ipv6_target_file_indexed(void)
 {
-    // ipv6_target_file_init() needs to be called before ipv6_target_file_get_ipv6()
-	assert(fp);
+	return indexed;
+}
 
-	char line[100];
+uint64_t ipv6_target_file_count(void)
+{
+	return num_targets;
+}
+
+void ipv6_target_file_get_index(uint64_t index, struct in6_addr *dst)
+{
+	assert(indexed && index < num_targets);
+	if (rec_len) {
+		get_binary(index, dst);
+		return;
+	}
+	const char *line = map + line_offsets[index];
+	const char *nl = memchr(line, '\n', (size_t)(map + map_len - line));
+	size_t len = (size_t)((nl ? nl : map + map_len) - line);
+	trim_line(&line, &len);
+	parse_line(line, len, dst);
+}
 
-	if (fgets(line, sizeof(line), fp) != NULL) {
-		// Remove newline
-		char *pos;
-		if ((pos = strchr(line, '\n')) != NULL) {
-			*pos = '\0';
+int ipv6_target_file_get_ipv6(uint16_t sender, struct in6_addr *dst)
+{
+	// ipv6_target_file_init() needs to be called before ipv6_target_file_get_ipv6()
+	assert(!indexed && sender < num_senders);
+
+	assert(rings);
+	struct target_ring *r = &rings[sender];
+	for (;;) {
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (head != r->tail) {
+			*dst = r->addrs[r->tail & (RING_SIZE - 1)];
+			__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+			return 0;
 		}
-		int rc = inet_pton(AF_INET6, line, dst);
-		if (rc != 1) {
-			log_fatal(LOGGER_NAME, "could not parse IPv6 address from line: %s: %s", line, strerror(errno));
+		if (__atomic_load_n(&reader_done, __ATOMIC_ACQUIRE)) {
+			// the reader may have pushed more right before finishing
+			if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail) {
+				continue;
+			}
 			return 1;
 		}
-	} else {
-		return 1;
+		ring_wait();
 	}
+}
 
-	return 0;
+void ipv6_target_file_close(uint16_t sender)
+{
+	if (rings) {
+		assert(sender < num_senders);
+		__atomic_store_n(&rings[sender].closed, 1, __ATOMIC_RELEASE);
+	}
 }
 
 int ipv6_target_file_deinit()
 {
-	fclose(fp);
-	fp = NULL;
+	if (map) {
+		munmap(map, map_len);
+		map = NULL;
+	}
+	xfree(line_offsets);
+	line_offsets = NULL;
+	rec_len = 0;
+	records = NULL;
+	dict = NULL;
+	num_targets = 0;
+	indexed = 0;
+	// The stdin reader may still be blocked on input or on a full ring
+	// when senders stop early, so its rings and stream are left to process
+	// exit.
 
 	return 0;
 }
-
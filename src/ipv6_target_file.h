@@ -10,8 +10,49 @@
 #ifndef IPV6_TARGET_FILE_H
 #define IPV6_TARGET_FILE_H
 
-int ipv6_target_file_init(char *file);
-int ipv6_target_file_get_ipv6(struct in6_addr *dst);
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * Binary target files (see zipv6pack) start with struct ipv6_bin_header. With
+ * IPV6_BIN_PREFIX_DICT set it is followed by dict_count 8-byte /64 prefixes
+ * and each record is a 4-byte prefix index plus the 8-byte interface
+ * identifier; otherwise each record is a plain 16-byte address. All integers
+ * are in network byte order.
+ */
+#define IPV6_BIN_MAGIC "ZMAP6BIN"
+#define IPV6_BIN_MAGIC_LEN 8
+#define IPV6_BIN_VERSION 1
+#define IPV6_BIN_PREFIX_DICT 0x1
+#define IPV6_BIN_PREFIX_LEN 8
+#define IPV6_BIN_DICT_RECORD_LEN (4 + 8)
+
+struct ipv6_bin_header {
+	char magic[IPV6_BIN_MAGIC_LEN];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t count_hi;
+	uint32_t count_lo;
+	uint32_t dict_count_hi;
+	uint32_t dict_count_lo;
+};
+
+// Open the target file for senders senders of shard shard out of shards;
+// "-" reads from stdin. Text and binary files are told apart by the binary
+// magic.
+int ipv6_target_file_init(char *file, uint16_t senders, uint16_t shard,
+			  uint16_t shards);
+// Regular files are indexed: targets are fetched by index in [0, count), in
+// whatever order the caller's iterator chooses
+int ipv6_target_file_indexed(void);
+uint64_t ipv6_target_file_count(void);
+void ipv6_target_file_get_index(uint64_t index, struct in6_addr *dst);
+// Streamed input (stdin, pipes) only: next target for sender, in file order.
+// Returns non-zero once the input is exhausted
+int ipv6_target_file_get_ipv6(uint16_t sender, struct in6_addr *dst);
+// Called by a sender that stops before its share of a stream is exhausted,
+// so the reader doesn't stall the other senders waiting for it
+void ipv6_target_file_close(uint16_t sender);
 int ipv6_target_file_deinit();
 
 #endif
@@ -7,6 +7,7 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <time.h>
@@ -25,29 +26,47 @@
 
 struct iterator {
 	cycle_t cycle;
-	uint8_t num_threads;
+	uint16_t num_threads;
 	shard_t *thread_shards;
+	// where the shards count until their senders localize them
+	shard_stats_t *initial_stats;
 	uint8_t *complete;
 	pthread_mutex_t mutex;
 	uint32_t curr_threads;
+	// --delta-from: the prior hosts, then the rest of the allowed space
+	shard_stratum_t strata[2];
 };
 
-void shard_complete(uint8_t thread_id, void *arg)
+static void add_shard_stats(iterator_totals_t *t, const shard_t *s)
+{
+	const shard_stats_t *st = __atomic_load_n(&s->stats, __ATOMIC_ACQUIRE);
+	t->sent += shard_stat_read(&st->packets_sent);
+	t->targets_scanned += shard_stat_read(&st->targets_scanned);
+	t->iterations += shard_stat_read(&st->iterations);
+	t->fail += shard_stat_read(&st->packets_failed);
+	t->retransmits_skipped += shard_stat_read(&st->retransmits_skipped);
+	t->aliased_skipped += shard_stat_read(&st->aliased_skipped);
+	t->ipv6_blocklisted += shard_stat_read(&st->ipv6_blocklisted);
+}
+
+void shard_complete(uint16_t thread_id, void *arg)
 {
 	iterator_t *it = (iterator_t *)arg;
 	assert(thread_id < it->num_threads);
 	pthread_mutex_lock(&it->mutex);
+	assert(!it->complete[thread_id]);
 	it->complete[thread_id] = 1;
 	it->curr_threads--;
-	shard_t *s = &it->thread_shards[thread_id];
-	zsend.packets_sent += s->state.packets_sent;
-	zsend.targets_scanned += s->state.targets_scanned;
-	zsend.sendto_failures += s->state.packets_failed;
-	uint8_t done = 1;
-	for (uint8_t i = 0; done && (i < it->num_threads); ++i) {
-		done = done && it->complete[i];
-	}
-	if (done) {
+	iterator_totals_t t = {0};
+	add_shard_stats(&t, &it->thread_shards[thread_id]);
+	zsend.packets_sent += t.sent;
+	zsend.targets_scanned += t.targets_scanned;
+	zsend.sendto_failures += t.fail;
+	zsend.retransmits_skipped += t.retransmits_skipped;
+	zsend.aliased_skipped += t.aliased_skipped;
+	zsend.ipv6_blocklisted += t.ipv6_blocklisted;
+	// every thread completes once, so the count says when all have
+	if (!it->curr_threads) {
 		zsend.finish = now();
 		zsend.complete = 1;
 		zsend.first_scanned = it->thread_shards[0].state.first_scanned;
@@ -55,83 +74,90 @@ void shard_complete(uint8_t thread_id, void *arg)
 	pthread_mutex_unlock(&it->mutex);
 }
 
-static uint64_t bits_needed(uint64_t n)
+// The prior hosts are walked first over a cycle sized for them, then the
+// rest of the allowed space over one of its own, leaving them out and only
+// sampling --delta-sample of it
+static uint8_t delta_strata(iterator_t *it, uint16_t num_shards,
+			    uint64_t num_addrs, uint32_t num_ports)
 {
-	n -= 1;
-	int r = 0;
-	while (n) {
-		r++;
-		n >>= 1;
+	uint8_t n = 0;
+	uint32_t num_subshards = (uint32_t)num_shards * it->num_threads;
+	uint64_t prior = zsend.delta_prior_count;
+	if ((uint64_t)prior * num_ports > num_subshards) {
+		it->strata[n++] = (shard_stratum_t){
+		    .cycle = make_cycle(get_group(prior * num_ports), zconf.aes),
+		    .num_addrs = prior,
+		    .list = zsend.delta_prior,
+		    .skip = NULL,
+		    .fraction = 1};
+	} else if (prior) {
+		log_fatal("iterator", "--delta-from has %" PRIu64 " hosts, too "
+				      "few for %u senders and shards",
+			  prior, num_subshards);
 	}
-	return r;
+	it->strata[n++] = (shard_stratum_t){
+	    .cycle = it->cycle,
+	    .num_addrs = num_addrs,
+	    .list = NULL,
+	    .skip = prior ? zsend.delta_prior_set : NULL,
+	    .fraction = zconf.delta_sample};
+	return n;
 }
 
-iterator_t *iterator_init(uint8_t num_threads, uint16_t shard,
+iterator_t *iterator_init(uint16_t num_threads, uint16_t shard,
 			  uint16_t num_shards, uint64_t num_addrs,
 			  uint32_t num_ports)
 {
-	uint8_t bits_for_ip = bits_needed(num_addrs);
-	log_debug("iterator", "bits needed for %u addresses: %u", num_addrs,
-		  bits_for_ip);
-	uint8_t bits_for_port = bits_needed(num_ports);
-	log_debug("iterator", "bits needed for %u ports: %u", num_ports,
-		  bits_for_port);
-	uint64_t group_min_size = ((uint64_t)1)
-				  << (bits_for_ip + bits_for_port);
-	log_debug("iterator", "minimum elements to iterate over: %llu",
-		  group_min_size);
+	// every (address, port) pair is one element, ports varying fastest,
+	// so the group need be no larger than their product
+	uint64_t group_min_size = num_addrs * num_ports;
+	log_debug("iterator",
+		  "minimum elements to iterate over: %" PRIu64
+		  " (%" PRIu64 " addresses, %u ports)",
+		  group_min_size, num_addrs, num_ports);
 	iterator_t *it = xmalloc(sizeof(struct iterator));
 	const cyclic_group_t *group = get_group(group_min_size);
-	if (num_addrs > (1LL << 32)) {
-		zsend.max_index = 0xFFFFFFFF;
-	} else {
-		zsend.max_index = (uint32_t)num_addrs;
-	}
-	log_debug("iterator", "max index %u", zsend.max_index);
+	zsend.max_index = num_addrs;
+	log_debug("iterator", "max index %" PRIu64, zsend.max_index);
 	it->cycle = make_cycle(group, zconf.aes);
 	it->num_threads = num_threads;
 	it->curr_threads = num_threads;
-	it->thread_shards = xcalloc(num_threads, sizeof(shard_t));
+	it->thread_shards =
+	    xmalloc_aligned(_Alignof(shard_t), num_threads * sizeof(shard_t));
+	it->initial_stats =
+	    xmalloc_aligned(_Alignof(shard_stats_t),
+			    num_threads * sizeof(shard_stats_t));
 	it->complete = xcalloc(it->num_threads, sizeof(uint8_t));
 	pthread_mutex_init(&it->mutex, NULL);
-	log_debug("iterator", "max targets is %u", zsend.max_targets);
-	for (uint8_t i = 0; i < num_threads; ++i) {
+	log_debug("iterator", "max targets is %" PRIu64, zsend.max_targets);
+	for (uint16_t i = 0; i < num_threads; ++i) {
 		shard_init(&it->thread_shards[i], shard, num_shards, i,
-			   num_threads, zsend.max_targets, bits_for_port,
-			   &it->cycle, shard_complete, it);
+			   num_threads, zsend.max_targets, num_ports,
+			   &it->cycle, &it->initial_stats[i], shard_complete,
+			   it);
+		it->thread_shards[i].peers = it->thread_shards;
+		it->thread_shards[i].num_peers = num_threads;
+	}
+	if (zconf.delta_filename) {
+		uint8_t n = delta_strata(it, num_shards, num_addrs, num_ports);
+		for (uint16_t i = 0; i < num_threads; ++i) {
+			shard_set_strata(&it->thread_shards[i], it->strata, n);
+		}
 	}
 	zconf.generator = it->cycle.generator;
 	return it;
 }
 
-uint64_t iterator_get_sent(iterator_t *it)
-{
-	uint64_t sent = 0;
-	for (uint8_t i = 0; i < it->num_threads; ++i) {
-		sent += it->thread_shards[i].state.packets_sent;
-	}
-	return sent;
-}
-
-uint64_t iterator_get_iterations(iterator_t *it)
-{
-	uint64_t iterations = 0;
-	for (uint8_t i = 0; i < it->num_threads; ++i) {
-		iterations += it->thread_shards[i].iterations;
-	}
-	return iterations;
-}
-
-uint32_t iterator_get_fail(iterator_t *it)
+void iterator_get_totals(iterator_t *it, iterator_totals_t *t)
 {
-	uint32_t fails = 0;
-	for (uint8_t i = 0; i < it->num_threads; ++i) {
-		fails += it->thread_shards[i].state.packets_failed;
+	iterator_totals_t sum = {0};
+	for (uint16_t i = 0; i < it->num_threads; ++i) {
+		add_shard_stats(&sum, &it->thread_shards[i]);
 	}
-	return fails;
+	*t = sum;
 }
 
-shard_t *get_shard(iterator_t *it, uint8_t thread_id)
+shard_t *get_shard(iterator_t *it, uint16_t thread_id)
 {
 	assert(thread_id < it->num_threads);
 	return &it->thread_shards[thread_id];
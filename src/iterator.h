@@ -19,16 +19,26 @@
 
 typedef struct iterator iterator_t;
 
-iterator_t *iterator_init(uint8_t num_threads, uint16_t shard,
+iterator_t *iterator_init(uint16_t num_threads, uint16_t shard,
 			  uint16_t num_shards, uint64_t num_addrs,
 			  uint32_t num_ports);
 
-uint64_t iterator_get_sent(iterator_t *it);
-uint64_t iterator_get_iterations(iterator_t *it);
-uint32_t iterator_get_fail(iterator_t *it);
+// sums over the sender threads' shards, read while they are counting
+typedef struct iterator_totals {
+	uint64_t sent;
+	uint64_t targets_scanned;
+	uint64_t iterations;
+	uint64_t fail;
+	uint64_t retransmits_skipped;
+	uint64_t aliased_skipped;
+	uint64_t ipv6_blocklisted;
+} iterator_totals_t;
+
+// all of the sums in one pass over the shards
+void iterator_get_totals(iterator_t *it, iterator_totals_t *t);
 
 uint32_t iterator_get_curr_send_threads(iterator_t *it);
 
-shard_t *get_shard(iterator_t *it, uint8_t thread_id);
+shard_t *get_shard(iterator_t *it, uint16_t thread_id);
 
 #endif /* ZMAP_ITERATOR_H */
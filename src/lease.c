@@ -0,0 +1,728 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "lease.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/logger.h"
+#include "../lib/util.h"
+#include "../lib/xalloc.h"
+
+#define LEASE_LINE_MAX 256
+// leases to split the cycle into unless told otherwise
+#define LEASE_DEFAULT_COUNT 4096
+// bits of the done bitmap kept by the coordinator
+#define LEASE_MAX_COUNT ((uint64_t)1 << 26)
+// how long a worker waits before asking again while every lease is held
+#define LEASE_WAIT_SECS 5
+// --rate-budget: how often a worker renews its rate, and how long the
+// coordinator counts a rate as taken without a renewal
+#define LEASE_RATE_INTERVAL_MS 250
+#define LEASE_RATE_TTL_MS (4 * LEASE_RATE_INTERVAL_MS)
+// a worker is never granted less than this fraction of the budget, as
+// tokens already claimed at a far slower rate would stall it long after
+// the next renewal
+#define LEASE_RATE_MIN_FRACTION 1000
+
+// FNV-1a
+#define LEASE_HASH_INIT 0xcbf29ce484222325ULL
+
+static uint64_t hash_bytes(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+uint64_t lease_config_hash(uint64_t seed, uint64_t order, uint64_t max_index,
+			   const struct port_conf *ports)
+{
+	uint64_t h = LEASE_HASH_INIT;
+	h = hash_bytes(h, &seed, sizeof(seed));
+	h = hash_bytes(h, &order, sizeof(order));
+	h = hash_bytes(h, &max_index, sizeof(max_index));
+	uint32_t count = ports->port_count;
+	h = hash_bytes(h, &count, sizeof(count));
+	for (uint32_t i = 0; i < count; i++) {
+		uint16_t port = ports->ports[i];
+		h = hash_bytes(h, &port, sizeof(port));
+	}
+	return h;
+}
+
+static int write_line(int fd, const char *line)
+{
+	size_t len = strlen(line);
+	while (len) {
+		ssize_t n = send(fd, line, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		line += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* the coordinator */
+
+typedef struct lease_client {
+	int fd;
+	int hello;
+	size_t len;
+	char buf[LEASE_LINE_MAX];
+	// --rate-budget: the rate the worker last asked for and the one it
+	// was granted, taken until rate_expires
+	uint64_t rate_want;
+	uint64_t rate;
+	double rate_expires;
+} lease_client_t;
+
+typedef struct lease_held {
+	uint64_t id;
+	double expires;
+	int fd;
+} lease_held_t;
+
+typedef struct lease_server {
+	uint64_t order;
+	uint64_t hash;
+	uint64_t size;
+	uint64_t count;
+	uint32_t timeout;
+	// never handed out from here on
+	uint64_t next;
+	uint64_t done;
+	uint8_t *done_bits;
+	lease_held_t *held;
+	size_t held_len, held_cap;
+	// held by a worker that went away or let them expire
+	uint64_t *again;
+	size_t again_len, again_cap;
+	uint64_t last_percent;
+	lease_client_t *clients;
+	size_t clients_len;
+	// packets per second shared by the workers, 0 for no budget
+	uint64_t rate_budget;
+	size_t rate_workers;
+} lease_server_t;
+
+static int lease_is_done(const lease_server_t *s, uint64_t id)
+{
+	return s->done_bits[id >> 3] & (1 << (id & 0x07));
+}
+
+static void hand_back(lease_server_t *s, uint64_t id)
+{
+	if (s->again_len == s->again_cap) {
+		s->again_cap = s->again_cap ? 2 * s->again_cap : 64;
+		s->again = xrealloc(s->again, s->again_cap * sizeof(uint64_t));
+	}
+	s->again[s->again_len++] = id;
+}
+
+static void drop_held(lease_server_t *s, size_t i)
+{
+	s->held[i] = s->held[--s->held_len];
+}
+
+// leases of a worker that went away are handed out again at once
+static void release_worker(lease_server_t *s, int fd)
+{
+	for (size_t i = 0; i < s->held_len;) {
+		if (s->held[i].fd == fd) {
+			log_info("lease", "lease %" PRIu64 " lost with its worker",
+				 s->held[i].id);
+			hand_back(s, s->held[i].id);
+			drop_held(s, i);
+		} else {
+			i++;
+		}
+	}
+}
+
+static void expire_leases(lease_server_t *s, double t)
+{
+	for (size_t i = 0; i < s->held_len;) {
+		if (s->held[i].expires <= t) {
+			log_info("lease",
+				 "lease %" PRIu64 " expired, handing it out again",
+				 s->held[i].id);
+			hand_back(s, s->held[i].id);
+			drop_held(s, i);
+		} else {
+			i++;
+		}
+	}
+}
+
+static void finish_lease(lease_server_t *s, uint64_t id)
+{
+	if (id >= s->count || lease_is_done(s, id)) {
+		return;
+	}
+	s->done_bits[id >> 3] |= (uint8_t)(1 << (id & 0x07));
+	s->done++;
+	// whoever else has it, or will, need not
+	for (size_t i = 0; i < s->held_len;) {
+		if (s->held[i].id == id) {
+			drop_held(s, i);
+		} else {
+			i++;
+		}
+	}
+	for (size_t i = 0; i < s->again_len;) {
+		if (s->again[i] == id) {
+			s->again[i] = s->again[--s->again_len];
+		} else {
+			i++;
+		}
+	}
+	uint64_t percent = 100 * s->done / s->count;
+	if (percent != s->last_percent) {
+		s->last_percent = percent;
+		log_info("lease", "%" PRIu64 " of %" PRIu64 " leases done (%" PRIu64
+				  "%%)",
+			 s->done, s->count, percent);
+	}
+}
+
+static void grant_lease(lease_server_t *s, int fd, char *reply, size_t len)
+{
+	uint64_t id;
+	if (s->again_len) {
+		id = s->again[--s->again_len];
+	} else if (s->next < s->count) {
+		id = s->next++;
+	} else if (s->done < s->count) {
+		snprintf(reply, len, "WAIT %d\n", LEASE_WAIT_SECS);
+		return;
+	} else {
+		snprintf(reply, len, "FINISHED\n");
+		return;
+	}
+	if (s->held_len == s->held_cap) {
+		s->held_cap = s->held_cap ? 2 * s->held_cap : 64;
+		s->held = xrealloc(s->held, s->held_cap * sizeof(lease_held_t));
+	}
+	s->held[s->held_len++] =
+	    (lease_held_t){.id = id, .expires = now() + s->timeout, .fd = fd};
+	uint64_t start = id * s->size;
+	uint64_t end = start + s->size < s->order ? start + s->size : s->order;
+	snprintf(reply, len, "RANGE %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", id,
+		 start, end);
+	log_debug("lease", "lease %" PRIu64 " to worker %d", id, fd);
+}
+
+// The rate at which sum(min(want, level)) over wants is budget, the fair
+// share of whoever wants more, or UINT64_MAX if they all fit.
+static uint64_t rate_level(uint64_t *wants, size_t n, uint64_t budget)
+{
+	// sorted, the smaller wants are met in full and the rest split what
+	// is left
+	for (size_t i = 1; i < n; i++) {
+		uint64_t w = wants[i];
+		size_t j = i;
+		for (; j > 0 && wants[j - 1] > w; j--) {
+			wants[j] = wants[j - 1];
+		}
+		wants[j] = w;
+	}
+	for (size_t i = 0; i < n; i++) {
+		uint64_t share = budget / (n - i);
+		if (wants[i] > share) {
+			return share;
+		}
+		budget -= wants[i];
+	}
+	return UINT64_MAX;
+}
+
+// Lease c a rate out of the budget: its fair share among the workers that
+// hold one, of no more than what the others hold leaves. A worker that
+// joins then starts on what is free, and gets its full share once the
+// others have renewed theirs at their new, smaller shares, so that the
+// rates granted add up to no more than the budget, bar the floor of a
+// worker that has just joined.
+static uint64_t grant_rate(lease_server_t *s, lease_client_t *c, uint64_t want)
+{
+	double t = now();
+	uint64_t *wants = xmalloc(s->clients_len * sizeof(uint64_t));
+	size_t n = 0;
+	uint64_t taken = 0;
+	for (size_t i = 0; i < s->clients_len; i++) {
+		lease_client_t *o = &s->clients[i];
+		if (o == c) {
+			continue;
+		}
+		if (o->rate_expires <= t) {
+			o->rate = 0;
+			continue;
+		}
+		taken += o->rate;
+		if (o->rate_want) {
+			wants[n++] = o->rate_want;
+		}
+	}
+	uint64_t rate = 0;
+	if (want) {
+		wants[n++] = want;
+		uint64_t level = rate_level(wants, n, s->rate_budget);
+		uint64_t left = taken < s->rate_budget ? s->rate_budget - taken : 0;
+		rate = want < level ? want : level;
+		rate = rate < left ? rate : left;
+		uint64_t floor = s->rate_budget / LEASE_RATE_MIN_FRACTION;
+		floor = floor ? floor : 1;
+		rate = rate > floor ? rate : floor;
+	}
+	xfree(wants);
+	c->rate_want = want;
+	c->rate = rate;
+	c->rate_expires = t + LEASE_RATE_TTL_MS / 1000.;
+	if (n != s->rate_workers) {
+		s->rate_workers = n;
+		log_info("lease",
+			 "rate budget of %" PRIu64 " pps shared by %zu workers",
+			 s->rate_budget, n);
+	}
+	return rate;
+}
+
+// returns 0 to hang up on the worker
+static int handle_line(lease_server_t *s, lease_client_t *c, const char *line)
+{
+	char reply[LEASE_LINE_MAX];
+	unsigned version;
+	uint64_t hash, id, want;
+	if (sscanf(line, "HELLO %u %" SCNx64, &version, &hash) == 2) {
+		if (version != LEASE_PROTOCOL_VERSION) {
+			write_line(c->fd, "ERR protocol version\n");
+			return 0;
+		}
+		if (hash != s->hash) {
+			log_warn("lease", "worker %d is of another scan", c->fd);
+			write_line(c->fd, "ERR seed, targets or ports differ\n");
+			return 0;
+		}
+		c->hello = 1;
+		if (s->rate_budget) {
+			snprintf(reply, sizeof(reply),
+				 "OK %" PRIu64 " %" PRIu64 "\n", s->order,
+				 s->rate_budget);
+		} else {
+			snprintf(reply, sizeof(reply), "OK %" PRIu64 "\n",
+				 s->order);
+		}
+	} else if (!c->hello) {
+		write_line(c->fd, "ERR HELLO first\n");
+		return 0;
+	} else if (!strcmp(line, "LEASE")) {
+		grant_lease(s, c->fd, reply, sizeof(reply));
+	} else if (sscanf(line, "DONE %" SCNu64, &id) == 1) {
+		finish_lease(s, id);
+		snprintf(reply, sizeof(reply), "OK\n");
+	} else if (s->rate_budget &&
+		   sscanf(line, "RATE %" SCNu64, &want) == 1) {
+		snprintf(reply, sizeof(reply), "RATE %" PRIu64 " %d\n",
+			 grant_rate(s, c, want), LEASE_RATE_TTL_MS);
+	} else {
+		write_line(c->fd, "ERR unknown request\n");
+		return 0;
+	}
+	return !write_line(c->fd, reply);
+}
+
+// returns 0 once the worker has gone
+static int read_client(lease_server_t *s, lease_client_t *c)
+{
+	ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+	if (n <= 0) {
+		return n < 0 && errno == EINTR;
+	}
+	c->len += n;
+	char *line = c->buf;
+	char *eol;
+	while ((eol = memchr(line, '\n', c->buf + c->len - line))) {
+		*eol = '\0';
+		if (eol > line && eol[-1] == '\r') {
+			eol[-1] = '\0';
+		}
+		if (!handle_line(s, c, line)) {
+			return 0;
+		}
+		line = eol + 1;
+	}
+	c->len -= line - c->buf;
+	memmove(c->buf, line, c->len);
+	// no request is this long
+	return c->len < sizeof(c->buf);
+}
+
+static int lease_listen(const char *address, uint16_t port)
+{
+	char service[8];
+	snprintf(service, sizeof(service), "%u", port);
+	struct addrinfo hints = {.ai_family = AF_UNSPEC,
+				 .ai_socktype = SOCK_STREAM,
+				 .ai_flags = AI_PASSIVE | AI_NUMERICHOST |
+					     AI_NUMERICSERV};
+	struct addrinfo *res = NULL;
+	int rc = getaddrinfo(address, service, &hints, &res);
+	if (rc) {
+		log_error("lease", "invalid address %s: %s", address,
+			  gai_strerror(rc));
+		return -1;
+	}
+	int fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	int one = 1;
+	if (fd < 0 ||
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+	    bind(fd, res->ai_addr, res->ai_addrlen) || listen(fd, 64)) {
+		log_error("lease", "could not listen on %s port %u: %s", address,
+			  port, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+int lease_serve(const char *address, uint16_t port, uint64_t order,
+		uint64_t hash, uint64_t lease_size, uint32_t timeout_secs,
+		uint64_t rate_budget)
+{
+	lease_server_t s = {.order = order,
+			    .hash = hash,
+			    .timeout = timeout_secs,
+			    .rate_budget = rate_budget};
+	s.size = lease_size ? lease_size : order / LEASE_DEFAULT_COUNT;
+	if (!s.size) {
+		s.size = 1;
+	}
+	s.count = (order + s.size - 1) / s.size;
+	if (s.count > LEASE_MAX_COUNT) {
+		log_error("lease",
+			  "%" PRIu64 " leases of %" PRIu64 " are too many, "
+			  "make them larger",
+			  s.count, s.size);
+		return EXIT_FAILURE;
+	}
+	s.done_bits = xcalloc(s.count / 8 + 1, 1);
+	s.last_percent = 0;
+	int listen_fd = lease_listen(address, port);
+	if (listen_fd < 0) {
+		xfree(s.done_bits);
+		return EXIT_FAILURE;
+	}
+	log_info("lease",
+		 "serving %" PRIu64 " leases of %" PRIu64 " exponents on %s port "
+		 "%u",
+		 s.count, s.size, address, port);
+	if (rate_budget) {
+		log_info("lease", "workers share a rate budget of %" PRIu64
+				  " pps",
+			 rate_budget);
+	}
+
+	// pfds[0] is the listening socket, pfds[i + 1] that of clients[i]
+	size_t cap = 16;
+	s.clients = xcalloc(cap, sizeof(lease_client_t));
+	struct pollfd *pfds = xcalloc(cap + 1, sizeof(struct pollfd));
+	// once every lease is done, until the workers have all hung up
+	while (s.done < s.count || s.clients_len) {
+		pfds[0] = (struct pollfd){
+		    .fd = s.done < s.count ? listen_fd : -1, .events = POLLIN};
+		for (size_t i = 0; i < s.clients_len; i++) {
+			pfds[i + 1] =
+			    (struct pollfd){.fd = s.clients[i].fd, .events = POLLIN};
+		}
+		int rc = poll(pfds, s.clients_len + 1, 1000);
+		if (rc < 0 && errno != EINTR) {
+			log_error("lease", "poll failed: %s", strerror(errno));
+			break;
+		}
+		expire_leases(&s, now());
+		if (rc <= 0) {
+			continue;
+		}
+		for (size_t i = s.clients_len; i-- > 0;) {
+			if (!pfds[i + 1].revents) {
+				continue;
+			}
+			if (read_client(&s, &s.clients[i])) {
+				continue;
+			}
+			log_debug("lease", "worker %d hung up", s.clients[i].fd);
+			release_worker(&s, s.clients[i].fd);
+			close(s.clients[i].fd);
+			s.clients[i] = s.clients[--s.clients_len];
+		}
+		if (pfds[0].revents & POLLIN) {
+			int fd = accept(listen_fd, NULL, NULL);
+			if (fd < 0) {
+				continue;
+			}
+			if (s.clients_len == cap) {
+				cap *= 2;
+				s.clients = xrealloc(
+				    s.clients, cap * sizeof(lease_client_t));
+				pfds = xrealloc(pfds,
+						(cap + 1) * sizeof(struct pollfd));
+			}
+			s.clients[s.clients_len++] = (lease_client_t){.fd = fd};
+			log_debug("lease", "worker %d connected", fd);
+		}
+	}
+	close(listen_fd);
+	xfree(s.clients);
+	xfree(pfds);
+	xfree(s.held);
+	xfree(s.again);
+	xfree(s.done_bits);
+	log_info("lease", "all %" PRIu64 " leases done", s.count);
+	return EXIT_SUCCESS;
+}
+
+/* a worker */
+
+static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int client_fd = -1;
+static FILE *client_in = NULL;
+static int client_lost = 0;
+static uint64_t client_order = 0;
+// the lease each send thread is walking, or -1
+static int64_t *client_held = NULL;
+// the coordinator's --rate-budget, and what is told each granted rate
+static uint64_t client_rate_budget = 0;
+static void (*client_set_rate)(uint64_t pps) = NULL;
+
+// a request and its reply, with client_mutex held
+static int request(const char *line, char *reply, size_t len)
+{
+	if (client_lost) {
+		return -1;
+	}
+	if (write_line(client_fd, line) || !fgets(reply, len, client_in)) {
+		log_error("lease", "lost the coordinator: %s",
+			  errno ? strerror(errno) : "connection closed");
+		client_lost = 1;
+		return -1;
+	}
+	return 0;
+}
+
+void lease_connect(const char *hostport, uint64_t order, uint64_t hash,
+		   uint16_t threads)
+{
+	char *host = strdup(hostport);
+	char *port = strrchr(host, ':');
+	if (!port || port == host) {
+		log_fatal("lease", "--coordinator must be host:port, not %s",
+			  hostport);
+	}
+	*port++ = '\0';
+	// [address]:port
+	if (host[0] == '[' && port[-2] == ']') {
+		port[-2] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+	struct addrinfo hints = {.ai_family = AF_UNSPEC,
+				 .ai_socktype = SOCK_STREAM};
+	struct addrinfo *res = NULL;
+	int rc = getaddrinfo(host, port, &hints, &res);
+	if (rc) {
+		log_fatal("lease", "unable to resolve %s: %s", hostport,
+			  gai_strerror(rc));
+	}
+	for (struct addrinfo *ai = res; ai && client_fd < 0; ai = ai->ai_next) {
+		client_fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (client_fd >= 0 &&
+		    connect(client_fd, ai->ai_addr, ai->ai_addrlen)) {
+			close(client_fd);
+			client_fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (client_fd < 0) {
+		log_fatal("lease", "unable to connect to the coordinator at %s: %s",
+			  hostport, strerror(errno));
+	}
+	client_in = fdopen(dup(client_fd), "r");
+	if (!client_in) {
+		log_fatal("lease", "fdopen failed: %s", strerror(errno));
+	}
+	char line[LEASE_LINE_MAX], reply[LEASE_LINE_MAX];
+	snprintf(line, sizeof(line), "HELLO %d %016" PRIx64 "\n",
+		 LEASE_PROTOCOL_VERSION, hash);
+	if (request(line, reply, sizeof(reply))) {
+		log_fatal("lease", "no answer from the coordinator at %s",
+			  hostport);
+	}
+	uint64_t their_order;
+	// a coordinator with a budget says so after the order
+	if (sscanf(reply, "OK %" SCNu64 " %" SCNu64, &their_order,
+		   &client_rate_budget) < 1 ||
+	    their_order != order) {
+		reply[strcspn(reply, "\n")] = '\0';
+		log_fatal("lease", "the coordinator at %s refused this scan: %s",
+			  hostport, reply);
+	}
+	client_order = order;
+	client_held = xmalloc(threads * sizeof(int64_t));
+	for (uint16_t i = 0; i < threads; i++) {
+		client_held[i] = -1;
+	}
+	free(host);
+	log_info("lease", "taking leases from the coordinator at %s", hostport);
+}
+
+int lease_next(uint16_t thread_id, uint64_t *pos, uint64_t *end, void *arg)
+{
+	(void)arg;
+	char line[LEASE_LINE_MAX], reply[LEASE_LINE_MAX];
+	pthread_mutex_lock(&client_mutex);
+	if (client_held[thread_id] >= 0) {
+		snprintf(line, sizeof(line), "DONE %" PRId64 "\n",
+			 client_held[thread_id]);
+		client_held[thread_id] = -1;
+		if (request(line, reply, sizeof(reply))) {
+			pthread_mutex_unlock(&client_mutex);
+			return 0;
+		}
+	}
+	for (;;) {
+		if (request("LEASE\n", reply, sizeof(reply))) {
+			break;
+		}
+		uint64_t id, start, stop;
+		unsigned wait;
+		if (sscanf(reply, "RANGE %" SCNu64 " %" SCNu64 " %" SCNu64, &id,
+			   &start, &stop) == 3 &&
+		    start < stop && stop <= client_order) {
+			client_held[thread_id] = (int64_t)id;
+			pthread_mutex_unlock(&client_mutex);
+			log_debug("lease", "thread %hu took lease %" PRIu64,
+				  thread_id, id);
+			*pos = start;
+			*end = stop;
+			return 1;
+		}
+		if (sscanf(reply, "WAIT %u", &wait) != 1) {
+			if (strcmp(reply, "FINISHED\n")) {
+				log_error("lease", "bad reply from the "
+						   "coordinator");
+				client_lost = 1;
+			}
+			break;
+		}
+		// the rest are held by other workers, which may yet let some go
+		pthread_mutex_unlock(&client_mutex);
+		for (unsigned i = 0; i < wait && !zrecv.complete; i++) {
+			sleep(1);
+		}
+		pthread_mutex_lock(&client_mutex);
+		if (zrecv.complete) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&client_mutex);
+	return 0;
+}
+
+uint64_t lease_rate_budget(void)
+{
+	return client_rate_budget;
+}
+
+// what this worker could use: its own rate, or with --adaptive-rate the
+// most that may reach; nothing once it has sent everything
+static uint64_t rate_wanted(void)
+{
+	if (zsend.complete) {
+		return 0;
+	}
+	int rate = zconf.adaptive_rate ? zconf.adaptive_rate : zconf.rate;
+	return rate > 0 ? (uint64_t)rate : client_rate_budget;
+}
+
+// returns -1 once the coordinator is lost
+static int rate_renew(void)
+{
+	char line[LEASE_LINE_MAX], reply[LEASE_LINE_MAX];
+	snprintf(line, sizeof(line), "RATE %" PRIu64 "\n", rate_wanted());
+	pthread_mutex_lock(&client_mutex);
+	int rc = request(line, reply, sizeof(reply));
+	pthread_mutex_unlock(&client_mutex);
+	uint64_t rate;
+	unsigned ttl_ms;
+	if (rc) {
+		return -1;
+	}
+	if (sscanf(reply, "RATE %" SCNu64 " %u", &rate, &ttl_ms) != 2) {
+		log_error("lease", "bad reply from the coordinator");
+		client_lost = 1;
+		return -1;
+	}
+	// a worker with nothing left to send keeps its last rate for the
+	// retransmissions and follow-ups still due
+	if (rate) {
+		client_set_rate(rate);
+	}
+	return 0;
+}
+
+static void *rate_thread(void *arg)
+{
+	(void)arg;
+	struct timespec interval = {
+	    .tv_sec = 0, .tv_nsec = LEASE_RATE_INTERVAL_MS * 1000000L};
+	while (!zrecv.complete) {
+		nanosleep(&interval, NULL);
+		if (rate_renew()) {
+			// the rates the others hold stay theirs too, so the
+			// last one granted stays within the budget
+			log_warn("lease", "keeping the last rate granted");
+			break;
+		}
+	}
+	return NULL;
+}
+
+void lease_rate_start(void (*set_rate)(uint64_t pps))
+{
+	assert(client_rate_budget);
+	client_set_rate = set_rate;
+	if (rate_renew()) {
+		log_fatal("lease", "no rate from the coordinator's budget");
+	}
+	pthread_t t;
+	if (pthread_create(&t, NULL, rate_thread, NULL)) {
+		log_fatal("lease", "unable to start the rate thread");
+	}
+	pthread_detach(t);
+}
@@ -0,0 +1,69 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_LEASE_H
+#define ZMAP_LEASE_H
+
+#include <stdint.h>
+
+#include "state.h"
+
+/*
+ * Scans spread over several machines without fixed shards: ziterate
+ * --serve-leases hands out leases of ranges of the cycle's linear exponents
+ * (see shard.h) to zmap --coordinator workers, one range per send thread at
+ * a time, which walk them as they would a subshard. A lease whose worker
+ * disconnects, or that is not done within the lease timeout, is handed out
+ * again, so a scan finishes as long as some worker is left. The coordinator
+ * and every worker must use the same seed, targets and ports; a hash of
+ * them is checked when a worker connects.
+ *
+ * With --rate-budget the coordinator also shares a send rate between the
+ * workers: four times a second each worker asks for the rate it
+ * could use and is granted its max-min fair share of the budget among the
+ * workers that hold a rate, and no more than the others leave free. A
+ * worker that hangs up or stops renewing gives its rate back, so the rates
+ * add up to the budget however many workers come and go.
+ *
+ * One request per line, each with a one-line reply:
+ *
+ *   HELLO <version> <hash>  ->  OK <order> [<budget>] | ERR <reason>
+ *   LEASE                   ->  RANGE <id> <start> <end> | WAIT <secs> |
+ *                               FINISHED
+ *   DONE <id>               ->  OK
+ *   RATE <want>             ->  RATE <pps> <ttl ms>
+ */
+
+#define LEASE_PROTOCOL_VERSION 1
+
+// what decides the order in which a worker walks the cycle
+uint64_t lease_config_hash(uint64_t seed, uint64_t order, uint64_t max_index,
+			   const struct port_conf *ports);
+
+// The coordinator, returning once every lease is done and every worker has
+// been told, or EXIT_FAILURE if it can't listen. lease_size 0 picks one;
+// rate_budget 0 shares no rate.
+int lease_serve(const char *address, uint16_t port, uint64_t order,
+		uint64_t hash, uint64_t lease_size, uint32_t timeout_secs,
+		uint64_t rate_budget);
+
+// A worker: connect to host:port and check that the coordinator is of the
+// same scan. Fatal if not.
+void lease_connect(const char *hostport, uint64_t order, uint64_t hash,
+		   uint16_t threads);
+// The next range for a send thread, once it is done with the last one, as
+// a shard_lease_cb. Waits while leases are held by others; returns 0 once
+// the scan is finished or the coordinator is lost.
+int lease_next(uint16_t thread_id, uint64_t *pos, uint64_t *end, void *arg);
+// the coordinator's rate budget once connected, 0 if it has none
+uint64_t lease_rate_budget(void);
+// Lease a first rate out of the budget, then keep renewing it on a thread
+// of its own, handing every rate granted to set_rate
+void lease_rate_start(void (*set_rate)(uint64_t pps));
+
+#endif /* ZMAP_LEASE_H */
@@ -0,0 +1,249 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "../lib/logger.h"
+#include "../lib/util.h"
+#include "../lib/xalloc.h"
+
+#include "state.h"
+
+// how long a scrape may take to send its request or take the page, so
+// that a stuck client cannot hold up the monitor
+#define METRICS_CLIENT_TIMEOUT_MS 200
+#define METRICS_REQUEST_MAX 2048
+
+static int listen_fd = -1;
+
+void metrics_init(void)
+{
+	if (!zconf.metrics_port) {
+		return;
+	}
+	char port[8];
+	snprintf(port, sizeof(port), "%u", zconf.metrics_port);
+	struct addrinfo hints = {.ai_family = AF_UNSPEC,
+				 .ai_socktype = SOCK_STREAM,
+				 .ai_flags = AI_PASSIVE | AI_NUMERICHOST |
+					     AI_NUMERICSERV};
+	struct addrinfo *res = NULL;
+	int rc = getaddrinfo(zconf.metrics_address, port, &hints, &res);
+	if (rc) {
+		log_fatal("metrics", "invalid --metrics-address (%s): %s",
+			  zconf.metrics_address, gai_strerror(rc));
+	}
+	listen_fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK |
+						 SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		log_fatal("metrics", "could not create socket: %s",
+			  strerror(errno));
+	}
+	int one = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(listen_fd, res->ai_addr, res->ai_addrlen) ||
+	    listen(listen_fd, 16)) {
+		log_fatal("metrics", "could not listen on %s port %u: %s",
+			  zconf.metrics_address, zconf.metrics_port,
+			  strerror(errno));
+	}
+	freeaddrinfo(res);
+	log_info("metrics", "serving metrics on %s port %u", zconf.metrics_address,
+		 zconf.metrics_port);
+}
+
+int metrics_enabled(void) { return listen_fd >= 0; }
+
+static void page_printf(metrics_page_t *p, const char *fmt, ...)
+{
+	for (;;) {
+		va_list ap;
+		va_start(ap, fmt);
+		size_t room = p->cap - p->len;
+		int n = vsnprintf(p->buf + p->len, room, fmt, ap);
+		va_end(ap);
+		if (n < 0) {
+			return;
+		}
+		if ((size_t)n < room) {
+			p->len += n;
+			return;
+		}
+		p->cap = p->cap ? 2 * p->cap + n : 4096 + n;
+		p->buf = xrealloc(p->buf, p->cap);
+	}
+}
+
+void metrics_page_reset(metrics_page_t *p)
+{
+	p->len = 0;
+	if (p->buf) {
+		p->buf[0] = '\0';
+	}
+}
+
+void metrics_family(metrics_page_t *p, const char *name, const char *type,
+		    const char *help)
+{
+	page_printf(p, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_sample(metrics_page_t *p, const char *name, const char *labels,
+		    double value)
+{
+	const char *open = labels[0] ? "{" : "";
+	const char *close = labels[0] ? "}" : "";
+	if (isnan(value)) {
+		page_printf(p, "%s%s%s%s NaN\n", name, open, labels, close);
+	} else if (isinf(value)) {
+		page_printf(p, "%s%s%s%s %s\n", name, open, labels, close,
+			    value > 0 ? "+Inf" : "-Inf");
+	} else {
+		page_printf(p, "%s%s%s%s %.17g\n", name, open, labels, close,
+			    value);
+	}
+}
+
+void metrics_sample_u64(metrics_page_t *p, const char *name,
+			const char *labels, uint64_t value)
+{
+	const char *open = labels[0] ? "{" : "";
+	const char *close = labels[0] ? "}" : "";
+	page_printf(p, "%s%s%s%s %" PRIu64 "\n", name, open, labels, close,
+		    value);
+}
+
+static void write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			// the client went away or stopped reading
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void answer(int fd, const metrics_page_t *page)
+{
+	struct timeval tv = {.tv_sec = 0,
+			     .tv_usec = METRICS_CLIENT_TIMEOUT_MS * 1000};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	// the request line and headers, of which only the path matters
+	char req[METRICS_REQUEST_MAX];
+	size_t len = 0;
+	while (len < sizeof(req) - 1) {
+		ssize_t n = read(fd, req + len, sizeof(req) - 1 - len);
+		if (n <= 0) {
+			break;
+		}
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+			break;
+		}
+	}
+	req[len] = '\0';
+	const char *status;
+	const char *type = "text/plain; charset=utf-8";
+	const char *body;
+	size_t body_len;
+	int head = !strncmp(req, "HEAD ", 5);
+	const char *path = strchr(req, ' ');
+	path = path ? path + 1 : "";
+	if (strncmp(req, "GET ", 4) && !head) {
+		status = "405 Method Not Allowed";
+		body = "only GET is supported\n";
+		body_len = strlen(body);
+	} else if (!strncmp(path, "/metrics", 8) &&
+		   (path[8] == ' ' || path[8] == '?' || path[8] == '\0')) {
+		status = "200 OK";
+		type = "text/plain; version=0.0.4; charset=utf-8";
+		body = page->buf ? page->buf : "";
+		body_len = page->len;
+	} else {
+		status = "404 Not Found";
+		body = "see /metrics\n";
+		body_len = strlen(body);
+	}
+	char header[256];
+	int n = snprintf(header, sizeof(header),
+			 "HTTP/1.0 %s\r\nContent-Type: %s\r\n"
+			 "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+			 status, type, body_len);
+	write_all(fd, header, n);
+	if (!head) {
+		write_all(fd, body, body_len);
+	}
+}
+
+void metrics_serve(const metrics_page_t *page, double seconds)
+{
+	double deadline = now() + seconds;
+	for (;;) {
+		double left = deadline - now();
+		if (left <= 0) {
+			return;
+		}
+		struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+		int rc = poll(&pfd, 1, (int)ceil(left * 1000));
+		if (rc < 0 && errno != EINTR) {
+			log_warn("metrics", "poll failed, no longer serving "
+					    "metrics: %s",
+				 strerror(errno));
+			metrics_close();
+			return;
+		}
+		if (rc <= 0) {
+			continue;
+		}
+		metrics_answer(page);
+	}
+}
+
+int metrics_fd(void)
+{
+	return listen_fd;
+}
+
+void metrics_answer(const metrics_page_t *page)
+{
+	// the listening socket is non-blocking, the accepted one not
+	int fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		return;
+	}
+	answer(fd, page);
+	close(fd);
+}
+
+void metrics_close(void)
+{
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+}
@@ -0,0 +1,56 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_METRICS_H
+#define ZMAP_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * --metrics-port serves the monitor's numbers in the Prometheus text
+ * format on http://<--metrics-address>:<port>/metrics. Everything is done
+ * on the monitor thread: it renders the page from what it has just
+ * exported, then answers scrapes while it waits for the next update. The
+ * send and receive threads do nothing besides keeping the counters they
+ * already keep.
+ */
+
+// the text of the page, rebuilt on every update
+typedef struct metrics_page {
+	char *buf;
+	size_t len;
+	size_t cap;
+} metrics_page_t;
+
+// opens the listening socket, if --metrics-port is given
+void metrics_init(void);
+int metrics_enabled(void);
+
+// starts the page over with nothing on it
+void metrics_page_reset(metrics_page_t *p);
+// the # HELP and # TYPE lines of a metric family; type is "counter",
+// "gauge" or "summary"
+void metrics_family(metrics_page_t *p, const char *name, const char *type,
+		    const char *help);
+// a sample of the family, labels being "" or of the form key="value",...
+void metrics_sample(metrics_page_t *p, const char *name, const char *labels,
+		    double value);
+void metrics_sample_u64(metrics_page_t *p, const char *name,
+			const char *labels, uint64_t value);
+
+// answers scrapes with page for the given number of seconds, returning
+// sooner only if the socket fails
+void metrics_serve(const metrics_page_t *page, double seconds);
+// the listening socket, -1 if there is none, for a caller that polls it
+// itself and has metrics_answer() take the scrape it has waiting
+int metrics_fd(void);
+void metrics_answer(const metrics_page_t *page);
+void metrics_close(void);
+
+#endif /* ZMAP_METRICS_H */
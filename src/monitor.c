@@ -26,13 +26,25 @@
 
 #include "../lib/lockfd.h"
 #include "../lib/logger.h"
+#include "../lib/statshm.h"
 #include "../lib/util.h"
 #include "../lib/xalloc.h"
 
 #include "blocklist.h"
+#include "drop_events.h"
 #include "iterator.h"
+#include "metrics.h"
+#include "rate_control.h"
+#include "output-queue.h"
 #include "recv.h"
+#include "sample.h"
+#include "send.h"
+#include "shaping.h"
+#include "stage_timing.h"
 #include "state.h"
+#ifdef XDP_FILTER
+#include "xdp_filter.h"
+#endif
 
 #define UPDATE_INTERVAL 1 // seconds
 #define NUMBER_STR_LEN 20
@@ -49,6 +61,10 @@ typedef struct internal_scan_status {
 	uint64_t last_recv_app_success;
 	uint64_t last_recv_total;
 	uint64_t last_pcap_drop;
+	uint64_t last_pipeline_drop;
+	uint64_t last_output_drop;
+	uint64_t last_starved_ns;
+	uint64_t last_backoff_ns;
 	double min_hitrate_start;
 } int_status_t;
 
@@ -94,6 +110,22 @@ typedef struct export_scan_status {
 	double pcap_drop_avg;
 	char pcap_drop_avg_str[NUMBER_STR_LEN];
 
+	// --recv-processing-threads queues
+	uint64_t capture_queue_depth;
+	uint64_t output_queue_depth;
+	uint64_t pipeline_drop_total;
+	double pipeline_drop_last;
+	// --output-queue-size
+	uint64_t output_ring_depth;
+	uint64_t output_spill_depth;
+	uint64_t output_drop_total;
+	double output_drop_last;
+	uint64_t output_spill_total;
+
+	// --end-when-answered
+	uint64_t outstanding;
+	char outstanding_str[40];
+
 	uint32_t time_remaining;
 	char time_remaining_str[NUMBER_STR_LEN];
 	uint32_t time_past;
@@ -104,9 +136,23 @@ typedef struct export_scan_status {
 	double fail_last;
 	float seconds_under_min_hitrate;
 
+	// --target-threads: the send threads' time spent waiting for targets,
+	// and its share of their time over the last update
+	double starved_total;
+	double starved_last;
+
+	// the send threads' waits for a full qdisc or device queue to
+	// drain, and their share of the senders' time over the last update
+	uint64_t backoff_total;
+	uint64_t backoff_ns_total;
+	double backoff_last;
+
 } export_status_t;
 
 static FILE *status_fd = NULL;
+static metrics_page_t metrics_page;
+static statshm_t *stats_shm = NULL;
+static uint64_t stats_shm_updates = 0;
 
 // find minimum of an array of doubles
 static double min_d(double array[], int n)
@@ -127,11 +173,12 @@ double compute_remaining_time(double age, uint64_t packets_sent,
 	if (!zsend.complete) {
 		double remaining[] = {INFINITY, INFINITY, INFINITY, INFINITY,
 				      INFINITY};
-		if (zsend.list_of_ips_pbm) {
+		if (zsend.list_of_ips) {
 			// Estimate progress using group iterations
 			double done =
 			    (double)iterations /
-			    ((uint64_t)0xFFFFFFFFU / zconf.total_shards);
+			    ((uint64_t)zconf.list_of_ips_count *
+			     zconf.ports->port_count / zconf.total_shards);
 			remaining[0] =
 			    (1. - done) * (age / done) + zconf.cooldown_secs;
 		}
@@ -149,13 +196,17 @@ double compute_remaining_time(double age, uint64_t packets_sent,
 		}
 		if (zconf.max_results) {
 			double done =
-			    (double)zrecv.filter_success / zconf.max_results;
+			    (double)recv_filter_success() / zconf.max_results;
 			remaining[3] = (1. - done) * (age / done);
 		}
 		if (zsend.max_index) {
+			// --delta-from and --sample only scan part of the
+			// space
+			uint64_t addrs = zsend.planned_targets ? zsend.planned_targets
+							       : zsend.max_index;
 			double done =
 			    (double)packets_sent /
-			    ((uint64_t)zsend.max_index * zconf.ports->port_count * zconf.packet_streams /
+			    ((uint64_t)addrs * zconf.ports->port_count * zconf.packet_streams /
 			     zconf.total_shards);
 			remaining[4] =
 			    (1. - done) * (age / done) + zconf.cooldown_secs;
@@ -181,18 +232,25 @@ static void update_pcap_stats(pthread_mutex_t *recv_ready_mutex)
 	// ask pcap for fresh values
 	pthread_mutex_lock(recv_ready_mutex);
 	recv_update_stats();
+#ifdef XDP_FILTER
+	xdp_filter_update_stats();
+#endif
 	pthread_mutex_unlock(recv_ready_mutex);
 }
 
 static void export_stats(int_status_t *intrnl, export_status_t *exp,
 			 iterator_t *it)
 {
-	uint64_t total_sent = iterator_get_sent(it);
-	uint64_t total_iterations = iterator_get_iterations(it);
-	uint32_t total_fail = iterator_get_fail(it);
+	iterator_totals_t totals;
+	iterator_get_totals(it, &totals);
+	uint64_t total_sent = totals.sent;
+	uint64_t total_iterations = totals.iterations;
+	uint64_t total_fail = totals.fail;
 	uint64_t total_recv = zrecv.pcap_recv;
-	uint64_t recv_success = zrecv.success_unique;
-	uint32_t app_success = zrecv.app_success_unique;
+	struct recv_stats rs;
+	recv_stats_snapshot(&rs);
+	uint64_t recv_success = rs.success_unique;
+	uint64_t app_success = rs.app_success_unique;
 	double cur_time = now();
 	double age = cur_time - zsend.start; // time of entire scan
 	// time since the last time we updated
@@ -276,6 +334,13 @@ static void export_stats(int_status_t *intrnl, export_status_t *exp,
 	exp->total_tried_sent = total_iterations;
 	exp->percent_complete = 100. * age / (age + remaining_secs);
 	exp->recv_success_unique = recv_success;
+	if (zconf.end_when_answered) {
+		exp->outstanding = recv_outstanding(&rs, totals.targets_scanned);
+		snprintf(exp->outstanding_str, sizeof(exp->outstanding_str),
+			 "; outstanding: %" PRIu64, exp->outstanding);
+	} else {
+		exp->outstanding_str[0] = '\0';
+	}
 	exp->app_recv_success_unique = app_success;
 	exp->total_recv = total_recv;
 	exp->complete = zsend.complete;
@@ -294,11 +359,52 @@ static void export_stats(int_status_t *intrnl, export_status_t *exp,
 	number_string(exp->pcap_drop_avg, exp->pcap_drop_avg_str,
 		      NUMBER_STR_LEN);
 
+	recv_pipeline_depths(&exp->capture_queue_depth,
+			     &exp->output_queue_depth);
+	exp->pipeline_drop_total =
+	    __atomic_load_n(&zrecv.pipeline_drops, __ATOMIC_RELAXED);
+	exp->pipeline_drop_last =
+	    (exp->pipeline_drop_total - intrnl->last_pipeline_drop) / delta;
+	output_queue_depths(&exp->output_ring_depth, &exp->output_spill_depth);
+	exp->output_drop_total =
+	    __atomic_load_n(&zrecv.output_drops, __ATOMIC_RELAXED);
+	exp->output_drop_last =
+	    (exp->output_drop_total - intrnl->last_output_drop) / delta;
+	exp->output_spill_total =
+	    __atomic_load_n(&zrecv.output_spilled, __ATOMIC_RELAXED);
+
 	zsend.sendto_failures = total_fail;
 	exp->fail_total = zsend.sendto_failures;
 	exp->fail_last = (exp->fail_total - intrnl->last_send_failures) / delta;
 	exp->fail_avg = exp->fail_total / age;
 
+	if (zconf.target_threads) {
+		uint64_t starved_ns = 0;
+		for (uint16_t i = 0; i < zconf.senders; i++) {
+			const shard_stats_t *st = __atomic_load_n(
+			    &get_shard(it, i)->stats, __ATOMIC_ACQUIRE);
+			starved_ns += shard_stat_read(&st->starved_ns);
+		}
+		exp->starved_total = starved_ns / 1e9;
+		exp->starved_last =
+		    (starved_ns - intrnl->last_starved_ns) / 1e9 /
+		    (delta * zconf.senders);
+		intrnl->last_starved_ns = starved_ns;
+	}
+
+	uint64_t backoffs = 0, backoff_ns = 0;
+	for (uint16_t i = 0; i < zconf.senders; i++) {
+		const shard_stats_t *st =
+		    __atomic_load_n(&get_shard(it, i)->stats, __ATOMIC_ACQUIRE);
+		backoffs += shard_stat_read(&st->send_backoffs);
+		backoff_ns += shard_stat_read(&st->backoff_ns);
+	}
+	exp->backoff_total = backoffs;
+	exp->backoff_ns_total = backoff_ns;
+	exp->backoff_last = (backoff_ns - intrnl->last_backoff_ns) / 1e9 /
+			    (delta * zconf.senders);
+	intrnl->last_backoff_ns = backoff_ns;
+
 	// misc
 	exp->send_threads = iterator_get_curr_send_threads(it);
 
@@ -308,6 +414,8 @@ static void export_stats(int_status_t *intrnl, export_status_t *exp,
 	intrnl->last_recv_net_success = exp->recv_success_unique;
 	intrnl->last_recv_app_success = exp->app_recv_success_unique;
 	intrnl->last_pcap_drop = exp->pcap_drop_total;
+	intrnl->last_pipeline_drop = exp->pipeline_drop_total;
+	intrnl->last_output_drop = exp->output_drop_total;
 	intrnl->last_send_failures = exp->fail_total;
 	intrnl->last_recv_total = exp->total_recv;
 }
@@ -321,9 +429,40 @@ static void log_drop_warnings(export_status_t *exp)
 			 exp->pcap_drop_last, exp->pcap_drop_total,
 			 exp->pcap_drop, exp->pcap_ifdrop);
 	}
+	if (exp->pipeline_drop_last > 0) {
+		log_warn("monitor",
+			 "Processing threads fell behind and %.0f packets were "
+			 "dropped in the last second (%" PRIu64
+			 " total, %" PRIu64 " queued for processing, %" PRIu64
+			 " for output)",
+			 exp->pipeline_drop_last, exp->pipeline_drop_total,
+			 exp->capture_queue_depth, exp->output_queue_depth);
+	}
+	if (exp->output_drop_last > 0) {
+		log_warn("monitor",
+			 "Output module fell behind and %.0f results were "
+			 "dropped in the last second (%" PRIu64
+			 " total, %" PRIu64 " queued)",
+			 exp->output_drop_last, exp->output_drop_total,
+			 exp->output_ring_depth);
+	}
+	if (exp->starved_last > 0.05 && !exp->complete) {
+		log_warn("monitor",
+			 "Send threads waited for targets %.0f%% of the last "
+			 "second, more --target-threads may help",
+			 exp->starved_last * 100);
+	}
+	if (exp->backoff_last > 0.05 && !exp->complete) {
+		log_warn("monitor",
+			 "Send threads waited for a full send queue %.0f%% of "
+			 "the last second (%" PRIu64 " waits), the interface "
+			 "can't keep up with the send rate",
+			 exp->backoff_last * 100, exp->backoff_total);
+	}
 	if (exp->fail_last / exp->send_rate > 0.01) {
 		log_warn("monitor",
-			 "Failed to send %.0f packets/sec (%u total failures)",
+			 "Failed to send %.0f packets/sec (%" PRIu64
+			 " total failures)",
 			 exp->fail_last, exp->fail_total);
 	}
 }
@@ -338,7 +477,7 @@ static void onscreen_appsuccess(export_status_t *exp)
 			"app success: %" PRIu64 " %sp/s (%sp/s avg); "
 			"drops: %sp/s (%sp/s avg); "
 			"hitrate: %0.2f%% "
-			"app hitrate: %0.2f%%\n",
+			"app hitrate: %0.2f%%%s\n",
 			exp->time_past_str, exp->percent_complete,
 			exp->time_remaining_str, exp->total_sent,
 			exp->send_rate_str, exp->send_rate_avg_str,
@@ -346,7 +485,7 @@ static void onscreen_appsuccess(export_status_t *exp)
 			exp->recv_avg_str, exp->app_recv_success_unique,
 			exp->app_success_rate_str, exp->app_success_avg_str,
 			exp->pcap_drop_last_str, exp->pcap_drop_avg_str,
-			exp->hitrate, exp->app_hitrate);
+			exp->hitrate, exp->app_hitrate, exp->outstanding_str);
 	} else {
 		fprintf(stderr,
 			"%5s %0.0f%%%s; sent: %" PRIu64 " done (%sp/s avg); "
@@ -354,14 +493,15 @@ static void onscreen_appsuccess(export_status_t *exp)
 			"app success: %" PRIu64 " %sp/s (%sp/s avg); "
 			"drops: %sp/s (%sp/s avg); "
 			"hitrate: %0.2f%% "
-			"app hitrate: %0.2f%%\n",
+			"app hitrate: %0.2f%%%s\n",
 			exp->time_past_str, exp->percent_complete,
 			exp->time_remaining_str, exp->total_sent,
 			exp->send_rate_avg_str, exp->recv_success_unique,
 			exp->recv_rate_str, exp->recv_avg_str,
 			exp->app_recv_success_unique, exp->app_success_rate_str,
 			exp->app_success_avg_str, exp->pcap_drop_last_str,
-			exp->pcap_drop_avg_str, exp->hitrate, exp->app_hitrate);
+			exp->pcap_drop_avg_str, exp->hitrate, exp->app_hitrate,
+			exp->outstanding_str);
 	}
 }
 
@@ -372,25 +512,26 @@ static void onscreen_generic(export_status_t *exp)
 			"%5s %0.0f%%%s; send: %" PRIu64 " %sp/s (%sp/s avg); "
 			"recv: %" PRIu64 " %sp/s (%sp/s avg); "
 			"drops: %sp/s (%sp/s avg); "
-			"hitrate: %0.2f%%\n",
+			"hitrate: %0.2f%%%s\n",
 			exp->time_past_str, exp->percent_complete,
 			exp->time_remaining_str, exp->total_sent,
 			exp->send_rate_str, exp->send_rate_avg_str,
 			exp->recv_success_unique, exp->recv_rate_str,
 			exp->recv_avg_str, exp->pcap_drop_last_str,
-			exp->pcap_drop_avg_str, exp->hitrate);
+			exp->pcap_drop_avg_str, exp->hitrate,
+			exp->outstanding_str);
 	} else {
 		fprintf(stderr,
 			"%5s %0.0f%%%s; send: %" PRIu64 " done (%sp/s avg); "
 			"recv: %" PRIu64 " %sp/s (%sp/s avg); "
 			"drops: %sp/s (%sp/s avg); "
-			"hitrate: %0.2f%%\n",
+			"hitrate: %0.2f%%%s\n",
 			exp->time_past_str, exp->percent_complete,
 			exp->time_remaining_str, exp->total_sent,
 			exp->send_rate_avg_str, exp->recv_success_unique,
 			exp->recv_rate_str, exp->recv_avg_str,
 			exp->pcap_drop_last_str, exp->pcap_drop_avg_str,
-			exp->hitrate);
+			exp->hitrate, exp->outstanding_str);
 	}
 	fflush(stderr);
 }
@@ -412,7 +553,10 @@ static FILE *init_status_update_file(char *path)
 	    "recv-success-total,recv-success-last-one-sec,recv-success-avg-per-sec,"
 	    "recv-total,recv-total-last-one-sec,recv-total-avg-per-sec,"
 	    "pcap-drop-total,drop-last-one-sec,drop-avg-per-sec,"
-	    "sendto-fail-total,sendto-fail-last-one-sec,sendto-fail-avg-per-sec\n");
+	    "sendto-fail-total,sendto-fail-last-one-sec,sendto-fail-avg-per-sec,"
+	    "capture-queue-depth,output-queue-depth,pipeline-drop-total,"
+	    "output-ring-depth,output-spill-depth,output-drop-total,"
+	    "output-spill-total\n");
 	fflush(f);
 	return f;
 }
@@ -433,14 +577,20 @@ static void update_status_updates_file(export_status_t *exp, FILE *f)
 		"%" PRIu64 ",%.0f,%.0f,"
 		"%" PRIu64 ",%.0f,%.0f,"
 		"%" PRIu64 ",%.0f,%.0f,"
-		"%" PRIu64 ",,%.0f,%.0f\n",
+		"%" PRIu64 ",,%.0f,%.0f,"
+		"%" PRIu64 ",%" PRIu64 ",%" PRIu64 ","
+		"%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
 		timestamp, exp->time_past, exp->time_remaining,
 		exp->percent_complete, exp->hitrate, exp->send_threads,
 		exp->total_sent, exp->send_rate, exp->send_rate_avg,
 		exp->recv_success_unique, exp->recv_rate, exp->recv_avg,
 		exp->total_recv, exp->recv_total_rate, exp->recv_total_avg,
 		exp->pcap_drop_total, exp->pcap_drop_last, exp->pcap_drop_avg,
-		exp->fail_total, exp->fail_last, exp->fail_avg);
+		exp->fail_total, exp->fail_last, exp->fail_avg,
+		exp->capture_queue_depth, exp->output_queue_depth,
+		exp->pipeline_drop_total, exp->output_ring_depth,
+		exp->output_spill_depth, exp->output_drop_total,
+		exp->output_spill_total);
 	fflush(f);
 }
 
@@ -463,12 +613,409 @@ static inline void check_max_sendto_failures(export_status_t *exp)
 	}
 }
 
+static void render_metrics(metrics_page_t *p, export_status_t *exp,
+			   iterator_t *it)
+{
+	metrics_page_reset(p);
+	char labels[64];
+
+	metrics_family(p, "zmap_packets_sent_total", "counter",
+		       "Probe packets handed to the send method");
+	metrics_sample_u64(p, "zmap_packets_sent_total", "", exp->total_sent);
+	metrics_family(p, "zmap_send_failures_total", "counter",
+		       "Probe packets the send method failed to send");
+	metrics_sample_u64(p, "zmap_send_failures_total", "", exp->fail_total);
+	metrics_family(p, "zmap_send_rate", "gauge",
+		       "Packets sent per second over the last update");
+	metrics_sample(p, "zmap_send_rate", "", exp->send_rate);
+	metrics_family(p, "zmap_send_threads_active", "gauge",
+		       "Send threads that have not finished");
+	metrics_sample_u64(p, "zmap_send_threads_active", "",
+			   exp->send_threads);
+	metrics_family(p, "zmap_sender_packets_sent_total", "counter",
+		       "Probe packets sent by each send thread");
+	for (uint16_t i = 0; i < zconf.senders; i++) {
+		const shard_stats_t *st =
+		    __atomic_load_n(&get_shard(it, i)->stats, __ATOMIC_ACQUIRE);
+		snprintf(labels, sizeof(labels), "thread=\"%u\"", i);
+		metrics_sample_u64(p, "zmap_sender_packets_sent_total", labels,
+				   shard_stat_read(&st->packets_sent));
+	}
+	metrics_family(p, "zmap_sender_send_failures_total", "counter",
+		       "Probe packets each send thread failed to send");
+	for (uint16_t i = 0; i < zconf.senders; i++) {
+		const shard_stats_t *st =
+		    __atomic_load_n(&get_shard(it, i)->stats, __ATOMIC_ACQUIRE);
+		snprintf(labels, sizeof(labels), "thread=\"%u\"", i);
+		metrics_sample_u64(p, "zmap_sender_send_failures_total", labels,
+				   shard_stat_read(&st->packets_failed));
+	}
+	metrics_family(p, "zmap_send_backoffs_total", "counter",
+		       "Times the send threads waited for a full send queue");
+	metrics_sample_u64(p, "zmap_send_backoffs_total", "",
+			   exp->backoff_total);
+	metrics_family(p, "zmap_send_backoff_seconds_total", "counter",
+		       "Time the send threads waited for a full send queue");
+	metrics_sample(p, "zmap_send_backoff_seconds_total", "",
+		       exp->backoff_ns_total / 1e9);
+
+	if (zconf.target_threads) {
+		metrics_family(p, "zmap_sender_target_ring_depth", "gauge",
+			       "Batches of targets waiting for each send "
+			       "thread");
+		for (uint16_t i = 0; i < zconf.senders; i++) {
+			snprintf(labels, sizeof(labels), "thread=\"%u\"", i);
+			metrics_sample_u64(p, "zmap_sender_target_ring_depth",
+					   labels, send_target_ring_depth(i));
+		}
+		metrics_family(p, "zmap_sender_starved_seconds_total",
+			       "counter",
+			       "Time each send thread waited for targets");
+		for (uint16_t i = 0; i < zconf.senders; i++) {
+			const shard_stats_t *st = __atomic_load_n(
+			    &get_shard(it, i)->stats, __ATOMIC_ACQUIRE);
+			snprintf(labels, sizeof(labels), "thread=\"%u\"", i);
+			metrics_sample(p, "zmap_sender_starved_seconds_total",
+				       labels,
+				       shard_stat_read(&st->starved_ns) / 1e9);
+		}
+	}
+
+	metrics_family(p, "zmap_pcap_received_total", "counter",
+		       "Frames the capture saw");
+	metrics_sample_u64(p, "zmap_pcap_received_total", "", exp->total_recv);
+	metrics_family(p, "zmap_pcap_dropped_total", "counter",
+		       "Frames dropped by the kernel (reason=\"kernel\") or "
+		       "the interface (reason=\"interface\")");
+	metrics_sample_u64(p, "zmap_pcap_dropped_total", "reason=\"kernel\"",
+			   exp->pcap_drop);
+	metrics_sample_u64(p, "zmap_pcap_dropped_total",
+			   "reason=\"interface\"", exp->pcap_ifdrop);
+	if (zconf.xdp_filter) {
+		metrics_family(p, "zmap_xdp_filter_packets_total", "counter",
+			       "Frames the XDP pre-filter left to the host "
+			       "(verdict=\"other\"), handed to zmap "
+			       "(verdict=\"scan\") or dropped as repeated "
+			       "SYN-ACKs (verdict=\"duplicate\")");
+		metrics_sample_u64(p, "zmap_xdp_filter_packets_total",
+				   "verdict=\"other\"", zrecv.xdp_other);
+		metrics_sample_u64(p, "zmap_xdp_filter_packets_total",
+				   "verdict=\"scan\"", zrecv.xdp_scan);
+		metrics_sample_u64(p, "zmap_xdp_filter_packets_total",
+				   "verdict=\"duplicate\"",
+				   zrecv.xdp_duplicates);
+	}
+	metrics_family(p, "zmap_responses_unique_total", "counter",
+		       "Unique successful responses");
+	metrics_sample_u64(p, "zmap_responses_unique_total", "",
+			   exp->recv_success_unique);
+	metrics_family(p, "zmap_recv_rate", "gauge",
+		       "Unique successful responses per second over the last "
+		       "update");
+	metrics_sample(p, "zmap_recv_rate", "", exp->recv_rate);
+	metrics_family(p, "zmap_hitrate_percent", "gauge",
+		       "Unique successful responses per target probed");
+	metrics_sample(p, "zmap_hitrate_percent", "", exp->hitrate);
+	if (zconf.fsconf.app_success_index >= 0) {
+		metrics_family(p, "zmap_app_responses_unique_total", "counter",
+			       "Unique application-level successes");
+		metrics_sample_u64(p, "zmap_app_responses_unique_total", "",
+				   exp->app_recv_success_unique);
+		metrics_family(p, "zmap_app_hitrate_percent", "gauge",
+			       "Unique application-level successes per target "
+			       "probed");
+		metrics_sample(p, "zmap_app_hitrate_percent", "",
+			       exp->app_hitrate);
+	}
+	struct recv_stats threads[MAX_RECV_THREADS + 1];
+	uint32_t n = recv_stats_threads(threads, MAX_RECV_THREADS + 1);
+	metrics_family(p, "zmap_receiver_validation_passed_total", "counter",
+		       "Responses that passed validation, by the thread that "
+		       "emitted them");
+	for (uint32_t i = 0; i < n; i++) {
+		snprintf(labels, sizeof(labels), "thread=\"%u\"", i);
+		metrics_sample_u64(p, "zmap_receiver_validation_passed_total",
+				   labels, threads[i].validation_passed);
+	}
+	metrics_family(p, "zmap_receiver_validation_failed_total", "counter",
+		       "Frames that failed validation, by the thread that "
+		       "classified them");
+	for (uint32_t i = 0; i < n; i++) {
+		snprintf(labels, sizeof(labels), "thread=\"%u\"", i);
+		metrics_sample_u64(p, "zmap_receiver_validation_failed_total",
+				   labels, threads[i].validation_failed);
+	}
+
+	struct recv_stats rs;
+	recv_stats_snapshot(&rs);
+	metrics_family(p, "zmap_rtt_seconds", "histogram",
+		       "Round-trip times of unique successes, where the probe "
+		       "module recovers them");
+	uint64_t cumulative = 0;
+	for (int i = 0; i < RTT_BUCKETS - 1; i++) {
+		cumulative += rs.rtt_buckets[i];
+		snprintf(labels, sizeof(labels), "le=\"%g\"",
+			 (double)(2ull << i) / 1e6);
+		metrics_sample_u64(p, "zmap_rtt_seconds_bucket", labels,
+				   cumulative);
+	}
+	metrics_sample_u64(p, "zmap_rtt_seconds_bucket", "le=\"+Inf\"",
+			   rs.rtt_samples);
+	metrics_sample(p, "zmap_rtt_seconds_sum", "", rs.rtt_sum_us / 1e6);
+	metrics_sample_u64(p, "zmap_rtt_seconds_count", "", rs.rtt_samples);
+
+	metrics_family(p, "zmap_queue_depth", "gauge",
+		       "Entries waiting in the receive pipeline and output "
+		       "queues");
+	metrics_sample_u64(p, "zmap_queue_depth", "queue=\"capture\"",
+			   exp->capture_queue_depth);
+	metrics_sample_u64(p, "zmap_queue_depth", "queue=\"sequencer\"",
+			   exp->output_queue_depth);
+	metrics_sample_u64(p, "zmap_queue_depth", "queue=\"output_ring\"",
+			   exp->output_ring_depth);
+	metrics_sample_u64(p, "zmap_queue_depth", "queue=\"output_spill\"",
+			   exp->output_spill_depth);
+	metrics_family(p, "zmap_queue_dropped_total", "counter",
+		       "Entries dropped because a queue was full");
+	metrics_sample_u64(p, "zmap_queue_dropped_total", "queue=\"pipeline\"",
+			   exp->pipeline_drop_total);
+	metrics_sample_u64(p, "zmap_queue_dropped_total", "queue=\"output\"",
+			   exp->output_drop_total);
+	metrics_family(p, "zmap_output_spilled_total", "counter",
+		       "Results spilled to disk behind the output queue");
+	metrics_sample_u64(p, "zmap_output_spilled_total", "",
+			   exp->output_spill_total);
+
+	metrics_family(p, "zmap_memory_bytes", "gauge",
+		       "Memory held by each subsystem now (kind=\"current\") "
+		       "and at its most (kind=\"peak\")");
+	for (int i = 0; i < MEM_TAGS; i++) {
+		uint64_t current, peak;
+		xalloc_usage(i, &current, &peak);
+		snprintf(labels, sizeof(labels),
+			 "subsystem=\"%s\",kind=\"current\"", MEM_TAG_NAMES[i]);
+		metrics_sample_u64(p, "zmap_memory_bytes", labels, current);
+		snprintf(labels, sizeof(labels),
+			 "subsystem=\"%s\",kind=\"peak\"", MEM_TAG_NAMES[i]);
+		metrics_sample_u64(p, "zmap_memory_bytes", labels, peak);
+	}
+
+	metrics_family(p, "zmap_elapsed_seconds", "gauge",
+		       "Time since the scan started");
+	metrics_sample_u64(p, "zmap_elapsed_seconds", "", exp->time_past);
+	metrics_family(p, "zmap_remaining_seconds", "gauge",
+		       "Estimated time until the scan finishes");
+	metrics_sample_u64(p, "zmap_remaining_seconds", "",
+			   exp->time_remaining);
+	metrics_family(p, "zmap_complete_percent", "gauge",
+		       "Estimated progress of the scan");
+	metrics_sample(p, "zmap_complete_percent", "", exp->percent_complete);
+	metrics_family(p, "zmap_send_complete", "gauge",
+		       "1 once every send thread has finished");
+	metrics_sample_u64(p, "zmap_send_complete", "", exp->complete);
+
+	if (zconf.stage_timing) {
+		stage_counters_t totals[NUM_STAGES];
+		stage_timing_totals(totals);
+		char help[128];
+		snprintf(help, sizeof(help),
+			 "%s spent in the sampled events of each send and "
+			 "receive stage",
+			 STAGE_TICK_UNIT);
+		metrics_family(p, "zmap_stage_ticks", "summary", help);
+		for (int i = 0; i < NUM_STAGES; i++) {
+			snprintf(labels, sizeof(labels), "stage=\"%s\"",
+				 STAGE_NAMES[i]);
+			metrics_sample_u64(p, "zmap_stage_ticks_sum", labels,
+					   totals[i].ticks);
+			metrics_sample_u64(p, "zmap_stage_ticks_count", labels,
+					   totals[i].sampled);
+		}
+		metrics_family(p, "zmap_stage_events_total", "counter",
+			       "Events of each send and receive stage, sampled "
+			       "or not");
+		for (int i = 0; i < NUM_STAGES; i++) {
+			snprintf(labels, sizeof(labels), "stage=\"%s\"",
+				 STAGE_NAMES[i]);
+			metrics_sample_u64(p, "zmap_stage_events_total", labels,
+					   totals[i].events);
+		}
+	}
+}
+
+static void publish_status(statshm_status_t *st, export_status_t *exp)
+{
+	st->time = now();
+	st->updates = ++stats_shm_updates;
+	st->time_elapsed = exp->time_past;
+	st->time_remaining = exp->time_remaining;
+	st->percent_complete = exp->percent_complete;
+	st->send_complete = exp->complete;
+	st->send_threads = exp->send_threads;
+	st->sent_total = exp->total_sent;
+	st->tried_total = exp->total_tried_sent;
+	st->sent_rate = exp->send_rate;
+	st->sent_avg = exp->send_rate_avg;
+	st->fail_total = exp->fail_total;
+	st->fail_rate = exp->fail_last;
+	st->fail_avg = exp->fail_avg;
+	st->hitrate = exp->hitrate;
+	st->app_hitrate = exp->app_hitrate;
+	st->success_unique = exp->recv_success_unique;
+	st->success_rate = exp->recv_rate;
+	st->success_avg = exp->recv_avg;
+	st->app_success_unique = exp->app_recv_success_unique;
+	st->app_success_rate = exp->app_success_rate;
+	st->app_success_avg = exp->app_success_avg;
+	st->recv_total = exp->total_recv;
+	st->recv_rate = exp->recv_total_rate;
+	st->recv_avg = exp->recv_total_avg;
+	st->pcap_drop = exp->pcap_drop;
+	st->pcap_ifdrop = exp->pcap_ifdrop;
+	st->pcap_drop_rate = exp->pcap_drop_last;
+	st->pcap_drop_avg = exp->pcap_drop_avg;
+	st->capture_queue_depth = exp->capture_queue_depth;
+	st->output_queue_depth = exp->output_queue_depth;
+	st->pipeline_drop_total = exp->pipeline_drop_total;
+	st->pipeline_drop_rate = exp->pipeline_drop_last;
+	st->output_ring_depth = exp->output_ring_depth;
+	st->output_spill_depth = exp->output_spill_depth;
+	st->output_drop_total = exp->output_drop_total;
+	st->output_drop_rate = exp->output_drop_last;
+	st->output_spill_total = exp->output_spill_total;
+	st->outstanding = exp->outstanding;
+	st->seconds_under_min_hitrate = exp->seconds_under_min_hitrate;
+}
+
+// The counters of every send and receive thread, which the threads keep
+// anyway; --stats-shm-interval apart, and with every status update
+static void publish_threads(statshm_t *s, iterator_t *it)
+{
+	for (uint16_t i = 0; i < zconf.senders; i++) {
+		const shard_stats_t *st =
+		    __atomic_load_n(&get_shard(it, i)->stats, __ATOMIC_ACQUIRE);
+		statshm_sender_t *out = statshm_sender(s, i);
+		out->packets_sent = shard_stat_read(&st->packets_sent);
+		out->targets_scanned = shard_stat_read(&st->targets_scanned);
+		out->packets_failed = shard_stat_read(&st->packets_failed);
+		out->iterations = shard_stat_read(&st->iterations);
+		out->retransmits_skipped =
+		    shard_stat_read(&st->retransmits_skipped);
+		out->target_ring_depth = send_target_ring_depth(i);
+		out->starved_ns = shard_stat_read(&st->starved_ns);
+	}
+	s->hdr->num_senders = zconf.senders;
+	struct recv_stats threads[MAX_RECV_THREADS + 1];
+	uint32_t n = recv_stats_threads(threads, s->hdr->max_receivers);
+	for (uint32_t i = 0; i < n; i++) {
+		statshm_receiver_t *out = statshm_receiver(s, i);
+		out->success_total = threads[i].success_total;
+		out->success_unique = threads[i].success_unique;
+		out->app_success_total = threads[i].app_success_total;
+		out->app_success_unique = threads[i].app_success_unique;
+		out->failure_total = threads[i].failure_total;
+		out->validation_passed = threads[i].validation_passed;
+		out->validation_failed = threads[i].validation_failed;
+		out->rtt_samples = threads[i].rtt_samples;
+		out->rtt_sum_us = threads[i].rtt_sum_us;
+	}
+	s->hdr->num_receivers = n;
+}
+
+static void update_stats_shm(export_status_t *exp, iterator_t *it)
+{
+	statshm_begin(stats_shm);
+	if (exp) {
+		publish_status(statshm_status(stats_shm), exp);
+	}
+	publish_threads(stats_shm, it);
+	statshm_commit(stats_shm, now());
+}
+
+// Waits out an update interval, answering scrapes and refreshing the
+// thread counters in the stats segment meanwhile
+static void monitor_wait(iterator_t *it)
+{
+	if (!stats_shm) {
+		if (metrics_enabled()) {
+			metrics_serve(&metrics_page, UPDATE_INTERVAL);
+		} else {
+			sleep(UPDATE_INTERVAL);
+		}
+		return;
+	}
+	double slice = zconf.stats_shm_interval_ms / 1000.0;
+	double end = now() + UPDATE_INTERVAL;
+	for (double left = UPDATE_INTERVAL; left > 0; left = end - now()) {
+		double secs = left < slice ? left : slice;
+		if (metrics_enabled()) {
+			metrics_serve(&metrics_page, secs);
+		} else {
+			struct timespec ts = {
+			    .tv_sec = (time_t)secs,
+			    .tv_nsec = (long)((secs - (time_t)secs) * 1e9)};
+			nanosleep(&ts, NULL);
+		}
+		if (end - now() > 0) {
+			update_stats_shm(NULL, it);
+		}
+	}
+}
+
+static void log_rtt(void)
+{
+	struct recv_stats rs;
+	recv_stats_snapshot(&rs);
+	if (!rs.rtt_samples) {
+		return;
+	}
+	log_info("monitor",
+		 "round-trip times of %" PRIu64 " responses: mean %.1f ms, "
+		 "50%% under %.1f ms, 90%% under %.1f ms, 99%% under %.1f ms",
+		 rs.rtt_samples, rs.rtt_sum_us / 1e3 / rs.rtt_samples,
+		 recv_rtt_quantile(&rs, 0.5) / 1e3,
+		 recv_rtt_quantile(&rs, 0.9) / 1e3,
+		 recv_rtt_quantile(&rs, 0.99) / 1e3);
+}
+
+static void log_memory(void)
+{
+	char buf[512];
+	size_t len = 0;
+	for (int i = 0; i < MEM_TAGS && len < sizeof(buf); i++) {
+		uint64_t peak;
+		xalloc_usage(i, NULL, &peak);
+		if (peak) {
+			len += snprintf(buf + len, sizeof(buf) - len,
+					"%s%s %.1f MiB", len ? ", " : "",
+					MEM_TAG_NAMES[i], peak / (double)(1 << 20));
+		}
+	}
+	if (len) {
+		log_info("monitor", "peak memory by subsystem: %s", buf);
+	}
+}
+
 void monitor_init(void)
 {
 	if (zconf.status_updates_file) {
 		status_fd = init_status_update_file(zconf.status_updates_file);
 		assert(status_fd);
 	}
+	metrics_init();
+	rate_control_init();
+	drop_events_init();
+	if (zconf.stats_shm) {
+		// every thread that keeps receive counters
+		stats_shm = statshm_create(zconf.stats_shm, zconf.senders,
+					   MAX_RECV_THREADS + 1);
+		if (!stats_shm) {
+			log_fatal("monitor", "could not create stats segment %s: %s",
+				  zconf.stats_shm, strerror(errno));
+		}
+		log_info("monitor", "live statistics in shared memory %s",
+			 zconf.stats_shm);
+	}
 }
 
 void export_then_update(int_status_t *internal_status, iterator_t *it, export_status_t *export_status, pthread_mutex_t *lock)
@@ -478,6 +1025,36 @@ void export_then_update(int_status_t *internal_status, iterator_t *it, export_st
 	log_drop_warnings(export_status);
 	check_min_hitrate(export_status);
 	check_max_sendto_failures(export_status);
+	sample_update();
+	shaping_update();
+	if (zconf.adaptive_rate) {
+		rate_control_sample_t s = {
+		    .time = now(),
+		    .sent = export_status->total_sent,
+		    .send_failures = export_status->fail_total,
+		    .pcap_recv = export_status->total_recv,
+		    .pcap_drops = export_status->pcap_drop_total,
+		    .queue_drops = export_status->pipeline_drop_total +
+				   export_status->output_drop_total,
+		    .successes = export_status->recv_success_unique,
+		    .send_backoff_ns = export_status->backoff_ns_total,
+		    .senders = zconf.senders};
+		rate_control_update(&s);
+	}
+	drop_sample_t d = {
+	    .time = now(),
+	    .capture_drops = export_status->pcap_drop,
+	    .interface_drops = export_status->pcap_ifdrop,
+	    .pipeline_drops = export_status->pipeline_drop_total,
+	    .output_drops = export_status->output_drop_total,
+	    .captured = export_status->total_recv,
+	    .capture_queue = export_status->capture_queue_depth,
+	    .emit_queue = export_status->output_queue_depth,
+	    .pipeline_capacity = recv_pipeline_capacity(),
+	    .output_queue = export_status->output_ring_depth,
+	    .output_written = output_queue_written(),
+	    .output_capacity = output_queue_capacity()};
+	drop_events_update(&d);
 	if (!zconf.quiet) {
 		lock_file(stderr);
 		if (zconf.fsconf.app_success_index >= 0) {
@@ -490,20 +1067,60 @@ void export_then_update(int_status_t *internal_status, iterator_t *it, export_st
 	if (status_fd) {
 		update_status_updates_file(export_status, status_fd);
 	}
+	if (zconf.stage_timing) {
+		stage_timing_log();
+	}
+	if (metrics_enabled()) {
+		render_metrics(&metrics_page, export_status, it);
+	}
+	if (stats_shm) {
+		update_stats_shm(export_status, it);
+	}
 }
 
-void monitor_run(iterator_t *it, pthread_mutex_t *lock)
+static int_status_t *internal_status = NULL;
+static export_status_t *export_status = NULL;
+
+void monitor_update(iterator_t *it, pthread_mutex_t *lock)
+{
+	if (!internal_status) {
+		internal_status = xmalloc(sizeof(int_status_t));
+		export_status = xmalloc(sizeof(export_status_t));
+	}
+	export_then_update(internal_status, it, export_status, lock);
+}
+
+double monitor_interval(void)
+{
+	return UPDATE_INTERVAL;
+}
+
+int monitor_fd(void)
 {
-	int_status_t *internal_status = xmalloc(sizeof(int_status_t));
-	export_status_t *export_status = xmalloc(sizeof(export_status_t));
+	return metrics_fd();
+}
 
+void monitor_serve(void)
+{
+	metrics_answer(&metrics_page);
+}
+
+void monitor_run(iterator_t *it, pthread_mutex_t *lock)
+{
 	// wait for the scanning process to finish
 	while (!(zsend.complete && zrecv.complete)) {
-		export_then_update(internal_status, it, export_status, lock);
-		sleep(UPDATE_INTERVAL);
+		monitor_update(it, lock);
+		monitor_wait(it);
 	}
+	monitor_finish(it, lock);
+}
+
+void monitor_finish(iterator_t *it, pthread_mutex_t *lock)
+{
 	// final update
-	export_then_update(internal_status, it, export_status, lock);
+	monitor_update(it, lock);
+	log_rtt();
+	log_memory();
 
 	if (!zconf.quiet) {
 		lock_file(stderr);
@@ -514,4 +1131,10 @@ void monitor_run(iterator_t *it, pthread_mutex_t *lock)
 		fflush(status_fd);
 		fclose(status_fd);
 	}
+	metrics_close();
+	drop_events_close();
+	if (stats_shm) {
+		statshm_close(stats_shm);
+		stats_shm = NULL;
+	}
 }
@@ -15,4 +15,14 @@
 void monitor_run(iterator_t *it, pthread_mutex_t *lock);
 void monitor_init(void);
 
+// What monitor_run() does, for --event-loop to interleave with sending
+// and receiving: an update every monitor_interval() seconds, answering
+// scrapes whenever monitor_fd() (-1 without --metrics-port) is readable,
+// and the final update once the scan is done
+void monitor_update(iterator_t *it, pthread_mutex_t *lock);
+double monitor_interval(void);
+int monitor_fd(void);
+void monitor_serve(void);
+void monitor_finish(iterator_t *it, pthread_mutex_t *lock);
+
 #endif
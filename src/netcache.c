@@ -0,0 +1,267 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "netcache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/stat.h>
+
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+#include "state.h"
+
+#define NETCACHE_HAS_SOURCE 1
+#define NETCACHE_HAS_GATEWAY 2
+#define NETCACHE_HAS_HW_MAC 4
+
+typedef struct netcache_iface {
+	char name[IFNAMSIZ];
+	int has;
+	in_addr_t source_ip;
+	uint32_t gw_ip;
+	macaddr_t gw_mac[MAC_ADDR_LEN_BYTES];
+	macaddr_t hw_mac[MAC_ADDR_LEN_BYTES];
+} netcache_iface_t;
+
+static char default_iface[IFNAMSIZ];
+static netcache_iface_t ifaces[MAX_IFACES];
+static int num_ifaces = 0;
+// set since the file was read, so that it is written again
+static int changed = 0;
+
+static netcache_iface_t *find(const char *name, int add)
+{
+	for (int i = 0; i < num_ifaces; i++) {
+		if (!strcmp(ifaces[i].name, name)) {
+			return &ifaces[i];
+		}
+	}
+	if (!add || num_ifaces == MAX_IFACES || strlen(name) >= IFNAMSIZ) {
+		return NULL;
+	}
+	netcache_iface_t *c = &ifaces[num_ifaces++];
+	memset(c, 0, sizeof(*c));
+	strcpy(c->name, name);
+	return c;
+}
+
+static int parse_mac(const char *s, macaddr_t *mac)
+{
+	unsigned int b[MAC_ADDR_LEN_BYTES];
+	if (sscanf(s, "%x:%x:%x:%x:%x:%x", &b[0], &b[1], &b[2], &b[3], &b[4],
+		   &b[5]) != MAC_ADDR_LEN_BYTES) {
+		return -1;
+	}
+	for (int i = 0; i < MAC_ADDR_LEN_BYTES; i++) {
+		if (b[i] > 0xFF) {
+			return -1;
+		}
+		mac[i] = (macaddr_t)b[i];
+	}
+	return 0;
+}
+
+static void format_mac(char *buf, const macaddr_t *mac)
+{
+	sprintf(buf, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2],
+		mac[3], mac[4], mac[5]);
+}
+
+int netcache_load(const char *path, int max_age)
+{
+	struct stat st;
+	if (stat(path, &st)) {
+		log_debug("netcache", "no network cache at %s yet", path);
+		return -1;
+	}
+	time_t age = time(NULL) - st.st_mtime;
+	if (age > max_age) {
+		log_debug("netcache", "network cache %s is %lds old, looking up "
+				      "the network again",
+			  path, (long)age);
+		return -1;
+	}
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		log_warn("netcache", "unable to read %s: %s", path,
+			 strerror(errno));
+		return -1;
+	}
+	char line[256];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		char kind[16], name[IFNAMSIZ + 1], a[64], b[64];
+		int n = sscanf(line, "%15s %16s %63s %63s", kind, name, a, b);
+		if (n < 1 || kind[0] == '#') {
+			continue;
+		}
+		netcache_iface_t *c = n >= 2 ? find(name, 1) : NULL;
+		struct in_addr ip;
+		if (!strcmp(kind, "default") && n == 2 &&
+		    strlen(name) < IFNAMSIZ) {
+			strcpy(default_iface, name);
+		} else if (!strcmp(kind, "source") && c && n == 3 &&
+			   inet_pton(AF_INET, a, &ip) == 1) {
+			c->source_ip = ip.s_addr;
+			c->has |= NETCACHE_HAS_SOURCE;
+		} else if (!strcmp(kind, "gateway") && c && n == 4 &&
+			   inet_pton(AF_INET, a, &ip) == 1 &&
+			   !parse_mac(b, c->gw_mac)) {
+			c->gw_ip = ip.s_addr;
+			c->has |= NETCACHE_HAS_GATEWAY;
+		} else if (!strcmp(kind, "mac") && c && n == 3 &&
+			   !parse_mac(a, c->hw_mac)) {
+			c->has |= NETCACHE_HAS_HW_MAC;
+		} else {
+			log_warn("netcache", "ignoring line %d of %s", lineno,
+				 path);
+		}
+	}
+	fclose(fp);
+	log_debug("netcache", "using network cache %s (%lds old)", path,
+		  (long)age);
+	return 0;
+}
+
+int netcache_save(const char *path)
+{
+	if (!changed) {
+		return 0;
+	}
+	// written next to path and renamed over it, so that concurrent scans
+	// never read half of it
+	size_t tmp_len = strlen(path) + 32;
+	char *tmp = xmalloc(tmp_len);
+	snprintf(tmp, tmp_len, "%s.%ld.tmp", path, (long)getpid());
+	FILE *fp = fopen(tmp, "w");
+	if (!fp) {
+		log_warn("netcache", "unable to create %s: %s", tmp,
+			 strerror(errno));
+		xfree(tmp);
+		return -1;
+	}
+	char a[INET_ADDRSTRLEN], mac[18];
+	fprintf(fp, "# zmap network cache, see --network-cache\n");
+	if (default_iface[0]) {
+		fprintf(fp, "default %s\n", default_iface);
+	}
+	for (int i = 0; i < num_ifaces; i++) {
+		const netcache_iface_t *c = &ifaces[i];
+		if (c->has & NETCACHE_HAS_SOURCE) {
+			inet_ntop(AF_INET, &c->source_ip, a, sizeof(a));
+			fprintf(fp, "source %s %s\n", c->name, a);
+		}
+		if (c->has & NETCACHE_HAS_GATEWAY) {
+			inet_ntop(AF_INET, &c->gw_ip, a, sizeof(a));
+			format_mac(mac, c->gw_mac);
+			fprintf(fp, "gateway %s %s %s\n", c->name, a, mac);
+		}
+		if (c->has & NETCACHE_HAS_HW_MAC) {
+			format_mac(mac, c->hw_mac);
+			fprintf(fp, "mac %s %s\n", c->name, mac);
+		}
+	}
+	int ok = !ferror(fp);
+	if (fclose(fp)) {
+		ok = 0;
+	}
+	if (!ok || rename(tmp, path)) {
+		log_warn("netcache", "unable to write %s: %s", path,
+			 strerror(errno));
+		unlink(tmp);
+		xfree(tmp);
+		return -1;
+	}
+	xfree(tmp);
+	log_debug("netcache", "wrote network cache %s", path);
+	return 0;
+}
+
+const char *netcache_default_iface(void)
+{
+	return default_iface[0] ? default_iface : NULL;
+}
+
+void netcache_set_default_iface(const char *name)
+{
+	if (strlen(name) < IFNAMSIZ) {
+		strcpy(default_iface, name);
+		changed = 1;
+	}
+}
+
+int netcache_source_ip(const char *iface, in_addr_t *ip)
+{
+	const netcache_iface_t *c = find(iface, 0);
+	if (!c || !(c->has & NETCACHE_HAS_SOURCE)) {
+		return -1;
+	}
+	*ip = c->source_ip;
+	return 0;
+}
+
+int netcache_gateway(const char *iface, uint32_t *gw_ip, macaddr_t *gw_mac)
+{
+	const netcache_iface_t *c = find(iface, 0);
+	if (!c || !(c->has & NETCACHE_HAS_GATEWAY)) {
+		return -1;
+	}
+	*gw_ip = c->gw_ip;
+	memcpy(gw_mac, c->gw_mac, MAC_ADDR_LEN_BYTES);
+	return 0;
+}
+
+int netcache_hw_mac(const char *iface, macaddr_t *hw_mac)
+{
+	const netcache_iface_t *c = find(iface, 0);
+	if (!c || !(c->has & NETCACHE_HAS_HW_MAC)) {
+		return -1;
+	}
+	memcpy(hw_mac, c->hw_mac, MAC_ADDR_LEN_BYTES);
+	return 0;
+}
+
+void netcache_set_source_ip(const char *iface, in_addr_t ip)
+{
+	netcache_iface_t *c = find(iface, 1);
+	if (c) {
+		c->source_ip = ip;
+		c->has |= NETCACHE_HAS_SOURCE;
+		changed = 1;
+	}
+}
+
+void netcache_set_gateway(const char *iface, uint32_t gw_ip,
+			  const macaddr_t *gw_mac)
+{
+	netcache_iface_t *c = find(iface, 1);
+	if (c) {
+		c->gw_ip = gw_ip;
+		memcpy(c->gw_mac, gw_mac, MAC_ADDR_LEN_BYTES);
+		c->has |= NETCACHE_HAS_GATEWAY;
+		changed = 1;
+	}
+}
+
+void netcache_set_hw_mac(const char *iface, const macaddr_t *hw_mac)
+{
+	netcache_iface_t *c = find(iface, 1);
+	if (c) {
+		memcpy(c->hw_mac, hw_mac, MAC_ADDR_LEN_BYTES);
+		c->has |= NETCACHE_HAS_HW_MAC;
+		changed = 1;
+	}
+}
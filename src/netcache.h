@@ -0,0 +1,47 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_NETCACHE_H
+#define ZMAP_NETCACHE_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "../lib/types.h"
+
+/*
+ * --network-cache: what network_config_init() and send_init() look up
+ * about the interfaces, the default interface, each one's source address,
+ * gateway address and MAC address and its own MAC address, kept in a small
+ * text file for the runs after it. While the file is younger than
+ * --network-cache-ttl the lookups (a netlink route dump, an ARP table
+ * query that may wait on the kernel, a raw socket) are skipped; anything
+ * not in it is looked up as usual and the file is rewritten with it. Only
+ * what was looked up is stored, never what was given with -S, -G or
+ * --source-mac.
+ */
+
+// read path, unless it is older than max_age seconds; returns 0 if it was
+int netcache_load(const char *path, int max_age);
+// write what was loaded or set since, if anything was set
+int netcache_save(const char *path);
+
+// NULL if not cached
+const char *netcache_default_iface(void);
+void netcache_set_default_iface(const char *name);
+
+// 0 if cached
+int netcache_source_ip(const char *iface, in_addr_t *ip);
+int netcache_gateway(const char *iface, uint32_t *gw_ip, macaddr_t *gw_mac);
+int netcache_hw_mac(const char *iface, macaddr_t *hw_mac);
+void netcache_set_source_ip(const char *iface, in_addr_t ip);
+void netcache_set_gateway(const char *iface, uint32_t gw_ip,
+			  const macaddr_t *gw_mac);
+void netcache_set_hw_mac(const char *iface, const macaddr_t *hw_mac);
+
+#endif /* ZMAP_NETCACHE_H */
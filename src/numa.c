@@ -0,0 +1,179 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#define _GNU_SOURCE
+#include "numa.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+#ifdef __linux__
+
+int numa_iface_node(const char *iface)
+{
+	if (!iface) {
+		return -1;
+	}
+	char path[256];
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+		 iface);
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		// virtual interfaces have no device
+		return -1;
+	}
+	int node = -1;
+	if (fscanf(fp, "%d", &node) != 1) {
+		node = -1;
+	}
+	fclose(fp);
+	// -1 as well on machines of a single node
+	return node < 0 ? -1 : node;
+}
+
+uint32_t numa_node_cpus(int node, uint32_t **cpus)
+{
+	*cpus = NULL;
+	if (node < 0) {
+		return 0;
+	}
+	char path[128];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+		 node);
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return 0;
+	}
+	char line[4096];
+	if (!fgets(line, sizeof(line), fp)) {
+		fclose(fp);
+		return 0;
+	}
+	fclose(fp);
+
+	// e.g. 0-7,16-23
+	uint32_t len = 0, cap = 0;
+	char *save = NULL;
+	for (char *tok = strtok_r(line, ",\n", &save); tok;
+	     tok = strtok_r(NULL, ",\n", &save)) {
+		unsigned first, last;
+		int n = sscanf(tok, "%u-%u", &first, &last);
+		if (n < 1) {
+			continue;
+		}
+		if (n == 1) {
+			last = first;
+		}
+		for (unsigned c = first; c <= last; c++) {
+			if (len == cap) {
+				cap = cap ? 2 * cap : 64;
+				*cpus = xrealloc(*cpus, cap * sizeof(uint32_t));
+			}
+			(*cpus)[len++] = c;
+		}
+	}
+	return len;
+}
+
+int numa_bind_thread(int node)
+{
+	uint32_t *cpus;
+	uint32_t len = numa_node_cpus(node, &cpus);
+	if (!len) {
+		return EXIT_FAILURE;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (uint32_t i = 0; i < len; i++) {
+		if (cpus[i] < CPU_SETSIZE) {
+			CPU_SET(cpus[i], &set);
+		}
+	}
+	xfree(cpus);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) {
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+#else
+
+int numa_iface_node(const char *iface)
+{
+	(void)iface;
+	return -1;
+}
+
+uint32_t numa_node_cpus(int node, uint32_t **cpus)
+{
+	(void)node;
+	*cpus = NULL;
+	return 0;
+}
+
+int numa_bind_thread(int node)
+{
+	(void)node;
+	return EXIT_FAILURE;
+}
+
+#endif
+
+static int is_on(uint32_t core, const uint32_t *cpus, uint32_t len)
+{
+	for (uint32_t i = 0; i < len; i++) {
+		if (cpus[i] == core) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+uint32_t numa_count_local(const uint32_t *cores, uint32_t len, int node)
+{
+	uint32_t *cpus;
+	uint32_t num_cpus = numa_node_cpus(node, &cpus);
+	uint32_t local = 0;
+	for (uint32_t i = 0; i < len; i++) {
+		local += is_on(cores[i], cpus, num_cpus);
+	}
+	xfree(cpus);
+	return local;
+}
+
+uint32_t numa_prefer_node(uint32_t *cores, uint32_t len, int node)
+{
+	uint32_t *cpus;
+	uint32_t num_cpus = numa_node_cpus(node, &cpus);
+	if (!num_cpus) {
+		return 0;
+	}
+	uint32_t *sorted = xmalloc(len * sizeof(uint32_t));
+	uint32_t local = 0;
+	for (uint32_t i = 0; i < len; i++) {
+		if (is_on(cores[i], cpus, num_cpus)) {
+			sorted[local++] = cores[i];
+		}
+	}
+	uint32_t j = local;
+	for (uint32_t i = 0; i < len; i++) {
+		if (!is_on(cores[i], cpus, num_cpus)) {
+			sorted[j++] = cores[i];
+		}
+	}
+	memcpy(cores, sorted, len * sizeof(uint32_t));
+	xfree(sorted);
+	xfree(cpus);
+	return local;
+}
@@ -0,0 +1,41 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_NUMA_H
+#define ZMAP_NUMA_H
+
+#include <stdint.h>
+
+/*
+ * Placement of threads and memory near the NIC on NUMA machines, as read
+ * from sysfs. Nothing is known elsewhere than on Linux, where every lookup
+ * fails and nothing moves.
+ *
+ * Memory is placed by first touch: the send and receive threads allocate
+ * their own buffers once pinned, and the main thread is kept on the NIC's
+ * node while it sets up what the senders share (blocklist, shards).
+ */
+
+// the NUMA node iface is attached to, or -1 if not known
+int numa_iface_node(const char *iface);
+
+// the cores of node, from /sys/devices/system/node/node<n>/cpulist, in
+// *cpus (allocated); returns how many, 0 if not known
+uint32_t numa_node_cpus(int node, uint32_t **cpus);
+
+// move the cores of node to the front of cores, each part keeping its
+// order; returns how many there are
+uint32_t numa_prefer_node(uint32_t *cores, uint32_t len, int node);
+
+// how many of cores are on node
+uint32_t numa_count_local(const uint32_t *cores, uint32_t len, int node);
+
+// keep the calling thread on the cores of node
+int numa_bind_thread(int node);
+
+#endif /* ZMAP_NUMA_H */
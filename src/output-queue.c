@@ -0,0 +1,487 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Output stage for --output-queue-size. The output module runs on a thread
+ * of its own, so a stalled disk or pipe holds up that thread and not the
+ * receive path. Results are emitted one at a time, behind recv_lock or by
+ * the pipeline's sequencer, so the ring has a single producer and a single
+ * consumer and needs no locks: emit_packet() fills the slot at head and the
+ * output thread outputs the one at tail. A result's fields point into
+ * packet buffers and arenas that are reused as soon as it has been emitted,
+ * so it is flattened into the slot first, with every pointer stored as an
+ * offset into the record. Field names are static and stay pointers.
+ *
+ * When the ring is full, results either wait for room, are dropped and
+ * counted, or are appended to an unlinked temporary file. Once a result has
+ * been spilled, every later one is too until the output thread has caught
+ * up with the file, so results are still output in order.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/hugemem.h"
+#include "../lib/xalloc.h"
+
+#include "output-queue.h"
+#include "recv.h"
+#include "state.h"
+#include "output_modules/output_modules.h"
+
+// records up to this size are kept in the slot, bigger ones on the heap
+#define OUTPUT_SLOT_INLINE (2048 - 16)
+#define OUTPUT_WAIT_NS 50000
+
+// a flattened fieldset, followed by its fields and then their data
+struct rec_fieldset {
+	int32_t len;
+	int32_t type;
+	int32_t inner_type;
+	int32_t unused;
+};
+
+struct output_slot {
+	uint32_t len;
+	uint8_t *heap;
+	uint8_t data[OUTPUT_SLOT_INLINE];
+};
+
+static struct output_slot *slots = NULL;
+static hugemem_t slots_mem;
+static uint32_t ring_size;
+static uint64_t head __attribute__((aligned(64))) = 0;
+static uint64_t tail __attribute__((aligned(64))) = 0;
+static pthread_t output_thread;
+static int stopping = 0;
+
+// spill file, tracked under spill_mutex. spilling is only set by the
+// producer and cleared by the output thread once it has read everything,
+// which also rewinds the file. The record counts only ever grow.
+static pthread_mutex_t spill_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int spill_fd = -1;
+static int spilling = 0;
+static uint64_t spill_written = 0;
+static uint64_t spill_end = 0;
+static uint64_t spill_read = 0;
+static uint64_t spill_off = 0;
+
+// producer side, which only one thread uses at a time
+static fieldset_t *scratch = NULL;
+static uint8_t *spill_buf = NULL;
+static size_t spill_buf_cap = 0;
+
+// output thread side: the fieldsets a record is decoded into
+static fieldset_t **pool = NULL;
+static size_t pool_len = 0;
+static size_t pool_used = 0;
+static translation_t identity;
+static uint64_t last_update = 0;
+
+static void output_wait(void)
+{
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = OUTPUT_WAIT_NS};
+	nanosleep(&ts, NULL);
+}
+
+static inline size_t align8(size_t n)
+{
+	return (n + 7) & ~(size_t)7;
+}
+
+// appends fs at *off, writing it to buf unless buf is NULL, in which case
+// this only works out the size
+static void encode(const fieldset_t *fs, uint8_t *buf, size_t *off)
+{
+	size_t base = *off;
+	size_t fields = base + sizeof(struct rec_fieldset);
+	*off = fields + (size_t)fs->len * sizeof(field_t);
+	if (buf) {
+		struct rec_fieldset h = {.len = fs->len,
+					 .type = fs->type,
+					 .inner_type = fs->inner_type,
+					 .unused = 0};
+		memcpy(buf + base, &h, sizeof(h));
+	}
+	for (int i = 0; i < fs->len; i++) {
+		field_t f = fs->fields[i];
+		f.free_ = 0;
+		size_t data_len = 0;
+		switch (f.type) {
+		case FS_STRING:
+			data_len = f.len + 1;
+			break;
+		case FS_BINARY:
+		case FS_IPV6:
+			data_len = f.len;
+			break;
+		}
+		if (f.type == FS_FIELDSET || f.type == FS_REPEATED) {
+			const fieldset_t *child = f.value.ptr;
+			f.value.num = *off;
+			encode(child, buf, off);
+		} else if (data_len && f.value.ptr) {
+			if (buf) {
+				memcpy(buf + *off, f.value.ptr, data_len);
+			}
+			f.value.num = *off;
+			*off = align8(*off + data_len);
+		} else if (f.type != FS_UINT64 && f.type != FS_BOOL &&
+			   f.type != FS_IPV4) {
+			// offset 0 is the record's own header
+			f.value.num = 0;
+		}
+		if (buf) {
+			memcpy(buf + fields + (size_t)i * sizeof(field_t), &f,
+			       sizeof(field_t));
+		}
+	}
+}
+
+static fieldset_t *decode(uint8_t *buf, size_t off)
+{
+	if (pool_used == pool_len) {
+		pool_len = pool_len ? pool_len * 2 : 4;
+		pool = xrealloc(pool, pool_len * sizeof(fieldset_t *));
+		for (size_t i = pool_used; i < pool_len; i++) {
+			pool[i] = fs_new_heap_fieldset(MAX_FIELDS);
+		}
+	}
+	fieldset_t *fs = pool[pool_used++];
+	struct rec_fieldset h;
+	memcpy(&h, buf + off, sizeof(h));
+	fs->len = h.len;
+	fs->type = h.type;
+	fs->inner_type = h.inner_type;
+	fs->fds = NULL;
+	fs->free_ = 0;
+	fs->arena = NULL;
+	memcpy(fs->fields, buf + off + sizeof(h), (size_t)h.len * sizeof(field_t));
+	for (int i = 0; i < fs->len; i++) {
+		field_t *f = &fs->fields[i];
+		switch (f->type) {
+		case FS_FIELDSET:
+		case FS_REPEATED:
+			f->value.ptr = decode(buf, f->value.num);
+			break;
+		case FS_UINT64:
+		case FS_BOOL:
+		case FS_IPV4:
+			break;
+		default:
+			f->value.ptr = f->value.num ? buf + f->value.num : NULL;
+		}
+	}
+	return fs;
+}
+
+static void write_all(int fd, const void *data, size_t len, uint64_t off)
+{
+	const uint8_t *p = data;
+	while (len) {
+		ssize_t n = pwrite(fd, p, len, off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			log_fatal("output-queue", "unable to write spill file: %s",
+				  strerror(errno));
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+}
+
+static void read_all(int fd, void *data, size_t len, uint64_t off)
+{
+	uint8_t *p = data;
+	while (len) {
+		ssize_t n = pread(fd, p, len, off);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			log_fatal("output-queue", "unable to read spill file: %s",
+				  strerror(errno));
+		}
+		p += n;
+		len -= n;
+		off += n;
+	}
+}
+
+static void open_spill_file(void)
+{
+	const char *dir = getenv("TMPDIR");
+	if (!dir || !*dir) {
+		dir = "/tmp";
+	}
+	size_t len = strlen(dir) + sizeof("/zmap-output-XXXXXX");
+	char *path = xmalloc(len);
+	snprintf(path, len, "%s/zmap-output-XXXXXX", dir);
+	spill_fd = mkstemp(path);
+	if (spill_fd < 0) {
+		log_fatal("output-queue", "unable to create spill file in %s: %s",
+			  dir, strerror(errno));
+	}
+	unlink(path);
+	log_debug("output-queue", "spilling results to %s", path);
+	xfree(path);
+}
+
+// called with spill_mutex held
+static void spill(const fieldset_t *fs, uint32_t len)
+{
+	if (spill_fd < 0) {
+		open_spill_file();
+	}
+	if (len > spill_buf_cap) {
+		spill_buf_cap = len;
+		spill_buf = xrealloc(spill_buf, spill_buf_cap);
+	}
+	size_t off = 0;
+	encode(fs, spill_buf, &off);
+	write_all(spill_fd, &len, sizeof(len), spill_end);
+	write_all(spill_fd, spill_buf, len, spill_end + sizeof(len));
+	spill_end += sizeof(len) + len;
+	__atomic_store_n(&spill_written, spill_written + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&zrecv.output_spilled, 1, __ATOMIC_RELAXED);
+}
+
+void output_queue_push(fieldset_t *fs, translation_t *t)
+{
+	if (!scratch) {
+		scratch = fs_new_heap_fieldset(MAX_FIELDS);
+	}
+	fs_translate_into(scratch, fs, t);
+	size_t size = 0;
+	encode(scratch, NULL, &size);
+	assert(size <= UINT32_MAX);
+	uint32_t len = (uint32_t)size;
+
+	if (__atomic_load_n(&spilling, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&spill_mutex);
+		if (spilling) {
+			spill(scratch, len);
+			pthread_mutex_unlock(&spill_mutex);
+			return;
+		}
+		pthread_mutex_unlock(&spill_mutex);
+	}
+	while (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= ring_size) {
+		if (zconf.output_backpressure == OUTPUT_BACKPRESSURE_DROP) {
+			__atomic_add_fetch(&zrecv.output_drops, 1,
+					   __ATOMIC_RELAXED);
+			return;
+		}
+		if (zconf.output_backpressure == OUTPUT_BACKPRESSURE_SPILL) {
+			pthread_mutex_lock(&spill_mutex);
+			__atomic_store_n(&spilling, 1, __ATOMIC_RELEASE);
+			spill(scratch, len);
+			pthread_mutex_unlock(&spill_mutex);
+			return;
+		}
+		output_wait();
+	}
+	struct output_slot *s = &slots[head % ring_size];
+	s->len = len;
+	s->heap = len > OUTPUT_SLOT_INLINE ? xmalloc(len) : NULL;
+	size_t off = 0;
+	encode(scratch, s->heap ? s->heap : s->data, &off);
+	__atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void identity_init(void)
+{
+	identity.len = zconf.fsconf.translation.len;
+	for (int i = 0; i < identity.len; i++) {
+		identity.translation[i] = i;
+	}
+}
+
+static void output_record(uint8_t *buf)
+{
+	pool_used = 0;
+	fieldset_t *fs = decode(buf, 0);
+	if (zconf.output_module->process_view) {
+		fs_view_t view = {.fs = fs, .t = &identity};
+		zconf.output_module->process_view(&view);
+	} else if (zconf.output_module->process_ip) {
+		zconf.output_module->process_ip(fs);
+	}
+}
+
+static void maybe_update(void)
+{
+	output_module_t *out = zconf.output_module;
+	if (!out->update || !out->update_interval) {
+		return;
+	}
+	uint64_t unique = recv_success_unique();
+	if (unique / out->update_interval !=
+	    last_update / out->update_interval) {
+		struct state_recv r = zrecv;
+		recv_stats_snapshot(&r.stats);
+		out->update(&zconf, &zsend, &r);
+	}
+	last_update = unique;
+}
+
+// outputs the oldest spilled result, if there is one
+static int output_spilled(uint8_t **buf, size_t *cap)
+{
+	pthread_mutex_lock(&spill_mutex);
+	if (!spilling) {
+		pthread_mutex_unlock(&spill_mutex);
+		return 0;
+	}
+	if (spill_read == spill_written) {
+		// caught up, ring again
+		spill_end = spill_off = 0;
+		if (ftruncate(spill_fd, 0)) {
+			log_warn("output-queue",
+				 "unable to truncate spill file: %s",
+				 strerror(errno));
+		}
+		__atomic_store_n(&spilling, 0, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&spill_mutex);
+		return 0;
+	}
+	uint64_t off = spill_off;
+	pthread_mutex_unlock(&spill_mutex);
+
+	// the producer only ever appends past spill_end
+	uint32_t len;
+	read_all(spill_fd, &len, sizeof(len), off);
+	if (len > *cap) {
+		*cap = len;
+		*buf = xrealloc(*buf, *cap);
+	}
+	read_all(spill_fd, *buf, len, off + sizeof(len));
+	output_record(*buf);
+
+	pthread_mutex_lock(&spill_mutex);
+	spill_off = off + sizeof(len) + len;
+	__atomic_store_n(&spill_read, spill_read + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&spill_mutex);
+	return 1;
+}
+
+static void *start_output(void *arg)
+{
+	uint8_t *buf = NULL;
+	size_t cap = 0;
+	for (;;) {
+		int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+		if (tail < __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+			struct output_slot *s = &slots[tail % ring_size];
+			output_record(s->heap ? s->heap : s->data);
+			xfree(s->heap);
+			s->heap = NULL;
+			__atomic_store_n(&tail, tail + 1, __ATOMIC_RELEASE);
+			maybe_update();
+			continue;
+		}
+		if (output_spilled(&buf, &cap)) {
+			maybe_update();
+			continue;
+		}
+		if (stop) {
+			break;
+		}
+		maybe_update();
+		output_wait();
+	}
+	xfree(buf);
+	if (zconf.output_module->close) {
+		zconf.output_module->close(&zconf, &zsend, &zrecv);
+	}
+	return NULL;
+}
+
+void output_queue_memory_estimate(uint64_t est[MEM_TAGS])
+{
+	uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+	uint64_t ring = (uint64_t)zconf.output_queue_size *
+			sizeof(struct output_slot);
+	est[MEM_OUTPUT] += (ring + page - 1) / page * page;
+}
+
+void output_queue_init(void)
+{
+	assert(zconf.output_queue_size);
+	ring_size = zconf.output_queue_size;
+	slots = hugemem_alloc(&slots_mem, MEM_OUTPUT,
+			      (size_t)ring_size * sizeof(struct output_slot));
+	identity_init();
+	last_update = recv_success_unique();
+	if (pthread_create(&output_thread, NULL, start_output, NULL)) {
+		log_fatal("output-queue", "unable to create output thread");
+	}
+	log_debug("output-queue", "output thread started, %u slots", ring_size);
+}
+
+void output_queue_finish(void)
+{
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	if (pthread_join(output_thread, NULL)) {
+		log_fatal("output-queue", "unable to join output thread");
+	}
+	if (spill_fd >= 0) {
+		close(spill_fd);
+	}
+	hugemem_free(&slots_mem);
+	slots = NULL;
+	log_debug("output-queue", "output thread finished");
+}
+
+void output_queue_depths(uint64_t *ring, uint64_t *spilled)
+{
+	if (!slots) {
+		*ring = *spilled = 0;
+		return;
+	}
+	// tail first, so that it is never ahead of head
+	uint64_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+	*ring = __atomic_load_n(&head, __ATOMIC_ACQUIRE) - t;
+	uint64_t r = __atomic_load_n(&spill_read, __ATOMIC_ACQUIRE);
+	*spilled = __atomic_load_n(&spill_written, __ATOMIC_ACQUIRE) - r;
+}
+
+uint64_t output_queue_capacity(void)
+{
+	return slots ? ring_size : 0;
+}
+
+uint64_t output_queue_written(void)
+{
+	return __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+}
+
+size_t output_record_encode(const fieldset_t *fs, uint8_t *buf)
+{
+	size_t off = 0;
+	encode(fs, buf, &off);
+	return off;
+}
+
+void output_record_write(uint8_t *buf)
+{
+	if (!identity.len) {
+		identity_init();
+	}
+	output_record(buf);
+}
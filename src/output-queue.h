@@ -0,0 +1,41 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <stdint.h>
+
+#include "../lib/xalloc.h"
+#include "fieldset.h"
+
+// starts the output thread (--output-queue-size), after the output module
+// has been initialized and started
+void output_queue_init(void);
+// copies the result out of fs, which the caller may free straight away
+void output_queue_push(fieldset_t *fs, translation_t *t);
+// outputs everything still queued, closes the output module from the output
+// thread and joins it
+void output_queue_finish(void);
+// results waiting in the ring and in the spill file
+void output_queue_depths(uint64_t *ring, uint64_t *spilled);
+// the results the ring holds, and those taken off it so far
+uint64_t output_queue_capacity(void);
+uint64_t output_queue_written(void);
+// adds the ring output_queue_init would map to est[MEM_OUTPUT]
+void output_queue_memory_estimate(uint64_t est[MEM_TAGS]);
+
+// A result flattened as in the queue, for passing it between processes
+// (--worker-processes): the size of fs's record, which is written to buf
+// unless buf is NULL. Field names stay pointers, valid in a forked process.
+size_t output_record_encode(const fieldset_t *fs, uint8_t *buf);
+// hands a flattened result, whose fields are already in output order, to
+// the output module
+void output_record_write(uint8_t *buf);
+
+#endif // OUTPUT_QUEUE_H
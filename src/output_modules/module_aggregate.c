@@ -0,0 +1,509 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Counts the results by a group key rather than writing them out, and
+ * writes the counts: those so far every --output-args=every=<secs>, and
+ * the final ones once the scan is done. The key is one or more output
+ * fields, by=<term>+<term>..., where an address field may be cut down to
+ * its prefix, e.g. by=saddr/24+sport+classification. Each group is a row
+ * of a compact open-addressing table, its key words and its count, with
+ * strings interned once; the output filter decides which results count,
+ * successful and unique ones by default.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include <arpa/inet.h>
+
+#include "../../lib/logger.h"
+#include "../../lib/util.h"
+#include "../../lib/xalloc.h"
+#include "../fieldset.h"
+
+#include "module_csv.h"
+#include "module_json.h"
+#include "output_buffer.h"
+#include "output_modules.h"
+
+#define AGG_MAX_TERMS 8
+// key words per term: an IPv6 prefix takes both
+#define AGG_TERM_WORDS 2
+#define AGG_INITIAL_SLOTS 1024
+
+enum agg_kind { AGG_IP, AGG_INT, AGG_BOOL, AGG_STRING };
+
+typedef struct agg_term {
+	// as given, which names its column
+	char *spec;
+	// index among the output fields
+	int field;
+	enum agg_kind kind;
+	// bits of an address kept, all of them by default, of 32 or 128
+	int prefix;
+	int bits;
+} agg_term_t;
+
+static agg_term_t terms[AGG_MAX_TERMS];
+static int num_terms = 0;
+// words of a key: AGG_TERM_WORDS for each term, then a bit for each null
+// term
+static int key_words = 0;
+
+// the groups in the order they first appeared, and the table of their
+// indices + 1 by key hash
+static uint64_t *keys = NULL;
+static uint64_t *counts = NULL;
+static uint64_t num_groups = 0;
+static uint64_t groups_cap = 0;
+static uint32_t *slots = NULL;
+static uint64_t num_slots = 0;
+
+// interned strings: the id of a string is its index + 1, 0 being none
+static char **strings = NULL;
+static uint32_t num_strings = 0;
+static uint32_t strings_cap = 0;
+static uint32_t *string_slots = NULL;
+static uint32_t num_string_slots = 0;
+
+static int fd = -1;
+static output_buffer_t out;
+static int json = 0;
+static double every = 0;
+static double next_snapshot = 0;
+static uint64_t results = 0;
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+static uint64_t hash_key(const uint64_t *key)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	for (int i = 0; i < key_words; i++) {
+		h = fmix64(h ^ key[i]);
+	}
+	return h;
+}
+
+static uint64_t hash_string(const char *s)
+{
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (; *s; s++) {
+		h = (h ^ (uint8_t)*s) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void strings_grow(void)
+{
+	uint32_t n = num_string_slots ? num_string_slots * 2 : 64;
+	uint32_t *t = xcalloc_tag(MEM_OUTPUT, n, sizeof(uint32_t));
+	for (uint32_t i = 0; i < num_strings; i++) {
+		uint32_t s = (uint32_t)hash_string(strings[i]) & (n - 1);
+		while (t[s]) {
+			s = (s + 1) & (n - 1);
+		}
+		t[s] = i + 1;
+	}
+	if (string_slots) {
+		xfree_tag(MEM_OUTPUT, string_slots);
+	}
+	string_slots = t;
+	num_string_slots = n;
+}
+
+static uint32_t intern(const char *str)
+{
+	if (2 * (num_strings + 1) > num_string_slots) {
+		strings_grow();
+	}
+	uint32_t s = (uint32_t)hash_string(str) & (num_string_slots - 1);
+	while (string_slots[s]) {
+		if (!strcmp(strings[string_slots[s] - 1], str)) {
+			return string_slots[s];
+		}
+		s = (s + 1) & (num_string_slots - 1);
+	}
+	if (num_strings == strings_cap) {
+		strings_cap = strings_cap ? strings_cap * 2 : 64;
+		strings = xrealloc(strings, strings_cap * sizeof(char *));
+	}
+	strings[num_strings++] = strdup(str);
+	string_slots[s] = num_strings;
+	return num_strings;
+}
+
+static void groups_grow(void)
+{
+	uint64_t n = num_slots ? num_slots * 2 : AGG_INITIAL_SLOTS;
+	uint32_t *t = xcalloc_tag(MEM_OUTPUT, n, sizeof(uint32_t));
+	for (uint64_t g = 0; g < num_groups; g++) {
+		uint64_t s = hash_key(&keys[g * key_words]) & (n - 1);
+		while (t[s]) {
+			s = (s + 1) & (n - 1);
+		}
+		t[s] = (uint32_t)(g + 1);
+	}
+	if (slots) {
+		xfree_tag(MEM_OUTPUT, slots);
+	}
+	slots = t;
+	num_slots = n;
+	// the rows fill up at half the slots
+	groups_cap = n / 2;
+	keys = xrealloc_tag(MEM_OUTPUT, keys,
+			    groups_cap * key_words * sizeof(uint64_t));
+	counts = xrealloc_tag(MEM_OUTPUT, counts, groups_cap * sizeof(uint64_t));
+}
+
+static void count(const uint64_t *key)
+{
+	if (num_groups == groups_cap) {
+		if (num_slots * 2 > UINT32_MAX) {
+			log_fatal("aggregate", "too many groups (%" PRIu64 ")",
+				  num_groups);
+		}
+		groups_grow();
+	}
+	uint64_t s = hash_key(key) & (num_slots - 1);
+	while (slots[s]) {
+		uint64_t g = slots[s] - 1;
+		if (!memcmp(&keys[g * key_words], key,
+			    key_words * sizeof(uint64_t))) {
+			counts[g]++;
+			return;
+		}
+		s = (s + 1) & (num_slots - 1);
+	}
+	memcpy(&keys[num_groups * key_words], key,
+	       key_words * sizeof(uint64_t));
+	counts[num_groups] = 1;
+	slots[s] = (uint32_t)++num_groups;
+}
+
+static void key_term(const agg_term_t *t, const field_t *f, uint64_t *w,
+		     uint64_t *nulls, int i)
+{
+	w[0] = w[1] = 0;
+	if (f->type == FS_NULL) {
+		*nulls |= 1ull << i;
+	} else if (f->type == FS_IPV4) {
+		uint32_t a = ntohl((uint32_t)f->value.num);
+		w[0] = t->prefix ? a & (0xFFFFFFFFu << (32 - t->prefix)) : 0;
+	} else if (f->type == FS_IPV6) {
+		uint8_t a[16];
+		memcpy(a, f->value.ptr, sizeof(a));
+		for (int b = t->prefix; b < 128; b++) {
+			a[b / 8] &= (uint8_t)~(0x80 >> (b % 8));
+		}
+		memcpy(&w[0], a, 8);
+		memcpy(&w[1], a + 8, 8);
+	} else if (f->type == FS_STRING) {
+		w[0] = intern((const char *)f->value.ptr);
+	} else {
+		// int and bool
+		w[0] = f->value.num;
+	}
+}
+
+static void write_snapshot(int final);
+
+static void add(const field_t *fields, fs_view_t *view)
+{
+	uint64_t key[AGG_MAX_TERMS * AGG_TERM_WORDS + 1];
+	uint64_t *nulls = &key[num_terms * AGG_TERM_WORDS];
+	*nulls = 0;
+	for (int i = 0; i < num_terms; i++) {
+		const field_t *f = view ? fs_view_field(view, terms[i].field)
+					: &fields[terms[i].field];
+		key_term(&terms[i], f, &key[i * AGG_TERM_WORDS], nulls, i);
+	}
+	count(key);
+	results++;
+	// the clock is only looked at every so often
+	if (every > 0 && !(results & 0xFF) && now() >= next_snapshot) {
+		write_snapshot(0);
+	}
+}
+
+// formats a term of a key into buf, returning whether it is a string to
+// quote in JSON (or NULL, for a null term)
+static const char *format_term(const agg_term_t *t, const uint64_t *w,
+			       uint64_t nulls, int i, char *buf, size_t len,
+			       int *quote)
+{
+	*quote = 0;
+	if (nulls & (1ull << i)) {
+		return NULL;
+	}
+	switch (t->kind) {
+	case AGG_IP: {
+		char addr[FS_IP_STR_LEN];
+		if (t->bits == 32) {
+			struct in_addr a = {.s_addr = htonl((uint32_t)w[0])};
+			inet_ntop(AF_INET, &a, addr, sizeof(addr));
+		} else {
+			uint8_t a[16];
+			memcpy(a, &w[0], 8);
+			memcpy(a + 8, &w[1], 8);
+			inet_ntop(AF_INET6, a, addr, sizeof(addr));
+		}
+		if (t->prefix == t->bits) {
+			snprintf(buf, len, "%s", addr);
+		} else {
+			snprintf(buf, len, "%s/%d", addr, t->prefix);
+		}
+		*quote = 1;
+		return buf;
+	}
+	case AGG_STRING:
+		*quote = 1;
+		return strings[w[0] - 1];
+	case AGG_BOOL:
+		if (json) {
+			return w[0] ? "true" : "false";
+		}
+		snprintf(buf, len, "%" PRId64, (int64_t)w[0]);
+		return buf;
+	case AGG_INT:
+	default:
+		snprintf(buf, len, "%" PRId64, (int64_t)w[0]);
+		return buf;
+	}
+}
+
+static void write_row(uint64_t g, uint64_t t, int final)
+{
+	const uint64_t *key = &keys[g * key_words];
+	uint64_t nulls = key[num_terms * AGG_TERM_WORDS];
+	char buf[FS_IP_STR_LEN + 8];
+	if (json) {
+		obuf_puts(&out, "{\"time\":");
+		obuf_put_uint64(&out, t);
+		obuf_puts(&out, final ? ",\"final\":true" : ",\"final\":false");
+	} else {
+		obuf_put_uint64(&out, t);
+		obuf_puts(&out, final ? ",1" : ",0");
+	}
+	for (int i = 0; i < num_terms; i++) {
+		int quote;
+		const char *v =
+		    format_term(&terms[i], &key[i * AGG_TERM_WORDS], nulls, i,
+				buf, sizeof(buf), &quote);
+		obuf_putc(&out, ',');
+		if (!json) {
+			if (v) {
+				csv_write_string(&out, v);
+			}
+			continue;
+		}
+		json_write_string(&out, terms[i].spec);
+		obuf_putc(&out, ':');
+		if (!v) {
+			obuf_puts(&out, "null");
+		} else if (quote) {
+			json_write_string(&out, v);
+		} else {
+			obuf_puts(&out, v);
+		}
+	}
+	obuf_puts(&out, json ? ",\"count\":" : ",");
+	obuf_put_uint64(&out, counts[g]);
+	obuf_puts(&out, json ? "}\n" : "\n");
+	obuf_end_record(&out);
+}
+
+static void write_snapshot(int final)
+{
+	uint64_t t = (uint64_t)now();
+	for (uint64_t g = 0; g < num_groups; g++) {
+		write_row(g, t, final);
+	}
+	obuf_flush(&out);
+	next_snapshot = now() + every;
+}
+
+static void csv_header(output_buffer_t *ob)
+{
+	obuf_puts(ob, "time,final");
+	for (int i = 0; i < num_terms; i++) {
+		obuf_putc(ob, ',');
+		csv_write_string(ob, terms[i].spec);
+	}
+	obuf_puts(ob, ",count\n");
+	obuf_flush(ob);
+}
+
+static void parse_by(struct state_conf *conf, const char *v, size_t vlen,
+		     const char **fields, int fieldlens)
+{
+	char *spec = strndup(v, vlen);
+	for (char *save = NULL, *t = strtok_r(spec, "+", &save); t;
+	     t = strtok_r(NULL, "+", &save)) {
+		if (num_terms == AGG_MAX_TERMS) {
+			log_fatal("aggregate", "at most %d terms in by=",
+				  AGG_MAX_TERMS);
+		}
+		agg_term_t *term = &terms[num_terms++];
+		term->spec = strdup(t);
+		char *slash = strchr(t, '/');
+		if (slash) {
+			*slash = '\0';
+		}
+		term->field = -1;
+		for (int i = 0; i < fieldlens; i++) {
+			if (!strcmp(fields[i], t)) {
+				term->field = i;
+			}
+		}
+		if (term->field < 0) {
+			log_fatal("aggregate", "%s is grouped by but not in "
+					       "--output-fields",
+				  t);
+		}
+		int def = conf->fsconf.translation.translation[term->field];
+		const char *type = conf->fsconf.defs.fielddefs[def].type;
+		int bits = conf->ipv6 ? 128 : 32;
+		term->prefix = term->bits = bits;
+		if (!strcmp(type, "ip")) {
+			term->kind = AGG_IP;
+		} else if (!strcmp(type, "int")) {
+			term->kind = AGG_INT;
+		} else if (!strcmp(type, "bool")) {
+			term->kind = AGG_BOOL;
+		} else if (!strcmp(type, "string")) {
+			term->kind = AGG_STRING;
+		} else {
+			log_fatal("aggregate", "can't group by %s, a %s field",
+				  t, type);
+		}
+		if (slash) {
+			char *end = NULL;
+			long len = strtol(slash + 1, &end, 10);
+			if (term->kind != AGG_IP || *end || len < 0 ||
+			    len > bits) {
+				log_fatal("aggregate",
+					  "%s: only addresses take a prefix "
+					  "length, of 0 to %d",
+					  term->spec, bits);
+			}
+			term->prefix = (int)len;
+		}
+	}
+	free(spec);
+}
+
+static void parse_args(struct state_conf *conf, const char **fields,
+		       int fieldlens)
+{
+	const char *p = conf->output_args;
+	while (p && *p) {
+		size_t n = strcspn(p, ",");
+		if (n > 3 && !strncmp(p, "by=", 3)) {
+			parse_by(conf, p + 3, n - 3, fields, fieldlens);
+		} else if (n == strlen("format=csv") &&
+			   !strncmp(p, "format=csv", n)) {
+			json = 0;
+		} else if (n == strlen("format=json") &&
+			   !strncmp(p, "format=json", n)) {
+			json = 1;
+		} else if (n > 6 && !strncmp(p, "every=", 6)) {
+			char *end = NULL;
+			every = strtod(p + 6, &end);
+			if (end != p + n || every < 0) {
+				log_fatal("aggregate", "every= takes seconds");
+			}
+		}
+		p += n;
+		if (*p == ',') {
+			p++;
+		}
+	}
+}
+
+int aggregate_init(struct state_conf *conf, const char **fields,
+		   int fieldlens)
+{
+	assert(conf);
+	parse_args(conf, fields, fieldlens);
+	if (!num_terms) {
+		log_fatal("aggregate", "the aggregate output module needs the "
+				       "fields to group by, as "
+				       "--output-args=by=<field>[/<prefix "
+				       "length>]+...");
+	}
+	key_words = num_terms * AGG_TERM_WORDS + 1;
+	groups_grow();
+	fd = output_open(conf, "aggregate");
+	obuf_init(&out, fd, "aggregate", conf->output_args);
+	if (!json && !conf->no_header_row) {
+		// every segment gets its own, when rotating
+		out.segment_begin = csv_header;
+		csv_header(&out);
+	}
+	next_snapshot = now() + every;
+	return EXIT_SUCCESS;
+}
+
+int aggregate_process(fieldset_t *fs)
+{
+	add(fs->fields, NULL);
+	return EXIT_SUCCESS;
+}
+
+int aggregate_process_view(fs_view_t *view)
+{
+	add(NULL, view);
+	return EXIT_SUCCESS;
+}
+
+int aggregate_close(UNUSED struct state_conf *c, UNUSED struct state_send *s,
+		    UNUSED struct state_recv *r)
+{
+	if (fd < 0) {
+		return EXIT_SUCCESS;
+	}
+	write_snapshot(1);
+	obuf_close(&out);
+	fd = -1;
+	log_info("aggregate", "counted %" PRIu64 " results in %" PRIu64
+			      " groups",
+		 results, num_groups);
+	return EXIT_SUCCESS;
+}
+
+output_module_t module_aggregate = {
+    .name = "aggregate",
+    .init = &aggregate_init,
+    .start = NULL,
+    .update = NULL,
+    .update_interval = 0,
+    .close = &aggregate_close,
+    .process_ip = &aggregate_process,
+    .process_view = &aggregate_process_view,
+    .supports_dynamic_output = NO_DYNAMIC_SUPPORT,
+    .helptext =
+	"Counts the results by a group key of output fields instead of "
+	"writing them, and writes one row per group: "
+	"--output-args=by=<field>[/<prefix length>]+..., e.g. "
+	"by=saddr/24+sport+classification, with the fields in "
+	"--output-fields. format=csv (default) or format=json, and every=<secs> "
+	"for the counts so far every so often as well as the final ones. Rows "
+	"have the time, whether they are final, the key and the count."};
@@ -0,0 +1,864 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Writes results as an Apache Arrow IPC file (https://arrow.apache.org/docs/
+ * format/Columnar.html), one column per output field, typed from the probe
+ * module's field definitions:
+ *
+ *   int          uint64
+ *   bool         bool
+ *   string, ip   utf8 (addresses in text form)
+ *   binary       binary
+ *   repeated     list<utf8>, nested fieldsets as JSON objects
+ *
+ * and utf8 holding JSON text for anything else. Rows are gathered into a
+ * record batch that is written out every batch-rows results, so the file
+ * holds complete batches as it grows and gets its footer when the scan
+ * ends. The flatbuffer metadata is built by hand, front to back, so that
+ * every reference points forward as the format requires. Column buffers
+ * are placed on 64-byte boundaries of the file, so readers can map it and
+ * use them in place.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <endian.h>
+#include <inttypes.h>
+
+#include "../../lib/includes.h"
+#include "../../lib/logger.h"
+#include "../../lib/util.h"
+#include "../../lib/xalloc.h"
+#include "../fieldset.h"
+
+#include "output_modules.h"
+#include "output_buffer.h"
+
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_ALIGN 64
+#define ARROW_DEFAULT_BATCH_ROWS 65536
+// utf8 and binary offsets are 32 bits, so a batch is cut short before any
+// of its columns gets near that
+#define ARROW_MAX_BATCH_BYTES (1U << 30)
+
+// flatbuffer identifiers from the Arrow schema (Schema.fbs, Message.fbs)
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_BINARY 4
+#define ARROW_TYPE_UTF8 5
+#define ARROW_TYPE_BOOL 6
+#define ARROW_TYPE_LIST 12
+
+enum column_kind { COL_UINT64, COL_BOOL, COL_UTF8, COL_BINARY, COL_LIST };
+
+typedef struct bytebuf {
+	uint8_t *p;
+	size_t len;
+	size_t cap;
+} bytebuf_t;
+
+struct arrow_column {
+	const char *name;
+	enum column_kind kind;
+	uint64_t nulls;
+	bytebuf_t validity;
+	bytebuf_t offsets; // utf8, binary and list
+	bytebuf_t data;
+	// list items, which are utf8 without nulls
+	uint32_t items;
+	bytebuf_t item_offsets;
+	bytebuf_t item_data;
+};
+
+// where a finished record batch sits in the file, for the footer
+struct arrow_block {
+	uint64_t offset;
+	uint32_t metadata_len;
+	uint64_t body_len;
+};
+
+struct body_part {
+	const void *data;
+	size_t len;
+};
+
+static int fd = -1;
+static output_buffer_t out;
+static uint64_t file_offset = 0;
+static struct arrow_column *columns = NULL;
+static int num_columns = 0;
+static uint32_t rows = 0;
+static uint32_t batch_rows = ARROW_DEFAULT_BATCH_ROWS;
+static struct arrow_block *blocks = NULL;
+static size_t num_blocks = 0;
+static size_t blocks_cap = 0;
+static bytebuf_t fb;
+
+static void bb_reserve(bytebuf_t *b, size_t n)
+{
+	if (b->len + n <= b->cap) {
+		return;
+	}
+	size_t cap = b->cap ? b->cap : 256;
+	while (cap < b->len + n) {
+		cap *= 2;
+	}
+	b->p = xrealloc(b->p, cap);
+	b->cap = cap;
+}
+
+static void bb_put(bytebuf_t *b, const void *data, size_t n)
+{
+	if (!n) {
+		return;
+	}
+	bb_reserve(b, n);
+	memcpy(b->p + b->len, data, n);
+	b->len += n;
+}
+
+static void bb_zero(bytebuf_t *b, size_t n)
+{
+	bb_reserve(b, n);
+	memset(b->p + b->len, 0, n);
+	b->len += n;
+}
+
+static inline void bb_putc(bytebuf_t *b, char c)
+{
+	bb_reserve(b, 1);
+	b->p[b->len++] = (uint8_t)c;
+}
+
+static void bb_puts(bytebuf_t *b, const char *s)
+{
+	bb_put(b, s, strlen(s));
+}
+
+static void bb_put_uint64(bytebuf_t *b, uint64_t v)
+{
+	char tmp[21];
+	int n = snprintf(tmp, sizeof(tmp), "%" PRIu64, v);
+	bb_put(b, tmp, (size_t)n);
+}
+
+// as text, in the encoding chosen with binary=
+static void bb_put_binary(bytebuf_t *b, const uint8_t *data, size_t len)
+{
+	if (out.binary == OBUF_BINARY_BASE64) {
+		bb_reserve(b, BASE64_ENCODED_LEN(len));
+		b->len += base64_encode((char *)b->p + b->len, data, len);
+	} else {
+		bb_reserve(b, HEX_ENCODED_LEN(len));
+		b->len += hex_encode((char *)b->p + b->len, data, len);
+	}
+}
+
+static void bb_free(bytebuf_t *b)
+{
+	xfree(b->p);
+	memset(b, 0, sizeof(*b));
+}
+
+//
+// flatbuffers
+//
+
+// an inline field of a table: a scalar, or a reference patched in once the
+// object it refers to has been written
+struct fb_slot {
+	uint16_t id;
+	uint8_t size;
+	uint8_t is_ref;
+	uint64_t val;
+};
+
+#define FB_MAX_SLOTS 8
+
+static void fb_pad_to(bytebuf_t *b, size_t align)
+{
+	bb_zero(b, (align - b->len % align) % align);
+}
+
+static void fb_put_le(bytebuf_t *b, uint64_t v, size_t size)
+{
+	uint8_t tmp[8];
+	for (size_t i = 0; i < size; i++) {
+		tmp[i] = (uint8_t)(v >> (8 * i));
+	}
+	bb_put(b, tmp, size);
+}
+
+static void fb_set_u32(bytebuf_t *b, size_t at, uint32_t v)
+{
+	for (int i = 0; i < 4; i++) {
+		b->p[at + i] = (uint8_t)(v >> (8 * i));
+	}
+}
+
+// points the reference at position at to position target
+static void fb_patch(bytebuf_t *b, size_t at, size_t target)
+{
+	assert(target > at);
+	fb_set_u32(b, at, (uint32_t)(target - at));
+}
+
+// writes a table, preceded by its vtable, and returns its position. refs
+// gets the positions of the reference slots, in order.
+static size_t fb_table(bytebuf_t *b, const struct fb_slot *s, int n,
+		       size_t *refs)
+{
+	assert(n <= FB_MAX_SLOTS);
+	int nfields = 0;
+	for (int i = 0; i < n; i++) {
+		if (s[i].id + 1 > nfields) {
+			nfields = s[i].id + 1;
+		}
+	}
+	fb_pad_to(b, 2);
+	size_t vt_pos = b->len;
+	size_t vt_len = 4 + 2 * (size_t)nfields;
+	size_t table_pos = vt_pos + vt_len;
+	table_pos += (4 - table_pos % 4) % 4;
+	// lay the fields out after the vtable offset, each on its own size
+	size_t pos = table_pos + 4;
+	size_t field_pos[FB_MAX_SLOTS];
+	for (int i = 0; i < n; i++) {
+		pos += (s[i].size - pos % s[i].size) % s[i].size;
+		field_pos[i] = pos;
+		pos += s[i].size;
+	}
+	uint16_t vt[2 + FB_MAX_SLOTS * 2] = {0};
+	vt[0] = (uint16_t)vt_len;
+	vt[1] = (uint16_t)(pos - table_pos);
+	for (int i = 0; i < n; i++) {
+		vt[2 + s[i].id] = (uint16_t)(field_pos[i] - table_pos);
+	}
+	for (int i = 0; i < nfields + 2; i++) {
+		fb_put_le(b, vt[i], 2);
+	}
+	bb_zero(b, table_pos - b->len);
+	fb_put_le(b, (uint32_t)(table_pos - vt_pos), 4);
+	int r = 0;
+	for (int i = 0; i < n; i++) {
+		bb_zero(b, field_pos[i] - b->len);
+		if (s[i].is_ref) {
+			refs[r++] = b->len;
+		}
+		fb_put_le(b, s[i].val, s[i].size);
+	}
+	return table_pos;
+}
+
+// writes the length of a vector of n elements so that they start aligned,
+// and returns the position of the length, which is what refers to it
+static size_t fb_vector(bytebuf_t *b, uint32_t n, size_t align)
+{
+	if (align < 4) {
+		align = 4;
+	}
+	while ((b->len + 4) % align) {
+		bb_zero(b, 1);
+	}
+	size_t pos = b->len;
+	fb_put_le(b, n, 4);
+	return pos;
+}
+
+static size_t fb_string(bytebuf_t *b, const char *s)
+{
+	fb_pad_to(b, 4);
+	size_t pos = b->len;
+	size_t len = strlen(s);
+	fb_put_le(b, len, 4);
+	bb_put(b, s, len + 1);
+	return pos;
+}
+
+static size_t fb_field(bytebuf_t *b, const char *name, enum column_kind kind)
+{
+	static const uint8_t types[] = {
+	    [COL_UINT64] = ARROW_TYPE_INT, [COL_BOOL] = ARROW_TYPE_BOOL,
+	    [COL_UTF8] = ARROW_TYPE_UTF8, [COL_BINARY] = ARROW_TYPE_BINARY,
+	    [COL_LIST] = ARROW_TYPE_LIST};
+	struct fb_slot s[] = {{.id = 0, .size = 4, .is_ref = 1},
+			      {.id = 1, .size = 1, .val = 1},
+			      {.id = 2, .size = 1, .val = types[kind]},
+			      {.id = 3, .size = 4, .is_ref = 1},
+			      {.id = 5, .size = 4, .is_ref = 1}};
+	size_t refs[3];
+	size_t pos = fb_table(b, s, 5, refs);
+	fb_patch(b, refs[0], fb_string(b, name));
+	if (kind == COL_UINT64) {
+		struct fb_slot t[] = {{.id = 0, .size = 4, .val = 64},
+				      {.id = 1, .size = 1, .val = 0}};
+		fb_patch(b, refs[1], fb_table(b, t, 2, NULL));
+	} else {
+		fb_patch(b, refs[1], fb_table(b, NULL, 0, NULL));
+	}
+	// readers insist on the children, even when there are none
+	uint32_t nchildren = kind == COL_LIST ? 1 : 0;
+	size_t vec = fb_vector(b, nchildren, 4);
+	fb_patch(b, refs[2], vec);
+	if (nchildren) {
+		bb_zero(b, 4);
+		fb_patch(b, vec + 4, fb_field(b, "item", COL_UTF8));
+	}
+	return pos;
+}
+
+static size_t fb_schema(bytebuf_t *b)
+{
+	uint16_t endianness = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+	struct fb_slot s[] = {{.id = 0, .size = 2, .val = endianness},
+			      {.id = 1, .size = 4, .is_ref = 1}};
+	size_t ref;
+	size_t pos = fb_table(b, s, 2, &ref);
+	size_t vec = fb_vector(b, (uint32_t)num_columns, 4);
+	fb_patch(b, ref, vec);
+	bb_zero(b, 4 * (size_t)num_columns);
+	for (int i = 0; i < num_columns; i++) {
+		fb_patch(b, vec + 4 + 4 * (size_t)i,
+			 fb_field(b, columns[i].name, columns[i].kind));
+	}
+	return pos;
+}
+
+// starts a Message of the given type in fb and returns the position of the
+// reference to its header
+static size_t fb_message(bytebuf_t *b, int header_type, uint64_t body_len)
+{
+	b->len = 0;
+	bb_zero(b, 4);
+	struct fb_slot s[] = {{.id = 3, .size = 8, .val = body_len},
+			      {.id = 0, .size = 2, .val = ARROW_METADATA_V5},
+			      {.id = 1, .size = 1, .val = header_type},
+			      {.id = 2, .size = 4, .is_ref = 1}};
+	size_t ref;
+	fb_patch(b, 0, fb_table(b, s, 4, &ref));
+	return ref;
+}
+
+//
+// file
+//
+
+static void write_bytes(const void *data, size_t len)
+{
+	obuf_write(&out, data, len);
+	file_offset += len;
+}
+
+static void write_zeros(size_t len)
+{
+	static const uint8_t zeros[ARROW_ALIGN];
+	while (len) {
+		size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+		write_bytes(zeros, n);
+		len -= n;
+	}
+}
+
+// writes the metadata in fb as an encapsulated message, padded so that the
+// body that follows starts on an ARROW_ALIGN boundary, and returns the size
+// of everything written
+static uint32_t write_metadata(void)
+{
+	size_t end = file_offset + 8 + fb.len;
+	size_t pad = (ARROW_ALIGN - end % ARROW_ALIGN) % ARROW_ALIGN;
+	uint32_t prefix[2] = {htole32(0xFFFFFFFF),
+			      htole32((uint32_t)(fb.len + pad))};
+	write_bytes(prefix, sizeof(prefix));
+	write_bytes(fb.p, fb.len);
+	write_zeros(pad);
+	return (uint32_t)(8 + fb.len + pad);
+}
+
+static void write_schema(void)
+{
+	size_t ref = fb_message(&fb, ARROW_HEADER_SCHEMA, 0);
+	fb_patch(&fb, ref, fb_schema(&fb));
+	write_metadata();
+}
+
+static void reset_column(struct arrow_column *c)
+{
+	static const int32_t zero = 0;
+	c->nulls = 0;
+	c->items = 0;
+	c->validity.len = 0;
+	c->data.len = 0;
+	c->offsets.len = 0;
+	c->item_offsets.len = 0;
+	c->item_data.len = 0;
+	if (c->kind == COL_UTF8 || c->kind == COL_BINARY ||
+	    c->kind == COL_LIST) {
+		bb_put(&c->offsets, &zero, sizeof(zero));
+	}
+	if (c->kind == COL_LIST) {
+		bb_put(&c->item_offsets, &zero, sizeof(zero));
+	}
+}
+
+// returns the number of rows written
+static uint32_t write_batch(void)
+{
+	if (!rows) {
+		return 0;
+	}
+	// two nodes and five buffers at most for a column
+	size_t max_nodes = 2 * (size_t)num_columns;
+	uint64_t *nodes = xcalloc(max_nodes * 2, sizeof(uint64_t));
+	struct body_part *parts = xcalloc(max_nodes * 3, sizeof(*parts));
+	size_t nn = 0;
+	size_t np = 0;
+	size_t bitmap_len = (rows + 7) / 8;
+	for (int i = 0; i < num_columns; i++) {
+		struct arrow_column *c = &columns[i];
+		nodes[2 * nn] = rows;
+		nodes[2 * nn + 1] = c->nulls;
+		nn++;
+		parts[np++] = (struct body_part){
+		    c->validity.p, c->nulls ? bitmap_len : 0};
+		switch (c->kind) {
+		case COL_UINT64:
+		case COL_BOOL:
+			parts[np++] = (struct body_part){c->data.p, c->data.len};
+			break;
+		case COL_UTF8:
+		case COL_BINARY:
+			parts[np++] =
+			    (struct body_part){c->offsets.p, c->offsets.len};
+			parts[np++] = (struct body_part){c->data.p, c->data.len};
+			break;
+		case COL_LIST:
+			parts[np++] =
+			    (struct body_part){c->offsets.p, c->offsets.len};
+			nodes[2 * nn] = c->items;
+			nodes[2 * nn + 1] = 0;
+			nn++;
+			parts[np++] = (struct body_part){NULL, 0};
+			parts[np++] = (struct body_part){c->item_offsets.p,
+							 c->item_offsets.len};
+			parts[np++] = (struct body_part){c->item_data.p,
+							 c->item_data.len};
+			break;
+		}
+	}
+	uint64_t body_len = 0;
+	for (size_t i = 0; i < np; i++) {
+		body_len += (parts[i].len + ARROW_ALIGN - 1) &
+			    ~(uint64_t)(ARROW_ALIGN - 1);
+	}
+
+	size_t ref = fb_message(&fb, ARROW_HEADER_RECORD_BATCH, body_len);
+	struct fb_slot s[] = {{.id = 0, .size = 8, .val = rows},
+			      {.id = 1, .size = 4, .is_ref = 1},
+			      {.id = 2, .size = 4, .is_ref = 1}};
+	size_t refs[2];
+	fb_patch(&fb, ref, fb_table(&fb, s, 3, refs));
+	fb_patch(&fb, refs[0], fb_vector(&fb, (uint32_t)nn, 8));
+	for (size_t i = 0; i < 2 * nn; i++) {
+		fb_put_le(&fb, nodes[i], 8);
+	}
+	fb_patch(&fb, refs[1], fb_vector(&fb, (uint32_t)np, 8));
+	uint64_t off = 0;
+	for (size_t i = 0; i < np; i++) {
+		fb_put_le(&fb, off, 8);
+		fb_put_le(&fb, parts[i].len, 8);
+		off += (parts[i].len + ARROW_ALIGN - 1) &
+		       ~(uint64_t)(ARROW_ALIGN - 1);
+	}
+
+	if (num_blocks == blocks_cap) {
+		blocks_cap = blocks_cap ? 2 * blocks_cap : 64;
+		blocks = xrealloc(blocks, blocks_cap * sizeof(*blocks));
+	}
+	struct arrow_block *blk = &blocks[num_blocks++];
+	blk->offset = file_offset;
+	blk->metadata_len = write_metadata();
+	blk->body_len = body_len;
+	for (size_t i = 0; i < np; i++) {
+		if (parts[i].len) {
+			write_bytes(parts[i].data, parts[i].len);
+		}
+		write_zeros((ARROW_ALIGN - parts[i].len % ARROW_ALIGN) %
+			    ARROW_ALIGN);
+	}
+	// a batch is only of use once all of it is in the file
+	obuf_flush(&out);
+	xfree(nodes);
+	xfree(parts);
+
+	uint32_t written = rows;
+	rows = 0;
+	for (int i = 0; i < num_columns; i++) {
+		reset_column(&columns[i]);
+	}
+	return written;
+}
+
+static void write_footer(void)
+{
+	static const uint32_t eos[2] = {0xFFFFFFFF, 0};
+	write_bytes(eos, sizeof(eos));
+
+	fb.len = 0;
+	bb_zero(&fb, 4);
+	struct fb_slot s[] = {{.id = 0, .size = 2, .val = ARROW_METADATA_V5},
+			      {.id = 1, .size = 4, .is_ref = 1},
+			      {.id = 2, .size = 4, .is_ref = 1},
+			      {.id = 3, .size = 4, .is_ref = 1}};
+	size_t refs[3];
+	fb_patch(&fb, 0, fb_table(&fb, s, 4, refs));
+	fb_patch(&fb, refs[0], fb_schema(&fb));
+	fb_patch(&fb, refs[1], fb_vector(&fb, 0, 8));
+	fb_patch(&fb, refs[2], fb_vector(&fb, (uint32_t)num_blocks, 8));
+	for (size_t i = 0; i < num_blocks; i++) {
+		fb_put_le(&fb, blocks[i].offset, 8);
+		fb_put_le(&fb, blocks[i].metadata_len, 4);
+		bb_zero(&fb, 4);
+		fb_put_le(&fb, blocks[i].body_len, 8);
+	}
+	write_bytes(fb.p, fb.len);
+	uint32_t len = htole32((uint32_t)fb.len);
+	write_bytes(&len, sizeof(len));
+	write_bytes(ARROW_MAGIC, strlen(ARROW_MAGIC));
+}
+
+// each segment of rotated output is a file of its own
+static void begin_file(output_buffer_t *ob)
+{
+	file_offset = 0;
+	num_blocks = 0;
+	write_bytes(ARROW_MAGIC "\0\0", 8);
+	write_schema();
+	obuf_flush(ob);
+}
+
+static void end_file(UNUSED output_buffer_t *ob)
+{
+	write_footer();
+}
+
+//
+// values
+//
+
+static void json_string(bytebuf_t *b, const char *s)
+{
+	bb_putc(b, '"');
+	for (; *s; s++) {
+		unsigned char ch = (unsigned char)*s;
+		switch (ch) {
+		case '"':
+			bb_puts(b, "\\\"");
+			break;
+		case '\\':
+			bb_puts(b, "\\\\");
+			break;
+		case '\n':
+			bb_puts(b, "\\n");
+			break;
+		case '\r':
+			bb_puts(b, "\\r");
+			break;
+		case '\t':
+			bb_puts(b, "\\t");
+			break;
+		default:
+			if (ch < 0x20) {
+				char esc[8];
+				snprintf(esc, sizeof(esc), "\\u%04x", ch);
+				bb_puts(b, esc);
+			} else {
+				bb_putc(b, (char)ch);
+			}
+		}
+	}
+	bb_putc(b, '"');
+}
+
+static void json_value(bytebuf_t *b, const field_t *f)
+{
+	char ip[FS_IP_STR_LEN];
+	switch (f->type) {
+	case FS_STRING:
+		json_string(b, (const char *)f->value.ptr);
+		break;
+	case FS_UINT64:
+		bb_put_uint64(b, f->value.num);
+		break;
+	case FS_BOOL:
+		bb_puts(b, f->value.num ? "true" : "false");
+		break;
+	case FS_BINARY:
+		bb_putc(b, '"');
+		bb_put_binary(b, (const uint8_t *)f->value.ptr, f->len);
+		bb_putc(b, '"');
+		break;
+	case FS_IPV4:
+	case FS_IPV6:
+		json_string(b, fs_format_ip(f, ip));
+		break;
+	case FS_FIELDSET:
+	case FS_REPEATED: {
+		const fieldset_t *fs = f->value.ptr;
+		int object = f->type == FS_FIELDSET;
+		bb_putc(b, object ? '{' : '[');
+		for (int i = 0; i < fs->len; i++) {
+			if (i) {
+				bb_putc(b, ',');
+			}
+			if (object) {
+				json_string(b, fs->fields[i].name);
+				bb_putc(b, ':');
+			}
+			json_value(b, &fs->fields[i]);
+		}
+		bb_putc(b, object ? '}' : ']');
+		break;
+	}
+	default:
+		bb_puts(b, "null");
+	}
+}
+
+// text of a field for a utf8 column: strings as they are, anything else as
+// JSON
+static void field_text(bytebuf_t *b, const field_t *f)
+{
+	char ip[FS_IP_STR_LEN];
+	switch (f->type) {
+	case FS_STRING:
+		bb_put(b, f->value.ptr, f->len);
+		break;
+	case FS_IPV4:
+	case FS_IPV6:
+		bb_puts(b, fs_format_ip(f, ip));
+		break;
+	default:
+		json_value(b, f);
+	}
+}
+
+static void end_var(bytebuf_t *offsets, const bytebuf_t *data)
+{
+	int32_t end = (int32_t)data->len;
+	bb_put(offsets, &end, sizeof(end));
+}
+
+static void append_field(struct arrow_column *c, const field_t *f)
+{
+	int valid = f->type != FS_NULL;
+	switch (c->kind) {
+	case COL_UINT64: {
+		valid = valid && (f->type == FS_UINT64 || f->type == FS_BOOL);
+		uint64_t v = valid ? f->value.num : 0;
+		bb_put(&c->data, &v, sizeof(v));
+		break;
+	}
+	case COL_BOOL:
+		valid = valid && (f->type == FS_UINT64 || f->type == FS_BOOL);
+		if (rows % 8 == 0) {
+			bb_zero(&c->data, 1);
+		}
+		if (valid && f->value.num) {
+			c->data.p[rows / 8] |= (uint8_t)(1 << (rows % 8));
+		}
+		break;
+	case COL_UTF8:
+		if (valid) {
+			field_text(&c->data, f);
+		}
+		end_var(&c->offsets, &c->data);
+		break;
+	case COL_BINARY:
+		valid = valid && (f->type == FS_BINARY || f->type == FS_STRING);
+		if (valid) {
+			bb_put(&c->data, f->value.ptr, f->len);
+		}
+		end_var(&c->offsets, &c->data);
+		break;
+	case COL_LIST:
+		valid = valid && f->type == FS_REPEATED;
+		if (valid) {
+			const fieldset_t *list = f->value.ptr;
+			for (int i = 0; i < list->len; i++) {
+				field_text(&c->item_data, &list->fields[i]);
+				end_var(&c->item_offsets, &c->item_data);
+			}
+			c->items += (uint32_t)list->len;
+		}
+		// list offsets count items
+		int32_t end = (int32_t)c->items;
+		bb_put(&c->offsets, &end, sizeof(end));
+		break;
+	}
+	if (rows % 8 == 0) {
+		bb_zero(&c->validity, 1);
+	}
+	if (valid) {
+		c->validity.p[rows / 8] |= (uint8_t)(1 << (rows % 8));
+	} else {
+		c->nulls++;
+	}
+}
+
+static void end_row(void)
+{
+	rows++;
+	int full = rows >= batch_rows;
+	for (int i = 0; i < num_columns && !full; i++) {
+		full = columns[i].data.len > ARROW_MAX_BATCH_BYTES ||
+		       columns[i].item_data.len > ARROW_MAX_BATCH_BYTES;
+	}
+	if (full) {
+		// a rotated segment is a complete file of whole batches
+		obuf_end_records(&out, write_batch());
+	}
+}
+
+static enum column_kind column_kind(const char *type)
+{
+	if (!strcmp(type, "int")) {
+		return COL_UINT64;
+	} else if (!strcmp(type, "bool")) {
+		return COL_BOOL;
+	} else if (!strcmp(type, "binary")) {
+		return COL_BINARY;
+	} else if (!strcmp(type, "repeated")) {
+		return COL_LIST;
+	}
+	return COL_UTF8;
+}
+
+static void parse_batch_rows(const char *args)
+{
+	const char *p = args;
+	while (p && *p) {
+		size_t n = strcspn(p, ",");
+		if (n > strlen("batch-rows=") && !strncmp(p, "batch-rows=", 11)) {
+			char *end;
+			unsigned long v = strtoul(p + 11, &end, 10);
+			if (end != p + n || v == 0 || v > UINT32_MAX) {
+				log_fatal("arrow", "invalid batch-rows: %.*s",
+					  (int)(n - 11), p + 11);
+			}
+			batch_rows = (uint32_t)v;
+		}
+		p += n;
+		if (*p == ',') {
+			p++;
+		}
+	}
+}
+
+int arrow_init(struct state_conf *conf, const char **fields, int fieldlens)
+{
+	assert(conf);
+	fd = output_open(conf, "arrow");
+	if (isatty(fd)) {
+		log_fatal("arrow", "refusing to write binary output to "
+				   "a terminal, use --output-file");
+	}
+	parse_batch_rows(conf->output_args);
+	obuf_init(&out, fd, "arrow", conf->output_args);
+
+	num_columns = fieldlens;
+	columns = xcalloc((size_t)fieldlens, sizeof(struct arrow_column));
+	for (int i = 0; i < fieldlens; i++) {
+		int def = conf->fsconf.translation.translation[i];
+		columns[i].name = fields[i];
+		columns[i].kind =
+		    column_kind(conf->fsconf.defs.fielddefs[def].type);
+		reset_column(&columns[i]);
+	}
+	out.segment_begin = begin_file;
+	out.segment_end = end_file;
+	begin_file(&out);
+	log_debug("arrow", "%d columns, %u rows per record batch", num_columns,
+		  batch_rows);
+	return EXIT_SUCCESS;
+}
+
+int arrow_process(fieldset_t *fs)
+{
+	if (fd < 0) {
+		return EXIT_SUCCESS;
+	}
+	for (int i = 0; i < num_columns; i++) {
+		append_field(&columns[i], &fs->fields[i]);
+	}
+	end_row();
+	return EXIT_SUCCESS;
+}
+
+int arrow_process_view(fs_view_t *view)
+{
+	if (fd < 0) {
+		return EXIT_SUCCESS;
+	}
+	for (int i = 0; i < num_columns; i++) {
+		append_field(&columns[i], fs_view_field(view, i));
+	}
+	end_row();
+	return EXIT_SUCCESS;
+}
+
+int arrow_close(UNUSED struct state_conf *c, UNUSED struct state_send *s,
+		UNUSED struct state_recv *r)
+{
+	if (fd < 0) {
+		return EXIT_SUCCESS;
+	}
+	// counted here rather than through obuf_end_records, which could
+	// start a segment only to leave it empty
+	out.records += write_batch();
+	write_footer();
+	obuf_close(&out);
+	fd = -1;
+	for (int i = 0; i < num_columns; i++) {
+		bb_free(&columns[i].validity);
+		bb_free(&columns[i].offsets);
+		bb_free(&columns[i].data);
+		bb_free(&columns[i].item_offsets);
+		bb_free(&columns[i].item_data);
+	}
+	xfree(columns);
+	xfree(blocks);
+	bb_free(&fb);
+	return EXIT_SUCCESS;
+}
+
+output_module_t module_arrow_file = {
+    .name = "arrow",
+    .init = &arrow_init,
+    .start = NULL,
+    .update = NULL,
+    .update_interval = 0,
+    .close = &arrow_close,
+    .process_ip = &arrow_process,
+    .process_view = &arrow_process_view,
+    .supports_dynamic_output = DYNAMIC_SUPPORT,
+    .helptext =
+	"Writes the output fields as columns of an Apache Arrow IPC file, typed "
+	"from the probe module's field definitions (int as uint64, bool, string "
+	"and ip as utf8, binary, repeated as a list of utf8 with nested records "
+	"as JSON). Rows are written in record batches of "
+	"--output-args=batch-rows=<n> (default 65536), and the footer that "
+	"makes the file readable with random access follows when the scan ends. "
+	"flush-bytes=<n> sets the write size as with the csv module."};
@@ -0,0 +1,116 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Writes the set of addresses in the results as a binary set file (see
+ * lib/ipbm.h) at the end of the scan, for the next scan of a chain to read
+ * with --list-of-ips-file without parsing, or for zbitmap to combine with
+ * others. Nothing but saddr is kept; the output filter decides which
+ * results count, successful and unique ones by default.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "../../lib/includes.h"
+#include "../../lib/ipbm.h"
+#include "../../lib/logger.h"
+#include "../../lib/pbm.h"
+#include "../fieldset.h"
+
+#include "output_modules.h"
+
+static uint8_t **set = NULL;
+static int saddr_index = -1;
+static uint64_t results = 0;
+
+int bitmap_init(struct state_conf *conf, const char **fields, int fieldlens)
+{
+	assert(conf);
+	if (conf->ipv6) {
+		log_fatal("bitmap", "the bitmap output module only holds IPv4 "
+				    "addresses");
+	}
+	if (output_rotating()) {
+		log_fatal("bitmap", "the bitmap output module writes a single "
+				    "file and can't be rotated");
+	}
+	if (conf->output_compression != OUTPUT_COMPRESSION_NONE) {
+		log_fatal("bitmap", "the bitmap output module can't be "
+				    "compressed, it is read by memory-mapping");
+	}
+	for (int i = 0; i < fieldlens; i++) {
+		if (!strcmp(fields[i], "saddr")) {
+			saddr_index = i;
+		}
+	}
+	if (saddr_index < 0) {
+		log_fatal("bitmap", "the bitmap output module needs saddr in "
+				    "--output-fields");
+	}
+	set = pbm_init();
+	return EXIT_SUCCESS;
+}
+
+static void add(const field_t *f)
+{
+	if (f->type != FS_IPV4) {
+		return;
+	}
+	pbm_set(set, ntohl((uint32_t)f->value.num));
+	results++;
+}
+
+int bitmap_process(fieldset_t *fs)
+{
+	add(&fs->fields[saddr_index]);
+	return EXIT_SUCCESS;
+}
+
+int bitmap_process_view(fs_view_t *view)
+{
+	add(fs_view_field(view, saddr_index));
+	return EXIT_SUCCESS;
+}
+
+int bitmap_close(struct state_conf *c, UNUSED struct state_send *s,
+		 UNUSED struct state_recv *r)
+{
+	if (!set) {
+		return EXIT_SUCCESS;
+	}
+	int fd = output_open(c, "bitmap");
+	if (ipbm_write(fd, set)) {
+		log_fatal("bitmap", "unable to write address set: %s",
+			  strerror(errno));
+	}
+	output_close(fd, "bitmap");
+	log_info("bitmap", "wrote the set of %" PRIu64 " results", results);
+	return EXIT_SUCCESS;
+}
+
+output_module_t module_bitmap = {
+    .name = "bitmap",
+    .init = &bitmap_init,
+    .start = NULL,
+    .update = NULL,
+    .update_interval = 0,
+    .close = &bitmap_close,
+    .process_ip = &bitmap_process,
+    .process_view = &bitmap_process_view,
+    .supports_dynamic_output = NO_DYNAMIC_SUPPORT,
+    .helptext =
+	"Writes the IPv4 addresses of the results (saddr) as a binary set "
+	"file once the scan is done, which --list-of-ips-file reads by "
+	"memory-mapping it and zbitmap can union, intersect and diff with "
+	"others. Repeated addresses, e.g. of several open ports, are kept "
+	"once."};
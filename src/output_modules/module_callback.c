@@ -0,0 +1,75 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Hands every result to a function of the program zmap is built into, set
+ * with output_set_result_callback() before the scan starts, as the fieldset
+ * of the output fields in order: nothing is formatted or written. The
+ * fieldset belongs to the receive thread and is only valid during the
+ * call, which must copy out what it keeps.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "../../lib/includes.h"
+#include "../../lib/logger.h"
+#include "../fieldset.h"
+
+#include "output_modules.h"
+
+static output_result_cb callback = NULL;
+static void *callback_arg = NULL;
+static uint64_t results = 0;
+
+void output_set_result_callback(output_result_cb cb, void *arg)
+{
+	callback = cb;
+	callback_arg = arg;
+}
+
+int callback_init(struct state_conf *conf, UNUSED const char **fields,
+		  UNUSED int fieldlens)
+{
+	assert(conf);
+	if (!callback) {
+		log_fatal("callback", "the callback output module is for programs "
+				      "embedding zmap, which set the callback "
+				      "with output_set_result_callback()");
+	}
+	return EXIT_SUCCESS;
+}
+
+int callback_process(fieldset_t *fs)
+{
+	results++;
+	return callback(fs, callback_arg);
+}
+
+int callback_close(UNUSED struct state_conf *c, UNUSED struct state_send *s,
+		   UNUSED struct state_recv *r)
+{
+	log_debug("callback", "handed %" PRIu64 " results to the callback",
+		  results);
+	return EXIT_SUCCESS;
+}
+
+output_module_t module_callback = {
+    .name = "callback",
+    .init = &callback_init,
+    .start = NULL,
+    .update = NULL,
+    .update_interval = 0,
+    .close = &callback_close,
+    .process_ip = &callback_process,
+    .supports_dynamic_output = DYNAMIC_SUPPORT,
+    .helptext =
+	"Hands each result's fieldset to a function set by the program zmap "
+	"is built into (output_set_result_callback()), without formatting "
+	"it. Not usable from the command line."};
@@ -10,6 +10,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -21,38 +23,44 @@
 #include "../fieldset.h"
 
 #include "output_modules.h"
+#include "output_buffer.h"
 
-static FILE *file = NULL;
+static int fd = -1;
+static output_buffer_t out;
 
-int csv_init(struct state_conf *conf, const char **fields, int fieldlens)
+static const char **header_fields = NULL;
+static int header_len = 0;
+
+void csv_write_header(output_buffer_t *ob, const char **fields, int len)
 {
-	assert(conf);
-	if (conf->output_filename) {
-		if (!strcmp(conf->output_filename, "-")) {
-			file = stdout;
-		} else {
-			if (!(file = fopen(conf->output_filename, "w"))) {
-				log_fatal(
-				    "csv",
-				    "could not open CSV output file (%s): %s",
-				    conf->output_filename, strerror(errno));
-			}
+	for (int i = 0; i < len; i++) {
+		if (i) {
+			obuf_putc(ob, ',');
 		}
-	} else {
-		file = stdout;
-		log_debug("csv", "no output file selected, will use stdout");
+		obuf_puts(ob, fields[i]);
 	}
+	obuf_putc(ob, '\n');
+	obuf_flush(ob);
+}
+
+static void csv_header(output_buffer_t *ob)
+{
+	csv_write_header(ob, header_fields, header_len);
+}
+
+int csv_init(struct state_conf *conf, const char **fields, int fieldlens)
+{
+	assert(conf);
+	fd = output_open(conf, "csv");
+	obuf_init(&out, fd, "csv", conf->output_args);
 	if (!conf->no_header_row) {
 		log_debug("csv", "more than one field, will add headers");
-		for (int i = 0; i < fieldlens; i++) {
-			if (i) {
-				fprintf(file, ",");
-			}
-			fprintf(file, "%s", fields[i]);
-		}
-		fprintf(file, "\n");
+		header_fields = fields;
+		header_len = fieldlens;
+		// every segment gets its own, when rotating
+		out.segment_begin = csv_header;
+		csv_header(&out);
 	}
-	check_and_log_file_error(file, "csv");
 	return EXIT_SUCCESS;
 }
 
@@ -60,52 +68,98 @@ int csv_close(__attribute__((unused)) struct state_conf *c,
 	      __attribute__((unused)) struct state_send *s,
 	      __attribute__((unused)) struct state_recv *r)
 {
-	if (file) {
-		fflush(file);
-		fclose(file);
+	if (fd >= 0) {
+		obuf_close(&out);
+		fd = -1;
 	}
 	return EXIT_SUCCESS;
 }
 
-static void hex_encode(FILE *f, unsigned char *readbuf, size_t len)
+// strings containing a comma are quoted, which is only known once the
+// string has been scanned, so it is copied first and shifted if need be
+void csv_write_string(output_buffer_t *ob, const char *str)
 {
+	size_t len = strlen(str);
+	if (ob->len + len + 2 > ob->cap) {
+		if (memchr(str, ',', len)) {
+			obuf_putc(ob, '"');
+			obuf_write(ob, str, len);
+			obuf_putc(ob, '"');
+		} else {
+			obuf_write(ob, str, len);
+		}
+		return;
+	}
+	char *dst = ob->buf + ob->len;
+	int quote = 0;
 	for (size_t i = 0; i < len; i++) {
-		fprintf(f, "%02x", readbuf[i]);
+		dst[i] = str[i];
+		quote |= str[i] == ',';
+	}
+	if (quote) {
+		memmove(dst + 1, dst, len);
+		dst[0] = '"';
+		dst[len + 1] = '"';
+		len += 2;
+	}
+	ob->len += len;
+}
+
+static void csv_field(output_buffer_t *ob, field_t *f, int first)
+{
+	if (!first) {
+		obuf_putc(ob, ',');
+	}
+	if (f->type == FS_STRING) {
+		csv_write_string(ob, (char *)f->value.ptr);
+	} else if (f->type == FS_UINT64) {
+		obuf_put_uint64(ob, (uint64_t)f->value.num);
+	} else if (f->type == FS_BOOL) {
+		int v = (int)f->value.num;
+		if (v < 0) {
+			obuf_putc(ob, '-');
+		}
+		obuf_put_uint64(ob, v < 0 ? -(uint64_t)(int64_t)v : (uint64_t)v);
+	} else if (f->type == FS_BINARY) {
+		obuf_put_binary(ob, (uint8_t *)f->value.ptr, f->len);
+	} else if (f->type == FS_IPV4 || f->type == FS_IPV6) {
+		char buf[FS_IP_STR_LEN];
+		obuf_puts(ob, fs_format_ip(f, buf));
+	} else if (f->type == FS_NULL) {
+		// do nothing
+	} else {
+		log_fatal("csv", "received unknown output type");
+	}
+}
+
+void csv_write_view(output_buffer_t *ob, fs_view_t *view)
+{
+	for (int i = 0; i < fs_view_len(view); i++) {
+		csv_field(ob, fs_view_field(view, i), !i);
 	}
-	check_and_log_file_error(f, "csv");
+	obuf_putc(ob, '\n');
+	obuf_end_record(ob);
 }
 
 int csv_process(fieldset_t *fs)
 {
-	if (!file) {
+	if (fd < 0) {
 		return EXIT_SUCCESS;
 	}
 	for (int i = 0; i < fs->len; i++) {
-		field_t *f = &(fs->fields[i]);
-		if (i) {
-			fprintf(file, ",");
-		}
-		if (f->type == FS_STRING) {
-			if (strchr((char *)f->value.ptr, ',')) {
-				fprintf(file, "\"%s\"", (char *)f->value.ptr);
-			} else {
-				fprintf(file, "%s", (char *)f->value.ptr);
-			}
-		} else if (f->type == FS_UINT64) {
-			fprintf(file, "%" PRIu64, (uint64_t)f->value.num);
-		} else if (f->type == FS_BOOL) {
-			fprintf(file, "%" PRIi32, (int)f->value.num);
-		} else if (f->type == FS_BINARY) {
-			hex_encode(file, (unsigned char *)f->value.ptr, f->len);
-		} else if (f->type == FS_NULL) {
-			// do nothing
-		} else {
-			log_fatal("csv", "received unknown output type");
-		}
+		csv_field(&out, &(fs->fields[i]), !i);
+	}
+	obuf_putc(&out, '\n');
+	obuf_end_record(&out);
+	return EXIT_SUCCESS;
+}
+
+int csv_process_view(fs_view_t *view)
+{
+	if (fd < 0) {
+		return EXIT_SUCCESS;
 	}
-	fprintf(file, "\n");
-	fflush(file);
-	check_and_log_file_error(file, "csv");
+	csv_write_view(&out, view);
 	return EXIT_SUCCESS;
 }
 
@@ -117,10 +171,16 @@ output_module_t module_csv_file = {
     .update_interval = 0,
     .close = &csv_close,
     .process_ip = &csv_process,
+    .process_view = &csv_process_view,
     .supports_dynamic_output = NO_DYNAMIC_SUPPORT,
     .helptext =
 	"Outputs one or more output fields as a comma-delimited file. By default, the "
 	"probe module does not filter out duplicates or limit to successful fields, "
 	"but rather includes all received packets. Fields can be controlled by "
 	"setting --output-fields. Filtering out failures and duplicate packets can "
-	"be achieved by setting an --output-filter."};
+	"be achieved by setting an --output-filter. Rows are buffered and "
+	"written in batches; --output-args=flush-bytes=<n>,flush-ms=<n> sets "
+	"how much (default 65536 bytes) and how long (default 1000 ms, 0 on a "
+	"terminal) output may be held back, and io=uring writes the batches "
+	"in the background through an io_uring. Binary fields are written in "
+	"hex, or in base64 with --output-args=binary=base64."};
@@ -8,7 +8,16 @@
 
 #include "../fieldset.h"
 #include "output_modules.h"
+#include "output_buffer.h"
 
 int csv_init(struct state_conf *conf, char **fields, int fieldlens);
 int csv_process(fieldset_t *fs);
+int csv_process_view(fs_view_t *view);
 int csv_close(struct state_conf *c, struct state_send *s, struct state_recv *r);
+
+// CSV formatting for writers of their own streams: a header row of the
+// given field names, and a record of the fields of a view
+void csv_write_header(output_buffer_t *ob, const char **fields, int len);
+void csv_write_view(output_buffer_t *ob, fs_view_t *view);
+// a string, quoted if it holds a comma
+void csv_write_string(output_buffer_t *ob, const char *str);
@@ -12,6 +12,8 @@
 #include <time.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "../../lib/includes.h"
 #include "../../lib/xalloc.h"
@@ -27,39 +29,66 @@
 #include <json.h>
 
 #include "../../lib/logger.h"
+#include "../../lib/util.h"
 
 #include "output_modules.h"
+#include "output_buffer.h"
+#include "module_json.h"
 #include "../probe_modules/probe_modules.h"
 
-static FILE *file = NULL;
+static int fd = -1;
+static output_buffer_t out;
+// --output-args=encoder=json-c builds a json-c object per record instead of
+// streaming it, which is slower but handy to check the streaming output
+static int use_json_c = 0;
+
+static void parse_encoder(const char *args)
+{
+	const char *p = args;
+	while (p && *p) {
+		size_t n = strcspn(p, ",");
+		if (n > strlen("encoder=") && !strncmp(p, "encoder=", 8)) {
+			const char *v = p + 8;
+			size_t vlen = n - 8;
+			if (vlen == strlen("json-c") && !strncmp(v, "json-c", vlen)) {
+				use_json_c = 1;
+			} else if (vlen == strlen("stream") &&
+				   !strncmp(v, "stream", vlen)) {
+				use_json_c = 0;
+			} else {
+				log_fatal("json",
+					  "unknown encoder %.*s, expected "
+					  "stream or json-c",
+					  (int)vlen, v);
+			}
+		}
+		p += n;
+		if (*p == ',') {
+			p++;
+		}
+	}
+}
 
 int json_output_file_init(struct state_conf *conf, UNUSED const char **fields,
 			  UNUSED int fieldlens)
 {
 	assert(conf);
-	if (!conf->output_filename) {
-		file = stdout;
-	} else if (!strcmp(conf->output_filename, "-")) {
-		file = stdout;
-	} else {
-		if (!(file = fopen(conf->output_filename, "w"))) {
-			log_fatal("output-json",
-				  "could not open JSON output file (%s): %s",
-				  conf->output_filename, strerror(errno));
-		}
-	}
-	check_and_log_file_error(file, "json");
+	fd = output_open(conf, "json");
+	parse_encoder(conf->output_args);
+	obuf_init(&out, fd, "json", conf->output_args);
 	return EXIT_SUCCESS;
 }
 
-char *hex_encode(unsigned char *packet, int buflen)
+// a binary field in the encoding chosen with binary=
+static json_object *binary_to_jsonobj(const uint8_t *data, size_t len)
 {
-	char *buf = xmalloc(2 * buflen + 1);
-	for (int i = 0; i < buflen; i++) {
-		snprintf(buf + (i * 2), 3, "%.2x", packet[i]);
-	}
-	buf[buflen * 2] = 0;
-	return buf;
+	char *buf = xmalloc(HEX_ENCODED_LEN(len) + BASE64_ENCODED_LEN(len) + 1);
+	size_t n = out.binary == OBUF_BINARY_BASE64
+		       ? base64_encode(buf, data, len)
+		       : hex_encode(buf, data, len);
+	json_object *t = json_object_new_string_len(buf, (int)n);
+	xfree(buf);
+	return t;
 }
 
 json_object *fs_to_jsonobj(fieldset_t *fs);
@@ -74,10 +103,10 @@ json_object *field_to_jsonobj(field_t *f)
 	} else if (f->type == FS_BOOL) {
 		return json_object_new_boolean(f->value.num);
 	} else if (f->type == FS_BINARY) {
-		char *encoded = hex_encode(f->value.ptr, f->len);
-		json_object *t = json_object_new_string(encoded);
-		free(encoded);
-		return t;
+		return binary_to_jsonobj(f->value.ptr, f->len);
+	} else if (f->type == FS_IPV4 || f->type == FS_IPV6) {
+		char buf[FS_IP_STR_LEN];
+		return json_object_new_string(fs_format_ip(f, buf));
 	} else if (f->type == FS_NULL) {
 		return NULL;
 	} else if (f->type == FS_FIELDSET) {
@@ -112,17 +141,194 @@ json_object *fs_to_jsonobj(fieldset_t *fs)
 	return obj;
 }
 
+json_object *view_to_jsonobj(fs_view_t *view)
+{
+	json_object *obj = json_object_new_object();
+	for (int i = 0; i < fs_view_len(view); i++) {
+		field_t *f = fs_view_field(view, i);
+		if (f->type != FS_NULL) {
+			json_object_object_add(obj, f->name,
+					       field_to_jsonobj(f));
+		}
+	}
+	return obj;
+}
+
+static void json_write_record(json_object *record)
+{
+	obuf_puts(&out,
+		  json_object_to_json_string_ext(record, JSON_C_TO_STRING_PLAIN));
+	obuf_putc(&out, '\n');
+	obuf_end_record(&out);
+	json_object_put(record);
+}
+
+// The streaming encoder writes records straight from the fieldset into the
+// output buffer, byte for byte what json-c produces with
+// JSON_C_TO_STRING_PLAIN (including its escaped '/' and signed integers).
+
+void json_write_string(output_buffer_t *ob, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *s = (const unsigned char *)str;
+	const unsigned char *run = s;
+	obuf_putc(ob, '"');
+	for (; *s; s++) {
+		char esc[6] = {'\\'};
+		size_t n = 2;
+		switch (*s) {
+		case '"':
+		case '\\':
+		case '/':
+			esc[1] = (char)*s;
+			break;
+		case '\b':
+			esc[1] = 'b';
+			break;
+		case '\f':
+			esc[1] = 'f';
+			break;
+		case '\n':
+			esc[1] = 'n';
+			break;
+		case '\r':
+			esc[1] = 'r';
+			break;
+		case '\t':
+			esc[1] = 't';
+			break;
+		default:
+			if (*s >= ' ') {
+				continue;
+			}
+			memcpy(esc + 1, "u00", 3);
+			esc[4] = hex[*s >> 4];
+			esc[5] = hex[*s & 0xf];
+			n = 6;
+		}
+		obuf_write(ob, run, (size_t)(s - run));
+		obuf_write(ob, esc, n);
+		run = s + 1;
+	}
+	obuf_write(ob, run, (size_t)(s - run));
+	obuf_putc(ob, '"');
+}
+
+static void json_string(const char *str)
+{
+	json_write_string(&out, str);
+}
+
+static void json_fieldset(fieldset_t *fs);
+static void json_repeated(fieldset_t *fs);
+
+static void json_value(field_t *f)
+{
+	if (f->type == FS_STRING) {
+		json_string((char *)f->value.ptr);
+	} else if (f->type == FS_UINT64) {
+		int64_t v = (int64_t)f->value.num;
+		if (v < 0) {
+			obuf_putc(&out, '-');
+			obuf_put_uint64(&out, -(uint64_t)v);
+		} else {
+			obuf_put_uint64(&out, (uint64_t)v);
+		}
+	} else if (f->type == FS_BOOL) {
+		obuf_puts(&out, f->value.num ? "true" : "false");
+	} else if (f->type == FS_BINARY) {
+		obuf_putc(&out, '"');
+		obuf_put_binary(&out, (uint8_t *)f->value.ptr, f->len);
+		obuf_putc(&out, '"');
+	} else if (f->type == FS_IPV4 || f->type == FS_IPV6) {
+		char buf[FS_IP_STR_LEN];
+		obuf_putc(&out, '"');
+		obuf_puts(&out, fs_format_ip(f, buf));
+		obuf_putc(&out, '"');
+	} else if (f->type == FS_NULL) {
+		obuf_puts(&out, "null");
+	} else if (f->type == FS_FIELDSET) {
+		json_fieldset((fieldset_t *)f->value.ptr);
+	} else if (f->type == FS_REPEATED) {
+		json_repeated((fieldset_t *)f->value.ptr);
+	} else {
+		log_fatal("json", "received unknown output type: %i", f->type);
+	}
+}
+
+// null fields are left out of objects, as json-c does
+static void json_member(field_t *f, int *first)
+{
+	if (f->type == FS_NULL) {
+		return;
+	}
+	if (!*first) {
+		obuf_putc(&out, ',');
+	}
+	*first = 0;
+	json_string(f->name);
+	obuf_putc(&out, ':');
+	json_value(f);
+}
+
+static void json_fieldset(fieldset_t *fs)
+{
+	int first = 1;
+	obuf_putc(&out, '{');
+	for (int i = 0; i < fs->len; i++) {
+		json_member(&(fs->fields[i]), &first);
+	}
+	obuf_putc(&out, '}');
+}
+
+static void json_repeated(fieldset_t *fs)
+{
+	obuf_putc(&out, '[');
+	for (int i = 0; i < fs->len; i++) {
+		if (i) {
+			obuf_putc(&out, ',');
+		}
+		json_value(&(fs->fields[i]));
+	}
+	obuf_putc(&out, ']');
+}
+
+static void json_end_record(void)
+{
+	obuf_putc(&out, '\n');
+	obuf_end_record(&out);
+}
+
 int json_output_to_file(fieldset_t *fs)
 {
-	if (!file) {
+	if (fd < 0) {
 		return EXIT_SUCCESS;
 	}
-	json_object *record = fs_to_jsonobj(fs);
-	fprintf(file, "%s\n",
-		json_object_to_json_string_ext(record, JSON_C_TO_STRING_PLAIN));
-	fflush(file);
-	check_and_log_file_error(file, "json");
-	json_object_put(record);
+	if (use_json_c) {
+		json_write_record(fs_to_jsonobj(fs));
+		return EXIT_SUCCESS;
+	}
+	json_fieldset(fs);
+	json_end_record();
+	return EXIT_SUCCESS;
+}
+
+int json_output_view_to_file(fs_view_t *view)
+{
+	if (fd < 0) {
+		return EXIT_SUCCESS;
+	}
+	if (use_json_c) {
+		json_write_record(view_to_jsonobj(view));
+		return EXIT_SUCCESS;
+	}
+	int first = 1;
+	obuf_putc(&out, '{');
+	for (int i = 0; i < fs_view_len(view); i++) {
+		json_member(fs_view_field(view, i), &first);
+	}
+	obuf_putc(&out, '}');
+	json_end_record();
 	return EXIT_SUCCESS;
 }
 
@@ -130,9 +336,9 @@ int json_output_file_close(UNUSED struct state_conf *c,
 			   UNUSED struct state_send *s,
 			   UNUSED struct state_recv *r)
 {
-	if (file) {
-		fflush(file);
-		fclose(file);
+	if (fd >= 0) {
+		obuf_close(&out);
+		fd = -1;
 	}
 	return EXIT_SUCCESS;
 }
@@ -153,10 +359,15 @@ output_module_t module_json_file = {
     .update_interval = 0,
     .close = &json_output_file_close,
     .process_ip = &json_output_to_file,
+    .process_view = &json_output_view_to_file,
     .supports_dynamic_output = DYNAMIC_SUPPORT,
     .helptext =
 	"Outputs one or more output fields as a json valid file. By default, the \n"
 	"probe module does not filter out duplicates or limit to successful fields, \n"
 	"but rather includes all received packets. Fields can be controlled by \n"
 	"setting --output-fields. Filtering out failures and duplicate packets can \n"
-	"be achieved by setting an --output-filter."};
+	"be achieved by setting an --output-filter. Records are buffered as \n"
+	"with the csv module (flush-bytes=<n>,flush-ms=<n>,io=uring in \n"
+	"--output-args), \n"
+	"binary fields are hex unless binary=base64 is given, and \n"
+	"encoder=json-c builds them with json-c instead of streaming them."};
@@ -17,3 +17,14 @@
 #include "fieldset.h"
 
 int print_json_fieldset(fieldset_t *fs);
+
+#include <json.h>
+
+// a json-c object of the fields, null ones left out
+json_object *fs_to_jsonobj(fieldset_t *fs);
+json_object *view_to_jsonobj(fs_view_t *view);
+
+#include "output_buffer.h"
+
+// a JSON string, escaped as json-c escapes it
+void json_write_string(output_buffer_t *ob, const char *str);
@@ -0,0 +1,331 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Publishes results as typed records into a shared memory ring (see
+ * lib/shmring.h for the layout and the consumer API), so that a tool running
+ * alongside the scan reads them in place instead of parsing text from a
+ * pipe. Each record holds the output fields in order, nested fieldsets and
+ * repeated fields included.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+
+#include "../../lib/includes.h"
+#include "../../lib/logger.h"
+#include "../../lib/shmring.h"
+#include "../../lib/xalloc.h"
+#include "../fieldset.h"
+
+#include "output_modules.h"
+#include "module_shm.h"
+
+#define SHM_DEFAULT_NAME "/zmap"
+#define SHM_DEFAULT_SIZE (64 * 1024 * 1024)
+
+static shmring_t *ring = NULL;
+static int num_fields = 0;
+static int block = 1;
+static uint64_t published = 0;
+static uint64_t dropped = 0;
+static uint64_t oversized = 0;
+
+uint8_t shm_field_type(const char *type)
+{
+	if (!strcmp(type, "int")) {
+		return SHMRING_UINT64;
+	} else if (!strcmp(type, "bool")) {
+		return SHMRING_BOOL;
+	} else if (!strcmp(type, "binary")) {
+		return SHMRING_BINARY;
+	} else if (!strcmp(type, "ip")) {
+		return SHMRING_IPV4;
+	} else if (!strcmp(type, "repeated")) {
+		return SHMRING_LIST;
+	}
+	return SHMRING_STRING;
+}
+
+static uint32_t name_len(const field_t *f, int named)
+{
+	size_t len = named ? strlen(f->name) : 0;
+	return len > UINT8_MAX ? UINT8_MAX : (uint32_t)len;
+}
+
+// bytes of value, the NUL after a string included
+static uint32_t value_len(const field_t *f)
+{
+	switch (f->type) {
+	case FS_UINT64:
+	case FS_BOOL:
+		return 8;
+	case FS_STRING:
+		return (uint32_t)f->len + 1;
+	case FS_BINARY:
+		return (uint32_t)f->len;
+	case FS_IPV4:
+		return 4;
+	case FS_IPV6:
+		return 16;
+	case FS_FIELDSET:
+	case FS_REPEATED: {
+		const fieldset_t *fs = f->value.ptr;
+		uint32_t len = 8;
+		for (int i = 0; i < fs->len; i++) {
+			const field_t *m = &fs->fields[i];
+			len += shmring_field_size(
+			    name_len(m, f->type == FS_FIELDSET), value_len(m));
+		}
+		return len;
+	}
+	default:
+		return 0;
+	}
+}
+
+static uint8_t *put_field(uint8_t *p, const field_t *f, int named)
+{
+	static const uint8_t types[] = {
+	    [FS_STRING] = SHMRING_STRING, [FS_UINT64] = SHMRING_UINT64,
+	    [FS_BINARY] = SHMRING_BINARY, [FS_NULL] = SHMRING_NULL,
+	    [FS_FIELDSET] = SHMRING_RECORD, [FS_REPEATED] = SHMRING_LIST,
+	    [FS_BOOL] = SHMRING_BOOL,	  [FS_IPV4] = SHMRING_IPV4,
+	    [FS_IPV6] = SHMRING_IPV6};
+	shmring_field_t *hdr = (shmring_field_t *)p;
+	int known = f->type >= 0 && f->type <= FS_IPV6 && f->type;
+	uint32_t len = known ? value_len(f) : 0;
+	uint32_t nlen = name_len(f, named);
+	hdr->type = known ? types[f->type] : SHMRING_NULL;
+	hdr->name_len = (uint8_t)nlen;
+	hdr->reserved = 0;
+	hdr->len = hdr->type == SHMRING_STRING ? len - 1 : len;
+	p += sizeof(*hdr);
+	if (nlen) {
+		memcpy(p, f->name, nlen);
+	}
+	memset(p + nlen, 0, shmring_align(nlen) - nlen);
+	p += shmring_align(nlen);
+	uint8_t *v = p;
+	switch (hdr->type) {
+	case SHMRING_UINT64:
+	case SHMRING_BOOL:
+		memcpy(v, &f->value.num, 8);
+		break;
+	case SHMRING_STRING:
+		memcpy(v, f->value.ptr, len - 1);
+		v[len - 1] = '\0';
+		break;
+	case SHMRING_BINARY:
+	case SHMRING_IPV6:
+		if (len) {
+			memcpy(v, f->value.ptr, len);
+		}
+		break;
+	case SHMRING_IPV4: {
+		uint32_t ip = (uint32_t)f->value.num;
+		memcpy(v, &ip, 4);
+		break;
+	}
+	case SHMRING_LIST:
+	case SHMRING_RECORD: {
+		const fieldset_t *fs = f->value.ptr;
+		uint32_t count = (uint32_t)fs->len;
+		memcpy(v, &count, 4);
+		memset(v + 4, 0, 4);
+		uint8_t *m = v + 8;
+		for (int i = 0; i < fs->len; i++) {
+			m = put_field(m, &fs->fields[i],
+				      hdr->type == SHMRING_RECORD);
+		}
+		break;
+	}
+	}
+	memset(v + len, 0, shmring_align(len) - len);
+	return v + shmring_align(len);
+}
+
+static void parse_args(const char *args, const char **name, size_t *size)
+{
+	static char name_buf[256];
+	const char *p = args;
+	while (p && *p) {
+		size_t n = strcspn(p, ",");
+		if (n > 5 && !strncmp(p, "name=", 5)) {
+			if (n - 5 >= sizeof(name_buf)) {
+				log_fatal("shm", "shared memory name too long");
+			}
+			memcpy(name_buf, p + 5, n - 5);
+			name_buf[n - 5] = '\0';
+			*name = name_buf;
+		} else if (n > 5 && !strncmp(p, "size=", 5)) {
+			char *end;
+			unsigned long long v = strtoull(p + 5, &end, 10);
+			switch (*end) {
+			case 'K':
+				v <<= 10;
+				end++;
+				break;
+			case 'M':
+				v <<= 20;
+				end++;
+				break;
+			case 'G':
+				v <<= 30;
+				end++;
+				break;
+			}
+			if (end != p + n || v < 4096) {
+				log_fatal("shm", "invalid ring size: %.*s",
+					  (int)(n - 5), p + 5);
+			}
+			*size = (size_t)v;
+		} else if (n == strlen("full=drop") &&
+			   !strncmp(p, "full=drop", n)) {
+			block = 0;
+		} else if (n == strlen("full=block") &&
+			   !strncmp(p, "full=block", n)) {
+			block = 1;
+		}
+		p += n;
+		if (*p == ',') {
+			p++;
+		}
+	}
+}
+
+int shm_init(struct state_conf *conf, const char **fields, int fieldlens)
+{
+	assert(conf);
+	const char *name = SHM_DEFAULT_NAME;
+	size_t size = SHM_DEFAULT_SIZE;
+	parse_args(conf->output_args, &name, &size);
+	uint8_t *types = xcalloc((size_t)fieldlens + 1, 1);
+	for (int i = 0; i < fieldlens; i++) {
+		int def = conf->fsconf.translation.translation[i];
+		types[i] = shm_field_type(conf->fsconf.defs.fielddefs[def].type);
+	}
+	ring = shmring_create(name, size, fields, types, (uint32_t)fieldlens);
+	xfree(types);
+	if (!ring) {
+		log_fatal("shm", "could not create shared memory ring %s: %s",
+			  name, strerror(errno));
+	}
+	num_fields = fieldlens;
+	log_info("shm", "publishing results to shared memory ring %s (%" PRIu64
+			" bytes), %s when full",
+		 name, ring->hdr->data_len, block ? "waiting" : "dropping");
+	return EXIT_SUCCESS;
+}
+
+uint32_t shm_record_size(shm_field_fn field, const void *arg, int n)
+{
+	uint32_t len = sizeof(shmring_record_t);
+	for (int i = 0; i < n; i++) {
+		len += shmring_field_size(0, value_len(field(arg, i)));
+	}
+	return len;
+}
+
+void shm_put_record(void *rec, uint32_t len, shm_field_fn field,
+		    const void *arg, int n)
+{
+	shmring_record_t *hdr = rec;
+	hdr->len = len;
+	hdr->num_fields = (uint32_t)n;
+	uint8_t *p = (uint8_t *)(hdr + 1);
+	for (int i = 0; i < n; i++) {
+		p = put_field(p, field(arg, i), 0);
+	}
+}
+
+static void publish(shm_field_fn field, const void *arg)
+{
+	uint32_t len = shm_record_size(field, arg, num_fields);
+	shmring_record_t *rec = shmring_reserve(ring, len, block);
+	if (!rec) {
+		if (len > ring->hdr->data_len / 4) {
+			oversized++;
+		} else {
+			dropped++;
+		}
+		return;
+	}
+	shm_put_record(rec, len, field, arg, num_fields);
+	shmring_publish(ring);
+	published++;
+}
+
+const field_t *shm_fieldset_field(const void *arg, int i)
+{
+	return &((const fieldset_t *)arg)->fields[i];
+}
+
+const field_t *shm_view_field(const void *arg, int i)
+{
+	return fs_view_field((fs_view_t *)arg, i);
+}
+
+int shm_process(fieldset_t *fs)
+{
+	if (ring) {
+		publish(shm_fieldset_field, fs);
+	}
+	return EXIT_SUCCESS;
+}
+
+int shm_process_view(fs_view_t *view)
+{
+	if (ring) {
+		publish(shm_view_field, view);
+	}
+	return EXIT_SUCCESS;
+}
+
+int shm_close(UNUSED struct state_conf *c, UNUSED struct state_send *s,
+	      UNUSED struct state_recv *r)
+{
+	if (!ring) {
+		return EXIT_SUCCESS;
+	}
+	shmring_close(ring);
+	ring = NULL;
+	log_info("shm", "published %" PRIu64 " results", published);
+	if (dropped) {
+		log_warn("shm", "dropped %" PRIu64 " results while the ring "
+				"was full", dropped);
+	}
+	if (oversized) {
+		log_warn("shm", "dropped %" PRIu64 " results too large for the "
+				"ring", oversized);
+	}
+	return EXIT_SUCCESS;
+}
+
+output_module_t module_shm = {
+    .name = "shm",
+    .init = &shm_init,
+    .start = NULL,
+    .update = NULL,
+    .update_interval = 0,
+    .close = &shm_close,
+    .process_ip = &shm_process,
+    .process_view = &shm_process_view,
+    .supports_dynamic_output = DYNAMIC_SUPPORT,
+    .helptext =
+	"Publishes the output fields as typed records into a POSIX shared "
+	"memory ring, read in place by other processes with the consumer API "
+	"in lib/shmring.h. --output-args: name=<shm name> (default /zmap), "
+	"size=<bytes> of ring (K, M or G suffix, default 64M), full=block to "
+	"wait for the reader when the ring is full (default) or full=drop to "
+	"drop results instead. The ring is left in place at the end of the "
+	"scan for the reader to finish and remove."};
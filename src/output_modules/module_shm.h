@@ -0,0 +1,32 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef MODULE_SHM_H
+#define MODULE_SHM_H
+
+#include <stdint.h>
+
+#include "../fieldset.h"
+
+// Records in the layout of lib/shmring.h, which the stream module sends as
+// its binary format too. A record's fields are field(arg, 0) to
+// field(arg, n - 1).
+typedef const field_t *(*shm_field_fn)(const void *arg, int i);
+
+const field_t *shm_fieldset_field(const void *arg, int i);
+const field_t *shm_view_field(const void *arg, int i);
+
+// the SHMRING_ type of a field definition's type
+uint8_t shm_field_type(const char *type);
+// bytes of the record, a multiple of 8
+uint32_t shm_record_size(shm_field_fn field, const void *arg, int n);
+// writes the record of len bytes (from shm_record_size) to rec, 8-aligned
+void shm_put_record(void *rec, uint32_t len, shm_field_fn field,
+		    const void *arg, int n);
+
+#endif // MODULE_SHM_H
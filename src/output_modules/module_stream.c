@@ -0,0 +1,694 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Streams results to a collector over TCP or a Unix socket, in batches of
+ * records. Every frame is a 16 byte header followed by its payload:
+ *
+ *   uint32 length of the frame after this field, big-endian
+ *   uint8  kind: 0 schema, 1 json batch, 2 binary batch
+ *   uint8  unused[3]
+ *   uint32 records in the payload (fields for a schema), big-endian
+ *   uint32 unused
+ *
+ * Each connection begins with the schema, one entry per output field of its
+ * SHMRING_ type (lib/shmring.h), name length and name. A json batch holds
+ * one object per line, a binary batch records in the layout of the shared
+ * memory ring, in the scanner's byte order.
+ *
+ * The output thread never blocks on the collector: batches are queued up to
+ * buffer= bytes and sent as far as the socket takes them whenever results
+ * come in, and once the queue is full further batches are dropped and
+ * counted. A lost connection is retried with backoff, from the start of the
+ * batch it was lost in. At the end of the scan the queue gets drain-ms to
+ * go out.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include "../../lib/includes.h"
+#include "../../lib/logger.h"
+#include "../../lib/xalloc.h"
+#include "../fieldset.h"
+
+#include "output_modules.h"
+#include "module_json.h"
+#include "module_shm.h"
+
+#define STREAM_KIND_SCHEMA 0
+#define STREAM_KIND_JSON 1
+#define STREAM_KIND_BINARY 2
+#define STREAM_HEADER_LEN 16
+
+#define STREAM_DEFAULT_BATCH_RECORDS 1024
+#define STREAM_DEFAULT_BATCH_BYTES (256 * 1024)
+#define STREAM_DEFAULT_LINGER_MS 100
+#define STREAM_DEFAULT_BUFFER (64 * 1024 * 1024)
+#define STREAM_DEFAULT_DRAIN_MS 10000
+// reconnects back off from the first delay to the last
+#define STREAM_RETRY_MIN_NS 100000000ULL
+#define STREAM_RETRY_MAX_NS 10000000000ULL
+// while batches are queued, how often sending is retried between batches
+#define STREAM_PUMP_NS 1000000ULL
+
+struct batch {
+	struct batch *next;
+	size_t len; // header included
+	size_t cap;
+	uint32_t records;
+	uint64_t started;
+	uint8_t data[] __attribute__((aligned(8)));
+};
+
+enum stream_state { STREAM_DOWN, STREAM_CONNECTING, STREAM_UP };
+
+static struct {
+	const char *target;
+	struct sockaddr_storage *addrs;
+	socklen_t *addr_lens;
+	int num_addrs;
+	int next_addr;
+	int binary;
+	uint32_t batch_records;
+	size_t batch_bytes;
+	uint64_t linger_ns;
+	size_t buffer;
+	uint64_t drain_ms;
+	int num_fields;
+
+	uint8_t *schema;
+	size_t schema_len;
+
+	struct batch *cur;
+	struct batch *head;
+	struct batch *tail;
+	size_t queued;
+	uint64_t last_pump;
+
+	enum stream_state state;
+	int sock;
+	// of the schema and the batch at the head, on this connection
+	size_t schema_sent;
+	size_t head_sent;
+	uint64_t retry_at;
+	uint64_t retry_ns;
+	int reported_down;
+
+	uint64_t sent_batches;
+	uint64_t sent_records;
+	uint64_t sent_bytes;
+	uint64_t dropped_batches;
+	uint64_t dropped_records;
+} st = {.sock = -1};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void put_header(uint8_t *p, size_t len, uint8_t kind, uint32_t count)
+{
+	uint32_t v = htonl((uint32_t)(len - 4));
+	memcpy(p, &v, 4);
+	memset(p + 4, 0, STREAM_HEADER_LEN - 4);
+	p[4] = kind;
+	v = htonl(count);
+	memcpy(p + 8, &v, 4);
+}
+
+// value of the argument p (n bytes) if it is key=value
+static const char *arg_value(const char *p, size_t n, const char *key,
+			     size_t *vlen)
+{
+	size_t klen = strlen(key);
+	if (n <= klen || strncmp(p, key, klen) || p[klen] != '=') {
+		return NULL;
+	}
+	*vlen = n - klen - 1;
+	return p + klen + 1;
+}
+
+// a number with an optional K, M or G suffix
+static uint64_t parse_number(const char *key, const char *v, size_t len,
+			     int suffix)
+{
+	char tmp[32];
+	if (!len || len >= sizeof(tmp) || v[0] == '-') {
+		log_fatal("stream", "invalid value for output argument %s", key);
+	}
+	memcpy(tmp, v, len);
+	tmp[len] = '\0';
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(tmp, &end, 10);
+	if (suffix) {
+		switch (*end) {
+		case 'K':
+			n <<= 10;
+			end++;
+			break;
+		case 'M':
+			n <<= 20;
+			end++;
+			break;
+		case 'G':
+			n <<= 30;
+			end++;
+			break;
+		}
+	}
+	if (errno || *end != '\0') {
+		log_fatal("stream", "invalid value for output argument %s: %s",
+			  key, tmp);
+	}
+	return (uint64_t)n;
+}
+
+static void resolve(const char *target)
+{
+	if (!strncmp(target, "unix:", 5)) {
+		struct sockaddr_un *un =
+		    xcalloc(1, sizeof(struct sockaddr_storage));
+		const char *path = target + 5;
+		if (!*path || strlen(path) >= sizeof(un->sun_path)) {
+			log_fatal("stream", "invalid unix socket path %s", path);
+		}
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, path);
+		st.addrs = (struct sockaddr_storage *)un;
+		st.addr_lens = xmalloc(sizeof(socklen_t));
+		st.addr_lens[0] = sizeof(struct sockaddr_un);
+		st.num_addrs = 1;
+		return;
+	}
+	if (strncmp(target, "tcp:", 4)) {
+		log_fatal("stream", "connect= must be tcp:<host>:<port> or "
+				    "unix:<path>, not %s",
+			  target);
+	}
+	char *host = strdup(target + 4);
+	char *port = strrchr(host, ':');
+	if (!port || port == host) {
+		log_fatal("stream", "connect= must be tcp:<host>:<port>, not %s",
+			  target);
+	}
+	*port++ = '\0';
+	// [address]:port
+	if (host[0] == '[' && port[-2] == ']') {
+		port[-2] = '\0';
+		memmove(host, host + 1, strlen(host));
+	}
+	struct addrinfo hints = {.ai_family = AF_UNSPEC,
+				 .ai_socktype = SOCK_STREAM};
+	struct addrinfo *res = NULL;
+	int rc = getaddrinfo(host, port, &hints, &res);
+	if (rc) {
+		log_fatal("stream", "unable to resolve %s: %s", target,
+			  gai_strerror(rc));
+	}
+	for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+		st.num_addrs++;
+	}
+	st.addrs = xcalloc(st.num_addrs, sizeof(struct sockaddr_storage));
+	st.addr_lens = xcalloc(st.num_addrs, sizeof(socklen_t));
+	int i = 0;
+	for (struct addrinfo *ai = res; ai; ai = ai->ai_next, i++) {
+		memcpy(&st.addrs[i], ai->ai_addr, ai->ai_addrlen);
+		st.addr_lens[i] = ai->ai_addrlen;
+	}
+	freeaddrinfo(res);
+	free(host);
+}
+
+static void parse_args(const char *args)
+{
+	const char *p = args;
+	static char target[512];
+	while (p && *p) {
+		size_t n = strcspn(p, ",");
+		const char *v;
+		size_t vlen;
+		if ((v = arg_value(p, n, "connect", &vlen))) {
+			if (vlen >= sizeof(target)) {
+				log_fatal("stream", "connect= too long");
+			}
+			memcpy(target, v, vlen);
+			target[vlen] = '\0';
+			st.target = target;
+		} else if ((v = arg_value(p, n, "format", &vlen))) {
+			if (vlen == strlen("binary") &&
+			    !strncmp(v, "binary", vlen)) {
+				st.binary = 1;
+			} else if (vlen == strlen("json") &&
+				   !strncmp(v, "json", vlen)) {
+				st.binary = 0;
+			} else {
+				log_fatal("stream", "invalid value for output "
+						    "argument format, use json "
+						    "or binary");
+			}
+		} else if ((v = arg_value(p, n, "batch-records", &vlen))) {
+			st.batch_records =
+			    (uint32_t)parse_number("batch-records", v, vlen, 0);
+		} else if ((v = arg_value(p, n, "batch-bytes", &vlen))) {
+			st.batch_bytes = parse_number("batch-bytes", v, vlen, 1);
+		} else if ((v = arg_value(p, n, "linger-ms", &vlen))) {
+			st.linger_ns =
+			    parse_number("linger-ms", v, vlen, 0) * 1000000ULL;
+		} else if ((v = arg_value(p, n, "buffer", &vlen))) {
+			st.buffer = parse_number("buffer", v, vlen, 1);
+		} else if ((v = arg_value(p, n, "drain-ms", &vlen))) {
+			st.drain_ms = parse_number("drain-ms", v, vlen, 0);
+		} else {
+			log_fatal("stream", "unknown output argument %.*s",
+				  (int)n, p);
+		}
+		p += n;
+		if (*p == ',') {
+			p++;
+		}
+	}
+	if (!st.target) {
+		log_fatal("stream", "the stream module needs a collector, "
+				    "--output-args=connect=tcp:<host>:<port> "
+				    "or connect=unix:<path>");
+	}
+	if (!st.batch_records) {
+		log_fatal("stream", "batch-records must be at least 1");
+	}
+	if (st.batch_bytes < STREAM_HEADER_LEN * 2 ||
+	    st.batch_bytes > UINT32_MAX / 2) {
+		log_fatal("stream", "invalid batch-bytes");
+	}
+	if (st.buffer < st.batch_bytes) {
+		log_fatal("stream", "buffer must hold at least one batch of "
+				    "batch-bytes");
+	}
+}
+
+static void build_schema(struct state_conf *conf, const char **fields,
+			 int fieldlens)
+{
+	size_t len = STREAM_HEADER_LEN;
+	for (int i = 0; i < fieldlens; i++) {
+		size_t n = strlen(fields[i]);
+		len += 2 + (n > UINT8_MAX ? UINT8_MAX : n);
+	}
+	st.schema = xmalloc(len);
+	put_header(st.schema, len, STREAM_KIND_SCHEMA, (uint32_t)fieldlens);
+	uint8_t *p = st.schema + STREAM_HEADER_LEN;
+	for (int i = 0; i < fieldlens; i++) {
+		int def = conf->fsconf.translation.translation[i];
+		size_t n = strlen(fields[i]);
+		n = n > UINT8_MAX ? UINT8_MAX : n;
+		*p++ = shm_field_type(conf->fsconf.defs.fielddefs[def].type);
+		*p++ = (uint8_t)n;
+		memcpy(p, fields[i], n);
+		p += n;
+	}
+	st.schema_len = len;
+}
+
+static struct batch *new_batch(size_t cap)
+{
+	struct batch *b = xmalloc(sizeof(struct batch) + cap);
+	b->next = NULL;
+	b->len = STREAM_HEADER_LEN;
+	b->cap = cap;
+	b->records = 0;
+	b->started = now_ns();
+	return b;
+}
+
+static void disconnect(int err)
+{
+	if (st.sock >= 0) {
+		close(st.sock);
+		st.sock = -1;
+	}
+	if (!st.reported_down) {
+		log_warn("stream", "lost the collector at %s (%s), queueing "
+				   "results and retrying",
+			 st.target, strerror(err));
+		st.reported_down = 1;
+	}
+	st.state = STREAM_DOWN;
+	st.head_sent = 0;
+	st.next_addr = (st.next_addr + 1) % st.num_addrs;
+	st.retry_at = now_ns() + st.retry_ns;
+	st.retry_ns *= 2;
+	if (st.retry_ns > STREAM_RETRY_MAX_NS) {
+		st.retry_ns = STREAM_RETRY_MAX_NS;
+	}
+}
+
+static void connected(void)
+{
+	st.state = STREAM_UP;
+	st.schema_sent = 0;
+	st.head_sent = 0;
+	st.retry_ns = STREAM_RETRY_MIN_NS;
+	if (st.reported_down) {
+		log_info("stream", "connected to the collector at %s",
+			 st.target);
+		st.reported_down = 0;
+	}
+}
+
+static void start_connect(void)
+{
+	const struct sockaddr_storage *addr = &st.addrs[st.next_addr];
+	st.sock = socket(addr->ss_family,
+			 SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (st.sock < 0) {
+		disconnect(errno);
+		return;
+	}
+	if (!connect(st.sock, (const struct sockaddr *)addr,
+		     st.addr_lens[st.next_addr])) {
+		connected();
+	} else if (errno == EINPROGRESS) {
+		st.state = STREAM_CONNECTING;
+	} else {
+		disconnect(errno);
+	}
+}
+
+// sends as much as the socket takes right now, connecting first if needed
+static void pump(void)
+{
+	st.last_pump = now_ns();
+	if (st.state == STREAM_DOWN) {
+		if (st.last_pump < st.retry_at) {
+			return;
+		}
+		start_connect();
+	}
+	if (st.state == STREAM_CONNECTING) {
+		struct pollfd pfd = {.fd = st.sock, .events = POLLOUT};
+		if (poll(&pfd, 1, 0) <= 0) {
+			return;
+		}
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(st.sock, SOL_SOCKET, SO_ERROR, &err, &len) ||
+		    err) {
+			disconnect(err ? err : errno);
+			return;
+		}
+		connected();
+	}
+	if (st.state != STREAM_UP) {
+		return;
+	}
+	while (st.schema_sent < st.schema_len || st.head) {
+		const uint8_t *data;
+		size_t len;
+		if (st.schema_sent < st.schema_len) {
+			data = st.schema + st.schema_sent;
+			len = st.schema_len - st.schema_sent;
+		} else {
+			data = st.head->data + st.head_sent;
+			len = st.head->len - st.head_sent;
+		}
+		ssize_t n = send(st.sock, data, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				disconnect(errno);
+			}
+			return;
+		}
+		st.sent_bytes += (uint64_t)n;
+		if (st.schema_sent < st.schema_len) {
+			st.schema_sent += (size_t)n;
+			continue;
+		}
+		st.head_sent += (size_t)n;
+		if (st.head_sent < st.head->len) {
+			continue;
+		}
+		struct batch *b = st.head;
+		st.head = b->next;
+		if (!st.head) {
+			st.tail = NULL;
+		}
+		st.queued -= b->len;
+		st.head_sent = 0;
+		st.sent_batches++;
+		st.sent_records += b->records;
+		xfree(b);
+	}
+}
+
+// queues the current batch, or drops it if the queue has no room for it
+static void seal(void)
+{
+	struct batch *b = st.cur;
+	if (!b || !b->records) {
+		return;
+	}
+	st.cur = NULL;
+	if (st.queued + b->len > st.buffer) {
+		st.dropped_batches++;
+		st.dropped_records += b->records;
+		xfree(b);
+		return;
+	}
+	put_header(b->data, b->len,
+		   st.binary ? STREAM_KIND_BINARY : STREAM_KIND_JSON,
+		   b->records);
+	if (st.tail) {
+		st.tail->next = b;
+	} else {
+		st.head = b;
+	}
+	st.tail = b;
+	st.queued += b->len;
+}
+
+// room for len more bytes of records in the current batch
+static uint8_t *reserve(size_t len)
+{
+	if (st.cur && st.cur->records && st.cur->len + len > st.batch_bytes) {
+		seal();
+	}
+	if (!st.cur) {
+		st.cur = new_batch(st.batch_bytes);
+	}
+	// a record too large for a batch gets one of its own
+	if (st.cur->len + len > st.cur->cap) {
+		st.cur->cap = st.cur->len + len;
+		st.cur = xrealloc(st.cur, sizeof(struct batch) + st.cur->cap);
+	}
+	uint8_t *p = st.cur->data + st.cur->len;
+	st.cur->len += len;
+	return p;
+}
+
+static void end_record(void)
+{
+	struct batch *b = st.cur;
+	b->records++;
+	uint64_t now = now_ns();
+	int sealed = 0;
+	if (b->records >= st.batch_records || b->len >= st.batch_bytes ||
+	    now - b->started >= st.linger_ns) {
+		seal();
+		sealed = 1;
+	}
+	if (st.head && (sealed || now - st.last_pump >= STREAM_PUMP_NS)) {
+		pump();
+	}
+}
+
+static void put_json(json_object *obj)
+{
+	const char *s = json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+	size_t len = strlen(s);
+	uint8_t *p = reserve(len + 1);
+	memcpy(p, s, len);
+	p[len] = '\n';
+	json_object_put(obj);
+	end_record();
+}
+
+static void put_binary(shm_field_fn field, const void *arg)
+{
+	uint32_t len = shm_record_size(field, arg, st.num_fields);
+	shm_put_record(reserve(len), len, field, arg, st.num_fields);
+	end_record();
+}
+
+int stream_init(struct state_conf *conf, const char **fields, int fieldlens)
+{
+	assert(conf);
+	st.batch_records = STREAM_DEFAULT_BATCH_RECORDS;
+	st.batch_bytes = STREAM_DEFAULT_BATCH_BYTES;
+	st.linger_ns = STREAM_DEFAULT_LINGER_MS * 1000000ULL;
+	st.buffer = STREAM_DEFAULT_BUFFER;
+	st.drain_ms = STREAM_DEFAULT_DRAIN_MS;
+	parse_args(conf->output_args);
+	resolve(st.target);
+	st.num_fields = fieldlens;
+	build_schema(conf, fields, fieldlens);
+	st.retry_ns = STREAM_RETRY_MIN_NS;
+	// the first attempt is made now, so a wrong address shows up early
+	st.reported_down = 1;
+	start_connect();
+	st.reported_down = st.state == STREAM_DOWN;
+	if (st.reported_down) {
+		log_warn("stream", "unable to connect to the collector at %s, "
+				   "queueing results and retrying",
+			 st.target);
+	}
+	log_info("stream", "streaming %s batches of up to %u records to %s",
+		 st.binary ? "binary" : "json", st.batch_records, st.target);
+	return EXIT_SUCCESS;
+}
+
+int stream_process(fieldset_t *fs)
+{
+	if (!st.schema) {
+		return EXIT_SUCCESS;
+	}
+	if (st.binary) {
+		put_binary(shm_fieldset_field, fs);
+	} else {
+		put_json(fs_to_jsonobj(fs));
+	}
+	return EXIT_SUCCESS;
+}
+
+int stream_process_view(fs_view_t *view)
+{
+	if (!st.schema) {
+		return EXIT_SUCCESS;
+	}
+	if (st.binary) {
+		put_binary(shm_view_field, view);
+	} else {
+		put_json(view_to_jsonobj(view));
+	}
+	return EXIT_SUCCESS;
+}
+
+// the one place the output thread waits on the collector, for at most
+// drain-ms
+static void drain(void)
+{
+	uint64_t deadline = now_ns() + st.drain_ms * 1000000ULL;
+	for (;;) {
+		pump();
+		uint64_t now = now_ns();
+		if (!st.head || now >= deadline) {
+			return;
+		}
+		int timeout_ms = (int)((deadline - now) / 1000000ULL) + 1;
+		if (st.state == STREAM_DOWN) {
+			if (st.retry_at > now &&
+			    (st.retry_at - now) / 1000000ULL < (uint64_t)timeout_ms) {
+				timeout_ms =
+				    (int)((st.retry_at - now) / 1000000ULL) + 1;
+			}
+			struct timespec ts = {.tv_sec = timeout_ms / 1000,
+					      .tv_nsec = (timeout_ms % 1000) *
+							 1000000L};
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		struct pollfd pfd = {.fd = st.sock, .events = POLLOUT};
+		poll(&pfd, 1, timeout_ms);
+	}
+}
+
+int stream_close(UNUSED struct state_conf *c, UNUSED struct state_send *s,
+		 UNUSED struct state_recv *r)
+{
+	if (!st.schema) {
+		return EXIT_SUCCESS;
+	}
+	seal();
+	drain();
+	uint64_t undelivered = 0;
+	while (st.head) {
+		struct batch *b = st.head;
+		st.head = b->next;
+		undelivered += b->records;
+		xfree(b);
+	}
+	st.tail = NULL;
+	if (st.sock >= 0) {
+		close(st.sock);
+		st.sock = -1;
+	}
+	log_info("stream",
+		 "sent %" PRIu64 " results in %" PRIu64 " batches (%" PRIu64
+		 " bytes) to %s",
+		 st.sent_records, st.sent_batches, st.sent_bytes, st.target);
+	if (st.dropped_records) {
+		log_warn("stream", "dropped %" PRIu64 " results in %" PRIu64
+				   " batches while the queue was full",
+			 st.dropped_records, st.dropped_batches);
+	}
+	if (undelivered) {
+		log_warn("stream", "%" PRIu64 " results were not delivered "
+				   "within drain-ms of the end of the scan",
+			 undelivered);
+	}
+	xfree(st.schema);
+	st.schema = NULL;
+	xfree(st.addrs);
+	xfree(st.addr_lens);
+	return EXIT_SUCCESS;
+}
+
+output_module_t module_stream = {
+    .name = "stream",
+    .init = &stream_init,
+    .start = NULL,
+    .update = NULL,
+    .update_interval = 0,
+    .close = &stream_close,
+    .process_ip = &stream_process,
+    .process_view = &stream_process_view,
+    .supports_dynamic_output = DYNAMIC_SUPPORT,
+    .helptext =
+	"Streams results to a collector in length-prefixed batches, each "
+	"connection starting with the field names and types (see "
+	"module_stream.c for the framing). --output-args: "
+	"connect=tcp:<host>:<port> or connect=unix:<path> (required), "
+	"format=json (one object per line, default) or format=binary (records "
+	"as in the shm module's ring), batch-records=<n> (default 1024) and "
+	"batch-bytes=<n> (default 256K) to end a batch, linger-ms=<n> (default "
+	"100) to end one early at the next result, buffer=<bytes> (default "
+	"64M) of batches queued while the collector is slow or away, beyond "
+	"which batches are dropped and counted, and drain-ms=<n> (default "
+	"10000) to wait at the end of the scan for the queue to go out. "
+	"Lost connections are retried with backoff."};
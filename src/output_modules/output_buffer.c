@@ -0,0 +1,346 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../../lib/logger.h"
+#include "../../lib/util.h"
+#include "../../lib/xalloc.h"
+
+#include "../state.h"
+
+#include "output_buffer.h"
+#include "output_compress.h"
+#include "output_uring.h"
+#include "output_modules.h"
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t parse_arg_value(const char *name, const char *key,
+				const char *val, size_t len)
+{
+	char tmp[32];
+	if (len == 0 || len >= sizeof(tmp)) {
+		log_fatal(name, "invalid value for output argument %s", key);
+	}
+	memcpy(tmp, val, len);
+	tmp[len] = '\0';
+	char *end;
+	errno = 0;
+	unsigned long long v = strtoull(tmp, &end, 10);
+	if (errno || *end != '\0' || tmp[0] == '-') {
+		log_fatal(name, "invalid value for output argument %s: %s", key,
+			  tmp);
+	}
+	return (uint64_t)v;
+}
+
+static void start_compressor(output_buffer_t *ob)
+{
+	ob->comp = ocomp_start(ob->fd, ob->name, zconf.output_compression,
+			       zconf.output_compression_level, ob->cap);
+	ob->buf = ocomp_buffer(ob->comp);
+}
+
+// without io_uring, e.g. on an older kernel, output is written directly
+static void start_uring(output_buffer_t *ob)
+{
+	ob->uring = ouring_start(ob->fd, ob->name, ob->cap);
+	if (!ob->uring) {
+		log_warn(ob->name, "unable to set up io_uring for output, "
+				   "writing directly: %s",
+			 strerror(errno));
+		ob->buf = xmalloc_tag(MEM_OUTPUT, ob->cap);
+		return;
+	}
+	ob->buf = ouring_buffer(ob->uring);
+}
+
+void obuf_init(output_buffer_t *ob, int fd, const char *name,
+	       const char *args)
+{
+	memset(ob, 0, sizeof(*ob));
+	ob->fd = fd;
+	ob->name = name;
+	ob->cap = OBUF_DEFAULT_FLUSH_BYTES;
+	// someone is watching, write records as they arrive
+	int flush_ms = isatty(fd) ? 0 : OBUF_DEFAULT_FLUSH_MS;
+	int use_uring = 0;
+	const char *p = args;
+	while (p && *p) {
+		size_t n = strcspn(p, ",");
+		const char *eq = memchr(p, '=', n);
+		if (eq) {
+			size_t klen = (size_t)(eq - p);
+			const char *val = eq + 1;
+			size_t vlen = n - klen - 1;
+			if (klen == strlen("flush-bytes") &&
+			    !strncmp(p, "flush-bytes", klen)) {
+				ob->cap = parse_arg_value(name, "flush-bytes",
+							  val, vlen);
+				if (ob->cap < 64) {
+					log_fatal(name,
+						  "flush-bytes must be at least 64");
+				}
+			} else if (klen == strlen("flush-ms") &&
+				   !strncmp(p, "flush-ms", klen)) {
+				flush_ms = (int)parse_arg_value(
+				    name, "flush-ms", val, vlen);
+			} else if (klen == strlen("binary") &&
+				   !strncmp(p, "binary", klen)) {
+				if (vlen == strlen("hex") &&
+				    !strncmp(val, "hex", vlen)) {
+					ob->binary = OBUF_BINARY_HEX;
+				} else if (vlen == strlen("base64") &&
+					   !strncmp(val, "base64", vlen)) {
+					ob->binary = OBUF_BINARY_BASE64;
+				} else {
+					log_fatal(name, "invalid value for output "
+							"argument binary, use hex "
+							"or base64");
+				}
+			} else if (klen == strlen("io") &&
+				   !strncmp(p, "io", klen)) {
+				if (vlen == strlen("uring") &&
+				    !strncmp(val, "uring", vlen)) {
+					use_uring = 1;
+				} else if (vlen == strlen("write") &&
+					   !strncmp(val, "write", vlen)) {
+					use_uring = 0;
+				} else {
+					log_fatal(name, "invalid value for output "
+							"argument io, use write "
+							"or uring");
+				}
+			}
+		}
+		p += n;
+		if (*p == ',') {
+			p++;
+		}
+	}
+	ob->flush_ns = (uint64_t)flush_ms * 1000000ULL;
+	ob->rotating = output_rotating();
+	if (zconf.output_compression != OUTPUT_COMPRESSION_NONE) {
+		if (isatty(fd)) {
+			log_fatal(name, "refusing to write compressed output to "
+					"a terminal, use --output-file");
+		}
+		if (use_uring) {
+			log_fatal(name, "io=uring cannot be combined with "
+					"--output-compression");
+		}
+		start_compressor(ob);
+	} else if (use_uring) {
+		start_uring(ob);
+	} else {
+		ob->buf = xmalloc_tag(MEM_OUTPUT, ob->cap);
+	}
+	ob->last_flush = now_ns();
+	log_debug(name, "buffering %zu bytes of output, flushing every %d ms",
+		  ob->cap, flush_ms);
+}
+
+static void write_all(output_buffer_t *ob, const char *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(ob->fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_fatal(ob->name, "unable to write to file: %s",
+				  strerror(errno));
+		}
+		data += n;
+		len -= (size_t)n;
+	}
+}
+
+void obuf_flush(output_buffer_t *ob)
+{
+	ob->written += ob->len;
+	if (ob->comp) {
+		ob->buf = ocomp_submit(ob->comp, ob->buf, ob->len);
+		ob->len = 0;
+	} else if (ob->uring) {
+		ob->buf = ouring_submit(ob->uring, ob->buf, ob->len);
+		ob->len = 0;
+	} else if (ob->len) {
+		write_all(ob, ob->buf, ob->len);
+		ob->len = 0;
+	}
+	ob->last_flush = now_ns();
+}
+
+void obuf_close(output_buffer_t *ob)
+{
+	if (!ob->buf) {
+		return;
+	}
+	obuf_flush(ob);
+	// the buffers belong to the compressor or the io_uring writer
+	if (!ob->comp && !ob->uring) {
+		xfree_tag(MEM_OUTPUT, ob->buf);
+	}
+	if (ob->uring) {
+		ouring_finish(ob->uring);
+		ob->uring = NULL;
+	}
+	if (ob->rotating) {
+		output_rotate_finish(ob->fd, ob->comp, ob->records, ob->written);
+	} else {
+		if (ob->comp) {
+			ocomp_finish(ob->comp);
+		}
+		output_close(ob->fd, ob->name);
+	}
+	ob->comp = NULL;
+	ob->buf = NULL;
+	ob->fd = -1;
+}
+
+void obuf_write_slow(output_buffer_t *ob, const void *data, size_t len)
+{
+	obuf_flush(ob);
+	if (len >= ob->cap && !ob->comp && !ob->uring) {
+		ob->written += len;
+		write_all(ob, data, len);
+		return;
+	}
+	// the compressor and io_uring writer only take whole buffers
+	while (len >= ob->cap) {
+		memcpy(ob->buf, data, ob->cap);
+		ob->len = ob->cap;
+		obuf_flush(ob);
+		data = (const char *)data + ob->cap;
+		len -= ob->cap;
+	}
+	memcpy(ob->buf, data, len);
+	ob->len = len;
+}
+
+// "00" through "99", so integers are built two digits at a time
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+void obuf_put_uint64(output_buffer_t *ob, uint64_t v)
+{
+	char tmp[20];
+	char *p = tmp + sizeof(tmp);
+	while (v >= 100) {
+		p -= 2;
+		memcpy(p, &digit_pairs[(v % 100) * 2], 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, &digit_pairs[v * 2], 2);
+	} else {
+		*--p = (char)('0' + v);
+	}
+	obuf_write(ob, p, (size_t)(tmp + sizeof(tmp) - p));
+}
+
+void obuf_put_hex(output_buffer_t *ob, const uint8_t *data, size_t len)
+{
+	while (len) {
+		if (ob->len + 2 > ob->cap) {
+			obuf_flush(ob);
+		}
+		// as much as fits before the next flush
+		size_t n = (ob->cap - ob->len) / 2;
+		if (n > len) {
+			n = len;
+		}
+		ob->len += hex_encode(ob->buf + ob->len, data, n);
+		data += n;
+		len -= n;
+	}
+}
+
+void obuf_put_base64(output_buffer_t *ob, const uint8_t *data, size_t len)
+{
+	while (len) {
+		if (ob->len + 4 > ob->cap) {
+			obuf_flush(ob);
+		}
+		// whole groups of three as fit, so that padding only ever comes
+		// at the end
+		size_t n = (ob->cap - ob->len) / 4 * 3;
+		if (n > len) {
+			n = len;
+		}
+		ob->len += base64_encode(ob->buf + ob->len, data, n);
+		data += n;
+		len -= n;
+	}
+}
+
+void obuf_put_binary(output_buffer_t *ob, const uint8_t *data, size_t len)
+{
+	if (ob->binary == OBUF_BINARY_BASE64) {
+		obuf_put_base64(ob, data, len);
+	} else {
+		obuf_put_hex(ob, data, len);
+	}
+}
+
+// the segment's trailer goes out with the last of its records, and the
+// writer thread takes over the compressor and finishes it off
+static void obuf_rotate(output_buffer_t *ob)
+{
+	if (ob->segment_end) {
+		ob->segment_end(ob);
+	}
+	obuf_flush(ob);
+	// the segment's writes complete before it is synced and listed
+	if (ob->uring) {
+		ouring_finish(ob->uring);
+	}
+	ob->fd = output_rotate(ob->fd, ob->comp, ob->records, ob->written);
+	if (ob->comp) {
+		start_compressor(ob);
+	} else if (ob->uring) {
+		start_uring(ob);
+	}
+	ob->records = 0;
+	ob->written = 0;
+	if (ob->segment_begin) {
+		ob->segment_begin(ob);
+	}
+}
+
+void obuf_end_records(output_buffer_t *ob, uint64_t n)
+{
+	ob->records += n;
+	if (ob->rotating &&
+	    output_rotate_due(ob->records, ob->written + ob->len)) {
+		obuf_rotate(ob);
+		return;
+	}
+	if (!ob->flush_ns || now_ns() - ob->last_flush >= ob->flush_ns) {
+		obuf_flush(ob);
+	}
+}
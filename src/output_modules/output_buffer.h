@@ -0,0 +1,103 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef OUTPUT_BUFFER_H
+#define OUTPUT_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Records are formatted straight into this buffer and handed to write(2) in
+// batches, once flush_bytes are pending or, at the end of a record, once
+// flush_ms have passed since the last write. Output modules only ever run
+// on one thread at a time, so a module needs a single buffer. With
+// --output-compression, batches go to the compression thread instead, and
+// with io=uring to an io_uring that writes them in the background.
+#define OBUF_DEFAULT_FLUSH_BYTES (64 * 1024)
+#define OBUF_DEFAULT_FLUSH_MS 1000
+
+// how binary fields are written out, binary=hex (default) or binary=base64
+enum obuf_binary_encoding { OBUF_BINARY_HEX, OBUF_BINARY_BASE64 };
+
+struct output_compressor;
+struct output_uring;
+struct output_buffer;
+
+// writes whatever a segment of output begins or ends with, when rotating
+typedef void (*obuf_segment_cb)(struct output_buffer *ob);
+
+typedef struct output_buffer {
+	int fd;
+	const char *name; // module name for log messages
+	char *buf;
+	size_t len;
+	size_t cap;
+	// 0 writes out every record, which is the default on a terminal
+	uint64_t flush_ns;
+	uint64_t last_flush;
+	struct output_compressor *comp; // NULL writes fd directly
+	struct output_uring *uring;	// io=uring, else NULL
+	// in the current segment, which is the whole file unless rotating
+	uint64_t records;
+	uint64_t written;
+	int rotating;
+	obuf_segment_cb segment_begin;
+	obuf_segment_cb segment_end;
+	enum obuf_binary_encoding binary;
+} output_buffer_t;
+
+// args are the module's --output-args (may be NULL), a comma-separated list
+// of key=value pairs. flush-bytes=<n>, flush-ms=<n>, binary=hex|base64 and
+// io=write|uring are handled here and other keys are left to the module.
+void obuf_init(output_buffer_t *ob, int fd, const char *name,
+	       const char *args);
+void obuf_flush(output_buffer_t *ob);
+// flush, then close fd unless it is stdout
+void obuf_close(output_buffer_t *ob);
+
+void obuf_write_slow(output_buffer_t *ob, const void *data, size_t len);
+void obuf_put_uint64(output_buffer_t *ob, uint64_t v);
+void obuf_put_hex(output_buffer_t *ob, const uint8_t *data, size_t len);
+void obuf_put_base64(output_buffer_t *ob, const uint8_t *data, size_t len);
+// in the encoding chosen with binary=
+void obuf_put_binary(output_buffer_t *ob, const uint8_t *data, size_t len);
+// ends n records, flushing when the time threshold has passed and moving on
+// to the next segment when rotating and the current one is due
+void obuf_end_records(output_buffer_t *ob, uint64_t n);
+
+static inline void obuf_end_record(output_buffer_t *ob)
+{
+	obuf_end_records(ob, 1);
+}
+
+static inline void obuf_write(output_buffer_t *ob, const void *data,
+			      size_t len)
+{
+	if (ob->len + len > ob->cap) {
+		obuf_write_slow(ob, data, len);
+		return;
+	}
+	memcpy(ob->buf + ob->len, data, len);
+	ob->len += len;
+}
+
+static inline void obuf_putc(output_buffer_t *ob, char c)
+{
+	if (ob->len == ob->cap) {
+		obuf_flush(ob);
+	}
+	ob->buf[ob->len++] = c;
+}
+
+static inline void obuf_puts(output_buffer_t *ob, const char *s)
+{
+	obuf_write(ob, s, strlen(s));
+}
+
+#endif // OUTPUT_BUFFER_H
@@ -0,0 +1,313 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * The output module's thread fills buffers one after another and the
+ * compression thread works through them in the same order. Buffer
+ * pos % OCOMP_BUFFERS holds the pos'th submission; the producer advances
+ * head once it has filled one and only reuses a buffer after the compressor
+ * has advanced tail past it, so the two never touch the same buffer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef ZSTD
+#include <zstd.h>
+#endif
+#ifdef LZ4
+#include <lz4frame.h>
+#endif
+
+#include "../../lib/includes.h"
+#include "../../lib/logger.h"
+#include "../../lib/xalloc.h"
+#include "../state.h"
+
+#include "output_compress.h"
+
+#define OCOMP_BUFFERS 4
+#define OCOMP_WAIT_NS 100000
+// frames are ended after this long, each one can be checked on its own
+#define OCOMP_FRAME_NS 1000000000ULL
+
+struct output_compressor {
+	int fd;
+	const char *name;
+	int method;
+	size_t buf_size;
+	char *bufs[OCOMP_BUFFERS];
+	size_t lens[OCOMP_BUFFERS];
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+	int stopping;
+	pthread_t thread;
+
+	// compression thread only
+	char *out;
+	size_t out_cap;
+	int in_frame;
+	int dirty; // compressed since the last flush
+	uint64_t frame_start;
+#ifdef ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+#ifdef LZ4
+	LZ4F_cctx *lz4;
+	LZ4F_preferences_t lz4_prefs;
+#endif
+};
+
+static void ocomp_wait(void)
+{
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = OCOMP_WAIT_NS};
+	nanosleep(&ts, NULL);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void write_out(output_compressor_t *c, const char *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(c->fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_fatal(c->name, "unable to write to file: %s",
+				  strerror(errno));
+		}
+		data += n;
+		len -= (size_t)n;
+	}
+}
+
+#ifdef ZSTD
+// mode is ZSTD_e_continue, ZSTD_e_flush or ZSTD_e_end
+static void zstd_compress(output_compressor_t *c, const char *data,
+			  size_t len, ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer in = {.src = data, .size = len, .pos = 0};
+	for (;;) {
+		ZSTD_outBuffer out = {.dst = c->out, .size = c->out_cap, .pos = 0};
+		size_t remaining = ZSTD_compressStream2(c->zstd, &out, &in, mode);
+		if (ZSTD_isError(remaining)) {
+			log_fatal(c->name, "zstd compression failed: %s",
+				  ZSTD_getErrorName(remaining));
+		}
+		write_out(c, c->out, out.pos);
+		if (mode == ZSTD_e_continue ? in.pos == in.size
+					    : remaining == 0) {
+			return;
+		}
+	}
+}
+#endif
+
+#ifdef LZ4
+static void lz4_check(output_compressor_t *c, size_t r)
+{
+	if (LZ4F_isError(r)) {
+		log_fatal(c->name, "lz4 compression failed: %s",
+			  LZ4F_getErrorName(r));
+	}
+}
+#endif
+
+static void compress_chunk(output_compressor_t *c, UNUSED const char *data,
+			   UNUSED size_t len)
+{
+	if (!c->in_frame) {
+#ifdef LZ4
+		if (c->method == OUTPUT_COMPRESSION_LZ4) {
+			size_t n = LZ4F_compressBegin(c->lz4, c->out, c->out_cap,
+						      &c->lz4_prefs);
+			lz4_check(c, n);
+			write_out(c, c->out, n);
+		}
+#endif
+		c->in_frame = 1;
+		c->frame_start = now_ns();
+	}
+	c->dirty = 1;
+#ifdef ZSTD
+	if (c->method == OUTPUT_COMPRESSION_ZSTD) {
+		zstd_compress(c, data, len, ZSTD_e_continue);
+	}
+#endif
+#ifdef LZ4
+	if (c->method == OUTPUT_COMPRESSION_LZ4) {
+		size_t n = LZ4F_compressUpdate(c->lz4, c->out, c->out_cap, data,
+					       len, NULL);
+		lz4_check(c, n);
+		write_out(c, c->out, n);
+	}
+#endif
+}
+
+// writes out whatever the compressor is holding back, ending the frame if
+// end is set
+static void flush_frame(output_compressor_t *c, int end)
+{
+	if (!c->in_frame) {
+		return;
+	}
+#ifdef ZSTD
+	if (c->method == OUTPUT_COMPRESSION_ZSTD) {
+		zstd_compress(c, NULL, 0, end ? ZSTD_e_end : ZSTD_e_flush);
+	}
+#endif
+#ifdef LZ4
+	if (c->method == OUTPUT_COMPRESSION_LZ4) {
+		size_t n = end ? LZ4F_compressEnd(c->lz4, c->out, c->out_cap, NULL)
+			       : LZ4F_flush(c->lz4, c->out, c->out_cap, NULL);
+		lz4_check(c, n);
+		write_out(c, c->out, n);
+	}
+#endif
+	c->dirty = 0;
+	if (end) {
+		c->in_frame = 0;
+	}
+}
+
+static void *start_compressor(void *arg)
+{
+	output_compressor_t *c = arg;
+	for (;;) {
+		int stop = __atomic_load_n(&c->stopping, __ATOMIC_ACQUIRE);
+		uint64_t tail = c->tail;
+		if (tail < __atomic_load_n(&c->head, __ATOMIC_ACQUIRE)) {
+			uint32_t i = tail % OCOMP_BUFFERS;
+			compress_chunk(c, c->bufs[i], c->lens[i]);
+			__atomic_store_n(&c->tail, tail + 1, __ATOMIC_RELEASE);
+			if (now_ns() - c->frame_start >= OCOMP_FRAME_NS) {
+				flush_frame(c, 1);
+			}
+			continue;
+		}
+		if (stop) {
+			break;
+		}
+		// caught up: make everything so far decompressible
+		if (c->dirty) {
+			flush_frame(c, 0);
+		}
+		ocomp_wait();
+	}
+	flush_frame(c, 1);
+	return NULL;
+}
+
+output_compressor_t *ocomp_start(int fd, const char *name, int method,
+				 int level, size_t buf_size)
+{
+	output_compressor_t *c = xcalloc(1, sizeof(output_compressor_t));
+	c->fd = fd;
+	c->name = name;
+	c->method = method;
+	c->buf_size = buf_size;
+	for (int i = 0; i < OCOMP_BUFFERS; i++) {
+		c->bufs[i] = xmalloc(buf_size);
+	}
+	switch (method) {
+#ifdef ZSTD
+	case OUTPUT_COMPRESSION_ZSTD:
+		c->zstd = ZSTD_createCCtx();
+		if (!c->zstd) {
+			log_fatal(name, "unable to create zstd context");
+		}
+		if (ZSTD_isError(ZSTD_CCtx_setParameter(
+			c->zstd, ZSTD_c_compressionLevel, level))) {
+			log_fatal(name, "invalid zstd compression level %d",
+				  level);
+		}
+		ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_checksumFlag, 1);
+		c->out_cap = ZSTD_CStreamOutSize();
+		break;
+#endif
+#ifdef LZ4
+	case OUTPUT_COMPRESSION_LZ4:
+		if (LZ4F_isError(
+			LZ4F_createCompressionContext(&c->lz4, LZ4F_VERSION))) {
+			log_fatal(name, "unable to create lz4 context");
+		}
+		c->lz4_prefs.compressionLevel = level;
+		c->lz4_prefs.frameInfo.contentChecksumFlag =
+		    LZ4F_contentChecksumEnabled;
+		// big enough for a whole buffer and the frame around it
+		c->out_cap = LZ4F_compressBound(buf_size, &c->lz4_prefs) +
+			     LZ4F_HEADER_SIZE_MAX;
+		break;
+#endif
+	default:
+		log_fatal(name, "zmap was built without %s support",
+			  OUTPUT_COMPRESSION_NAMES[method]);
+	}
+	c->out = xmalloc(c->out_cap);
+	if (pthread_create(&c->thread, NULL, start_compressor, c)) {
+		log_fatal(name, "unable to create compression thread");
+	}
+	log_debug(name, "compressing output with %s, level %d",
+		  OUTPUT_COMPRESSION_NAMES[method], level);
+	return c;
+}
+
+char *ocomp_buffer(output_compressor_t *c)
+{
+	return c->bufs[c->head % OCOMP_BUFFERS];
+}
+
+char *ocomp_submit(output_compressor_t *c, char *buf, size_t len)
+{
+	uint64_t head = c->head;
+	uint32_t i = head % OCOMP_BUFFERS;
+	if (buf != c->bufs[i]) {
+		log_fatal(c->name, "output buffer submitted out of order");
+	}
+	if (!len) {
+		return buf;
+	}
+	c->lens[i] = len;
+	__atomic_store_n(&c->head, head + 1, __ATOMIC_RELEASE);
+	// the next buffer is free once the compressor is less than a full
+	// set of buffers behind
+	while (head + 1 - __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE) >=
+	       OCOMP_BUFFERS) {
+		ocomp_wait();
+	}
+	return c->bufs[(head + 1) % OCOMP_BUFFERS];
+}
+
+void ocomp_finish(output_compressor_t *c)
+{
+	__atomic_store_n(&c->stopping, 1, __ATOMIC_RELEASE);
+	if (pthread_join(c->thread, NULL)) {
+		log_fatal(c->name, "unable to join compression thread");
+	}
+#ifdef ZSTD
+	ZSTD_freeCCtx(c->zstd);
+#endif
+#ifdef LZ4
+	LZ4F_freeCompressionContext(c->lz4);
+#endif
+	for (int i = 0; i < OCOMP_BUFFERS; i++) {
+		xfree(c->bufs[i]);
+	}
+	xfree(c->out);
+	xfree(c);
+}
@@ -0,0 +1,33 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef OUTPUT_COMPRESS_H
+#define OUTPUT_COMPRESS_H
+
+#include <stddef.h>
+
+// Compresses output on a thread of its own (--output-compression). Filled
+// buffers are handed over whole and compressed into a stream of zstd or lz4
+// frames on fd. Whatever has been handed over is flushed once the thread
+// runs out of work, and frames are ended once they are a second old, so a
+// file cut short by a crash still decompresses up to near its end.
+typedef struct output_compressor output_compressor_t;
+
+// buffers are buf_size bytes
+output_compressor_t *ocomp_start(int fd, const char *name, int method,
+				 int level, size_t buf_size);
+// the buffer to fill first
+char *ocomp_buffer(output_compressor_t *c);
+// hands over the len bytes in buf, which must be the buffer last returned,
+// and returns the next one to fill, waiting while all are queued
+char *ocomp_submit(output_compressor_t *c, char *buf, size_t len);
+// compresses everything handed over, ends the stream and frees c along with
+// its buffers
+void ocomp_finish(output_compressor_t *c);
+
+#endif // OUTPUT_COMPRESS_H
@@ -7,15 +7,38 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <json.h>
+
+#include "../../lib/includes.h"
+#include "../../lib/logger.h"
+#include "../../lib/xalloc.h"
 
 #include "output_modules.h"
+#include "output_compress.h"
 
 extern output_module_t module_csv_file;
 extern output_module_t module_json_file;
+extern output_module_t module_arrow_file;
+extern output_module_t module_shm;
+extern output_module_t module_stream;
+extern output_module_t module_bitmap;
+extern output_module_t module_callback;
+extern output_module_t module_aggregate;
 
 output_module_t *output_modules[] = {
-    &module_csv_file, &module_json_file,
+    &module_csv_file, &module_json_file, &module_arrow_file, &module_shm,
+    &module_stream, &module_bitmap, &module_callback, &module_aggregate,
     // ADD YOUR MODULE HERE
 };
 
@@ -39,3 +62,305 @@ void print_output_modules(void)
 		printf("%s\n", output_modules[i]->name);
 	}
 }
+
+int output_open(struct state_conf *conf, const char *name)
+{
+	if (output_rotating()) {
+		return output_rotate(-1, NULL, 0, 0);
+	}
+	if (!conf->output_filename || !strcmp(conf->output_filename, "-")) {
+		if (!conf->output_filename) {
+			log_debug(name, "no output file selected, will use stdout");
+		}
+		return STDOUT_FILENO;
+	}
+	int fd = open(conf->output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		log_fatal(name, "could not open output file (%s): %s",
+			  conf->output_filename, strerror(errno));
+	}
+	return fd;
+}
+
+void output_close(int fd, const char *name)
+{
+	if (fd != STDOUT_FILENO && close(fd)) {
+		log_fatal(name, "unable to close output file: %s",
+			  strerror(errno));
+	}
+}
+
+// a finished segment on its way to a writer thread
+struct output_segment {
+	struct output_segment *next;
+	int fd;
+	struct output_compressor *comp;
+	char *path;
+	uint64_t seq;
+	uint64_t records;
+	uint64_t bytes;
+	time_t start;
+	time_t end;
+};
+
+// segments waiting for a writer, per writer thread, before output waits too
+#define OUTPUT_SEGMENTS_PENDING 2
+
+static pthread_mutex_t segment_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t segment_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t segment_taken = PTHREAD_COND_INITIALIZER;
+static struct output_segment *pending_head = NULL;
+static struct output_segment *pending_tail = NULL;
+static uint32_t num_pending = 0;
+static int writers_stopping = 0;
+static pthread_t *writers = NULL;
+static int manifest_fd = -1;
+
+// the segment being written
+static char *current_path = NULL;
+static uint64_t current_seq = 0;
+static time_t current_start = 0;
+
+int output_rotating(void)
+{
+	return zconf.output_rotate_records || zconf.output_rotate_bytes ||
+	       zconf.output_rotate_secs;
+}
+
+int output_rotate_due(uint64_t records, uint64_t bytes)
+{
+	if (zconf.output_rotate_records &&
+	    records >= zconf.output_rotate_records) {
+		return 1;
+	}
+	if (zconf.output_rotate_bytes && bytes >= zconf.output_rotate_bytes) {
+		return 1;
+	}
+	return zconf.output_rotate_secs &&
+	       (uint64_t)(time(NULL) - current_start) >=
+		   zconf.output_rotate_secs;
+}
+
+// %N in the pattern is the segment's number and the rest goes through
+// strftime(3) for the time it was opened. Without a %N, the number is
+// appended, so segments never overwrite one another.
+static char *segment_path(uint64_t seq, time_t t)
+{
+	const char *pattern = zconf.output_filename;
+	size_t cap = strlen(pattern) + 32;
+	char *fmt = xmalloc(cap);
+	size_t len = 0;
+	int numbered = 0;
+	for (const char *p = pattern; *p; p++) {
+		if (p[0] == '%' && p[1] == 'N') {
+			len += (size_t)snprintf(fmt + len, cap - len,
+						"%06" PRIu64, seq);
+			numbered = 1;
+			p++;
+		} else if (p[0] == '%' && p[1] == '%') {
+			fmt[len++] = *p++;
+			fmt[len++] = *p;
+		} else {
+			fmt[len++] = *p;
+		}
+		if (cap - len < 32) {
+			cap *= 2;
+			fmt = xrealloc(fmt, cap);
+		}
+	}
+	if (!numbered) {
+		len += (size_t)snprintf(fmt + len, cap - len, ".%06" PRIu64,
+					seq);
+	}
+	fmt[len] = '\0';
+	struct tm tm;
+	localtime_r(&t, &tm);
+	char *path = xmalloc(PATH_MAX);
+	if (!strftime(path, PATH_MAX, fmt, &tm)) {
+		log_fatal("output", "output segment name from %s is too long",
+			  pattern);
+	}
+	xfree(fmt);
+	return path;
+}
+
+static void manifest_append(struct output_segment *seg)
+{
+	char start[32], end[32];
+	struct tm tm;
+	localtime_r(&seg->start, &tm);
+	strftime(start, sizeof(start), "%Y-%m-%dT%H:%M:%S%z", &tm);
+	localtime_r(&seg->end, &tm);
+	strftime(end, sizeof(end), "%Y-%m-%dT%H:%M:%S%z", &tm);
+	struct stat st;
+	if (stat(seg->path, &st)) {
+		st.st_size = 0;
+	}
+	json_object *obj = json_object_new_object();
+	json_object_object_add(obj, "segment",
+			       json_object_new_int64((int64_t)seg->seq));
+	json_object_object_add(obj, "path", json_object_new_string(seg->path));
+	json_object_object_add(obj, "records",
+			       json_object_new_int64((int64_t)seg->records));
+	json_object_object_add(obj, "bytes",
+			       json_object_new_int64((int64_t)seg->bytes));
+	json_object_object_add(obj, "file_bytes",
+			       json_object_new_int64((int64_t)st.st_size));
+	json_object_object_add(obj, "start", json_object_new_string(start));
+	json_object_object_add(obj, "end", json_object_new_string(end));
+	const char *line =
+	    json_object_to_json_string_ext(obj, JSON_C_TO_STRING_PLAIN);
+	size_t len = strlen(line);
+	char *buf = xmalloc(len + 1);
+	memcpy(buf, line, len);
+	buf[len] = '\n';
+	json_object_put(obj);
+	// O_APPEND and a single write keep the lines of several writers apart
+	if (write(manifest_fd, buf, len + 1) != (ssize_t)(len + 1) ||
+	    fsync(manifest_fd)) {
+		log_fatal("output", "unable to write to output manifest: %s",
+			  strerror(errno));
+	}
+	xfree(buf);
+}
+
+// the segment is only listed once all of it is on disk
+static void finish_segment(struct output_segment *seg)
+{
+	if (seg->comp) {
+		ocomp_finish(seg->comp);
+	}
+	if (fsync(seg->fd)) {
+		log_fatal("output", "unable to sync output segment %s: %s",
+			  seg->path, strerror(errno));
+	}
+	if (close(seg->fd)) {
+		log_fatal("output", "unable to close output segment %s: %s",
+			  seg->path, strerror(errno));
+	}
+	if (manifest_fd >= 0) {
+		manifest_append(seg);
+	}
+	log_debug("output", "finished segment %s, %" PRIu64 " records",
+		  seg->path, seg->records);
+	xfree(seg->path);
+	xfree(seg);
+}
+
+static void *start_writer(UNUSED void *arg)
+{
+	pthread_mutex_lock(&segment_mutex);
+	for (;;) {
+		while (!pending_head && !writers_stopping) {
+			pthread_cond_wait(&segment_ready, &segment_mutex);
+		}
+		struct output_segment *seg = pending_head;
+		if (!seg) {
+			break;
+		}
+		pending_head = seg->next;
+		if (!pending_head) {
+			pending_tail = NULL;
+		}
+		num_pending--;
+		pthread_cond_signal(&segment_taken);
+		pthread_mutex_unlock(&segment_mutex);
+		finish_segment(seg);
+		pthread_mutex_lock(&segment_mutex);
+	}
+	pthread_mutex_unlock(&segment_mutex);
+	return NULL;
+}
+
+static void start_writers(void)
+{
+	if (zconf.output_manifest) {
+		manifest_fd = open(zconf.output_manifest,
+				   O_WRONLY | O_CREAT | O_APPEND, 0666);
+		if (manifest_fd < 0) {
+			log_fatal("output",
+				  "could not open output manifest (%s): %s",
+				  zconf.output_manifest, strerror(errno));
+		}
+	}
+	writers = xcalloc(zconf.output_writers, sizeof(pthread_t));
+	for (int i = 0; i < zconf.output_writers; i++) {
+		if (pthread_create(&writers[i], NULL, start_writer, NULL)) {
+			log_fatal("output", "unable to create writer thread");
+		}
+	}
+	log_debug("output", "rotating output with %u writer threads",
+		  zconf.output_writers);
+}
+
+static void hand_over(int fd, struct output_compressor *comp,
+		      uint64_t records, uint64_t bytes)
+{
+	struct output_segment *seg = xcalloc(1, sizeof(struct output_segment));
+	seg->fd = fd;
+	seg->comp = comp;
+	seg->path = current_path;
+	seg->seq = current_seq;
+	seg->records = records;
+	seg->bytes = bytes;
+	seg->start = current_start;
+	seg->end = time(NULL);
+	current_path = NULL;
+	pthread_mutex_lock(&segment_mutex);
+	while (num_pending >=
+	       (uint32_t)zconf.output_writers * OUTPUT_SEGMENTS_PENDING) {
+		pthread_cond_wait(&segment_taken, &segment_mutex);
+	}
+	if (pending_tail) {
+		pending_tail->next = seg;
+	} else {
+		pending_head = seg;
+	}
+	pending_tail = seg;
+	num_pending++;
+	pthread_cond_signal(&segment_ready);
+	pthread_mutex_unlock(&segment_mutex);
+}
+
+int output_rotate(int fd, struct output_compressor *comp, uint64_t records,
+		  uint64_t bytes)
+{
+	if (fd >= 0) {
+		hand_over(fd, comp, records, bytes);
+	} else if (!writers) {
+		start_writers();
+	}
+	current_seq++;
+	current_start = time(NULL);
+	current_path = segment_path(current_seq, current_start);
+	int next = open(current_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (next < 0) {
+		log_fatal("output", "could not open output segment (%s): %s",
+			  current_path, strerror(errno));
+	}
+	log_debug("output", "writing segment %s", current_path);
+	return next;
+}
+
+void output_rotate_finish(int fd, struct output_compressor *comp,
+			  uint64_t records, uint64_t bytes)
+{
+	hand_over(fd, comp, records, bytes);
+	pthread_mutex_lock(&segment_mutex);
+	writers_stopping = 1;
+	pthread_cond_broadcast(&segment_ready);
+	pthread_mutex_unlock(&segment_mutex);
+	for (int i = 0; i < zconf.output_writers; i++) {
+		if (pthread_join(writers[i], NULL)) {
+			log_fatal("output", "unable to join writer thread");
+		}
+	}
+	xfree(writers);
+	writers = NULL;
+	if (manifest_fd >= 0 && close(manifest_fd)) {
+		log_fatal("output", "unable to close output manifest: %s",
+			  strerror(errno));
+	}
+	manifest_fd = -1;
+	log_info("output", "wrote %" PRIu64 " output segments", current_seq);
+}
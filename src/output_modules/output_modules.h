@@ -21,6 +21,9 @@ typedef int (*output_init_cb)(struct state_conf *, const char **fields,
 
 // called on packet receipt
 typedef int (*output_packet_cb)(fieldset_t *fs);
+// called on packet receipt instead of output_packet_cb when provided, with
+// the requested fields as a view over the probe module's fieldset
+typedef int (*output_view_cb)(fs_view_t *view);
 
 // called periodically during the scan
 typedef int (*output_update_cb)(struct state_conf *, struct state_send *,
@@ -35,11 +38,44 @@ typedef struct output_module {
 	output_update_cb update;
 	output_update_cb close;
 	output_packet_cb process_ip;
+	output_view_cb process_view;
 	const char *helptext;
 } output_module_t;
 
 output_module_t *get_output_module_by_name(const char *);
 
+struct output_compressor;
+
+// opens --output-file for the module, stdout without one, or the first
+// segment when rotating
+int output_open(struct state_conf *conf, const char *name);
+// closes what output_open returned, leaving stdout open
+void output_close(int fd, const char *name);
+
+// With --output-rotate, output goes to a series of files named from the
+// --output-file pattern. The output buffer asks at the end of each record
+// whether the current segment is due, and if so hands it over with
+// output_rotate() and carries on in the next one straight away. A pool of
+// writer threads (--output-writers) finishes the segments handed over:
+// ends their compression, fsyncs and closes them and lists them in the
+// --output-manifest, so a slow disk never holds up the scan's output.
+int output_rotating(void);
+// bytes are the uncompressed bytes the module has written to the segment
+int output_rotate_due(uint64_t records, uint64_t bytes);
+// hands over fd and the compressor writing to it, if any, and returns the fd
+// of the next segment
+int output_rotate(int fd, struct output_compressor *comp, uint64_t records,
+		  uint64_t bytes);
+// hands over the last segment and waits until every segment is finished
+void output_rotate_finish(int fd, struct output_compressor *comp,
+			  uint64_t records, uint64_t bytes);
+
 void print_output_modules(void);
 
+// The callback output module hands each result to cb, on the thread that
+// processes results, as a fieldset of the output fields; see
+// module_callback.c
+typedef int (*output_result_cb)(fieldset_t *fs, void *arg);
+void output_set_result_callback(output_result_cb cb, void *arg);
+
 #endif // HEADER_OUTPUT_MODULES_H
@@ -0,0 +1,222 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Buffer pos % OURING_BUFFERS holds the pos'th submission, as with the
+ * compressor, and is written by one IORING_OP_WRITE. A regular file gets
+ * each write at its own offset, so they may complete in any order. Pipes,
+ * terminals and files opened O_APPEND have no offsets to write at, and their
+ * next write is only submitted once the one before has completed. A write
+ * the kernel cuts short is finished here with write(2).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../../lib/logger.h"
+#include "../../lib/uring.h"
+#include "../../lib/xalloc.h"
+
+#include "output_uring.h"
+
+#define OURING_BUFFERS 4
+#define OURING_ALIGN 4096
+
+#ifdef IO_URING
+
+struct output_uring {
+	int fd;
+	const char *name;
+	size_t buf_size;
+	// writes at offset, else in order at the file position
+	int seekable;
+	off_t offset;
+	char *bufs[OURING_BUFFERS];
+	size_t lens[OURING_BUFFERS];
+	off_t offs[OURING_BUFFERS];
+	int busy[OURING_BUFFERS];
+	uint32_t inflight;
+	uint64_t head;
+	uring_t ring;
+};
+
+static void write_rest(output_uring_t *u, uint32_t i, size_t done)
+{
+	const char *data = u->bufs[i] + done;
+	size_t len = u->lens[i] - done;
+	off_t off = u->offs[i] + (off_t)done;
+	while (len) {
+		ssize_t n = u->seekable ? pwrite(u->fd, data, len, off)
+					: write(u->fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_fatal(u->name, "unable to write to file: %s",
+				  strerror(errno));
+		}
+		data += n;
+		len -= (size_t)n;
+		off += n;
+	}
+}
+
+static void reap(output_uring_t *u)
+{
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+		uint32_t i = (uint32_t)cqe->user_data;
+		int res = cqe->res;
+		uring_cqe_seen(&u->ring);
+		if (res < 0) {
+			log_fatal(u->name, "unable to write to file: %s",
+				  strerror(-res));
+		}
+		if ((size_t)res < u->lens[i]) {
+			write_rest(u, i, (size_t)res);
+		}
+		u->busy[i] = 0;
+		u->inflight--;
+	}
+}
+
+// reaps until no more than max writes are in flight
+static void wait_inflight(output_uring_t *u, uint32_t max)
+{
+	reap(u);
+	while (u->inflight > max) {
+		if (uring_wait(&u->ring, 1)) {
+			log_fatal(u->name, "unable to wait for io_uring: %s",
+				  strerror(errno));
+		}
+		reap(u);
+	}
+}
+
+output_uring_t *ouring_start(int fd, const char *name, size_t buf_size)
+{
+	output_uring_t *u = xcalloc(1, sizeof(output_uring_t));
+	if (uring_init(&u->ring, OURING_BUFFERS, 0, 0)) {
+		int err = errno;
+		xfree(u);
+		errno = err;
+		return NULL;
+	}
+	u->fd = fd;
+	u->name = name;
+	u->buf_size = buf_size;
+	struct stat st;
+	int flags = fcntl(fd, F_GETFL);
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && flags >= 0 &&
+	    !(flags & O_APPEND)) {
+		u->offset = lseek(fd, 0, SEEK_CUR);
+		u->seekable = u->offset >= 0;
+	}
+	for (int i = 0; i < OURING_BUFFERS; i++) {
+		u->bufs[i] = xmalloc_aligned(OURING_ALIGN, buf_size);
+	}
+	log_debug(name, "writing output through io_uring%s",
+		  u->seekable ? "" : ", one write at a time");
+	return u;
+}
+
+char *ouring_buffer(output_uring_t *u)
+{
+	return u->bufs[u->head % OURING_BUFFERS];
+}
+
+char *ouring_submit(output_uring_t *u, char *buf, size_t len)
+{
+	uint32_t i = u->head % OURING_BUFFERS;
+	if (buf != u->bufs[i]) {
+		log_fatal(u->name, "output buffer submitted out of order");
+	}
+	if (!len) {
+		return buf;
+	}
+	if (!u->seekable) {
+		wait_inflight(u, 0);
+	}
+	u->lens[i] = len;
+	u->offs[i] = u->offset;
+	struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = u->fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = (uint32_t)len;
+	sqe->off = u->seekable ? (uint64_t)u->offset : (uint64_t)-1;
+	sqe->user_data = i;
+	while (uring_submit(&u->ring) < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			log_fatal(u->name, "unable to submit to io_uring: %s",
+				  strerror(errno));
+		}
+		// completions have to be reaped before the kernel takes more
+		wait_inflight(u, u->inflight ? u->inflight - 1 : 0);
+	}
+	u->busy[i] = 1;
+	u->inflight++;
+	if (u->seekable) {
+		u->offset += (off_t)len;
+	}
+	u->head++;
+	// the next buffer is free once its last write has completed
+	uint32_t next = u->head % OURING_BUFFERS;
+	reap(u);
+	while (u->busy[next]) {
+		wait_inflight(u, u->inflight - 1);
+	}
+	return u->bufs[next];
+}
+
+void ouring_finish(output_uring_t *u)
+{
+	wait_inflight(u, 0);
+	// whoever writes to fd next carries on after the output
+	if (u->seekable && lseek(u->fd, u->offset, SEEK_SET) < 0) {
+		log_fatal(u->name, "unable to seek in file: %s",
+			  strerror(errno));
+	}
+	uring_free(&u->ring);
+	for (int i = 0; i < OURING_BUFFERS; i++) {
+		xfree(u->bufs[i]);
+	}
+	xfree(u);
+}
+
+#else
+
+output_uring_t *ouring_start(int fd, const char *name, size_t buf_size)
+{
+	(void)fd;
+	(void)name;
+	(void)buf_size;
+	errno = ENOSYS;
+	return NULL;
+}
+
+char *ouring_buffer(output_uring_t *u)
+{
+	(void)u;
+	return NULL;
+}
+
+char *ouring_submit(output_uring_t *u, char *buf, size_t len)
+{
+	(void)u;
+	(void)len;
+	return buf;
+}
+
+void ouring_finish(output_uring_t *u) { (void)u; }
+
+#endif /* IO_URING */
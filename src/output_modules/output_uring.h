@@ -0,0 +1,34 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef OUTPUT_URING_H
+#define OUTPUT_URING_H
+
+#include <stddef.h>
+
+// Writes output through an io_uring (--output-args io=uring), so that the
+// thread formatting records never waits on write(2). Like the compressor it
+// hands out whole buffers and takes them back filled: each is written in the
+// background while the next ones are filled, and only once all are in
+// flight does submitting wait for the oldest. Files are written at explicit
+// offsets, pipes and terminals one buffer at a time in order.
+typedef struct output_uring output_uring_t;
+
+// buffers are buf_size bytes. NULL, with errno set, if no io_uring can be
+// set up, e.g. on a kernel without it or a build without IO_URING.
+output_uring_t *ouring_start(int fd, const char *name, size_t buf_size);
+// the buffer to fill first
+char *ouring_buffer(output_uring_t *u);
+// writes the len bytes in buf, which must be the buffer last returned, and
+// returns the next one to fill
+char *ouring_submit(output_uring_t *u, char *buf, size_t len);
+// waits for every write to complete and frees u along with its buffers,
+// leaving fd open
+void ouring_finish(output_uring_t *u);
+
+#endif // OUTPUT_URING_H
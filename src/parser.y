@@ -28,6 +28,9 @@ extern node_t *zfilter;
 %token '(' ')' T_AND T_OR
 %token <int_literal> T_NUMBER
 %token <string_literal> T_FIELD
+%token <string_literal> T_IP
+%token <string_literal> T_SET
+%token T_IN T_NOT_IN
 %token T_NOT_EQ T_GT_EQ '>' '<' '=' T_LT_EQ
 
 %left T_OR
@@ -36,6 +39,8 @@ extern node_t *zfilter;
 %type <expr> filter
 %type <expr> number_filter
 %type <expr> string_filter
+%type <expr> ip_filter
+%type <expr> set_filter
 %type <expr> filter_expr
 
 
@@ -78,6 +83,14 @@ filter: number_filter
 		{
 			$$ = $1;
 		}
+	| ip_filter
+		{
+			$$ = $1;
+		}
+	| set_filter
+		{
+			$$ = $1;
+		}
 	;
 
 number_filter: T_FIELD '=' T_NUMBER
@@ -139,6 +152,66 @@ string_filter:
 		}
 	;
 
+ip_filter:
+	T_FIELD '=' T_IP
+		{
+			$$ = make_op_node(EQ);
+			$$->left_child = make_field_node($1);
+			$$->right_child = make_ip_node($3);
+		}
+	|
+	T_FIELD T_NOT_EQ T_IP
+		{
+			$$ = make_op_node(NEQ);
+			$$->left_child = make_field_node($1);
+			$$->right_child = make_ip_node($3);
+		}
+	|
+	T_FIELD '>' T_IP
+		{
+			$$ = make_op_node(GT);
+			$$->left_child = make_field_node($1);
+			$$->right_child = make_ip_node($3);
+		}
+	|
+	T_FIELD '<' T_IP
+		{
+			$$ = make_op_node(LT);
+			$$->left_child = make_field_node($1);
+			$$->right_child = make_ip_node($3);
+		}
+	|
+	T_FIELD T_GT_EQ T_IP
+		{
+			$$ = make_op_node(GT_EQ);
+			$$->left_child = make_field_node($1);
+			$$->right_child = make_ip_node($3);
+		}
+	|
+	T_FIELD T_LT_EQ T_IP
+		{
+			$$ = make_op_node(LT_EQ);
+			$$->left_child = make_field_node($1);
+			$$->right_child = make_ip_node($3);
+		}
+	;
+
+set_filter:
+	T_FIELD T_IN T_SET
+		{
+			$$ = make_op_node(IN);
+			$$->left_child = make_field_node($1);
+			$$->right_child = make_set_node($3);
+		}
+	|
+	T_FIELD T_NOT_IN T_SET
+		{
+			$$ = make_op_node(NOT_IN);
+			$$->left_child = make_field_node($1);
+			$$->right_child = make_set_node($3);
+		}
+	;
+
 %%
 
 
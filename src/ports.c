@@ -19,12 +19,18 @@
 #include "state.h"
 #include "../lib/pbm.h"
 #include "../lib/logger.h"
+#include "../lib/xalloc.h"
 
 static void add_port(struct port_conf *ports, int port)
 {
 	if (port < 0 || port > 0xFFFF) {
 		log_fatal("ports", "invalid target port specified: %i", port);
 	}
+	if (ports->port_count == ports->port_cap) {
+		ports->port_cap = ports->port_cap ? ports->port_cap * 2 : 16;
+		ports->ports = xrealloc(ports->ports,
+					ports->port_cap * sizeof(uint16_t));
+	}
 	ports->ports[ports->port_count] = port;
 	if (ports->port_bitmap) {
 		bm_set(ports->port_bitmap, port);
@@ -83,8 +83,8 @@ int bacnet_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw, UNUSED void
 	return EXIT_SUCCESS;
 }
 
-int bacnet_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
-		       ipaddr_n_t dst_ip, port_n_t dport, uint8_t ttl,
+int bacnet_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+		       const ipaddr_t *dst_ip, port_n_t dport, uint8_t ttl,
 		       uint32_t *validation, int probe_num, uint16_t ip_id,
 		       UNUSED void *arg)
 {
@@ -93,8 +93,8 @@ int bacnet_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 	struct udphdr *udp_header = (struct udphdr *)&ip_header[1];
 	struct bacnet_probe *bnp = (struct bacnet_probe *)&udp_header[1];
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	ip_header->ip_ttl = ttl;
 	ip_header->ip_sum = 0;
 	ip_header->ip_id = ip_id;
@@ -113,7 +113,7 @@ int bacnet_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 
 int bacnet_validate_packet(const struct ip *ip_hdr, uint32_t len,
 			   uint32_t *src_ip, uint32_t *validation,
-			   const struct port_conf *ports)
+			   const struct port_conf *ports, UNUSED void *arg)
 {
 	// this will reject packets that aren't UDP or ICMP and fully process ICMP packets
 	if (udp_do_validate_packet(ip_hdr, len, src_ip, validation, num_ports, should_validate_src_port, ports) == PACKET_INVALID) {
@@ -138,26 +138,23 @@ int bacnet_validate_packet(const struct ip *ip_hdr, uint32_t len,
 	return PACKET_VALID;
 }
 
-void bacnet_process_packet(const u_char *packet, uint32_t len, fieldset_t *fs,
+void bacnet_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
 			   UNUSED uint32_t *validation,
-			   UNUSED struct timespec ts)
+			   UNUSED struct timespec ts, UNUSED void *arg)
 {
-	struct ip *ip_hdr = get_ip_header(packet, len);
-	assert(ip_hdr);
+	struct ip *ip_hdr = (struct ip *)pp->ip;
 	if (ip_hdr->ip_p == IPPROTO_UDP) {
-		struct udphdr *udp = get_udp_header(ip_hdr, len);
+		struct udphdr *udp = (struct udphdr *)pp->udp;
 		assert(udp);
 		fs_add_uint64(fs, "sport", ntohs(udp->uh_sport));
 		fs_add_uint64(fs, "dport", ntohs(udp->uh_dport));
 		fs_add_constchar(fs, "classification", "bacnet");
 		fs_add_bool(fs, "success", 1);
 		fs_add_null_icmp(fs);
-		uint32_t udp_offset =
-		    sizeof(struct ether_header) + ip_hdr->ip_hl * 4;
-		uint32_t payload_offset = udp_offset + sizeof(struct udphdr);
-		assert(payload_offset < len);
-		uint8_t *payload = get_udp_payload(udp, len);
-		uint32_t payload_len = len - payload_offset;
+		uint32_t payload_offset = pp->l4_off + sizeof(struct udphdr);
+		assert(payload_offset < pp->len);
+		uint8_t *payload = get_udp_payload(udp, pp->len);
+		uint32_t payload_len = pp->len - payload_offset;
 		fs_add_binary(fs, "udp_payload", payload_len, (void *)payload,
 			      0);
 		fs_add_null_icmp(fs);
@@ -167,7 +164,7 @@ void bacnet_process_packet(const u_char *packet, uint32_t len, fieldset_t *fs,
 		fs_add_constchar(fs, "classification", "icmp");
 		fs_add_bool(fs, "success", 0);
 		fs_add_null(fs, "udp_payload");
-		fs_populate_icmp_from_iphdr(ip_hdr, len, fs);
+		fs_populate_icmp_from_parsed(pp, fs);
 	}
 }
 
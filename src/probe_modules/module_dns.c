@@ -63,6 +63,11 @@
 #define MAX_LABEL_RECURSION 10
 #define DNS_QR_ANSWER 1
 #define SOURCE_PORT_VALIDATION_MODULE_DEFAULT true; // default to validating source port
+// whether any field built from resource records is consumed
+static bool dns_parse_rrs = true;
+// of the sections, in packet order, which are consumed and built into
+// fieldsets; the others are only stepped over
+static bool dns_section_needed[4] = {true, true, true, true};
 static bool should_validate_src_port = SOURCE_PORT_VALIDATION_MODULE_DEFAULT
 
 // Note: each label has a max length of 63 bytes. So someone has to be doing
@@ -83,6 +88,23 @@ static uint16_t *dns_packet_lens; // Not including udp header
 static uint16_t *qname_lens;
 static char **qnames;
 static uint16_t *qtypes;
+// with --dnsippadding, the label encoding each octet of the destination
+// address in a qname, \x03 followed by three digits
+#define DNS_IP_LABEL_LEN 4
+static char dns_ip_labels[256][DNS_IP_LABEL_LEN];
+
+// packets built by this send thread, for --dns-log-payloads
+static __thread uint32_t dns_payloads_seen = 0;
+
+// A receive thread's context while it parses responses: the buffer names
+// are decompressed into, and the response's first question name, which
+// answers mostly refer to with a pointer to just after the header
+typedef struct dns_recv_state {
+	char name[MAX_NAME_LENGTH];
+	char qname[MAX_NAME_LENGTH];
+	bool have_qname;
+} dns_recv_state_t;
+
 static int num_questions = 0; // How many DNS questions to query. Note: There's a requirement that probes is a multiple of DNS questions
 // necessary to null-terminate these since strtrk_r can take multiple delimitors as a char*, and since these are contiguous in memory,
 // they were being used jointly when the intention is to use only one at a time.
@@ -207,17 +229,17 @@ static int build_global_dns_packets(char *domains[], int num_domains, size_t *ma
 
 static uint16_t get_name_helper(const char *data, uint16_t data_len,
 				const char *payload, uint16_t payload_len,
-				char *name, uint16_t name_len,
+				char **name, uint16_t *name_len,
 				uint16_t recursion_level)
 {
 	log_trace("dns",
 		  "_get_name_helper IN, datalen: %d namelen: %d recursion: %d",
-		  data_len, name_len, recursion_level);
-	if (data_len == 0 || name_len == 0 || payload_len == 0) {
+		  data_len, *name_len, recursion_level);
+	if (data_len == 0 || *name_len == 0 || payload_len == 0) {
 		log_trace(
 		    "dns",
 		    "_get_name_helper OUT, err. 0 length field. datalen %d namelen %d payloadlen %d",
-		    data_len, name_len, payload_len);
+		    data_len, *name_len, payload_len);
 		return 0;
 	}
 	if (recursion_level > MAX_LABEL_RECURSION) {
@@ -257,16 +279,16 @@ static uint16_t get_name_helper(const char *data, uint16_t data_len,
 			// -- have consumed bytes
 			if (recursion_level > 0 || bytes_consumed > 0) {
 
-				if (name_len < 1) {
+				if (*name_len < 1) {
 					log_warn(
 					    "dns",
 					    "Exceeded static name field allocation.");
 					return 0;
 				}
 
-				name[0] = '.';
-				name++;
-				name_len--;
+				**name = '.';
+				(*name)++;
+				(*name_len)--;
 			}
 			uint16_t rec_bytes_consumed = get_name_helper(
 			    payload + offset, payload_len - offset, payload,
@@ -317,21 +339,21 @@ static uint16_t get_name_helper(const char *data, uint16_t data_len,
 			// in a label chain. We need to add a dot.
 			if (bytes_consumed > 0) {
 
-				if (name_len < 1) {
+				if (*name_len < 1) {
 					log_warn(
 					    "dns",
 					    "Exceeded static name field allocation.");
 					return 0;
 				}
 
-				name[0] = '.';
-				name++;
-				name_len--;
+				**name = '.';
+				(*name)++;
+				(*name_len)--;
 			}
 			// Now we've consumed a byte.
 			++bytes_consumed;
 			// Did we run out of our arbitrary buffer?
-			if (byte > name_len) {
+			if (byte > *name_len) {
 				log_warn(
 				    "dns",
 				    "Exceeded static name field allocation.");
@@ -339,9 +361,9 @@ static uint16_t get_name_helper(const char *data, uint16_t data_len,
 			}
 
 			assert(data_len > 0);
-			memcpy(name, data, byte);
-			name += byte;
-			name_len -= byte;
+			memcpy(*name, data, byte);
+			*name += byte;
+			*name_len -= byte;
 			data_len -= byte;
 			data += byte;
 			bytes_consumed += byte;
@@ -359,54 +381,106 @@ static uint16_t get_name_helper(const char *data, uint16_t data_len,
 	return 0;
 }
 
+// Decompresses the name at data into name, which has room for
+// MAX_NAME_LENGTH bytes, NUL-terminated. Returns the bytes of data the name
+// takes, 0 if it is malformed.
 // data: Where we are in the dns payload
 // payload: the entire udp payload
-static char *get_name(const char *data, uint16_t data_len, const char *payload,
-		      uint16_t payload_len, uint16_t *bytes_consumed)
+static uint16_t decode_name(const char *data, uint16_t data_len,
+			    const char *payload, uint16_t payload_len,
+			    char *name)
 {
-	log_trace("dns", "call to get_name, data_len: %d", data_len);
-	char *name = xmalloc(MAX_NAME_LENGTH);
-	*bytes_consumed = get_name_helper(data, data_len, payload, payload_len,
-					  name, MAX_NAME_LENGTH - 1, 0);
-	if (*bytes_consumed == 0) {
-		free(name);
-		return NULL;
+	log_trace("dns", "call to decode_name, data_len: %d", data_len);
+	char *end = name;
+	uint16_t left = MAX_NAME_LENGTH - 1;
+	uint16_t bytes_consumed = get_name_helper(
+	    data, data_len, payload, payload_len, &end, &left, 0);
+	if (bytes_consumed == 0) {
+		return 0;
 	}
-	// Our memset ensured null byte.
-	assert(name[MAX_NAME_LENGTH - 1] == '\0');
+	*end = '\0';
 	log_trace(
 	    "dns",
-	    "return success from get_name, bytes_consumed: %d, string: %s",
-	    *bytes_consumed, name);
-	return name;
+	    "return success from decode_name, bytes_consumed: %d, string: %s",
+	    bytes_consumed, name);
+	return bytes_consumed;
+}
+
+// Whether the name at data, which decode_name() took bytes of, is labels
+// only, so that reading it through a pointer gives the same string
+static bool name_is_uncompressed(const char *data, uint16_t bytes)
+{
+	for (uint16_t i = 0; i < bytes && data[i]; i += (uint8_t)data[i] + 1) {
+		if ((uint8_t)data[i] >= 0xc0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// decode_name() into st->name, except that a pointer to the first question
+// is answered with its name as decoded already. Sets *name to the result.
+static uint16_t decode_rr_name(dns_recv_state_t *st, const char *data,
+			       uint16_t data_len, const char *payload,
+			       uint16_t payload_len, const char **name)
+{
+	if (st->have_qname && data_len >= 2 && (uint8_t)data[0] == 0xc0 &&
+	    (uint8_t)data[1] == sizeof(dns_header)) {
+		*name = st->qname;
+		return 2;
+	}
+	*name = st->name;
+	return decode_name(data, data_len, payload, payload_len, st->name);
 }
 
-static bool process_response_question(char **data, uint16_t *data_len,
-				      const char *payload, uint16_t payload_len,
-				      fieldset_t *list)
+// a copy of a decoded name from the packet's arena, at its real length
+// rather than MAX_NAME_LENGTH
+static char *copy_name(const char *name, size_t extra)
+{
+	size_t len = strlen(name);
+	char *copy = fs_arena_alloc(extra + len + 1);
+	memcpy(copy + extra, name, len + 1);
+	return copy;
+}
+
+// The question and RR parsers below build their fieldset into list, or only
+// check the record and step over it when list is NULL because the section
+// is not output. Names are decompressed either way, so dns_parse_err and
+// dns_unconsumed_bytes do not depend on which sections were asked for.
+static bool process_response_question(dns_recv_state_t *st, char **data,
+				      uint16_t *data_len, const char *payload,
+				      uint16_t payload_len, fieldset_t *list)
 {
 	// Payload is the start of the DNS packet, including header
 	// data is handle to the start of this RR
 	// data_len is a pointer to the how much total data we have to work
 	// with. This is awful. I'm bad and should feel bad.
-	uint16_t bytes_consumed = 0;
-	char *question_name =
-	    get_name(*data, *data_len, payload, payload_len, &bytes_consumed);
+	char *question_name = st->name;
+	uint16_t bytes_consumed = decode_name(*data, *data_len, payload,
+					      payload_len, question_name);
 	// Error.
-	if (question_name == NULL) {
+	if (bytes_consumed == 0) {
 		return true;
 	}
-	assert(bytes_consumed > 0);
+	if (*data == payload + sizeof(dns_header) &&
+	    name_is_uncompressed(*data, bytes_consumed)) {
+		memcpy(st->qname, question_name, strlen(question_name) + 1);
+		st->have_qname = true;
+	}
 	if ((bytes_consumed + sizeof(dns_question_tail)) > *data_len) {
-		free(question_name);
 		return true;
 	}
 	dns_question_tail *tail = (dns_question_tail *)(*data + bytes_consumed);
+	*data = *data + bytes_consumed + sizeof(dns_question_tail);
+	*data_len = *data_len - bytes_consumed - sizeof(dns_question_tail);
+	if (!list) {
+		return false;
+	}
 	uint16_t qtype = ntohs(tail->qtype);
 	uint16_t qclass = ntohs(tail->qclass);
 	// Build our new question fieldset
 	fieldset_t *qfs = fs_new_fieldset(NULL);
-	fs_add_unsafe_string(qfs, "name", question_name, 1);
+	fs_add_unsafe_string(qfs, "name", copy_name(question_name, 0), 1);
 	fs_add_uint64(qfs, "qtype", qtype);
 	if (qtype > MAX_QTYPE || qtype_qtype_to_strid[qtype] == BAD_QTYPE_VAL) {
 		fs_add_string(qfs, "qtype_str", (char *)BAD_QTYPE_STR, 0);
@@ -420,100 +494,40 @@ static bool process_response_question(char **data, uint16_t *data_len,
 	fs_add_uint64(qfs, "qclass", qclass);
 	// Now we're adding the new fs to the list.
 	fs_add_fieldset(list, NULL, qfs);
-	// Now update the pointers.
-	*data = *data + bytes_consumed + sizeof(dns_question_tail);
-	*data_len = *data_len - bytes_consumed - sizeof(dns_question_tail);
 	return false;
 }
 
-static bool process_response_answer(char **data, uint16_t *data_len,
-				    const char *payload, uint16_t payload_len,
-				    fieldset_t *list)
+static void add_rdata(dns_recv_state_t *st, fieldset_t *afs, uint16_t type,
+		      const char *rdata, uint16_t rdlength,
+		      const char *payload, uint16_t payload_len)
 {
-	log_trace("dns", "call to process_response_answer, data_len: %d",
-		  *data_len);
-	// Payload is the start of the DNS packet, including header
-	// data is handle to the start of this RR
-	// data_len is a pointer to the how much total data we have to work
-	// with. This is awful. I'm bad and should feel bad.
-	uint16_t bytes_consumed = 0;
-	char *answer_name =
-	    get_name(*data, *data_len, payload, payload_len, &bytes_consumed);
-	// Error.
-	if (answer_name == NULL) {
-		return true;
-	}
-	assert(bytes_consumed > 0);
-	if ((bytes_consumed + sizeof(dns_answer_tail)) > *data_len) {
-		free(answer_name);
-		return true;
-	}
-	dns_answer_tail *tail = (dns_answer_tail *)(*data + bytes_consumed);
-	uint16_t type = ntohs(tail->type);
-	uint16_t class = ntohs(tail->class);
-	uint32_t ttl = ntohl(tail->ttl);
-	uint16_t rdlength = ntohs(tail->rdlength);
-	char *rdata = tail->rdata;
-
-	if ((rdlength + bytes_consumed + sizeof(dns_answer_tail)) > *data_len) {
-		free(answer_name);
-		return true;
-	}
-	// Build our new question fieldset
-	fieldset_t *afs = fs_new_fieldset(NULL);
-	fs_add_unsafe_string(afs, "name", answer_name, 1);
-	fs_add_uint64(afs, "type", type);
-	if (type > MAX_QTYPE || qtype_qtype_to_strid[type] == BAD_QTYPE_VAL) {
-		fs_add_string(afs, "type_str", (char *)BAD_QTYPE_STR, 0);
-	} else {
-		// I've written worse things than this 3rd arg. But I want to be
-		// fast.
-		fs_add_string(afs, "type_str",
-			      (char *)qtype_strs[qtype_qtype_to_strid[type]],
-			      0);
-	}
-	fs_add_uint64(afs, "class", class);
-	fs_add_uint64(afs, "ttl", ttl);
-	fs_add_uint64(afs, "rdlength", rdlength);
-
+	const char *name;
 	// XXX Fill this out for the other types we care about.
 	if (type == DNS_QTYPE_NS || type == DNS_QTYPE_CNAME) {
-		uint16_t rdata_bytes_consumed = 0;
-		char *rdata_name = get_name(rdata, rdlength, payload,
-					    payload_len, &rdata_bytes_consumed);
-		if (rdata_name == NULL) {
+		if (!decode_rr_name(st, rdata, rdlength, payload, payload_len,
+				    &name)) {
 			fs_add_uint64(afs, "rdata_is_parsed", 0);
-			fs_add_binary(afs, "rdata", rdlength, rdata, 0);
+			fs_add_binary(afs, "rdata", rdlength, (void *)rdata, 0);
 		} else {
 			fs_add_uint64(afs, "rdata_is_parsed", 1);
-			fs_add_unsafe_string(afs, "rdata", rdata_name, 1);
+			fs_add_unsafe_string(afs, "rdata", copy_name(name, 0),
+					     1);
 		}
 	} else if (type == DNS_QTYPE_MX) {
-		uint16_t rdata_bytes_consumed = 0;
-		if (rdlength <= 4) {
+		if (rdlength <= 4 ||
+		    !decode_rr_name(st, rdata + 2, rdlength - 2, payload,
+				    payload_len, &name)) {
 			fs_add_uint64(afs, "rdata_is_parsed", 0);
-			fs_add_binary(afs, "rdata", rdlength, rdata, 0);
+			fs_add_binary(afs, "rdata", rdlength, (void *)rdata, 0);
 		} else {
-			char *rdata_name =
-			    get_name(rdata + 2, rdlength - 2, payload,
-				     payload_len, &rdata_bytes_consumed);
-			if (rdata_name == NULL) {
-				fs_add_uint64(afs, "rdata_is_parsed", 0);
-				fs_add_binary(afs, "rdata", rdlength, rdata, 0);
-			} else {
-				// (largest value 16bit) + " " + answer + null
-				char *rdata_with_pref =
-				    xmalloc(5 + 1 + strlen(rdata_name) + 1);
-
-				uint8_t num_printed =
-				    snprintf(rdata_with_pref, 6, "%hu ",
-					     ntohs(*(uint16_t *)rdata));
-				memcpy(rdata_with_pref + num_printed,
-				       rdata_name, strlen(rdata_name));
-				fs_add_uint64(afs, "rdata_is_parsed", 1);
-				fs_add_unsafe_string(afs, "rdata",
-						     rdata_with_pref, 1);
-			}
+			// (largest value 16bit) + " " in front of the name
+			char pref[7];
+			int num_printed = snprintf(pref, sizeof(pref), "%hu ",
+						   ntohs(*(uint16_t *)rdata));
+			char *rdata_with_pref = copy_name(name, num_printed);
+			memcpy(rdata_with_pref, pref, num_printed);
+			fs_add_uint64(afs, "rdata_is_parsed", 1);
+			fs_add_unsafe_string(afs, "rdata", rdata_with_pref, 1);
 		}
 	} else if (type == DNS_QTYPE_TXT) {
 		if (rdlength >= 1 && (rdlength - 1) != *(uint8_t *)rdata) {
@@ -521,11 +535,13 @@ static bool process_response_answer(char **data, uint16_t *data_len,
 			    "dns",
 			    "TXT record with wrong TXT len. Not processing.");
 			fs_add_uint64(afs, "rdata_is_parsed", 0);
-			fs_add_binary(afs, "rdata", rdlength, rdata, 0);
+			fs_add_binary(afs, "rdata", rdlength, (void *)rdata, 0);
 		} else {
 			fs_add_uint64(afs, "rdata_is_parsed", 1);
-			char *txt = xmalloc(rdlength);
-			memcpy(txt, rdata + 1, rdlength - 1);
+			size_t len = rdlength ? rdlength - 1 : 0;
+			char *txt = fs_arena_alloc(len + 1);
+			memcpy(txt, rdata + 1, len);
+			txt[len] = '\0';
 			fs_add_unsafe_string(afs, "rdata", txt, 1);
 		}
 	} else if (type == DNS_QTYPE_A) {
@@ -535,11 +551,11 @@ static bool process_response_answer(char **data, uint16_t *data_len,
 			    "A record with IP of length %d. Not processing.",
 			    rdlength);
 			fs_add_uint64(afs, "rdata_is_parsed", 0);
-			fs_add_binary(afs, "rdata", rdlength, rdata, 0);
+			fs_add_binary(afs, "rdata", rdlength, (void *)rdata, 0);
 		} else {
 			fs_add_uint64(afs, "rdata_is_parsed", 1);
-			char *addr =
-			    strdup(inet_ntoa(*(struct in_addr *)rdata));
+			char *addr = fs_arena_alloc(INET_ADDRSTRLEN);
+			inet_ntop(AF_INET, rdata, addr, INET_ADDRSTRLEN);
 			fs_add_unsafe_string(afs, "rdata", addr, 1);
 		}
 	} else if (type == DNS_QTYPE_AAAA) {
@@ -549,22 +565,44 @@ static bool process_response_answer(char **data, uint16_t *data_len,
 			    "AAAA record with IP of length %d. Not processing.",
 			    rdlength);
 			fs_add_uint64(afs, "rdata_is_parsed", 0);
-			fs_add_binary(afs, "rdata", rdlength, rdata, 0);
+			fs_add_binary(afs, "rdata", rdlength, (void *)rdata, 0);
 		} else {
 			fs_add_uint64(afs, "rdata_is_parsed", 1);
-			char *ipv6_str = xmalloc(INET6_ADDRSTRLEN);
-
-			inet_ntop(AF_INET6, (struct sockaddr_in6 *)rdata,
-				  ipv6_str, INET6_ADDRSTRLEN);
-
+			char *ipv6_str = fs_arena_alloc(INET6_ADDRSTRLEN);
+			inet_ntop(AF_INET6, rdata, ipv6_str, INET6_ADDRSTRLEN);
 			fs_add_unsafe_string(afs, "rdata", ipv6_str, 1);
 		}
 	} else {
 		fs_add_uint64(afs, "rdata_is_parsed", 0);
-		fs_add_binary(afs, "rdata", rdlength, rdata, 0);
+		fs_add_binary(afs, "rdata", rdlength, (void *)rdata, 0);
+	}
+}
+
+static bool process_response_answer(dns_recv_state_t *st, char **data,
+				    uint16_t *data_len, const char *payload,
+				    uint16_t payload_len, fieldset_t *list)
+{
+	log_trace("dns", "call to process_response_answer, data_len: %d",
+		  *data_len);
+	// Payload is the start of the DNS packet, including header
+	// data is handle to the start of this RR
+	// data_len is a pointer to the how much total data we have to work
+	// with. This is awful. I'm bad and should feel bad.
+	const char *answer_name;
+	uint16_t bytes_consumed = decode_rr_name(st, *data, *data_len, payload,
+						 payload_len, &answer_name);
+	// Error.
+	if (bytes_consumed == 0) {
+		return true;
+	}
+	if ((bytes_consumed + sizeof(dns_answer_tail)) > *data_len) {
+		return true;
+	}
+	dns_answer_tail *tail = (dns_answer_tail *)(*data + bytes_consumed);
+	uint16_t rdlength = ntohs(tail->rdlength);
+	if ((rdlength + bytes_consumed + sizeof(dns_answer_tail)) > *data_len) {
+		return true;
 	}
-	// Now we're adding the new fs to the list.
-	fs_add_fieldset(list, NULL, afs);
 	// Now update the pointers.
 	*data = *data + bytes_consumed + sizeof(dns_answer_tail) + rdlength;
 	*data_len =
@@ -572,6 +610,32 @@ static bool process_response_answer(char **data, uint16_t *data_len,
 	log_trace("dns",
 		  "return success from process_response_answer, data_len: %d",
 		  *data_len);
+	if (!list) {
+		return false;
+	}
+	uint16_t type = ntohs(tail->type);
+	uint16_t class = ntohs(tail->class);
+	uint32_t ttl = ntohl(tail->ttl);
+	// Build our new question fieldset
+	fieldset_t *afs = fs_new_fieldset(NULL);
+	fs_add_unsafe_string(afs, "name", copy_name(answer_name, 0), 1);
+	fs_add_uint64(afs, "type", type);
+	if (type > MAX_QTYPE || qtype_qtype_to_strid[type] == BAD_QTYPE_VAL) {
+		fs_add_string(afs, "type_str", (char *)BAD_QTYPE_STR, 0);
+	} else {
+		// I've written worse things than this 3rd arg. But I want to be
+		// fast.
+		fs_add_string(afs, "type_str",
+			      (char *)qtype_strs[qtype_qtype_to_strid[type]],
+			      0);
+	}
+	fs_add_uint64(afs, "class", class);
+	fs_add_uint64(afs, "ttl", ttl);
+	fs_add_uint64(afs, "rdlength", rdlength);
+	// answer_name is copied, so that add_rdata() may reuse st->name
+	add_rdata(st, afs, type, tail->rdata, rdlength, payload, payload_len);
+	// Now we're adding the new fs to the list.
+	fs_add_fieldset(list, NULL, afs);
 	return false;
 }
 
@@ -582,6 +646,31 @@ static bool process_response_answer(char **data, uint16_t *data_len,
 static int dns_global_initialize(struct state_conf *conf)
 {
 	setup_qtype_str_map();
+	for (int i = 0; i < 256; i++) {
+		dns_ip_labels[i][0] = 3;
+		dns_ip_labels[i][1] = '0' + i / 100;
+		dns_ip_labels[i][2] = '0' + i / 10 % 10;
+		dns_ip_labels[i][3] = '0' + i % 10;
+	}
+	static const char *rr_fields[] = {
+	    "dns_questions", "dns_answers",   "dns_authorities",
+	    "dns_additionals", "dns_parse_err", "dns_unconsumed_bytes"};
+	dns_parse_rrs = false;
+	for (size_t i = 0; i < sizeof(rr_fields) / sizeof(rr_fields[0]); i++) {
+		int index = fds_get_index_by_name(&conf->fsconf.defs, rr_fields[i]);
+		bool needed =
+		    index >= 0 && fds_is_needed(&conf->fsconf.defs, index);
+		if (needed) {
+			dns_parse_rrs = true;
+		}
+		if (i < sizeof(dns_section_needed) / sizeof(dns_section_needed[0])) {
+			dns_section_needed[i] = needed;
+		}
+	}
+	if (!dns_parse_rrs) {
+		log_debug("dns", "no resource record fields requested, "
+				 "responses will not be parsed past the header");
+	}
 	if (conf->validate_source_port_override == VALIDATE_SRC_PORT_DISABLE_OVERRIDE) {
 		log_debug("dns", "disabling source port validation");
 		should_validate_src_port = false;
@@ -700,6 +789,17 @@ static int dns_global_initialize(struct state_conf *conf)
 	size_t max_payload_len;
 	int ret = build_global_dns_packets(domains, num_questions, &max_payload_len);
 	module_dns.max_packet_length = max_payload_len + sizeof(struct ether_header) + sizeof(struct ip) + sizeof(struct udphdr);
+	// checked here rather than for every packet built
+	for (int i = 0; ret == EXIT_SUCCESS && i < num_questions; i++) {
+		if (dns_packet_lens[i] <= sizeof(dns_header)) {
+			log_warn("dns", "DNS question %d has an empty question section", i);
+		}
+		if (conf->dnsippadding &&
+		    dns_packet_lens[i] < sizeof(dns_header) + 4 * DNS_IP_LABEL_LEN) {
+			log_fatal("dns", "DNS question %d is too short to be padded "
+					 "with the destination address (--dnsippadding)", i);
+		}
+	}
 	return ret;
 }
 
@@ -824,8 +924,8 @@ static void log_ascii_payload(const char *func, int line, const char *data, size
     }
 }
 
-int dns_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
-		    ipaddr_n_t dst_ip, port_n_t dport, uint8_t ttl,
+int dns_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+		    const ipaddr_t *dst_ip, port_n_t dport, uint8_t ttl,
 		    uint32_t *validation, int probe_num,
 		    uint16_t ip_id, UNUSED void *arg)
 {
@@ -868,8 +968,8 @@ int dns_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 		       dns_packet_lens[dns_index]);
 	}
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	ip_header->ip_ttl = ttl;
 	ip_header->ip_id = ip_id;
 	// Above we wanted to look up the dns question index (so we could send 2 probes for the same DNS query)
@@ -883,33 +983,54 @@ int dns_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 
 	dns_header_p->id = validation[2] & 0xFFFF;
 
-	ip_header->ip_sum = 0;
-	ip_header->ip_sum = zmap_ip_checksum((unsigned short *)ip_header);
+	// make_ip_header() above may have rebuilt the header, so sum its
+	// invariant part here
+	ip_header->ip_sum =
+	    ip_header_csum(ip_header_csum_base(ip_header), ip_header);
 
 	// added on 2025-03-24 by pqm
+	// the packets were checked to have room for this in global_initialize
 	if (zconf.dnsippadding)
 	{
-		if (*buf_len < 54 + 16) {
-            log_error("dns", "%s:%d - Buffer too small for IP padding (need %d, have %zu)",
-                     __FILE__, __LINE__, 54+16, *buf_len);
-            // return EXIT_FAILURE;
-        }
-		char *ipqname = make_ip_strinqname(dst_ip);
-		// log_debug("dns", "dns_make_packet, qname: %s",ipqname);
-		
-		memcpy(buf + 54, ipqname, 16);		
-
-		free(ipqname);
+		// the qname starts with a label for each octet of the address,
+		// copied from the table in place of the placeholder. UDP checksums
+		// are left at 0, so nothing else changes.
+		const uint8_t *octets = (const uint8_t *)&dst_ip->v4;
+		char *qname = (char *)buf + 54;
+		for (int i = 0; i < 4; i++) {
+			memcpy(qname + i * DNS_IP_LABEL_LEN,
+			       dns_ip_labels[octets[i]], DNS_IP_LABEL_LEN);
+		}
 	}
 	// 日志记录（增加上下文信息）, added by pqm
-    if (*buf_len > 54) {
-        size_t payload_len = *buf_len - 54;
-        log_ascii_payload(__func__, __LINE__, (char*)buf + 54, payload_len);
-    } else {
-        log_warn("dns", "%s:%d - Packet too small for DNS payload (len=%zu)", 
-                __FILE__, __LINE__, *buf_len);
-    }
+	// only every nth packet with --dns-log-payloads, a single untaken
+	// branch otherwise
+	if (zconf.dns_log_payloads &&
+	    ++dns_payloads_seen % zconf.dns_log_payloads == 0 && *buf_len > 54) {
+		log_ascii_payload(__func__, __LINE__, (char *)buf + 54,
+				  *buf_len - 54);
+	}
+
+	return EXIT_SUCCESS;
+}
 
+// The question, and with it the layout of the packet, depends on the probe
+// number, so each packet still goes through dns_make_packet, but as a direct
+// call the compiler can inline.
+static int dns_make_packets(struct batch_packet *packets,
+			    const probe_spec_t *specs, size_t n, uint8_t ttl,
+			    void *arg)
+{
+	for (size_t i = 0; i < n; i++) {
+		const probe_spec_t *spec = &specs[i];
+		uint32_t validation[VALIDATE_BYTES / sizeof(uint32_t)];
+		memcpy(validation, spec->validation, VALIDATE_BYTES);
+		size_t len = 0;
+		dns_make_packet(packets[i].buf, &len, &spec->src_ip,
+				&spec->dst_ip, spec->dst_port, ttl, validation,
+				spec->probe_num, spec->ip_id, arg);
+		packets[i].len = (uint32_t)len;
+	}
 	return EXIT_SUCCESS;
 }
 
@@ -922,13 +1043,33 @@ void dns_print_packet(FILE *fp, void *packet)
 	fprintf(fp, "dns { source: %u | dest: %u | checksum: %#04X }\n",
 		ntohs(udph->uh_sport), ntohs(udph->uh_dport),
 		ntohs(udph->uh_sum));
+	// the question, unprintable bytes as dots, which is what --dryrun is
+	// for rather than logging every packet
+	size_t ulen = ntohs(udph->uh_ulen);
+	if (ulen > sizeof(struct udphdr) + sizeof(dns_header)) {
+		const uint8_t *q = (const uint8_t *)&udph[1] + sizeof(dns_header);
+		size_t qlen = ulen - sizeof(struct udphdr) - sizeof(dns_header);
+		fprintf(fp, "dns question { ");
+		for (size_t i = 0; i < qlen; i++) {
+			fputc(q[i] >= 0x20 && q[i] <= 0x7e ? q[i] : '.', fp);
+		}
+		fprintf(fp, " }\n");
+	}
 	fprintf_ip_header(fp, iph);
 	fprintf_eth_header(fp, ethh);
 	fprintf(fp, PRINT_PACKET_SEP);
 }
 
+// like the rest of what a receive thread sets up, kept until zmap exits
+static int dns_recv_thread_initialize(void **arg_ptr)
+{
+	*arg_ptr = xcalloc(1, sizeof(dns_recv_state_t));
+	return EXIT_SUCCESS;
+}
+
 int dns_validate_packet(const struct ip *ip_hdr, uint32_t len, uint32_t *src_ip,
-			uint32_t *validation, const struct port_conf *ports)
+			uint32_t *validation, const struct port_conf *ports,
+			UNUSED void *arg)
 {
 	// this does the heavy lifting including ICMP validation
 	if (udp_do_validate_packet(ip_hdr, len, src_ip, validation, num_ports, should_validate_src_port, ports) == PACKET_INVALID) {
@@ -984,13 +1125,79 @@ void dns_add_null_fs(fieldset_t *fs)
 	fs_add_uint64(fs, "dns_unconsumed_bytes", 0);
 }
 
-void dns_process_packet(const u_char *packet, uint32_t len, fieldset_t *fs,
+// Resource records are most of the cost of a response, and are only parsed
+// when one of the fields built from them is output or filtered on, and then
+// only built into fieldsets for the sections that are. Everything allocated
+// here comes from the receive thread's arena and goes with the packet.
+static void dns_add_rrs(dns_recv_state_t *st, fieldset_t *fs,
+			dns_header *dns_hdr, uint16_t udp_len)
+{
+	// And now for the complicated part. Hierarchical data.
+	char *data = ((char *)dns_hdr) + sizeof(dns_header);
+	uint16_t data_len = udp_len - sizeof(struct udphdr) - sizeof(dns_header);
+	bool err = false;
+	st->have_qname = false;
+	static const char *sections[] = {"dns_questions", "dns_answers",
+					 "dns_authorities", "dns_additionals"};
+	uint16_t counts[] = {ntohs(dns_hdr->qdcount), ntohs(dns_hdr->ancount),
+			     ntohs(dns_hdr->nscount), ntohs(dns_hdr->arcount)};
+	for (int s = 0; s < 4; s++) {
+		fieldset_t *list =
+		    dns_section_needed[s] ? fs_new_repeated_fieldset() : NULL;
+		for (int i = 0; i < counts[s] && !err; i++) {
+			if (s == 0) {
+				err = process_response_question(
+				    st, &data, &data_len, (char *)dns_hdr,
+				    udp_len, list);
+			} else {
+				err = process_response_answer(
+				    st, &data, &data_len, (char *)dns_hdr,
+				    udp_len, list);
+			}
+		}
+		if (list) {
+			fs_add_repeated(fs, sections[s], list);
+		} else {
+			fs_add_null(fs, sections[s]);
+		}
+	}
+	// Do we have unconsumed data?
+	if (data_len != 0) {
+		err = true;
+	}
+	// Did we parse OK?
+	fs_add_uint64(fs, "dns_parse_err", err);
+	fs_add_uint64(fs, "dns_unconsumed_bytes", data_len);
+}
+
+static void dns_add_null_rrs(fieldset_t *fs)
+{
+	fs_add_null(fs, "dns_questions");
+	fs_add_null(fs, "dns_answers");
+	fs_add_null(fs, "dns_authorities");
+	fs_add_null(fs, "dns_additionals");
+	fs_add_null(fs, "dns_parse_err");
+	fs_add_null(fs, "dns_unconsumed_bytes");
+}
+
+// only ICMP errors are told apart without parsing the answer
+int dns_classify(const parsed_packet_t *pp, UNUSED uint32_t *validation,
+		 int *app_success, UNUSED void *arg)
+{
+	if (pp->proto != IPPROTO_ICMP) {
+		return -1;
+	}
+	*app_success = 0;
+	return 0;
+}
+
+void dns_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
 			uint32_t *validation,
-			UNUSED struct timespec ts)
+			UNUSED struct timespec ts, void *arg)
 {
-	struct ip *ip_hdr = (struct ip *)&packet[sizeof(struct ether_header)];
+	struct ip *ip_hdr = (struct ip *)pp->ip;
 	if (ip_hdr->ip_p == IPPROTO_UDP) {
-		struct udphdr *udp_hdr = get_udp_header(ip_hdr, len);
+		struct udphdr *udp_hdr = (struct udphdr *)pp->udp;
 		assert(udp_hdr);
 		uint16_t udp_len = ntohs(udp_hdr->uh_ulen);
 
@@ -1073,54 +1280,11 @@ void dns_process_packet(const u_char *packet, uint32_t len, fieldset_t *fs,
 				      ntohs(dns_hdr->nscount));
 			fs_add_uint64(fs, "dns_arcount",
 				      ntohs(dns_hdr->arcount));
-			// And now for the complicated part. Hierarchical data.
-			char *data = ((char *)dns_hdr) + sizeof(dns_header);
-			uint16_t data_len =
-			    udp_len - sizeof(udp_hdr) - sizeof(dns_header);
-			bool err = false;
-			// Questions
-			fieldset_t *list = fs_new_repeated_fieldset();
-			for (int i = 0; i < ntohs(dns_hdr->qdcount) && !err;
-			     i++) {
-				err = process_response_question(
-				    &data, &data_len, (char *)dns_hdr, udp_len,
-				    list);
-			}
-			fs_add_repeated(fs, "dns_questions", list);
-			// Answers
-			list = fs_new_repeated_fieldset();
-			for (int i = 0; i < ntohs(dns_hdr->ancount) && !err;
-			     i++) {
-				err = process_response_answer(&data, &data_len,
-							      (char *)dns_hdr,
-							      udp_len, list);
-			}
-			fs_add_repeated(fs, "dns_answers", list);
-			// Authorities
-			list = fs_new_repeated_fieldset();
-			for (int i = 0; i < ntohs(dns_hdr->nscount) && !err;
-			     i++) {
-				err = process_response_answer(&data, &data_len,
-							      (char *)dns_hdr,
-							      udp_len, list);
-			}
-			fs_add_repeated(fs, "dns_authorities", list);
-			// Additionals
-			list = fs_new_repeated_fieldset();
-			for (int i = 0; i < ntohs(dns_hdr->arcount) && !err;
-			     i++) {
-				err = process_response_answer(&data, &data_len,
-							      (char *)dns_hdr,
-							      udp_len, list);
-			}
-			fs_add_repeated(fs, "dns_additionals", list);
-			// Do we have unconsumed data?
-			if (data_len != 0) {
-				err = true;
+			if (dns_parse_rrs) {
+				dns_add_rrs(arg, fs, dns_hdr, udp_len);
+			} else {
+				dns_add_null_rrs(fs);
 			}
-			// Did we parse OK?
-			fs_add_uint64(fs, "dns_parse_err", err);
-			fs_add_uint64(fs, "dns_unconsumed_bytes", data_len);
 		}
 		// Now the raw stuff.
 		fs_add_binary(fs, "raw_data", (udp_len - sizeof(struct udphdr)),
@@ -1132,10 +1296,10 @@ void dns_process_packet(const u_char *packet, uint32_t len, fieldset_t *fs,
 		fs_add_bool(fs, "success", 0);
 		fs_add_bool(fs, "app_success", 0);
 		// Populate all ICMP Fields
-		fs_populate_icmp_from_iphdr(ip_hdr, len, fs);
+		fs_populate_icmp_from_parsed(pp, fs);
 		fs_add_null(fs, "udp_len");
 		dns_add_null_fs(fs);
-		fs_add_binary(fs, "raw_data", len, (char *)packet, 0);
+		fs_add_binary(fs, "raw_data", pp->len, (char *)ip_hdr, 0);
 	} else {
 		// This should not happen. Both the pcap filter and validate
 		// packet prevent this.
@@ -1200,9 +1364,12 @@ probe_module_t module_dns = {
     .global_initialize = &dns_global_initialize,
     .prepare_packet = &dns_prepare_packet,
     .make_packet = &dns_make_packet,
+    .make_packets = &dns_make_packets,
     .print_packet = &dns_print_packet,
+    .recv_thread_initialize = &dns_recv_thread_initialize,
     .validate_packet = &dns_validate_packet,
     .process_packet = &dns_process_packet,
+    .classify = &dns_classify,
     .close = &dns_global_cleanup,
     .output_type = OUTPUT_TYPE_DYNAMIC,
     .fields = fields,
@@ -29,6 +29,7 @@
 #include "../fieldset.h"
 #include "packet.h"
 #include "validate.h"
+#include "../ipv6_source.h"
 
 #define ICMP_SMALLEST_SIZE 5
 #define ICMP_TIMXCEED_UNREACH_HEADER_SIZE 8
@@ -44,7 +45,7 @@ struct icmp6_payload_for_rtt {
 int icmp6_echotime_global_initialize(struct state_conf *conf)
 {
 	// Only look at received packets destined to the specified scanning address (useful for parallel zmap scans)
-	if (asprintf((char ** restrict) &module_icmp6_echo_time_novalidation.pcap_filter, "%s && ip6 dst host %s", module_icmp6_echo_time_novalidation.pcap_filter, conf->ipv6_source_ip) == -1) {
+	if (asprintf((char ** restrict) &module_icmp6_echo_time_novalidation.pcap_filter, "%s && ip6 dst %s %s", module_icmp6_echo_time_novalidation.pcap_filter, ipv6_source_filter_kind(conf->ipv6_source_ip), conf->ipv6_source_ip) == -1) {
 		return 1;
 	}
 
@@ -70,7 +71,7 @@ static int icmp6_echotime_prepare_packet(void *buf, macaddr_t *src, macaddr_t *g
 	return EXIT_SUCCESS;
 }
 
-static int icmp6_echotime_make_packet(void *buf, size_t *buf_len, UNUSED ipaddr_n_t src_ip,  UNUSED ipaddr_n_t dst_ip, UNUSED port_n_t dst_port, uint8_t ttl, uint32_t *validation, UNUSED int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg)
+static int icmp6_echotime_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,  const ipaddr_t *dst_ip, UNUSED port_n_t dst_port, uint8_t ttl, uint32_t *validation, UNUSED int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg)
 {
 	struct ether_header *eth_header = (struct ether_header *) buf;
 	struct ip6_hdr *ip6_header = (struct ip6_hdr *)(&eth_header[1]);
@@ -84,8 +85,8 @@ static int icmp6_echotime_make_packet(void *buf, size_t *buf_len, UNUSED ipaddr_
 	icmp6_header->icmp6_data32[1] = validation[0];
 	icmp6_header->icmp6_data32[2] = validation[1];
 
-	ip6_header->ip6_src = ((struct in6_addr *) arg)[0];
-	ip6_header->ip6_dst = ((struct in6_addr *) arg)[1];
+	ip6_header->ip6_src = src_ip->v6;
+	ip6_header->ip6_dst = dst_ip->v6;
 	ip6_header->ip6_ctlun.ip6_un1.ip6_un1_hlim = ttl;
 
 	icmp6_header->icmp6_id= icmp_idnum;
@@ -94,7 +95,7 @@ static int icmp6_echotime_make_packet(void *buf, size_t *buf_len, UNUSED ipaddr_
 	gettimeofday(&tv, NULL);
 	payload->sent_tv_sec = tv.tv_sec;
 	payload->sent_tv_usec = tv.tv_usec;
-	payload->dst_init =  ((struct in6_addr *) arg)[1];
+	payload->dst_init =  dst_ip->v6;
 
 	icmp6_header->icmp6_cksum = 0;
 	icmp6_header->icmp6_cksum= ipv6_payload_checksum(sizeof(struct icmp6_hdr) + sizeof(struct icmp6_payload_for_rtt), &ip6_header->ip6_src, &ip6_header->ip6_dst, (unsigned short *) icmp6_header, IPPROTO_ICMPV6);
@@ -125,7 +126,7 @@ static void icmp6_echotime_print_packet(FILE *fp, void* packet)
 
 
 static int icmp6_echotime_validate_packet(const struct ip *ip_hdr,
-		uint32_t len, __attribute__((unused)) uint32_t *src_ip,UNUSED uint32_t *validation, UNUSED const struct port_conf *ports)
+		uint32_t len, __attribute__((unused)) uint32_t *src_ip,UNUSED uint32_t *validation, UNUSED const struct port_conf *ports, UNUSED void *arg)
 {
     struct ip6_hdr *ip6_hdr = (struct ip6_hdr*) ip_hdr;
 
@@ -174,12 +175,11 @@ static int icmp6_echotime_validate_packet(const struct ip *ip_hdr,
 	return 1;
 }
 
-static void icmp6_echotime_process_packet(const u_char *packet,
-		__attribute__((unused)) uint32_t len, fieldset_t *fs,
+static void icmp6_echotime_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
 		__attribute__((unused)) uint32_t *validation,
-		__attribute__((unused)) struct timespec ts)
+		__attribute__((unused)) struct timespec ts, UNUSED void *arg)
 {
-	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *) &packet[sizeof(struct ether_header)];
+	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *)pp->ip6;
 	struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *) (&ip6_hdr[1]);
 	fs_add_uint64(fs, "type", icmp6_hdr->icmp6_type);
 	fs_add_uint64(fs, "code", icmp6_hdr->icmp6_code);
@@ -197,8 +197,8 @@ static void icmp6_echotime_process_packet(const u_char *packet,
 	} else {
 		// Use inner IP header values for unsuccessful ICMP replies
 		struct ip6_hdr *ip6_inner_hdr = (struct ip6_hdr *) &icmp6_hdr[1];
-		fs_modify_string(fs, "saddr", make_ipv6_str(&(ip6_inner_hdr->ip6_dst)), 1);
-		fs_modify_string(fs, "daddr", make_ipv6_str(&(ip6_inner_hdr->ip6_src)), 1);
+		fs_modify_ipv6(fs, "saddr", &(ip6_inner_hdr->ip6_dst));
+		fs_modify_ipv6(fs, "daddr", &(ip6_inner_hdr->ip6_src));
 
 		switch(icmp6_hdr->icmp6_type) {
 			case ICMP6_DST_UNREACH:
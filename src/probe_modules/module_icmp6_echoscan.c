@@ -26,6 +26,7 @@
 #include "../fieldset.h"
 #include "packet.h"
 #include "validate.h"
+#include "../ipv6_source.h"
 
 #define ICMP_SMALLEST_SIZE 5
 #define ICMP_TIMXCEED_UNREACH_HEADER_SIZE 8
@@ -35,13 +36,15 @@ probe_module_t module_icmp6_echoscan;
 int icmp6_echo_global_initialize(struct state_conf *conf)
 {
 	// Only look at received packets destined to the specified scanning address (useful for parallel zmap scans)
-	if (asprintf((char ** restrict) &module_icmp6_echoscan.pcap_filter, "%s && ip6 dst host %s", module_icmp6_echoscan.pcap_filter, conf->ipv6_source_ip) == -1) {
+	if (asprintf((char ** restrict) &module_icmp6_echoscan.pcap_filter, "%s && ip6 dst %s %s", module_icmp6_echoscan.pcap_filter, ipv6_source_filter_kind(conf->ipv6_source_ip), conf->ipv6_source_ip) == -1) {
 		return 1;
 	}
 
 	return EXIT_SUCCESS;
 }
 
+static __thread uint32_t icmp6_csum_base;
+
 static int icmp6_echo_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 				    UNUSED void *arg_ptr)
 {
@@ -58,10 +61,18 @@ static int icmp6_echo_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 	struct icmp6_hdr *icmp6_header = (struct icmp6_hdr*)(&ip6_header[1]);
 	make_icmp6_header(icmp6_header);
 
+	// everything but the id and the validation carried in the payload
+	uint32_t sum = csum_partial(icmp6_header, payload_len, 0);
+	sum = csum_sub16(sum, icmp6_header->icmp6_id);
+	sum = csum_sub32(sum, icmp6_header->icmp6_data32[1]);
+	sum = csum_sub32(sum, icmp6_header->icmp6_data32[2]);
+	sum = csum_sub16(sum, icmp6_header->icmp6_cksum);
+	icmp6_csum_base = sum + htons(payload_len) + htons(IPPROTO_ICMPV6);
+
 	return EXIT_SUCCESS;
 }
 
-static int icmp6_echo_make_packet(void *buf, size_t *buf_len, UNUSED ipaddr_n_t src_ip,  UNUSED ipaddr_n_t dst_ip, UNUSED port_n_t dst_port, uint8_t ttl, uint32_t *validation, UNUSED int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg)
+static int icmp6_echo_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,  const ipaddr_t *dst_ip, UNUSED port_n_t dst_port, uint8_t ttl, uint32_t *validation, UNUSED int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg)
 {
 	struct ether_header *eth_header = (struct ether_header *) buf;
 	struct ip6_hdr *ip6_header = (struct ip6_hdr *)(&eth_header[1]);
@@ -72,14 +83,17 @@ static int icmp6_echo_make_packet(void *buf, size_t *buf_len, UNUSED ipaddr_n_t
 	icmp6_header->icmp6_data32[1] = validation[0];
 	icmp6_header->icmp6_data32[2] = validation[1];
 
-	ip6_header->ip6_src = ((struct in6_addr *) arg)[0];
-	ip6_header->ip6_dst = ((struct in6_addr *) arg)[1];
+	ip6_header->ip6_src = src_ip->v6;
+	ip6_header->ip6_dst = dst_ip->v6;
 	ip6_header->ip6_ctlun.ip6_un1.ip6_un1_hlim = ttl;
 
 	icmp6_header->icmp6_id= icmp_idnum;
-	icmp6_header->icmp6_cksum = 0;
 
-	icmp6_header->icmp6_cksum = ipv6_payload_checksum(sizeof(struct icmp6_hdr) + 2*sizeof(uint32_t), &ip6_header->ip6_src, &ip6_header->ip6_dst, (unsigned short *) icmp6_header, IPPROTO_ICMPV6);
+	uint32_t sum = icmp6_csum_base + icmp6_header->icmp6_id +
+		ip6_pseudo_csum(&ip6_header->ip6_src, &ip6_header->ip6_dst);
+	sum = csum_add32(sum, icmp6_header->icmp6_data32[1]);
+	sum = csum_add32(sum, icmp6_header->icmp6_data32[2]);
+	icmp6_header->icmp6_cksum = csum_fold(sum);
 
     // 8 bytes of data are used in ICMPv6 for validation
     *buf_len = sizeof(struct ether_header) + sizeof(struct ip6_hdr) + ICMP_MINLEN + 2*sizeof(uint32_t);
@@ -109,7 +123,7 @@ static void icmp6_echo_print_packet(FILE *fp, void* packet)
 
 
 static int icmp6_validate_packet(const struct ip *ip_hdr,
-		uint32_t len, __attribute__((unused)) uint32_t *src_ip, uint32_t *validation, UNUSED const struct port_conf *ports)
+		uint32_t len, __attribute__((unused)) uint32_t *src_ip, uint32_t *validation, UNUSED const struct port_conf *ports, UNUSED void *arg)
 {
     struct ip6_hdr *ip6_hdr = (struct ip6_hdr*) ip_hdr;
 
@@ -157,12 +171,11 @@ static int icmp6_validate_packet(const struct ip *ip_hdr,
 	return 1;
 }
 
-static void icmp6_echo_process_packet(const u_char *packet,
-		__attribute__((unused)) uint32_t len, fieldset_t *fs,
+static void icmp6_echo_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
 		__attribute__((unused)) uint32_t *validation,
-		UNUSED const struct timespec ts)
+		UNUSED const struct timespec ts, UNUSED void *arg)
 {
-	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *) &packet[sizeof(struct ether_header)];
+	struct ip6_hdr *ip6_hdr = (struct ip6_hdr *)pp->ip6;
 	struct icmp6_hdr *icmp6_hdr = (struct icmp6_hdr *) (&ip6_hdr[1]);
 	fs_add_uint64(fs, "type", icmp6_hdr->icmp6_type);
 	fs_add_uint64(fs, "code", icmp6_hdr->icmp6_code);
@@ -175,8 +188,8 @@ static void icmp6_echo_process_packet(const u_char *packet,
 	} else {
 		// Use inner IP header values for unsuccessful ICMP replies
 		struct ip6_hdr *ip6_inner_hdr = (struct ip6_hdr *) &icmp6_hdr[1];
-		fs_modify_string(fs, "saddr", make_ipv6_str(&(ip6_inner_hdr->ip6_dst)), 1);
-		fs_modify_string(fs, "daddr", make_ipv6_str(&(ip6_inner_hdr->ip6_src)), 1);
+		fs_modify_ipv6(fs, "saddr", &(ip6_inner_hdr->ip6_dst));
+		fs_modify_ipv6(fs, "daddr", &(ip6_inner_hdr->ip6_src));
 
 		switch(icmp6_hdr->icmp6_type) {
 			case ICMP6_DST_UNREACH:
@@ -37,6 +37,9 @@ static size_t icmp_payload_len = 0;
 static const size_t icmp_payload_default_len = 20;
 static char *icmp_payload = NULL;
 
+static __thread uint32_t ip_csum_base;
+static __thread uint32_t icmp_csum_base;
+
 int icmp_global_initialize(struct state_conf *conf)
 {
 	if (!(conf->probe_args && strlen(conf->probe_args) > 0)) {
@@ -157,11 +160,19 @@ static int icmp_echo_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 
 	memcpy(payload, icmp_payload, icmp_payload_len);
 
+	ip_csum_base = ip_header_csum_base(ip_header);
+	// everything but the id and sequence number, which carry validation
+	uint32_t sum =
+	    checksum_partial(icmp_header, ICMP_MINLEN + icmp_payload_len, 0);
+	sum = csum_sub16(sum, icmp_header->icmp_id);
+	sum = csum_sub16(sum, icmp_header->icmp_seq);
+	icmp_csum_base = csum_sub16(sum, icmp_header->icmp_cksum);
+
 	return EXIT_SUCCESS;
 }
 
-static int icmp_echo_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
-				 ipaddr_n_t dst_ip, UNUSED port_n_t dst_port,
+static int icmp_echo_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+				 const ipaddr_t *dst_ip, UNUSED port_n_t dst_port,
 				 uint8_t ttl, uint32_t *validation,
 				 UNUSED int probe_num, uint16_t ip_id,
 				 UNUSED void *arg)
@@ -173,28 +184,58 @@ static int icmp_echo_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 	uint16_t icmp_idnum = validation[1] & 0xFFFF;
 	uint16_t icmp_seqnum = validation[2] & 0xFFFF;
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	ip_header->ip_ttl = ttl;
 
 	icmp_header->icmp_id = icmp_idnum;
 	icmp_header->icmp_seq = icmp_seqnum;
 
-	icmp_header->icmp_cksum = 0;
-	icmp_header->icmp_cksum = icmp_checksum((unsigned short *)icmp_header,
-						ICMP_MINLEN + icmp_payload_len);
+	icmp_header->icmp_cksum = csum_fold(
+	    icmp_csum_base + icmp_header->icmp_id + icmp_header->icmp_seq);
 
 	// Update the IP and UDP headers to match the new payload length
 	size_t ip_len = sizeof(struct ip) + ICMP_MINLEN + icmp_payload_len;
 	ip_header->ip_len = htons(ip_len);
 	ip_header->ip_id = ip_id;
-	ip_header->ip_sum = 0;
-	ip_header->ip_sum = zmap_ip_checksum((unsigned short *)ip_header);
+	ip_header->ip_sum = ip_header_csum(ip_csum_base, ip_header);
 	*buf_len = ip_len + sizeof(struct ether_header);
 
 	return EXIT_SUCCESS;
 }
 
+// prepare_packet has already set the lengths, which don't change
+static int icmp_echo_make_packets(struct batch_packet *packets,
+				  const probe_spec_t *specs, size_t n,
+				  uint8_t ttl, UNUSED void *arg)
+{
+	const uint32_t ip_base = ip_csum_base;
+	const uint32_t icmp_base = icmp_csum_base;
+	const uint32_t len = sizeof(struct ether_header) + sizeof(struct ip) +
+			     ICMP_MINLEN + icmp_payload_len;
+	for (size_t i = 0; i < n; i++) {
+		const probe_spec_t *spec = &specs[i];
+		struct ip *ip_header =
+		    (struct ip *)(packets[i].buf + sizeof(struct ether_header));
+		struct icmp *icmp_header = (struct icmp *)(&ip_header[1]);
+		uint16_t icmp_idnum = spec->validation[1] & 0xFFFF;
+		uint16_t icmp_seqnum = spec->validation[2] & 0xFFFF;
+
+		ip_header->ip_src.s_addr = spec->src_ip.v4;
+		ip_header->ip_dst.s_addr = spec->dst_ip.v4;
+		ip_header->ip_ttl = ttl;
+		ip_header->ip_id = spec->ip_id;
+		ip_header->ip_sum = ip_header_csum(ip_base, ip_header);
+
+		icmp_header->icmp_id = icmp_idnum;
+		icmp_header->icmp_seq = icmp_seqnum;
+		icmp_header->icmp_cksum =
+		    csum_fold(icmp_base + icmp_idnum + icmp_seqnum);
+		packets[i].len = len;
+	}
+	return EXIT_SUCCESS;
+}
+
 static void icmp_echo_print_packet(FILE *fp, void *packet)
 {
 	struct ether_header *ethh = (struct ether_header *)packet;
@@ -212,7 +253,8 @@ static void icmp_echo_print_packet(FILE *fp, void *packet)
 	fprintf(fp, PRINT_PACKET_SEP);
 }
 
-static int imcp_validate_id_seq(struct icmp *icmp_h, uint32_t *validation)
+static int imcp_validate_id_seq(const struct icmp *icmp_h,
+				uint32_t *validation)
 {
 	if (icmp_h->icmp_id != (validation[1] & 0xFFFF)) {
 		return PACKET_INVALID;
@@ -223,55 +265,57 @@ static int imcp_validate_id_seq(struct icmp *icmp_h, uint32_t *validation)
 	return PACKET_VALID;
 }
 
-static int icmp_validate_packet(const struct ip *ip_hdr, uint32_t len,
+static int icmp_validate_parsed(const parsed_packet_t *pp,
 				UNUSED uint32_t *src_ip, uint32_t *validation,
-				UNUSED const struct port_conf *ports)
+				UNUSED const struct port_conf *ports,
+				UNUSED void *arg)
 {
-	if (ip_hdr->ip_p != IPPROTO_ICMP) {
-		return PACKET_INVALID;
-	}
-	struct icmp *icmp_h = get_icmp_header(ip_hdr, len);
-	if (!icmp_h) {
+	if (pp->proto != IPPROTO_ICMP || !pp->icmp) {
 		return PACKET_INVALID;
 	}
-	if (icmp_h->icmp_type == ICMP_ECHOREPLY) {
-		return imcp_validate_id_seq(icmp_h, validation);
+	if (pp->icmp->icmp_type == ICMP_ECHOREPLY) {
+		return imcp_validate_id_seq(pp->icmp, validation);
 	} else {
 		// handle unresearch/quench/redirect/timeout
-		struct ip *ip_inner;
-		size_t ip_inner_len;
-		int icmp_inner_valid = icmp_helper_validate(
-		    ip_hdr, len, sizeof(struct icmp), &ip_inner, &ip_inner_len);
-		if (icmp_inner_valid == PACKET_INVALID) {
+		if (icmp_helper_validate_parsed(pp, sizeof(struct icmp)) ==
+		    PACKET_INVALID) {
 			return PACKET_INVALID;
 		}
-		struct icmp *icmp_inner =
-		    get_icmp_header(ip_inner, ip_inner_len);
-		if (!icmp_inner) {
-			return PACKET_INVALID;
-		}
-		validate_gen(ip_hdr->ip_dst.s_addr, ip_inner->ip_dst.s_addr, 0,
-			     (uint8_t *)validation);
+		validate_gen(pp->ip->ip_dst.s_addr, pp->inner_ip->ip_dst.s_addr,
+			     0, (uint8_t *)validation);
 		// validate icmp id and seqnum
-		return imcp_validate_id_seq(icmp_inner, validation);
+		return imcp_validate_id_seq(pp->inner_l4, validation);
 	}
 }
 
-static void icmp_echo_process_packet(const u_char *packet, uint32_t len,
+static int icmp_validate_packet(const struct ip *ip_hdr, uint32_t len,
+				uint32_t *src_ip, uint32_t *validation,
+				const struct port_conf *ports, void *arg)
+{
+	parsed_packet_t pp;
+	parse_packet(ip_hdr, len, 0, &pp);
+	return icmp_validate_parsed(&pp, src_ip, validation, ports, arg);
+}
+
+static int icmp_echo_classify(const parsed_packet_t *pp,
+			      UNUSED uint32_t *validation,
+			      UNUSED int *app_success, UNUSED void *arg)
+{
+	return pp->icmp->icmp_type == ICMP_ECHOREPLY;
+}
+
+static void icmp_echo_process_packet(const parsed_packet_t *pp,
 				     fieldset_t *fs,
 				     UNUSED uint32_t *validation,
-				     UNUSED struct timespec ts)
+				     UNUSED struct timespec ts,
+				     UNUSED void *arg)
 {
-	struct ip *ip_hdr = (struct ip *)&packet[sizeof(struct ether_header)];
-	struct icmp *icmp_hdr =
-	    (struct icmp *)((char *)ip_hdr + 4 * ip_hdr->ip_hl);
+	const struct icmp *icmp_hdr = pp->icmp;
 	fs_add_uint64(fs, "type", icmp_hdr->icmp_type);
 	fs_add_uint64(fs, "code", icmp_hdr->icmp_code);
 	fs_add_uint64(fs, "icmp_id", ntohs(icmp_hdr->icmp_id));
 	fs_add_uint64(fs, "seq", ntohs(icmp_hdr->icmp_seq));
 
-	uint32_t hdrlen = sizeof(struct ether_header) + 4 * ip_hdr->ip_hl + 4;
-
 	switch (icmp_hdr->icmp_type) {
 	case ICMP_ECHOREPLY:
 		fs_add_string(fs, "classification", (char *)"echoreply", 0);
@@ -299,10 +343,11 @@ static void icmp_echo_process_packet(const u_char *packet, uint32_t len,
 		break;
 	}
 
-	int datalen = len - hdrlen;
+	// the payload starts after the type, code and checksum
+	int datalen = pp->l4_len - 4;
 
 	if (datalen > 0) {
-		const uint8_t *data = (uint8_t *)&packet[hdrlen];
+		const uint8_t *data = (const uint8_t *)icmp_hdr + 4;
 		fs_add_binary(fs, "data", (size_t)datalen, (void *)data, 0);
 	} else {
 		fs_add_null(fs, "data");
@@ -332,9 +377,12 @@ probe_module_t module_icmp_echo = {
     .close = &icmp_global_cleanup,
     .prepare_packet = &icmp_echo_prepare_packet,
     .make_packet = &icmp_echo_make_packet,
+    .make_packets = &icmp_echo_make_packets,
     .print_packet = &icmp_echo_print_packet,
     .process_packet = &icmp_echo_process_packet,
+    .classify = &icmp_echo_classify,
     .validate_packet = &icmp_validate_packet,
+    .validate_parsed = &icmp_validate_parsed,
     .helptext =
 	"Probe module that sends ICMP echo requests to hosts.\n"
 	"Payload of ICMP packets will consist of zeroes unless you customize it with\n"
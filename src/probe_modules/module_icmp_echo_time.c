@@ -22,6 +22,7 @@
 #include "../fieldset.h"
 #include "packet.h"
 #include "validate.h"
+#include "../timestamps.h"
 
 #define ICMP_SMALLEST_SIZE 5
 #define ICMP_TIMXCEED_UNREACH_HEADER_SIZE 8
@@ -52,8 +53,8 @@ static int icmp_echo_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 	return EXIT_SUCCESS;
 }
 
-static int icmp_echo_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
-				 ipaddr_n_t dst_ip, UNUSED port_n_t dport,
+static int icmp_echo_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+				 const ipaddr_t *dst_ip, UNUSED port_n_t dport,
 				 uint8_t ttl, uint32_t *validation,
 				 UNUSED int probe_num, uint16_t ip_id,
 				 UNUSED void *arg)
@@ -68,8 +69,8 @@ static int icmp_echo_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 	uint16_t icmp_seqnum = validation[2] & 0xFFFF;
 	struct timeval tv;
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	ip_header->ip_ttl = ttl;
 
 	icmp_header->icmp_id = icmp_idnum;
@@ -78,7 +79,7 @@ static int icmp_echo_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 	gettimeofday(&tv, NULL);
 	payload->sent_tv_sec = tv.tv_sec;
 	payload->sent_tv_usec = tv.tv_usec;
-	payload->dst = dst_ip;
+	payload->dst = dst_ip->v4;
 
 	icmp_header->icmp_cksum = 0;
 	icmp_header->icmp_cksum =
@@ -116,7 +117,8 @@ static void icmp_echo_print_packet(FILE *fp, void *packet)
 
 static int icmp_validate_packet(const struct ip *ip_hdr, uint32_t len,
 				uint32_t *src_ip, uint32_t *validation,
-				UNUSED const struct port_conf *ports)
+				UNUSED const struct port_conf *ports,
+				UNUSED void *arg)
 {
 	if (ip_hdr->ip_p != IPPROTO_ICMP) {
 		return 0;
@@ -165,12 +167,13 @@ static int icmp_validate_packet(const struct ip *ip_hdr, uint32_t len,
 	return 1;
 }
 
-static void icmp_echo_process_packet(const u_char *packet, UNUSED uint32_t len,
+static void icmp_echo_process_packet(const parsed_packet_t *pp,
 				     fieldset_t *fs,
 				     UNUSED uint32_t *validation,
-				     UNUSED struct timespec ts)
+				     UNUSED struct timespec ts,
+				     UNUSED void *arg)
 {
-	struct ip *ip_hdr = (struct ip *)&packet[sizeof(struct ether_header)];
+	struct ip *ip_hdr = (struct ip *)pp->ip;
 	struct icmp *icmp_hdr =
 	    (struct icmp *)((char *)ip_hdr + 4 * ip_hdr->ip_hl);
 	fs_add_uint64(fs, "type", icmp_hdr->icmp_type);
@@ -185,8 +188,16 @@ static void icmp_echo_process_packet(const u_char *packet, UNUSED uint32_t len,
 	uint64_t sent_timestamp_us = (uint64_t)payload->sent_tv_usec;
 	uint64_t recv_timestamp_ts = (uint64_t)ts.tv_sec;
 	uint64_t recv_timestamp_us = (uint64_t)ts.tv_nsec / 1000;
-	uint64_t rtt_us = (recv_timestamp_ts * 1000000 + recv_timestamp_us) -
-			  (sent_timestamp_ts * 1000000 + sent_timestamp_us);
+	// from when the probe left if it was stamped (--tx-timestamps), else
+	// from when it was built
+	uint64_t sent_ns;
+	if (!tx_stamps_lookup(payload->dst, &sent_ns)) {
+		sent_ns = sent_timestamp_ts * 1000000000 +
+			  sent_timestamp_us * 1000;
+	}
+	uint64_t recv_ns =
+	    recv_timestamp_ts * 1000000000 + (uint64_t)ts.tv_nsec;
+	uint64_t rtt_us = (recv_ns - sent_ns) / 1000;
 
 	fs_add_uint64(fs, "sent_timestamp_ts", sent_timestamp_ts);
 	fs_add_uint64(fs, "sent_timestamp_us", sent_timestamp_us);
@@ -0,0 +1,299 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+// probe module for stateless, TTL-limited path discovery: each of the -P
+// probes to a target is an ICMP echo request with its own TTL, and the
+// routers' time exceeded messages, which quote the probe, are validated
+// against it and give one hop of the path each. The TTL travels in the
+// low byte of the sequence number, the rest of it and the id carrying
+// validation, so a hop is known without any state kept for the probe.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "../../lib/includes.h"
+#include "probe_modules.h"
+#include "../fieldset.h"
+#include "packet.h"
+#include "logger.h"
+#include "validate.h"
+
+#define ICMP_TRACE_PAYLOAD_LEN 20
+#define ICMP_TRACE_DEFAULT_FIRST_TTL 1
+
+probe_module_t module_icmp_trace;
+
+// the TTL of probe 0, probe n having first_ttl + n
+static uint8_t first_ttl = ICMP_TRACE_DEFAULT_FIRST_TTL;
+
+static __thread uint32_t ip_csum_base;
+static __thread uint32_t icmp_csum_base;
+
+static inline uint16_t trace_id(const uint32_t *validation)
+{
+	return validation[1] & 0xFFFF;
+}
+
+// network order, as are the id and sequence number in the header
+static inline uint16_t trace_seq(const uint32_t *validation, uint8_t ttl)
+{
+	return htons((ntohs(validation[2] & 0xFFFF) & 0xFF00) | ttl);
+}
+
+static int icmp_trace_global_initialize(struct state_conf *conf)
+{
+	if (conf->probe_args && strlen(conf->probe_args) > 0) {
+		char *end = NULL;
+		if (strncmp(conf->probe_args, "first-ttl=", 10)) {
+			log_error("icmp_trace", "unknown probe argument %s "
+						"(expected first-ttl=<n>)",
+				  conf->probe_args);
+			return EXIT_FAILURE;
+		}
+		long ttl = strtol(conf->probe_args + 10, &end, 10);
+		if (*end || ttl < 1 || ttl > 255) {
+			log_error("icmp_trace", "first-ttl must be 1 to 255");
+			return EXIT_FAILURE;
+		}
+		first_ttl = (uint8_t)ttl;
+	}
+	if (first_ttl + conf->packet_streams - 1 > 255) {
+		log_error("icmp_trace",
+			  "%d probes from a TTL of %u go past 255; send fewer "
+			  "(-P) or start lower (first-ttl=)",
+			  conf->packet_streams, first_ttl);
+		return EXIT_FAILURE;
+	}
+	if (conf->packet_streams == 1) {
+		log_warn("icmp_trace", "sending a single probe per target, with "
+				       "a TTL of %u; -P sets the number of "
+				       "hops probed",
+			 first_ttl);
+	}
+	log_info("icmp_trace", "probing TTLs %u to %u of each target",
+		 first_ttl, first_ttl + conf->packet_streams - 1);
+	return EXIT_SUCCESS;
+}
+
+static int icmp_trace_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
+				     UNUSED void *arg_ptr)
+{
+	memset(buf, 0, MAX_PACKET_SIZE);
+
+	struct ether_header *eth_header = (struct ether_header *)buf;
+	make_eth_header(eth_header, src, gw);
+
+	struct ip *ip_header = (struct ip *)(&eth_header[1]);
+	uint16_t len =
+	    htons(sizeof(struct ip) + ICMP_MINLEN + ICMP_TRACE_PAYLOAD_LEN);
+	make_ip_header(ip_header, IPPROTO_ICMP, len);
+
+	struct icmp *icmp_header = (struct icmp *)(&ip_header[1]);
+	make_icmp_header(icmp_header);
+
+	ip_csum_base = ip_header_csum_base(ip_header);
+	// everything but the id and sequence number, which carry validation
+	uint32_t sum = checksum_partial(icmp_header,
+					ICMP_MINLEN + ICMP_TRACE_PAYLOAD_LEN, 0);
+	sum = csum_sub16(sum, icmp_header->icmp_id);
+	sum = csum_sub16(sum, icmp_header->icmp_seq);
+	icmp_csum_base = csum_sub16(sum, icmp_header->icmp_cksum);
+
+	return EXIT_SUCCESS;
+}
+
+static int icmp_trace_make_packet(void *buf, size_t *buf_len,
+				  const ipaddr_t *src_ip, const ipaddr_t *dst_ip,
+				  UNUSED port_n_t dst_port, UNUSED uint8_t ttl,
+				  uint32_t *validation, int probe_num,
+				  uint16_t ip_id, UNUSED void *arg)
+{
+	struct ether_header *eth_header = (struct ether_header *)buf;
+	struct ip *ip_header = (struct ip *)(&eth_header[1]);
+	struct icmp *icmp_header = (struct icmp *)(&ip_header[1]);
+	uint8_t probe_ttl = first_ttl + probe_num;
+
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
+	ip_header->ip_ttl = probe_ttl;
+	ip_header->ip_id = ip_id;
+	ip_header->ip_sum = ip_header_csum(ip_csum_base, ip_header);
+
+	icmp_header->icmp_id = trace_id(validation);
+	icmp_header->icmp_seq = trace_seq(validation, probe_ttl);
+	icmp_header->icmp_cksum = csum_fold(
+	    icmp_csum_base + icmp_header->icmp_id + icmp_header->icmp_seq);
+
+	*buf_len = sizeof(struct ether_header) + sizeof(struct ip) +
+		   ICMP_MINLEN + ICMP_TRACE_PAYLOAD_LEN;
+	return EXIT_SUCCESS;
+}
+
+static void icmp_trace_print_packet(FILE *fp, void *packet)
+{
+	struct ether_header *ethh = (struct ether_header *)packet;
+	struct ip *iph = (struct ip *)&ethh[1];
+	struct icmp *icmp_header = (struct icmp *)(&iph[1]);
+
+	fprintf(fp,
+		"icmp { type: %u | code: %u "
+		"| checksum: %#04X | id: %u | seq: %u }\n",
+		icmp_header->icmp_type, icmp_header->icmp_code,
+		ntohs(icmp_header->icmp_cksum), ntohs(icmp_header->icmp_id),
+		ntohs(icmp_header->icmp_seq));
+	fprintf_ip_header(fp, iph);
+	fprintf_eth_header(fp, ethh);
+	fprintf(fp, PRINT_PACKET_SEP);
+}
+
+// whether an echo request or reply, ours or quoted, is to or from the
+// target the validation is of, with a TTL that was probed
+static int icmp_trace_check(const struct icmp *icmp_h, uint32_t *validation)
+{
+	if (icmp_h->icmp_id != trace_id(validation)) {
+		return PACKET_INVALID;
+	}
+	uint8_t ttl = ntohs(icmp_h->icmp_seq) & 0xFF;
+	if (icmp_h->icmp_seq != trace_seq(validation, ttl)) {
+		return PACKET_INVALID;
+	}
+	if (ttl < first_ttl || ttl - first_ttl >= zconf.packet_streams) {
+		return PACKET_INVALID;
+	}
+	return PACKET_VALID;
+}
+
+static int icmp_trace_validate_parsed(const parsed_packet_t *pp,
+				      UNUSED uint32_t *src_ip,
+				      uint32_t *validation,
+				      UNUSED const struct port_conf *ports,
+				      UNUSED void *arg)
+{
+	if (pp->proto != IPPROTO_ICMP || !pp->icmp) {
+		return PACKET_INVALID;
+	}
+	if (pp->icmp->icmp_type == ICMP_ECHOREPLY) {
+		return icmp_trace_check(pp->icmp, validation);
+	}
+	// a time exceeded message from a router on the way, or an
+	// unreachable one, which quote the probe: the validation the
+	// receive path made is of the router, and is made again of the
+	// target the probe was sent to
+	if (icmp_helper_validate_parsed(pp, ICMP_MINLEN) == PACKET_INVALID) {
+		return PACKET_INVALID;
+	}
+	const struct icmp *probe = pp->inner_l4;
+	if (pp->inner_ip->ip_p != IPPROTO_ICMP || probe->icmp_type != ICMP_ECHO) {
+		return PACKET_INVALID;
+	}
+	validate_gen(pp->ip->ip_dst.s_addr, pp->inner_ip->ip_dst.s_addr, 0,
+		     (uint8_t *)validation);
+	return icmp_trace_check(probe, validation);
+}
+
+static int icmp_trace_validate_packet(const struct ip *ip_hdr, uint32_t len,
+				      uint32_t *src_ip, uint32_t *validation,
+				      const struct port_conf *ports,
+				      void *arg)
+{
+	parsed_packet_t pp;
+	parse_packet(ip_hdr, len, 0, &pp);
+	return icmp_trace_validate_parsed(&pp, src_ip, validation, ports, arg);
+}
+
+static int icmp_trace_classify(const parsed_packet_t *pp,
+			       UNUSED uint32_t *validation,
+			       UNUSED int *app_success, UNUSED void *arg)
+{
+	return pp->icmp->icmp_type == ICMP_ECHOREPLY;
+}
+
+static void icmp_trace_process_packet(const parsed_packet_t *pp,
+				      fieldset_t *fs,
+				      UNUSED uint32_t *validation,
+				      UNUSED struct timespec ts,
+				      UNUSED void *arg)
+{
+	const struct icmp *icmp_hdr = pp->icmp;
+	const struct icmp *probe = icmp_hdr;
+	if (icmp_hdr->icmp_type != ICMP_ECHOREPLY) {
+		probe = pp->inner_l4;
+		// saddr is the target, as with the other modules' ICMP
+		// errors, and hop the router that answered for it
+		fs_modify_ipv4(fs, "saddr", pp->inner_ip->ip_dst.s_addr);
+	}
+	fs_add_ipv4(fs, "hop", pp->ip->ip_src.s_addr);
+	fs_add_uint64(fs, "probe_ttl", ntohs(probe->icmp_seq) & 0xFF);
+	fs_add_uint64(fs, "type", icmp_hdr->icmp_type);
+	fs_add_uint64(fs, "code", icmp_hdr->icmp_code);
+
+	switch (icmp_hdr->icmp_type) {
+	case ICMP_ECHOREPLY:
+		fs_add_string(fs, "classification", (char *)"echoreply", 0);
+		fs_add_bool(fs, "success", 1);
+		break;
+	case ICMP_TIMXCEED:
+		fs_add_string(fs, "classification", (char *)"timxceed", 0);
+		fs_add_bool(fs, "success", 0);
+		break;
+	case ICMP_UNREACH:
+		fs_add_string(fs, "classification", (char *)"unreach", 0);
+		fs_add_bool(fs, "success", 0);
+		break;
+	default:
+		fs_add_string(fs, "classification", (char *)"other", 0);
+		fs_add_bool(fs, "success", 0);
+		break;
+	}
+}
+
+static fielddef_t fields[] = {
+    {.name = "hop",
+     .type = "ip",
+     .desc = "address that answered the probe: a router on the path, or the "
+	     "target"},
+    {.name = "probe_ttl", .type = "int", .desc = "TTL the probe was sent with"},
+    {.name = "type", .type = "int", .desc = "icmp message type"},
+    {.name = "code", .type = "int", .desc = "icmp message sub type code"},
+    {.name = "classification",
+     .type = "string",
+     .desc = "probe module classification"},
+    {.name = "success",
+     .type = "bool",
+     .desc = "did the probe reach the target"}};
+
+probe_module_t module_icmp_trace = {
+    .name = "icmp_trace",
+    .max_packet_length = sizeof(struct ether_header) + sizeof(struct ip) +
+			 ICMP_MINLEN + ICMP_TRACE_PAYLOAD_LEN,
+    .pcap_filter = "icmp and icmp[0]!=8",
+    .pcap_snaplen = 96,
+    .port_args = 0,
+    .global_initialize = &icmp_trace_global_initialize,
+    .prepare_packet = &icmp_trace_prepare_packet,
+    .make_packet = &icmp_trace_make_packet,
+    .print_packet = &icmp_trace_print_packet,
+    .process_packet = &icmp_trace_process_packet,
+    .classify = &icmp_trace_classify,
+    .validate_packet = &icmp_trace_validate_packet,
+    .validate_parsed = &icmp_trace_validate_parsed,
+    .helptext =
+	"Probe module that discovers the paths to hosts without keeping state, "
+	"sending each target -P ICMP echo requests whose TTLs count up from "
+	"--probe-args=first-ttl=<n> (default 1). Each time exceeded message "
+	"is validated against the probe it quotes and gives a hop of the "
+	"path: saddr is the target, hop the router and probe_ttl its "
+	"distance. An echo reply means the target was reached (success). "
+	"Hops are never deduplicated; e.g. -P 32 -f "
+	"saddr,hop,probe_ttl,classification.",
+    .output_type = OUTPUT_TYPE_STATIC,
+    .fields = fields,
+    .numfields = 6};
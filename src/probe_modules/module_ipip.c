@@ -166,8 +166,8 @@ int ipip_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 	return EXIT_SUCCESS;
 }
 
-int ipip_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
-		     ipaddr_n_t dst_ip, port_n_t dport, UNUSED uint8_t ttl,
+int ipip_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+		     const ipaddr_t *dst_ip, port_n_t dport, UNUSED uint8_t ttl,
 		     uint32_t *validation, int probe_num, uint16_t ip_id,
 		     UNUSED void *arg)
 {
@@ -176,11 +176,11 @@ int ipip_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 	struct ip *ip_header2 = (struct ip *)(&ip_header[1]);
 	struct udphdr *udp_header = (struct udphdr *)&ip_header2[1];
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	ip_header->ip_id = ip_id;
-	ip_header2->ip_src.s_addr = dst_ip;
-	ip_header2->ip_dst.s_addr = src_ip; // TODO put "external_ip"
+	ip_header2->ip_src.s_addr = dst_ip->v4;
+	ip_header2->ip_dst.s_addr = src_ip->v4; // TODO put "external_ip"
 	ip_header2->ip_id = ip_id;
 	udp_header->uh_sport =
 	    htons(get_src_port(num_ports, probe_num, validation));
@@ -213,11 +213,11 @@ void ipip_print_packet(FILE *fp, void *packet)
 	fprintf(fp, "------------------------------------------------------\n");
 }
 
-void ipip_process_packet(const u_char *packet, UNUSED uint32_t len,
-			 fieldset_t *fs, UNUSED uint32_t *validation,
-			 UNUSED const struct timespec ts)
+void ipip_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
+			 UNUSED uint32_t *validation,
+			 UNUSED const struct timespec ts, UNUSED void *arg)
 {
-	struct ip *ip_hdr = (struct ip *)&packet[sizeof(struct ether_header)];
+	struct ip *ip_hdr = (struct ip *)pp->ip;
 	if (ip_hdr->ip_p == IPPROTO_UDP) {
 		struct udphdr *udp =
 		    (struct udphdr *)((char *)ip_hdr + ip_hdr->ip_hl * 4);
@@ -236,7 +236,7 @@ void ipip_process_packet(const u_char *packet, UNUSED uint32_t len,
 		if (data_len > sizeof(struct udphdr)) {
 			uint32_t overhead =
 			    (sizeof(struct udphdr) + (ip_hdr->ip_hl * 4));
-			uint32_t max_rlen = len - overhead;
+			uint32_t max_rlen = pp->len - overhead;
 			uint32_t max_ilen = ntohs(ip_hdr->ip_len) - overhead;
 
 			// Verify that the UDP length is inside of our received
@@ -262,14 +262,12 @@ void ipip_process_packet(const u_char *packet, UNUSED uint32_t len,
 		// ICMP unreach comes from another server (not the one we sent a
 		// probe to); But we will fix up saddr to be who we sent the
 		// probe to, in case you care.
-		fs_modify_string(fs, "saddr",
-				 make_ip_str(ip_inner->ip_dst.s_addr), 1);
+		fs_modify_ipv4(fs, "saddr", ip_inner->ip_dst.s_addr);
 		fs_add_string(fs, "classification", (char *)"icmp-unreach", 0);
 		fs_add_bool(fs, "success", 0);
 		fs_add_null(fs, "sport");
 		fs_add_null(fs, "dport");
-		fs_add_string(fs, "icmp_responder",
-			      make_ip_str(ip_hdr->ip_src.s_addr), 1);
+		fs_add_ipv4(fs, "icmp_responder", ip_hdr->ip_src.s_addr);
 		fs_add_uint64(fs, "icmp_type", icmp->icmp_type);
 		fs_add_uint64(fs, "icmp_code", icmp->icmp_code);
 		if (icmp->icmp_code <= ICMP_UNREACH_PRECEDENCE_CUTOFF) {
@@ -298,7 +296,7 @@ void ipip_process_packet(const u_char *packet, UNUSED uint32_t len,
 
 int ipip_validate_packet(const struct ip *ip_hdr, uint32_t len,
 			 uint32_t *src_ip, uint32_t *validation,
-			 const struct port_conf *ports)
+			 const struct port_conf *ports, UNUSED void *arg)
 {
 	if (ip_hdr->ip_p == IPPROTO_UDP) {
 		if ((4 * ip_hdr->ip_hl + sizeof(struct udphdr)) > len) {
@@ -319,9 +317,17 @@ int ipip_validate_packet(const struct ip *ip_hdr, uint32_t len,
 		if (check_dst_port(sport, num_ports, validation)) {
 			return PACKET_VALID;
 		}
-		for (unsigned i = 0; i < zconf.number_source_ips; i++) {
+		// the addresses the probe may have been sent from, which for
+		// large pools are those the sender would pick for each stream
+		uint32_t n = zconf.number_source_ips;
+		uint32_t tries = n > (uint32_t)zconf.packet_streams
+				     ? (uint32_t)zconf.packet_streams
+				     : n;
+		for (uint32_t i = 0; i < tries; i++) {
+			uint32_t idx = tries == n ? i
+						  : (ntohl(ip_hdr->ip_src.s_addr) + i) % n;
 			validate_gen(
-			    zconf.source_ip_addresses[i],
+			    zconf.source_ip_addresses[idx],
 			    ip_hdr->ip_src.s_addr, udp->uh_dport, (uint8_t *)validation);
 			if (check_dst_port(sport, num_ports, validation)) {
 				return PACKET_VALID;
@@ -392,7 +398,7 @@ static fielddef_t fields[] = {
     {.name = "sport", .type = "int", .desc = "UDP source port"},
     {.name = "dport", .type = "int", .desc = "UDP destination port"},
     {.name = "icmp_responder",
-     .type = "string",
+     .type = "ip",
      .desc = "Source IP of ICMP_UNREACH message"},
     {.name = "icmp_type", .type = "int", .desc = "icmp message type"},
     {.name = "icmp_code", .type = "int", .desc = "icmp message sub type code"},
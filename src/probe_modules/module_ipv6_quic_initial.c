@@ -34,50 +34,29 @@
 #include "state.h"
 #include "module_udp.h"
 #include "module_quic_initial.h"
+#include "../ipv6_source.h"
 
 #define UNUSED __attribute__((unused))
 
-static int padding_length = QUIC_PACKET_LENGTH - sizeof(quic_long_hdr);
-
-static inline uint64_t ipv6_make_quic_conn_id(char a, char b, char c, char d, char e,
-					 char f, char g, char h)
-{
-	return (uint64_t)(a) | (uint64_t)(b) << 8 | (uint64_t)(c) << 16 |
-	       (uint64_t)(d) << 24 | (uint64_t)(e) << 32 | (uint64_t)(f) << 40 |
-	       (uint64_t)(g) << 48 | (uint64_t)(h) << 56;
-}
-
 static int num_ports;
 #define SOURCE_PORT_VALIDATION_MODULE_DEFAULT false; // default to NOT validating source port
 static bool should_validate_src_port = SOURCE_PORT_VALIDATION_MODULE_DEFAULT
 
 probe_module_t module_ipv6_quic_initial;
-uint64_t connection_id_v6;
 
 void ipv6_quic_initial_set_num_ports(int x) { num_ports = x; }
 
 int ipv6_quic_initial_global_initialize(struct state_conf *conf){
-	char *args = NULL;
-
-	if (conf->probe_args != NULL) {
-		args = strdup(conf->probe_args);
-	}
-
     // Only look at received packets destined to the specified scanning address (useful for parallel zmap scans)
-    if (asprintf((char ** restrict) &module_ipv6_quic_initial.pcap_filter, "%s && ip6 dst host %s", module_ipv6_quic_initial.pcap_filter, conf->ipv6_source_ip) == -1) {
+    if (asprintf((char ** restrict) &module_ipv6_quic_initial.pcap_filter, "%s && ip6 dst %s %s", module_ipv6_quic_initial.pcap_filter, ipv6_source_filter_kind(conf->ipv6_source_ip), conf->ipv6_source_ip) == -1) {
         return 1;
     }
 
 
-	if (args != NULL) {
-		if (strncmp(args, "padding:", strlen("padding:")) == 0) {
-			char *padding_string = strtok(args, ":");
-			// get part after colon
-			padding_string = strtok(NULL, ":");
-			int num = atoi(padding_string);
-			padding_length = num;
-		}
-	}
+	quic_initial_payload_init(conf->probe_args,
+				  sizeof(struct ether_header) +
+				      sizeof(struct ip6_hdr) +
+				      sizeof(struct udphdr));
 
 	num_ports = conf->source_port_last - conf->source_port_first + 1;
 
@@ -86,12 +65,6 @@ int ipv6_quic_initial_global_initialize(struct state_conf *conf){
 	    sizeof(struct ether_header) + sizeof(struct ip6_hdr) +
 	    sizeof(struct udphdr) + QUIC_PACKET_LENGTH;
 
-	connection_id_v6 =
-	    ipv6_make_quic_conn_id('S', 'C', 'A', 'N', 'N', 'I', 'N', 'G');
-
-	if (args != NULL) {
-		free(args);
-	}
 	return EXIT_SUCCESS;
 }
 
@@ -103,24 +76,22 @@ int ipv6_quic_initial_global_cleanup(
 	return EXIT_SUCCESS;
 }
 
+static __thread uint32_t udp_csum_base_sum;
+
 static int ipv6_quic_initial_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 				  UNUSED void *arg_ptr)
 {
 	// set length of udp msg
-	int udp_send_msg_len = padding_length + sizeof(quic_long_hdr);
-	//log_debug("prepare", "UDP PAYLOAD LEN: %d", udp_send_msg_len);
+	size_t udp_send_msg_len = quic_initial_payload_len();
 
 	memset(buf, 0, MAX_PACKET_SIZE);
 	struct ether_header *eth_header = (struct ether_header *)buf;
 	make_eth_header_ethertype(eth_header, src, gw, ETHERTYPE_IPV6);
     struct ip6_hdr *ip6_header = (struct ip6_hdr*)(&eth_header[1]);
-	uint16_t len =
-	    htons(sizeof(struct ip6_hdr) + sizeof(struct udphdr) + udp_send_msg_len);
-	//log_debug("prepare", "IP LEN IN HEX %h", len);
+	uint16_t len = sizeof(struct udphdr) + udp_send_msg_len;
 	make_ip6_header(ip6_header, IPPROTO_UDP, len);
 
 	struct udphdr *udp_header = (struct udphdr *)(&ip6_header[1]);
-	len = sizeof(struct udphdr) + udp_send_msg_len;
 	make_udp_header(udp_header, len);
 
 	char *payload = (char *)(&udp_header[1]);
@@ -129,63 +100,33 @@ static int ipv6_quic_initial_prepare_packet(void *buf, macaddr_t *src, macaddr_t
 	    sizeof(struct ether_header) + sizeof(struct ip6_hdr) +
 	    sizeof(struct udphdr) + udp_send_msg_len;
 	assert(module_ipv6_quic_initial.max_packet_length <= MAX_PACKET_SIZE);
-	memset(payload, 0, udp_send_msg_len);
+	memcpy(payload, quic_initial_payload(), udp_send_msg_len);
+	udp_csum_base_sum = udp_csum_base(udp_header, len);
 
 	return EXIT_SUCCESS;
 }
 
 int ipv6_quic_initial_make_packet(void *buf, size_t *buf_len,
-			     UNUSED ipaddr_n_t src_ip, UNUSED ipaddr_n_t dst_ip,  port_n_t dport,
-			     UNUSED uint8_t ttl, uint32_t *validation,
-			     int probe_num, UNUSED uint16_t ip_id, void *arg)
+			     const ipaddr_t *src_ip, const ipaddr_t *dst_ip,  port_n_t dport,
+			     uint8_t ttl, uint32_t *validation,
+			     int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg)
 {
 	struct ether_header *eth_header = (struct ether_header *)buf;
 	struct ip6_hdr *ip6_header = (struct ip6_hdr *)(&eth_header[1]);
 	struct udphdr *udp_header = (struct udphdr *)&ip6_header[1];
 
-    ip6_header->ip6_src = ((struct in6_addr *) arg)[0];
-    ip6_header->ip6_dst = ((struct in6_addr *) arg)[1];
+    ip6_header->ip6_src = src_ip->v6;
+    ip6_header->ip6_dst = dst_ip->v6;
     ip6_header->ip6_ctlun.ip6_un1.ip6_un1_hlim = ttl;
-
 	udp_header->uh_sport =
 	    htons(get_src_port(num_ports, probe_num, validation));
 	udp_header->uh_dport = dport;
 
-	uint8_t *payload = (uint8_t *)&udp_header[1];
-	int payload_len = 0;
-
-	memset(payload, 0, padding_length + sizeof(quic_long_hdr));
-
-	quic_long_hdr *common_hdr = (quic_long_hdr *)payload;
-
-	// set header flags
-	uint8_t protected_header_flags =
-	    HEADER_FLAG_RESERVED_BITS | HEADER_FLAG_PACKET_NUMBER_LENGTH;
-	uint8_t public_header_flags = HEADER_FLAG_FORM_LONG_HEADER |
-				      HEADER_FLAG_FIXED_BIT |
-				      HEADER_FLAG_TYPE_INITIAL;
-	common_hdr->header_flags = protected_header_flags | public_header_flags;
-	common_hdr->version = QUIC_VERSION_FORCE_NEGOTIATION;
-	common_hdr->dst_conn_id_length = HEADER_CONNECTION_ID_LENGTH;
-	common_hdr->dst_conn_id = connection_id_v6;
-	common_hdr->src_conn_id_length = 0x00;
-	common_hdr->token_length = 0x00;
-	common_hdr->length = padding_length + sizeof(common_hdr->packet_number);
-	common_hdr->packet_number = 0x0000;
-
-	// Padding was already done with memset
-	payload_len = padding_length + sizeof(quic_long_hdr);
-
-	// Update the IP and UDP headers to match the new payload length
-	ip6_header->ip6_ctlun.ip6_un1.ip6_un1_plen =
-	    htons(sizeof(struct udphdr) + payload_len);
-	udp_header->uh_ulen = ntohs(sizeof(struct udphdr) + payload_len);
-
-	udp_header->uh_sum = 0;
-	udp_header->uh_sum = ipv6_payload_checksum(ntohs(udp_header->uh_ulen), &ip6_header->ip6_src, &ip6_header->ip6_dst, (unsigned short *) udp_header, IPPROTO_UDP);
+	udp_header->uh_sum = udp_csum(udp_csum_base_sum, udp_header,
+			ip6_pseudo_csum(&ip6_header->ip6_src, &ip6_header->ip6_dst));
 
-	size_t headers_len = sizeof(struct ether_header) + sizeof(struct ip6_hdr) + sizeof(struct udphdr);
-	*buf_len = headers_len + payload_len;
+	*buf_len = sizeof(struct ether_header) + sizeof(struct ip6_hdr) +
+		   sizeof(struct udphdr) + quic_initial_payload_len();
 
 	return EXIT_SUCCESS;
 }
@@ -203,11 +144,12 @@ void ipv6_quic_initial_print_packet(FILE *fp, void *packet)
 	fprintf(fp, "------------------------------------------------------\n");
 }
 
-void ipv6_quic_initial_process_packet(const u_char *packet, UNUSED uint32_t len,
+void ipv6_quic_initial_process_packet(const parsed_packet_t *pp,
 				 fieldset_t *fs, UNUSED uint32_t *validation,
-				 __attribute__((unused)) struct timespec ts)
+				 __attribute__((unused)) struct timespec ts,
+				      UNUSED void *arg)
 {
-	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *) &packet[sizeof(struct ether_header)];
+	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *)pp->ip6;
 	if (ipv6_hdr->ip6_ctlun.ip6_un1.ip6_un1_nxt == IPPROTO_UDP) {
 		struct udphdr *udp = (struct udphdr*) &ipv6_hdr[1];
 
@@ -227,7 +169,7 @@ void ipv6_quic_initial_process_packet(const u_char *packet, UNUSED uint32_t len,
 				    quic_version_negotiation
 					    ->src_conn_id_length == 0x08 &&
 				    quic_version_negotiation->src_conn_id ==
-					connection_id_v6) {
+					connection_id) {
 					fs_add_string(fs, "classification",
 						      (char *)"quic", 0);
 					fs_add_uint64(fs, "success", 1);
@@ -296,7 +238,8 @@ void ipv6_quic_initial_process_packet(const u_char *packet, UNUSED uint32_t len,
 int ipv6_quic_initial_validate_packet(const struct ip *ip_hdr, uint32_t len,
 				 __attribute__((unused)) uint32_t *src_ip,
 				 UNUSED uint32_t *validation,
-				 const struct port_conf *ports)
+				 const struct port_conf *ports,
+				      UNUSED void *arg)
 {
     struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *) ip_hdr;
 
@@ -30,6 +30,7 @@
 #include "logger.h"
 
 #include "module_tcp_synopt.h"
+#include "../ipv6_source.h"
 
 
 probe_module_t module_ipv6_tcp_synopt;
@@ -56,7 +57,7 @@ int ipv6_tcp_synopt_global_initialize(struct state_conf *conf)
 	num_ports = conf->source_port_last - conf->source_port_first + 1;
 
 	// Only look at received packets destined to the specified scanning address (useful for parallel zmap scans)
-	if (asprintf((char ** restrict) &module_ipv6_tcp_synopt.pcap_filter, "%s && ip6 dst host %s", module_ipv6_tcp_synopt.pcap_filter, conf->ipv6_source_ip) == -1) {
+	if (asprintf((char ** restrict) &module_ipv6_tcp_synopt.pcap_filter, "%s && ip6 dst %s %s", module_ipv6_tcp_synopt.pcap_filter, ipv6_source_filter_kind(conf->ipv6_source_ip), conf->ipv6_source_ip) == -1) {
 		return 1;
 	}
 
@@ -110,6 +111,8 @@ int ipv6_tcp_synopt_global_initialize(struct state_conf *conf)
 	return EXIT_SUCCESS;
 }
 
+static __thread uint32_t tcp_csum_base_sum;
+
 static int ipv6_tcp_synopt_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 				  UNUSED void *arg_ptr)
 {
@@ -120,36 +123,38 @@ static int ipv6_tcp_synopt_prepare_packet(void *buf, macaddr_t *src, macaddr_t *
 	make_ip6_header(ip6_header, IPPROTO_TCP, payload_len);
 	struct tcphdr *tcp_header = (struct tcphdr*)(&ip6_header[1]);
 	make_tcp_header(tcp_header, TH_SYN);
+	// the options are the same for every probe
+	memcpy(&tcp_header[1], tcp_send_opts, tcp_send_opts_len);
+	tcp_header->th_off = 5+tcp_send_opts_len/4; // default length = 5 + 9*32 bit options
+	tcp_csum_base_sum = tcp_csum_base(tcp_header, payload_len);
 	return EXIT_SUCCESS;
 }
 
-int ipv6_tcp_synopt_make_packet(void *buf, size_t *buf_len, __attribute__((unused)) ipaddr_n_t src_ip, __attribute__((unused)) ipaddr_n_t dst_ip, port_n_t dport, 
-        uint8_t ttl, uint32_t *validation, int probe_num, UNUSED uint16_t ip_id, void *arg)
+int ipv6_tcp_synopt_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip, const ipaddr_t *dst_ip, port_n_t dport, 
+        uint8_t ttl, uint32_t *validation, int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg)
 {
 	struct ether_header *eth_header = (struct ether_header *) buf;
 	struct ip6_hdr *ip6_header = (struct ip6_hdr*) (&eth_header[1]);
 	struct tcphdr *tcp_header = (struct tcphdr*) (&ip6_header[1]);
-	unsigned char* opts = (unsigned char*)&tcp_header[1];
 	uint32_t tcp_seq = validation[0];
-	ip6_header->ip6_src = ((struct in6_addr *) arg)[0];
-	ip6_header->ip6_dst = ((struct in6_addr *) arg)[1];
+	ip6_header->ip6_src = src_ip->v6;
+	ip6_header->ip6_dst = dst_ip->v6;
 	ip6_header->ip6_ctlun.ip6_un1.ip6_un1_hlim = ttl;
 
 	tcp_header->th_sport = htons(get_src_port(num_ports,
 				probe_num, validation));
 	tcp_header->th_dport = dport;
 	tcp_header->th_seq = tcp_seq;
-
-    memcpy(opts, tcp_send_opts, tcp_send_opts_len);
-
-    tcp_header->th_off = 5+tcp_send_opts_len/4; // default length = 5 + 9*32 bit options
-
-
-	tcp_header->th_sum = 0;
-
-	unsigned short len_tcp = ZMAPV6_TCP_SYNOPT_TCP_HEADER_LEN+tcp_send_opts_len;
-
-	tcp_header->th_sum = ipv6_payload_checksum(len_tcp, &ip6_header->ip6_src, &ip6_header->ip6_dst, (unsigned short *) tcp_header, IPPROTO_TCP);
+	uint32_t pseudo =
+	    ip6_pseudo_csum(&ip6_header->ip6_src, &ip6_header->ip6_dst);
+	if (zconf.csum_offload) {
+		tcp_header->th_sum = l4_csum_partial(
+		    pseudo, ZMAPV6_TCP_SYNOPT_TCP_HEADER_LEN + tcp_send_opts_len,
+		    IPPROTO_TCP);
+	} else {
+		tcp_header->th_sum =
+		    tcp_csum(tcp_csum_base_sum, tcp_header, pseudo);
+	}
 
 	*buf_len = ZMAPV6_TCP_SYNOPT_PACKET_LEN+tcp_send_opts_len;
 
@@ -174,7 +179,7 @@ void ipv6_tcp_synopt_print_packet(FILE *fp, void* packet)
 int ipv6_tcp_synopt_validate_packet(const struct ip *ip_hdr, uint32_t len,
 		__attribute__((unused))uint32_t *src_ip,
 		uint32_t *validation,
-		const struct port_conf *ports)
+		const struct port_conf *ports, UNUSED void *arg)
 {
 	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *) ip_hdr;
 
@@ -203,17 +208,15 @@ int ipv6_tcp_synopt_validate_packet(const struct ip *ip_hdr, uint32_t len,
 	return PACKET_VALID;
 }
 
-void ipv6_tcp_synopt_process_packet(const u_char *packet,
-		__attribute__((unused)) uint32_t len, fieldset_t *fs,
+void ipv6_tcp_synopt_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
 		__attribute__((unused)) uint32_t *validation,
-		 __attribute__((unused)) struct timespec ts)
+		 __attribute__((unused)) struct timespec ts, UNUSED void *arg)
 {
-	struct ether_header *eth_hdr = (struct ether_header *) packet;
-	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *) (&eth_hdr[1]);
+	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *)pp->ip6;
 	struct tcphdr *tcp_hdr = (struct tcphdr*) (&ipv6_hdr[1]);
-	//	unsigned int optionbytes2=len-(sizeof(struct ether_header)+ntohs(ipv6_hdr->ip6_ctlun.ip6_un1.ip6_un1_plen) + sizeof(struct tcphdr));
-	unsigned int optionbytes2=len-(sizeof(struct ether_header)+sizeof(struct ip6_hdr) + sizeof(struct tcphdr));
-	tcpsynopt_process_packet_parse(len, fs,tcp_hdr,optionbytes2);
+	//	unsigned int optionbytes2=pp->len-(ntohs(ipv6_hdr->ip6_ctlun.ip6_un1.ip6_un1_plen) + sizeof(struct tcphdr));
+	unsigned int optionbytes2=pp->len-(sizeof(struct ip6_hdr) + sizeof(struct tcphdr));
+	tcpsynopt_process_packet_parse(pp->len, fs,tcp_hdr,optionbytes2);
 	return;
 }
 
@@ -223,6 +226,7 @@ probe_module_t module_ipv6_tcp_synopt = {
 	.pcap_filter = "ip6 proto 6 && (ip6[53] & 4 != 0 || ip6[53] == 18)",
 	.pcap_snaplen = 116+10*4, // max option len
 	.port_args = 1,
+	.csum_offload = 1,
 	.global_initialize = &ipv6_tcp_synopt_global_initialize,
 	.prepare_packet = &ipv6_tcp_synopt_prepare_packet,
 	.make_packet = &ipv6_tcp_synopt_make_packet,
@@ -26,6 +26,8 @@
 #include "../fieldset.h"
 #include "probe_modules.h"
 #include "packet.h"
+#include "tcp_followup.h"
+#include "../ipv6_source.h"
 
 #define ZMAPV6_TCP_SYNSCAN_TCP_HEADER_LEN 20
 #define ZMAPV6_TCP_SYNSCAN_PACKET_LEN 74
@@ -38,15 +40,20 @@ static uint32_t num_ports;
 int ipv6_synscan_global_initialize(struct state_conf *state)
 {
 	num_ports = state->source_port_last - state->source_port_first + 1;
+	if (tcp_followup_init(&module_ipv6_tcp_synscan, 1)) {
+		return EXIT_FAILURE;
+	}
 
 	// Only look at received packets destined to the specified scanning address (useful for parallel zmap scans)
-	if (asprintf((char ** restrict) &module_ipv6_tcp_synscan.pcap_filter, "%s && ip6 dst host %s", module_ipv6_tcp_synscan.pcap_filter, state->ipv6_source_ip) == -1) {
+	if (asprintf((char ** restrict) &module_ipv6_tcp_synscan.pcap_filter, "%s && ip6 dst %s %s", module_ipv6_tcp_synscan.pcap_filter, ipv6_source_filter_kind(state->ipv6_source_ip), state->ipv6_source_ip) == -1) {
 		return 1;
 	}
 
 	return EXIT_SUCCESS;
 }
 
+static __thread uint32_t tcp_csum_base_sum;
+
 static int ipv6_tcp_synscan_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 				  UNUSED void *arg_ptr)
 {
@@ -57,28 +64,36 @@ static int ipv6_tcp_synscan_prepare_packet(void *buf, macaddr_t *src, macaddr_t
 	make_ip6_header(ip6_header, IPPROTO_TCP, payload_len);
 	struct tcphdr *tcp_header = (struct tcphdr*)(&ip6_header[1]);
 	make_tcp_header(tcp_header, TH_SYN);
+	tcp_csum_base_sum =
+	    tcp_csum_base(tcp_header, ZMAPV6_TCP_SYNSCAN_TCP_HEADER_LEN);
 	return EXIT_SUCCESS;
 }
 
-int ipv6_synscan_make_packet(void *buf, size_t *buf_len, UNUSED ipaddr_n_t src_ip, UNUSED ipaddr_n_t dst_ip, port_n_t dport,
-        uint8_t ttl, uint32_t *validation, int probe_num, UNUSED uint16_t ip_id, void *arg)
+int ipv6_synscan_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip, const ipaddr_t *dst_ip, port_n_t dport,
+        uint8_t ttl, uint32_t *validation, int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg)
 {
 	struct ether_header *eth_header = (struct ether_header *) buf;
 	struct ip6_hdr *ip6_header = (struct ip6_hdr*) (&eth_header[1]);
 	struct tcphdr *tcp_header = (struct tcphdr*) (&ip6_header[1]);
 	uint32_t tcp_seq = validation[0];
 
-	ip6_header->ip6_src = ((struct in6_addr *) arg)[0];
-	ip6_header->ip6_dst = ((struct in6_addr *) arg)[1];
+	ip6_header->ip6_src = src_ip->v6;
+	ip6_header->ip6_dst = dst_ip->v6;
 	ip6_header->ip6_ctlun.ip6_un1.ip6_un1_hlim = ttl;
 
 	tcp_header->th_sport = htons(get_src_port(num_ports,
 				probe_num, validation));
 	tcp_header->th_dport = dport;
 	tcp_header->th_seq = tcp_seq;
-	tcp_header->th_sum = 0;
-
-	tcp_header->th_sum = ipv6_payload_checksum(ZMAPV6_TCP_SYNSCAN_TCP_HEADER_LEN, &ip6_header->ip6_src, &ip6_header->ip6_dst, (unsigned short *) tcp_header, IPPROTO_TCP);
+	uint32_t pseudo =
+	    ip6_pseudo_csum(&ip6_header->ip6_src, &ip6_header->ip6_dst);
+	if (zconf.csum_offload) {
+		tcp_header->th_sum = l4_csum_partial(
+		    pseudo, ZMAPV6_TCP_SYNSCAN_TCP_HEADER_LEN, IPPROTO_TCP);
+	} else {
+		tcp_header->th_sum =
+		    tcp_csum(tcp_csum_base_sum, tcp_header, pseudo);
+	}
 
 	*buf_len = ZMAPV6_TCP_SYNSCAN_PACKET_LEN;
 
@@ -103,7 +118,7 @@ void ipv6_synscan_print_packet(FILE *fp, void* packet)
 int ipv6_synscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
 		__attribute__((unused))uint32_t *src_ip,
 		uint32_t *validation,
-		const struct port_conf *ports)
+		const struct port_conf *ports, UNUSED void *arg)
 {
 	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *) ip_hdr;
 
@@ -125,6 +140,13 @@ int ipv6_synscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
 	if (!check_dst_port(dport, num_ports, validation)) {
 		return 0;
 	}
+	if (!(tcp_hdr->th_flags & (TH_SYN | TH_RST)) && tcp_followup_enabled()) {
+		// --tcp-payload data, acking up to the whole payload
+		parsed_packet_t pp;
+		parse_packet(ip_hdr, len, 1, &pp);
+		return tcp_followup_is_data(&pp) &&
+		       tcp_followup_ack_valid(tcp_hdr->th_ack, validation[0]);
+	}
 	// validate tcp acknowledgement number
 	if (htonl(tcp_hdr->th_ack) != htonl(validation[0])+1) {
 		return 0;
@@ -132,13 +154,11 @@ int ipv6_synscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
 	return 1;
 }
 
-void ipv6_synscan_process_packet(const u_char *packet,
-		__attribute__((unused)) uint32_t len, fieldset_t *fs,
+void ipv6_synscan_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
 		__attribute__((unused)) uint32_t *validation,
-		__attribute__((unused)) struct timespec ts)
+		__attribute__((unused)) struct timespec ts, UNUSED void *arg)
 {
-	struct ether_header *eth_hdr = (struct ether_header *) packet;
-	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *) (&eth_hdr[1]);
+	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *)pp->ip6;
 	struct tcphdr *tcp_hdr = (struct tcphdr*) (&ipv6_hdr[1]);
 
 	fs_add_uint64(fs, "sport", (uint64_t) ntohs(tcp_hdr->th_sport));
@@ -148,11 +168,20 @@ void ipv6_synscan_process_packet(const u_char *packet,
 	fs_add_uint64(fs, "window", (uint64_t) ntohs(tcp_hdr->th_win));
 
 	if (tcp_hdr->th_flags & TH_RST) { // RST packet
+		fs_add_null(fs, "banner");
 		fs_add_string(fs, "classification", (char*) "rst", 0);
 		fs_add_uint64(fs, "success", 0);
-	} else { // SYNACK packet
+	} else if (tcp_hdr->th_flags & TH_SYN) { // SYNACK packet
+		fs_add_null(fs, "banner");
 		fs_add_string(fs, "classification", (char*) "synack", 0);
 		fs_add_uint64(fs, "success", 1);
+	} else { // --tcp-payload data
+		uint32_t len;
+		const uint8_t *data = tcp_followup_data(pp, &len);
+		fs_add_binary(fs, "banner", len, (void *)data, 0);
+		fs_add_string(fs, "classification", (char*) "data", 0);
+		fs_add_uint64(fs, "success", 1);
+		tcp_followup_count_data();
 	}
 }
 
@@ -162,6 +191,7 @@ static fielddef_t fields[] = {
 	{.name = "seqnum", .type = "int", .desc = "TCP sequence number"},
 	{.name = "acknum", .type = "int", .desc = "TCP acknowledgement number"},
 	{.name = "window", .type = "int", .desc = "TCP window"},
+	{.name = "banner", .type = "binary", .desc = "data the server sent after the --tcp-payload follow-up"},
 	{.name = "classification", .type="string", .desc = "packet classification"},
 	{.name = "success", .type="int", .desc = "is response considered success"}
 };
@@ -172,18 +202,23 @@ probe_module_t module_ipv6_tcp_synscan = {
 	.pcap_filter = "ip6 proto 6 && (ip6[53] & 4 != 0 || ip6[53] == 18)",
 	.pcap_snaplen = 116, // was 96 for IPv4
 	.port_args = 1,
+	.csum_offload = 1,
 	.global_initialize = &ipv6_synscan_global_initialize,
 	.prepare_packet = &ipv6_tcp_synscan_prepare_packet,
 	.make_packet = &ipv6_synscan_make_packet,
 	.print_packet = &ipv6_synscan_print_packet,
 	.process_packet = &ipv6_synscan_process_packet,
 	.validate_packet = &ipv6_synscan_validate_packet,
+	.followup = &tcp_followup_respond,
 	.close = NULL,
 	.helptext = "Probe module that sends an IPv6+TCP SYN packet to a specific "
 		"port. Possible classifications are: synack and rst. A "
 		"SYN-ACK packet is considered a success and a reset packet "
-		"is considered a failed response.",
+		"is considered a failed response. With --tcp-payload, each "
+		"SYN-ACK is answered with an ACK carrying the payload, and the "
+		"data the server sends back is a \"data\" response with the "
+		"\"banner\" field.",
 
 	.fields = fields,
-	.numfields = 7};
+	.numfields = sizeof(fields) / sizeof(fields[0])};
 
@@ -31,6 +31,7 @@
 #include "aesrand.h"
 #include "state.h"
 #include "module_udp.h"
+#include "../ipv6_source.h"
 
 #define MAX_UDP_PAYLOAD_LEN 1472
 #define ICMP_UNREACH_HEADER_SIZE 8
@@ -127,7 +128,7 @@ int ipv6_udp_global_initialize(struct state_conf *conf) {
 	udp_send_msg_len = strlen(udp_send_msg);
 
 	// Only look at received packets destined to the specified scanning address (useful for parallel zmap scans)
-	if (asprintf((char ** restrict) &module_ipv6_udp.pcap_filter, "%s && ip6 dst host %s", module_ipv6_udp.pcap_filter, conf->ipv6_source_ip) == -1) {
+	if (asprintf((char ** restrict) &module_ipv6_udp.pcap_filter, "%s && ip6 dst %s %s", module_ipv6_udp.pcap_filter, ipv6_source_filter_kind(conf->ipv6_source_ip), conf->ipv6_source_ip) == -1) {
 		return 1;
 	}
 
@@ -245,6 +246,8 @@ int ipv6_udp_init_perthread(void **arg_ptr)
 	return EXIT_SUCCESS;
 }
 
+static __thread uint32_t udp_csum_base_sum;
+
 int ipv6_udp_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw, UNUSED void *arg_ptr)
 {
 	memset(buf, 0, MAX_PACKET_SIZE);
@@ -264,20 +267,21 @@ int ipv6_udp_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw, UNUSED voi
 	assert(module_ipv6_udp.max_packet_length <= MAX_PACKET_SIZE);
 
 	memcpy(payload, udp_send_msg, udp_send_msg_len);
+	udp_csum_base_sum = udp_csum_base(udp_header, payload_len);
 
 	return EXIT_SUCCESS;
 }
 
-int ipv6_udp_make_packet(void *buf, size_t *buf_len, UNUSED ipaddr_n_t src_ip,
-		UNUSED ipaddr_n_t dst_ip, port_n_t dport, uint8_t ttl, uint32_t *validation, int probe_num, UNUSED uint16_t ip_id, void *arg)
+int ipv6_udp_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+		const ipaddr_t *dst_ip, port_n_t dport, uint8_t ttl, uint32_t *validation, int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg)
 {
 	// From module_ipv6_udp_dns
 	struct ether_header *eth_header = (struct ether_header *) buf;
 	struct ip6_hdr *ip6_header = (struct ip6_hdr*) (&eth_header[1]);
 	struct udphdr *udp_header= (struct udphdr *) &ip6_header[1];
 
-	ip6_header->ip6_src = ((struct in6_addr *) arg)[0];
-	ip6_header->ip6_dst = ((struct in6_addr *) arg)[1];
+	ip6_header->ip6_src = src_ip->v6;
+	ip6_header->ip6_dst = dst_ip->v6;
 	ip6_header->ip6_ctlun.ip6_un1.ip6_un1_hlim = ttl;
 	udp_header->uh_sport = htons(get_src_port(num_ports, probe_num,
 				     validation));
@@ -309,8 +313,8 @@ int ipv6_udp_make_packet(void *buf, size_t *buf_len, UNUSED ipaddr_n_t src_ip,
 		udp_header->uh_ulen = ntohs(sizeof(struct udphdr) + payload_len);
 	}
 */
-	udp_header->uh_sum = 0;
-	udp_header->uh_sum = ipv6_payload_checksum(ntohs(udp_header->uh_ulen), &ip6_header->ip6_src, &ip6_header->ip6_dst, (unsigned short *) udp_header, IPPROTO_UDP);
+	udp_header->uh_sum = udp_csum(udp_csum_base_sum, udp_header,
+			ip6_pseudo_csum(&ip6_header->ip6_src, &ip6_header->ip6_dst));
 	
 	size_t headers_len = sizeof(struct ether_header) + sizeof(struct ip6_hdr) +
 			     sizeof(struct udphdr);
@@ -333,11 +337,11 @@ void ipv6_udp_print_packet(FILE *fp, void* packet)
 	fprintf(fp, "------------------------------------------------------\n");
 }
 
-void ipv6_udp_process_packet(const u_char *packet, UNUSED uint32_t len, fieldset_t *fs,
+void ipv6_udp_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
 		__attribute__((unused)) uint32_t *validation,
-		__attribute__((unused)) struct timespec ts)
+		__attribute__((unused)) struct timespec ts, UNUSED void *arg)
 {
-	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *) &packet[sizeof(struct ether_header)];
+	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *)pp->ip6;
 	if (ipv6_hdr->ip6_ctlun.ip6_un1.ip6_un1_nxt == IPPROTO_UDP) {
 		struct udphdr *udp  = (struct udphdr*) &ipv6_hdr[1];
 		fs_add_string(fs, "classification", (char*) "udp", 0);
@@ -353,7 +357,7 @@ void ipv6_udp_process_packet(const u_char *packet, UNUSED uint32_t len, fieldset
 		uint16_t data_len = ntohs(udp->uh_ulen);
 		if (data_len > sizeof(struct udphdr)) {
 			uint32_t overhead = sizeof(struct udphdr);
-			uint32_t max_rlen = len - overhead;
+			uint32_t max_rlen = pp->len - sizeof(struct ip6_hdr) - overhead;
 			uint32_t max_ilen = ntohs(ipv6_hdr->ip6_ctlun.ip6_un1.ip6_un1_plen) - overhead;
 
 			// Verify that the UDP length is inside of our received buffer
@@ -374,7 +378,7 @@ void ipv6_udp_process_packet(const u_char *packet, UNUSED uint32_t len, fieldset
 		struct ip6_hdr *ipv6_inner = (struct ip6_hdr *) &icmp6[1];
 		// ICMP unreach comes from another server (not the one we sent a probe to);
 		// But we will fix up saddr to be who we sent the probe to, in case you care.
-		fs_modify_string(fs, "saddr", make_ipv6_str(&ipv6_inner->ip6_dst), 1);
+		fs_modify_ipv6(fs, "saddr", &ipv6_inner->ip6_dst);
 		fs_add_string(fs, "classification", (char*) "icmp-unreach", 0);
 		fs_add_uint64(fs, "success", 0);
 		fs_add_null(fs, "sport");
@@ -409,7 +413,7 @@ void ipv6_udp_process_packet(const u_char *packet, UNUSED uint32_t len, fieldset
 
 
 int _ipv6_udp_validate_packet(const struct ip *ip_hdr, uint32_t len,
-		UNUSED uint32_t *src_ip, uint32_t *validation, const struct port_conf *ports)
+		UNUSED uint32_t *src_ip, uint32_t *validation, const struct port_conf *ports, UNUSED void *arg)
 {
 	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *) ip_hdr;
 /*
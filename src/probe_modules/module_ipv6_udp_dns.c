@@ -31,6 +31,7 @@
 #include "logger.h"
 #include "module_dns.h"
 #include "module_udp.h"
+#include "../ipv6_source.h"
 
 #define MAX_UDP_PAYLOAD_LEN 1472
 #define UNUSED __attribute__((unused))
@@ -166,7 +167,7 @@ int ipv6_udp_dns_global_initialize(struct state_conf *conf) {
 	udp_set_num_ports(num_ports);
 
 	// Only look at received packets destined to the specified scanning address (useful for parallel zmap scans)
-	if (asprintf((char ** restrict) &module_ipv6_udp_dns.pcap_filter, "%s && ip6 dst host %s", module_ipv6_udp_dns.pcap_filter, conf->ipv6_source_ip) == -1) {
+	if (asprintf((char ** restrict) &module_ipv6_udp_dns.pcap_filter, "%s && ip6 dst %s %s", module_ipv6_udp_dns.pcap_filter, ipv6_source_filter_kind(conf->ipv6_source_ip), conf->ipv6_source_ip) == -1) {
 		return 1;
 	}
 
@@ -242,6 +243,8 @@ int ipv6_udp_dns_global_cleanup(__attribute__((unused)) struct state_conf *zconf
 	return EXIT_SUCCESS;
 }
 
+static __thread uint32_t udp_csum_base_sum;
+
 int ipv6_udp_dns_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw, UNUSED void *arg_ptr)
 {
 	memset(buf, 0, MAX_PACKET_SIZE);
@@ -261,18 +264,21 @@ int ipv6_udp_dns_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw, UNUSED
 	assert(module_ipv6_udp_dns.max_packet_length <= MAX_PACKET_SIZE);
 
 	memcpy(payload, udp_send_msg, udp_send_msg_len);
+	// the DNS transaction id carries validation, so leave it out too
+	udp_csum_base_sum = csum_sub16(udp_csum_base(udp_header, payload_len),
+			((dns_header *)payload)->id);
 
 	return EXIT_SUCCESS;
 }
 
-int ipv6_udp_dns_make_packet(void *buf, size_t *buf_len, UNUSED ipaddr_n_t src_ip, UNUSED ipaddr_n_t dst_ip, port_n_t dport,
-		uint8_t ttl, uint32_t *validation, int probe_num, UNUSED uint16_t ip_id, void *arg) {
+int ipv6_udp_dns_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip, const ipaddr_t *dst_ip, port_n_t dport,
+		uint8_t ttl, uint32_t *validation, int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg) {
 	struct ether_header *eth_header = (struct ether_header *) buf;
 	struct ip6_hdr *ip6_header = (struct ip6_hdr*) (&eth_header[1]);
 	struct udphdr *udp_header= (struct udphdr *) &ip6_header[1];
 
-	ip6_header->ip6_src = ((struct in6_addr *) arg)[0];
-	ip6_header->ip6_dst = ((struct in6_addr *) arg)[1];
+	ip6_header->ip6_src = src_ip->v6;
+	ip6_header->ip6_dst = dst_ip->v6;
 	ip6_header->ip6_ctlun.ip6_un1.ip6_un1_hlim = ttl;
 	udp_header->uh_sport = htons(get_src_port(num_ports, probe_num,
 				     validation));
@@ -283,8 +289,9 @@ int ipv6_udp_dns_make_packet(void *buf, size_t *buf_len, UNUSED ipaddr_n_t src_i
 
 	dns_header_p->id = validation[2] & 0xFFFF;
 	
-	udp_header->uh_sum = 0;
-	udp_header->uh_sum = ipv6_payload_checksum(ntohs(udp_header->uh_ulen), &ip6_header->ip6_src, &ip6_header->ip6_dst, (unsigned short *) udp_header, IPPROTO_UDP);
+	udp_header->uh_sum = udp_csum(
+			csum_add16(udp_csum_base_sum, dns_header_p->id), udp_header,
+			ip6_pseudo_csum(&ip6_header->ip6_src, &ip6_header->ip6_dst));
 
 	size_t headers_len = sizeof(struct ether_header) + sizeof(struct ip6_hdr) + sizeof(struct udphdr);
 	*buf_len = headers_len + udp_send_msg_len;
@@ -306,7 +313,7 @@ void ipv6_udp_dns_print_packet(FILE *fp, void* packet) {
 }
 
 int ipv6_udp_dns_validate_packet(const struct ip *ip_hdr, uint32_t len,
-		UNUSED uint32_t *src_ip, uint32_t *validation, const struct port_conf *ports)
+		UNUSED uint32_t *src_ip, uint32_t *validation, const struct port_conf *ports, UNUSED void *arg)
 {
 	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *) ip_hdr;
 /*
@@ -324,8 +331,8 @@ int ipv6_udp_dns_validate_packet(const struct ip *ip_hdr, uint32_t len,
 	return 1;
 }
 
-void ipv6_udp_dns_process_packet(const u_char *packet, UNUSED uint32_t len, fieldset_t *fs, __attribute__((unused)) uint32_t *validation, UNUSED struct timespec ts) {
-	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *) &packet[sizeof(struct ether_header)];
+void ipv6_udp_dns_process_packet(const parsed_packet_t *pp, fieldset_t *fs, __attribute__((unused)) uint32_t *validation, UNUSED struct timespec ts, UNUSED void *arg) {
+	struct ip6_hdr *ipv6_hdr = (struct ip6_hdr *)pp->ip6;
 	if (ipv6_hdr->ip6_ctlun.ip6_un1.ip6_un1_nxt == IPPROTO_UDP) {
 		struct udphdr *udp_hdr = (struct udphdr *) (&ipv6_hdr[1]);
 		dns_header *dns_hdr = (dns_header *) (&udp_hdr[1]);
@@ -363,7 +370,7 @@ void ipv6_udp_dns_process_packet(const u_char *packet, UNUSED uint32_t len, fiel
 		struct icmp6_hdr *icmp6 = (struct icmp6_hdr *) (&ipv6_hdr[1]);
 		struct ip6_hdr *ipv6_inner = (struct ip6_hdr *) &icmp6[1];
 		// ICMP unreachable comes from another server, set saddr to original dst
-		fs_modify_string(fs, "saddr", make_ipv6_str(&ipv6_inner->ip6_dst), 1);
+		fs_modify_ipv6(fs, "saddr", &ipv6_inner->ip6_dst);
 		fs_add_string(fs, "classification", (char*) "icmp-unreach", 0);
 		fs_add_uint64(fs, "success", 0);
 		fs_add_null(fs, "sport");
@@ -40,17 +40,18 @@ int ntp_global_initialize(struct state_conf *conf)
 }
 
 int ntp_validate_packet(const struct ip *ip_hdr, uint32_t len, uint32_t *src_ip,
-			uint32_t *validation, const struct port_conf *ports)
+			uint32_t *validation, const struct port_conf *ports,
+			UNUSED void *arg)
 {
 	return udp_do_validate_packet(ip_hdr, len, src_ip, validation,
 				      num_ports, should_validate_src_port, ports);
 }
 
-void ntp_process_packet(const u_char *packet, UNUSED uint32_t len,
-			fieldset_t *fs, UNUSED uint32_t *validation,
-			UNUSED struct timespec ts)
+void ntp_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
+			UNUSED uint32_t *validation,
+			UNUSED struct timespec ts, UNUSED void *arg)
 {
-	struct ip *ip_hdr = (struct ip *)&packet[sizeof(struct ether_header)];
+	struct ip *ip_hdr = (struct ip *)pp->ip;
 	uint64_t temp64;
 	uint8_t temp8;
 	uint32_t temp32;
@@ -69,7 +70,8 @@ void ntp_process_packet(const u_char *packet, UNUSED uint32_t len,
 		fs_add_null(fs, "icmp_code");
 		fs_add_null(fs, "icmp_unreach_str");
 
-		if (len > 90) {
+		// an IP and UDP header plus the 48 byte NTP header
+		if (pp->len > 76) {
 			temp8 = *((uint8_t *)ptr);
 			fs_add_uint64(fs, "LI_VN_MODE", temp8);
 			temp8 = *((uint8_t *)ptr + 1);
@@ -113,14 +115,12 @@ void ntp_process_packet(const u_char *packet, UNUSED uint32_t len,
 		struct ip *ip_inner =
 		    (struct ip *)((char *)icmp + ICMP_UNREACH_HEADER_SIZE);
 
-		fs_modify_string(fs, "saddr",
-				 make_ip_str(ip_inner->ip_dst.s_addr), 1);
+		fs_modify_ipv4(fs, "saddr", ip_inner->ip_dst.s_addr);
 		fs_add_constchar(fs, "classification", "icmp");
 		fs_add_bool(fs, "success", 0);
 		fs_add_null(fs, "sport");
 		fs_add_null(fs, "dport");
-		fs_add_string(fs, "icmp_responder",
-			      make_ip_str(ip_hdr->ip_src.s_addr), 1);
+		fs_add_ipv4(fs, "icmp_responder", ip_hdr->ip_src.s_addr);
 		fs_add_uint64(fs, "icmp_type", icmp->icmp_type);
 		fs_add_uint64(fs, "icmp_code", icmp->icmp_code);
 		fs_add_null(fs, "icmp_unreach_str");
@@ -255,6 +255,7 @@ probe_module_t module_ntp = {.name = "ntp",
 			     .thread_initialize = &ntp_init_perthread,
 			     .prepare_packet = &ntp_prepare_packet,
 			     .make_packet = &udp_make_packet,
+			     .make_packets = &udp_make_packets,
 			     .print_packet = &ntp_print_packet,
 			     .validate_packet = &ntp_validate_packet,
 			     .process_packet = &ntp_process_packet,
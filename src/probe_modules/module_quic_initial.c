@@ -33,8 +33,6 @@
 
 #define UNUSED __attribute__((unused))
 
-static int padding_length = QUIC_PACKET_LENGTH - sizeof(quic_long_hdr);
-
 static inline uint64_t make_quic_conn_id(char a, char b, char c, char d, char e,
 					 char f, char g, char h)
 {
@@ -52,23 +50,56 @@ uint64_t connection_id;
 
 void quic_initial_set_num_ports(int x) { num_ports = x; }
 
-int quic_initial_global_initialize(struct state_conf *conf)
-{
-	char *args = NULL;
+static uint8_t quic_payload[MAX_PACKET_SIZE];
+static size_t quic_payload_len;
 
-	if (conf->probe_args != NULL) {
-		args = strdup(conf->probe_args);
+void quic_initial_payload_init(const char *probe_args, size_t headers_len)
+{
+	int padding_length = QUIC_PACKET_LENGTH - sizeof(quic_long_hdr);
+	if (probe_args != NULL &&
+	    strncmp(probe_args, "padding:", strlen("padding:")) == 0) {
+		padding_length = atoi(probe_args + strlen("padding:"));
 	}
-
-	if (args != NULL) {
-		if (strncmp(args, "padding:", strlen("padding:")) == 0) {
-			char *padding_string = strtok(args, ":");
-			// get part after colon
-			padding_string = strtok(NULL, ":");
-			int num = atoi(padding_string);
-			padding_length = num;
-		}
+	if (padding_length < 0 ||
+	    headers_len + sizeof(quic_long_hdr) + padding_length >
+		MAX_PACKET_SIZE) {
+		log_fatal("quic_initial",
+			  "padding of %d bytes does not fit in a packet",
+			  padding_length);
 	}
+	connection_id =
+	    make_quic_conn_id('S', 'C', 'A', 'N', 'N', 'I', 'N', 'G');
+
+	quic_payload_len = sizeof(quic_long_hdr) + padding_length;
+	// the padding frames are the zero bytes after the header
+	memset(quic_payload, 0, quic_payload_len);
+	quic_long_hdr *common_hdr = (quic_long_hdr *)quic_payload;
+
+	// set header flags
+	uint8_t protected_header_flags =
+	    HEADER_FLAG_RESERVED_BITS | HEADER_FLAG_PACKET_NUMBER_LENGTH;
+	uint8_t public_header_flags = HEADER_FLAG_FORM_LONG_HEADER |
+				      HEADER_FLAG_FIXED_BIT |
+				      HEADER_FLAG_TYPE_INITIAL;
+	common_hdr->header_flags = protected_header_flags | public_header_flags;
+	common_hdr->version = QUIC_VERSION_FORCE_NEGOTIATION;
+	common_hdr->dst_conn_id_length = HEADER_CONNECTION_ID_LENGTH;
+	common_hdr->dst_conn_id = connection_id;
+	common_hdr->src_conn_id_length = 0x00;
+	common_hdr->token_length = 0x00;
+	common_hdr->length = padding_length + sizeof(common_hdr->packet_number);
+	common_hdr->packet_number = 0x0000;
+}
+
+const uint8_t *quic_initial_payload(void) { return quic_payload; }
+
+size_t quic_initial_payload_len(void) { return quic_payload_len; }
+
+int quic_initial_global_initialize(struct state_conf *conf)
+{
+	quic_initial_payload_init(conf->probe_args,
+				  sizeof(struct ether_header) +
+				      sizeof(struct ip) + sizeof(struct udphdr));
 
 	num_ports = conf->source_port_last - conf->source_port_first + 1;
 
@@ -77,12 +108,6 @@ int quic_initial_global_initialize(struct state_conf *conf)
 	    sizeof(struct ether_header) + sizeof(struct ip) +
 	    sizeof(struct udphdr) + QUIC_PACKET_LENGTH;
 
-	connection_id =
-	    make_quic_conn_id('S', 'C', 'A', 'N', 'N', 'I', 'N', 'G');
-
-	if (args != NULL) {
-		free(args);
-	}
 	return EXIT_SUCCESS;
 }
 
@@ -94,12 +119,13 @@ int quic_initial_global_cleanup(
 	return EXIT_SUCCESS;
 }
 
+// The whole probe but the addresses, source port and port, and so the IP
+// checksum, is written here once per buffer.
 static int quic_initial_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 				  UNUSED void *arg_ptr)
 {
 		// set length of udp msg
-	int udp_send_msg_len = padding_length + sizeof(quic_long_hdr);
-	//log_debug("prepare", "UDP PAYLOAD LEN: %d", udp_send_msg_len);
+	size_t udp_send_msg_len = quic_initial_payload_len();
 
 	memset(buf, 0, MAX_PACKET_SIZE);
 	struct ether_header *eth_header = (struct ether_header *)buf;
@@ -107,7 +133,6 @@ static int quic_initial_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 	struct ip *ip_header = (struct ip *)(&eth_header[1]);
 	uint16_t len =
 	    htons(sizeof(struct ip) + sizeof(struct udphdr) + udp_send_msg_len);
-	//log_debug("prepare", "IP LEN IN HEX %h", len);
 	make_ip_header(ip_header, IPPROTO_UDP, len);
 
 	struct udphdr *udp_header = (struct udphdr *)(&ip_header[1]);
@@ -120,13 +145,13 @@ static int quic_initial_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 	    sizeof(struct ether_header) + sizeof(struct ip) +
 	    sizeof(struct udphdr) + udp_send_msg_len;
 	assert(module_quic_initial.max_packet_length <= MAX_PACKET_SIZE);
-	memset(payload, 0, udp_send_msg_len);
+	memcpy(payload, quic_initial_payload(), udp_send_msg_len);
 
 	return EXIT_SUCCESS;
 }
 
 int quic_initial_make_packet(void *buf, size_t *buf_len,
-			     ipaddr_n_t src_ip, ipaddr_n_t dst_ip, port_n_t dport,
+			     const ipaddr_t *src_ip, const ipaddr_t *dst_ip, port_n_t dport,
 			     UNUSED uint8_t ttl, uint32_t *validation,
 			     int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg)
 {
@@ -134,47 +159,18 @@ int quic_initial_make_packet(void *buf, size_t *buf_len,
 	struct ip *ip_header = (struct ip *)(&eth_header[1]);
 	struct udphdr *udp_header = (struct udphdr *)&ip_header[1];
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	udp_header->uh_sport =
 	    htons(get_src_port(num_ports, probe_num, validation));
 	udp_header->uh_dport = dport;
 
-	uint8_t *payload = (uint8_t *)&udp_header[1];
-	int payload_len = 0;
-
-	memset(payload, 0, padding_length + sizeof(quic_long_hdr));
-
-	quic_long_hdr *common_hdr = (quic_long_hdr *)payload;
-
-	// set header flags
-	uint8_t protected_header_flags =
-	    HEADER_FLAG_RESERVED_BITS | HEADER_FLAG_PACKET_NUMBER_LENGTH;
-	uint8_t public_header_flags = HEADER_FLAG_FORM_LONG_HEADER |
-				      HEADER_FLAG_FIXED_BIT |
-				      HEADER_FLAG_TYPE_INITIAL;
-	common_hdr->header_flags = protected_header_flags | public_header_flags;
-	common_hdr->version = QUIC_VERSION_FORCE_NEGOTIATION;
-	common_hdr->dst_conn_id_length = HEADER_CONNECTION_ID_LENGTH;
-	common_hdr->dst_conn_id = connection_id;
-	common_hdr->src_conn_id_length = 0x00;
-	common_hdr->token_length = 0x00;
-	common_hdr->length = padding_length + sizeof(common_hdr->packet_number);
-	common_hdr->packet_number = 0x0000;
-
-	// Padding was already done with memset
-	payload_len = padding_length + sizeof(quic_long_hdr);
-
-	// Update the IP and UDP headers to match the new payload length
-	ip_header->ip_len =
-	    htons(sizeof(struct ip) + sizeof(struct udphdr) + payload_len);
-	udp_header->uh_ulen = ntohs(sizeof(struct udphdr) + payload_len);
+	// the UDP checksum is left at zero, which IPv4 allows
+	ip_header->ip_sum =
+	    ip_header_csum(ip_header_csum_base(ip_header), ip_header);
 
-	ip_header->ip_sum = 0;
-	ip_header->ip_sum = zmap_ip_checksum((unsigned short *)ip_header);
-	
-        size_t headers_len = sizeof(struct ether_header) + sizeof(struct ip) + sizeof(struct udphdr);
-        *buf_len = headers_len + payload_len;
+	*buf_len = sizeof(struct ether_header) + sizeof(struct ip) +
+		   sizeof(struct udphdr) + quic_payload_len;
 
 	return EXIT_SUCCESS;
 }
@@ -192,11 +188,12 @@ void quic_initial_print_packet(FILE *fp, void *packet)
 	fprintf(fp, "------------------------------------------------------\n");
 }
 
-void quic_initial_process_packet(const u_char *packet, UNUSED uint32_t len,
+void quic_initial_process_packet(const parsed_packet_t *pp,
 				 fieldset_t *fs, UNUSED uint32_t *validation,
-				 __attribute__((unused)) struct timespec ts)
+				 __attribute__((unused)) struct timespec ts,
+				 UNUSED void *arg)
 {
-	struct ip *ip_hdr = (struct ip *)&packet[sizeof(struct ether_header)];
+	struct ip *ip_hdr = (struct ip *)pp->ip;
 	if (ip_hdr->ip_p == IPPROTO_UDP) {
 		struct udphdr *udp =
 		    (struct udphdr *)((char *)ip_hdr + ip_hdr->ip_hl * 4);
@@ -285,7 +282,7 @@ void quic_initial_process_packet(const u_char *packet, UNUSED uint32_t len,
 
 int quic_initial_validate_packet(const struct ip *ip_hdr, uint32_t len,
 				 __attribute__((unused)) uint32_t *src_ip,
-				 UNUSED uint32_t *validation, const struct port_conf *ports)
+				 UNUSED uint32_t *validation, const struct port_conf *ports, UNUSED void *arg)
 {
 	// We only want to process UDP datagrams
 	if (ip_hdr->ip_p != IPPROTO_UDP) {
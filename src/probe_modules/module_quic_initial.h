@@ -70,3 +70,15 @@ typedef struct {
 	uint64_t src_conn_id; // must be our dst_conn_id from before
 			      // next fields should be supported versions
 } __attribute__((__packed__)) quic_version_negotiation_hdr;
+
+/*
+ * The padded Initial packet both the IPv4 and IPv6 modules send, built once
+ * by quic_initial_payload_init() from the padding:<n> probe argument and
+ * copied into every packet buffer by prepare_packet. It is the same for
+ * every probe, only the addressing of the datagram around it changes.
+ */
+extern uint64_t connection_id;
+
+void quic_initial_payload_init(const char *probe_args, size_t headers_len);
+const uint8_t *quic_initial_payload(void);
+size_t quic_initial_payload_len(void);
@@ -59,7 +59,7 @@ static int synackscan_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 }
 
 static int synackscan_make_packet(void *buf, UNUSED size_t *buf_len,
-				  ipaddr_n_t src_ip, ipaddr_n_t dst_ip,
+				  const ipaddr_t *src_ip, const ipaddr_t *dst_ip,
 				  port_n_t dport, uint8_t ttl,
 				  uint32_t *validation, int probe_num,
 				  uint16_t ip_id, UNUSED void *arg)
@@ -71,8 +71,8 @@ static int synackscan_make_packet(void *buf, UNUSED size_t *buf_len,
 	uint32_t tcp_ack =
 	    validation[2]; // get_src_port() below uses validation 1 internally.
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	ip_header->ip_ttl = ttl;
 	ip_header->ip_id = ip_id;
 
@@ -93,25 +93,23 @@ static int synackscan_make_packet(void *buf, UNUSED size_t *buf_len,
 	return EXIT_SUCCESS;
 }
 
-static int synackscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
-				      UNUSED uint32_t *src_ip,
-				      uint32_t *validation,
-				      const struct port_conf *ports)
+static int synackscan_validate_parsed(const parsed_packet_t *pp,
+				      uint32_t *src_ip, uint32_t *validation,
+				      const struct port_conf *ports,
+				      UNUSED void *arg)
 {
 
-	if (ip_hdr->ip_p == IPPROTO_TCP) {
-		struct tcphdr *tcp = get_tcp_header(ip_hdr, len);
+	if (pp->proto == IPPROTO_TCP) {
+		const struct tcphdr *tcp = pp->tcp;
 		if (!tcp) {
 			return PACKET_INVALID;
 		}
-		uint16_t sport = ntohs(tcp->th_sport);
-		uint16_t dport = ntohs(tcp->th_dport);
 		// validate source port
-		if (should_validate_src_port && !check_src_port(sport, ports)) {
+		if (should_validate_src_port && !check_src_port(pp->sport, ports)) {
 			return PACKET_INVALID;
 		}
 		// validate destination port
-		if (!check_dst_port(dport, num_ports, validation)) {
+		if (!check_dst_port(pp->dport, num_ports, validation)) {
 			return PACKET_INVALID;
 		}
 		// check whether we'll ever send to this IP during the scan
@@ -136,18 +134,12 @@ static int synackscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
 				return PACKET_INVALID;
 			}
 		}
-	} else if (ip_hdr->ip_p == IPPROTO_ICMP) {
-		struct ip *ip_inner;
-		size_t ip_inner_len;
-		if (icmp_helper_validate(ip_hdr, len, sizeof(struct udphdr),
-					 &ip_inner,
-					 &ip_inner_len) == PACKET_INVALID) {
-			return PACKET_INVALID;
-		}
-		struct tcphdr *tcp = get_tcp_header(ip_inner, ip_inner_len);
-		if (!tcp) {
+	} else if (pp->proto == IPPROTO_ICMP) {
+		if (icmp_helper_validate_parsed(pp, sizeof(struct tcphdr)) ==
+		    PACKET_INVALID) {
 			return PACKET_INVALID;
 		}
+		const struct tcphdr *tcp = pp->inner_l4;
 		// we can always check the destination port because this is the
 		// original packet and wouldn't have been altered by something
 		// responding on a different port
@@ -156,7 +148,7 @@ static int synackscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
 		if (!check_src_port(dport, ports)) {
 			return PACKET_INVALID;
 		}
-		validate_gen(ip_hdr->ip_dst.s_addr, ip_inner->ip_dst.s_addr,
+		validate_gen(pp->ip->ip_dst.s_addr, pp->inner_ip->ip_dst.s_addr,
 			     tcp->th_dport, (uint8_t *)validation);
 		if (!check_dst_port(sport, num_ports, validation)) {
 			return PACKET_INVALID;
@@ -167,14 +159,25 @@ static int synackscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
 	return PACKET_VALID;
 }
 
-static void synackscan_process_packet(const u_char *packet, UNUSED uint32_t len,
+static int synackscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
+				      uint32_t *src_ip, uint32_t *validation,
+				      const struct port_conf *ports,
+				      void *arg)
+{
+	parsed_packet_t pp;
+	parse_packet(ip_hdr, len, 0, &pp);
+	return synackscan_validate_parsed(&pp, src_ip, validation, ports, arg);
+}
+
+static void synackscan_process_packet(const parsed_packet_t *pp,
 				      fieldset_t *fs,
 				      UNUSED uint32_t *validation,
-				      UNUSED struct timespec ts)
+				      UNUSED struct timespec ts,
+				      UNUSED void *arg)
 {
-	struct ip *ip_hdr = get_ip_header(packet, len);
+	struct ip *ip_hdr = (struct ip *)pp->ip;
 	if (ip_hdr->ip_p == IPPROTO_TCP) {
-		struct tcphdr *tcp = get_tcp_header(ip_hdr, len);
+		struct tcphdr *tcp = (struct tcphdr *)pp->tcp;
 		fs_add_uint64(fs, "sport", (uint64_t)ntohs(tcp->th_sport));
 		fs_add_uint64(fs, "dport", (uint64_t)ntohs(tcp->th_dport));
 		fs_add_uint64(fs, "seqnum", (uint64_t)ntohl(tcp->th_seq));
@@ -198,7 +201,7 @@ static void synackscan_process_packet(const u_char *packet, UNUSED uint32_t len,
 		fs_add_constchar(fs, "classification", "icmp");
 		fs_add_bool(fs, "success", 0);
 		// icmp
-		fs_populate_icmp_from_iphdr(ip_hdr, len, fs);
+		fs_populate_icmp_from_parsed(pp, fs);
 	}
 }
 
@@ -224,6 +227,7 @@ probe_module_t module_tcp_synackscan = {
     .print_packet = &synscan_print_packet,
     .process_packet = &synackscan_process_packet,
     .validate_packet = &synackscan_validate_packet,
+    .validate_parsed = &synackscan_validate_parsed,
     .close = NULL,
     .helptext = "Probe module that sends a TCP SYNACK packet to a specific "
 		"port. Possible classifications are: synack and rst. A "
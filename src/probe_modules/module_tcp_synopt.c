@@ -102,6 +102,9 @@ int tcpsynopt_global_initialize(struct state_conf *conf)
 	return EXIT_SUCCESS;
 }
 
+static __thread uint32_t ip_csum_base;
+static __thread uint32_t tcp_csum_base_sum;
+
 static int tcpsynopt_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 				  UNUSED void *arg_ptr)
 {
@@ -109,41 +112,46 @@ static int tcpsynopt_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 	struct ether_header *eth_header = (struct ether_header *) buf;
 	make_eth_header(eth_header, src, gw);
 	struct ip *ip_header = (struct ip*)(&eth_header[1]);
-	uint16_t len = htons(sizeof(struct ip) + ZMAP_TCP_SYNOPT_TCP_HEADER_LEN + tcp_send_opts_len);
+	uint16_t tcp_len = ZMAP_TCP_SYNOPT_TCP_HEADER_LEN + tcp_send_opts_len;
+	uint16_t len = htons(sizeof(struct ip) + tcp_len);
 	make_ip_header(ip_header, IPPROTO_TCP, len);
 	struct tcphdr *tcp_header = (struct tcphdr*)(&ip_header[1]);
 	make_tcp_header(tcp_header, TH_SYN);
+	// the options are the same for every probe
+	memcpy(&tcp_header[1], tcp_send_opts, tcp_send_opts_len);
+	tcp_header->th_off = 5+tcp_send_opts_len/4; // default length = 5 + 9*32 bit options
+	ip_csum_base = ip_header_csum_base(ip_header);
+	tcp_csum_base_sum = tcp_csum_base(tcp_header, tcp_len);
 	return EXIT_SUCCESS;
 }
 
-int tcpsynopt_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip, ipaddr_n_t dst_ip, port_n_t dport,
+int tcpsynopt_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip, const ipaddr_t *dst_ip, port_n_t dport,
 		uint8_t ttl, uint32_t *validation, int probe_num, UNUSED uint16_t ip_id, UNUSED void *arg)
 {
 	struct ether_header *eth_header = (struct ether_header *)buf;
 	struct ip *ip_header = (struct ip*)(&eth_header[1]);
 	struct tcphdr *tcp_header = (struct tcphdr*)(&ip_header[1]);
-	unsigned char* opts = (unsigned char*)&tcp_header[1];
 	uint32_t tcp_seq = validation[0];
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	ip_header->ip_ttl = ttl;
 
 	tcp_header->th_sport = htons(get_src_port(num_ports,
 				probe_num, validation));
 	tcp_header->th_dport = dport;
 	tcp_header->th_seq = tcp_seq;
+	uint32_t pseudo = ip_pseudo_csum(src_ip->v4, dst_ip->v4);
+	if (zconf.csum_offload) {
+		tcp_header->th_sum = l4_csum_partial(
+		    pseudo, ZMAP_TCP_SYNOPT_TCP_HEADER_LEN + tcp_send_opts_len,
+		    IPPROTO_TCP);
+	} else {
+		tcp_header->th_sum =
+		    tcp_csum(tcp_csum_base_sum, tcp_header, pseudo);
+	}
 
-    memcpy(opts, tcp_send_opts, tcp_send_opts_len);
-
-    tcp_header->th_off = 5+tcp_send_opts_len/4; // default length = 5 + 9*32 bit options
-
-	tcp_header->th_sum = 0;
-	tcp_header->th_sum = tcp_checksum(ZMAP_TCP_SYNOPT_TCP_HEADER_LEN+tcp_send_opts_len,
-			ip_header->ip_src.s_addr, ip_header->ip_dst.s_addr, tcp_header);
-
-	ip_header->ip_sum = 0;
-	ip_header->ip_sum = zmap_ip_checksum((unsigned short *) ip_header);
+	ip_header->ip_sum = ip_header_csum(ip_csum_base, ip_header);
 
     *buf_len = ZMAP_TCP_SYNOPT_PACKET_LEN+tcp_send_opts_len;
 
@@ -168,7 +176,7 @@ void tcpsynopt_print_packet(FILE *fp, void* packet)
 int tcpsynopt_validate_packet(const struct ip *ip_hdr, uint32_t len,
 		__attribute__((unused))uint32_t *src_ip,
 		uint32_t *validation,
-		const struct port_conf *ports)
+		const struct port_conf *ports, UNUSED void *arg)
 {
 	if (ip_hdr->ip_p != IPPROTO_TCP) {
 		return 0;
@@ -207,12 +215,11 @@ int tcpsynopt_validate_packet(const struct ip *ip_hdr, uint32_t len,
 
 #define IP_ADDR_LEN_STR 20
 
-void tcpsynopt_process_packet(const u_char *packet,
-		__attribute__((unused)) uint32_t len, fieldset_t *fs,
+void tcpsynopt_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
 	    __attribute__((unused)) uint32_t *validation,
-		__attribute__((unused)) struct timespec ts)
+		__attribute__((unused)) struct timespec ts, UNUSED void *arg)
 {
-	struct ip *ip_hdr = (struct ip *)&packet[sizeof(struct ether_header)];
+	struct ip *ip_hdr = (struct ip *)pp->ip;
 
 	char srcip[IP_ADDR_LEN_STR+1];
 	struct in_addr *s = (struct in_addr *) &(ip_hdr->ip_src);
@@ -222,9 +229,9 @@ void tcpsynopt_process_packet(const u_char *packet,
 
 	struct tcphdr *tcp = (struct tcphdr*)((char *)ip_hdr
 					+ 4*ip_hdr->ip_hl);
-	unsigned int optionbytes2=len-(sizeof(struct ether_header)+4*ip_hdr->ip_hl + sizeof(struct tcphdr));
+	unsigned int optionbytes2=pp->len-(4*ip_hdr->ip_hl + sizeof(struct tcphdr));
 
-	tcpsynopt_process_packet_parse(len, fs,tcp,optionbytes2);
+	tcpsynopt_process_packet_parse(pp->len, fs,tcp,optionbytes2);
 	return;
 }
 
@@ -235,6 +242,7 @@ probe_module_t module_tcp_synopt = {
 	.pcap_filter = "tcp && tcp[13] & 4 != 0 || tcp[13] == 18",
 	.pcap_snaplen = 96+10*4, //max len
 	.port_args = 1,
+	.csum_offload = 1,
 	.global_initialize = &tcpsynopt_global_initialize,
 	.prepare_packet = &tcpsynopt_prepare_packet,
 	.make_packet = &tcpsynopt_make_packet,
@@ -16,6 +16,7 @@
 #include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
 
 #include "../../lib/includes.h"
 #include "../fieldset.h"
@@ -23,6 +24,7 @@
 #include "module_tcp_synscan.h"
 #include "probe_modules.h"
 #include "packet.h"
+#include "tcp_followup.h"
 #include "validate.h"
 
 // defaults
@@ -35,6 +37,13 @@ probe_module_t module_tcp_synscan;
 
 static uint16_t num_source_ports;
 static uint8_t os_for_tcp_options;
+// where the TSval of the timestamp option sits in the TCP header, 0 when
+// the options have none. Probes carry their send time there, in
+// microseconds, and the TSecr of a SYN-ACK echoes it back.
+static size_t tsval_offset;
+
+static __thread uint32_t ip_csum_base;
+static __thread uint32_t tcp_csum_base_sum;
 
 static int synscan_global_initialize(struct state_conf *state)
 {
@@ -75,8 +84,30 @@ static int synscan_global_initialize(struct state_conf *state)
 					 "\"windows\", and \"linux\"",
 			  state->probe_args);
 	}
+	// find the timestamp option in the options we are going to send
+	uint8_t scratch[60] = {0};
+	struct tcphdr *tcp = (struct tcphdr *)scratch;
+	make_tcp_header(tcp, TH_SYN);
+	size_t header_size = set_tcp_options(tcp, os_for_tcp_options);
+	for (size_t i = 20; i + 1 < header_size;) {
+		if (scratch[i] == TCPOPT_EOL || scratch[i] == TCPOPT_NOP) {
+			i++;
+			continue;
+		}
+		if (scratch[i] == TCPOPT_TIMESTAMP) {
+			tsval_offset = i + 2;
+			break;
+		}
+		if (scratch[i + 1] < 2) {
+			break;
+		}
+		i += scratch[i + 1];
+	}
 	// set max packet length accordingly for accurate send rate calculation
 	module_tcp_synscan.max_packet_length = zmap_tcp_synscan_packet_len;
+	if (tcp_followup_init(&module_tcp_synscan, 0)) {
+		return EXIT_FAILURE;
+	}
 	// double-check arithmetic
 	assert(zmap_tcp_synscan_packet_len - zmap_tcp_synscan_tcp_header_len == 34);
 
@@ -95,11 +126,27 @@ static int synscan_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 	struct tcphdr *tcp_header = (struct tcphdr *)(&ip_header[1]);
 	make_tcp_header(tcp_header, TH_SYN);
 	set_tcp_options(tcp_header, os_for_tcp_options);
+	if (tsval_offset) {
+		// filled in per probe, so left out of the checksum base
+		memset((uint8_t *)tcp_header + tsval_offset, 0, sizeof(uint32_t));
+	}
+	ip_csum_base = ip_header_csum_base(ip_header);
+	tcp_csum_base_sum =
+	    tcp_csum_base(tcp_header, zmap_tcp_synscan_tcp_header_len);
 	return EXIT_SUCCESS;
 }
 
-static int synscan_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
-			       ipaddr_n_t dst_ip, port_n_t dport, uint8_t ttl,
+// the low 32 bits of the time in microseconds, in network order
+static uint32_t send_tsval(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint64_t us = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	return htonl((uint32_t)us);
+}
+
+static int synscan_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+			       const ipaddr_t *dst_ip, port_n_t dport, uint8_t ttl,
 			       uint32_t *validation, int probe_num,
 			       uint16_t ip_id, UNUSED void *arg)
 {
@@ -108,29 +155,87 @@ static int synscan_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 	struct tcphdr *tcp_header = (struct tcphdr *)(&ip_header[1]);
 	uint32_t tcp_seq = validation[0];
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	ip_header->ip_ttl = ttl;
 
 	port_h_t sport = get_src_port(num_source_ports, probe_num, validation);
 	tcp_header->th_sport = htons(sport);
 	tcp_header->th_dport = dport;
 	tcp_header->th_seq = tcp_seq;
-	// checksum value must be zero when calculating packet's checksum
-	tcp_header->th_sum = 0;
-	tcp_header->th_sum = tcp_checksum(zmap_tcp_synscan_tcp_header_len,
-					  ip_header->ip_src.s_addr,
-					  ip_header->ip_dst.s_addr, tcp_header);
+	uint32_t tcp_base = tcp_csum_base_sum;
+	if (tsval_offset) {
+		uint32_t tsval = send_tsval();
+		memcpy((uint8_t *)tcp_header + tsval_offset, &tsval, sizeof(tsval));
+		tcp_base = csum_add32(tcp_base, tsval);
+	}
+	uint32_t pseudo = ip_pseudo_csum(src_ip->v4, dst_ip->v4);
+	if (zconf.csum_offload) {
+		tcp_header->th_sum = l4_csum_partial(
+		    pseudo, zmap_tcp_synscan_tcp_header_len, IPPROTO_TCP);
+	} else {
+		tcp_header->th_sum = tcp_csum(tcp_base, tcp_header, pseudo);
+	}
 
 	ip_header->ip_id = ip_id;
-	// checksum value must be zero when calculating packet's checksum
-	ip_header->ip_sum = 0;
-	ip_header->ip_sum = zmap_ip_checksum((unsigned short *)ip_header);
+	ip_header->ip_sum = ip_header_csum(ip_csum_base, ip_header);
 
 	*buf_len = zmap_tcp_synscan_packet_len;
 	return EXIT_SUCCESS;
 }
 
+static int synscan_make_packets(struct batch_packet *packets,
+				const probe_spec_t *specs, size_t n, uint8_t ttl,
+				UNUSED void *arg)
+{
+	const uint32_t ip_base = ip_csum_base;
+	uint32_t tcp_base = tcp_csum_base_sum;
+	const uint32_t len = zmap_tcp_synscan_packet_len;
+	const uint16_t ports = num_source_ports;
+	const size_t ts_off = tsval_offset;
+	const int offload = zconf.csum_offload;
+	const uint16_t tcp_len = zmap_tcp_synscan_tcp_header_len;
+	// the batch goes out as soon as it is built, so one reading of the
+	// clock stands for all of it
+	uint32_t tsval = 0;
+	if (ts_off) {
+		tsval = send_tsval();
+		tcp_base = csum_add32(tcp_base, tsval);
+	}
+	for (size_t i = 0; i < n; i++) {
+		const probe_spec_t *spec = &specs[i];
+		struct ip *ip_header =
+		    (struct ip *)(packets[i].buf + sizeof(struct ether_header));
+		struct tcphdr *tcp_header = (struct tcphdr *)(&ip_header[1]);
+		uint32_t saddr = spec->src_ip.v4;
+		uint32_t daddr = spec->dst_ip.v4;
+
+		ip_header->ip_src.s_addr = saddr;
+		ip_header->ip_dst.s_addr = daddr;
+		ip_header->ip_ttl = ttl;
+		ip_header->ip_id = spec->ip_id;
+		ip_header->ip_sum = ip_header_csum(ip_base, ip_header);
+
+		tcp_header->th_sport = htons(
+		    get_src_port(ports, spec->probe_num, spec->validation));
+		tcp_header->th_dport = spec->dst_port;
+		tcp_header->th_seq = spec->validation[0];
+		if (ts_off) {
+			memcpy((uint8_t *)tcp_header + ts_off, &tsval,
+			       sizeof(tsval));
+		}
+		uint32_t pseudo = ip_pseudo_csum(saddr, daddr);
+		if (offload) {
+			tcp_header->th_sum =
+			    l4_csum_partial(pseudo, tcp_len, IPPROTO_TCP);
+		} else {
+			tcp_header->th_sum = tcp_csum(tcp_base, tcp_header, pseudo);
+		}
+		packets[i].len = len;
+	}
+	return EXIT_SUCCESS;
+}
+
 // not static because used by synack scan
 void synscan_print_packet(FILE *fp, void *packet)
 {
@@ -146,23 +251,22 @@ void synscan_print_packet(FILE *fp, void *packet)
 	fprintf(fp, PRINT_PACKET_SEP);
 }
 
-static int synscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
+static int synscan_validate_parsed(const parsed_packet_t *pp,
 				   uint32_t *src_ip, uint32_t *validation,
-				   const struct port_conf *ports)
+				   const struct port_conf *ports,
+				   UNUSED void *arg)
 {
-	if (ip_hdr->ip_p == IPPROTO_TCP) {
-		struct tcphdr *tcp = get_tcp_header(ip_hdr, len);
+	if (pp->proto == IPPROTO_TCP) {
+		const struct tcphdr *tcp = pp->tcp;
 		if (!tcp) {
 			return PACKET_INVALID;
 		}
-		port_h_t sport = ntohs(tcp->th_sport);
-		port_h_t dport = ntohs(tcp->th_dport);
 		// validate source port
-		if (should_validate_src_port && !check_src_port(sport, ports)) {
+		if (should_validate_src_port && !check_src_port(pp->sport, ports)) {
 			return PACKET_INVALID;
 		}
 		// validate destination port
-		if (!check_dst_port(dport, num_source_ports, validation)) {
+		if (!check_dst_port(pp->dport, num_source_ports, validation)) {
 			return PACKET_INVALID;
 		}
 		// check whether we'll ever send to this IP during the scan
@@ -176,24 +280,24 @@ static int synscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
 			    htonl(tcp->th_ack) != htonl(validation[0]) + 1) {
 				return PACKET_INVALID;
 			}
-		} else {
+		} else if (tcp->th_flags & TH_SYN) {
 			// For non RST packets, recv(ack) == sent(seq) + 1
 			if (htonl(tcp->th_ack) != htonl(validation[0]) + 1) {
 				return PACKET_INVALID;
 			}
+		} else {
+			// --tcp-payload data, acking up to the whole payload
+			if (!tcp_followup_is_data(pp) ||
+			    !tcp_followup_ack_valid(tcp->th_ack, validation[0])) {
+				return PACKET_INVALID;
+			}
 		}
-	} else if (ip_hdr->ip_p == IPPROTO_ICMP) {
-		struct ip *ip_inner;
-		size_t ip_inner_len;
-		if (icmp_helper_validate(ip_hdr, len, sizeof(struct tcphdr),
-					 &ip_inner,
-					 &ip_inner_len) == PACKET_INVALID) {
-			return PACKET_INVALID;
-		}
-		struct tcphdr *tcp = get_tcp_header(ip_inner, ip_inner_len);
-		if (!tcp) {
+	} else if (pp->proto == IPPROTO_ICMP) {
+		if (icmp_helper_validate_parsed(pp, sizeof(struct tcphdr)) ==
+		    PACKET_INVALID) {
 			return PACKET_INVALID;
 		}
+		const struct tcphdr *tcp = pp->inner_l4;
 		// we can always check the destination port because this is the
 		// original packet and wouldn't have been altered by something
 		// responding on a different port. Note this is *different*
@@ -204,7 +308,7 @@ static int synscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
 		if (!check_src_port(dport, ports)) {
 			return PACKET_INVALID;
 		}
-		validate_gen(ip_hdr->ip_dst.s_addr, ip_inner->ip_dst.s_addr,
+		validate_gen(pp->ip->ip_dst.s_addr, pp->inner_ip->ip_dst.s_addr,
 			     tcp->th_dport, (uint8_t *)validation);
 		if (!check_dst_port(sport, num_source_ports, validation)) {
 			return PACKET_INVALID;
@@ -215,6 +319,16 @@ static int synscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
 	return PACKET_VALID;
 }
 
+static int synscan_validate_packet(const struct ip *ip_hdr, uint32_t len,
+				   uint32_t *src_ip, uint32_t *validation,
+				   const struct port_conf *ports,
+				   void *arg)
+{
+	parsed_packet_t pp;
+	parse_packet(ip_hdr, len, 0, &pp);
+	return synscan_validate_parsed(&pp, src_ip, validation, ports, arg);
+}
+
 
 static void add_tcpopt_to_fs(fieldset_t *fs, int64_t *val, const char *label)
 {
@@ -225,7 +339,8 @@ static void add_tcpopt_to_fs(fieldset_t *fs, int64_t *val, const char *label)
 	}
 }
 
-static void parse_tcp_opts(struct tcphdr *tcp, fieldset_t *fs)
+// adds the option fields, returning the TSecr or -1 without one
+static int64_t parse_tcp_opts(const struct tcphdr *tcp, fieldset_t *fs)
 {
 	int64_t mss = -1, wscale = -1, sack_perm = -1, ts_val = -1, ts_ecr = -1;
 
@@ -299,32 +414,48 @@ break_loop:
 	add_tcpopt_to_fs(fs, &sack_perm, "tcpopt_sack_perm");
 	add_tcpopt_to_fs(fs, &ts_val, "tcpopt_ts_val");
 	add_tcpopt_to_fs(fs, &ts_ecr, "tcpopt_ts_ecr");
+	return ts_ecr;
 }
 
-static void synscan_process_packet(const u_char *packet, UNUSED uint32_t len,
-				   fieldset_t *fs, UNUSED uint32_t *validation,
-				   UNUSED struct timespec ts)
+static void synscan_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
+				   UNUSED uint32_t *validation,
+				   struct timespec ts, UNUSED void *arg)
 {
-	struct ip *ip_hdr = get_ip_header(packet, len);
-	assert(ip_hdr);
-	if (ip_hdr->ip_p == IPPROTO_TCP) {
-		struct tcphdr *tcp = get_tcp_header(ip_hdr, len);
+	if (pp->proto == IPPROTO_TCP) {
+		const struct tcphdr *tcp = pp->tcp;
 		assert(tcp);
-		fs_add_uint64(fs, "sport", (uint64_t)ntohs(tcp->th_sport));
-		fs_add_uint64(fs, "dport", (uint64_t)ntohs(tcp->th_dport));
+		fs_add_uint64(fs, "sport", (uint64_t)pp->sport);
+		fs_add_uint64(fs, "dport", (uint64_t)pp->dport);
 		fs_add_uint64(fs, "seqnum", (uint64_t)ntohl(tcp->th_seq));
 		fs_add_uint64(fs, "acknum", (uint64_t)ntohl(tcp->th_ack));
 		fs_add_uint64(fs, "window", (uint64_t)ntohs(tcp->th_win));
-		parse_tcp_opts(tcp, fs);
+		int64_t ts_ecr = parse_tcp_opts(tcp, fs);
+		if (tsval_offset && ts_ecr > 0) {
+			// wraps every 71 minutes, far longer than a round trip
+			uint64_t us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+			fs_add_uint64(fs, "rtt_us",
+				      (uint32_t)((uint32_t)us - (uint32_t)ts_ecr));
+		} else {
+			fs_add_null(fs, "rtt_us");
+		}
 		if (tcp->th_flags & TH_RST) { // RST packet
+			fs_add_null(fs, "banner");
 			fs_add_constchar(fs, "classification", "rst");
 			fs_add_bool(fs, "success", 0);
-		} else { // SYNACK packet
+		} else if (tcp->th_flags & TH_SYN) { // SYNACK packet
+			fs_add_null(fs, "banner");
 			fs_add_constchar(fs, "classification", "synack");
 			fs_add_bool(fs, "success", 1);
+		} else { // --tcp-payload data
+			uint32_t len;
+			const uint8_t *data = tcp_followup_data(pp, &len);
+			fs_add_binary(fs, "banner", len, (void *)data, 0);
+			fs_add_constchar(fs, "classification", "data");
+			fs_add_bool(fs, "success", 1);
+			tcp_followup_count_data();
 		}
 		fs_add_null_icmp(fs);
-	} else if (ip_hdr->ip_p == IPPROTO_ICMP) {
+	} else if (pp->proto == IPPROTO_ICMP) {
 		// tcp
 		fs_add_null(fs, "sport");
 		fs_add_null(fs, "dport");
@@ -336,14 +467,23 @@ static void synscan_process_packet(const u_char *packet, UNUSED uint32_t len,
 		fs_add_null(fs, "tcpopt_sack_perm");
 		fs_add_null(fs, "tcpopt_ts_val");
 		fs_add_null(fs, "tcpopt_ts_ecr");
+		fs_add_null(fs, "rtt_us");
+		fs_add_null(fs, "banner");
 		// global
 		fs_add_constchar(fs, "classification", "icmp");
 		fs_add_bool(fs, "success", 0);
 		// icmp
-		fs_populate_icmp_from_iphdr(ip_hdr, len, fs);
+		fs_populate_icmp_from_parsed(pp, fs);
 	}
 }
 
+static int synscan_classify(const parsed_packet_t *pp,
+			    UNUSED uint32_t *validation,
+			    UNUSED int *app_success, UNUSED void *arg)
+{
+	return pp->proto == IPPROTO_TCP && !(pp->tcp->th_flags & TH_RST);
+}
+
 static fielddef_t fields[] = {
     {.name = "sport", .type = "int", .desc = "TCP source port"},
     {.name = "dport", .type = "int", .desc = "TCP destination port"},
@@ -355,6 +495,8 @@ static fielddef_t fields[] = {
     {.name = "tcpopt_sack_perm", .type = "int", .desc = "TCP SACK permitted option"},
     {.name = "tcpopt_ts_val", .type = "int", .desc = "TCP timestamp option value"},
     {.name = "tcpopt_ts_ecr", .type = "int", .desc = "TCP timestamp option echo reply"},
+    {.name = "rtt_us", .type = "int", .desc = "round-trip time in microseconds, from the send time echoed in the timestamp option (linux and bsd probe-args only)"},
+    {.name = "banner", .type = "binary", .desc = "data the server sent after the --tcp-payload follow-up"},
     CLASSIFICATION_SUCCESS_FIELDSET_FIELDS,
     ICMP_FIELDSET_FIELDS,
 };
@@ -364,12 +506,17 @@ probe_module_t module_tcp_synscan = {
     .pcap_filter = "(tcp && tcp[13] & 4 != 0 || tcp[13] == 18) || icmp",
     .pcap_snaplen = 96,
     .port_args = 1,
+    .csum_offload = 1,
     .global_initialize = &synscan_global_initialize,
     .prepare_packet = &synscan_prepare_packet,
     .make_packet = &synscan_make_packet,
+    .make_packets = &synscan_make_packets,
     .print_packet = &synscan_print_packet,
     .process_packet = &synscan_process_packet,
+    .classify = &synscan_classify,
+    .followup = &tcp_followup_respond,
     .validate_packet = &synscan_validate_packet,
+    .validate_parsed = &synscan_validate_parsed,
     .close = NULL,
     .helptext =
 	"Probe module that sends a TCP SYN packet to a specific port. Possible "
@@ -381,7 +528,10 @@ probe_module_t module_tcp_synscan = {
 	"\"smallest-probes\", \"bsd\", \"linux\", \"windows\" (default). "
 	"The \"smallest-probes\" option only sends MSS to achieve a better hit-rate "
 	"than no options while staying within the minimum Ethernet payload size. Windows-style "
-	"TCP options offer the highest hit-rate with a modest increase in probe size.",
+	"TCP options offer the highest hit-rate with a modest increase in probe size. "
+	"With --tcp-payload, each SYN-ACK is answered with an ACK carrying the "
+	"payload, and the data the server sends back is a \"data\" response "
+	"with the \"banner\" field.",
     .output_type = OUTPUT_TYPE_STATIC,
     .fields = fields,
     .numfields = sizeof(fields) / sizeof(fields[0])};
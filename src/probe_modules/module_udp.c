@@ -37,6 +37,32 @@ static size_t udp_fixed_payload_len = 0;
 
 static udp_payload_template_t *udp_template = NULL;
 
+// A payload template compiled into a prebuilt prefix and the fields to fill
+// in for each packet
+typedef struct udp_template_op {
+	udp_payload_field_type_t ftype;
+	size_t offset; // from the start of the payload, for patches
+	size_t length;
+	const char *data; // UDP_DATA and UDP_HEX
+} udp_template_op_t;
+
+typedef struct udp_compiled_template {
+	char prefix[MAX_UDP_PAYLOAD_LEN];
+	size_t prefix_len;
+	udp_template_op_t *patches; // generated fields within the prefix
+	size_t patch_count;
+	udp_template_op_t *tail; // the fields after it, in order
+	size_t tail_count;
+} udp_compiled_template_t;
+
+static udp_compiled_template_t *udp_compiled = NULL;
+
+static udp_compiled_template_t *udp_template_compile(udp_payload_template_t *t);
+static void udp_template_compiled_free(udp_compiled_template_t *ct);
+static size_t udp_template_patch(const udp_compiled_template_t *ct,
+				 char *payload, struct ip *ip_hdr,
+				 struct udphdr *udp_hdr, aesrand_t *aes);
+
 const char *udp_usage_error =
     "unknown UDP probe specification (expected file:/path or text:STRING or hex:01020304 or template:/path or template-fields)";
 
@@ -208,7 +234,9 @@ int udp_global_initialize(struct state_conf *conf)
 
 		udp_template =
 		    udp_template_load(in, in_len, &udp_template_max_len);
+		udp_compiled = udp_template_compile(udp_template);
 		module_udp.make_packet = udp_make_templated_packet;
+		module_udp.make_packets = NULL;
 	} else if (strncmp(args, "hex", arg_name_len) == 0) {
 		udp_fixed_payload_len = strlen(c) / 2;
 		udp_fixed_payload = xmalloc(udp_fixed_payload_len);
@@ -255,6 +283,10 @@ int udp_global_cleanup(UNUSED struct state_conf *zconf,
 		free(udp_fixed_payload);
 		udp_fixed_payload = NULL;
 	}
+	if (udp_compiled) {
+		udp_template_compiled_free(udp_compiled);
+		udp_compiled = NULL;
+	}
 	if (udp_template) {
 		udp_template_free(udp_template);
 		udp_template = NULL;
@@ -291,11 +323,23 @@ int udp_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw, UNUSED void *ar
 		memcpy(payload, udp_fixed_payload, udp_fixed_payload_len);
 	}
 
+	if (udp_compiled) {
+		memcpy(&udp_header[1], udp_compiled->prefix,
+		       udp_compiled->prefix_len);
+		// with nothing after the prefix every payload is as long
+		if (!udp_compiled->tail_count) {
+			size_t len = udp_compiled->prefix_len;
+			ip_header->ip_len = htons(sizeof(struct ip) +
+						  sizeof(struct udphdr) + len);
+			udp_header->uh_ulen = htons(sizeof(struct udphdr) + len);
+		}
+	}
+
 	return EXIT_SUCCESS;
 }
 
-int udp_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
-		    ipaddr_n_t dst_ip, port_n_t dport, uint8_t ttl,
+int udp_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+		    const ipaddr_t *dst_ip, port_n_t dport, uint8_t ttl,
 		    uint32_t *validation, int probe_num, uint16_t ip_id,
 		    UNUSED void *arg)
 {
@@ -305,24 +349,58 @@ int udp_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 	size_t headers_len = sizeof(struct ether_header) + sizeof(struct ip) +
 			     sizeof(struct udphdr);
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	ip_header->ip_ttl = ttl;
 	udp_header->uh_sport =
 	    htons(get_src_port(num_ports, probe_num, validation));
 	udp_header->uh_dport = dport;
 
 	ip_header->ip_id = ip_id;
-	ip_header->ip_sum = 0;
-	ip_header->ip_sum = zmap_ip_checksum((unsigned short *)ip_header);
+	// also used by modules with their own prepare_packet, so the invariant
+	// part of the header is summed here rather than cached
+	ip_header->ip_sum =
+	    ip_header_csum(ip_header_csum_base(ip_header), ip_header);
 
 	// Output the total length of the packet
 	*buf_len = headers_len + udp_fixed_payload_len;
 	return EXIT_SUCCESS;
 }
 
-int udp_make_templated_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
-			      ipaddr_n_t dst_ip, port_n_t dport, uint8_t ttl,
+// udp_make_packet for a batch. Every buffer was set up by the same
+// prepare_packet, so the invariant part of the IP header is summed once.
+int udp_make_packets(struct batch_packet *packets, const probe_spec_t *specs,
+		     size_t n, uint8_t ttl, UNUSED void *arg)
+{
+	if (!n) {
+		return EXIT_SUCCESS;
+	}
+	const size_t ip_off = sizeof(struct ether_header);
+	const uint32_t ip_base =
+	    ip_header_csum_base((struct ip *)(packets[0].buf + ip_off));
+	const uint32_t len = sizeof(struct ether_header) + sizeof(struct ip) +
+			     sizeof(struct udphdr) + udp_fixed_payload_len;
+	const int ports = num_ports;
+	for (size_t i = 0; i < n; i++) {
+		const probe_spec_t *spec = &specs[i];
+		struct ip *ip_header = (struct ip *)(packets[i].buf + ip_off);
+		struct udphdr *udp_header = (struct udphdr *)&ip_header[1];
+
+		ip_header->ip_src.s_addr = spec->src_ip.v4;
+		ip_header->ip_dst.s_addr = spec->dst_ip.v4;
+		ip_header->ip_ttl = ttl;
+		ip_header->ip_id = spec->ip_id;
+		ip_header->ip_sum = ip_header_csum(ip_base, ip_header);
+		udp_header->uh_sport = htons(
+		    get_src_port(ports, spec->probe_num, spec->validation));
+		udp_header->uh_dport = spec->dst_port;
+		packets[i].len = len;
+	}
+	return EXIT_SUCCESS;
+}
+
+int udp_make_templated_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+			      const ipaddr_t *dst_ip, port_n_t dport, uint8_t ttl,
 			      uint32_t *validation, int probe_num, uint16_t ip_id,
 			      void *arg)
 {
@@ -332,39 +410,38 @@ int udp_make_templated_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
 	size_t headers_len = sizeof(struct ether_header) + sizeof(struct ip) +
 			     sizeof(struct udphdr);
 
-	ip_header->ip_src.s_addr = src_ip;
-	ip_header->ip_dst.s_addr = dst_ip;
+	ip_header->ip_src.s_addr = src_ip->v4;
+	ip_header->ip_dst.s_addr = dst_ip->v4;
 	ip_header->ip_ttl = ttl;
 	udp_header->uh_sport =
 	    htons(get_src_port(num_ports, probe_num, validation));
 	udp_header->uh_dport = dport;
 
-	char *payload = (char *)&udp_header[1];
-	memset(payload, 0, MAX_UDP_PAYLOAD_LEN);
-
 	// Grab our random number generator
 	aesrand_t *aes = (aesrand_t *)arg;
 
-	// The buf is a stack var of our caller of size MAX_PACKET_SIZE
-	// Recalculate the payload using the loaded template
-	int payload_len =
-	    udp_template_build(udp_template, payload, MAX_UDP_PAYLOAD_LEN,
-			       ip_header, udp_header, aes);
+	// The constant parts of the payload were written by prepare_packet and
+	// are left alone by earlier packets, so only the generated fields are
+	// filled in
+	size_t payload_len = udp_template_patch(
+	    udp_compiled, (char *)&udp_header[1], ip_header, udp_header, aes);
 
-	// If success is zero, the template output was truncated
-	if (payload_len <= 0) {
+	// Templates that could overflow the payload are refused when compiled
+	if (payload_len == 0) {
 		log_fatal("udp",
 			  "UDP payload template generated an empty payload");
 	}
 
 	// Update the IP and UDP headers to match the new payload length
-	ip_header->ip_len =
-	    htons(sizeof(struct ip) + sizeof(struct udphdr) + payload_len);
-	udp_header->uh_ulen = ntohs(sizeof(struct udphdr) + payload_len);
+	if (udp_compiled->tail_count) {
+		ip_header->ip_len = htons(sizeof(struct ip) +
+					  sizeof(struct udphdr) + payload_len);
+		udp_header->uh_ulen = htons(sizeof(struct udphdr) + payload_len);
+	}
 
-	ip_header->ip_sum = 0;
 	ip_header->ip_id = ip_id;
-	ip_header->ip_sum = zmap_ip_checksum((unsigned short *)ip_header);
+	ip_header->ip_sum =
+	    ip_header_csum(ip_header_csum_base(ip_header), ip_header);
 
 	// Recalculate the total length of the packet
 	*buf_len = headers_len + payload_len;
@@ -384,26 +461,24 @@ void udp_print_packet(FILE *fp, void *packet)
 	fprintf(fp, PRINT_PACKET_SEP);
 }
 
-void udp_process_packet(const u_char *packet, UNUSED uint32_t len,
-			fieldset_t *fs, UNUSED uint32_t *validation,
-			UNUSED struct timespec ts)
+void udp_process_packet(const parsed_packet_t *pp, fieldset_t *fs,
+			UNUSED uint32_t *validation,
+			UNUSED struct timespec ts, UNUSED void *arg)
 {
-	struct ip *ip_hdr = (struct ip *)&packet[sizeof(struct ether_header)];
-	if (ip_hdr->ip_p == IPPROTO_UDP) {
-		struct udphdr *udp = get_udp_header(ip_hdr, len);
+	if (pp->proto == IPPROTO_UDP) {
+		const struct udphdr *udp = pp->udp;
 		fs_add_constchar(fs, "classification", "udp");
 		fs_add_bool(fs, "success", 1);
-		fs_add_uint64(fs, "sport", ntohs(udp->uh_sport));
-		fs_add_uint64(fs, "dport", ntohs(udp->uh_dport));
+		fs_add_uint64(fs, "sport", pp->sport);
+		fs_add_uint64(fs, "dport", pp->dport);
 		fs_add_uint64(fs, "udp_pkt_size", ntohs(udp->uh_ulen));
 		// Verify that the UDP length is big enough for the header and
 		// at least one byte
 		uint16_t data_len = ntohs(udp->uh_ulen);
 		if (data_len > sizeof(struct udphdr)) {
-			uint32_t overhead =
-			    (sizeof(struct udphdr) + (ip_hdr->ip_hl * 4));
-			uint32_t max_rlen = len - overhead;
-			uint32_t max_ilen = ntohs(ip_hdr->ip_len) - overhead;
+			uint32_t overhead = sizeof(struct udphdr) + pp->l4_off;
+			uint32_t max_rlen = pp->len - overhead;
+			uint32_t max_ilen = ntohs(pp->ip->ip_len) - overhead;
 
 			// Verify that the UDP length is inside of our received
 			// buffer
@@ -421,14 +496,14 @@ void udp_process_packet(const u_char *packet, UNUSED uint32_t len,
 			fs_add_null(fs, "data");
 		}
 		fs_add_null_icmp(fs);
-	} else if (ip_hdr->ip_p == IPPROTO_ICMP) {
+	} else if (pp->proto == IPPROTO_ICMP) {
 		fs_add_constchar(fs, "classification", "icmp");
 		fs_add_bool(fs, "success", 0);
 		fs_add_null(fs, "sport");
 		fs_add_null(fs, "dport");
 		fs_add_null(fs, "udp_pkt_size");
 		fs_add_null(fs, "data");
-		fs_populate_icmp_from_iphdr(ip_hdr, len, fs);
+		fs_populate_icmp_from_parsed(pp, fs);
 	} else {
 		fs_add_constchar(fs, "classification", "other");
 		fs_add_bool(fs, "success", 0);
@@ -440,13 +515,28 @@ void udp_process_packet(const u_char *packet, UNUSED uint32_t len,
 	}
 }
 
+int udp_classify(const parsed_packet_t *pp, UNUSED uint32_t *validation,
+		 UNUSED int *app_success, UNUSED void *arg)
+{
+	return pp->proto == IPPROTO_UDP;
+}
+
 int udp_validate_packet(const struct ip *ip_hdr, uint32_t len, uint32_t *src_ip,
-			uint32_t *validation, const struct port_conf *ports)
+			uint32_t *validation, const struct port_conf *ports,
+			UNUSED void *arg)
 {
 	return udp_do_validate_packet(ip_hdr, len, src_ip, validation,
 				      num_ports, should_validate_src_port, ports);
 }
 
+static int udp_validate_parsed(const parsed_packet_t *pp, uint32_t *src_ip,
+			       uint32_t *validation,
+			       const struct port_conf *ports, UNUSED void *arg)
+{
+	return udp_do_validate_parsed(pp, src_ip, validation, num_ports,
+				      should_validate_src_port, ports);
+}
+
 // Do very basic validation that this is an ICMP response to a packet we sent
 // Find the application layer packet that was originally sent and give it back
 // to the caller to do additional validation (e.g., correct TCP destination
@@ -454,36 +544,40 @@ int udp_validate_packet(const struct ip *ip_hdr, uint32_t len, uint32_t *src_ip,
 
 int udp_do_validate_packet(const struct ip *ip_hdr, uint32_t len,
 			   uint32_t *src_ip, uint32_t *validation,
-			   int num_ports, UNUSED int validate_port,
+			   int num_ports, int validate_port,
 			   const struct port_conf *ports)
 {
-	if (ip_hdr->ip_p == IPPROTO_UDP) {
-		struct udphdr *udp = get_udp_header(ip_hdr, len);
-		if (!udp) {
+	parsed_packet_t pp;
+	parse_packet(ip_hdr, len, 0, &pp);
+	return udp_do_validate_parsed(&pp, src_ip, validation, num_ports,
+				      validate_port, ports);
+}
+
+int udp_do_validate_parsed(const parsed_packet_t *pp, uint32_t *src_ip,
+			   uint32_t *validation, int num_ports,
+			   int validate_port, const struct port_conf *ports)
+{
+	if (pp->proto == IPPROTO_UDP) {
+		if (!pp->udp) {
 			return PACKET_INVALID;
 		}
-		uint16_t dport = ntohs(udp->uh_dport);
-		if (!check_dst_port(dport, num_ports, validation)) {
+		if (!check_dst_port(pp->dport, num_ports, validation)) {
 			return PACKET_INVALID;
 		}
 		if (!blocklist_is_allowed(*src_ip)) {
 			return PACKET_INVALID;
 		}
 		if (validate_port == SRC_PORT_VALIDATION) {
-			uint16_t sport = ntohs(udp->uh_sport);
-			if (!check_src_port(sport, ports)) {
+			if (!check_src_port(pp->sport, ports)) {
 				return PACKET_INVALID;
 			}
 		}
-	} else if (ip_hdr->ip_p == IPPROTO_ICMP) {
-		struct ip *ip_inner;
-		size_t ip_inner_len;
-		if (icmp_helper_validate(ip_hdr, len, sizeof(struct udphdr),
-					 &ip_inner,
-					 &ip_inner_len) == PACKET_INVALID) {
+	} else if (pp->proto == IPPROTO_ICMP) {
+		if (icmp_helper_validate_parsed(pp, sizeof(struct udphdr)) ==
+		    PACKET_INVALID) {
 			return PACKET_INVALID;
 		}
-		struct udphdr *udp = get_udp_header(ip_inner, ip_inner_len);
+		const struct udphdr *udp = pp->inner_l4;
 		// we can always check the destination port because this is the
 		// original packet and wouldn't have been altered by something
 		// responding on a different port
@@ -604,6 +698,82 @@ int udp_random_bytes(char *dst, int len, const unsigned char *charset,
 	return i;
 }
 
+// Writes the value of a generated field at p, returning its length, which
+// is c->length for all but the dotted-quad and ascii port fields.
+static int udp_template_gen(udp_payload_field_type_t ftype, size_t length,
+			    char *p, struct ip *ip_hdr, struct udphdr *udp_hdr,
+			    aesrand_t *aes, struct timeval *tv)
+{
+	char tmp[256];
+	int y;
+
+	switch (ftype) {
+	case UDP_DATA:
+	case UDP_HEX:
+		return 0;
+
+	case UDP_RAND_DIGIT:
+		return udp_random_bytes(p, length, charset_digit, 10, aes);
+
+	case UDP_RAND_ALPHA:
+		return udp_random_bytes(p, length, charset_alpha, 52, aes);
+
+	case UDP_RAND_ALPHANUM:
+		return udp_random_bytes(p, length, charset_alphanum, 62, aes);
+
+	case UDP_RAND_BYTE:
+		return udp_random_bytes(p, length, charset_all, 256, aes);
+
+	case UDP_SADDR_A:
+	case UDP_DADDR_A:
+		// Write to stack and then memcpy in order to properly
+		// track length
+		inet_ntop(AF_INET,
+			  ftype == UDP_SADDR_A ? (char *)&ip_hdr->ip_src
+					       : (char *)&ip_hdr->ip_dst,
+			  tmp, sizeof(tmp) - 1);
+		y = strlen(tmp);
+		memcpy(p, tmp, y);
+		return y;
+
+	case UDP_SADDR_N:
+		memcpy(p, &ip_hdr->ip_src.s_addr, 4);
+		return 4;
+
+	case UDP_DADDR_N:
+		memcpy(p, &ip_hdr->ip_dst.s_addr, 4);
+		return 4;
+
+	case UDP_SPORT_N:
+		memcpy(p, &udp_hdr->uh_sport, 2);
+		return 2;
+
+	case UDP_DPORT_N:
+		memcpy(p, &udp_hdr->uh_dport, 2);
+		return 2;
+
+	case UDP_SPORT_A:
+	case UDP_DPORT_A:
+		y = snprintf(tmp, 6, "%d",
+			     ntohs(ftype == UDP_SPORT_A ? udp_hdr->uh_sport
+							: udp_hdr->uh_dport));
+		memcpy(p, tmp, y);
+		return y;
+
+	case UDP_UNIXTIME_SEC:
+	case UDP_UNIXTIME_USEC: {
+		if (tv->tv_sec == 0) {
+			gettimeofday(tv, NULL);
+		}
+		int32_t v = htonl(ftype == UDP_UNIXTIME_SEC ? tv->tv_sec
+							   : tv->tv_usec);
+		memcpy(p, &v, 4);
+		return 4;
+	}
+	}
+	return 0;
+}
+
 int udp_template_build(udp_payload_template_t *t, char *out, unsigned int len,
 		       struct ip *ip_hdr, struct udphdr *udp_hdr,
 		       aesrand_t *aes)
@@ -611,12 +781,7 @@ int udp_template_build(udp_payload_template_t *t, char *out, unsigned int len,
 	udp_payload_field_t *c;
 	char *p;
 	char *max;
-	char tmp[256];
-	int full = 0;
-	unsigned int x, y;
-	uint32_t *u32;
-	uint16_t *u16;
-	int32_t *i32;
+	unsigned int x;
 	struct timeval tv = (struct timeval){0};
 
 	max = out + len;
@@ -627,160 +792,112 @@ int udp_template_build(udp_payload_template_t *t, char *out, unsigned int len,
 
 		// Exit the processing loop if our packet buffer would overflow
 		if (p + c->length >= max) {
-			full = 1;
 			return 0;
 		}
 
-		switch (c->ftype) {
-			// These fields have a specified output length value
-
-		case UDP_DATA:
-		case UDP_HEX:
-			if (!(c->data && c->length))
-				break;
-			memcpy(p, c->data, c->length);
-			p += c->length;
-			break;
-
-		case UDP_RAND_DIGIT:
-			p += udp_random_bytes(p, c->length, charset_digit, 10,
-					      aes);
-			break;
-
-		case UDP_RAND_ALPHA:
-			p += udp_random_bytes(p, c->length, charset_alpha, 52,
-					      aes);
-			break;
-
-		case UDP_RAND_ALPHANUM:
-			p += udp_random_bytes(p, c->length, charset_alphanum,
-					      62, aes);
-			break;
-
-		case UDP_RAND_BYTE:
-			p += udp_random_bytes(p, c->length, charset_all, 256,
-					      aes);
-			break;
-
-		// These fields need to calculate size on their own
-
-		// TODO: Condense these case statements to remove redundant code
-		case UDP_SADDR_A:
-			if (p + 15 >= max) {
-				full = 1;
-				break;
-			}
-			// Write to stack and then memcpy in order to properly
-			// track length
-			inet_ntop(AF_INET, (char *)&ip_hdr->ip_src, tmp,
-				  sizeof(tmp) - 1);
-			memcpy(p, tmp, strlen(tmp));
-			p += strlen(tmp);
-			break;
-
-		case UDP_DADDR_A:
-			if (p + 15 >= max) {
-				full = 1;
-				break;
-			}
-			// Write to stack and then memcpy in order to properly
-			// track length
-			inet_ntop(AF_INET, (char *)&ip_hdr->ip_dst, tmp,
-				  sizeof(tmp) - 1);
-			memcpy(p, tmp, strlen(tmp));
-			p += strlen(tmp);
-			break;
-
-		case UDP_SADDR_N:
-			if (p + 4 >= max) {
-				full = 1;
-				break;
+		if (c->ftype == UDP_DATA || c->ftype == UDP_HEX) {
+			if (c->data && c->length) {
+				memcpy(p, c->data, c->length);
+				p += c->length;
 			}
+			continue;
+		}
+		p += udp_template_gen(c->ftype, c->length, p, ip_hdr, udp_hdr,
+				      aes, &tv);
+	}
 
-			u32 = (uint32_t *)p;
-			*u32 = ip_hdr->ip_src.s_addr;
-			p += 4;
-			break;
-
-		case UDP_DADDR_N:
-			if (p + 4 >= max) {
-				full = 1;
-				break;
-			}
-			u32 = (uint32_t *)p;
-			*u32 = ip_hdr->ip_dst.s_addr;
-			p += 4;
-			break;
-
-		case UDP_SPORT_N:
-			if (p + 2 >= max) {
-				full = 1;
-				break;
-			}
-			u16 = (uint16_t *)p;
-			*u16 = udp_hdr->uh_sport;
-			p += 2;
-			break;
-
-		case UDP_DPORT_N:
-			if (p + 2 >= max) {
-				full = 1;
-				break;
-			}
-			u16 = (uint16_t *)p;
-			*u16 = udp_hdr->uh_dport;
-			p += 2;
-			break;
-
-		case UDP_SPORT_A:
-			if (p + 5 >= max) {
-				full = 1;
-				break;
-			}
-			y = snprintf(tmp, 6, "%d", ntohs(udp_hdr->uh_sport));
-			memcpy(p, tmp, y);
-			p += y;
-			break;
-
-		case UDP_DPORT_A:
-			if (p + 5 >= max) {
-				full = 1;
-				break;
-			}
-			y = snprintf(tmp, 6, "%d", ntohs(udp_hdr->uh_dport));
-			memcpy(p, tmp, y);
-			p += y;
-			break;
+	return p - out;
+}
 
-		case UDP_UNIXTIME_SEC:
-		case UDP_UNIXTIME_USEC:
-			if (p + 4 >= max) {
-				full = 1;
-				break;
-			}
+static int udp_template_variable_length(udp_payload_field_type_t ftype)
+{
+	return ftype == UDP_SADDR_A || ftype == UDP_DADDR_A ||
+	       ftype == UDP_SPORT_A || ftype == UDP_DPORT_A;
+}
 
-			if (tv.tv_sec == 0) {
-				gettimeofday(&tv, NULL);
-			}
+static void udp_template_add_op(udp_template_op_t **ops, size_t *count,
+				const udp_payload_field_t *c, size_t offset)
+{
+	*ops = xrealloc(*ops, (*count + 1) * sizeof(udp_template_op_t));
+	(*ops)[(*count)++] = (udp_template_op_t){.ftype = c->ftype,
+						  .offset = offset,
+						  .length = c->length,
+						  .data = c->data};
+}
 
-			i32 = (int32_t *)p;
-			if (c->ftype == UDP_UNIXTIME_SEC) {
-				*i32 = htonl(tv.tv_sec);
-			} else {
-				*i32 = htonl(tv.tv_usec);
-			}
-			p += 4;
-			break;
+// Everything up to the first field whose length varies is at a fixed offset
+// in every payload: its constant bytes go into prefix, written out once per
+// buffer by prepare_packet, and its generated fields become patches at those
+// offsets. What follows is kept as a list of fields to write out in order.
+static udp_compiled_template_t *udp_template_compile(udp_payload_template_t *t)
+{
+	udp_compiled_template_t *ct = xcalloc(1, sizeof(udp_compiled_template_t));
+	size_t off = 0;
+	size_t max_len = 0;
+	int fixed = 1;
+	for (unsigned int x = 0; x < t->fcount; x++) {
+		udp_payload_field_t *c = t->fields[x];
+		// as udp_template_build, which gives up on any payload this
+		// could reach
+		if (max_len + c->length >= MAX_UDP_PAYLOAD_LEN) {
+			log_fatal("udp", "UDP payload template can generate "
+					 "payloads over %d bytes",
+				  MAX_UDP_PAYLOAD_LEN - 1);
+		}
+		max_len += c->length;
+		int is_data = c->ftype == UDP_DATA || c->ftype == UDP_HEX;
+		if (is_data && !(c->data && c->length)) {
+			continue;
+		}
+		if (fixed && udp_template_variable_length(c->ftype)) {
+			fixed = 0;
+		}
+		if (!fixed) {
+			udp_template_add_op(&ct->tail, &ct->tail_count, c, 0);
+		} else if (is_data) {
+			memcpy(ct->prefix + off, c->data, c->length);
+			off += c->length;
+		} else {
+			udp_template_add_op(&ct->patches, &ct->patch_count, c,
+					    off);
+			off += c->length;
 		}
+	}
+	ct->prefix_len = off;
+	return ct;
+}
 
+static void udp_template_compiled_free(udp_compiled_template_t *ct)
+{
+	xfree(ct->patches);
+	xfree(ct->tail);
+	xfree(ct);
+}
 
-		// Bail out if our packet buffer would overflow
-		if (full == 1) {
-			return 0;
+// Fills in the generated fields of a payload whose prefix is already in
+// place, returning the length of the payload.
+static size_t udp_template_patch(const udp_compiled_template_t *ct,
+				 char *payload, struct ip *ip_hdr,
+				 struct udphdr *udp_hdr, aesrand_t *aes)
+{
+	struct timeval tv = (struct timeval){0};
+	for (size_t i = 0; i < ct->patch_count; i++) {
+		const udp_template_op_t *op = &ct->patches[i];
+		udp_template_gen(op->ftype, op->length, payload + op->offset,
+				 ip_hdr, udp_hdr, aes, &tv);
+	}
+	char *p = payload + ct->prefix_len;
+	for (size_t i = 0; i < ct->tail_count; i++) {
+		const udp_template_op_t *op = &ct->tail[i];
+		if (op->ftype == UDP_DATA || op->ftype == UDP_HEX) {
+			memcpy(p, op->data, op->length);
+			p += op->length;
+		} else {
+			p += udp_template_gen(op->ftype, op->length, p, ip_hdr,
+					      udp_hdr, aes, &tv);
 		}
 	}
-
-	return p - out;
+	return p - payload;
 }
 
 // Convert a string field name to a field type, parsing any specified length
@@ -986,9 +1103,12 @@ probe_module_t module_udp = {
     .prepare_packet = &udp_prepare_packet,
     .make_packet =
 	&udp_make_packet, // can be overridden to udp_make_templated_packet by udp_global_initalize
+    .make_packets = &udp_make_packets,
     .print_packet = &udp_print_packet,
     .validate_packet = &udp_validate_packet,
     .process_packet = &udp_process_packet,
+    .validate_parsed = &udp_validate_parsed,
+    .classify = &udp_classify,
     .close = &udp_global_cleanup,
     .helptext = "Probe module that sends UDP packets to hosts. Packets can "
 		"optionally be templated based on destination host. Specify "
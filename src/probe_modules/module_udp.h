@@ -17,6 +17,7 @@
 #include "types.h"
 
 #include "state.h"
+#include "probe_modules.h"
 
 #define NO_SRC_PORT_VALIDATION 0
 #define SRC_PORT_VALIDATION 1
@@ -65,12 +66,14 @@ typedef struct udp_payload_output {
 
 void udp_print_packet(FILE *fp, void *packet);
 
-int udp_make_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
-		    ipaddr_n_t dst_ip, port_n_t dport, uint8_t ttl,
+int udp_make_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+		    const ipaddr_t *dst_ip, port_n_t dport, uint8_t ttl,
 		    uint32_t *validation, int probe_num, uint16_t ip_id,
 		    void *arg);
-int udp_make_templated_packet(void *buf, size_t *buf_len, ipaddr_n_t src_ip,
-			      ipaddr_n_t dst_ip, port_n_t dport, uint8_t ttl,
+int udp_make_packets(struct batch_packet *packets, const probe_spec_t *specs,
+		     size_t n, uint8_t ttl, void *arg);
+int udp_make_templated_packet(void *buf, size_t *buf_len, const ipaddr_t *src_ip,
+			      const ipaddr_t *dst_ip, port_n_t dport, uint8_t ttl,
 			      uint32_t *validation, int probe_num, uint16_t ip_id,
 			      void *arg);
 
@@ -79,6 +82,10 @@ int udp_do_validate_packet(const struct ip *ip_hdr, uint32_t len,
 			   int num_ports, int expected_port,
 			   const struct port_conf *ports);
 
+int udp_do_validate_parsed(const parsed_packet_t *pp, uint32_t *src_ip,
+			   uint32_t *validation, int num_ports,
+			   int validate_port, const struct port_conf *ports);
+
 int ipv6_udp_validate_packet(const struct ip6_hdr *ipv6_hdr, uint32_t len,
 		__attribute__((unused))uint32_t *src_ip, uint32_t *validation, int num_ports, int validate_port, 
 		const struct port_conf *ports);
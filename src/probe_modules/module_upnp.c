@@ -76,108 +76,144 @@ int upnp_prepare_packet(void *buf, macaddr_t *src, macaddr_t *gw,
 
 int upnp_validate_packet(const struct ip *ip_hdr, uint32_t len,
 			 uint32_t *src_ip, uint32_t *validation,
-			 const struct port_conf *ports)
+			 const struct port_conf *ports, UNUSED void *arg)
 {
 	return udp_do_validate_packet(ip_hdr, len, src_ip, validation,
 				      num_ports, should_validate_src_port, ports);
 }
 
-void upnp_process_packet(const u_char *packet, UNUSED uint32_t len,
+// The headers kept, in the order of their fields
+enum upnp_header {
+	UPNP_SERVER,
+	UPNP_LOCATION,
+	UPNP_USN,
+	UPNP_ST,
+	UPNP_EXT,
+	UPNP_CACHE_CONTROL,
+	UPNP_X_USER_AGENT,
+	UPNP_AGENT,
+	UPNP_DATE,
+	UPNP_HEADERS
+};
+
+static const struct {
+	const char *key;
+	size_t key_len;
+	const char *field;
+} upnp_headers[UPNP_HEADERS] = {
+    [UPNP_SERVER] = {"server", 6, "server"},
+    [UPNP_LOCATION] = {"location", 8, "location"},
+    [UPNP_USN] = {"usn", 3, "usn"},
+    [UPNP_ST] = {"st", 2, "st"},
+    [UPNP_EXT] = {"ext", 3, "ext"},
+    [UPNP_CACHE_CONTROL] = {"cache-control", 13, "cache_control"},
+    [UPNP_X_USER_AGENT] = {"x-user-agent", 12, "x_user_agent"},
+    [UPNP_AGENT] = {"agent", 5, "agent"},
+    [UPNP_DATE] = {"date", 4, "date"},
+};
+
+#define UPNP_STATUS_LINE "HTTP/1.1 200 OK"
+
+// a header value as it is in the packet
+typedef struct upnp_slice {
+	const char *p;
+	size_t len;
+} upnp_slice_t;
+
+static int upnp_header_index(const char *key, size_t len)
+{
+	for (int i = 0; i < UPNP_HEADERS; i++) {
+		if (len == upnp_headers[i].key_len &&
+		    !strncasecmp(key, upnp_headers[i].key, len)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// One pass over the response's lines, which end in "\n" or "\r\n", blank
+// ones skipped: the classification, by whether the first is the status
+// line, and where in the packet the values of the headers kept are, the
+// last of each winning. Nothing is copied.
+static const char *upnp_scan_headers(const char *data, size_t len,
+				     upnp_slice_t values[UPNP_HEADERS])
+{
+	const char *end = data + len;
+	bool is_first = true;
+	while (data < end) {
+		const char *eol = memchr(data, '\n', (size_t)(end - data));
+		const char *line = data;
+		size_t line_len = (size_t)((eol ? eol : end) - line);
+		data = eol ? eol + 1 : end;
+		if (line_len && line[line_len - 1] == '\r') {
+			line_len--;
+		}
+		if (!line_len) {
+			continue;
+		}
+		if (is_first) {
+			if (line_len != strlen(UPNP_STATUS_LINE) ||
+			    memcmp(line, UPNP_STATUS_LINE, line_len)) {
+				return "no-http-header";
+			}
+			is_first = false;
+			continue;
+		}
+		const char *colon = memchr(line, ':', line_len);
+		if (!colon) {
+			continue;
+		}
+		int i = upnp_header_index(line, (size_t)(colon - line));
+		if (i < 0) {
+			continue;
+		}
+		const char *value = colon + 1;
+		size_t value_len = line_len - (size_t)(value - line);
+		if (value_len && value[0] == ' ') {
+			value++;
+			value_len--;
+		}
+		values[i].p = value;
+		values[i].len = value_len;
+	}
+	return is_first ? "none" : "upnp";
+}
+
+void upnp_process_packet(const parsed_packet_t *pp,
 			 fieldset_t *fs, UNUSED uint32_t *validation,
-			 UNUSED struct timespec ts)
+			 UNUSED struct timespec ts, UNUSED void *arg)
 {
-	struct ip *ip_hdr = (struct ip *)&packet[sizeof(struct ether_header)];
+	struct ip *ip_hdr = (struct ip *)pp->ip;
 	if (ip_hdr->ip_p == IPPROTO_UDP) {
 		struct udphdr *udp =
 		    (struct udphdr *)((char *)ip_hdr + ip_hdr->ip_hl * 4);
 
-		char *payload = (char *)(&udp[1]);
-		uint16_t plen = udp->uh_ulen - 8;
-
-		char *s = xmalloc(plen + 1);
-		strncpy(s, payload, plen);
-		s[plen] = 0;
-
-		int is_first = 1;
-		const char *classification = "none";
-		uint64_t is_success = 0;
-
-		char *server = NULL, *location = NULL, *usn = NULL, *st = NULL,
-		     *cachecontrol = NULL, *ext = NULL, *xusragent = NULL,
-		     *date = NULL, *agent = NULL;
+		const char *payload = (const char *)(&udp[1]);
+		// the UDP length, of what was captured
+		size_t ulen = ntohs(udp->uh_ulen);
+		if (ulen > pp->l4_len) {
+			ulen = pp->l4_len;
+		}
+		size_t plen =
+		    ulen > sizeof(struct udphdr) ? ulen - sizeof(struct udphdr) : 0;
 
-		char *pch = strtok(s, "\n");
-		while (pch != NULL) {
-			if (pch[strlen(pch) - 1] == '\r') {
-				pch[strlen(pch) - 1] = '\0';
-			}
-			if (strlen(pch) == 0) {
-				pch = strtok(NULL, "\n");
-				continue;
-			}
-			// the first pch is always supposed to be an HTTP
-			// response
-			if (is_first) {
-				if (strcmp(pch, "HTTP/1.1 200 OK")) {
-					classification = "no-http-header";
-					is_success = 0;
-					goto cleanup;
-				}
-				is_first = 0;
-				is_success = 1;
-				classification = "upnp";
-				pch = strtok(NULL, "\n");
+		upnp_slice_t values[UPNP_HEADERS];
+		memset(values, 0, sizeof(values));
+		const char *classification =
+		    upnp_scan_headers(payload, plen, values);
+		fs_add_constchar(fs, "classification", classification);
+		fs_add_bool(fs, "success", !strcmp(classification, "upnp"));
+		for (int i = 0; i < UPNP_HEADERS; i++) {
+			// copied only for the fields that are output
+			if (!values[i].p || !fs_next_needed(fs)) {
+				fs_add_null(fs, upnp_headers[i].field);
 				continue;
 			}
-			char *value = pch;
-			char *key = strsep(&value, ":");
-			if (!key) {
-				pch = strtok(NULL, "\n");
-				continue;
-			}
-			if (!value) {
-				pch = strtok(NULL, "\n");
-				continue;
-			}
-			if (value[0] == ' ') {
-				value += (size_t)1;
-			}
-			if (!strcasecmp(key, "server")) {
-				server = strdup(value);
-			} else if (!strcasecmp(key, "location")) {
-				location = strdup(value);
-			} else if (!strcasecmp(key, "USN")) {
-				usn = strdup(value);
-			} else if (!strcasecmp(key, "EXT")) {
-				ext = strdup(value);
-			} else if (!strcasecmp(key, "ST")) {
-				st = strdup(value);
-			} else if (!strcasecmp(key, "Agent")) {
-				agent = strdup(value);
-			} else if (!strcasecmp(key, "X-User-Agent")) {
-				xusragent = strdup(value);
-			} else if (!strcasecmp(key, "date")) {
-				date = strdup(value);
-			} else if (!strcasecmp(key, "Cache-Control")) {
-				cachecontrol = strdup(value);
-			} else {
-				// log_debug("upnp-module", "new key: %s", key);
-			}
-			pch = strtok(NULL, "\n");
+			char *v = fs_arena_alloc(values[i].len + 1);
+			memcpy(v, values[i].p, values[i].len);
+			v[values[i].len] = '\0';
+			fs_add_unsafe_string(fs, upnp_headers[i].field, v, 1);
 		}
-
-	cleanup:
-		fs_add_string(fs, "classification", (char *)classification, 0);
-		fs_add_bool(fs, "success", is_success);
-		fs_chkadd_unsafe_string(fs, "server", server, 1);
-		fs_chkadd_unsafe_string(fs, "location", location, 1);
-		fs_chkadd_unsafe_string(fs, "usn", usn, 1);
-		fs_chkadd_unsafe_string(fs, "st", st, 1);
-		fs_chkadd_unsafe_string(fs, "ext", ext, 1);
-		fs_chkadd_unsafe_string(fs, "cache_control", cachecontrol, 1);
-		fs_chkadd_unsafe_string(fs, "x_user_agent", xusragent, 1);
-		fs_chkadd_unsafe_string(fs, "agent", agent, 1);
-		fs_chkadd_unsafe_string(fs, "date", date, 1);
 		fs_add_uint64(fs, "sport", ntohs(udp->uh_sport));
 		fs_add_uint64(fs, "dport", ntohs(udp->uh_dport));
 		fs_add_null(fs, "icmp_responder");
@@ -185,11 +221,7 @@ void upnp_process_packet(const u_char *packet, UNUSED uint32_t len,
 		fs_add_null(fs, "icmp_code");
 		fs_add_null(fs, "icmp_unreach_str");
 
-		fs_add_binary(fs, "data",
-			      (ntohs(udp->uh_ulen) - sizeof(struct udphdr)),
-			      (void *)&udp[1], 0);
-
-		free(s);
+		fs_add_binary(fs, "data", plen, (void *)payload, 0);
 	} else if (ip_hdr->ip_p == IPPROTO_ICMP) {
 		fs_add_constchar(fs, "classification", "icmp");
 		fs_add_uint64(fs, "success", 0);
@@ -207,7 +239,7 @@ void upnp_process_packet(const u_char *packet, UNUSED uint32_t len,
 		fs_add_null(fs, "sport");
 		fs_add_null(fs, "dport");
 
-		fs_populate_icmp_from_iphdr(ip_hdr, len, fs);
+		fs_populate_icmp_from_parsed(pp, fs);
 		fs_add_null(fs, "data");
 	} else {
 		fs_add_constchar(fs, "classification", "other");
@@ -263,6 +295,7 @@ probe_module_t module_upnp = {
     .global_initialize = &upnp_global_initialize,
     .prepare_packet = &upnp_prepare_packet,
     .make_packet = &udp_make_packet,
+    .make_packets = &udp_make_packets,
     .print_packet = &udp_print_packet,
     .process_packet = &upnp_process_packet,
     .validate_packet = &upnp_validate_packet,
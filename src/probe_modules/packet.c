@@ -11,9 +11,18 @@
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <pthread.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "../../lib/cpu.h"
 #include "../../lib/includes.h"
 #include "../../lib/xalloc.h"
+#include "../fieldset.h"
 #include "packet.h"
 
 #include "module_tcp_synscan.h"
@@ -32,6 +41,151 @@ void print_macaddr(struct ifreq *i)
 }
 #endif /* NDEBUG */
 
+// Reduce a 64-bit one's complement accumulator to at most 0x10000, so that
+// callers can keep adding to the result. 2^16 and 2^32 are both 1 modulo
+// 0xFFFF, so halves can simply be added.
+static inline uint32_t checksum_reduce64(uint64_t sum)
+{
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	sum = (sum >> 32) + (sum & 0xFFFFFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	sum = (sum >> 16) + (sum & 0xFFFF);
+	return (uint32_t)sum;
+}
+
+// Summing 32-bit words is equivalent to summing their 16-bit halves
+// because 2^16 is 1 modulo 0xFFFF.
+static uint32_t checksum_partial_generic(const void *buf, size_t len,
+					 uint32_t sum)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint64_t acc = sum;
+	for (; len >= sizeof(uint32_t); len -= sizeof(uint32_t)) {
+		uint32_t w;
+		memcpy(&w, p, sizeof(w));
+		acc += w;
+		p += sizeof(w);
+	}
+	return csum_partial(p, len, checksum_reduce64(acc));
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) static uint32_t
+checksum_partial_avx2(const void *buf, size_t len, uint32_t sum)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i acc0 = zero;
+	__m256i acc1 = zero;
+	// widen each 32-bit word into a 64-bit lane so nothing can overflow
+	for (; len >= 64; len -= 64, p += 64) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v0, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v0, zero));
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v1, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v1, zero));
+	}
+	for (; len >= 32; len -= 32, p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+		acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+	}
+	uint64_t lanes[4];
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(acc0, acc1));
+	uint64_t acc = (uint64_t)sum + lanes[0] + lanes[1] + lanes[2] + lanes[3];
+	// p is still an even offset into buf, so the tail keeps word parity
+	return checksum_partial_generic(p, len, checksum_reduce64(acc));
+}
+
+__attribute__((target("avx512f,avx512bw"))) static uint32_t
+checksum_partial_avx512(const void *buf, size_t len, uint32_t sum)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	const __m512i zero = _mm512_setzero_si512();
+	__m512i acc0 = zero;
+	__m512i acc1 = zero;
+	// as checksum_partial_avx2(), twice as wide
+	for (; len >= 128; len -= 128, p += 128) {
+		__m512i v0 = _mm512_loadu_si512((const void *)p);
+		__m512i v1 = _mm512_loadu_si512((const void *)(p + 64));
+		acc0 = _mm512_add_epi64(acc0, _mm512_unpacklo_epi32(v0, zero));
+		acc1 = _mm512_add_epi64(acc1, _mm512_unpackhi_epi32(v0, zero));
+		acc0 = _mm512_add_epi64(acc0, _mm512_unpacklo_epi32(v1, zero));
+		acc1 = _mm512_add_epi64(acc1, _mm512_unpackhi_epi32(v1, zero));
+	}
+	for (; len >= 64; len -= 64, p += 64) {
+		__m512i v = _mm512_loadu_si512((const void *)p);
+		acc0 = _mm512_add_epi64(acc0, _mm512_unpacklo_epi32(v, zero));
+		acc1 = _mm512_add_epi64(acc1, _mm512_unpackhi_epi32(v, zero));
+	}
+	uint64_t acc = (uint64_t)sum +
+		       (uint64_t)_mm512_reduce_add_epi64(_mm512_add_epi64(acc0, acc1));
+	// below 64 bytes, the AVX2 loop takes what is left
+	return checksum_partial_avx2(p, len, checksum_reduce64(acc));
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static uint32_t checksum_partial_neon(const void *buf, size_t len,
+				      uint32_t sum)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	uint64_t acc = sum;
+	while (len >= 16) {
+		// each 32-bit lane gains at most 2 * 0xFFFF per block, so
+		// drain them into acc well before they could overflow
+		size_t blocks = len / 16 > 16384 ? 16384 : len / 16;
+		uint32x4_t lanes = vdupq_n_u32(0);
+		for (size_t i = 0; i < blocks; i++, p += 16) {
+			lanes = vpadalq_u16(lanes, vreinterpretq_u16_u8(vld1q_u8(p)));
+		}
+		acc += vaddlvq_u32(lanes);
+		len -= blocks * 16;
+	}
+	return checksum_partial_generic(p, len, checksum_reduce64(acc));
+}
+#endif
+
+typedef uint32_t (*checksum_partial_fn)(const void *, size_t, uint32_t);
+
+static checksum_partial_fn checksum_partial_impl = checksum_partial_generic;
+static const char *checksum_impl_name = "generic";
+static pthread_once_t checksum_inited = PTHREAD_ONCE_INIT;
+
+static void checksum_init_once(void)
+{
+	uint32_t features = cpu_features();
+#if defined(__x86_64__)
+	if (features & CPU_AVX512) {
+		checksum_partial_impl = checksum_partial_avx512;
+		checksum_impl_name = "avx512";
+	} else if (features & CPU_AVX2) {
+		checksum_partial_impl = checksum_partial_avx2;
+		checksum_impl_name = "avx2";
+	}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+	if (features & CPU_NEON) {
+		checksum_partial_impl = checksum_partial_neon;
+		checksum_impl_name = "neon";
+	}
+#else
+	(void)features;
+#endif
+	log_debug("packet", "checksums with the %s implementation",
+		  checksum_impl_name);
+}
+
+uint32_t checksum_partial(const void *buf, size_t len, uint32_t sum)
+{
+	pthread_once(&checksum_inited, checksum_init_once);
+	return checksum_partial_impl(buf, len, sum);
+}
+
+const char *checksum_impl(void)
+{
+	pthread_once(&checksum_inited, checksum_init_once);
+	return checksum_impl_name;
+}
+
 #define IP_ADDR_LEN_STR 20
 
 void fprintf_ip_header(FILE *fp, struct ip *iph)
@@ -365,6 +519,86 @@ int icmp_helper_validate(const struct ip *ip_hdr, uint32_t len,
 	return PACKET_VALID;
 }
 
+void parse_packet(const void *l3, uint32_t len, int ipv6,
+		  parsed_packet_t *pp)
+{
+	memset(pp, 0, sizeof(*pp));
+	pp->len = len;
+	if (ipv6) {
+		const struct ip6_hdr *ip6 = l3;
+		pp->ip6 = ip6;
+		pp->proto = ip6->ip6_nxt;
+		if (ntohs(ip6->ip6_plen) > len) {
+			// buffer not large enough to contain the IPv6 payload
+			return;
+		}
+		pp->l4_off = sizeof(struct ip6_hdr);
+	} else {
+		const struct ip *ip = l3;
+		pp->ip = ip;
+		pp->proto = ip->ip_p;
+		pp->l4_off = 4 * ip->ip_hl;
+	}
+	if (pp->l4_off > len) {
+		return;
+	}
+	pp->l4_len = len - pp->l4_off;
+	const char *l4 = (const char *)l3 + pp->l4_off;
+	switch (pp->proto) {
+	case IPPROTO_TCP:
+		if (pp->l4_len >= sizeof(struct tcphdr)) {
+			pp->tcp = (const struct tcphdr *)l4;
+			pp->sport = ntohs(pp->tcp->th_sport);
+			pp->dport = ntohs(pp->tcp->th_dport);
+		}
+		break;
+	case IPPROTO_UDP:
+		if (pp->l4_len >= sizeof(struct udphdr)) {
+			pp->udp = (const struct udphdr *)l4;
+			pp->sport = ntohs(pp->udp->uh_sport);
+			pp->dport = ntohs(pp->udp->uh_dport);
+		}
+		break;
+	case IPPROTO_ICMP:
+		if (ipv6 || pp->l4_len < sizeof(struct icmp)) {
+			break;
+		}
+		pp->icmp = (const struct icmp *)l4;
+		// see icmp_helper_validate() for which messages quote our probe
+		if (!(pp->icmp->icmp_type == ICMP_UNREACH ||
+		      pp->icmp->icmp_type == ICMP_SOURCEQUENCH ||
+		      pp->icmp->icmp_type == ICMP_REDIRECT ||
+		      pp->icmp->icmp_type == ICMP_TIMXCEED) ||
+		    pp->l4_len < ICMP_HEADER_SIZE + sizeof(struct ip)) {
+			break;
+		}
+		pp->inner_ip = (const struct ip *)(l4 + ICMP_HEADER_SIZE);
+		pp->inner_len = pp->l4_len - ICMP_HEADER_SIZE;
+		if (4 * pp->inner_ip->ip_hl <= pp->inner_len) {
+			pp->inner_l4 =
+			    (const char *)pp->inner_ip + 4 * pp->inner_ip->ip_hl;
+			pp->inner_l4_len =
+			    pp->inner_len - 4 * pp->inner_ip->ip_hl;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+int icmp_helper_validate_parsed(const parsed_packet_t *pp, size_t min_l4_len)
+{
+	if (!pp->inner_l4 || pp->inner_l4_len < min_l4_len) {
+		return PACKET_INVALID;
+	}
+	// find original destination IP and check that we sent a packet
+	// to that IP address
+	if (!blocklist_is_allowed(pp->inner_ip->ip_dst.s_addr)) {
+		return PACKET_INVALID;
+	}
+	return PACKET_VALID;
+}
+
 void fs_add_null_icmp(fieldset_t *fs)
 {
 	fs_add_null(fs, "icmp_responder");
@@ -385,15 +619,21 @@ void fs_populate_icmp_from_iphdr(struct ip *ip, size_t len, fieldset_t *fs)
 {
 	assert(ip && "no ip header provide to fs_populate_icmp_from_iphdr");
 	assert(fs && "no fieldset provided to fs_populate_icmp_from_iphdr");
-	struct icmp *icmp = get_icmp_header(ip, len);
-	assert(icmp);
+	parsed_packet_t pp;
+	parse_packet(ip, len, 0, &pp);
+	fs_populate_icmp_from_parsed(&pp, fs);
+}
+
+void fs_populate_icmp_from_parsed(const parsed_packet_t *pp, fieldset_t *fs)
+{
+	assert(pp->inner_ip &&
+	       "no quoted probe provided to fs_populate_icmp_from_parsed");
+	const struct icmp *icmp = pp->icmp;
 	// ICMP unreach comes from another server (not the one we sent a
 	// probe to); But we will fix up saddr to be who we sent the
 	// probe to, in case you care.
-	struct ip *ip_inner = get_inner_ip_header(icmp, len);
-	fs_modify_string(fs, "saddr", make_ip_str(ip_inner->ip_dst.s_addr), 1);
-	// Add other ICMP fields from within the header
-	fs_add_string(fs, "icmp_responder", make_ip_str(ip->ip_src.s_addr), 1);
+	fs_modify_ipv4(fs, "saddr", pp->inner_ip->ip_dst.s_addr);
+	fs_add_ipv4(fs, "icmp_responder", pp->ip->ip_src.s_addr);
 	fs_add_uint64(fs, "icmp_type", icmp->icmp_type);
 	fs_add_uint64(fs, "icmp_code", icmp->icmp_code);
 	if (icmp->icmp_code <= ICMP_UNREACH_PRECEDENCE_CUTOFF) {
@@ -404,34 +644,14 @@ void fs_populate_icmp_from_iphdr(struct ip *ip, size_t len, fieldset_t *fs)
 	}
 }
 
-// Note: caller must free return value
+// Note: return value comes from the current fieldset arena and must be
+// handed to a fieldset with free_ set (or freed before the arena is reset)
 char *make_ip_str(uint32_t ip)
 {
 	struct in_addr t;
 	t.s_addr = ip;
-	const char *temp = inet_ntoa(t);
-	char *retv = xmalloc(strlen(temp) + 1);
-	strcpy(retv, temp);
-	return retv;
-}
-
-// Note: caller must free return value
-// added by pqm
-char *make_ip_strinqname(uint32_t ip)
-{
-	struct in_addr t;
-	t.s_addr = ip;
-	const char *temp = inet_ntoa(t);
-	char *retv = xmalloc(16 + 1);
-	char *p;
-	int count = 0;
-	while(p = strsep(&temp, "."))
-	{
-		memset(retv + count*4, 0x03,1);
-		int tmpint = atoi(p);
-		sprintf(retv + count*4 + 1, "%03d", tmpint);
-		count += 1;
-	}
+	char *retv = fs_arena_alloc(INET_ADDRSTRLEN);
+	inet_ntop(AF_INET, &t, retv, INET_ADDRSTRLEN);
 	return retv;
 }
 
@@ -14,11 +14,14 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
 #include "../../lib/includes.h"
 #include "../../lib/blocklist.h"
 #include "../../lib/pbm.h"
 #include "../state.h"
 #include "../send.h"
+#include "probe_modules.h"
 
 #ifndef PACKET_H
 #define PACKET_H
@@ -46,7 +49,7 @@
 
 #define ICMP_FIELDSET_FIELDS                                                                             \
 	{.name = "icmp_responder",                                                                       \
-	 .type = "string",                                                                               \
+	 .type = "ip",                                                                                   \
 	 .desc = "Source IP of ICMP_UNREACH messages"},                                                  \
 	    {.name = "icmp_type", .type = "int", .desc = "icmp message type"},                           \
 	    {.name = "icmp_code",                                                                        \
@@ -77,6 +80,14 @@ void fprintf_ip_header(FILE *fp, struct ip *iph);
 void fprintf_ipv6_header(FILE *fp, struct ip6_hdr *iph);
 void fprintf_eth_header(FILE *fp, struct ether_header *ethh);
 
+// Partial one's complement sum of len bytes starting at buf, added to sum.
+// Uses AVX-512, AVX2 or NEON where the CPU has it, and is the one to use for
+// payloads; the result is below 2^18 and combines with the csum_* helpers
+// below.
+uint32_t checksum_partial(const void *buf, size_t len, uint32_t sum);
+// the variant checksum_partial() picked for this CPU, for the metadata
+const char *checksum_impl(void);
+
 static inline unsigned short in_checksum(unsigned short *ip_pkt, int len)
 {
 	unsigned long sum = 0;
@@ -87,20 +98,16 @@ static inline unsigned short in_checksum(unsigned short *ip_pkt, int len)
 		sum += *((unsigned char *)ip_pkt);
 	}
 	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
 	return (unsigned short)(~sum);
 }
 
+// forward declaration, defined with the other csum helpers below
+static inline uint16_t csum_fold(uint32_t sum);
+
 static inline unsigned short in_icmp_checksum(unsigned short *ip_pkt, int len)
 {
-	unsigned long sum = 0;
-	for (int nwords = len / 2; nwords > 0; nwords--) {
-		sum += *ip_pkt++;
-	}
-	if (len % 2 == 1) {
-		sum += *((unsigned char *)ip_pkt);
-	}
-	sum = (sum >> 16) + (sum & 0xffff);
-	return (unsigned short)(~sum);
+	return csum_fold(checksum_partial(ip_pkt, (size_t)len, 0));
 }
 
 static inline unsigned short zmap_ip_checksum(unsigned short *buf)
@@ -120,72 +127,176 @@ static inline uint16_t ipv6_payload_checksum(
 	unsigned short *w,
 	unsigned char proto)
 {
-	unsigned long sum = 0;
-	uint16_t *src_addr = (uint16_t *) saddr;
-	uint16_t *dest_addr = (uint16_t *) daddr;
+	uint32_t sum = checksum_partial(w, len, 0);
 
 	// Pseudo header for IPv6+UDP
-	for (int i = 0; i < 8; i++) {
-		sum += src_addr[i];
-	}
-	for (int i = 0; i < 8; i++) {
-		sum += dest_addr[i];
-	}
+	sum = checksum_partial(saddr, sizeof(struct in6_addr), sum);
+	sum = checksum_partial(daddr, sizeof(struct in6_addr), sum);
 	sum += htons(len);
 	sum += htons(proto);
 
-	// Add checksum of header and data
-	while (len > 1) {
+	return csum_fold(sum);
+}
+
+static inline uint16_t tcp_checksum(unsigned short len_tcp, uint32_t saddr,
+				    uint32_t daddr, struct tcphdr *tcp_pkt)
+{
+	// calculate the checksum for the tcp header and tcp data
+	uint32_t sum = checksum_partial(tcp_pkt, len_tcp, 0);
+	// add the pseudo header
+	sum += (saddr >> 16) + (saddr & 0xFFFF);
+	sum += (daddr >> 16) + (daddr & 0xFFFF);
+	sum += htons(len_tcp);
+	sum += htons(IPPROTO_TCP);
+	return csum_fold(sum);
+}
+
+/*
+ * One's complement sums for building checksums out of a part that stays the
+ * same for every probe, computed once in prepare_packet, and the handful of
+ * fields make_packet fills in per probe (RFC 1071, RFC 1624). Partial sums
+ * are unfolded 32-bit accumulators of 16-bit words in network byte order.
+ */
+static inline uint32_t csum_partial(const void *buf, size_t len, uint32_t sum)
+{
+	const alias_unsigned_short *w = (const alias_unsigned_short *)buf;
+	for (; len > 1; len -= 2) {
 		sum += *w++;
-		len -= 2;
 	}
-
-	// If 1 byte is left, we add a padding byte (0xFF) to build a 16bit word
-	if (len > 0) {
-		sum += *w & ntohs(0xFF00);
+	if (len) {
+		// pad the trailing byte with a zero byte
+		uint16_t last = 0;
+		memcpy(&last, w, 1);
+		sum += last;
 	}
+	return sum;
+}
 
-	// Account for carries
-	sum = (sum >> 16) + (sum & 0xFFFF);
-	sum += (sum >> 16);
+static inline uint32_t csum_add16(uint32_t sum, uint16_t v)
+{
+	return sum + v;
+}
 
-	// Take the one's complement of sum
-	return (unsigned short) (~sum);
+static inline uint32_t csum_sub16(uint32_t sum, uint16_t v)
+{
+	return sum + (uint16_t)~v;
 }
 
-static inline uint16_t tcp_checksum(unsigned short len_tcp, uint32_t saddr,
-				    uint32_t daddr, struct tcphdr *tcp_pkt)
+static inline uint32_t csum_add32(uint32_t sum, uint32_t v)
 {
-	alias_unsigned_short *src_addr = (alias_unsigned_short *)&saddr;
-	alias_unsigned_short *dest_addr = (alias_unsigned_short *)&daddr;
+	return sum + (v >> 16) + (v & 0xFFFF);
+}
 
-	unsigned char prot_tcp = 6;
-	unsigned long sum = 0;
-	int nleft = len_tcp;
-	unsigned short *w;
+static inline uint32_t csum_sub32(uint32_t sum, uint32_t v)
+{
+	return csum_sub16(csum_sub16(sum, (uint16_t)(v >> 16)), (uint16_t)v);
+}
 
-	w = (unsigned short *)tcp_pkt;
-	// calculate the checksum for the tcp header and tcp data
-	while (nleft > 1) {
-		sum += *w++;
-		nleft -= 2;
-	}
-	// if nleft is 1 there is still one byte left.
-	// We add a padding byte (0xFF) to build a 16bit word
-	if (nleft > 0) {
-		sum += *w & ntohs(0xFF00);
-	}
-	// add the pseudo header
-	sum += src_addr[0];
-	sum += src_addr[1];
-	sum += dest_addr[0];
-	sum += dest_addr[1];
-	sum += htons(len_tcp);
-	sum += htons(prot_tcp);
+static inline uint32_t csum_add_in6(uint32_t sum, const struct in6_addr *addr)
+{
+	return csum_partial(addr, sizeof(struct in6_addr), sum);
+}
+
+// Fold a partial sum into the final (complemented) checksum
+static inline uint16_t csum_fold(uint32_t sum)
+{
 	sum = (sum >> 16) + (sum & 0xFFFF);
 	sum += (sum >> 16);
-	// Take the one's complement of sum
-	return (unsigned short)(~sum);
+	return (uint16_t)~sum;
+}
+
+// RFC 1624 eqn. 3: patch check after a 16-bit word changed from old to new
+static inline uint16_t csum_replace16(uint16_t check, uint16_t old_val,
+				      uint16_t new_val)
+{
+	return csum_fold(csum_add16(csum_sub16((uint16_t)~check, old_val), new_val));
+}
+
+static inline uint16_t csum_replace32(uint16_t check, uint32_t old_val,
+				      uint32_t new_val)
+{
+	return csum_fold(csum_add32(csum_sub32((uint16_t)~check, old_val), new_val));
+}
+
+// The *_csum_base() helpers sum what every probe of a send thread has in
+// common. prepare_packet keeps that sum in a __thread variable, and
+// make_packet adds only the fields it fills in for each probe.
+
+// IPv4 header words that make_packet never changes: version, IHL and TOS,
+// fragment offset and protocol.
+static inline uint32_t ip_header_csum_base(const struct ip *iph)
+{
+	const alias_unsigned_short *w = (const alias_unsigned_short *)iph;
+	return (uint32_t)w[0] + w[3] + htons(iph->ip_p);
+}
+
+// IPv4 header checksum from ip_header_csum_base() and the per-probe fields
+static inline uint16_t ip_header_csum(uint32_t base, const struct ip *iph)
+{
+	uint32_t sum = base + iph->ip_len + iph->ip_id +
+		       htons((uint16_t)(iph->ip_ttl << 8));
+	sum = csum_add32(sum, iph->ip_src.s_addr);
+	sum = csum_add32(sum, iph->ip_dst.s_addr);
+	return csum_fold(sum);
+}
+
+// Address part of the IPv4 and IPv6 pseudo-headers
+static inline uint32_t ip_pseudo_csum(uint32_t saddr, uint32_t daddr)
+{
+	return csum_add32(csum_add32(0, saddr), daddr);
+}
+
+static inline uint32_t ip6_pseudo_csum(const struct in6_addr *saddr,
+				       const struct in6_addr *daddr)
+{
+	return csum_add_in6(csum_add_in6(0, saddr), daddr);
+}
+
+// Sum of a TCP segment of len bytes and the length and protocol of its
+// pseudo-header, leaving out the ports, sequence number and checksum that
+// make_packet fills in per probe.
+static inline uint32_t tcp_csum_base(const struct tcphdr *tcp, uint16_t len)
+{
+	uint32_t sum = checksum_partial(tcp, len, 0);
+	sum = csum_sub16(sum, tcp->th_sport);
+	sum = csum_sub16(sum, tcp->th_dport);
+	sum = csum_sub32(sum, tcp->th_seq);
+	sum = csum_sub16(sum, tcp->th_sum);
+	return sum + htons(len) + htons(IPPROTO_TCP);
+}
+
+static inline uint16_t tcp_csum(uint32_t base, const struct tcphdr *tcp,
+				uint32_t pseudo)
+{
+	uint32_t sum = base + pseudo + tcp->th_sport + tcp->th_dport;
+	return csum_fold(csum_add32(sum, tcp->th_seq));
+}
+
+// As tcp_csum_base() for a UDP datagram: ports and checksum are left out
+static inline uint32_t udp_csum_base(const struct udphdr *udp, uint16_t len)
+{
+	uint32_t sum = checksum_partial(udp, len, 0);
+	sum = csum_sub16(sum, udp->uh_sport);
+	sum = csum_sub16(sum, udp->uh_dport);
+	sum = csum_sub16(sum, udp->uh_sum);
+	return sum + htons(len) + htons(IPPROTO_UDP);
+}
+
+static inline uint16_t udp_csum(uint32_t base, const struct udphdr *udp,
+				uint32_t pseudo)
+{
+	uint16_t check = csum_fold(base + pseudo + udp->uh_sport + udp->uh_dport);
+	// zero means no checksum, so a computed zero goes out as all ones
+	return check ? check : 0xFFFF;
+}
+
+// With --checksum-offload, the NIC completes the L4 checksum from the start
+// of the L4 header and needs the sum of the pseudo-header in its place,
+// uncomplemented. pseudo is from ip_pseudo_csum() or ip6_pseudo_csum().
+static inline uint16_t l4_csum_partial(uint32_t pseudo, uint16_t len,
+				       uint8_t proto)
+{
+	return (uint16_t)~csum_fold(pseudo + htons(len) + htons(proto));
 }
 
 // Returns 0 if dst_port is outside the expected valid range, non-zero otherwise
@@ -197,7 +308,13 @@ static inline int check_dst_port(uint16_t port, int num_ports,
 	}
 	int32_t to_validate = port - zconf.source_port_first;
 	int32_t min = validation[1] % num_ports;
-	int32_t max = (validation[1] + zconf.packet_streams - 1) % num_ports;
+	// with --rss-queues each stream may have moved on by up to
+	// candidates - 1 times the number of streams
+	int32_t span = zconf.packet_streams * zconf.rss.candidates;
+	if (span >= num_ports) {
+		return 1;
+	}
+	int32_t max = (validation[1] + span - 1) % num_ports;
 
 	if (min <= max) {
 		return (to_validate <= max && to_validate >= min);
@@ -207,7 +324,7 @@ static inline int check_dst_port(uint16_t port, int num_ports,
 }
 
 static inline uint16_t get_src_port(int num_ports, int probe_num,
-				    uint32_t *validation)
+				    const uint32_t *validation)
 {
 	return zconf.source_port_first +
 	       ((validation[1] + probe_num) % num_ports);
@@ -294,7 +411,6 @@ static inline struct ip *get_inner_ip_header(const struct icmp *icmp,
 
 // Note: caller must free return value
 char *make_ip_str(uint32_t ip);
-char *make_ip_strinqname(uint32_t ip);
 char *make_ipv6_str(struct in6_addr *ipv6);
 
 extern const char *icmp_unreach_strings[];
@@ -303,8 +419,18 @@ int icmp_helper_validate(const struct ip *ip_hdr, uint32_t len,
 			 size_t min_l4_len, struct ip **probe_pkt,
 			 size_t *probe_len);
 
+// Locate the L3/L4 headers (and the probe quoted by ICMP errors) of the
+// len bytes at l3, which is a struct ip or, with ipv6 set, a struct ip6_hdr
+void parse_packet(const void *l3, uint32_t len, int ipv6,
+		  parsed_packet_t *pp);
+
+// icmp_helper_validate() for an already parsed packet; the quoted probe is
+// at pp->inner_ip and its L4 header at pp->inner_l4
+int icmp_helper_validate_parsed(const parsed_packet_t *pp, size_t min_l4_len);
+
 void fs_add_null_icmp(fieldset_t *fs);
 
 void fs_populate_icmp_from_iphdr(struct ip *ip, size_t len, fieldset_t *fs);
+void fs_populate_icmp_from_parsed(const parsed_packet_t *pp, fieldset_t *fs);
 
 #endif
@@ -23,6 +23,7 @@ extern probe_module_t module_tcp_synscan;
 extern probe_module_t module_tcp_synackscan;
 extern probe_module_t module_icmp_echo;
 extern probe_module_t module_icmp_echo_time;
+extern probe_module_t module_icmp_trace;
 extern probe_module_t module_udp;
 extern probe_module_t module_ntp;
 extern probe_module_t module_upnp;
@@ -46,6 +47,7 @@ probe_module_t *probe_modules[] = {
 	&module_tcp_synackscan,
 	&module_icmp_echo,
 	&module_icmp_echo_time,
+	&module_icmp_trace,
 	&module_udp,
 	&module_ntp,
 	&module_upnp,
@@ -89,9 +91,9 @@ void fs_add_ip_fields(fieldset_t *fs, struct ip *ip)
 	// WARNING: you must update fs_ip_fields_len  as well
 	// as the definitions set (ip_fiels) if you
 	// change the fields added below:
-	fs_add_string(fs, "saddr", make_ip_str(ip->ip_src.s_addr), 1);
+	fs_add_ipv4(fs, "saddr", ip->ip_src.s_addr);
 	fs_add_uint64(fs, "saddr_raw", (uint64_t)ip->ip_src.s_addr);
-	fs_add_string(fs, "daddr", make_ip_str(ip->ip_dst.s_addr), 1);
+	fs_add_ipv4(fs, "daddr", ip->ip_dst.s_addr);
 	fs_add_uint64(fs, "daddr_raw", (uint64_t)ip->ip_dst.s_addr);
 	fs_add_uint64(fs, "ipid", ntohs(ip->ip_id));
 	fs_add_uint64(fs, "ttl", ip->ip_ttl);
@@ -102,11 +104,11 @@ void fs_add_ipv6_fields(fieldset_t *fs, struct ip6_hdr *ipv6_hdr)
 	// WARNING: you must update fs_ip_fields_len  as well
 	// as the definitions set (ip_fiels) if you
 	// change the fields added below:
-	fs_add_string(fs, "saddr", make_ipv6_str(&(ipv6_hdr->ip6_src)), 1);
+	fs_add_ipv6(fs, "saddr", &(ipv6_hdr->ip6_src));
 // TODO FIXME
 //	fs_add_uint64(fs, "saddr-raw", (uint64_t) ip->ip_src.s_addr);
 	fs_add_uint64(fs, "saddr_raw", (uint64_t) 0);
-	fs_add_string(fs, "daddr", make_ipv6_str(&(ipv6_hdr->ip6_dst)), 1);
+	fs_add_ipv6(fs, "daddr", &(ipv6_hdr->ip6_dst));
 //	fs_add_uint64(fs, "daddr_raw", (uint64_t) ip->ip_dst.s_addr);
 	fs_add_uint64(fs, "daddr_raw", (uint64_t) 0);
 //	fs_add_uint64(fs, "ipid", ntohs(ipv6->ip_id));
@@ -116,18 +118,59 @@ void fs_add_ipv6_fields(fieldset_t *fs, struct ip6_hdr *ipv6_hdr)
 
 #define TIMESTR_LEN 55
 
-void fs_add_system_fields(fieldset_t *fs, int is_repeat, int in_cooldown, const struct timespec ts)
+// The local time of the last second a thread formatted, split around
+// where the milliseconds go, so that localtime_r() and strftime() run
+// once a second rather than once per result
+struct timestr_cache {
+	time_t sec;
+	size_t date_len;
+	size_t zone_len;
+	char date[TIMESTR_LEN];
+	char zone[16];
+};
+static __thread struct timestr_cache timestr_cache = {.sec = -1};
+
+static char *make_timestr(const struct timespec ts)
+{
+	struct timestr_cache *c = &timestr_cache;
+	if (c->sec != ts.tv_sec) {
+		struct tm tm;
+		localtime_r(&ts.tv_sec, &tm);
+		c->date_len =
+		    strftime(c->date, sizeof(c->date), "%Y-%m-%dT%H:%M:%S", &tm);
+		c->zone_len = strftime(c->zone, sizeof(c->zone), "%z", &tm);
+		c->sec = ts.tv_sec;
+	}
+	unsigned ms = (unsigned)(ts.tv_nsec / 1000000) % 1000;
+	char *timestr = fs_arena_alloc(c->date_len + 4 + c->zone_len + 1);
+	char *p = timestr;
+	memcpy(p, c->date, c->date_len);
+	p += c->date_len;
+	*p++ = '.';
+	*p++ = (char)('0' + ms / 100);
+	*p++ = (char)('0' + ms / 10 % 10);
+	*p++ = (char)('0' + ms % 10);
+	memcpy(p, c->zone, c->zone_len);
+	p[c->zone_len] = '\0';
+	return timestr;
+}
+
+void fs_add_system_fields(fieldset_t *fs, int is_repeat, int in_cooldown,
+			  const char *stratum, const struct timespec ts)
 {
 	fs_add_bool(fs, "repeat", is_repeat);
 	fs_add_bool(fs, "cooldown", in_cooldown);
+	if (stratum) {
+		fs_add_constchar(fs, "stratum", stratum);
+	} else {
+		fs_add_null(fs, "stratum");
+	}
 
-	char *timestr = xmalloc(TIMESTR_LEN + 1);
-	char *timestr_ms = xmalloc(TIMESTR_LEN + 1);
-	struct tm *ptm = localtime(&ts.tv_sec);
-	strftime(timestr, TIMESTR_LEN, "%Y-%m-%dT%H:%M:%S.%%03d%z", ptm);
-	snprintf(timestr_ms, TIMESTR_LEN, timestr, ts.tv_nsec / 1000000);
-	free(timestr);
-	fs_add_string(fs, "timestamp_str", timestr_ms, 1);
+	if (fs_next_needed(fs)) {
+		fs_add_string(fs, "timestamp_str", make_timestr(ts), 1);
+	} else {
+		fs_add_null(fs, "timestamp_str");
+	}
 	fs_add_uint64(fs, "timestamp_ts", (uint64_t)ts.tv_sec);
 	fs_add_uint64(fs, "timestamp_us", (uint64_t)(ts.tv_nsec/1000));
 }
@@ -135,13 +178,13 @@ void fs_add_system_fields(fieldset_t *fs, int is_repeat, int in_cooldown, const
 int ip_fields_len = 6;
 fielddef_t ip_fields[] = {
     {.name = "saddr",
-     .type = "string",
+     .type = "ip",
      .desc = "source IP address of response"},
     {.name = "saddr_raw",
      .type = "int",
      .desc = "network order integer form of source IP address"},
     {.name = "daddr",
-     .type = "string",
+     .type = "ip",
      .desc = "destination IP address of response"},
     {.name = "daddr_raw",
      .type = "int",
@@ -151,7 +194,7 @@ fielddef_t ip_fields[] = {
      .desc = "IP identification number of response"},
     {.name = "ttl", .type = "int", .desc = "time-to-live of response packet"}};
 
-int sys_fields_len = 5;
+int sys_fields_len = 6;
 fielddef_t sys_fields[] = {
     {.name = "repeat",
      .type = "bool",
@@ -159,6 +202,10 @@ fielddef_t sys_fields[] = {
     {.name = "cooldown",
      .type = "bool",
      .desc = "Was response received during the cooldown period"},
+    {.name = "stratum",
+     .type = "string",
+     .desc = "--delta-from stratum of the target, \"prior\" for the hosts "
+	     "of the earlier scan and \"rest\" for the others"},
     {.name = "timestamp_str",
      .type = "string",
      .desc = "timestamp of when response arrived in ISO8601 format."},
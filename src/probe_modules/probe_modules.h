@@ -16,6 +16,7 @@
 
 #include "../state.h"
 #include "../fieldset.h"
+#include "../validate.h"
 #include <netinet/ip6.h>
 
 #ifndef PROBE_MODULES_H
@@ -36,7 +37,10 @@ typedef struct probe_response_type {
 
 typedef int (*probe_global_init_cb)(struct state_conf *);
 
-// Called once per send thread to initialize state.
+// Called once per send thread to initialize state, and as
+// recv_thread_initialize once per receive thread, before its first
+// response, for what validate_packet and process_packet keep between
+// packets. Either passes *arg_ptr back as arg on that thread.
 typedef int (*probe_thread_init_cb)(void **arg_ptr);
 
 // The make_packet callback is passed a buffer pointing at an ethernet header.
@@ -61,7 +65,8 @@ typedef int (*probe_prepare_packet_cb)(void *packetbuf, macaddr_t *src_mac,
 //
 // The probe module is responsible for populating the IP header. The src_ip,
 // dst_ip, and ttl are provided by the framework and must be set on the IP
-// header.
+// header. The addresses are v4 for IPv4 modules and v6 for IPv6 modules, and
+// are only valid for the duration of the call.
 //
 // The uin32_t validation parameter is a pointer to four 4-byte words of
 // validation data.  The data is deterministic based on the the validation
@@ -69,11 +74,32 @@ typedef int (*probe_prepare_packet_cb)(void *packetbuf, macaddr_t *src_mac,
 // get_src_port function which takes probe_num and validation as parameters.
 //
 typedef int (*probe_make_packet_cb)(void *packetbuf, size_t *buf_len,
-				    ipaddr_n_t src_ip, ipaddr_n_t dst_ip,
+				    const ipaddr_t *src_ip,
+				    const ipaddr_t *dst_ip,
 				    port_n_t dst_port, uint8_t ttl,
 				    uint32_t *validation, int probe_num,
 				    uint16_t ip_id, void *arg);
 
+// The arguments of one make_packet call, for make_packets
+typedef struct probe_spec {
+	ipaddr_t src_ip;
+	ipaddr_t dst_ip;
+	uint32_t validation[VALIDATE_BYTES / sizeof(uint32_t)];
+	port_n_t dst_port;
+	uint16_t ip_id;
+	int probe_num;
+} probe_spec_t;
+
+struct batch_packet;
+
+// Optional variant of make_packet that builds n packets at once, the i-th
+// from specs[i] into packets[i].buf, setting packets[i].len. Used instead of
+// make_packet when set, so a module can hoist what is loop invariant out of
+// the per-packet work. The same rules about buffer contents apply.
+typedef int (*probe_make_packets_cb)(struct batch_packet *packets,
+				     const probe_spec_t *specs, size_t n,
+				     uint8_t ttl, void *arg);
+
 typedef void (*probe_print_packet_cb)(FILE *, void *packetbuf);
 
 typedef int (*probe_close_cb)(struct state_conf *, struct state_send *,
@@ -81,11 +107,63 @@ typedef int (*probe_close_cb)(struct state_conf *, struct state_send *,
 
 typedef int (*probe_validate_packet_cb)(const struct ip *ip_hdr, uint32_t len,
 					uint32_t *src_ip, uint32_t *validation,
-					const struct port_conf *ports);
+					const struct port_conf *ports,
+					void *arg);
+
+
+// Headers of a received packet, located once by the receive path and handed
+// to validate_parsed and process_packet so modules don't re-derive them.
+// Offsets are from the start of the IP header and every pointer is NULL when
+// the captured bytes are too short to hold that header.
+typedef struct parsed_packet {
+	const struct ip *ip;	   // set for IPv4
+	const struct ip6_hdr *ip6; // set for IPv6
+	uint32_t len;		   // bytes from the IP header to end of capture
+	uint8_t proto;		   // ip_p or ip6_nxt
+	uint32_t l4_off;
+	uint32_t l4_len;
+	const struct tcphdr *tcp;
+	const struct udphdr *udp;
+	const struct icmp *icmp;
+	port_h_t sport;		   // host order, 0 unless TCP or UDP
+	port_h_t dport;
+	// the probe quoted by an ICMP unreach, source quench, redirect or
+	// time exceeded message
+	const struct ip *inner_ip;
+	uint32_t inner_len;
+	const void *inner_l4;
+	uint32_t inner_l4_len;
+} parsed_packet_t;
+
+// Optional variant of validate_packet that takes the parsed headers, used
+// instead of it when set.
+typedef int (*probe_validate_parsed_cb)(const parsed_packet_t *pp,
+					uint32_t *src_ip, uint32_t *validation,
+					const struct port_conf *ports,
+					void *arg);
 
-typedef void (*probe_classify_packet_cb)(const u_char *packetbuf, uint32_t len,
+// The process_packet callback is handed the parsed headers of a validated
+// response, which point into the captured bytes starting at the IP header;
+// IP-only links (--iplayer) need no Ethernet framing.
+typedef void (*probe_classify_packet_cb)(const parsed_packet_t *pp,
 					 fieldset_t *, uint32_t *validation,
-					 const struct timespec ts);
+					 const struct timespec ts, void *arg);
+
+// Optional: the success (and app_success, where the module has it) that
+// process_packet would find for a validated response, without building any
+// field, so the receive path can drop those the output filter rejects on
+// them alone. Returns 0 or 1, or -1 when it can't tell cheaply, e.g. before
+// parsing the payload, and then process_packet decides.
+typedef int (*probe_classify_cb)(const parsed_packet_t *pp,
+				 uint32_t *validation, int *app_success,
+				 void *arg);
+
+// Optional: called for each validated response before it is classified or
+// filtered, and may answer it from the receive path (any receive thread).
+// Returns 1 for a response to such an answer rather than to a probe, which
+// is deduplicated apart from those.
+typedef int (*probe_followup_cb)(const parsed_packet_t *pp,
+				 uint32_t *validation, void *arg);
 
 typedef struct probe_module {
 	const char *name;
@@ -102,13 +180,22 @@ typedef struct probe_module {
 	// source and target port numbers?
 	uint8_t port_args;
 
+	// Whether make_packet, with zconf.csum_offload set, leaves the TCP or
+	// UDP checksum to the NIC, writing l4_csum_partial() in its place.
+	uint8_t csum_offload;
+
 	probe_global_init_cb global_initialize;
 	probe_thread_init_cb thread_initialize;
 	probe_prepare_packet_cb prepare_packet;
 	probe_make_packet_cb make_packet;
+	probe_make_packets_cb make_packets;
 	probe_print_packet_cb print_packet;
+	probe_thread_init_cb recv_thread_initialize;
 	probe_validate_packet_cb validate_packet;
 	probe_classify_packet_cb process_packet;
+	probe_validate_parsed_cb validate_parsed;
+	probe_classify_cb classify;
+	probe_followup_cb followup;
 	probe_close_cb close;
 	int output_type;
 	fielddef_t *fields;
@@ -121,7 +208,9 @@ probe_module_t *get_probe_module_by_name(const char *);
 
 void fs_add_ip_fields(fieldset_t *fs, struct ip *ip);
 void fs_add_ipv6_fields(fieldset_t *fs, struct ip6_hdr *ipv6_hdr);
-void fs_add_system_fields(fieldset_t *fs, int is_repeat, int in_cooldown, const struct timespec ts);
+// stratum is the --delta-from stratum of the target, or NULL without one
+void fs_add_system_fields(fieldset_t *fs, int is_repeat, int in_cooldown,
+			  const char *stratum, const struct timespec ts);
 void print_probe_modules(void);
 
 extern int ip_fields_len;
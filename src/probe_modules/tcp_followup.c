@@ -0,0 +1,252 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "tcp_followup.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "../../lib/includes.h"
+#include "../../lib/logger.h"
+#include "../state.h"
+#include "packet.h"
+
+#define LOGGER_NAME "tcp_followup"
+
+#define TCP_FOLLOWUP_USAGE                                                     \
+	"unknown --tcp-payload (expected text:STRING or hex:01020304 or "      \
+	"file:/path)"
+
+// the SYN-ACK, each data segment and the follow-up fit in an Ethernet frame
+#define SNAPLEN 1514
+
+static uint8_t payload[TCP_FOLLOWUP_MAX_PAYLOAD];
+static size_t payload_len = 0;
+static int enabled = 0;
+static int is_ipv6 = 0;
+static int sock = -1;
+
+static uint64_t sent = 0;
+static uint64_t data_segments = 0;
+
+static void parse_payload(const char *spec)
+{
+	const char *c = strchr(spec, ':');
+	if (!c) {
+		log_fatal(LOGGER_NAME, TCP_FOLLOWUP_USAGE);
+	}
+	size_t name_len = c - spec;
+	c++;
+	size_t len = 0;
+	if (name_len == 4 && strncmp(spec, "text", name_len) == 0) {
+		len = strlen(c);
+		if (len > TCP_FOLLOWUP_MAX_PAYLOAD) {
+			log_fatal(LOGGER_NAME, "payload of %zu bytes is over "
+					       "the %d that fit in a segment",
+				  len, TCP_FOLLOWUP_MAX_PAYLOAD);
+		}
+		memcpy(payload, c, len);
+	} else if (name_len == 3 && strncmp(spec, "hex", name_len) == 0) {
+		len = strlen(c) / 2;
+		if (len > TCP_FOLLOWUP_MAX_PAYLOAD) {
+			log_fatal(LOGGER_NAME, "payload of %zu bytes is over "
+					       "the %d that fit in a segment",
+				  len, TCP_FOLLOWUP_MAX_PAYLOAD);
+		}
+		unsigned int n;
+		for (size_t i = 0; i < len; i++) {
+			if (sscanf(c + (i * 2), "%2x", &n) != 1) {
+				log_fatal(LOGGER_NAME, "non-hex character: '%c'",
+					  c[i * 2]);
+			}
+			payload[i] = (uint8_t)n;
+		}
+	} else if (name_len == 4 && strncmp(spec, "file", name_len) == 0) {
+		FILE *f = fopen(c, "rb");
+		if (!f) {
+			log_fatal(LOGGER_NAME, "could not open payload file '%s'",
+				  c);
+		}
+		len = fread(payload, 1, TCP_FOLLOWUP_MAX_PAYLOAD, f);
+		int more = fgetc(f) != EOF;
+		fclose(f);
+		if (more) {
+			log_fatal(LOGGER_NAME, "payload file '%s' is over the "
+					       "%d bytes that fit in a segment",
+				  c, TCP_FOLLOWUP_MAX_PAYLOAD);
+		}
+	} else {
+		log_fatal(LOGGER_NAME, TCP_FOLLOWUP_USAGE);
+	}
+	payload_len = len;
+}
+
+int tcp_followup_init(probe_module_t *pm, int ipv6)
+{
+	if (!zconf.tcp_payload) {
+		return EXIT_SUCCESS;
+	}
+	parse_payload(zconf.tcp_payload);
+	is_ipv6 = ipv6;
+	if (!zconf.dryrun) {
+		// IPPROTO_RAW sockets take the IP header from us, as for
+		// --iplayer
+		sock = socket(ipv6 ? AF_INET6 : AF_INET, SOCK_RAW, IPPROTO_RAW);
+		if (sock < 0) {
+			log_error(LOGGER_NAME,
+				  "couldn't create a raw socket for the "
+				  "follow-ups. Are you root? Error: %s",
+				  strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+	// every segment acknowledging anything, not just the SYN-ACKs
+	if (ipv6) {
+		pm->pcap_filter =
+		    "ip6 proto 6 && (ip6[53] & 4 != 0 || ip6[53] & 16 != 0)";
+	} else {
+		pm->pcap_filter =
+		    "(tcp && (tcp[13] & 4 != 0 || tcp[13] & 16 != 0)) || icmp";
+	}
+	if (pm->pcap_snaplen < SNAPLEN) {
+		pm->pcap_snaplen = SNAPLEN;
+	}
+	enabled = 1;
+	log_debug(LOGGER_NAME, "answering SYN-ACKs with %zu bytes of payload",
+		  payload_len);
+	return EXIT_SUCCESS;
+}
+
+int tcp_followup_enabled(void) { return enabled; }
+
+int tcp_followup_ack_valid(uint32_t ack, uint32_t isn)
+{
+	// unsigned, so that an ack before ours wraps far past the payload
+	uint32_t acked = ntohl(ack) - (ntohl(isn) + 1);
+	return acked <= payload_len;
+}
+
+const uint8_t *tcp_followup_data(const parsed_packet_t *pp, uint32_t *len)
+{
+	const struct tcphdr *tcp = pp->tcp;
+	uint32_t off = 4 * tcp->th_off;
+	// from the IP length rather than the capture, which may be padded
+	uint32_t l4_len =
+	    pp->ip6 ? ntohs(pp->ip6->ip6_ctlun.ip6_un1.ip6_un1_plen)
+		    : ntohs(pp->ip->ip_len) - pp->l4_off;
+	if (l4_len > pp->l4_len) {
+		l4_len = pp->l4_len;
+	}
+	if (off < sizeof(struct tcphdr) || off >= l4_len) {
+		*len = 0;
+		return NULL;
+	}
+	*len = l4_len - off;
+	return (const uint8_t *)tcp + off;
+}
+
+int tcp_followup_is_data(const parsed_packet_t *pp)
+{
+	if (!enabled || pp->proto != IPPROTO_TCP || !pp->tcp ||
+	    (pp->tcp->th_flags & (TH_SYN | TH_RST))) {
+		return 0;
+	}
+	uint32_t len;
+	return tcp_followup_data(pp, &len) != NULL;
+}
+
+static void send_followup(const parsed_packet_t *pp, uint32_t isn)
+{
+	const struct tcphdr *synack = pp->tcp;
+	uint8_t buf[sizeof(struct ip6_hdr) + sizeof(struct tcphdr) +
+		    TCP_FOLLOWUP_MAX_PAYLOAD];
+	size_t ip_len = is_ipv6 ? sizeof(struct ip6_hdr) : sizeof(struct ip);
+	uint16_t tcp_len = sizeof(struct tcphdr) + payload_len;
+	memset(buf, 0, ip_len);
+	struct tcphdr *tcp = (struct tcphdr *)(buf + ip_len);
+	make_tcp_header(tcp, TH_ACK | TH_PUSH);
+	tcp->th_sport = synack->th_dport;
+	tcp->th_dport = synack->th_sport;
+	tcp->th_seq = htonl(ntohl(isn) + 1);
+	tcp->th_ack = htonl(ntohl(synack->th_seq) + 1);
+	memcpy(&tcp[1], payload, payload_len);
+
+	struct sockaddr_storage to;
+	socklen_t to_len;
+	memset(&to, 0, sizeof(to));
+	if (is_ipv6) {
+		struct ip6_hdr *ip6 = (struct ip6_hdr *)buf;
+		make_ip6_header(ip6, IPPROTO_TCP, tcp_len);
+		ip6->ip6_src = pp->ip6->ip6_dst;
+		ip6->ip6_dst = pp->ip6->ip6_src;
+		tcp->th_sum = ipv6_payload_checksum(tcp_len, &ip6->ip6_src,
+						    &ip6->ip6_dst,
+						    (unsigned short *)tcp,
+						    IPPROTO_TCP);
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&to;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_addr = ip6->ip6_dst;
+		to_len = sizeof(*sin6);
+	} else {
+		struct ip *ip = (struct ip *)buf;
+		make_ip_header(ip, IPPROTO_TCP, htons(ip_len + tcp_len));
+		ip->ip_src = pp->ip->ip_dst;
+		ip->ip_dst = pp->ip->ip_src;
+		tcp->th_sum = tcp_checksum(tcp_len, ip->ip_src.s_addr,
+					   ip->ip_dst.s_addr, tcp);
+		ip->ip_sum = zmap_ip_checksum((unsigned short *)ip);
+		struct sockaddr_in *sin = (struct sockaddr_in *)&to;
+		sin->sin_family = AF_INET;
+		sin->sin_addr = ip->ip_dst;
+		to_len = sizeof(*sin);
+	}
+	// a lost follow-up is retried on the server's retransmitted SYN-ACK
+	if (sendto(sock, buf, ip_len + tcp_len, 0, (struct sockaddr *)&to,
+		   to_len) < 0) {
+		log_debug(LOGGER_NAME, "couldn't send a follow-up: %s",
+			  strerror(errno));
+		return;
+	}
+	__atomic_add_fetch(&sent, 1, __ATOMIC_RELAXED);
+}
+
+int tcp_followup_respond(const parsed_packet_t *pp, uint32_t *validation,
+			 UNUSED void *arg)
+{
+	if (!enabled || pp->proto != IPPROTO_TCP || !pp->tcp) {
+		return 0;
+	}
+	if (pp->tcp->th_flags & TH_SYN) {
+		if (!zconf.dryrun) {
+			send_followup(pp, validation[0]);
+		}
+		return 0;
+	}
+	return tcp_followup_is_data(pp);
+}
+
+size_t tcp_followup_payload_len(void) { return payload_len; }
+
+uint64_t tcp_followup_sent(void)
+{
+	return __atomic_load_n(&sent, __ATOMIC_RELAXED);
+}
+
+uint64_t tcp_followup_data_segments(void)
+{
+	return __atomic_load_n(&data_segments, __ATOMIC_RELAXED);
+}
+
+void tcp_followup_count_data(void)
+{
+	__atomic_add_fetch(&data_segments, 1, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,62 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_TCP_FOLLOWUP_H
+#define ZMAP_TCP_FOLLOWUP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "probe_modules.h"
+
+/*
+ * --tcp-payload: the TCP SYN scan modules answer each validated SYN-ACK
+ * straight from the receive path with an ACK carrying the payload, as the
+ * second half of a handshake the scanner never kept any state for. Our
+ * sequence number is the probe's (the validation word) plus one, so the
+ * server's data segments acknowledge between that and the end of the
+ * payload, and are validated on it like the SYN-ACK itself. Their data is
+ * the "banner" field of a "data" response.
+ *
+ * The follow-ups go out through a raw IP socket of their own, routed by the
+ * kernel, from any receive thread and also during the cooldown. The
+ * kernel knows nothing of the connections either and resets them on the
+ * SYN-ACK unless such resets are dropped, e.g. by a firewall rule on
+ * outgoing RSTs from the source ports.
+ */
+
+// Longest payload, to stay in one segment of a 1500-byte path
+#define TCP_FOLLOWUP_MAX_PAYLOAD 1400
+
+// From a module's global_initialize: parses zconf.tcp_payload
+// ("text:STRING", "hex:HEX" or "file:PATH") and opens the socket. The
+// module's pcap filter and snaplen are widened to let the data segments in.
+int tcp_followup_init(probe_module_t *pm, int ipv6);
+int tcp_followup_enabled(void);
+
+// Whether a non-SYN, non-RST segment acknowledges our sequence number
+// validation word isn (network order) plus at most the payload
+int tcp_followup_ack_valid(uint32_t ack, uint32_t isn);
+
+// Whether a validated response is a data segment of a follow-up
+// connection, with the data where process_packet finds it
+int tcp_followup_is_data(const parsed_packet_t *pp);
+const uint8_t *tcp_followup_data(const parsed_packet_t *pp, uint32_t *len);
+
+// The modules' followup callback: sends the ACK and payload answering a
+// validated SYN-ACK, and tells the data segments apart
+int tcp_followup_respond(const parsed_packet_t *pp, uint32_t *validation,
+			 UNUSED void *arg);
+
+// for the metadata
+size_t tcp_followup_payload_len(void);
+uint64_t tcp_followup_sent(void);
+uint64_t tcp_followup_data_segments(void);
+void tcp_followup_count_data(void);
+
+#endif /* ZMAP_TCP_FOLLOWUP_H */
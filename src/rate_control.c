@@ -0,0 +1,168 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "rate_control.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "../lib/logger.h"
+
+#include "send.h"
+#include "state.h"
+
+// more than this fraction of frames dropped or sends failed is a loss
+#define LOSS_FRACTION 0.01
+// the send threads waiting on a full send queue more than this fraction of
+// their time is a loss, as the queue drops what doesn't fit
+#define BACKOFF_FRACTION 0.05
+// a hit rate below this fraction of the one seen at lower rates is a loss,
+// given enough probes and expected responses to tell
+#define HITRATE_DROP 0.7
+#define HITRATE_MIN_SENT 1000
+#define HITRATE_MIN_EXPECTED 50
+#define HITRATE_EWMA_WEIGHT 0.2
+// responses trail their probes, so the hit rate means little at first
+#define WARMUP_SECS 5
+// updates to wait after a cut before growing again
+#define HOLD_UPDATES 3
+
+static rate_control_sample_t last;
+static int have_last = 0;
+static int slow_start = 1;
+static int hold = 0;
+static double good_hitrate = -1;
+static uint64_t decreases = 0;
+static int64_t step = 1;
+static int64_t floor_rate = 1;
+
+void rate_control_init(void)
+{
+	if (!zconf.adaptive_rate) {
+		return;
+	}
+	if (zconf.rate <= 0) {
+		log_fatal("monitor", "--adaptive-rate requires --rate or "
+				     "--bandwidth");
+	}
+	if (zconf.rate > zconf.adaptive_rate) {
+		log_fatal("monitor",
+			  "--adaptive-rate (%d pps) must not be below the "
+			  "starting rate (%d pps)",
+			  zconf.adaptive_rate, zconf.rate);
+	}
+	step = zconf.adaptive_rate / 100 > 1 ? zconf.adaptive_rate / 100 : 1;
+	floor_rate = step;
+	log_info("monitor", "adaptive rate: starting at %d pps, up to %d pps",
+		 zconf.rate, zconf.adaptive_rate);
+}
+
+static void set_rate(int64_t rate)
+{
+	if (rate < floor_rate) {
+		rate = floor_rate;
+	}
+	if (rate > zconf.adaptive_rate) {
+		rate = zconf.adaptive_rate;
+	}
+	send_set_rate((int)rate);
+}
+
+void rate_control_update(const rate_control_sample_t *s)
+{
+	if (!zconf.adaptive_rate || zsend.complete) {
+		return;
+	}
+	if (!have_last) {
+		last = *s;
+		have_last = 1;
+		return;
+	}
+	if (s->time <= last.time) {
+		return;
+	}
+	uint64_t sent = s->sent - last.sent;
+	uint64_t failures = s->send_failures - last.send_failures;
+	uint64_t frames = s->pcap_recv - last.pcap_recv;
+	uint64_t drops = s->pcap_drops - last.pcap_drops;
+	uint64_t queue_drops = s->queue_drops - last.queue_drops;
+	uint64_t successes = s->successes - last.successes;
+	double backoff = (s->send_backoff_ns - last.send_backoff_ns) / 1e9 /
+			 ((s->time - last.time) * (s->senders ? s->senders : 1));
+	last = *s;
+
+	char reason[128];
+	reason[0] = '\0';
+	if (drops > LOSS_FRACTION * (frames + drops)) {
+		snprintf(reason, sizeof(reason),
+			 "%" PRIu64 " of %" PRIu64 " frames dropped by "
+			 "the capture",
+			 drops, frames + drops);
+	} else if (queue_drops) {
+		snprintf(reason, sizeof(reason),
+			 "%" PRIu64 " responses dropped by the receive "
+			 "queues",
+			 queue_drops);
+	} else if (failures > LOSS_FRACTION * sent) {
+		snprintf(reason, sizeof(reason),
+			 "%" PRIu64 " of %" PRIu64 " sends failed", failures,
+			 sent);
+	} else if (backoff > BACKOFF_FRACTION) {
+		snprintf(reason, sizeof(reason),
+			 "send threads waited for a full send queue %.0f%% "
+			 "of the time",
+			 100 * backoff);
+	}
+	int warm = s->time - zsend.start >= WARMUP_SECS;
+	double hitrate = sent ? (double)successes / sent : 0;
+	if (!reason[0] && warm && sent >= HITRATE_MIN_SENT &&
+	    good_hitrate > 0 && good_hitrate * sent >= HITRATE_MIN_EXPECTED &&
+	    hitrate < HITRATE_DROP * good_hitrate) {
+		snprintf(reason, sizeof(reason),
+			 "hit rate fell to %.3f%% from %.3f%%", 100 * hitrate,
+			 100 * good_hitrate);
+	}
+
+	int rate = zconf.rate;
+	if (reason[0]) {
+		decreases++;
+		slow_start = 0;
+		hold = HOLD_UPDATES;
+		set_rate((int64_t)rate * 3 / 4);
+		log_info("monitor",
+			 "adaptive rate: %s, lowering the send rate from %d to "
+			 "%d pps",
+			 reason, rate, zconf.rate);
+		return;
+	}
+	// what the hit rate looks like when nothing is lost
+	if (warm && sent >= HITRATE_MIN_SENT) {
+		good_hitrate = good_hitrate < 0
+				   ? hitrate
+				   : good_hitrate + HITRATE_EWMA_WEIGHT *
+							(hitrate - good_hitrate);
+	}
+	if (hold) {
+		hold--;
+		return;
+	}
+	if (rate >= zconf.adaptive_rate) {
+		return;
+	}
+	set_rate(slow_start ? (int64_t)rate * 5 / 4 + 1 : (int64_t)rate + step);
+	if (zconf.rate == zconf.adaptive_rate) {
+		log_info("monitor", "adaptive rate: reached the maximum of %d pps",
+			 zconf.rate);
+	} else {
+		log_debug("monitor", "adaptive rate: raising the send rate from "
+				     "%d to %d pps",
+			  rate, zconf.rate);
+	}
+}
+
+uint64_t rate_control_decreases(void) { return decreases; }
@@ -0,0 +1,47 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_RATE_CONTROL_H
+#define ZMAP_RATE_CONTROL_H
+
+#include <stdint.h>
+
+/*
+ * --adaptive-rate: the monitor looks for the fastest send rate, up to the
+ * given maximum, at which no responses are lost. After each update it
+ * hands the controller its running totals. Any sign of loss in the last
+ * interval cuts the rate by a quarter and holds it for a few updates:
+ * capture drops (pcap or interface), processing or output queue drops,
+ * sends that failed, send threads that spent more than a few percent of
+ * their time waiting for a full send queue to drain, or a hit rate that
+ * fell well below what it was at lower rates. Otherwise the rate grows,
+ * by a quarter per update until the first loss and then by a small step.
+ * The senders' shared token bucket takes every new rate at once.
+ */
+
+// running totals, as the monitor exports them
+typedef struct rate_control_sample {
+	double time;
+	uint64_t sent;
+	uint64_t send_failures;
+	uint64_t pcap_recv;
+	uint64_t pcap_drops;
+	uint64_t queue_drops;
+	uint64_t successes;
+	// the send threads' waits for a full send queue, and their number
+	uint64_t send_backoff_ns;
+	uint16_t senders;
+} rate_control_sample_t;
+
+// from monitor_init(), once send_init() has settled the starting rate
+void rate_control_init(void);
+void rate_control_update(const rate_control_sample_t *s);
+// how often the rate was cut
+uint64_t rate_control_decreases(void);
+
+#endif /* ZMAP_RATE_CONTROL_H */
@@ -0,0 +1,117 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "recv.h"
+#include "recv-internal.h"
+#include "socket-dpdk.h"
+#include "state.h"
+
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rte_errno.h>
+#include <rte_lcore.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+
+// Each receive thread drains the RX queue of its own, which RSS spreads
+// responses across, in bursts. As with PF_RING, an empty queue is polled
+// again right away for a while, then with sleeps that double up to
+// DPDK_RECV_MAX_SLEEP_US.
+#define DPDK_RECV_SPINS 1024
+#define DPDK_RECV_MAX_SLEEP_US 1000
+
+static __thread struct rte_mbuf *rx_bufs[DPDK_RX_BURST];
+static __thread uint16_t rx_queue;
+static __thread uint32_t empty_polls;
+static __thread uint32_t sleep_us;
+static int started = 0;
+
+void recv_init(void)
+{
+	static uint32_t next_queue = 0;
+	uint32_t queue = __atomic_fetch_add(&next_queue, 1, __ATOMIC_SEQ_CST);
+	assert(queue < zconf.recv_threads);
+	if (rte_thread_register()) {
+		log_debug("recv-dpdk", "unable to register receive thread with the EAL: %s",
+			  rte_strerror(rte_errno));
+	}
+	rx_queue = (uint16_t)queue;
+	empty_polls = 0;
+	sleep_us = 0;
+	zconf.data_link_size = sizeof(struct ether_header);
+	__atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+	log_debug("recv-dpdk", "receiving on queue %u", queue);
+}
+
+void recv_cleanup(void) {}
+
+// the queue is polled busily, with no descriptor to wait on
+int recv_fd(void)
+{
+	return -1;
+}
+
+void recv_packets(void)
+{
+	uint16_t n = rte_eth_rx_burst(zconf.dpdk.port_id, rx_queue, rx_bufs,
+				      DPDK_RX_BURST);
+	if (n == 0) {
+		if (++empty_polls < DPDK_RECV_SPINS) {
+			return;
+		}
+		sleep_us = sleep_us ? sleep_us * 2 : 1;
+		if (sleep_us > DPDK_RECV_MAX_SLEEP_US) {
+			sleep_us = DPDK_RECV_MAX_SLEEP_US;
+		}
+		usleep(sleep_us);
+		return;
+	}
+	empty_polls = 0;
+	sleep_us = 0;
+	// mbufs carry no timestamp unless the PMD is asked for one, stamp
+	// the whole burst
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	pkt_ref_t batch[DPDK_RX_BURST];
+	size_t b = 0;
+	for (uint16_t i = 0; i < n; i++) {
+		struct rte_mbuf *m = rx_bufs[i];
+		// Like libpcap, a single poll can hand us several packets;
+		// throw out results once we've gotten our --max-results worth.
+		if (!recv_max_results_reached()) {
+			batch[b].bytes = rte_pktmbuf_mtod(m, const uint8_t *);
+			batch[b].len = rte_pktmbuf_data_len(m);
+			batch[b].ts = ts;
+			b++;
+		}
+	}
+	handle_packets(batch, b);
+	rte_pktmbuf_free_bulk(rx_bufs, n);
+}
+
+int recv_update_stats(void)
+{
+	if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+		return EXIT_FAILURE;
+	}
+	struct rte_eth_stats st;
+	int rc = rte_eth_stats_get(zconf.dpdk.port_id, &st);
+	if (rc) {
+		log_error("recv-dpdk", "unable to retrieve port statistics: %s",
+			  rte_strerror(-rc));
+		return EXIT_FAILURE;
+	}
+	zrecv.pcap_recv = st.ipackets;
+	zrecv.pcap_drop = st.imissed + st.rx_nombuf;
+	zrecv.pcap_ifdrop = st.ierrors;
+	return EXIT_SUCCESS;
+}
@@ -9,12 +9,83 @@
 #ifndef ZMAP_RECV_INTERNAL_H
 #define ZMAP_RECV_INTERNAL_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <time.h>
+
+#include "../lib/xalloc.h"
+#include "fieldset.h"
+
+#define RECV_RESULT_SHORT 0   // too short to hold an IP header
+#define RECV_RESULT_INVALID 1 // failed validation
+#define RECV_RESULT_VALID 2
+
+// what classifying a frame tells emit_packet()
+typedef struct recv_result {
+	int status;
+	// probe module fields of a valid response, freed by emit_packet().
+	// NULL for one the output filter rejected on its IP header and
+	// success alone, which carries just what is counted of it.
+	fieldset_t *fs;
+	int success;
+	int app_success;
+	// which probe module it answers, 0 for the main one and i + 1 for
+	// --extra-probe-module i
+	int probe;
+	// a response to the probe module's followup, e.g. --tcp-payload data
+	int followup;
+	uint32_t src_ip;
+	uint16_t src_port;
+	// (address, port) fingerprint of IPv6 responses, and the address for
+	// --ipv6-alias-detect
+	uint64_t fp6;
+	struct in6_addr src6;
+	int fragment;
+	struct timespec ts;
+} recv_result_t;
 
 void handle_packet(uint32_t buflen, const uint8_t *bytes,
 		   const struct timespec ts);
+
+// frames classified before any of them is emitted
+#define RECV_BATCH 64
+
+// a captured frame, which must stay in place until handle_packets() returns
+typedef struct pkt_ref {
+	const uint8_t *bytes;
+	uint32_t len;
+	struct timespec ts;
+} pkt_ref_t;
+
+// handle_packet() for what a backend received in one burst or ring block,
+// classified and emitted RECV_BATCH at a time
+void handle_packets(const pkt_ref_t *pkts, size_t n);
+// Validate a frame and have the probe module fill in its fields. Touches no
+// shared state, so it may run on several threads at once. The fieldset may
+// point into bytes until emit_packet().
+void classify_packet(uint32_t buflen, const uint8_t *bytes,
+		     const struct timespec ts, recv_result_t *res);
+// Deduplicate, count and output a classified frame. One thread at a time.
+void emit_packet(recv_result_t *res);
+
+// recv-pipeline.c: capture threads copy frames into per (capture thread,
+// processing thread) rings, processing threads classify them in place and
+// a single sequencer thread emits them. cpus holds the processing threads'
+// cores followed by the sequencer's.
+void recv_pipeline_init(uint8_t capture_threads, uint8_t processing_threads,
+			const uint32_t *cpus);
+// adds what recv_pipeline_init allocates under each tag to est
+void recv_pipeline_memory_estimate(uint8_t capture_threads,
+				   uint8_t processing_threads,
+				   uint64_t est[MEM_TAGS]);
+void recv_pipeline_push(uint8_t capture_idx, uint32_t buflen,
+			const uint8_t *bytes, const struct timespec ts);
+// once capture has stopped: wait for everything queued to be emitted
+void recv_pipeline_finish(void);
 void recv_init(void);
 void recv_packets(void);
 void recv_cleanup(void);
+// from recv_packets(), once it has read all of --replay-pcap
+void recv_replay_finished(void);
 
 #endif /* ZMAP_RECV_INTERNAL_H */
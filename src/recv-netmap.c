@@ -18,9 +18,11 @@
 #include "probe_modules/packet.h"
 #include "if-netmap.h"
 #include "state.h"
+#include "utility.h"
 
 #include "../lib/includes.h"
 #include "../lib/logger.h"
+#include "../lib/xalloc.h"
 
 #include <net/netmap_user.h>
 #include <net/if_arp.h>
@@ -251,19 +253,92 @@ wait_for_e2e_connectivity(void)
 	}
 }
 
-static struct pollfd fds;
+// With --recv-threads, each receive thread takes an equal share of the RX
+// rings, polled through fds of its own that are bound to one ring each, so
+// that syncing them never moves head/cur/tail of rings of other threads.
+// The first thread also waits for --netmap-wait-ping on every ring, through
+// the main fd, before the other threads are started.
 static struct netmap_if *nm_if;
+// per ring, as a frame may span syncs
 static bool *in_multi_seg_packet;
 static if_stats_ctx_t *stats_ctx;
 static bool need_recv_counter;
 static uint64_t recv_counter;
+static uint32_t num_threads;
+
+static __thread struct pollfd *fds;
+static __thread nfds_t num_fds;
+static __thread uint32_t first_ring;
+static __thread uint32_t end_ring;
+static __thread int own_fds;
+
+static int
+open_rx_ring(uint32_t ri)
+{
+	int fd = open(NETMAP_DEVICE_NAME, O_RDWR);
+	if (fd == -1) {
+		log_fatal("recv-netmap", "open(\"" NETMAP_DEVICE_NAME "\") failed: %d: %s", errno, strerror(errno));
+	}
+
+	struct nmreq_register nmrreg;
+	memset(&nmrreg, 0, sizeof(nmrreg));
+	nmrreg.nr_ringid = ri;
+	nmrreg.nr_mode = NR_REG_ONE_NIC;
+	nmrreg.nr_flags = NR_RX_RINGS_ONLY | NR_NO_TX_POLL;
+	struct nmreq_header nmrhdr;
+	memset(&nmrhdr, 0, sizeof(nmrhdr));
+	nmrhdr.nr_version = NETMAP_API;
+	nmrhdr.nr_reqtype = NETMAP_REQ_REGISTER;
+	cross_platform_strlcpy(nmrhdr.nr_name, zconf.iface, sizeof(nmrhdr.nr_name));
+	nmrhdr.nr_body = (uint64_t)&nmrreg;
+	if (ioctl(fd, NIOCCTRL, &nmrhdr) == -1) {
+		log_fatal("recv-netmap", "ioctl(NIOCCTRL) for rx ring %" PRIu32 " failed: %d: %s", ri, errno, strerror(errno));
+	}
+	return fd;
+}
+
+// every ring, through the main fd
+static void
+use_all_rings(void)
+{
+	fds = xcalloc(1, sizeof(struct pollfd));
+	fds[0].fd = zconf.nm.nm_fd;
+	fds[0].events = POLLIN;
+	num_fds = 1;
+	first_ring = 0;
+	end_ring = nm_if->ni_rx_rings;
+	own_fds = 0;
+}
+
+static void
+use_rings_of(uint32_t thread)
+{
+	uint32_t rings = nm_if->ni_rx_rings;
+	first_ring = (uint32_t)((uint64_t)rings * thread / num_threads);
+	end_ring = (uint32_t)((uint64_t)rings * (thread + 1) / num_threads);
+	num_fds = end_ring - first_ring;
+	fds = xcalloc(num_fds, sizeof(struct pollfd));
+	for (uint32_t ri = first_ring; ri < end_ring; ri++) {
+		fds[ri - first_ring].fd = open_rx_ring(ri);
+		fds[ri - first_ring].events = POLLIN;
+	}
+	own_fds = 1;
+	log_debug("recv-netmap", "receive thread %" PRIu32 " on rx rings %" PRIu32 "-%" PRIu32,
+		  thread, first_ring, end_ring - 1);
+}
 
 void recv_init(void)
 {
-	fds.fd = zconf.nm.nm_fd;
-	fds.events = POLLIN;
+	static uint32_t next_thread = 0;
+	uint32_t thread = __atomic_fetch_add(&next_thread, 1, __ATOMIC_SEQ_CST);
+	if (thread) {
+		use_rings_of(thread);
+		return;
+	}
 
 	nm_if = zconf.nm.nm_if;
+	num_threads = zconf.recv_threads;
+	assert(num_threads <= nm_if->ni_rx_rings);
 
 	in_multi_seg_packet = (bool *)malloc(nm_if->ni_rx_rings * sizeof(bool));
 	assert(in_multi_seg_packet);
@@ -274,23 +349,46 @@ void recv_init(void)
 	zconf.data_link_size = if_get_data_link_size(zconf.iface, zconf.nm.nm_fd);
 	log_debug("recv-netmap", "data_link_size %d", zconf.data_link_size);
 
+	stats_ctx = if_stats_init(zconf.iface, zconf.nm.nm_fd);
+	assert(stats_ctx);
+	need_recv_counter = !if_stats_have_recv_ctr(stats_ctx);
+	if (need_recv_counter) {
+		recv_counter = 0;
+	}
+
+	use_all_rings();
 	if (zconf.nm.wait_ping_dstip != 0) {
 		handle_packet_func = handle_packet_wait_ping;
 		wait_for_e2e_connectivity();
 	} else {
 		handle_packet_func = handle_packet;
 	}
-
-	stats_ctx = if_stats_init(zconf.iface, zconf.nm.nm_fd);
-	assert(stats_ctx);
-	need_recv_counter = !if_stats_have_recv_ctr(stats_ctx);
-	if (need_recv_counter) {
-		recv_counter = 0;
+	if (num_threads > 1) {
+		xfree(fds);
+		use_rings_of(0);
 	}
 }
 
+// the rings have a descriptor each, which recv_packets() polls together
+int recv_fd(void)
+{
+	return -1;
+}
+
 void recv_cleanup(void)
 {
+	if (own_fds) {
+		for (nfds_t i = 0; i < num_fds; i++) {
+			close(fds[i].fd);
+		}
+	}
+	xfree(fds);
+	fds = NULL;
+	num_fds = 0;
+	// the first thread is the last to clean up
+	if (first_ring) {
+		return;
+	}
 	if_stats_fini(stats_ctx);
 	stats_ctx = NULL;
 	free(in_multi_seg_packet);
@@ -305,7 +403,7 @@ void recv_packets(void)
 	// and making the total delay longer should not hurt.
 	// We may want to look into the root cause some time tho.
 	for (ssize_t retry = 5; retry >= 0; retry--) {
-		int ret = poll(&fds, 1, 100 /* ms */);
+		int ret = poll(fds, num_fds, 100 /* ms */);
 		if (ret > 0) {
 			break;
 		} else if (ret == 0) {
@@ -318,7 +416,10 @@ void recv_packets(void)
 		}
 	}
 
-	for (unsigned int ri = 0; ri < nm_if->ni_rx_rings; ri++) {
+	uint64_t received = 0;
+	pkt_ref_t batch[RECV_BATCH];
+	size_t n = 0;
+	for (unsigned int ri = first_ring; ri < end_ring; ri++) {
 		struct netmap_ring *rxring = NETMAP_RXRING(nm_if, ri);
 		unsigned head = rxring->head;
 		unsigned tail = rxring->tail;
@@ -362,14 +463,28 @@ void recv_packets(void)
 			struct timespec ts;
 			ts.tv_sec = rxring->ts.tv_sec;
 			ts.tv_nsec = rxring->ts.tv_usec * 1000;
-			if (need_recv_counter) {
-				recv_counter++;
-			}
+			received++;
 			handle_packet_arp(slot->len, (uint8_t *)buf, ts);
-			handle_packet_func(slot->len, (uint8_t *)buf, ts);
+			if (handle_packet_func != handle_packet) {
+				handle_packet_func(slot->len, (uint8_t *)buf, ts);
+				continue;
+			}
+			batch[n].bytes = (uint8_t *)buf;
+			batch[n].len = slot->len;
+			batch[n].ts = ts;
+			if (++n == RECV_BATCH) {
+				handle_packets(batch, n);
+				n = 0;
+			}
 		}
+		// the buffers are the kernel's again once head moves past them
+		handle_packets(batch, n);
+		n = 0;
 		rxring->cur = rxring->head = head;
 	}
+	if (need_recv_counter && received) {
+		__atomic_add_fetch(&recv_counter, received, __ATOMIC_RELAXED);
+	}
 
 #if 0
 	// We can get by without this sync because we are getting
@@ -379,7 +494,7 @@ void recv_packets(void)
 	// do not care about dropped packets anymore anyway, as we
 	// will be about to terminate.
 	// Leaving this here for future debugging.
-	if (ioctl(fds.fd, NIOCRXSYNC, NULL) == -1) {
+	if (ioctl(fds[0].fd, NIOCRXSYNC, NULL) == -1) {
 		log_error("recv-netmap", "ioctl(NIOCRXSYNC) failed: %d: %s", errno, strerror(errno));
 	}
 #endif
@@ -395,7 +510,7 @@ int recv_update_stats(void)
 		return EXIT_FAILURE;
 	}
 	if (need_recv_counter) {
-		zrecv.pcap_recv = (uint32_t)recv_counter;
+		zrecv.pcap_recv = (uint32_t)__atomic_load_n(&recv_counter, __ATOMIC_RELAXED);
 	}
 	return EXIT_SUCCESS;
 }
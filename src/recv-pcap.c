@@ -14,6 +14,9 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 
 #include "../lib/includes.h"
 #include "../lib/logger.h"
@@ -22,17 +25,70 @@
 #include <pcap/pcap.h>
 #if defined __linux__ && __linux__
 #include <pcap/sll.h>
+#include <poll.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
 #endif
 
 #include "recv-internal.h"
 #include "state.h"
+#include "extra_probes.h"
+#include "ifaces.h"
+#include "timestamps.h"
 
 #include "probe_modules/probe_modules.h"
 
 #define PCAP_PROMISC 1
 #define PCAP_TIMEOUT 100
 
-static pcap_t *pc = NULL;
+// each receive thread captures on its own handle, of its own interface
+static __thread pcap_t *pc = NULL;
+static __thread uint32_t pc_slot;
+static __thread struct iface_conf *pc_iface;
+// whether pc's timestamps are in nanoseconds rather than microseconds
+static __thread int pc_nano = 0;
+// every open handle, and the totals of those already closed, so that
+// recv_update_stats() can report across all receive threads
+static pcap_t *pcs[MAX_RECV_THREADS];
+static uint32_t num_pcs = 0;
+static struct pcap_stat closed_stats;
+
+#if defined __linux__ && __linux__
+// TPACKET_V3 RX ring geometry (--recv-method=tpacket-v3). The kernel packs
+// frames back to back into blocks and hands a block over once it is full,
+// or RX_RING_BLOCK_TIMEOUT_MS after it was opened so that responses still
+// arrive promptly when the scan is quiet.
+#define RX_RING_BLOCK_SIZE (1 << 22)
+// the blocks --capture-buffer makes, at least enough for the kernel to
+// fill some while the receive thread walks another
+#define RX_RING_MIN_BLOCKS 4
+#define RX_RING_FRAME_SIZE (1 << 11)
+#define RX_RING_BLOCK_TIMEOUT_MS 10
+#define RX_RING_POLL_TIMEOUT_MS PCAP_TIMEOUT
+
+struct rx_ring {
+	int fd;
+	uint8_t *map;
+	size_t map_len;
+	uint32_t block_nr;
+	// block the receive thread is waiting on or walking
+	uint32_t next;
+};
+
+static __thread struct rx_ring rx_ring = {.fd = -1};
+// ring sockets by slot, like pcs. Reading PACKET_STATISTICS resets the
+// kernel's counters, so every read is added to the running totals.
+static int ring_fds[MAX_RECV_THREADS] = {[0 ... MAX_RECV_THREADS - 1] = -1};
+static uint64_t ring_packets = 0;
+static uint64_t ring_drops = 0;
+#endif
 
 void packet_cb(u_char __attribute__((__unused__)) * user,
 	       const struct pcap_pkthdr *p, const u_char *bytes)
@@ -41,7 +97,7 @@ void packet_cb(u_char __attribute__((__unused__)) * user,
 	if (!p) {
 		return;
 	}
-	if (zrecv.filter_success >= zconf.max_results) {
+	if (recv_max_results_reached()) {
 		// Libpcap can process multiple packets per pcap_dispatch;
 		// we need to throw out results once we've
 		// gotten our --max-results worth.
@@ -51,24 +107,349 @@ void packet_cb(u_char __attribute__((__unused__)) * user,
 	// length of entire packet captured by libpcap
 	uint32_t buflen = (uint32_t)p->caplen;
 	ts.tv_sec = p->ts.tv_sec;
-	ts.tv_nsec = p->ts.tv_usec * 1000;
+	ts.tv_nsec = pc_nano ? p->ts.tv_usec : p->ts.tv_usec * 1000;
 	handle_packet(buflen, bytes, ts);
 }
 
 #define BPFLEN 1024
 
-void recv_init(void)
+// What can be a response to this scan and no other traffic: to one of the
+// source addresses (the smallest prefix holding them all), at a source
+// port of the scan, or an ICMP error quoting a probe sent from one. Other
+// ICMP, IP fragments after the first, which have no ports, and what quotes
+// an ICMP probe are left to the probe modules. "" if not to be narrowed.
+static void scan_filter(char *buf, size_t len)
+{
+	buf[0] = '\0';
+	if (zconf.loose_capture_filter || zconf.ipv6 ||
+	    zconf.replay_filename) {
+		return;
+	}
+	const in_addr_t *src = pc_iface ? pc_iface->source_ip_addresses
+					: zconf.source_ip_addresses;
+	uint32_t n = pc_iface ? pc_iface->number_source_ips
+			      : zconf.number_source_ips;
+	if (!n) {
+		return;
+	}
+	uint32_t lo = ntohl(src[0]);
+	uint32_t diff = 0;
+	for (uint32_t i = 1; i < n; i++) {
+		diff |= ntohl(src[i]) ^ lo;
+	}
+	int prefix = diff ? __builtin_clz(diff) : 32;
+	uint32_t net = prefix ? lo & (0xFFFFFFFFu << (32 - prefix)) : 0;
+	const char *quoted = "icmp[((icmp[8] & 0xf) << 2) + 8:2]";
+	int r = snprintf(
+	    buf, len,
+	    // "and" and "or" bind equally tightly, left to right
+	    "dst net %u.%u.%u.%u/%d and ((ip[6:2] & 0x1fff != 0)"
+	    " or ((tcp or udp) and dst portrange %u-%u)"
+	    " or (icmp and ((icmp[0] != 3 and icmp[0] != 4 and icmp[0] != 5"
+	    " and icmp[0] != 11 and icmp[0] != 12) or icmp[17] = 1"
+	    " or (%s >= %u and %s <= %u))))",
+	    net >> 24, (net >> 16) & 0xFF, (net >> 8) & 0xFF, net & 0xFF,
+	    prefix, zconf.source_port_first, zconf.source_port_last, quoted,
+	    zconf.source_port_first, quoted, zconf.source_port_last);
+	if (r < 0 || (size_t)r >= len) {
+		buf[0] = '\0';
+	}
+}
+
+// the capture filter: the probe modules', narrowed to the scan (see
+// scan_filter()) and minus our own outgoing packets, which are from hw_mac
+static void build_filter(char *bpftmp, const macaddr_t *hw_mac)
+{
+	char filter[BPFLEN];
+	probes_pcap_filter(filter, sizeof(filter));
+	char scan[BPFLEN / 2];
+	// a module seeing everything may want more than TCP, UDP and ICMP
+	if (filter[0]) {
+		scan_filter(scan, sizeof(scan));
+	} else {
+		scan[0] = '\0';
+	}
+	// a replayed capture holds our packets only if --source-mac says
+	// which they are
+	int own = !zconf.send_ip_pkts &&
+		  (!zconf.replay_filename || zconf.hw_mac_set);
+	if (own) {
+		snprintf(bpftmp, BPFLEN - 1,
+			 "not ether src %02x:%02x:%02x:%02x:%02x:%02x",
+			 hw_mac[0], hw_mac[1], hw_mac[2],
+			 hw_mac[3], hw_mac[4], hw_mac[5]);
+		assert(strlen(filter) + 10 < (BPFLEN - strlen(bpftmp)));
+	} else {
+		bpftmp[0] = 0;
+	}
+	if (filter[0]) {
+		if (own) {
+			strcat(bpftmp, " and (");
+		} else {
+			strcat(bpftmp, "(");
+		}
+		strcat(bpftmp, filter);
+		strcat(bpftmp, ")");
+	}
+	if (scan[0] && strlen(bpftmp) + strlen(scan) + 8 < BPFLEN) {
+		strcat(bpftmp, " and (");
+		strcat(bpftmp, scan);
+		strcat(bpftmp, ")");
+	}
+	log_debug("recv", "capture filter: %s", bpftmp);
+}
+
+static uint32_t register_handle(void)
 {
+	uint32_t slot = __atomic_fetch_add(&num_pcs, 1, __ATOMIC_SEQ_CST);
+	assert(slot < MAX_RECV_THREADS);
+	return slot;
+}
+
+#if defined __linux__ && __linux__
+static void join_fanout(int fd)
+{
+	if (zconf.recv_threads <= 1) {
+		return;
+	}
+	// every handle of an interface joins the same fanout group, and the
+	// kernel hands each packet to exactly one of them
+	int mode = zconf.recv_fanout == RECV_FANOUT_CPU ? PACKET_FANOUT_CPU
+							: PACKET_FANOUT_HASH;
+	uint32_t group = getpid() + (uint32_t)(pc_iface - zconf.ifaces);
+	int fanout = (group & 0xFFFF) | (mode << 16);
+	if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+		       sizeof(fanout)) < 0) {
+		log_fatal("recv", "unable to join PACKET_FANOUT group: %s",
+			  strerror(errno));
+	}
+}
+
+static void rx_ring_init(void)
+{
+	struct rx_ring *r = &rx_ring;
+	// protocol 0 receives nothing until the socket is bound below, once
+	// the filter and the ring are in place
+	r->fd = socket(AF_PACKET, SOCK_RAW, 0);
+	if (r->fd < 0) {
+		log_fatal("recv", "unable to open packet socket: %s",
+			  strerror(errno));
+	}
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	if (strlen(pc_iface->name) >= IFNAMSIZ) {
+		log_fatal("recv", "device interface name (%s) too long",
+			  pc_iface->name);
+	}
+	strncpy(ifr.ifr_name, pc_iface->name, IFNAMSIZ - 1);
+	if (ioctl(r->fd, SIOCGIFINDEX, &ifr) < 0) {
+		log_fatal("recv", "could not open device %s: %s", pc_iface->name,
+			  strerror(errno));
+	}
+	int ifindex = ifr.ifr_ifindex;
+	if (ioctl(r->fd, SIOCGIFHWADDR, &ifr) < 0) {
+		log_fatal("recv", "unable to get link type of %s: %s",
+			  pc_iface->name, strerror(errno));
+	}
+	int linktype;
+	switch (ifr.ifr_hwaddr.sa_family) {
+	case ARPHRD_ETHER:
+	case ARPHRD_LOOPBACK:
+		log_debug("recv", "Data link layer Ethernet");
+		linktype = DLT_EN10MB;
+		zconf.data_link_size = sizeof(struct ether_header);
+		break;
+	case ARPHRD_NONE:
+		log_info("recv", "Data link RAW");
+		linktype = DLT_RAW;
+		zconf.data_link_size = 0;
+		break;
+	default:
+		log_fatal("recv", "unsupported link type %u for tpacket-v3, "
+				  "use --recv-method=pcap",
+			  ifr.ifr_hwaddr.sa_family);
+	}
+
 	char bpftmp[BPFLEN];
-	char errbuf[PCAP_ERRBUF_SIZE];
+	build_filter(bpftmp, pc_iface ? pc_iface->hw_mac : zconf.hw_mac);
+	if (strcmp(bpftmp, "")) {
+		pcap_t *dead =
+		    pcap_open_dead(linktype, probes_pcap_snaplen());
+		struct bpf_program bpf;
+		if (!dead || pcap_compile(dead, &bpf, bpftmp, 1, 0) < 0) {
+			log_fatal("recv", "couldn't compile filter");
+		}
+		struct sock_fprog prog = {
+		    .len = (unsigned short)bpf.bf_len,
+		    .filter = (struct sock_filter *)bpf.bf_insns};
+		if (setsockopt(r->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+			       sizeof(prog)) < 0) {
+			log_fatal("recv", "couldn't install filter: %s",
+				  strerror(errno));
+		}
+		pcap_freecode(&bpf);
+		pcap_close(dead);
+	}
+
+	if (zconf.timestamps == TIMESTAMPS_HARDWARE) {
+		// tp_sec and tp_nsec are then the NIC's, where it stamped the
+		// frame, and the kernel's where it didn't
+		if (timestamps_enable_hardware(pc_iface->name,
+					       zconf.tx_timestamps)) {
+			log_warn("recv", "%s can't stamp packets in hardware "
+					 "(%s), using software timestamps",
+				 pc_iface->name, strerror(errno));
+		} else {
+			int ts = SOF_TIMESTAMPING_RAW_HARDWARE;
+			if (setsockopt(r->fd, SOL_PACKET, PACKET_TIMESTAMP, &ts,
+				       sizeof(ts)) < 0) {
+				log_warn("recv", "unable to set PACKET_TIMESTAMP: "
+						 "%s",
+					 strerror(errno));
+			}
+		}
+	}
+
+	int version = TPACKET_V3;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &version,
+		       sizeof(version)) < 0) {
+		log_fatal("recv", "unable to select TPACKET_V3: %s",
+			  strerror(errno));
+	}
+	r->block_nr = (uint32_t)(recv_capture_buffer_bytes() / RX_RING_BLOCK_SIZE);
+	if (r->block_nr < RX_RING_MIN_BLOCKS) {
+		r->block_nr = RX_RING_MIN_BLOCKS;
+	}
+	struct tpacket_req3 req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RX_RING_BLOCK_SIZE;
+	req.tp_block_nr = r->block_nr;
+	req.tp_frame_size = RX_RING_FRAME_SIZE;
+	req.tp_frame_nr = (RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE) *
+			  r->block_nr;
+	req.tp_retire_blk_tov = RX_RING_BLOCK_TIMEOUT_MS;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req,
+		       sizeof(req)) < 0) {
+		log_fatal("recv", "unable to set up PACKET_RX_RING: %s",
+			  strerror(errno));
+	}
+	r->map_len = (size_t)RX_RING_BLOCK_SIZE * r->block_nr;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_LOCKED, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		// MAP_LOCKED can fail against RLIMIT_MEMLOCK
+		r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, r->fd, 0);
+	}
+	if (r->map == MAP_FAILED) {
+		log_fatal("recv", "unable to mmap PACKET_RX_RING: %s",
+			  strerror(errno));
+	}
+	r->next = 0;
+
+	struct sockaddr_ll sll;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = ifindex;
+	if (bind(r->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0) {
+		log_fatal("recv", "unable to bind packet socket to %s: %s",
+			  pc_iface->name, strerror(errno));
+	}
+	struct packet_mreq mr;
+	memset(&mr, 0, sizeof(mr));
+	mr.mr_ifindex = ifindex;
+	mr.mr_type = PACKET_MR_PROMISC;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mr,
+		       sizeof(mr)) < 0) {
+		log_warn("recv", "unable to put %s in promiscuous mode: %s",
+			 pc_iface->name, strerror(errno));
+	}
+	join_fanout(r->fd);
+	__atomic_store_n(&ring_fds[pc_slot], r->fd, __ATOMIC_RELEASE);
+	log_debug("recv", "PACKET_RX_RING with %u blocks of %u bytes mapped",
+		  r->block_nr, RX_RING_BLOCK_SIZE);
+}
 
-	pc = pcap_open_live(zconf.iface, zconf.probe_module->pcap_snaplen,
-			    PCAP_PROMISC, PCAP_TIMEOUT, errbuf);
-	if (pc == NULL) {
-		log_fatal("recv", "could not open device %s: %s", zconf.iface,
-			  errbuf);
+// Wait for the next block, then hand its frames to handle_packets() before
+// giving the whole block back to the kernel
+static void rx_ring_packets(void)
+{
+	struct rx_ring *r = &rx_ring;
+	struct tpacket_block_desc *b =
+	    (struct tpacket_block_desc *)(r->map +
+					  (size_t)r->next * RX_RING_BLOCK_SIZE);
+	if (!(__atomic_load_n(&b->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+	      TP_STATUS_USER)) {
+		struct pollfd pfd = {.fd = r->fd, .events = POLLIN | POLLERR};
+		// the event loop has polled already
+		int timeout = zconf.event_loop ? 0 : RX_RING_POLL_TIMEOUT_MS;
+		if (poll(&pfd, 1, timeout) < 0 &&
+		    errno != EINTR) {
+			log_fatal("recv", "poll error: %s", strerror(errno));
+		}
+		return;
+	}
+	uint8_t *frame = (uint8_t *)b + b->hdr.bh1.offset_to_first_pkt;
+	pkt_ref_t batch[RECV_BATCH];
+	size_t n = 0;
+	for (uint32_t i = 0; i < b->hdr.bh1.num_pkts; i++) {
+		struct tpacket3_hdr *h = (struct tpacket3_hdr *)frame;
+		struct sockaddr_ll *sll =
+		    (struct sockaddr_ll *)(frame + TPACKET_ALIGN(
+						       sizeof(struct tpacket3_hdr)));
+		// see packet_cb() for why results past --max-results are
+		// thrown out
+		if (sll->sll_pkttype != PACKET_OUTGOING &&
+		    !recv_max_results_reached()) {
+			pkt_ref_t *p = &batch[n++];
+			p->bytes = frame + h->tp_mac;
+			p->len = h->tp_snaplen;
+			p->ts.tv_sec = h->tp_sec;
+			p->ts.tv_nsec = h->tp_nsec;
+			if (n == RECV_BATCH) {
+				handle_packets(batch, n);
+				n = 0;
+			}
+		}
+		frame += h->tp_next_offset;
+	}
+	handle_packets(batch, n);
+	__atomic_store_n(&b->hdr.bh1.block_status, TP_STATUS_KERNEL,
+			 __ATOMIC_RELEASE);
+	r->next = (r->next + 1) % r->block_nr;
+}
+
+static void rx_ring_read_stats(int fd)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+	if (getsockopt(fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0) {
+		log_error("recv", "unable to retrieve ring statistics: %s",
+			  strerror(errno));
+		return;
 	}
-	switch (pcap_datalink(pc)) {
+	// tp_packets already includes tp_drops, as ps_recv does for pcap
+	__atomic_add_fetch(&ring_packets, st.tp_packets, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&ring_drops, st.tp_drops, __ATOMIC_RELAXED);
+}
+
+static void rx_ring_cleanup(void)
+{
+	struct rx_ring *r = &rx_ring;
+	ring_fds[pc_slot] = -1;
+	rx_ring_read_stats(r->fd);
+	munmap(r->map, r->map_len);
+	close(r->fd);
+	r->fd = -1;
+	r->map = NULL;
+}
+#endif
+
+// the length of the link layer header in front of every frame of p
+static void set_data_link(pcap_t *p)
+{
+	switch (pcap_datalink(p)) {
 	case DLT_NULL:
 		// utun on macOS
 		log_debug("recv", "BSD loopback encapsulation");
@@ -89,31 +470,95 @@ void recv_init(void)
 		break;
 #endif
 	default:
-		log_error("recv", "unknown data link layer: %u", pcap_datalink(pc));
+		log_error("recv", "unknown data link layer: %u", pcap_datalink(p));
 	}
+}
 
-	struct bpf_program bpf;
+// --replay-pcap: frames read from the capture so far, for
+// recv_update_stats(), as savefiles keep no statistics
+static uint64_t replay_frames = 0;
 
-	if (!zconf.send_ip_pkts) {
-		snprintf(bpftmp, sizeof(bpftmp) - 1,
-			 "not ether src %02x:%02x:%02x:%02x:%02x:%02x",
-			 zconf.hw_mac[0], zconf.hw_mac[1], zconf.hw_mac[2],
-			 zconf.hw_mac[3], zconf.hw_mac[4], zconf.hw_mac[5]);
-		assert(strlen(zconf.probe_module->pcap_filter) + 10 <
-		       (BPFLEN - strlen(bpftmp)));
+// A live capture stamping in nanoseconds where libpcap and the kernel can,
+// and with --timestamps=hardware on the NIC
+static pcap_t *open_live(const char *name, char *errbuf)
+{
+	pcap_t *p = pcap_create(name, errbuf);
+	if (p == NULL) {
+		return NULL;
+	}
+	pcap_set_snaplen(p, probes_pcap_snaplen());
+	pcap_set_promisc(p, PCAP_PROMISC);
+	pcap_set_timeout(p, PCAP_TIMEOUT);
+	uint64_t buffer = recv_capture_buffer_bytes();
+	if (pcap_set_buffer_size(p, buffer > INT_MAX ? INT_MAX : (int)buffer)) {
+		log_warn("recv", "unable to set the capture buffer of %s",
+			 name);
 	} else {
-		bpftmp[0] = 0;
+		log_debug("recv", "capture buffer of %" PRIu64 " bytes on %s",
+			  buffer, name);
 	}
-	if (zconf.probe_module->pcap_filter) {
-		if (!zconf.send_ip_pkts) {
-			strcat(bpftmp, " and (");
-		} else {
-			strcat(bpftmp, "(");
+	if (pcap_set_tstamp_precision(p, PCAP_TSTAMP_PRECISION_NANO)) {
+		log_debug("recv", "no nanosecond timestamps on %s", name);
+	}
+	// the NIC's clock synced to the system's if the driver offers it,
+	// else its own
+	if (zconf.timestamps == TIMESTAMPS_HARDWARE &&
+	    pcap_set_tstamp_type(p, PCAP_TSTAMP_ADAPTER) &&
+	    pcap_set_tstamp_type(p, PCAP_TSTAMP_ADAPTER_UNSYNCED)) {
+		log_warn("recv", "%s can't stamp packets in hardware, using "
+				 "software timestamps",
+			 name);
+	}
+	int rc = pcap_activate(p);
+	if (rc < 0) {
+		snprintf(errbuf, PCAP_ERRBUF_SIZE, "%s",
+			 rc == PCAP_ERROR ? pcap_geterr(p) : pcap_statustostr(rc));
+		pcap_close(p);
+		return NULL;
+	}
+	if (rc > 0) {
+		log_warn("recv", "%s: %s", name,
+			 rc == PCAP_WARNING ? pcap_geterr(p) : pcap_statustostr(rc));
+	}
+	pc_nano = pcap_get_tstamp_precision(p) == PCAP_TSTAMP_PRECISION_NANO;
+	return p;
+}
+
+void recv_init(void)
+{
+	// receive threads take the interfaces in turn
+	pc_slot = register_handle();
+	pc_iface = zconf.num_ifaces ? iface_of_receiver(pc_slot) : NULL;
+#if defined __linux__ && __linux__
+	if (zconf.recv_method == RECV_METHOD_TPACKET_V3) {
+		rx_ring_init();
+		return;
+	}
+#endif
+	char errbuf[PCAP_ERRBUF_SIZE];
+
+	if (zconf.replay_filename) {
+		// libpcap scales a microsecond capture's timestamps
+		pc = pcap_open_offline_with_tstamp_precision(
+		    zconf.replay_filename, PCAP_TSTAMP_PRECISION_NANO, errbuf);
+		if (pc == NULL) {
+			log_fatal("recv", "could not open %s: %s",
+				  zconf.replay_filename, errbuf);
+		}
+		pc_nano = 1;
+	} else {
+		pc = open_live(pc_iface->name, errbuf);
+		if (pc == NULL) {
+			log_fatal("recv", "could not open device %s: %s",
+				  pc_iface->name, errbuf);
 		}
-		strcat(bpftmp, zconf.probe_module->pcap_filter);
-		strcat(bpftmp, ")");
 	}
+	set_data_link(pc);
+
+	char bpftmp[BPFLEN];
+	build_filter(bpftmp, pc_iface ? pc_iface->hw_mac : zconf.hw_mac);
 	if (strcmp(bpftmp, "")) {
+		struct bpf_program bpf;
 		if (pcap_compile(pc, &bpf, bpftmp, 1, 0) < 0) {
 			log_fatal("recv", "couldn't compile filter");
 		}
@@ -121,44 +566,120 @@ void recv_init(void)
 			log_fatal("recv", "couldn't install filter");
 		}
 	}
+	if (zconf.replay_filename) {
+		__atomic_store_n(&pcs[pc_slot], pc, __ATOMIC_RELEASE);
+		return;
+	}
 	// set pcap_dispatch to not hang if it never receives any packets
 	// this could occur if you ever scan a small number of hosts as
 	// documented in issue #74.
 	if (pcap_setnonblock(pc, 1, errbuf) == -1) {
 		log_fatal("recv", "pcap_setnonblock error:%s", errbuf);
 	}
+#if defined __linux__ && __linux__
+	join_fanout(pcap_fileno(pc));
+#endif
+	__atomic_store_n(&pcs[pc_slot], pc, __ATOMIC_RELEASE);
 }
 
 void recv_packets(void)
 {
+#if defined __linux__ && __linux__
+	if (zconf.recv_method == RECV_METHOD_TPACKET_V3) {
+		rx_ring_packets();
+		return;
+	}
+#endif
 	int ret = pcap_dispatch(pc, -1, packet_cb, NULL);
 	if (ret == -1) {
-		log_fatal("recv", "pcap_dispatch error");
-	} else if (ret == 0) {
+		log_fatal("recv", "pcap_dispatch error: %s", pcap_geterr(pc));
+	} else if (zconf.replay_filename) {
+		// a savefile returns 0 only at its end
+		__atomic_add_fetch(&replay_frames, ret, __ATOMIC_RELAXED);
+		if (ret == 0) {
+			recv_replay_finished();
+		}
+	} else if (ret == 0 && !zconf.event_loop) {
 		usleep(1000);
 	}
 }
 
+int recv_fd(void)
+{
+#if defined __linux__ && __linux__
+	if (zconf.recv_method == RECV_METHOD_TPACKET_V3) {
+		return rx_ring.fd;
+	}
+#endif
+	return pcap_get_selectable_fd(pc);
+}
+
+// called with the recv_ready_mutex held, as is recv_update_stats()
 void recv_cleanup(void)
 {
+#if defined __linux__ && __linux__
+	if (zconf.recv_method == RECV_METHOD_TPACKET_V3) {
+		rx_ring_cleanup();
+		return;
+	}
+#endif
+	struct pcap_stat pcst;
+	if (!zconf.replay_filename && !pcap_stats(pc, &pcst)) {
+		closed_stats.ps_recv += pcst.ps_recv;
+		closed_stats.ps_drop += pcst.ps_drop;
+		closed_stats.ps_ifdrop += pcst.ps_ifdrop;
+	}
+	pcs[pc_slot] = NULL;
 	pcap_close(pc);
 	pc = NULL;
 }
 
 int recv_update_stats(void)
 {
-	if (!pc) {
+	uint32_t n = __atomic_load_n(&num_pcs, __ATOMIC_ACQUIRE);
+	if (!n) {
 		return EXIT_FAILURE;
 	}
-	struct pcap_stat pcst;
-	if (pcap_stats(pc, &pcst)) {
-		log_error("recv", "unable to retrieve pcap statistics: %s",
-			  pcap_geterr(pc));
-		return EXIT_FAILURE;
-	} else {
-		zrecv.pcap_recv = pcst.ps_recv;
-		zrecv.pcap_drop = pcst.ps_drop;
-		zrecv.pcap_ifdrop = pcst.ps_ifdrop;
+#if defined __linux__ && __linux__
+	if (zconf.recv_method == RECV_METHOD_TPACKET_V3) {
+		for (uint32_t i = 0; i < n && i < MAX_RECV_THREADS; i++) {
+			int fd = __atomic_load_n(&ring_fds[i], __ATOMIC_ACQUIRE);
+			if (fd >= 0) {
+				rx_ring_read_stats(fd);
+			}
+		}
+		zrecv.pcap_recv =
+		    __atomic_load_n(&ring_packets, __ATOMIC_RELAXED);
+		zrecv.pcap_drop = __atomic_load_n(&ring_drops, __ATOMIC_RELAXED);
+		zrecv.pcap_ifdrop = 0;
+		return EXIT_SUCCESS;
+	}
+#endif
+	if (zconf.replay_filename) {
+		zrecv.pcap_recv =
+		    __atomic_load_n(&replay_frames, __ATOMIC_RELAXED);
+		zrecv.pcap_drop = 0;
+		zrecv.pcap_ifdrop = 0;
+		return EXIT_SUCCESS;
+	}
+	struct pcap_stat total = closed_stats;
+	for (uint32_t i = 0; i < n && i < MAX_RECV_THREADS; i++) {
+		pcap_t *p = __atomic_load_n(&pcs[i], __ATOMIC_ACQUIRE);
+		if (!p) {
+			continue;
+		}
+		struct pcap_stat pcst;
+		if (pcap_stats(p, &pcst)) {
+			log_error("recv", "unable to retrieve pcap statistics: %s",
+				  pcap_geterr(p));
+			return EXIT_FAILURE;
+		}
+		total.ps_recv += pcst.ps_recv;
+		total.ps_drop += pcst.ps_drop;
+		total.ps_ifdrop += pcst.ps_ifdrop;
 	}
+	zrecv.pcap_recv = total.ps_recv;
+	zrecv.pcap_drop = total.ps_drop;
+	zrecv.pcap_ifdrop = total.ps_ifdrop;
 	return EXIT_SUCCESS;
 }
@@ -12,6 +12,7 @@
 #include "../lib/includes.h"
 #include "../lib/logger.h"
 
+#include <assert.h>
 #include <errno.h>
 #include <unistd.h>
 
@@ -19,19 +20,42 @@
 
 #include "state.h"
 
-static pfring_zc_pkt_buff *pf_buffer;
-static pfring_zc_queue *pf_recv;
+// Each receive thread drains the RX queue of its own (see zmap.c) in
+// bursts. An empty queue is polled again right away for a while, since
+// responses tend to come in runs, then with sleeps that double up to
+// PF_RECV_MAX_SLEEP_US so that an idle scan doesn't keep a core busy.
+#define PF_RECV_SPINS 1024
+#define PF_RECV_MAX_SLEEP_US 1000
+
+static __thread pfring_zc_pkt_buff *pf_buffers[PF_RECV_BURST];
+static __thread pfring_zc_queue *pf_recv;
+static __thread uint32_t empty_polls;
+static __thread uint32_t sleep_us;
 
 void recv_init()
 {
-	// Get the socket and packet handle
-	pf_recv = zconf.pf.recv;
-	pf_buffer = pfring_zc_get_packet_handle(zconf.pf.cluster);
-	if (pf_buffer == NULL) {
-		log_fatal("recv", "Could not get packet handle: %s",
-			  strerror(errno));
+	static uint32_t next_queue = 0;
+	uint32_t queue = __atomic_fetch_add(&next_queue, 1, __ATOMIC_SEQ_CST);
+	assert(queue < zconf.recv_threads);
+	// Get the socket and packet handles
+	pf_recv = zconf.pf.recv[queue];
+	for (int i = 0; i < PF_RECV_BURST; i++) {
+		pf_buffers[i] = pfring_zc_get_packet_handle(zconf.pf.cluster);
+		if (pf_buffers[i] == NULL) {
+			log_fatal("recv", "Could not get packet handle: %s",
+				  strerror(errno));
+		}
 	}
+	empty_polls = 0;
+	sleep_us = 0;
 	zconf.data_link_size = sizeof(struct ether_header);
+	log_debug("recv", "receiving on queue %u", queue);
+}
+
+// the queue is polled busily, with no descriptor to wait on
+int recv_fd(void)
+{
+	return -1;
 }
 
 void recv_cleanup()
@@ -44,38 +68,55 @@ void recv_cleanup()
 
 void recv_packets()
 {
-	int ret = pfring_zc_recv_pkt(pf_recv, &pf_buffer, 0);
+	int ret = pfring_zc_recv_pkt_burst(pf_recv, pf_buffers, PF_RECV_BURST,
+					   0);
 	// Empty queue, return to let outer loop check for termination
 	if (ret == 0) {
-		usleep(1000);
+		if (++empty_polls < PF_RECV_SPINS) {
+			return;
+		}
+		sleep_us = sleep_us ? sleep_us * 2 : 1;
+		if (sleep_us > PF_RECV_MAX_SLEEP_US) {
+			sleep_us = PF_RECV_MAX_SLEEP_US;
+		}
+		usleep(sleep_us);
 		return;
 	}
 	// Handle other errors, by not doing anything and logging
-	if (ret != 1) {
+	if (ret < 0) {
 		log_error("recv", "Error: %d", ret);
 		return;
 	}
-	// Successfully got a packet, now handle it
-	struct timespec ts;
-	ts.tv_sec = pf_buffer->ts.tv_sec;
-	ts.tv_nsec = pf_buffer->ts.tv_nsec; //* 1000;
-
-	uint8_t *pkt_buf = pfring_zc_pkt_buff_data(pf_buffer, pf_recv);
-	handle_packet(pf_buffer->len, pkt_buf, ts);
+	empty_polls = 0;
+	sleep_us = 0;
+	// Successfully got packets, now handle them
+	pkt_ref_t batch[PF_RECV_BURST];
+	for (int i = 0; i < ret; i++) {
+		pfring_zc_pkt_buff *b = pf_buffers[i];
+		batch[i].ts.tv_sec = b->ts.tv_sec;
+		batch[i].ts.tv_nsec = b->ts.tv_nsec; //* 1000;
+		batch[i].bytes = pfring_zc_pkt_buff_data(b, pf_recv);
+		batch[i].len = b->len;
+	}
+	handle_packets(batch, (size_t)ret);
 }
 
 int recv_update_stats(void)
 {
-	if (!pf_recv) {
+	if (!zconf.pf.recv) {
 		return EXIT_FAILURE;
 	}
-	pfring_zc_stat pfst;
-	if (pfring_zc_stats(pf_recv, &pfst)) {
-		log_error("recv", "unable to retrieve pfring statistics");
-		return EXIT_FAILURE;
-	} else {
-		zrecv.pcap_recv = pfst.recv;
-		zrecv.pcap_drop = pfst.drop;
+	uint64_t recv = 0, drop = 0;
+	for (uint32_t i = 0; i < zconf.recv_threads; i++) {
+		pfring_zc_stat pfst;
+		if (pfring_zc_stats(zconf.pf.recv[i], &pfst)) {
+			log_error("recv", "unable to retrieve pfring statistics");
+			return EXIT_FAILURE;
+		}
+		recv += pfst.recv;
+		drop += pfst.drop;
 	}
+	zrecv.pcap_recv = recv;
+	zrecv.pcap_drop = drop;
 	return EXIT_SUCCESS;
 }
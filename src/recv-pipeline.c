@@ -0,0 +1,285 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * Staged receive path for --recv-processing-threads. Capture threads must
+ * never wait on a slow output module, so all they do is copy each frame
+ * into a ring. Every (capture thread, processing thread) pair has its own
+ * ring, and every slot in it is passed along by three threads in turn: the
+ * capture thread fills it and advances head, the processing thread
+ * classifies it in place and advances classified, and the single sequencer
+ * emits it and advances tail, after which the slot can be refilled. Each
+ * position is only ever written by its own thread, so no locks are needed,
+ * and frames stay where the probe module's fields may point at them until
+ * they have been output.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/util.h"
+#include "../lib/xalloc.h"
+
+#include "recv.h"
+#include "recv-internal.h"
+#include "stage_timing.h"
+#include "state.h"
+#include "extra_probes.h"
+#include "probe_modules/probe_modules.h"
+
+// slots per ring, must be a power of two
+#define PIPELINE_RING_SIZE 2048
+// fieldsets of the frames in a ring, roughly two pages' worth per slot;
+// a backlog deeper than that spills to the heap
+#define PIPELINE_ARENA_SIZE (PIPELINE_RING_SIZE * 8 * 1024)
+#define PIPELINE_WAIT_NS 50000
+
+struct pipeline_slot {
+	recv_result_t res;
+	struct timespec ts;
+	uint32_t len;
+	// end of the slot's fieldsets in the ring's arena
+	uint64_t arena_mark;
+	uint8_t frame[];
+};
+
+struct pipeline_ring {
+	uint8_t *slots;
+	// allocated from by the processing thread, released by the sequencer
+	fs_arena_t arena;
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t classified __attribute__((aligned(64)));
+	uint64_t tail __attribute__((aligned(64)));
+};
+
+struct processing_arg {
+	uint8_t idx;
+	uint32_t cpu;
+};
+
+static uint8_t num_capture;
+static uint8_t num_processing;
+static size_t slot_size;
+static uint32_t frame_cap;
+// rings[capture * num_processing + processing]
+static struct pipeline_ring *rings = NULL;
+static pthread_t *processors;
+static pthread_t sequencer;
+static int stopping = 0;
+static int processors_done = 0;
+// processing thread a capture thread tries first for its next frame
+static __thread uint32_t next_processor = 0;
+
+static void pipeline_wait(void)
+{
+	struct timespec ts = {.tv_sec = 0, .tv_nsec = PIPELINE_WAIT_NS};
+	nanosleep(&ts, NULL);
+}
+
+static inline struct pipeline_slot *slot_at(struct pipeline_ring *r,
+					    uint64_t pos)
+{
+	return (struct pipeline_slot *)(r->slots +
+					(pos & (PIPELINE_RING_SIZE - 1)) *
+					    slot_size);
+}
+
+void recv_pipeline_push(uint8_t capture_idx, uint32_t buflen,
+			const uint8_t *bytes, const struct timespec ts)
+{
+	assert(capture_idx < num_capture);
+	// spread frames round robin, skipping processing threads that have
+	// fallen a full ring behind
+	for (uint8_t i = 0; i < num_processing; i++) {
+		uint32_t p = next_processor++ % num_processing;
+		struct pipeline_ring *r =
+		    &rings[(uint32_t)capture_idx * num_processing + p];
+		uint64_t head = r->head;
+		if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >=
+		    PIPELINE_RING_SIZE) {
+			continue;
+		}
+		struct pipeline_slot *s = slot_at(r, head);
+		if (buflen > frame_cap) {
+			buflen = frame_cap;
+		}
+		memcpy(s->frame, bytes, buflen);
+		s->len = buflen;
+		s->ts = ts;
+		__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+		return;
+	}
+	__atomic_add_fetch(&zrecv.pipeline_drops, 1, __ATOMIC_RELAXED);
+}
+
+static void *processing_thread(void *arg)
+{
+	struct processing_arg *a = arg;
+	uint8_t p = a->idx;
+	log_debug("recv", "Pinning a processing thread to core %u", a->cpu);
+	set_cpu(a->cpu);
+	free(a);
+	while (1) {
+		// capture has stopped for good once this is seen, so an empty
+		// pass after it means everything has been classified
+		int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+		int busy = 0;
+		for (uint8_t c = 0; c < num_capture; c++) {
+			struct pipeline_ring *r = &rings[c * num_processing + p];
+			uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+			for (uint64_t pos = r->classified; pos < head; pos++) {
+				struct pipeline_slot *s = slot_at(r, pos);
+				fs_arena_use(&r->arena);
+				uint64_t t0 = stage_begin(STAGE_CLASSIFY);
+				classify_packet(s->len, s->frame, s->ts, &s->res);
+				stage_end(STAGE_CLASSIFY, t0);
+				s->arena_mark = fs_arena_mark(&r->arena);
+				__atomic_store_n(&r->classified, pos + 1,
+						 __ATOMIC_RELEASE);
+				busy = 1;
+			}
+		}
+		if (!busy) {
+			if (stop) {
+				break;
+			}
+			pipeline_wait();
+		}
+	}
+	__atomic_add_fetch(&processors_done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void *sequencer_thread(void *arg)
+{
+	uint32_t cpu = *(const uint32_t *)arg;
+	log_debug("recv", "Pinning the sequencer thread to core %u", cpu);
+	set_cpu(cpu);
+	uint32_t num_rings = (uint32_t)num_capture * num_processing;
+	while (1) {
+		int stop = __atomic_load_n(&processors_done, __ATOMIC_ACQUIRE) ==
+			   num_processing;
+		int busy = 0;
+		for (uint32_t i = 0; i < num_rings; i++) {
+			struct pipeline_ring *r = &rings[i];
+			uint64_t classified =
+			    __atomic_load_n(&r->classified, __ATOMIC_ACQUIRE);
+			for (uint64_t pos = r->tail; pos < classified; pos++) {
+				struct pipeline_slot *s = slot_at(r, pos);
+				uint64_t t0 = stage_begin(STAGE_EMIT);
+				emit_packet(&s->res);
+				stage_end(STAGE_EMIT, t0);
+				fs_arena_release(&r->arena, s->arena_mark);
+				__atomic_store_n(&r->tail, pos + 1,
+						 __ATOMIC_RELEASE);
+				busy = 1;
+			}
+		}
+		if (!busy) {
+			if (stop) {
+				break;
+			}
+			pipeline_wait();
+		}
+	}
+	return NULL;
+}
+
+static size_t pipeline_slot_size(void)
+{
+	size_t size = sizeof(struct pipeline_slot) + probes_pcap_snaplen();
+	return (size + 63) & ~(size_t)63;
+}
+
+void recv_pipeline_memory_estimate(uint8_t capture_threads,
+				   uint8_t processing_threads,
+				   uint64_t est[MEM_TAGS])
+{
+	uint64_t num_rings = (uint64_t)capture_threads * processing_threads;
+	est[MEM_PACKETS] += num_rings * PIPELINE_RING_SIZE * pipeline_slot_size();
+	est[MEM_RESULTS] += num_rings * PIPELINE_ARENA_SIZE;
+}
+
+void recv_pipeline_init(uint8_t capture_threads, uint8_t processing_threads,
+			const uint32_t *cpus)
+{
+	assert(capture_threads > 0);
+	assert(processing_threads > 0);
+	num_capture = capture_threads;
+	num_processing = processing_threads;
+	frame_cap = probes_pcap_snaplen();
+	slot_size = pipeline_slot_size();
+
+	uint32_t num_rings = (uint32_t)num_capture * num_processing;
+	rings = xmalloc_aligned(64, num_rings * sizeof(struct pipeline_ring));
+	for (uint32_t i = 0; i < num_rings; i++) {
+		rings[i].slots = xmalloc_aligned_tag(
+		    MEM_PACKETS, 64, PIPELINE_RING_SIZE * slot_size);
+		fs_arena_init(&rings[i].arena, PIPELINE_ARENA_SIZE);
+	}
+
+	processors = xcalloc(num_processing, sizeof(pthread_t));
+	for (uint8_t p = 0; p < num_processing; p++) {
+		struct processing_arg *a = xmalloc(sizeof(struct processing_arg));
+		a->idx = p;
+		a->cpu = cpus[p];
+		if (pthread_create(&processors[p], NULL, processing_thread, a)) {
+			log_fatal("recv", "unable to create processing thread");
+		}
+	}
+	if (pthread_create(&sequencer, NULL, sequencer_thread,
+			   (void *)&cpus[num_processing])) {
+		log_fatal("recv", "unable to create sequencer thread");
+	}
+	log_debug("recv",
+		  "%u processing threads fed by %u rings of %u %zu byte slots",
+		  num_processing, num_rings, PIPELINE_RING_SIZE, slot_size);
+}
+
+void recv_pipeline_finish(void)
+{
+	if (!rings) {
+		return;
+	}
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	for (uint8_t p = 0; p < num_processing; p++) {
+		pthread_join(processors[p], NULL);
+	}
+	pthread_join(sequencer, NULL);
+	xfree(processors);
+	processors = NULL;
+	// rings stay mapped, the monitor may still be reading their depths
+}
+
+uint64_t recv_pipeline_capacity(void)
+{
+	return rings ? (uint64_t)num_capture * num_processing * PIPELINE_RING_SIZE
+		     : 0;
+}
+
+void recv_pipeline_depths(uint64_t *capture, uint64_t *output)
+{
+	*capture = 0;
+	*output = 0;
+	if (!rings) {
+		return;
+	}
+	uint32_t num_rings = (uint32_t)num_capture * num_processing;
+	for (uint32_t i = 0; i < num_rings; i++) {
+		uint64_t tail = __atomic_load_n(&rings[i].tail, __ATOMIC_ACQUIRE);
+		uint64_t classified =
+		    __atomic_load_n(&rings[i].classified, __ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&rings[i].head, __ATOMIC_ACQUIRE);
+		*capture += head - classified;
+		*output += classified - tail;
+	}
+}
@@ -0,0 +1,136 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "recv.h"
+#include "recv-internal.h"
+#include "socket-xdp.h"
+#include "state.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+// max number of descriptors consumed from one RX ring per poll
+#define XDP_RX_BATCH 64
+
+static struct pollfd *fds = NULL;
+static uint64_t recv_count = 0;
+
+void recv_init(void)
+{
+	if (zconf.send_ip_pkts) {
+		log_fatal("recv-xdp", "AF_XDP does not support IP layer mode (--iplayer/-X)");
+	}
+	zconf.data_link_size = sizeof(struct ether_header);
+	fds = xcalloc(zconf.xdp.num_queues, sizeof(struct pollfd));
+	for (uint32_t i = 0; i < zconf.xdp.num_queues; i++) {
+		fds[i].fd = xsk_socket__fd(zconf.xdp.queues[i].xsk);
+		fds[i].events = POLLIN;
+	}
+}
+
+static void recv_queue(struct xdp_queue *q, struct timespec ts)
+{
+	uint32_t idx_rx;
+	uint32_t n = xsk_ring_cons__peek(&q->rx, XDP_RX_BATCH, &idx_rx);
+	if (!n) {
+		return;
+	}
+	// RX frames are conserved, so the fill ring always has room for
+	// the ones we are about to give back
+	uint32_t idx_fill;
+	while (xsk_ring_prod__reserve(&q->fill, n, &idx_fill) != n)
+		;
+	// the frames stay ours until the fill ring is submitted
+	pkt_ref_t batch[RECV_BATCH];
+	size_t b = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&q->rx, idx_rx + i);
+		// Like libpcap, a single wakeup can hand us several
+		// packets; throw out results once we've gotten our
+		// --max-results worth.
+		if (!recv_max_results_reached()) {
+			batch[b].bytes = xsk_umem__get_data(q->umem_area, desc->addr);
+			batch[b].len = desc->len;
+			batch[b].ts = ts;
+			if (++b == RECV_BATCH) {
+				handle_packets(batch, b);
+				b = 0;
+			}
+		}
+		*xsk_ring_prod__fill_addr(&q->fill, idx_fill + i) =
+		    desc->addr - desc->addr % XDP_FRAME_SIZE;
+	}
+	handle_packets(batch, b);
+	xsk_ring_prod__submit(&q->fill, n);
+	xsk_ring_cons__release(&q->rx, n);
+	recv_count += n;
+}
+
+void recv_packets(void)
+{
+	int rv = poll(fds, zconf.xdp.num_queues, 1);
+	if (rv < 0) {
+		if (errno == EINTR) {
+			return;
+		}
+		log_fatal("recv-xdp", "poll(POLLIN) failed: %d: %s", errno, strerror(errno));
+	} else if (rv == 0) {
+		return;
+	}
+	// AF_XDP descriptors carry no timestamp, stamp the whole wakeup
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	for (uint32_t i = 0; i < zconf.xdp.num_queues; i++) {
+		if (fds[i].revents & POLLIN) {
+			recv_queue(&zconf.xdp.queues[i], ts);
+		}
+	}
+}
+
+// the rings have a descriptor each, which recv_packets() polls together
+int recv_fd(void)
+{
+	return -1;
+}
+
+void recv_cleanup(void)
+{
+	xfree(fds);
+	fds = NULL;
+}
+
+int recv_update_stats(void)
+{
+	if (!fds) {
+		return EXIT_FAILURE;
+	}
+	uint64_t drop = 0;
+	uint64_t ifdrop = 0;
+	for (uint32_t i = 0; i < zconf.xdp.num_queues; i++) {
+		struct xdp_statistics st;
+		socklen_t optlen = sizeof(st);
+		if (getsockopt(fds[i].fd, SOL_XDP, XDP_STATISTICS, &st, &optlen)) {
+			log_error("recv-xdp", "unable to retrieve XDP statistics for queue %u: %s",
+				  i, strerror(errno));
+			return EXIT_FAILURE;
+		}
+		drop += st.rx_dropped + st.rx_ring_full;
+		ifdrop += st.rx_fill_ring_empty_descs;
+	}
+	zrecv.pcap_recv = recv_count;
+	zrecv.pcap_drop = drop;
+	zrecv.pcap_ifdrop = ifdrop;
+	return EXIT_SUCCESS;
+}
@@ -9,12 +9,17 @@
 #include "recv.h"
 
 #include <assert.h>
+#include <math.h>
 
 #include "../lib/includes.h"
-#include "cachehash.h"
 #include "../lib/util.h"
+#include "../lib/xalloc.h"
 #include "../lib/logger.h"
 #include "../lib/pbm.h"
+#include "../lib/cbm.h"
+#include "../lib/fpset.h"
+#include "../lib/fpgen.h"
+#include "../lib/fpwindow.h"
 
 #include <pthread.h>
 #include <unistd.h>
@@ -24,29 +29,341 @@
 #include "validate.h"
 #include "fieldset.h"
 #include "shard.h"
+#include "stage_timing.h"
+#include "capture_file.h"
+#include "checkpoint.h"
 #include "expression.h"
+#include "extra_probes.h"
+#include "ifaces.h"
+#include "ipv6_alias.h"
+#include "ipv6_pattern.h"
+#include "ipv6_source.h"
+#include "ipv6_target_file.h"
+#include "output-queue.h"
+#include "sample.h"
+#include "shaping.h"
+#ifdef XDP_FILTER
+#include "xdp_filter.h"
+#endif
 #include "probe_modules/packet.h"
 #include "probe_modules/probe_modules.h"
 #include "output_modules/output_modules.h"
 
-static u_char fake_eth_hdr[65535];
-// bitmap of observed IP addresses
+// what each capture thread builds its fieldsets in, reset after every
+// packet (--recv-processing-threads uses one per ring instead)
+#define RECV_ARENA_SIZE (256 * 1024)
+static __thread fs_arena_t arena;
+// copy handed to output modules without process_view; emit_packet() only
+// ever runs on one thread at a time
+static fieldset_t *translated = NULL;
+// The counting blocks of the threads that have emitted results: every
+// capture thread, or the sequencer alone with --recv-processing-threads.
+// Each is written by its thread only, with recv_count().
+#define MAX_RECV_STATS (MAX_RECV_THREADS + 1)
+static struct recv_stats *stats_blocks[MAX_RECV_STATS];
+static uint32_t num_stats_blocks = 0;
+static __thread struct recv_stats *local_stats = NULL;
+// the probe modules' contexts on this thread, from recv_thread_initialize:
+// zconf.probe_module's first, then each --extra-probe-module's
+static __thread void **probe_args = NULL;
+// successes since the output module's update() was last called, only
+// touched by emit_packet()
+static uint64_t unique_since_update = 0;
+// bitmap of observed IP addresses, paged or flat (--flat-bitmap)
 static uint8_t **seen = NULL;
-static cachehash *ch = NULL;
+static uint8_t *seen_flat = NULL;
+// --compressed-bitmap, in place of seen. Setting a value can move a
+// container, so sets and copies for checkpoints take seen_cbm_lock.
+static cbm_t *seen_cbm = NULL;
+static pthread_mutex_t seen_cbm_lock = PTHREAD_MUTEX_INITIALIZER;
+// With several ports, seen is keyed on (address, port): address *
+// seen_slots + the slot of the port answered from, the last slot being for
+// responses from none of the scanned ports (ICMP errors and the like)
+static uint32_t seen_slots = 1;
+static uint32_t *port_slot = NULL;
+// (address, port) fingerprints of IPv6 responders
+static fpset_t *seen6 = NULL;
+// responses to the probe module's follow-ups, by (address, port)
+static fpset_t *seen_followup = NULL;
+// recently seen (address, port) fingerprints for --dedup-method window
+static fpwindow_t *window = NULL;
+// or those seen over the last --dedup-window-time seconds
+static fpgen_t *window_gens = NULL;
 
 // IPv6
 static int ipv6 = 0;
-void handle_packet(uint32_t buflen, const u_char *bytes,
-		   const struct timespec ts)
+
+// With more than one capture thread and no processing threads, every
+// capture thread classifies its own packets and emit_packet(), which
+// touches the shared state (dedup, counters, the output module), is
+// serialized behind recv_lock.
+static int recv_locking = 0;
+static pthread_mutex_t recv_lock = PTHREAD_MUTEX_INITIALIZER;
+// With --recv-processing-threads, capture threads only copy frames into
+// the pipeline (recv-pipeline.c)
+static int pipeline = 0;
+// capture threads besides the one running recv_run()
+static pthread_t *capture_threads = NULL;
+static int capture_threads_ready = 0;
+static int capture_threads_stop = 0;
+static pthread_mutex_t *capture_ready_mutex = NULL;
+static __thread uint8_t capture_idx = 0;
+
+struct capture_arg {
+	uint8_t idx;
+	uint32_t cpu;
+};
+
+static inline uint64_t fmix64(uint64_t k)
+{
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+// --dedup-method window, by count or, keyed on when the packet was
+// captured, by time
+static inline int window_check_and_set(uint64_t fp, struct timespec ts)
+{
+	if (window_gens) {
+		return fpgen_check_and_set(
+		    window_gens, fp,
+		    (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+	}
+	return fpwindow_check_and_set(window, fp);
+}
+
+static uint64_t ipv6_fingerprint(const struct in6_addr *addr, uint16_t port)
+{
+	uint64_t hi, lo;
+	memcpy(&hi, addr->s6_addr, sizeof(hi));
+	memcpy(&lo, addr->s6_addr + sizeof(hi), sizeof(lo));
+	return fmix64(hi ^ fmix64(lo ^ port));
+}
+
+static inline uint64_t seen_key(uint32_t src_ip, uint16_t src_port)
+{
+	uint64_t ip = ntohl(src_ip);
+	if (seen_slots == 1) {
+		return ip;
+	}
+	return ip * seen_slots + port_slot[ntohs(src_port)];
+}
+
+// pbm_set64 on seen, counting the pages it allocates
+static void seen_set(uint64_t v)
+{
+	if (!seen[v >> 16]) {
+		xalloc_account(MEM_DEDUP, RECV_DEDUP_PAGE_BYTES);
+	}
+	pbm_set64(seen, v);
+}
+
+static struct recv_stats *thread_stats(void)
+{
+	if (!local_stats) {
+		local_stats = xmalloc_aligned(_Alignof(struct recv_stats),
+					      sizeof(struct recv_stats));
+		uint32_t i = __atomic_fetch_add(&num_stats_blocks, 1,
+						__ATOMIC_ACQ_REL);
+		assert(i < MAX_RECV_STATS);
+		__atomic_store_n(&stats_blocks[i], local_stats,
+				 __ATOMIC_RELEASE);
+	}
+	return local_stats;
+}
+
+static void **thread_probe_args(void)
+{
+	if (!probe_args) {
+		int n = 1 + zconf.num_extra_probes;
+		probe_args = xcalloc(n, sizeof(void *));
+		for (int i = 0; i < n; i++) {
+			probe_module_t *pm = zconf.probe_module;
+			if (i) {
+				pm = zconf.extra_probes[i - 1].module;
+			}
+			if (pm->recv_thread_initialize &&
+			    pm->recv_thread_initialize(&probe_args[i]) !=
+				EXIT_SUCCESS) {
+				log_fatal("recv",
+					  "Receive thread initialization for "
+					  "probe module %s failed",
+					  pm->name);
+			}
+		}
+	}
+	return probe_args;
+}
+
+static inline void recv_add(uint64_t *stat, uint64_t n)
+{
+	// a plain load and store, as nothing else writes it
+	__atomic_store_n(stat, __atomic_load_n(stat, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+static inline void recv_count(uint64_t *stat) { recv_add(stat, 1); }
+
+static void recv_count_rtt(struct recv_stats *st, fieldset_t *fs)
+{
+	int index = zconf.fsconf.rtt_index;
+	if (index < 0 || index >= fs->len || fs->fields[index].type == FS_NULL) {
+		return;
+	}
+	uint64_t rtt = fs_get_uint64_by_index(fs, index);
+	int bucket = rtt < 2 ? 0 : 63 - __builtin_clzll(rtt);
+	if (bucket >= RTT_BUCKETS) {
+		bucket = RTT_BUCKETS - 1;
+	}
+	recv_count(&st->rtt_samples);
+	recv_add(&st->rtt_sum_us, rtt);
+	recv_count(&st->rtt_buckets[bucket]);
+}
+
+uint64_t recv_rtt_quantile(const struct recv_stats *rs, double q)
+{
+	if (!rs->rtt_samples) {
+		return 0;
+	}
+	uint64_t want = (uint64_t)ceil(q * rs->rtt_samples);
+	uint64_t seen = 0;
+	for (int i = 0; i < RTT_BUCKETS; i++) {
+		seen += rs->rtt_buckets[i];
+		if (seen >= want) {
+			return (2ull << i) - 1;
+		}
+	}
+	return (2ull << (RTT_BUCKETS - 1)) - 1;
+}
+
+void recv_stats_snapshot(struct recv_stats *out)
+{
+	memset(out, 0, sizeof(*out));
+	uint32_t n = __atomic_load_n(&num_stats_blocks, __ATOMIC_ACQUIRE);
+	for (uint32_t i = 0; i < n; i++) {
+		const struct recv_stats *b =
+		    __atomic_load_n(&stats_blocks[i], __ATOMIC_ACQUIRE);
+		if (!b) {
+			// registered, but not yet published
+			continue;
+		}
+		// the block is nothing but uint64_t counters and zeroed padding
+		const uint64_t *src = (const uint64_t *)b;
+		uint64_t *dst = (uint64_t *)out;
+		for (size_t j = 0; j < sizeof(*b) / sizeof(uint64_t); j++) {
+			dst[j] += __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+uint32_t recv_stats_threads(struct recv_stats *out, uint32_t max)
+{
+	uint32_t n = __atomic_load_n(&num_stats_blocks, __ATOMIC_ACQUIRE);
+	uint32_t copied = 0;
+	for (uint32_t i = 0; i < n && copied < max; i++) {
+		const struct recv_stats *b =
+		    __atomic_load_n(&stats_blocks[i], __ATOMIC_ACQUIRE);
+		if (!b) {
+			continue;
+		}
+		const uint64_t *src = (const uint64_t *)b;
+		uint64_t *dst = (uint64_t *)&out[copied++];
+		for (size_t j = 0; j < sizeof(*b) / sizeof(uint64_t); j++) {
+			dst[j] = __atomic_load_n(&src[j], __ATOMIC_RELAXED);
+		}
+	}
+	return copied;
+}
+
+uint64_t recv_success_unique(void)
+{
+	uint64_t unique = 0;
+	uint32_t n = __atomic_load_n(&num_stats_blocks, __ATOMIC_ACQUIRE);
+	for (uint32_t i = 0; i < n; i++) {
+		const struct recv_stats *b =
+		    __atomic_load_n(&stats_blocks[i], __ATOMIC_ACQUIRE);
+		if (b) {
+			unique += __atomic_load_n(&b->success_unique,
+						  __ATOMIC_RELAXED);
+		}
+	}
+	return unique;
+}
+
+static void output_update(void)
+{
+	struct state_recv r = zrecv;
+	recv_stats_snapshot(&r.stats);
+	zconf.output_module->update(&zconf, &zsend, &r);
+}
+
+static inline int probe_validate(const probe_module_t *pm,
+				 const parsed_packet_t *pp, struct ip *ip_hdr,
+				 uint32_t len, uint32_t *src_ip,
+				 uint32_t *validation, void *arg)
+{
+	return pm->validate_parsed
+		   ? pm->validate_parsed(pp, src_ip, validation, zconf.ports,
+					 arg)
+		   : pm->validate_packet(ip_hdr, len, src_ip, validation,
+					 zconf.ports, arg);
+}
+
+// Whether the output filter, or default mode, rejects a response on its
+// IP header fields and success alone, as the probe module tells the latter
+// from the headers. fs holds just the IP header fields.
+static int early_reject(const probe_module_t *pm, const parsed_packet_t *pp,
+			fieldset_t *fs, uint32_t *validation, void *arg,
+			recv_result_t *res)
+{
+	if (!pm->classify || !(zconf.default_mode || zconf.filter.early)) {
+		return 0;
+	}
+	int app_success = 0;
+	int success = pm->classify(pp, validation, &app_success, arg);
+	// the round trip time of a success is sampled from its fields
+	if (success < 0 || (success && zconf.fsconf.rtt_index >= 0)) {
+		return 0;
+	}
+	if (zconf.default_mode) {
+		if (success) {
+			return 0;
+		}
+	} else {
+		// in its place past the IP header fields, where process_packet
+		// writes it again if the response is kept
+		field_t *f = &fs->fields[zconf.fsconf.success_index];
+		f->name = "success";
+		f->type = FS_BOOL;
+		f->free_ = 0;
+		f->len = sizeof(int);
+		f->value.num = success;
+		if (filter_eval(zconf.filter.early, fs)) {
+			return 0;
+		}
+	}
+	res->success = success;
+	res->app_success = app_success;
+	return 1;
+}
+
+void classify_packet(uint32_t buflen, const u_char *bytes,
+		     const struct timespec ts, recv_result_t *res)
 {
 	uint32_t src_ip;
 	struct ip *ip_hdr;
 	uint16_t src_port = 0;
 	uint32_t validation[VALIDATE_BYTES / sizeof(uint8_t)];
 	struct ip6_hdr *ipv6_hdr = NULL;
+	parsed_packet_t pp;
 
-	uint32_t len_ip_and_payload =
-	    buflen - (zconf.send_ip_pkts ? 0 : sizeof(struct ether_header));
+	memset(res, 0, sizeof(*res));
+	res->status = RECV_RESULT_SHORT;
+	res->ts = ts;
 
 	// IPv6
 	if (ipv6) {
@@ -56,195 +373,793 @@ void handle_packet(uint32_t buflen, const u_char *bytes,
 			return;
 		}
 		ipv6_hdr = (struct ip6_hdr *)&bytes[zconf.data_link_size];
-
-		// extract port if TCP or UDP packet to both generate validation data and to
-		// check if the response is a duplicate
-		if (ipv6_hdr->ip6_ctlun.ip6_un1.ip6_un1_nxt == IPPROTO_TCP) {
-			struct tcphdr *tcp = get_tcp_header_ipv6(ipv6_hdr, len_ip_and_payload);
-			if (tcp) {
-				src_port = tcp->th_sport;
-			}
-		} else if (ipv6_hdr->ip6_ctlun.ip6_un1.ip6_un1_nxt == IPPROTO_UDP) {
-			struct udphdr *udp = get_udp_header_ipv6(ipv6_hdr, len_ip_and_payload);
-			if (udp) {
-				src_port = udp->uh_sport;
-			}
-		}
-
-		validate_gen_ipv6(&ipv6_hdr->ip6_dst, &(ipv6_hdr->ip6_src), src_port,
-						 (uint8_t *)validation);
-		ip_hdr = (struct ip *) ipv6_hdr;
+		ip_hdr = (struct ip *)ipv6_hdr;
 	} else {
 		if ((sizeof(struct ip) + zconf.data_link_size) > buflen) {
-        	// buffer not large enough to contain ethernet
-        	// and ip headers. further action would overrun buf
-        	return;
-    	}
-
+			// buffer not large enough to contain ethernet
+			// and ip headers. further action would overrun buf
+			return;
+		}
 		ip_hdr = (struct ip *)&bytes[zconf.data_link_size];
 		src_ip = ip_hdr->ip_src.s_addr;
-		
-
-		// extract port if TCP or UDP packet to both generate validation data and to
-		// check if the response is a duplicate
-		if (ip_hdr->ip_p == IPPROTO_TCP) {
-			struct tcphdr *tcp = get_tcp_header(ip_hdr, len_ip_and_payload);
-			if (tcp) {
-				src_port = tcp->th_sport;
-			}
-		} else if (ip_hdr->ip_p == IPPROTO_UDP) {
-			struct udphdr *udp = get_udp_header(ip_hdr, len_ip_and_payload);
-			if (udp) {
-				src_port = udp->uh_sport;
-			}
-		}
+	}
 
-		// TODO: for TTL exceeded messages, ip_hdr->saddr is going to be
-		// different and we must calculate off potential payload message instead
+	// locate the headers once, in place after whatever link layer header
+	// there is, for validation, dedup and the probe module. The port is
+	// used to both generate validation data and to check if the response
+	// is a duplicate
+	uint32_t len_ip_and_payload = buflen - zconf.data_link_size;
+	parse_packet(ip_hdr, len_ip_and_payload, ipv6, &pp);
+	src_port = htons(pp.sport);
+	if (ipv6) {
+		validate_gen_ipv6(&ipv6_hdr->ip6_dst, &(ipv6_hdr->ip6_src),
+				  src_port, (uint8_t *)validation);
+	} else {
+		// of the responder: for the ICMP errors that quote a probe,
+		// such as time exceeded, that is a router, and the probe
+		// module makes it again of the probe's target
 		validate_gen(ip_hdr->ip_dst.s_addr, ip_hdr->ip_src.s_addr, src_port,
 			     (uint8_t *)validation);
 	}
 
-	if (!zconf.probe_module->validate_packet(
-		ip_hdr, len_ip_and_payload, &src_ip, validation, zconf.ports)) {
-		zrecv.validation_failed++;
+	void **args = thread_probe_args();
+	const probe_module_t *pm = zconf.probe_module;
+	fielddefset_t *fds = &zconf.fsconf.defs;
+	void *arg = args[0];
+	uint32_t packet_src_ip = src_ip;
+	int valid = probe_validate(pm, &pp, ip_hdr, len_ip_and_payload,
+				   &src_ip, validation, arg);
+	// then the --extra-probe-module ones, in order
+	for (int i = 0; !valid && i < zconf.num_extra_probes; i++) {
+		extra_probe_t *p = &zconf.extra_probes[i];
+		pm = p->module;
+		fds = &p->fsconf.defs;
+		arg = args[i + 1];
+		src_ip = packet_src_ip;
+		valid = probe_validate(pm, &pp, ip_hdr, len_ip_and_payload,
+				       &src_ip, validation, arg);
+		if (valid) {
+			res->probe = i + 1;
+		}
+	}
+	if (!valid) {
+		res->status = RECV_RESULT_INVALID;
+		return;
+	}
+	if (ipv6 && ipv6_source_is_pool()) {
+		// the response must be to the source its target was probed
+		// from, which for an ICMPv6 error is in the quoted probe
+		const struct in6_addr *dst = &ipv6_hdr->ip6_dst;
+		const struct in6_addr *target = &ipv6_hdr->ip6_src;
+		const uint8_t *l4 = (const uint8_t *)ip_hdr + pp.l4_off;
+		if (pp.proto == IPPROTO_ICMPV6 &&
+		    pp.l4_len >= 8 + sizeof(struct ip6_hdr) && l4[0] < 128) {
+			const struct ip6_hdr *probe =
+			    (const struct ip6_hdr *)(l4 + 8);
+			dst = &probe->ip6_src;
+			target = &probe->ip6_dst;
+		}
+		if (!ipv6_source_check(dst, target)) {
+			res->status = RECV_RESULT_INVALID;
+			return;
+		}
+	}
+	if (zconf.capture_only_filename) {
+		// the frame itself is kept, for --replay-pcap to classify
+		res->status = RECV_RESULT_VALID;
 		return;
+	}
+
+	if (pm->followup) {
+		res->followup = pm->followup(&pp, validation, arg);
+	}
+
+	// woo! We've validated that the packet is a response to our scan
+	res->status = RECV_RESULT_VALID;
+	res->src_ip = src_ip;
+	res->src_port = src_port;
+	if (ipv6) {
+		res->fp6 = ipv6_fingerprint(&ipv6_hdr->ip6_src, src_port);
+		res->src6 = ipv6_hdr->ip6_src;
 	} else {
-		zrecv.validation_passed++;
+		// track whether this is the first packet in an IP fragment.
+		res->fragment = (ip_hdr->ip_off & IP_MF) != 0;
 	}
 
+	fieldset_t *fs = fs_new_fieldset(fds);
 	// IPv6
-	int is_repeat;
 	if (ipv6) {
-		is_repeat = 0;
+		fs_add_ipv6_fields(fs, ipv6_hdr);
 	} else {
-		// woo! We've validated that the packet is a response to our scan
-		is_repeat = 0;
+		fs_add_ip_fields(fs, ip_hdr);
+	}
+	if (!res->probe && early_reject(pm, &pp, fs, validation, arg, res)) {
+		fs_free(fs);
+		return;
+	}
+
+	pm->process_packet(&pp, fs, validation, ts, arg);
+	res->fs = fs;
+}
+
+static const char DELTA_PRIOR[] = "prior";
+static const char DELTA_REST[] = "rest";
+
+// which --delta-from stratum an IPv4 target was in
+static inline const char *delta_stratum(uint32_t ip)
+{
+	if (!zsend.delta_prior_set || ipv6) {
+		return NULL;
+	}
+	return cbm_check(zsend.delta_prior_set, ntohl(ip)) ? DELTA_PRIOR
+							   : DELTA_REST;
+}
+
+void emit_packet(recv_result_t *res)
+{
+	if (res->status == RECV_RESULT_SHORT) {
+		return;
+	}
+	struct recv_stats *st = thread_stats();
+	if (res->status == RECV_RESULT_INVALID) {
+		recv_count(&st->validation_failed);
+		return;
+	}
+	if (res->probe) {
+		// not deduplicated, counted or filtered with the main module's
+		fs_add_system_fields(res->fs, 0, zsend.complete,
+				     delta_stratum(res->src_ip), res->ts);
+		extra_probe_emit(&zconf.extra_probes[res->probe - 1], res->fs);
+		return;
+	}
+	recv_count(&st->validation_passed);
+
+	uint32_t src_ip = res->src_ip;
+	uint16_t src_port = res->src_port;
+	int is_repeat = 0;
+	fieldset_t *fs = res->fs;
+	const char *stratum = delta_stratum(src_ip);
+	if (res->followup) {
+		// not counted as the probes' responses, and repeats only of
+		// each other
+		uint64_t fp = ipv6 ? res->fp6
+				   : fmix64(((uint64_t)src_ip << 16) | src_port);
+		if (seen_followup) {
+			is_repeat = fpset_check(seen_followup, fp);
+			fpset_set(seen_followup, fp);
+		}
+		if (!fs || (is_repeat && zconf.default_mode)) {
+			goto cleanup;
+		}
+		fs_add_system_fields(fs, is_repeat, zsend.complete, stratum,
+				     res->ts);
+		goto output;
+	}
+	if (ipv6) {
 		if (zconf.dedup_method == DEDUP_METHOD_FULL) {
-			is_repeat = pbm_check(seen, ntohl(src_ip));
+			is_repeat = fpset_check(seen6, res->fp6);
 		} else if (zconf.dedup_method == DEDUP_METHOD_WINDOW) {
-			target_t t = {.ip = src_ip, .port = src_port, .status = 0};
-			if (cachehash_get(ch, &t, sizeof(target_t))) {
-				is_repeat = 1;
+			is_repeat = window_check_and_set(res->fp6, res->ts);
+		}
+	} else {
+		if (zconf.dedup_method == DEDUP_METHOD_FULL) {
+			if (seen_flat) {
+				is_repeat = flat_bm_check(seen_flat, ntohl(src_ip));
+			} else if (seen_cbm) {
+				is_repeat = cbm_check(seen_cbm,
+						      seen_key(src_ip, src_port));
 			} else {
-				cachehash_put(ch, &t, sizeof(target_t), (void *)1);
+				is_repeat = pbm_check64(seen, seen_key(src_ip, src_port));
 			}
+		} else if (zconf.dedup_method == DEDUP_METHOD_WINDOW) {
+			// fmix64 is a bijection, so distinct (address, port)
+			// pairs never share a fingerprint
+			is_repeat = window_check_and_set(
+			    fmix64(((uint64_t)src_ip << 16) | src_port), res->ts);
 		}
-		// track whether this is the first packet in an IP fragment.
-		if (ip_hdr->ip_off & IP_MF) {
-			zrecv.ip_fragments++;
+		if (res->fragment) {
+			recv_count(&st->ip_fragments);
 		}
 	}
 
-	fieldset_t *fs = fs_new_fieldset(&zconf.fsconf.defs);
-	// IPv6
-	if (ipv6) {
-		fs_add_ipv6_fields(fs, ipv6_hdr);
-	} else {
-		fs_add_ip_fields(fs, ip_hdr);
+	int is_success = res->success;
+	if (fs) {
+		fs_add_system_fields(fs, is_repeat, zsend.complete, stratum,
+				     res->ts);
+		int success_index = zconf.fsconf.success_index;
+		assert(success_index < fs->len);
+		is_success = fs_get_uint64_by_index(fs, success_index);
 	}
 
-	// HACK:
-	// probe modules expect the full ethernet frame
-	// in process_packet. For VPN, we only get back an IP frame.
-	// Here, we fake an ethernet frame (which is initialized to
-	// have ETH_P_IP proto and 00s for dest/src).
-	if (zconf.send_ip_pkts) {
-		static const uint32_t available_space = sizeof(fake_eth_hdr) - sizeof(struct ether_header);
-		assert(buflen > (uint32_t)zconf.data_link_size);
-		buflen -= zconf.data_link_size;
-		if (buflen > available_space) {
-			buflen = available_space;
-		}
-		memcpy(&fake_eth_hdr[sizeof(struct ether_header)],
-		       bytes + zconf.data_link_size, buflen);
-		bytes = fake_eth_hdr;
-		buflen += sizeof(struct ether_header);
-	}
-	zconf.probe_module->process_packet(bytes, buflen, fs, validation, ts);
-	fs_add_system_fields(fs, is_repeat, zsend.complete, ts);
-	int success_index = zconf.fsconf.success_index;
-	assert(success_index < fs->len);
-	int is_success = fs_get_uint64_by_index(fs, success_index);
-
 	if (is_success) {
-		zrecv.success_total++;
+		recv_count(&st->success_total);
 		if (!is_repeat) {
-			zrecv.success_unique++;
+			recv_count(&st->success_unique);
+			if (stratum == DELTA_PRIOR) {
+				recv_count(&st->success_unique_prior);
+			}
+			if (zsample.hits && !ipv6) {
+				sample_count(zsample.hits, ntohl(src_ip));
+			}
+			if (zshaping.probed && !ipv6) {
+				shaping_success(ntohl(src_ip));
+			}
+			if (ipv6 && zconf.ipv6_alias_detect) {
+				ipv6_alias_success(&res->src6);
+			}
+			unique_since_update++;
+			// a repeat's time is that of a retransmission
+			if (fs) {
+				recv_count_rtt(st, fs);
+			}
 			if (zconf.dedup_method == DEDUP_METHOD_FULL) {
-				pbm_set(seen, ntohl(src_ip));
-			} else if (zconf.dedup_method == DEDUP_METHOD_WINDOW) {
+				if (ipv6) {
+					fpset_set(seen6, res->fp6);
+				} else if (seen_flat) {
+					flat_bm_set(seen_flat, ntohl(src_ip));
+				} else if (seen_cbm) {
+					pthread_mutex_lock(&seen_cbm_lock);
+					cbm_set(seen_cbm, seen_key(src_ip, src_port));
+					pthread_mutex_unlock(&seen_cbm_lock);
+				} else {
+					seen_set(seen_key(src_ip, src_port));
+				}
 			}
 		}
 		if (zsend.complete) {
-			zrecv.cooldown_total++;
+			recv_count(&st->cooldown_total);
 			if (!is_repeat) {
-				zrecv.cooldown_unique++;
+				recv_count(&st->cooldown_unique);
 			}
 		}
 	} else {
-		zrecv.failure_total++;
+		recv_count(&st->failure_total);
 	}
 	// probe module includes app_success field
 	if (zconf.fsconf.app_success_index >= 0) {
 		int is_app_success =
-		    fs_get_uint64_by_index(fs, zconf.fsconf.app_success_index);
+		    fs ? fs_get_uint64_by_index(fs, zconf.fsconf.app_success_index)
+		       : res->app_success;
 		if (is_app_success) {
-			zrecv.app_success_total++;
+			recv_count(&st->app_success_total);
 			if (!is_repeat) {
-				zrecv.app_success_unique++;
+				recv_count(&st->app_success_unique);
 			}
 		}
 	}
 
-	fieldset_t *o = NULL;
-	// we need to translate the data provided by the probe module
-	// into a fieldset that can be used by the output module
+	// the output module gets the fields the user asked for, in their order:
+	// a view over the probe module's fieldset if it takes one, else a copy
+	if (!fs) {
+		goto cleanup;
+	}
 	if (!is_success && zconf.default_mode) {
 		goto cleanup;
 	}
 	if (is_repeat && zconf.default_mode) {
 		goto cleanup;
 	}
-	if (!evaluate_expression(zconf.filter.expression, fs)) {
+output:
+	if (!filter_eval(zconf.filter.program, fs)) {
+		goto cleanup;
+	}
+	if (recv_max_results_reached()) {
+		// other receive threads may have reached --max-results
 		goto cleanup;
 	}
-	zrecv.filter_success++;
-	o = translate_fieldset(fs, &zconf.fsconf.translation);
-	if (zconf.output_module && zconf.output_module->process_ip) {
-		zconf.output_module->process_ip(o);
+	__atomic_store_n(&zrecv.filter_success, recv_filter_success() + 1,
+			 __ATOMIC_RELAXED);
+	if (zconf.output_queue_size) {
+		// the output thread calls the output module, update included
+		output_queue_push(fs, &zconf.fsconf.translation);
+		fs_free(fs);
+		return;
+	}
+	if (zconf.output_module && zconf.output_module->process_view) {
+		fs_view_t view = {.fs = fs, .t = &zconf.fsconf.translation};
+		zconf.output_module->process_view(&view);
+	} else if (zconf.output_module && zconf.output_module->process_ip) {
+		if (!translated) {
+			translated =
+			    fs_new_heap_fieldset(zconf.fsconf.translation.len);
+		}
+		fs_translate_into(translated, fs, &zconf.fsconf.translation);
+		zconf.output_module->process_ip(translated);
 	}
 cleanup:
 	fs_free(fs);
-	free(o);
-	if (zconf.output_module && zconf.output_module->update &&
-	    !(zrecv.success_unique % zconf.output_module->update_interval)) {
-		zconf.output_module->update(&zconf, &zsend, &zrecv);
+	if (!zconf.output_queue_size && zconf.output_module &&
+	    zconf.output_module->update &&
+	    unique_since_update >= zconf.output_module->update_interval) {
+		unique_since_update = 0;
+		output_update();
+	}
+}
+
+// the byte of the flat dedup bitmap a response will be looked up in
+static inline void prefetch_seen(const recv_result_t *res)
+{
+	if (seen_flat && res->status == RECV_RESULT_VALID && !res->probe) {
+		__builtin_prefetch(&seen_flat[ntohl(res->src_ip) >> 3]);
+	}
+}
+
+// --capture-only: the frames that passed validation are stored as they
+// were captured, and only counted
+static void capture_packets(const pkt_ref_t *pkts, const recv_result_t *res,
+			    size_t n)
+{
+	struct recv_stats *st = thread_stats();
+	for (size_t i = 0; i < n; i++) {
+		if (res[i].status == RECV_RESULT_SHORT) {
+			continue;
+		}
+		if (res[i].status == RECV_RESULT_INVALID) {
+			recv_count(&st->validation_failed);
+			continue;
+		}
+		recv_count(&st->validation_passed);
+		uint64_t t0 = stage_begin(STAGE_EMIT);
+		capture_file_write(pkts[i].ts, pkts[i].bytes, pkts[i].len);
+		stage_end(STAGE_EMIT, t0);
+	}
+}
+
+void handle_packets(const pkt_ref_t *pkts, size_t n)
+{
+	if (pipeline) {
+		for (size_t i = 0; i < n; i++) {
+			recv_pipeline_push(capture_idx, pkts[i].len,
+					   pkts[i].bytes, pkts[i].ts);
+		}
+		return;
+	}
+	if (!arena.base) {
+		fs_arena_init(&arena, RECV_ARENA_SIZE);
+		fs_arena_use(&arena);
+	}
+	recv_result_t res[RECV_BATCH];
+	while (n) {
+		size_t m = n < RECV_BATCH ? n : RECV_BATCH;
+		// every frame is classified before any is emitted, so the
+		// next one's headers and dedup bits are fetched while the
+		// current one is worked on, and the lock is taken once
+		for (size_t i = 0; i < m; i++) {
+			if (i + 1 < m) {
+				__builtin_prefetch(pkts[i + 1].bytes +
+						   zconf.data_link_size);
+			}
+			uint64_t t0 = stage_begin(STAGE_CLASSIFY);
+			classify_packet(pkts[i].len, pkts[i].bytes, pkts[i].ts,
+					&res[i]);
+			stage_end(STAGE_CLASSIFY, t0);
+		}
+		if (zconf.capture_only_filename) {
+			capture_packets(pkts, res, m);
+			pkts += m;
+			n -= m;
+			continue;
+		}
+		if (recv_locking) {
+			pthread_mutex_lock(&recv_lock);
+		}
+		prefetch_seen(&res[0]);
+		for (size_t i = 0; i < m; i++) {
+			if (i + 1 < m) {
+				prefetch_seen(&res[i + 1]);
+			}
+			uint64_t t0 = stage_begin(STAGE_EMIT);
+			emit_packet(&res[i]);
+			stage_end(STAGE_EMIT, t0);
+		}
+		if (recv_locking) {
+			pthread_mutex_unlock(&recv_lock);
+		}
+		fs_arena_reset(&arena);
+		pkts += m;
+		n -= m;
+	}
+}
+
+void handle_packet(uint32_t buflen, const u_char *bytes,
+		   const struct timespec ts)
+{
+	pkt_ref_t pkt = {.bytes = bytes, .len = buflen, .ts = ts};
+	handle_packets(&pkt, 1);
+}
+
+static void *capture_thread(void *arg)
+{
+	struct capture_arg *c = arg;
+	capture_idx = c->idx;
+	log_debug("recv", "Pinning a receive thread to core %u", c->cpu);
+	set_cpu(c->cpu);
+	free(c);
+	recv_init();
+	__atomic_add_fetch(&capture_threads_ready, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&capture_threads_stop, __ATOMIC_ACQUIRE)) {
+		recv_packets();
+	}
+	pthread_mutex_lock(capture_ready_mutex);
+	recv_cleanup();
+	pthread_mutex_unlock(capture_ready_mutex);
+	return NULL;
+}
+
+// --adaptive-cooldown looks at the responses every so often, over windows
+// at least as long as nearly all round trips, and waits at least twice
+// that before giving up on the stragglers
+#define COOLDOWN_CHECK_SECS 0.1
+#define COOLDOWN_MIN_WINDOW_SECS 0.25
+#define COOLDOWN_MIN_WAIT_SECS 0.5
+// without round-trip times to go by
+#define COOLDOWN_NO_RTT_WAIT_SECS 1.0
+
+static int cooldown_drained(double t, double elapsed)
+{
+	static double last_check = 0;
+	static double scan_rate = -1;
+	static double window = 0, min_wait = 0;
+	static double window_start = 0;
+	static uint64_t window_start_count = 0;
+	if (t - last_check < COOLDOWN_CHECK_SECS) {
+		return 0;
+	}
+	last_check = t;
+	struct recv_stats rs;
+	recv_stats_snapshot(&rs);
+	if (scan_rate < 0) {
+		// the first look once sending is done
+		double sending = zsend.finish - zsend.start;
+		scan_rate = sending > 0 ? rs.validation_passed / sending : 0;
+		double rtt = recv_rtt_quantile(&rs, 0.99) / 1e6;
+		window = rtt > COOLDOWN_MIN_WINDOW_SECS ? rtt
+							: COOLDOWN_MIN_WINDOW_SECS;
+		min_wait = rs.rtt_samples ? 2 * window : COOLDOWN_NO_RTT_WAIT_SECS;
+		if (min_wait < COOLDOWN_MIN_WAIT_SECS) {
+			min_wait = COOLDOWN_MIN_WAIT_SECS;
+		}
+		window_start = t;
+		window_start_count = rs.validation_passed;
+		log_debug("recv",
+			  "adaptive cooldown: %.0f responses/s during the scan, "
+			  "windows of %.2fs, waiting at least %.2fs",
+			  scan_rate, window, min_wait);
+		return 0;
+	}
+	if (t - window_start < window) {
+		return 0;
+	}
+	double rate = (rs.validation_passed - window_start_count) /
+		      (t - window_start);
+	window_start = t;
+	window_start_count = rs.validation_passed;
+	if (elapsed < min_wait) {
+		return 0;
+	}
+	if (rate > scan_rate * zconf.adaptive_cooldown / 100) {
+		return 0;
+	}
+	log_info("recv",
+		 "responses have drained to %.0f/s (%.0f/s during the scan), "
+		 "ending the cooldown after %.1fs",
+		 rate, scan_rate, elapsed);
+	return 1;
+}
+
+uint64_t recv_outstanding(const struct recv_stats *rs, uint64_t targets)
+{
+	return targets > rs->success_unique ? targets - rs->success_unique : 0;
+}
+
+// --end-when-answered: the targets that haven't answered have all had
+// their last probe out since sending finished, so they have aged past
+// the 99th percentile round trip once that much time has passed
+static int cooldown_answered(double t, double elapsed)
+{
+	static double last_check = 0;
+	if (t - last_check < COOLDOWN_CHECK_SECS) {
+		return 0;
+	}
+	last_check = t;
+	struct recv_stats rs;
+	recv_stats_snapshot(&rs);
+	uint64_t outstanding = recv_outstanding(&rs, zsend.targets_scanned);
+	if (!outstanding) {
+		log_info("recv",
+			 "every target has answered, ending the cooldown after "
+			 "%.1fs",
+			 elapsed);
+		return 1;
+	}
+	if (!rs.rtt_samples) {
+		return 0;
+	}
+	double rtt = recv_rtt_quantile(&rs, 0.99) / 1e6;
+	if (rtt < COOLDOWN_MIN_WINDOW_SECS) {
+		rtt = COOLDOWN_MIN_WINDOW_SECS;
+	}
+	if (elapsed < rtt) {
+		return 0;
+	}
+	log_info("recv",
+		 "%" PRIu64 " targets are still outstanding %.2fs after the "
+		 "last probe, past the 99th percentile round trip, ending the "
+		 "cooldown",
+		 outstanding, elapsed);
+	return 1;
+}
+
+// set by the receive backend at the end of --replay-pcap
+static int replay_done = 0;
+
+void recv_replay_finished(void)
+{
+	__atomic_store_n(&replay_done, 1, __ATOMIC_RELEASE);
+}
+
+static int cooldown_over(void)
+{
+	if (zconf.replay_filename) {
+		// nothing is sent, so there is no cooldown to wait out
+		return __atomic_load_n(&replay_done, __ATOMIC_ACQUIRE);
+	}
+	if (!zsend.complete) {
+		return 0;
+	}
+	double t = now();
+	double elapsed = t - zsend.finish;
+	if (elapsed > zconf.cooldown_secs) {
+		return 1;
+	}
+	if (zconf.end_when_answered && cooldown_answered(t, elapsed)) {
+		return 1;
+	}
+	return zconf.adaptive_cooldown > 0 && cooldown_drained(t, elapsed);
+}
+
+int recv_responded(ipaddr_n_t ip, port_n_t port)
+{
+	if (seen_flat) {
+		return flat_bm_check(seen_flat, ntohl(ip));
+	}
+	if (seen_cbm) {
+		pthread_mutex_lock(&seen_cbm_lock);
+		int is = cbm_check(seen_cbm, seen_key(ip, port));
+		pthread_mutex_unlock(&seen_cbm_lock);
+		return is;
+	}
+	if (seen) {
+		uint64_t v = seen_key(ip, port);
+		uint8_t *page = __atomic_load_n(&seen[v >> 16], __ATOMIC_ACQUIRE);
+		return page && bm_check(page, (uint16_t)(v & 0xFFFF));
+	}
+	return 0;
+}
+
+int recv_dedup_get_page(uint32_t page, uint8_t *out)
+{
+	const uint8_t *bits = NULL;
+	if (seen_slots > 1) {
+		return 0;
+	}
+	if (seen_cbm) {
+		pthread_mutex_lock(&seen_cbm_lock);
+		int any = cbm_get_page(seen_cbm, page, out);
+		pthread_mutex_unlock(&seen_cbm_lock);
+		return any;
+	}
+	if (seen_flat) {
+		bits = seen_flat + (size_t)page * RECV_DEDUP_PAGE_BYTES;
+	} else if (seen) {
+		bits = __atomic_load_n(&seen[page], __ATOMIC_ACQUIRE);
+	}
+	if (!bits) {
+		return 0;
+	}
+	int any = 0;
+	for (size_t i = 0; i < RECV_DEDUP_PAGE_BYTES; i++) {
+		out[i] = __atomic_load_n(&bits[i], __ATOMIC_RELAXED);
+		any |= out[i];
+	}
+	return any != 0;
+}
+
+void recv_dedup_merge_page(uint32_t page, const uint8_t *in)
+{
+	if (seen_flat) {
+		uint8_t *bits = seen_flat + (size_t)page * RECV_DEDUP_PAGE_BYTES;
+		for (size_t i = 0; i < RECV_DEDUP_PAGE_BYTES; i++) {
+			bits[i] |= in[i];
+		}
+		return;
+	}
+	if ((!seen && !seen_cbm) || seen_slots > 1) {
+		return;
+	}
+	uint32_t base = page << 16;
+	for (uint32_t i = 0; i < RECV_DEDUP_PAGE_BYTES; i++) {
+		for (uint32_t b = 0; in[i] >> b; b++) {
+			if (in[i] & (1 << b)) {
+				if (seen_cbm) {
+					cbm_set(seen_cbm, base | (i << 3) | b);
+				} else {
+					seen_set(base | (i << 3) | b);
+				}
+			}
+		}
+	}
+}
+
+// --capture-buffer, by default sized to hold CAPTURE_BUFFER_SECS of the
+// responses expected at the send rate, each frame taking the snap length
+// and CAPTURE_FRAME_OVERHEAD of headers
+#define CAPTURE_BUFFER_SECS 2
+#define CAPTURE_FRAME_OVERHEAD 128
+#define CAPTURE_BUFFER_MIN (2ULL << 20)
+#define CAPTURE_BUFFER_MAX (512ULL << 20)
+
+uint64_t recv_capture_buffer_bytes(void)
+{
+	if (zconf.capture_buffer_mb) {
+		return (uint64_t)zconf.capture_buffer_mb << 20;
+	}
+	int rate = zconf.adaptive_rate > zconf.rate ? zconf.adaptive_rate
+						    : zconf.rate;
+	if (rate <= 0) {
+		return CAPTURE_BUFFER_MAX;
+	}
+	// the fanout spreads responses evenly across the capture threads
+	double frames = rate * zconf.expected_hitrate * CAPTURE_BUFFER_SECS /
+			(zconf.recv_threads ? zconf.recv_threads : 1);
+	double bytes =
+	    frames * (probes_pcap_snaplen() + CAPTURE_FRAME_OVERHEAD);
+	if (bytes < CAPTURE_BUFFER_MIN) {
+		return CAPTURE_BUFFER_MIN;
+	}
+	if (bytes > CAPTURE_BUFFER_MAX) {
+		return CAPTURE_BUFFER_MAX;
+	}
+	return (uint64_t)bytes;
+}
+
+void recv_memory_estimate(uint64_t est[MEM_TAGS])
+{
+#if !defined(PFRING) && !defined(NETMAP) && !defined(XDP) && !defined(DPDK)
+	if (!zconf.replay_filename) {
+		est[MEM_PACKETS] +=
+		    (uint64_t)zconf.recv_threads * recv_capture_buffer_bytes();
+	}
+#endif
+	uint64_t ports = zconf.ports->port_count;
+	uint64_t targets = zconf.list_of_ips_count ? zconf.list_of_ips_count
+						   : zconf.total_allowed;
+	if (zconf.ipv6_target_patterns_len) {
+		targets = ipv6_pattern_count();
+	}
+	if (zsend.max_targets && zsend.max_targets < targets) {
+		targets = zsend.max_targets;
+	}
+	uint64_t keys = targets * ports;
+	if (zconf.dedup_method == DEDUP_METHOD_FULL && zconf.ipv6) {
+		est[MEM_DEDUP] += fpset_bytes(keys);
+	} else if (zconf.dedup_method == DEDUP_METHOD_FULL &&
+		   zconf.flat_bitmap) {
+		est[MEM_DEDUP] += FLAT_BM_SIZE_IN_BYTES;
+	} else if (zconf.dedup_method == DEDUP_METHOD_FULL) {
+		uint64_t slots = ports > 1 ? ports + 1 : 1;
+		uint64_t pages = (slots << 32) >> 16;
+		uint64_t used = keys < pages ? keys : pages;
+		est[MEM_DEDUP] += pages * sizeof(uint8_t *);
+		if (slots > 1) {
+			est[MEM_DEDUP] += (0xFFFF + 1) * sizeof(uint32_t);
+		}
+		if (zconf.compressed_bitmap) {
+			// sorted arrays until a page is dense enough to go to
+			// a bitmap of the same size
+			uint64_t arrays = keys * sizeof(uint16_t);
+			uint64_t bitmaps = used * CBM_PAGE_BYTES;
+			est[MEM_DEDUP] += arrays < bitmaps ? arrays : bitmaps;
+		} else {
+			est[MEM_DEDUP] += used * RECV_DEDUP_PAGE_BYTES;
+		}
+	} else if (zconf.dedup_method == DEDUP_METHOD_WINDOW &&
+		   zconf.dedup_window_time > 0) {
+		est[MEM_DEDUP_WINDOW] +=
+		    fpgen_bytes((uint64_t)(zconf.dedup_window_time * 1e9),
+				(uint64_t)(zconf.rate > 0 ? zconf.rate : 0));
+	} else if (zconf.dedup_method == DEDUP_METHOD_WINDOW) {
+		est[MEM_DEDUP_WINDOW] += fpwindow_bytes(zconf.dedup_window_size);
+	}
+	if (zconf.recv_processing_threads) {
+		recv_pipeline_memory_estimate(zconf.recv_threads,
+					      zconf.recv_processing_threads,
+					      est);
+	} else {
+		est[MEM_RESULTS] += (uint64_t)zconf.recv_threads *
+				    RECV_ARENA_SIZE;
 	}
 }
 
-int recv_run(pthread_mutex_t *recv_ready_mutex)
+// the frames the interfaces had received as the capture started
+static uint64_t rx_start = 0;
+
+void recv_start(pthread_mutex_t *recv_ready_mutex, const uint32_t *worker_cpus)
 {
 	// IPv6
-	if (zconf.ipv6_target_filename) {
+	if (zconf.ipv6) {
 		ipv6 = 1;
 	}
 
 	log_trace("recv", "recv thread started");
-	log_debug("recv", "capturing responses on %s", zconf.iface);
+	if (zconf.replay_filename) {
+		log_debug("recv", "replaying responses from %s",
+			  zconf.replay_filename);
+	} else if (zconf.num_ifaces > 1) {
+		log_debug("recv", "capturing responses on %u interfaces",
+			  zconf.num_ifaces);
+	} else {
+		log_debug("recv", "capturing responses on %s", zconf.iface);
+	}
+	if (zconf.capture_only_filename) {
+		capture_file_open(zconf.capture_only_filename,
+				  zconf.capture_only_max_bytes);
+	}
 	if (!zconf.dryrun) {
 		recv_init();
 	}
-	if (zconf.send_ip_pkts) {
-		struct ether_header *eth = (struct ether_header *)fake_eth_hdr;
-		memset(fake_eth_hdr, 0, sizeof(fake_eth_hdr));
-		eth->ether_type = htons(ETHERTYPE_IP);
+	// the follow-ups' responses come from a few of the targets, and the
+	// set grows with them
+	if (zconf.tcp_payload && zconf.dedup_method != DEDUP_METHOD_NONE) {
+		seen_followup = fpset_init(1024, MEM_DEDUP);
 	}
 	// initialize paged bitmap
-	if (zconf.dedup_method == DEDUP_METHOD_FULL) {
-		seen = pbm_init();
+	if (zconf.dedup_method == DEDUP_METHOD_FULL && ipv6) {
+		// Start at an eighth of the (address, port) targets, since
+		// most targets never answer, and grow from there. Streams
+		// can't be counted up front and start small.
+		uint64_t targets = zconf.ipv6_target_patterns_len
+				       ? ipv6_pattern_count()
+				       : ipv6_target_file_count();
+		uint64_t expected = targets * zconf.ports->port_count / 8;
+		seen6 = fpset_init(expected, MEM_DEDUP);
+	} else if (zconf.dedup_method == DEDUP_METHOD_FULL &&
+		   zconf.flat_bitmap) {
+		seen_flat = flat_bm_init();
+		xalloc_account(MEM_DEDUP, FLAT_BM_SIZE_IN_BYTES);
+	} else if (zconf.dedup_method == DEDUP_METHOD_FULL &&
+		   zconf.ports->port_count > 1) {
+		// pages of 2^16 (address, port) keys, allocated as they
+		// answer, so memory grows with the ports scanned
+		seen_slots = zconf.ports->port_count + 1;
+		port_slot =
+		    xmalloc_tag(MEM_DEDUP, (0xFFFF + 1) * sizeof(uint32_t));
+		for (uint32_t p = 0; p <= 0xFFFF; p++) {
+			port_slot[p] = seen_slots - 1;
+		}
+		for (uint32_t i = 0; i < zconf.ports->port_count; i++) {
+			port_slot[zconf.ports->ports[i]] = i;
+		}
+	}
+	if (zconf.dedup_method == DEDUP_METHOD_FULL && !ipv6 && !seen_flat) {
+		uint64_t pages = ((uint64_t)seen_slots << 32) >> 16;
+		if (zconf.compressed_bitmap) {
+			seen_cbm = cbm_init(pages, MEM_DEDUP);
+		} else {
+			seen = pbm_init_pages(pages);
+			xalloc_account(MEM_DEDUP,
+				       (int64_t)(pages * sizeof(uint8_t *)));
+		}
+	} else if (zconf.dedup_method == DEDUP_METHOD_WINDOW &&
+		   zconf.dedup_window_time > 0) {
+		window_gens =
+		    fpgen_init((uint64_t)(zconf.dedup_window_time * 1e9));
 	} else if (zconf.dedup_method == DEDUP_METHOD_WINDOW) {
-		ch = cachehash_init(zconf.dedup_window_size, NULL);
+		window = fpwindow_init(zconf.dedup_window_size);
+	}
+	// --resume: the addresses that answered before
+	if (seen || seen_flat || seen_cbm) {
+		checkpoint_restore_dedup();
 	}
 	if (zconf.default_mode) {
 		log_info("recv",
@@ -259,29 +1174,115 @@ int recv_run(pthread_mutex_t *recv_ready_mutex)
 		    "recv",
 		    "unsuccessful responses will be passed to the output module");
 	}
+	if (zconf.max_results == 0) {
+		zconf.max_results = -1;
+	}
+	if (!zconf.dryrun && zconf.recv_processing_threads) {
+		pipeline = 1;
+		recv_pipeline_init(zconf.recv_threads,
+				   zconf.recv_processing_threads,
+				   worker_cpus + zconf.recv_threads - 1);
+	}
+	if (!zconf.dryrun && zconf.recv_threads > 1) {
+		recv_locking = !pipeline;
+		capture_ready_mutex = recv_ready_mutex;
+		capture_threads =
+		    xcalloc(zconf.recv_threads - 1, sizeof(pthread_t));
+		for (uint8_t i = 0; i < zconf.recv_threads - 1; i++) {
+			struct capture_arg *c = xmalloc(sizeof(struct capture_arg));
+			c->idx = i + 1;
+			c->cpu = worker_cpus[i];
+			if (pthread_create(&capture_threads[i], NULL,
+					   capture_thread, c)) {
+				log_fatal("recv", "unable to create recv thread");
+			}
+		}
+		// wait for every thread to join the fanout group before
+		// anything is sent
+		while (__atomic_load_n(&capture_threads_ready,
+				       __ATOMIC_SEQ_CST) <
+		       zconf.recv_threads - 1) {
+			usleep(1000);
+		}
+		log_debug("recv", "%d receive threads capturing",
+			  zconf.recv_threads);
+	}
+	if (!zconf.dryrun && !zconf.replay_filename) {
+		rx_start = ifaces_rx_packets();
+	}
 	pthread_mutex_lock(recv_ready_mutex);
 	zconf.recv_ready = 1;
 	pthread_mutex_unlock(recv_ready_mutex);
 	zrecv.start = now();
-	if (zconf.max_results == 0) {
-		zconf.max_results = -1;
+}
+
+int recv_step(void)
+{
+	if (zconf.dryrun) {
+		sleep(1);
+	} else {
+		recv_packets();
+		if (zconf.max_results && recv_max_results_reached()) {
+			return 1;
+		}
 	}
+	return cooldown_over();
+}
 
-	do {
-		if (zconf.dryrun) {
-			sleep(1);
-		} else {
-			recv_packets();
-			if (zconf.max_results &&
-			    zrecv.filter_success >= zconf.max_results) {
-				break;
-			}
+int recv_run(pthread_mutex_t *recv_ready_mutex, const uint32_t *worker_cpus)
+{
+	recv_start(recv_ready_mutex, worker_cpus);
+	while (!recv_step())
+		;
+	recv_finish(recv_ready_mutex);
+	return 0;
+}
+
+void recv_finish(pthread_mutex_t *recv_ready_mutex)
+{
+	if (zsend.complete) {
+		zrecv.cooldown_used = now() - zsend.finish;
+	}
+	if (capture_threads) {
+		__atomic_store_n(&capture_threads_stop, 1, __ATOMIC_RELEASE);
+		for (uint8_t i = 0; i < zconf.recv_threads - 1; i++) {
+			pthread_join(capture_threads[i], NULL);
 		}
-	} while (
-	    !(zsend.complete && (now() - zsend.finish > zconf.cooldown_secs)));
+		xfree(capture_threads);
+		capture_threads = NULL;
+	}
+	if (pipeline) {
+		// let the processing threads and the sequencer drain what
+		// was captured
+		recv_pipeline_finish();
+	}
 	zrecv.finish = now();
+	recv_stats_snapshot(&zrecv.stats);
 	// get final pcap statistics before closing
 	recv_update_stats();
+#ifdef XDP_FILTER
+	xdp_filter_update_stats();
+	if (zconf.xdp_filter) {
+		log_info("recv",
+			 "XDP pre-filter handed %" PRIu64 " frames to zmap, "
+			 "left %" PRIu64 " to the host and dropped %" PRIu64
+			 " repeated SYN-ACKs",
+			 zrecv.xdp_scan, zrecv.xdp_other, zrecv.xdp_duplicates);
+	}
+#endif
+	uint64_t rx_end = rx_start ? ifaces_rx_packets() : 0;
+	if (rx_end > rx_start) {
+		zrecv.iface_rx = rx_end - rx_start;
+		uint64_t passed = zrecv.pcap_recv < zrecv.iface_rx
+				      ? zrecv.pcap_recv
+				      : zrecv.iface_rx;
+		log_info("recv",
+			 "capture filter passed %" PRIu64 " of %" PRIu64
+			 " frames received (%.1f%% left out in the kernel)",
+			 passed, zrecv.iface_rx,
+			 100.0 * (zrecv.iface_rx - passed) / zrecv.iface_rx);
+	}
+	capture_file_close();
 	if (!zconf.dryrun) {
 		pthread_mutex_lock(recv_ready_mutex);
 		recv_cleanup();
@@ -289,5 +1290,4 @@ int recv_run(pthread_mutex_t *recv_ready_mutex)
 	}
 	zrecv.complete = 1;
 	log_debug("recv", "thread finished");
-	return 0;
 }
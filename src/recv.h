@@ -10,8 +10,77 @@
 #define ZMAP_RECV_H
 
 #include <pthread.h>
+#include <stdint.h>
+
+#include "../lib/types.h"
+#include "../lib/xalloc.h"
+#include "state.h"
+
+#define MAX_RECV_THREADS 64
+
+// the sum of every receiving thread's counts, taken while they count
+void recv_stats_snapshot(struct recv_stats *out);
+// the success_unique of the snapshot alone
+uint64_t recv_success_unique(void);
+// an upper bound, in microseconds, on the q quantile (0 < q <= 1) of the
+// round-trip times in rs: the top of the bucket it falls in, 0 with none
+uint64_t recv_rtt_quantile(const struct recv_stats *rs, double q);
+// of targets sent, those without a unique success in rs, for
+// --end-when-answered
+uint64_t recv_outstanding(const struct recv_stats *rs, uint64_t targets);
+// a copy of each receiving thread's counts, in the order they started
+// counting, up to max of them; returns how many were copied
+uint32_t recv_stats_threads(struct recv_stats *out, uint32_t max);
+
+static inline uint64_t recv_filter_success(void)
+{
+	return __atomic_load_n(&zrecv.filter_success, __ATOMIC_RELAXED);
+}
+
+static inline int recv_max_results_reached(void)
+{
+	return recv_filter_success() >= zconf.max_results;
+}
 
 int recv_update_stats(void);
-int recv_run(pthread_mutex_t *recv_ready_mutex);
+// the kernel buffer, or TPACKET_V3 ring, of each capture handle
+uint64_t recv_capture_buffer_bytes(void);
+// worker_cpus holds the cores for the zconf.recv_threads - 1 additional
+// capture threads, then for the zconf.recv_processing_threads processing
+// threads and their sequencer
+int recv_run(pthread_mutex_t *recv_ready_mutex, const uint32_t *worker_cpus);
+// What recv_run() does, for --event-loop to interleave with sending: opens
+// the capture, takes what it has waiting (having polled recv_fd(), the
+// capture's descriptor or -1 if it has none) returning whether receiving
+// is over, and closes it
+void recv_start(pthread_mutex_t *recv_ready_mutex, const uint32_t *worker_cpus);
+int recv_fd(void);
+int recv_step(void);
+void recv_finish(pthread_mutex_t *recv_ready_mutex);
+// frames waiting to be classified, and classified frames waiting for the
+// sequencer, across all pipeline rings
+void recv_pipeline_depths(uint64_t *capture, uint64_t *output);
+// the frames all pipeline rings hold, 0 without processing threads
+uint64_t recv_pipeline_capacity(void);
+
+// Whether an IPv4 target (network order) has sent a successful response,
+// as far as the full dedup bitmap tells; always 0 without one. Safe to call
+// from the send threads while responses are counted.
+int recv_responded(ipaddr_n_t ip, port_n_t port);
+
+// The IPv4 full dedup bitmap in pages of RECV_DEDUP_PAGE_BYTES, the
+// addresses sharing their top 16 bits, for --checkpoint-file. get copies a
+// page while responses are still being counted and returns 0 when no
+// address in it has been seen (or there is no bitmap, or it is keyed on
+// (address, port) in a multi-port scan); merge sets the bits of a page saved
+// earlier.
+#define RECV_DEDUP_PAGES 0x10000
+#define RECV_DEDUP_PAGE_BYTES 0x2000
+int recv_dedup_get_page(uint32_t page, uint8_t *out);
+void recv_dedup_merge_page(uint32_t page, const uint8_t *in);
+
+// adds to est what recv_run will allocate under each tag for the scan as
+// configured, for --dry-estimate-memory: dedup as if every target answered
+void recv_memory_estimate(uint64_t est[MEM_TAGS]);
 
 #endif /* ZMP_RECV_H */
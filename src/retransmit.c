@@ -0,0 +1,91 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "retransmit.h"
+
+#include <string.h>
+
+#include "../lib/xalloc.h"
+
+#define RETRANSMIT_TICK_NS 1000000
+// more than this and the ticks grow longer instead
+#define RETRANSMIT_MAX_SLOTS 0x10000
+
+void retransmit_wheel_init(retransmit_wheel_t *w, uint64_t horizon_ns,
+			   uint64_t now_ns)
+{
+	memset(w, 0, sizeof(*w));
+	w->tick_ns = RETRANSMIT_TICK_NS;
+	if (horizon_ns / w->tick_ns > RETRANSMIT_MAX_SLOTS - 2) {
+		w->tick_ns = horizon_ns / (RETRANSMIT_MAX_SLOTS - 2) + 1;
+	}
+	// besides the horizon: the tick being handed out, the one under way and
+	// one for the rounding of due times
+	uint64_t ticks = horizon_ns / w->tick_ns + 3;
+	w->num_slots = 1;
+	while (w->num_slots < ticks) {
+		w->num_slots <<= 1;
+	}
+	w->slots = xcalloc(w->num_slots, sizeof(retransmit_slot_t));
+	w->next_tick = now_ns / w->tick_ns;
+}
+
+void retransmit_wheel_free(retransmit_wheel_t *w)
+{
+	for (uint64_t i = 0; i < w->num_slots; i++) {
+		xfree(w->slots[i].probes);
+	}
+	xfree(w->slots);
+	memset(w, 0, sizeof(*w));
+}
+
+void retransmit_add(retransmit_wheel_t *w, const retransmit_t *r,
+		    uint64_t due_ns)
+{
+	uint64_t tick = due_ns / w->tick_ns;
+	// A thread that fell behind on expiring would wrap around onto a slot
+	// still to come, or the one it is handing out; such probes go in the
+	// last slot before those instead, a little early.
+	if (tick < w->next_tick) {
+		tick = w->next_tick;
+	} else if (tick >= w->next_tick + w->num_slots - 1) {
+		tick = w->next_tick + w->num_slots - 2;
+	}
+	retransmit_slot_t *slot = &w->slots[tick & (w->num_slots - 1)];
+	if (slot->len == slot->capacity) {
+		slot->capacity = slot->capacity ? 2 * slot->capacity : 64;
+		slot->probes = xrealloc(slot->probes,
+					slot->capacity * sizeof(retransmit_t));
+	}
+	slot->probes[slot->len++] = *r;
+	w->pending++;
+}
+
+retransmit_t *retransmit_expire(retransmit_wheel_t *w, uint64_t now_ns,
+				uint32_t *n)
+{
+	// a slot is due once its tick is over, so nothing goes out early
+	uint64_t now_tick = now_ns / w->tick_ns;
+	while (w->pending && w->next_tick < now_tick) {
+		retransmit_slot_t *slot =
+		    &w->slots[w->next_tick & (w->num_slots - 1)];
+		w->next_tick++;
+		if (slot->len) {
+			*n = slot->len;
+			w->pending -= slot->len;
+			// nothing is added to it until the wheel comes around
+			slot->len = 0;
+			return slot->probes;
+		}
+	}
+	if (!w->pending && w->next_tick < now_tick) {
+		w->next_tick = now_tick;
+	}
+	*n = 0;
+	return NULL;
+}
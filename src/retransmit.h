@@ -0,0 +1,67 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_RETRANSMIT_H
+#define ZMAP_RETRANSMIT_H
+
+#include <stdint.h>
+
+#include "../lib/types.h"
+#include "validate.h"
+
+/*
+ * --probe-spacing: a send thread sends the first of the --probes copies to
+ * a target at once and holds the others in a timer wheel of its own, each
+ * due the spacing times its probe number later. Every slot of the wheel
+ * holds the probes due in one tick; a thread expires the slots that are due
+ * as it goes and, once its shard is done, waits out what is left. The
+ * wheel spans the longest delay, so a probe never lands in a slot that
+ * comes around before it is due.
+ */
+
+// one held probe, with what make_packet needs to build it again
+typedef struct retransmit {
+	ipaddr_t src_ip;
+	ipaddr_t dst_ip;
+	uint8_t validation[VALIDATE_BYTES];
+	port_h_t port;
+	uint8_t probe_num;
+	// --prefix-shaping: times the probe was put off (see shaping.h)
+	uint8_t deferrals;
+} retransmit_t;
+
+typedef struct retransmit_slot {
+	retransmit_t *probes;
+	uint32_t len;
+	uint32_t capacity;
+} retransmit_slot_t;
+
+typedef struct retransmit_wheel {
+	retransmit_slot_t *slots;
+	// a power of two, of tick_ns each
+	uint64_t num_slots;
+	uint64_t tick_ns;
+	// the first tick not expired yet
+	uint64_t next_tick;
+	uint64_t pending;
+} retransmit_wheel_t;
+
+// for probes held up to horizon_ns, starting at now_ns
+void retransmit_wheel_init(retransmit_wheel_t *w, uint64_t horizon_ns,
+			   uint64_t now_ns);
+void retransmit_wheel_free(retransmit_wheel_t *w);
+
+void retransmit_add(retransmit_wheel_t *w, const retransmit_t *r,
+		    uint64_t due_ns);
+
+// The probes of the first slot due by now_ns, taken off the wheel, or NULL
+// once none are due. They are valid until the next call.
+retransmit_t *retransmit_expire(retransmit_wheel_t *w, uint64_t now_ns,
+				uint32_t *n);
+
+#endif /* ZMAP_RETRANSMIT_H */
@@ -0,0 +1,222 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "rss.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/logger.h"
+#include "../lib/util.h"
+#include "../lib/xalloc.h"
+#include "state.h"
+
+// 40 bytes, the key length of most NICs, covers the 36 bytes of an IPv6
+// 4-tuple plus the 32 bit window each of them is hashed with
+#define RSS_KEY_LEN 40
+#define RSS_INPUT_LEN 36
+
+// the key drivers default to when none is set
+static const char *default_key =
+    "6d:5a:56:da:25:5b:0e:c2:41:67:25:3d:43:a3:8f:b0:d0:ca:2b:cb"
+    ":ae:7b:30:b4:77:cb:2d:a3:80:30:f2:0c:6a:42:b7:3b:be:ac:01:fa";
+
+// Toeplitz is linear in its input, so the hash of a tuple is the XOR of
+// what each of its bytes contributes at its offset, looked up here
+static uint32_t byte_hash[RSS_INPUT_LEN][256];
+
+// the queues responses are wanted on, in turn
+static uint16_t *steer;
+static uint16_t steer_len;
+static uint8_t *in_steer;
+
+static __thread uint32_t next_steer;
+
+static int parse_key(const char *hex, uint8_t *key)
+{
+	int len = 0;
+	while (*hex) {
+		if (*hex == ':') {
+			hex++;
+			continue;
+		}
+		if (!isxdigit((unsigned char)hex[0]) ||
+		    !isxdigit((unsigned char)hex[1]) || len == RSS_KEY_LEN) {
+			return -1;
+		}
+		char byte[3] = {hex[0], hex[1], '\0'};
+		key[len++] = (uint8_t)strtoul(byte, NULL, 16);
+		hex += 2;
+	}
+	return len;
+}
+
+static void build_tables(const uint8_t *key)
+{
+	for (int pos = 0; pos < RSS_INPUT_LEN; pos++) {
+		// the key bits lined up with each bit of the byte at pos
+		uint64_t bits = 0;
+		for (int i = 0; i < 5; i++) {
+			bits = (bits << 8) | key[pos + i];
+		}
+		uint32_t window[8];
+		for (int b = 0; b < 8; b++) {
+			window[b] = (uint32_t)(bits >> (8 - b));
+		}
+		for (int v = 0; v < 256; v++) {
+			uint32_t h = 0;
+			for (int b = 0; b < 8; b++) {
+				if (v & (0x80 >> b)) {
+					h ^= window[b];
+				}
+			}
+			byte_hash[pos][v] = h;
+		}
+	}
+}
+
+static uint32_t hash_bytes(uint32_t h, int pos, const uint8_t *bytes, int len)
+{
+	for (int i = 0; i < len; i++) {
+		h ^= byte_hash[pos + i][bytes[i]];
+	}
+	return h;
+}
+
+void rss_init(void)
+{
+	uint8_t key[RSS_KEY_LEN];
+	int len = parse_key(zconf.rss.key ? zconf.rss.key : default_key, key);
+	if (len < 0) {
+		log_fatal("rss", "--rss-key must be hex bytes, optionally separated by "
+				 "colons, as printed by ethtool -x");
+	}
+	if (len < RSS_KEY_LEN) {
+		log_fatal("rss", "--rss-key must be %d bytes long, got %d",
+			  RSS_KEY_LEN, len);
+	}
+	build_tables(key);
+
+	in_steer = xcalloc(zconf.rss.queues, sizeof(uint8_t));
+	if (zconf.rss.steer) {
+		const char **queues = NULL;
+		int n = 0;
+		split_string(zconf.rss.steer, &n, &queues);
+		steer = xcalloc(n, sizeof(uint16_t));
+		for (int i = 0; i < n; i++) {
+			char *end;
+			long q = strtol(queues[i], &end, 10);
+			if (*end || q < 0 || q >= zconf.rss.queues) {
+				log_fatal("rss", "--rss-steer queue %s is not one of the "
+						 "%u --rss-queues",
+					  queues[i], zconf.rss.queues);
+			}
+			steer[steer_len++] = (uint16_t)q;
+			in_steer[q] = 1;
+			xfree((void *)queues[i]);
+		}
+		xfree(queues);
+		if (!steer_len) {
+			log_fatal("rss", "--rss-steer lists no queues");
+		}
+	} else {
+		steer = xcalloc(zconf.rss.queues, sizeof(uint16_t));
+		for (uint16_t q = 0; q < zconf.rss.queues; q++) {
+			steer[steer_len++] = q;
+			in_steer[q] = 1;
+		}
+	}
+
+	// Enough tries that a probe hardly ever misses the queue wanted, but
+	// the ports tried for all the streams of a probe must not wrap around
+	// the source port range.
+	int num_ports = zconf.source_port_last - zconf.source_port_first + 1;
+	int candidates = 4 * zconf.rss.queues;
+	if (candidates > num_ports / zconf.packet_streams) {
+		candidates = num_ports / zconf.packet_streams;
+	}
+	if (candidates < 2) {
+		log_fatal("rss", "the source port range is too small to steer "
+				 "responses, it needs at least %d ports",
+			  2 * zconf.packet_streams);
+	}
+	if (candidates < zconf.rss.queues) {
+		log_warn("rss", "only %d source ports can be tried per probe for %u "
+				"queues, responses will be spread unevenly",
+			 candidates, zconf.rss.queues);
+	}
+	zconf.rss.candidates = candidates;
+	log_debug("rss", "steering responses to %u of %u queues, %d source "
+			 "ports tried per probe",
+		  steer_len, zconf.rss.queues, candidates);
+}
+
+uint32_t rss_hash_base(uint32_t target, uint32_t saddr, uint16_t port)
+{
+	uint32_t h = hash_bytes(0, 0, (const uint8_t *)&target, 4);
+	h = hash_bytes(h, 4, (const uint8_t *)&saddr, 4);
+	return hash_bytes(h, 8, (const uint8_t *)&port, 2);
+}
+
+uint32_t rss_hash_base_ipv6(const struct in6_addr *target,
+			    const struct in6_addr *saddr, uint16_t port)
+{
+	uint32_t h = hash_bytes(0, 0, target->s6_addr, 16);
+	h = hash_bytes(h, 16, saddr->s6_addr, 16);
+	return hash_bytes(h, 32, (const uint8_t *)&port, 2);
+}
+
+static inline uint16_t queue_of(uint32_t hash)
+{
+	// the default indirection table of Linux drivers, entry i is queue
+	// i % queues
+	return (uint16_t)((hash % zconf.rss.table_size) % zconf.rss.queues);
+}
+
+void rss_steer(uint32_t *validation, uint32_t hash_base, int probe_num,
+	       int ipv6)
+{
+	const int pos = ipv6 ? 34 : 10;
+	const uint32_t num_ports =
+	    zconf.source_port_last - zconf.source_port_first + 1;
+	const uint32_t stride = zconf.packet_streams;
+	const uint32_t first = validation[1] % num_ports + probe_num;
+	uint16_t want = steer[next_steer++ % steer_len];
+	int chosen = -1;
+	int fallback = -1;
+	for (int k = 0; k < zconf.rss.candidates; k++) {
+		uint16_t port = zconf.source_port_first +
+				(first + k * stride) % num_ports;
+		uint32_t h = hash_base ^ byte_hash[pos][port >> 8] ^
+			     byte_hash[pos + 1][port & 0xFF];
+		uint16_t q = queue_of(h);
+		if (q == want) {
+			chosen = k;
+			break;
+		}
+		if (fallback < 0 && in_steer[q]) {
+			fallback = k;
+		}
+	}
+	if (chosen < 0) {
+		chosen = fallback;
+	}
+	if (chosen <= 0) {
+		return;
+	}
+	// Moves get_src_port() by delta, modulo the port range, leaving the
+	// top byte of validation[1] alone for modules that use it otherwise
+	// (bacnet's invoke id).
+	uint32_t delta = (chosen * stride) % num_ports;
+	if ((validation[1] & 0xFFFFFF) + delta <= 0xFFFFFF) {
+		validation[1] += delta;
+	} else {
+		validation[1] -= num_ports - delta;
+	}
+}
@@ -0,0 +1,45 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_RSS_H
+#define ZMAP_RSS_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * --rss-queues: the NIC hashes the addresses and ports of every response
+ * with Toeplitz and the RSS key, and looks the RX queue up in its
+ * indirection table. Of all that only the source port of the probe is ours
+ * to pick, so for each probe a few source ports are tried, in an order
+ * that never overlaps with the other packet streams, and the first that
+ * sends the response to the queue wanted is used. Queues are wanted in
+ * turn, out of --rss-steer or all of them, so that responses are spread
+ * evenly.
+ *
+ * The ports tried start where get_src_port() would have picked, which
+ * rss_steer() moves by changing validation[1]. check_dst_port() accepts
+ * every port that may have been tried.
+ */
+
+// Parse zconf.rss and build the hash tables. Sets zconf.rss.candidates,
+// the source ports tried per probe.
+void rss_init(void);
+
+// The hash of a response from target:port to saddr, but for its
+// destination port, all in network order.
+uint32_t rss_hash_base(uint32_t target, uint32_t saddr, uint16_t port);
+uint32_t rss_hash_base_ipv6(const struct in6_addr *target,
+			    const struct in6_addr *saddr, uint16_t port);
+
+// Move validation[1] so that get_src_port(probe_num) picks the source port
+// that the response to it is wanted on, given its rss_hash_base().
+void rss_steer(uint32_t *validation, uint32_t hash_base, int probe_num,
+	       int ipv6);
+
+#endif /* ZMAP_RSS_H */
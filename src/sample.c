@@ -0,0 +1,154 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "sample.h"
+
+#include <inttypes.h>
+#include <math.h>
+
+#include "../lib/blocklist.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+#include "aesrand.h"
+#include "state.h"
+
+// z of a two-sided 95% interval
+#define SAMPLE_Z 1.96
+// the precision isn't trusted before this many targets were sent
+#define SAMPLE_MIN_PROBES 1000
+
+sample_t zsample = {.probed = NULL, .hits = NULL, .stop = 0};
+
+// targets sent as of the monitor's last update, whose responses have had
+// an update interval to come in
+static uint64_t probed_last = 0;
+
+void sample_init(void)
+{
+	if (zconf.sample_fraction <= 0) {
+		return;
+	}
+	sample_t *s = &zsample;
+	s->host_bits = 32 - (uint32_t)zconf.sample_prefix;
+	s->host_mask = ((uint32_t)1 << s->host_bits) - 1;
+	s->half_bits = (s->host_bits + 1) / 2;
+	s->half_mask = ((uint32_t)1 << s->half_bits) - 1;
+	s->threshold =
+	    (uint32_t)ceil(zconf.sample_fraction * ((uint64_t)1 << s->host_bits));
+	for (int i = 0; i < SAMPLE_ROUNDS; i++) {
+		s->keys[i] = (uint32_t)aesrand_getword(zconf.aes);
+	}
+	uint64_t strata = (uint64_t)1 << zconf.sample_prefix;
+	s->probed = xcalloc(strata, sizeof(uint64_t));
+	s->hits = xcalloc(strata, sizeof(uint64_t));
+	zsend.planned_targets =
+	    (uint64_t)(blocklist_count_allowed() * zconf.sample_fraction);
+	log_info("sample",
+		 "sampling %.4g of each /%d of the allowed space (%u of %u "
+		 "addresses each)",
+		 zconf.sample_fraction, zconf.sample_prefix, s->threshold,
+		 s->host_mask + 1);
+}
+
+// The stratified estimate with the strata weighted by their targets sent,
+// which for a sample at one fraction everywhere are in proportion to their
+// targets: the variance is that of each stratum's proportion, of those
+// with too few targets to tell the overall one.
+void sample_estimate(sample_estimate_t *e)
+{
+	const sample_t *s = &zsample;
+	uint64_t strata = (uint64_t)1 << zconf.sample_prefix;
+	uint64_t n = 0;
+	uint64_t hits = 0;
+	e->strata = 0;
+	for (uint64_t h = 0; h < strata; h++) {
+		uint64_t n_h = __atomic_load_n(&s->probed[h], __ATOMIC_RELAXED);
+		uint64_t x_h = __atomic_load_n(&s->hits[h], __ATOMIC_RELAXED);
+		n += n_h;
+		hits += x_h < n_h ? x_h : n_h;
+		e->strata += n_h != 0;
+	}
+	e->probed = n;
+	e->hits = hits;
+	e->estimate = n ? (double)hits / n : 0;
+	uint64_t population =
+	    blocklist_count_allowed() * (uint64_t)zconf.ports->port_count;
+	e->fraction_sent = population ? (double)n / population : 0;
+	if (n < 2) {
+		e->margin = 1;
+		return;
+	}
+	double pooled = e->estimate * (1 - e->estimate);
+	double sum = 0;
+	for (uint64_t h = 0; h < strata; h++) {
+		uint64_t n_h = __atomic_load_n(&s->probed[h], __ATOMIC_RELAXED);
+		if (!n_h) {
+			continue;
+		}
+		uint64_t x_h = __atomic_load_n(&s->hits[h], __ATOMIC_RELAXED);
+		double p_h = x_h < n_h ? (double)x_h / n_h : 1;
+		double var_h = n_h > 1 ? p_h * (1 - p_h) * n_h / (n_h - 1)
+				       : pooled;
+		sum += n_h * var_h;
+	}
+	// with the finite population correction for what was sent
+	double fpc = e->fraction_sent < 1 ? 1 - e->fraction_sent : 0;
+	e->margin = SAMPLE_Z * sqrt(fpc * sum) / n;
+}
+
+// Half-width of the Wilson score interval, which unlike the normal one
+// isn't zero while nothing has responded
+static double wilson_margin(uint64_t hits, uint64_t n)
+{
+	double z2 = SAMPLE_Z * SAMPLE_Z;
+	double p = (double)hits / n;
+	return SAMPLE_Z / (1 + z2 / n) *
+	       sqrt(p * (1 - p) / n + z2 / (4.0 * n * n));
+}
+
+void sample_update(void)
+{
+	if (!zsample.probed || sample_stopped()) {
+		return;
+	}
+	sample_estimate_t e;
+	sample_estimate(&e);
+	// the responses to what was sent since the last update may be
+	// outstanding, so the hits are held against the targets before
+	uint64_t n = probed_last;
+	probed_last = e.probed;
+	if (!zconf.sample_precision || n < SAMPLE_MIN_PROBES) {
+		return;
+	}
+	uint64_t hits = e.hits < n ? e.hits : n;
+	double margin = 100 * wilson_margin(hits, n);
+	if (margin <= zconf.sample_precision) {
+		log_info("sample",
+			 "precision reached after %" PRIu64 " targets: %.4f%% "
+			 "+/- %.4f%%, ending the scan",
+			 n, 100.0 * hits / n, margin);
+		__atomic_store_n(&zsample.stop, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void sample_log(void)
+{
+	if (!zsample.probed) {
+		return;
+	}
+	sample_estimate_t e;
+	sample_estimate(&e);
+	log_info("sample",
+		 "%" PRIu64 " of %" PRIu64 " targets responded in %" PRIu64
+		 " strata: %.4f%% +/- %.4f%% (95%% CI) of the allowed space, "
+		 "about %.0f targets",
+		 e.hits, e.probed, e.strata, 100 * e.estimate, 100 * e.margin,
+		 e.estimate * blocklist_count_allowed() *
+		     zconf.ports->port_count);
+}
@@ -0,0 +1,116 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_SAMPLE_H
+#define ZMAP_SAMPLE_H
+
+#include <stdint.h>
+
+/*
+ * --sample: a stratified random sample of the allowed IPv4 space. A stratum
+ * is the addresses sharing their top --sample-strata bits, and of each the
+ * scan keeps those whose host bits a keyed permutation (a Feistel network
+ * over them, cycle-walked to their width, keyed by the stratum too) takes
+ * below fraction * 2^host bits. Every whole stratum is so sampled at exactly
+ * the fraction, while the cyclic iterator still decides the order. Senders
+ * count the targets sent in each stratum and the receiver their unique
+ * successes, from which the monitor estimates the responsive fraction of
+ * the allowed space with its confidence interval, and with
+ * --sample-precision ends sending once the interval is narrow enough.
+ */
+
+#define SAMPLE_ROUNDS 4
+#define SAMPLE_PREFIX_MIN 8
+#define SAMPLE_PREFIX_MAX 20
+
+typedef struct sample {
+	uint32_t host_bits;
+	uint32_t host_mask;
+	// the Feistel network's halves, of half_bits bits each
+	uint32_t half_bits;
+	uint32_t half_mask;
+	// kept if the permuted host bits are below it
+	uint32_t threshold;
+	uint32_t keys[SAMPLE_ROUNDS];
+	// per stratum: targets sent and their unique successes. NULL unless
+	// sampling.
+	uint64_t *probed;
+	uint64_t *hits;
+	// set by the monitor once the precision is reached
+	int stop;
+} sample_t;
+
+extern sample_t zsample;
+
+typedef struct sample_estimate {
+	uint64_t probed;
+	uint64_t hits;
+	// strata with any target sent
+	uint64_t strata;
+	// of the targets in the allowed space, those sent
+	double fraction_sent;
+	// the responsive fraction of the allowed targets, and the half-width
+	// of its 95% confidence interval
+	double estimate;
+	double margin;
+} sample_estimate_t;
+
+// after iterator_init(), drawing the keys from zconf.aes
+void sample_init(void);
+
+static inline uint32_t sample_round(uint32_t x, uint32_t key, uint32_t stratum)
+{
+	x ^= key ^ (stratum * 0x9e3779b9);
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+// whether an address (host order) is in the sample
+static inline int sample_keep(uint32_t ip)
+{
+	const sample_t *s = &zsample;
+	uint32_t stratum = ip >> s->host_bits;
+	uint32_t x = ip & s->host_mask;
+	do {
+		uint32_t l = x >> s->half_bits;
+		uint32_t r = x & s->half_mask;
+		for (int i = 0; i < SAMPLE_ROUNDS; i++) {
+			uint32_t t = r;
+			r = l ^ (sample_round(r, s->keys[i], stratum) &
+				 s->half_mask);
+			l = t;
+		}
+		x = l << s->half_bits | r;
+	} while (x > s->host_mask);
+	return x < s->threshold;
+}
+
+static inline void sample_count(uint64_t *counts, uint32_t ip)
+{
+	__atomic_fetch_add(&counts[ip >> zsample.host_bits], 1,
+			   __ATOMIC_RELAXED);
+}
+
+static inline int sample_stopped(void)
+{
+	return __atomic_load_n(&zsample.stop, __ATOMIC_RELAXED);
+}
+
+// over everything counted so far
+void sample_estimate(sample_estimate_t *e);
+// from the monitor after each update: end sending once the interval over
+// the targets sent by the last update is within --sample-precision
+void sample_update(void);
+// once the scan is done
+void sample_log(void);
+
+#endif /* ZMAP_SAMPLE_H */
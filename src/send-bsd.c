@@ -26,12 +26,29 @@
 #include "../lib/includes.h"
 #include "../lib/logger.h"
 
-int send_run_init(UNUSED sock_t sock)
+// Neither BPF nor raw IP sockets take more than one packet per write(2) or
+// sendto(2), so each packet costs a syscall; what can be done is to do no
+// more per packet than that. Builds with netmap(4) (-DWITH_NETMAP=ON) send
+// whole batches instead.
+
+// the destination of raw IP sends, of which only the address changes
+static __thread struct sockaddr_in sai;
+
+int send_run_init(UNUSED sock_t sock, UNUSED batch_t *batch)
 {
-	// Don't need to do anything on BSD-like variants
+	bzero(&sai, sizeof(sai));
+	sai.sin_family = AF_INET;
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+	sai.sin_len = sizeof(sai);
+#endif
 	return EXIT_SUCCESS;
 }
 
+void send_run_cleanup(UNUSED sock_t sock)
+{
+	// nothing held beyond the batch
+}
+
 static int
 send_packet(sock_t sock, uint8_t *buf, int len, UNUSED uint32_t retry_ct)
 {
@@ -60,9 +77,6 @@ send_packet(sock_t sock, uint8_t *buf, int len, UNUSED uint32_t retry_ct)
 		}
 #endif
 
-		struct sockaddr_in sai;
-		bzero(&sai, sizeof(sai));
-		sai.sin_family = AF_INET;
 		sai.sin_addr.s_addr = iph->ip_dst.s_addr;
 		return sendto(sock.sock, buf, len, 0, (struct sockaddr *)&sai, sizeof(sai));
 	} else {
@@ -91,6 +105,10 @@ int send_batch(sock_t sock, batch_t *batch, int retries)
 				packets_sent++;
 				break;
 			}
+			// only a full interface queue is worth another syscall
+			if (errno != ENOBUFS && errno != EAGAIN && errno != EINTR) {
+				break;
+			}
 		}
 		if (rc < 0) {
 			// packet couldn't be sent in retries number of attempts
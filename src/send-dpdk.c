@@ -0,0 +1,172 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "send.h"
+#include "send-internal.h"
+#include "socket-dpdk.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <rte_errno.h>
+#include <rte_lcore.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+#include "state.h"
+
+// Each send thread owns one TX queue and a ring of sets of mbufs, a batch
+// each. Probe modules build a batch directly in the mbufs of one set, which
+// are then handed to the PMD with a reference of ours left on them, so they
+// never go back to the pool and keep what prepare_packet() wrote. By the
+// time the ring comes back around to a set, the PMD has dropped its
+// reference to every mbuf of it.
+struct dpdk_tx {
+	uint16_t port;
+	uint16_t queue;
+	uint16_t capacity;
+	uint32_t num_sets;
+	uint32_t cur;
+	// sets that packets have been built in, the others are seeded first
+	uint32_t seeded;
+	struct rte_mbuf **mbufs;
+	struct batch_packet **sets;
+	// for batches not built in a set, i.e., of extra probe modules
+	struct rte_mbuf **copies;
+};
+
+static __thread struct dpdk_tx dpdk_tx;
+
+int send_run_init(sock_t sock, batch_t *batch)
+{
+	if (zconf.dryrun) {
+		return EXIT_SUCCESS;
+	}
+	// gives the thread an lcore id, and with it an mbuf cache
+	if (rte_thread_register()) {
+		log_debug("send-dpdk", "unable to register send thread with the EAL: %s",
+			  rte_strerror(rte_errno));
+	}
+	struct dpdk_tx *t = &dpdk_tx;
+	t->port = zconf.dpdk.port_id;
+	t->queue = sock.dpdk.queue;
+	t->capacity = batch->capacity;
+	t->num_sets = dpdk_tx_mbufs_per_thread() / zconf.batch;
+	t->cur = 0;
+	t->seeded = 1;
+	uint32_t n = t->num_sets * t->capacity;
+	t->mbufs = xcalloc(n, sizeof(struct rte_mbuf *));
+	if (rte_pktmbuf_alloc_bulk(zconf.dpdk.tx_pool, t->mbufs, n)) {
+		log_error("send-dpdk", "unable to allocate %u mbufs for TX queue %u",
+			  n, t->queue);
+		return EXIT_FAILURE;
+	}
+	t->copies = xcalloc(t->capacity, sizeof(struct rte_mbuf *));
+	t->sets = xcalloc(t->num_sets, sizeof(struct batch_packet *));
+	t->sets[0] = batch->packets;
+	for (uint32_t s = 1; s < t->num_sets; s++) {
+		t->sets[s] = xcalloc(t->capacity, sizeof(struct batch_packet));
+	}
+	for (uint32_t s = 0; s < t->num_sets; s++) {
+		for (uint32_t i = 0; i < t->capacity; i++) {
+			struct rte_mbuf *m = t->mbufs[s * t->capacity + i];
+			m->data_off += DPDK_DATA_OFFSET;
+			t->sets[s][i].buf = rte_pktmbuf_mtod(m, uint8_t *);
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+void send_run_cleanup(UNUSED sock_t sock)
+{
+	// the NIC may still hold mbufs of the last burst, which go with the
+	// pool when the EAL is cleaned up
+}
+
+// hands pkts to the TX queue, returning how many it took
+static uint16_t tx_burst(struct dpdk_tx *t, struct rte_mbuf **pkts,
+			 uint16_t len, int retries)
+{
+	uint16_t sent = 0;
+	for (int i = 0; i < retries && sent < len; i++) {
+		sent += rte_eth_tx_burst(t->port, t->queue, pkts + sent, len - sent);
+	}
+	return sent;
+}
+
+// extra probe modules build in batches of their own, which are copied
+static int send_copies(struct dpdk_tx *t, batch_t *batch, int retries)
+{
+	if (rte_pktmbuf_alloc_bulk(zconf.dpdk.tx_pool, t->copies, batch->len)) {
+		log_error("send-dpdk", "out of mbufs on TX queue %u", t->queue);
+		return -1;
+	}
+	for (int i = 0; i < batch->len; i++) {
+		struct rte_mbuf *m = t->copies[i];
+		uint32_t len = batch->packets[i].len;
+		memcpy(rte_pktmbuf_mtod(m, uint8_t *), batch->packets[i].buf, len);
+		m->data_len = len;
+		m->pkt_len = len;
+	}
+	uint16_t sent = tx_burst(t, t->copies, batch->len, retries);
+	if (sent < batch->len) {
+		rte_pktmbuf_free_bulk(t->copies + sent, batch->len - sent);
+	}
+	return sent;
+}
+
+int send_batch(sock_t sock, batch_t *batch, int retries)
+{
+	(void)sock;
+	if (batch->len == 0) {
+		// nothing to send
+		return EXIT_SUCCESS;
+	}
+	struct dpdk_tx *t = &dpdk_tx;
+	if (batch->packets != t->sets[t->cur]) {
+		return send_copies(t, batch, retries);
+	}
+	struct rte_mbuf **pkts = &t->mbufs[t->cur * t->capacity];
+	for (int i = 0; i < batch->len; i++) {
+		struct rte_mbuf *m = pkts[i];
+		m->data_len = batch->packets[i].len;
+		m->pkt_len = batch->packets[i].len;
+		// the PMD drops this one once the packet is out
+		rte_mbuf_refcnt_update(m, 1);
+	}
+	uint16_t sent = tx_burst(t, pkts, batch->len, retries);
+	for (int i = sent; i < batch->len; i++) {
+		rte_mbuf_refcnt_update(pkts[i], -1);
+	}
+	if (sent < batch->len) {
+		log_error("send-dpdk", "TX queue %u is full", t->queue);
+	}
+
+	uint32_t next = (t->cur + 1) % t->num_sets;
+	if (t->seeded < t->num_sets && next == t->seeded) {
+		// The next set has never been prepared by the probe module,
+		// so seed it with the packets just built (see struct
+		// batch_packet).
+		for (uint32_t i = 0; i < t->capacity; i++) {
+			memcpy(t->sets[next][i].buf, t->sets[t->cur][i].buf,
+			       MAX_PACKET_SIZE);
+		}
+		t->seeded++;
+	}
+	t->cur = next;
+	batch->packets = t->sets[t->cur];
+	// the mbufs we are about to build into must be back from the PMD
+	pkts = &t->mbufs[t->cur * t->capacity];
+	for (uint32_t i = 0; i < t->capacity; i++) {
+		while (rte_mbuf_refcnt_read(pkts[i]) > 1) {
+			rte_eth_tx_done_cleanup(t->port, t->queue, 0);
+		}
+	}
+	return sent;
+}
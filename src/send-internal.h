@@ -11,8 +11,22 @@
 
 #include "socket.h"
 
-int send_run_init(sock_t s);
+struct iface_conf;
+
+// the interface the calling send thread sends through, set before
+// send_run_init()
+extern __thread struct iface_conf *send_iface;
+
+// how often send_batch() waited for a full queue to drain, and for how
+// long, since the send thread last moved them into its shard's stats
+extern __thread uint64_t send_backoffs;
+extern __thread uint64_t send_backoff_ns;
+
+int send_run_init(sock_t s, batch_t *batch);
 int send_batch(sock_t sock, batch_t *batch, int retries);
+// once the thread has sent its last batch: releases what send_run_init()
+// set up, after which the batch it was given must not be sent again
+void send_run_cleanup(sock_t s);
 
 #if defined(PFRING)
 #include "send-pfring.h"
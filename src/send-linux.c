@@ -16,6 +16,7 @@
 
 #define _GNU_SOURCE
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/ioctl.h>
@@ -24,34 +25,407 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 
-#include <netpacket/packet.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
 #include <linux/netlink.h>
+#include <linux/virtio_net.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
 
 #include "../lib/includes.h"
 #include "../lib/logger.h"
+#include "../lib/uring.h"
+#include "../lib/xalloc.h"
 #include "./send.h"
 #include "./send-linux.h"
+#include "send-internal.h"
 #include "state.h"
+#include "timestamps.h"
 
-// Dummy sockaddr for sendto
-static struct sockaddr_ll sockaddr;
+// Dummy sockaddr for sendto, of the thread's interface
+static __thread struct sockaddr_ll sockaddr;
 
-int send_run_init(sock_t s)
+// PACKET_MMAP TX_RING geometry. Every frame holds a tpacket2_hdr
+// followed by packet data at TX_RING_DATA_OFFSET, which keeps the IP
+// header 32-bit aligned just like struct batch_frame does. The ring
+// holds two batches: while the kernel drains one half, the send
+// thread builds the next batch directly in the other half.
+#define TX_RING_DATA_OFFSET (TPACKET_ALIGN(sizeof(struct tpacket2_hdr)) + 2)
+// With --checksum-offload, a virtio_net_hdr sits between the frame header
+// and the packet data, whose 10 bytes keep the IP header aligned the same way
+#define TX_RING_VNET_DATA_OFFSET \
+	(TPACKET_ALIGN(sizeof(struct tpacket2_hdr)) + sizeof(struct virtio_net_hdr))
+static_assert(TX_RING_VNET_DATA_OFFSET % sizeof(uint32_t) == TX_RING_DATA_OFFSET % sizeof(uint32_t),
+	      "the virtio_net_hdr must not change the alignment of packet data");
+#define TX_RING_FRAME_SIZE \
+	TPACKET_ALIGN(TX_RING_VNET_DATA_OFFSET + MAX_PACKET_SIZE)
+#define TX_RING_BLOCK_SIZE (1 << 16)
+#define TX_RING_FRAMES_PER_BLOCK (TX_RING_BLOCK_SIZE / TX_RING_FRAME_SIZE)
+
+struct tx_ring {
+	uint8_t *map;
+	size_t map_len;
+	uint16_t capacity;
+	// where packet data starts in a frame
+	uint32_t data_off;
+	// which half of the ring the batch currently points into
+	int cur;
+	// whether the second half has been seeded with packet templates
+	int seeded;
+	struct batch_packet *halves[2];
+};
+
+// every send thread owns its own socket and therefore its own ring
+static __thread struct tx_ring tx_ring;
+
+// CLOCK_TAI - CLOCK_MONOTONIC, for SO_TXTIME launch times on CLOCK_TAI
+static __thread int64_t txtime_tai_offset;
+
+static struct tpacket2_hdr *tx_ring_frame(struct tx_ring *r, uint32_t idx)
+{
+	return (struct tpacket2_hdr *)(r->map +
+				       (idx / TX_RING_FRAMES_PER_BLOCK) * TX_RING_BLOCK_SIZE +
+				       (idx % TX_RING_FRAMES_PER_BLOCK) * TX_RING_FRAME_SIZE);
+}
+
+static int tx_ring_init(int sock, int ifindex, batch_t *batch)
+{
+	struct tx_ring *r = &tx_ring;
+	int version = TPACKET_V2;
+	if (setsockopt(sock, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+		log_error("send", "unable to select TPACKET_V2: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	// lets us place packet data at TX_RING_DATA_OFFSET instead of
+	// directly after the frame header (Linux >= 3.8)
+	int has_off = 1;
+	if (setsockopt(sock, SOL_PACKET, PACKET_TX_HAS_OFF, &has_off, sizeof(has_off)) < 0) {
+		log_error("send", "unable to enable PACKET_TX_HAS_OFF: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	uint32_t frames = 2 * (uint32_t)batch->capacity;
+	struct tpacket_req req;
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = TX_RING_BLOCK_SIZE;
+	req.tp_block_nr = (frames + TX_RING_FRAMES_PER_BLOCK - 1) / TX_RING_FRAMES_PER_BLOCK;
+	req.tp_frame_size = TX_RING_FRAME_SIZE;
+	req.tp_frame_nr = req.tp_block_nr * TX_RING_FRAMES_PER_BLOCK;
+	if (setsockopt(sock, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) < 0) {
+		log_error("send", "unable to set up PACKET_TX_RING (%u frames): %s",
+			  req.tp_frame_nr, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	r->map_len = (size_t)req.tp_block_size * req.tp_block_nr;
+	r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, sock, 0);
+	if (r->map == MAP_FAILED) {
+		log_error("send", "unable to mmap PACKET_TX_RING: %s", strerror(errno));
+		r->map = NULL;
+		return EXIT_FAILURE;
+	}
+	// the ring is drained with send(sock, NULL, 0, ...), so the
+	// destination interface has to come from the socket itself.
+	// binding with protocol 0 also keeps inbound traffic from being
+	// queued on this socket.
+	struct sockaddr_ll bind_addr;
+	memset(&bind_addr, 0, sizeof(bind_addr));
+	bind_addr.sll_family = AF_PACKET;
+	bind_addr.sll_ifindex = ifindex;
+	if (bind(sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0) {
+		log_error("send", "unable to bind TX_RING socket: %s", strerror(errno));
+		munmap(r->map, r->map_len);
+		r->map = NULL;
+		return EXIT_FAILURE;
+	}
+	r->capacity = batch->capacity;
+	r->data_off = zconf.csum_offload ? TX_RING_VNET_DATA_OFFSET
+					  : TX_RING_DATA_OFFSET;
+	r->cur = 0;
+	r->seeded = 0;
+	r->halves[0] = batch->packets;
+	r->halves[1] = xcalloc(batch->capacity, sizeof(struct batch_packet));
+	for (uint32_t h = 0; h < 2; h++) {
+		for (uint32_t i = 0; i < batch->capacity; i++) {
+			struct tpacket2_hdr *hdr = tx_ring_frame(r, h * batch->capacity + i);
+			// the kernel takes the virtio_net_hdr from tp_mac on
+			hdr->tp_mac = zconf.csum_offload
+					  ? r->data_off - sizeof(struct virtio_net_hdr)
+					  : r->data_off;
+			r->halves[h][i].buf = (uint8_t *)hdr + r->data_off;
+		}
+	}
+	log_debug("send", "PACKET_TX_RING with %u frames of %u bytes mapped",
+		  req.tp_frame_nr, req.tp_frame_size);
+	return EXIT_SUCCESS;
+}
+
+// Waits for the kernel to send the frames still queued, then unmaps the
+// ring
+static void tx_ring_free(int sock)
+{
+	struct tx_ring *r = &tx_ring;
+	for (uint32_t i = 0; i < 2 * (uint32_t)r->capacity; i++) {
+		struct tpacket2_hdr *hdr = tx_ring_frame(r, i);
+		while (__atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE) &
+		       (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+			if (send(sock, NULL, 0, 0) < 0 && errno != EAGAIN &&
+			    errno != EINTR) {
+				break;
+			}
+		}
+	}
+	munmap(r->map, r->map_len);
+	xfree(r->halves[1]);
+	memset(r, 0, sizeof(*r));
+}
+
+#ifdef IO_URING
+// --send-method=io-uring: every packet of a batch is an IORING_OP_SENDMSG
+// of the thread's socket, registered with the ring, and the batches
+// alternate between two sets of packet buffers like the halves of the TX
+// ring, so that the next batch is built while the kernel drains the last
+// one. Completions are reaped once a set comes around again. With
+// io-uring-sqpoll a kernel thread polls the submission queue, and the send
+// thread only needs a syscall to wake it up after it went idle.
+#define URING_SQPOLL_IDLE_MS 100
+
+struct uring_tx {
+	uring_t ring;
+	// whether the socket is the ring's fixed file 0
+	int fixed_file;
+	uint16_t capacity;
+	// which set of buffers the batch currently points into
+	int cur;
+	// whether the second set has been seeded with packet templates
+	int seeded;
+	// sends from each set that haven't completed
+	uint32_t inflight[2];
+	struct batch_packet *halves[2];
+	batch_t *spare;
+	// read by the kernel until the send completes, one per packet of
+	// both sets
+	struct msghdr *msgs;
+	struct iovec (*iovs)[2];
+	struct virtio_net_hdr vh[2];
+};
+
+static __thread struct uring_tx uring_tx;
+
+static int uring_tx_init(int sock, batch_t *batch)
+{
+	struct uring_tx *u = &uring_tx;
+	// both sets in flight at once
+	if (uring_init(&u->ring, 2 * (uint32_t)batch->capacity,
+		       zconf.send_method == SEND_METHOD_IO_URING_SQPOLL,
+		       URING_SQPOLL_IDLE_MS)) {
+		log_error("send", "unable to set up an io_uring: %s",
+			  strerror(errno));
+		return EXIT_FAILURE;
+	}
+	// saves looking the socket up for every send, and is what SQPOLL
+	// needs on kernels before 5.11
+	u->fixed_file = uring_register_files(&u->ring, &sock, 1) == 0;
+	if (!u->fixed_file) {
+		log_debug("send", "unable to register the socket with the "
+				  "io_uring: %s",
+			  strerror(errno));
+	}
+	u->capacity = batch->capacity;
+	u->cur = 0;
+	u->seeded = 0;
+	u->inflight[0] = u->inflight[1] = 0;
+	u->spare = create_packet_batch(batch->capacity);
+	u->halves[0] = batch->packets;
+	u->halves[1] = u->spare->packets;
+	u->msgs = xcalloc(2 * (size_t)batch->capacity, sizeof(struct msghdr));
+	u->iovs = xcalloc(2 * (size_t)batch->capacity, sizeof(*u->iovs));
+	log_debug("send", "io_uring for batches of %u%s", batch->capacity,
+		  u->ring.sqpoll ? ", polled by a kernel thread" : "");
+	return EXIT_SUCCESS;
+}
+
+// Counts the completions so far against their set, returning those that
+// failed
+static int uring_tx_reap(struct uring_tx *u, int *err)
+{
+	int failed = 0;
+	struct io_uring_cqe *cqe;
+	while ((cqe = uring_peek_cqe(&u->ring))) {
+		u->inflight[cqe->user_data & 1]--;
+		if (cqe->res < 0) {
+			*err = -cqe->res;
+			failed++;
+		}
+		uring_cqe_seen(&u->ring);
+	}
+	return failed;
+}
+#endif
+
+static int64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Launch times are generated on CLOCK_MONOTONIC, which is what the fq
+// qdisc expects. etf only accepts CLOCK_TAI, so remember the offset.
+static int txtime_init(int sock)
+{
+	struct sock_txtime cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.clockid = zconf.pacing == PACING_TXTIME_TAI ? CLOCK_TAI : CLOCK_MONOTONIC;
+	if (setsockopt(sock, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) < 0) {
+		log_error("send", "unable to enable SO_TXTIME: %s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (zconf.pacing == PACING_TXTIME_TAI) {
+		txtime_tai_offset = clock_ns(CLOCK_TAI) - clock_ns(CLOCK_MONOTONIC);
+	}
+	return EXIT_SUCCESS;
+}
+
+// --tx-timestamps: the kernel, or with --timestamps=hardware the NIC,
+// stamps every probe as it leaves and hands it back on the socket's error
+// queue, see tx_stamps_drain()
+static int tx_timestamps_init(int sock)
+{
+	int flags = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if (zconf.timestamps == TIMESTAMPS_HARDWARE) {
+		if (timestamps_enable_hardware(send_iface->name, 1)) {
+			log_warn("send", "%s can't stamp probes in hardware (%s), "
+					 "using software timestamps",
+				 send_iface->name, strerror(errno));
+		} else {
+			flags = SOF_TIMESTAMPING_TX_HARDWARE |
+				SOF_TIMESTAMPING_RAW_HARDWARE;
+		}
+	}
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+		       sizeof(flags)) < 0) {
+		log_error("send", "unable to enable SO_TIMESTAMPING: %s",
+			  strerror(errno));
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+// the IPv4 destination of a probe handed back on the error queue, which
+// starts at its Ethernet header, or at its IP header with --iplayer
+static int tx_stamp_dst(const uint8_t *pkt, size_t len, ipaddr_n_t *dst)
+{
+	size_t off = 0;
+	if (len >= sizeof(struct ether_header) + sizeof(struct ip) &&
+	    ((const struct ether_header *)pkt)->ether_type ==
+		htons(ETHERTYPE_IP)) {
+		off = sizeof(struct ether_header);
+	} else if (len < sizeof(struct ip) || pkt[0] >> 4 != 4) {
+		return 0;
+	}
+	struct ip ip;
+	memcpy(&ip, pkt + off, sizeof(ip));
+	*dst = ip.ip_dst.s_addr;
+	return 1;
+}
+
+// Record the stamps of the probes that have left since the last batch. Only
+// the headers of each are read back, enough to tell its destination.
+static void tx_stamps_drain(int sock)
+{
+	uint8_t pkt[sizeof(struct ether_header) + sizeof(struct ip)];
+	union {
+		char buf[CMSG_SPACE(sizeof(struct scm_timestamping)) +
+			 CMSG_SPACE(sizeof(struct sock_extended_err) +
+				    sizeof(struct sockaddr_ll))];
+		struct cmsghdr align;
+	} ctrl;
+	int hw = zconf.timestamps == TIMESTAMPS_HARDWARE;
+	for (;;) {
+		struct iovec iov = {.iov_base = pkt, .iov_len = sizeof(pkt)};
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = sizeof(ctrl.buf);
+		ssize_t n = recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (n < 0) {
+			return;
+		}
+		uint64_t ns = 0;
+		for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c;
+		     c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level != SOL_SOCKET ||
+			    c->cmsg_type != SCM_TIMESTAMPING) {
+				continue;
+			}
+			struct scm_timestamping st;
+			memcpy(&st, CMSG_DATA(c), sizeof(st));
+			const struct timespec *ts = &st.ts[hw ? 2 : 0];
+			ns = (uint64_t)ts->tv_sec * 1000000000ULL +
+			     (uint64_t)ts->tv_nsec;
+		}
+		ipaddr_n_t dst;
+		if (ns && tx_stamp_dst(pkt, (size_t)n, &dst)) {
+			tx_stamps_record(dst, ns);
+		}
+	}
+}
+
+// The virtio_net_hdr that packets go out behind with --checksum-offload,
+// which tells the kernel which L4 checksum to complete. The packets of a
+// batch are all of one probe module, and share their headers.
+static void vnet_hdr_init(struct virtio_net_hdr *vh, const uint8_t *pkt)
+{
+	memset(vh, 0, sizeof(*vh));
+	vh->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+	const struct ether_header *eth = (const struct ether_header *)pkt;
+	const uint8_t *l3 = pkt + sizeof(struct ether_header);
+	uint16_t l4_off;
+	uint8_t proto;
+	if (eth->ether_type == htons(ETHERTYPE_IPV6)) {
+		proto = ((const struct ip6_hdr *)l3)->ip6_nxt;
+		l4_off = sizeof(struct ether_header) + sizeof(struct ip6_hdr);
+	} else {
+		const struct ip *ip = (const struct ip *)l3;
+		proto = ip->ip_p;
+		l4_off = sizeof(struct ether_header) + 4 * ip->ip_hl;
+	}
+	uint16_t sum_off;
+	if (proto == IPPROTO_TCP) {
+		sum_off = offsetof(struct tcphdr, th_sum);
+	} else if (proto == IPPROTO_UDP) {
+		sum_off = offsetof(struct udphdr, uh_sum);
+	} else {
+		// nothing for the NIC to complete
+		return;
+	}
+	vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vh->csum_start = l4_off;
+	vh->csum_offset = sum_off;
+	vh->hdr_len = l4_off + sum_off + sizeof(uint16_t);
+}
+
+int send_run_init(sock_t s, batch_t *batch)
 {
 	// Get the actual socket
 	int sock = s.sock;
 	// get source interface index
 	struct ifreq if_idx;
 	memset(&if_idx, 0, sizeof(struct ifreq));
-	if (strlen(zconf.iface) >= IFNAMSIZ) {
+	if (strlen(send_iface->name) >= IFNAMSIZ) {
 		log_error("send", "device interface name (%s) too long\n",
-			  zconf.iface);
+			  send_iface->name);
 		return EXIT_FAILURE;
 	}
-	strncpy(if_idx.ifr_name, zconf.iface, IFNAMSIZ - 1);
+	strncpy(if_idx.ifr_name, send_iface->name, IFNAMSIZ - 1);
 	if (ioctl(sock, SIOCGIFINDEX, &if_idx) < 0) {
 		log_error("send", "%s", "SIOCGIFINDEX");
 		return EXIT_FAILURE;
@@ -65,35 +439,331 @@ int send_run_init(sock_t s)
 	if (zconf.send_ip_pkts) {
 		sockaddr.sll_protocol = htons(ETHERTYPE_IP);
 	}
-	memcpy(sockaddr.sll_addr, zconf.gw_mac, ETH_ALEN);
+	memcpy(sockaddr.sll_addr, send_iface->gw_mac, ETH_ALEN);
+	// must come before the TX ring is set up
+	if (zconf.csum_offload && !zconf.dryrun) {
+		int one = 1;
+		if (setsockopt(sock, SOL_PACKET, PACKET_VNET_HDR, &one, sizeof(one)) < 0) {
+			log_error("send", "unable to enable PACKET_VNET_HDR: %s", strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
+	if (zconf.tx_timestamps && !zconf.dryrun &&
+	    tx_timestamps_init(sock) != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	if (zconf.send_method == SEND_METHOD_TX_RING && !zconf.dryrun) {
+		return tx_ring_init(sock, ifindex, batch);
+	}
+#ifdef IO_URING
+	if ((zconf.send_method == SEND_METHOD_IO_URING ||
+	     zconf.send_method == SEND_METHOD_IO_URING_SQPOLL) &&
+	    !zconf.dryrun) {
+		return uring_tx_init(sock, batch);
+	}
+#endif
+	if (zconf.pacing != PACING_USERSPACE && !zconf.dryrun) {
+		return txtime_init(sock);
+	}
 	return EXIT_SUCCESS;
 }
 
+void send_run_cleanup(sock_t s)
+{
+	if (tx_ring.map) {
+		tx_ring_free(s.sock);
+	}
+}
+
+// A full qdisc or device queue fails sends with ENOBUFS, and a full socket
+// buffer with EAGAIN. Retrying at once only spins until the queue drains,
+// so a retry waits first: for the socket to become writable after EAGAIN,
+// and after ENOBUFS, where there is nothing to wait on, for a sleep that
+// doubles with every retry of the batch.
+#define SEND_BACKOFF_MIN_NS 10000
+#define SEND_BACKOFF_MAX_NS 1000000
+
+// the last error send_batch() logged, so a failing send is logged once
+// rather than for every batch
+static __thread int send_last_errno;
+
+// Returns whether err was a full queue, after waiting for it to drain
+static int send_backoff(int sock, int err, uint64_t *wait_ns)
+{
+	if (err != ENOBUFS && err != EAGAIN && err != EWOULDBLOCK) {
+		return 0;
+	}
+	int64_t t0 = clock_ns(CLOCK_MONOTONIC);
+	if (err == ENOBUFS) {
+		struct timespec ts = {.tv_sec = 0, .tv_nsec = (long)*wait_ns};
+		nanosleep(&ts, NULL);
+	} else {
+		struct pollfd pfd = {.fd = sock, .events = POLLOUT};
+		int ms = (int)((*wait_ns + 999999) / 1000000);
+		poll(&pfd, 1, ms);
+	}
+	*wait_ns = *wait_ns * 2 > SEND_BACKOFF_MAX_NS ? SEND_BACKOFF_MAX_NS
+						     : *wait_ns * 2;
+	send_backoffs++;
+	send_backoff_ns += (uint64_t)(clock_ns(CLOCK_MONOTONIC) - t0);
+	return 1;
+}
+
+static void send_log_error(const char *what, int err)
+{
+	if (err != send_last_errno) {
+		log_error("batch send", "error %s: %s", what, strerror(err));
+		send_last_errno = err;
+	}
+}
+
+// Hands the current half of the ring to the kernel and switches the
+// batch over to the other half. Transmission completes asynchronously,
+// so frames the kernel rejected are only noticed once their half comes
+// around again; those are subtracted from the count of sent packets.
+static int send_batch_tx_ring(sock_t sock, batch_t *batch, int retries)
+{
+	struct tx_ring *r = &tx_ring;
+	struct batch_packet *packets = r->halves[r->cur];
+	uint32_t first = r->cur * r->capacity;
+	struct virtio_net_hdr vh;
+	if (zconf.csum_offload) {
+		vnet_hdr_init(&vh, packets[0].buf);
+	}
+	for (int i = 0; i < batch->len; i++) {
+		struct tpacket2_hdr *hdr = tx_ring_frame(r, first + i);
+		hdr->tp_len = packets[i].len;
+		if (zconf.csum_offload) {
+			memcpy((uint8_t *)hdr + hdr->tp_mac, &vh, sizeof(vh));
+			hdr->tp_len += sizeof(vh);
+		}
+		// packet contents must be visible before the kernel sees the status
+		__atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+	}
+	int kicked = 0;
+	uint64_t wait_ns = SEND_BACKOFF_MIN_NS;
+	for (int i = 0; i < retries; i++) {
+		if (send(sock.sock, NULL, 0, MSG_DONTWAIT) >= 0 || errno == EAGAIN) {
+			kicked = 1;
+			break;
+		}
+		int err = errno;
+		if (!send_backoff(sock.sock, err, &wait_ns)) {
+			send_log_error("kicking TX_RING", err);
+		}
+	}
+	if (!kicked) {
+		// hand the frames back, they will be overwritten by the next batch
+		for (int i = 0; i < batch->len; i++) {
+			__atomic_store_n(&tx_ring_frame(r, first + i)->tp_status,
+					 TP_STATUS_AVAILABLE, __ATOMIC_RELAXED);
+		}
+		return -1;
+	}
+	if (!r->seeded) {
+		// The other half has never been prepared by the probe module,
+		// so seed it with the packets we just built (see struct
+		// batch_packet).
+		for (uint32_t i = 0; i < r->capacity; i++) {
+			memcpy(r->halves[1][i].buf, packets[i].buf, MAX_PACKET_SIZE);
+		}
+		r->seeded = 1;
+	}
+	r->cur ^= 1;
+	batch->packets = r->halves[r->cur];
+
+	// wait for the kernel to release the half we're about to reuse
+	int failed = 0;
+	first = r->cur * r->capacity;
+	for (uint32_t i = 0; i < r->capacity; i++) {
+		struct tpacket2_hdr *hdr = tx_ring_frame(r, first + i);
+		uint32_t status;
+		while ((status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE)) &
+		       (TP_STATUS_SEND_REQUEST | TP_STATUS_SENDING)) {
+			// a blocking send returns once pending frames complete
+			if (send(sock.sock, NULL, 0, 0) < 0 && errno != EAGAIN && errno != EINTR) {
+				log_error("batch send", "error draining TX_RING: %s", strerror(errno));
+				break;
+			}
+		}
+		if (status & TP_STATUS_WRONG_FORMAT) {
+			failed++;
+			__atomic_store_n(&hdr->tp_status, TP_STATUS_AVAILABLE, __ATOMIC_RELAXED);
+		}
+	}
+	if (failed) {
+		log_warn("batch send", "kernel rejected %d packets from TX_RING", failed);
+	}
+	return failed > batch->len ? 0 : batch->len - failed;
+}
+
+#ifdef IO_URING
+// Queues a send of every packet of the batch, linked so they go out in
+// order, and switches the batch over to the other set of buffers once the
+// kernel is done with it. As with the TX ring, sends that failed are only
+// noticed when their set comes around again and are subtracted then.
+static int send_batch_io_uring(sock_t sock, batch_t *batch, int retries)
+{
+	struct uring_tx *u = &uring_tx;
+	struct batch_packet *packets = u->halves[u->cur];
+	uint32_t first = u->cur * u->capacity;
+	struct virtio_net_hdr *vh = &u->vh[u->cur];
+	if (zconf.csum_offload) {
+		vnet_hdr_init(vh, packets[0].buf);
+	}
+	size_t buf_offset = 0;
+	if (zconf.send_ip_pkts) {
+		buf_offset = sizeof(struct ether_header);
+	}
+	for (int i = 0; i < batch->len; i++) {
+		struct iovec *iov = u->iovs[first + i];
+		int iovlen = 0;
+		if (zconf.csum_offload) {
+			iov[iovlen].iov_base = vh;
+			iov[iovlen].iov_len = sizeof(*vh);
+			iovlen++;
+		}
+		iov[iovlen].iov_base = packets[i].buf + buf_offset;
+		iov[iovlen].iov_len = packets[i].len - buf_offset;
+		iovlen++;
+		struct msghdr *msg = &u->msgs[first + i];
+		memset(msg, 0, sizeof(struct msghdr));
+		msg->msg_name = (struct sockaddr *)&sockaddr;
+		msg->msg_namelen = sizeof(struct sockaddr_ll);
+		msg->msg_iov = iov;
+		msg->msg_iovlen = iovlen;
+
+		struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = u->fixed_file ? 0 : sock.sock;
+		sqe->flags = u->fixed_file ? IOSQE_FIXED_FILE : 0;
+		if (i + 1 < batch->len) {
+			sqe->flags |= IOSQE_IO_LINK;
+		}
+		sqe->addr = (uint64_t)(uintptr_t)msg;
+		sqe->len = 1;
+		sqe->user_data = (uint64_t)u->cur;
+	}
+	int submitted = 0;
+	for (int i = 0; i < retries && submitted < batch->len; i++) {
+		int rv = uring_submit(&u->ring);
+		if (rv < 0) {
+			send_log_error("submitting to io_uring", errno);
+			continue;
+		}
+		submitted += rv;
+	}
+	if (submitted < batch->len) {
+		// what the kernel didn't take is ours to drop
+		uring_drop_unsubmitted(&u->ring);
+		if (!submitted) {
+			return -1;
+		}
+	}
+	u->inflight[u->cur] += submitted;
+	if (!u->seeded) {
+		// seeded as the TX ring is, see struct batch_packet
+		for (uint32_t i = 0; i < u->capacity; i++) {
+			memcpy(u->halves[1][i].buf, packets[i].buf,
+			       MAX_PACKET_SIZE);
+		}
+		u->seeded = 1;
+	}
+	u->cur ^= 1;
+	batch->packets = u->halves[u->cur];
+
+	// wait for the sends from the set we're about to reuse
+	int err = 0;
+	int failed = uring_tx_reap(u, &err);
+	while (u->inflight[u->cur]) {
+		if (uring_wait(&u->ring, 1)) {
+			log_error("batch send", "error reaping io_uring: %s",
+				  strerror(errno));
+			break;
+		}
+		failed += uring_tx_reap(u, &err);
+	}
+	if (failed && err != ENOBUFS && err != EAGAIN) {
+		// a full queue is counted by the caller as failed packets
+		send_log_error("in io_uring sends", err);
+	}
+	return failed > submitted ? 0 : submitted - failed;
+}
+#endif
+
 int send_batch(sock_t sock, batch_t *batch, int retries)
 {
 	if (batch->len == 0) {
 		// nothing to send
 		return EXIT_SUCCESS;
 	}
+	if (zconf.tx_timestamps) {
+		tx_stamps_drain(sock.sock);
+	}
+	if (zconf.send_method == SEND_METHOD_TX_RING) {
+		return send_batch_tx_ring(sock, batch, retries);
+	}
+#ifdef IO_URING
+	if (zconf.send_method == SEND_METHOD_IO_URING ||
+	    zconf.send_method == SEND_METHOD_IO_URING_SQPOLL) {
+		return send_batch_io_uring(sock, batch, retries);
+	}
+#endif
 	struct mmsghdr msgvec[batch->capacity]; // Array of multiple msg header structures
 	struct msghdr msgs[batch->capacity];
-	struct iovec iovs[batch->capacity];
+	// with --checksum-offload, each packet is preceded by a virtio_net_hdr
+	struct iovec iovs[batch->capacity][2];
+	struct virtio_net_hdr vh;
+	int vnet = zconf.csum_offload;
+	if (vnet) {
+		vnet_hdr_init(&vh, batch->packets[0].buf);
+	}
+	// per-packet SCM_TXTIME control messages, only when pacing with SO_TXTIME
+	int txtime = zconf.pacing != PACING_USERSPACE;
+	union {
+		char buf[CMSG_SPACE(sizeof(uint64_t))];
+		struct cmsghdr align;
+	} ctrl[txtime ? batch->capacity : 1];
+	// etf drops packets whose launch time has already passed, which
+	// happens for the head of a burst when catching up
+	uint64_t earliest = txtime ? (uint64_t)clock_ns(CLOCK_MONOTONIC) : 0;
 
 	size_t buf_offset = 0;
 	if (zconf.send_ip_pkts) {
 		buf_offset = sizeof(struct ether_header);
 	}
 	for (int i = 0; i < batch->len; ++i) {
-		struct iovec *iov = &iovs[i];
-		iov->iov_base = batch->packets[i].buf + buf_offset;
-		iov->iov_len = batch->packets[i].len - buf_offset;
+		struct iovec *iov = iovs[i];
+		int iovlen = 0;
+		if (vnet) {
+			iov[iovlen].iov_base = &vh;
+			iov[iovlen].iov_len = sizeof(vh);
+			iovlen++;
+		}
+		iov[iovlen].iov_base = batch->packets[i].buf + buf_offset;
+		iov[iovlen].iov_len = batch->packets[i].len - buf_offset;
+		iovlen++;
 		struct msghdr *msg = &msgs[i];
 		memset(msg, 0, sizeof(struct msghdr));
 		// based on https://github.com/torvalds/linux/blob/master/net/socket.c#L2180
 		msg->msg_name = (struct sockaddr *)&sockaddr;
 		msg->msg_namelen = sizeof(struct sockaddr_ll);
 		msg->msg_iov = iov;
-		msg->msg_iovlen = 1;
+		msg->msg_iovlen = iovlen;
+		if (txtime && batch->packets[i].txtime) {
+			uint64_t t = batch->packets[i].txtime;
+			if (zconf.pacing == PACING_TXTIME_TAI && t < earliest) {
+				t = earliest;
+			}
+			t += txtime_tai_offset;
+			msg->msg_control = ctrl[i].buf;
+			msg->msg_controllen = sizeof(ctrl[i].buf);
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_TXTIME;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+			memcpy(CMSG_DATA(cmsg), &t, sizeof(t));
+		}
 		msgvec[i].msg_hdr = *msg;
 		msgvec[i].msg_len = batch->packets[i].len - buf_offset;
 	}
@@ -101,6 +771,7 @@ int send_batch(sock_t sock, batch_t *batch, int retries)
 	struct mmsghdr *current_msg_vec = msgvec;
 	int total_packets_sent = 0;
 	int num_of_packets_in_batch = batch->len;
+	uint64_t wait_ns = SEND_BACKOFF_MIN_NS;
 	for (int i = 0; i < retries; i++) {
 		// according to manpages
 		// On success, sendmmsg() returns the number of messages sent from msgvec; if this is less than vlen, the
@@ -108,8 +779,13 @@ int send_batch(sock_t sock, batch_t *batch, int retries)
 		// On error, -1 is returned, and errno is set to indicate the error.
 		int rv = sendmmsg(sock.sock, current_msg_vec, num_of_packets_in_batch, 0);
 		if (rv < 0) {
-			// retry if sending all packets failed
-			log_error("batch send", "error in sendmmsg: %s", strerror(errno));
+			// retry if sending all packets failed, once the queue
+			// has had time to drain if that is what failed
+			int err = errno;
+			if (!send_backoff(sock.sock, err, &wait_ns)) {
+				send_log_error("in sendmmsg", err);
+			}
+			errno = err;
 			continue;
 		}
 		// if rv is positive, it gives the number of packets successfully sent
@@ -118,8 +794,9 @@ int send_batch(sock_t sock, batch_t *batch, int retries)
 			// all packets in batch were sent successfully
 			break;
 		}
-		// batch send was only partially successful, we'll retry if we have retries available
-		log_warn("batch send", "only successfully sent %d packets out of a batch of %d packets", total_packets_sent, batch->len);
+		// batch send was only partially successful, we'll retry if we
+		// have retries available. sendmmsg() doesn't say why it stopped,
+		// the retry does, and backs off if the queue is full.
 		// per the manpages for sendmmsg, packets are sent sequentially and the call returns upon a
 		// failure, returning the number of packets successfully sent
 		// remove successfully sent packets from batch for retry
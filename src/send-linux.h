@@ -13,7 +13,7 @@
 #include <string.h>
 
 #include <netinet/ip.h>
-#include <netpacket/packet.h>
+#include <linux/if_packet.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -24,22 +24,84 @@
 
 #include "../lib/includes.h"
 #include "../lib/logger.h"
-#include "../lib/queue.h"
+#include "../lib/ring.h"
+#include "../lib/xalloc.h"
 
 #include "socket.h"
 #include "state.h"
 
+// batches waiting for send thread 0, which never takes long to get to them
+#define SUBMIT_QUEUE_BATCHES 256
+
 static pthread_once_t submit_queue_inited = PTHREAD_ONCE_INIT;
-static zqueue_t *submit_queue;
+static zring_t *submit_queue;
 
 static void
 submit_queue_init_once(void)
 {
-	submit_queue = queue_init();
+	submit_queue = zring_init(SUBMIT_QUEUE_BATCHES, ZRING_MPSC);
 	assert(submit_queue);
 }
 
-int send_run_init(sock_t sock)
+// The send thread's batch is built directly in the buffers of the TX slots
+// it is sent from, which saves copying every packet into the ring. Slot
+// buffers are never swapped, so one keeps the last packet built in it,
+// which is as good a template for the next packet as the one
+// prepare_packet() made; only buffers that a copied packet (e.g., an ARP
+// reply submitted by the recv thread) went through need the template put
+// back. Netmap buffers start with the Ethernet header, so the IP header is
+// not 32-bit aligned in them, which is only done where that is allowed.
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+#define NETMAP_IN_PLACE 1
+#else
+#define NETMAP_IN_PLACE 0
+#endif
+
+struct nm_tx {
+	struct netmap_ring *ring;
+	int fd;
+	// built in place, or NULL if every batch is copied
+	batch_t *batch;
+	// per slot, if its buffer holds no packet of batch's probe module
+	uint8_t *dirty;
+	int have_template;
+	uint8_t template[MAX_PACKET_SIZE];
+};
+
+static __thread struct nm_tx nm_tx;
+
+// Point the in-place batch at the free slots from cur on, waiting until
+// there are enough of them.
+static int nm_tx_reserve(struct nm_tx *t)
+{
+	struct netmap_ring *ring = t->ring;
+	batch_t *batch = t->batch;
+	struct pollfd fds = {
+	    .fd = t->fd,
+	    .events = POLLOUT,
+	};
+	while (nm_ring_space(ring) < batch->capacity) {
+		if (poll(&fds, 1, -1) == -1) {
+			int oerrno = errno;
+			log_debug("send-netmap", "poll(POLLOUT) failed: %d: %s", errno, strerror(errno));
+			errno = oerrno;
+			return -1;
+		}
+	}
+	uint32_t idx = ring->cur;
+	for (uint16_t i = 0; i < batch->capacity; i++) {
+		uint8_t *buf = (uint8_t *)NETMAP_BUF(ring, ring->slot[idx].buf_idx);
+		if (t->dirty[idx] && t->have_template) {
+			memcpy(buf, t->template, MAX_PACKET_SIZE);
+			t->dirty[idx] = 0;
+		}
+		batch->packets[i].buf = buf;
+		idx = nm_ring_next(ring, idx);
+	}
+	return 0;
+}
+
+int send_run_init(sock_t sock, batch_t *batch)
 {
 	if (sock.nm.tx_ring_idx == 0) {
 		pthread_once(&submit_queue_inited, submit_queue_init_once);
@@ -54,30 +116,94 @@ int send_run_init(sock_t sock)
 		log_error("send-netmap", "poll(POLLOUT) failed: %d: %s", errno, strerror(errno));
 		return -1;
 	}
+
+	struct nm_tx *t = &nm_tx;
+	t->ring = NETMAP_TXRING(zconf.nm.nm_if, sock.nm.tx_ring_idx);
+	t->fd = sock.nm.tx_ring_fd;
+	t->batch = NULL;
+	// Extra probe modules send batches of their own through the same
+	// slots, so those are copied throughout.
+	if (!NETMAP_IN_PLACE || zconf.dryrun || zconf.num_extra_probes ||
+	    t->ring->nr_buf_size < MAX_PACKET_SIZE ||
+	    batch->capacity > t->ring->num_slots / 2) {
+		log_debug("send-netmap", "tx ring %" PRIu32 ": copying packets into slots", sock.nm.tx_ring_idx);
+		return 0;
+	}
+	t->batch = batch;
+	// none was prepared by the probe module but those of the first batch
+	t->dirty = xmalloc(t->ring->num_slots);
+	memset(t->dirty, 1, t->ring->num_slots);
+	t->have_template = 0;
+	if (nm_tx_reserve(t)) {
+		return -1;
+	}
+	for (uint32_t i = 0, idx = t->ring->cur; i < batch->capacity; i++) {
+		t->dirty[idx] = 0;
+		idx = nm_ring_next(t->ring, idx);
+	}
+	log_debug("send-netmap", "tx ring %" PRIu32 ": building packets in %" PRIu32 " slots", sock.nm.tx_ring_idx, t->ring->num_slots);
 	return 0;
 }
 
+void send_run_cleanup(UNUSED sock_t sock)
+{
+	// nothing held beyond the batch
+}
+
 // Called from the recv thread to submit a batch of packets
 // for sending on thread 0; typically batch size is just 1.
 // Used for responding to ARP requests.
-// The way this works is rather inefficient and only makes
-// sense for low volume packets.
+// Batches go through a bounded ring, which only makes sense
+// for low volume packets.
 // Since we don't know if send_run_init() has been called
 // yet or not, we need to ensure the queue is initialized.
 void submit_batch_internal(batch_t *batch)
 {
 	pthread_once(&submit_queue_inited, submit_queue_init_once);
-	push_back((void *)batch, submit_queue);
+	if (!zring_push(submit_queue, batch)) {
+		// the sender has stopped taking them, or fallen far behind
+		log_warn("send-netmap", "Dropping submitted batch of %u packet(s), submit queue is full", batch->len);
+		free_packet_batch(batch);
+	}
+}
+
+static int nm_tx_sync(int fd)
+{
+	if (ioctl(fd, NIOCTXSYNC, NULL) == -1) {
+		int oerrno = errno;
+		log_debug("send-netmap", "ioctl(NIOCTXSYNC) failed: %d: %s", errno, strerror(errno));
+		errno = oerrno;
+		return -1;
+	}
+	return 0;
 }
 
 int send_batch_internal(sock_t sock, batch_t *batch)
 {
 	struct netmap_ring *ring = NETMAP_TXRING(zconf.nm.nm_if, sock.nm.tx_ring_idx);
+	struct nm_tx *t = &nm_tx;
 	struct pollfd fds = {
 	    .fd = sock.nm.tx_ring_fd,
 	    .events = POLLOUT,
 	};
 
+	if (batch == t->batch) {
+		// already in the slots from cur on, see nm_tx_reserve()
+		for (int i = 0; i < batch->len; i++) {
+			assert(batch->packets[i].len <= ring->nr_buf_size);
+			ring->slot[ring->cur].len = batch->packets[i].len;
+			ring->head = ring->cur = nm_ring_next(ring, ring->cur);
+		}
+		if (!t->have_template && batch->len) {
+			memcpy(t->template, batch->packets[0].buf, MAX_PACKET_SIZE);
+			t->have_template = 1;
+		}
+		if (nm_tx_sync(fds.fd)) {
+			return -1;
+		}
+		return batch->len;
+	}
+
 	for (int i = 0; i < batch->len; i++) {
 		if (ring->head == ring->tail && poll(&fds, 1, -1) == -1) {
 			int oerrno = errno;
@@ -90,13 +216,13 @@ int send_batch_internal(sock_t sock, batch_t *batch)
 		assert(len <= ring->nr_buf_size);
 		memcpy(NETMAP_BUF(ring, ring->slot[ring->cur].buf_idx), batch->packets[i].buf, len);
 		ring->slot[ring->cur].len = len;
+		if (t->batch) {
+			t->dirty[ring->cur] = 1;
+		}
 		ring->head = ring->cur = nm_ring_next(ring, ring->cur);
 	}
 
-	if (ioctl(fds.fd, NIOCTXSYNC, NULL) == -1) {
-		int oerrno = errno;
-		log_debug("send-netmap", "ioctl(NIOCTXSYNC) failed: %d: %s", errno, strerror(errno));
-		errno = oerrno;
+	if (nm_tx_sync(fds.fd)) {
 		return -1;
 	}
 
@@ -112,24 +238,28 @@ int send_batch_internal(sock_t sock, batch_t *batch)
 // All we know is that a poll or ioctl syscall failed, not if or
 // how many of the packets we placed in the ringbuffer were sent.
 //
-// There is a bit of unused optimization potential here; ZMap's
-// current architecture requires us to copy packet data on the
-// send path, we cannot supply netmap buffers to ZMap to write
-// into directly.  And even though netmap would allow us to reuse
-// data still in buffers (unless NS_BUF_CHANGED has been set by
-// the kernel), we cannot take advantage of that currently.
+// The in-place batch goes first, as its packets are in the slots
+// that submitted batches would otherwise be copied into, and is only
+// pointed at its next slots once those are sent.
 int send_batch(sock_t sock, batch_t *batch, UNUSED int attempts)
 {
+	struct nm_tx *t = &nm_tx;
+	int rc = 0;
+	if (batch == t->batch && batch->len) {
+		rc = send_batch_internal(sock, batch);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
 	// On send thread 0, send any batches that have been
-	// submitted onto the submit_queue before sending the
+	// submitted onto the submit_queue along with the
 	// actual batch.  There should only be packets in the
 	// submit_queue very infrequently.
 	if (sock.nm.tx_ring_idx == 0) {
-		while (!is_empty(submit_queue)) {
-			znode_t *node = pop_front(submit_queue);
-			batch_t *extra_batch = (batch_t *)node->data;
+		batch_t *extra_batch;
+		while ((extra_batch = zring_pop(submit_queue))) {
 			assert(extra_batch->len > 0);
-			free(node);
 			if (send_batch_internal(sock, extra_batch) != extra_batch->len) {
 				log_error("send-netmap", "Failed to send extra batch of %u submitted packet(s)", extra_batch->len);
 			} else {
@@ -139,9 +269,15 @@ int send_batch(sock_t sock, batch_t *batch, UNUSED int attempts)
 		}
 	}
 
-	if (batch->len == 0) {
-		return 0;
+	if (batch != t->batch && batch->len) {
+		rc = send_batch_internal(sock, batch);
+		if (rc < 0) {
+			return rc;
+		}
 	}
 
-	return send_batch_internal(sock, batch);
+	if (t->batch && nm_tx_reserve(t)) {
+		return -1;
+	}
+	return rc;
 }
@@ -16,7 +16,7 @@
 #error "Don't include send-bsd.h or send-linux.h with send-pfring.h"
 #endif
 
-int send_run_init(sock_t socket)
+int send_run_init(sock_t socket, UNUSED batch_t *batch)
 {
 	(void)socket;
 
@@ -24,6 +24,11 @@ int send_run_init(sock_t socket)
 	return 0;
 }
 
+void send_run_cleanup(UNUSED sock_t sock)
+{
+	// nothing held beyond the batch
+}
+
 int send_batch(sock_t sock, batch_t *batch, UNUSED int attempts)
 {
 	for (int i = 0; i < batch->len; i++) {
@@ -0,0 +1,148 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "send.h"
+#include "send-internal.h"
+#include "socket-xdp.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+#include "state.h"
+
+// Each send thread owns the TX side of one queue. Its TX frames are
+// split into two halves the size of a batch: probe modules build the
+// next batch directly in one half while the NIC drains the other.
+struct xdp_tx {
+	struct xdp_queue *q;
+	uint16_t capacity;
+	int cur;
+	int seeded;
+	uint32_t outstanding[2];
+	struct batch_packet *halves[2];
+};
+
+static __thread struct xdp_tx xdp_tx;
+
+static inline uint64_t frame_addr(uint32_t frame)
+{
+	return (uint64_t)(XDP_RX_FRAMES + frame) * XDP_FRAME_SIZE;
+}
+
+int send_run_init(sock_t sock, batch_t *batch)
+{
+	if (zconf.dryrun) {
+		return EXIT_SUCCESS;
+	}
+	struct xdp_tx *t = &xdp_tx;
+	t->q = &zconf.xdp.queues[sock.xdp.queue];
+	t->capacity = batch->capacity;
+	t->cur = 0;
+	t->seeded = 0;
+	t->halves[0] = batch->packets;
+	t->halves[1] = xcalloc(batch->capacity, sizeof(struct batch_packet));
+	for (uint32_t h = 0; h < 2; h++) {
+		for (uint32_t i = 0; i < batch->capacity; i++) {
+			uint64_t addr = frame_addr(h * batch->capacity + i);
+			t->halves[h][i].buf = t->q->umem_area + addr + XDP_DATA_OFFSET;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+void send_run_cleanup(UNUSED sock_t sock)
+{
+	// the frames themselves are in the queue's UMEM
+	xfree(xdp_tx.halves[1]);
+	xdp_tx.halves[1] = NULL;
+}
+
+static void kick_tx(struct xdp_queue *q)
+{
+	if (!xsk_ring_prod__needs_wakeup(&q->tx)) {
+		return;
+	}
+	if (sendto(xsk_socket__fd(q->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0) < 0) {
+		// these only mean the kernel is still busy with earlier frames
+		if (errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+			log_error("send-xdp", "unable to wake up TX on queue %u: %s",
+				  q->id, strerror(errno));
+		}
+	}
+}
+
+static void reap_completions(struct xdp_tx *t)
+{
+	struct xdp_queue *q = t->q;
+	uint32_t idx;
+	uint32_t n = xsk_ring_cons__peek(&q->comp, 2 * t->capacity, &idx);
+	for (uint32_t i = 0; i < n; i++) {
+		uint64_t addr = *xsk_ring_cons__comp_addr(&q->comp, idx + i);
+		uint32_t frame = addr / XDP_FRAME_SIZE - XDP_RX_FRAMES;
+		t->outstanding[frame / t->capacity]--;
+	}
+	xsk_ring_cons__release(&q->comp, n);
+}
+
+int send_batch(sock_t sock, batch_t *batch, int retries)
+{
+	(void)sock;
+	if (batch->len == 0) {
+		// nothing to send
+		return EXIT_SUCCESS;
+	}
+	struct xdp_tx *t = &xdp_tx;
+	struct xdp_queue *q = t->q;
+	uint32_t idx;
+	int reserved = 0;
+	for (int i = 0; i < retries; i++) {
+		if (xsk_ring_prod__reserve(&q->tx, batch->len, &idx) == batch->len) {
+			reserved = 1;
+			break;
+		}
+		kick_tx(q);
+		reap_completions(t);
+	}
+	if (!reserved) {
+		log_error("send-xdp", "TX ring of queue %u is full", q->id);
+		return -1;
+	}
+	uint8_t *base = q->umem_area;
+	for (int i = 0; i < batch->len; i++) {
+		struct xdp_desc *desc = xsk_ring_prod__tx_desc(&q->tx, idx + i);
+		desc->addr = batch->packets[i].buf - base;
+		desc->len = batch->packets[i].len;
+	}
+	xsk_ring_prod__submit(&q->tx, batch->len);
+	t->outstanding[t->cur] += batch->len;
+	kick_tx(q);
+
+	if (!t->seeded) {
+		// The other half has never been prepared by the probe module,
+		// so seed it with the packets just built (see struct
+		// batch_packet).
+		for (uint32_t i = 0; i < t->capacity; i++) {
+			memcpy(t->halves[1][i].buf, t->halves[0][i].buf, MAX_PACKET_SIZE);
+		}
+		t->seeded = 1;
+	}
+	t->cur ^= 1;
+	batch->packets = t->halves[t->cur];
+	// the frames we are about to build into must be back from the NIC
+	while (t->outstanding[t->cur]) {
+		reap_completions(t);
+		if (t->outstanding[t->cur]) {
+			kick_tx(q);
+		}
+	}
+	return batch->len;
+}
@@ -11,6 +11,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <time.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -18,6 +19,8 @@
 #include <errno.h>
 #include <assert.h>
 #include <signal.h>
+#include <math.h>
+#include <limits.h>
 
 #include "../lib/includes.h"
 #include "../lib/util.h"
@@ -27,35 +30,82 @@
 #include "../lib/lockfd.h"
 #include "../lib/pbm.h"
 #include "../lib/xalloc.h"
+#include "../lib/ratelimit.h"
+#include "../lib/ring.h"
 
 #include "send-internal.h"
 #include "aesrand.h"
+#include "event_loop.h"
+#include "extra_probes.h"
 #include "get_gateway.h"
+#include "ifaces.h"
 #include "iterator.h"
+#include "lease.h"
+#include "netcache.h"
+#include "recv.h"
+#include "retransmit.h"
+#include "rss.h"
+#include "sample.h"
 #include "probe_modules/packet.h"
 #include "probe_modules/probe_modules.h"
+#include "shaping.h"
 #include "shard.h"
+#include "stage_timing.h"
 #include "state.h"
 #include "validate.h"
+#ifdef XDP
+#include "socket-xdp.h"
+#endif
+#include "ipv6_alias.h"
+#include "ipv6_pattern.h"
+#include "ipv6_source.h"
 #include "ipv6_target_file.h"
+#include "ipv4_target_stream.h"
 
 // The iterator over the cyclic group
 
 // Lock for send run
 static pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+// send threads through their init, under send_mutex
+static uint16_t senders_ready = 0;
+// send threads past the first --delta-from stratum
+static uint16_t senders_past_prior = 0;
 
 // Source ports for outgoing packets
 static uint16_t num_src_ports;
 
 // IPv6
 static int ipv6 = 0;
-static struct in6_addr ipv6_src;
+static ipaddr_t ipv6_src;
 
+// Token bucket shared by all send threads
+static ratelimit_t rate_limiter;
+// With a --coordinator that has a rate budget, the rate last granted this
+// machine, which caps its own; 0 otherwise
+static uint64_t rate_cap = 0;
+
+__thread struct iface_conf *send_iface;
+__thread uint64_t send_backoffs;
+__thread uint64_t send_backoff_ns;
+
+// With SO_TXTIME pacing, how far ahead of their launch times send
+// threads build packets
+#define TXTIME_LEAD_NS 2000000
+
+
+static uint64_t capped_rate(int rate)
+{
+	uint64_t cap = __atomic_load_n(&rate_cap, __ATOMIC_RELAXED);
+	return cap && (uint64_t)rate > cap ? cap : (uint64_t)rate;
+}
 
 void sig_handler_increase_speed(UNUSED int signal)
 {
 	int old_rate = zconf.rate;
 	zconf.rate += (zconf.rate * 0.05);
+	if (zconf.rate > 0) {
+		ratelimit_set_rate(&rate_limiter, capped_rate(zconf.rate));
+	}
 	log_info("send", "send rate increased from %i to %i pps.", old_rate,
 		 zconf.rate);
 }
@@ -64,35 +114,123 @@ void sig_handler_decrease_speed(UNUSED int signal)
 {
 	int old_rate = zconf.rate;
 	zconf.rate -= (zconf.rate * 0.05);
+	if (zconf.rate > 0) {
+		ratelimit_set_rate(&rate_limiter, capped_rate(zconf.rate));
+	}
 	log_info("send", "send rate decreased from %i to %i pps.", old_rate,
 		 zconf.rate);
 }
 
+void send_set_rate(int rate)
+{
+	zconf.rate = rate;
+	ratelimit_set_rate(&rate_limiter, capped_rate(rate));
+}
+
+static void send_set_rate_cap(uint64_t pps)
+{
+	__atomic_store_n(&rate_cap, pps, __ATOMIC_RELAXED);
+	ratelimit_set_rate(&rate_limiter, capped_rate(zconf.rate));
+}
+
 // global sender initialize (not thread specific)
 iterator_t *send_init(void)
 {
 	// IPv6
-	if (zconf.ipv6_target_filename) {
+	if (zconf.ipv6) {
 		ipv6 = 1;
-		int ret = inet_pton(AF_INET6, (char *) zconf.ipv6_source_ip, &ipv6_src);
-		if (ret != 1) {
-			log_fatal("send", "could not read valid IPv6 src address, inet_pton returned `%d'", ret);
+		// a single address, or the prefix of the pool, see
+		// ipv6_source.h
+		ipv6_src.v6 = zconf.ipv6_src_base;
+		if (ipv6_source_is_pool()) {
+			log_debug("send", "sending from %s", zconf.ipv6_source_ip);
+		}
+	}
+	if (zconf.ipv6_target_filename) {
+		ipv6_target_file_init(zconf.ipv6_target_filename, zconf.senders,
+				      zconf.shard_num, zconf.total_shards);
+	}
+	if (zconf.list_of_ips_stream) {
+		ipv4_target_stream_init(zconf.senders, zconf.shard_num,
+					zconf.total_shards);
+	}
+	// Memory-mapped IPv6 target files, IPv6 patterns and lists of IPs are
+	// permuted by index through the same cyclic group iterator as the IPv4
+	// address space. Streamed input can only be sent in file order, the
+	// iterator then standing idle.
+	uint64_t num_addrs = blocklist_count_allowed();
+	if (zsend.list_of_ips) {
+		num_addrs = zconf.list_of_ips_count;
+		zsend.index_targets = 1;
+	}
+	const int v6_indexed = zconf.ipv6_target_patterns_len ||
+			       (ipv6 && ipv6_target_file_indexed());
+	if (ipv6 && !v6_indexed && zconf.ipv6_max_targets_fraction > 0) {
+		log_fatal("send", "--max-targets as a percentage needs a regular "
+				  "IPv6 target file, not a stream");
+	}
+	if (v6_indexed) {
+		if (zconf.ipv6_target_patterns_len) {
+			num_addrs = ipv6_pattern_count();
+		} else {
+			num_addrs = ipv6_target_file_count();
+		}
+		if (!num_addrs) {
+			log_fatal("send", "no IPv6 targets in %s",
+				  zconf.ipv6_target_filename);
+		}
+		if (num_addrs * zconf.ports->port_count >
+		    IPV6_PATTERN_MAX_TARGETS) {
+			log_fatal("send",
+				  "%" PRIu64 " IPv6 targets on %u ports are more "
+				  "than the 2^48 the iterator can permute",
+				  num_addrs, zconf.ports->port_count);
 		}
-		ipv6_target_file_init(zconf.ipv6_target_filename);
+		zsend.index_targets = 1;
+		if (zconf.ipv6_max_targets_fraction > 0) {
+			zsend.max_targets = (uint64_t)(zconf.ipv6_max_targets_fraction *
+						       num_addrs * zconf.ports->port_count);
+			if (!zsend.max_targets) {
+				zsend.max_targets = 1;
+			}
+			log_debug("send", "max targets is %" PRIu64 " of %" PRIu64
+				  " IPv6 targets", zsend.max_targets, num_addrs);
+		}
+	}
+	if (zsend.index_targets && 2 * zconf.senders >= num_addrs &&
+	    zconf.senders > zconf.num_ifaces) {
+		log_warn("send", "too few targets relative to senders, "
+				 "dropping to one sender%s",
+			 zconf.num_ifaces > 1 ? " per interface" : "");
+		zconf.senders = zconf.num_ifaces > 1 ? zconf.num_ifaces : 1;
 	}
+	ifaces_assign_senders();
 
 	// generate a new primitive root and starting position
 	iterator_t *it;
 	uint32_t num_subshards = (uint32_t)zconf.senders * (uint32_t)zconf.total_shards;
-	if (num_subshards > (blocklist_count_allowed() * zconf.ports->port_count)) {
+	if (num_subshards > (num_addrs * zconf.ports->port_count)) {
 		log_fatal("send", "senders * shards > allowed probes");
 	}
 	if (zsend.max_targets && (num_subshards > zsend.max_targets)) {
 		log_fatal("send", "senders * shards > max targets");
 	}
-	uint64_t num_addrs = blocklist_count_allowed();
 	it = iterator_init(zconf.senders, zconf.shard_num, zconf.total_shards,
 			   num_addrs, zconf.ports->port_count);
+	// keyed after the cycle, which stays that of an unsampled scan
+	sample_init();
+	shaping_init();
+	if (zconf.coordinator) {
+		uint64_t order = get_shard(it, 0)->params.order;
+		lease_connect(zconf.coordinator, order,
+			      lease_config_hash(zconf.seed, order,
+						zsend.max_index, zconf.ports),
+			      zconf.senders);
+		for (uint16_t i = 0; i < zconf.senders; i++) {
+			shard_set_lease_source(get_shard(it, i), lease_next,
+					       NULL);
+		}
+	}
 	// determine the source address offset from which we'll send packets
 	struct in_addr temp;
 	temp.s_addr = zconf.source_ip_addresses[0];
@@ -114,6 +252,7 @@ iterator_t *send_init(void)
 			    "global initialization for probe module failed.");
 		}
 	}
+	extra_probes_global_initialize();
 	// only allow bandwidth or rate
 	if (zconf.bandwidth > 0 && zconf.rate > 0) {
 		log_fatal(
@@ -123,7 +262,7 @@ iterator_t *send_init(void)
 	// Convert specified bandwidth to packet rate. This is an estimate using the
 	// max packet size a probe module will generate.
 	if (zconf.bandwidth > 0) {
-		size_t pkt_len = zconf.probe_module->max_packet_length;
+		size_t pkt_len = probes_max_packet_length();
 		pkt_len *= 8;
 		// 7 byte MAC preamble, 1 byte Start frame, 4 byte CRC, 12 byte
 		// inter-frame gap
@@ -152,10 +291,17 @@ iterator_t *send_init(void)
 		    "using bandwidth %lu bits/s for %zu byte probe, rate set to %d pkt/s",
 		    zconf.bandwidth, pkt_len / 8, zconf.rate);
 	}
+	// with a share of the coordinator's budget, a machine not limited
+	// otherwise may take all of it
+	if (lease_rate_budget() && zconf.rate <= 0) {
+		zconf.rate = lease_rate_budget() < INT_MAX
+				 ? (int)lease_rate_budget()
+				 : INT_MAX;
+	}
 	// convert default placeholder to default value
 	if (zconf.rate == -1) {
-		// default 10K pps
-		zconf.rate = 10000;
+		// default 10K pps, unlimited when only measuring packet building
+		zconf.rate = zconf.dryrun == DRYRUN_NULL ? 0 : 10000;
 	}
 	// log rate, if explicitly specified
 	if (zconf.rate < 0) {
@@ -164,37 +310,81 @@ iterator_t *send_init(void)
 	if (zconf.rate > 0 && zconf.bandwidth <= 0) {
 		log_debug("send", "rate set to %d pkt/s", zconf.rate);
 	}
-	// Get the source hardware address, and give it to the probe
-	// module
-	if (!zconf.hw_mac_set) {
-		if (get_iface_hw_addr(zconf.iface, zconf.hw_mac)) {
+	if (zconf.delta_rate && zconf.rate <= 0) {
+		log_fatal("send", "--delta-rate needs a send rate to slow down "
+				  "from");
+	}
+	if (zconf.delta_rate && !zsend.delta_prior_count) {
+		// there is only the rest of the space
+		zconf.rate = zconf.delta_rate;
+	}
+	if (zconf.rate > 0) {
+		ratelimit_init(&rate_limiter, zconf.rate, zconf.batch);
+		if (zconf.event_loop) {
+			// receiving in the meantime
+			ratelimit_set_wait(&rate_limiter, event_loop_wait);
+		}
+		if (lease_rate_budget()) {
+			lease_rate_start(send_set_rate_cap);
+		}
+	} else if (zconf.pacing != PACING_USERSPACE) {
+		log_warn("send", "--pacing=%s has no effect without a send rate",
+			 PACING_NAMES[zconf.pacing]);
+	}
+	// Get the source hardware address of each interface, and give it
+	// to the probe module
+	for (uint8_t i = 0; i < zconf.num_ifaces; i++) {
+		struct iface_conf *ifc = &zconf.ifaces[i];
+		if (i == 0 && zconf.hw_mac_set) {
+			memcpy(ifc->hw_mac, zconf.hw_mac, ETHER_ADDR_LEN);
+		} else if (!netcache_hw_mac(ifc->name, ifc->hw_mac)) {
+			log_debug("send", "source MAC address of %s from the "
+					  "network cache",
+				  ifc->name);
+		} else if (get_iface_hw_addr(ifc->name, ifc->hw_mac)) {
 			log_fatal(
 			    "send",
 			    "ZMap could not retrieve the hardware (MAC) address for "
 			    "the interface \"%s\". You likely do not privileges to open a raw packet socket. "
 			    "Are you running as root or with the CAP_NET_RAW capability? If you are, you "
 			    "may need to manually set the source MAC address with the \"--source-mac\" flag.",
-			    zconf.iface);
+			    ifc->name);
 			return NULL;
+		} else {
+			log_debug(
+			    "send",
+			    "no source MAC provided. "
+			    "automatically detected %02x:%02x:%02x:%02x:%02x:%02x as hw "
+			    "interface for %s",
+			    ifc->hw_mac[0], ifc->hw_mac[1], ifc->hw_mac[2],
+			    ifc->hw_mac[3], ifc->hw_mac[4], ifc->hw_mac[5],
+			    ifc->name);
+			netcache_set_hw_mac(ifc->name, ifc->hw_mac);
 		}
-		log_debug(
-		    "send",
-		    "no source MAC provided. "
-		    "automatically detected %02x:%02x:%02x:%02x:%02x:%02x as hw "
-		    "interface for %s",
-		    zconf.hw_mac[0], zconf.hw_mac[1], zconf.hw_mac[2],
-		    zconf.hw_mac[3], zconf.hw_mac[4], zconf.hw_mac[5],
-		    zconf.iface);
 	}
+	memcpy(zconf.hw_mac, zconf.ifaces[0].hw_mac, ETHER_ADDR_LEN);
 	log_debug("send", "source MAC address %02x:%02x:%02x:%02x:%02x:%02x",
 		  zconf.hw_mac[0], zconf.hw_mac[1], zconf.hw_mac[2],
 		  zconf.hw_mac[3], zconf.hw_mac[4], zconf.hw_mac[5]);
 
-	if (zconf.dryrun) {
+	if (zconf.dryrun == DRYRUN_NULL) {
+		log_info("send", "null dryrun mode -- building packets, then "
+				 "discarding them");
+	} else if (zconf.dryrun) {
 		log_info("send", "dryrun mode -- won't actually send packets");
 	}
-	// initialize random validation key
-	validate_init();
+	// initialize random validation key, or the one of an earlier scan
+	if (zconf.validation_key_filename) {
+		if (validate_load_key(zconf.validation_key_filename)) {
+			log_fatal("send", "unable to load the validation key");
+		}
+	} else {
+		validate_init();
+	}
+	if (zconf.save_validation_key_filename &&
+	    validate_save_key(zconf.save_validation_key_filename)) {
+		log_fatal("send", "unable to save the validation key");
+	}
 	// setup signal handlers for changing scan speed
 	signal(SIGUSR1, sig_handler_increase_speed);
 	signal(SIGUSR2, sig_handler_decrease_speed);
@@ -202,338 +392,1244 @@ iterator_t *send_init(void)
 	return it;
 }
 
+// the IPv6 source of a probe out of its validation input, the XOR of
+// source and destination
+static inline void get_src_ipv6(const validate_input_t *in,
+				const struct in6_addr *dst, struct in6_addr *src)
+{
+	const uint32_t *d = (const uint32_t *)dst;
+	uint32_t *out = (uint32_t *)src;
+	for (size_t w = 0; w < VALIDATE_BYTES / sizeof(uint32_t); w++) {
+		out[w] = in->input[w] ^ d[w];
+	}
+}
+
 static inline ipaddr_n_t get_src_ip(ipaddr_n_t dst, int local_offset)
 {
-	if (zconf.number_source_ips == 1) {
-		return zconf.source_ip_addresses[0];
+	if (send_iface->number_source_ips == 1) {
+		return send_iface->source_ip_addresses[0];
 	}
-	return zconf.source_ip_addresses[(ntohl(dst) + local_offset) %
-					 zconf.number_source_ips];
+	return send_iface->source_ip_addresses[(ntohl(dst) + local_offset) %
+					       send_iface->number_source_ips];
 }
 
-// one sender thread
-int send_run(sock_t st, shard_t *s)
+// Threads claim a whole batch worth of tokens at a time, but never more
+// than 10ms worth, so that slow scans still notice when they are done.
+static inline uint32_t tokens_per_claim(void)
 {
-	log_debug("send", "send thread started");
-	pthread_mutex_lock(&send_mutex);
-	// allocate batch
-	batch_t *batch = create_packet_batch(zconf.batch);
+	uint32_t n = zconf.rate / 100;
+	if (n > zconf.batch) {
+		n = zconf.batch;
+	}
+	return n ? n : 1;
+}
 
-	// OS specific per-thread init
-	if (send_run_init(st)) {
-		pthread_mutex_unlock(&send_mutex);
-		return EXIT_FAILURE;
+// A probe module and the batch its packets are built in. Each send thread
+// has one for the main module and one for each --extra-probe-module. The
+// main one probes every target, so no other batch is fuller than its, and
+// all of them are sent once it is full.
+typedef struct send_lane {
+	probe_module_t *pm;
+	// NULL for the main module
+	const extra_probe_t *extra;
+	batch_t *batch;
+	probe_spec_t *specs;
+	void *probe_data;
+	uint64_t packets_sent;
+} send_lane_t;
+
+// Builds the packets queued in the lane's batch from its specs, with
+// make_packets when the probe module has it and a make_packet call for
+// each otherwise.
+static void build_packets(send_lane_t *lane, uint8_t ttl, uint16_t thread_id)
+{
+	probe_module_t *pm = lane->pm;
+	batch_t *batch = lane->batch;
+	probe_spec_t *specs = lane->specs;
+	uint64_t t0 = stage_begin(STAGE_BUILD);
+	if (pm->make_packets) {
+		pm->make_packets(batch->packets, specs, batch->len, ttl,
+				 lane->probe_data);
+	} else {
+		for (int i = 0; i < batch->len; i++) {
+			probe_spec_t *spec = &specs[i];
+			size_t length = 0;
+			pm->make_packet(batch->packets[i].buf, &length,
+					&spec->src_ip, &spec->dst_ip,
+					spec->dst_port, ttl, spec->validation,
+					spec->probe_num, spec->ip_id,
+					lane->probe_data);
+			batch->packets[i].len = (uint32_t)length;
+		}
 	}
+	stage_end(STAGE_BUILD, t0);
+	for (int i = 0; i < batch->len; i++) {
+		if (batch->packets[i].len > MAX_PACKET_SIZE) {
+			log_fatal(
+			    "send",
+			    "send thread %hu set length (%u) larger than MAX (%zu)",
+			    thread_id, batch->packets[i].len, MAX_PACKET_SIZE);
+		}
+	}
+}
 
-	// MAC address length in characters
-	char mac_buf[(ETHER_ADDR_LEN * 2) + (ETHER_ADDR_LEN - 1) + 1];
-	char *p = mac_buf;
-	for (int i = 0; i < ETHER_ADDR_LEN; i++) {
-		if (i == ETHER_ADDR_LEN - 1) {
-			snprintf(p, 3, "%.2x", zconf.hw_mac[i]);
-			p += 2;
-		} else {
-			snprintf(p, 4, "%.2x:", zconf.hw_mac[i]);
-			p += 3;
+// Weighted least squares fit of what a send_batch() call costs against
+// the packets in it, older calls weighing less and less. Its intercept is
+// the fixed cost of a call, which is what larger batches amortize.
+typedef struct batch_cost {
+	// decayed sums of 1, n, t, n*n and n*t over the calls
+	double w, n, t, nn, nt;
+	double call_ns;
+	uint64_t calls;
+	uint64_t packets;
+} batch_cost_t;
+
+#define BATCH_COST_DECAY 0.99
+// the fixed cost of send calls may take up this share of a send thread's
+// time before batches grow
+#define BATCH_OVERHEAD_SHARE 0.125
+
+static void batch_cost_add(batch_cost_t *bc, uint32_t n, uint64_t ns)
+{
+	double t = (double)ns;
+	bc->w = BATCH_COST_DECAY * bc->w + 1;
+	bc->n = BATCH_COST_DECAY * bc->n + n;
+	bc->t = BATCH_COST_DECAY * bc->t + t;
+	bc->nn = BATCH_COST_DECAY * bc->nn + (double)n * n;
+	bc->nt = BATCH_COST_DECAY * bc->nt + n * t;
+	bc->calls++;
+	bc->packets += n;
+	// w^2 times the variance of the batch sizes
+	double var = bc->w * bc->nn - bc->n * bc->n;
+	double call = bc->t / bc->w;
+	if (var > 0.25 * bc->w * bc->w) {
+		double per_packet = (bc->w * bc->nt - bc->n * bc->t) / var;
+		if (per_packet > 0) {
+			call = (bc->t - per_packet * bc->n) / bc->w;
 		}
 	}
-	log_debug("send", "source MAC address %s", mac_buf);
+	// With batches that all had the same size the whole cost of a call
+	// counts as fixed, which errs towards larger batches.
+	bc->call_ns = call > 0 ? call : 0;
+}
+
+// A group of targets, resolved and with the validation of every (target,
+// packet stream) pair, which the send loop turns into probes
+typedef struct target_group {
+	size_t num_targets;
+	target_t *targets;
+	validate_input_t *validation_inputs;
+	uint8_t (*validations)[VALIDATE_BYTES];
+} target_group_t;
 
-	void *probe_data = NULL;
-	if (zconf.probe_module->thread_initialize) {
-		int rv = zconf.probe_module->thread_initialize(&probe_data);
-		if (rv != EXIT_SUCCESS) {
-			pthread_mutex_unlock(&send_mutex);
-			log_fatal("send", "Send thread initialization for probe module failed: %u", rv);
+// Where a send thread's targets come from, its shard or a stream (of IPv6
+// targets or --list-of-ips-file=-), and what fetching them keeps track of. Only the thread fetching the
+// groups, the send thread itself or its generator, touches it.
+typedef struct target_source {
+	shard_t *s;
+	// targets taken at a time, the capacity of the send batch
+	size_t capacity;
+	size_t max_batch_targets;
+	int stream;
+	// the streamed address being paired with each port in turn
+	struct in6_addr stream_addr;
+	uint32_t stream_ip;
+	uint32_t stream_port;
+	// --checkpoint-file: the shard before the group of targets in flight
+	int checkpoint;
+	shard_checkpoint_t pending;
+	// the --delta-from stratum the shard was last seen in
+	uint8_t stratum;
+} target_source_t;
+
+// What a send thread's loop works with, set up once by send_run()
+typedef struct send_loop_ctx {
+	sock_t st;
+	shard_t *s;
+	send_lane_t *lanes;
+	int num_lanes;
+	// the targets come from src into own, or with --target-threads from
+	// the thread's generator through pipe
+	target_source_t src;
+	target_group_t own;
+	struct target_pipe *pipe;
+	uint8_t ttl;
+	int attempts;
+	uint64_t lead_ns;
+	// --probe-spacing: the probes after the first, until they are due
+	uint64_t spacing_ns;
+	retransmit_wheel_t wheel;
+	// --prefix-shaping: the probes to throttled groups, put off
+	int shaping;
+	retransmit_wheel_t deferred;
+	// Batches go out once the main lane's holds batch_target packets or,
+	// rate limited, once the rate's schedule is batch_deadline_ns past
+	// its first probe. With adaptive batches the target follows the
+	// rate and the measured cost of a send call.
+	int adaptive_batch;
+	uint16_t batch_target;
+	uint64_t batch_deadline_ns;
+	uint64_t batch_first_ns;
+	batch_cost_t cost;
+	// the errno of the last batch that failed altogether
+	int last_errno;
+} send_loop_ctx_t;
+
+// The send rate's tokens a thread has claimed, and when the packets they
+// are for go out
+typedef struct send_pace {
+	// claimed from the shared rate limiter but not yet spent
+	uint32_t tokens;
+	// launch time of the next packet, relative to the limiter's epoch
+	uint64_t txtime_ps;
+	uint64_t txtime_cost_ps;
+} send_pace_t;
+
+static inline uint64_t send_clock_ns(void)
+{
+	return (uint64_t)(steady_now() * 1e9);
+}
+
+// Once every thread has finished the prior hosts of --delta-from, the rest
+// of the space goes out at --delta-rate
+static void delta_stratum_changed(void)
+{
+	uint16_t past =
+	    __atomic_add_fetch(&senders_past_prior, 1, __ATOMIC_RELAXED);
+	if (past == zconf.senders && zconf.delta_rate) {
+		log_info("send", "prior hosts done, send rate lowered to %d pps",
+			 zconf.delta_rate);
+		send_set_rate(zconf.delta_rate);
+	}
+}
+
+static void dryrun_batch(send_lane_t *lane)
+{
+	batch_t *batch = lane->batch;
+	// --null-dryrun: the packets were built, which is all it measures
+	if (zconf.dryrun == DRYRUN_NULL) {
+		batch->len = 0;
+		return;
+	}
+	lock_file(stdout);
+	for (int i = 0; i < batch->len; i++) {
+		lane->pm->print_packet(stdout, batch->packets[i].buf);
+	}
+	unlock_file(stdout);
+	// reset batch length for next batch
+	batch->len = 0;
+}
+
+static void send_backoff_flush(shard_t *s)
+{
+	if (send_backoffs) {
+		shard_stat_add(&s->stats->send_backoffs, send_backoffs);
+		shard_stat_add(&s->stats->backoff_ns, send_backoff_ns);
+		send_backoffs = 0;
+		send_backoff_ns = 0;
+	}
+}
+
+static void flush_batch(send_loop_ctx_t *c, send_lane_t *lane)
+{
+	batch_t *batch = lane->batch;
+	shard_t *s = c->s;
+	build_packets(lane, c->ttl, s->thread_id);
+	// batch is full, sending
+	uint64_t t0 = stage_begin(STAGE_SEND);
+	uint64_t start_ns = c->adaptive_batch ? send_clock_ns() : 0;
+	int rc = send_batch(c->st, batch, c->attempts);
+	if (c->adaptive_batch) {
+		batch_cost_add(&c->cost, batch->len, send_clock_ns() - start_ns);
+	}
+	stage_end(STAGE_SEND, t0);
+	send_backoff_flush(s);
+	// whether batch succeeds or fails, this was the only attempt. Any
+	// re-tries are handled within batch
+	if (rc < 0) {
+		// the failed packets are counted, and a run of failures with
+		// the same error logged once
+		if (errno != c->last_errno) {
+			log_error("send_batch",
+				  "could not send any batch packets: %s",
+				  strerror(errno));
+			c->last_errno = errno;
 		}
+		// rc is the last error code if all packets couldn't be sent
+		shard_stat_add(&s->stats->packets_failed, batch->len);
+	} else {
+		// rc is number of packets sent successfully, if > 0
+		shard_stat_add(&s->stats->packets_failed, batch->len - rc);
 	}
-	pthread_mutex_unlock(&send_mutex);
+	// reset batch length for next batch
+	batch->len = 0;
+}
 
-	if (zconf.probe_module->prepare_packet) {
-		for (size_t i = 0; i < batch->capacity; i++) {
-			int rv = zconf.probe_module->prepare_packet(
-			    batch->packets[i].buf, zconf.hw_mac, zconf.gw_mac, probe_data);
-			if (rv != EXIT_SUCCESS) {
-				log_fatal("send", "Probe module failed to prepare packet: %u", rv);
-			}
-		}
-	}
-
-	
-	// adaptive timing to hit target rate
-	uint64_t count = 0;
-	uint64_t last_count = count;
-	double last_time = steady_now();
-	uint32_t delay = 0;
-	int interval = 0;
-	volatile int vi;
-	struct timespec ts, rem;
-	double send_rate =
-	    (double)zconf.rate /
-	    ((double)zconf.senders * zconf.packet_streams);
-	const double slow_rate = 1000; // packets per seconds per thread
-	// at which it uses the slow methods
-	long nsec_per_sec = 1000 * 1000 * 1000;
-	long long sleep_time = nsec_per_sec;
-	if (zconf.rate > 0) {
-		delay = 10000;
-		if (send_rate < slow_rate) {
-			// set the initial time difference
-			sleep_time = nsec_per_sec / send_rate;
-			last_time = steady_now() - (1.0 / send_rate);
+// The smallest batch whose send calls keep their fixed cost within
+// BATCH_OVERHEAD_SHARE of the thread's time at its share of the rate
+static uint16_t adaptive_batch_target(const send_loop_ctx_t *c)
+{
+	uint16_t capacity = c->lanes[0].batch->capacity;
+	// the rate may have changed since, by signal or --adaptive-rate
+	int rate = zconf.rate;
+	if (rate <= 0) {
+		return capacity;
+	}
+	double pps = (double)rate / zconf.senders;
+	double n = ceil(pps * c->cost.call_ns * 1e-9 / BATCH_OVERHEAD_SHARE);
+	if (n >= capacity) {
+		return capacity;
+	}
+	return n > zconf.batch_min ? (uint16_t)n : zconf.batch_min;
+}
+
+// Sends (or with a dry run, prints) the batch of every lane
+static void send_lanes(send_loop_ctx_t *c, const int dryrun)
+{
+	for (int l = 0; l < c->num_lanes; l++) {
+		if (dryrun) {
+			build_packets(&c->lanes[l], c->ttl, c->s->thread_id);
+			dryrun_batch(&c->lanes[l]);
 		} else {
-			// estimate initial rate
-			for (vi = delay; vi--;)
-				;
-			delay *= 1 / (steady_now() - last_time) /
-				 ((double)zconf.rate /
-				  (double)zconf.senders);
-			interval = ((double)zconf.rate /
-				    (double)zconf.senders) /
-				   20;
-			last_time = steady_now();
-			assert(interval > 0);
-			if (delay == 0) {
-				// at extremely high bandwidths, the delay could be set to zero.
-				// this breaks the multiplier logic below, so we'll hard-set it to 1 in this case.
-				delay = 1;
-			}
-		}
-	}
-	int attempts = zconf.retries + 1;
-	// Get the initial IP to scan.
-	target_t current;
-	uint32_t current_ip = 0;
-	uint16_t current_port = 0;
-	struct in6_addr ipv6_dst;
+			flush_batch(c, &c->lanes[l]);
+		}
+	}
+	if (c->adaptive_batch) {
+		c->batch_target = adaptive_batch_target(c);
+	}
+	if (zconf.event_loop) {
+		event_loop_wait(0);
+	}
+}
 
-	if (ipv6) {
-		int ret = ipv6_target_file_get_ipv6(&ipv6_dst);
-		if (ret != 0) {
-			log_debug("send", "send thread %hhu finished, no more target IPv6 addresses", s->thread_id);
-			goto cleanup;
+// Queues one probe in the batch of every lane that takes the target, and
+// sends the batches once the main module's is full or has waited long
+// enough
+static inline __attribute__((always_inline)) void
+queue_probe(send_loop_ctx_t *c, send_pace_t *pace, const int v6,
+	    const int dryrun, const int rated, const ipaddr_t *src,
+	    const ipaddr_t *dst, port_h_t port, const uint8_t *validation,
+	    int probe_num)
+{
+	send_lane_t *lanes = c->lanes;
+	batch_t *batch = lanes[0].batch;
+	const uint64_t lead_ns = rated ? c->lead_ns : 0;
+	uint32_t queued = 0;
+	for (int l = 0; l < c->num_lanes; l++) {
+		if (l && !extra_probe_takes(lanes[l].extra, dst, port, v6)) {
+			continue;
 		}
-		probe_data = malloc(2*sizeof(struct in6_addr));
-		current_port = zconf.ports->ports[0];
-	} else {
-		current = shard_get_cur_target(s);
-		// If provided a list of IPs to scan, then the first generated address
-		// might not be on that list. Iterate until the current IP is one the
-		// list, then start the true scanning process.
-			if (zconf.list_of_ips_filename) {
-			while (!pbm_check(zsend.list_of_ips_pbm, current_ip)) {
-				current = shard_get_next_target(s);
-				current_ip = current.ip;
-				current_port = current.port;
-				if (current.status == ZMAP_SHARD_DONE) {
-					log_debug(
-					    "send",
-					    "never made it to send loop in send thread %i",
-					    s->thread_id);
-					goto cleanup;
-				}
+		if (rated && !pace->tokens) {
+			// a partial batch goes out rather than wait for the
+			// next claim past its deadline
+			if (c->batch_deadline_ns && batch->len &&
+			    ratelimit_next(&rate_limiter) >=
+				c->batch_first_ns + c->batch_deadline_ns) {
+				send_lanes(c, dryrun);
+			}
+			pace->tokens = tokens_per_claim();
+			pace->txtime_ps = ratelimit_acquire(&rate_limiter, pace->tokens, lead_ns) * 1000;
+			pace->txtime_cost_ps = ratelimit_cost(&rate_limiter);
+		}
+		pace->tokens--;
+		batch_t *b = lanes[l].batch;
+		probe_spec_t *spec = &lanes[l].specs[b->len];
+		spec->src_ip = *src;
+		spec->dst_ip = *dst;
+		memcpy(spec->validation, validation, VALIDATE_BYTES);
+		spec->dst_port = htons(port);
+		// Grab last 2 bytes of validation for ip_id
+		spec->ip_id = (uint16_t)(spec->validation[VALIDATE_BYTES / sizeof(uint32_t) - 1] & 0xFFFF);
+		spec->probe_num = probe_num;
+		if (rated) {
+			if (lead_ns) {
+				b->packets[b->len].txtime = rate_limiter.epoch_ns + pace->txtime_ps / 1000;
 			}
+			if (!l && !b->len) {
+				c->batch_first_ns = pace->txtime_ps / 1000;
+			}
+			pace->txtime_ps += pace->txtime_cost_ps;
 		}
+		b->len++;
+		lanes[l].packets_sent++;
+		queued++;
 	}
-	while (1) {
-		// Adaptive timing delay
-		if (count && delay > 0) {
-			if (send_rate < slow_rate) {
-				double t = steady_now();
-				double last_rate = (1.0 / (t - last_time));
-
-				sleep_time *= ((last_rate / send_rate) + 1) / 2;
-				ts.tv_sec = sleep_time / nsec_per_sec;
-				ts.tv_nsec = sleep_time % nsec_per_sec;
-				log_debug("sleep",
-					  "sleep for %d sec, %ld nanoseconds",
-					  ts.tv_sec, ts.tv_nsec);
-				while (nanosleep(&ts, &rem) == -1) {
+	shard_stat_add(&c->s->stats->packets_sent, queued);
+	if (batch->len >= c->batch_target ||
+	    (rated && c->batch_deadline_ns &&
+	     pace->txtime_ps / 1000 >=
+		 c->batch_first_ns + c->batch_deadline_ns)) {
+		send_lanes(c, dryrun);
+	}
+}
+
+// --ipv6-alias-detect: the test probes due, to the first port, into targets
+static size_t take_alias_tests(target_t *targets, size_t max)
+{
+	struct in6_addr addrs[IPV6_ALIAS_MAX_TESTS];
+	if (max > IPV6_ALIAS_MAX_TESTS) {
+		max = IPV6_ALIAS_MAX_TESTS;
+	}
+	size_t n = ipv6_alias_take_tests(addrs, max);
+	for (size_t i = 0; i < n; i++) {
+		targets[i].addr.v6 = addrs[i];
+		targets[i].port = (uint16_t)zconf.ports->ports[0];
+		targets[i].status = ZMAP_SHARD_OK;
+	}
+	return n;
+}
+
+// Sends the held probes that are due by now_ns, but not to targets that
+// have responded since
+static inline __attribute__((always_inline)) void
+send_due_probes(send_loop_ctx_t *c, send_pace_t *pace, const int v6,
+		const int dryrun, const int rated, uint64_t now_ns)
+{
+	uint32_t n;
+	retransmit_t *due;
+	while ((due = retransmit_expire(&c->wheel, now_ns, &n))) {
+		for (uint32_t j = 0; j < n; j++) {
+			const retransmit_t *r = &due[j];
+			if (!v6 && recv_responded(r->dst_ip.v4, htons(r->port))) {
+				shard_stat_add(&c->s->stats->retransmits_skipped, 1);
+				continue;
+			}
+			queue_probe(c, pace, v6, dryrun, rated, &r->src_ip,
+				    &r->dst_ip, r->port, r->validation,
+				    r->probe_num);
+		}
+	}
+}
+
+// --prefix-shaping: sends the deferred probes that are due by now_ns and
+// that their group now admits, and puts the others off again, for twice as
+// long, unless that was their last deferral
+static inline __attribute__((always_inline)) void
+send_deferred(send_loop_ctx_t *c, send_pace_t *pace, const int dryrun,
+	      const int rated, uint64_t now_ns)
+{
+	uint32_t n;
+	retransmit_t *due;
+	while ((due = retransmit_expire(&c->deferred, now_ns, &n))) {
+		for (uint32_t j = 0; j < n; j++) {
+			const retransmit_t *r = &due[j];
+			uint32_t g = shaping_group(ntohl(r->dst_ip.v4));
+			if (r->deferrals < SHAPING_MAX_DEFERRALS &&
+			    !shaping_admit(g, 1)) {
+				retransmit_t again = *r;
+				again.deferrals++;
+				retransmit_add(&c->deferred, &again,
+					       now_ns + (SHAPING_DEFER_NS
+							 << r->deferrals));
+				continue;
+			}
+			if (r->deferrals == SHAPING_MAX_DEFERRALS) {
+				__atomic_fetch_add(&zshaping.forced, 1,
+						   __ATOMIC_RELAXED);
+			}
+			if (!r->probe_num) {
+				shaping_probed(g);
+			}
+			queue_probe(c, pace, 0, dryrun, rated, &r->src_ip,
+				    &r->dst_ip, r->port, r->validation,
+				    r->probe_num);
+		}
+	}
+}
+
+// Fills g with the next group of targets, none once the source is done.
+// Called with constant flags from the send loop and the generator threads.
+static inline __attribute__((always_inline)) void
+fetch_group(target_source_t *source, target_group_t *g, const int v6,
+	    const int streams)
+{
+	shard_t *s = source->s;
+	shard_stats_t *stats = s->stats;
+	target_t *targets = g->targets;
+	validate_input_t *validation_inputs = g->validation_inputs;
+	uint8_t (*validations)[VALIDATE_BYTES] = g->validations;
+	const int stream = source->stream;
+	const int v6_pool = v6 && ipv6_source_is_pool();
+	size_t num_targets;
+	for (;;) {
+		uint64_t t0 = stage_begin(STAGE_TARGETS);
+		// --ipv6-alias-detect tests go in front, leaving at
+		// least half of the batch to the targets
+		size_t tests = 0;
+		if (v6 && zconf.ipv6_alias_detect) {
+			tests = take_alias_tests(targets,
+						 (source->capacity + 1) / 2);
+		}
+		if (stream && v6) {
+			num_targets = tests;
+			if (source->stream_port == 0 &&
+			    ipv6_target_file_get_ipv6(s->thread_id, &source->stream_addr)) {
+				source->stream_port = zconf.ports->port_count;
+			}
+			while (num_targets < source->max_batch_targets &&
+			       source->stream_port < zconf.ports->port_count) {
+				targets[num_targets].addr.v6 = source->stream_addr;
+				targets[num_targets].port =
+				    zconf.ports->ports[source->stream_port++];
+				num_targets++;
+			}
+			if (num_targets > tests) {
+				source->stream_port %= zconf.ports->port_count;
+			}
+		} else if (stream) {
+			// unlike IPv6 a batch takes several addresses, there
+			// being no per-address work to keep it small for
+			num_targets = 0;
+			while (num_targets < source->capacity) {
+				if (source->stream_port == 0 &&
+				    ipv4_target_stream_get(s->thread_id,
+							   &source->stream_ip)) {
+					break;
 				}
-				last_time = t;
-			} else {
-				for (vi = delay; vi--;)
-					;
-				if (!interval || (count % interval == 0)) {
-					double t = steady_now();
-					assert(count > last_count);
-					assert(t > last_time);
-					double multiplier =
-					    (double)(count - last_count) /
-					    (t - last_time) /
-					    (zconf.rate / zconf.senders);
-					uint32_t old_delay = delay;
-					delay *= multiplier;
-					if (delay == old_delay) {
-						if (multiplier > 1.0) {
-							delay *= 2;
-						} else if (multiplier < 1.0) {
-							delay *= 0.5;
-						}
-					}
-					if (delay == 0) {
-						// delay could become zero if the actual send rate stays below the target rate for long enough
-						// this could be due to things like VM cpu contention, or the NIC being saturated.
-						// However, we never want delay to become 0, as this would remove any rate limiting for the rest
-						// of the ZMap invocation (since 0 * multiplier = 0 for any multiplier). To prevent the removal
-						// of rate-limiting we'll set delay to one here.
-						delay = 1;
+				targets[num_targets].ip = source->stream_ip;
+				targets[num_targets].port =
+				    zconf.ports->ports[source->stream_port++];
+				source->stream_port %= zconf.ports->port_count;
+				num_targets++;
+			}
+		} else {
+			// a thread out of targets takes over part of
+			// another's
+			int refilled = s->current == ZMAP_SHARD_DONE &&
+				       shard_refill(s);
+			if (s->stratum != source->stratum) {
+				source->stratum = s->stratum;
+				delta_stratum_changed();
+			}
+			// A group fills a batch, so once the next one is
+			// wanted everything before the last one has been
+			// sent and may be checkpointed. That may have been
+			// in the range left behind, which stays in the
+			// checkpoint until then.
+			if (source->checkpoint) {
+				shard_checkpoint_t next =
+				    shard_checkpoint_take(s);
+				shard_checkpoint_publish(
+				    s, &source->pending,
+				    refilled ? &next : NULL);
+				source->pending = next;
+			}
+			num_targets = tests + shard_get_next_targets(
+						    s, targets + tests,
+						    source->capacity - tests);
+		}
+		stage_end(STAGE_TARGETS, t0);
+		t0 = stage_begin(STAGE_VALIDATION);
+		size_t k = 0;
+		size_t kept = 0;
+		for (size_t t = 0; t < num_targets; t++) {
+			if (v6 && !stream && t >= tests) {
+				// resolve the index in place
+				uint64_t index = targets[t].index;
+				if (zconf.ipv6_target_patterns_len) {
+					ipv6_pattern_get_index(
+					    index, &targets[t].addr.v6);
+				} else {
+					ipv6_target_file_get_index(
+					    (uint32_t)index,
+					    &targets[t].addr.v6);
+				}
+			}
+			if (v6 && t >= tests &&
+			    !blocklist_is_allowed_ipv6(&targets[t].addr.v6)) {
+				shard_stat_add(&stats->ipv6_blocklisted, 1);
+				continue;
+			}
+			if (v6 && zconf.ipv6_alias_detect && t >= tests &&
+			    ipv6_alias_skip(&targets[t].addr.v6)) {
+				shard_stat_add(&stats->aliased_skipped, 1);
+				continue;
+			}
+			targets[kept] = targets[t];
+			for (int i = 0; i < streams; i++) {
+				if (v6) {
+					validation_inputs[k++] = validate_input_ipv6(
+					    &ipv6_src.v6, &targets[kept].addr.v6);
+				} else {
+					validation_inputs[k++] = validate_input(
+					    get_src_ip(targets[kept].ip, i),
+					    targets[kept].ip, htons(targets[kept].port));
+				}
+			}
+			kept++;
+		}
+		if (!kept && num_targets) {
+			// all of them were blocklisted or in aliased
+			// prefixes
+			num_targets = 0;
+			stage_end(STAGE_VALIDATION, t0);
+			continue;
+		}
+		num_targets = kept;
+		validate_gen_batch(validation_inputs, validations, k);
+		if (v6_pool) {
+			// those were of the prefix, and pick each
+			// probe's source, which is then validated as
+			// any other
+			k = 0;
+			for (size_t t = 0; t < num_targets; t++) {
+				for (int i = 0; i < streams; i++, k++) {
+					struct in6_addr src;
+					ipv6_source_derive(&src, validations[k], i);
+					validation_inputs[k] = validate_input_ipv6(
+					    &src, &targets[t].addr.v6);
+				}
+			}
+			validate_gen_batch(validation_inputs, validations, k);
+		}
+		if (zconf.rss.queues) {
+			// picks each probe's source port for the RX
+			// queue its response should land on
+			k = 0;
+			for (size_t t = 0; t < num_targets; t++) {
+				for (int i = 0; i < streams; i++, k++) {
+					struct in6_addr src = ipv6_src.v6;
+					if (v6_pool) {
+						get_src_ipv6(&validation_inputs[k],
+							     &targets[t].addr.v6, &src);
 					}
-					last_count = count;
-					last_time = t;
+					uint32_t h = v6 ? rss_hash_base_ipv6(
+							      &targets[t].addr.v6,
+							      &src,
+							      htons(targets[t].port))
+							: rss_hash_base(
+							      targets[t].ip,
+							      validation_inputs[k].input[0],
+							      htons(targets[t].port));
+					rss_steer((uint32_t *)validations[k], h, i, v6);
 				}
 			}
 		}
+		stage_end(STAGE_VALIDATION, t0);
+		g->num_targets = num_targets;
+		if (!num_targets && source->checkpoint) {
+			source->pending = shard_checkpoint_take(s);
+		}
+		return;
+	}
+}
+
+// --target-threads: a generator thread fetches the groups of a send thread
+// into ready, from the spare ones the send thread hands back, so that the
+// send thread only builds and sends. cur is the group being sent.
+typedef struct target_pipe {
+	zring_t *ready;
+	zring_t *spare;
+	target_group_t *groups;
+	target_group_t *cur;
+	// set up by the send thread, then the generator's alone
+	target_source_t src;
+	// by the send thread once src is set up, and once it is done
+	int sender_ready;
+	int stopped;
+	// by the send thread: it has had a first group, so waits count
+	int started;
+	// by the generator: the ring is closed
+	int finished;
+} target_pipe_t;
+
+typedef struct target_gen_arg {
+	uint16_t id;
+	uint32_t cpu;
+} target_gen_arg_t;
+
+static target_pipe_t *target_pipes = NULL;
+static pthread_t *target_threads = NULL;
+
+static void target_group_alloc(target_group_t *g, size_t max_targets)
+{
+	size_t n = max_targets * zconf.packet_streams;
+	g->num_targets = 0;
+	g->targets = xmalloc(max_targets * sizeof(target_t));
+	g->validation_inputs = xmalloc(n * sizeof(validate_input_t));
+	g->validations = xmalloc(n * VALIDATE_BYTES);
+}
+
+static void target_group_free(target_group_t *g)
+{
+	xfree(g->targets);
+	xfree(g->validation_inputs);
+	xfree(g->validations);
+}
+
+// The send thread's next group from its generator, NULL once there are no
+// more. The time spent waiting for one, after the first, is counted as the
+// thread starving.
+static target_group_t *target_pipe_next(target_pipe_t *p, shard_stats_t *stats)
+{
+	if (p->cur) {
+		zring_push(p->spare, p->cur);
+		p->cur = NULL;
+	}
+	void *g;
+	if (!zring_pop_batch(p->ready, &g, 1)) {
+		uint64_t t0 = send_clock_ns();
+		if (!zring_pop_wait(p->ready, &g, 1)) {
+			return NULL;
+		}
+		if (p->started) {
+			shard_stat_add(&stats->starved_ns, send_clock_ns() - t0);
+		}
+	}
+	p->started = 1;
+	p->cur = g;
+	return g;
+}
+
+// so the stream's reader stops waiting on a sender that is done
+static void target_stream_close(uint16_t sender)
+{
+	if (ipv6) {
+		ipv6_target_file_close(sender);
+	} else {
+		ipv4_target_stream_close(sender);
+	}
+}
+
+static void target_pipe_finish(target_pipe_t *p, uint16_t sender)
+{
+	zring_close(p->ready);
+	if (p->src.stream) {
+		target_stream_close(sender);
+	}
+	p->finished = 1;
+}
+
+// Generator thread id serves send threads id, id + --target-threads, ...
+// keeping each of their rings topped up with as many groups as it holds.
+static void *target_generator(void *arg)
+{
+	target_gen_arg_t *a = arg;
+	uint16_t id = a->id;
+	set_cpu(a->cpu);
+	xfree(a);
+	uint32_t left = 0;
+	for (uint32_t i = id; i < zconf.senders; i += zconf.target_threads) {
+		left++;
+	}
+	struct timespec idle = {.tv_sec = 0, .tv_nsec = 50000};
+	while (left) {
+		int busy = 0;
+		for (uint32_t i = id; i < zconf.senders;
+		     i += zconf.target_threads) {
+			target_pipe_t *p = &target_pipes[i];
+			if (p->finished ||
+			    !__atomic_load_n(&p->sender_ready, __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			if (__atomic_load_n(&p->stopped, __ATOMIC_ACQUIRE)) {
+				target_pipe_finish(p, (uint16_t)i);
+				left--;
+				continue;
+			}
+			void *g;
+			if (!zring_pop_batch(p->spare, &g, 1)) {
+				continue;
+			}
+			// source addresses are of the send thread's interface
+			send_iface = iface_of_sender((uint16_t)i);
+			fetch_group(&p->src, g, ipv6 != 0, zconf.packet_streams);
+			if (!((target_group_t *)g)->num_targets) {
+				// g is freed with p->groups; only the send
+				// thread pushes to spare
+				target_pipe_finish(p, (uint16_t)i);
+				left--;
+				continue;
+			}
+			zring_push(p->ready, g);
+			busy = 1;
+		}
+		if (!busy) {
+			nanosleep(&idle, NULL);
+		}
+	}
+	return NULL;
+}
+
+void send_targets_start(uint32_t cpu)
+{
+	if (!zconf.target_threads) {
+		return;
+	}
+	// before the send threads, which find their pipe in send_run()
+	target_pipes = xcalloc(zconf.senders, sizeof(target_pipe_t));
+	target_threads = xcalloc(zconf.target_threads, sizeof(pthread_t));
+	for (uint16_t g = 0; g < zconf.target_threads; g++) {
+		target_gen_arg_t *a = xmalloc(sizeof(target_gen_arg_t));
+		a->id = g;
+		a->cpu = zconf.pin_cores[(cpu + g) % zconf.pin_cores_len];
+		if (pthread_create(&target_threads[g], NULL, target_generator,
+				   a)) {
+			log_fatal("send", "unable to create target thread");
+		}
+	}
+	log_debug("send", "%u target threads feeding %hu send threads",
+		  zconf.target_threads, zconf.senders);
+}
+
+void send_targets_finish(void)
+{
+	if (!zconf.target_threads) {
+		return;
+	}
+	for (uint16_t g = 0; g < zconf.target_threads; g++) {
+		pthread_join(target_threads[g], NULL);
+	}
+	for (uint16_t i = 0; i < zconf.senders; i++) {
+		target_pipe_t *p = &target_pipes[i];
+		if (!p->groups) {
+			continue;
+		}
+		for (uint32_t j = 0; j <= zconf.target_ring_depth; j++) {
+			target_group_free(&p->groups[j]);
+		}
+		xfree(p->groups);
+		zring_free(p->ready);
+		zring_free(p->spare);
+	}
+	xfree(target_threads);
+	xfree(target_pipes);
+	target_threads = NULL;
+	target_pipes = NULL;
+}
+
+uint64_t send_target_ring_depth(uint16_t sender)
+{
+	if (!target_pipes) {
+		return 0;
+	}
+	target_pipe_t *p = &target_pipes[sender];
+	if (!__atomic_load_n(&p->sender_ready, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	return zring_size(p->ready);
+}
+
+// The per-packet loop of a send thread, returning once the thread is done.
+// It is only called from the variants below with constant flags, so each
+// copy loses the branches on the address family, dry runs, rate limiting
+// and packet streams that do not apply to it.
+static inline __attribute__((always_inline)) void
+send_loop(send_loop_ctx_t *c, const int v6, const int dryrun, const int rated,
+	  const int one_stream)
+{
+	shard_t *s = c->s;
+	shard_stats_t *stats = s->stats;
+	batch_t *batch = c->lanes[0].batch;
+	target_t *targets = NULL;
+	validate_input_t *validation_inputs = NULL;
+	uint8_t (*validations)[VALIDATE_BYTES] = NULL;
+	const int streams = one_stream ? 1 : zconf.packet_streams;
+	const int v6_pool = v6 && ipv6_source_is_pool();
+	const int spaced = !one_stream && c->spacing_ns;
+	send_pace_t pace = {0};
+	uint64_t now_ns = 0;
+	size_t num_targets = 0;
+	size_t next_target = 0;
 
+	while (1) {
 		// Check if the program has otherwise completed and break out of the send loop.
 		if (zrecv.complete) {
-			goto cleanup;
+			return;
 		}
 		if (zconf.max_runtime &&
 		    zconf.max_runtime <= now() - zsend.start) {
-			goto cleanup;
+			return;
+		}
+		if (spaced && c->wheel.pending) {
+			now_ns = send_clock_ns();
+			send_due_probes(c, &pace, v6, dryrun, rated, now_ns);
 		}
 
 		// Check if we've finished this shard or thread before sending each
 		// packet, regardless of batch size.
 		if (s->state.max_targets &&
-		    s->state.targets_scanned >= s->state.max_targets) {
+		    shard_stat_read(&stats->targets_scanned) >= s->state.max_targets) {
 			log_debug(
 			    "send",
-			    "send thread %hhu finished (max targets of %u reached)",
+			    "send thread %hu finished (max targets of %" PRIu64 " reached)",
 			    s->thread_id, s->state.max_targets);
-			goto cleanup;
+			break;
 		}
 		if (s->state.max_packets &&
-		    s->state.packets_sent >= s->state.max_packets) {
+		    shard_stat_read(&stats->packets_sent) >= s->state.max_packets) {
 			log_debug(
 			    "send",
-			    "send thread %hhu finished (max packets of %u reached)",
+			    "send thread %hu finished (max packets of %" PRIu64 " reached)",
 			    s->thread_id, s->state.max_packets);
-			goto cleanup;
+			return;
+		}
+		if (next_target == num_targets && sample_stopped()) {
+			log_debug("send",
+				  "send thread %hu finished (sample precision "
+				  "reached)",
+				  s->thread_id);
+			return;
+		}
+		if (next_target == num_targets) {
+			if (!v6 && c->deferred.pending) {
+				send_deferred(c, &pace, dryrun, rated,
+					      send_clock_ns());
+			}
+			target_group_t *g = &c->own;
+			if (c->pipe) {
+				g = target_pipe_next(c->pipe, stats);
+			} else {
+				fetch_group(&c->src, g, v6, streams);
+			}
+			num_targets = g ? g->num_targets : 0;
+			if (g) {
+				targets = g->targets;
+				validation_inputs = g->validation_inputs;
+				validations = g->validations;
+			}
+			next_target = 0;
 		}
-		if (!ipv6 && current.status == ZMAP_SHARD_DONE) {
+		if (!num_targets) {
+			// every target fetched was sent
 			log_debug(
 			    "send",
-			    "send thread %hhu finished, shard depleted",
-			    s->thread_id);
-			goto cleanup;
-		}
-		for (int i = 0; i < zconf.packet_streams; i++) {
-			count++;
-			uint32_t src_ip = get_src_ip(current_ip, i);
-			uint8_t size_of_validation = VALIDATE_BYTES / sizeof(uint32_t);
-			uint32_t validation[size_of_validation];
-			// IPv6
-			if (ipv6) {
-				((struct in6_addr *) probe_data)[0] = ipv6_src;
-				((struct in6_addr *) probe_data)[1] = ipv6_dst;
-				validate_gen_ipv6(&ipv6_src, &ipv6_dst,
-				 					htons(current_port),
-					 				(uint8_t *)validation);
+			    "send thread %hu finished, %s",
+			    s->thread_id, !c->src.stream ? "shard depleted"
+			    : v6 ? "no more target IPv6 addresses"
+				 : "no more target addresses");
+			break;
+		}
+		const target_t *target = &targets[next_target++];
+		if (!v6 && c->shaping) {
+			uint32_t g = shaping_group(ntohl(target->ip));
+			if (!shaping_admit(g, streams)) {
+				// its group is throttled, and the rate goes
+				// to the next target in the meantime
+				uint64_t due_ns = send_clock_ns() + SHAPING_DEFER_NS;
+				for (int i = 0; i < streams; i++) {
+					size_t k = (next_target - 1) * streams + i;
+					retransmit_t r = {
+					    .src_ip.v4 = validation_inputs[k].input[0],
+					    .dst_ip = target->addr,
+					    .port = target->port,
+					    .probe_num = (uint8_t)i,
+					    .deferrals = 1};
+					memcpy(r.validation, validations[k],
+					       VALIDATE_BYTES);
+					retransmit_add(&c->deferred, &r, due_ns);
+				}
+				__atomic_fetch_add(&zshaping.deferred, streams,
+						   __ATOMIC_RELAXED);
+				shard_stat_add(&stats->targets_scanned, 1);
+				continue;
+			}
+			shaping_probed(g);
+		}
+		if (spaced && !c->wheel.pending) {
+			now_ns = send_clock_ns();
+		}
+		for (int i = 0; i < streams; i++) {
+			size_t k = (next_target - 1) * streams + i;
+			ipaddr_t src;
+			if (v6_pool) {
+				get_src_ipv6(&validation_inputs[k],
+					     &target->addr.v6, &src.v6);
+			} else if (v6) {
+				src = ipv6_src;
 			} else {
-				validate_gen(src_ip, current_ip,
-				 			htons(current_port),
-							 (uint8_t *)validation);
+				src.v4 = validation_inputs[k].input[0];
 			}
-			uint8_t ttl = zconf.probe_ttl;
-			size_t length = 0;
-			zconf.probe_module->make_packet(
-			    batch->packets[batch->len].buf, &length,
-				src_ip, current_ip, htons(current_port), ttl, validation, i,
-				// Grab last 2 bytes of validation for ip_id
-			    (uint16_t)(validation[size_of_validation - 1] & 0xFFFF),
-			    probe_data);
-			if (length > MAX_PACKET_SIZE) {
-				log_fatal(
-				    "send",
-				    "send thread %hhu set length (%zu) larger than MAX (%zu)",
-				    s->thread_id, length,
-				    MAX_PACKET_SIZE);
-			}
-			batch->packets[batch->len].len = (uint32_t)length;
-			if (zconf.dryrun) {
-				batch->len++;
-				if (batch->len == batch->capacity) {
-					lock_file(stdout);
-					for (int i = 0; i < batch->len; i++) {
-						zconf.probe_module->print_packet(stdout,
-														 batch->packets[i].buf);
-					}
-					unlock_file(stdout);
-					// reset batch length for next batch
-					batch->len = 0;
-				}
+			if (spaced && i) {
+				retransmit_t r = {.src_ip = src,
+						  .dst_ip = target->addr,
+						  .port = target->port,
+						  .probe_num = (uint8_t)i};
+				memcpy(r.validation, validations[k], VALIDATE_BYTES);
+				retransmit_add(&c->wheel, &r,
+					       now_ns + i * c->spacing_ns);
+				continue;
+			}
+			// every probe module sends this stream's packet
+			queue_probe(c, &pace, v6, dryrun, rated, &src,
+				    &target->addr, target->port,
+				    validations[k], i);
+		}
+		// Track the number of targets (ip,p
+		shard_stat_add(&stats->targets_scanned, 1);
+	}
+	// the probes still held go out as they come due
+	while ((spaced && c->wheel.pending) || c->deferred.pending) {
+		if (zrecv.complete ||
+		    (zconf.max_runtime &&
+		     zconf.max_runtime <= now() - zsend.start)) {
+			return;
+		}
+		if (spaced) {
+			send_due_probes(c, &pace, v6, dryrun, rated,
+					send_clock_ns());
+		}
+		if (!v6 && c->deferred.pending) {
+			send_deferred(c, &pace, dryrun, rated, send_clock_ns());
+		}
+		if (c->batch_deadline_ns && batch->len) {
+			send_lanes(c, dryrun);
+		}
+		if (c->wheel.pending || c->deferred.pending) {
+			if (zconf.event_loop) {
+				event_loop_wait(send_clock_ns() + 1000000);
 			} else {
-                batch->len++;
-                if (batch->len == batch->capacity) {
-                    // batch is full, sending
-                    int rc = send_batch(st, batch, attempts);
-                    // whether batch succeeds or fails, this was the only attempt. Any re-tries are     handled within batch
-                    if (rc < 0) {
-                        log_error("send_batch", "could not send any batch packets: %s", strerror(errno));
-                        // rc is the last error code if all packets couldn't be sent
-                        s->state.packets_failed += batch->len;
-                    } else {
-                        // rc is number of packets sent successfully, if > 0
-                        s->state.packets_failed += batch->len - rc;
-                    }
-                    // reset batch length for next batch
-                    batch->len = 0;
-                }
-            }
-            s->state.packets_sent++;
-        }
-        // Track the number of targets (ip,p
-		s->state.targets_scanned++;
-
-		// IPv6
-		if (ipv6) {
-			int ret = ipv6_target_file_get_ipv6(&ipv6_dst);
-			if (ret != 0) {
-				log_debug("send", "send thread %hhu finished, no more target IPv6 addresses", s->thread_id);
-				goto cleanup;
+				struct timespec ms = {.tv_sec = 0,
+						      .tv_nsec = 1000000};
+				nanosleep(&ms, NULL);
 			}
+		}
+	}
+}
+
+#define SEND_LOOP_VARIANT(v6, dryrun, rated, one_stream)                       \
+	static void send_loop_##v6##dryrun##rated##one_stream(                \
+	    send_loop_ctx_t *c)                                                \
+	{                                                                      \
+		send_loop(c, v6, dryrun, rated, one_stream);                   \
+	}
+
+SEND_LOOP_VARIANT(0, 0, 0, 0)
+SEND_LOOP_VARIANT(0, 0, 0, 1)
+SEND_LOOP_VARIANT(0, 0, 1, 0)
+SEND_LOOP_VARIANT(0, 0, 1, 1)
+SEND_LOOP_VARIANT(0, 1, 0, 0)
+SEND_LOOP_VARIANT(0, 1, 0, 1)
+SEND_LOOP_VARIANT(0, 1, 1, 0)
+SEND_LOOP_VARIANT(0, 1, 1, 1)
+SEND_LOOP_VARIANT(1, 0, 0, 0)
+SEND_LOOP_VARIANT(1, 0, 0, 1)
+SEND_LOOP_VARIANT(1, 0, 1, 0)
+SEND_LOOP_VARIANT(1, 0, 1, 1)
+SEND_LOOP_VARIANT(1, 1, 0, 0)
+SEND_LOOP_VARIANT(1, 1, 0, 1)
+SEND_LOOP_VARIANT(1, 1, 1, 0)
+SEND_LOOP_VARIANT(1, 1, 1, 1)
+
+// indexed by [ipv6][dryrun][rate > 0][packet_streams == 1]
+static void (*const send_loops[2][2][2][2])(send_loop_ctx_t *) = {
+    {{{send_loop_0000, send_loop_0001}, {send_loop_0010, send_loop_0011}},
+     {{send_loop_0100, send_loop_0101}, {send_loop_0110, send_loop_0111}}},
+    {{{send_loop_1000, send_loop_1001}, {send_loop_1010, send_loop_1011}},
+     {{send_loop_1100, send_loop_1101}, {send_loop_1110, send_loop_1111}}}};
+
+// one sender thread
+int send_run(sock_t st, shard_t *s)
+{
+	log_debug("send", "send thread started");
+	pthread_mutex_lock(&send_mutex);
+	int num_lanes = 1 + zconf.num_extra_probes;
+	send_lane_t *lanes = xcalloc(num_lanes, sizeof(send_lane_t));
+	for (int l = 0; l < num_lanes; l++) {
+		lanes[l].pm = l ? zconf.extra_probes[l - 1].module
+				: zconf.probe_module;
+		lanes[l].extra = l ? &zconf.extra_probes[l - 1] : NULL;
+		// allocate batch
+		lanes[l].batch = create_packet_batch(zconf.batch);
+	}
+	batch_t *batch = lanes[0].batch;
+
+	// counted from here on, in memory local to this thread
+	shard_stats_localize(s);
+	send_iface = iface_of_sender(s->thread_id);
+
+	// OS specific per-thread init
+	if (send_run_init(st, batch)) {
+		pthread_mutex_unlock(&send_mutex);
+		return EXIT_FAILURE;
+	}
+
+	// MAC address length in characters
+	char mac_buf[(ETHER_ADDR_LEN * 2) + (ETHER_ADDR_LEN - 1) + 1];
+	char *p = mac_buf;
+	for (int i = 0; i < ETHER_ADDR_LEN; i++) {
+		if (i == ETHER_ADDR_LEN - 1) {
+			snprintf(p, 3, "%.2x", send_iface->hw_mac[i]);
+			p += 2;
 		} else {
-			// Get the next IP to scan
-			current = shard_get_next_target(s);
-			current_ip = current.ip;
-			current_port = current.port;
-			if (zconf.list_of_ips_filename &&
-				current.status != ZMAP_SHARD_DONE) {
-				// If we have a list of IPs bitmap, ensure the next IP
-				// to scan is on the list.
-				while (!pbm_check(zsend.list_of_ips_pbm,
-						current_ip)) {
-					current = shard_get_next_target(s);
-					current_ip = current.ip;
-					if (current.status == ZMAP_SHARD_DONE) {
-						log_debug(
-							"send",
-							"send thread %hhu shard finished in get_next_ip_loop depleted",
-							s->thread_id);
-						goto cleanup;
-					}
-				}
+			snprintf(p, 4, "%.2x:", send_iface->hw_mac[i]);
+			p += 3;
+		}
+	}
+	log_debug("send", "sending through %s, source MAC address %s",
+		  send_iface->name, mac_buf);
+
+	for (int l = 0; l < num_lanes; l++) {
+		probe_module_t *pm = lanes[l].pm;
+		if (pm->thread_initialize) {
+			int rv = pm->thread_initialize(&lanes[l].probe_data);
+			if (rv != EXIT_SUCCESS) {
+				pthread_mutex_unlock(&send_mutex);
+				log_fatal("send", "Send thread initialization for probe module %s failed: %u", pm->name, rv);
 			}
 		}
 	}
-cleanup:
-	if (!zconf.dryrun && send_batch(st, batch, attempts) < 0) {
-		log_error("send_batch cleanup", "could not send remaining batch packets: %s", strerror(errno));
-	} else if (zconf.dryrun) {
-		lock_file(stdout);
-		for (int i = 0; i < batch->len; i++) {
-			zconf.probe_module->print_packet(stdout,
-											 batch->packets[i].buf);
+	// the last of them has all the packet buffers there will be
+	if (++senders_ready == zconf.senders) {
+		hugemem_report("send");
+	}
+	pthread_mutex_unlock(&send_mutex);
+
+	for (int l = 0; l < num_lanes; l++) {
+		probe_module_t *pm = lanes[l].pm;
+		if (!pm->prepare_packet) {
+			continue;
 		}
-		unlock_file(stdout);
-		// reset batch length for next batch
-		batch->len = 0;
+		for (size_t i = 0; i < batch->capacity; i++) {
+			int rv = pm->prepare_packet(
+			    lanes[l].batch->packets[i].buf, send_iface->hw_mac,
+			    send_iface->gw_mac, lanes[l].probe_data);
+			if (rv != EXIT_SUCCESS) {
+				log_fatal("send", "Probe module %s failed to prepare packet: %u", pm->name, rv);
+			}
+		}
+	}
+
+	send_loop_ctx_t c = {
+	    .st = st,
+	    .s = s,
+	    .lanes = lanes,
+	    .num_lanes = num_lanes,
+	    .ttl = zconf.probe_ttl,
+	    .attempts = zconf.retries + 1,
+	    .lead_ns = (zconf.pacing != PACING_USERSPACE && zconf.rate > 0)
+			   ? TXTIME_LEAD_NS
+			   : 0,
+	    .adaptive_batch = !zconf.dryrun && zconf.rate > 0 &&
+			      zconf.batch_min < batch->capacity,
+	    .batch_target = batch->capacity,
+	    .batch_deadline_ns = (uint64_t)zconf.batch_deadline_us * 1000,
+	};
+	if (c.adaptive_batch) {
+		// nothing measured yet, so the first batches are the
+		// smallest and answer what a call costs soonest
+		c.batch_target = zconf.batch_min;
+	}
+	// Targets are pulled from the shard a batch at a time, and the validation
+	// of every (target, packet stream) pair is computed in one go.
+	// Streamed input bypasses the shard and is read in file order, each
+	// address being paired with every port before the next one is read.
+	c.src.s = s;
+	c.src.capacity = batch->capacity;
+	c.src.stream = ipv6 ? !zsend.index_targets : zconf.list_of_ips_stream;
+	c.src.max_batch_targets = batch->capacity;
+	if (ipv6 && c.src.stream &&
+	    zconf.ports->port_count < c.src.max_batch_targets) {
+		c.src.max_batch_targets = zconf.ports->port_count;
+	}
+	// packets are queued in the batch as what to build and built once it
+	// is full
+	for (int l = 0; l < num_lanes; l++) {
+		lanes[l].specs = xmalloc(batch->capacity * sizeof(probe_spec_t));
+	}
+
+	if (zconf.probe_spacing && zconf.packet_streams > 1) {
+		c.spacing_ns = (uint64_t)zconf.probe_spacing * 1000000;
+		retransmit_wheel_init(&c.wheel,
+				      c.spacing_ns * (zconf.packet_streams - 1),
+				      send_clock_ns());
+	}
+
+	if (zshaping.probed) {
+		c.shaping = 1;
+		retransmit_wheel_init(&c.deferred, SHAPING_DEFER_MAX_NS,
+				      send_clock_ns());
+	}
+
+	c.src.checkpoint = zconf.checkpoint_filename && !c.src.stream;
+	if (c.src.checkpoint) {
+		c.src.pending = shard_checkpoint_take(s);
+		shard_checkpoint_publish(s, &c.src.pending, NULL);
+	}
+
+	if (target_pipes) {
+		// the generator takes the source over, and the groups it
+		// fills come back through spare
+		target_pipe_t *p = &target_pipes[s->thread_id];
+		uint32_t groups = zconf.target_ring_depth + 1;
+		p->ready = zring_init(groups, ZRING_SPSC);
+		p->spare = zring_init(groups, ZRING_SPSC);
+		p->groups = xcalloc(groups, sizeof(target_group_t));
+		for (uint32_t j = 0; j < groups; j++) {
+			target_group_alloc(&p->groups[j], c.src.max_batch_targets);
+			zring_push(p->spare, &p->groups[j]);
+		}
+		p->src = c.src;
+		c.pipe = p;
+		__atomic_store_n(&p->sender_ready, 1, __ATOMIC_RELEASE);
+	} else {
+		target_group_alloc(&c.own, c.src.max_batch_targets);
+	}
+
+	double start = now();
+	send_loops[ipv6 != 0][zconf.dryrun != 0][zconf.rate > 0]
+		  [zconf.packet_streams == 1](&c);
+
+	for (int l = 0; l < num_lanes; l++) {
+		build_packets(&lanes[l], c.ttl, s->thread_id);
+		if (zconf.dryrun) {
+			dryrun_batch(&lanes[l]);
+			continue;
+		}
+		uint64_t t0 = stage_begin(STAGE_SEND);
+		int rc = send_batch(st, lanes[l].batch, c.attempts);
+		stage_end(STAGE_SEND, t0);
+		send_backoff_flush(s);
+		if (rc < 0) {
+			log_error("send_batch cleanup", "could not send remaining batch packets: %s", strerror(errno));
+		}
+	}
+	send_run_cleanup(st);
+	if (c.pipe) {
+		__atomic_store_n(&c.pipe->stopped, 1, __ATOMIC_RELEASE);
+	} else if (c.src.stream) {
+		target_stream_close(s->thread_id);
+	}
+	if (c.src.checkpoint) {
+		shard_checkpoint_publish(s, &c.src.pending, NULL);
+	}
+	for (int l = 0; l < num_lanes; l++) {
+		if (l) {
+			__atomic_fetch_add(&zconf.extra_probes[l - 1].packets_sent,
+					   lanes[l].packets_sent,
+					   __ATOMIC_RELAXED);
+		}
+		free_packet_batch(lanes[l].batch);
+		xfree(lanes[l].specs);
+	}
+	xfree(lanes);
+	if (!c.pipe) {
+		target_group_free(&c.own);
+	}
+	if (c.spacing_ns) {
+		retransmit_wheel_free(&c.wheel);
+	}
+	if (c.shaping) {
+		retransmit_wheel_free(&c.deferred);
+	}
+	if (c.adaptive_batch && c.cost.calls) {
+		log_debug("send",
+			  "thread %hu sent %" PRIu64 " batches of %.1f packets "
+			  "on average, %.1f us fixed cost per send call",
+			  s->thread_id, c.cost.calls,
+			  (double)c.cost.packets / c.cost.calls,
+			  c.cost.call_ns / 1000);
+	}
+	if (zconf.dryrun == DRYRUN_NULL) {
+		uint64_t built = shard_stat_read(&s->stats->packets_sent);
+		double secs = now() - start;
+		log_info("send",
+			 "thread %hu built %" PRIu64 " packets in %.3f s "
+			 "(%.0f packets/s)",
+			 s->thread_id, built, secs, secs > 0 ? built / secs : 0);
 	}
-	free_packet_batch(batch);
 	s->cb(s->thread_id, s->arg);
-	if (zconf.dryrun) {
+	if (zconf.dryrun == DRYRUN_PRINT) {
 		lock_file(stdout);
 		fflush(stdout);
 		unlock_file(stdout);
@@ -542,11 +1638,46 @@ cleanup:
 	return EXIT_SUCCESS;
 }
 
+static size_t packet_batch_bytes(uint16_t capacity)
+{
+	return sizeof(batch_t) + capacity * (sizeof(struct batch_packet) +
+					     sizeof(struct batch_frame));
+}
+
+void send_memory_estimate(uint64_t est[MEM_TAGS])
+{
+	uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+	uint64_t batch = (packet_batch_bytes(zconf.batch) + page - 1) / page * page;
+	// a batch for each lane of each thread, and with io_uring a spare
+	// that the kernel sends from while the other is built
+	uint64_t batches = (uint64_t)zconf.senders * (1 + zconf.num_extra_probes);
+	if (zconf.send_method == SEND_METHOD_IO_URING ||
+	    zconf.send_method == SEND_METHOD_IO_URING_SQPOLL) {
+		batches += zconf.senders;
+	}
+	est[MEM_PACKETS] += batches * batch;
+#ifdef XDP
+	// a UMEM for the queue of each send thread
+	uint64_t umem = (uint64_t)(XDP_RX_FRAMES + 2 * (uint32_t)zconf.batch) *
+			XDP_FRAME_SIZE;
+	est[MEM_PACKETS] +=
+	    (uint64_t)zconf.senders * ((umem + page - 1) / page * page);
+#endif
+}
+
 batch_t *create_packet_batch(uint16_t capacity)
 {
-	// allocating batch and associated data structures in single xmalloc for cache locality
-	batch_t *batch = (batch_t *)xmalloc(sizeof(batch_t) + capacity * sizeof(struct batch_packet));
+	// batch and associated data structures in a single mapping for cache
+	// and TLB locality, on huge pages where there are any
+	hugemem_t mem;
+	batch_t *batch = (batch_t *)hugemem_alloc(&mem, MEM_PACKETS,
+						  packet_batch_bytes(capacity));
+	batch->mem = mem;
 	batch->packets = (struct batch_packet *)(batch + 1);
+	struct batch_frame *frames = (struct batch_frame *)(batch->packets + capacity);
+	for (uint16_t i = 0; i < capacity; i++) {
+		batch->packets[i].buf = frames[i].buf;
+	}
 	batch->capacity = capacity;
 	batch->len = 0;
 	return batch;
@@ -554,6 +1685,7 @@ batch_t *create_packet_batch(uint16_t capacity)
 
 void free_packet_batch(batch_t *batch)
 {
-	// batch was created with a single xmalloc, so this will free the component array too
-	xfree(batch);
+	// the mapping holds the component arrays too
+	hugemem_t mem = batch->mem;
+	hugemem_free(&mem);
 }
@@ -11,40 +11,71 @@
 
 #include "iterator.h"
 #include "socket.h"
+#include "../lib/hugemem.h"
 
 #include <assert.h>
 
+// sender threads are numbered with a uint16_t (zconf.senders, shard ids)
+#define MAX_SENDER_THREADS UINT16_MAX
+
 iterator_t *send_init(void);
 int send_run(sock_t, shard_t *);
+// changes the rate of a rate-limited scan while it runs
+void send_set_rate(int rate);
+// --target-threads: starts the generator threads, pinned from core cpu of
+// --cores on, before the send threads they feed, and joins them once the
+// send threads are done
+void send_targets_start(uint32_t cpu);
+void send_targets_finish(void);
+// groups of targets ready for send thread sender
+uint64_t send_target_ring_depth(uint16_t sender);
 
 // Fit two packets with metadata into one 4k page.
 // 2k seems like more than enough with typical MTU of
 // 1500, and we don't want to cause IP fragmentation.
 #define MAX_PACKET_SIZE (2048 - sizeof(uint32_t) - 2 * sizeof(uint8_t))
 
-// Metadata and initial packet bytes are adjacent,
-// for cache locality esp. with short packets.
-// buf is aligned such that the end of the Ethernet
-// header and beginning of the IP header will align
-// to a 32 bit boundary, such that reading/writing
-// IP addresses and other 32 bit header fields is
-// properly aligned.
-struct batch_packet {
-	uint32_t len;
+// Backing storage for one packet. buf is aligned such that
+// the end of the Ethernet header and beginning of the IP header
+// will align to a 32 bit boundary, such that reading/writing
+// IP addresses and other 32 bit header fields is properly
+// aligned.
+struct batch_frame {
 	uint8_t unused[2];
 	uint8_t buf[MAX_PACKET_SIZE];
 };
 
-static_assert((offsetof(struct batch_packet, buf) + sizeof(struct ether_header)) % sizeof(uint32_t) == 0,
+static_assert((offsetof(struct batch_frame, buf) + sizeof(struct ether_header)) % sizeof(uint32_t) == 0,
 	      "buf is aligned such that IP header is 32-bit aligned");
+static_assert(sizeof(struct batch_frame) % sizeof(uint32_t) == 0,
+	      "consecutive frames keep the IP header 32-bit aligned");
+
+// buf normally points into the batch's own frames, but send
+// backends that share packet memory with the kernel or NIC (e.g.,
+// a PACKET_MMAP TX_RING) may point it directly at their slots so
+// that probe modules build packets in place. Modules only rewrite
+// the fields of a target in a buffer they prepared once, so every
+// packet they built is also a valid template for the next one: such
+// a backend seeds slots the probe module has never prepared with
+// copies of packets just built.
+struct batch_packet {
+	uint32_t len;
+	uint8_t *buf;
+	// CLOCK_MONOTONIC launch time in ns, when pacing with SO_TXTIME
+	uint64_t txtime;
+};
 
 typedef struct {
 	struct batch_packet *packets;
 	uint16_t len;
 	uint16_t capacity;
+	hugemem_t mem; // holding the batch itself
 } batch_t;
 
 batch_t *create_packet_batch(uint16_t capacity);
+// adds what the send threads will map under each tag to est, for
+// --dry-estimate-memory, counting normal pages
+void send_memory_estimate(uint64_t est[MEM_TAGS]);
 void free_packet_batch(batch_t *batch);
 
 #endif // SEND_H
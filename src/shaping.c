@@ -0,0 +1,309 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "shaping.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../lib/constraint.h"
+#include "../lib/logger.h"
+#include "../lib/util.h"
+#include "../lib/xalloc.h"
+
+#include "state.h"
+
+// a window is never smaller than this, nor larger unless it has yet to
+// expect SHAPING_EXPECTED_HITS
+#define SHAPING_WINDOW_MIN 64
+#define SHAPING_WINDOW_MAX 65536
+// healthy windows before a group's baseline is trusted
+#define SHAPING_BASELINE_WINDOWS 4
+// weight of a window in the baseline, once there are that many
+#define SHAPING_BASELINE_WEIGHT 0.125
+// a throttled group's share of the probe rate it had
+#define SHAPING_FACTOR 0.25
+
+shaping_t zshaping = {.probed = NULL};
+
+// the monitor's view of a group
+typedef struct shaping_window {
+	// the counters as the window started
+	uint64_t probed;
+	uint64_t hits;
+	double start;
+	// hit rate of the healthy windows, and their number
+	double baseline;
+	uint32_t windows;
+	// targets per second of the last healthy window, and the probes per
+	// second a throttled group may have
+	double pps;
+	double budget;
+} shaping_window_t;
+
+static shaping_window_t *windows = NULL;
+// the ASes of --prefix-shaping-asn-file by group, after the /16s; a
+// prefix of the file maps to its AS's index + 1, anything else to 0
+static uint32_t *asns = NULL;
+static constraint_t *asn_map = NULL;
+static uint32_t throttled_now = 0;
+static double last_update = 0;
+
+static int cmp_prefix_len(const void *a, const void *b)
+{
+	const constraint_prefix_t *x = a, *y = b;
+	if (x->len != y->len) {
+		return x->len < y->len ? -1 : 1;
+	}
+	return x->prefix < y->prefix ? -1 : x->prefix > y->prefix;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Lines of "prefix/len asn", or "prefix len asn" as in CAIDA's pfx2as
+// files. Where prefixes overlap the longest one wins, as it would route.
+static void load_asn_file(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		log_fatal("shaping", "unable to open %s: %s", path,
+			  strerror(errno));
+	}
+	size_t len = 0, cap = 4096;
+	constraint_prefix_t *prefixes = xmalloc(cap * sizeof(*prefixes));
+	char line[256];
+	uint64_t lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char *hash = strchr(line, '#');
+		if (hash) {
+			*hash = '\0';
+		}
+		char *tok[3];
+		int n = 0;
+		for (char *save = NULL, *t = strtok_r(line, " \t\r\n/", &save);
+		     t && n < 3; t = strtok_r(NULL, " \t\r\n/", &save)) {
+			tok[n++] = t;
+		}
+		if (!n) {
+			continue;
+		}
+		struct in_addr addr;
+		char *end1 = NULL, *end2 = NULL;
+		unsigned long plen = n == 3 ? strtoul(tok[1], &end1, 10) : 0;
+		unsigned long asn = n == 3 ? strtoul(tok[2], &end2, 10) : 0;
+		if (n != 3 || inet_pton(AF_INET, tok[0], &addr) != 1 ||
+		    *end1 || plen > 32 || *end2 || asn > UINT32_MAX) {
+			log_fatal("shaping", "%s:%" PRIu64 ": expected an IPv4 "
+					     "prefix and an AS number",
+				  path, lineno);
+		}
+		if (len == cap) {
+			cap *= 2;
+			prefixes = xrealloc(prefixes, cap * sizeof(*prefixes));
+		}
+		uint32_t mask = plen ? 0xFFFFFFFFu << (32 - plen) : 0;
+		prefixes[len].prefix = ntohl(addr.s_addr) & mask;
+		prefixes[len].len = (int)plen;
+		// the AS for now, its index once they are all known
+		prefixes[len].value = (value_t)asn;
+		len++;
+	}
+	fclose(f);
+
+	// the distinct ASes, each a group
+	asns = xmalloc((len ? len : 1) * sizeof(uint32_t));
+	uint32_t num_asns = 0;
+	for (size_t i = 0; i < len; i++) {
+		asns[i] = prefixes[i].value;
+	}
+	qsort(asns, len, sizeof(uint32_t), cmp_u32);
+	for (size_t i = 0; i < len; i++) {
+		if (!num_asns || asns[num_asns - 1] != asns[i]) {
+			asns[num_asns++] = asns[i];
+		}
+	}
+	for (size_t i = 0; i < len; i++) {
+		uint32_t *a = bsearch(&prefixes[i].value, asns, num_asns,
+				      sizeof(uint32_t), cmp_u32);
+		prefixes[i].value = (value_t)(a - asns) + 1;
+	}
+	qsort(prefixes, len, sizeof(*prefixes), cmp_prefix_len);
+	asn_map = constraint_init(0);
+	constraint_set_bulk(asn_map, prefixes, len);
+	xfree(prefixes);
+	zshaping.num_groups += num_asns;
+	log_info("shaping", "%zu prefixes of %u ASes from %s", len, num_asns,
+		 path);
+}
+
+void shaping_init(void)
+{
+	if (!zconf.prefix_shaping) {
+		return;
+	}
+	zshaping.num_groups = SHAPING_SLASH16_GROUPS;
+	if (zconf.prefix_shaping_asn_file) {
+		load_asn_file(zconf.prefix_shaping_asn_file);
+	}
+	uint32_t n = zshaping.num_groups;
+	zshaping.probed = xcalloc(n, sizeof(uint64_t));
+	zshaping.hits = xcalloc(n, sizeof(uint64_t));
+	zshaping.throttled = xcalloc(n, sizeof(uint8_t));
+	zshaping.allowance = xcalloc(n, sizeof(int64_t));
+	windows = xcalloc(n, sizeof(shaping_window_t));
+	log_debug("shaping", "shaping the probe rate of %u groups", n);
+}
+
+uint32_t shaping_group(uint32_t ip)
+{
+	if (asn_map) {
+		value_t v = constraint_lookup_ip(asn_map, ip);
+		if (v) {
+			return SHAPING_SLASH16_GROUPS + v - 1;
+		}
+	}
+	return ip >> 16;
+}
+
+// what a group is, for the log
+static void group_name(uint32_t g, char *buf, size_t len)
+{
+	if (g >= SHAPING_SLASH16_GROUPS) {
+		snprintf(buf, len, "AS%u", asns[g - SHAPING_SLASH16_GROUPS]);
+	} else {
+		snprintf(buf, len, "%u.%u.0.0/16", g >> 8, g & 0xFF);
+	}
+}
+
+// Closes the group's window if it is due, at time t, returning whether the
+// group was throttled or released
+static int close_window(uint32_t g, double t)
+{
+	shaping_window_t *w = &windows[g];
+	uint64_t p = __atomic_load_n(&zshaping.probed[g], __ATOMIC_RELAXED) -
+		     w->probed;
+	uint64_t need = SHAPING_WINDOW_MIN;
+	if (w->windows >= SHAPING_BASELINE_WINDOWS) {
+		need = SHAPING_WINDOW_MAX;
+		if (w->baseline * SHAPING_WINDOW_MAX > SHAPING_EXPECTED_HITS) {
+			need = (uint64_t)(SHAPING_EXPECTED_HITS / w->baseline);
+		}
+		if (need < SHAPING_WINDOW_MIN) {
+			need = SHAPING_WINDOW_MIN;
+		}
+	}
+	if (p < need) {
+		return 0;
+	}
+	uint64_t h =
+	    __atomic_load_n(&zshaping.hits[g], __ATOMIC_RELAXED) - w->hits;
+	double expected = w->baseline * p;
+	// too few successes to go by, once the baseline is known, and the
+	// window then only moves the baseline
+	int judged = w->windows >= SHAPING_BASELINE_WINDOWS &&
+		     expected >= SHAPING_EXPECTED_HITS;
+	int changed = 0;
+	if (zshaping.throttled[g]) {
+		if (h * 2 >= expected) {
+			__atomic_store_n(&zshaping.throttled[g], 0,
+					 __ATOMIC_RELAXED);
+			throttled_now--;
+			changed = 1;
+		}
+	} else if (judged && h * 4 < expected) {
+		w->budget = w->pps * SHAPING_FACTOR * zconf.packet_streams;
+		__atomic_store_n(&zshaping.throttled[g], 1, __ATOMIC_RELAXED);
+		zshaping.throttles++;
+		throttled_now++;
+		changed = 1;
+	} else {
+		double rate = (double)h / p;
+		double weight = 1.0 / (w->windows + 1);
+		if (weight < SHAPING_BASELINE_WEIGHT) {
+			weight = SHAPING_BASELINE_WEIGHT;
+		}
+		w->baseline += weight * (rate - w->baseline);
+		w->windows++;
+		if (t > w->start) {
+			w->pps = p / (t - w->start);
+		}
+	}
+	if (changed) {
+		char name[32];
+		group_name(g, name, sizeof(name));
+		log_debug("shaping",
+			  "%s %s: %" PRIu64 " of %" PRIu64 " targets responded, "
+			  "%.2f%% against %.2f%% before",
+			  name, zshaping.throttled[g] ? "throttled" : "released",
+			  h, p, 100.0 * h / p, 100 * w->baseline);
+	}
+	w->probed += p;
+	w->hits += h;
+	w->start = t;
+	return changed;
+}
+
+void shaping_update(void)
+{
+	if (!zshaping.probed) {
+		return;
+	}
+	double t = now();
+	double dt = last_update ? t - last_update : 1;
+	last_update = t;
+	uint32_t changes = 0;
+	for (uint32_t g = 0; g < zshaping.num_groups; g++) {
+		if (!windows[g].start) {
+			windows[g].start = t;
+		}
+		changes += close_window(g, t);
+		if (zshaping.throttled[g]) {
+			// at least a target's probes each update
+			int64_t a = (int64_t)(windows[g].budget * dt);
+			if (a < zconf.packet_streams) {
+				a = zconf.packet_streams;
+			}
+			__atomic_store_n(&zshaping.allowance[g], a,
+					 __ATOMIC_RELAXED);
+		}
+	}
+	if (changes) {
+		log_info("shaping", "%u groups throttled, %" PRIu64
+				    " probes deferred so far",
+			 throttled_now,
+			 __atomic_load_n(&zshaping.deferred, __ATOMIC_RELAXED));
+	}
+}
+
+uint32_t shaping_throttled_now(void)
+{
+	return throttled_now;
+}
+
+void shaping_log(void)
+{
+	if (!zshaping.probed) {
+		return;
+	}
+	log_info("shaping",
+		 "%" PRIu64 " times a group was throttled, %u still are; %" PRIu64
+		 " probes deferred, %" PRIu64 " of them sent after their last "
+		 "deferral",
+		 zshaping.throttles, throttled_now,
+		 __atomic_load_n(&zshaping.deferred, __ATOMIC_RELAXED),
+		 __atomic_load_n(&zshaping.forced, __ATOMIC_RELAXED));
+}
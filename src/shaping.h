@@ -0,0 +1,99 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_SHAPING_H
+#define ZMAP_SHAPING_H
+
+#include <stdint.h>
+
+/*
+ * --prefix-shaping: networks that start dropping or rate limiting probes
+ * part way through a scan barely move the overall hit rate, but their
+ * coverage collapses. Targets are grouped by their /16, or with
+ * --prefix-shaping-asn-file by the AS of their longest matching prefix.
+ * The send threads count the targets sent into each group and the
+ * receiver their unique successes. The monitor closes a window of a group
+ * once it has seen enough targets to expect SHAPING_EXPECTED_HITS
+ * successes at the group's baseline hit rate, and throttles a group whose
+ * window got less than a quarter of those: it may then have only a quarter
+ * of the probes per second it had been getting. The send threads put the
+ * probes to a throttled group over its allowance off, by SHAPING_DEFER_NS
+ * and then twice as long again each time, sending the next target in their
+ * place so that the overall rate holds; after SHAPING_MAX_DEFERRALS a probe
+ * goes out regardless. A throttled group whose hit rate is back to half
+ * its baseline is released. IPv4 only.
+ */
+
+// put off by this first, then twice as long each time
+#define SHAPING_DEFER_NS 1000000000ull
+#define SHAPING_MAX_DEFERRALS 3
+// the longest a probe is put off at once
+#define SHAPING_DEFER_MAX_NS (SHAPING_DEFER_NS << (SHAPING_MAX_DEFERRALS - 1))
+// successes a window is sized to expect, at the group's baseline
+#define SHAPING_EXPECTED_HITS 16
+// the /16s come first, then the ASes of the file
+#define SHAPING_SLASH16_GROUPS 0x10000
+
+typedef struct shaping {
+	// per group: targets sent, their unique successes, whether the group
+	// is throttled and, while it is, the probes it may still have until
+	// the next update. NULL unless shaping.
+	uint64_t *probed;
+	uint64_t *hits;
+	uint8_t *throttled;
+	int64_t *allowance;
+	uint32_t num_groups;
+	// probes put off, and sent after their last deferral
+	uint64_t deferred;
+	uint64_t forced;
+	// times a group was throttled
+	uint64_t throttles;
+} shaping_t;
+
+extern shaping_t zshaping;
+
+// from zconf, loading --prefix-shaping-asn-file
+void shaping_init(void);
+
+// the group of an address (host order)
+uint32_t shaping_group(uint32_t ip);
+
+static inline void shaping_probed(uint32_t group)
+{
+	__atomic_fetch_add(&zshaping.probed[group], 1, __ATOMIC_RELAXED);
+}
+
+// Send side: whether n probes to the group may go out now
+static inline int shaping_admit(uint32_t group, uint32_t n)
+{
+	if (__builtin_expect(
+		!__atomic_load_n(&zshaping.throttled[group], __ATOMIC_RELAXED),
+		1)) {
+		return 1;
+	}
+	return __atomic_sub_fetch(&zshaping.allowance[group], n,
+				  __ATOMIC_RELAXED) >= 0;
+}
+
+// Receive side, for each unique success (an address in host order)
+static inline void shaping_success(uint32_t ip)
+{
+	__atomic_fetch_add(&zshaping.hits[shaping_group(ip)], 1,
+			   __ATOMIC_RELAXED);
+}
+
+// from the monitor after each update: closes the windows that are due,
+// throttles the groups whose hit rate collapsed and releases those that
+// recovered, and hands the throttled ones their next allowance
+void shaping_update(void);
+// groups throttled at the moment
+uint32_t shaping_throttled_now(void);
+// once the scan is done
+void shaping_log(void);
+
+#endif /* ZMAP_SHAPING_H */
@@ -8,40 +8,80 @@
 
 #include <stdint.h>
 #include <assert.h>
-
-#include <gmp.h>
+#include <inttypes.h>
 
 #include "../lib/includes.h"
 #include "../lib/logger.h"
 #include "../lib/blocklist.h"
+#include "../lib/xalloc.h"
+#include "sample.h"
 #include "shard.h"
 #include "state.h"
 
-static inline uint16_t extract_port(uint64_t v, uint8_t bits)
+// IPv6 target file and pattern indices go to the sender as they are, in
+// target_t.index, for send.c to resolve itself
+static inline int shard_passes_index(const shard_t *shard)
+{
+	return zsend.index_targets && !shard->list;
+}
+
+// Map an element of the cyclic group's (ip index) space to the IPv4
+// address the sender receives, from the allowed space or the list of IPs
+static inline uint32_t shard_resolve_index(const shard_t *shard,
+					   uint64_t index)
+{
+	if (shard->list) {
+		return shard->list[index];
+	}
+	return (uint32_t)blocklist_lookup_index((uint32_t)index);
+}
+
+static inline void shard_prefetch_index(const shard_t *shard, uint64_t index)
+{
+	if (shard->list) {
+		__builtin_prefetch(&shard->list[index]);
+	} else if (!zsend.index_targets) {
+		blocklist_prefetch_index((uint32_t)index);
+	}
+}
+
+// exponents walked between takes of the range lock
+#define SHARD_CLAIM_STEPS 4096
+// less than this left unclaimed isn't worth stealing
+#define SHARD_STEAL_MIN (2 * SHARD_CLAIM_STEPS)
+
+// g^pos, for a linear exponent pos
+static uint64_t shard_element(const shard_t *shard, uint64_t pos)
 {
-	uint64_t mask = (1 << bits) - 1;
-	return (uint16_t)(v & mask);
+	uint64_t exponent = (pos + shard->params.offset) % shard->params.order;
+	uint64_t elt = cyclic_powmod(shard->params.factor, exponent,
+				     shard->params.modulus);
+	return elt;
 }
 
-static inline uint32_t extract_ip(uint64_t v, uint8_t bits)
+// set under the range lock, end also being written by thieves
+static void shard_set_range(shard_t *shard, uint64_t pos, uint64_t end)
 {
-	return (uint32_t)(v >> bits);
+	shard->pos = pos;
+	uint64_t claimed =
+	    end - pos > SHARD_CLAIM_STEPS ? pos + SHARD_CLAIM_STEPS : end;
+	__atomic_store_n(&shard->claimed, claimed, __ATOMIC_RELAXED);
+	__atomic_store_n(&shard->end, end, __ATOMIC_RELAXED);
 }
 
 static void shard_roll_to_valid(shard_t *s)
 {
-	uint64_t current_ip_index = (s->current - 1) >> s->bits_for_port;
-	uint16_t candidate_port = extract_port(s->current - 1, s->bits_for_port);
-	if (current_ip_index < zsend.max_index && candidate_port < zconf.ports->port_count) {
+	if (s->current - 1 < s->num_targets) {
 		return;
 	}
 	shard_get_next_target(s);
 }
 
 void shard_init(shard_t *shard, uint16_t shard_idx, uint16_t num_shards,
-		uint8_t thread_idx, uint8_t num_threads,
-		uint64_t max_total_targets, uint8_t bits_for_port,
-		const cycle_t *cycle, shard_complete_cb cb, void *arg)
+		uint16_t thread_idx, uint16_t num_threads,
+		uint64_t max_total_targets, uint32_t num_ports,
+		const cycle_t *cycle, shard_stats_t *stats,
+		shard_complete_cb cb, void *arg)
 {
 	// Start out by figuring out how many shards we have. A single shard of
 	// ZMap (set with --shards=N, --shard=n) may have several subshards, if
@@ -64,7 +104,7 @@ void shard_init(shard_t *shard, uint16_t shard_idx, uint16_t num_shards,
 	// subshards with indices the range [n*T, (n+1)*T].
 	//
 	// We can calculate our subshard index i = n*T + t.
-	uint32_t sub_idx = shard_idx * num_threads + thread_idx;
+	uint32_t sub_idx = (uint32_t)shard_idx * num_threads + thread_idx;
 
 	// Given i, we want to calculate the start of subshard i. Subshards
 	// define ranges over exponents of g. They range from [0, Q-1), where Q
@@ -82,41 +122,52 @@ void shard_init(shard_t *shard, uint16_t shard_idx, uint16_t num_shards,
 
 	// We actually offset the begin and end of each cycle. Given an offset
 	// k, shift each exponent by k modulo Q.
+	shard->pos = exponent_begin;
+	shard->end = exponent_end ? exponent_end : num_elts;
 	exponent_begin = (exponent_begin + cycle->offset) % num_elts;
 	exponent_end = (exponent_end + cycle->offset) % num_elts;
 
-	// Multiprecision variants of everything above
-	mpz_t generator_m, exponent_begin_m, exponent_end_m, prime_m;
-	mpz_init_set_ui(generator_m, cycle->generator);
-	mpz_init_set_ui(exponent_begin_m, exponent_begin);
-	mpz_init_set_ui(exponent_end_m, exponent_end);
-	mpz_init_set_ui(prime_m, cycle->group->prime);
-
 	// Calculate the first and last points of the shard as powers of g
 	// modulo p.
-	mpz_t start_m, stop_m;
-	mpz_init(start_m);
-	mpz_init(stop_m);
-	mpz_powm(start_m, generator_m, exponent_begin_m, prime_m);
-	mpz_powm(stop_m, generator_m, exponent_end_m, prime_m);
-
-	// Pull the result out as a uint64_t
-	shard->params.first = (uint64_t)mpz_get_ui(start_m);
-	shard->params.last = (uint64_t)mpz_get_ui(stop_m);
+	shard->params.first =
+	    cyclic_powmod(cycle->generator, exponent_begin, cycle->group->prime);
+	shard->params.last =
+	    cyclic_powmod(cycle->generator, exponent_end, cycle->group->prime);
 	shard->params.factor = cycle->generator;
 	shard->params.modulus = cycle->group->prime;
+	shard->params.factor_pre =
+	    cyclic_mulmod_precompute(shard->params.factor, shard->params.modulus);
+	shard->params.order = num_elts;
+	shard->params.offset = cycle->offset;
 	//
-	shard->bits_for_port = bits_for_port;
+	shard->port_count = num_ports;
+	shard->port_recip = UINT64_MAX / num_ports;
+	shard->num_targets = zsend.max_index * num_ports;
 
 	// Set the shard at the beginning.
 	shard->current = shard->params.first;
+	pthread_mutex_init(&shard->range_lock, NULL);
+	shard_set_range(shard, shard->pos, shard->end);
+	shard->next_pos = shard->next_end = 0;
+	shard->peers = NULL;
+	shard->num_peers = 0;
+	shard->lease_cb = NULL;
+	shard->lease_arg = NULL;
 
 	// Set the (thread) id
 	shard->thread_id = thread_idx;
+	shard->sub_idx = sub_idx;
+	shard->num_subshards = num_subshards;
+	shard->stats = stats;
+	shard->strata = NULL;
+	shard->num_strata = 0;
+	shard->stratum = 0;
+	shard->list = zsend.list_of_ips;
+	shard->skip = NULL;
 
 	// Set max_targets if applicable
 	if (max_total_targets > 0) {
-		uint32_t max_targets_this_shard =
+		uint64_t max_targets_this_shard =
 		    max_total_targets / num_subshards;
 		if (sub_idx < (max_total_targets % num_subshards)) {
 			++max_targets_this_shard;
@@ -131,14 +182,92 @@ void shard_init(shard_t *shard, uint16_t shard_idx, uint16_t num_shards,
 	// If the beginning of a shard isn't pointing to a valid index in the
 	// blocklist, find the first element that is.
 	shard_roll_to_valid(shard);
+}
+
+// a page, so that no other allocation shares it
+#define SHARD_STATS_PAGE 4096
+
+void shard_stats_localize(shard_t *shard)
+{
+	shard_stats_t *local = xmalloc_aligned(SHARD_STATS_PAGE, SHARD_STATS_PAGE);
+	*local = *shard->stats;
+	// the monitor may still read the old block, which the iterator keeps
+	__atomic_store_n(&shard->stats, local, __ATOMIC_RELEASE);
+}
+
+shard_checkpoint_t shard_checkpoint_take(const shard_t *shard)
+{
+	const shard_stats_t *st = shard->stats;
+	return (shard_checkpoint_t){
+	    .current = shard->current,
+	    .pos = shard->pos,
+	    .end = __atomic_load_n(&shard->end, __ATOMIC_RELAXED),
+	    .next_pos = shard->next_pos,
+	    .next_end = shard->next_end,
+	    .targets_scanned = shard_stat_read(&st->targets_scanned),
+	    .packets_sent = shard_stat_read(&st->packets_sent),
+	    .packets_failed = shard_stat_read(&st->packets_failed),
+	    .iterations = shard_stat_read(&st->iterations),
+	};
+}
 
-	// Clear everything
-	mpz_clear(generator_m);
-	mpz_clear(exponent_begin_m);
-	mpz_clear(exponent_end_m);
-	mpz_clear(prime_m);
-	mpz_clear(start_m);
-	mpz_clear(stop_m);
+// A sequence lock, as the sender must never wait for the reader. The end of
+// a range is that from when it was taken: should a thief have had part of
+// it since, a resumed scan sends that part twice rather than not at all.
+void shard_checkpoint_publish(shard_t *shard, const shard_checkpoint_t *c,
+			      const shard_checkpoint_t *then)
+{
+	shard_checkpoint_t both;
+	if (then) {
+		both = *c;
+		both.next_pos = then->pos;
+		both.next_end = then->end;
+		c = &both;
+	}
+	uint64_t seq = __atomic_load_n(&shard->checkpoint_seq, __ATOMIC_RELAXED);
+	__atomic_store_n(&shard->checkpoint_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	uint64_t *dst = (uint64_t *)&shard->checkpoint;
+	const uint64_t *src = (const uint64_t *)c;
+	for (size_t i = 0; i < sizeof(*c) / sizeof(uint64_t); i++) {
+		__atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&shard->checkpoint_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void shard_checkpoint_read(const shard_t *shard, shard_checkpoint_t *out)
+{
+	const uint64_t *src = (const uint64_t *)&shard->checkpoint;
+	uint64_t *dst = (uint64_t *)out;
+	for (;;) {
+		uint64_t seq =
+		    __atomic_load_n(&shard->checkpoint_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			continue;
+		}
+		for (size_t i = 0; i < sizeof(*out) / sizeof(uint64_t); i++) {
+			dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shard->checkpoint_seq, __ATOMIC_RELAXED) ==
+		    seq) {
+			return;
+		}
+	}
+}
+
+void shard_checkpoint_restore(shard_t *shard, const shard_checkpoint_t *c)
+{
+	shard->current = c->current;
+	shard_set_range(shard, c->pos, c->end);
+	shard->next_pos = c->next_pos;
+	shard->next_end = c->next_end;
+	shard_stats_t *st = shard->stats;
+	st->targets_scanned = c->targets_scanned;
+	st->packets_sent = c->packets_sent;
+	st->packets_failed = c->packets_failed;
+	st->iterations = c->iterations;
+	shard->checkpoint = *c;
 }
 
 target_t shard_get_cur_target(shard_t *shard)
@@ -148,45 +277,269 @@ target_t shard_get_cur_target(shard_t *shard)
 		return (target_t){
 		    .ip = 0, .port = 0, .status = ZMAP_SHARD_DONE};
 	}
-	uint32_t ip = extract_ip(shard->current - 1, shard->bits_for_port);
-	uint16_t port = extract_port(shard->current - 1, shard->bits_for_port);
-	return (target_t){.ip = (uint32_t)blocklist_lookup_index(ip),
-			  .port = (uint16_t)zconf.ports->ports[port],
-			  .status = ZMAP_SHARD_OK};
+	uint64_t index;
+	uint16_t port;
+	shard_decode(shard, shard->current - 1, &index, &port);
+	target_t t = {.port = (uint16_t)zconf.ports->ports[port],
+		      .status = ZMAP_SHARD_OK};
+	if (shard_passes_index(shard)) {
+		t.index = index;
+	} else {
+		t.ip = shard_resolve_index(shard, index);
+	}
+	return t;
 }
 
 static inline uint64_t shard_get_next_elem(shard_t *shard)
 {
-	shard->current *= shard->params.factor;
-	shard->current %= shard->params.modulus;
+	shard->current =
+	    cyclic_mulmod(shard->current, shard->params.factor,
+			  shard->params.factor_pre, shard->params.modulus);
 	return (uint64_t)shard->current;
 }
 
+// Claim the next steps of the range, or return 0 if another thread has
+// taken the rest of it
+static __attribute__((noinline)) int shard_claim(shard_t *shard)
+{
+	pthread_mutex_lock(&shard->range_lock);
+	uint64_t end = shard->end;
+	if (shard->claimed < end) {
+		uint64_t claimed = end - shard->claimed > SHARD_CLAIM_STEPS
+				       ? shard->claimed + SHARD_CLAIM_STEPS
+				       : end;
+		__atomic_store_n(&shard->claimed, claimed, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&shard->range_lock);
+	return shard->pos < shard->claimed;
+}
+
+// Step the shard to the next element that maps to a valid (ip index, port
+// index) pair, or to ZMAP_SHARD_DONE at the end of its range.
+static inline void shard_advance(shard_t *shard)
+{
+	while (1) {
+		uint64_t candidate = shard_get_next_elem(shard);
+		if (++shard->pos == shard->claimed && !shard_claim(shard)) {
+			shard->current = ZMAP_SHARD_DONE;
+			shard_stat_add(&shard->stats->iterations, 1);
+			return;
+		}
+		if (candidate - 1 < shard->num_targets) {
+			shard_stat_add(&shard->stats->iterations, 1);
+			return;
+		}
+	}
+}
+
+// Take the upper half of the unclaimed part of the range of the peer with
+// the most left. What is read without the lock only picks the peer.
+static int shard_steal(shard_t *shard, uint64_t *pos, uint64_t *end)
+{
+	for (;;) {
+		shard_t *victim = NULL;
+		uint64_t most = 0;
+		for (uint16_t i = 0; i < shard->num_peers; i++) {
+			shard_t *peer = &shard->peers[i];
+			if (peer == shard ||
+			    __atomic_load_n(&peer->stratum, __ATOMIC_RELAXED) !=
+				shard->stratum) {
+				continue;
+			}
+			uint64_t e = __atomic_load_n(&peer->end, __ATOMIC_RELAXED);
+			uint64_t c =
+			    __atomic_load_n(&peer->claimed, __ATOMIC_RELAXED);
+			if (e > c && e - c > most) {
+				most = e - c;
+				victim = peer;
+			}
+		}
+		if (!victim || most < SHARD_STEAL_MIN) {
+			return 0;
+		}
+		pthread_mutex_lock(&victim->range_lock);
+		uint64_t e = victim->end;
+		uint64_t c = victim->claimed;
+		if (victim->stratum == shard->stratum && e > c &&
+		    e - c >= SHARD_STEAL_MIN) {
+			uint64_t mid = c + (e - c) / 2;
+			__atomic_store_n(&victim->end, mid, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&victim->range_lock);
+			log_debug("shard",
+				  "thread %hu took %" PRIu64
+				  " exponents from thread %hu",
+				  shard->thread_id, e - mid, victim->thread_id);
+			*pos = mid;
+			*end = e;
+			return 1;
+		}
+		// claimed or stolen from since, look again
+		pthread_mutex_unlock(&victim->range_lock);
+	}
+}
+
+// The subshard's range of exponents in a cycle of the given order, as
+// shard_init() splits it
+static void shard_subshard_range(const shard_t *shard, uint64_t order,
+				 uint64_t *pos, uint64_t *end)
+{
+	uint64_t step = order / shard->num_subshards;
+	*pos = step * shard->sub_idx;
+	*end = shard->sub_idx + 1 == shard->num_subshards
+		   ? order
+		   : step * (shard->sub_idx + 1);
+}
+
+static void shard_use_stratum(shard_t *shard, const shard_stratum_t *st)
+{
+	shard->params.factor = st->cycle.generator;
+	shard->params.modulus = st->cycle.group->prime;
+	shard->params.factor_pre = cyclic_mulmod_precompute(
+	    shard->params.factor, shard->params.modulus);
+	shard->params.order = st->cycle.order;
+	shard->params.offset = st->cycle.offset;
+	shard->num_targets = st->num_addrs * shard->port_count;
+	shard->list = st->list;
+	shard->skip = st->skip;
+}
+
+// Move a shard that is done, whose range has nothing left to steal either,
+// on to its range of the next stratum. The elements being walked only
+// change under the range lock, with the stratum thieves check.
+static int shard_next_stratum(shard_t *shard, uint64_t *pos, uint64_t *end)
+{
+	if (shard->stratum + 1 >= shard->num_strata) {
+		return 0;
+	}
+	const shard_stratum_t *st = &shard->strata[shard->stratum + 1];
+	pthread_mutex_lock(&shard->range_lock);
+	shard_use_stratum(shard, st);
+	__atomic_store_n(&shard->stratum, shard->stratum + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&shard->range_lock);
+	shard_subshard_range(shard, st->cycle.order, pos, end);
+	if (st->fraction < 1) {
+		// the cycle's order is random, so any part of it is a sample
+		*end = *pos + (uint64_t)((*end - *pos) * st->fraction);
+	}
+	log_debug("shard", "thread %hu moved on to stratum %u",
+		  shard->thread_id, shard->stratum);
+	return 1;
+}
+
+void shard_set_strata(shard_t *shard, const shard_stratum_t *strata,
+		      uint8_t num_strata)
+{
+	assert(num_strata > 0);
+	shard->strata = strata;
+	shard->num_strata = num_strata;
+	shard->stratum = 0;
+	shard_use_stratum(shard, &strata[0]);
+	uint64_t pos, end;
+	shard_subshard_range(shard, strata[0].cycle.order, &pos, &end);
+	if (strata[0].fraction < 1) {
+		end = pos + (uint64_t)((end - pos) * strata[0].fraction);
+	}
+	shard_set_range(shard, pos, end);
+	shard->current = pos < end ? shard_element(shard, pos) : ZMAP_SHARD_DONE;
+	if (shard->current != ZMAP_SHARD_DONE) {
+		shard_roll_to_valid(shard);
+	}
+}
+
+void shard_set_lease_source(shard_t *shard, shard_lease_cb cb, void *arg)
+{
+	shard->lease_cb = cb;
+	shard->lease_arg = arg;
+	shard->current = ZMAP_SHARD_DONE;
+	shard_set_range(shard, 0, 0);
+}
+
+int shard_refill(shard_t *shard)
+{
+	assert(shard->current == ZMAP_SHARD_DONE);
+	while (shard->current == ZMAP_SHARD_DONE) {
+		uint64_t pos, end;
+		if (shard->next_end > shard->next_pos) {
+			pos = shard->next_pos;
+			end = shard->next_end;
+			shard->next_pos = shard->next_end = 0;
+		} else if (shard->lease_cb) {
+			if (!shard->lease_cb(shard->thread_id, &pos, &end,
+					     shard->lease_arg)) {
+				return 0;
+			}
+		} else if (!shard_steal(shard, &pos, &end) &&
+			   !shard_next_stratum(shard, &pos, &end)) {
+			return 0;
+		}
+		pthread_mutex_lock(&shard->range_lock);
+		shard_set_range(shard, pos, end);
+		pthread_mutex_unlock(&shard->range_lock);
+		shard->current = shard_element(shard, pos);
+		shard_roll_to_valid(shard);
+	}
+	return 1;
+}
+
 target_t shard_get_next_target(shard_t *shard)
 {
 	if (shard->current == ZMAP_SHARD_DONE) {
 		return (target_t){
 		    .ip = 0, .port = 0, .status = ZMAP_SHARD_DONE};
 	}
-	while (1) {
-		uint64_t candidate = shard_get_next_elem(shard);
-		if (candidate == shard->params.last) {
-			shard->current = ZMAP_SHARD_DONE;
-			shard->iterations++;
-			return (target_t){
-			    .ip = 0, .port = 0, .status = ZMAP_SHARD_DONE};
+	shard_advance(shard);
+	return shard_get_cur_target(shard);
+}
+
+size_t shard_get_next_targets(shard_t *shard, target_t *out, size_t n)
+{
+	if (shard->state.max_targets) {
+		uint64_t scanned = shard_stat_read(&shard->stats->targets_scanned);
+		uint64_t remaining = shard->state.max_targets > scanned
+					 ? shard->state.max_targets - scanned
+					 : 0;
+		if (remaining < n) {
+			n = remaining;
+		}
+	}
+	size_t filled = 0;
+	while (filled < n && shard->current != ZMAP_SHARD_DONE) {
+		// First walk the cycle, which is only the multiply-modulo
+		// chain, and stash the raw indices so the blocklist or list of
+		// IPs lookups for the whole run can be prefetched ahead of use.
+		size_t end = filled;
+		while (end < n && shard->current != ZMAP_SHARD_DONE) {
+			uint64_t v = shard->current - 1;
+			shard_decode(shard, v, &out[end].index, &out[end].port);
+			shard_prefetch_index(shard, out[end].index);
+			end++;
+			shard_advance(shard);
 		}
-		uint32_t candidate_ip =
-		    extract_ip(candidate - 1, shard->bits_for_port);
-		uint16_t candidate_port =
-		    extract_port(candidate - 1, shard->bits_for_port);
-		if (candidate_ip < zsend.max_index &&
-		    candidate_port < zconf.ports->port_count) {
-			shard->iterations++;
-			return (target_t){
-			    .ip = blocklist_lookup_index(candidate_ip),
-			    .port = zconf.ports->ports[candidate_port],
-			    .status = ZMAP_SHARD_OK};
+		// Then resolve the indices in place, dropping those of the
+		// stratum's skip set and those --sample leaves out
+		for (size_t i = filled; i < end; i++) {
+			if (shard_passes_index(shard)) {
+				out[filled].index = out[i].index;
+				out[filled].port = zconf.ports->ports[out[i].port];
+				out[filled].status = ZMAP_SHARD_OK;
+				filled++;
+				continue;
+			}
+			uint32_t ip = shard_resolve_index(shard, out[i].index);
+			if (shard->skip && cbm_check(shard->skip, ntohl(ip))) {
+				continue;
+			}
+			if (zsample.probed) {
+				if (!sample_keep(ntohl(ip))) {
+					continue;
+				}
+				sample_count(zsample.probed, ntohl(ip));
+			}
+			out[filled].ip = ip;
+			out[filled].port = zconf.ports->ports[out[i].port];
+			out[filled].status = ZMAP_SHARD_OK;
+			filled++;
 		}
 	}
+	return filled;
 }
@@ -9,45 +9,212 @@
 #ifndef ZMAP_SHARD_H
 #define ZMAP_SHARD_H
 
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "../lib/cbm.h"
+#include "../lib/types.h"
 #include "cyclic.h"
 
 #define ZMAP_SHARD_DONE 0
 #define ZMAP_SHARD_OK 1
 
-typedef void (*shard_complete_cb)(uint8_t id, void *arg);
+typedef void (*shard_complete_cb)(uint16_t id, void *arg);
+// the next range [pos, end) of linear exponents for the thread to walk,
+// returning 0 if there is none
+typedef int (*shard_lease_cb)(uint16_t id, uint64_t *pos, uint64_t *end,
+			      void *arg);
 
+// What a sender counts while it runs. The sender is the only writer, with
+// shard_stat_add(); the monitor reads with shard_stat_read() and
+// iterator_get_totals(). Once the sender thread is pinned it moves its
+// block to a page of its own that it allocates itself (shard_stats_localize),
+// so the first touch puts the page on that thread's NUMA node and no other
+// thread writes to the cache line.
+typedef struct shard_stats {
+	uint64_t packets_sent;
+	uint64_t targets_scanned;
+	uint64_t packets_failed;
+	uint64_t iterations;
+	// --probe-spacing: held probes not sent as the target had responded
+	uint64_t retransmits_skipped;
+	// --ipv6-alias-detect: targets left out as their prefix is aliased
+	uint64_t aliased_skipped;
+	// IPv6 targets left out by the allowlist and blocklist
+	uint64_t ipv6_blocklisted;
+	// --target-threads: ns the sender waited for its generator
+	uint64_t starved_ns;
+	// times, and ns, the sender waited for a full qdisc or device
+	// queue to drain
+	uint64_t send_backoffs;
+	uint64_t backoff_ns;
+} __attribute__((aligned(64))) shard_stats_t;
+
+static inline void shard_stat_add(uint64_t *stat, uint64_t n)
+{
+	// a plain load and store, as nothing else writes it
+	__atomic_store_n(stat, __atomic_load_n(stat, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+static inline uint64_t shard_stat_read(const uint64_t *stat)
+{
+	return __atomic_load_n(stat, __ATOMIC_RELAXED);
+}
+
+// Where a shard is and what it has counted, for --checkpoint-file. A resumed
+// scan sets its shards back to it with shard_checkpoint_restore().
+typedef struct shard_checkpoint {
+	uint64_t current;
+	// the range current is in, and one to walk after it (see
+	// shard_refill())
+	uint64_t pos;
+	uint64_t end;
+	uint64_t next_pos;
+	uint64_t next_end;
+	uint64_t targets_scanned;
+	uint64_t packets_sent;
+	uint64_t packets_failed;
+	uint64_t iterations;
+} shard_checkpoint_t;
+
+// One of the parts of the target space that --delta-from has the shards
+// walk in turn, each over a cycle of its own: the addresses of list by
+// index, or of the allowed space if it is NULL, leaving out those in skip
+// (host order), and of the latter only the first fraction of every range.
+typedef struct shard_stratum {
+	cycle_t cycle;
+	uint64_t num_addrs;
+	const uint32_t *list;
+	const cbm_t *skip;
+	double fraction;
+} shard_stratum_t;
+
+// The sender thread walks its shard, writing current, so shards are kept on
+// cache lines of their own (see iterator_init())
 typedef struct shard {
 	struct shard_state {
-		uint64_t packets_sent;
-		uint64_t targets_scanned;
 		uint64_t max_targets;
 		uint64_t max_packets;
-		uint32_t packets_failed;
 		uint64_t first_scanned;
 	} state;
+	shard_stats_t *stats;
 	struct shard_params {
 		uint64_t first;
 		uint64_t last;
 		uint64_t factor;
+		uint64_t factor_pre; // see cyclic_mulmod_precompute()
 		uint64_t modulus;
+		uint64_t order;
+		uint32_t offset;
 	} params;
 	uint64_t current;
-	uint64_t iterations;
-	uint8_t thread_id;
-	uint8_t bits_for_port;
+	// Exponents are linear here, from 0 to the order of the cycle before
+	// the offset, so a range never wraps. current is g^pos; the shard owns
+	// [pos, end) but walks without the lock only up to claimed, as other
+	// threads may take the rest of the range from end down.
+	uint64_t pos;
+	uint64_t claimed;
+	uint64_t end;
+	// a range restored from a checkpoint, walked before stealing
+	uint64_t next_pos;
+	uint64_t next_end;
+	pthread_mutex_t range_lock;
+	// the shards of the other send threads, to steal from
+	struct shard *peers;
+	uint16_t num_peers;
+	// where ranges come from instead, if set
+	shard_lease_cb lease_cb;
+	void *lease_arg;
+	uint16_t thread_id;
+	// the subshard, for the range of each stratum
+	uint32_t sub_idx;
+	uint32_t num_subshards;
+	// if set, the strata walked in turn, stratum being the one walked now
+	// (see shard_set_strata()). Thieves only take from a peer in the same
+	// stratum, which changes under the range lock.
+	const shard_stratum_t *strata;
+	uint8_t num_strata;
+	uint8_t stratum;
+	// addresses by index rather than the blocklist's, and those to leave
+	// out, of the stratum or else zsend.list_of_ips
+	const uint32_t *list;
+	const cbm_t *skip;
+	// An element v of the group is the target (ip index, port index)
+	// with v - 1 = ip * port_count + port, if v - 1 < num_targets.
+	// port_recip is floor((2^64 - 1) / port_count), see shard_decode().
+	uint64_t num_targets;
+	uint64_t port_recip;
+	uint32_t port_count;
 	shard_complete_cb cb;
 	void *arg;
-} shard_t;
+	// published by the sender, odd while it writes checkpoint
+	uint64_t checkpoint_seq;
+	shard_checkpoint_t checkpoint;
+} __attribute__((aligned(64))) shard_t;
+
+// Split v - 1 of a valid element into (ip index, port index) without a
+// divide: the quotient from the rounded-down reciprocal is off by at most
+// one for any v below 2^64, which the remainder tells.
+static inline void shard_decode(const shard_t *shard, uint64_t v,
+				uint64_t *index, uint16_t *port)
+{
+	uint64_t q =
+	    (uint64_t)(((unsigned __int128)v * shard->port_recip) >> 64);
+	uint64_t r = v - q * shard->port_count;
+	if (r >= shard->port_count) {
+		q++;
+		r -= shard->port_count;
+	}
+	*index = q;
+	*port = (uint16_t)r;
+}
 
 void shard_init(shard_t *shard, uint16_t shard_idx, uint16_t num_shards,
-		uint8_t thread_idx, uint8_t num_threads,
-		uint64_t max_total_targets, uint8_t bits_for_port,
-		const cycle_t *cycle, shard_complete_cb cb, void *arg);
+		uint16_t thread_idx, uint16_t num_threads,
+		uint64_t max_total_targets, uint32_t num_ports,
+		const cycle_t *cycle, shard_stats_t *stats,
+		shard_complete_cb cb, void *arg);
+// from the sender thread, pinned to its core, before it starts counting
+void shard_stats_localize(shard_t *shard);
+
+// From the sender, once the shard is done: move it to the range queued by a
+// checkpoint, or else to one from the lease source, or else to the upper
+// half of what the peer with the most left has not yet claimed, or else to
+// the next stratum. Returns 0 if there was nothing worth taking.
+int shard_refill(shard_t *shard);
+// Before the sender starts: have the shard walk its subshard of each of the
+// strata in turn, from the first, moving on once its own range of one and
+// whatever it can take from peers there is done
+void shard_set_strata(shard_t *shard, const shard_stratum_t *strata,
+		      uint8_t num_strata);
+// Before the sender starts: empty the shard, so that all of its ranges come
+// from cb
+void shard_set_lease_source(shard_t *shard, shard_lease_cb cb, void *arg);
+
+// From the sender: where the shard is now, and publishing a position all of
+// whose targets have been sent as the one checkpoints save, with the start
+// of the range it has moved on to since (or NULL)
+shard_checkpoint_t shard_checkpoint_take(const shard_t *shard);
+void shard_checkpoint_publish(shard_t *shard, const shard_checkpoint_t *c,
+			      const shard_checkpoint_t *then);
+// from any thread: the position the sender last published
+void shard_checkpoint_read(const shard_t *shard, shard_checkpoint_t *out);
+// before the sender starts
+void shard_checkpoint_restore(shard_t *shard, const shard_checkpoint_t *c);
 
 typedef struct target {
-	uint32_t ip;
+	union {
+		// IPv4 address
+		uint32_t ip;
+		// IPv6 target file or pattern index straight out of the shard
+		// when zsend.index_targets is set without a list of IPs
+		uint64_t index;
+		// the address as handed to make_packet; for IPv6 filled in
+		// by the sender once it has resolved the index
+		ipaddr_t addr;
+	};
 	uint16_t port;
 	uint8_t status;
 } target_t;
@@ -55,4 +222,9 @@ typedef struct target {
 target_t shard_get_cur_target(shard_t *shard);
 target_t shard_get_next_target(shard_t *shard);
 
+// Fill out with up to n targets, starting with the current one, and leave
+// the shard on the target following the last one returned. No more than the
+// remaining max_targets are returned. Returns 0 once the shard is done.
+size_t shard_get_next_targets(shard_t *shard, target_t *out, size_t n);
+
 #endif /* ZMAP_SHARD_H */
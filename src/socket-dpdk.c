@@ -0,0 +1,257 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include "socket.h"
+#include "socket-dpdk.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rte_eal.h>
+#include <rte_errno.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/util.h"
+#include "../lib/xalloc.h"
+#include "send.h"
+#include "state.h"
+#include "utility.h"
+
+// the PCI address of the device behind a kernel interface, e.g.
+// 0000:01:00.0, which is also the name DPDK gives its port
+static int iface_pci_addr(const char *iface, char *buf, size_t len)
+{
+	char path[PATH_MAX];
+	char target[PATH_MAX];
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device", iface);
+	ssize_t n = readlink(path, target, sizeof(target) - 1);
+	if (n < 0) {
+		return -1;
+	}
+	target[n] = '\0';
+	const char *base = strrchr(target, '/');
+	cross_platform_strlcpy(buf, base ? base + 1 : target, len);
+	return 0;
+}
+
+static void eal_init(const char *pci)
+{
+	const char **args = NULL;
+	int nargs = 0;
+	if (zconf.dpdk.eal_args) {
+		split_string(zconf.dpdk.eal_args, &nargs, &args);
+	}
+	// the EAL keeps argv, so none of this is freed
+	char **argv = xcalloc(nargs + 6, sizeof(char *));
+	int argc = 0;
+	argv[argc++] = "zmap";
+	for (int i = 0; i < nargs; i++) {
+		argv[argc++] = (char *)args[i];
+	}
+	cpu_set_t cpus;
+	int have_cpus = !pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	if (!nargs) {
+		// Without --dpdk-args, take just the device of the interface,
+		// and a single lcore, as zmap runs its own threads.
+		int first = 0;
+		while (have_cpus && first < CPU_SETSIZE && !CPU_ISSET(first, &cpus)) {
+			first++;
+		}
+		char *lcores = xmalloc(16);
+		snprintf(lcores, 16, "%d", first);
+		argv[argc++] = "-l";
+		argv[argc++] = lcores;
+		if (pci) {
+			char *allow = xmalloc(strlen(pci) + 1);
+			strcpy(allow, pci);
+			argv[argc++] = "-a";
+			argv[argc++] = allow;
+		}
+	}
+	if (rte_eal_init(argc, argv) < 0) {
+		log_fatal("socket-dpdk", "unable to initialize the DPDK EAL: %s",
+			  rte_strerror(rte_errno));
+	}
+	// the EAL pins the main thread to its main lcore, which every thread
+	// started from here on would inherit; zmap places its threads itself
+	if (have_cpus) {
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+}
+
+void dpdk_init(void)
+{
+	char pci[64];
+	int have_pci = !iface_pci_addr(zconf.iface, pci, sizeof(pci));
+	eal_init(have_pci ? pci : NULL);
+
+	const char *name = have_pci ? pci : zconf.iface;
+	uint16_t port;
+	if (rte_eth_dev_get_port_by_name(name, &port)) {
+		log_fatal("socket-dpdk", "no DPDK port for %s, is its device bound to a DPDK "
+					 "driver (see dpdk-devbind.py)?",
+			  name);
+	}
+	struct rte_eth_dev_info info;
+	int rc = rte_eth_dev_info_get(port, &info);
+	if (rc) {
+		log_fatal("socket-dpdk", "unable to get device info of %s: %s", name,
+			  rte_strerror(-rc));
+	}
+	zconf.dpdk.port_id = port;
+	zconf.dpdk.max_rx_queues = info.max_rx_queues;
+	zconf.dpdk.max_tx_queues = info.max_tx_queues;
+
+	int socket = rte_eth_dev_socket_id(port);
+	if (socket >= 0) {
+		zconf.numa_node = socket;
+	}
+	if (!zconf.hw_mac_set) {
+		struct rte_ether_addr mac;
+		if (rte_eth_macaddr_get(port, &mac)) {
+			log_fatal("socket-dpdk", "unable to get the MAC address of %s",
+				  name);
+		}
+		memcpy(zconf.hw_mac, mac.addr_bytes, ETHER_ADDR_LEN);
+		zconf.hw_mac_set = 1;
+	}
+	log_debug("socket-dpdk", "%s is DPDK port %u (%s), %u RX and %u TX queues",
+		  name, port, info.driver_name, info.max_rx_queues,
+		  info.max_tx_queues);
+}
+
+uint32_t dpdk_tx_mbufs_per_thread(void)
+{
+	// Packets are built in sets of a batch. A set is built into again
+	// only once all the packets sent after it could not have fit in the
+	// TX ring along with it, so the PMD is done with it by then.
+	uint32_t batch = zconf.batch;
+	uint32_t sets = (zconf.dpdk.tx_descs + batch - 1) / batch + 2;
+	return sets * batch;
+}
+
+void dpdk_start(void)
+{
+	uint16_t port = zconf.dpdk.port_id;
+	uint16_t nb_rx = zconf.recv_threads;
+	uint16_t nb_tx = (uint16_t)zconf.senders;
+	struct rte_eth_dev_info info;
+	int rc = rte_eth_dev_info_get(port, &info);
+	if (rc) {
+		log_fatal("socket-dpdk", "unable to get device info of port %u: %s",
+			  port, rte_strerror(-rc));
+	}
+	struct rte_eth_conf conf;
+	memset(&conf, 0, sizeof(conf));
+	if (nb_rx > 1) {
+		conf.rxmode.mq_mode = RTE_ETH_MQ_RX_RSS;
+		conf.rx_adv_conf.rss_conf.rss_hf =
+		    (RTE_ETH_RSS_IP | RTE_ETH_RSS_TCP | RTE_ETH_RSS_UDP) &
+		    info.flow_type_rss_offloads;
+		if (!conf.rx_adv_conf.rss_conf.rss_hf) {
+			log_fatal("socket-dpdk", "port %u can't spread responses across "
+						 "--recv-threads by RSS",
+				  port);
+		}
+	}
+	// RTE_ETH_TX_OFFLOAD_MBUF_FAST_FREE is left off, as the send threads
+	// hold a reference to the mbufs they build packets in
+	rc = rte_eth_dev_configure(port, nb_rx, nb_tx, &conf);
+	if (rc) {
+		log_fatal("socket-dpdk", "unable to configure port %u with %u RX and "
+					 "%u TX queues: %s",
+			  port, nb_rx, nb_tx, rte_strerror(-rc));
+	}
+	uint16_t rx_descs = DPDK_RX_DESCS;
+	uint16_t tx_descs = DPDK_TX_DESCS;
+	rc = rte_eth_dev_adjust_nb_rx_tx_desc(port, &rx_descs, &tx_descs);
+	if (rc) {
+		log_fatal("socket-dpdk", "unable to size the rings of port %u: %s",
+			  port, rte_strerror(-rc));
+	}
+	zconf.dpdk.rx_descs = rx_descs;
+	zconf.dpdk.tx_descs = tx_descs;
+
+	int socket = rte_eth_dev_socket_id(port);
+	if (socket < 0) {
+		socket = (int)rte_socket_id();
+	}
+	// every RX descriptor holds an mbuf, and each thread has a burst out
+	uint32_t rx_mbufs = nb_rx * (rx_descs + DPDK_RX_BURST + DPDK_MBUF_CACHE);
+	zconf.dpdk.rx_pool =
+	    rte_pktmbuf_pool_create("zmap_rx", rx_mbufs, DPDK_MBUF_CACHE, 0,
+				    RTE_MBUF_DEFAULT_BUF_SIZE, socket);
+	// the sets each send thread builds in, and what extra probe modules
+	// copy into as it waits in the TX ring
+	uint32_t tx_mbufs = nb_tx * (dpdk_tx_mbufs_per_thread() + tx_descs +
+				     zconf.batch + DPDK_MBUF_CACHE);
+	zconf.dpdk.tx_pool =
+	    rte_pktmbuf_pool_create("zmap_tx", tx_mbufs, DPDK_MBUF_CACHE, 0,
+				    RTE_MBUF_DEFAULT_BUF_SIZE, socket);
+	if (!zconf.dpdk.rx_pool || !zconf.dpdk.tx_pool) {
+		log_fatal("socket-dpdk", "unable to allocate %u RX and %u TX mbufs on "
+					 "socket %d: %s",
+			  rx_mbufs, tx_mbufs, socket, rte_strerror(rte_errno));
+	}
+	for (uint16_t q = 0; q < nb_rx; q++) {
+		rc = rte_eth_rx_queue_setup(port, q, rx_descs, socket, NULL,
+					    zconf.dpdk.rx_pool);
+		if (rc) {
+			log_fatal("socket-dpdk", "unable to set up RX queue %u of port %u: %s",
+				  q, port, rte_strerror(-rc));
+		}
+	}
+	for (uint16_t q = 0; q < nb_tx; q++) {
+		rc = rte_eth_tx_queue_setup(port, q, tx_descs, socket, NULL);
+		if (rc) {
+			log_fatal("socket-dpdk", "unable to set up TX queue %u of port %u: %s",
+				  q, port, rte_strerror(-rc));
+		}
+	}
+	rc = rte_eth_dev_start(port);
+	if (rc) {
+		log_fatal("socket-dpdk", "unable to start port %u: %s", port,
+			  rte_strerror(-rc));
+	}
+	// waits for the link to come up, for a few seconds at most
+	struct rte_eth_link link;
+	memset(&link, 0, sizeof(link));
+	rte_eth_link_get(port, &link);
+	if (link.link_status != RTE_ETH_LINK_UP) {
+		log_warn("socket-dpdk", "link of port %u is down", port);
+	}
+	log_info("socket-dpdk", "DPDK port %u started with %u RX and %u TX queues, "
+				"link at %u Mbps",
+		 port, nb_rx, nb_tx, link.link_speed);
+}
+
+void dpdk_cleanup(void)
+{
+	uint16_t port = zconf.dpdk.port_id;
+	rte_eth_dev_stop(port);
+	rte_eth_dev_close(port);
+	rte_eal_cleanup();
+}
+
+sock_t get_socket(uint32_t id)
+{
+	if (id >= zconf.senders) {
+		log_fatal("socket-dpdk", "no DPDK TX queue for send thread %u", id);
+	}
+	sock_t sock;
+	sock.dpdk.queue = (uint16_t)id;
+	return sock;
+}
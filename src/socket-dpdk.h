@@ -0,0 +1,47 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_SOCKET_DPDK_H
+#define ZMAP_SOCKET_DPDK_H
+
+#if !defined(__linux__)
+#error "DPDK requires Linux"
+#endif
+
+#include <rte_ethdev.h>
+#include <rte_mbuf.h>
+#include <rte_mempool.h>
+
+// descriptors asked for per queue, the PMD may round them
+#define DPDK_RX_DESCS 1024
+#define DPDK_TX_DESCS 1024
+// max number of mbufs taken from one RX queue per poll
+#define DPDK_RX_BURST 32
+#define DPDK_MBUF_CACHE 256
+// Offset of packet data past the mbuf headroom, keeps the IP header 32-bit
+// aligned just like struct batch_frame does.
+#define DPDK_DATA_OFFSET 2
+
+// Start the EAL and find the port of zconf.iface, which is either a kernel
+// interface whose PCI device DPDK drives, or a DPDK device name such as a
+// PCI address. Takes the source MAC from the port unless --source-mac was
+// given, and the NUMA node from the port.
+void dpdk_init(void);
+
+// Set up an RX queue for every receive thread, spread by RSS, and a TX
+// queue for every send thread, then start the port. Must be called once
+// the number of send threads and the batch size are known.
+void dpdk_start(void);
+
+// Stop the port and the EAL.
+void dpdk_cleanup(void);
+
+// Mbufs a send thread keeps for building packets in, see send-dpdk.c.
+uint32_t dpdk_tx_mbufs_per_thread(void);
+
+#endif /* ZMAP_SOCKET_DPDK_H */
@@ -0,0 +1,156 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "socket.h"
+#include "socket-xdp.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+#include "state.h"
+#include "utility.h"
+#include "xdp_filter.h"
+
+// Number of queues we need to bind to in order to see every response,
+// i.e., everything RSS may spread incoming packets across.
+static uint32_t xdp_get_num_queues(const char *ifname)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		log_fatal("socket-xdp", "socket(AF_INET): %s", strerror(errno));
+	}
+	struct ethtool_channels channels;
+	memset(&channels, 0, sizeof(channels));
+	channels.cmd = ETHTOOL_GCHANNELS;
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	cross_platform_strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+	ifr.ifr_data = (void *)&channels;
+	uint32_t queues = 1;
+	if (ioctl(fd, SIOCETHTOOL, &ifr) == 0) {
+		uint32_t n = channels.combined_count + channels.rx_count;
+		if (n > 0) {
+			queues = n;
+		}
+	} else {
+		log_debug("socket-xdp", "ETHTOOL_GCHANNELS failed on %s (%s), assuming a single queue",
+			  ifname, strerror(errno));
+	}
+	close(fd);
+	return queues;
+}
+
+static uint32_t next_pow2(uint32_t v)
+{
+	uint32_t p = 1;
+	while (p < v) {
+		p <<= 1;
+	}
+	return p;
+}
+
+static void xdp_queue_init(struct xdp_queue *q, uint32_t id, uint32_t tx_ring_size)
+{
+	q->id = id;
+	q->tx_frames = 2 * (uint32_t)zconf.batch;
+	q->umem_len = (size_t)(XDP_RX_FRAMES + q->tx_frames) * XDP_FRAME_SIZE;
+	// page aligned, as a UMEM has to be, and populated up front
+	q->umem_area = hugemem_alloc(&q->umem_mem, MEM_PACKETS, q->umem_len);
+	struct xsk_umem_config ucfg = {
+	    .fill_size = XDP_RX_FRAMES,
+	    .comp_size = tx_ring_size,
+	    .frame_size = XDP_FRAME_SIZE,
+	    .frame_headroom = 0,
+	    .flags = 0,
+	};
+	int rc = xsk_umem__create(&q->umem, q->umem_area, q->umem_len, &q->fill,
+				  &q->comp, &ucfg);
+	if (rc) {
+		log_fatal("socket-xdp", "xsk_umem__create failed for queue %u: %s",
+			  id, strerror(-rc));
+	}
+	struct xsk_socket_config scfg = {
+	    .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+	    .tx_size = tx_ring_size,
+	    // the pre-filter, if any, is attached already
+	    .libxdp_flags =
+		zconf.xdp_filter ? XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD : 0,
+	    .xdp_flags = 0,
+	    .bind_flags = XDP_USE_NEED_WAKEUP | XDP_ZEROCOPY,
+	};
+	rc = xsk_socket__create(&q->xsk, zconf.iface, id, q->umem, &q->rx,
+				&q->tx, &scfg);
+	if (rc) {
+		log_warn("socket-xdp", "zero-copy AF_XDP unavailable on %s queue %u (%s), falling back to copy mode",
+			 zconf.iface, id, strerror(-rc));
+		scfg.bind_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+		rc = xsk_socket__create(&q->xsk, zconf.iface, id, q->umem,
+					&q->rx, &q->tx, &scfg);
+	}
+	if (rc) {
+		log_fatal("socket-xdp", "xsk_socket__create failed for %s queue %u: %s",
+			  zconf.iface, id, strerror(-rc));
+	}
+	if (zconf.xdp_filter) {
+		xdp_filter_add_socket(q->xsk, id);
+	}
+	// hand every RX frame to the kernel up front
+	uint32_t idx;
+	if (xsk_ring_prod__reserve(&q->fill, XDP_RX_FRAMES, &idx) != XDP_RX_FRAMES) {
+		log_fatal("socket-xdp", "unable to populate fill ring for queue %u", id);
+	}
+	for (uint32_t i = 0; i < XDP_RX_FRAMES; i++) {
+		*xsk_ring_prod__fill_addr(&q->fill, idx++) = (uint64_t)i * XDP_FRAME_SIZE;
+	}
+	xsk_ring_prod__submit(&q->fill, XDP_RX_FRAMES);
+}
+
+void xdp_init(void)
+{
+	uint32_t n = xdp_get_num_queues(zconf.iface);
+	uint32_t tx_ring_size = next_pow2(2 * (uint32_t)zconf.batch);
+	if (tx_ring_size < XSK_RING_PROD__DEFAULT_NUM_DESCS) {
+		tx_ring_size = XSK_RING_PROD__DEFAULT_NUM_DESCS;
+	}
+	zconf.xdp.num_queues = n;
+	zconf.xdp.queues = xcalloc(n, sizeof(struct xdp_queue));
+	for (uint32_t i = 0; i < n; i++) {
+		xdp_queue_init(&zconf.xdp.queues[i], i, tx_ring_size);
+	}
+	log_info("socket-xdp", "AF_XDP bound to %s with %u queues", zconf.iface, n);
+}
+
+void xdp_cleanup(void)
+{
+	for (uint32_t i = 0; i < zconf.xdp.num_queues; i++) {
+		struct xdp_queue *q = &zconf.xdp.queues[i];
+		xsk_socket__delete(q->xsk);
+		xsk_umem__delete(q->umem);
+		hugemem_free(&q->umem_mem);
+	}
+	xfree(zconf.xdp.queues);
+	zconf.xdp.queues = NULL;
+	zconf.xdp.num_queues = 0;
+}
+
+sock_t get_socket(uint32_t id)
+{
+	if (id >= zconf.xdp.num_queues) {
+		log_fatal("socket-xdp", "no AF_XDP queue for send thread %u", id);
+	}
+	sock_t sock;
+	sock.xdp.queue = id;
+	return sock;
+}
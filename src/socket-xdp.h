@@ -0,0 +1,56 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_SOCKET_XDP_H
+#define ZMAP_SOCKET_XDP_H
+
+#if !defined(__linux__)
+#error "XDP requires Linux"
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <xdp/xsk.h>
+
+#include "../lib/hugemem.h"
+
+#define XDP_FRAME_SIZE XSK_UMEM__DEFAULT_FRAME_SIZE
+// Frames at the start of every UMEM that are handed to the fill ring
+// for receiving. The frames after them belong to the send thread that
+// drives the queue's TX ring.
+#define XDP_RX_FRAMES (2 * XSK_RING_PROD__DEFAULT_NUM_DESCS)
+// Offset of packet data within a frame, keeps the IP header 32-bit
+// aligned just like struct batch_frame does.
+#define XDP_DATA_OFFSET 2
+
+// One AF_XDP socket and UMEM per NIC queue. The RX and fill rings are
+// only touched by the receive thread, the TX and completion rings only
+// by the send thread whose index matches the queue.
+struct xdp_queue {
+	uint32_t id;
+	uint8_t *umem_area;
+	size_t umem_len;
+	hugemem_t umem_mem; // holding umem_area
+	uint32_t tx_frames;
+	struct xsk_umem *umem;
+	struct xsk_socket *xsk;
+	struct xsk_ring_prod fill;
+	struct xsk_ring_cons comp;
+	struct xsk_ring_cons rx;
+	struct xsk_ring_prod tx;
+};
+
+// Bind an AF_XDP socket to every combined/RX queue of zconf.iface.
+// Must be called after the batch size has been configured.
+void xdp_init(void);
+
+// Tear down all sockets and UMEMs created by xdp_init().
+void xdp_cleanup(void);
+
+#endif /* ZMAP_SOCKET_XDP_H */
@@ -13,8 +13,8 @@
 
 #include "../lib/includes.h"
 
-#if defined(PFRING) && defined(NETMAP)
-#error "PFRING and NETMAP are mutually exclusive, only define one of them"
+#if (defined(PFRING) + defined(NETMAP) + defined(XDP) + defined(DPDK)) > 1
+#error "PFRING, NETMAP, XDP and DPDK are mutually exclusive, only define one of them"
 #endif
 
 #ifdef PFRING
@@ -33,6 +33,14 @@ typedef union {
 		uint32_t tx_ring_idx;
 		int tx_ring_fd;
 	} nm;
+#elif defined(XDP)
+	struct {
+		uint32_t queue;
+	} xdp;
+#elif defined(DPDK)
+	struct {
+		uint16_t queue;
+	} dpdk;
 #else
 	int sock;
 #endif
@@ -0,0 +1,106 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "stage_timing.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+const char *const STAGE_TICK_UNIT = "cycles";
+#else
+const char *const STAGE_TICK_UNIT = "ns";
+#endif
+
+const char *const STAGE_NAMES[NUM_STAGES] = {
+    [STAGE_TARGETS] = "targets",   [STAGE_VALIDATION] = "validation",
+    [STAGE_BUILD] = "build",	   [STAGE_SEND] = "send",
+    [STAGE_CLASSIFY] = "classify", [STAGE_EMIT] = "emit"};
+
+__thread stage_block_t *stage_local = NULL;
+
+// every thread's block, newest first; only added to, once per thread
+static stage_block_t *blocks = NULL;
+static pthread_mutex_t blocks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// what the monitor saw the last time it logged
+static stage_counters_t last[NUM_STAGES];
+
+stage_block_t *stage_timing_register(void)
+{
+	stage_block_t *b = xmalloc_aligned(_Alignof(stage_block_t),
+					   sizeof(stage_block_t));
+	pthread_mutex_lock(&blocks_mutex);
+	b->next = blocks;
+	blocks = b;
+	pthread_mutex_unlock(&blocks_mutex);
+	stage_local = b;
+	return b;
+}
+
+void stage_timing_totals(stage_counters_t totals[NUM_STAGES])
+{
+	memset(totals, 0, NUM_STAGES * sizeof(stage_counters_t));
+	pthread_mutex_lock(&blocks_mutex);
+	for (const stage_block_t *b = blocks; b; b = b->next) {
+		for (int s = 0; s < NUM_STAGES; s++) {
+			const stage_counters_t *c = &b->stages[s];
+			totals[s].events +=
+			    __atomic_load_n(&c->events, __ATOMIC_RELAXED);
+			totals[s].sampled +=
+			    __atomic_load_n(&c->sampled, __ATOMIC_RELAXED);
+			totals[s].ticks +=
+			    __atomic_load_n(&c->ticks, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_mutex_unlock(&blocks_mutex);
+}
+
+void stage_timing_log(void)
+{
+	stage_counters_t now[NUM_STAGES];
+	stage_timing_totals(now);
+	// ticks spent in each stage since the last call, scaled up from the
+	// sampled events
+	double spent[NUM_STAGES];
+	double per_event[NUM_STAGES];
+	double send_total = 0, recv_total = 0;
+	for (int s = 0; s < NUM_STAGES; s++) {
+		uint64_t events = now[s].events - last[s].events;
+		uint64_t sampled = now[s].sampled - last[s].sampled;
+		uint64_t ticks = now[s].ticks - last[s].ticks;
+		per_event[s] = sampled ? (double)ticks / sampled : 0;
+		spent[s] = per_event[s] * events;
+		if (s < STAGE_CLASSIFY) {
+			send_total += spent[s];
+		} else {
+			recv_total += spent[s];
+		}
+	}
+	memcpy(last, now, sizeof(last));
+
+	char line[512];
+	size_t len = 0;
+	for (int s = 0; s < NUM_STAGES; s++) {
+		double total = s < STAGE_CLASSIFY ? send_total : recv_total;
+		int n = snprintf(line + len, sizeof(line) - len,
+				 "%s%s %.0f (%.0f%%)", s ? ", " : "",
+				 STAGE_NAMES[s], per_event[s],
+				 total > 0 ? 100 * spent[s] / total : 0);
+		if (n < 0 || (size_t)n >= sizeof(line) - len) {
+			break;
+		}
+		len += n;
+	}
+	log_info("monitor", "%s per event (share of send/recv): %s",
+		 STAGE_TICK_UNIT, line);
+}
@@ -0,0 +1,108 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_STAGE_TIMING_H
+#define ZMAP_STAGE_TIMING_H
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "state.h"
+
+// --stage-timing: where the send and receive threads spend their time.
+// Every event of a stage is counted, and one in STAGE_SAMPLE_INTERVAL of
+// them is timed with the TSC (a monotonic clock in ns elsewhere), into a
+// block of counters that each thread has to itself. With the option off a
+// stage costs one predictable branch on zconf.stage_timing.
+enum stage {
+	STAGE_TARGETS,	  // shard walk and blocklist lookups, per batch
+	STAGE_VALIDATION, // validate_gen_batch() and its inputs, per batch
+	STAGE_BUILD,	  // make_packet(s), per batch
+	STAGE_SEND,	  // send_batch(), per batch
+	STAGE_CLASSIFY,	  // validation and process_packet, per packet
+	STAGE_EMIT,	  // dedup, counting and output, per packet
+	NUM_STAGES
+};
+
+#define STAGE_SAMPLE_INTERVAL 16
+
+typedef struct stage_counters {
+	uint64_t events;
+	uint64_t sampled;
+	uint64_t ticks; // over the sampled events
+} stage_counters_t;
+
+typedef struct stage_block {
+	stage_counters_t stages[NUM_STAGES];
+	struct stage_block *next;
+} __attribute__((aligned(64))) stage_block_t;
+
+extern __thread stage_block_t *stage_local;
+stage_block_t *stage_timing_register(void);
+
+// "cycles" with the TSC, "ns" otherwise
+extern const char *const STAGE_TICK_UNIT;
+extern const char *const STAGE_NAMES[NUM_STAGES];
+
+static inline uint64_t stage_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static inline void stage_add(uint64_t *c, uint64_t n)
+{
+	// only this thread writes its block
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+// Counts an event of stage s, returning the ticks at its start if it is
+// one of the sampled ones and 0 otherwise; hand the result to stage_end().
+static inline uint64_t stage_begin(enum stage s)
+{
+	if (__builtin_expect(!zconf.stage_timing, 1)) {
+		return 0;
+	}
+	stage_block_t *b = stage_local ? stage_local : stage_timing_register();
+	stage_counters_t *c = &b->stages[s];
+	uint64_t n = __atomic_load_n(&c->events, __ATOMIC_RELAXED);
+	stage_add(&c->events, 1);
+	if (n % STAGE_SAMPLE_INTERVAL) {
+		return 0;
+	}
+	// never 0, which stands for not sampled
+	return stage_ticks() | 1;
+}
+
+static inline void stage_end(enum stage s, uint64_t start)
+{
+	if (__builtin_expect(!start, 1)) {
+		return;
+	}
+	uint64_t ticks = stage_ticks() - start;
+	stage_counters_t *c = &stage_local->stages[s];
+	stage_add(&c->sampled, 1);
+	stage_add(&c->ticks, ticks);
+}
+
+// the sum over every thread's block
+void stage_timing_totals(stage_counters_t totals[NUM_STAGES]);
+// from the monitor: logs each stage's ticks per event and estimated share
+// of the time since the last call
+void stage_timing_log(void);
+
+#endif /* ZMAP_STAGE_TIMING_H */
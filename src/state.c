@@ -10,12 +10,23 @@
 #include "../lib/logger.h"
 
 const char *const DEDUP_METHOD_NAMES[] = {"default", "none", "full", "window"};
+const char *const VALIDATION_METHOD_NAMES[] = {"auto", "aes", "siphash"};
+const char *const SEND_METHOD_NAMES[] = {"sendmmsg", "tx-ring", "io-uring",
+					       "io-uring-sqpoll"};
+const char *const PACING_NAMES[] = {"userspace", "txtime", "txtime-tai"};
+const char *const RECV_METHOD_NAMES[] = {"pcap", "tpacket-v3"};
+const char *const TIMESTAMPS_NAMES[] = {"software", "hardware"};
+const char *const RECV_FANOUT_NAMES[] = {"hash", "cpu"};
+const char *const OUTPUT_BACKPRESSURE_NAMES[] = {"block", "drop", "spill"};
+const char *const OUTPUT_COMPRESSION_NAMES[] = {"none", "zstd", "lz4"};
 
 // global configuration and defaults
 struct state_conf zconf = {
     .allowlist_filename = NULL,
     .bandwidth = 0,
-    .batch = 64,
+    .batch = DEFAULT_BATCH,
+    .batch_min = 1,
+    .batch_deadline_us = 1000,
     .blocklist_filename = NULL,
     .cooldown_secs = 0,
     .custom_metadata_str = NULL,
@@ -24,7 +35,10 @@ struct state_conf zconf = {
     .dnsippadding = 0,
     .default_mode = 0,
     .dedup_method = 0,
+    .validation_method = VALIDATION_METHOD_AUTO,
     .dedup_window_size = 0,
+    .dedup_window_time = 0,
+    .compressed_bitmap = DEFAULT_COMPRESSED_BITMAP,
     .dryrun = 0,
     .hw_mac = {0},
     .hw_mac_set = 0,
@@ -33,16 +47,37 @@ struct state_conf zconf = {
     .gw_mac_set = 0,
     .iface = NULL,
     .ipv6_source_ip = NULL,
+    .ipv6_src_prefix_len = 128,
     .ipv6_target_filename = NULL,
+    .ipv6_target_patterns = NULL,
+    .ipv6_target_patterns_len = 0,
+    .ipv6_target_prefixes_filename = NULL,
+    .ipv6 = 0,
+    .ipv6_alias_detect = 0,
+    .ipv6_alias_prefix_len = 64,
+    .ipv6_alias_threshold = 8,
+    .ipv6_alias_tests = 16,
     .list_of_ips_count = 0,
     .list_of_ips_filename = NULL,
+    .list_of_ips_stream = 0,
+    .delta_filename = NULL,
+    .delta_sample = 1.0,
+    .delta_rate = 0,
+    .sample_fraction = 0.0,
+    .sample_prefix = 16,
+    .prefix_shaping = 0,
+    .prefix_shaping_asn_file = NULL,
+    .sample_precision = 0.0,
     .log_directory = NULL,
     .log_file = NULL,
     .log_level = LOG_INFO,
     .max_results = 0,
     .max_runtime = 0,
+    .network_cache_filename = NULL,
+    .network_cache_ttl = 300,
     .max_sendto_failures = -1,
     .max_targets = UINT64_MAX,
+    .ipv6_max_targets_fraction = 0.0,
     .metadata_file = NULL,
     .metadata_filename = NULL,
     .min_hitrate = 0.0,
@@ -56,27 +91,55 @@ struct state_conf zconf = {
     .output_filter_str = NULL,
     .output_module = NULL,
     .packet_streams = 1,
+    .probe_spacing = 0,
+    .pacing = PACING_USERSPACE,
     .ports = NULL,
     .probe_args = NULL,
+    .tcp_payload = NULL,
     .probe_module = NULL,
     .probe_ttl = IPDEFTTL,
     .quiet = 0,
     .rate = -1,
     .raw_output_fields = NULL,
     .recv_ready = 0,
+    .recv_method = RECV_METHOD_PCAP,
+    .timestamps = TIMESTAMPS_SOFTWARE,
+    .tx_timestamps = 0,
+    .recv_threads = 1,
+    .capture_buffer_mb = 0,
+    .capture_only_filename = NULL,
+    .capture_only_max_bytes = 0,
+    .expected_hitrate = 0.1,
+    .recv_fanout = RECV_FANOUT_HASH,
+    .recv_processing_threads = 0,
     .retries = 10,
     .seed = 0,
     .seed_provided = 0,
+    .checkpoint_filename = NULL,
+    .checkpoint_interval = 60,
+    .csum_offload = 0,
+    .rss = {.queues = 0, .table_size = 128, .key = NULL, .steer = NULL, .candidates = 1},
+    .resume = 0,
+    .numa_node = -1,
     .senders = 1,
+    .target_threads = 0,
+    .event_loop = 0,
+    .target_ring_depth = 4,
     .send_ip_pkts = 0,
+    .send_method = SEND_METHOD_SENDMMSG,
     .source_port_first = 32768, // (these are the default
     .source_port_last = 61000,	//   ephemeral range on Linux),
     .status_updates_file = NULL,
+    .drop_log_filename = NULL,
+    .stats_shm = NULL,
+    .stats_shm_interval_ms = 100,
+    .worker_processes = 0,
     .syslog = 1};
 
 void init_empty_global_configuration(struct state_conf *c)
 {
-	memset(c->source_ip_addresses, 0, sizeof(c->source_ip_addresses));
+	c->source_ip_addresses = NULL;
+	c->number_source_ips = 0;
 }
 
 // global sender stats and defaults
@@ -89,22 +152,18 @@ struct state_send zsend = {
     .complete = 0,
     .sendto_failures = 0,
     .max_targets = 0,
-    .list_of_ips_pbm = NULL,
+    .list_of_ips = NULL,
+    .index_targets = 0,
+    .delta_prior = NULL,
+    .delta_prior_count = 0,
+    .delta_prior_set = NULL,
+    .planned_targets = 0,
 };
 
 // global receiver stats and defaults
 struct state_recv zrecv = {
-    .success_unique = 0,
-    .success_total = 0,
-    .app_success_unique = 0,
-    .app_success_total = 0,
-    .validation_passed = 0,
-    .validation_failed = 0,
-    .cooldown_unique = 0,
-    .cooldown_total = 0,
-    .failure_total = 0,
+    .stats = {0},
     .filter_success = 0,
-    .ip_fragments = 0,
     .complete = 0,
     .pcap_recv = 0,
     .pcap_drop = 0,
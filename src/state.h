@@ -13,9 +13,12 @@
 #include <stdint.h>
 
 #include "../lib/includes.h"
+#include "../lib/cbm.h"
 
 #ifdef PFRING
 #include <pfring_zc.h>
+// packets each receive thread takes off its queue at a time
+#define PF_RECV_BURST 32
 #endif
 
 #include "aesrand.h"
@@ -25,6 +28,26 @@
 
 #define MAC_ADDR_LEN_BYTES 6
 
+// -i may be given this many times
+#define MAX_IFACES 8
+
+// Defaults that -DWITH_LOW_MEMORY trades down, for hosts with 256 MB or
+// so: there a scan with the defaults stays under LOW_MEMORY_PEAK_BYTES of
+// resident memory, which the benchmark suite checks its own peak against
+#define LOW_MEMORY_PEAK_BYTES (96ull << 20)
+#ifdef LOW_MEMORY
+#define DEFAULT_BATCH 8
+// window deduplication for a single port too
+#define DEFAULT_DEDUP_WINDOW 1
+#define DEFAULT_DEDUP_WINDOW_SIZE 65536
+#define DEFAULT_COMPRESSED_BITMAP 1
+#else
+#define DEFAULT_BATCH 64
+#define DEFAULT_DEDUP_WINDOW 0
+#define DEFAULT_DEDUP_WINDOW_SIZE 1000000
+#define DEFAULT_COMPRESSED_BITMAP 0
+#endif
+
 #define DEDUP_METHOD_DEFAULT 0
 #define DEDUP_METHOD_NONE 1
 #define DEDUP_METHOD_FULL 2
@@ -32,8 +55,65 @@
 
 extern const char *const DEDUP_METHOD_NAMES[];
 
+// how validate.c keys its validations, see validate.h
+#define VALIDATION_METHOD_AUTO 0
+#define VALIDATION_METHOD_AES 1
+#define VALIDATION_METHOD_SIPHASH 2
+
+extern const char *const VALIDATION_METHOD_NAMES[];
+
+#define SEND_METHOD_SENDMMSG 0
+#define SEND_METHOD_TX_RING 1
+#define SEND_METHOD_IO_URING 2
+#define SEND_METHOD_IO_URING_SQPOLL 3
+
+extern const char *const SEND_METHOD_NAMES[];
+
+#define PACING_USERSPACE 0
+#define PACING_TXTIME 1
+#define PACING_TXTIME_TAI 2
+
+extern const char *const PACING_NAMES[];
+
+// --dryrun prints every packet, --null-dryrun builds and discards them
+#define DRYRUN_OFF 0
+#define DRYRUN_PRINT 1
+#define DRYRUN_NULL 2
+
+#define RECV_METHOD_PCAP 0
+#define RECV_METHOD_TPACKET_V3 1
+
+extern const char *const RECV_METHOD_NAMES[];
+
+#define TIMESTAMPS_SOFTWARE 0
+#define TIMESTAMPS_HARDWARE 1
+
+extern const char *const TIMESTAMPS_NAMES[];
+
+#define RECV_FANOUT_HASH 0
+#define RECV_FANOUT_CPU 1
+
+extern const char *const RECV_FANOUT_NAMES[];
+
+// what happens to a result when the output thread is a full queue behind
+#define OUTPUT_BACKPRESSURE_BLOCK 0
+#define OUTPUT_BACKPRESSURE_DROP 1
+#define OUTPUT_BACKPRESSURE_SPILL 2
+
+extern const char *const OUTPUT_BACKPRESSURE_NAMES[];
+
+// --output-compression, support for each is optional at build time
+#define OUTPUT_COMPRESSION_NONE 0
+#define OUTPUT_COMPRESSION_ZSTD 1
+#define OUTPUT_COMPRESSION_LZ4 2
+
+extern const char *const OUTPUT_COMPRESSION_NAMES[];
+
 struct probe_module;
+struct extra_probe;
 struct output_module;
+struct xdp_queue;
+struct rte_mempool;
 
 struct fieldset_conf {
 	fielddefset_t defs;
@@ -42,9 +122,28 @@ struct fieldset_conf {
 	int success_index;
 	int app_success_index;
 	int classification_index;
+	// the probe module's rtt_us field, -1 if it has none
+	int rtt_index;
 };
 
 // global configuration
+// One interface scanned through, with what is looked up for it. See
+// ifaces.h.
+struct iface_conf {
+	char *name;
+	macaddr_t hw_mac[MAC_ADDR_LEN_BYTES];
+	macaddr_t gw_mac[MAC_ADDR_LEN_BYTES];
+	uint32_t gw_ip;
+	// see parse_source_ips()
+	in_addr_t *source_ip_addresses;
+	uint32_t number_source_ips;
+	// link speed in Mbit/s, 0 if not known
+	uint32_t speed;
+	// send threads first_sender to first_sender + senders - 1
+	uint16_t first_sender;
+	uint16_t senders;
+};
+
 struct state_conf {
 	int log_level;
 	struct port_conf *ports;
@@ -56,6 +155,9 @@ struct state_conf {
 	// maximum number of packets that the scanner will send before
 	// terminating
 	uint64_t max_targets;
+	// --max-targets given as a fraction of an IPv6 target file, resolved
+	// once the file has been counted
+	double ipv6_max_targets_fraction;
 	// maximum number of seconds that scanner will run before terminating
 	uint32_t max_runtime;
 	// maximum number of results before terminating
@@ -71,15 +173,95 @@ struct state_conf {
 	// how many seconds after the termination of the sender will the
 	// receiver continue to process responses
 	int cooldown_secs;
+	// --adaptive-cooldown: end the cooldown early once responses arrive
+	// at less than this percentage of the rate they came in at during
+	// the scan, 0 to always wait cooldown_secs
+	float adaptive_cooldown;
+	// --end-when-answered: end the cooldown once every target sent has a
+	// unique success, or has been waited on for nearly every round trip
+	int end_when_answered;
+	// --adaptive-rate: the most packets per second the rate controller
+	// may go up to, 0 when the rate is fixed
+	int adaptive_rate;
 	// number of sending threads
-	uint8_t senders;
+	uint16_t senders;
+	// --target-threads: threads fetching the send threads' targets, 0 to
+	// have each send thread fetch its own, and how many groups of them
+	// each send thread may have waiting
+	uint16_t target_threads;
+	uint32_t target_ring_depth;
+	// --event-loop: the one send thread receives and monitors in between
+	// its batches, and no other thread is started for them
+	int event_loop;
+	// largest batch, and with a send rate the smallest one batches are
+	// sized down to from the rate and the cost of a send call
 	uint16_t batch;
+	uint16_t batch_min;
+	// with a send rate, how long a probe may wait in a partial batch,
+	// 0 to only send full ones
+	uint32_t batch_deadline_us;
+	// how a batch is handed to the kernel (Linux only)
+	int send_method;
+	// make_packet leaves L4 checksums to the NIC (--checksum-offload)
+	int csum_offload;
+	// whether send threads wait for the rate limiter themselves or
+	// leave spacing packets to the qdisc via SO_TXTIME
+	int pacing;
+	// how responses are captured (Linux pcap build only)
+	int recv_method;
+	// who stamps responses, and with tx_timestamps probes, see
+	// timestamps.h
+	int timestamps;
+	int tx_timestamps;
+	// number of capture threads, joined in a PACKET_FANOUT group
+	uint8_t recv_threads;
+	// --capture-buffer: MB of kernel buffer or ring per capture handle, 0
+	// to size it from the rate and the responses expected per probe
+	uint32_t capture_buffer_mb;
+	double expected_hitrate;
+	int recv_fanout;
+	// --rss-queues: source ports are picked so that the NIC's RSS hash
+	// spreads responses across its RX queues, see rss.h
+	struct {
+		// 0 when source ports are not picked for RSS
+		uint16_t queues;
+		uint16_t table_size;
+		char *key;
+		char *steer;
+		// source ports tried per probe, response ports are checked
+		// against all of them
+		int candidates;
+	} rss;
+	// threads running the probe module's response processing, fed by the
+	// capture threads; 0 processes each frame on its capture thread
+	uint8_t recv_processing_threads;
+	// results queued for the output thread, 0 outputs each one from the
+	// receive path
+	uint32_t output_queue_size;
+	int output_backpressure;
+	// applied by the output buffer, so by every module writing through it
+	int output_compression;
+	int output_compression_level;
+	// a new output segment once any of these is reached, 0 for no limit
+	uint64_t output_rotate_records;
+	uint64_t output_rotate_bytes;
+	uint64_t output_rotate_secs;
+	// threads finishing rotated segments
+	uint8_t output_writers;
+	char *output_manifest;
 	uint32_t pin_cores_len;
 	uint32_t *pin_cores;
+	// of the interface, -1 if not known (see numa.h)
+	int numa_node;
 	// should use CLI provided randomization seed instead of generating
 	// a random seed.
 	int seed_provided;
 	uint64_t seed;
+	// --checkpoint-file, written every checkpoint_interval seconds, and
+	// --resume to start from it
+	char *checkpoint_filename;
+	int checkpoint_interval;
+	int resume;
 	aesrand_t *aes;
 	// generator of the cyclic multiplicative group that is utilized for
 	// address generation
@@ -87,11 +269,21 @@ struct state_conf {
 	// sharding options
 	uint16_t shard_num;
 	uint16_t total_shards;
+	// --coordinator host:port handing out leases in place of shards
+	char *coordinator;
 	int packet_streams;
+	// --probe-spacing: milliseconds between the probes to a target, 0
+	// to send them back to back
+	int probe_spacing;
 	struct probe_module *probe_module;
 	char *output_module_name;
 	struct output_module *output_module;
 	char *probe_args;
+	// --extra-probe-module, see extra_probes.h
+	struct extra_probe *extra_probes;
+	int num_extra_probes;
+	// --tcp-payload as given, see probe_modules/tcp_followup.h
+	char *tcp_payload;
 	uint8_t probe_ttl;
 	char *output_args;
 	macaddr_t gw_mac[MAC_ADDR_LEN_BYTES];
@@ -99,14 +291,46 @@ struct state_conf {
 	uint32_t gw_ip;
 	int gw_mac_set;
 	int hw_mac_set;
-	in_addr_t source_ip_addresses[256];
+	// -S, up to MAX_SOURCE_IPS (see utility.h)
+	in_addr_t *source_ip_addresses;
 	uint32_t number_source_ips;
+	// every -i; the first is also the one in iface, gw_mac, hw_mac and
+	// source_ip_addresses
+	struct iface_conf ifaces[MAX_IFACES];
+	uint8_t num_ifaces;
 	int send_ip_pkts;
 	char *output_filename;
 	char *blocklist_filename;
 	char *allowlist_filename;
+	char *blocklist_cache_filename;
+	// --loose-capture-filter: only the probe modules' capture filters,
+	// not narrowed to the scan's source addresses and ports
+	int loose_capture_filter;
+	// --xdp-filter: the XDP pre-filter, loaded from xdp_filter_object
+	int xdp_filter;
+	char *xdp_filter_object;
+	// --network-cache, read while younger than network_cache_ttl seconds
+	char *network_cache_filename;
+	int network_cache_ttl;
 	char *list_of_ips_filename;
 	uint32_t list_of_ips_count;
+	// --list-of-ips-file=-: read from stdin as the scan goes, see
+	// ipv4_target_stream.h
+	int list_of_ips_stream;
+	// --delta-from, and how much of the rest of the space to scan and how
+	// fast once its hosts are done (0 if no slower)
+	char *delta_filename;
+	float delta_sample;
+	int delta_rate;
+	// --sample: the fraction of each stratum, the strata's prefix length
+	// and the confidence interval to stop at (percentage points, 0 if none)
+	float sample_fraction;
+	int sample_prefix;
+	// --prefix-shaping, and the prefix to AS file it may group by (see
+	// shaping.h)
+	int prefix_shaping;
+	char *prefix_shaping_asn_file;
+	float sample_precision;
 	char *metadata_filename;
 	FILE *metadata_file;
 	char *notes;
@@ -122,8 +346,30 @@ struct state_conf {
 	char *log_file;
 	char *log_directory;
 	char *status_updates_file;
+	// --drop-log: where drop_events.c writes what was dropped where
+	char *drop_log_filename;
 	int dryrun;
+	// --replay-pcap: responses come from this capture instead of a scan
+	char *replay_filename;
+	char *validation_key_filename;
+	char *save_validation_key_filename;
+	// --capture-only: validated frames go to this file as they are, see
+	// capture_file.h
+	char *capture_only_filename;
+	uint64_t capture_only_max_bytes;
+	// --validation-method, AES or SipHash once validate.c has chosen
+	int validation_method;
 	int quiet;
+	int stage_timing;
+	// --metrics-port, 0 when not serving metrics
+	uint16_t metrics_port;
+	char *metrics_address;
+	// --stats-shm, the name of the shared memory stats segment or NULL,
+	// and how often its thread counters are refreshed
+	char *stats_shm;
+	uint32_t stats_shm_interval_ms;
+	// --worker-processes, 0 to scan in this process (see workers.h)
+	uint32_t worker_processes;
 	int ignore_invalid_hosts;
 	int syslog;
 	int recv_ready;
@@ -133,19 +379,41 @@ struct state_conf {
 	int max_sendto_failures;
 	float min_hitrate;
 	char *ipv6_source_ip;
+	// parsed from it, see ipv6_source.h; a length of 128 is one address
+	struct in6_addr ipv6_src_base;
+	uint8_t ipv6_src_prefix_len;
 	char *ipv6_target_filename;
+	// --ipv6-target-pattern and --ipv6-target-prefixes, see ipv6_pattern.h
+	char **ipv6_target_patterns;
+	int ipv6_target_patterns_len;
+	char *ipv6_target_prefixes_filename;
+	// set when scanning IPv6 targets from either a file or patterns
+	int ipv6;
+	// --ipv6-alias-detect and its parameters, see ipv6_alias.h
+	int ipv6_alias_detect;
+	uint8_t ipv6_alias_prefix_len;
+	uint32_t ipv6_alias_threshold;
+	uint32_t ipv6_alias_tests;
 	int data_link_size;
 	// added by pqm
 	int dnsippadding;
+	// log the payload of every nth DNS probe, 0 for none
+	uint32_t dns_log_payloads;
 	int default_mode;
 	int no_header_row;
 	int dedup_method;
 	int dedup_window_size;
+	// --dedup-window-time: seconds the window holds responses for, 0 to
+	// hold dedup_window_size of them instead
+	double dedup_window_time;
+	int flat_bitmap;
+	int compressed_bitmap;
 #ifdef PFRING
 	struct {
 		pfring_zc_cluster *cluster;
 		pfring_zc_queue *send;
-		pfring_zc_queue *recv;
+		// one RX queue of the NIC per receive thread
+		pfring_zc_queue **recv;
 		pfring_zc_queue **queues;
 		pfring_zc_pkt_buff **buffers;
 		pfring_zc_buffer_pool *prefetches;
@@ -159,6 +427,25 @@ struct state_conf {
 		uint32_t wait_ping_dstip;
 	} nm;
 #endif
+#ifdef XDP
+	struct {
+		uint32_t num_queues;
+		struct xdp_queue *queues;
+	} xdp;
+#endif
+#ifdef DPDK
+	struct {
+		// --dpdk-args, split on spaces
+		char *eal_args;
+		uint16_t port_id;
+		uint16_t max_rx_queues;
+		uint16_t max_tx_queues;
+		uint16_t rx_descs;
+		uint16_t tx_descs;
+		struct rte_mempool *rx_pool;
+		struct rte_mempool *tx_pool;
+	} dpdk;
+#endif
 };
 extern struct state_conf zconf;
 
@@ -174,19 +461,46 @@ struct state_send {
 	int complete;
 	uint32_t first_scanned;
 	uint64_t max_targets;
-	uint32_t sendto_failures;
-	uint32_t max_index;
+	uint64_t sendto_failures;
+	// held --probe-spacing probes left out as their target had responded
+	uint64_t retransmits_skipped;
+	// targets left out as --ipv6-alias-detect found their prefix aliased
+	uint64_t aliased_skipped;
+	// IPv6 targets the allowlist and blocklist left out as they were sent
+	uint64_t ipv6_blocklisted;
+	uint64_t max_index;
 	uint16_t max_port_index;
-	uint8_t **list_of_ips_pbm;
+	// sorted, allowed addresses (network order) of --list-of-ips-file
+	uint32_t *list_of_ips;
+	// shards yield raw indices into the IPv6 target file, or addresses
+	// from list_of_ips, rather than addresses looked up in the blocklist
+	int index_targets;
+	// --delta-from: its allowed hosts, sorted as list_of_ips are, and the
+	// same as a set of host order addresses, for the senders to leave out
+	// of the rest of the space and receivers to tell the strata apart
+	uint32_t *delta_prior;
+	uint32_t delta_prior_count;
+	cbm_t *delta_prior_set;
+	// the targets the --delta-from strata or --sample add up to, for the
+	// time left
+	uint64_t planned_targets;
 };
 extern struct state_send zsend;
 
+// log2 buckets of round-trip times in microseconds, up to 2^26 (67s)
+#define RTT_BUCKETS 27
+
 // global receiver stats
-struct state_recv {
+// What the receive side counts about responses. Each thread that emits
+// results counts into a block of its own, which nothing else writes, and
+// recv_stats_snapshot() sums the blocks.
+struct recv_stats {
 	// valid responses classified as "success"
 	uint64_t success_total;
 	// unique IPs that sent valid responses classified as "success"
 	uint64_t success_unique;
+	// of those, the ones in --delta-from's prior stratum
+	uint64_t success_unique_prior;
 	// valid responses classified as "success"
 	uint64_t app_success_total;
 	// unique IPs that sent valid responses classified as "success"
@@ -197,18 +511,34 @@ struct state_recv {
 	uint64_t cooldown_unique;
 	// valid responses NOT classified as "success"
 	uint64_t failure_total;
-	// valid responses that passed the filter
-	uint64_t filter_success;
 	// how many packets did we receive that were marked as being the first
 	// fragment in a stream
-	uint32_t ip_fragments;
+	uint64_t ip_fragments;
 	// metrics about _only_ validate_packet
 	uint64_t validation_passed;
 	uint64_t validation_failed;
+	// round-trip times of the unique successes whose probe module could
+	// recover one (its rtt_us field): bucket i holds those of [2^i,
+	// 2^(i+1)) microseconds, the first also 0 and the last anything longer
+	uint64_t rtt_samples;
+	uint64_t rtt_sum_us;
+	uint64_t rtt_buckets[RTT_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct state_recv {
+	// the sum of the threads' counts once receiving has finished; the
+	// copies given to output modules' update() hold a fresh snapshot
+	struct recv_stats stats;
+	// valid responses that passed the filter. One counter for all
+	// threads, so that --max-results stays a single relaxed load: only
+	// the thread emitting a result (one at a time) writes it.
+	uint64_t filter_success;
 
 	int complete;  // has the scanner finished sending?
 	double start;  // timestamp of when recv started
 	double finish; // timestamp of when recv terminated
+	// how long receiving went on after sending finished
+	double cooldown_used;
 
 	// number of packets captured by pcap filter
 	uint64_t pcap_recv;
@@ -218,12 +548,29 @@ struct state_recv {
 	uint64_t pcap_drop;
 	// number of packets dropped by the network interface or its driver.
 	uint64_t pcap_ifdrop;
+	// frames the interfaces received while capturing, 0 if not known; of
+	// those, all but pcap_recv were left out by the capture filter
+	uint64_t iface_rx;
+	// number of captured packets dropped because every processing
+	// thread's ring was full (--recv-processing-threads)
+	uint64_t pipeline_drops;
+	// results dropped, or written to the spill file, because the output
+	// thread's queue was full (--output-backpressure)
+	uint64_t output_drops;
+	uint64_t output_spilled;
+	// the XDP pre-filter's verdicts (--xdp-filter): left to the host,
+	// handed to zmap, and dropped as repeated SYN-ACKs
+	uint64_t xdp_other;
+	uint64_t xdp_scan;
+	uint64_t xdp_duplicates;
 };
 extern struct state_recv zrecv;
 
 struct port_conf {
 	uint port_count;
-	uint16_t ports[0xFFFF + 1];
+	// the port_count ports, grown as they are parsed
+	uint16_t *ports;
+	uint port_cap;
 	uint8_t *port_bitmap;
 };
 
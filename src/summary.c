@@ -17,10 +17,29 @@
 
 #include "../lib/includes.h"
 #include "../lib/logger.h"
+#include "../lib/aes128.h"
 #include "../lib/blocklist.h"
+#include "../lib/cpu.h"
+#include "../lib/util.h"
+#include "../lib/xalloc.h"
 
+#include "capture_file.h"
+#include "drop_events.h"
+#include "extra_probes.h"
+#include "ipv4_target_stream.h"
+#include "ipv6_alias.h"
+#include "lease.h"
+#include "rate_control.h"
+#include "recv.h"
+#include "sample.h"
+#include "shaping.h"
+#include "stage_timing.h"
 #include "state.h"
+#include "validate.h"
+#include "workers.h"
+#include "probe_modules/packet.h"
 #include "probe_modules/probe_modules.h"
+#include "probe_modules/tcp_followup.h"
 #include "output_modules/output_modules.h"
 
 #define STRTIME_LEN 1024
@@ -41,7 +60,9 @@ void json_metadata(FILE *file)
 	char recv_end_time[STRTIME_LEN + 1];
 	assert(dstrftime(recv_end_time, STRTIME_LEN, "%Y-%m-%dT%H:%M:%S%z",
 			 zrecv.finish));
-	double hitrate = ((double)100 * zrecv.success_unique) /
+	struct recv_stats rs;
+	recv_stats_snapshot(&rs);
+	double hitrate = ((double)100 * rs.success_unique) /
 			 ((double)zsend.targets_scanned);
 
 	json_object *obj = json_object_new_object();
@@ -87,19 +108,156 @@ void json_metadata(FILE *file)
 	json_object_object_add(obj, "max_results",
 			       json_object_new_int(zconf.max_results));
 	json_object_object_add(obj, "output_results",
-			       json_object_new_int(zrecv.filter_success));
+			       json_object_new_int64(zrecv.filter_success));
 	if (zconf.iface) {
 		json_object_object_add(obj, "iface",
 				       json_object_new_string(zconf.iface));
 	}
 	json_object_object_add(obj, "rate", json_object_new_int(zconf.rate));
+	if (zconf.coordinator) {
+		json_object_object_add(obj, "coordinator",
+				       json_object_new_string(zconf.coordinator));
+		if (lease_rate_budget()) {
+			json_object_object_add(
+			    obj, "coordinator_rate_budget",
+			    json_object_new_int64((int64_t)lease_rate_budget()));
+		}
+	}
+	if (zconf.adaptive_rate) {
+		json_object_object_add(obj, "adaptive_rate_max",
+				       json_object_new_int(zconf.adaptive_rate));
+		json_object_object_add(
+		    obj, "adaptive_rate_decreases",
+		    json_object_new_int64(rate_control_decreases()));
+	}
 	json_object_object_add(obj, "bandwidth",
 			       json_object_new_int(zconf.bandwidth));
 	json_object_object_add(obj, "cooldown_secs",
 			       json_object_new_int(zconf.cooldown_secs));
+	json_object_object_add(obj, "adaptive_cooldown",
+			       json_object_new_double(zconf.adaptive_cooldown));
+	json_object_object_add(obj, "end_when_answered",
+			       json_object_new_boolean(zconf.end_when_answered));
+	json_object_object_add(obj, "cooldown_used_secs",
+			       json_object_new_double(zrecv.cooldown_used));
 	json_object_object_add(obj, "senders",
 			       json_object_new_int(zconf.senders));
+	json_object_object_add(obj, "target_threads",
+			       json_object_new_int(zconf.target_threads));
+	json_object_object_add(obj, "event_loop",
+			       json_object_new_boolean(zconf.event_loop));
+	json_object_object_add(
+	    obj, "send_method",
+	    json_object_new_string(SEND_METHOD_NAMES[zconf.send_method]));
+	json_object_object_add(
+	    obj, "pacing",
+	    json_object_new_string(PACING_NAMES[zconf.pacing]));
+	json_object_object_add(
+	    obj, "recv_method",
+	    json_object_new_string(RECV_METHOD_NAMES[zconf.recv_method]));
+	json_object_object_add(
+	    obj, "timestamps",
+	    json_object_new_string(TIMESTAMPS_NAMES[zconf.timestamps]));
+	json_object_object_add(obj, "tx_timestamps",
+			       json_object_new_boolean(zconf.tx_timestamps));
+	json_object_object_add(obj, "recv_threads",
+			       json_object_new_int(zconf.recv_threads));
+	json_object_object_add(
+	    obj, "capture_buffer_bytes",
+	    json_object_new_int64((int64_t)recv_capture_buffer_bytes()));
+	json_object_object_add(obj, "expected_hitrate",
+			       json_object_new_double(zconf.expected_hitrate));
+	if (zconf.drop_log_filename) {
+		json_object_object_add(
+		    obj, "drop_log",
+		    json_object_new_string(zconf.drop_log_filename));
+	}
+	json_object *drop_stages = json_object_new_object();
+	for (int i = 0; i < NUM_DROP_STAGES; i++) {
+		json_object_object_add(
+		    drop_stages, DROP_STAGE_NAMES[i],
+		    json_object_new_int64(
+			(int64_t)drop_events_count((enum drop_stage)i)));
+	}
+	json_object_object_add(obj, "drop_events", drop_stages);
+	if (zconf.capture_only_filename) {
+		json_object *capture = json_object_new_object();
+		json_object_object_add(
+		    capture, "file",
+		    json_object_new_string(zconf.capture_only_filename));
+		json_object_object_add(
+		    capture, "validation_key",
+		    json_object_new_string(zconf.save_validation_key_filename));
+		json_object_object_add(
+		    capture, "frames",
+		    json_object_new_int64((int64_t)capture_file_frames()));
+		json_object_object_add(
+		    capture, "bytes",
+		    json_object_new_int64((int64_t)capture_file_bytes()));
+		json_object_object_add(
+		    capture, "dropped",
+		    json_object_new_int64((int64_t)capture_file_dropped()));
+		json_object_object_add(obj, "capture_only", capture);
+	}
+	json_object_object_add(
+	    obj, "recv_processing_threads",
+	    json_object_new_int(zconf.recv_processing_threads));
+	json_object_object_add(
+	    obj, "recv_fanout",
+	    json_object_new_string(RECV_FANOUT_NAMES[zconf.recv_fanout]));
+	json_object_object_add(
+	    obj, "output_compression",
+	    json_object_new_string(
+		OUTPUT_COMPRESSION_NAMES[zconf.output_compression]));
+	if (zconf.output_compression != OUTPUT_COMPRESSION_NONE) {
+		json_object_object_add(
+		    obj, "output_compression_level",
+		    json_object_new_int(zconf.output_compression_level));
+	}
+	if (zconf.output_rotate_records) {
+		json_object_object_add(
+		    obj, "output_rotate_records",
+		    json_object_new_int64((int64_t)zconf.output_rotate_records));
+	}
+	if (zconf.output_rotate_bytes) {
+		json_object_object_add(
+		    obj, "output_rotate_bytes",
+		    json_object_new_int64((int64_t)zconf.output_rotate_bytes));
+	}
+	if (zconf.output_rotate_secs) {
+		json_object_object_add(
+		    obj, "output_rotate_seconds",
+		    json_object_new_int64((int64_t)zconf.output_rotate_secs));
+	}
+	if (zconf.output_manifest) {
+		json_object_object_add(
+		    obj, "output_manifest",
+		    json_object_new_string(zconf.output_manifest));
+	}
+	json_object_object_add(obj, "output_queue_size",
+			       json_object_new_int(zconf.output_queue_size));
+	json_object_object_add(
+	    obj, "output_backpressure",
+	    json_object_new_string(
+		OUTPUT_BACKPRESSURE_NAMES[zconf.output_backpressure]));
 	json_object_object_add(obj, "seed", json_object_new_int64(zconf.seed));
+	json_object_object_add(obj, "validation_method",
+			       json_object_new_string(validate_method_name()));
+	char features[128];
+	cpu_features_str(cpu_detected(), features, sizeof(features));
+	json_object_object_add(obj, "cpu_features",
+			       json_object_new_string(features));
+	cpu_features_str(cpu_features(), features, sizeof(features));
+	json_object_object_add(obj, "cpu_features_used",
+			       json_object_new_string(features));
+	json_object *kernels = json_object_new_object();
+	json_object_object_add(kernels, "aes128",
+			       json_object_new_string(aes128_impl()));
+	json_object_object_add(kernels, "checksum",
+			       json_object_new_string(checksum_impl()));
+	json_object_object_add(kernels, "hex_encode",
+			       json_object_new_string(hex_encode_impl()));
+	json_object_object_add(obj, "cpu_kernels", kernels);
 	json_object_object_add(obj, "seed_provided",
 			       json_object_new_int64(zconf.seed_provided));
 	json_object_object_add(obj, "generator",
@@ -109,6 +267,10 @@ void json_metadata(FILE *file)
 			       json_object_new_int(zconf.shard_num));
 	json_object_object_add(obj, "total_shards",
 			       json_object_new_int(zconf.total_shards));
+	json_object_object_add(obj, "worker_processes",
+			       json_object_new_int(zconf.worker_processes));
+	json_object_object_add(obj, "workers_failed",
+			       json_object_new_int(workers_failed()));
 
 	json_object_object_add(obj, "min_hitrate",
 			       json_object_new_double(zconf.min_hitrate));
@@ -123,19 +285,40 @@ void json_metadata(FILE *file)
 			       json_object_new_int(zrecv.pcap_recv));
 	json_object_object_add(obj, "pcap_drop",
 			       json_object_new_int(zrecv.pcap_drop));
+	if (zrecv.iface_rx) {
+		json_object_object_add(obj, "iface_rx",
+				       json_object_new_int64(zrecv.iface_rx));
+	}
 	json_object_object_add(obj, "pcap_ifdrop",
 			       json_object_new_int(zrecv.pcap_ifdrop));
+	json_object_object_add(obj, "pipeline_drops",
+			       json_object_new_int(zrecv.pipeline_drops));
+	json_object_object_add(obj, "output_drops",
+			       json_object_new_int(zrecv.output_drops));
+	json_object_object_add(obj, "output_spilled",
+			       json_object_new_int(zrecv.output_spilled));
+	if (zconf.xdp_filter) {
+		json_object *xdp = json_object_new_object();
+		json_object_object_add(xdp, "other",
+				       json_object_new_int64(zrecv.xdp_other));
+		json_object_object_add(xdp, "scan",
+				       json_object_new_int64(zrecv.xdp_scan));
+		json_object_object_add(
+		    xdp, "duplicates",
+		    json_object_new_int64(zrecv.xdp_duplicates));
+		json_object_object_add(obj, "xdp_filter", xdp);
+	}
 
 	json_object_object_add(obj, "ip_fragments",
-			       json_object_new_int(zrecv.ip_fragments));
+			       json_object_new_int64(rs.ip_fragments));
 	json_object_object_add(obj, "blocklist_total_allowed",
 			       json_object_new_int64(zconf.total_allowed));
 	json_object_object_add(obj, "blocklist_total_not_allowed",
 			       json_object_new_int64(zconf.total_disallowed));
 	json_object_object_add(obj, "validation_passed",
-			       json_object_new_int(zrecv.validation_passed));
+			       json_object_new_int64(rs.validation_passed));
 	json_object_object_add(obj, "validation_failed",
-			       json_object_new_int(zrecv.validation_failed));
+			       json_object_new_int64(rs.validation_failed));
 
 	//	json_object_object_add(obj, "blocklisted",
 	//            json_object_new_int64(zsend.blocklisted));
@@ -147,29 +330,220 @@ void json_metadata(FILE *file)
 			       json_object_new_int64(zsend.sendto_failures));
 	json_object_object_add(obj, "packets_sent",
 			       json_object_new_int64(zsend.packets_sent));
+	json_object_object_add(obj, "retransmits_skipped",
+			       json_object_new_int64(zsend.retransmits_skipped));
+	if (zconf.ipv6) {
+		json_object_object_add(
+		    obj, "ipv6_blocklisted",
+		    json_object_new_int64(zsend.ipv6_blocklisted));
+	}
+	if (zconf.ipv6_alias_detect) {
+		// the aliased prefixes found, and the targets left out of them
+		json_object *alias = json_object_new_object();
+		json_object_object_add(
+		    alias, "prefix_len",
+		    json_object_new_int(zconf.ipv6_alias_prefix_len));
+		json_object_object_add(
+		    alias, "threshold",
+		    json_object_new_int64(zconf.ipv6_alias_threshold));
+		json_object_object_add(alias, "tests",
+				       json_object_new_int64(zconf.ipv6_alias_tests));
+		json_object_object_add(alias, "targets_skipped",
+				       json_object_new_int64(zsend.aliased_skipped));
+		json_object *prefixes = json_object_new_array();
+		uint32_t n = ipv6_alias_count();
+		for (uint32_t i = 0; i < n; i++) {
+			struct in6_addr prefix;
+			char buf[INET6_ADDRSTRLEN + 4];
+			ipv6_alias_get(i, &prefix);
+			inet_ntop(AF_INET6, &prefix, buf, INET6_ADDRSTRLEN);
+			snprintf(buf + strlen(buf), 5, "/%u",
+				 zconf.ipv6_alias_prefix_len);
+			json_object_array_add(prefixes,
+					      json_object_new_string(buf));
+		}
+		json_object_object_add(alias, "prefixes", prefixes);
+		json_object_object_add(obj, "ipv6_aliases", alias);
+	}
+	if (tcp_followup_enabled()) {
+		json_object *followup = json_object_new_object();
+		json_object_object_add(
+		    followup, "payload_len",
+		    json_object_new_int64(tcp_followup_payload_len()));
+		json_object_object_add(followup, "sent",
+				       json_object_new_int64(tcp_followup_sent()));
+		json_object_object_add(
+		    followup, "data_segments",
+		    json_object_new_int64(tcp_followup_data_segments()));
+		json_object_object_add(obj, "tcp_followup", followup);
+	}
 	json_object_object_add(obj, "targets_scanned",
 			       json_object_new_int64(zsend.targets_scanned));
 	json_object_object_add(obj, "success_total",
-			       json_object_new_int64(zrecv.success_total));
+			       json_object_new_int64(rs.success_total));
 	json_object_object_add(obj, "success_unique",
-			       json_object_new_int64(zrecv.success_unique));
+			       json_object_new_int64(rs.success_unique));
 	if (zconf.fsconf.app_success_index >= 0) {
 		json_object_object_add(
 		    obj, "app_success_total",
-		    json_object_new_int64(zrecv.app_success_total));
+		    json_object_new_int64(rs.app_success_total));
 		json_object_object_add(
 		    obj, "app_success_unique",
-		    json_object_new_int64(zrecv.app_success_unique));
+		    json_object_new_int64(rs.app_success_unique));
 	}
 	json_object_object_add(obj, "success_cooldown_total",
-			       json_object_new_int64(zrecv.cooldown_total));
+			       json_object_new_int64(rs.cooldown_total));
 	json_object_object_add(obj, "success_cooldown_unique",
-			       json_object_new_int64(zrecv.cooldown_unique));
+			       json_object_new_int64(rs.cooldown_unique));
 	json_object_object_add(obj, "failure_total",
-			       json_object_new_int64(zrecv.failure_total));
+			       json_object_new_int64(rs.failure_total));
+	if (zconf.delta_filename) {
+		// the unique successes of each stratum, see the stratum field
+		json_object *delta = json_object_new_object();
+		json_object_object_add(
+		    delta, "from", json_object_new_string(zconf.delta_filename));
+		json_object_object_add(delta, "sample",
+				       json_object_new_double(zconf.delta_sample));
+		json_object_object_add(delta, "rate",
+				       json_object_new_int(zconf.delta_rate));
+		json_object_object_add(
+		    delta, "prior_hosts",
+		    json_object_new_int64(zsend.delta_prior_count));
+		json_object_object_add(
+		    delta, "prior_success_unique",
+		    json_object_new_int64(rs.success_unique_prior));
+		json_object_object_add(
+		    delta, "rest_success_unique",
+		    json_object_new_int64(rs.success_unique -
+					  rs.success_unique_prior));
+		json_object_object_add(obj, "delta", delta);
+	}
+	if (zshaping.probed) {
+		json_object *shaping = json_object_new_object();
+		json_object_object_add(
+		    shaping, "asn_file",
+		    zconf.prefix_shaping_asn_file
+			? json_object_new_string(zconf.prefix_shaping_asn_file)
+			: NULL);
+		json_object_object_add(shaping, "groups",
+				       json_object_new_int64(zshaping.num_groups));
+		json_object_object_add(shaping, "throttles",
+				       json_object_new_int64(zshaping.throttles));
+		json_object_object_add(
+		    shaping, "throttled_at_end",
+		    json_object_new_int64(shaping_throttled_now()));
+		json_object_object_add(shaping, "probes_deferred",
+				       json_object_new_int64(zshaping.deferred));
+		json_object_object_add(shaping, "probes_forced",
+				       json_object_new_int64(zshaping.forced));
+		json_object_object_add(obj, "prefix_shaping", shaping);
+	}
+	if (zsample.probed) {
+		sample_estimate_t e;
+		sample_estimate(&e);
+		json_object *sample = json_object_new_object();
+		json_object_object_add(
+		    sample, "fraction",
+		    json_object_new_double(zconf.sample_fraction));
+		json_object_object_add(sample, "strata_prefix",
+				       json_object_new_int(zconf.sample_prefix));
+		json_object_object_add(sample, "strata",
+				       json_object_new_int64(e.strata));
+		json_object_object_add(sample, "targets",
+				       json_object_new_int64(e.probed));
+		json_object_object_add(sample, "success_unique",
+				       json_object_new_int64(e.hits));
+		json_object_object_add(sample, "fraction_sent",
+				       json_object_new_double(e.fraction_sent));
+		json_object_object_add(sample, "estimate",
+				       json_object_new_double(e.estimate));
+		json_object_object_add(sample, "ci95_low",
+				       json_object_new_double(
+					   e.estimate > e.margin
+					       ? e.estimate - e.margin
+					       : 0));
+		json_object_object_add(sample, "ci95_high",
+				       json_object_new_double(
+					   e.estimate + e.margin < 1
+					       ? e.estimate + e.margin
+					       : 1));
+		json_object_object_add(
+		    sample, "precision",
+		    json_object_new_double(zconf.sample_precision));
+		json_object_object_add(sample, "stopped_early",
+				       json_object_new_boolean(sample_stopped()));
+		json_object_object_add(obj, "sample", sample);
+	}
+	if (zconf.fsconf.rtt_index >= 0) {
+		json_object *rtt = json_object_new_object();
+		json_object_object_add(rtt, "samples",
+				       json_object_new_int64(rs.rtt_samples));
+		json_object_object_add(
+		    rtt, "mean_us",
+		    json_object_new_double(
+			rs.rtt_samples ? (double)rs.rtt_sum_us / rs.rtt_samples
+				       : 0));
+		json_object_object_add(
+		    rtt, "p50_us",
+		    json_object_new_int64(recv_rtt_quantile(&rs, 0.5)));
+		json_object_object_add(
+		    rtt, "p90_us",
+		    json_object_new_int64(recv_rtt_quantile(&rs, 0.9)));
+		json_object_object_add(
+		    rtt, "p99_us",
+		    json_object_new_int64(recv_rtt_quantile(&rs, 0.99)));
+		// bucket i counts the times below 2^(i+1) microseconds that
+		// the bucket before does not
+		json_object *buckets = json_object_new_array();
+		for (int i = 0; i < RTT_BUCKETS; i++) {
+			json_object_array_add(
+			    buckets, json_object_new_int64(rs.rtt_buckets[i]));
+		}
+		json_object_object_add(rtt, "log2_us_buckets", buckets);
+		json_object_object_add(obj, "rtt", rtt);
+	}
+	if (zconf.stage_timing) {
+		stage_counters_t totals[NUM_STAGES];
+		stage_timing_totals(totals);
+		json_object *stages = json_object_new_object();
+		json_object_object_add(stages, "tick_unit",
+				       json_object_new_string(STAGE_TICK_UNIT));
+		for (int i = 0; i < NUM_STAGES; i++) {
+			const stage_counters_t *t = &totals[i];
+			double per_event =
+			    t->sampled ? (double)t->ticks / t->sampled : 0;
+			json_object *stage = json_object_new_object();
+			json_object_object_add(stage, "events",
+					       json_object_new_int64(t->events));
+			json_object_object_add(stage, "sampled",
+					       json_object_new_int64(t->sampled));
+			json_object_object_add(stage, "ticks_per_event",
+					       json_object_new_double(per_event));
+			json_object_object_add(
+			    stage, "estimated_ticks",
+			    json_object_new_double(per_event * t->events));
+			json_object_object_add(stages, STAGE_NAMES[i], stage);
+		}
+		json_object_object_add(obj, "stage_timing", stages);
+	}
+	// bytes by subsystem, as held when the metadata is written and at
+	// most over the scan
+	json_object *memory = json_object_new_object();
+	for (int i = 0; i < MEM_TAGS; i++) {
+		uint64_t current, peak;
+		xalloc_usage(i, &current, &peak);
+		json_object *m = json_object_new_object();
+		json_object_object_add(m, "current",
+				       json_object_new_int64(current));
+		json_object_object_add(m, "peak", json_object_new_int64(peak));
+		json_object_object_add(memory, MEM_TAG_NAMES[i], m);
+	}
+	json_object_object_add(obj, "memory", memory);
 
 	json_object_object_add(obj, "packet_streams",
 			       json_object_new_int(zconf.packet_streams));
+	json_object_object_add(obj, "probe_spacing",
+			       json_object_new_int(zconf.probe_spacing));
 	json_object_object_add(
 	    obj, "probe_module",
 	    json_object_new_string(
@@ -218,6 +592,10 @@ void json_metadata(FILE *file)
 		    obj, "probe_args",
 		    json_object_new_string(zconf.probe_args));
 	}
+	if (zconf.num_extra_probes) {
+		json_object_object_add(obj, "extra_probes",
+				       extra_probes_json());
+	}
 	if (zconf.probe_ttl) {
 		json_object_object_add(obj, "probe_ttl",
 				       json_object_new_int(zconf.probe_ttl));
@@ -264,14 +642,40 @@ void json_metadata(FILE *file)
 		json_object_object_add(obj, "source_mac",
 				       json_object_new_string(mac_buf));
 	}
+	// large pools are only counted
+	json_object_object_add(obj, "source_ip_count",
+			       json_object_new_int64(zconf.number_source_ips));
 	json_object *source_ips = json_object_new_array();
-	for (uint i = 0; i < zconf.number_source_ips; i++) {
+	for (uint i = 0; i < zconf.number_source_ips && i < 256; i++) {
 		struct in_addr temp;
 		temp.s_addr = zconf.source_ip_addresses[i];
 		json_object_array_add(source_ips, json_object_new_string(
 						      strdup(inet_ntoa(temp))));
 	}
 	json_object_object_add(obj, "source_ips", source_ips);
+	if (zconf.num_ifaces > 1) {
+		json_object *ifaces = json_object_new_array();
+		for (uint8_t i = 0; i < zconf.num_ifaces; i++) {
+			const struct iface_conf *ifc = &zconf.ifaces[i];
+			json_object *o = json_object_new_object();
+			json_object_object_add(o, "name",
+					       json_object_new_string(ifc->name));
+			json_object_object_add(o, "link_speed_mbps",
+					       json_object_new_int64(ifc->speed));
+			json_object_object_add(o, "senders",
+					       json_object_new_int(ifc->senders));
+			json_object *ips = json_object_new_array();
+			for (uint32_t j = 0; j < ifc->number_source_ips; j++) {
+				struct in_addr temp;
+				temp.s_addr = ifc->source_ip_addresses[j];
+				json_object_array_add(
+				    ips, json_object_new_string(inet_ntoa(temp)));
+			}
+			json_object_object_add(o, "source_ips", ips);
+			json_object_array_add(ifaces, o);
+		}
+		json_object_object_add(obj, "interfaces", ifaces);
+	}
 	if (zconf.output_filename) {
 		json_object_object_add(
 		    obj, "output_filename",
@@ -291,9 +695,20 @@ void json_metadata(FILE *file)
 		json_object_object_add(
 		    obj, "list_of_ips_filename",
 		    json_object_new_string(zconf.list_of_ips_filename));
-		json_object_object_add(
-		    obj, "list_of_ips_count",
-		    json_object_new_int(zconf.list_of_ips_count));
+		if (zconf.list_of_ips_stream) {
+			json_object_object_add(
+			    obj, "list_of_ips_count",
+			    json_object_new_int64(
+				(int64_t)ipv4_target_stream_read()));
+			json_object_object_add(
+			    obj, "list_of_ips_blocklisted",
+			    json_object_new_int64(
+				(int64_t)ipv4_target_stream_blocked()));
+		} else {
+			json_object_object_add(
+			    obj, "list_of_ips_count",
+			    json_object_new_int(zconf.list_of_ips_count));
+		}
 	}
 	json_object_object_add(obj, "dryrun",
 			       json_object_new_int(zconf.dryrun));
@@ -304,7 +719,12 @@ void json_metadata(FILE *file)
 	json_object_object_add(
 	    obj, "deduplication_method",
 	    json_object_new_string(DEDUP_METHOD_NAMES[zconf.dedup_method]));
-	if (zconf.dedup_method == DEDUP_METHOD_WINDOW) {
+	if (zconf.dedup_method == DEDUP_METHOD_WINDOW &&
+	    zconf.dedup_window_time > 0) {
+		json_object_object_add(
+		    obj, "deduplication_window_time",
+		    json_object_new_double(zconf.dedup_window_time));
+	} else if (zconf.dedup_method == DEDUP_METHOD_WINDOW) {
 		json_object_object_add(
 		    obj, "deduplication_window_size",
 		    json_object_new_int(zconf.dedup_window_size));
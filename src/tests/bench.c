@@ -0,0 +1,740 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <sys/resource.h>
+
+#include "../lib/includes.h"
+#include "../lib/blocklist.h"
+#include "../lib/logger.h"
+#include "../lib/pbm.h"
+#include "../lib/util.h"
+#include "../lib/xalloc.h"
+
+#include "aesrand.h"
+#include "expression.h"
+#include "filter.h"
+#include "iterator.h"
+#include "ports.h"
+#include "recv-internal.h"
+#include "send.h"
+#include "shard.h"
+#include "state.h"
+#include "validate.h"
+
+#include "output_modules/output_modules.h"
+#include "probe_modules/packet.h"
+#include "probe_modules/probe_modules.h"
+
+#include "bench.h"
+
+// distinct targets the per-packet benchmarks cycle through, enough to
+// leave the caches guessing as a scan would
+#define BENCH_TARGETS 4096
+#define BENCH_BATCH 64
+// opt-out lists of large scanning projects run to tens of thousands of
+// prefixes, on top of the reserved ranges
+#define BENCH_BLOCKLIST_PREFIXES 50000
+#define BENCH_SRC_IP "192.0.2.1"
+#define BENCH_SRC_IPV6 "2001:db8::1"
+
+static const char *bench_only = NULL;
+static double bench_secs = 0.5;
+// results go here so that the compiler cannot drop the work
+static volatile uint64_t bench_sink;
+
+// does n operations, rounded up to a multiple of the benchmark's unit
+typedef uint64_t (*bench_fn)(uint64_t n);
+
+// Run fn with growing n until a run takes bench_secs, and report that run.
+static void bench_run(const char *name, const char *params, uint64_t unit,
+		      bench_fn fn)
+{
+	if (bench_only && !strstr(name, bench_only) &&
+	    !strstr(params, bench_only)) {
+		return;
+	}
+	uint64_t n = unit;
+	double elapsed;
+	for (;;) {
+		double start = now();
+		bench_sink += fn(n);
+		elapsed = now() - start;
+		if (elapsed >= bench_secs) {
+			break;
+		}
+		// aim a little past bench_secs, growing at most 100 fold
+		double scale = elapsed > 0 ? 1.2 * bench_secs / elapsed : 100;
+		n = (uint64_t)(n * (scale < 100 ? scale : 100));
+		n = (n + unit - 1) / unit * unit;
+	}
+	printf("{\"bench\":\"%s\",\"params\":\"%s\",\"ops\":%" PRIu64
+	       ",\"ns_per_op\":%.2f,\"ops_per_sec\":%.0f}\n",
+	       name, params, n, elapsed * 1e9 / n, n / elapsed);
+	fflush(stdout);
+}
+
+static uint64_t bench_prefixes;
+
+static void bench_blocklist_init(void)
+{
+	static const char *reserved[] = {
+	    "0.0.0.0/8",      "10.0.0.0/8",	"100.64.0.0/10",
+	    "127.0.0.0/8",    "169.254.0.0/16", "172.16.0.0/12",
+	    "192.0.0.0/24",   "192.0.2.0/24",	"192.88.99.0/24",
+	    "192.168.0.0/16", "198.18.0.0/15",	"198.51.100.0/24",
+	    "203.0.113.0/24", "240.0.0.0/4",	"255.255.255.255/32",
+	    "224.0.0.0/4"};
+	size_t n_reserved = sizeof(reserved) / sizeof(reserved[0]);
+	bench_prefixes = n_reserved + BENCH_BLOCKLIST_PREFIXES;
+	char **entries = xcalloc(bench_prefixes, sizeof(char *));
+	for (size_t i = 0; i < n_reserved; i++) {
+		entries[i] = strdup(reserved[i]);
+	}
+	aesrand_t *aes = aesrand_init_from_seed(2);
+	for (size_t i = n_reserved; i < bench_prefixes; i++) {
+		uint32_t ip = (uint32_t)aesrand_getword(aes);
+		// mostly small prefixes, as opt-out requests are
+		int len = 16 + (int)(aesrand_getword(aes) % 17);
+		struct in_addr a = {.s_addr = htonl(ip)};
+		char buf[32];
+		snprintf(buf, sizeof(buf), "%s/%d", inet_ntoa(a), len);
+		entries[i] = strdup(buf);
+	}
+	aesrand_free(aes);
+	if (blocklist_init(NULL, NULL, NULL, 0, entries, bench_prefixes, 0)) {
+		log_fatal("bench", "unable to initialize the blocklist");
+	}
+	for (size_t i = 0; i < bench_prefixes; i++) {
+		free(entries[i]);
+	}
+	free(entries);
+}
+
+static uint64_t bench_lookup_index(uint64_t n)
+{
+	uint64_t allowed = blocklist_count_allowed();
+	uint64_t sum = 0;
+	uint64_t x = 1;
+	for (uint64_t i = 0; i < n; i++) {
+		x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+		sum += blocklist_lookup_index((x >> 32) * allowed >> 32);
+	}
+	return sum;
+}
+
+static uint64_t bench_is_allowed(uint64_t n)
+{
+	uint64_t sum = 0;
+	uint32_t x = 1;
+	for (uint64_t i = 0; i < n; i++) {
+		x = x * 1664525u + 1013904223u;
+		sum += blocklist_is_allowed(x);
+	}
+	return sum;
+}
+
+static uint64_t shard_addrs;
+static iterator_t *shard_it;
+static shard_t *shard_cur;
+
+// a fresh walk of the group, the old one left behind as it is small
+static void shard_restart(void)
+{
+	shard_it = iterator_init(1, 0, 1, shard_addrs, zconf.ports->port_count);
+	shard_cur = get_shard(shard_it, 0);
+}
+
+static uint64_t bench_next_target(uint64_t n)
+{
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		target_t t = shard_get_next_target(shard_cur);
+		if (t.status == ZMAP_SHARD_DONE) {
+			shard_restart();
+			t = shard_get_cur_target(shard_cur);
+		}
+		sum += t.ip;
+	}
+	return sum;
+}
+
+static uint64_t bench_next_targets(uint64_t n)
+{
+	target_t out[BENCH_BATCH];
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n;) {
+		size_t got = shard_get_next_targets(shard_cur, out, BENCH_BATCH);
+		if (got < BENCH_BATCH) {
+			shard_restart();
+		}
+		for (size_t j = 0; j < got && i < n; j++, i++) {
+			sum += out[j].ip;
+		}
+	}
+	return sum;
+}
+
+static target_t targets[BENCH_TARGETS];
+static struct in6_addr targets6[BENCH_TARGETS];
+static uint32_t src_ip;
+static struct in6_addr src_ip6;
+
+// targets as a scan of the whole allowed space would visit them
+static void bench_targets_init(void)
+{
+	shard_addrs = blocklist_count_allowed();
+	shard_restart();
+	size_t got = shard_get_next_targets(shard_cur, targets, BENCH_TARGETS);
+	if (got != BENCH_TARGETS) {
+		log_fatal("bench", "only %zu targets in the allowed space", got);
+	}
+	src_ip = inet_addr(BENCH_SRC_IP);
+	inet_pton(AF_INET6, BENCH_SRC_IPV6, &src_ip6);
+	for (size_t i = 0; i < BENCH_TARGETS; i++) {
+		// 2001:db8::<IPv4 target>
+		memcpy(&targets6[i], &src_ip6, sizeof(struct in6_addr));
+		memcpy(&targets6[i].s6_addr[12], &targets[i].ip, sizeof(uint32_t));
+	}
+}
+
+static uint64_t bench_validate_gen(uint64_t n)
+{
+	uint8_t out[VALIDATE_BYTES];
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		const target_t *t = &targets[i % BENCH_TARGETS];
+		validate_gen(src_ip, t->ip, htons(t->port), out);
+		sum += out[0];
+	}
+	return sum;
+}
+
+static uint64_t bench_validate_gen_ipv6(uint64_t n)
+{
+	uint8_t out[VALIDATE_BYTES];
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		validate_gen_ipv6(&src_ip6, &targets6[i % BENCH_TARGETS],
+				  htons(targets[i % BENCH_TARGETS].port), out);
+		sum += out[0];
+	}
+	return sum;
+}
+
+// the kernels with a variant per CPU, over kernel_len bytes
+static uint8_t kernel_buf[1500];
+static size_t kernel_len;
+
+static uint64_t bench_checksum(uint64_t n)
+{
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		kernel_buf[0] = (uint8_t)i;
+		sum += checksum_partial(kernel_buf, kernel_len, 0);
+	}
+	return sum;
+}
+
+static uint64_t bench_hex_encode(uint64_t n)
+{
+	char out[HEX_ENCODED_LEN(sizeof(kernel_buf))];
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		kernel_buf[0] = (uint8_t)i;
+		sum += hex_encode(out, kernel_buf, kernel_len) + (uint8_t)out[0];
+	}
+	return sum;
+}
+
+// with the variants --cpu-features leaves them
+static void bench_kernels(void)
+{
+	for (size_t i = 0; i < sizeof(kernel_buf); i++) {
+		kernel_buf[i] = (uint8_t)(i * 131);
+	}
+	char params[64];
+	const size_t csum_lens[] = {40, 1480};
+	for (size_t i = 0; i < sizeof(csum_lens) / sizeof(csum_lens[0]); i++) {
+		kernel_len = csum_lens[i];
+		snprintf(params, sizeof(params), "impl=%s,len=%zu",
+			 checksum_impl(), kernel_len);
+		bench_run("checksum_partial", params, 1, bench_checksum);
+	}
+	const size_t hex_lens[] = {16, 256};
+	for (size_t i = 0; i < sizeof(hex_lens) / sizeof(hex_lens[0]); i++) {
+		kernel_len = hex_lens[i];
+		snprintf(params, sizeof(params), "impl=%s,len=%zu",
+			 hex_encode_impl(), kernel_len);
+		bench_run("hex_encode", params, 1, bench_hex_encode);
+	}
+}
+
+static uint64_t bench_validate_gen_batch(uint64_t n)
+{
+	validate_input_t in[BENCH_BATCH];
+	uint8_t out[BENCH_BATCH][VALIDATE_BYTES];
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i += BENCH_BATCH) {
+		for (size_t j = 0; j < BENCH_BATCH; j++) {
+			const target_t *t = &targets[(i + j) % BENCH_TARGETS];
+			in[j] = validate_input(src_ip, t->ip, htons(t->port));
+		}
+		validate_gen_batch(in, out, BENCH_BATCH);
+		sum += out[0][0];
+	}
+	return sum;
+}
+
+// what send_packets() hands the probe module for each target
+static probe_spec_t specs[BENCH_TARGETS];
+static probe_module_t *bench_pm;
+static void *bench_pm_arg;
+static batch_t *bench_packets;
+
+static void specs_init(int v6)
+{
+	for (size_t i = 0; i < BENCH_TARGETS; i++) {
+		probe_spec_t *spec = &specs[i];
+		memset(spec, 0, sizeof(*spec));
+		if (v6) {
+			spec->src_ip.v6 = src_ip6;
+			spec->dst_ip.v6 = targets6[i];
+			validate_gen_ipv6(&src_ip6, &targets6[i],
+					  htons(targets[i].port),
+					  (uint8_t *)spec->validation);
+		} else {
+			spec->src_ip.v4 = src_ip;
+			spec->dst_ip.v4 = targets[i].ip;
+			validate_gen(src_ip, targets[i].ip,
+				     htons(targets[i].port),
+				     (uint8_t *)spec->validation);
+		}
+		spec->dst_port = htons(targets[i].port);
+		spec->ip_id = (uint16_t)(spec->validation[3] & 0xFFFF);
+	}
+}
+
+static uint64_t bench_make_packet(uint64_t n)
+{
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		const probe_spec_t *spec = &specs[i % BENCH_TARGETS];
+		size_t len = 0;
+		bench_pm->make_packet(
+		    bench_packets->packets[i % BENCH_BATCH].buf, &len,
+		    &spec->src_ip, &spec->dst_ip, spec->dst_port,
+		    zconf.probe_ttl, (uint32_t *)spec->validation,
+		    spec->probe_num, spec->ip_id, bench_pm_arg);
+		sum += len;
+	}
+	return sum;
+}
+
+static uint64_t bench_make_packets(uint64_t n)
+{
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i += BENCH_BATCH) {
+		bench_pm->make_packets(bench_packets->packets,
+				       &specs[i % BENCH_TARGETS], BENCH_BATCH,
+				       zconf.probe_ttl, bench_pm_arg);
+		sum += bench_packets->packets[0].len;
+	}
+	return sum;
+}
+
+// The probe module with its scan-time setup done, NULL if it would not
+// start with these arguments.
+static probe_module_t *probe_setup(const char *name, const char *args)
+{
+	probe_module_t *pm = get_probe_module_by_name(name);
+	if (!pm) {
+		return NULL;
+	}
+	zconf.probe_module = pm;
+	zconf.probe_args = args ? strdup(args) : NULL;
+	if (pm->global_initialize && pm->global_initialize(&zconf)) {
+		log_warn("bench", "probe module %s did not initialize", name);
+		return NULL;
+	}
+	bench_pm_arg = NULL;
+	if (pm->thread_initialize && pm->thread_initialize(&bench_pm_arg)) {
+		log_warn("bench", "probe module %s did not initialize", name);
+		return NULL;
+	}
+	if (!bench_packets) {
+		bench_packets = create_packet_batch(BENCH_BATCH);
+	}
+	for (size_t i = 0; pm->prepare_packet && i < BENCH_BATCH; i++) {
+		pm->prepare_packet(bench_packets->packets[i].buf, zconf.hw_mac,
+				   zconf.gw_mac, bench_pm_arg);
+	}
+	return pm;
+}
+
+static void bench_probe_modules(void)
+{
+	// what each module needs to start, as a user would give it
+	static const struct {
+		const char *name;
+		const char *args;
+		int v6;
+	} probes[] = {{"tcp_synscan", NULL, 0},
+		      {"tcp_synackscan", NULL, 0},
+		      {"icmp_echoscan", NULL, 0},
+		      {"icmp_echo_time", NULL, 0},
+		      {"udp", "text:hello", 0},
+		      {"ntp", NULL, 0},
+		      {"upnp", NULL, 0},
+		      {"dns", "A,example.com", 0},
+		      {"bacnet", NULL, 0},
+		      {"quic_initial", NULL, 0},
+		      {"ipv6_tcp_synscan", NULL, 1},
+		      {"ipv6_udp", "text:hello", 1},
+		      {"icmp6_echoscan", NULL, 1}};
+	zconf.ipv6_source_ip = (char *)BENCH_SRC_IPV6;
+	for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+		char params[64];
+		snprintf(params, sizeof(params), "module=%s", probes[i].name);
+		if (bench_only && !strstr("make_packets", bench_only) &&
+		    !strstr(params, bench_only)) {
+			continue;
+		}
+		bench_pm = probe_setup(probes[i].name, probes[i].args);
+		if (!bench_pm) {
+			continue;
+		}
+		specs_init(probes[i].v6);
+		bench_run("make_packet", params, 1, bench_make_packet);
+		if (bench_pm->make_packets) {
+			bench_run("make_packets", params, BENCH_BATCH,
+				  bench_make_packets);
+		}
+	}
+}
+
+// SYN-ACKs, and as many answers that fail validation, to the probes a TCP
+// SYN scan sends to targets
+#define BENCH_FRAMES 1024
+static uint8_t *frames[BENCH_FRAMES];
+static uint8_t *bad_frames[BENCH_FRAMES];
+static uint32_t frame_len;
+static fieldset_t *records[BENCH_FRAMES];
+static const struct timespec frame_ts = {.tv_sec = 1700000000, .tv_nsec = 0};
+
+// the fields and translation zmap sets up when every field is output
+static void fields_init(void)
+{
+	memset(&zconf.fsconf, 0, sizeof(struct fieldset_conf));
+	fielddefset_t *fds = &zconf.fsconf.defs;
+	gen_fielddef_set(fds, (fielddef_t *)&(ip_fields), ip_fields_len);
+	gen_fielddef_set(fds, zconf.probe_module->fields,
+			 zconf.probe_module->numfields);
+	gen_fielddef_set(fds, (fielddef_t *)&(sys_fields), sys_fields_len);
+	zconf.fsconf.success_index = fds_get_index_by_name(fds, "success");
+	zconf.fsconf.app_success_index =
+	    fds_get_index_by_name(fds, "app_success");
+	zconf.fsconf.classification_index =
+	    fds_get_index_by_name(fds, "classification");
+	zconf.fsconf.rtt_index = fds_get_index_by_name(fds, "rtt_us");
+	zconf.output_fields_len = fds->len;
+	zconf.output_fields = xcalloc(fds->len, sizeof(const char *));
+	for (int i = 0; i < fds->len; i++) {
+		zconf.output_fields[i] = fds->fielddefs[i].name;
+	}
+	fs_generate_full_fieldset_translation(&zconf.fsconf.translation, fds);
+}
+
+static void frames_init(void)
+{
+	size_t len = 0;
+	for (size_t i = 0; i < BENCH_FRAMES; i++) {
+		const probe_spec_t *spec = &specs[i];
+		uint8_t *buf = bench_packets->packets[0].buf;
+		bench_pm->make_packet(buf, &len, &spec->src_ip, &spec->dst_ip,
+				      spec->dst_port, zconf.probe_ttl,
+				      (uint32_t *)spec->validation,
+				      spec->probe_num, spec->ip_id,
+				      bench_pm_arg);
+		// turn the probe around into its answer
+		struct ip *ip = (struct ip *)(buf + sizeof(struct ether_header));
+		struct tcphdr *tcp = (struct tcphdr *)&ip[1];
+		struct in_addr a = ip->ip_src;
+		ip->ip_src = ip->ip_dst;
+		ip->ip_dst = a;
+		uint16_t port = tcp->th_sport;
+		tcp->th_sport = tcp->th_dport;
+		tcp->th_dport = port;
+		tcp->th_ack = htonl(ntohl(tcp->th_seq) + 1);
+		tcp->th_seq = htonl((uint32_t)i);
+		tcp->th_flags = TH_SYN | TH_ACK;
+		frames[i] = xmalloc(len);
+		memcpy(frames[i], buf, len);
+		tcp->th_ack = htonl(ntohl(tcp->th_ack) + 2);
+		bad_frames[i] = xmalloc(len);
+		memcpy(bad_frames[i], buf, len);
+	}
+	frame_len = (uint32_t)len;
+	for (size_t i = 0; i < BENCH_FRAMES; i++) {
+		recv_result_t res;
+		classify_packet(frame_len, frames[i], frame_ts, &res);
+		if (res.status != RECV_RESULT_VALID) {
+			log_fatal("bench", "synthetic SYN-ACK %zu did not "
+					   "validate",
+				  i);
+		}
+		fs_add_system_fields(res.fs, 0, 0, NULL, frame_ts);
+		records[i] = res.fs;
+	}
+}
+
+static uint64_t bench_classify(uint64_t n)
+{
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		recv_result_t res;
+		classify_packet(frame_len, frames[i % BENCH_FRAMES], frame_ts,
+				&res);
+		sum += res.status;
+		fs_free(res.fs);
+	}
+	return sum;
+}
+
+static uint64_t bench_classify_invalid(uint64_t n)
+{
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		recv_result_t res;
+		classify_packet(frame_len, bad_frames[i % BENCH_FRAMES],
+				frame_ts, &res);
+		sum += res.status;
+	}
+	return sum;
+}
+
+static uint64_t bench_handle_packet(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++) {
+		handle_packet(frame_len, frames[i % BENCH_FRAMES], frame_ts);
+	}
+	return n;
+}
+
+static node_t *filter_tree;
+static struct filter_program *filter_prog;
+
+static uint64_t bench_evaluate_expression(uint64_t n)
+{
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		sum += evaluate_expression(filter_tree,
+					   records[i % BENCH_FRAMES]);
+	}
+	return sum;
+}
+
+static uint64_t bench_filter_eval(uint64_t n)
+{
+	uint64_t sum = 0;
+	for (uint64_t i = 0; i < n; i++) {
+		sum += filter_eval(filter_prog, records[i % BENCH_FRAMES]);
+	}
+	return sum;
+}
+
+static void bench_filters(void)
+{
+	const char *filters[] = {
+	    "success = 1 && repeat = 0",
+	    "classification = synack || sport > 1000",
+	    "saddr = 10.0.0.0/8 || (sport >= 80 && sport <= 443 && repeat = 0)"};
+	for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+		if (!parse_filter_string(strdup(filters[f])) ||
+		    !validate_filter(zconf.filter.expression,
+				     &zconf.fsconf.defs)) {
+			log_fatal("bench", "bad benchmark filter %s",
+				  filters[f]);
+		}
+		filter_tree = zconf.filter.expression;
+		filter_prog = filter_compile(filter_tree);
+		char params[128];
+		snprintf(params, sizeof(params), "filter=%s", filters[f]);
+		bench_run("evaluate_expression", params, 1,
+			  bench_evaluate_expression);
+		bench_run("filter_eval", params, 1, bench_filter_eval);
+		free(filter_prog);
+	}
+	// handle_packet() runs the program, which none is left as
+	zconf.filter.expression = NULL;
+	zconf.filter.program = NULL;
+}
+
+static output_module_t *writer;
+
+static uint64_t bench_writer(uint64_t n)
+{
+	for (uint64_t i = 0; i < n; i++) {
+		fs_view_t view = {.fs = records[i % BENCH_FRAMES],
+				  .t = &zconf.fsconf.translation};
+		writer->process_view(&view);
+	}
+	return n;
+}
+
+static void writer_open(const char *name)
+{
+	writer = get_output_module_by_name(name);
+	if (!writer) {
+		log_fatal("bench", "no output module %s", name);
+	}
+	writer->init(&zconf, zconf.output_fields, zconf.output_fields_len);
+}
+
+static void bench_writers(void)
+{
+	static const char *names[] = {"csv", "json"};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		char params[64];
+		snprintf(params, sizeof(params), "module=%s", names[i]);
+		if (bench_only && !strstr("output", bench_only) &&
+		    !strstr(params, bench_only)) {
+			continue;
+		}
+		writer_open(names[i]);
+		bench_run("output", params, 1, bench_writer);
+		writer->close(&zconf, &zsend, &zrecv);
+	}
+}
+
+// The suite's peak resident memory, which low-memory builds hold to the
+// ceiling they document
+static int bench_peak_memory(void)
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru)) {
+		log_fatal("bench", "getrusage: %s", strerror(errno));
+	}
+#ifdef __APPLE__
+	uint64_t peak = (uint64_t)ru.ru_maxrss;
+#else
+	uint64_t peak = (uint64_t)ru.ru_maxrss * 1024;
+#endif
+	printf("{\"bench\":\"peak_rss\",\"params\":\"ceiling=%llu\","
+	       "\"bytes\":%" PRIu64 "}\n",
+	       LOW_MEMORY_PEAK_BYTES, peak);
+	fflush(stdout);
+#ifdef LOW_MEMORY
+	if (peak > LOW_MEMORY_PEAK_BYTES) {
+		log_error("bench",
+			  "peak resident memory of %" PRIu64 " bytes is over "
+			  "the %llu of low-memory builds",
+			  peak, LOW_MEMORY_PEAK_BYTES);
+		return EXIT_FAILURE;
+	}
+#endif
+	return EXIT_SUCCESS;
+}
+
+int bench_suite(const char *only, double secs)
+{
+	bench_only = only;
+	if (secs > 0) {
+		bench_secs = secs;
+	}
+	zconf.aes = aesrand_init_from_seed(1);
+	validate_init();
+	zconf.ports = xmalloc(sizeof(struct port_conf));
+	zconf.ports->port_bitmap = bm_init();
+	parse_ports(strdup("80,443"), zconf.ports);
+	// everything written goes nowhere, so only the encoding is timed
+	zconf.output_filename = (char *)"/dev/null";
+	zconf.data_link_size = sizeof(struct ether_header);
+	zconf.dedup_method = DEDUP_METHOD_NONE;
+
+	bench_blocklist_init();
+	char params[128];
+	snprintf(params, sizeof(params), "prefixes=%" PRIu64, bench_prefixes);
+	bench_run("blocklist_lookup_index", params, 1, bench_lookup_index);
+	bench_run("blocklist_is_allowed", params, 1, bench_is_allowed);
+
+	// a /16, a /8 and the whole allowed space, the latter two on two ports
+	const uint64_t groups[] = {1 << 16, 1 << 24,
+				   blocklist_count_allowed()};
+	for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++) {
+		shard_addrs = groups[i];
+		shard_restart();
+		snprintf(params, sizeof(params),
+			 "addrs=%" PRIu64 ",ports=%u,prime=%" PRIu64,
+			 shard_addrs, zconf.ports->port_count,
+			 shard_cur->params.modulus);
+		bench_run("shard_get_next_target", params, 1,
+			  bench_next_target);
+		bench_run("shard_get_next_targets", params, 1,
+			  bench_next_targets);
+	}
+	// walking off the end of a shard marks the sending done
+	zsend.complete = 0;
+
+	bench_targets_init();
+	// the method auto picks, then the other one
+	for (int m = 0; m < 2; m++) {
+		if (m) {
+			zconf.validation_method =
+			    zconf.validation_method == VALIDATION_METHOD_AES
+				? VALIDATION_METHOD_SIPHASH
+				: VALIDATION_METHOD_AES;
+			validate_init();
+		}
+		snprintf(params, sizeof(params), "method=%s",
+			 validate_method_name());
+		bench_run("validate_gen", params, 1, bench_validate_gen);
+		bench_run("validate_gen_ipv6", params, 1,
+			  bench_validate_gen_ipv6);
+		snprintf(params, sizeof(params), "batch=%d,method=%s",
+			 BENCH_BATCH, validate_method_name());
+		bench_run("validate_gen_batch", params, BENCH_BATCH,
+			  bench_validate_gen_batch);
+	}
+
+	bench_kernels();
+	bench_probe_modules();
+
+	// the receive side, with TCP SYN scan answers
+	bench_pm = probe_setup("tcp_synscan", NULL);
+	if (!bench_pm) {
+		log_fatal("bench", "tcp_synscan did not initialize");
+	}
+	specs_init(0);
+	fields_init();
+	frames_init();
+	bench_run("classify_packet", "module=tcp_synscan,valid=1", 1,
+		  bench_classify);
+	bench_run("classify_packet", "module=tcp_synscan,valid=0", 1,
+		  bench_classify_invalid);
+	bench_filters();
+	bench_writers();
+	// the whole of it, through to a CSV line, as with one receive thread
+	writer_open("csv");
+	zconf.output_module = writer;
+	bench_run("handle_packet", "module=tcp_synscan,output=csv", 1,
+		  bench_handle_packet);
+	writer->close(&zconf, &zsend, &zrecv);
+	zconf.output_module = NULL;
+	return bench_peak_memory();
+}
@@ -0,0 +1,27 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_TESTS_BENCH_H
+#define ZMAP_TESTS_BENCH_H
+
+// Run the microbenchmarks of the scanner's hot paths whose names contain
+// only (all of them if NULL), each for about secs seconds, and print one
+// JSON object per benchmark on stdout:
+//
+//   {"bench":"validate_gen","params":"","ops":...,"ns_per_op":...,
+//    "ops_per_sec":...}
+//
+// followed by the suite's peak resident memory:
+//
+//   {"bench":"peak_rss","params":"ceiling=...","bytes":...}
+//
+// Sets up zconf as a scan would, so it is run once per process. Fails in
+// low-memory builds whose peak is over LOW_MEMORY_PEAK_BYTES.
+int bench_suite(const char *only, double secs);
+
+#endif /* ZMAP_TESTS_BENCH_H */
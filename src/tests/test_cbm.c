@@ -0,0 +1,151 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../lib/cbm.h"
+#include "../../lib/pbm.h"
+
+#include "tests.h"
+
+#define CBM_TEST_PAGES 48
+#define CBM_TEST_NUM_PAGES 0x10000
+
+static void set_both(cbm_t *c, uint8_t *flat, uint32_t v)
+{
+	cbm_set(c, v);
+	flat_bm_set(flat, v);
+}
+
+// Fills page as its kind says, to take it through each container and each
+// conversion between them: arrays that stay small or overflow into a bitmap,
+// runs that grow, merge and then split into too many, dense bitmaps, and a
+// whole page set backwards so every run grows at its start.
+static void fill_page(cbm_t *c, uint8_t *flat, uint32_t page, int kind,
+		      uint64_t *seed)
+{
+	uint32_t base = page << 16;
+	switch (kind) {
+	case 0: {
+		uint32_t n = 1 + test_rand(seed) % 4000;
+		for (uint32_t i = 0; i < n; i++) {
+			set_both(c, flat, base + (uint16_t)test_rand(seed));
+		}
+		break;
+	}
+	case 1:
+		for (uint32_t i = 0; i < CBM_ARRAY_MAX + 500; i++) {
+			set_both(c, flat, base + (uint16_t)test_rand(seed));
+		}
+		break;
+	case 2:
+	case 3: {
+		// in order, so the array is few runs when it fills up
+		uint32_t v = test_rand(seed) % 64;
+		uint32_t starts[200];
+		uint32_t ends[200];
+		int runs = 0;
+		while (runs < 200 && v < 0x10000 - 64) {
+			uint32_t len = 10 + test_rand(seed) % 50;
+			starts[runs] = v;
+			for (uint32_t i = 0; i < len && v < 0x10000; i++, v++) {
+				set_both(c, flat, base + v);
+			}
+			ends[runs++] = v;
+			v += 2 + test_rand(seed) % 250;
+		}
+		if (kind == 2) {
+			// single values between the runs, until there are
+			// too many runs to keep
+			for (int i = 0; i < 1500; i++) {
+				set_both(c, flat,
+					 base + (uint16_t)test_rand(seed));
+			}
+		} else {
+			// close every other gap, from either side
+			for (int r = 0; r + 1 < runs; r += 2) {
+				for (uint32_t u = ends[r]; u < starts[r + 1];
+				     u++) {
+					uint32_t w = r % 4 ? u
+						 : starts[r + 1] - 1 -
+						       (u - ends[r]);
+					set_both(c, flat, base + w);
+				}
+			}
+		}
+		break;
+	}
+	case 4:
+		for (uint32_t i = 0; i < 30000; i++) {
+			set_both(c, flat, base + (uint16_t)test_rand(seed));
+		}
+		break;
+	default:
+		for (uint32_t v = 0x10000; v-- > 0;) {
+			set_both(c, flat, base + v);
+		}
+		break;
+	}
+	// setting what is already set changes nothing
+	for (int i = 0; i < 100; i++) {
+		uint32_t v = base + (uint16_t)test_rand(seed);
+		if (flat_bm_check(flat, v)) {
+			cbm_set(c, v);
+		}
+	}
+}
+
+// Randomized comparison of the compressed bitmap with the flat one: every
+// value of the pages set, and every page through cbm_get_page.
+int test_cbm(void)
+{
+	cbm_t *c = cbm_init(CBM_TEST_NUM_PAGES, MEM_DEDUP);
+	uint8_t *flat = flat_bm_init();
+	uint8_t *page_bits = xmalloc(CBM_PAGE_BYTES);
+	uint64_t seed = 82;
+
+	uint32_t pages[CBM_TEST_PAGES];
+	for (int k = 0; k < CBM_TEST_PAGES; k++) {
+		// the first and last pages, and others scattered between
+		pages[k] = k == 0 ? 0
+			   : k == 1 ? CBM_TEST_NUM_PAGES - 1
+				    : (uint32_t)(k * 1361) % CBM_TEST_NUM_PAGES;
+		fill_page(c, flat, pages[k], k % 6, &seed);
+	}
+	for (int k = 0; k < CBM_TEST_PAGES; k++) {
+		uint32_t base = pages[k] << 16;
+		for (uint32_t v = 0; v < 0x10000; v++) {
+			TEST_CHECK(!cbm_check(c, base + v) ==
+				   !flat_bm_check(flat, base + v));
+		}
+	}
+	for (uint32_t p = 0; p < CBM_TEST_NUM_PAGES; p++) {
+		const uint8_t *want = flat + (uint64_t)p * CBM_PAGE_BYTES;
+		int any = 0;
+		for (size_t i = 0; i < CBM_PAGE_BYTES && !any; i++) {
+			any = want[i] != 0;
+		}
+		TEST_CHECK(cbm_get_page(c, p, page_bits) == any);
+		TEST_CHECK(!memcmp(page_bits, want, CBM_PAGE_BYTES));
+	}
+	// and pages nothing was set in
+	for (int i = 0; i < 100000; i++) {
+		uint32_t v = (uint32_t)test_rand(&seed);
+		TEST_CHECK(!cbm_check(c, v) == !flat_bm_check(flat, v));
+	}
+	TEST_CHECK(cbm_memory(c) < (size_t)CBM_TEST_PAGES * CBM_PAGE_BYTES +
+					CBM_TEST_NUM_PAGES * sizeof(void *) +
+					sizeof(cbm_t) +
+					CBM_TEST_PAGES * 64);
+
+	free(page_bits);
+	flat_bm_free(flat);
+	cbm_free(c);
+	return EXIT_SUCCESS;
+}
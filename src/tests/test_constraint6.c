@@ -0,0 +1,152 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../lib/constraint6.h"
+#include "../../lib/xalloc.h"
+
+#include "tests.h"
+
+#define CONSTRAINT6_TEST_TRIALS 100
+#define CONSTRAINT6_TEST_LOOKUPS 5000
+#define CONSTRAINT6_TEST_PREFIXES 64
+
+typedef unsigned __int128 u128;
+
+static u128 to_u128(const struct in6_addr *a)
+{
+	u128 v = 0;
+	for (int i = 0; i < 16; i++) {
+		v = v << 8 | a->s6_addr[i];
+	}
+	return v;
+}
+
+static struct in6_addr from_u128(u128 v)
+{
+	struct in6_addr a;
+	for (int i = 15; i >= 0; i--) {
+		a.s6_addr[i] = (uint8_t)v;
+		v >>= 8;
+	}
+	return a;
+}
+
+// the low n bits set
+static u128 low_bits(int n)
+{
+	if (n <= 0) {
+		return 0;
+	}
+	return n >= 128 ? ~(u128)0 : ((u128)1 << n) - 1;
+}
+
+static u128 rand_u128(uint64_t *seed)
+{
+	return (u128)test_rand(seed) << 64 | test_rand(seed);
+}
+
+// whether the first len bits of a and p match, bit by bit
+static int covers(const struct in6_addr *p, int len, const struct in6_addr *a)
+{
+	for (int bit = 0; bit < len; bit++) {
+		int m = 0x80 >> (bit % 8);
+		if ((p->s6_addr[bit / 8] & m) != (a->s6_addr[bit / 8] & m)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int brute_force(int default_allowed, const constraint6_prefix_t *p,
+		       size_t n, const struct in6_addr *a)
+{
+	int allowed = default_allowed;
+	for (size_t i = 0; i < n; i++) {
+		if (covers(&p[i].prefix, p[i].len, a)) {
+			if (!p[i].allowed) {
+				return 0;
+			}
+			allowed = 1;
+		}
+	}
+	return allowed;
+}
+
+// lengths at and around the direct table and the strides below it
+static uint8_t rand_len(uint64_t *seed)
+{
+	static const uint8_t edges[] = {0,  1,  15, 16, 17,  22,  28,  48,
+					63, 64, 65, 96, 124, 127, 128};
+	uint64_t r = test_rand(seed);
+	if (r % 2) {
+		return edges[(r >> 8) % sizeof(edges)];
+	}
+	return (uint8_t)((r >> 8) % 129);
+}
+
+// Randomized comparison of the poptrie with checking every prefix, for
+// nested and overlapping allowed and blocked prefixes under a few common
+// parents, looked up at and just outside their bounds and at random.
+int test_constraint6(void)
+{
+	uint64_t seed = 113;
+	constraint6_prefix_t *p = xcalloc(CONSTRAINT6_TEST_PREFIXES,
+					  sizeof(constraint6_prefix_t));
+	for (int t = 0; t < CONSTRAINT6_TEST_TRIALS; t++) {
+		u128 parents[4];
+		for (int i = 0; i < 4; i++) {
+			parents[i] = rand_u128(&seed);
+		}
+		// none at all the first time
+		size_t n = 0;
+		if (t) {
+			n = test_rand(&seed) % CONSTRAINT6_TEST_PREFIXES + 1;
+		}
+		for (size_t i = 0; i < n; i++) {
+			// under one of a few parents, differing in some low bits
+			u128 v = parents[test_rand(&seed) % 4];
+			int shift = (int)(test_rand(&seed) % 129);
+			v ^= rand_u128(&seed) & low_bits(shift);
+			p[i].prefix = from_u128(v);
+			p[i].len = rand_len(&seed);
+			p[i].allowed = test_rand(&seed) % 3 != 0;
+		}
+		int default_allowed = t % 4 == 0;
+		constraint6_t *con =
+		    constraint6_build(default_allowed, p, n);
+		for (int i = 0; i < CONSTRAINT6_TEST_LOOKUPS; i++) {
+			u128 v = rand_u128(&seed);
+			if (n && i % 4) {
+				const constraint6_prefix_t *q =
+				    &p[test_rand(&seed) % n];
+				u128 host = low_bits(128 - q->len);
+				u128 start = to_u128(&q->prefix) & ~host;
+				switch (i % 4) {
+				case 1:
+					v = start - (i % 8 == 1);
+					break;
+				case 2:
+					v = (start | host) + (i % 8 == 2);
+					break;
+				default:
+					v = start | (v & host);
+					break;
+				}
+			}
+			struct in6_addr a = from_u128(v);
+			TEST_CHECK(constraint6_is_allowed(con, &a) ==
+				   brute_force(default_allowed, p, n, &a));
+		}
+		constraint6_free(con);
+	}
+	free(p);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,162 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cyclic.h"
+#include "../shard.h"
+
+#include "tests.h"
+
+// 2^32 addresses times 2^16 ports
+#define CYCLIC_TEST_MAX_TARGETS (UINT64_C(1) << 48)
+#define CYCLIC_TEST_DECODES 100000
+
+// Miller-Rabin with the first twelve primes as bases, which is exact for
+// any n below 2^64
+static int is_prime(uint64_t n)
+{
+	static const uint64_t bases[] = {2,  3,  5,  7,  11, 13,
+					 17, 19, 23, 29, 31, 37};
+	if (n < 2) {
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(bases) / sizeof(bases[0]); i++) {
+		if (n % bases[i] == 0) {
+			return n == bases[i];
+		}
+	}
+	uint64_t d = n - 1;
+	int s = 0;
+	while (!(d & 1)) {
+		d >>= 1;
+		s++;
+	}
+	for (size_t i = 0; i < sizeof(bases) / sizeof(bases[0]); i++) {
+		uint64_t x = cyclic_powmod(bases[i], d, n);
+		int witness = x != 1 && x != n - 1;
+		for (int r = 1; r < s && witness; r++) {
+			x = (uint64_t)((unsigned __int128)x * x % n);
+			witness = x != n - 1;
+		}
+		if (witness) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Each group's modulus is prime, its factors are exactly the distinct primes
+// of p - 1, and its known root has order p - 1, which together with the
+// factors is what make_cycle() relies on to find other generators. The
+// groups come in ascending order up to one with every possible target.
+static int test_cyclic_groups(void)
+{
+	const cyclic_group_t *g = get_group(0);
+	uint64_t prev = 0;
+	int n = 0;
+	for (;;) {
+		TEST_CHECK(g->prime > prev);
+		TEST_CHECK(is_prime(g->prime));
+		TEST_CHECK(g->num_prime_factors > 0);
+		TEST_CHECK(g->num_prime_factors <=
+			   sizeof(g->prime_factors) / sizeof(uint64_t));
+		uint64_t rest = g->prime - 1;
+		for (size_t i = 0; i < g->num_prime_factors; i++) {
+			uint64_t q = g->prime_factors[i];
+			TEST_CHECK(is_prime(q));
+			TEST_CHECK(rest % q == 0);
+			while (rest % q == 0) {
+				rest /= q;
+			}
+			TEST_CHECK(cyclic_powmod(g->known_primroot,
+						 (g->prime - 1) / q,
+						 g->prime) != 1);
+		}
+		TEST_CHECK(rest == 1);
+		TEST_CHECK(cyclic_powmod(g->known_primroot, g->prime - 1,
+					 g->prime) == 1);
+		// the smallest group with more elements than asked for
+		TEST_CHECK(get_group(prev) == g);
+		TEST_CHECK(get_group(g->prime - 1) == g);
+		n++;
+		if (g->prime > CYCLIC_TEST_MAX_TARGETS) {
+			break;
+		}
+		prev = g->prime;
+		g = get_group(prev);
+	}
+	TEST_CHECK(n > 2);
+	return EXIT_SUCCESS;
+}
+
+static int check_decode(const shard_t *shard, uint64_t v)
+{
+	uint64_t index;
+	uint16_t port;
+	shard_decode(shard, v, &index, &port);
+	TEST_CHECK(index == v / shard->port_count);
+	TEST_CHECK(port == v % shard->port_count);
+	return EXIT_SUCCESS;
+}
+
+// The reciprocal decode against / and %, for port counts from one to every
+// port, around multiples of the count, around the most targets a scan has,
+// and up to the largest v it is defined for.
+static int test_shard_decode(void)
+{
+	static const uint32_t counts[] = {1,   2,    3,    7,     10,    255,
+					  256, 1000, 4093, 32768, 65535, 65536};
+	uint64_t seed = 69;
+	shard_t shard;
+	memset(&shard, 0, sizeof(shard));
+	for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+		shard.port_count = counts[c];
+		shard.port_recip = UINT64_MAX / counts[c];
+		uint64_t n = counts[c];
+		const uint64_t edges[] = {0,
+					  n,
+					  n * n,
+					  CYCLIC_TEST_MAX_TARGETS / n * n,
+					  CYCLIC_TEST_MAX_TARGETS,
+					  UINT64_MAX / n * n,
+					  UINT64_MAX};
+		for (size_t e = 0; e < sizeof(edges) / sizeof(edges[0]); e++) {
+			for (uint64_t d = 0; d < 2 * n + 2 && d < 1000; d++) {
+				if (edges[e] >= d &&
+				    check_decode(&shard, edges[e] - d) !=
+					EXIT_SUCCESS) {
+					return EXIT_FAILURE;
+				}
+				if (edges[e] <= UINT64_MAX - d &&
+				    check_decode(&shard, edges[e] + d) !=
+					EXIT_SUCCESS) {
+					return EXIT_FAILURE;
+				}
+			}
+		}
+		for (int i = 0; i < CYCLIC_TEST_DECODES; i++) {
+			uint64_t r = test_rand(&seed);
+			// as often below the most targets as anywhere
+			uint64_t v = i % 2 ? r : r % CYCLIC_TEST_MAX_TARGETS;
+			if (check_decode(&shard, v) != EXIT_SUCCESS) {
+				return EXIT_FAILURE;
+			}
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+int test_cyclic(void)
+{
+	if (test_cyclic_groups() != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	return test_shard_decode();
+}
@@ -0,0 +1,252 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../lib/includes.h"
+#include "../../lib/xalloc.h"
+#include "../fieldset.h"
+#include "../probe_modules/module_dns.h"
+#include "../probe_modules/packet.h"
+#include "../probe_modules/probe_modules.h"
+#include "../state.h"
+
+#include "tests.h"
+
+#define DNS_TEST_ID 0x4d2
+#define DNS_TEST_PACKETS 2000
+
+extern probe_module_t module_dns;
+
+// a response and what its answers' names and rdata should decode to
+typedef struct dns_test_response {
+	uint8_t buf[512];
+	uint32_t len;
+	int answers;
+	const char *names[5];
+	const char *rdata[5];
+	char www[64];
+	char mail[64];
+	char mx[64];
+} dns_test_response_t;
+
+static uint8_t *put(uint8_t *p, const void *bytes, size_t len)
+{
+	memcpy(p, bytes, len);
+	return p + len;
+}
+
+static uint8_t *put_rr(uint8_t *p, const char *name, size_t name_len,
+		       uint16_t type, const char *rdata, uint16_t rdlength)
+{
+	p = put(p, name, name_len);
+	dns_answer_tail tail = {.type = htons(type),
+				.class = htons(1),
+				.ttl = htonl(300),
+				.rdlength = htons(rdlength)};
+	p = put(p, &tail, sizeof(tail));
+	return put(p, rdata, rdlength);
+}
+
+static dns_header *build_headers(dns_test_response_t *r)
+{
+	memset(r, 0, sizeof(*r));
+	struct ip *ip = (struct ip *)r->buf;
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_p = IPPROTO_UDP;
+	struct udphdr *udp = (struct udphdr *)&ip[1];
+	udp->uh_sport = htons(53);
+	udp->uh_dport = htons(32768);
+	dns_header *dns = (dns_header *)&udp[1];
+	dns->id = DNS_TEST_ID;
+	dns->qr = 1;
+	return dns;
+}
+
+static void finish_response(dns_test_response_t *r, dns_header *dns,
+			    const uint8_t *end)
+{
+	struct ip *ip = (struct ip *)r->buf;
+	struct udphdr *udp = (struct udphdr *)&ip[1];
+	udp->uh_ulen = htons((uint16_t)(end - (uint8_t *)udp));
+	r->len = (uint32_t)(end - r->buf);
+	ip->ip_len = htons((uint16_t)r->len);
+	dns->ancount = htons((uint16_t)r->answers);
+}
+
+// A response for the question domain, whose answers refer to it with a
+// pointer to just after the header, to it through another pointer, and to
+// names of their own
+static void build_response(dns_test_response_t *r, const char *qname,
+			   size_t qname_len, const char *domain)
+{
+	dns_header *dns = build_headers(r);
+	dns->qdcount = htons(1);
+	uint8_t *p = (uint8_t *)&dns[1];
+	p = put(p, qname, qname_len);
+	dns_question_tail q = {.qtype = htons(DNS_QTYPE_A),
+			       .qclass = htons(1)};
+	p = put(p, &q, sizeof(q));
+	p = put_rr(p, "\xc0\x0c", 2, DNS_QTYPE_A, "\x01\x02\x03\x04", 4);
+	p = put_rr(p, "\xc0\x0c", 2, DNS_QTYPE_CNAME, "\xc0\x0c", 2);
+	uint16_t www = (uint16_t)(p - (uint8_t *)dns) + 2 + 10;
+	p = put_rr(p, "\xc0\x0c", 2, DNS_QTYPE_CNAME, "\x03www\xc0\x0c", 6);
+	// the rdata of the one before, which ends in a pointer of its own
+	char www_ptr[2] = {(char)(0xc0 | www >> 8), (char)www};
+	p = put_rr(p, www_ptr, 2, DNS_QTYPE_A, "\x05\x06\x07\x08", 4);
+	p = put_rr(p, "\x04mail\xc0\x0c", 7, DNS_QTYPE_MX,
+		   "\x00\x0a\x04mail\xc0\x0c", 9);
+	r->answers = 5;
+	finish_response(r, dns, p);
+
+	snprintf(r->www, sizeof(r->www), "www.%s", domain);
+	snprintf(r->mail, sizeof(r->mail), "mail.%s", domain);
+	snprintf(r->mx, sizeof(r->mx), "10 mail.%s", domain);
+	const char *names[] = {domain, domain, domain, r->www, r->mail};
+	const char *rdata[] = {"1.2.3.4", domain, r->www, "5.6.7.8", r->mx};
+	memcpy(r->names, names, sizeof(names));
+	memcpy(r->rdata, rdata, sizeof(rdata));
+}
+
+// A response without questions, whose first answer is where the question
+// would be and has what the module asked for as its name, and whose second
+// points at it
+static void build_answer_only(dns_test_response_t *r, const char *qname,
+			      size_t qname_len, const char *domain)
+{
+	dns_header *dns = build_headers(r);
+	uint8_t *p = (uint8_t *)&dns[1];
+	p = put_rr(p, qname, qname_len, DNS_QTYPE_A, "\x01\x02\x03\x04", 4);
+	p = put_rr(p, "\xc0\x0c", 2, DNS_QTYPE_A, "\x05\x06\x07\x08", 4);
+	r->answers = 2;
+	finish_response(r, dns, p);
+	const char *names[] = {domain, domain};
+	const char *rdata[] = {"1.2.3.4", "5.6.7.8"};
+	memcpy(r->names, names, sizeof(names));
+	memcpy(r->rdata, rdata, sizeof(rdata));
+}
+
+static field_t *get_field(fieldset_t *fs, const char *name)
+{
+	for (int i = 0; i < fs->len; i++) {
+		if (!strcmp(fs->fields[i].name, name)) {
+			return &fs->fields[i];
+		}
+	}
+	return NULL;
+}
+
+static int check_response(void *ctx, const dns_test_response_t *r)
+{
+	parsed_packet_t pp;
+	parse_packet(r->buf, r->len, 0, &pp);
+	uint32_t validation[4] = {0, 0, DNS_TEST_ID, 0};
+	struct timespec ts = {0, 0};
+	fieldset_t *fs = fs_new_fieldset(NULL);
+	module_dns.process_packet(&pp, fs, validation, ts, ctx);
+	int ret = EXIT_FAILURE;
+	field_t *f = get_field(fs, "success");
+	if (!f || !f->value.num) {
+		goto out;
+	}
+	f = get_field(fs, "dns_parse_err");
+	if (!f || f->type != FS_UINT64 || f->value.num) {
+		goto out;
+	}
+	f = get_field(fs, "dns_answers");
+	if (!f || f->type != FS_REPEATED) {
+		goto out;
+	}
+	fieldset_t *answers = f->value.ptr;
+	if (answers->len != r->answers) {
+		goto out;
+	}
+	for (int i = 0; i < answers->len; i++) {
+		fieldset_t *a = answers->fields[i].value.ptr;
+		field_t *name = get_field(a, "name");
+		field_t *rdata = get_field(a, "rdata");
+		if (!name || strcmp(name->value.ptr, r->names[i]) || !rdata ||
+		    rdata->type != FS_STRING ||
+		    strcmp(rdata->value.ptr, r->rdata[i])) {
+			log_error("ztests", "dns answer %d of %s is wrong", i,
+				  r->names[0]);
+			goto out;
+		}
+	}
+	ret = EXIT_SUCCESS;
+out:
+	fs_free(fs);
+	return ret;
+}
+
+static const char example_com[] = "\x07" "example\x03" "com";
+static const char example_net[] = "\x07" "example\x03" "net";
+
+// Alternates responses for both questions and one without any, so that a
+// context must forget one response's question before the next
+static void *check_responses(void *ret)
+{
+	void *ctx;
+	if (module_dns.recv_thread_initialize(&ctx) != EXIT_SUCCESS) {
+		*(int *)ret = EXIT_FAILURE;
+		return NULL;
+	}
+	dns_test_response_t *r = xmalloc(3 * sizeof(dns_test_response_t));
+	build_response(&r[0], example_com, sizeof(example_com), "example.com");
+	build_response(&r[1], example_net, sizeof(example_net), "example.net");
+	build_answer_only(&r[2], example_com, sizeof(example_com),
+			  "example.com");
+	*(int *)ret = EXIT_SUCCESS;
+	for (int i = 0; i < DNS_TEST_PACKETS; i++) {
+		if (check_response(ctx, &r[i % 3]) != EXIT_SUCCESS) {
+			*(int *)ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	free(r);
+	free(ctx);
+	return NULL;
+}
+
+// Responses parsed with each receive thread's context, on two threads at
+// once, with answer names and name rdata that point at the question, at
+// other records and at nothing.
+int test_dns(void)
+{
+	char *saved_args = zconf.probe_args;
+	int saved_streams = zconf.packet_streams;
+	char *args = strdup("A,example.com;A,example.net");
+	zconf.probe_args = args;
+	zconf.packet_streams = 2;
+	gen_fielddef_set(&zconf.fsconf.defs, module_dns.fields,
+			 module_dns.numfields);
+	int ret = module_dns.global_initialize(&zconf);
+	if (ret == EXIT_SUCCESS) {
+		pthread_t threads[2];
+		int rets[2];
+		for (int i = 0; i < 2; i++) {
+			pthread_create(&threads[i], NULL, check_responses,
+				       &rets[i]);
+		}
+		for (int i = 0; i < 2; i++) {
+			pthread_join(threads[i], NULL);
+			if (rets[i] != EXIT_SUCCESS) {
+				ret = EXIT_FAILURE;
+			}
+		}
+		module_dns.close(&zconf, NULL, NULL);
+	}
+	memset(&zconf.fsconf.defs, 0, sizeof(zconf.fsconf.defs));
+	zconf.probe_args = saved_args;
+	zconf.packet_streams = saved_streams;
+	free(args);
+	return ret;
+}
@@ -0,0 +1,120 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../lib/fpset.h"
+
+#include "tests.h"
+
+#define FPSET_TEST_KEYS 200000
+// how many keys share their low bits, and so one long probe run
+#define FPSET_TEST_COLLIDING 4096
+// fpset_key() stores 0, the empty marker, as this fingerprint
+#define FPSET_ZERO_KEY 0x9e3779b97f4a7c15ULL
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static int ref_contains(const uint64_t *ref, size_t n, uint64_t fp)
+{
+	uint64_t key = fp ? fp : FPSET_ZERO_KEY;
+	return bsearch(&key, ref, n, sizeof(uint64_t), cmp_u64) != NULL;
+}
+
+// Inserts keys, with repeats and some sharing their low bits so that a
+// probe run gets long, into a set that starts at its smallest and grows,
+// and compares membership with a sorted reference array.
+int test_fpset(void)
+{
+	uint64_t seed = 17;
+	uint64_t *keys = xcalloc(FPSET_TEST_KEYS, sizeof(uint64_t));
+	for (size_t i = 0; i < FPSET_TEST_KEYS; i++) {
+		uint64_t r = test_rand(&seed);
+		switch (i % 4) {
+		case 0:
+			keys[i] = r;
+			break;
+		case 1:
+			// the same slot in every table up to 2^20 slots
+			keys[i] =
+			    i < FPSET_TEST_COLLIDING ? (r << 20) | 0x5a5 : r;
+			break;
+		case 2:
+			keys[i] = keys[r % (i + 1)];
+			break;
+		default:
+			keys[i] = r % 1024;
+			break;
+		}
+	}
+	keys[0] = 0;
+	keys[1] = FPSET_ZERO_KEY;
+
+	fpset_t *set = fpset_init(1, MEM_DEDUP);
+	uint64_t slots = set->mask + 1;
+	for (size_t i = 0; i < FPSET_TEST_KEYS; i++) {
+		uint64_t before = set->count;
+		int had = fpset_check(set, keys[i]);
+		fpset_set(set, keys[i]);
+		TEST_CHECK(fpset_check(set, keys[i]));
+		TEST_CHECK(set->count == before + !had);
+		// grows by doubling, before it is more than half full
+		TEST_CHECK(set->count * 2 <= set->mask + 1);
+		TEST_CHECK(((set->mask + 1) & set->mask) == 0);
+		TEST_CHECK(set->mask + 1 >= slots);
+		slots = set->mask + 1;
+	}
+	TEST_CHECK(slots > 1024);
+
+	uint64_t *ref = xcalloc(FPSET_TEST_KEYS, sizeof(uint64_t));
+	for (size_t i = 0; i < FPSET_TEST_KEYS; i++) {
+		ref[i] = keys[i] ? keys[i] : FPSET_ZERO_KEY;
+	}
+	qsort(ref, FPSET_TEST_KEYS, sizeof(uint64_t), cmp_u64);
+	size_t n = 0;
+	for (size_t i = 0; i < FPSET_TEST_KEYS; i++) {
+		if (!n || ref[n - 1] != ref[i]) {
+			ref[n++] = ref[i];
+		}
+	}
+	// 0 and FPSET_ZERO_KEY are one fingerprint
+	TEST_CHECK(set->count == n);
+	for (size_t i = 0; i < FPSET_TEST_KEYS; i++) {
+		TEST_CHECK(fpset_check(set, keys[i]));
+	}
+	for (size_t i = 0; i < FPSET_TEST_KEYS; i++) {
+		uint64_t r = test_rand(&seed);
+		uint64_t probe = i % 16 ? r : (r << 20) | 0x5a5;
+		TEST_CHECK(fpset_check(set, probe) ==
+			   ref_contains(ref, n, probe));
+	}
+	fpset_free(set);
+
+	// a set kept at the size it was made for never grows
+	set = fpset_init(FPSET_TEST_KEYS, MEM_DEDUP);
+	slots = set->mask + 1;
+	TEST_CHECK(slots / 2 >= FPSET_TEST_KEYS);
+	TEST_CHECK(fpset_bytes(FPSET_TEST_KEYS) ==
+		   sizeof(fpset_t) + slots * sizeof(uint64_t));
+	for (size_t i = 0; i < n; i++) {
+		fpset_set(set, ref[i]);
+	}
+	TEST_CHECK(set->mask + 1 == slots);
+	TEST_CHECK(set->count == n);
+	fpset_free(set);
+
+	free(ref);
+	free(keys);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <stdlib.h>
+
+#include "../../lib/fpset.h"
+#include "../../lib/fpwindow.h"
+
+#include "tests.h"
+
+#define FPWINDOW_TEST_BUCKETS 1024
+#define FPWINDOW_TEST_HOT 512
+#define FPWINDOW_TEST_ROUNDS 200
+// few enough new keys between two looks at the hot ones that no bucket
+// takes enough of them to evict a referenced key
+#define FPWINDOW_TEST_COLD 128
+
+// the way of b holding fp, or -1, looked up without marking it used
+static int way_of(const fpwindow_bucket_t *b, uint64_t fp)
+{
+	for (int i = 0; i < FPWINDOW_WAYS; i++) {
+		if (b->fp[i] == fpset_key(fp)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// CLOCK replacement within a bucket: a full bucket evicts the first way
+// after the hand that hasn't been looked up since the hand last passed it
+static int test_fpwindow_order(void)
+{
+	fpwindow_t *w = fpwindow_init(FPWINDOW_WAYS);
+	TEST_CHECK(w->mask == 0);
+	const fpwindow_bucket_t *b = &w->buckets[0];
+	// 0 is the empty marker, and is stored like any other fingerprint
+	for (uint64_t k = 0; k < FPWINDOW_WAYS; k++) {
+		TEST_CHECK(!fpwindow_check_and_set(w, k));
+		TEST_CHECK(way_of(b, k) == (int)k);
+	}
+	TEST_CHECK(fpwindow_check_and_set(w, 0));
+	TEST_CHECK(fpwindow_check_and_set(w, 2));
+
+	// 0 gets a second chance, 1 goes
+	TEST_CHECK(!fpwindow_check_and_set(w, 100));
+	TEST_CHECK(way_of(b, 100) == 1);
+	TEST_CHECK(way_of(b, 1) < 0);
+	// 2 gets a second chance, then 3, 4, 5 and 6 go in order
+	for (uint64_t k = 101; k <= 104; k++) {
+		TEST_CHECK(!fpwindow_check_and_set(w, k));
+		TEST_CHECK(way_of(b, k - 98) < 0);
+		TEST_CHECK(way_of(b, k) == (int)(k - 98));
+	}
+	// the hand has passed 0 since it was looked up, so it goes next,
+	// then 100, and 2 only after those
+	TEST_CHECK(!fpwindow_check_and_set(w, 105));
+	TEST_CHECK(way_of(b, 0) < 0);
+	TEST_CHECK(way_of(b, 105) == 0);
+	TEST_CHECK(!fpwindow_check_and_set(w, 106));
+	TEST_CHECK(way_of(b, 100) < 0);
+	TEST_CHECK(way_of(b, 2) == 2);
+	TEST_CHECK(!fpwindow_check_and_set(w, 107));
+	TEST_CHECK(way_of(b, 2) < 0);
+	for (uint64_t k = 101; k <= 107; k++) {
+		TEST_CHECK(fpwindow_check_and_set(w, k));
+	}
+	fpwindow_free(w);
+	return EXIT_SUCCESS;
+}
+
+// Keys looked up between every few insertions stay in the window however
+// many others go through it.
+static int test_fpwindow_recent(void)
+{
+	size_t size = FPWINDOW_TEST_BUCKETS * FPWINDOW_WAYS;
+	fpwindow_t *w = fpwindow_init(size);
+	TEST_CHECK(w->mask + 1 == FPWINDOW_TEST_BUCKETS);
+	TEST_CHECK(fpwindow_bytes(size) ==
+		   sizeof(fpwindow_t) +
+		       FPWINDOW_TEST_BUCKETS * sizeof(fpwindow_bucket_t));
+	uint64_t seed = 18;
+	uint64_t hot[FPWINDOW_TEST_HOT];
+	for (int i = 0; i < FPWINDOW_TEST_HOT; i++) {
+		hot[i] = test_rand(&seed);
+		TEST_CHECK(!fpwindow_check_and_set(w, hot[i]));
+	}
+	for (int r = 0; r < FPWINDOW_TEST_ROUNDS; r++) {
+		for (int i = 0; i < FPWINDOW_TEST_COLD; i++) {
+			uint64_t k = test_rand(&seed);
+			TEST_CHECK(!fpwindow_check_and_set(w, k));
+		}
+		for (int i = 0; i < FPWINDOW_TEST_HOT; i++) {
+			TEST_CHECK(fpwindow_check_and_set(w, hot[i]));
+		}
+	}
+	fpwindow_free(w);
+	return EXIT_SUCCESS;
+}
+
+int test_fpwindow(void)
+{
+	if (test_fpwindow_order() != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+	return test_fpwindow_recent();
+}
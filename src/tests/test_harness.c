@@ -19,18 +19,21 @@
 #include <time.h>
 #include <getopt.h>
 
+#include <arpa/inet.h>
 #include <pcap/pcap.h>
 #include <json.h>
 #include <pthread.h>
 
 #include "../lib/includes.h"
 #include "../lib/blocklist.h"
+#include "../lib/cpu.h"
 #include "../lib/logger.h"
 #include "../lib/random.h"
 #include "../lib/util.h"
 #include "../lib/xalloc.h"
 
 #include "aesrand.h"
+#include "cyclic.h"
 #include "send.h"
 #include "recv.h"
 #include "state.h"
@@ -43,6 +46,8 @@
 #include "probe_modules/probe_modules.h"
 #include "output_modules/module_json.h"
 #include "ztopt.h"
+#include "bench.h"
+#include "tests.h"
 
 int test_recursive_fieldsets(void)
 {
@@ -67,6 +72,163 @@ int test_recursive_fieldsets(void)
 	return EXIT_SUCCESS;
 }
 
+static const struct unit_test {
+	const char *name;
+	int (*run)(void);
+} unit_tests[] = {
+    {"fieldset", test_recursive_fieldsets},
+    {"fpset", test_fpset},
+    {"fpwindow", test_fpwindow},
+    {"cbm", test_cbm},
+    {"constraint6", test_constraint6},
+    {"cyclic", test_cyclic},
+    {"validate", test_validate},
+    {"dns", test_dns},
+};
+
+int run_tests(const char *only)
+{
+	int failed = 0;
+	int ran = 0;
+	for (size_t i = 0; i < sizeof(unit_tests) / sizeof(unit_tests[0]);
+	     i++) {
+		const struct unit_test *t = &unit_tests[i];
+		if (only && !strstr(t->name, only)) {
+			continue;
+		}
+		ran++;
+		if (t->run() == EXIT_SUCCESS) {
+			log_info("ztests", "%s: ok", t->name);
+		} else {
+			log_error("ztests", "%s: FAILED", t->name);
+			failed++;
+		}
+	}
+	log_info("ztests", "%d of %d tests passed", ran - failed, ran);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#define BENCH_CYCLIC_STEPS 100000000
+
+// Compare candidates per second of the reference multiply-and-divide step
+// with cyclic_mulmod() for every group size the scanner can pick.
+int bench_cyclic(void)
+{
+	const uint64_t sizes[] = {1ULL << 8, 1ULL << 16, 1ULL << 24, 1ULL << 28,
+				  1ULL << 32, 1ULL << 33, 1ULL << 34, 1ULL << 36,
+				  1ULL << 40, 1ULL << 44, 1ULL << 48};
+	aesrand_t *aes = aesrand_init_from_seed(1);
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		const cyclic_group_t *group = get_group(sizes[i] - 1);
+		cycle_t cycle = make_cycle(group, aes);
+		uint64_t p = group->prime;
+		uint64_t g = cycle.generator;
+		uint64_t pre = cyclic_mulmod_precompute(g, p);
+
+		uint64_t x = 1;
+		double start = now();
+		for (int j = 0; j < BENCH_CYCLIC_STEPS; j++) {
+#ifdef __SIZEOF_INT128__
+			x = (uint64_t)((unsigned __int128)x * g % p);
+#else
+			x = x * g % p;
+#endif
+		}
+		double divide = now() - start;
+		uint64_t expected = x;
+
+		x = 1;
+		start = now();
+		for (int j = 0; j < BENCH_CYCLIC_STEPS; j++) {
+			x = cyclic_mulmod(x, g, pre, p);
+		}
+		double mulmod = now() - start;
+		if (x != expected) {
+			log_fatal("ztests", "cyclic_mulmod mismatch for p = %llu",
+				  (unsigned long long)p);
+		}
+		printf("p=%llu divide=%.1fM/s mulmod=%.1fM/s\n",
+		       (unsigned long long)p, BENCH_CYCLIC_STEPS / divide / 1e6,
+		       BENCH_CYCLIC_STEPS / mulmod / 1e6);
+	}
+	aesrand_free(aes);
+	return EXIT_SUCCESS;
+}
+
+#define BENCH_FILTER_RECORDS 4096
+#define BENCH_FILTER_ROUNDS 2000
+
+static uint64_t count_matches(node_t *tree, struct filter_program *prog,
+			      fieldset_t **records)
+{
+	uint64_t matches = 0;
+	for (int r = 0; r < BENCH_FILTER_ROUNDS; r++) {
+		for (int i = 0; i < BENCH_FILTER_RECORDS; i++) {
+			matches += prog ? filter_eval(prog, records[i])
+					: evaluate_expression(tree, records[i]);
+		}
+	}
+	return matches;
+}
+
+// Compare responses per second of walking the parsed filter tree with the
+// compiled program, over synthetic records shaped like a TCP SYN scan's.
+int bench_filter(void)
+{
+	static fielddef_t defs[] = {
+	    {.name = "saddr", .type = "ip", .desc = ""},
+	    {.name = "sport", .type = "int", .desc = ""},
+	    {.name = "classification", .type = "string", .desc = ""},
+	    {.name = "success", .type = "bool", .desc = ""},
+	    {.name = "repeat", .type = "bool", .desc = ""}};
+	static fielddefset_t fds;
+	gen_fielddef_set(&fds, defs, sizeof(defs) / sizeof(defs[0]));
+	fieldset_t **records =
+	    xcalloc(BENCH_FILTER_RECORDS, sizeof(fieldset_t *));
+	for (uint32_t i = 0; i < BENCH_FILTER_RECORDS; i++) {
+		fieldset_t *fs = fs_new_fieldset(&fds);
+		fs_add_ipv4(fs, "saddr", htonl(i * 2654435761u));
+		fs_add_uint64(fs, "sport", i % 2048);
+		fs_add_constchar(fs, "classification", i % 3 ? "synack" : "rst");
+		fs_add_bool(fs, "success", i % 3 != 0);
+		fs_add_bool(fs, "repeat", i % 7 == 0);
+		records[i] = fs;
+	}
+	const char *filters[] = {
+	    "success = 1 && repeat = 0",
+	    "classification = synack || sport > 1000",
+	    "saddr = 10.0.0.0/8 || (sport >= 80 && sport <= 443 && repeat = 0)"};
+	for (size_t f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+		if (!parse_filter_string(strdup(filters[f])) ||
+		    !validate_filter(zconf.filter.expression, &fds)) {
+			log_fatal("ztests", "bad benchmark filter %s",
+				  filters[f]);
+		}
+		node_t *tree = zconf.filter.expression;
+		struct filter_program *prog = filter_compile(tree);
+
+		double start = now();
+		uint64_t expected = count_matches(tree, NULL, records);
+		double walked = now() - start;
+		start = now();
+		uint64_t matches = count_matches(NULL, prog, records);
+		double compiled = now() - start;
+		if (matches != expected) {
+			log_fatal("ztests", "compiled filter mismatch for %s",
+				  filters[f]);
+		}
+		double evals = (double)BENCH_FILTER_RECORDS * BENCH_FILTER_ROUNDS;
+		printf("%s: tree=%.1fM/s compiled=%.1fM/s\n", filters[f],
+		       evals / walked / 1e6, evals / compiled / 1e6);
+		free(prog);
+	}
+	for (int i = 0; i < BENCH_FILTER_RECORDS; i++) {
+		fs_free(records[i]);
+	}
+	free(records);
+	return EXIT_SUCCESS;
+}
+
 int main(UNUSED int argc, UNUSED char **argv)
 {
 	struct gengetopt_args_info args;
@@ -91,6 +253,27 @@ int main(UNUSED int argc, UNUSED char **argv)
 		exit(EXIT_SUCCESS);
 	}
 
+	if (args.cpu_features_given && cpu_restrict(args.cpu_features_arg)) {
+		log_fatal("ztests", "invalid --cpu-features '%s'",
+			  args.cpu_features_arg);
+	}
+	if (args.test_given) {
+		return run_tests(args.test_only_given ? args.test_only_arg
+						      : NULL);
+	}
+	if (args.bench_cyclic_given) {
+		return bench_cyclic();
+	}
+	if (args.bench_filter_given) {
+		return bench_filter();
+	}
+	if (args.bench_given) {
+		if (args.bench_time_arg <= 0) {
+			log_fatal("ztests", "--bench-time must be positive");
+		}
+		return bench_suite(args.bench_only_arg, args.bench_time_arg);
+	}
+
 	for (int i = 0; i < 100000000; i++)
 		test_recursive_fieldsets();
 	return EXIT_SUCCESS;
@@ -0,0 +1,142 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../state.h"
+#include "../validate.h"
+
+#include "tests.h"
+
+typedef struct validate_vector {
+	const char *key;
+	const char *in;
+	const char *out;
+} validate_vector_t;
+
+#define VECTORS(v) (sizeof(v) / sizeof((v)[0]))
+
+// SipHash-1-3 with a 128-bit output of one 16-byte message, from the
+// reference algorithm with its rounds as parameters, which gives the
+// published SipHash-2-4 vectors for 64 and 128 bits. The first sixteen walk
+// every byte value under the key of those vectors.
+static const validate_vector_t siphash_vectors[] = {
+	{"000102030405060708090a0b0c0d0e0f", "000102030405060708090a0b0c0d0e0f",
+	 "d0a8d95715518eebb513b0f83d9e1793"},
+	{"000102030405060708090a0b0c0d0e0f", "101112131415161718191a1b1c1d1e1f",
+	 "c939b05f701f7cbb5d3c25a202d719f3"},
+	{"000102030405060708090a0b0c0d0e0f", "202122232425262728292a2b2c2d2e2f",
+	 "e98ad30256c555fe8614007bbb4412c2"},
+	{"000102030405060708090a0b0c0d0e0f", "303132333435363738393a3b3c3d3e3f",
+	 "d6eaee88a183b3ea2f55ee33e4c80675"},
+	{"000102030405060708090a0b0c0d0e0f", "404142434445464748494a4b4c4d4e4f",
+	 "164bb7d9c9b5176a910e769e6985fef6"},
+	{"000102030405060708090a0b0c0d0e0f", "505152535455565758595a5b5c5d5e5f",
+	 "d8e58a9d7061003bba25c3fefae1ca10"},
+	{"000102030405060708090a0b0c0d0e0f", "606162636465666768696a6b6c6d6e6f",
+	 "694efa8d37e3cbd5ea89ac32bce6269e"},
+	{"000102030405060708090a0b0c0d0e0f", "707172737475767778797a7b7c7d7e7f",
+	 "95f8a73fb68be6394cf4d7cd05fd0a03"},
+	{"000102030405060708090a0b0c0d0e0f", "808182838485868788898a8b8c8d8e8f",
+	 "5b83fea1698c1a821435b45c2b74b1be"},
+	{"000102030405060708090a0b0c0d0e0f", "909192939495969798999a9b9c9d9e9f",
+	 "305565fa4c88ba36923eb16a41822e57"},
+	{"000102030405060708090a0b0c0d0e0f", "a0a1a2a3a4a5a6a7a8a9aaabacadaeaf",
+	 "d647afda7b33562e7c5f369b9653e8c6"},
+	{"000102030405060708090a0b0c0d0e0f", "b0b1b2b3b4b5b6b7b8b9babbbcbdbebf",
+	 "dd1d54d0c70d2f278a3da3561ba0cd9c"},
+	{"000102030405060708090a0b0c0d0e0f", "c0c1c2c3c4c5c6c7c8c9cacbcccdcecf",
+	 "724af1aa9447845bf759bd1d89f7924f"},
+	{"000102030405060708090a0b0c0d0e0f", "d0d1d2d3d4d5d6d7d8d9dadbdcdddedf",
+	 "89b2a36eccae032aaa605f876ca17240"},
+	{"000102030405060708090a0b0c0d0e0f", "e0e1e2e3e4e5e6e7e8e9eaebecedeeef",
+	 "f05913680daa7681d25e9f5af0c3aadb"},
+	{"000102030405060708090a0b0c0d0e0f", "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff",
+	 "ec3ba3de8c7e4e7a84fe7e06432b0cdc"},
+	{"00000000000000000000000000000000", "00000000000000000000000000000000",
+	 "6aaca6deedd20b5e02af71321214acbb"},
+	{"ffffffffffffffffffffffffffffffff", "ffffffffffffffffffffffffffffffff",
+	 "c4c50139fe7c26d137b0b7dd5b023d97"},
+};
+
+// FIPS-197 appendix C.1
+static const validate_vector_t aes_vectors[] = {
+	{"000102030405060708090a0b0c0d0e0f", "00112233445566778899aabbccddeeff",
+	 "69c4e0d86a7b0430d8cdb78070b4c55a"},
+};
+
+static void from_hex(const char *hex, uint8_t out[VALIDATE_BYTES])
+{
+	for (int i = 0; i < VALIDATE_BYTES; i++) {
+		unsigned int b;
+		sscanf(hex + 2 * i, "%2x", &b);
+		out[i] = (uint8_t)b;
+	}
+}
+
+// Keys validation with key for method through a key file, as --replay-pcap
+// does
+static int load_key(const char *key, int method)
+{
+	char path[] = "/tmp/ztests-validate-XXXXXX";
+	int fd = mkstemp(path);
+	TEST_CHECK(fd >= 0);
+	FILE *f = fdopen(fd, "w");
+	TEST_CHECK(f);
+	fprintf(f, "%s\n%s\n", key, VALIDATION_METHOD_NAMES[method]);
+	fclose(f);
+	zconf.validation_method = VALIDATION_METHOD_AUTO;
+	int ret = validate_load_key(path);
+	unlink(path);
+	TEST_CHECK(ret == EXIT_SUCCESS);
+	TEST_CHECK(zconf.validation_method == method);
+	return EXIT_SUCCESS;
+}
+
+// Each vector through validate_gen_ex() and validate_gen_batch(), with the
+// input words as they are laid out in memory
+static int check_vectors(const validate_vector_t *v, size_t n, int method)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (load_key(v[i].key, method) != EXIT_SUCCESS) {
+			return EXIT_FAILURE;
+		}
+		validate_input_t in;
+		uint8_t want[VALIDATE_BYTES];
+		uint8_t out[VALIDATE_BYTES];
+		uint8_t batch[3][VALIDATE_BYTES];
+		from_hex(v[i].in, (uint8_t *)&in);
+		from_hex(v[i].out, want);
+		validate_gen_ex(in.input[0], in.input[1], in.input[2],
+				in.input[3], out);
+		TEST_CHECK(!memcmp(out, want, VALIDATE_BYTES));
+		validate_input_t ins[3] = {in, in, in};
+		ins[1].input[0] ^= 1;
+		validate_gen_batch(ins, batch, 3);
+		TEST_CHECK(!memcmp(batch[0], want, VALIDATE_BYTES));
+		TEST_CHECK(memcmp(batch[1], want, VALIDATE_BYTES));
+		TEST_CHECK(!memcmp(batch[2], want, VALIDATE_BYTES));
+	}
+	return EXIT_SUCCESS;
+}
+
+int test_validate(void)
+{
+	int saved = zconf.validation_method;
+	int ret = check_vectors(siphash_vectors, VECTORS(siphash_vectors),
+				VALIDATION_METHOD_SIPHASH);
+	if (ret == EXIT_SUCCESS) {
+		ret = check_vectors(aes_vectors, VECTORS(aes_vectors),
+				    VALIDATION_METHOD_AES);
+	}
+	zconf.validation_method = saved;
+	return ret;
+}
@@ -0,0 +1,50 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_TESTS_TESTS_H
+#define ZMAP_TESTS_TESTS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../../lib/logger.h"
+
+// The unit tests ztests --test runs. Each returns EXIT_SUCCESS, or logs the
+// first check that failed and returns EXIT_FAILURE.
+#define TEST_CHECK(cond)                                                       \
+	do {                                                                   \
+		if (!(cond)) {                                                 \
+			log_error("ztests", "%s:%d: check failed: %s",         \
+				  __FILE__, __LINE__, #cond);                  \
+			return EXIT_FAILURE;                                   \
+		}                                                              \
+	} while (0)
+
+// splitmix64, so that the randomized tests check the same cases every run
+static inline uint64_t test_rand(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+int test_recursive_fieldsets(void);
+int test_fpset(void);
+int test_fpwindow(void);
+int test_cbm(void);
+int test_constraint6(void);
+int test_cyclic(void);
+int test_validate(void);
+int test_dns(void);
+
+// Runs the tests whose name contains only, or all of them when it is NULL,
+// and returns EXIT_FAILURE if any failed
+int run_tests(const char *only);
+
+#endif /* ZMAP_TESTS_TESTS_H */
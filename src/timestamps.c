@@ -0,0 +1,117 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "timestamps.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#if defined(__linux__)
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#endif
+
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+// key is the destination with bit 32 set, 0 while the slot is written
+struct tx_stamp {
+	uint64_t key;
+	uint64_t ns;
+};
+
+static struct tx_stamp *tx_stamps = NULL;
+static uint64_t tx_recorded = 0;
+
+int timestamps_enable_hardware(const char *ifname, int tx)
+{
+#if defined(__linux__)
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	struct hwtstamp_config cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.tx_type = tx ? HWTSTAMP_TX_ON : HWTSTAMP_TX_OFF;
+	cfg.rx_filter = HWTSTAMP_FILTER_ALL;
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+	ifr.ifr_data = (void *)&cfg;
+	int rc = ioctl(fd, SIOCSHWTSTAMP, &ifr);
+	int err = errno;
+	close(fd);
+	if (rc < 0) {
+		errno = err;
+		return -1;
+	}
+	// a NIC unable to stamp everything received may settle for less
+	if (cfg.rx_filter == HWTSTAMP_FILTER_NONE) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return 0;
+#else
+	(void)ifname;
+	(void)tx;
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+void tx_stamps_init(void)
+{
+	tx_stamps = xcalloc(TX_STAMPS_SLOTS, sizeof(struct tx_stamp));
+}
+
+static inline struct tx_stamp *slot_of(ipaddr_n_t dst)
+{
+	uint32_t h = dst * 0x9e3779b1u;
+	return &tx_stamps[h >> (32 - 20)];
+}
+
+void tx_stamps_record(ipaddr_n_t dst, uint64_t ns)
+{
+	if (!tx_stamps) {
+		return;
+	}
+	struct tx_stamp *s = slot_of(dst);
+	__atomic_store_n(&s->key, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&s->ns, ns, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->key, (uint64_t)1 << 32 | dst, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&tx_recorded, 1, __ATOMIC_RELAXED);
+}
+
+int tx_stamps_lookup(ipaddr_n_t dst, uint64_t *ns)
+{
+	if (!tx_stamps) {
+		return 0;
+	}
+	const struct tx_stamp *s = slot_of(dst);
+	uint64_t want = (uint64_t)1 << 32 | dst;
+	if (__atomic_load_n(&s->key, __ATOMIC_ACQUIRE) != want) {
+		return 0;
+	}
+	uint64_t v = __atomic_load_n(&s->ns, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	// rewritten for another destination meanwhile
+	if (__atomic_load_n(&s->key, __ATOMIC_RELAXED) != want) {
+		return 0;
+	}
+	*ns = v;
+	return 1;
+}
+
+uint64_t tx_stamps_recorded(void)
+{
+	return __atomic_load_n(&tx_recorded, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,43 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_TIMESTAMPS_H
+#define ZMAP_TIMESTAMPS_H
+
+#include <stdint.h>
+
+#include "../lib/types.h"
+
+/*
+ * Responses are stamped in nanoseconds, by the kernel as they arrive
+ * (--timestamps=software) or by the NIC (--timestamps=hardware). With
+ * --tx-timestamps the Linux raw socket sender also has the kernel or NIC
+ * stamp every probe as it leaves, and keeps the latest stamp of each IPv4
+ * destination in a direct-mapped table for the probe modules that measure
+ * round-trip times, which then no longer include the time a probe spent
+ * between being built and reaching the wire. A destination whose slot was
+ * since taken by another, or whose stamp hasn't come back yet, falls back
+ * to the time the probe module wrote into the probe.
+ */
+
+#define TX_STAMPS_SLOTS (1 << 20)
+
+// Turn on hardware timestamping on the NIC, which the kernel leaves off: of
+// received packets, and with tx of sent ones. Linux only; 0 on success.
+int timestamps_enable_hardware(const char *ifname, int tx);
+
+// allocate the table, with --tx-timestamps only
+void tx_stamps_init(void);
+// the stamp, in ns, of a probe to dst (network order) that left
+void tx_stamps_record(ipaddr_n_t dst, uint64_t ns);
+// the stamp of the last probe to dst that the table still holds
+int tx_stamps_lookup(ipaddr_n_t dst, uint64_t *ns);
+// stamps recorded so far
+uint64_t tx_stamps_recorded(void);
+
+#endif /* ZMAP_TIMESTAMPS_H */
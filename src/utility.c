@@ -6,12 +6,14 @@
  * of the License at http://www.apache.org/licenses/LICENSE-2.0
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
 
 #include "state.h"
 #include "utility.h"
 #include "../lib/logger.h"
+#include "../lib/xalloc.h"
 
 in_addr_t string_to_ip_address(char *t)
 {
@@ -22,53 +24,83 @@ in_addr_t string_to_ip_address(char *t)
 	return r;
 }
 
-void add_to_array(char *to_add)
+// Pools are kept in arrays sized to the next power of two of their count,
+// so that adding addresses one by one or a range at a time both stay linear.
+static void reserve_source_ips(in_addr_t **ips, uint32_t count, uint64_t n)
 {
-	if (zconf.number_source_ips >= 256) {
-		// log fatal here
-		log_fatal("parse", "over 256 source IP addresses provided");
+	if (count + n > MAX_SOURCE_IPS) {
+		log_fatal("parse", "over %u source IP addresses provided",
+			  MAX_SOURCE_IPS);
+	}
+	uint64_t have = 1;
+	while (have < count) {
+		have <<= 1;
+	}
+	if (!count) {
+		have = 0;
+	}
+	uint64_t want = 1;
+	while (want < count + n) {
+		want <<= 1;
+	}
+	if (want > have) {
+		*ips = xrealloc(*ips, want * sizeof(in_addr_t));
 	}
-	log_debug("SEND", "ipaddress: %s\n", to_add);
-	zconf.source_ip_addresses[zconf.number_source_ips] =
-	    string_to_ip_address(to_add);
-	zconf.number_source_ips++;
 }
 
-void parse_source_ip_addresses(char given_string[])
+// first to last, in host order
+static void add_source_range(uint32_t first, uint32_t last, in_addr_t **ips,
+			     uint32_t *count)
 {
-	char *dash = strchr(given_string, '-');
-	char *comma = strchr(given_string, ',');
-	if (dash && comma) {
-		*comma = '\0';
-		parse_source_ip_addresses(given_string);
-		parse_source_ip_addresses(comma + 1);
-	} else if (comma) {
-		while (comma) {
-			*comma = '\0';
-			add_to_array(given_string);
-			given_string = comma + 1;
-			comma = strchr(given_string, ',');
-			if (!comma) {
-				add_to_array(given_string);
+	if (last < first) {
+		log_fatal("parse", "invalid source IP range: last address is "
+				   "less than the first");
+	}
+	reserve_source_ips(ips, *count, (uint64_t)last - first + 1);
+	for (uint64_t ip = first; ip <= last; ip++) {
+		(*ips)[(*count)++] = htonl((uint32_t)ip);
+	}
+}
+
+void parse_source_ips(char given_string[], in_addr_t **ips, uint32_t *count)
+{
+	char *saveptr = NULL;
+	for (char *tok = strtok_r(given_string, ",", &saveptr); tok;
+	     tok = strtok_r(NULL, ",", &saveptr)) {
+		char *dash = strchr(tok, '-');
+		char *slash = strchr(tok, '/');
+		if (dash) {
+			*dash = '\0';
+			log_debug("SEND", "address: %s\n", tok);
+			log_debug("SEND", "address: %s\n", dash + 1);
+			add_source_range(ntohl(string_to_ip_address(tok)),
+					 ntohl(string_to_ip_address(dash + 1)),
+					 ips, count);
+		} else if (slash) {
+			*slash = '\0';
+			char *end;
+			long len = strtol(slash + 1, &end, 10);
+			if (*end || end == slash + 1 || len < 0 || len > 32) {
+				log_fatal("parse", "invalid source IP prefix length: `%s'",
+					  slash + 1);
 			}
+			uint32_t mask = len ? 0xFFFFFFFFu << (32 - len) : 0;
+			uint32_t base = ntohl(string_to_ip_address(tok)) & mask;
+			add_source_range(base, base | ~mask, ips, count);
+		} else {
+			log_debug("SEND", "ipaddress: %s\n", tok);
+			reserve_source_ips(ips, *count, 1);
+			(*ips)[(*count)++] = string_to_ip_address(tok);
 		}
-	} else if (dash) {
-		*dash = '\0';
-		log_debug("SEND", "address: %s\n", given_string);
-		log_debug("SEND", "address: %s\n", dash + 1);
-		in_addr_t start = ntohl(string_to_ip_address(given_string));
-		in_addr_t end = ntohl(string_to_ip_address(dash + 1)) + 1;
-		while (start != end) {
-			struct in_addr temp;
-			temp.s_addr = htonl(start);
-			add_to_array(strdup(inet_ntoa(temp)));
-			start++;
-		}
-	} else {
-		add_to_array(given_string);
 	}
 }
 
+void parse_source_ip_addresses(char given_string[])
+{
+	parse_source_ips(given_string, &zconf.source_ip_addresses,
+			 &zconf.number_source_ips);
+}
+
 // Not all platforms have strlcpy, so we provide our own using strncpy
 size_t cross_platform_strlcpy(char *dst, const char *src, size_t siz)
 {
@@ -17,9 +17,16 @@
 #ifndef UTILITY_H
 #define UTILITY_H
 
+#include <stdint.h>
 #include <netinet/in.h>
 
+// the size a pool of source addresses may grow to, a /8
+#define MAX_SOURCE_IPS (1u << 24)
+
+// -S: addresses, ranges (a-b) and prefixes (a/len), separated by commas
 void parse_source_ip_addresses(char given_string[]);
+// the same, onto the pool in *ips, which is grown as needed
+void parse_source_ips(char given_string[], in_addr_t **ips, uint32_t *count);
 in_addr_t string_to_ip_address(char *t);
 
 size_t cross_platform_strlcpy(char *dst, const char *src, size_t siz);
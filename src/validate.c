@@ -7,31 +7,234 @@
  */
 
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <assert.h>
 #include "../lib/aes128.h"
 #include "../lib/random.h"
 #include "../lib/logger.h"
+#include "state.h"
 #include "validate.h"
 
-#define AES_BLOCK_WORDS 4
 
 
 static aes128_ctx_t *aes128 = NULL;
+// kept for validate_save_key(), and SipHash's key
+static uint8_t aes128_key[AES128_KEY_BYTES];
+static int keyed = 0;
+static uint64_t sip_k0, sip_k1;
 
 /*
  * validate.c encrypts the src IP, dst IP and source port of a probe into a 16-bit value put in the IPID.
  * We use a random key to encrypt the values, static across this ZMap run, so we can
  * identify packets that came form this ZMap scan.
  * This is used to validate a probe response and ensure it is a response to a probe we sent in this ZMap run.
+ *
+ * Without AES instructions the table AES costs more than building the
+ * packet, so --validation-method=auto keys the 128-bit output of
+ * SipHash-1-3 with the same 16-byte key instead.
  */
 
+static inline uint64_t load_le64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i--) {
+		v = v << 8 | p[i];
+	}
+	return v;
+}
+
+static inline void store_le64(uint8_t *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++) {
+		p[i] = (uint8_t)(v >> (8 * i));
+	}
+}
+
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND                                                              \
+	do {                                                                   \
+		v0 += v1;                                                      \
+		v1 = SIP_ROTL(v1, 13);                                         \
+		v1 ^= v0;                                                      \
+		v0 = SIP_ROTL(v0, 32);                                         \
+		v2 += v3;                                                      \
+		v3 = SIP_ROTL(v3, 16);                                         \
+		v3 ^= v2;                                                      \
+		v0 += v3;                                                      \
+		v3 = SIP_ROTL(v3, 21);                                         \
+		v3 ^= v0;                                                      \
+		v2 += v1;                                                      \
+		v1 = SIP_ROTL(v1, 17);                                         \
+		v1 ^= v2;                                                      \
+		v2 = SIP_ROTL(v2, 32);                                         \
+	} while (0)
+
+// SipHash-1-3 with a 128-bit output of one 16-byte block: one round per
+// message word and the length, three for each half of the output
+static inline void siphash13_128(const uint8_t in[VALIDATE_BYTES],
+				 uint8_t out[VALIDATE_BYTES])
+{
+	uint64_t v0 = 0x736f6d6570736575ULL ^ sip_k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ sip_k1 ^ 0xee;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ sip_k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ sip_k1;
+	for (int i = 0; i < 2; i++) {
+		uint64_t m = load_le64(in + 8 * i);
+		v3 ^= m;
+		SIP_ROUND;
+		v0 ^= m;
+	}
+	const uint64_t b = (uint64_t)VALIDATE_BYTES << 56;
+	v3 ^= b;
+	SIP_ROUND;
+	v0 ^= b;
+	v2 ^= 0xee;
+	SIP_ROUND;
+	SIP_ROUND;
+	SIP_ROUND;
+	store_le64(out, v0 ^ v1 ^ v2 ^ v3);
+	v1 ^= 0xdd;
+	SIP_ROUND;
+	SIP_ROUND;
+	SIP_ROUND;
+	store_le64(out + 8, v0 ^ v1 ^ v2 ^ v3);
+}
+
+// the one block of either method
+static inline void validate_block(const uint8_t in[VALIDATE_BYTES],
+				  uint8_t out[VALIDATE_BYTES])
+{
+	if (zconf.validation_method == VALIDATION_METHOD_SIPHASH) {
+		siphash13_128(in, out);
+	} else {
+		aes128_encrypt_block(aes128, in, out);
+	}
+}
+
+static void validate_set_key(const uint8_t key[AES128_KEY_BYTES])
+{
+	if (zconf.validation_method == VALIDATION_METHOD_AUTO) {
+		zconf.validation_method = aes128_hw_available()
+					      ? VALIDATION_METHOD_AES
+					      : VALIDATION_METHOD_SIPHASH;
+	}
+	memcpy(aes128_key, key, AES128_KEY_BYTES);
+	if (zconf.validation_method == VALIDATION_METHOD_AES) {
+		aes128 = aes128_init(key);
+	}
+	sip_k0 = load_le64(key);
+	sip_k1 = load_le64(key + 8);
+	keyed = 1;
+	log_debug("validate", "validating with %s",
+		  VALIDATION_METHOD_NAMES[zconf.validation_method]);
+}
+
 void validate_init(void)
 {
 	uint8_t key[AES128_KEY_BYTES];
 	if (!random_bytes(key, sizeof(key))) {
 		log_fatal("validate", "couldn't get random bytes");
 	}
-	aes128 = aes128_init(key);
+	validate_set_key(key);
+}
+
+const char *validate_method_name(void)
+{
+	return VALIDATION_METHOD_NAMES[zconf.validation_method];
+}
+
+int validate_save_key(const char *path)
+{
+	assert(keyed);
+	// the key lets anyone forge responses to the scan, so only the
+	// owner may read it
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		log_error("validate", "could not open %s: %s", path,
+			  strerror(errno));
+		return EXIT_FAILURE;
+	}
+	// the method follows the key, on a line of its own unless it is AES,
+	// which is what a key alone means
+	char hex[2 * AES128_KEY_BYTES + 32];
+	for (int i = 0; i < AES128_KEY_BYTES; i++) {
+		snprintf(hex + 2 * i, 3, "%02x", aes128_key[i]);
+	}
+	hex[2 * AES128_KEY_BYTES] = '\n';
+	hex[2 * AES128_KEY_BYTES + 1] = '\0';
+	if (zconf.validation_method != VALIDATION_METHOD_AES) {
+		snprintf(hex + 2 * AES128_KEY_BYTES + 1,
+			 sizeof(hex) - 2 * AES128_KEY_BYTES - 1, "%s\n",
+			 validate_method_name());
+	}
+	ssize_t n = write(fd, hex, strlen(hex));
+	if (close(fd) || n != (ssize_t)strlen(hex)) {
+		log_error("validate", "could not write %s", path);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+int validate_load_key(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		log_error("validate", "could not open %s: %s", path,
+			  strerror(errno));
+		return EXIT_FAILURE;
+	}
+	char line[128], method[128];
+	int ok = fgets(line, sizeof(line), f) != NULL;
+	int has_method = ok && fgets(method, sizeof(method), f) != NULL;
+	fclose(f);
+	line[ok ? strcspn(line, "\r\n") : 0] = '\0';
+	int m = VALIDATION_METHOD_AES;
+	if (has_method) {
+		method[strcspn(method, "\r\n")] = '\0';
+		for (m = VALIDATION_METHOD_AES; m <= VALIDATION_METHOD_SIPHASH;
+		     m++) {
+			if (!strcmp(method, VALIDATION_METHOD_NAMES[m])) {
+				break;
+			}
+		}
+		if (m > VALIDATION_METHOD_SIPHASH) {
+			log_error("validate",
+				  "%s names an unknown validation method %s",
+				  path, method);
+			return EXIT_FAILURE;
+		}
+	}
+	if (zconf.validation_method != VALIDATION_METHOD_AUTO &&
+	    zconf.validation_method != m) {
+		log_error("validate", "%s is a key for --validation-method=%s",
+			  path, VALIDATION_METHOD_NAMES[m]);
+		return EXIT_FAILURE;
+	}
+	zconf.validation_method = m;
+	if (strlen(line) != 2 * AES128_KEY_BYTES) {
+		log_error("validate", "%s does not hold a validation key of "
+				      "%d hex digits",
+			  path, 2 * AES128_KEY_BYTES);
+		return EXIT_FAILURE;
+	}
+	uint8_t key[AES128_KEY_BYTES];
+	for (int i = 0; i < AES128_KEY_BYTES; i++) {
+		unsigned int b;
+		if (sscanf(line + 2 * i, "%2x", &b) != 1) {
+			log_error("validate", "%s does not hold a validation "
+					      "key of %d hex digits",
+				  path, 2 * AES128_KEY_BYTES);
+			return EXIT_FAILURE;
+		}
+		key[i] = (uint8_t)b;
+	}
+	validate_set_key(key);
+	return EXIT_SUCCESS;
 }
 
 void validate_gen(const uint32_t src, const uint32_t dst,
@@ -44,25 +247,38 @@ void validate_gen_ex(const uint32_t input0, const uint32_t input1,
 		     const uint32_t input2, const uint32_t input3,
 		     uint8_t output[VALIDATE_BYTES])
 {
-	assert(aes128);
+	assert(keyed);
 
 	uint32_t aes_input[AES128_BLOCK_BYTES / sizeof(uint32_t)];
 	aes_input[0] = input0;
 	aes_input[1] = input1;
 	aes_input[2] = input2;
 	aes_input[3] = input3;
-	aes128_encrypt_block(aes128, (uint8_t *)aes_input, output);
+	validate_block((uint8_t *)aes_input, output);
+}
+
+void validate_gen_batch(const validate_input_t *input,
+			uint8_t (*output)[VALIDATE_BYTES], size_t n)
+{
+	assert(keyed);
+	_Static_assert(sizeof(validate_input_t) == AES128_BLOCK_BYTES,
+		       "validate_input_t must be one AES block");
+	if (zconf.validation_method == VALIDATION_METHOD_SIPHASH) {
+		// independent, so the rounds of neighbouring blocks overlap
+		for (size_t i = 0; i < n; i++) {
+			siphash13_128((const uint8_t *)&input[i], output[i]);
+		}
+		return;
+	}
+	aes128_encrypt_blocks(aes128, (const uint8_t *)input, (uint8_t *)output, n);
 }
 
 void validate_gen_ipv6(const struct in6_addr *src, const struct in6_addr *dst,
 				__attribute__((unused)) const uint16_t dst_port, uint8_t output[VALIDATE_BYTES])
 {
-	assert(aes128);
+	assert(keyed);
 
-	uint32_t aes_input[AES_BLOCK_WORDS];
-	for (int i = 0; i < AES_BLOCK_WORDS; i++) {
-		// XOR IPv6 src and dst
-		aes_input[i] = ((uint32_t *) src)[i] ^ ((uint32_t *) dst)[i];
-	}
-	aes128_encrypt_block(aes128, (uint8_t *)aes_input, output);
+	// XOR of IPv6 src and dst
+	validate_input_t aes_input = validate_input_ipv6(src, dst);
+	validate_block((uint8_t *)&aes_input, output);
 }
@@ -9,15 +9,57 @@
 #ifndef VALIDATE_H
 #define VALIDATE_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <netinet/in.h>
 
 #define VALIDATE_BYTES 16
 
+// Keys the validations from a random key, with --validation-method or,
+// for auto, AES where the CPU has AES instructions and SipHash-1-3
+// elsewhere.
 void validate_init(void);
+// the method chosen, for the metadata
+const char *validate_method_name(void);
+// The key of this scan, as hex in a file followed by the method unless it
+// is AES, so that a capture of its responses can be validated again with
+// --replay-pcap. Both log why they failed and return EXIT_FAILURE.
+int validate_save_key(const char *path);
+int validate_load_key(const char *path);
 void validate_gen(const uint32_t src, const uint32_t dst, const uint16_t dst_port, uint8_t output[VALIDATE_BYTES]);
 void validate_gen_ipv6(const struct in6_addr *src, const struct in6_addr *dst, const uint16_t dst_port, uint8_t output[VALIDATE_BYTES]);
 void validate_gen_ex(const uint32_t input0, const uint32_t input1,
 		     const uint32_t input2, const uint32_t input3,
 		     uint8_t output[VALIDATE_BYTES]);
 
+// Input block of one validation, in validate_gen_ex() argument order.
+typedef struct validate_input {
+	uint32_t input[VALIDATE_BYTES / sizeof(uint32_t)];
+} validate_input_t;
+
+// The input validate_gen() would encrypt for (src, dst, dst_port)
+static inline validate_input_t validate_input(const uint32_t src,
+					      const uint32_t dst,
+					      const uint16_t dst_port)
+{
+	return (validate_input_t){.input = {src, dst, (uint32_t)dst_port, 0}};
+}
+
+// The input validate_gen_ipv6() would encrypt for (src, dst)
+static inline validate_input_t validate_input_ipv6(const struct in6_addr *src,
+						   const struct in6_addr *dst)
+{
+	validate_input_t in;
+	for (size_t i = 0; i < VALIDATE_BYTES / sizeof(uint32_t); i++) {
+		in.input[i] = ((const uint32_t *)src)[i] ^
+			      ((const uint32_t *)dst)[i];
+	}
+	return in;
+}
+
+// Compute n validations at once, which lets the rounds of independent
+// blocks overlap. output[i] is the validation of input[i].
+void validate_gen_batch(const validate_input_t *input,
+			uint8_t (*output)[VALIDATE_BYTES], size_t n);
+
 #endif //_VALIDATE_H
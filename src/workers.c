@@ -0,0 +1,455 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "workers.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/shmring.h"
+#include "../lib/statshm.h"
+#include "../lib/util.h"
+#include "../lib/xalloc.h"
+
+#include "fieldset.h"
+#include "output-queue.h"
+#include "state.h"
+#include "output_modules/output_modules.h"
+
+#define LOGGER_NAME "workers"
+
+// results a worker can get ahead of the supervisor by
+#define RING_BYTES (8 << 20)
+// records drained from one ring before looking at the others
+#define DRAIN_BATCH 256
+
+struct worker {
+	pid_t pid;
+	int running;
+	int failed;
+	char ring_name[64];
+	char stats_name[64];
+	shmring_t *ring;
+	statshm_t *stats;
+	uint8_t *snapshot; // the last consistent copy of stats
+};
+
+static struct worker *workers = NULL;
+static uint32_t num_workers = 0;
+static uint32_t failed = 0;
+
+// in a worker: the producer half of its ring
+static shmring_t *ring = NULL;
+static fieldset_t *scratch = NULL;
+static uint64_t ring_drops = 0;
+
+static int worker_process_view(fs_view_t *v)
+{
+	if (!scratch) {
+		scratch = fs_new_heap_fieldset(MAX_FIELDS);
+	}
+	fs_translate_into(scratch, v->fs, (translation_t *)v->t);
+	size_t size = output_record_encode(scratch, NULL);
+	uint32_t need = sizeof(shmring_record_t) +
+			shmring_field_size(0, (uint32_t)size);
+	shmring_record_t *rec = NULL;
+	if (size <= UINT32_MAX / 2) {
+		rec = shmring_reserve(ring, need, 1);
+	}
+	if (!rec) {
+		// only a record longer than a quarter of the ring
+		ring_drops++;
+		log_debug(LOGGER_NAME, "dropping a result of %zu bytes", size);
+		return EXIT_SUCCESS;
+	}
+	rec->num_fields = 1;
+	shmring_field_t *f = (shmring_field_t *)(rec + 1);
+	f->type = SHMRING_BINARY;
+	f->name_len = 0;
+	f->reserved = 0;
+	f->len = (uint32_t)size;
+	output_record_encode(scratch, (uint8_t *)(f + 1));
+	shmring_publish(ring);
+	return EXIT_SUCCESS;
+}
+
+static int worker_close(UNUSED struct state_conf *c,
+			UNUSED struct state_send *s, UNUSED struct state_recv *r)
+{
+	if (ring_drops) {
+		log_warn(LOGGER_NAME, "%" PRIu64 " results too long to hand "
+				      "to the supervisor",
+			 ring_drops);
+	}
+	shmring_close(ring);
+	ring = NULL;
+	return EXIT_SUCCESS;
+}
+
+// stands in for the output module in the workers
+static output_module_t module_worker = {
+    .name = "worker",
+    .process_view = &worker_process_view,
+    .close = &worker_close,
+};
+
+static void share(uint64_t total, uint32_t i, uint32_t n, uint64_t *first,
+		  uint64_t *count)
+{
+	*first = total / n * i + (i < total % n ? i : total % n);
+	*count = total / n + (i < total % n);
+}
+
+static void become_worker(uint32_t i)
+{
+	struct worker *w = &workers[i];
+	uint32_t n = num_workers;
+	zconf.shard_num = zconf.shard_num * n + i;
+	zconf.total_shards = zconf.total_shards * n;
+
+	uint64_t first, count;
+	share(zconf.source_port_last - zconf.source_port_first + 1, i, n,
+	      &first, &count);
+	zconf.source_port_first += first;
+	zconf.source_port_last = zconf.source_port_first + count - 1;
+
+	if (zconf.rate > 0) {
+		share(zconf.rate, i, n, &first, &count);
+		zconf.rate = count ? count : 1;
+	}
+	if (zconf.adaptive_rate > 0) {
+		share(zconf.adaptive_rate, i, n, &first, &count);
+		zconf.adaptive_rate = count ? count : 1;
+	}
+	if (zconf.bandwidth > 0) {
+		share(zconf.bandwidth, i, n, &first, &count);
+		zconf.bandwidth = count ? count : 1;
+	}
+	if (zsend.max_targets) {
+		share(zsend.max_targets, i, n, &first, &count);
+		zsend.max_targets = count ? count : 1;
+	}
+
+	// the cores after those of the workers before
+	uint32_t per_worker = zconf.senders + zconf.recv_threads + 1;
+	uint32_t *cores = xmalloc(zconf.pin_cores_len * sizeof(uint32_t));
+	for (uint32_t c = 0; c < zconf.pin_cores_len; c++) {
+		cores[c] = zconf.pin_cores[(c + i * per_worker) %
+					 zconf.pin_cores_len];
+	}
+	zconf.pin_cores = cores;
+
+	// the supervisor shows the status and writes the metadata
+	zconf.quiet = 1;
+	zconf.status_updates_file = NULL;
+	zconf.metadata_filename = NULL;
+	zconf.metadata_file = NULL;
+	zconf.stats_shm = w->stats_name;
+	zconf.output_module = &module_worker;
+
+	// the supervisor's ends
+	for (uint32_t j = 0; j < n; j++) {
+		shmring_detach(workers[j].ring, NULL, 0);
+		workers[j].ring = NULL;
+	}
+	log_debug(LOGGER_NAME,
+		  "worker %u: shard %hu of %hu, source ports %u-%u", i,
+		  zconf.shard_num, zconf.total_shards, zconf.source_port_first,
+		  zconf.source_port_last);
+}
+
+int workers_fork(void)
+{
+	num_workers = zconf.worker_processes;
+	workers = xcalloc(num_workers, sizeof(struct worker));
+	const char *names[] = {"record"};
+	const uint8_t types[] = {SHMRING_BINARY};
+	shmring_t **producers = xcalloc(num_workers, sizeof(shmring_t *));
+	for (uint32_t i = 0; i < num_workers; i++) {
+		struct worker *w = &workers[i];
+		snprintf(w->ring_name, sizeof(w->ring_name), "/zmap-%d-%u",
+			 (int)getpid(), i);
+		snprintf(w->stats_name, sizeof(w->stats_name),
+			 "/zmap-%d-%u-stats", (int)getpid(), i);
+		producers[i] =
+		    shmring_create(w->ring_name, RING_BYTES, names, types, 1);
+		if (!producers[i]) {
+			log_fatal(LOGGER_NAME, "unable to create %s: %s",
+				  w->ring_name, strerror(errno));
+		}
+		w->ring = shmring_open(w->ring_name);
+		if (!w->ring) {
+			log_fatal(LOGGER_NAME, "unable to open %s: %s",
+				  w->ring_name, strerror(errno));
+		}
+		// mapped on both sides by now, nothing is left behind
+		shm_unlink(w->ring_name);
+	}
+
+	// nothing buffered may be written out twice
+	log_async_stop();
+	fflush(NULL);
+	for (uint32_t i = 0; i < num_workers; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			log_fatal(LOGGER_NAME, "unable to fork worker %u: %s", i,
+				  strerror(errno));
+		}
+		if (pid == 0) {
+			ring = producers[i];
+			for (uint32_t j = 0; j < num_workers; j++) {
+				if (j != i) {
+					munmap(producers[j]->hdr,
+					       producers[j]->map_len);
+					free(producers[j]);
+				}
+			}
+			free(producers);
+			become_worker(i);
+			if (log_async_start()) {
+				log_fatal(LOGGER_NAME,
+					  "unable to start the log thread");
+			}
+			return 1;
+		}
+		workers[i].pid = pid;
+		workers[i].running = 1;
+	}
+	// the workers' ends, without marking the rings closed
+	for (uint32_t i = 0; i < num_workers; i++) {
+		munmap(producers[i]->hdr, producers[i]->map_len);
+		free(producers[i]);
+	}
+	free(producers);
+	if (log_async_start()) {
+		log_fatal(LOGGER_NAME, "unable to start the log thread");
+	}
+	log_info(LOGGER_NAME, "started %u worker processes", num_workers);
+	return 0;
+}
+
+static int drain(struct worker *w)
+{
+	int n = 0;
+	const shmring_record_t *rec;
+	while (n < DRAIN_BATCH && (rec = shmring_read(w->ring, 0))) {
+		const shmring_field_t *f = shmring_first_field(rec);
+		output_record_write((uint8_t *)shmring_value(f));
+		shmring_release(w->ring);
+		n++;
+	}
+	return n;
+}
+
+static void reap(struct worker *w, int status)
+{
+	w->running = 0;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
+		log_debug(LOGGER_NAME, "worker %d finished", (int)w->pid);
+		return;
+	}
+	w->failed = 1;
+	failed++;
+	if (WIFSIGNALED(status)) {
+		log_error(LOGGER_NAME, "worker %d was killed by signal %d",
+			  (int)w->pid, WTERMSIG(status));
+	} else {
+		log_error(LOGGER_NAME, "worker %d exited with status %d",
+			  (int)w->pid, WEXITSTATUS(status));
+	}
+}
+
+// the supervisor's copy; 0 until the worker's monitor has written it once
+static void sample(struct worker *w)
+{
+	if (!w->stats) {
+		w->stats = statshm_open(w->stats_name);
+		if (!w->stats) {
+			return;
+		}
+		shm_unlink(w->stats_name);
+		w->snapshot = xcalloc(1, statshm_len(w->stats));
+	}
+	// a failed attempt keeps the last copy
+	statshm_snapshot(w->stats, w->snapshot, 100);
+}
+
+static const statshm_header_t *header(const struct worker *w)
+{
+	if (!w->snapshot) {
+		return NULL;
+	}
+	const statshm_header_t *h = (const statshm_header_t *)w->snapshot;
+	return h->magic == STATSHM_MAGIC && h->writes ? h : NULL;
+}
+
+static const statshm_status_t *worker_status(const struct worker *w)
+{
+	const statshm_header_t *h = header(w);
+	return h ? (const statshm_status_t *)(w->snapshot + h->status_offset)
+		 : NULL;
+}
+
+static void print_status(double start, uint32_t running)
+{
+	uint64_t sent = 0, success = 0, recv = 0;
+	double sent_rate = 0, success_rate = 0;
+	int streams = zconf.packet_streams > 0 ? zconf.packet_streams : 1;
+	for (uint32_t i = 0; i < num_workers; i++) {
+		const statshm_status_t *st = worker_status(&workers[i]);
+		if (!st) {
+			continue;
+		}
+		sent += st->sent_total;
+		success += st->success_unique;
+		recv += st->recv_total;
+		if (workers[i].running) {
+			sent_rate += st->sent_rate;
+			success_rate += st->success_rate;
+		}
+	}
+	double hitrate =
+	    sent ? success * 100.0 / ((double)sent / streams) : 0;
+	fprintf(stderr,
+		"%.0fs; workers: %u/%u running; send: %" PRIu64
+		" (%.0f p/s); recv: %" PRIu64 " (%.0f p/s), %" PRIu64
+		" frames; hitrate: %.2f%%\n",
+		now() - start, running, num_workers, sent, sent_rate, success,
+		success_rate, recv, hitrate);
+}
+
+// the workers' final counters into zsend and zrecv, for the metadata
+static void total(void)
+{
+	for (uint32_t i = 0; i < num_workers; i++) {
+		const statshm_header_t *h = header(&workers[i]);
+		if (!h) {
+			continue;
+		}
+		const uint8_t *base = workers[i].snapshot;
+		const statshm_status_t *st =
+		    (const statshm_status_t *)(base + h->status_offset);
+		zsend.packets_sent += st->sent_total;
+		zsend.sendto_failures += st->fail_total;
+		zrecv.pcap_recv += st->recv_total;
+		zrecv.pcap_drop += st->pcap_drop;
+		zrecv.pcap_ifdrop += st->pcap_ifdrop;
+		for (uint32_t s = 0; s < h->num_senders; s++) {
+			const statshm_sender_t *snd =
+			    (const statshm_sender_t *)(base + h->sender_offset +
+							s * h->sender_len);
+			zsend.targets_scanned += snd->targets_scanned;
+			zsend.retransmits_skipped += snd->retransmits_skipped;
+		}
+		for (uint32_t r = 0; r < h->num_receivers; r++) {
+			const statshm_receiver_t *rcv =
+			    (const statshm_receiver_t *)(base +
+							  h->receiver_offset +
+							  r * h->receiver_len);
+			struct recv_stats *t = &zrecv.stats;
+			t->success_total += rcv->success_total;
+			t->success_unique += rcv->success_unique;
+			t->app_success_total += rcv->app_success_total;
+			t->app_success_unique += rcv->app_success_unique;
+			t->failure_total += rcv->failure_total;
+			t->validation_passed += rcv->validation_passed;
+			t->validation_failed += rcv->validation_failed;
+			t->rtt_samples += rcv->rtt_samples;
+			t->rtt_sum_us += rcv->rtt_sum_us;
+		}
+	}
+}
+
+uint32_t workers_supervise(void)
+{
+	double start = now();
+	double last_status = start;
+	zsend.start = start;
+	zrecv.start = start;
+	uint32_t running = num_workers;
+	struct timespec idle = {0, 1000000};
+	for (;;) {
+		int busy = 0;
+		for (uint32_t i = 0; i < num_workers; i++) {
+			busy += drain(&workers[i]);
+		}
+		for (uint32_t i = 0; i < num_workers; i++) {
+			struct worker *w = &workers[i];
+			int st;
+			if (w->running && waitpid(w->pid, &st, WNOHANG) == w->pid) {
+				reap(w, st);
+				running--;
+			}
+		}
+		if (!running && !busy) {
+			break;
+		}
+		double t = now();
+		if (t - last_status >= 1) {
+			int sending = 0;
+			for (uint32_t i = 0; i < num_workers; i++) {
+				sample(&workers[i]);
+				const statshm_status_t *s = worker_status(&workers[i]);
+				if (workers[i].running && (!s || !s->send_complete)) {
+					sending = 1;
+				}
+			}
+			if (sending == 0 && !zsend.complete) {
+				zsend.complete = 1;
+				zsend.finish = t;
+			}
+			if (!zconf.quiet) {
+				print_status(start, running);
+			}
+			last_status = t;
+		}
+		if (!busy) {
+			nanosleep(&idle, NULL);
+		}
+	}
+	for (uint32_t i = 0; i < num_workers; i++) {
+		sample(&workers[i]);
+		shmring_detach(workers[i].ring, NULL, 0);
+		workers[i].ring = NULL;
+		if (workers[i].stats) {
+			statshm_detach(workers[i].stats, NULL, 0);
+			workers[i].stats = NULL;
+		} else {
+			// a worker that failed before its monitor started
+			shm_unlink(workers[i].stats_name);
+		}
+	}
+	total();
+	if (!zsend.complete) {
+		zsend.complete = 1;
+		zsend.finish = now();
+	}
+	zrecv.complete = 1;
+	zrecv.finish = now();
+	if (!zconf.quiet) {
+		print_status(start, 0);
+	}
+	for (uint32_t i = 0; i < num_workers; i++) {
+		free(workers[i].snapshot);
+		workers[i].snapshot = NULL;
+	}
+	return failed;
+}
+
+uint32_t workers_failed(void) { return failed; }
@@ -0,0 +1,42 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_WORKERS_H
+#define ZMAP_WORKERS_H
+
+#include <stdint.h>
+
+/*
+ * --worker-processes: the scan runs in that many forked worker processes
+ * under a supervisor, so that no process needs more than a few threads and
+ * a worker that crashes takes only its part of the scan with it.
+ *
+ * Everything is set up once, before the fork, so the workers share the
+ * seed and so the iterator and validation keys. Worker i scans shard
+ * shard * n + i of total_shards * n, from its share of the source ports,
+ * which also keeps the responses to the other workers out of its capture,
+ * at its share of --rate and --bandwidth. Each runs the send, receive and
+ * monitor threads of a whole scan, its own cooldown included, and puts its
+ * results, flattened as for --output-queue-size, into a shared memory ring
+ * (lib/shmring.h) and its statistics into a stats segment
+ * (lib/statshm.h). The supervisor is the only one to run the output
+ * module: it drains the rings, shows the sum of the statistics, and once
+ * every worker has exited writes the metadata from their final numbers.
+ * Sending is complete when every worker has finished sending.
+ */
+
+// Forks the workers. Returns 1 in a worker, which goes on to run the scan
+// as usual, and 0 in the supervisor.
+int workers_fork(void);
+// Supervisor: outputs the workers' results until they have all exited,
+// then fills zsend and zrecv in from their statistics. Returns the number
+// of workers that failed.
+uint32_t workers_supervise(void);
+uint32_t workers_failed(void);
+
+#endif /* ZMAP_WORKERS_H */
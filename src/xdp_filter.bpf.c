@@ -0,0 +1,161 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * The XDP pre-filter (--xdp-filter), built with clang -target bpf. Traffic
+ * that can't be a response to the scan, i.e. isn't to one of its source
+ * addresses at one of its source ports, goes on to the host stack as if
+ * zmap weren't there; the rest goes to zmap's AF_XDP socket on the queue,
+ * or with the pcap backend on to the stack and pcap as well. Of that, a
+ * SYN-ACK from a target that was already seen is a retransmit or the
+ * answer to a further --probes copy, which zmap would only count as a
+ * repeat, and is dropped before it costs a copy to userspace. The targets
+ * are remembered in an LRU hash with per-CPU LRU lists, so they are
+ * forgotten oldest first and without the CPUs contending on one list.
+ */
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <bpf/bpf_endian.h>
+#include <bpf/bpf_helpers.h>
+
+#include "xdp_filter_maps.h"
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__type(key, __u32);
+	__type(value, struct xdp_filter_config);
+} zmap_config SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, XDP_FILTER_COUNTERS);
+	__type(key, __u32);
+	__type(value, __u64);
+} zmap_counters SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__uint(map_flags, BPF_F_NO_COMMON_LRU);
+	__uint(max_entries, XDP_FILTER_SEEN_ENTRIES);
+	__type(key, struct xdp_filter_key);
+	__type(value, __u8);
+} zmap_seen SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_XSKMAP);
+	__uint(max_entries, XDP_FILTER_MAX_QUEUES);
+	__type(key, __u32);
+	__type(value, __u32);
+} zmap_xsks SEC(".maps");
+
+static __always_inline void count(__u32 counter)
+{
+	__u64 *n = bpf_map_lookup_elem(&zmap_counters, &counter);
+	if (n) {
+		(*n)++;
+	}
+}
+
+static __always_inline int other(void)
+{
+	count(XDP_FILTER_OTHER);
+	return XDP_PASS;
+}
+
+static __always_inline int scan(struct xdp_md *ctx,
+				const struct xdp_filter_config *cfg)
+{
+	count(XDP_FILTER_SCAN);
+	if (!cfg->redirect) {
+		return XDP_PASS;
+	}
+	// to the stack if no socket is bound to the queue (yet)
+	return bpf_redirect_map(&zmap_xsks, ctx->rx_queue_index, XDP_PASS);
+}
+
+static __always_inline int in_ports(const struct xdp_filter_config *cfg,
+				    __be16 port)
+{
+	__u16 p = bpf_ntohs(port);
+	return p >= cfg->port_first && p <= cfg->port_last;
+}
+
+SEC("xdp")
+int zmap_filter(struct xdp_md *ctx)
+{
+	void *data = (void *)(long)ctx->data;
+	void *data_end = (void *)(long)ctx->data_end;
+	__u32 zero = 0;
+	const struct xdp_filter_config *cfg =
+	    bpf_map_lookup_elem(&zmap_config, &zero);
+	if (!cfg) {
+		return XDP_PASS;
+	}
+	struct ethhdr *eth = data;
+	if ((void *)(eth + 1) > data_end) {
+		return other();
+	}
+	if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+		return cfg->ipv6 ? scan(ctx, cfg) : other();
+	}
+	if (eth->h_proto != bpf_htons(ETH_P_IP) || cfg->ipv6) {
+		return other();
+	}
+	struct iphdr *ip = (void *)(eth + 1);
+	if ((void *)(ip + 1) > data_end || ip->ihl < 5) {
+		return other();
+	}
+	if ((ip->daddr & cfg->mask) != cfg->net) {
+		return other();
+	}
+	// fragments after the first have no ports to tell by
+	if (ip->frag_off & bpf_htons(0x1fff)) {
+		return scan(ctx, cfg);
+	}
+	void *l4 = (void *)ip + ip->ihl * 4;
+	if (ip->protocol == IPPROTO_TCP) {
+		struct tcphdr *tcp = l4;
+		if ((void *)(tcp + 1) > data_end) {
+			return other();
+		}
+		if (!in_ports(cfg, tcp->dest)) {
+			return other();
+		}
+		if (cfg->dedup && tcp->syn && tcp->ack) {
+			struct xdp_filter_key key = {
+			    .saddr = ip->saddr, .sport = tcp->source, .pad = 0};
+			if (bpf_map_lookup_elem(&zmap_seen, &key)) {
+				count(XDP_FILTER_DUPLICATE);
+				return XDP_DROP;
+			}
+			__u8 one = 1;
+			bpf_map_update_elem(&zmap_seen, &key, &one, BPF_ANY);
+		}
+		return scan(ctx, cfg);
+	}
+	if (ip->protocol == IPPROTO_UDP) {
+		struct udphdr *udp = l4;
+		if ((void *)(udp + 1) > data_end) {
+			return other();
+		}
+		return in_ports(cfg, udp->dest) ? scan(ctx, cfg) : other();
+	}
+	// ICMP errors quote the probe, the probe modules tell which are ours
+	if (ip->protocol == IPPROTO_ICMP) {
+		return scan(ctx, cfg);
+	}
+	return other();
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,165 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#include "xdp_filter.h"
+
+#include <errno.h>
+#include <string.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <xdp/libxdp.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+#include "state.h"
+
+static struct xdp_program *prog = NULL;
+static enum xdp_attach_mode prog_mode;
+static int prog_ifindex = 0;
+static int counters_fd = -1;
+static int xsks_fd = -1;
+
+static int map_fd(const char *name)
+{
+	struct bpf_object *obj = xdp_program__bpf_obj(prog);
+	int fd = bpf_object__find_map_fd_by_name(obj, name);
+	if (fd < 0) {
+		log_fatal("xdp-filter", "%s has no %s map",
+			  zconf.xdp_filter_object, name);
+	}
+	return fd;
+}
+
+// the smallest prefix holding every source address, as scan_filter() in
+// recv-pcap.c narrows the capture filter to
+static void source_prefix(struct xdp_filter_config *cfg)
+{
+	uint32_t lo = ntohl(zconf.source_ip_addresses[0]);
+	uint32_t diff = 0;
+	for (uint32_t i = 1; i < zconf.number_source_ips; i++) {
+		diff |= ntohl(zconf.source_ip_addresses[i]) ^ lo;
+	}
+	int prefix = diff ? __builtin_clz(diff) : 32;
+	uint32_t mask = prefix ? 0xFFFFFFFFu << (32 - prefix) : 0;
+	cfg->net = htonl(lo & mask);
+	cfg->mask = htonl(mask);
+}
+
+void xdp_filter_init(int redirect)
+{
+	prog_ifindex = (int)if_nametoindex(zconf.iface);
+	if (!prog_ifindex) {
+		log_fatal("xdp-filter", "unknown interface %s: %s", zconf.iface,
+			  strerror(errno));
+	}
+	struct xdp_filter_config cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.ipv6 = zconf.ipv6;
+	if (!cfg.ipv6) {
+		if (!zconf.number_source_ips) {
+			log_fatal("xdp-filter", "no source addresses to filter on");
+		}
+		source_prefix(&cfg);
+	}
+	cfg.port_first = zconf.source_port_first;
+	cfg.port_last = zconf.source_port_last;
+	cfg.redirect = redirect != 0;
+	cfg.dedup = zconf.dedup_method != DEDUP_METHOD_NONE;
+
+	prog = xdp_program__open_file(zconf.xdp_filter_object, "xdp", NULL);
+	int err = libxdp_get_error(prog);
+	if (err) {
+		prog = NULL;
+		log_fatal("xdp-filter", "unable to open %s: %s",
+			  zconf.xdp_filter_object, strerror(-err));
+	}
+	prog_mode = XDP_MODE_NATIVE;
+	err = xdp_program__attach(prog, prog_ifindex, prog_mode, 0);
+	if (err) {
+		log_warn("xdp-filter", "native XDP unavailable on %s (%s), "
+				       "falling back to generic XDP",
+			 zconf.iface, strerror(-err));
+		prog_mode = XDP_MODE_SKB;
+		err = xdp_program__attach(prog, prog_ifindex, prog_mode, 0);
+	}
+	if (err) {
+		xdp_program__close(prog);
+		prog = NULL;
+		log_fatal("xdp-filter", "unable to attach %s to %s: %s",
+			  zconf.xdp_filter_object, zconf.iface, strerror(-err));
+	}
+	uint32_t zero = 0;
+	if (bpf_map_update_elem(map_fd("zmap_config"), &zero, &cfg, BPF_ANY)) {
+		log_fatal("xdp-filter", "unable to configure the filter: %s",
+			  strerror(errno));
+	}
+	counters_fd = map_fd("zmap_counters");
+	xsks_fd = map_fd("zmap_xsks");
+	log_info("xdp-filter", "XDP pre-filter attached to %s%s%s",
+		 zconf.iface, prog_mode == XDP_MODE_SKB ? " (generic)" : "",
+		 cfg.dedup ? ", dropping repeated SYN-ACKs" : "");
+}
+
+void xdp_filter_add_socket(struct xsk_socket *xsk, uint32_t queue)
+{
+	if (queue >= XDP_FILTER_MAX_QUEUES) {
+		log_fatal("xdp-filter", "queue %u is beyond the filter's %u",
+			  queue, XDP_FILTER_MAX_QUEUES);
+	}
+	int err = xsk_socket__update_xskmap(xsk, xsks_fd);
+	if (err) {
+		log_fatal("xdp-filter", "unable to add the socket of queue %u: "
+					"%s",
+			  queue, strerror(-err));
+	}
+}
+
+void xdp_filter_update_stats(void)
+{
+	if (counters_fd < 0) {
+		return;
+	}
+	int cpus = libbpf_num_possible_cpus();
+	if (cpus <= 0) {
+		return;
+	}
+	uint64_t counts[XDP_FILTER_COUNTERS] = {0};
+	uint64_t *values = xcalloc((size_t)cpus, sizeof(uint64_t));
+	for (uint32_t c = 0; c < XDP_FILTER_COUNTERS; c++) {
+		if (bpf_map_lookup_elem(counters_fd, &c, values)) {
+			continue;
+		}
+		for (int i = 0; i < cpus; i++) {
+			counts[c] += values[i];
+		}
+	}
+	xfree(values);
+	zrecv.xdp_other = counts[XDP_FILTER_OTHER];
+	zrecv.xdp_scan = counts[XDP_FILTER_SCAN];
+	zrecv.xdp_duplicates = counts[XDP_FILTER_DUPLICATE];
+}
+
+void xdp_filter_cleanup(void)
+{
+	if (!prog) {
+		return;
+	}
+	int err = xdp_program__detach(prog, prog_ifindex, prog_mode, 0);
+	if (err) {
+		log_warn("xdp-filter", "unable to detach the filter from %s: %s",
+			 zconf.iface, strerror(-err));
+	}
+	xdp_program__close(prog);
+	prog = NULL;
+	counters_fd = -1;
+	xsks_fd = -1;
+}
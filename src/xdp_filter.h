@@ -0,0 +1,33 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_XDP_FILTER_H
+#define ZMAP_XDP_FILTER_H
+
+#include <stdint.h>
+
+#include <xdp/xsk.h>
+
+#include "xdp_filter_maps.h"
+
+// Attach the pre-filter (see xdp_filter.bpf.c) to zconf.iface, set up for
+// the scan's source addresses and ports. With redirect, scan traffic goes
+// to the AF_XDP sockets added with xdp_filter_add_socket(), which are then
+// to be created with XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD.
+void xdp_filter_init(int redirect);
+
+// deliver the scan traffic arriving on the socket's queue to it
+void xdp_filter_add_socket(struct xsk_socket *xsk, uint32_t queue);
+
+// sum the counters over all CPUs into zrecv
+void xdp_filter_update_stats(void);
+
+// detach the filter, if attached
+void xdp_filter_cleanup(void);
+
+#endif /* ZMAP_XDP_FILTER_H */
@@ -0,0 +1,56 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+#ifndef ZMAP_XDP_FILTER_MAPS_H
+#define ZMAP_XDP_FILTER_MAPS_H
+
+// Shared by the XDP pre-filter (xdp_filter.bpf.c) and its loader
+// (xdp_filter.c): the layout of its maps.
+
+#include <linux/types.h>
+
+// the zmap_config array's single entry, filled in by the loader
+struct xdp_filter_config {
+	// the smallest prefix holding the source addresses, network order
+	__u32 net;
+	__u32 mask;
+	// the scan's source ports, host order
+	__u16 port_first;
+	__u16 port_last;
+	// hand scan traffic to the AF_XDP sockets in zmap_xsks rather than
+	// on to the host stack (and pcap)
+	__u8 redirect;
+	// drop SYN-ACKs from a (saddr, sport) already seen
+	__u8 dedup;
+	// an IPv6 scan: every IPv6 packet is scan traffic
+	__u8 ipv6;
+	__u8 pad;
+};
+
+// the zmap_seen LRU hash's keys, of the responding target
+struct xdp_filter_key {
+	__u32 saddr;
+	__u16 sport;
+	__u16 pad;
+};
+
+// entries of the per-CPU zmap_counters array
+enum xdp_filter_counter {
+	// not scan traffic, left to the host stack
+	XDP_FILTER_OTHER,
+	// scan traffic, handed to zmap
+	XDP_FILTER_SCAN,
+	// repeated SYN-ACKs dropped
+	XDP_FILTER_DUPLICATE,
+	XDP_FILTER_COUNTERS
+};
+
+#define XDP_FILTER_SEEN_ENTRIES (1 << 20)
+#define XDP_FILTER_MAX_QUEUES 256
+
+#endif /* ZMAP_XDP_FILTER_MAPS_H */
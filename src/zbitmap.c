@@ -0,0 +1,325 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * ZBitmap works on the binary IPv4 address sets (see lib/ipbm.h) that the
+ * bitmap output module writes and --list-of-ips-file reads, so that the
+ * scans of a chain hand their results on without any text in between: it
+ * unions, intersects and diffs them a page at a time, counts them, prints
+ * them as text and packs text lists into them.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#include "../lib/includes.h"
+#include "../lib/ipbm.h"
+#include "../lib/logger.h"
+#include "../lib/pbm.h"
+#include "../lib/xalloc.h"
+
+#include "zbmopt.h"
+
+#define MAX_LINE_LENGTH 1024
+
+enum zbm_op { OP_UNION, OP_INTERSECT, OP_DIFFERENCE, OP_COUNT, OP_PRINT, OP_PACK };
+
+struct zbm_conf {
+	char *output_filename;
+	char *log_filename;
+	int ignore_input_errors;
+	int verbosity;
+	int disable_syslog;
+};
+
+#define SET_BOOL(DST, ARG)              \
+	{                               \
+		if (args.ARG##_given) { \
+			(DST) = 1;      \
+		};                      \
+	}
+
+static void open_set(ipbm_t *b, const char *path)
+{
+	if (ipbm_open(b, path)) {
+		log_fatal("zbitmap", "unable to read address set %s: %s", path,
+			  errno == EINVAL ? "not a valid set file"
+					  : strerror(errno));
+	}
+}
+
+// where each page of b is, -1 for those it doesn't have
+static void index_pages(const ipbm_t *b, int32_t *where)
+{
+	for (uint32_t i = 0; i < IPBM_PAGES; i++) {
+		where[i] = -1;
+	}
+	for (uint32_t i = 0; i < b->pages; i++) {
+		where[ipbm_page_number(b, i)] = (int32_t)i;
+	}
+}
+
+// the result of a set operation over the input sets, as a paged bitmap
+static uint8_t **combine(enum zbm_op op, char **inputs, unsigned n)
+{
+	uint8_t **out = pbm_init();
+	int32_t *where = xmalloc(IPBM_PAGES * sizeof(int32_t));
+	for (unsigned f = 0; f < n; f++) {
+		ipbm_t b;
+		open_set(&b, inputs[f]);
+		index_pages(&b, where);
+		for (uint32_t p = 0; p < IPBM_PAGES; p++) {
+			const uint8_t *bits =
+			    where[p] < 0 ? NULL : ipbm_page_bits(&b, where[p]);
+			if (f == 0 || op == OP_UNION) {
+				if (!bits) {
+					continue;
+				}
+				if (!out[p]) {
+					out[p] = bm_init();
+				}
+				for (size_t i = 0; i < IPBM_PAGE_BYTES; i++) {
+					out[p][i] |= bits[i];
+				}
+			} else if (op == OP_INTERSECT && out[p]) {
+				if (!bits) {
+					xfree(out[p]);
+					out[p] = NULL;
+					continue;
+				}
+				for (size_t i = 0; i < IPBM_PAGE_BYTES; i++) {
+					out[p][i] &= bits[i];
+				}
+			} else if (op == OP_DIFFERENCE && out[p] && bits) {
+				for (size_t i = 0; i < IPBM_PAGE_BYTES; i++) {
+					out[p][i] &= ~bits[i];
+				}
+			}
+		}
+		ipbm_close(&b);
+	}
+	xfree(where);
+	return out;
+}
+
+static void pack_file(uint8_t **out, FILE *in, const char *name,
+		      int ignore_input_errors, uint64_t *invalid)
+{
+	char line[MAX_LINE_LENGTH];
+	while (fgets(line, sizeof(line), in) != NULL) {
+		char *s = line + strspn(line, " \t");
+		s[strcspn(s, " \t\r\n,#")] = '\0';
+		if (*s == '\0') {
+			continue;
+		}
+		struct in_addr addr;
+		if (inet_pton(AF_INET, s, &addr) != 1) {
+			if (!ignore_input_errors) {
+				log_fatal("zbitmap",
+					  "invalid input address in %s: %s",
+					  name, s);
+			}
+			(*invalid)++;
+			continue;
+		}
+		pbm_set(out, ntohl(addr.s_addr));
+	}
+	if (ferror(in)) {
+		log_fatal("zbitmap", "error reading %s: %s", name,
+			  strerror(errno));
+	}
+}
+
+static void print_set(FILE *out, const char *path)
+{
+	ipbm_t b;
+	open_set(&b, path);
+	for (uint32_t i = 0; i < b.pages; i++) {
+		uint32_t base = ipbm_page_number(&b, i) << 16;
+		const uint8_t *bits = ipbm_page_bits(&b, i);
+		for (uint32_t j = 0; j < IPBM_PAGE_BYTES; j++) {
+			for (uint32_t k = 0; bits[j] >> k; k++) {
+				if (bits[j] & (1 << k)) {
+					uint32_t v = base | (j << 3) | k;
+					fprintf(out, "%u.%u.%u.%u\n", v >> 24,
+						(v >> 16) & 0xFF,
+						(v >> 8) & 0xFF, v & 0xFF);
+				}
+			}
+		}
+	}
+	ipbm_close(&b);
+}
+
+int main(int argc, char **argv)
+{
+	struct zbm_conf conf;
+	memset(&conf, 0, sizeof(struct zbm_conf));
+	conf.verbosity = 3;
+
+	struct gengetopt_args_info args;
+	struct cmdline_parser_params *params;
+	params = cmdline_parser_params_create();
+	assert(params);
+	params->initialize = 1;
+	params->override = 0;
+	params->check_required = 0;
+
+	if (cmdline_parser_ext(argc, argv, &args, params) != 0) {
+		exit(EXIT_SUCCESS);
+	}
+
+	// Handle help text and version
+	if (args.help_given) {
+		cmdline_parser_print_help();
+		exit(EXIT_SUCCESS);
+	}
+	if (args.version_given) {
+		cmdline_parser_print_version();
+		exit(EXIT_SUCCESS);
+	}
+
+	if (args.output_file_given) {
+		conf.output_filename = strdup(args.output_file_arg);
+	}
+	if (args.log_file_given) {
+		conf.log_filename = strdup(args.log_file_arg);
+	}
+	if (args.verbosity_given) {
+		conf.verbosity = args.verbosity_arg;
+	}
+	SET_BOOL(conf.ignore_input_errors, ignore_input_errors);
+	SET_BOOL(conf.disable_syslog, disable_syslog);
+
+	// initialize logging
+	FILE *logfile = stderr;
+	if (conf.log_filename) {
+		logfile = fopen(conf.log_filename, "w");
+		if (!logfile) {
+			fprintf(
+			    stderr,
+			    "FATAL: unable to open specified logfile (%s)\n",
+			    conf.log_filename);
+			exit(1);
+		}
+	}
+	if (log_init(logfile, conf.verbosity, !conf.disable_syslog,
+		     "zbitmap")) {
+		fprintf(stderr, "FATAL: unable able to initialize logging\n");
+		exit(1);
+	}
+
+	int ops = 0;
+	enum zbm_op op = OP_UNION;
+	if (args.union_given) {
+		op = OP_UNION;
+		ops++;
+	}
+	if (args.intersect_given) {
+		op = OP_INTERSECT;
+		ops++;
+	}
+	if (args.difference_given) {
+		op = OP_DIFFERENCE;
+		ops++;
+	}
+	if (args.count_given) {
+		op = OP_COUNT;
+		ops++;
+	}
+	if (args.print_given) {
+		op = OP_PRINT;
+		ops++;
+	}
+	if (args.pack_given) {
+		op = OP_PACK;
+		ops++;
+	}
+	if (ops != 1) {
+		log_fatal("zbitmap", "give exactly one of --union, --intersect, "
+				     "--difference, --count, --print and --pack");
+	}
+	if (op != OP_PACK && !args.inputs_num) {
+		log_fatal("zbitmap", "no input sets given");
+	}
+	if (op == OP_PRINT && args.inputs_num != 1) {
+		log_fatal("zbitmap", "--print takes a single input set");
+	}
+
+	if (op == OP_COUNT) {
+		for (unsigned i = 0; i < args.inputs_num; i++) {
+			ipbm_t b;
+			open_set(&b, args.inputs[i]);
+			printf("%" PRIu64 "\t%s\n", b.count, args.inputs[i]);
+			ipbm_close(&b);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	FILE *out = stdout;
+	if (conf.output_filename) {
+		out = fopen(conf.output_filename, "w");
+		if (!out) {
+			log_fatal("zbitmap", "unable to open output file %s: %s",
+				  conf.output_filename, strerror(errno));
+		}
+	} else if (op != OP_PRINT && isatty(fileno(stdout))) {
+		log_fatal("zbitmap", "refusing to write binary output to a "
+				     "terminal, use --output-file");
+	}
+
+	if (op == OP_PRINT) {
+		print_set(out, args.inputs[0]);
+	} else {
+		uint8_t **set;
+		uint64_t invalid = 0;
+		if (op == OP_PACK) {
+			set = pbm_init();
+			if (!args.inputs_num) {
+				pack_file(set, stdin, "stdin",
+					  conf.ignore_input_errors, &invalid);
+			}
+			for (unsigned i = 0; i < args.inputs_num; i++) {
+				FILE *in = fopen(args.inputs[i], "r");
+				if (!in) {
+					log_fatal("zbitmap",
+						  "unable to open %s: %s",
+						  args.inputs[i],
+						  strerror(errno));
+				}
+				pack_file(set, in, args.inputs[i],
+					  conf.ignore_input_errors, &invalid);
+				fclose(in);
+			}
+		} else {
+			set = combine(op, args.inputs, args.inputs_num);
+		}
+		if (fflush(out) != 0 || ipbm_write(fileno(out), set)) {
+			log_fatal("zbitmap", "unable to write output: %s",
+				  strerror(errno));
+		}
+		if (invalid) {
+			log_warn("zbitmap", "skipped %" PRIu64
+					    " invalid input lines",
+				 invalid);
+		}
+	}
+	if (fflush(out) != 0 || (out != stdout && fclose(out) != 0)) {
+		log_fatal("zbitmap", "unable to write output: %s",
+			  strerror(errno));
+	}
+	return EXIT_SUCCESS;
+}
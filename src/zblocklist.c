@@ -27,11 +27,14 @@
 #include <errno.h>
 #include <pwd.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "../lib/includes.h"
 #include "../lib/blocklist.h"
 #include "../lib/logger.h"
 #include "../lib/pbm.h"
+#include "../lib/cbm.h"
+#include "../lib/xalloc.h"
 
 #include "zbopt.h"
 
@@ -45,34 +48,281 @@
 //	uint32_t duplicates;
 //};
 
-#undef MIN
-#define MIN(X, Y) ((X) < (Y) ? (X) : (Y))
-
 // allow 1mb lines + newline + \0
 #define MAX_LINE_LENGTH 1024 * 1024 + 2
-
-static inline char *zmin(char *a, char *b)
-{
-	if (a && !b)
-		return a;
-	else if (b && !a)
-		return b;
-	else
-		return MIN(a, b);
-}
+// input is read and filtered a block of whole lines at a time
+#define BLOCK_SIZE (8 * 1024 * 1024)
 
 struct zbl_conf {
 	char *blocklist_filename;
 	char *allowlist_filename;
+	char *compile_filename;
 	char *log_filename;
 	int check_duplicates;
+	int compressed_bitmap;
 	int ignore_blocklist_errors;
 	int ignore_input_errors;
 	int verbosity;
 	int disable_syslog;
+	int threads;
+	int unordered;
 	// struct zbl_stats stats;
 };
 
+static struct zbl_conf conf;
+static uint8_t **seen = NULL;
+// --compressed-bitmap, in place of seen
+static cbm_t *seen_cbm = NULL;
+
+// Blocks are read under in_mutex, numbered in input order, and written
+// under out_mutex, in that order unless --unordered.
+static pthread_mutex_t in_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *carry; // partial last line of the previous block
+static size_t carry_len;
+static int input_done;
+static uint64_t next_block;
+
+static pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t out_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t next_write;
+
+// a line to print, in a block being filtered with duplicate checking
+typedef struct zbl_line {
+	uint32_t ip; // host order
+	uint32_t len;
+	int invalid; // printed as is
+	size_t off;
+} zbl_line_t;
+
+typedef struct zbl_worker {
+	char *in;
+	char *out;
+	zbl_line_t *lines;
+	size_t lines_len;
+	size_t lines_cap;
+} zbl_worker_t;
+
+static void write_all(const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(STDOUT_FILENO, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_fatal("zblocklist", "unable to write output: %s",
+				  strerror(errno));
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+// Fill w->in with the next block of whole lines, of which the last may
+// lack a newline at the end of the input. Returns its length, 0 once
+// the input is done.
+static size_t read_block(zbl_worker_t *w, uint64_t *seq)
+{
+	pthread_mutex_lock(&in_mutex);
+	if (input_done) {
+		pthread_mutex_unlock(&in_mutex);
+		return 0;
+	}
+	memcpy(w->in, carry, carry_len);
+	size_t len = carry_len;
+	int eof = 0;
+	while (len < BLOCK_SIZE) {
+		ssize_t n = read(STDIN_FILENO, w->in + len, BLOCK_SIZE - len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_fatal("zblocklist", "unable to read input: %s",
+				  strerror(errno));
+		}
+		if (n == 0) {
+			eof = 1;
+			break;
+		}
+		len += n;
+	}
+	size_t end = len;
+	if (!eof) {
+		char *nl = memrchr(w->in, '\n', len);
+		if (!nl || len - (size_t)(nl + 1 - w->in) >= MAX_LINE_LENGTH) {
+			log_fatal("zblocklist",
+				  "received line longer than max length: %i",
+				  MAX_LINE_LENGTH);
+		}
+		end = nl + 1 - w->in;
+	}
+	carry_len = len - end;
+	memcpy(carry, w->in + end, carry_len);
+	input_done = eof;
+	*seq = next_block++;
+	pthread_mutex_unlock(&in_mutex);
+	return end;
+}
+
+// dotted quad, the common case, without inet_aton()'s other forms
+static int parse_ipv4(const char *s, size_t len, uint32_t *ip)
+{
+	uint32_t addr = 0;
+	size_t i = 0;
+	for (int part = 0; part < 4; part++) {
+		if (part) {
+			if (i == len || s[i] != '.') {
+				return 0;
+			}
+			i++;
+		}
+		uint32_t v = 0;
+		size_t start = i;
+		while (i < len && i - start < 3 && s[i] >= '0' && s[i] <= '9') {
+			v = v * 10 + (s[i] - '0');
+			i++;
+		}
+		if (i == start || v > 255) {
+			return 0;
+		}
+		addr = addr << 8 | v;
+	}
+	if (i != len) {
+		return 0;
+	}
+	*ip = addr;
+	return 1;
+}
+
+static int parse_address(const char *s, size_t len, uint32_t *ip)
+{
+	if (parse_ipv4(s, len, ip)) {
+		return 1;
+	}
+	// hex, octal and shortened forms
+	char buf[64];
+	struct in_addr addr;
+	if (len >= sizeof(buf)) {
+		return 0;
+	}
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	if (!inet_aton(buf, &addr)) {
+		return 0;
+	}
+	*ip = ntohl(addr.s_addr);
+	return 1;
+}
+
+static void add_line(zbl_worker_t *w, uint32_t ip, int invalid, size_t off,
+		     size_t len)
+{
+	if (w->lines_len == w->lines_cap) {
+		w->lines_cap *= 2;
+		w->lines = xrealloc(w->lines, w->lines_cap * sizeof(zbl_line_t));
+	}
+	zbl_line_t *l = &w->lines[w->lines_len++];
+	l->ip = ip;
+	l->invalid = invalid;
+	l->off = off;
+	l->len = len;
+}
+
+// Copy the lines of w->in[0..len) to print to w->out and return their
+// length. With duplicate checking, they are only listed in w->lines, as
+// the bitmap is checked in input order when writing.
+static size_t filter_block(zbl_worker_t *w, size_t len)
+{
+	const char *in = w->in;
+	size_t out = 0;
+	w->lines_len = 0;
+	for (size_t pos = 0; pos < len;) {
+		const char *line = in + pos;
+		const char *nl = memchr(line, '\n', len - pos);
+		size_t line_len = nl ? (size_t)(nl - line) + 1 : len - pos;
+		pos += line_len;
+		// the address ends at the first separator
+		size_t n = 0;
+		while (n < line_len && line[n] != '\n' && line[n] != ',' &&
+		       line[n] != '\t' && line[n] != ' ' && line[n] != '#') {
+			n++;
+		}
+		uint32_t ip;
+		if (!parse_address(line, n, &ip)) {
+			log_warn("zblocklist", "invalid input address: %.*s",
+				 (int)n, line);
+			if (conf.ignore_input_errors) {
+				continue;
+			}
+			if (conf.check_duplicates) {
+				add_line(w, 0, 1, line - in, line_len);
+			} else {
+				memcpy(w->out + out, line, line_len);
+				out += line_len;
+			}
+			continue;
+		}
+		if (!blocklist_is_allowed(htonl(ip))) {
+			continue;
+		}
+		if (conf.check_duplicates) {
+			add_line(w, ip, 0, line - in, line_len);
+		} else {
+			memcpy(w->out + out, line, line_len);
+			out += line_len;
+		}
+	}
+	return out;
+}
+
+// Under out_mutex: drop the lines already seen and gather the rest in
+// w->out.
+static size_t dedup_block(zbl_worker_t *w)
+{
+	size_t out = 0;
+	for (size_t i = 0; i < w->lines_len; i++) {
+		zbl_line_t *l = &w->lines[i];
+		if (!l->invalid) {
+			if (seen_cbm) {
+				if (cbm_check(seen_cbm, l->ip)) {
+					continue;
+				}
+				cbm_set(seen_cbm, l->ip);
+			} else {
+				if (pbm_check(seen, l->ip)) {
+					continue;
+				}
+				pbm_set(seen, l->ip);
+			}
+		}
+		memcpy(w->out + out, w->in + l->off, l->len);
+		out += l->len;
+	}
+	return out;
+}
+
+static void *filter_thread(void *arg)
+{
+	zbl_worker_t *w = arg;
+	uint64_t seq;
+	size_t len;
+	while ((len = read_block(w, &seq)) > 0) {
+		size_t out = filter_block(w, len);
+		pthread_mutex_lock(&out_mutex);
+		while (!conf.unordered && next_write != seq) {
+			pthread_cond_wait(&out_cond, &out_mutex);
+		}
+		if (conf.check_duplicates) {
+			out = dedup_block(w);
+		}
+		write_all(w->out, out);
+		next_write++;
+		pthread_cond_broadcast(&out_cond);
+		pthread_mutex_unlock(&out_mutex);
+	}
+	return NULL;
+}
+
 #define SET_IF_GIVEN(DST, ARG)                  \
 	{                                       \
 		if (args.ARG##_given) {         \
@@ -88,7 +338,6 @@ struct zbl_conf {
 
 int main(int argc, char **argv)
 {
-	struct zbl_conf conf;
 	conf.verbosity = 3;
 	memset(&conf, 0, sizeof(struct zbl_conf));
 	int no_dupchk_pres = 0;
@@ -132,6 +381,7 @@ int main(int argc, char **argv)
 	if (args.allowlist_file_given) {
 		conf.allowlist_filename = strdup(args.allowlist_file_arg);
 	}
+	SET_IF_GIVEN(conf.compile_filename, compile);
 
 	// Read the boolean flags
 	SET_BOOL(no_dupchk_pres, no_duplicate_checking);
@@ -139,6 +389,9 @@ int main(int argc, char **argv)
 	SET_BOOL(conf.ignore_blocklist_errors, ignore_blocklist_errors);
 	SET_BOOL(conf.ignore_input_errors, ignore_input_errors);
 	SET_BOOL(conf.disable_syslog, disable_syslog);
+	SET_BOOL(conf.unordered, unordered);
+	SET_BOOL(conf.compressed_bitmap, compressed_bitmap);
+	conf.threads = args.threads_arg;
 
 	// initialize logging
 	FILE *logfile = stderr;
@@ -158,6 +411,9 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
+	if (conf.threads < 1) {
+		log_fatal("zblocklist", "--threads must be at least 1");
+	}
 	if (!conf.blocklist_filename && !conf.allowlist_filename) {
 		log_fatal("zblocklist",
 			  "must specify either a allowlist or blocklist file");
@@ -189,74 +445,49 @@ int main(int argc, char **argv)
 			  conf.allowlist_filename);
 	}
 
+	if (conf.compile_filename) {
+		blocklist_set_cache(conf.compile_filename);
+	}
 	if (blocklist_init(conf.allowlist_filename, conf.blocklist_filename,
 			   NULL, 0, NULL, 0, conf.ignore_blocklist_errors)) {
 		log_fatal("zmap", "unable to initialize blocklist / allowlist");
 	}
+	if (conf.compile_filename) {
+		return EXIT_SUCCESS;
+	}
 	// initialize paged bitmap
-	uint8_t **seen = NULL;
-	if (conf.check_duplicates) {
+	if (conf.check_duplicates && conf.compressed_bitmap) {
+		seen_cbm = cbm_init(0x10000, MEM_DEDUP);
+	} else if (conf.check_duplicates) {
 		seen = pbm_init();
 		if (!seen) {
 			log_fatal("zblocklist",
 				  "unable to initialize paged bitmap");
 		}
 	}
-	// process addresses
-	char *line = malloc(MAX_LINE_LENGTH);
-	assert(line);
-	char *original = malloc(MAX_LINE_LENGTH);
-	assert(original);
-	while (fgets(line, MAX_LINE_LENGTH, stdin) != NULL) {
-		size_t len = strlen(line);
-		if (len >= (MAX_LINE_LENGTH - 1)) {
-			log_fatal("zblocklist",
-				  "received line longer than max length: %i",
-				  MAX_LINE_LENGTH);
-		}
-		// remove new line
-		memcpy(original, line, len + 1);
-		char *n =
-		    zmin(zmin(zmin(zmin(strchr(line, '\n'), strchr(line, ',')),
-				   strchr(line, '\t')),
-			      strchr(line, ' ')),
-			 strchr(line, '#'));
-		assert(n);
-		n[0] = 0;
-		log_debug("zblocklist", "input value %s", line);
-		// parse into int
-		struct in_addr addr;
-		if (!inet_aton(line, &addr)) {
-			log_warn("zblocklist", "invalid input address: %s",
-				 line);
-			if (!conf.ignore_input_errors) {
-				printf("%s", original);
-			}
-			continue;
-		}
-		if (conf.check_duplicates) {
-			if (pbm_check(seen, ntohl(addr.s_addr))) {
-				log_debug("zblocklist",
-					  "%s is a duplicate: skipped", line);
-				continue;
-			} else {
-				log_debug("zblocklist",
-					  "%s not a duplicate: skipped", line);
+	// process addresses, a block at a time in each thread
+	carry = xmalloc(BLOCK_SIZE);
+	zbl_worker_t *workers = xcalloc(conf.threads, sizeof(zbl_worker_t));
+	for (int i = 0; i < conf.threads; i++) {
+		workers[i].in = xmalloc(BLOCK_SIZE);
+		workers[i].out = xmalloc(BLOCK_SIZE);
+		workers[i].lines_cap = 4096;
+		workers[i].lines =
+		    xmalloc(workers[i].lines_cap * sizeof(zbl_line_t));
+	}
+	if (conf.threads == 1) {
+		filter_thread(&workers[0]);
+	} else {
+		pthread_t *threads = xcalloc(conf.threads, sizeof(pthread_t));
+		for (int i = 0; i < conf.threads; i++) {
+			if (pthread_create(&threads[i], NULL, filter_thread,
+					   &workers[i])) {
+				log_fatal("zblocklist",
+					  "unable to create filter thread");
 			}
-		} else {
-			log_debug("zblocklist", "no duplicate checking for %s",
-				  line);
 		}
-		// check if in blocklist
-		if (blocklist_is_allowed(addr.s_addr)) {
-			if (conf.check_duplicates) {
-				if (!pbm_check(seen, ntohl(addr.s_addr))) {
-					pbm_set(seen, ntohl(addr.s_addr));
-					printf("%s", original);
-				}
-			} else {
-				printf("%s", original);
-			}
+		for (int i = 0; i < conf.threads; i++) {
+			pthread_join(threads[i], NULL);
 		}
 	}
 	return EXIT_SUCCESS;
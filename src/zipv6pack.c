@@ -0,0 +1,275 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * ZIPv6Pack converts a text list of IPv6 addresses, one per line, into the
+ * binary target format that zmap memory-maps for --ipv6-target-file. The
+ * addresses are sorted and (by default) deduplicated, and can optionally be
+ * stored against a dictionary of /64 prefixes, which makes hitlists that are
+ * dense in a few networks considerably smaller.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+#include "ipv6_target_file.h"
+
+#include "zpkopt.h"
+
+#define MAX_LINE_LENGTH 1024
+
+struct zpk_conf {
+	char *input_filename;
+	char *output_filename;
+	char *log_filename;
+	int prefix_dict;
+	int check_duplicates;
+	int ignore_input_errors;
+	int verbosity;
+	int disable_syslog;
+};
+
+#define SET_BOOL(DST, ARG)              \
+	{                               \
+		if (args.ARG##_given) { \
+			(DST) = 1;      \
+		};                      \
+	}
+
+static int addr_cmp(const void *a, const void *b)
+{
+	return memcmp(a, b, sizeof(struct in6_addr));
+}
+
+static void write_all(FILE *out, const void *buf, size_t len)
+{
+	if (len && fwrite(buf, len, 1, out) != 1) {
+		log_fatal("zipv6pack", "unable to write output: %s",
+			  strerror(errno));
+	}
+}
+
+static void put_u64(uint32_t *hi, uint32_t *lo, uint64_t v)
+{
+	*hi = htonl((uint32_t)(v >> 32));
+	*lo = htonl((uint32_t)v);
+}
+
+int main(int argc, char **argv)
+{
+	struct zpk_conf conf;
+	memset(&conf, 0, sizeof(struct zpk_conf));
+	conf.verbosity = 3;
+	int no_dupchk_pres = 0;
+
+	struct gengetopt_args_info args;
+	struct cmdline_parser_params *params;
+	params = cmdline_parser_params_create();
+	assert(params);
+	params->initialize = 1;
+	params->override = 0;
+	params->check_required = 0;
+
+	if (cmdline_parser_ext(argc, argv, &args, params) != 0) {
+		exit(EXIT_SUCCESS);
+	}
+
+	// Handle help text and version
+	if (args.help_given) {
+		cmdline_parser_print_help();
+		exit(EXIT_SUCCESS);
+	}
+	if (args.version_given) {
+		cmdline_parser_print_version();
+		exit(EXIT_SUCCESS);
+	}
+
+	if (args.input_file_given) {
+		conf.input_filename = strdup(args.input_file_arg);
+	}
+	if (args.output_file_given) {
+		conf.output_filename = strdup(args.output_file_arg);
+	}
+	if (args.log_file_given) {
+		conf.log_filename = strdup(args.log_file_arg);
+	}
+	if (args.verbosity_given) {
+		conf.verbosity = args.verbosity_arg;
+	}
+	SET_BOOL(conf.prefix_dict, prefix_dict);
+	SET_BOOL(no_dupchk_pres, no_duplicate_checking);
+	conf.check_duplicates = !no_dupchk_pres;
+	SET_BOOL(conf.ignore_input_errors, ignore_input_errors);
+	SET_BOOL(conf.disable_syslog, disable_syslog);
+
+	// initialize logging
+	FILE *logfile = stderr;
+	if (conf.log_filename) {
+		logfile = fopen(conf.log_filename, "w");
+		if (!logfile) {
+			fprintf(
+			    stderr,
+			    "FATAL: unable to open specified logfile (%s)\n",
+			    conf.log_filename);
+			exit(1);
+		}
+	}
+	if (log_init(logfile, conf.verbosity, !conf.disable_syslog,
+		     "zipv6pack")) {
+		fprintf(stderr, "FATAL: unable able to initialize logging\n");
+		exit(1);
+	}
+
+	FILE *in = stdin;
+	if (conf.input_filename) {
+		in = fopen(conf.input_filename, "r");
+		if (!in) {
+			log_fatal("zipv6pack", "unable to open input file %s: %s",
+				  conf.input_filename, strerror(errno));
+		}
+	}
+	FILE *out = stdout;
+	if (conf.output_filename) {
+		out = fopen(conf.output_filename, "w");
+		if (!out) {
+			log_fatal("zipv6pack",
+				  "unable to open output file %s: %s",
+				  conf.output_filename, strerror(errno));
+		}
+	} else if (isatty(fileno(stdout))) {
+		log_fatal("zipv6pack", "refusing to write binary output to a "
+				       "terminal, use --output-file");
+	}
+
+	// read every address, the header needs the final count up front
+	size_t count = 0;
+	size_t cap = 1 << 16;
+	struct in6_addr *addrs = xmalloc(cap * sizeof(struct in6_addr));
+	char line[MAX_LINE_LENGTH];
+	uint64_t invalid = 0;
+	while (fgets(line, sizeof(line), in) != NULL) {
+		char *s = line + strspn(line, " \t");
+		s[strcspn(s, " \t\r\n,#")] = '\0';
+		if (*s == '\0') {
+			continue;
+		}
+		if (count == cap) {
+			cap *= 2;
+			addrs = xrealloc(addrs, cap * sizeof(struct in6_addr));
+		}
+		if (inet_pton(AF_INET6, s, &addrs[count]) != 1) {
+			if (!conf.ignore_input_errors) {
+				log_fatal("zipv6pack",
+					  "invalid input address: %s", s);
+			}
+			log_warn("zipv6pack", "invalid input address: %s", s);
+			invalid++;
+			continue;
+		}
+		count++;
+	}
+	if (ferror(in)) {
+		log_fatal("zipv6pack", "error reading input: %s",
+			  strerror(errno));
+	}
+
+	qsort(addrs, count, sizeof(struct in6_addr), addr_cmp);
+	size_t total = count;
+	if (conf.check_duplicates && count) {
+		size_t uniq = 1;
+		for (size_t i = 1; i < count; i++) {
+			if (memcmp(&addrs[i], &addrs[uniq - 1],
+				   sizeof(struct in6_addr))) {
+				addrs[uniq++] = addrs[i];
+			}
+		}
+		count = uniq;
+	}
+
+	// sorted input keeps every /64 contiguous, so the dictionary is just
+	// the distinct prefixes in order
+	uint8_t *prefixes = NULL;
+	uint64_t prefix_count = 0;
+	if (conf.prefix_dict) {
+		size_t pcap = 1024;
+		prefixes = xmalloc(pcap * IPV6_BIN_PREFIX_LEN);
+		for (size_t i = 0; i < count; i++) {
+			if (prefix_count &&
+			    !memcmp(prefixes +
+					(prefix_count - 1) * IPV6_BIN_PREFIX_LEN,
+				    addrs[i].s6_addr, IPV6_BIN_PREFIX_LEN)) {
+				continue;
+			}
+			if (prefix_count == UINT32_MAX) {
+				log_fatal("zipv6pack",
+					  "too many distinct /64 prefixes for "
+					  "--prefix-dict");
+			}
+			if (prefix_count == pcap) {
+				pcap *= 2;
+				prefixes = xrealloc(
+				    prefixes, pcap * IPV6_BIN_PREFIX_LEN);
+			}
+			memcpy(prefixes + prefix_count * IPV6_BIN_PREFIX_LEN,
+			       addrs[i].s6_addr, IPV6_BIN_PREFIX_LEN);
+			prefix_count++;
+		}
+	}
+
+	struct ipv6_bin_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, IPV6_BIN_MAGIC, IPV6_BIN_MAGIC_LEN);
+	h.version = htonl(IPV6_BIN_VERSION);
+	h.flags = htonl(conf.prefix_dict ? IPV6_BIN_PREFIX_DICT : 0);
+	put_u64(&h.count_hi, &h.count_lo, count);
+	put_u64(&h.dict_count_hi, &h.dict_count_lo, prefix_count);
+	write_all(out, &h, sizeof(h));
+
+	if (conf.prefix_dict) {
+		write_all(out, prefixes, prefix_count * IPV6_BIN_PREFIX_LEN);
+		uint32_t idx = 0;
+		for (size_t i = 0; i < count; i++) {
+			uint8_t rec[IPV6_BIN_DICT_RECORD_LEN];
+			while (memcmp(prefixes + (size_t)idx * IPV6_BIN_PREFIX_LEN,
+				      addrs[i].s6_addr, IPV6_BIN_PREFIX_LEN)) {
+				idx++;
+			}
+			uint32_t nidx = htonl(idx);
+			memcpy(rec, &nidx, sizeof(nidx));
+			memcpy(rec + sizeof(nidx),
+			       addrs[i].s6_addr + IPV6_BIN_PREFIX_LEN,
+			       sizeof(struct in6_addr) - IPV6_BIN_PREFIX_LEN);
+			write_all(out, rec, sizeof(rec));
+		}
+	} else {
+		write_all(out, addrs, count * sizeof(struct in6_addr));
+	}
+	if (fflush(out) != 0 || (out != stdout && fclose(out) != 0)) {
+		log_fatal("zipv6pack", "unable to write output: %s",
+			  strerror(errno));
+	}
+
+	log_info("zipv6pack",
+		 "packed %zu addresses (%zu read, %" PRIu64
+		 " invalid, %" PRIu64 " /64 prefixes)",
+		 count, total, invalid, prefix_count);
+	xfree(prefixes);
+	xfree(addrs);
+	return EXIT_SUCCESS;
+}
@@ -20,6 +20,8 @@
 #include <getopt.h>
 #include <assert.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "../lib/includes.h"
 #include "../lib/blocklist.h"
@@ -29,6 +31,8 @@
 #include "../lib/xalloc.h"
 
 #include "iterator.h"
+#include "lease.h"
+#include "shard.h"
 #include "ports.h"
 #include "state.h"
 #include "validate.h"
@@ -51,8 +55,138 @@ struct zit_conf {
 	uint64_t seed;
 	aesrand_t *aes;
 	uint32_t max_hosts;
+
+	// output options
+	uint16_t threads;
+	int binary;
+	int with_ports;
 };
 
+// targets generated, formatted and written at a time by each thread
+#define CHUNK_TARGETS 65536
+// "255.255.255.255,65535\n"
+#define TARGET_TEXT_MAX 22
+
+static struct zit_conf conf;
+
+// Threads write their chunks in turn, thread 0 first, which keeps the
+// output the same from run to run for a given seed and --threads.
+static pthread_mutex_t turn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t turn_cond = PTHREAD_COND_INITIALIZER;
+static uint16_t turn;
+static uint16_t active;
+static uint8_t *finished;
+
+// "00" through "99", so dotted quads are built two digits at a time
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+static char *put_uint(char *p, uint32_t v)
+{
+	char tmp[10];
+	char *t = tmp + sizeof(tmp);
+	while (v >= 100) {
+		t -= 2;
+		memcpy(t, &digit_pairs[(v % 100) * 2], 2);
+		v /= 100;
+	}
+	if (v >= 10) {
+		t -= 2;
+		memcpy(t, &digit_pairs[v * 2], 2);
+	} else {
+		*--t = (char)('0' + v);
+	}
+	size_t n = tmp + sizeof(tmp) - t;
+	memcpy(p, t, n);
+	return p + n;
+}
+
+// target_t addresses are in network byte order
+static size_t format_targets(const target_t *targets, size_t n, char *out)
+{
+	char *p = out;
+	if (conf.binary) {
+		for (size_t i = 0; i < n; i++) {
+			memcpy(p, &targets[i].ip, 4);
+			p += 4;
+			if (conf.with_ports) {
+				uint16_t port = htons(targets[i].port);
+				memcpy(p, &port, 2);
+				p += 2;
+			}
+		}
+		return p - out;
+	}
+	for (size_t i = 0; i < n; i++) {
+		const uint8_t *octets = (const uint8_t *)&targets[i].ip;
+		for (int j = 0; j < 4; j++) {
+			if (j) {
+				*p++ = '.';
+			}
+			p = put_uint(p, octets[j]);
+		}
+		if (conf.with_ports) {
+			*p++ = ',';
+			p = put_uint(p, targets[i].port);
+		}
+		*p++ = '\n';
+	}
+	return p - out;
+}
+
+static void write_all(const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(STDOUT_FILENO, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_fatal("ziterate", "unable to write output: %s",
+				  strerror(errno));
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void *iterate_thread(void *arg)
+{
+	shard_t *shard = arg;
+	uint16_t id = shard->thread_id;
+	target_t *targets = xmalloc(CHUNK_TARGETS * sizeof(target_t));
+	char *buf = xmalloc(CHUNK_TARGETS * TARGET_TEXT_MAX);
+	for (;;) {
+		size_t n = shard_get_next_targets(shard, targets, CHUNK_TARGETS);
+		shard_stat_add(&shard->stats->targets_scanned, n);
+		size_t len = format_targets(targets, n, buf);
+		pthread_mutex_lock(&turn_mutex);
+		while (turn != id) {
+			pthread_cond_wait(&turn_cond, &turn_mutex);
+		}
+		write_all(buf, len);
+		int done = n < CHUNK_TARGETS || shard->current == ZMAP_SHARD_DONE;
+		if (done) {
+			finished[id] = 1;
+			active--;
+		}
+		// on to the next thread that still has targets
+		while (active && finished[turn = (turn + 1) % conf.threads])
+			;
+		pthread_cond_broadcast(&turn_cond);
+		pthread_mutex_unlock(&turn_mutex);
+		if (done) {
+			break;
+		}
+	}
+	xfree(targets);
+	xfree(buf);
+	return NULL;
+}
+
 #define SET_BOOL(DST, ARG)              \
 	{                               \
 		if (args.ARG##_given) { \
@@ -62,8 +196,6 @@ struct zit_conf {
 
 int main(int argc, char **argv)
 {
-	struct zit_conf conf;
-
 	memset(&conf, 0, sizeof(struct zit_conf));
 	conf.verbosity = 3;
 	conf.ignore_errors = 0;
@@ -100,6 +232,9 @@ int main(int argc, char **argv)
 	// Read the boolean flags
 	SET_BOOL(conf.ignore_errors, ignore_blocklist_errors);
 	SET_BOOL(conf.disable_syslog, disable_syslog);
+	SET_BOOL(conf.binary, binary);
+	enforce_range("threads", args.threads_arg, 1, 65535);
+	conf.threads = args.threads_arg;
 
 	// initialize logging
 	FILE *logfile = stderr;
@@ -128,10 +263,6 @@ int main(int argc, char **argv)
 	}
 	conf.destination_cidrs = args.inputs;
 	conf.destination_cidrs_len = args.inputs_num;
-	// max targets
-	if (args.max_targets_given) {
-		conf.max_hosts = parse_max_targets(args.max_targets_arg, zconf.ports->port_count);
-	}
 
 	// sanity check blocklist file
 	if (conf.blocklist_filename) {
@@ -211,12 +342,17 @@ int main(int argc, char **argv)
 	}
 	zconf.aes = aesrand_init_from_seed(conf.seed);
 
-	zconf.ports = xmalloc(sizeof(struct port_conf));
+	zconf.ports = xcalloc(1, sizeof(struct port_conf));
 	if (args.target_ports_given) {
 		parse_ports(args.target_ports_arg, zconf.ports);
+		conf.with_ports = 1;
 	} else {
 		zconf.ports->port_count = 1;
 	}
+	// max targets, which depend on the number of ports
+	if (args.max_targets_given) {
+		conf.max_hosts = parse_max_targets(args.max_targets_arg, zconf.ports->port_count);
+	}
 
 	uint64_t num_addrs = blocklist_count_allowed();
 	if (zconf.list_of_ips_filename) {
@@ -224,23 +360,63 @@ int main(int argc, char **argv)
 			  "forcing max group size for compatibility with -I");
 		num_addrs = 0xFFFFFFFF;
 	}
-	iterator_t *it = iterator_init(1, conf.shard_num, conf.total_shards,
-				       num_addrs, zconf.ports->port_count);
-	shard_t *shard = get_shard(it, 0);
-
-	target_t current = shard_get_cur_target(shard);
-	for (uint32_t count = 0; current.ip; ++count) {
-		if (conf.max_hosts && count >= conf.max_hosts) {
-			break;
+	if (args.serve_leases_given) {
+		enforce_range("serve-leases", args.serve_leases_arg, 1, 65535);
+		if (!args.seed_given) {
+			log_fatal("ziterate", "--serve-leases needs the --seed "
+					      "the workers will scan with");
+		}
+		if (args.shard_given || args.shards_given ||
+		    args.max_targets_given || zconf.list_of_ips_filename) {
+			log_fatal("ziterate", "--serve-leases hands out the "
+					      "whole scan, without shards or "
+					      "--max-targets");
 		}
-		struct in_addr next_ip;
-		next_ip.s_addr = current.ip;
-		if (current.port) {
-			printf("%s,%u\n", inet_ntoa(next_ip), current.port);
-		} else {
-			printf("%s\n", inet_ntoa(next_ip));
+		if (args.lease_size_given && args.lease_size_arg <= 0) {
+			log_fatal("ziterate", "--lease-size must be positive");
 		}
-		current = shard_get_next_target(shard);
+		if (args.lease_timeout_arg <= 0) {
+			log_fatal("ziterate", "--lease-timeout must be positive");
+		}
+		if (args.rate_budget_given && args.rate_budget_arg <= 0) {
+			log_fatal("ziterate", "--rate-budget must be positive");
+		}
+		// the cycle the workers will walk
+		iterator_t *it = iterator_init(1, 0, 1, num_addrs,
+					       zconf.ports->port_count);
+		uint64_t order = get_shard(it, 0)->params.order;
+		uint64_t hash = lease_config_hash(conf.seed, order,
+						  zsend.max_index, zconf.ports);
+		return lease_serve(args.lease_address_arg,
+				   (uint16_t)args.serve_leases_arg, order, hash,
+				   args.lease_size_given
+				       ? (uint64_t)args.lease_size_arg
+				       : 0,
+				   (uint32_t)args.lease_timeout_arg,
+				   args.rate_budget_given
+				       ? (uint64_t)args.rate_budget_arg
+				       : 0);
+	}
+	// the shards split max_targets among the threads
+	zsend.max_targets = conf.max_hosts;
+	iterator_t *it = iterator_init(conf.threads, conf.shard_num,
+				       conf.total_shards, num_addrs,
+				       zconf.ports->port_count);
+	finished = xcalloc(conf.threads, sizeof(uint8_t));
+	active = conf.threads;
+	if (conf.threads == 1) {
+		iterate_thread(get_shard(it, 0));
+		return EXIT_SUCCESS;
+	}
+	pthread_t *threads = xcalloc(conf.threads, sizeof(pthread_t));
+	for (uint16_t i = 0; i < conf.threads; i++) {
+		if (pthread_create(&threads[i], NULL, iterate_thread,
+				   get_shard(it, i))) {
+			log_fatal("ziterate", "unable to create thread");
+		}
+	}
+	for (uint16_t i = 0; i < conf.threads; i++) {
+		pthread_join(threads[i], NULL);
 	}
 	return EXIT_SUCCESS;
 }
@@ -30,20 +30,40 @@
 #include "../lib/util.h"
 #include "../lib/xalloc.h"
 #include "../lib/pbm.h"
+#include "../lib/hugemem.h"
+#include "../lib/ipbm.h"
 #include "../lib/aes128.h"
+#include "../lib/cpu.h"
 
 #include "aesrand.h"
+#include "checkpoint.h"
 #include "constants.h"
+#include "event_loop.h"
 #include "ports.h"
 #include "zopt.h"
 #include "send.h"
 #include "recv.h"
+#include "rss.h"
+#include "sample.h"
+#include "shaping.h"
 #include "state.h"
 #include "monitor.h"
+#include "netcache.h"
+#include "numa.h"
+#include "output-queue.h"
+#include "extra_probes.h"
 #include "get_gateway.h"
+#include "ifaces.h"
+#include "ipv4_target_stream.h"
+#include "ipv6_alias.h"
+#include "ipv6_pattern.h"
+#include "ipv6_source.h"
 #include "filter.h"
 #include "summary.h"
+#include "timestamps.h"
 #include "utility.h"
+#include "validate.h"
+#include "workers.h"
 
 #include "output_modules/output_modules.h"
 #include "probe_modules/probe_modules.h"
@@ -71,6 +91,18 @@ static int64_t distrib_func(pfring_zc_pkt_buff *pkt, pfring_zc_queue *in_queue,
 #include <fcntl.h>
 #endif
 
+#ifdef XDP
+#include "socket-xdp.h"
+#endif
+
+#ifdef XDP_FILTER
+#include "xdp_filter.h"
+#endif
+
+#ifdef DPDK
+#include "socket-dpdk.h"
+#endif
+
 pthread_mutex_t recv_ready_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 int get_num_cores(void)
@@ -86,6 +118,8 @@ typedef struct send_arg {
 
 typedef struct recv_arg {
 	uint32_t cpu;
+	// cores for the remaining zconf.recv_threads - 1 capture threads
+	uint32_t *worker_cpus;
 } recv_arg_t;
 
 typedef struct mon_start_arg {
@@ -120,7 +154,9 @@ static void *start_recv(void *arg)
 	recv_arg_t *r = (recv_arg_t *)arg;
 	log_debug("zmap", "Pinning receive thread to core %u", r->cpu);
 	set_cpu(r->cpu);
-	recv_run(&recv_ready_mutex);
+	recv_run(&recv_ready_mutex, r->worker_cpus);
+	free(r->worker_cpus);
+	free(r);
 	return NULL;
 }
 
@@ -134,47 +170,50 @@ static void *start_mon(void *arg)
 	return NULL;
 }
 
-static void network_config_init(void)
+// the source addresses and gateway MAC address of ifc, unless given
+static void iface_config_init(struct iface_conf *ifc, int gw_mac_set)
 {
-	if (zconf.iface == NULL) {
-		zconf.iface = get_default_iface();
-		assert(zconf.iface);
-		log_debug("zmap",
-			  "no interface provided. will use default"
-			  " interface (%s).",
-			  zconf.iface);
-	}
-	if (zconf.number_source_ips == 0) {
+	if (ifc->number_source_ips == 0) {
 		struct in_addr default_ip;
-		if (get_iface_ip(zconf.iface, &default_ip) < 0) {
+		if (!netcache_source_ip(ifc->name, &default_ip.s_addr)) {
+			log_debug("zmap", "source address of %s from the network cache",
+				  ifc->name);
+		} else if (get_iface_ip(ifc->name, &default_ip) < 0) {
 			log_fatal("zmap",
 				  "could not detect default IP address for %s."
 				  " Try specifying a source address (-S).",
-				  zconf.iface);
+				  ifc->name);
+		} else {
+			netcache_set_source_ip(ifc->name, default_ip.s_addr);
 		}
-		zconf.source_ip_addresses[0] = default_ip.s_addr;
-		zconf.number_source_ips++;
+		ifc->source_ip_addresses = xmalloc(sizeof(in_addr_t));
+		ifc->source_ip_addresses[0] = default_ip.s_addr;
+		ifc->number_source_ips = 1;
 		log_debug(
 		    "zmap",
 		    "no source IP address given. will use default address: %s.",
 		    inet_ntoa(default_ip));
 	}
-	if (!zconf.gw_mac_set) {
+	if (!gw_mac_set && !netcache_gateway(ifc->name, &ifc->gw_ip, ifc->gw_mac)) {
+		struct in_addr gw_ip = {.s_addr = ifc->gw_ip};
+		log_debug("zmap", "gateway IP %s on %s from the network cache",
+			  inet_ntoa(gw_ip), ifc->name);
+	} else if (!gw_mac_set) {
 		struct in_addr gw_ip;
 		memset(&gw_ip, 0, sizeof(struct in_addr));
-		if (get_default_gw(&gw_ip, zconf.iface) < 0) {
+		if (get_default_gw(&gw_ip, ifc->name) < 0) {
 			log_fatal(
 			    "zmap",
 			    "could not detect default gateway address for %s."
 			    " Try setting default gateway mac address (-G)."
 			    " If this is a newly launched machine, try completing an outgoing network connection (e.g. curl https://zmap.io), and trying again.",
-			    zconf.iface);
+			    ifc->name);
 		}
 		log_debug("zmap", "found gateway IP %s on %s", inet_ntoa(gw_ip),
-			  zconf.iface);
-		zconf.gw_ip = gw_ip.s_addr;
-		memset(&zconf.gw_mac, 0, MAC_ADDR_LEN);
-		if (get_hw_addr(&gw_ip, zconf.iface, zconf.gw_mac)) {
+			  ifc->name);
+		ifc->gw_ip = gw_ip.s_addr;
+		memset(&ifc->gw_mac, 0, MAC_ADDR_LEN);
+		if (get_hw_addr(&gw_ip, ifc->name, ifc->gw_mac)) {
 			log_fatal(
 			    "zmap",
 			    "could not detect GW MAC address for %s on %s."
@@ -182,18 +221,148 @@ static void network_config_init(void)
 			    " \"arp <gateway_ip>\" in terminal."
 			    " If this is a newly launched machine, try completing an outgoing network connection (e.g. curl https://zmap.io), and trying again."
 			    " If you are using a VPN, supply the --iplayer flag (and provide an interface via -i)",
-			    inet_ntoa(gw_ip), zconf.iface);
+			    inet_ntoa(gw_ip), ifc->name);
 		}
-		zconf.gw_mac_set = 1;
+		netcache_set_gateway(ifc->name, ifc->gw_ip, ifc->gw_mac);
 	}
-	log_debug("send", "gateway MAC address %02x:%02x:%02x:%02x:%02x:%02x",
-		  zconf.gw_mac[0], zconf.gw_mac[1], zconf.gw_mac[2],
-		  zconf.gw_mac[3], zconf.gw_mac[4], zconf.gw_mac[5]);
+	log_debug("send", "gateway MAC address of %s %02x:%02x:%02x:%02x:%02x:%02x",
+		  ifc->name, ifc->gw_mac[0], ifc->gw_mac[1], ifc->gw_mac[2],
+		  ifc->gw_mac[3], ifc->gw_mac[4], ifc->gw_mac[5]);
 }
 
-static void start_zmap(void)
+static void network_config_init(void)
+{
+	if (zconf.iface == NULL && netcache_default_iface()) {
+		zconf.iface = strdup(netcache_default_iface());
+		memset(&zconf.ifaces[0], 0, sizeof(zconf.ifaces[0]));
+		zconf.ifaces[0].name = zconf.iface;
+		zconf.num_ifaces = 1;
+	} else if (zconf.iface == NULL) {
+		zconf.iface = get_default_iface();
+		assert(zconf.iface);
+		netcache_set_default_iface(zconf.iface);
+		log_debug("zmap",
+			  "no interface provided. will use default"
+			  " interface (%s).",
+			  zconf.iface);
+		memset(&zconf.ifaces[0], 0, sizeof(zconf.ifaces[0]));
+		zconf.ifaces[0].name = zconf.iface;
+		zconf.num_ifaces = 1;
+	}
+	// the first interface takes -S and -G, and hands back what it found
+	struct iface_conf *first = &zconf.ifaces[0];
+	if (zconf.number_source_ips) {
+		if (first->number_source_ips) {
+			log_fatal("zmap", "source addresses are given both with -S and -i %s=",
+				  first->name);
+		}
+		first->source_ip_addresses = zconf.source_ip_addresses;
+		first->number_source_ips = zconf.number_source_ips;
+	}
+	if (zconf.gw_mac_set) {
+		memcpy(first->gw_mac, zconf.gw_mac, MAC_ADDR_LEN);
+	}
+	for (uint8_t i = 0; i < zconf.num_ifaces; i++) {
+		iface_config_init(&zconf.ifaces[i], i == 0 && zconf.gw_mac_set);
+	}
+	zconf.source_ip_addresses = first->source_ip_addresses;
+	zconf.number_source_ips = first->number_source_ips;
+	memcpy(zconf.gw_mac, first->gw_mac, MAC_ADDR_LEN);
+	zconf.gw_ip = first->gw_ip;
+	zconf.gw_mac_set = 1;
+}
+
+// A binary set file is mapped and its bits walked, already in order
+static uint32_t *load_list_of_ips_set(char *file, uint32_t *count)
+{
+	ipbm_t b;
+	if (ipbm_open(&b, file)) {
+		log_fatal("zmap", "unable to read address set %s: %s", file,
+			  strerror(errno));
+	}
+	uint32_t *ips = xmalloc_tag(MEM_TARGETS,
+				    (b.count ? b.count : 1) * sizeof(uint32_t));
+	uint64_t n = 0;
+	for (uint32_t i = 0; i < b.pages; i++) {
+		uint32_t base = ipbm_page_number(&b, i) << 16;
+		const uint8_t *bits = ipbm_page_bits(&b, i);
+		for (uint32_t j = 0; j < IPBM_PAGE_BYTES; j++) {
+			for (uint32_t k = 0; bits[j] >> k; k++) {
+				if (!(bits[j] & (1 << k))) {
+					continue;
+				}
+				uint32_t addr = htonl(base | (j << 3) | k);
+				if (n == b.count) {
+					log_fatal("zmap", "%s holds more addresses "
+							  "than its header says",
+						  file);
+				}
+				if (blocklist_is_allowed(addr)) {
+					ips[n++] = addr;
+				}
+			}
+		}
+	}
+	ipbm_close(&b);
+	*count = (uint32_t)n;
+	return ips;
+}
+
+// Read --list-of-ips-file into a sorted array of the distinct addresses that
+// the blocklist allows, which the senders then permute by index
+static uint32_t *load_list_of_ips(char *file, uint32_t *count)
+{
+	if (ipbm_is_file(file)) {
+		return load_list_of_ips_set(file, count);
+	}
+	// parsed in parallel into a bitmap, whose bits then come out sorted
+	// and without repeats
+	uint8_t **set = pbm_init();
+	uint64_t lines =
+	    pbm_load_from_file(set, file, (uint32_t)get_num_cores());
+	uint64_t distinct = 0;
+	int64_t set_bytes = IPBM_PAGES * sizeof(uint8_t *);
+	for (uint32_t p = 0; p < IPBM_PAGES; p++) {
+		set_bytes += set[p] ? IPBM_PAGE_BYTES : 0;
+		for (uint32_t j = 0; set[p] && j < IPBM_PAGE_BYTES; j++) {
+			distinct += __builtin_popcount(set[p][j]);
+		}
+	}
+	xalloc_account(MEM_TARGETS, set_bytes);
+	uint32_t *ips = xmalloc_tag(MEM_TARGETS,
+				    (distinct ? distinct : 1) * sizeof(uint32_t));
+	uint64_t n = 0;
+	for (uint32_t p = 0; p < IPBM_PAGES; p++) {
+		if (!set[p]) {
+			continue;
+		}
+		for (uint32_t j = 0; j < IPBM_PAGE_BYTES; j++) {
+			for (uint32_t k = 0; set[p][j] >> k; k++) {
+				if (!(set[p][j] & (1 << k))) {
+					continue;
+				}
+				uint32_t addr = htonl(p << 16 | j << 3 | k);
+				if (blocklist_is_allowed(addr)) {
+					ips[n++] = addr;
+				}
+			}
+		}
+		xfree(set[p]);
+	}
+	xfree(set);
+	xalloc_account(MEM_TARGETS, -set_bytes);
+	if (n > UINT32_MAX) {
+		log_fatal("zmap", "too many addresses in %s", file);
+	}
+	log_debug("zmap",
+		  "%" PRIu64 " addresses in %s, %" PRIu64 " distinct",
+		  lines, file, distinct);
+	*count = (uint32_t)n;
+	return ips;
+}
+
+static void output_init(void)
 {
-	// Initialization
 	assert(zconf.output_module && "no output module set");
 	log_debug("zmap", "output module: %s", zconf.output_module->name);
 	if (zconf.output_module && zconf.output_module->init) {
@@ -204,14 +373,198 @@ static void start_zmap(void)
 			    "output module did not initialize successfully.");
 		}
 	}
+}
+
+// once receiving is over: the metadata, then closing the modules
+static void output_finish(void)
+{
+	int queued = zconf.output_queue_size && !zconf.dryrun;
+	if (queued) {
+		// closes the output module, and settles the output counts
+		// before they go into the metadata
+		output_queue_finish();
+	}
+	if (zconf.metadata_filename) {
+		json_metadata(zconf.metadata_file);
+	}
+	if (!queued && zconf.output_module && zconf.output_module->close) {
+		zconf.output_module->close(&zconf, &zsend, &zrecv);
+	}
+	if (zconf.probe_module && zconf.probe_module->close) {
+		zconf.probe_module->close(&zconf, &zsend, &zrecv);
+	}
+	extra_probes_close();
+}
+
+// --replay-pcap: nothing is sent, the receive side runs on this thread
+// until it has read the whole capture
+static void replay_zmap(void)
+{
+	output_init();
+	if (zconf.probe_module->global_initialize &&
+	    zconf.probe_module->global_initialize(&zconf)) {
+		log_fatal("zmap", "global initialization for probe module "
+				  "failed.");
+	}
+	extra_probes_global_initialize();
+	if (validate_load_key(zconf.validation_key_filename)) {
+		log_fatal("zmap", "unable to load the validation key");
+	}
+	if (zconf.save_validation_key_filename &&
+	    validate_save_key(zconf.save_validation_key_filename)) {
+		log_fatal("zmap", "unable to save the validation key");
+	}
+	if (zconf.output_module && zconf.output_module->start) {
+		zconf.output_module->start(&zconf, &zsend, &zrecv);
+	}
+	if (zconf.output_queue_size) {
+		output_queue_init();
+	}
+	// the processing threads and their sequencer, if any
+	uint32_t workers = zconf.recv_processing_threads
+			       ? zconf.recv_processing_threads + 1
+			       : 0;
+	uint32_t *worker_cpus = xcalloc(workers + 1, sizeof(uint32_t));
+	for (uint32_t i = 0; i < workers; i++) {
+		worker_cpus[i] = zconf.pin_cores[(i + 1) % zconf.pin_cores_len];
+	}
+	set_cpu(zconf.pin_cores[0]);
+	zsend.start = now();
+	recv_run(&recv_ready_mutex, worker_cpus);
+	free(worker_cpus);
+
+	double secs = zrecv.finish - zrecv.start;
+	log_info("zmap",
+		 "replayed %" PRIu64 " frames in %.3f s (%.0f frames/s): %" PRIu64
+		 " validated, %" PRIu64 " failed validation",
+		 zrecv.pcap_recv, secs, secs > 0 ? zrecv.pcap_recv / secs : 0,
+		 zrecv.stats.validation_passed, zrecv.stats.validation_failed);
+	output_finish();
+	log_info("zmap", "completed");
+}
+
+// --worker-processes, in the supervisor: the output module, fed from the
+// workers until they have all exited, then the metadata from their
+// numbers
+static void supervise_zmap(void)
+{
+	output_init();
+	if (zconf.output_module && zconf.output_module->start) {
+		zconf.output_module->start(&zconf, &zsend, &zrecv);
+	}
+	drop_privs();
+	uint32_t failed = workers_supervise();
+	if (failed) {
+		log_error("zmap", "%u of %u worker processes failed, their part "
+				  "of the scan is incomplete",
+			  failed, zconf.worker_processes);
+	}
+	// the probe module only ever ran in the workers
+	if (zconf.metadata_filename) {
+		json_metadata(zconf.metadata_file);
+	}
+	if (zconf.output_module->close) {
+		zconf.output_module->close(&zconf, &zsend, &zrecv);
+	}
+	log_info("zmap", "completed");
+}
+
+// --dry-estimate-memory: what is already allocated (the constraint and the
+// targets) as measured, and what the scan would go on to allocate as the
+// modules work it out from the configuration
+static void estimate_memory(void)
+{
+	uint64_t est[MEM_TAGS] = {0};
+	xalloc_usage(MEM_CONSTRAINT, &est[MEM_CONSTRAINT], NULL);
+	xalloc_usage(MEM_TARGETS, &est[MEM_TARGETS], NULL);
+	send_memory_estimate(est);
+	recv_memory_estimate(est);
+	if (zconf.output_queue_size) {
+		output_queue_memory_estimate(est);
+	}
+	uint64_t total = 0;
+	printf("%-14s %12s\n", "subsystem", "MiB");
+	for (int i = 0; i < MEM_TAGS; i++) {
+		const char *note = "";
+		if (i == MEM_CONSTRAINT || i == MEM_TARGETS) {
+			note = "  measured";
+		} else if (i == MEM_DEDUP && est[i]) {
+			note = "  at most, if every target answers";
+		}
+		printf("%-14s %12.1f%s\n", MEM_TAG_NAMES[i],
+		       est[i] / (double)(1 << 20), note);
+		total += est[i];
+	}
+	printf("%-14s %12.1f\n", "total", total / (double)(1 << 20));
+}
+
+static void finish_zmap(void)
+{
+	checkpoint_finish();
+	sample_log();
+	shaping_log();
+	output_finish();
+#ifdef PFRING
+	pfring_zc_destroy_cluster(zconf.pf.cluster);
+#endif
+#ifdef XDP
+	if (!zconf.dryrun) {
+		xdp_cleanup();
+	}
+#endif
+#ifdef XDP_FILTER
+	xdp_filter_cleanup();
+#endif
+#ifdef DPDK
+	if (!zconf.dryrun) {
+		dpdk_cleanup();
+	}
+#endif
+	log_info("zmap", "completed");
+}
+
+// --event-loop: this thread sends, receives and monitors
+static void start_event_loop(iterator_t *it)
+{
+	log_debug("zmap", "Pinning the event loop to core %u",
+		  zconf.pin_cores[0]);
+	set_cpu(zconf.pin_cores[0]);
+	recv_start(&recv_ready_mutex, NULL);
+	sock_t sock = get_socket(0);
+	shard_t *shard = get_shard(it, 0);
+	checkpoint_start();
+	monitor_init();
+#ifndef PFRING
+	drop_privs();
+#endif
+	event_loop_run(sock, shard, it, &recv_ready_mutex);
+}
+
+static void start_zmap(void)
+{
+	// Initialization
+	output_init();
 
 	iterator_t *it = send_init();
 	if (!it) {
 		log_fatal("zmap", "unable to initialize sending component");
 	}
+	// everything about the interfaces has been looked up by now
+	if (zconf.network_cache_filename) {
+		netcache_save(zconf.network_cache_filename);
+	}
+	checkpoint_init(it);
 	if (zconf.output_module && zconf.output_module->start) {
 		zconf.output_module->start(&zconf, &zsend, &zrecv);
 	}
+	if (zconf.output_queue_size && !zconf.dryrun) {
+		output_queue_init();
+	}
+	if (zconf.event_loop) {
+		start_event_loop(it);
+		finish_zmap();
+		return;
+	}
 
 	// start threads
 	uint32_t cpu = 0;
@@ -221,6 +574,19 @@ static void start_zmap(void)
 		recv_arg_t *recv_arg = xmalloc(sizeof(recv_arg_t));
 		recv_arg->cpu = zconf.pin_cores[cpu % zconf.pin_cores_len];
 		cpu += 1;
+		// extra capture threads, then processing threads and their
+		// sequencer
+		uint32_t workers = zconf.recv_threads - 1;
+		if (zconf.recv_processing_threads) {
+			workers += zconf.recv_processing_threads + 1;
+		}
+		recv_arg->worker_cpus =
+		    xcalloc(workers + 1, sizeof(uint32_t));
+		for (uint32_t i = 0; i < workers; i++) {
+			recv_arg->worker_cpus[i] =
+			    zconf.pin_cores[cpu % zconf.pin_cores_len];
+			cpu += 1;
+		}
 		r = pthread_create(&trecv, NULL, start_recv, recv_arg);
 		if (r != 0) {
 			log_fatal("zmap", "unable to create recv thread");
@@ -241,8 +607,13 @@ static void start_zmap(void)
 	    NULL, 0, zconf.pin_cores[cpu & zconf.pin_cores_len]);
 	cpu += 1;
 #endif
+	// the target threads are on the cores after the send threads'
+	send_targets_start(cpu + zconf.senders);
 	tsend = xmalloc(zconf.senders * sizeof(pthread_t));
-	for (uint8_t i = 0; i < zconf.senders; i++) {
+	// the send cores, for the layout reported once they are all up
+	char send_cores[256] = "";
+	size_t send_cores_len = 0;
+	for (uint16_t i = 0; i < zconf.senders; i++) {
 		sock_t sock;
 		if (zconf.dryrun) {
 			sock = get_dryrun_socket();
@@ -255,6 +626,12 @@ static void start_zmap(void)
 		arg->shard = get_shard(it, i);
 		arg->cpu = zconf.pin_cores[cpu % zconf.pin_cores_len];
 		cpu += 1;
+		if (send_cores_len < sizeof(send_cores)) {
+			send_cores_len += snprintf(
+			    send_cores + send_cores_len,
+			    sizeof(send_cores) - send_cores_len, "%s%u",
+			    i ? "," : "", arg->cpu);
+		}
 		int r = pthread_create(&tsend[i], NULL, start_send, arg);
 		if (r != 0) {
 			log_fatal("zmap", "unable to create send thread");
@@ -262,6 +639,23 @@ static void start_zmap(void)
 		}
 	}
 	log_debug("zmap", "%d sender threads spawned", zconf.senders);
+	cpu += zconf.target_threads;
+	char layout[320];
+	if (zconf.dryrun) {
+		snprintf(layout, sizeof(layout), "sending on cores %s",
+			 send_cores);
+	} else {
+		snprintf(layout, sizeof(layout),
+			 "receiving on core %u, sending on cores %s",
+			 zconf.pin_cores[0], send_cores);
+	}
+	if (zconf.numa_node >= 0) {
+		log_info("zmap", "%s is on NUMA node %d: %s", zconf.iface,
+			 zconf.numa_node, layout);
+	} else {
+		log_debug("zmap", "%s", layout);
+	}
+	checkpoint_start();
 
 	if (!zconf.dryrun) {
 		monitor_init();
@@ -281,7 +675,7 @@ static void start_zmap(void)
 #endif
 
 	// wait for completion
-	for (uint8_t i = 0; i < zconf.senders; i++) {
+	for (uint16_t i = 0; i < zconf.senders; i++) {
 		int r = pthread_join(tsend[i], NULL);
 		if (r != 0) {
 			log_fatal("zmap", "unable to join send thread");
@@ -289,6 +683,15 @@ static void start_zmap(void)
 		}
 	}
 	log_debug("zmap", "senders finished");
+	send_targets_finish();
+	if (zconf.dryrun == DRYRUN_NULL) {
+		double secs = zsend.finish - zsend.start;
+		log_info("zmap",
+			 "built %" PRIu64 " packets in %.3f s with %hu send "
+			 "threads (%.0f packets/s)",
+			 zsend.packets_sent, secs, zconf.senders,
+			 secs > 0 ? zsend.packets_sent / secs : 0);
+	}
 #ifdef PFRING
 	pfring_zc_kill_worker(zw);
 	pfring_zc_sync_queue(zconf.pf.send, tx_only);
@@ -301,7 +704,8 @@ static void start_zmap(void)
 			log_fatal("zmap", "unable to join recv thread");
 			exit(EXIT_FAILURE);
 		}
-		if (!zconf.quiet || zconf.status_updates_file) {
+		if (!zconf.quiet || zconf.status_updates_file ||
+		    zconf.metrics_port || zconf.stats_shm) {
 			pthread_join(tmon, NULL);
 			if (r != 0) {
 				log_fatal("zmap",
@@ -311,20 +715,59 @@ static void start_zmap(void)
 		}
 	}
 
-	// finished
-	if (zconf.metadata_filename) {
-		json_metadata(zconf.metadata_file);
-	}
-	if (zconf.output_module && zconf.output_module->close) {
-		zconf.output_module->close(&zconf, &zsend, &zrecv);
-	}
-	if (zconf.probe_module && zconf.probe_module->close) {
-		zconf.probe_module->close(&zconf, &zsend, &zrecv);
+	finish_zmap();
+}
+
+// records=n,bytes=n,seconds=n in any combination; n may end in K, M or G
+static void parse_output_rotate(const char *spec)
+{
+	const char *p = spec;
+	while (*p) {
+		size_t n = strcspn(p, ",");
+		const char *eq = memchr(p, '=', n);
+		if (!eq) {
+			log_fatal("zmap", "invalid --output-rotate limit: %.*s",
+				  (int)n, p);
+		}
+		char *end;
+		errno = 0;
+		uint64_t v = strtoull(eq + 1, &end, 10);
+		switch (*end) {
+		case 'K':
+			v <<= 10;
+			end++;
+			break;
+		case 'M':
+			v <<= 20;
+			end++;
+			break;
+		case 'G':
+			v <<= 30;
+			end++;
+			break;
+		}
+		if (errno || end != p + n || end == eq + 1 || !v) {
+			log_fatal("zmap", "invalid --output-rotate limit: %.*s",
+				  (int)n, p);
+		}
+		size_t klen = (size_t)(eq - p);
+		if (klen == strlen("records") && !strncmp(p, "records", klen)) {
+			zconf.output_rotate_records = v;
+		} else if (klen == strlen("bytes") &&
+			   !strncmp(p, "bytes", klen)) {
+			zconf.output_rotate_bytes = v;
+		} else if (klen == strlen("seconds") &&
+			   !strncmp(p, "seconds", klen)) {
+			zconf.output_rotate_secs = v;
+		} else {
+			log_fatal("zmap", "unknown --output-rotate limit %.*s, legal ones are records, bytes and seconds",
+				  (int)klen, p);
+		}
+		p += n;
+		if (*p == ',') {
+			p++;
+		}
 	}
-#ifdef PFRING
-	pfring_zc_destroy_cluster(zconf.pf.cluster);
-#endif
-	log_info("zmap", "completed");
 }
 
 #define SET_IF_GIVEN(DST, ARG)                  \
@@ -404,6 +847,10 @@ int main(int argc, char *argv[])
 			  strerror(errno));
 	}
 	log_init(log_location, zconf.log_level, zconf.syslog, "zmap");
+	if (log_async_start()) {
+		log_warn("zmap", "unable to start log thread, logging "
+				 "synchronously");
+	}
 	log_debug("zmap", "zmap main thread started");
 	if (config_loaded) {
 		log_debug("zmap", "Loaded configuration file %s",
@@ -514,6 +961,10 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	if (args.cpu_features_given && cpu_restrict(args.cpu_features_arg)) {
+		log_fatal("zmap", "invalid --cpu-features '%s'",
+			  args.cpu_features_arg);
+	}
 	aes128_selftest();
 
 	// now that we know the probe module, let's find what it supports
@@ -540,6 +991,7 @@ int main(int argc, char *argv[])
 	}
 	zconf.fsconf.app_success_index =
 	    fds_get_index_by_name(fds, "app_success");
+	zconf.fsconf.rtt_index = fds_get_index_by_name(fds, "rtt_us");
 
 	if (zconf.fsconf.app_success_index < 0) {
 		log_debug("fieldset", "probe module does not supply "
@@ -558,32 +1010,173 @@ int main(int argc, char *argv[])
 	}
 	zconf.ignore_invalid_hosts = args.ignore_blocklist_errors_given;
 	SET_BOOL(zconf.dryrun, dryrun);
+	if (args.null_dryrun_given) {
+		if (zconf.dryrun) {
+			log_fatal("zmap", "--null-dryrun cannot be combined with --dryrun");
+		}
+		zconf.dryrun = DRYRUN_NULL;
+	}
+	// nothing is sent, and no interface taken over, to estimate
+	if (args.dry_estimate_memory_given && !zconf.dryrun) {
+		zconf.dryrun = DRYRUN_PRINT;
+	}
+	SET_IF_GIVEN(zconf.replay_filename, replay_pcap);
+	SET_IF_GIVEN(zconf.validation_key_filename, validation_key);
+	SET_IF_GIVEN(zconf.save_validation_key_filename, save_validation_key);
+	if (!strcmp(args.validation_method_arg, "auto")) {
+		zconf.validation_method = VALIDATION_METHOD_AUTO;
+	} else if (!strcmp(args.validation_method_arg, "aes")) {
+		zconf.validation_method = VALIDATION_METHOD_AES;
+	} else if (!strcmp(args.validation_method_arg, "siphash")) {
+		zconf.validation_method = VALIDATION_METHOD_SIPHASH;
+	} else {
+		log_fatal("zmap", "Invalid validation method provided. Legal "
+				  "options are: auto, aes, siphash.");
+	}
+	if (zconf.replay_filename) {
+#if defined(PFRING) || defined(NETMAP) || defined(XDP) || defined(DPDK)
+		log_fatal("zmap", "--replay-pcap is only supported by the pcap receiver");
+#endif
+		if (!zconf.validation_key_filename) {
+			log_fatal("zmap", "--replay-pcap requires --validation-key, "
+					  "as saved by the scan with --save-validation-key");
+		}
+		if (zconf.dryrun) {
+			log_fatal("zmap", "--replay-pcap cannot be combined with "
+					  "--dryrun or --null-dryrun");
+		}
+	}
 	// added by pqm
 	SET_BOOL(zconf.dnsippadding, dnsippadding);
+	if (args.dns_log_payloads_given) {
+		if (args.dns_log_payloads_arg <= 0) {
+			log_fatal("zmap", "--dns-log-payloads must be positive");
+		}
+		zconf.dns_log_payloads = (uint32_t)args.dns_log_payloads_arg;
+	}
 	SET_BOOL(zconf.quiet, quiet);
+	SET_BOOL(zconf.stage_timing, stage_timing);
 	SET_BOOL(zconf.no_header_row, no_header_row);
+	SET_BOOL(zconf.flat_bitmap, flat_bitmap);
+	SET_BOOL(zconf.compressed_bitmap, compressed_bitmap);
+	if (zconf.flat_bitmap && args.compressed_bitmap_given) {
+		log_fatal("zmap", "--flat-bitmap and --compressed-bitmap can't "
+				  "be used together");
+	}
+	if (zconf.flat_bitmap) {
+		// over the default of low-memory builds
+		zconf.compressed_bitmap = 0;
+	}
 	zconf.cooldown_secs = args.cooldown_time_arg;
+	if (args.adaptive_cooldown_arg < 0 || args.adaptive_cooldown_arg > 100) {
+		log_fatal("zmap", "--adaptive-cooldown must be between 0 and 100");
+	}
+	zconf.adaptive_cooldown = args.adaptive_cooldown_arg;
+	SET_BOOL(zconf.end_when_answered, end_when_answered);
 	SET_IF_GIVEN(zconf.output_filename, output_file);
 	SET_IF_GIVEN(zconf.blocklist_filename, blocklist_file);
 	SET_IF_GIVEN(zconf.list_of_ips_filename, list_of_ips_file);
+	zconf.list_of_ips_stream =
+	    ipv4_target_stream_is_stream(zconf.list_of_ips_filename);
 	SET_IF_GIVEN(zconf.probe_args, probe_args);
+	SET_IF_GIVEN(zconf.tcp_payload, tcp_payload);
 	SET_IF_GIVEN(zconf.probe_ttl, probe_ttl);
 	SET_IF_GIVEN(zconf.output_args, output_args);
-	SET_IF_GIVEN(zconf.iface, interface);
+	if (args.interface_given) {
+		ifaces_parse(args.interface_arg, (int)args.interface_given);
+	}
 	SET_IF_GIVEN(zconf.max_runtime, max_runtime);
 	SET_IF_GIVEN(zconf.max_results, max_results);
 	SET_IF_GIVEN(zconf.rate, rate);
+	if (args.adaptive_rate_given) {
+		if (args.adaptive_rate_arg <= 0) {
+			log_fatal("zmap", "--adaptive-rate must be positive");
+		}
+		zconf.adaptive_rate = args.adaptive_rate_arg;
+	}
 	SET_IF_GIVEN(zconf.packet_streams, probes);
+	if (args.probe_spacing_given) {
+		enforce_range("probe-spacing", args.probe_spacing_arg, 0, 60000);
+		zconf.probe_spacing = args.probe_spacing_arg;
+		if (zconf.probe_spacing && zconf.packet_streams < 2) {
+			log_warn("zmap", "--probe-spacing has no effect with a "
+					 "single probe per target");
+		}
+	}
 	SET_IF_GIVEN(zconf.status_updates_file, status_updates_file);
+	SET_IF_GIVEN(zconf.drop_log_filename, drop_log);
+	if (args.metrics_port_given) {
+		if (args.metrics_port_arg < 1 || args.metrics_port_arg > 0xFFFF) {
+			log_fatal("zmap", "--metrics-port must be between 1 and 65535");
+		}
+		zconf.metrics_port = (uint16_t)args.metrics_port_arg;
+	}
+	zconf.metrics_address = args.metrics_address_arg;
+	SET_IF_GIVEN(zconf.stats_shm, stats_shm);
+	if (args.stats_shm_interval_given) {
+		if (args.stats_shm_interval_arg < 1 ||
+		    args.stats_shm_interval_arg > 1000) {
+			log_fatal("zmap", "--stats-shm-interval must be between 1 "
+					  "and 1000 ms");
+		}
+		zconf.stats_shm_interval_ms = args.stats_shm_interval_arg;
+	}
 	SET_IF_GIVEN(zconf.retries, retries);
 	SET_IF_GIVEN(zconf.max_sendto_failures, max_sendto_failures);
 	SET_IF_GIVEN(zconf.min_hitrate, min_hitrate);
 	SET_IF_GIVEN(zconf.ipv6_target_filename, ipv6_target_file);
 	SET_IF_GIVEN(zconf.ipv6_source_ip, ipv6_source_ip);
+	SET_IF_GIVEN(zconf.ipv6_target_prefixes_filename, ipv6_target_prefixes);
+	if (args.ipv6_target_pattern_given) {
+		zconf.ipv6_target_patterns = args.ipv6_target_pattern_arg;
+		zconf.ipv6_target_patterns_len =
+		    (int)args.ipv6_target_pattern_given;
+	}
+	if (zconf.ipv6_target_patterns_len && zconf.ipv6_target_filename) {
+		log_fatal("ipv6", "--ipv6-target-pattern and --ipv6-target-file "
+				  "are mutually exclusive");
+	}
+	if (zconf.ipv6_target_prefixes_filename &&
+	    !zconf.ipv6_target_patterns_len) {
+		log_fatal("ipv6",
+			  "--ipv6-target-prefixes requires --ipv6-target-pattern");
+	}
+	zconf.ipv6 =
+	    zconf.ipv6_target_filename || zconf.ipv6_target_patterns_len;
 
-	if (zconf.ipv6_target_filename && !zconf.ipv6_source_ip) {
+	if (zconf.ipv6 && !zconf.ipv6_source_ip) {
 		log_fatal("ipv6", "No IPv6 source address specified");
 	}
+	if (zconf.ipv6_source_ip && ipv6_source_parse(zconf.ipv6_source_ip)) {
+		log_fatal("ipv6", "invalid IPv6 source address or prefix: %s",
+			  zconf.ipv6_source_ip);
+	}
+	if (zconf.ipv6 && zconf.list_of_ips_filename) {
+		log_fatal("ipv6", "--list-of-ips-file is IPv4 only, use "
+				  "--ipv6-target-file on its own");
+	}
+	if (zconf.ipv6_target_patterns_len) {
+		ipv6_pattern_init(zconf.ipv6_target_patterns,
+				  zconf.ipv6_target_patterns_len,
+				  zconf.ipv6_target_prefixes_filename);
+	}
+	if (args.ipv6_alias_detect_given) {
+		if (!zconf.ipv6) {
+			log_fatal("ipv6", "--ipv6-alias-detect needs IPv6 targets");
+		}
+		enforce_range("ipv6-alias-prefix-len", args.ipv6_alias_prefix_len_arg,
+			      16, 64);
+		enforce_range("ipv6-alias-tests", args.ipv6_alias_tests_arg, 1,
+			      IPV6_ALIAS_MAX_TESTS);
+		if (args.ipv6_alias_threshold_arg < 1) {
+			log_fatal("ipv6", "--ipv6-alias-threshold must be at least 1");
+		}
+		zconf.ipv6_alias_detect = 1;
+		zconf.ipv6_alias_prefix_len = (uint8_t)args.ipv6_alias_prefix_len_arg;
+		zconf.ipv6_alias_threshold = (uint32_t)args.ipv6_alias_threshold_arg;
+		zconf.ipv6_alias_tests = (uint32_t)args.ipv6_alias_tests_arg;
+		ipv6_alias_init();
+	}
 
 	if (zconf.retries < 0) {
 		log_fatal("zmap", "Invalid retry count");
@@ -648,6 +1241,29 @@ int main(int argc, char *argv[])
 		    " If you have modified the default blocklist, you can ignore this message.");
 	}
 	SET_IF_GIVEN(zconf.allowlist_filename, allowlist_file);
+	SET_IF_GIVEN(zconf.blocklist_cache_filename, blocklist_cache);
+	SET_IF_GIVEN(zconf.network_cache_filename, network_cache);
+	SET_BOOL(zconf.loose_capture_filter, loose_capture_filter);
+	SET_BOOL(zconf.xdp_filter, xdp_filter);
+	SET_IF_GIVEN(zconf.xdp_filter_object, xdp_filter_object);
+#ifdef XDP_FILTER
+	if (!zconf.xdp_filter_object) {
+		zconf.xdp_filter_object = ZMAP_XDP_FILTER_OBJECT;
+	}
+	if (zconf.xdp_filter && zconf.num_ifaces > 1) {
+		log_fatal("zmap", "--xdp-filter takes a single interface");
+	}
+#else
+	if (zconf.xdp_filter) {
+		log_fatal("zmap", "--xdp-filter needs ZMap built with AF_XDP or "
+				  "WITH_XDP_FILTER");
+	}
+#endif
+	if (args.network_cache_ttl_given) {
+		enforce_range("network-cache-ttl", args.network_cache_ttl_arg, 0,
+			      INT32_MAX);
+		zconf.network_cache_ttl = args.network_cache_ttl_arg;
+	}
 	zconf.validate_source_port_override = VALIDATE_SRC_PORT_UNSET_OVERRIDE;
 	if (args.validate_source_port_given) {
 		if (strcmp(args.validate_source_port_arg, "enable") == 0) {
@@ -728,17 +1344,17 @@ int main(int argc, char *argv[])
 		parse_ports(line, zconf.ports);
 	}
 
-	if (zconf.ipv6_target_filename && zconf.ports->port_count > 1) {
-		log_fatal("ipv6", "IPv6 currently only supports one port");
-	}
-
+	// several ports, or any scan of a low-memory build where the window's
+	// fixed-size table is the bound on memory the full set isn't, go to a
+	// window unless the targets answered must be told apart
+	int dedup_window_default =
+	    zconf.ports->port_count > 1 ||
+	    (DEFAULT_DEDUP_WINDOW && !zconf.end_when_answered);
 	if (args.dedup_method_given) {
 		if (!strcmp(args.dedup_method_arg, "default")) {
-			if (zconf.ports->port_count > 1) {
-				zconf.dedup_method = DEDUP_METHOD_WINDOW;
-			} else {
-				zconf.dedup_method = DEDUP_METHOD_FULL;
-			}
+			zconf.dedup_method = dedup_window_default
+						 ? DEDUP_METHOD_WINDOW
+						 : DEDUP_METHOD_FULL;
 		} else if (!strcmp(args.dedup_method_arg, "none")) {
 			zconf.dedup_method = DEDUP_METHOD_NONE;
 		} else if (!strcmp(args.dedup_method_arg, "full")) {
@@ -751,23 +1367,43 @@ int main(int argc, char *argv[])
 			    "Invalid dedup option provided. Legal options are: default, none, full, window.");
 		}
 	} else {
-		if (zconf.ports->port_count > 1) {
-			zconf.dedup_method = DEDUP_METHOD_WINDOW;
-		} else {
-			zconf.dedup_method = DEDUP_METHOD_FULL;
-		}
+		zconf.dedup_method = dedup_window_default ? DEDUP_METHOD_WINDOW
+							  : DEDUP_METHOD_FULL;
 	}
+	// with several ports, full de-duplication is keyed on (address, port),
+	// which a single flat bitmap of addresses can't hold
 	if (zconf.dedup_method == DEDUP_METHOD_FULL &&
-	    zconf.ports->port_count > 1) {
-		log_fatal(
-		    "dedup",
-		    "full response de-duplication is not supported for multiple ports");
-	}
-	if (zconf.dedup_method == DEDUP_METHOD_WINDOW) {
+	    zconf.ports->port_count > 1 && zconf.flat_bitmap &&
+	    !zconf.ipv6) {
+		log_fatal("dedup", "--flat-bitmap is only supported for a single "
+				   "port, full de-duplication of several uses a "
+				   "paged bitmap");
+	}
+	if (args.dedup_window_time_given) {
+		if (args.dedup_window_time_arg <= 0) {
+			log_fatal("dedup", "--dedup-window-time must be positive");
+		}
+		if (args.dedup_window_size_given) {
+			log_fatal("dedup", "--dedup-window-time and "
+					   "--dedup-window-size can't be combined");
+		}
+		if (!args.dedup_method_given) {
+			zconf.dedup_method = DEDUP_METHOD_WINDOW;
+		} else if (zconf.dedup_method != DEDUP_METHOD_WINDOW) {
+			log_fatal("dedup", "--dedup-window-time needs "
+					   "--dedup-method=window");
+		}
+		zconf.dedup_window_time = args.dedup_window_time_arg;
+		log_info("dedup",
+			 "Response deduplication method is %s over the last "
+			 "%.3f seconds",
+			 DEDUP_METHOD_NAMES[zconf.dedup_method],
+			 zconf.dedup_window_time);
+	} else if (zconf.dedup_method == DEDUP_METHOD_WINDOW) {
 		if (args.dedup_window_size_given) {
 			zconf.dedup_window_size = args.dedup_window_size_arg;
 		} else {
-			zconf.dedup_window_size = 1000000;
+			zconf.dedup_window_size = DEFAULT_DEDUP_WINDOW_SIZE;
 		}
 		log_info("dedup",
 			 "Response deduplication method is %s with size %u",
@@ -777,6 +1413,13 @@ int main(int argc, char *argv[])
 		log_info("dedup", "Response deduplication method is %s",
 			 DEDUP_METHOD_NAMES[zconf.dedup_method]);
 	}
+	// a window may forget a target and count its success twice
+	if (zconf.end_when_answered &&
+	    zconf.dedup_method != DEDUP_METHOD_FULL) {
+		log_fatal("dedup", "--end-when-answered needs "
+				   "--dedup-method=full to tell which targets "
+				   "have answered");
+	}
 
 	// process the list of requested output fields.
 	if (args.output_fields_given) {
@@ -830,6 +1473,22 @@ int main(int argc, char *argv[])
 				     &zconf.fsconf.defs)) {
 			log_fatal("zmap", "Invalid filter");
 		}
+		zconf.filter.program = filter_compile(zconf.filter.expression);
+		// what can be decided before the probe module's fields are
+		// built, for the modules that tell success from the headers
+		uint8_t *early = xcalloc(zconf.fsconf.defs.len, 1);
+		for (int i = 0; i < ip_fields_len; i++) {
+			early[i] = 1;
+		}
+		early[zconf.fsconf.success_index] = 1;
+		node_t *prefix = filter_prefix(zconf.filter.expression, early);
+		xfree(early);
+		if (prefix && zconf.probe_module->classify) {
+			zconf.filter.early = filter_compile(prefix);
+			log_debug("filter", "conditions on IP header fields and "
+					    "success are checked before the "
+					    "probe module's fields are built");
+		}
 		zconf.output_filter_str = args.output_filter_arg;
 		log_debug("filter", "will use output filter %s",
 			  args.output_filter_arg);
@@ -847,7 +1506,41 @@ int main(int argc, char *argv[])
 		    "default behavior, you can set an output filter similar to the "
 		    "following: --output-filter=\"success=1 && repeat=0\".");
 	}
+	// only what is output, filtered on, or read by recv needs to be built
+	for (int i = 0; i < zconf.fsconf.translation.len; i++) {
+		fds_set_needed(&zconf.fsconf.defs,
+			       zconf.fsconf.translation.translation[i]);
+	}
+	fds_set_needed(&zconf.fsconf.defs, zconf.fsconf.success_index);
+	fds_set_needed(&zconf.fsconf.defs, zconf.fsconf.classification_index);
+	if (zconf.fsconf.app_success_index >= 0) {
+		fds_set_needed(&zconf.fsconf.defs,
+			       zconf.fsconf.app_success_index);
+	}
+	if (zconf.fsconf.rtt_index >= 0) {
+		fds_set_needed(&zconf.fsconf.defs, zconf.fsconf.rtt_index);
+	}
+	filter_mark_needed(zconf.filter.expression, &zconf.fsconf.defs);
 
+	if (zconf.num_ifaces > 1) {
+#if defined(PFRING) || defined(NETMAP) || defined(XDP) || defined(DPDK) || !defined(__linux__)
+		log_fatal("zmap", "scanning through several interfaces is only supported by the Linux raw socket sender");
+#endif
+		if (args.source_ip_given || args.gateway_mac_given ||
+		    args.source_mac_given) {
+			log_fatal("zmap", "with several interfaces, give source addresses as -i name=addresses; "
+					  "gateway and source MAC addresses are looked up for each interface");
+		}
+		if (zconf.send_ip_pkts) {
+			log_fatal("zmap", "--iplayer cannot be combined with several interfaces");
+		}
+		if (zconf.ipv6) {
+			log_fatal("zmap", "IPv6 scans are only supported through a single interface");
+		}
+		if (zconf.replay_filename) {
+			log_fatal("zmap", "--replay-pcap takes no interface");
+		}
+	}
 	if (args.source_ip_given) {
 		parse_source_ip_addresses(args.source_ip_arg);
 	}
@@ -873,8 +1566,29 @@ int main(int argc, char *argv[])
 
 		zconf.hw_mac_set = 1;
 	}
+	SET_IF_GIVEN(zconf.checkpoint_filename, checkpoint_file);
+	if (args.checkpoint_interval_arg <= 0) {
+		log_fatal("zmap", "--checkpoint-interval must be positive");
+	}
+	zconf.checkpoint_interval = args.checkpoint_interval_arg;
+	SET_BOOL(zconf.resume, resume);
+	if (zconf.resume && !zconf.checkpoint_filename) {
+		log_fatal("zmap", "--resume requires --checkpoint-file");
+	}
+	if (zconf.checkpoint_filename && zconf.list_of_ips_stream) {
+		log_fatal("zmap", "--checkpoint-file can't resume a scan of "
+				  "--list-of-ips-file=-, which is read as it goes");
+	}
 	// Check for a random seed
-	if (args.seed_given) {
+	if (zconf.resume) {
+		// the one the checkpointed scan was started with
+		checkpoint_load();
+		if (args.seed_given && (uint64_t)args.seed_arg != zconf.seed) {
+			log_fatal("zmap", "--seed differs from that of the "
+					  "checkpointed scan");
+		}
+		zconf.seed_provided = 1;
+	} else if (args.seed_given) {
 		zconf.seed = args.seed_arg;
 		zconf.seed_provided = 1;
 	} else {
@@ -890,7 +1604,8 @@ int main(int argc, char *argv[])
 	// Set up sharding
 	zconf.shard_num = 0;
 	zconf.total_shards = 1;
-	if ((args.shard_given || args.shards_given) && !args.seed_given) {
+	if ((args.shard_given || args.shards_given) && !args.seed_given &&
+	    !zconf.resume) {
 		log_fatal("zmap", "Need to specify seed if sharding a scan");
 	}
 	if (args.shard_given ^ args.shards_given) {
@@ -906,6 +1621,84 @@ int main(int argc, char *argv[])
 	}
 	SET_IF_GIVEN(zconf.shard_num, shard);
 	SET_IF_GIVEN(zconf.total_shards, shards);
+	SET_IF_GIVEN(zconf.coordinator, coordinator);
+	if (zconf.coordinator) {
+		if (args.shard_given || args.shards_given) {
+			log_fatal("zmap", "--coordinator hands out the ranges of "
+					  "the scan in place of --shards");
+		}
+		if (!args.seed_given) {
+			log_fatal("zmap", "--coordinator needs the --seed of the "
+					  "coordinator");
+		}
+		if (zconf.checkpoint_filename) {
+			log_fatal("zmap", "--coordinator can't be combined with "
+					  "--checkpoint-file");
+		}
+		if (zconf.ipv6 || zconf.list_of_ips_filename) {
+			log_fatal("zmap", "--coordinator only scans the IPv4 "
+					  "allowlist and blocklist");
+		}
+	}
+	if (args.sample_given) {
+		if (args.sample_arg <= 0 || args.sample_arg > 1) {
+			log_fatal("zmap", "--sample must be more than 0 and at "
+					  "most 1");
+		}
+		if (zconf.ipv6 || zconf.list_of_ips_filename ||
+		    args.delta_from_given) {
+			log_fatal("zmap", "--sample only samples the IPv4 "
+					  "allowlist and blocklist");
+		}
+		enforce_range("sample-strata", args.sample_strata_arg,
+			      SAMPLE_PREFIX_MIN, SAMPLE_PREFIX_MAX);
+		zconf.sample_fraction = args.sample_arg;
+		zconf.sample_prefix = args.sample_strata_arg;
+		if (args.sample_precision_given) {
+			if (args.sample_precision_arg <= 0) {
+				log_fatal("zmap", "--sample-precision must be "
+						  "positive");
+			}
+			zconf.sample_precision = args.sample_precision_arg;
+		}
+	} else if (args.sample_strata_given || args.sample_precision_given) {
+		log_fatal("zmap", "--sample-strata and --sample-precision need "
+				  "--sample");
+	}
+	if (args.prefix_shaping_given || args.prefix_shaping_asn_file_given) {
+		if (zconf.ipv6 || zconf.list_of_ips_filename) {
+			log_fatal("zmap", "--prefix-shaping only shapes scans of "
+					  "the IPv4 allowlist and blocklist");
+		}
+		zconf.prefix_shaping = 1;
+		SET_IF_GIVEN(zconf.prefix_shaping_asn_file,
+			     prefix_shaping_asn_file);
+	}
+	SET_IF_GIVEN(zconf.delta_filename, delta_from);
+	if (zconf.delta_filename) {
+		if (zconf.ipv6 || zconf.list_of_ips_filename) {
+			log_fatal("zmap", "--delta-from only scans the IPv4 "
+					  "allowlist and blocklist");
+		}
+		if (zconf.coordinator || zconf.checkpoint_filename) {
+			log_fatal("zmap", "--delta-from can't be combined with "
+					  "--coordinator or --checkpoint-file");
+		}
+		if (args.delta_sample_arg <= 0 || args.delta_sample_arg > 1) {
+			log_fatal("zmap", "--delta-sample must be more than 0 "
+					  "and at most 1");
+		}
+		zconf.delta_sample = args.delta_sample_arg;
+		if (args.delta_rate_given) {
+			if (args.delta_rate_arg <= 0) {
+				log_fatal("zmap", "--delta-rate must be positive");
+			}
+			zconf.delta_rate = args.delta_rate_arg;
+		}
+	} else if (args.delta_sample_given || args.delta_rate_given) {
+		log_fatal("zmap", "--delta-sample and --delta-rate need "
+				  "--delta-from");
+	}
 	if (zconf.shard_num >= zconf.total_shards) {
 		log_fatal("zmap",
 			  "With %hhu total shards, shard number (%hhu)"
@@ -951,23 +1744,360 @@ int main(int argc, char *argv[])
 	} else if (args.batch_given) {
 		log_fatal("zmap", "batch size must be > 0 and <= 65535");
 	}
+	if (args.batch_min_given) {
+		if (args.batch_min_arg < 1 || args.batch_min_arg > zconf.batch) {
+			log_fatal("zmap", "--batch-min must be between 1 and "
+					  "--batch (%u)",
+				  zconf.batch);
+		}
+		zconf.batch_min = args.batch_min_arg;
+	} else if (zconf.batch_min > zconf.batch) {
+		zconf.batch_min = zconf.batch;
+	}
+	if (args.batch_deadline_given) {
+		if (args.batch_deadline_arg < 0) {
+			log_fatal("zmap", "--batch-deadline must not be negative");
+		}
+		zconf.batch_deadline_us = args.batch_deadline_arg;
+	}
+	// before any packet buffers or rings are allocated
+	hugemem_set_enabled(!args.no_hugepages_given);
+
+	if (!strcmp(args.send_method_arg, "sendmmsg")) {
+		zconf.send_method = SEND_METHOD_SENDMMSG;
+	} else if (!strcmp(args.send_method_arg, "tx-ring")) {
+#if defined(PFRING) || defined(NETMAP) || defined(XDP) || defined(DPDK) || !defined(__linux__)
+		log_fatal("zmap", "--send-method=tx-ring is only supported by the Linux raw socket sender");
+#endif
+		if (zconf.send_ip_pkts) {
+			log_fatal("zmap", "--send-method=tx-ring cannot be combined with --iplayer");
+		}
+		zconf.send_method = SEND_METHOD_TX_RING;
+	} else if (!strcmp(args.send_method_arg, "io-uring") ||
+		   !strcmp(args.send_method_arg, "io-uring-sqpoll")) {
+#if defined(PFRING) || defined(NETMAP) || defined(XDP) || defined(DPDK) || !defined(__linux__)
+		log_fatal("zmap", "--send-method=%s is only supported by the Linux raw socket sender", args.send_method_arg);
+#elif !defined(IO_URING)
+		log_fatal("zmap", "--send-method=%s requires ZMap to be built with linux/io_uring.h available", args.send_method_arg);
+#endif
+		zconf.send_method = strcmp(args.send_method_arg, "io-uring") ? SEND_METHOD_IO_URING_SQPOLL : SEND_METHOD_IO_URING;
+	} else {
+		log_fatal("zmap", "Invalid send method provided. Legal options are: sendmmsg, tx-ring, io-uring, io-uring-sqpoll.");
+	}
+	extra_probes_init(args.extra_probe_module_arg,
+			  (int)args.extra_probe_module_given);
+	if (args.checksum_offload_given) {
+#if defined(PFRING) || defined(NETMAP) || defined(XDP) || defined(DPDK) || !defined(__linux__)
+		log_fatal("zmap", "--checksum-offload is only supported by the Linux raw socket sender");
+#endif
+		if (zconf.send_ip_pkts) {
+			log_fatal("zmap", "--checksum-offload cannot be combined with --iplayer");
+		}
+		if (!zconf.probe_module->csum_offload) {
+			log_fatal("zmap", "probe module %s does not support --checksum-offload",
+				  zconf.probe_module->name);
+		}
+		for (int i = 0; i < zconf.num_extra_probes; i++) {
+			if (!zconf.extra_probes[i].module->csum_offload) {
+				log_fatal("zmap", "probe module %s does not support --checksum-offload",
+					  zconf.extra_probes[i].module->name);
+			}
+		}
+		zconf.csum_offload = 1;
+	}
+
+	if (!strcmp(args.pacing_arg, "userspace")) {
+		zconf.pacing = PACING_USERSPACE;
+	} else if (!strcmp(args.pacing_arg, "txtime") || !strcmp(args.pacing_arg, "txtime-tai")) {
+#if defined(PFRING) || defined(NETMAP) || defined(XDP) || defined(DPDK) || !defined(__linux__)
+		log_fatal("zmap", "--pacing=%s is only supported by the Linux raw socket sender", args.pacing_arg);
+#endif
+		if (zconf.send_method != SEND_METHOD_SENDMMSG) {
+			log_fatal("zmap", "--pacing=%s requires --send-method=sendmmsg", args.pacing_arg);
+		}
+		zconf.pacing = strcmp(args.pacing_arg, "txtime") ? PACING_TXTIME_TAI : PACING_TXTIME;
+	} else {
+		log_fatal("zmap", "Invalid pacing mode provided. Legal options are: userspace, txtime, txtime-tai.");
+	}
+
+	if (!strcmp(args.recv_method_arg, "pcap")) {
+		zconf.recv_method = RECV_METHOD_PCAP;
+	} else if (!strcmp(args.recv_method_arg, "tpacket-v3")) {
+#if defined(PFRING) || defined(NETMAP) || defined(XDP) || defined(DPDK) || !defined(__linux__)
+		log_fatal("zmap", "--recv-method=tpacket-v3 is only supported by the Linux pcap receiver");
+#endif
+		zconf.recv_method = RECV_METHOD_TPACKET_V3;
+	} else {
+		log_fatal("zmap", "Invalid receive method provided. Legal options are: pcap, tpacket-v3.");
+	}
+	if (!strcmp(args.timestamps_arg, "software")) {
+		zconf.timestamps = TIMESTAMPS_SOFTWARE;
+	} else if (!strcmp(args.timestamps_arg, "hardware")) {
+#if defined(PFRING) || defined(NETMAP) || defined(XDP) || defined(DPDK) || !defined(__linux__)
+		log_fatal("zmap", "--timestamps=hardware is only supported by the Linux pcap receiver");
+#endif
+		zconf.timestamps = TIMESTAMPS_HARDWARE;
+	} else {
+		log_fatal("zmap", "Invalid timestamp source provided. Legal options are: software, hardware.");
+	}
+	SET_BOOL(zconf.tx_timestamps, tx_timestamps);
+#if defined(PFRING) || defined(NETMAP) || defined(XDP) || defined(DPDK) || !defined(__linux__)
+	if (zconf.tx_timestamps) {
+		log_fatal("zmap", "--tx-timestamps is only supported by the Linux raw socket sender");
+	}
+#endif
+	if (zconf.tx_timestamps) {
+		if (zconf.ipv6) {
+			log_fatal("zmap", "--tx-timestamps only keeps the stamps of IPv4 probes");
+		}
+		tx_stamps_init();
+	}
+	if (args.recv_threads_arg < 1 ||
+	    args.recv_threads_arg > MAX_RECV_THREADS) {
+		log_fatal("zmap", "--recv-threads must be between 1 and %d",
+			  MAX_RECV_THREADS);
+	}
+	zconf.recv_threads = (uint8_t)args.recv_threads_arg;
+	if (args.capture_buffer_arg < 0) {
+		log_fatal("zmap", "--capture-buffer must not be negative");
+	}
+	zconf.capture_buffer_mb = (uint32_t)args.capture_buffer_arg;
+	if (args.expected_hitrate_arg <= 0) {
+		log_fatal("zmap", "--expected-hitrate must be above 0");
+	}
+	zconf.expected_hitrate = args.expected_hitrate_arg;
+	if (zconf.recv_threads < zconf.num_ifaces) {
+		// every interface needs a capture handle of its own
+		log_debug("zmap", "using a receive thread for each of the %u interfaces",
+			  zconf.num_ifaces);
+		zconf.recv_threads = zconf.num_ifaces;
+	}
+	if (zconf.replay_filename &&
+	    (zconf.recv_threads > 1 || zconf.recv_method != RECV_METHOD_PCAP)) {
+		log_fatal("zmap", "--replay-pcap reads the capture on one receive thread with --recv-method=pcap");
+	}
+#if !defined(NETMAP) && !defined(PFRING) && !defined(DPDK) && (defined(XDP) || !defined(__linux__))
+	if (zconf.recv_threads > 1) {
+		log_fatal("zmap", "--recv-threads is only supported by the Linux pcap, netmap, PF_RING and DPDK receivers");
+	}
+#endif
+	if (!strcmp(args.recv_fanout_arg, "hash")) {
+		zconf.recv_fanout = RECV_FANOUT_HASH;
+	} else if (!strcmp(args.recv_fanout_arg, "cpu")) {
+		zconf.recv_fanout = RECV_FANOUT_CPU;
+	} else {
+		log_fatal("zmap", "Invalid receive fanout mode provided. Legal options are: hash, cpu.");
+	}
+	if (args.rss_queues_given) {
+		if (args.rss_queues_arg < 2 || args.rss_queues_arg > 0xFFFF) {
+			log_fatal("zmap", "--rss-queues must be between 2 and 65535");
+		}
+		if (args.rss_table_size_arg < args.rss_queues_arg ||
+		    args.rss_table_size_arg > 0xFFFF) {
+			log_fatal("zmap", "--rss-table-size must be between --rss-queues and 65535");
+		}
+		if (!zconf.probe_module->port_args) {
+			log_fatal("zmap", "--rss-queues needs a probe module that picks source ports, %s does not",
+				  zconf.probe_module->name);
+		}
+		for (int i = 0; i < zconf.num_extra_probes; i++) {
+			if (!zconf.extra_probes[i].module->port_args) {
+				log_fatal("zmap", "--rss-queues needs a probe module that picks source ports, %s does not",
+					  zconf.extra_probes[i].module->name);
+			}
+		}
+		zconf.rss.queues = (uint16_t)args.rss_queues_arg;
+		zconf.rss.table_size = (uint16_t)args.rss_table_size_arg;
+		SET_IF_GIVEN(zconf.rss.key, rss_key);
+		SET_IF_GIVEN(zconf.rss.steer, rss_steer);
+		rss_init();
+	} else if (args.rss_key_given || args.rss_steer_given) {
+		log_fatal("zmap", "--rss-key and --rss-steer require --rss-queues");
+	}
+	if (args.recv_processing_threads_arg < 0 ||
+	    args.recv_processing_threads_arg > MAX_RECV_THREADS) {
+		log_fatal("zmap",
+			  "--recv-processing-threads must be between 0 and %d",
+			  MAX_RECV_THREADS);
+	}
+	zconf.recv_processing_threads =
+	    (uint8_t)args.recv_processing_threads_arg;
+	SET_IF_GIVEN(zconf.capture_only_filename, capture_only);
+	if (zconf.capture_only_filename) {
+		if (zconf.replay_filename || zconf.dryrun) {
+			log_fatal("zmap", "--capture-only cannot be combined with "
+					  "--replay-pcap or --dryrun");
+		}
+		if (zconf.recv_processing_threads) {
+			log_fatal("zmap", "--capture-only validates on the "
+					  "capture threads, without "
+					  "--recv-processing-threads");
+		}
+		if (zconf.max_results || zconf.tcp_payload) {
+			log_fatal("zmap", "--capture-only doesn't classify "
+					  "responses, for --max-results or "
+					  "--tcp-payload");
+		}
+		if (args.capture_only_max_arg <= 0) {
+			log_fatal("zmap", "--capture-only-max must be positive");
+		}
+		zconf.capture_only_max_bytes =
+		    (uint64_t)args.capture_only_max_arg << 20;
+		// the capture is no use without the key to validate it again
+		if (!zconf.save_validation_key_filename) {
+			size_t len = strlen(zconf.capture_only_filename) + 5;
+			zconf.save_validation_key_filename = xmalloc(len);
+			snprintf(zconf.save_validation_key_filename, len,
+				 "%s.key", zconf.capture_only_filename);
+		}
+	}
+	if (!strcmp(args.output_compression_arg, "none")) {
+		zconf.output_compression = OUTPUT_COMPRESSION_NONE;
+	} else if (!strcmp(args.output_compression_arg, "zstd")) {
+		zconf.output_compression = OUTPUT_COMPRESSION_ZSTD;
+		zconf.output_compression_level = 3;
+	} else if (!strcmp(args.output_compression_arg, "lz4")) {
+		zconf.output_compression = OUTPUT_COMPRESSION_LZ4;
+		zconf.output_compression_level = 0;
+	} else {
+		log_fatal("zmap", "Invalid output compression method provided. Legal options are: none, zstd, lz4.");
+	}
+#ifndef ZSTD
+	if (zconf.output_compression == OUTPUT_COMPRESSION_ZSTD) {
+		log_fatal("zmap", "zstd output compression requires building with WITH_ZSTD");
+	}
+#endif
+#ifndef LZ4
+	if (zconf.output_compression == OUTPUT_COMPRESSION_LZ4) {
+		log_fatal("zmap", "lz4 output compression requires building with WITH_LZ4");
+	}
+#endif
+	if (args.output_compression_level_given) {
+		if (zconf.output_compression == OUTPUT_COMPRESSION_NONE) {
+			log_fatal("zmap", "--output-compression-level requires --output-compression");
+		}
+		zconf.output_compression_level =
+		    args.output_compression_level_arg;
+	}
+	if (args.output_rotate_given) {
+		parse_output_rotate(args.output_rotate_arg);
+		if (!zconf.output_filename || !strcmp(zconf.output_filename, "-")) {
+			log_fatal("zmap", "--output-rotate requires --output-file, which names the files");
+		}
+	}
+	if (args.output_writers_arg < 1 || args.output_writers_arg > 64) {
+		log_fatal("zmap", "--output-writers must be between 1 and 64");
+	}
+	zconf.output_writers = (uint8_t)args.output_writers_arg;
+	if (args.output_manifest_given) {
+		if (!args.output_rotate_given) {
+			log_fatal("zmap", "--output-manifest requires --output-rotate");
+		}
+		zconf.output_manifest = args.output_manifest_arg;
+	}
+	if (args.output_queue_size_arg < 0) {
+		log_fatal("zmap", "--output-queue-size must not be negative");
+	}
+	zconf.output_queue_size = (uint32_t)args.output_queue_size_arg;
+	if (!strcmp(args.output_backpressure_arg, "block")) {
+		zconf.output_backpressure = OUTPUT_BACKPRESSURE_BLOCK;
+	} else if (!strcmp(args.output_backpressure_arg, "drop")) {
+		zconf.output_backpressure = OUTPUT_BACKPRESSURE_DROP;
+	} else if (!strcmp(args.output_backpressure_arg, "spill")) {
+		zconf.output_backpressure = OUTPUT_BACKPRESSURE_SPILL;
+	} else {
+		log_fatal("zmap", "Invalid output backpressure policy provided. Legal options are: block, drop, spill.");
+	}
+#if !defined(NETMAP) && !defined(PFRING) && !defined(DPDK) && (defined(XDP) || !defined(__linux__))
+	if (zconf.recv_processing_threads) {
+		log_fatal("zmap", "--recv-processing-threads is only supported by the Linux pcap, netmap, PF_RING and DPDK receivers");
+	}
+#endif
 
 	if (args.max_targets_given) {
-		zconf.max_targets = parse_max_targets(args.max_targets_arg, zconf.ports->port_count);
+		size_t len = strlen(args.max_targets_arg);
+		if (zconf.ipv6 && len &&
+		    args.max_targets_arg[len - 1] == '%') {
+			// IPv6 percentages refer to the target file, which isn't
+			// counted until send_init()
+			zconf.ipv6_max_targets_fraction =
+			    (double)parse_max_targets(args.max_targets_arg, 1) /
+			    ((uint64_t)1 << 32);
+		} else {
+			zconf.max_targets = parse_max_targets(args.max_targets_arg, zconf.ports->port_count);
+		}
+	}
+
+	// Perform network initialization before initializing
+	// PFRING and NETMAP, as they depend on the interface name
+	// being available.
+	// NETMAP will additionally break network connectivity of
+	// the host through the chosen NIC.  If one wanted to do
+	// active ARP or IPv6 ND as part of network initialization
+	// instead of just querying the kernel, that would also
+	// have to happen before NETMAP binding to the interface.
+	if (!zconf.replay_filename) {
+		if (zconf.network_cache_filename) {
+			netcache_load(zconf.network_cache_filename,
+				      zconf.network_cache_ttl);
+		}
+		network_config_init();
+	}
+
+	// Keep the main thread on the interface's NUMA node while it sets up
+	// what the senders read (blocklist, list of IPs, shards), so that it
+	// is first touched there
+	zconf.numa_node = numa_iface_node(zconf.iface);
+	if (zconf.numa_node >= 0 && !args.cores_given &&
+	    numa_bind_thread(zconf.numa_node)) {
+		log_debug("zmap", "unable to keep main thread on NUMA node %d",
+			  zconf.numa_node);
 	}
 
 	// blocklist
+	if (zconf.blocklist_cache_filename) {
+		blocklist_set_cache(zconf.blocklist_cache_filename);
+	}
+	blocklist_set_ipv6(zconf.ipv6);
 	if (blocklist_init(zconf.allowlist_filename, zconf.blocklist_filename,
 			   zconf.destination_cidrs, zconf.destination_cidrs_len,
 			   NULL, 0, zconf.ignore_invalid_hosts)) {
 		log_fatal("zmap", "unable to initialize blocklist / allowlist");
 	}
-	// if there's a list of ips to scan, then initialize PBM and populate
-	// it based on the provided file
-	if (zconf.list_of_ips_filename) {
-		zsend.list_of_ips_pbm = pbm_init();
-		zconf.list_of_ips_count = pbm_load_from_file(
-		    zsend.list_of_ips_pbm, zconf.list_of_ips_filename);
+	// if there's a list of ips to scan, the senders iterate over the list
+	// itself rather than over the allowed address space, or with a stream
+	// take its addresses as they come
+	if (zconf.list_of_ips_filename && !zconf.list_of_ips_stream) {
+		zsend.list_of_ips = load_list_of_ips(zconf.list_of_ips_filename,
+						     &zconf.list_of_ips_count);
+		if (!zconf.list_of_ips_count) {
+			log_fatal("zmap", "no allowed addresses in %s",
+				  zconf.list_of_ips_filename);
+		}
+		log_debug("zmap", "%u allowed addresses in list of IPs",
+			  zconf.list_of_ips_count);
+	}
+	if (zconf.delta_filename) {
+		zsend.delta_prior = load_list_of_ips(zconf.delta_filename,
+						     &zsend.delta_prior_count);
+		zsend.delta_prior_set = cbm_init(0x10000, MEM_TARGETS);
+		for (uint32_t i = 0; i < zsend.delta_prior_count; i++) {
+			cbm_set(zsend.delta_prior_set, ntohl(zsend.delta_prior[i]));
+		}
+		if (!zsend.delta_prior_count) {
+			log_warn("zmap", "no allowed addresses in %s, the whole "
+					 "space is sampled",
+				 zconf.delta_filename);
+		}
+		uint64_t rest =
+		    blocklist_count_allowed() - zsend.delta_prior_count;
+		zsend.planned_targets = zsend.delta_prior_count +
+				      (uint64_t)(rest * zconf.delta_sample);
+		log_info("zmap",
+			 "%u hosts from %s first, then %.4g of the %" PRIu64
+			 " other allowed addresses",
+			 zsend.delta_prior_count, zconf.delta_filename,
+			 zconf.delta_sample, rest);
 	}
 
 	// compute number of targets
@@ -978,26 +2108,10 @@ int main(int argc, char *argv[])
 	if (!zconf.total_allowed) {
 		log_fatal("zmap", "zero eligible addresses to scan");
 	}
-	if (zconf.list_of_ips_count > 0 &&
-	    0xFFFFFFFFU / zconf.list_of_ips_count > 100000) {
-		log_warn(
-		    "zmap",
-		    "list of IPs is small compared to address space. Performance will suffer, consider using an allowlist instead");
-	}
 	if (zconf.max_targets) {
 		zsend.max_targets = zconf.max_targets;
 	}
 
-	// Perform network initialization before initializing
-	// PFRING and NETMAP, as they depend on the interface name
-	// being available.
-	// NETMAP will additionally break network connectivity of
-	// the host through the chosen NIC.  If one wanted to do
-	// active ARP or IPv6 ND as part of network initialization
-	// instead of just querying the kernel, that would also
-	// have to happen before NETMAP binding to the interface.
-	network_config_init();
-
 #ifdef NETMAP
 	// Initialize netmap(4) before computing number of threads,
 	// because we want to know the number of tx queues for that.
@@ -1060,18 +2174,69 @@ int main(int argc, char *argv[])
 	if_wait_for_phy_reset(zconf.iface, zconf.nm.nm_fd);
 	log_debug("zmap", "PHY reset is complete, link state is up");
 
+	// receive threads split the rx rings between them
+	if (zconf.recv_threads > zconf.nm.nm_if->ni_rx_rings) {
+		log_fatal("zmap", "--recv-threads=%u is more than the %" PRIu32 " rx rings of %s",
+			  zconf.recv_threads, zconf.nm.nm_if->ni_rx_rings, zconf.iface);
+	}
+
 	if (args.netmap_wait_ping_arg != NULL) {
 		zconf.nm.wait_ping_dstip = string_to_ip_address(args.netmap_wait_ping_arg);
 	}
 #endif
+#ifdef XDP
+	if (zconf.send_ip_pkts) {
+		log_fatal("zmap", "AF_XDP does not support IP layer mode (--iplayer/-X)");
+	}
+	assert(zconf.iface);
+	if (!zconf.dryrun) {
+		if (zconf.xdp_filter) {
+			// only what can be a response to the scan is taken
+			// from the host, see xdp_filter.bpf.c
+			xdp_filter_init(1);
+		} else {
+			// As with netmap, the default XDP program redirects
+			// all traffic arriving on bound queues to our sockets,
+			// so the host stack will not see it for the duration
+			// of the scan.
+			log_warn("zmap", "AF_XDP will divert all traffic on %s away from the host while zmap is executing", zconf.iface);
+		}
+		xdp_init();
+	}
+#elif defined(XDP_FILTER)
+	if (zconf.xdp_filter && !zconf.dryrun && !zconf.replay_filename) {
+		xdp_filter_init(0);
+	}
+#endif
+#ifdef DPDK
+	if (zconf.send_ip_pkts) {
+		log_fatal("zmap", "DPDK does not support IP layer mode (--iplayer/-X)");
+	}
+	assert(zconf.iface);
+	if (!zconf.dryrun) {
+		// The route and gateway MAC were looked up above, while the
+		// kernel still had the interface. From here on the port is
+		// DPDK's, so the host stack will not see its traffic.
+		log_warn("zmap", "DPDK will divert all traffic on %s away from the host while zmap is executing", zconf.iface);
+		zconf.dpdk.eal_args = args.dpdk_args_arg;
+		dpdk_init();
+		// receive threads each take an RSS queue of the port
+		if (zconf.recv_threads > zconf.dpdk.max_rx_queues) {
+			log_fatal("zmap", "--recv-threads=%u is more than the %u RX queues of %s",
+				  zconf.recv_threads, zconf.dpdk.max_rx_queues, zconf.iface);
+		}
+	}
+#endif
 
 #ifndef PFRING
 	// Set the correct number of threads, default to min(4, number of cores on host - 1, as available)
 	if (args.sender_threads_given) {
-		if (args.sender_threads_arg > 255) {
-			log_fatal("zmap", "cannot use > 255 sending threads. We advise using a sending thread per CPU "
+		if (args.sender_threads_arg < 1 ||
+		    args.sender_threads_arg > MAX_SENDER_THREADS) {
+			log_fatal("zmap", "--sender-threads must be between 1 and %d. We advise using a sending thread per CPU "
 					  "core while reserving one core for packet receiving and monitoring. Using a large number of sender threads "
-					  "will likely decrease performance, not increase it.");
+					  "will likely decrease performance, not increase it.",
+				  MAX_SENDER_THREADS);
 		}
 		zconf.senders = args.sender_threads_arg;
 	} else {
@@ -1081,7 +2246,9 @@ int main(int argc, char *argv[])
 		if (available_cores > 1) {
 			available_cores--;
 		}
-		int senders = (int) min_uint64_t(min_uint64_t(available_cores, 4), (zconf.total_allowed * zconf.ports->port_count));
+		uint64_t targets = zsend.list_of_ips ? zconf.list_of_ips_count
+						     : zconf.total_allowed;
+		int senders = (int) min_uint64_t(min_uint64_t(available_cores, 4), (targets * zconf.ports->port_count));
 		zconf.senders = senders;
 		log_debug("zmap", "will use %i sender threads based on core availability and number of targets", senders);
 	}
@@ -1090,6 +2257,18 @@ int main(int argc, char *argv[])
 		zconf.senders = (int)zconf.nm.nm_if->ni_tx_rings;
 		log_debug("zmap", "capping to %i sender threads based on number of TX rings", zconf.senders);
 	}
+#endif
+#ifdef XDP
+	if (!zconf.dryrun && zconf.senders > (int)zconf.xdp.num_queues) {
+		zconf.senders = (int)zconf.xdp.num_queues;
+		log_debug("zmap", "capping to %i sender threads based on number of AF_XDP queues", zconf.senders);
+	}
+#endif
+#ifdef DPDK
+	if (!zconf.dryrun && zconf.senders > (int)zconf.dpdk.max_tx_queues) {
+		zconf.senders = (int)zconf.dpdk.max_tx_queues;
+		log_debug("zmap", "capping to %i sender threads based on number of DPDK TX queues", zconf.senders);
+	}
 #endif
 	if (2 * zconf.senders >= zsend.max_targets) {
 		log_warn(
@@ -1097,6 +2276,11 @@ int main(int argc, char *argv[])
 		    "too few targets relative to senders, dropping to one sender");
 		zconf.senders = 1;
 	}
+	if (zconf.senders < zconf.num_ifaces) {
+		log_debug("zmap", "using a send thread for each of the %u interfaces",
+			  zconf.num_ifaces);
+		zconf.senders = zconf.num_ifaces;
+	}
 	// reserving 1 core for the receiver/monitor thread
 	int sender_cap = get_num_cores() - 1;
 	if (sender_cap < 1) {
@@ -1115,6 +2299,87 @@ int main(int argc, char *argv[])
 #else
 	zconf.senders = args.sender_threads_arg;
 #endif
+#ifdef DPDK
+	// a TX queue for every send thread
+	if (!zconf.dryrun) {
+		dpdk_start();
+	}
+#endif
+	if (args.target_threads_given) {
+		enforce_range("target-threads", args.target_threads_arg, 0,
+			      zconf.senders);
+		zconf.target_threads = (uint16_t)args.target_threads_arg;
+	}
+	enforce_range("target-ring-depth", args.target_ring_depth_arg, 1, 1024);
+	zconf.target_ring_depth = (uint32_t)args.target_ring_depth_arg;
+	if (zconf.target_threads && zconf.checkpoint_filename) {
+		// the shard a checkpoint records is the one of the batch
+		// being sent, which a generator is ahead of
+		log_fatal("zmap", "--target-threads can't be combined with "
+				  "--checkpoint-file");
+	}
+	if (args.event_loop_given) {
+		if (zconf.dryrun || zconf.replay_filename) {
+			log_fatal("zmap", "--event-loop can't be combined with "
+					  "--dryrun or --replay-pcap");
+		}
+		if ((args.sender_threads_given && args.sender_threads_arg > 1) ||
+		    zconf.recv_threads > 1 || zconf.recv_processing_threads ||
+		    zconf.target_threads) {
+			log_fatal("zmap", "--event-loop scans on a single thread, "
+					  "and can't have more send or receive "
+					  "threads, --recv-processing-threads "
+					  "or --target-threads");
+		}
+		zconf.senders = 1;
+		zconf.event_loop = 1;
+	}
+	if (args.dry_estimate_memory_given) {
+		estimate_memory();
+		exit(EXIT_SUCCESS);
+	}
+	if (args.worker_processes_given) {
+		enforce_range("worker-processes", args.worker_processes_arg, 1,
+			      256);
+#if defined(PFRING) || defined(NETMAP) || defined(XDP) || defined(DPDK)
+		log_fatal("zmap", "--worker-processes needs the pcap and raw "
+				  "socket build");
+#endif
+		zconf.worker_processes = args.worker_processes_arg;
+		if (zconf.dryrun || zconf.replay_filename) {
+			log_fatal("zmap", "--worker-processes needs a scan that "
+					  "sends and receives");
+		}
+		if (zconf.checkpoint_filename || zconf.coordinator) {
+			log_fatal("zmap", "--worker-processes can't be combined "
+					  "with --checkpoint-file or --coordinator");
+		}
+		if (zconf.stats_shm || zconf.metrics_port) {
+			log_fatal("zmap", "--worker-processes uses --stats-shm "
+					  "itself and can't serve --metrics-port");
+		}
+		if (zconf.output_queue_size || zconf.num_extra_probes ||
+		    zconf.max_results) {
+			log_fatal("zmap", "--worker-processes can't be combined "
+					  "with --output-queue-size, "
+					  "--extra-probe-module or --max-results");
+		}
+		if ((uint32_t)zconf.total_shards * zconf.worker_processes >
+		    UINT16_MAX) {
+			log_fatal("zmap", "--shards times --worker-processes is "
+					  "over %u",
+				  UINT16_MAX);
+		}
+		// each worker tells its own responses apart by source port
+		if (!zconf.probe_module->port_args ||
+		    (uint32_t)(zconf.source_port_last -
+			       zconf.source_port_first + 1) <
+			zconf.worker_processes) {
+			log_fatal("zmap", "--worker-processes needs a probe module "
+					  "with source ports, at least one for "
+					  "each worker");
+		}
+	}
 
 	// Figure out what cores to bind to
 	if (args.cores_given) {
@@ -1136,6 +2401,26 @@ int main(int argc, char *argv[])
 			zconf.pin_cores[i] = i;
 		}
 	}
+	// threads take cores in order, so those on the interface's node go
+	// first
+	if (zconf.numa_node >= 0) {
+		if (args.cores_given) {
+			if (!numa_count_local(zconf.pin_cores,
+					      zconf.pin_cores_len,
+					      zconf.numa_node)) {
+				log_warn("zmap",
+					 "none of --cores are on NUMA node %d of "
+					 "%s",
+					 zconf.numa_node, zconf.iface);
+			}
+		} else {
+			uint32_t local = numa_prefer_node(
+			    zconf.pin_cores, zconf.pin_cores_len,
+			    zconf.numa_node);
+			log_debug("zmap", "%u cores on NUMA node %d of %s", local,
+				  zconf.numa_node, zconf.iface);
+		}
+	}
 
 // PFRING
 #ifdef PFRING
@@ -1145,11 +2430,12 @@ int main(int argc, char *argv[])
 #define ZMAP_PF_ZC_CLUSTER_ID 9627
 	uint32_t user_buffers = zconf.senders * zconf.batch;
 	uint32_t queue_buffers = zconf.senders * QUEUE_LEN;
-	uint32_t card_buffers = 2 * MAX_CARD_SLOTS;
+	uint32_t card_buffers = (1 + zconf.recv_threads) * MAX_CARD_SLOTS;
+	uint32_t recv_buffers = zconf.recv_threads * PF_RECV_BURST;
 	uint32_t total_buffers =
-	    user_buffers + queue_buffers + card_buffers + 2;
+	    user_buffers + queue_buffers + card_buffers + recv_buffers + 2;
 	uint32_t metadata_len = 0;
-	uint32_t numa_node = 0; // TODO
+	uint32_t numa_node = zconf.numa_node >= 0 ? zconf.numa_node : 0;
 	zconf.pf.cluster = pfring_zc_create_cluster(
 	    ZMAP_PF_ZC_CLUSTER_ID, ZMAP_PF_BUFFER_SIZE, metadata_len,
 	    total_buffers, numa_node, NULL, 0);
@@ -1174,11 +2460,27 @@ int main(int argc, char *argv[])
 			  zconf.iface, strerror(errno));
 	}
 
-	zconf.pf.recv =
-	    pfring_zc_open_device(zconf.pf.cluster, zconf.iface, rx_only, 0);
-	if (zconf.pf.recv == NULL) {
-		log_fatal("zmap", "Could not open device %s for RX. [%s]",
-			  zconf.iface, strerror(errno));
+	// with --recv-threads, a receive thread for each of the first RSS
+	// queues of the NIC
+	if (zconf.recv_threads > 1 && strchr(zconf.iface, '@')) {
+		log_fatal("zmap", "--recv-threads opens queues 0 to %u of %s itself, "
+				  "give the interface without a queue",
+			  zconf.recv_threads - 1, zconf.iface);
+	}
+	zconf.pf.recv = xcalloc(zconf.recv_threads, sizeof(pfring_zc_queue *));
+	for (uint32_t i = 0; i < zconf.recv_threads; ++i) {
+		char dev[64];
+		if (zconf.recv_threads > 1) {
+			snprintf(dev, sizeof(dev), "%s@%u", zconf.iface, i);
+		} else {
+			snprintf(dev, sizeof(dev), "%s", zconf.iface);
+		}
+		zconf.pf.recv[i] =
+		    pfring_zc_open_device(zconf.pf.cluster, dev, rx_only, 0);
+		if (zconf.pf.recv[i] == NULL) {
+			log_fatal("zmap", "Could not open device %s for RX. [%s]",
+				  dev, strerror(errno));
+		}
 	}
 
 	zconf.pf.queues = xcalloc(zconf.senders, sizeof(pfring_zc_queue *));
@@ -1200,11 +2502,18 @@ int main(int argc, char *argv[])
 
 	// resume scan if requested
 
-	start_zmap();
+	if (zconf.replay_filename) {
+		replay_zmap();
+	} else if (zconf.worker_processes && !workers_fork()) {
+		supervise_zmap();
+	} else {
+		start_zmap();
+	}
 
+	log_async_stop();
 	fclose(log_location);
 
 	cmdline_parser_free(&args);
 	free(params);
-	return EXIT_SUCCESS;
+	return workers_failed() ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -17,7 +17,7 @@ zmap_base = Record({
     "timestamp_str":String(),
     "timestamp_ts":Unsigned32BitInteger(),
     "timestamp_us":Unsigned32BitInteger(),
-    "icmp_responder":String(),
+    "icmp_responder":IPv4Address(),
     "icmp_type":Unsigned32BitInteger(),
     "icmp_code":Unsigned32BitInteger(),
     "icmp_unreach_str":String(),
@@ -0,0 +1,621 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * ZMerge merges the outputs of the shards of a scan into one, sorted by
+ * address (and port) with the duplicates dropped. Each CSV input is mapped
+ * and its rows are keyed and radix sorted in place, one file per thread,
+ * and then the files are merged a row at a time as they are, without
+ * parsing anything but the key fields. The binary IPv4 address sets of the
+ * bitmap output module are merged into a set, a /16 at a time.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../lib/includes.h"
+#include "../lib/ipbm.h"
+#include "../lib/logger.h"
+#include "../lib/pbm.h"
+#include "../lib/xalloc.h"
+
+#include "zmgopt.h"
+
+// radix digits of a key: two of the port, then sixteen of the address
+#define KEY_DIGITS 18
+
+struct zmg_conf {
+	char *output_filename;
+	char *log_filename;
+	char *key_field;
+	char *port_field;
+	int keep_duplicates;
+	int ignore_input_errors;
+	int verbosity;
+	int disable_syslog;
+};
+
+#define SET_BOOL(DST, ARG)              \
+	{                               \
+		if (args.ARG##_given) { \
+			(DST) = 1;      \
+		};                      \
+	}
+
+// IPv4 addresses are keyed as ::ffff:a.b.c.d, so they sort numerically and
+// before IPv6 ones outside that prefix
+struct row {
+	uint64_t hi;
+	uint64_t lo;
+	uint32_t port;
+	uint32_t len; // of the line, without its newline
+	uint64_t off;
+};
+
+struct input {
+	const char *name;
+	const char *map;
+	size_t len;
+	size_t header_len;
+	struct row *rows;
+	uint64_t count;
+	uint64_t invalid;
+};
+
+static struct zmg_conf conf;
+static struct input *inputs = NULL;
+static unsigned num_inputs = 0;
+static unsigned next_input = 0;
+static pthread_mutex_t next_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint8_t key_digit(const struct row *r, int d)
+{
+	if (d < 2) {
+		return (uint8_t)(r->port >> (8 * d));
+	}
+	if (d < 10) {
+		return (uint8_t)(r->lo >> (8 * (d - 2)));
+	}
+	return (uint8_t)(r->hi >> (8 * (d - 10)));
+}
+
+static int row_cmp(const struct row *a, const struct row *b)
+{
+	if (a->hi != b->hi) {
+		return a->hi < b->hi ? -1 : 1;
+	}
+	if (a->lo != b->lo) {
+		return a->lo < b->lo ? -1 : 1;
+	}
+	if (a->port != b->port) {
+		return a->port < b->port ? -1 : 1;
+	}
+	return 0;
+}
+
+// LSD radix sort, stable so that duplicates keep the order of the file. The
+// histograms of every digit come from one pass, and a digit all rows share
+// (the upper 12 bytes of IPv4 keys, or the port without one) costs nothing.
+static void radix_sort(struct row *rows, uint64_t n)
+{
+	if (n < 2) {
+		return;
+	}
+	uint64_t(*counts)[256] = xcalloc(KEY_DIGITS, sizeof(*counts));
+	for (uint64_t i = 0; i < n; i++) {
+		for (int d = 0; d < KEY_DIGITS; d++) {
+			counts[d][key_digit(&rows[i], d)]++;
+		}
+	}
+	struct row *tmp = xmalloc(n * sizeof(struct row));
+	struct row *src = rows, *dst = tmp;
+	for (int d = 0; d < KEY_DIGITS; d++) {
+		uint64_t *c = counts[d];
+		if (c[key_digit(&src[0], d)] == n) {
+			continue;
+		}
+		uint64_t sum = 0;
+		for (int b = 0; b < 256; b++) {
+			uint64_t k = c[b];
+			c[b] = sum;
+			sum += k;
+		}
+		for (uint64_t i = 0; i < n; i++) {
+			dst[c[key_digit(&src[i], d)]++] = src[i];
+		}
+		struct row *t = src;
+		src = dst;
+		dst = t;
+	}
+	if (src != rows) {
+		memcpy(rows, src, n * sizeof(struct row));
+	}
+	xfree(tmp);
+	xfree(counts);
+}
+
+static int parse_key(const char *s, size_t len, struct row *r)
+{
+	char buf[INET6_ADDRSTRLEN];
+	if (len == 0 || len >= sizeof(buf)) {
+		return -1;
+	}
+	memcpy(buf, s, len);
+	buf[len] = '\0';
+	struct in_addr a4;
+	struct in6_addr a6;
+	if (inet_pton(AF_INET, buf, &a4) == 1) {
+		r->hi = 0;
+		r->lo = 0xffff00000000ULL | ntohl(a4.s_addr);
+		return 0;
+	}
+	if (inet_pton(AF_INET6, buf, &a6) == 1) {
+		r->hi = r->lo = 0;
+		for (int i = 0; i < 8; i++) {
+			r->hi = (r->hi << 8) | a6.s6_addr[i];
+			r->lo = (r->lo << 8) | a6.s6_addr[i + 8];
+		}
+		return 0;
+	}
+	return -1;
+}
+
+static int parse_port(const char *s, size_t len, uint32_t *port)
+{
+	if (len == 0 || len > 5) {
+		return -1;
+	}
+	uint32_t v = 0;
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] < '0' || s[i] > '9') {
+			return -1;
+		}
+		v = v * 10 + (s[i] - '0');
+	}
+	if (v > 0xffff) {
+		return -1;
+	}
+	*port = v;
+	return 0;
+}
+
+// the start and length of field idx of line, whose quoted fields (as the
+// csv output module writes them) may hold commas
+static int field_at(const char *line, size_t len, int idx, const char **start,
+		    size_t *flen)
+{
+	size_t p = 0;
+	for (int i = 0;; i++) {
+		size_t b = p;
+		if (p < len && line[p] == '"') {
+			for (p++; p < len; p++) {
+				if (line[p] == '"') {
+					if (p + 1 < len && line[p + 1] == '"') {
+						p++;
+					} else {
+						p++;
+						break;
+					}
+				}
+			}
+		}
+		while (p < len && line[p] != ',') {
+			p++;
+		}
+		if (i == idx) {
+			*start = line + b;
+			*flen = p - b;
+			return 0;
+		}
+		if (p >= len) {
+			return -1;
+		}
+		p++;
+	}
+}
+
+static int header_index(const char *header, size_t len, const char *name)
+{
+	size_t n = strlen(name);
+	const char *f;
+	size_t flen;
+	for (int i = 0; field_at(header, len, i, &f, &flen) == 0; i++) {
+		if (flen == n && !memcmp(f, name, n)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static size_t line_len(const char *p, size_t left)
+{
+	const char *nl = memchr(p, '\n', left);
+	return nl ? (size_t)(nl - p) : left;
+}
+
+static size_t strip_cr(const char *p, size_t len)
+{
+	return len && p[len - 1] == '\r' ? len - 1 : len;
+}
+
+static void map_input(struct input *in)
+{
+	int fd = open(in->name, O_RDONLY);
+	if (fd < 0) {
+		log_fatal("zmerge", "unable to open %s: %s", in->name,
+			  strerror(errno));
+	}
+	struct stat st;
+	if (fstat(fd, &st)) {
+		log_fatal("zmerge", "unable to stat %s: %s", in->name,
+			  strerror(errno));
+	}
+	in->len = (size_t)st.st_size;
+	if (in->len) {
+		in->map = mmap(NULL, in->len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (in->map == MAP_FAILED) {
+			log_fatal("zmerge", "unable to map %s: %s", in->name,
+				  strerror(errno));
+		}
+		madvise((void *)in->map, in->len, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	in->header_len = in->len ? line_len(in->map, in->len) : 0;
+}
+
+static void read_input(struct input *in)
+{
+	const char *header = in->map;
+	size_t hlen = strip_cr(header, in->header_len);
+	int key = header_index(header, hlen, conf.key_field);
+	if (key < 0) {
+		log_fatal("zmerge", "%s has no %s field", in->name,
+			  conf.key_field);
+	}
+	int port = conf.port_field
+		       ? header_index(header, hlen, conf.port_field)
+		       : -1;
+
+	uint64_t cap = 1024;
+	in->rows = xmalloc(cap * sizeof(struct row));
+	size_t off = in->header_len + 1;
+	while (off < in->len) {
+		const char *line = in->map + off;
+		size_t raw = line_len(line, in->len - off);
+		size_t len = strip_cr(line, raw);
+		size_t line_off = off;
+		off += raw + 1;
+		if (len == 0) {
+			continue;
+		}
+		struct row r = {.port = 0, .len = (uint32_t)raw, .off = line_off};
+		const char *f;
+		size_t flen;
+		if (raw > UINT32_MAX ||
+		    field_at(line, len, key, &f, &flen) ||
+		    parse_key(f, flen, &r) ||
+		    (port >= 0 && (field_at(line, len, port, &f, &flen) ||
+				   parse_port(f, flen, &r.port)))) {
+			if (!conf.ignore_input_errors) {
+				log_fatal("zmerge",
+					  "invalid %s%s%s in %s: %.*s",
+					  conf.key_field, port >= 0 ? " or " : "",
+					  port >= 0 ? conf.port_field : "",
+					  in->name, (int)(len > 80 ? 80 : len),
+					  line);
+			}
+			in->invalid++;
+			continue;
+		}
+		if (in->count == cap) {
+			cap *= 2;
+			in->rows = xrealloc(in->rows, cap * sizeof(struct row));
+		}
+		in->rows[in->count++] = r;
+	}
+	radix_sort(in->rows, in->count);
+	log_debug("zmerge", "%s: %" PRIu64 " rows sorted", in->name,
+		  in->count);
+}
+
+static void *start_reader(UNUSED void *arg)
+{
+	for (;;) {
+		pthread_mutex_lock(&next_mutex);
+		unsigned i = next_input++;
+		pthread_mutex_unlock(&next_mutex);
+		if (i >= num_inputs) {
+			return NULL;
+		}
+		if (inputs[i].len) {
+			read_input(&inputs[i]);
+		}
+	}
+}
+
+static void write_all(FILE *out, const void *buf, size_t len)
+{
+	if (len && fwrite(buf, len, 1, out) != 1) {
+		log_fatal("zmerge", "unable to write output: %s",
+			  strerror(errno));
+	}
+}
+
+struct cursor {
+	unsigned input;
+	uint64_t pos;
+};
+
+// ties go to the earlier file, so the first of the duplicates is kept
+static int cursor_less(const struct cursor *a, const struct cursor *b)
+{
+	int c = row_cmp(&inputs[a->input].rows[a->pos],
+			&inputs[b->input].rows[b->pos]);
+	return c < 0 || (c == 0 && a->input < b->input);
+}
+
+static void sift_down(struct cursor *heap, unsigned n, unsigned i)
+{
+	for (;;) {
+		unsigned l = 2 * i + 1, m = i;
+		if (l < n && cursor_less(&heap[l], &heap[m])) {
+			m = l;
+		}
+		if (l + 1 < n && cursor_less(&heap[l + 1], &heap[m])) {
+			m = l + 1;
+		}
+		if (m == i) {
+			return;
+		}
+		struct cursor t = heap[i];
+		heap[i] = heap[m];
+		heap[m] = t;
+		i = m;
+	}
+}
+
+static void merge_csv(FILE *out, unsigned threads)
+{
+	const struct input *first = NULL;
+	for (unsigned i = 0; i < num_inputs; i++) {
+		map_input(&inputs[i]);
+		if (!inputs[i].len) {
+			log_debug("zmerge", "%s is empty", inputs[i].name);
+			continue;
+		}
+		if (!first) {
+			first = &inputs[i];
+		} else if (strip_cr(inputs[i].map, inputs[i].header_len) !=
+			       strip_cr(first->map, first->header_len) ||
+			   memcmp(inputs[i].map, first->map,
+				  strip_cr(first->map, first->header_len))) {
+			log_fatal("zmerge", "%s has other fields than %s",
+				  inputs[i].name, first->name);
+		}
+	}
+	if (!first) {
+		log_warn("zmerge", "all inputs are empty");
+		return;
+	}
+
+	if (threads > num_inputs) {
+		threads = num_inputs;
+	}
+	pthread_t *readers = xcalloc(threads, sizeof(pthread_t));
+	for (unsigned t = 0; t < threads; t++) {
+		if (pthread_create(&readers[t], NULL, start_reader, NULL)) {
+			log_fatal("zmerge", "unable to create reader thread");
+		}
+	}
+	for (unsigned t = 0; t < threads; t++) {
+		pthread_join(readers[t], NULL);
+	}
+	xfree(readers);
+
+	write_all(out, first->map, strip_cr(first->map, first->header_len));
+	write_all(out, "\n", 1);
+	struct cursor *heap = xcalloc(num_inputs, sizeof(struct cursor));
+	unsigned n = 0;
+	uint64_t rows = 0, invalid = 0;
+	for (unsigned i = 0; i < num_inputs; i++) {
+		rows += inputs[i].count;
+		invalid += inputs[i].invalid;
+		if (inputs[i].count) {
+			heap[n].input = i;
+			heap[n].pos = 0;
+			n++;
+		}
+	}
+	for (unsigned i = n / 2; i-- > 0;) {
+		sift_down(heap, n, i);
+	}
+	uint64_t written = 0;
+	struct row last = {0};
+	while (n) {
+		struct input *in = &inputs[heap[0].input];
+		const struct row *r = &in->rows[heap[0].pos];
+		if (conf.keep_duplicates || !written || row_cmp(r, &last)) {
+			const char *line = in->map + r->off;
+			write_all(out, line, strip_cr(line, r->len));
+			write_all(out, "\n", 1);
+			last = *r;
+			written++;
+		}
+		if (++heap[0].pos == in->count) {
+			heap[0] = heap[--n];
+		}
+		sift_down(heap, n, 0);
+	}
+	xfree(heap);
+	for (unsigned i = 0; i < num_inputs; i++) {
+		xfree(inputs[i].rows);
+		if (inputs[i].len) {
+			munmap((void *)inputs[i].map, inputs[i].len);
+		}
+	}
+	log_info("zmerge",
+		 "merged %" PRIu64 " rows of %u files into %" PRIu64
+		 " (%" PRIu64 " duplicates)",
+		 rows, num_inputs, written, rows - written);
+	if (invalid) {
+		log_warn("zmerge", "skipped %" PRIu64 " invalid rows", invalid);
+	}
+}
+
+// the union of the sets, a page at a time
+static uint8_t **merge_sets(void)
+{
+	uint8_t **out = pbm_init();
+	for (unsigned f = 0; f < num_inputs; f++) {
+		ipbm_t b;
+		if (ipbm_open(&b, inputs[f].name)) {
+			log_fatal("zmerge", "unable to read address set %s: %s",
+				  inputs[f].name,
+				  errno == EINVAL ? "not a valid set file"
+						  : strerror(errno));
+		}
+		for (uint32_t i = 0; i < b.pages; i++) {
+			uint32_t p = ipbm_page_number(&b, i);
+			const uint8_t *bits = ipbm_page_bits(&b, i);
+			if (!out[p]) {
+				out[p] = bm_init();
+			}
+			for (size_t j = 0; j < IPBM_PAGE_BYTES; j++) {
+				out[p][j] |= bits[j];
+			}
+		}
+		ipbm_close(&b);
+	}
+	return out;
+}
+
+int main(int argc, char **argv)
+{
+	memset(&conf, 0, sizeof(struct zmg_conf));
+	conf.verbosity = 3;
+
+	struct gengetopt_args_info args;
+	struct cmdline_parser_params *params;
+	params = cmdline_parser_params_create();
+	assert(params);
+	params->initialize = 1;
+	params->override = 0;
+	params->check_required = 0;
+
+	if (cmdline_parser_ext(argc, argv, &args, params) != 0) {
+		exit(EXIT_SUCCESS);
+	}
+
+	// Handle help text and version
+	if (args.help_given) {
+		cmdline_parser_print_help();
+		exit(EXIT_SUCCESS);
+	}
+	if (args.version_given) {
+		cmdline_parser_print_version();
+		exit(EXIT_SUCCESS);
+	}
+
+	if (args.output_file_given) {
+		conf.output_filename = strdup(args.output_file_arg);
+	}
+	if (args.log_file_given) {
+		conf.log_filename = strdup(args.log_file_arg);
+	}
+	if (args.verbosity_given) {
+		conf.verbosity = args.verbosity_arg;
+	}
+	conf.key_field = strdup(args.key_field_arg);
+	if (!args.no_port_given) {
+		conf.port_field = strdup(args.port_field_arg);
+	}
+	SET_BOOL(conf.keep_duplicates, keep_duplicates);
+	SET_BOOL(conf.ignore_input_errors, ignore_input_errors);
+	SET_BOOL(conf.disable_syslog, disable_syslog);
+
+	// initialize logging
+	FILE *logfile = stderr;
+	if (conf.log_filename) {
+		logfile = fopen(conf.log_filename, "w");
+		if (!logfile) {
+			fprintf(
+			    stderr,
+			    "FATAL: unable to open specified logfile (%s)\n",
+			    conf.log_filename);
+			exit(1);
+		}
+	}
+	if (log_init(logfile, conf.verbosity, !conf.disable_syslog,
+		     "zmerge")) {
+		fprintf(stderr, "FATAL: unable able to initialize logging\n");
+		exit(1);
+	}
+
+	if (!args.inputs_num) {
+		log_fatal("zmerge", "no input files given");
+	}
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned threads = cores > 0 ? (unsigned)cores : 1;
+	if (args.threads_given) {
+		if (args.threads_arg < 1 || args.threads_arg > 1024) {
+			log_fatal("zmerge", "--threads must be between 1 and "
+					    "1024");
+		}
+		threads = (unsigned)args.threads_arg;
+	}
+	num_inputs = args.inputs_num;
+	inputs = xcalloc(num_inputs, sizeof(struct input));
+	unsigned sets = 0;
+	for (unsigned i = 0; i < num_inputs; i++) {
+		inputs[i].name = args.inputs[i];
+		sets += ipbm_is_file(args.inputs[i]) == 1;
+	}
+	if (sets && sets != num_inputs) {
+		log_fatal("zmerge", "give either CSV files or address sets, "
+				    "not both");
+	}
+
+	FILE *out = stdout;
+	if (conf.output_filename) {
+		out = fopen(conf.output_filename, "w");
+		if (!out) {
+			log_fatal("zmerge", "unable to open output file %s: %s",
+				  conf.output_filename, strerror(errno));
+		}
+	} else if (sets && isatty(fileno(stdout))) {
+		log_fatal("zmerge", "refusing to write binary output to a "
+				    "terminal, use --output-file");
+	}
+
+	if (sets) {
+		uint8_t **set = merge_sets();
+		if (fflush(out) != 0 || ipbm_write(fileno(out), set)) {
+			log_fatal("zmerge", "unable to write output: %s",
+				  strerror(errno));
+		}
+	} else {
+		merge_csv(out, threads);
+	}
+	if (fflush(out) != 0 || (out != stdout && fclose(out) != 0)) {
+		log_fatal("zmerge", "unable to write output: %s",
+			  strerror(errno));
+	}
+	return EXIT_SUCCESS;
+}
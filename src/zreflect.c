@@ -0,0 +1,948 @@
+/*
+ * ZMap Copyright 2013 Regents of the University of Michigan
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License"); you may not
+ * use this file except in compliance with the License. You may obtain a copy
+ * of the License at http://www.apache.org/licenses/LICENSE-2.0
+ */
+
+/*
+ * ZReflect answers ZMap's probes arriving on an interface, typically the
+ * peer of a veth pair zmap sends into, so that the whole path from the send
+ * threads over the wire to the receive path and output can be measured
+ * without scanning anyone. Each thread reads the probes from its own packet
+ * socket (spread over the threads by a fanout group hashing the flows) in
+ * batches, builds their responses and holds them in a heap ordered by when
+ * they are due, sending those due in batches. Whether and how a target
+ * answers is decided by a keyed hash of the probe, the delays, duplicates
+ * and retransmissions by a per-thread generator.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+#include "../lib/includes.h"
+#include "../lib/logger.h"
+#include "../lib/xalloc.h"
+
+#include "zropt.h"
+
+#define ZR_BATCH 64
+#define ZR_FRAME_MAX 1518
+#define ZR_MAX_ICMP_CODES 16
+#define ZR_DNS_PORT 53
+#define ZR_DNS_TTL 300
+// longest the threads sleep between checks for stopping
+#define ZR_POLL_MS 100
+// of each packet socket, to ride out bursts of probes
+#define ZR_SOCKET_BUFFER (16 * 1024 * 1024)
+
+struct zr_conf {
+	char *iface;
+	int ifindex;
+	int threads;
+	int duration;
+	uint64_t seed;
+	// the hash of a target below these answers, else below the second
+	// answers with an ICMP error
+	uint64_t respond_below;
+	uint64_t icmp_below;
+	double rst_rate;
+	double duplicate_rate;
+	double retransmit_rate;
+	uint64_t rtt_ns;
+	uint64_t rtt_jitter_ns;
+	uint64_t retransmit_ns;
+	uint32_t max_pending;
+	uint8_t icmp_codes[ZR_MAX_ICMP_CODES];
+	int num_icmp_codes;
+	char *log_filename;
+	int verbosity;
+	int disable_syslog;
+};
+
+static struct zr_conf zconf;
+static volatile sig_atomic_t stopping = 0;
+
+// counted by each thread and read by the main thread
+struct zr_stats {
+	uint64_t rx;
+	uint64_t probes;
+	uint64_t tx;
+	uint64_t synacks;
+	uint64_t rsts;
+	uint64_t echo_replies;
+	uint64_t udp;
+	uint64_t dns;
+	uint64_t icmp_errors;
+	uint64_t duplicates;
+	uint64_t retransmits;
+	uint64_t pending_dropped;
+	uint64_t tx_failed;
+	uint64_t socket_drops;
+};
+
+// a response waiting for its time
+struct zr_pending {
+	uint64_t due;
+	uint16_t len;
+	uint8_t duplicate;
+	uint8_t retransmit;
+	uint8_t data[ZR_FRAME_MAX];
+};
+
+struct zr_thread {
+	int id;
+	int fd;
+	pthread_t thread;
+	uint64_t rand;
+	struct zr_pending *slots;
+	uint32_t *free;
+	uint32_t num_free;
+	// min-heap of slots by due time
+	uint32_t *heap;
+	uint32_t heap_len;
+	struct zr_stats stats;
+};
+
+#define COUNT(T, FIELD, N) \
+	__atomic_fetch_add(&(T)->stats.FIELD, (N), __ATOMIC_RELAXED)
+
+#define SET_BOOL(DST, ARG)              \
+	{                               \
+		if (args.ARG##_given) { \
+			(DST) = 1;      \
+		};                      \
+	}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+static uint64_t next_rand(struct zr_thread *t)
+{
+	t->rand += 0x9e3779b97f4a7c15ULL;
+	return mix64(t->rand);
+}
+
+// uniform in [0, 1)
+static double rand_unit(struct zr_thread *t)
+{
+	return (double)(next_rand(t) >> 11) * 0x1.0p-53;
+}
+
+static uint64_t fraction_below(double fraction)
+{
+	if (fraction >= 1) {
+		return UINT64_MAX;
+	}
+	return fraction <= 0 ? 0 : (uint64_t)(fraction * 0x1.0p64);
+}
+
+static uint16_t checksum(const void *buf, size_t len, uint32_t sum)
+{
+	const uint8_t *p = buf;
+	for (; len > 1; len -= 2, p += 2) {
+		sum += (uint32_t)(p[0] << 8 | p[1]);
+	}
+	if (len) {
+		sum += (uint32_t)(p[0] << 8);
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return htons((uint16_t)~sum);
+}
+
+// sum of the IPv4 pseudo-header, for checksum()
+static uint32_t pseudo_sum(const struct ip *ip, uint8_t proto, size_t len)
+{
+	const uint8_t *s = (const uint8_t *)&ip->ip_src;
+	const uint8_t *d = (const uint8_t *)&ip->ip_dst;
+	return (uint32_t)(s[0] << 8 | s[1]) + (uint32_t)(s[2] << 8 | s[3]) +
+	       (uint32_t)(d[0] << 8 | d[1]) + (uint32_t)(d[2] << 8 | d[3]) +
+	       proto + (uint32_t)len;
+}
+
+static void heap_push(struct zr_thread *t, uint32_t slot)
+{
+	uint32_t i = t->heap_len++;
+	uint64_t due = t->slots[slot].due;
+	while (i) {
+		uint32_t parent = (i - 1) / 2;
+		if (t->slots[t->heap[parent]].due <= due) {
+			break;
+		}
+		t->heap[i] = t->heap[parent];
+		i = parent;
+	}
+	t->heap[i] = slot;
+}
+
+static uint32_t heap_pop(struct zr_thread *t)
+{
+	uint32_t top = t->heap[0];
+	uint32_t last = t->heap[--t->heap_len];
+	uint64_t due = t->slots[last].due;
+	uint32_t i = 0;
+	for (;;) {
+		uint32_t c = 2 * i + 1;
+		if (c >= t->heap_len) {
+			break;
+		}
+		if (c + 1 < t->heap_len &&
+		    t->slots[t->heap[c + 1]].due < t->slots[t->heap[c]].due) {
+			c++;
+		}
+		if (t->slots[t->heap[c]].due >= due) {
+			break;
+		}
+		t->heap[i] = t->heap[c];
+		i = c;
+	}
+	if (t->heap_len) {
+		t->heap[i] = last;
+	}
+	return top;
+}
+
+// a slot for a response, NULL once max-pending are waiting
+static struct zr_pending *reserve(struct zr_thread *t, uint32_t *slot)
+{
+	if (!t->num_free) {
+		COUNT(t, pending_dropped, 1);
+		return NULL;
+	}
+	*slot = t->free[--t->num_free];
+	return &t->slots[*slot];
+}
+
+static void schedule(struct zr_thread *t, uint32_t slot, uint64_t now)
+{
+	struct zr_pending *p = &t->slots[slot];
+	p->due = now + zconf.rtt_ns;
+	if (zconf.rtt_jitter_ns) {
+		p->due += (uint64_t)(rand_unit(t) * (double)zconf.rtt_jitter_ns);
+	}
+	p->duplicate = zconf.duplicate_rate > 0 &&
+		       rand_unit(t) < zconf.duplicate_rate;
+	p->retransmit = zconf.retransmit_rate > 0 &&
+			rand_unit(t) < zconf.retransmit_rate;
+	heap_push(t, slot);
+}
+
+// The response's Ethernet and IP headers, to the prober from the address it
+// probed. Returns where the IP payload goes.
+static uint8_t *put_headers(uint8_t *out, const uint8_t *frame,
+			    const struct ip *probe, uint8_t proto,
+			    struct zr_thread *t)
+{
+	struct ethhdr *eth = (struct ethhdr *)out;
+	const struct ethhdr *peth = (const struct ethhdr *)frame;
+	memcpy(eth->h_dest, peth->h_source, ETH_ALEN);
+	memcpy(eth->h_source, peth->h_dest, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+	struct ip *ip = (struct ip *)(eth + 1);
+	memset(ip, 0, sizeof(*ip));
+	ip->ip_v = 4;
+	ip->ip_hl = 5;
+	ip->ip_id = (uint16_t)next_rand(t);
+	ip->ip_off = htons(IP_DF);
+	ip->ip_ttl = 64;
+	ip->ip_p = proto;
+	ip->ip_src = probe->ip_dst;
+	ip->ip_dst = probe->ip_src;
+	return (uint8_t *)(ip + 1);
+}
+
+// finishes the IP header of a response with payload_len bytes of payload
+static uint16_t finish_ip(uint8_t *out, size_t payload_len)
+{
+	struct ip *ip = (struct ip *)(out + sizeof(struct ethhdr));
+	ip->ip_len = htons((uint16_t)(sizeof(struct ip) + payload_len));
+	ip->ip_sum = 0;
+	ip->ip_sum = checksum(ip, sizeof(struct ip), 0);
+	return (uint16_t)(sizeof(struct ethhdr) + sizeof(struct ip) +
+			  payload_len);
+}
+
+static uint16_t tcp_response(uint8_t *out, const uint8_t *frame,
+			     const struct ip *probe, const struct tcphdr *syn,
+			     uint64_t hash, int rst, struct zr_thread *t)
+{
+	struct tcphdr *tcp = (struct tcphdr *)put_headers(
+	    out, frame, probe, IPPROTO_TCP, t);
+	memset(tcp, 0, sizeof(*tcp));
+	tcp->th_sport = syn->th_dport;
+	tcp->th_dport = syn->th_sport;
+	tcp->th_ack = htonl(ntohl(syn->th_seq) + 1);
+	size_t len = sizeof(*tcp);
+	if (rst) {
+		tcp->th_flags = TH_RST | TH_ACK;
+		tcp->th_off = 5;
+	} else {
+		tcp->th_seq = htonl((uint32_t)(hash >> 32));
+		tcp->th_flags = TH_SYN | TH_ACK;
+		tcp->th_win = htons(65535);
+		// MSS 1460
+		uint8_t *opt = (uint8_t *)(tcp + 1);
+		opt[0] = 2;
+		opt[1] = 4;
+		opt[2] = 1460 >> 8;
+		opt[3] = 1460 & 0xff;
+		len += 4;
+		tcp->th_off = (uint8_t)(len / 4);
+	}
+	struct ip *ip = (struct ip *)(out + sizeof(struct ethhdr));
+	tcp->th_sum = checksum(tcp, len, pseudo_sum(ip, IPPROTO_TCP, len));
+	return finish_ip(out, len);
+}
+
+static uint16_t echo_reply(uint8_t *out, const uint8_t *frame,
+			   const struct ip *probe, const uint8_t *icmp,
+			   size_t len, struct zr_thread *t)
+{
+	uint8_t *p = put_headers(out, frame, probe, IPPROTO_ICMP, t);
+	memcpy(p, icmp, len);
+	struct icmp *reply = (struct icmp *)p;
+	reply->icmp_type = ICMP_ECHOREPLY;
+	reply->icmp_code = 0;
+	reply->icmp_cksum = 0;
+	reply->icmp_cksum = checksum(p, len, 0);
+	return finish_ip(out, len);
+}
+
+// A DNS response to the query in p (len bytes), written over it. The query
+// is answered with one record for its question if that asks for an A or
+// AAAA record, and otherwise with none. Anything after the question, such
+// as an OPT record, is left out. Returns the response's length.
+static size_t dns_answer(uint8_t *p, size_t len, uint64_t hash)
+{
+	if (len < 12) {
+		return 0;
+	}
+	size_t off = 12;
+	while (off < len && p[off]) {
+		if ((p[off] & 0xc0) || off + 1 + p[off] >= len) {
+			off = len;
+			break;
+		}
+		off += 1 + p[off];
+	}
+	// the question's name, type and class
+	int parsed = p[5] == 1 && p[4] == 0 && off + 5 <= len;
+	p[2] = (uint8_t)(0x80 | (p[2] & 0x79)); // QR, opcode and RD kept
+	p[3] = parsed ? 0x80 : 0x81;		 // RA, NOERROR or FORMERR
+	memset(p + 6, 0, 6);
+	if (!parsed) {
+		memset(p + 4, 0, 2);
+		return 12;
+	}
+	off += 5;
+	uint16_t qtype = (uint16_t)(p[off - 4] << 8 | p[off - 3]);
+	if (qtype != 1 && qtype != 28) {
+		return off;
+	}
+	uint16_t rdlen = qtype == 1 ? 4 : 16;
+	if (off + 12 + rdlen > ZR_FRAME_MAX - sizeof(struct ethhdr) -
+				   sizeof(struct ip) - sizeof(struct udphdr)) {
+		return off;
+	}
+	p[7] = 1;
+	uint8_t *a = p + off;
+	// the name is the question's
+	a[0] = 0xc0;
+	a[1] = 12;
+	memcpy(a + 2, p + off - 4, 4);
+	uint32_t ttl = htonl(ZR_DNS_TTL);
+	memcpy(a + 6, &ttl, 4);
+	a[10] = 0;
+	a[11] = (uint8_t)rdlen;
+	if (qtype == 1) {
+		// in 198.18.0.0/15, set aside for benchmarking
+		uint32_t addr = htonl(0xc6120000 | (uint32_t)(hash & 0x1ffff));
+		memcpy(a + 12, &addr, 4);
+	} else {
+		static const uint8_t prefix[8] = {0x20, 0x01, 0x0d, 0xb8};
+		memcpy(a + 12, prefix, 8);
+		memcpy(a + 20, &hash, 8);
+	}
+	return off + 12 + rdlen;
+}
+
+static uint16_t udp_response(uint8_t *out, const uint8_t *frame,
+			     const struct ip *probe, const struct udphdr *req,
+			     size_t len, uint64_t hash, struct zr_thread *t)
+{
+	struct udphdr *udp = (struct udphdr *)put_headers(
+	    out, frame, probe, IPPROTO_UDP, t);
+	udp->uh_sport = req->uh_dport;
+	udp->uh_dport = req->uh_sport;
+	size_t payload = len - sizeof(*udp);
+	uint8_t *p = (uint8_t *)(udp + 1);
+	memcpy(p, req + 1, payload);
+	if (ntohs(req->uh_dport) == ZR_DNS_PORT) {
+		payload = dns_answer(p, payload, hash);
+		COUNT(t, dns, 1);
+	} else {
+		COUNT(t, udp, 1);
+	}
+	len = sizeof(*udp) + payload;
+	udp->uh_ulen = htons((uint16_t)len);
+	udp->uh_sum = 0;
+	struct ip *ip = (struct ip *)(out + sizeof(struct ethhdr));
+	udp->uh_sum = checksum(udp, len, pseudo_sum(ip, IPPROTO_UDP, len));
+	if (!udp->uh_sum) {
+		udp->uh_sum = 0xffff;
+	}
+	return finish_ip(out, len);
+}
+
+// destination unreachable quoting the probe's IP header and 8 bytes of it
+static uint16_t icmp_error(uint8_t *out, const uint8_t *frame,
+			   const struct ip *probe, size_t ip_len,
+			   uint64_t hash, struct zr_thread *t)
+{
+	uint8_t *p = put_headers(out, frame, probe, IPPROTO_ICMP, t);
+	struct icmp *icmp = (struct icmp *)p;
+	memset(icmp, 0, 8);
+	icmp->icmp_type = ICMP_UNREACH;
+	icmp->icmp_code =
+	    zconf.icmp_codes[(hash >> 8) % (uint64_t)zconf.num_icmp_codes];
+	size_t quoted = (size_t)probe->ip_hl * 4 + 8;
+	if (quoted > ip_len) {
+		quoted = ip_len;
+	}
+	memcpy(p + 8, probe, quoted);
+	size_t len = 8 + quoted;
+	icmp->icmp_cksum = checksum(p, len, 0);
+	return finish_ip(out, len);
+}
+
+static void handle_probe(struct zr_thread *t, const uint8_t *frame,
+			 size_t len, uint64_t now)
+{
+	if (len < sizeof(struct ethhdr) + sizeof(struct ip)) {
+		return;
+	}
+	const struct ethhdr *eth = (const struct ethhdr *)frame;
+	if (eth->h_proto != htons(ETH_P_IP)) {
+		return;
+	}
+	const struct ip *ip = (const struct ip *)(eth + 1);
+	size_t ihl = (size_t)ip->ip_hl * 4;
+	size_t ip_len = ntohs(ip->ip_len);
+	if (ip->ip_v != 4 || ihl < sizeof(struct ip) || ip_len < ihl ||
+	    ip_len > len - sizeof(struct ethhdr) ||
+	    (ntohs(ip->ip_off) & (IP_OFFMASK | IP_MF))) {
+		return;
+	}
+	const uint8_t *l4 = (const uint8_t *)ip + ihl;
+	size_t l4_len = ip_len - ihl;
+	uint32_t ports;
+	switch (ip->ip_p) {
+	case IPPROTO_TCP: {
+		const struct tcphdr *tcp = (const struct tcphdr *)l4;
+		if (l4_len < sizeof(*tcp) ||
+		    (tcp->th_flags & (TH_SYN | TH_ACK | TH_RST)) != TH_SYN) {
+			return;
+		}
+		memcpy(&ports, l4, 4);
+		break;
+	}
+	case IPPROTO_UDP:
+		if (l4_len < sizeof(struct udphdr)) {
+			return;
+		}
+		memcpy(&ports, l4, 4);
+		break;
+	case IPPROTO_ICMP: {
+		const struct icmp *icmp = (const struct icmp *)l4;
+		if (l4_len < 8 || icmp->icmp_type != ICMP_ECHO) {
+			return;
+		}
+		ports = icmp->icmp_id;
+		break;
+	}
+	default:
+		return;
+	}
+	COUNT(t, probes, 1);
+	uint64_t hash = mix64(zconf.seed ^
+			      mix64((uint64_t)ip->ip_src.s_addr << 32 |
+				    ip->ip_dst.s_addr) ^
+			      ((uint64_t)ports << 8 | ip->ip_p));
+	if (hash >= zconf.icmp_below) {
+		return;
+	}
+	uint32_t slot;
+	struct zr_pending *p = reserve(t, &slot);
+	if (!p) {
+		return;
+	}
+	if (hash >= zconf.respond_below) {
+		p->len = icmp_error(p->data, frame, ip, ip_len, hash, t);
+		COUNT(t, icmp_errors, 1);
+	} else if (ip->ip_p == IPPROTO_TCP) {
+		int rst = (double)(mix64(hash) >> 11) * 0x1.0p-53 <
+			  zconf.rst_rate;
+		p->len = tcp_response(p->data, frame, ip,
+				      (const struct tcphdr *)l4, hash, rst, t);
+		if (rst) {
+			COUNT(t, rsts, 1);
+		} else {
+			COUNT(t, synacks, 1);
+		}
+	} else if (ip->ip_p == IPPROTO_UDP) {
+		p->len = udp_response(p->data, frame, ip,
+				      (const struct udphdr *)l4, l4_len, hash,
+				      t);
+	} else {
+		p->len = echo_reply(p->data, frame, ip, l4, l4_len, t);
+		COUNT(t, echo_replies, 1);
+	}
+	schedule(t, slot, now);
+}
+
+// sends the responses due, in batches, requeueing their duplicates and
+// retransmissions
+static void send_due(struct zr_thread *t, uint64_t now)
+{
+	struct mmsghdr msgs[ZR_BATCH];
+	struct iovec iovs[ZR_BATCH];
+	uint32_t batch[ZR_BATCH];
+	while (t->heap_len && t->slots[t->heap[0]].due <= now) {
+		int n = 0;
+		while (n < ZR_BATCH && t->heap_len &&
+		       t->slots[t->heap[0]].due <= now) {
+			uint32_t slot = heap_pop(t);
+			batch[n] = slot;
+			iovs[n].iov_base = t->slots[slot].data;
+			iovs[n].iov_len = t->slots[slot].len;
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_iov = &iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			n++;
+		}
+		int sent = 0;
+		while (sent < n) {
+			int rc = sendmmsg(t->fd, msgs + sent,
+					  (unsigned)(n - sent), 0);
+			if (rc < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				if (errno == EAGAIN || errno == ENOBUFS) {
+					struct pollfd pfd = {.fd = t->fd,
+							     .events = POLLOUT};
+					poll(&pfd, 1, 1);
+					continue;
+				}
+				// skip the frame the kernel refused
+				COUNT(t, tx_failed, 1);
+				sent++;
+				continue;
+			}
+			sent += rc;
+		}
+		COUNT(t, tx, (uint64_t)n);
+		for (int i = 0; i < n; i++) {
+			struct zr_pending *p = &t->slots[batch[i]];
+			if (p->duplicate) {
+				p->duplicate = 0;
+				heap_push(t, batch[i]);
+				COUNT(t, duplicates, 1);
+			} else if (p->retransmit) {
+				p->retransmit = 0;
+				p->due = now + zconf.retransmit_ns;
+				heap_push(t, batch[i]);
+				COUNT(t, retransmits, 1);
+			} else {
+				t->free[t->num_free++] = batch[i];
+			}
+		}
+	}
+}
+
+static int open_socket(int fanout_id)
+{
+	int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+	if (fd < 0) {
+		log_fatal("zreflect", "unable to open packet socket: %s "
+				      "(zreflect needs CAP_NET_RAW)",
+			  strerror(errno));
+	}
+	int one = 1;
+#ifdef PACKET_IGNORE_OUTGOING
+	// our own responses aren't probes
+	setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one,
+		   sizeof(one));
+#endif
+#ifdef PACKET_QDISC_BYPASS
+	setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+#endif
+	// beyond rmem_max when privileged enough, else as far as it goes
+	int size = ZR_SOCKET_BUFFER;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size))) {
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size))) {
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+	struct sockaddr_ll sll;
+	memset(&sll, 0, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	sll.sll_ifindex = zconf.ifindex;
+	if (bind(fd, (struct sockaddr *)&sll, sizeof(sll))) {
+		log_fatal("zreflect", "unable to bind to %s: %s", zconf.iface,
+			  strerror(errno));
+	}
+	if (zconf.threads > 1) {
+		int arg = fanout_id | (PACKET_FANOUT_HASH << 16) |
+			  (PACKET_FANOUT_FLAG_DEFRAG << 16);
+		if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg,
+			       sizeof(arg))) {
+			log_fatal("zreflect", "unable to join fanout group: %s",
+				  strerror(errno));
+		}
+	}
+	return fd;
+}
+
+static void *start_thread(void *arg)
+{
+	struct zr_thread *t = arg;
+	uint8_t *bufs = xmalloc((size_t)ZR_BATCH * ZR_FRAME_MAX);
+	struct mmsghdr msgs[ZR_BATCH];
+	struct iovec iovs[ZR_BATCH];
+	struct sockaddr_ll from[ZR_BATCH];
+	while (!stopping) {
+		uint64_t now = now_ns();
+		int timeout = ZR_POLL_MS;
+		if (t->heap_len) {
+			uint64_t due = t->slots[t->heap[0]].due;
+			uint64_t wait_ms =
+			    due > now ? (due - now + 999999) / 1000000 : 0;
+			if (wait_ms < (uint64_t)timeout) {
+				timeout = (int)wait_ms;
+			}
+		}
+		struct pollfd pfd = {.fd = t->fd, .events = POLLIN};
+		if (timeout) {
+			poll(&pfd, 1, timeout);
+		}
+		for (int i = 0; i < ZR_BATCH; i++) {
+			iovs[i].iov_base = bufs + (size_t)i * ZR_FRAME_MAX;
+			iovs[i].iov_len = ZR_FRAME_MAX;
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &from[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		}
+		int n = recvmmsg(t->fd, msgs, ZR_BATCH, MSG_DONTWAIT, NULL);
+		now = now_ns();
+		if (n > 0) {
+			COUNT(t, rx, (uint64_t)n);
+			for (int i = 0; i < n; i++) {
+				if (from[i].sll_pkttype == PACKET_OUTGOING) {
+					continue;
+				}
+				handle_probe(t, iovs[i].iov_base, msgs[i].msg_len,
+					     now);
+			}
+		} else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			log_fatal("zreflect", "unable to receive: %s",
+				  strerror(errno));
+		}
+		send_due(t, now);
+	}
+	xfree(bufs);
+	return NULL;
+}
+
+static void parse_icmp_codes(const char *codes)
+{
+	const char *p = codes;
+	while (*p) {
+		char *end;
+		unsigned long code = strtoul(p, &end, 10);
+		if (end == p || code > 15 || (*end && *end != ',')) {
+			log_fatal("zreflect", "invalid --icmp-error-codes %s",
+				  codes);
+		}
+		if (zconf.num_icmp_codes == ZR_MAX_ICMP_CODES) {
+			log_fatal("zreflect", "too many --icmp-error-codes");
+		}
+		zconf.icmp_codes[zconf.num_icmp_codes++] = (uint8_t)code;
+		p = *end ? end + 1 : end;
+	}
+	if (!zconf.num_icmp_codes) {
+		log_fatal("zreflect", "--icmp-error-codes needs a code");
+	}
+}
+
+static void check_fraction(const char *name, double v)
+{
+	if (v < 0 || v > 1) {
+		log_fatal("zreflect", "--%s must be between 0 and 1", name);
+	}
+}
+
+static void sum_stats(struct zr_thread *threads, struct zr_stats *sum)
+{
+	memset(sum, 0, sizeof(*sum));
+	uint64_t *s = (uint64_t *)sum;
+	for (int i = 0; i < zconf.threads; i++) {
+		const uint64_t *c = (const uint64_t *)&threads[i].stats;
+		for (size_t j = 0; j < sizeof(*sum) / sizeof(uint64_t); j++) {
+			s[j] += __atomic_load_n(&c[j], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// packets the kernel dropped for want of room in the sockets, since the
+// last call
+static uint64_t socket_drops(struct zr_thread *threads)
+{
+	uint64_t drops = 0;
+	for (int i = 0; i < zconf.threads; i++) {
+		struct tpacket_stats st;
+		socklen_t len = sizeof(st);
+		if (!getsockopt(threads[i].fd, SOL_PACKET, PACKET_STATISTICS,
+				&st, &len)) {
+			drops += st.tp_drops;
+		}
+	}
+	return drops;
+}
+
+static void handle_signal(int sig)
+{
+	(void)sig;
+	stopping = 1;
+}
+
+int main(int argc, char **argv)
+{
+	memset(&zconf, 0, sizeof(zconf));
+	zconf.verbosity = 3;
+
+	struct gengetopt_args_info args;
+	struct cmdline_parser_params *params;
+	params = cmdline_parser_params_create();
+	assert(params);
+	params->initialize = 1;
+	params->override = 0;
+	params->check_required = 0;
+
+	if (cmdline_parser_ext(argc, argv, &args, params) != 0) {
+		exit(EXIT_SUCCESS);
+	}
+
+	// Handle help text and version
+	if (args.help_given) {
+		cmdline_parser_print_help();
+		exit(EXIT_SUCCESS);
+	}
+	if (args.version_given) {
+		cmdline_parser_print_version();
+		exit(EXIT_SUCCESS);
+	}
+
+	if (args.log_file_given) {
+		zconf.log_filename = strdup(args.log_file_arg);
+	}
+	if (args.verbosity_given) {
+		zconf.verbosity = args.verbosity_arg;
+	}
+	SET_BOOL(zconf.disable_syslog, disable_syslog);
+
+	// initialize logging
+	FILE *logfile = stderr;
+	if (zconf.log_filename) {
+		logfile = fopen(zconf.log_filename, "w");
+		if (!logfile) {
+			fprintf(
+			    stderr,
+			    "FATAL: unable to open specified logfile (%s)\n",
+			    zconf.log_filename);
+			exit(1);
+		}
+	}
+	if (log_init(logfile, zconf.verbosity, !zconf.disable_syslog,
+		     "zreflect")) {
+		fprintf(stderr, "FATAL: unable able to initialize logging\n");
+		exit(1);
+	}
+
+	if (!args.interface_given) {
+		log_fatal("zreflect", "an --interface to answer on is required");
+	}
+	zconf.iface = strdup(args.interface_arg);
+	zconf.ifindex = (int)if_nametoindex(zconf.iface);
+	if (!zconf.ifindex) {
+		log_fatal("zreflect", "no interface %s: %s", zconf.iface,
+			  strerror(errno));
+	}
+	if (args.threads_arg < 1) {
+		log_fatal("zreflect", "--threads must be at least 1");
+	}
+	zconf.threads = args.threads_arg;
+	zconf.duration = args.duration_arg;
+	zconf.seed = (uint64_t)args.seed_arg;
+	check_fraction("response-rate", args.response_rate_arg);
+	check_fraction("rst-rate", args.rst_rate_arg);
+	check_fraction("icmp-error-rate", args.icmp_error_rate_arg);
+	check_fraction("duplicate-rate", args.duplicate_rate_arg);
+	check_fraction("retransmit-rate", args.retransmit_rate_arg);
+	if (args.response_rate_arg + args.icmp_error_rate_arg > 1) {
+		log_fatal("zreflect", "--response-rate and --icmp-error-rate "
+				      "add up to more than 1");
+	}
+	zconf.respond_below = fraction_below(args.response_rate_arg);
+	zconf.icmp_below =
+	    fraction_below(args.response_rate_arg + args.icmp_error_rate_arg);
+	zconf.rst_rate = args.rst_rate_arg;
+	zconf.duplicate_rate = args.duplicate_rate_arg;
+	zconf.retransmit_rate = args.retransmit_rate_arg;
+	if (args.rtt_ms_arg < 0 || args.rtt_jitter_ms_arg < 0 ||
+	    args.retransmit_ms_arg < 0) {
+		log_fatal("zreflect", "delays must not be negative");
+	}
+	zconf.rtt_ns = (uint64_t)args.rtt_ms_arg * 1000000ULL;
+	zconf.rtt_jitter_ns = (uint64_t)args.rtt_jitter_ms_arg * 1000000ULL;
+	zconf.retransmit_ns = (uint64_t)args.retransmit_ms_arg * 1000000ULL;
+	if (args.max_pending_arg < ZR_BATCH) {
+		log_fatal("zreflect", "--max-pending must be at least %d",
+			  ZR_BATCH);
+	}
+	zconf.max_pending = (uint32_t)args.max_pending_arg;
+	parse_icmp_codes(args.icmp_error_codes_arg);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	struct zr_thread *threads =
+	    xcalloc((size_t)zconf.threads, sizeof(struct zr_thread));
+	int fanout_id = getpid() & 0xffff;
+	for (int i = 0; i < zconf.threads; i++) {
+		struct zr_thread *t = &threads[i];
+		t->id = i;
+		t->fd = open_socket(fanout_id);
+		t->rand = mix64(zconf.seed + (uint64_t)i + 1);
+		t->slots = xmalloc((size_t)zconf.max_pending *
+				   sizeof(struct zr_pending));
+		t->free = xmalloc((size_t)zconf.max_pending * sizeof(uint32_t));
+		t->heap = xmalloc((size_t)zconf.max_pending * sizeof(uint32_t));
+		for (uint32_t j = 0; j < zconf.max_pending; j++) {
+			t->free[j] = zconf.max_pending - 1 - j;
+		}
+		t->num_free = zconf.max_pending;
+	}
+	// the sockets' counters only start now
+	socket_drops(threads);
+	for (int i = 0; i < zconf.threads; i++) {
+		if (pthread_create(&threads[i].thread, NULL, start_thread,
+				   &threads[i])) {
+			log_fatal("zreflect", "unable to create thread");
+		}
+	}
+	log_info("zreflect",
+		 "answering probes on %s with %d thread(s): %.4g respond, %.4g "
+		 "ICMP errors, rtt %d+%d ms",
+		 zconf.iface, zconf.threads, args.response_rate_arg,
+		 args.icmp_error_rate_arg, args.rtt_ms_arg,
+		 args.rtt_jitter_ms_arg);
+
+	uint64_t start = now_ns();
+	uint64_t drops = 0;
+	struct zr_stats last;
+	memset(&last, 0, sizeof(last));
+	while (!stopping) {
+		struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
+		nanosleep(&ts, NULL);
+		struct zr_stats cur;
+		sum_stats(threads, &cur);
+		drops += socket_drops(threads);
+		log_info("zreflect",
+			 "%" PRIu64 " probes/s, %" PRIu64 " responses/s, %" PRIu64
+			 " pending dropped, %" PRIu64 " socket drops",
+			 cur.probes - last.probes, cur.tx - last.tx,
+			 cur.pending_dropped, drops);
+		last = cur;
+		if (zconf.duration &&
+		    now_ns() - start >= (uint64_t)zconf.duration * 1000000000ULL) {
+			stopping = 1;
+		}
+	}
+	for (int i = 0; i < zconf.threads; i++) {
+		pthread_join(threads[i].thread, NULL);
+	}
+	double secs = (double)(now_ns() - start) / 1e9;
+	struct zr_stats s;
+	sum_stats(threads, &s);
+	s.socket_drops = drops + socket_drops(threads);
+	printf("{\"seconds\":%.3f,\"rx\":%" PRIu64 ",\"probes\":%" PRIu64
+	       ",\"probes_per_sec\":%.0f,\"tx\":%" PRIu64
+	       ",\"tx_per_sec\":%.0f,\"synacks\":%" PRIu64 ",\"rsts\":%" PRIu64
+	       ",\"echo_replies\":%" PRIu64 ",\"udp\":%" PRIu64
+	       ",\"dns\":%" PRIu64 ",\"icmp_errors\":%" PRIu64
+	       ",\"duplicates\":%" PRIu64 ",\"retransmits\":%" PRIu64
+	       ",\"pending_dropped\":%" PRIu64 ",\"tx_failed\":%" PRIu64
+	       ",\"socket_drops\":%" PRIu64 "}\n",
+	       secs, s.rx, s.probes, secs > 0 ? s.probes / secs : 0, s.tx,
+	       secs > 0 ? s.tx / secs : 0, s.synacks, s.rsts, s.echo_replies,
+	       s.udp, s.dns, s.icmp_errors, s.duplicates, s.retransmits,
+	       s.pending_dropped, s.tx_failed, s.socket_drops);
+	fflush(stdout);
+	for (int i = 0; i < zconf.threads; i++) {
+		close(threads[i].fd);
+		xfree(threads[i].slots);
+		xfree(threads[i].free);
+		xfree(threads[i].heap);
+	}
+	xfree(threads);
+	cmdline_parser_free(&args);
+	return EXIT_SUCCESS;
+}
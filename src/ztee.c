@@ -6,23 +6,25 @@
  * of the License at http://www.apache.org/licenses/LICENSE-2.0
  */
 
-// without defining this, FreeBSD throws a warning.
-#define _WITH_GETLINE
 #include <stdio.h>
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <signal.h>
+#include <sys/uio.h>
 
+#include "../lib/includes.h"
 #include "../lib/lockfd.h"
 #include "../lib/logger.h"
-#include "../lib/queue.h"
+#include "../lib/ring.h"
 #include "../lib/util.h"
 #include "../lib/xalloc.h"
 #include "../lib/csv.h"
@@ -39,7 +41,7 @@ typedef struct ztee_conf {
 	char *output_filename;
 	char *status_updates_filename;
 	char *log_file_name;
-	FILE *output_file;
+	int output_fd;
 	FILE *status_updates_file;
 	FILE *log_file;
 
@@ -64,8 +66,6 @@ typedef struct ztee_conf {
 
 static ztee_conf_t tconf;
 
-static int print_from_csv(char *line);
-
 static format_t test_input_format(char *line, size_t len)
 {
 	// Check for empty input, remember line contains '\n'
@@ -85,42 +85,42 @@ static format_t test_input_format(char *line, size_t len)
 	return FORMAT_RAW;
 }
 
-int done = 0;
+// Input is read in blocks of whole lines, which go to the writer thread
+// through a ring and come back through another once written out, so once
+// started nothing is allocated or copied: the output file gets the blocks as
+// they are and stdout gets the fields it needs straight out of them, both
+// with writev(2).
+#define ZTEE_BLOCK_SIZE (1024 * 1024)
+#define ZTEE_BLOCKS 16
+#define ZTEE_IOVS 1024
+
+typedef struct ztee_block {
+	char *data;
+	size_t cap;
+	size_t len;   // of the whole lines in data
+	size_t lines; // number of them
+} block_t;
+
 int process_done = 0;
-int total_read_in = 0;
-int read_in_last_sec = 0;
-int total_written = 0;
+uint64_t total_read_in = 0;
+uint64_t total_written = 0;
 
 double start_time;
 
-pthread_t threads[3];
-
 // one thread reads in
 // one thread writes out and parses
+static zring_t *full_blocks;
+static zring_t *free_blocks;
 
-// pops next element and determines what to do
-// if zqueue_t is empty and read_in is finished, then
-// it exits
-void *process_queue(void *my_q);
-
-// uses fgets to read from stdin and add it to the zqueue_t
-void *read_in(void *my_q);
+static block_t *new_block(void);
+static size_t read_first_line(block_t *b);
 
-// does the same as find UP but finds only successful IPs, determined by the
-// is_successful field and flag
-void find_successful_IP(char *my_string);
+// pops blocks, writes them out and hands them back until read_in is
+// finished
+void *process_queue(void *arg);
 
-// finds IP in the string of csv and sends it to stdout for zgrab
-// you need to know what position is the csv string the ip field is in
-// zero indexed
-void find_IP(char *my_string);
-
-// writes a csv string out to csv file
-// fprintf(stderr, "Is empty inside if %i\n", is_empty(queue));
-void write_out_to_file(char *data);
-
-// figure out how many fields are present if it is a csv
-void figure_out_fields(char *data);
+// reads stdin into blocks and queues them
+void *read_in(void *arg);
 
 // check that the output file is either in a csv form or json form
 // throws error is it is not either
@@ -131,7 +131,7 @@ void print_thread_error(char *string);
 
 // monitor code for ztee
 // executes every second
-void *monitor_ztee(void *my_q);
+void *monitor_ztee(void *arg);
 
 #define SET_IF_GIVEN(DST, ARG)                  \
 	{                                       \
@@ -199,8 +199,9 @@ int main(int argc, char *argv[])
 	}
 
 	tconf.output_filename = args.inputs[0];
-	tconf.output_file = fopen(tconf.output_filename, "w");
-	if (!tconf.output_file) {
+	tconf.output_fd =
+	    open(tconf.output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (tconf.output_fd < 0) {
 		log_fatal("ztee", "Could not open output file %s, %s",
 			  tconf.output_filename, strerror(errno));
 	}
@@ -228,14 +229,15 @@ int main(int argc, char *argv[])
 	}
 
 	// Read the first line of the input file
-	size_t first_line_len = 1024;
-	char *first_line = xmalloc(first_line_len);
-	if (getline(&first_line, &first_line_len, stdin) < 0) {
+	block_t *first = new_block();
+	size_t first_len = read_first_line(first);
+	if (!first_len) {
 		log_fatal("ztee", "reading input to test format failed");
 	}
+	char *header = strndup(first->data, first_len);
 	// Detect the input format
 	if (!raw) {
-		format_t format = test_input_format(first_line, first_line_len);
+		format_t format = test_input_format(header, first_len);
 		log_info("ztee", "detected input format %s",
 			 format_names[format]);
 		tconf.in_format = format;
@@ -244,14 +246,8 @@ int main(int argc, char *argv[])
 		log_info("ztee", "raw input");
 	}
 
-	if (tconf.in_format == FORMAT_JSON) {
-		log_fatal("ztee", "json input not implemented");
-	}
-
 	// Find fields if needed
-	char *header = strdup(first_line);
 	int found_success = 0;
-	int found_ip = 0;
 	if (tconf.in_format == FORMAT_CSV) {
 		static const char *success_names[] = {"success"};
 		static const char *ip_names[] = {"saddr", "ip"};
@@ -261,34 +257,37 @@ int main(int argc, char *argv[])
 			tconf.success_field = (size_t)success_idx;
 		}
 		int ip_idx = csv_find_index(header, ip_names, 2);
-		if (found_ip >= 0) {
-			found_ip = 1;
-			tconf.ip_field = (size_t)ip_idx;
-		}
-		if (!found_ip) {
+		if (ip_idx < 0) {
 			log_fatal("ztee", "Unable to find IP/SADDR field");
 		}
+		tconf.ip_field = (size_t)ip_idx;
+	} else if (tconf.in_format == FORMAT_JSON) {
+		// fields are looked up by name on every line
+		found_success = 1;
 	}
+	free(header);
 
 	if (tconf.success_only) {
-		if (tconf.in_format != FORMAT_CSV) {
-			log_fatal("ztee", "success filter requires csv input");
+		if (tconf.in_format == FORMAT_RAW) {
+			log_fatal("ztee",
+				  "success filter requires csv or json input");
 		}
 		if (!found_success) {
 			log_fatal("ztee", "Could not find success field");
 		}
 	}
 
-	// Make the queue
-	zqueue_t *queue = queue_init();
-	assert(queue);
-
-	// Add the first line to the queue if needed
-	push_back(first_line, queue);
+	// Make the queues, with every block but the first free to fill
+	full_blocks = zring_init(ZTEE_BLOCKS, ZRING_SPSC);
+	free_blocks = zring_init(ZTEE_BLOCKS, ZRING_SPSC);
+	for (int i = 1; i < ZTEE_BLOCKS; i++) {
+		void *b = new_block();
+		zring_push_wait(free_blocks, &b, 1);
+	}
 
 	// Start the regular read thread
 	pthread_t read_thread;
-	if (pthread_create(&read_thread, NULL, read_in, queue)) {
+	if (pthread_create(&read_thread, NULL, read_in, first)) {
 		log_fatal("ztee", "unable to start read thread");
 	}
 
@@ -297,7 +296,7 @@ int main(int argc, char *argv[])
 
 	// Start the process thread
 	pthread_t process_thread;
-	if (pthread_create(&process_thread, NULL, process_queue, queue)) {
+	if (pthread_create(&process_thread, NULL, process_queue, NULL)) {
 		log_fatal("ztee", "unable to start process thread");
 	}
 
@@ -305,7 +304,7 @@ int main(int argc, char *argv[])
 	if (tconf.monitor || tconf.status_updates_file) {
 		pthread_t monitor_thread;
 		if (pthread_create(&monitor_thread, NULL, monitor_ztee,
-				   queue)) {
+				   NULL)) {
 			log_fatal("ztee", "unable to create monitor thread");
 		}
 		pthread_join(monitor_thread, NULL);
@@ -317,113 +316,364 @@ int main(int argc, char *argv[])
 	return 0;
 }
 
-void *process_queue(void *arg)
+static block_t *new_block(void)
 {
-	zqueue_t *queue = arg;
-	FILE *output_file = tconf.output_file;
-	while (!process_done) {
+	block_t *b = xcalloc(1, sizeof(block_t));
+	b->cap = ZTEE_BLOCK_SIZE;
+	b->data = xmalloc(b->cap);
+	return b;
+}
 
-		pthread_mutex_lock(&queue->lock);
-		while (!done && is_empty(queue)) {
-			pthread_cond_wait(&queue->empty, &queue->lock);
+// reads into b after its first fill bytes, growing it when a line doesn't
+// fit. Returns the bytes read, 0 at the end of input.
+static size_t read_more(block_t *b, size_t fill)
+{
+	if (fill == b->cap) {
+		b->cap *= 2;
+		b->data = xrealloc(b->data, b->cap);
+	}
+	for (;;) {
+		ssize_t n = read(STDIN_FILENO, b->data + fill, b->cap - fill);
+		if (n >= 0) {
+			return (size_t)n;
 		}
-		if (done && is_empty(queue)) {
-			process_done = 1;
-			pthread_mutex_unlock(&queue->lock);
-			continue;
+		if (errno != EINTR) {
+			log_fatal("ztee", "unable to read input: %s",
+				  strerror(errno));
 		}
-		znode_t *node = pop_front_unsafe(queue);
-		pthread_mutex_unlock(&queue->lock);
+	}
+}
 
-		// Write raw data to output file
-		fprintf(output_file, "%s", (char *)node->data);
-		fflush(output_file);
-		if (ferror(output_file)) {
-			log_fatal("ztee", "Error writing to output file");
-		}
+// Reads until b holds the first line, and returns the bytes read. Whatever
+// follows the line is left in b for read_in.
+static size_t first_fill = 0;
 
-		// Dump to stdout
-		switch (tconf.in_format) {
-		case FORMAT_JSON:
-			log_fatal("ztee", "JSON input format unimplemented");
-			break;
-		case FORMAT_CSV:
-			print_from_csv((char *)node->data);
-			break;
-		default:
-			// Handle raw
-			fprintf(stdout, "%s", (char *)node->data);
+static size_t read_first_line(block_t *b)
+{
+	while (!memchr(b->data, '\n', first_fill)) {
+		size_t n = read_more(b, first_fill);
+		if (!n) {
 			break;
 		}
+		first_fill += n;
+	}
+	char *nl = memchr(b->data, '\n', first_fill);
+	return nl ? (size_t)(nl - b->data) + 1 : first_fill;
+}
 
-		// Check to see if write failed
-		fflush(stdout);
-		if (ferror(stdout)) {
-			log_fatal("ztee", "%s", "Error writing to stdout");
-		}
-
-		// Record output lines
-		total_written++;
+static size_t count_lines(const char *p, size_t len)
+{
+	size_t lines = 0;
+	const char *end = p + len;
+	while ((p = memchr(p, '\n', (size_t)(end - p)))) {
+		lines++;
+		p++;
+	}
+	return lines;
+}
 
-		// Free the memory
-		free(node->data);
-		free(node);
+static char *last_newline(char *p, size_t len)
+{
+	while (len--) {
+		if (p[len] == '\n') {
+			return p + len;
+		}
 	}
-	process_done = 1;
-	fflush(output_file);
-	fclose(output_file);
 	return NULL;
 }
 
 void *read_in(void *arg)
 {
-	// Allocate buffers
-	zqueue_t *queue = (zqueue_t *)arg;
-	size_t length = 1000;
-	char *input = xcalloc(sizeof(char), length);
-	;
-
-	// Read in from stdin and add to back of linked list
-	while (getline(&input, &length, stdin) > 0) {
-		push_back((void *)strdup(input), queue);
-
-		total_read_in++;
-		read_in_last_sec++;
-	}
-	pthread_mutex_lock(&queue->lock);
-	done = 1;
-	pthread_cond_signal(&queue->empty);
-	pthread_mutex_unlock(&queue->lock);
+	block_t *b = arg;
+	size_t fill = first_fill;
+	int eof = 0;
+	for (;;) {
+		// everything up to the last newline goes, the rest is carried
+		// over into the next block; at the end of input, all of it
+		char *nl = last_newline(b->data, fill);
+		size_t whole = eof ? fill : nl ? (size_t)(nl - b->data) + 1 : 0;
+		if (whole) {
+			void *next;
+			zring_pop_wait(free_blocks, &next, 1);
+			block_t *nb = next;
+			size_t rest = fill - whole;
+			if (rest > nb->cap) {
+				nb->cap = b->cap;
+				nb->data = xrealloc(nb->data, nb->cap);
+			}
+			memcpy(nb->data, b->data + whole, rest);
+			b->len = whole;
+			b->lines = count_lines(b->data, whole);
+			if (b->data[whole - 1] != '\n') {
+				// unterminated last line
+				b->lines++;
+			}
+			__atomic_add_fetch(&total_read_in, b->lines,
+					   __ATOMIC_RELAXED);
+			void *full = b;
+			zring_push_wait(full_blocks, &full, 1);
+			b = nb;
+			fill = rest;
+		}
+		if (eof) {
+			break;
+		}
+		size_t n = read_more(b, fill);
+		eof = !n;
+		fill += n;
+	}
+	zring_close(full_blocks);
 	return NULL;
 }
 
-int print_from_csv(char *line)
+static void write_iovs(int fd, struct iovec *iov, int n, const char *what)
+{
+	while (n) {
+		ssize_t w = writev(fd, iov, n);
+		if (w < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			log_fatal("ztee", "Error writing to %s: %s", what,
+				  strerror(errno));
+		}
+		// skip what was written, picking up partway through an iovec
+		while (n && (size_t)w >= iov->iov_len) {
+			w -= (ssize_t)iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= (size_t)w;
+		}
+	}
+}
+
+static struct iovec out_iov[ZTEE_IOVS];
+static int out_iovs = 0;
+static int header_pending = 1;
+
+static void put_stdout(const char *p, size_t len)
+{
+	if (out_iovs == ZTEE_IOVS) {
+		write_iovs(STDOUT_FILENO, out_iov, out_iovs, "stdout");
+		out_iovs = 0;
+	}
+	out_iov[out_iovs++] = (struct iovec){(void *)p, len};
+}
+
+// 1, true or any other number but 0, as with atoi
+static int is_true(const char *v, size_t len)
 {
-	if (total_written == 0) {
+	if (len && *v == '"') {
+		v++;
+		len = len >= 2 ? len - 2 : 0;
+	}
+	if (len == 4 && !strncasecmp(v, "true", 4)) {
 		return 1;
 	}
-	if (tconf.success_only) {
-		char *success_entry = csv_get_index(line, tconf.success_field);
-		if (success_entry == NULL) {
-			return 1;
+	size_t i = len && (*v == '-' || *v == '+') ? 1 : 0;
+	int nonzero = 0;
+	for (; i < len && v[i] >= '0' && v[i] <= '9'; i++) {
+		nonzero |= v[i] != '0';
+	}
+	return nonzero;
+}
+
+// the idx'th field of a CSV line, leaving quoted commas alone
+static int csv_field(const char *p, const char *end, size_t idx,
+		     const char **field, size_t *len)
+{
+	const char *start = p;
+	int quoted = 0;
+	size_t i = 0;
+	for (; p < end; p++) {
+		if (*p == '"') {
+			quoted = !quoted;
+		} else if (*p == ',' && !quoted) {
+			if (i == idx) {
+				break;
+			}
+			i++;
+			start = p + 1;
 		}
-		int success = 0;
-		if (atoi(success_entry)) {
-			success = 1;
-		} else if (strcasecmp(success_entry, "true") == 0) {
-			success = 1;
+	}
+	if (i != idx) {
+		return 0;
+	}
+	*field = start;
+	*len = (size_t)(p - start);
+	return 1;
+}
+
+static const char *json_skip_ws(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+		p++;
+	}
+	return p;
+}
+
+// past the string whose opening quote is at p
+static const char *json_skip_string(const char *p, const char *end)
+{
+	for (p++; p < end && *p != '"'; p++) {
+		if (*p == '\\') {
+			p++;
 		}
-		if (!success) {
-			return 1;
+	}
+	return p < end ? p + 1 : end;
+}
+
+// up to the , or } after the value at p
+static const char *json_skip_value(const char *p, const char *end)
+{
+	int depth = 0;
+	while (p < end) {
+		if (*p == '"') {
+			p = json_skip_string(p, end);
+			continue;
 		}
+		if (*p == '{' || *p == '[') {
+			depth++;
+		} else if (*p == '}' || *p == ']') {
+			if (!depth) {
+				break;
+			}
+			depth--;
+		} else if (*p == ',' && !depth) {
+			break;
+		}
+		p++;
 	}
-	// Find the ip
-	char *ip = csv_get_index(line, tconf.ip_field);
-	int ret = fprintf(stdout, "%s\n", ip);
-	if (ferror(stdout)) {
-		log_fatal("ztee", "unable to write to stdout");
+	return p;
+}
+
+// the saddr (or ip) and success members of the object on a JSON line
+static void json_fields(const char *p, const char *end, const char **ip,
+			size_t *ip_len, int *success)
+{
+	p = json_skip_ws(p, end);
+	if (p == end || *p != '{') {
+		return;
 	}
-	return ret;
+	p++;
+	while ((p = json_skip_ws(p, end)) < end && *p == '"') {
+		const char *key = p + 1;
+		p = json_skip_string(p, end);
+		size_t klen = (size_t)(p - key) - 1;
+		p = json_skip_ws(p, end);
+		if (p == end || *p != ':') {
+			return;
+		}
+		const char *val = json_skip_ws(p + 1, end);
+		p = json_skip_value(val, end);
+		size_t vlen = (size_t)(p - val);
+		while (vlen && (val[vlen - 1] == ' ' || val[vlen - 1] == '\t' ||
+				val[vlen - 1] == '\r')) {
+			vlen--;
+		}
+		if (((klen == 5 && !strncmp(key, "saddr", 5)) ||
+		     (klen == 2 && !strncmp(key, "ip", 2))) &&
+		    vlen >= 2 && *val == '"') {
+			*ip = val + 1;
+			*ip_len = vlen - 2;
+		} else if (klen == 7 && !strncmp(key, "success", 7)) {
+			*success = is_true(val, vlen);
+		}
+		if (p == end || *p != ',') {
+			return;
+		}
+		p++;
+	}
+}
+
+// queues the address on the line for stdout, if it passes the success
+// filter
+static void process_line(const char *line, const char *end)
+{
+	const char *ip = NULL;
+	size_t ip_len = 0;
+	int success = 0;
+	if (end > line && end[-1] == '\r') {
+		end--;
+	}
+	if (tconf.in_format == FORMAT_JSON) {
+		json_fields(line, end, &ip, &ip_len, &success);
+	} else {
+		// the first line is the header
+		if (header_pending) {
+			header_pending = 0;
+			return;
+		}
+		if (!csv_field(line, end, tconf.ip_field, &ip, &ip_len)) {
+			return;
+		}
+		const char *v;
+		size_t vlen;
+		if (tconf.success_only &&
+		    csv_field(line, end, tconf.success_field, &v, &vlen)) {
+			success = is_true(v, vlen);
+		}
+	}
+	if (!ip || (tconf.success_only && !success)) {
+		return;
+	}
+	put_stdout(ip, ip_len);
+	put_stdout("\n", 1);
+}
+
+void *process_queue(UNUSED void *arg)
+{
+	void *items[ZTEE_BLOCKS];
+	struct iovec file_iov[ZTEE_BLOCKS];
+	size_t n;
+	while ((n = zring_pop_wait(full_blocks, items, ZTEE_BLOCKS))) {
+		// Write raw data to output file
+		for (size_t i = 0; i < n; i++) {
+			block_t *b = items[i];
+			file_iov[i] = (struct iovec){b->data, b->len};
+		}
+		write_iovs(tconf.output_fd, file_iov, (int)n, "output file");
+
+		// Dump to stdout
+		if (tconf.in_format == FORMAT_RAW) {
+			for (size_t i = 0; i < n; i++) {
+				block_t *b = items[i];
+				put_stdout(b->data, b->len);
+			}
+		} else {
+			for (size_t i = 0; i < n; i++) {
+				block_t *b = items[i];
+				const char *p = b->data;
+				const char *end = b->data + b->len;
+				while (p < end) {
+					const char *nl =
+					    memchr(p, '\n', (size_t)(end - p));
+					const char *eol = nl ? nl : end;
+					process_line(p, eol);
+					p = eol + 1;
+				}
+			}
+		}
+		write_iovs(STDOUT_FILENO, out_iov, out_iovs, "stdout");
+		out_iovs = 0;
+
+		// Record output lines and hand the blocks back
+		for (size_t i = 0; i < n; i++) {
+			block_t *b = items[i];
+			__atomic_add_fetch(&total_written, b->lines,
+					   __ATOMIC_RELAXED);
+		}
+		zring_push_wait(free_blocks, items, n);
+	}
+	process_done = 1;
+	if (close(tconf.output_fd)) {
+		log_fatal("ztee", "Error writing to output file: %s",
+			  strerror(errno));
+	}
+	return NULL;
 }
 
 void output_file_is_csv(void)
@@ -475,7 +725,7 @@ typedef struct ztee_stats {
 	char time_past_str[TIME_STR_LEN];
 } stats_t;
 
-void update_stats(stats_t *stats, zqueue_t *queue)
+void update_stats(stats_t *stats)
 {
 	double age = now() - start_time;
 	double delta = age - stats->_last_age;
@@ -484,19 +734,19 @@ void update_stats(stats_t *stats, zqueue_t *queue)
 	stats->time_past = age;
 	time_string((int)age, 0, stats->time_past_str, TIME_STR_LEN);
 
-	uint32_t total_read = total_read_in;
+	uint64_t written = __atomic_load_n(&total_written, __ATOMIC_RELAXED);
+	uint32_t total_read = __atomic_load_n(&total_read_in, __ATOMIC_RELAXED);
 	stats->read_last_sec = (total_read - stats->total_read) / delta;
 	stats->total_read = total_read;
 	stats->read_per_sec_avg = stats->total_read / age;
 
-	stats->buffer_cur_size = get_size(queue);
+	stats->buffer_cur_size = total_read - written;
 	stats->_buffer_size_sum += stats->buffer_cur_size;
 	stats->buffer_avg_size = stats->_buffer_size_sum / age;
 }
 
-void *monitor_ztee(void *arg)
+void *monitor_ztee(UNUSED void *arg)
 {
-	zqueue_t *queue = (zqueue_t *)arg;
 	stats_t *stats = xmalloc(sizeof(stats_t));
 
 	if (tconf.status_updates_file) {
@@ -513,7 +763,7 @@ void *monitor_ztee(void *arg)
 	while (!process_done) {
 		sleep(1);
 
-		update_stats(stats, queue);
+		update_stats(stats);
 		if (tconf.monitor) {
 			lock_file(stderr);
 			fprintf(
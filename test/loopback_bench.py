@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""Runs zmap against zreflect over a veth pair and reports, per probe
+module, the sustained send rate, the responses received, pcap drops and
+output throughput, one JSON object per line.
+
+Needs root (to create the veth pair) and a zmap built with the Linux raw
+socket sender. Run from the build directory, or pass --zmap and --zreflect:
+
+    sudo ./loopback_bench.py --zmap src/zmap --zreflect src/zreflect
+"""
+
+import argparse
+import json
+import os
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+MODULES = {
+    "tcp_synscan": ["-p", "80"],
+    "icmp_echoscan": [],
+    "udp": ["-p", "9999", "--probe-args=text:zreflect"],
+    "dns": ["-p", "53", "--probe-args=A,example.com"],
+}
+
+
+def run(*cmd):
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+
+
+def mac_of(iface):
+    with open("/sys/class/net/%s/address" % iface) as f:
+        return f.read().strip()
+
+
+def setup_veth(scan_if, reflect_if):
+    run("ip", "link", "add", scan_if, "type", "veth", "peer", "name", reflect_if)
+    for iface in (scan_if, reflect_if):
+        # nothing but the scan on the wire
+        with open("/proc/sys/net/ipv6/conf/%s/disable_ipv6" % iface, "w") as f:
+            f.write("1")
+        run("ip", "link", "set", iface, "arp", "off", "up")
+
+
+def teardown_veth(scan_if):
+    subprocess.run(["ip", "link", "del", scan_if], stderr=subprocess.DEVNULL)
+
+
+def bench(args, module, scan_if, reflect_if, tmp):
+    reflect = subprocess.Popen(
+        [args.zreflect, "-i", reflect_if, "-T", str(args.reflect_threads),
+         "--seed", "1", "--disable-syslog", "-v", "2"] + args.zreflect_args,
+        stdout=subprocess.PIPE)
+    # let it join the interface before the first probe
+    time.sleep(0.5)
+    output = os.path.join(tmp, "%s.out" % module)
+    metadata = os.path.join(tmp, "%s.json" % module)
+    cmd = [args.zmap, "-i", scan_if, "-G", mac_of(reflect_if),
+           "-S", "192.0.2.1", "-M", module, "-r", str(args.rate),
+           "-n", str(args.targets), "-c", str(args.cooldown),
+           "-T", str(args.sender_threads), "-b", "/dev/null",
+           "--seed", "1", "-o", output, "-m", metadata, "-q",
+           "--disable-syslog", "-v", "2"] + MODULES[module] + args.zmap_args
+    cmd.append(args.subnet)
+    start = time.monotonic()
+    subprocess.run(cmd, check=True)
+    wall = time.monotonic() - start
+    reflect.send_signal(signal.SIGTERM)
+    reflected = json.loads(reflect.communicate()[0].decode().strip()
+                           .splitlines()[-1])
+    with open(metadata) as f:
+        meta = json.load(f)
+    with open(output, "rb") as f:
+        records = sum(1 for _ in f)
+    sending = max(wall - meta.get("cooldown_used_secs", args.cooldown), 1e-9)
+    return {
+        "module": module,
+        "rate": args.rate,
+        "targets": args.targets,
+        "packets_sent": meta["packets_sent"],
+        "send_pps": round(meta["packets_sent"] / sending),
+        "probes_reflected": reflected["probes"],
+        "responses_sent": reflected["tx"],
+        "reflector_drops": reflected["socket_drops"],
+        "success_total": meta["success_total"],
+        "success_unique": meta["success_unique"],
+        "pcap_recv": meta["pcap_recv"],
+        "pcap_drop": meta["pcap_drop"],
+        "pcap_ifdrop": meta["pcap_ifdrop"],
+        "output_drops": meta.get("output_drops", 0),
+        "output_records": records,
+        "output_records_per_sec": round(records / wall),
+        "seconds": round(wall, 3),
+    }
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    p.add_argument("--zmap", default="src/zmap")
+    p.add_argument("--zreflect", default="src/zreflect")
+    p.add_argument("--modules", default=",".join(MODULES),
+                   help="comma-separated probe modules to run")
+    p.add_argument("--rate", type=int, default=100000,
+                   help="packets per second zmap sends")
+    p.add_argument("--targets", type=int, default=1000000)
+    p.add_argument("--subnet", default="10.0.0.0/8")
+    p.add_argument("--cooldown", type=int, default=2)
+    p.add_argument("--sender-threads", type=int, default=1)
+    p.add_argument("--reflect-threads", type=int, default=1)
+    p.add_argument("--interface", default="zbench",
+                   help="prefix of the veth pair's names")
+    p.add_argument("--zmap-args", default="",
+                   help="more arguments for zmap, space-separated")
+    p.add_argument("--zreflect-args", default="",
+                   help="more arguments for zreflect, e.g. "
+                   "'--response-rate 0.1 --rtt-ms 20'")
+    args = p.parse_args()
+    args.zmap_args = args.zmap_args.split()
+    args.zreflect_args = args.zreflect_args.split()
+    for module in args.modules.split(","):
+        if module not in MODULES:
+            sys.exit("unknown module %s, expected one of %s" %
+                     (module, ", ".join(MODULES)))
+    scan_if = args.interface + "0"
+    reflect_if = args.interface + "1"
+    teardown_veth(scan_if)
+    setup_veth(scan_if, reflect_if)
+    try:
+        with tempfile.TemporaryDirectory() as tmp:
+            for module in args.modules.split(","):
+                print(json.dumps(bench(args, module, scan_if, reflect_if,
+                                       tmp)), flush=True)
+    finally:
+        teardown_veth(scan_if)
+
+
+if __name__ == "__main__":
+    main()